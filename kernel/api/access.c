@@ -1,6 +1,7 @@
 #include "globals.h"
 #include "errno.h"
 
+#include "util/init.h"
 #include "util/string.h"
 #include "util/debug.h"
 
@@ -8,30 +9,83 @@
 #include "mm/page.h"
 #include "mm/mm.h"
 #include "mm/kmalloc.h"
+#include "mm/slab.h"
 
 #include "proc/proc.h"
 
 #include "vm/vmmap.h"
 
+#include "main/interrupt.h"
+
 #include "api/access.h"
 #include "api/syscall.h"
 
+/*
+ * Copies nbytes from src to dst, through whatever the current page table
+ * has mapped, and returns how many bytes were left when it stopped. The
+ * only instruction here that touches user memory is the rep movsb at
+ * __user_copy_insn; a page fault on it goes to __user_copy_fixup instead
+ * of panicking (see access_fixup), which returns what is left in %ecx.
+ * The kernel runs with CR0.WP set, so a read-only page, copy-on-write or
+ * not, stops a write here the same way a missing one does.
+ */
+size_t __user_copy(void *dst, const void *src, size_t nbytes);
+extern char __user_copy_insn[], __user_copy_fixup[];
+__asm__(".global __user_copy\n"
+        "__user_copy:\n\t"
+        "push %esi\n\t"
+        "push %edi\n\t"
+        "movl 12(%esp), %edi\n\t"
+        "movl 16(%esp), %esi\n\t"
+        "movl 20(%esp), %ecx\n\t"
+        "cld\n"
+        ".global __user_copy_insn\n"
+        "__user_copy_insn:\n\t"
+        "rep movsb\n"
+        ".global __user_copy_fixup\n"
+        "__user_copy_fixup:\n\t"
+        "movl %ecx, %eax\n\t"
+        "pop %edi\n\t"
+        "pop %esi\n\t"
+        "ret\n");
+
+int access_fixup(regs_t *regs, uintptr_t vaddr) {
+  if ((uintptr_t)__user_copy_insn != regs->r_eip || vaddr < USER_MEM_LOW ||
+      vaddr >= USER_MEM_HIGH)
+    return 0;
+  regs->r_eip = (uintptr_t)__user_copy_fixup;
+  return 1;
+}
+
 /* copy_to_user and copy_from_user are used to copy to and from the
  * user space of the current process.  They first check that the range
- * of addresses has valid mappings, then call vmmap_read/write.
+ * of addresses has valid mappings, then copy straight through the page
+ * table, which works whenever the pages are already mapped the way we
+ * need them. Whatever that misses goes through vmmap_read/write, which
+ * find the pages (and bring them in) the slow way.
  */
 int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes) {
+  size_t left;
+
   if (!range_perm(curproc, uaddr, nbytes, PROT_READ)) {
     return -EFAULT;
   }
-  return vmmap_read(curproc->p_vmmap, uaddr, kaddr, nbytes);
+  if (0 == (left = __user_copy(kaddr, uaddr, nbytes)))
+    return 0;
+  return vmmap_read(curproc->p_vmmap, (const char *)uaddr + nbytes - left,
+                    (char *)kaddr + nbytes - left, left);
 }
 
 int copy_to_user(void *uaddr, const void *kaddr, size_t nbytes) {
+  size_t left;
+
   if (!range_perm(curproc, uaddr, nbytes, PROT_WRITE)) {
     return -EFAULT;
   }
-  return vmmap_write(curproc->p_vmmap, uaddr, kaddr, nbytes);
+  if (0 == (left = __user_copy(uaddr, kaddr, nbytes)))
+    return 0;
+  return vmmap_write(curproc->p_vmmap, (char *)uaddr + nbytes - left,
+                     (const char *)kaddr + nbytes - left, left);
 }
 
 /* Like strndup(), but gets the string from user space, ensuring
@@ -55,6 +109,42 @@ char *user_strdup(argstr_t *ustr) {
   return kstr;
 }
 
+static slab_allocator_t *path_allocator;
+
+static __attribute__((unused)) void access_init(void) {
+  path_allocator = slab_allocator_create("path", MAXPATHLEN + 1);
+  KASSERT(NULL != path_allocator);
+}
+init_func(access_init);
+
+/* Like user_strdup(), for a path name about to be resolved: the copy
+ * goes in a MAXPATHLEN buffer from its own slab cache, and a name too
+ * long to resolve fails with ENAMETOOLONG before anything is copied.
+ * On failure errno is set and NULL returned. Free the result with
+ * user_putpath().
+ */
+char *user_getpath(argstr_t *ustr) {
+  char *kstr;
+  int ret;
+
+  if (ustr->as_len > MAXPATHLEN) {
+    curthr->kt_errno = ENAMETOOLONG;
+    return NULL;
+  }
+  if (NULL == (kstr = (char *)slab_obj_alloc(path_allocator))) {
+    curthr->kt_errno = ENOMEM;
+    return NULL;
+  }
+  if (0 > (ret = copy_from_user(kstr, ustr->as_str, ustr->as_len + 1))) {
+    curthr->kt_errno = -ret;
+    slab_obj_free(path_allocator, kstr);
+    return NULL;
+  }
+  return kstr;
+}
+
+void user_putpath(char *path) { slab_obj_free(path_allocator, path); }
+
 /* Copies in an entire vector of strings from user space, similarly to
  * user_strdup. The vector of strings and each string can be
  * freed (separately) with kfree */
@@ -119,8 +209,8 @@ fail:
  * vaddr?")
  */
 int addr_perm(struct proc *p, const void *vaddr, int perm) {
-  NOT_YET_IMPLEMENTED("VM: ***none***");
-  return 0;
+  vmarea_t *vma = vmmap_lookup(p->p_vmmap, ADDR_TO_PN(vaddr));
+  return NULL != vma && (vma->vma_prot & perm) == perm;
 }
 
 /*
@@ -133,6 +223,17 @@ int addr_perm(struct proc *p, const void *vaddr, int perm) {
  * the given permissions, and 0 otherwise.
  */
 int range_perm(struct proc *p, const void *avaddr, size_t len, int perm) {
-  NOT_YET_IMPLEMENTED("VM: ***none***");
-  return 0;
+  uint32_t vfn;
+
+  if (!len)
+    return 1;
+  if ((uintptr_t)avaddr < USER_MEM_LOW ||
+      len > USER_MEM_HIGH - (uintptr_t)avaddr)
+    return 0;
+  for (vfn = ADDR_TO_PN(avaddr); vfn <= ADDR_TO_PN((uintptr_t)avaddr + len - 1);
+       ++vfn) {
+    if (!addr_perm(p, PN_TO_ADDR(vfn), perm))
+      return 0;
+  }
+  return 1;
 }
@@ -10,6 +10,8 @@
 
 #include "mm/kmalloc.h"
 
+#include "proc/rcu.h"
+
 #include "api/binfmt.h"
 
 struct binfmt {
@@ -18,6 +20,9 @@ struct binfmt {
   list_link_t bf_link;
 };
 
+/* Loaders are only ever added, and each is filled in before it is put on
+ * the list, so binfmt_load walks it without a lock even though the
+ * loaders it calls block */
 static list_t binfmt_list;
 
 static __attribute__((unused)) void binfmt_init() { list_init(&binfmt_list); }
@@ -33,7 +38,7 @@ int binfmt_add(const char *id, binfmt_load_func_t loadfunc) {
 
   fmt->bf_id = id;
   fmt->bf_load = loadfunc;
-  list_insert_head(&binfmt_list, &fmt->bf_link);
+  list_insert_head_rcu(&binfmt_list, &fmt->bf_link);
 
   return 0;
 }
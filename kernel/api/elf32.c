@@ -6,6 +6,7 @@
 #include "mm/tlb.h"
 #include "mm/pagetable.h"
 #include "mm/kmalloc.h"
+#include "mm/pframe.h"
 
 #include "vm/vmmap.h"
 
@@ -20,6 +21,7 @@
 #include "fs/fcntl.h"
 #include "fs/lseek.h"
 #include "fs/vfs_syscall.h"
+#include "fs/vnode.h"
 
 static int _elf32_platform_check(const Elf32_Ehdr *header) {
   return (EM_386 == header->e_machine) &&
@@ -117,19 +119,18 @@ static int _elf32_map_segment(vmmap_t *map, vnode_t *file, int32_t memoff,
        * should not just map in another page (as there could be garbage
        * after addr+filesz). For instance, consider the data-bss boundary
        * (c.f. Intel x86 ELF supplement pp. 82).
-       * To fix this, we need to read in the contents of the file manually
-       * and put them at that user space addr in the anon map we just
-       * added. */
-      void *buf;
-      if (NULL == (buf = page_alloc()))
-        return -ENOMEM;
-      if (!(0 > (ret = file->vn_ops->read(file,
-                                          (off_t)PAGE_ALIGN_DOWN(off + filesz),
-                                          buf, PAGE_OFFSET(addr + filesz))))) {
-        ret = vmmap_write(map, PAGE_ALIGN_DOWN(addr + filesz), buf,
-                          PAGE_OFFSET(addr + filesz));
-      }
-      page_free(buf);
+       * To fix this, we copy the start of that page out of the file's
+       * page cache into the anon map we just added; only this page is
+       * filled now, the rest of the bss is left to be faulted in (from
+       * the zero page, until it is written). */
+      pframe_t *pf;
+      if (0 > (ret = pframe_lookup(&file->vn_mmobj,
+                                   ADDR_TO_PN(off + filesz), 0, &pf)))
+        return ret;
+      pframe_pin(pf);
+      ret = vmmap_write(map, PAGE_ALIGN_DOWN(addr + filesz), pf->pf_addr,
+                        PAGE_OFFSET(addr + filesz));
+      pframe_unpin(pf);
       return ret;
     }
   }
@@ -142,6 +143,8 @@ static int _elf32_map_segment(vmmap_t *map, vnode_t *file, int32_t memoff,
  * interp is 1 if we are loading an interpreter, 0 otherwise
  * Returns 0 on success, -errno on failure. Returns the ELF header in the header
  * argument. */
+static int _elf32_check_ehdr(const Elf32_Ehdr *header, int interp);
+
 static int _elf32_load_ehdr(int fd, Elf32_Ehdr *header, int interp) {
   int err;
   memset(header, 0, sizeof(*header));
@@ -166,6 +169,13 @@ static int _elf32_load_ehdr(int fd, Elf32_Ehdr *header, int interp) {
   dbgq(DBG_ELF, "Type:    %d\n", (int)header->e_type);
   dbgq(DBG_ELF, "Machine: %d\n", (int)header->e_machine);
 
+  return _elf32_check_ehdr(header, interp);
+}
+
+/* The checks _elf32_load_ehdr makes on a header which has been read in:
+ * that it is executable, and for the correct platform. Returns 0 or
+ * -ENOEXEC. */
+static int _elf32_check_ehdr(const Elf32_Ehdr *header, int interp) {
   /* Check that the ELF file is executable and targets
    * the correct platform */
   if (ET_EXEC != header->e_type && !(ET_DYN == header->e_type && interp)) {
@@ -276,6 +286,113 @@ done:
   return err;
 }
 
+/* What a vnode's vn_exec holds: the ELF header, followed by the program
+ * header table and then the interpreter's name, if there is one */
+typedef struct elf32_image {
+  Elf32_Ehdr ei_header;
+  size_t ei_interplen; /* 0 if there is no interpreter */
+} elf32_image_t;
+
+#define elf32_image_pht(img) ((char *)((img) + 1))
+
+/*
+ * Gets the ELF header, the program header table and the interpreter's
+ * name (NULL, with *interplen 0, if there is none) of the file open as
+ * fd, whose vnode is vn. They are copied from vn->vn_exec when an earlier
+ * exec of the same file left them there, and read in and left there
+ * otherwise, so that exec'ing a program (or its interpreter) again costs
+ * no reads. The header is checked either way, as _elf32_load_ehdr checks
+ * it. *pht and *interpname are kmalloc()ed, for the caller to free even
+ * on failure.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int _elf32_load_image(int fd, vnode_t *vn, int interp,
+                             Elf32_Ehdr *header, char **pht, char **interpname,
+                             size_t *interplen) {
+  elf32_image_t *img = vn->vn_exec;
+  Elf32_Phdr *phinterp;
+  size_t phtsize;
+  int building = 0;
+  int err;
+
+  *interplen = 0;
+  if (NULL != img && VN_EXEC_BUILDING != img) {
+    *header = img->ei_header;
+    if (0 > (err = _elf32_check_ehdr(header, interp)))
+      return err;
+    phtsize = header->e_phentsize * header->e_phnum;
+    if (NULL == (*pht = kmalloc(phtsize)))
+      return -ENOMEM;
+    memcpy(*pht, elf32_image_pht(img), phtsize);
+    if (img->ei_interplen) {
+      if (NULL == (*interpname = kmalloc(img->ei_interplen)))
+        return -ENOMEM;
+      memcpy(*interpname, elf32_image_pht(img) + phtsize, img->ei_interplen);
+      *interplen = img->ei_interplen;
+    }
+    return 0;
+  }
+
+  /* If someone else is already reading these in, we do it for ourselves
+   * only */
+  if (NULL == img) {
+    vn->vn_exec = VN_EXEC_BUILDING;
+    building = 1;
+  }
+
+  /* Load and verify the ELF header */
+  if (0 > (err = _elf32_load_ehdr(fd, header, interp))) {
+    goto done;
+  }
+  phtsize = header->e_phentsize * header->e_phnum;
+  if (NULL == (*pht = kmalloc(phtsize))) {
+    err = -ENOMEM;
+    goto done;
+  }
+  /* Read in the program header table */
+  if (0 > (err = _elf32_load_phtable(fd, header, *pht, phtsize))) {
+    goto done;
+  }
+  /* read the file name of the interpreter from the binary, if it has one */
+  if (0 > (err = _elf32_find_phinterp(header, *pht, &phinterp))) {
+    goto done;
+  }
+  if (NULL != phinterp) {
+    if (0 > (err = do_lseek(fd, phinterp->p_offset, SEEK_SET))) {
+      goto done;
+    } else if (NULL == (*interpname = kmalloc(phinterp->p_filesz))) {
+      err = -ENOMEM;
+      goto done;
+    } else if (0 > (err = do_read(fd, *interpname, phinterp->p_filesz))) {
+      goto done;
+    }
+    if (err != (int)phinterp->p_filesz) {
+      err = -ENOEXEC;
+      goto done;
+    }
+    *interplen = phinterp->p_filesz;
+  }
+  err = 0;
+
+done:
+  /* A write while we were reading took VN_EXEC_BUILDING away, and what
+   * we read may be out of date already */
+  if (building && VN_EXEC_BUILDING == vn->vn_exec) {
+    vn->vn_exec = NULL;
+    if (0 == err &&
+        NULL != (img = kmalloc(sizeof(*img) + phtsize + *interplen))) {
+      img->ei_header = *header;
+      img->ei_interplen = *interplen;
+      memcpy(elf32_image_pht(img), *pht, phtsize);
+      if (*interplen)
+        memcpy(elf32_image_pht(img) + phtsize, *interpname, *interplen);
+      vn->vn_exec = img;
+    }
+  }
+  return err;
+}
+
 /* Calculates the lower and upper virtual addresses that the given program
  * header table would load into if _elf32_load_progsegs were called. We traverse
  * all the program segments of type PT_LOAD and look at p_vaddr and p_memsz
@@ -351,101 +468,143 @@ static size_t _elf32_calc_argsize(char *const argv[], char *const envp[],
   return size;
 }
 
+/* Where _elf32_load_args() is writing on the new stack: the next user
+ * address, and the page holding it, which is kept pinned while held */
+typedef struct argcursor {
+  vmmap_t *ac_map;
+  char *ac_vaddr;
+  pframe_t *ac_pf;
+  uint32_t ac_vfn;
+} argcursor_t;
+
+static void _elf32_argcursor_init(argcursor_t *ac, vmmap_t *map, char *vaddr) {
+  ac->ac_map = map;
+  ac->ac_vaddr = vaddr;
+  ac->ac_pf = NULL;
+}
+
+static void _elf32_argcursor_done(argcursor_t *ac) {
+  if (NULL != ac->ac_pf) {
+    pframe_unpin(ac->ac_pf);
+    ac->ac_pf = NULL;
+  }
+}
+
+/* Copies len bytes from src to the cursor, straight into the pages of the
+ * new stack, and advances it. Returns 0 or -errno. */
+static int _elf32_argput(argcursor_t *ac, const void *src, size_t len) {
+  uint32_t vfn;
+  vmarea_t *vma;
+  pframe_t *pf;
+  size_t n;
+  int ret;
+
+  while (len) {
+    vfn = ADDR_TO_PN(ac->ac_vaddr);
+    if (NULL == ac->ac_pf || vfn != ac->ac_vfn) {
+      _elf32_argcursor_done(ac);
+      vma = vmmap_lookup(ac->ac_map, vfn);
+      KASSERT(NULL != vma);
+      if (0 > (ret = pframe_lookup(vma->vma_obj,
+                                   vma->vma_off + vfn - vma->vma_start, 1,
+                                   &pf)))
+        return ret;
+      pframe_pin(pf);
+      if (0 > (ret = pframe_dirty(pf))) {
+        pframe_unpin(pf);
+        return ret;
+      }
+      ac->ac_pf = pf;
+      ac->ac_vfn = vfn;
+    }
+    n = MIN(len, PAGE_SIZE - PAGE_OFFSET(ac->ac_vaddr));
+    memcpy((char *)ac->ac_pf->pf_addr + PAGE_OFFSET(ac->ac_vaddr), src, n);
+    ac->ac_vaddr += n;
+    src = (const char *)src + n;
+    len -= n;
+  }
+  return 0;
+}
+
 /* Copies the arguments that must be on the stack prior to execution onto the
- * user stack. This should never fail.
+ * user stack, in one pass writing straight into the stack's pages: one
+ * cursor lays down the vectors while another follows with the strings they
+ * point to. Returns 0 or -errno.
  * arglow:   low address on the user stack where we should start the copying
- * argsize:  total size of everything to go on the stack
- * buf:      a kernel buffer at least as big as argsize (for convenience)
  * argv, envp, auxv: various vectors of stuff (to go on the stack)
  * argc, envc, auxc: number of non-NULL entries in argv, envp, auxv,
  *                   respectively (to avoid recomputing them)
  * phtsize: the size of the program header table (to avoid recomputing)
  * c.f. Intel i386 ELF supplement pp 54-59
  */
-static void _elf32_load_args(vmmap_t *map, void *arglow, size_t argsize,
-                             char *buf, char *const argv[], char *const envp[],
-                             Elf32_auxv_t *auxv, int argc, int envc, int auxc,
-                             int phtsize) {
-  int i;
-
-  /* Copy argc */
-  *((int *)buf) = argc;
+static int _elf32_load_args(vmmap_t *map, void *arglow, char *const argv[],
+                            char *const envp[], Elf32_auxv_t *auxv, int argc,
+                            int envc, int auxc, int phtsize) {
+  argcursor_t vec, str;
+  Elf32_auxv_t ent;
+  char *vecs[3];
+  char *vstr;
+  size_t len;
+  int i, ret;
 
   /* Calculate where the strings / tables pointed to by the vectors start */
   size_t veclen = (argc + 1 + envc + 1) * sizeof(char *) +
                   (auxc + 1) * sizeof(Elf32_auxv_t);
 
-  char *vecstart =
-      buf + sizeof(int) +
-      3 * sizeof(void *); /* Beginning of argv (in kernel buffer) */
-
-  char *vvecstart = ((char *)arglow) + sizeof(int) +
-                    3 * sizeof(void *); /* Beginning of argv (in user space) */
+  /* Beginning of argv (in user space) */
+  char *vvecstart = ((char *)arglow) + sizeof(int) + 3 * sizeof(void *);
 
-  char *strstart =
-      vecstart +
-      veclen; /* Beginning of first string pointed to by argv
-                                                     (in kernel buffer) */
+  /* The pointers to argv, envp and auxv (as passed to main) */
+  vecs[0] = vvecstart;
+  vecs[1] = vvecstart + (argc + 1) * sizeof(char *);
+  vecs[2] = vvecstart + (argc + 1 + envc + 1) * sizeof(char *);
 
+  _elf32_argcursor_init(&vec, map, arglow);
   /* Beginning of first string pointed to by argv (in user space) */
-  char *vstrstart = vvecstart + veclen;
-
-  /* Copy over pointer to argv */
-  *(char **)(buf + 4) = vvecstart;
-  /* Copy over pointer to envp */
-  *(char **)(buf + 8) = vvecstart + (argc + 1) * sizeof(char *);
-  /* Copy over pointer to auxv */
-  *(char **)(buf + 12) = vvecstart + (argc + 1 + envc + 1) * sizeof(char *);
-
-  /* Copy over argv along with every string in it */
-  for (i = 0; i < argc; i++) {
-    size_t len = strlen(argv[i]) + 1;
-    strcpy(strstart, argv[i]);
-    /* Remember that we need to use the virtual address of the string */
-    *(char **)vecstart = vstrstart;
-    strstart += len;
-    vstrstart += len;
-    vecstart += sizeof(char *);
-  }
-  /* null terminator of argv */
-  *(char **)vecstart = NULL;
-  vecstart += sizeof(char *);
-
-  /* Copy over envp along with every string in it */
-  for (i = 0; i < envc; i++) {
-    size_t len = strlen(envp[i]) + 1;
-    strcpy(strstart, envp[i]);
-    /* Remember that we need to use the virtual address of the string */
-    *(char **)vecstart = vstrstart;
-    strstart += len;
-    vstrstart += len;
-    vecstart += sizeof(char *);
+  _elf32_argcursor_init(&str, map, vvecstart + veclen);
+
+  if (0 > (ret = _elf32_argput(&vec, &argc, sizeof(int))) ||
+      0 > (ret = _elf32_argput(&vec, vecs, sizeof(vecs))))
+    goto done;
+
+  /* Copy over argv and envp along with every string in them, remembering
+   * that the vectors need the virtual addresses of the strings */
+  for (i = 0; i < argc + 1 + envc; i++) {
+    const char *s = i < argc ? argv[i] : i > argc ? envp[i - argc - 1] : NULL;
+
+    vstr = NULL;
+    if (NULL != s) {
+      vstr = str.ac_vaddr;
+      len = strlen(s) + 1;
+      if (0 > (ret = _elf32_argput(&str, s, len)))
+        goto done;
+    }
+    /* NULL between argv and envp, which terminates argv */
+    if (0 > (ret = _elf32_argput(&vec, &vstr, sizeof(vstr))))
+      goto done;
   }
   /* null terminator of envp */
-  *(char **)vecstart = NULL;
-  vecstart += sizeof(char *);
-
-  /* Copy over auxv along with the program header (if we find it) */
-  for (i = 0; i < auxc; i++) {
-    /* Copy over the auxv entry */
-    memcpy(vecstart, &auxv[i], sizeof(Elf32_auxv_t));
-    /* Check if it points to the program header */
-    if (auxv[i].a_type == AT_PHDR) {
-      /* Copy over the program header table */
-      memcpy(strstart, auxv[i].a_un.a_ptr, phtsize);
-      /* And modify the address */
-      ((Elf32_auxv_t *)vecstart)->a_un.a_ptr = vstrstart;
+  vstr = NULL;
+  if (0 > (ret = _elf32_argput(&vec, &vstr, sizeof(vstr))))
+    goto done;
+
+  /* Copy over auxv along with the program header (if we find it), and its
+   * null terminator */
+  for (i = 0; i <= auxc; i++) {
+    ent = auxv[i];
+    if (i < auxc && auxv[i].a_type == AT_PHDR) {
+      ent.a_un.a_ptr = str.ac_vaddr;
+      if (0 > (ret = _elf32_argput(&str, auxv[i].a_un.a_ptr, phtsize)))
+        goto done;
     }
-    vecstart += sizeof(Elf32_auxv_t);
+    if (0 > (ret = _elf32_argput(&vec, &ent, sizeof(ent))))
+      goto done;
   }
-  /* null terminator of auxv */
-  ((Elf32_auxv_t *)vecstart)->a_type = NULL;
 
-  /* Finally, we're done copying into the kernel buffer. Now just copy the
-   * kernel buffer into user space */
-  int ret = vmmap_write(map, arglow, buf, argsize);
-  /* If this failed, we must have set up the address space wrong... */
-  KASSERT(0 == ret);
+done:
+  _elf32_argcursor_done(&vec);
+  _elf32_argcursor_done(&str);
+  return ret;
 }
 
 static int _elf32_load(const char *filename, int fd, char *const argv[],
@@ -463,15 +622,16 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
   file_t *interpfile = NULL;
   char *interppht = NULL;
   Elf32_auxv_t *auxv = NULL;
-  char *argbuf = NULL;
 
   uintptr_t entry;
 
   file = fget(fd);
   KASSERT(NULL != file);
 
-  /* Load and verify the ELF header */
-  if (0 > (err = _elf32_load_ehdr(fd, &header, 0))) {
+  /* Get the ELF header, the program header table and the interpreter */
+  size_t interplen;
+  if (0 > (err = _elf32_load_image(fd, file->f_vnode, 0, &header, &pht,
+                                   &interpname, &interplen))) {
     goto done;
   }
 
@@ -481,25 +641,11 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
   }
 
   size_t phtsize = header.e_phentsize * header.e_phnum;
-  if (NULL == (pht = kmalloc(phtsize))) {
-    err = -ENOMEM;
-    goto done;
-  }
-  /* Read in the program header table */
-  if (0 > (err = _elf32_load_phtable(fd, &header, pht, phtsize))) {
-    goto done;
-  }
   /* Load the segments in the program header table */
   if (0 > (err = _elf32_map_progsegs(file->f_vnode, map, &header, pht, 0))) {
     goto done;
   }
 
-  Elf32_Phdr *phinterp = NULL;
-  /* Check if program requires an interpreter */
-  if (0 > (err = _elf32_find_phinterp(&header, pht, &phinterp))) {
-    goto done;
-  }
-
   /* Calculate program bounds for future reference */
   void *proglow;
   void *proghigh;
@@ -508,23 +654,9 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
   entry = (uintptr_t)header.e_entry;
 
   /* if an interpreter was requested load it */
-  if (NULL != phinterp) {
-    /* read the file name of the interpreter from the binary */
-    if (0 > (err = do_lseek(fd, phinterp->p_offset, SEEK_SET))) {
-      goto done;
-    } else if (NULL == (interpname = kmalloc(phinterp->p_filesz))) {
-      err = -ENOMEM;
-      goto done;
-    } else if (0 > (err = do_read(fd, interpname, phinterp->p_filesz))) {
-      goto done;
-    }
-    if (err != (int)phinterp->p_filesz) {
-      err = -ENOEXEC;
-      goto done;
-    }
-
+  if (NULL != interpname) {
     /* open the interpreter */
-    dbgq(DBG_ELF, "ELF Interpreter: %*s\n", phinterp->p_filesz, interpname);
+    dbgq(DBG_ELF, "ELF Interpreter: %*s\n", interplen, interpname);
     if (0 > (interpfd = do_open(interpname, O_RDONLY))) {
       err = interpfd;
       goto done;
@@ -535,28 +667,14 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
     interpfile = fget(interpfd);
     KASSERT(NULL != interpfile);
 
-    /* Load and verify the interpreter ELF header */
-    if (0 > (err = _elf32_load_ehdr(interpfd, &interpheader, 1))) {
+    /* Load and verify the interpreter's headers. The interpreter
+     * shouldn't itself need an interpreter */
+    if (0 > (err = _elf32_load_image(interpfd, interpfile->f_vnode, 1,
+                                     &interpheader, &interppht, &interpname,
+                                     &interplen))) {
       goto done;
     }
-    size_t interpphtsize = interpheader.e_phentsize * interpheader.e_phnum;
-    if (NULL == (interppht = kmalloc(interpphtsize))) {
-      err = -ENOMEM;
-      goto done;
-    }
-    /* Read in the program header table */
-    if (0 > (err = _elf32_load_phtable(interpfd, &interpheader, interppht,
-                                       interpphtsize))) {
-      goto done;
-    }
-
-    /* Interpreter shouldn't itself need an interpreter */
-    Elf32_Phdr *interpphinterp;
-    if (0 > (err = _elf32_find_phinterp(&interpheader, interppht,
-                                        &interpphinterp))) {
-      goto done;
-    }
-    if (NULL != interpphinterp) {
+    if (NULL != interpname) {
       err = -EINVAL;
       goto done;
     }
@@ -660,17 +778,14 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
     err = -E2BIG;
     goto done;
   }
-  /* Copy arguments into kernel buffer */
-  if (NULL == (argbuf = (char *)kmalloc(argsize))) {
-    err = -ENOMEM;
-    goto done;
-  }
   /* Calculate where in user space we start putting the args. */
   void *arglow = (void *)((uintptr_t)(((char *)proglow) - argsize) & ~PTR_MASK);
   /* Copy everything into the user address space, modifying addresses in
    * argv, envp, and auxv to be user addresses as we go. */
-  _elf32_load_args(map, arglow, argsize, argbuf, argv, envp, auxv, argc, envc,
-                   auxc, phtsize);
+  if (0 > (err = _elf32_load_args(map, arglow, argv, envp, auxv, argc, envc,
+                                  auxc, phtsize))) {
+    goto done;
+  }
 
   dbg(DBG_ELF, "Past the point of no return. Swapping to map at 0x%p, setting "
                "brk to 0x%p\n",
@@ -688,6 +803,11 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
   /* Flush the process pagetables and TLB */
   pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
   tlb_flush_all();
+  /* A kernel thread becoming a user one stops borrowing a directory */
+  if (NULL == curthr->kt_ctx.c_pdptr) {
+    curthr->kt_ctx.c_pdptr = curproc->p_pagedir;
+    pt_set(curproc->p_pagedir);
+  }
 
   /* Set the process break and starting break (immediately after the mapped-in
    * text/data/bss from the executable) */
@@ -732,9 +852,6 @@ done:
   if (NULL != auxv) {
     kfree(auxv);
   }
-  if (NULL != argbuf) {
-    kfree(argbuf);
-  }
   return err;
 }
 
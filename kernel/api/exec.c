@@ -1,10 +1,21 @@
+#include "globals.h"
+#include "errno.h"
+
 #include "util/debug.h"
 
 #include "main/interrupt.h"
 #include "main/gdt.h"
 
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "fs/file.h"
+#include "fs/vnode.h"
+
 #include "api/exec.h"
 #include "api/binfmt.h"
+#include "api/spawn.h"
 #include "api/syscall.h"
 
 /* Enters userland from the kernel. Call this for a process that has up to now
@@ -13,12 +24,14 @@
  * stack of execution.
  */
 void userland_entry(const regs_t *regs) {
+  sched_charge(0);
   intr_disable();
   intr_setipl(IPL_LOW);
   /* We "return from the interrupt" to get into userland */
   __asm__ __volatile__(
       "movl %%eax, %%esp\n\t" /* Move stack pointer up to regs */
-      "pop %%es\n\t" /* Set userland data and extra segment appropriately */
+      "pop %%fs\n\t" /* Set userland data and extra segment appropriately */
+      "pop %%es\n\t"
       "pop %%ds\n\t"
       "popa\n\t"
       "add $8, %%esp\n\t" /*
@@ -35,21 +48,29 @@ void userland_entry(const regs_t *regs) {
 int do_execve(const char *filename, char *const *argv, char *const *envp,
               struct regs *regs) {
   uint32_t eip, esp;
-  int ret = binfmt_load(filename, argv, envp, &eip, &esp);
-  if (ret < 0) {
+  int ret;
+
+#ifdef __MTP__
+  /* The other threads would go on running in the old image */
+  if (0 > (ret = proc_kill_threads()))
+    return ret;
+#endif
+  if (0 > (ret = binfmt_load(filename, argv, envp, &eip, &esp))) {
     return ret;
   }
-  /* Make sure we "return" into the start of the newly loaded binary */
+  /* Make sure we "return" into the start of the newly loaded binary, with
+   * whatever TLS the old one set up gone */
   regs->r_eip = eip;
   regs->r_useresp = esp;
+  curthr->kt_ctx.c_tls = 0;
+  gdt_set_tls(0);
+  context_fpu_reset(&curthr->kt_ctx);
   return 0;
 }
 
-void kernel_execve(const char *filename, char *const *argv, char *const *envp) {
-  uint32_t eip, esp;
-  int ret = binfmt_load(filename, argv, envp, &eip, &esp);
-  KASSERT(0 == ret); /* Should never fail to load the first binary */
-
+/* Enters a program just loaded by a kernel-only process at eip, with its
+ * stack at esp. Does not return. */
+static void userland_start(uint32_t eip, uint32_t esp) {
   dbg(DBG_EXEC, "Entering userland with eip %#08x, esp %#08x\n", eip, esp);
 
   /* To enter userland, we build a set of saved registers to "trick" the
@@ -62,6 +83,7 @@ void kernel_execve(const char *filename, char *const *argv, char *const *envp) {
   regs.r_ss = GDT_USER_DATA | 0x3;
   regs.r_ds = regs.r_ss;
   regs.r_es = regs.r_ss;
+  regs.r_fs = 0; /* userland has no use for %fs */
 
   /* Userland instruction pointer and stack pointer */
   regs.r_eip = eip;
@@ -92,3 +114,121 @@ void kernel_execve(const char *filename, char *const *argv, char *const *envp) {
   regs.r_esp = 0;
   userland_entry(&regs);
 }
+
+void kernel_execve(const char *filename, char *const *argv, char *const *envp) {
+  uint32_t eip, esp;
+  int ret = binfmt_load(filename, argv, envp, &eip, &esp);
+  KASSERT(0 == ret); /* Should never fail to load the first binary */
+  userland_start(eip, esp);
+}
+
+/* A spawn in progress, on the spawner's stack */
+typedef struct spawn_req {
+  const char *sr_filename;
+  char *const *sr_argv;
+  char *const *sr_envp;
+  int sr_done;
+  int sr_ret; /* what binfmt_load returned */
+  ktqueue_t sr_waitq;
+} spawn_req_t;
+
+/* The new process's thread: loads the program and enters it, or exits
+ * if it can't be loaded */
+static void *spawn_entry(int arg1, void *arg2) {
+  spawn_req_t *req = (spawn_req_t *)arg2;
+  uint32_t eip, esp;
+  int ret;
+
+  ret = binfmt_load(req->sr_filename, req->sr_argv, req->sr_envp, &eip, &esp);
+  /* The spawner can return once it runs, taking req and the arguments
+   * with it; nothing here blocks before they are last used */
+  req->sr_ret = ret;
+  req->sr_done = 1;
+  sched_broadcast_on(&req->sr_waitq);
+  if (0 > ret)
+    return (void *)1;
+  userland_start(eip, esp);
+  return NULL;
+}
+
+/*
+ * Starts filename in a new child process, as fork followed by execve in
+ * the child would, but without copying the address space only for exec
+ * to throw it away. The child gets the spawner's files as changed by
+ * actions, and its working directory. Returns the child's pid once the
+ * program is loaded, or -errno (with no child left behind) if any
+ * action is invalid or the program can't be loaded.
+ */
+int do_spawn(const char *filename, char *const *argv, char *const *envp,
+             const struct spawn_action *actions, int nactions) {
+  fdtable_t *ft;
+  file_t *f, *old;
+  spawn_req_t req;
+  proc_t *child;
+  kthread_t *thr;
+  pid_t pid, reaped;
+  int i, fd, ret;
+
+  /* Work the actions out on a copy of the table, which becomes the
+   * child's, so that a bad one leaves nothing to undo */
+  if (NULL == (ft = fdtable_copy(curproc->p_fdt)))
+    return -ENOMEM;
+  for (i = 0; i < nactions; i++) {
+    fd = actions[i].sa_fd;
+    if (NULL == (f = fdtable_get(ft, fd))) {
+      ret = -EBADF;
+      goto fail;
+    }
+    switch (actions[i].sa_op) {
+    case SPAWN_DUP2:
+      if (fd == actions[i].sa_newfd)
+        break;
+      if (0 > (ret = fdtable_fit(ft, actions[i].sa_newfd)))
+        goto fail;
+      if (NULL != (old = fdtable_clear(ft, actions[i].sa_newfd)))
+        fput(old);
+      fref(f);
+      fdtable_set(ft, actions[i].sa_newfd, f);
+      break;
+    case SPAWN_CLOSE:
+      fput(fdtable_clear(ft, fd));
+      break;
+    default:
+      ret = -EINVAL;
+      goto fail;
+    }
+  }
+
+  child = proc_create(curproc->p_comm);
+  KASSERT(NULL != child);
+  fdtable_put(child->p_fdt);
+  child->p_fdt = ft;
+  if (child->p_cwd)
+    vput(child->p_cwd);
+  if (NULL != (child->p_cwd = curproc->p_cwd))
+    vref(child->p_cwd);
+
+  req.sr_filename = filename;
+  req.sr_argv = argv;
+  req.sr_envp = envp;
+  req.sr_done = 0;
+  req.sr_ret = 0;
+  sched_queue_init(&req.sr_waitq);
+  thr = kthread_create(child, spawn_entry, 0, &req);
+  KASSERT(NULL != thr);
+  pid = child->p_pid;
+  sched_make_runnable(thr);
+
+  while (!req.sr_done)
+    sched_sleep_on(&req.sr_waitq);
+  if (0 > req.sr_ret) {
+    reaped = do_waitpid(pid, 0, NULL);
+    KASSERT(reaped == pid);
+    return req.sr_ret;
+  }
+  return pid;
+
+fail:
+  fdtable_put(ft);
+  return ret;
+}
@@ -2,16 +2,25 @@
 #include "globals.h"
 #include "errno.h"
 #include "types.h"
+#include "limits.h"
 
 #include "main/interrupt.h"
+#include "main/gdt.h"
 
 #include "proc/proc.h"
 #include "proc/kthread.h"
+#include "proc/futex.h"
+#include "proc/resource.h"
+#include "proc/times.h"
 
 #include "util/init.h"
 #include "util/string.h"
 #include "util/debug.h"
+#include "util/hist.h"
 #include "util/list.h"
+#include "util/printf.h"
+#include "util/time.h"
+#include "util/trace.h"
 
 #include "mm/mman.h"
 #include "mm/mm.h"
@@ -20,6 +29,11 @@
 #include "mm/kmalloc.h"
 
 #include "fs/vfs_syscall.h"
+#include "fs/uio.h"
+#include "fs/poll.h"
+#include "fs/epoll.h"
+#include "fs/aio.h"
+#include "fs/socket.h"
 #include "fs/vnode.h"
 
 #include "test/kshell/kshell.h"
@@ -32,10 +46,55 @@
 #include "api/utsname.h"
 #include "api/access.h"
 #include "api/exec.h"
+#include "api/spawn.h"
+#include "api/perf.h"
+
+#include "time.h"
 
 static void syscall_handler(regs_t *regs);
 static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs);
 
+/* Calls of each system call, for syscall_info; the rest (SYS_debug and
+ * SYS_kshell) are counted together */
+#define SYSCALL_NCOUNTED 128
+static uint32_t syscall_counts[SYSCALL_NCOUNTED + 1];
+/* How long the calls took, for syscall_latency_info; calls which never
+ * return, like exit, are left out */
+static hist_t syscall_hists[SYSCALL_NCOUNTED + 1];
+
+size_t syscall_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  int i;
+
+  KASSERT(NULL == arg);
+  for (i = 0; i < SYSCALL_NCOUNTED; i++) {
+    if (syscall_counts[i])
+      iprintf(&buf, &size, "%d %u\n", i, syscall_counts[i]);
+  }
+  if (syscall_counts[SYSCALL_NCOUNTED])
+    iprintf(&buf, &size, "other %u\n", syscall_counts[SYSCALL_NCOUNTED]);
+  return size;
+}
+
+size_t syscall_latency_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  char name[16];
+  int i;
+
+  KASSERT(NULL == arg);
+  hist_iprintf_header(&buf, &size);
+  for (i = 0; i <= SYSCALL_NCOUNTED; i++) {
+    if (!syscall_hists[i].h_count)
+      continue;
+    if (SYSCALL_NCOUNTED == i)
+      strcpy(name, "other");
+    else
+      snprintf(name, sizeof(name), "%d", i);
+    hist_iprintf(&buf, &size, name, &syscall_hists[i]);
+  }
+  return size;
+}
+
 static __attribute__((unused)) void syscall_init(void) {
   intr_register(INTR_SYSCALL, syscall_handler);
 }
@@ -65,18 +124,406 @@ static int sys_write(write_args_t *arg) {
   return -1;
 }
 
+/* Most pages of data a readv, writev, pread or pwrite stages in the
+ * kernel; a larger request is cut short, as if the file ended there */
+#define RW_BOUNCE_PAGES 8
+
+/*
+ * Does the work of readv, writev, pread and pwrite given uiov, a kernel
+ * copy of the user's vector: the data is staged in one kernel buffer,
+ * divided into a kernel vector like the user's, and moved with a single
+ * VFS call, at offset or, if offset is negative, at the file position.
+ */
+static int sys_rw(int fd, const struct iovec *uiov, int iovcnt, off_t offset,
+                  int write) {
+  struct iovec kiov[IOV_MAX];
+  size_t total = 0, len;
+  uint32_t npages;
+  char *buf;
+  int i, k, ret;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < iovcnt; ++i)
+    total += MIN(uiov[i].iov_len, RW_BOUNCE_PAGES * PAGE_SIZE - total);
+  npages = MAX(1, (total + PAGE_SIZE - 1) / PAGE_SIZE);
+  if (NULL == (buf = page_alloc_n(npages))) {
+    curthr->kt_errno = ENOMEM;
+    return -1;
+  }
+
+  for (k = 0, len = 0; k < iovcnt && len < total; len += kiov[k++].iov_len) {
+    kiov[k].iov_base = buf + len;
+    kiov[k].iov_len = MIN(uiov[k].iov_len, total - len);
+    if (write && (ret = copy_from_user(kiov[k].iov_base, uiov[k].iov_base,
+                                       kiov[k].iov_len)) < 0)
+      goto out;
+  }
+  if (!k) { /* nothing to move, but the call still checks fd */
+    kiov[0].iov_base = buf;
+    kiov[k++].iov_len = 0;
+  }
+
+  if (0 <= offset)
+    ret = write ? do_pwrite(fd, buf, total, offset)
+                : do_pread(fd, buf, total, offset);
+  else
+    ret = write ? do_writev(fd, kiov, k) : do_readv(fd, kiov, k);
+
+  for (i = 0, len = 0; !write && 0 < ret && len < (size_t)ret; ++i) {
+    int err = copy_to_user(uiov[i].iov_base, kiov[i].iov_base,
+                           MIN(kiov[i].iov_len, ret - len));
+    if (err < 0) {
+      ret = err;
+      break;
+    }
+    len += kiov[i].iov_len;
+  }
+
+out:
+  page_free_n(buf, npages);
+  if (ret < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+static int sys_readv(readv_args_t *arg) {
+  readv_args_t kern_args;
+  struct iovec uiov[IOV_MAX];
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (kern_args.iovcnt > 0 && kern_args.iovcnt <= IOV_MAX &&
+       (ret = copy_from_user(uiov, kern_args.iov,
+                             kern_args.iovcnt * sizeof(struct iovec))) < 0)) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return sys_rw(kern_args.fd, uiov, kern_args.iovcnt, -1, 0);
+}
+
+static int sys_writev(writev_args_t *arg) {
+  writev_args_t kern_args;
+  struct iovec uiov[IOV_MAX];
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (kern_args.iovcnt > 0 && kern_args.iovcnt <= IOV_MAX &&
+       (ret = copy_from_user(uiov, kern_args.iov,
+                             kern_args.iovcnt * sizeof(struct iovec))) < 0)) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return sys_rw(kern_args.fd, uiov, kern_args.iovcnt, -1, 1);
+}
+
+static int sys_pread(pread_args_t *arg) {
+  pread_args_t kern_args;
+  struct iovec uiov;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (kern_args.offset < 0) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  uiov.iov_base = kern_args.buf;
+  uiov.iov_len = kern_args.nbytes;
+  return sys_rw(kern_args.fd, &uiov, 1, kern_args.offset, 0);
+}
+
+static int sys_pwrite(pwrite_args_t *arg) {
+  pwrite_args_t kern_args;
+  struct iovec uiov;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (kern_args.offset < 0) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  uiov.iov_base = (void *)kern_args.buf;
+  uiov.iov_len = kern_args.nbytes;
+  return sys_rw(kern_args.fd, &uiov, 1, kern_args.offset, 1);
+}
+
+/*
+ * The data never passes through user memory, so only the offset needs
+ * copying in and back out.
+ */
+static int sys_sendfile(sendfile_args_t *arg) {
+  sendfile_args_t kern_args;
+  off_t offset;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (kern_args.offset &&
+       (ret = copy_from_user(&offset, kern_args.offset, sizeof(offset))) < 0)) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  ret = do_sendfile(kern_args.out_fd, kern_args.in_fd,
+                    kern_args.offset ? &offset : NULL, kern_args.count);
+  if (ret < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (kern_args.offset) {
+    int err;
+    if ((err = copy_to_user(kern_args.offset, &offset, sizeof(offset))) < 0) {
+      curthr->kt_errno = -err;
+      return -1;
+    }
+  }
+  return ret;
+}
+
+/* do_poll limits nfds to NFILES, so the entries fit on the stack */
+static int sys_poll(poll_args_t *arg) {
+  poll_args_t kern_args;
+  struct pollfd fds[NFILES];
+  int nready, ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (kern_args.nfds > NFILES) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  if ((ret = copy_from_user(fds, kern_args.fds,
+                            kern_args.nfds * sizeof(*fds))) < 0 ||
+      (ret = nready = do_poll(fds, kern_args.nfds, kern_args.timeout)) < 0 ||
+      (ret = copy_to_user(kern_args.fds, fds,
+                          kern_args.nfds * sizeof(*fds))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return nready;
+}
+
+static int sys_fcntl(fcntl_args_t *arg) {
+  fcntl_args_t kern_args;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = do_fcntl(kern_args.fd, kern_args.cmd, kern_args.arg)) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+static int sys_fadvise(fadvise_args_t *arg) {
+  fadvise_args_t kern_args;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = do_fadvise(kern_args.fd, kern_args.offset, kern_args.len,
+                        kern_args.advice)) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+static int sys_ftruncate(ftruncate_args_t *arg) {
+  ftruncate_args_t kern_args;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = do_ftruncate(kern_args.fd, kern_args.len)) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+static int sys_fallocate(fallocate_args_t *arg) {
+  fallocate_args_t kern_args;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = do_fallocate(kern_args.fd, kern_args.mode, kern_args.offset,
+                          kern_args.len)) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+/* size is only checked, as an old hint of how many files will be watched */
+static int sys_epoll_create(int size) {
+  int ret;
+  if (size <= 0) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  if ((ret = do_epoll_create()) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+static int sys_epoll_ctl(epoll_ctl_args_t *arg) {
+  epoll_ctl_args_t kern_args;
+  struct epoll_event event;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (kern_args.op != EPOLL_CTL_DEL &&
+       (ret = copy_from_user(&event, kern_args.event, sizeof(event))) < 0) ||
+      (ret = do_epoll_ctl(kern_args.epfd, kern_args.op, kern_args.fd,
+                          &event)) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns at most a page of events per call */
+static int sys_epoll_wait(epoll_wait_args_t *arg) {
+  epoll_wait_args_t kern_args;
+  struct epoll_event *events;
+  int n, ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (kern_args.maxevents <= 0) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  kern_args.maxevents =
+      MIN(kern_args.maxevents, (int)(PAGE_SIZE / sizeof(*events)));
+  if (NULL == (events = (struct epoll_event *)page_alloc())) {
+    curthr->kt_errno = ENOMEM;
+    return -1;
+  }
+  if ((ret = n = do_epoll_wait(kern_args.epfd, events, kern_args.maxevents,
+                               kern_args.timeout)) < 0 ||
+      (ret = copy_to_user(kern_args.events, events, n * sizeof(*events))) <
+          0) {
+    page_free(events);
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  page_free(events);
+  return n;
+}
+
+static int sys_io_setup(unsigned int entries) {
+  int ret;
+  if ((ret = do_io_setup(entries)) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+static int sys_io_submit(io_submit_args_t *arg) {
+  io_submit_args_t kern_args;
+  struct io_sqe *sqes;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (kern_args.nr < 0) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  kern_args.nr = MIN(kern_args.nr, (int)(PAGE_SIZE / sizeof(*sqes)));
+  if (NULL == (sqes = (struct io_sqe *)page_alloc())) {
+    curthr->kt_errno = ENOMEM;
+    return -1;
+  }
+  if ((ret = copy_from_user(sqes, kern_args.sqes,
+                            kern_args.nr * sizeof(*sqes))) < 0 ||
+      (ret = do_io_submit(sqes, kern_args.nr)) < 0) {
+    page_free(sqes);
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  page_free(sqes);
+  return ret;
+}
+
+static int sys_io_getevents(io_getevents_args_t *arg) {
+  io_getevents_args_t kern_args;
+  struct io_cqe *cqes;
+  int n, ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (kern_args.nr < 0 || kern_args.min_nr < 0 ||
+      kern_args.min_nr > kern_args.nr) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  kern_args.nr = MIN(kern_args.nr, (int)(PAGE_SIZE / sizeof(*cqes)));
+  kern_args.min_nr = MIN(kern_args.min_nr, kern_args.nr);
+  if (NULL == (cqes = (struct io_cqe *)page_alloc())) {
+    curthr->kt_errno = ENOMEM;
+    return -1;
+  }
+  if ((ret = n = do_io_getevents(cqes, kern_args.min_nr, kern_args.nr,
+                                 kern_args.timeout)) < 0 ||
+      (ret = copy_to_user(kern_args.cqes, cqes, n * sizeof(*cqes))) < 0) {
+    page_free(cqes);
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  page_free(cqes);
+  return n;
+}
+
 /*
- * This is another tricly sys_* function that you will need to write.
- * It's pretty similar to sys_read(), but you don't need
- * to allocate a whole page, just a single dirent_t. call do_getdents in a
- * loop until you have read getdent_args_t->count bytes (or an error
- * occurs).  You should note that count is the number of bytes in the
- * buffer, not the number of dirents, which means that you'll need to loop
- * a max of something like count / sizeof(dirent_t) times.
+ * Reads as many directory entries as fit in getdents_args_t->count bytes,
+ * up to a page's worth per call, with a single do_getdents() so that the
+ * file system can fill them a directory block at a time.
  */
 static int sys_getdents(getdents_args_t *arg) {
-  NOT_YET_IMPLEMENTED("VM: sys_getdents");
-  return -1;
+  getdents_args_t kern_args;
+  dirent_t *buf;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (NULL == (buf = page_alloc())) {
+    curthr->kt_errno = ENOMEM;
+    return -1;
+  }
+  ret = do_getdents(kern_args.fd, buf, MIN(kern_args.count, PAGE_SIZE));
+  if (ret > 0) {
+    int err = copy_to_user(kern_args.dirp, buf, ret);
+    if (err < 0)
+      ret = err;
+  }
+  page_free(buf);
+  if (ret < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
 }
 
 #ifdef __MOUNTING__
@@ -157,6 +604,16 @@ static int sys_close(int fd) {
     return err;
 }
 
+static int sys_fsync(int fd, int datasync) {
+  int err;
+
+  if ((err = do_fsync(fd, datasync)) < 0) {
+    curthr->kt_errno = -err;
+    return -1;
+  }
+  return 0;
+}
+
 static int sys_dup(int fd) {
   int err;
 
@@ -193,14 +650,12 @@ static int sys_mkdir(mkdir_args_t *arg) {
     return -1;
   }
 
-  path = user_strdup(&kern_args.path);
-  if (!path) {
-    curthr->kt_errno = EINVAL;
+  path = user_getpath(&kern_args.path);
+  if (!path)
     return -1;
-  }
 
   err = do_mkdir(path);
-  kfree(path);
+  user_putpath(path);
   if (err < 0) {
     curthr->kt_errno = -err;
     return -1;
@@ -217,15 +672,13 @@ static int sys_rmdir(argstr_t *arg) {
     curthr->kt_errno = -err;
     return -1;
   }
-  path = user_strdup(&kern_args);
+  path = user_getpath(&kern_args);
 
-  if (!path) {
-    curthr->kt_errno = EINVAL;
+  if (!path)
     return -1;
-  }
 
   err = do_rmdir(path);
-  kfree(path);
+  user_putpath(path);
   if (err < 0) {
     curthr->kt_errno = -err;
     return -1;
@@ -243,14 +696,12 @@ static int sys_unlink(argstr_t *arg) {
     return -1;
   }
 
-  path = user_strdup(&kern_args);
-  if (!path) {
-    curthr->kt_errno = EINVAL;
+  path = user_getpath(&kern_args);
+  if (!path)
     return -1;
-  }
 
   err = do_unlink(path);
-  kfree(path);
+  user_putpath(path);
   if (err < 0) {
     curthr->kt_errno = -err;
     return -1;
@@ -269,22 +720,19 @@ static int sys_link(link_args_t *arg) {
     return -1;
   }
 
-  to = user_strdup(&kern_args.to);
-  if (!to) {
-    curthr->kt_errno = EINVAL;
+  to = user_getpath(&kern_args.to);
+  if (!to)
     return -1;
-  }
 
-  from = user_strdup(&kern_args.from);
+  from = user_getpath(&kern_args.from);
   if (!from) {
-    curthr->kt_errno = EINVAL;
-    kfree(to);
+    user_putpath(to);
     return -1;
   }
 
   err = do_link(from, to);
-  kfree(to);
-  kfree(from);
+  user_putpath(to);
+  user_putpath(from);
 
   if (err < 0) {
     curthr->kt_errno = -err;
@@ -305,22 +753,19 @@ static int sys_rename(rename_args_t *arg) {
     return -1;
   }
 
-  oldname = user_strdup(&kern_args.oldname);
-  if (!oldname) {
-    curthr->kt_errno = EINVAL;
+  oldname = user_getpath(&kern_args.oldname);
+  if (!oldname)
     return -1;
-  }
 
-  newname = user_strdup(&kern_args.newname);
+  newname = user_getpath(&kern_args.newname);
   if (!newname) {
-    curthr->kt_errno = EINVAL;
-    kfree(oldname);
+    user_putpath(oldname);
     return -1;
   }
 
   err = do_rename(oldname, newname);
-  kfree(newname);
-  kfree(oldname);
+  user_putpath(newname);
+  user_putpath(oldname);
 
   if (err < 0) {
     curthr->kt_errno = -err;
@@ -339,14 +784,12 @@ static int sys_chdir(argstr_t *arg) {
     return -1;
   }
 
-  path = user_strdup(&kern_args);
-  if (!path) {
-    curthr->kt_errno = EINVAL;
+  path = user_getpath(&kern_args);
+  if (!path)
     return -1;
-  }
 
   err = do_chdir(path);
-  kfree(path);
+  user_putpath(path);
 
   if (err < 0) {
     curthr->kt_errno = -err;
@@ -383,14 +826,12 @@ static int sys_open(open_args_t *arg) {
     return -1;
   }
 
-  path = user_strdup(&kern_args.filename);
-  if (!path) {
-    curthr->kt_errno = EINVAL;
+  path = user_getpath(&kern_args.filename);
+  if (!path)
     return -1;
-  }
 
   err = do_open(path, kern_args.flags);
-  kfree(path);
+  user_putpath(path);
   if (err < 0) {
     curthr->kt_errno = -err;
     return -1;
@@ -415,6 +856,41 @@ static int sys_munmap(munmap_args_t *args) {
   return 0;
 }
 
+static int sys_madvise(madvise_args_t *args) {
+  madvise_args_t kargs;
+  int err;
+
+  if (copy_from_user(&kargs, args, sizeof(madvise_args_t))) {
+    curthr->kt_errno = EFAULT;
+    return -1;
+  }
+
+  err = do_madvise(kargs.addr, kargs.len, kargs.advice);
+  if (err < 0) {
+    curthr->kt_errno = -err;
+    return -1;
+  }
+  return 0;
+}
+
+static void *sys_mremap(mremap_args_t *args) {
+  mremap_args_t kargs;
+  void *ret;
+  int err;
+
+  if (copy_from_user(&kargs, args, sizeof(mremap_args_t))) {
+    curthr->kt_errno = EFAULT;
+    return MAP_FAILED;
+  }
+
+  err = do_mremap(kargs.addr, kargs.oldlen, kargs.newlen, kargs.flags, &ret);
+  if (err < 0) {
+    curthr->kt_errno = -err;
+    return MAP_FAILED;
+  }
+  return ret;
+}
+
 static void *sys_mmap(mmap_args_t *arg) {
   mmap_args_t kargs;
   void *ret;
@@ -457,11 +933,11 @@ static pid_t sys_waitpid(waitpid_args_t *args) {
   return p;
 }
 
-static void *sys_brk(void *addr) {
+static void *sys_brk(void *addr, int populate) {
   void *ret;
   int err;
 
-  if (0 == (err = do_brk(addr, &ret))) {
+  if (0 == (err = do_brk(addr, populate, &ret))) {
     return ret;
   } else {
     curthr->kt_errno = -err;
@@ -473,8 +949,28 @@ static void sys_sync(void) { pframe_clean_all(); }
 
 static void sys_halt(void) { proc_kill_all(); }
 
-static int sys_stat(stat_args_t *arg) {
-  stat_args_t kern_args;
+static int sys_fstat(fstat_args_t *arg) {
+  fstat_args_t kern_args;
+  struct stat buf;
+  int ret;
+
+  if (copy_from_user(&kern_args, arg, sizeof(kern_args)) < 0) {
+    curthr->kt_errno = EFAULT;
+    return -1;
+  }
+
+  ret = do_fstat(kern_args.fd, &buf);
+  if (ret == 0)
+    ret = copy_to_user(kern_args.buf, &buf, sizeof(struct stat));
+  if (ret != 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+static int sys_fstatat(fstatat_args_t *arg) {
+  fstatat_args_t kern_args;
   struct stat buf;
   char *path;
   int ret;
@@ -484,10 +980,34 @@ static int sys_stat(stat_args_t *arg) {
     return -1;
   }
 
-  if ((path = user_strdup(&kern_args.path)) == NULL) {
-    curthr->kt_errno = EINVAL;
+  if ((path = user_getpath(&kern_args.path)) == NULL)
+    return -1;
+
+  ret = do_fstatat(kern_args.dirfd, path, &buf);
+  user_putpath(path);
+
+  if (ret == 0)
+    ret = copy_to_user(kern_args.buf, &buf, sizeof(struct stat));
+  if (ret != 0) {
+    curthr->kt_errno = -ret;
     return -1;
   }
+  return 0;
+}
+
+static int sys_stat(stat_args_t *arg) {
+  stat_args_t kern_args;
+  struct stat buf;
+  char *path;
+  int ret;
+
+  if (copy_from_user(&kern_args, arg, sizeof(kern_args)) < 0) {
+    curthr->kt_errno = EFAULT;
+    return -1;
+  }
+
+  if ((path = user_getpath(&kern_args.path)) == NULL)
+    return -1;
 
   ret = do_stat(path, &buf);
 
@@ -496,15 +1016,63 @@ static int sys_stat(stat_args_t *arg) {
   }
 
   if (ret != 0) {
-    kfree(path);
+    user_putpath(path);
     curthr->kt_errno = -ret;
     return -1;
   }
 
-  kfree(path);
+  user_putpath(path);
   return 0;
 }
 
+/* Longest sleep whose length in msecs fits time_deadline_ms's argument */
+#define NANOSLEEP_MAX_SECS (UINT_MAX / 1000 - 1)
+#define NSECS_PER_TICK (TICK_MSECS * 1000000)
+
+static int sys_nanosleep(nanosleep_args_t *arg) {
+  nanosleep_args_t kern_args;
+  struct timespec req, rem;
+  unsigned long deadline, now, left;
+  unsigned int msecs;
+  ktqueue_t waitq;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = copy_from_user(&req, kern_args.req, sizeof(req))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  if (req.tv_sec > NANOSLEEP_MAX_SECS)
+    req.tv_sec = NANOSLEEP_MAX_SECS;
+  /* Rounded up to whole msecs; time_deadline_ms rounds on to ticks */
+  msecs = (unsigned int)req.tv_sec * 1000 + (req.tv_nsec + 999999) / 1000000;
+  if (!msecs)
+    return 0;
+
+  sched_queue_init(&waitq);
+  deadline = time_deadline_ms(msecs);
+  if ((now = time_ticks()) >= deadline ||
+      -EINTR != sched_cancellable_sleep_on_timeout(&waitq, deadline - now))
+    return 0;
+
+  if (kern_args.rem) {
+    now = time_ticks();
+    left = now < deadline ? deadline - now : 0;
+    rem.tv_sec = left / TIME_HZ;
+    rem.tv_nsec = (left % TIME_HZ) * NSECS_PER_TICK;
+    if ((ret = copy_to_user(kern_args.rem, &rem, sizeof(rem))) < 0) {
+      curthr->kt_errno = -ret;
+      return -1;
+    }
+  }
+  curthr->kt_errno = EINTR;
+  return -1;
+}
+
 static int sys_pipe(int arg[2]) {
   int kern_args[2];
   int ret;
@@ -523,6 +1091,20 @@ static int sys_pipe(int arg[2]) {
   return 0;
 }
 
+static int sys_perf_read(perf_counts_t *arg) {
+  perf_counts_t pc;
+  int ret;
+
+  ret = do_perf_read(&pc);
+  if (ret == 0)
+    ret = copy_to_user(arg, &pc, sizeof(pc));
+  if (ret != 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
 static int sys_uname(struct utsname *arg) {
   static const char sysname[] = "Weenix";
   static const char release[] = "1.2";
@@ -567,6 +1149,345 @@ static int sys_fork(regs_t *regs) {
   return ret;
 }
 
+#ifdef __MTP__
+static int sys_thr_create(thr_create_args_t *args, regs_t *regs) {
+  thr_create_args_t kargs;
+  int ret;
+
+  if (copy_from_user(&kargs, args, sizeof(thr_create_args_t))) {
+    curthr->kt_errno = EFAULT;
+    return -1;
+  }
+
+  ret = do_thr_create(regs, kargs.entry, kargs.stack, kargs.tls);
+  if (ret < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+static int sys_thr_join(thr_join_args_t *args) {
+  thr_join_args_t kargs;
+  kthread_t *kthr;
+  void *retval;
+  int err;
+
+  if (copy_from_user(&kargs, args, sizeof(thr_join_args_t))) {
+    curthr->kt_errno = EFAULT;
+    return -1;
+  }
+
+  if (NULL == (kthr = kthread_lookup(curproc, kargs.tid)))
+    err = -ESRCH;
+  else if (0 <= (err = kthread_join(kthr, &retval)) && kargs.retval &&
+           copy_to_user(kargs.retval, &retval, sizeof(retval)))
+    err = -EFAULT;
+  if (err < 0) {
+    curthr->kt_errno = -err;
+    return -1;
+  }
+  return 0;
+}
+
+static int sys_thr_cancel(thr_cancel_args_t *args) {
+  thr_cancel_args_t kargs;
+  kthread_t *kthr;
+
+  if (copy_from_user(&kargs, args, sizeof(thr_cancel_args_t))) {
+    curthr->kt_errno = EFAULT;
+    return -1;
+  }
+
+  if (NULL == (kthr = kthread_lookup(curproc, kargs.tid))) {
+    curthr->kt_errno = ESRCH;
+    return -1;
+  }
+  kthread_cancel(kthr, kargs.retval);
+  return 0;
+}
+
+static int sys_thr_detach(int tid) {
+  kthread_t *kthr;
+  int err;
+
+  if (NULL == (kthr = kthread_lookup(curproc, tid)))
+    err = -ESRCH;
+  else
+    err = kthread_detach(kthr);
+  if (err < 0) {
+    curthr->kt_errno = -err;
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+/* Bases the calling thread's %gs segment at the given user address */
+static int sys_set_tls(void *base) {
+  if ((uint32_t)base >= USER_MEM_HIGH) {
+    curthr->kt_errno = EINVAL;
+    return -1;
+  }
+  curthr->kt_ctx.c_tls = (uint32_t)base;
+  gdt_set_tls((uint32_t)base);
+  return 0;
+}
+
+static int sys_futex(futex_args_t *args) {
+  futex_args_t kargs;
+  int ret;
+
+  if (copy_from_user(&kargs, args, sizeof(futex_args_t))) {
+    curthr->kt_errno = EFAULT;
+    return -1;
+  }
+
+  ret = do_futex(kargs.uaddr, kargs.op, kargs.val, kargs.uaddr2, kargs.val2,
+                 kargs.val3);
+  if (ret < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+static int sys_getrusage(getrusage_args_t *args) {
+  getrusage_args_t kargs;
+  struct rusage ru;
+  int ret;
+
+  if ((ret = copy_from_user(&kargs, args, sizeof(kargs))) < 0 ||
+      (ret = do_getrusage(kargs.who, &ru)) < 0 ||
+      (ret = copy_to_user(kargs.ru, &ru, sizeof(ru))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+/* The thread of the current process with the given id, 0 meaning curthr */
+static kthread_t *affinity_thread(int tid) {
+  kthread_t *kthr;
+
+  if (0 == tid)
+    return curthr;
+  list_iterate_begin(&curproc->p_threads, kthr, kthread_t, kt_plink) {
+    if (tid == kthr->kt_tid && KT_EXITED != kthr->kt_state)
+      return kthr;
+  }
+  list_iterate_end();
+  return NULL;
+}
+
+static int sys_sched_setaffinity(sched_affinity_args_t *args) {
+  sched_affinity_args_t kargs;
+  kthread_t *kthr;
+  uint32_t mask;
+  int ret;
+
+  if ((ret = copy_from_user(&kargs, args, sizeof(kargs))) < 0 ||
+      (ret = copy_from_user(&mask, kargs.mask, sizeof(mask))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (NULL == (kthr = affinity_thread(kargs.tid))) {
+    curthr->kt_errno = ESRCH;
+    return -1;
+  }
+  if ((ret = sched_set_affinity(kthr, mask)) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+/* Like Linux, gives the mask less the processors which are not online */
+static int sys_sched_getaffinity(sched_affinity_args_t *args) {
+  sched_affinity_args_t kargs;
+  kthread_t *kthr;
+  uint32_t mask;
+  int ret;
+
+  if ((ret = copy_from_user(&kargs, args, sizeof(kargs))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  if (NULL == (kthr = affinity_thread(kargs.tid))) {
+    curthr->kt_errno = ESRCH;
+    return -1;
+  }
+  mask = kthr->kt_cpumask & sched_cpus_online();
+  if ((ret = copy_to_user(kargs.mask, &mask, sizeof(mask))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+static int sys_clock_gettime(clock_gettime_args_t *arg) {
+  clock_gettime_args_t kern_args;
+  struct timespec ts;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = time_gettime(kern_args.clk, &ts)) < 0 ||
+      (ret = copy_to_user(kern_args.tp, &ts, sizeof(ts))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+static int sys_socketpair(socketpair_args_t *arg) {
+  socketpair_args_t kern_args;
+  int sv[2];
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = do_socketpair(kern_args.domain, kern_args.type,
+                           kern_args.protocol, sv)) < 0 ||
+      (ret = copy_to_user(kern_args.sv, sv, sizeof(sv))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+static int sys_socket(socket_args_t *arg) {
+  socket_args_t kern_args;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = do_socket(kern_args.domain, kern_args.type, kern_args.protocol)) <
+          0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+static int sys_bind(bind_args_t *arg) {
+  bind_args_t kern_args;
+  struct sockaddr addr;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = kern_args.addrlen > sizeof(addr) ? -EINVAL : 0) < 0 ||
+      (ret = copy_from_user(&addr, kern_args.addr, kern_args.addrlen)) < 0 ||
+      (ret = do_bind(kern_args.fd, &addr, kern_args.addrlen)) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+/* Room for the control messages of a sendmsg or recvmsg: enough for one
+ * passing SCM_MAX_FD descriptors */
+#define MSG_CONTROL_MAX CMSG_SPACE(SCM_MAX_FD * sizeof(int))
+
+/*
+ * Copies in the header at umsg, and the vector, control messages and
+ * address it points to, into msg, iov, ctl and name; the buffers stay in
+ * user space. For receiving, only as much room for control messages and
+ * the address as ctl and name have is given.
+ */
+static int sys_msghdr(const struct msghdr *umsg, struct msghdr *msg,
+                      struct iovec *iov, void *ctl, struct sockaddr *name,
+                      int recv) {
+  int ret;
+
+  if ((ret = copy_from_user(msg, umsg, sizeof(*msg))) < 0)
+    return ret;
+  if (msg->msg_iovlen < 0 || msg->msg_iovlen > IOV_MAX)
+    return -EINVAL;
+  if (recv) {
+    msg->msg_controllen = MIN(msg->msg_controllen, MSG_CONTROL_MAX);
+    msg->msg_namelen = MIN(msg->msg_namelen, sizeof(*name));
+  } else if (msg->msg_controllen > MSG_CONTROL_MAX) {
+    return -ENOBUFS;
+  } else if (msg->msg_name && msg->msg_namelen > sizeof(*name)) {
+    return -EINVAL;
+  }
+  if ((msg->msg_iovlen &&
+       (ret = copy_from_user(iov, msg->msg_iov,
+                             msg->msg_iovlen * sizeof(*iov))) < 0) ||
+      (!recv && msg->msg_controllen &&
+       (ret = copy_from_user(ctl, msg->msg_control, msg->msg_controllen)) <
+           0) ||
+      (!recv && msg->msg_name &&
+       (ret = copy_from_user(name, msg->msg_name, msg->msg_namelen)) < 0))
+    return ret;
+  msg->msg_iov = iov;
+  msg->msg_control = ctl;
+  if (msg->msg_name)
+    msg->msg_name = name;
+  return 0;
+}
+
+static int sys_sendmsg(sendmsg_args_t *arg) {
+  sendmsg_args_t kern_args;
+  struct msghdr msg;
+  struct iovec iov[IOV_MAX];
+  int ctl[MSG_CONTROL_MAX / sizeof(int)];
+  struct sockaddr name;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = sys_msghdr(kern_args.msg, &msg, iov, ctl, &name, 0)) < 0 ||
+      (ret = do_sendmsg(kern_args.fd, &msg, kern_args.flags)) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
+/* The control messages and address received, and their lengths and the
+ * flags, are copied back out along with the data; the address is cut
+ * short if there isn't room, but msg_namelen is its whole length */
+static int sys_recvmsg(recvmsg_args_t *arg) {
+  recvmsg_args_t kern_args;
+  struct msghdr msg, umsg;
+  struct iovec iov[IOV_MAX];
+  int ctl[MSG_CONTROL_MAX / sizeof(int)];
+  struct sockaddr name;
+  int n, ret;
+
+  if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+      (ret = copy_from_user(&umsg, kern_args.msg, sizeof(umsg))) < 0 ||
+      (ret = sys_msghdr(kern_args.msg, &msg, iov, ctl, &name, 1)) < 0 ||
+      (ret = n = do_recvmsg(kern_args.fd, &msg, kern_args.flags)) < 0 ||
+      (msg.msg_controllen &&
+       (ret = copy_to_user(umsg.msg_control, ctl, msg.msg_controllen)) < 0) ||
+      (umsg.msg_name && msg.msg_namelen &&
+       (ret = copy_to_user(umsg.msg_name, &name,
+                           MIN(umsg.msg_namelen, msg.msg_namelen))) < 0)) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  umsg.msg_namelen = umsg.msg_name ? msg.msg_namelen : 0;
+  umsg.msg_controllen = msg.msg_controllen;
+  umsg.msg_flags = msg.msg_flags;
+  if ((ret = copy_to_user(kern_args.msg, &umsg, sizeof(umsg))) < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return n;
+}
+
+static clock_t sys_times(struct tms *buf) {
+  struct tms kbuf;
+  clock_t ret;
+  int err;
+
+  ret = do_times(&kbuf);
+  if (NULL != buf && (err = copy_to_user(buf, &kbuf, sizeof(kbuf))) < 0) {
+    curthr->kt_errno = -err;
+    return -1;
+  }
+  return ret;
+}
+
 static void free_vector(char **vect) {
   char **temp;
   for (temp = vect; *temp; temp++)
@@ -618,6 +1539,59 @@ cleanup:
   return 0;
 }
 
+static int sys_spawn(spawn_args_t *args) {
+  spawn_args_t kern_args;
+  struct spawn_action kern_actions[SPAWN_ACTIONS_MAX];
+  char *kern_filename = NULL;
+  char **kern_argv = NULL;
+  char **kern_envp = NULL;
+  int ret;
+
+  if ((ret = copy_from_user(&kern_args, args, sizeof(kern_args))) < 0)
+    goto cleanup;
+  if (0 > kern_args.nactions || SPAWN_ACTIONS_MAX < kern_args.nactions) {
+    ret = -EINVAL;
+    goto cleanup;
+  }
+  if ((ret = copy_from_user(kern_actions, kern_args.actions,
+                            kern_args.nactions * sizeof(*kern_actions))) < 0)
+    goto cleanup;
+
+  /* The duplicating functions leave the error in errno */
+  if ((kern_filename = user_strdup(&kern_args.filename)) == NULL) {
+    ret = -curthr->kt_errno;
+    goto cleanup;
+  }
+  if (kern_args.argv.av_vec) {
+    if ((kern_argv = user_vecdup(&kern_args.argv)) == NULL) {
+      ret = -curthr->kt_errno;
+      goto cleanup;
+    }
+  }
+  if (kern_args.envp.av_vec) {
+    if ((kern_envp = user_vecdup(&kern_args.envp)) == NULL) {
+      ret = -curthr->kt_errno;
+      goto cleanup;
+    }
+  }
+
+  ret = do_spawn(kern_filename, kern_argv, kern_envp, kern_actions,
+                 kern_args.nactions);
+
+cleanup:
+  if (kern_filename)
+    kfree(kern_filename);
+  if (kern_argv)
+    free_vector(kern_argv);
+  if (kern_envp)
+    free_vector(kern_envp);
+  if (ret < 0) {
+    curthr->kt_errno = -ret;
+    return -1;
+  }
+  return ret;
+}
+
 static int sys_debug(argstr_t *arg) {
   argstr_t kern_args;
   int err;
@@ -677,7 +1651,18 @@ static void syscall_handler(regs_t *regs) {
 
   dbginfo(DBG_VMMAP, vmmap_mapping_info, curproc->p_vmmap);
 
+  /* SYSENTER callers get errno back in %esi instead of asking for it with
+   * another system call. It is set beforehand too, for the child of a
+   * fork, which returns to userland with a copy of this frame */
+  if (INTR_SYSENTER == regs->r_err)
+    regs->r_esi = curthr->kt_errno;
+
+  syscall_counts[MIN(sysnum, SYSCALL_NCOUNTED)]++;
+  trace(TRACE_SYSCALL_BEGIN, sysnum, args);
+  uint64_t start = time_cycles();
   int ret = syscall_dispatch(sysnum, args, regs);
+  hist_add_since(&syscall_hists[MIN(sysnum, SYSCALL_NCOUNTED)], start);
+  trace(TRACE_SYSCALL_END, sysnum, ret);
 
   if (curthr->kt_cancelled) {
     dbg(DBG_SYSCALL, "trap: CANCELLING: thread %p of proc %d "
@@ -690,6 +1675,13 @@ static void syscall_handler(regs_t *regs) {
   dbg(DBG_SYSCALL, "<< pid %d, sysnum: %d (%x), returned: %d (%#x)\n",
       curproc->p_pid, sysnum, sysnum, ret, ret);
   regs->r_eax = ret; /* Return value goes in eax */
+  if (INTR_SYSENTER == regs->r_err)
+    regs->r_esi = curthr->kt_errno;
+
+#ifdef __UPREEMPT__
+  /* The quantum may have run out while we were in the kernel */
+  sched_preempt();
+#endif
 }
 
 static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs) {
@@ -712,6 +1704,41 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs) {
     sched_switch();
     return 0;
 
+#ifdef __MTP__
+  case SYS_thr_create:
+    return sys_thr_create((thr_create_args_t *)args, regs);
+
+  case SYS_thr_join:
+    return sys_thr_join((thr_join_args_t *)args);
+
+  case SYS_thr_cancel:
+    return sys_thr_cancel((thr_cancel_args_t *)args);
+
+  case SYS_thr_detach:
+    return sys_thr_detach((int)args);
+#endif
+
+  case SYS_gettid:
+    return curthr->kt_tid;
+
+  case SYS_set_tls:
+    return sys_set_tls((void *)args);
+
+  case SYS_futex:
+    return sys_futex((futex_args_t *)args);
+
+  case SYS_getrusage:
+    return sys_getrusage((getrusage_args_t *)args);
+
+  case SYS_times:
+    return sys_times((struct tms *)args);
+
+  case SYS_sched_setaffinity:
+    return sys_sched_setaffinity((sched_affinity_args_t *)args);
+
+  case SYS_sched_getaffinity:
+    return sys_sched_getaffinity((sched_affinity_args_t *)args);
+
   case SYS_fork:
     return sys_fork(regs);
 
@@ -722,6 +1749,18 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs) {
     sys_sync();
     return 0;
 
+  case SYS_fsync:
+    return sys_fsync((int)args, 0);
+
+  case SYS_fdatasync:
+    return sys_fsync((int)args, 1);
+
+  case SYS_ftruncate:
+    return sys_ftruncate((ftruncate_args_t *)args);
+
+  case SYS_fallocate:
+    return sys_fallocate((fallocate_args_t *)args);
+
 #ifdef __MOUNTING__
   case SYS_mount:
     return sys_mount((mount_args_t *)args);
@@ -735,6 +1774,10 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs) {
 
   case SYS_munmap:
     return sys_munmap((munmap_args_t *)args);
+  case SYS_madvise:
+    return sys_madvise((madvise_args_t *)args);
+  case SYS_mremap:
+    return (int)sys_mremap((mremap_args_t *)args);
 
   case SYS_open:
     return sys_open((open_args_t *)args);
@@ -748,6 +1791,47 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs) {
   case SYS_write:
     return sys_write((write_args_t *)args);
 
+  case SYS_readv:
+    return sys_readv((readv_args_t *)args);
+
+  case SYS_writev:
+    return sys_writev((writev_args_t *)args);
+
+  case SYS_pread:
+    return sys_pread((pread_args_t *)args);
+
+  case SYS_pwrite:
+    return sys_pwrite((pwrite_args_t *)args);
+
+  case SYS_sendfile:
+    return sys_sendfile((sendfile_args_t *)args);
+
+  case SYS_poll:
+    return sys_poll((poll_args_t *)args);
+
+  case SYS_fcntl:
+    return sys_fcntl((fcntl_args_t *)args);
+  case SYS_fadvise:
+    return sys_fadvise((fadvise_args_t *)args);
+
+  case SYS_epoll_create:
+    return sys_epoll_create((int)args);
+
+  case SYS_epoll_ctl:
+    return sys_epoll_ctl((epoll_ctl_args_t *)args);
+
+  case SYS_epoll_wait:
+    return sys_epoll_wait((epoll_wait_args_t *)args);
+
+  case SYS_io_setup:
+    return sys_io_setup((unsigned int)args);
+
+  case SYS_io_submit:
+    return sys_io_submit((io_submit_args_t *)args);
+
+  case SYS_io_getevents:
+    return sys_io_getevents((io_getevents_args_t *)args);
+
   case SYS_dup:
     return sys_dup((int)args);
 
@@ -776,7 +1860,9 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs) {
     return sys_getdents((getdents_args_t *)args);
 
   case SYS_brk:
-    return (int)sys_brk((void *)args);
+    return (int)sys_brk((void *)args, 0);
+  case SYS_brk_populate:
+    return (int)sys_brk((void *)args, 1);
 
   case SYS_lseek:
     return sys_lseek((lseek_args_t *)args);
@@ -789,18 +1875,49 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs) {
     curthr->kt_errno = (int)args;
     return 0;
 
+  case SYS_sysenter:
+    return intr_sysenter_enabled();
+
   case SYS_errno:
     return curthr->kt_errno;
 
   case SYS_execve:
     return sys_execve((execve_args_t *)args, regs);
 
+  case SYS_spawn:
+    return sys_spawn((spawn_args_t *)args);
+
   case SYS_stat:
     return sys_stat((stat_args_t *)args);
 
+  case SYS_fstat:
+    return sys_fstat((fstat_args_t *)args);
+
+  case SYS_fstatat:
+    return sys_fstatat((fstatat_args_t *)args);
+
   case SYS_pipe:
     return sys_pipe((int *)args);
 
+  case SYS_perf_read:
+    return sys_perf_read((perf_counts_t *)args);
+
+  case SYS_nanosleep:
+    return sys_nanosleep((nanosleep_args_t *)args);
+
+  case SYS_clock_gettime:
+    return sys_clock_gettime((clock_gettime_args_t *)args);
+  case SYS_socketpair:
+    return sys_socketpair((socketpair_args_t *)args);
+  case SYS_sendmsg:
+    return sys_sendmsg((sendmsg_args_t *)args);
+  case SYS_recvmsg:
+    return sys_recvmsg((recvmsg_args_t *)args);
+  case SYS_socket:
+    return sys_socket((socket_args_t *)args);
+  case SYS_bind:
+    return sys_bind((bind_args_t *)args);
+
   case SYS_uname:
     return sys_uname((struct utsname *)args);
 
@@ -1,10 +1,27 @@
 #include "kernel.h"
+#include "globals.h"
+#include "config.h"
 #include "types.h"
+#include "errno.h"
 #include "util/debug.h"
+#include "util/init.h"
 #include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
 
 #include "drivers/blockdev.h"
+#include "drivers/disk/ahci.h"
 #include "drivers/disk/ata.h"
+#include "drivers/disk/ramdisk.h"
+#include "drivers/disk/virtio_blk.h"
+
+#include "fs/stat.h"
+#include "fs/devfs/devfs.h"
 
 #include "mm/pframe.h"
 #include "mm/mmobj.h"
@@ -16,27 +33,83 @@ static int blockdev_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite,
 static int blockdev_fillpage(mmobj_t *o, pframe_t *pf);
 static int blockdev_dirtypage(mmobj_t *o, pframe_t *pf);
 static int blockdev_cleanpage(mmobj_t *o, pframe_t *pf);
+static int blockdev_cleanpages(mmobj_t *o, pframe_t **pfs, int npages);
 
-static mmobj_ops_t blockdev_mmobj_ops = {.ref = blockdev_ref,
+static mmobj_ops_t blockdev_mmobj_ops = {.name = "blockdev",
+                                         .ref = blockdev_ref,
                                          .put = blockdev_put,
                                          .lookuppage = blockdev_lookuppage,
                                          .fillpage = blockdev_fillpage,
                                          .dirtypage = blockdev_dirtypage,
-                                         .cleanpage = blockdev_cleanpage};
+                                         .cleanpage = blockdev_cleanpage,
+                                         .cleanpages = blockdev_cleanpages};
+
+static int blockdev_submit(blockdev_t *bd, const blockdev_iovec_t *iov,
+                           int iovcnt, blocknum_t loc, int write);
 
 static list_t blockdevs;
 
+/* The block I/O threads, which dispatch queued requests nobody is
+ * waiting on, and where the idle ones sleep */
+static proc_t *biod[BLOCKDEV_WORKERS];
+static kthread_t *biod_thr[BLOCKDEV_WORKERS];
+static ktqueue_t biod_waitq;
+
+static void *biod_run(int arg1, void *arg2);
+
 void blockdev_init() {
   list_init(&blockdevs);
   /* Initialize all subsystems */
   ata_init();
+  virtio_blk_init();
+  ahci_init();
+  ramdisk_init();
+}
+
+static __attribute__((unused)) void biod_init(void) {
+  int i;
+
+  sched_queue_init(&biod_waitq);
+
+  KASSERT(curproc && (PID_IDLE == curproc->p_pid) &&
+          "should be calling this from idleproc");
+  for (i = 0; i < BLOCKDEV_WORKERS; ++i) {
+    biod[i] = proc_create("biod");
+    KASSERT(NULL != biod[i]);
+    biod_thr[i] = kthread_create(biod[i], biod_run, i, NULL);
+    KASSERT(NULL != biod_thr[i]);
+    sched_make_runnable(biod_thr[i]);
+  }
+}
+init_func(biod_init);
+init_depends(sched_init);
+
+void blockdev_shutdown(void) {
+  blockdev_t *bd;
+  int i, pid, child;
+
+  KASSERT(PID_IDLE == curproc->p_pid);
+  list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+    KASSERT(list_empty(&bd->bd_reqq));
+  }
+  list_iterate_end();
+  for (i = 0; i < BLOCKDEV_WORKERS; ++i)
+    kthread_cancel(biod_thr[i], (void *)0);
+  for (i = 0; i < BLOCKDEV_WORKERS; ++i) {
+    pid = biod[i]->p_pid;
+    child = do_waitpid(pid, 0, NULL);
+    KASSERT(pid == child && "waited on process other than biod");
+    biod_thr[i] = NULL;
+    biod[i] = NULL;
+  }
 }
 
 int blockdev_register(blockdev_t *dev) {
   blockdev_t *bd;
 
   /* Make sure dev, dev ops, and dev id not null */
-  if (!dev || (NULL_DEVID == dev->bd_id) || !(dev->bd_ops))
+  if (!dev || (NULL_DEVID == dev->bd_id) || !(dev->bd_ops) ||
+      dev->bd_depth < 1)
     return -1;
 
   /* dev id must be unique */
@@ -48,8 +121,16 @@ int blockdev_register(blockdev_t *dev) {
 
   /* Initialize its object here */
   mmobj_init(&dev->bd_mmobj, &blockdev_mmobj_ops);
+  dev->bd_holdwrite = NULL;
+  dev->bd_verify = NULL;
+  dev->bd_holdarg = NULL;
+  list_init(&dev->bd_reqq);
+  dev->bd_head = 0;
+  dev->bd_dispatching = 0;
+  memset(&dev->bd_stats, 0, sizeof(blockdev_stats_t));
 
   list_insert_tail(&blockdevs, &dev->bd_link);
+  devfs_add(S_IFBLK, dev->bd_id);
   return 0;
 }
 
@@ -63,6 +144,352 @@ blockdev_t *blockdev_lookup(devid_t id) {
   return NULL;
 }
 
+uint32_t blockdev_op_count() {
+  blockdev_t *bd;
+  uint32_t n = 0;
+
+  list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+    n += bd->bd_stats.bs_ops[0] + bd->bd_stats.bs_ops[1];
+  }
+  list_iterate_end();
+  return n;
+}
+
+size_t blockdev_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  blockdev_stats_t *bs;
+  blockdev_t *bd;
+  uint64_t busy;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size,
+          "%-6s %8s %8s %12s %8s %8s %12s %8s %6s %6s %6s %10s\n", "DISK",
+          "READS", "RMERGED", "BYTES_READ", "WRITES", "WMERGED", "BYTES_WRIT",
+          "FLUSHES", "ERRORS", "QUEUED", "MAXQ", "BUSY_MS");
+  list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+    bs = &bd->bd_stats;
+    busy = bs->bs_busy;
+    if (bs->bs_inflight)
+      busy += time_cycles() - bs->bs_busy_start;
+    iprintf(&buf, &size,
+            "%-6u %8u %8u %12llu %8u %8u %12llu %8u %6u %6u %6u %10llu\n",
+            MINOR(bd->bd_id), bs->bs_ops[0], bs->bs_merged[0],
+            bs->bs_blocks[0] * BLOCK_SIZE, bs->bs_ops[1], bs->bs_merged[1],
+            bs->bs_blocks[1] * BLOCK_SIZE, bs->bs_flushes, bs->bs_errors,
+            bs->bs_queued, bs->bs_max_queued,
+            time_cycles_to_usecs(busy) / 1000);
+  }
+  list_iterate_end();
+  return size;
+}
+
+size_t blockdev_latency_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  blockdev_t *bd;
+  char name[16];
+
+  KASSERT(NULL == arg);
+  hist_iprintf_header(&buf, &size);
+  list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+    snprintf(name, sizeof(name), "disk%u read", MINOR(bd->bd_id));
+    hist_iprintf(&buf, &size, name, &bd->bd_stats.bs_hist[0]);
+    snprintf(name, sizeof(name), "disk%u write", MINOR(bd->bd_id));
+    hist_iprintf(&buf, &size, name, &bd->bd_stats.bs_hist[1]);
+  }
+  list_iterate_end();
+  return size;
+}
+
+/*
+ * Carries out one transfer in the driver, in a single operation if it
+ * can take a list of buffers, and counts it in the device's statistics.
+ */
+static int blockdev_transfer(blockdev_t *dev, const blockdev_iovec_t *iov,
+                             int iovcnt, blocknum_t loc, int write) {
+  blockdev_stats_t *bs = &dev->bd_stats;
+  uint64_t start = time_cycles();
+  size_t nblocks = 0;
+  int i, ret = 0;
+
+  if (0 == bs->bs_inflight++)
+    bs->bs_busy_start = start;
+  if (write && NULL != dev->bd_ops->writev_block) {
+    ret = dev->bd_ops->writev_block(dev, iov, iovcnt, loc);
+  } else if (!write && NULL != dev->bd_ops->readv_block) {
+    ret = dev->bd_ops->readv_block(dev, iov, iovcnt, loc);
+  } else {
+    for (i = 0; i < iovcnt && 0 <= ret; ++i) {
+      if (write)
+        ret = dev->bd_ops->write_block(dev, iov[i].bv_buf, loc + nblocks,
+                                       iov[i].bv_count);
+      else
+        ret = dev->bd_ops->read_block(dev, iov[i].bv_buf, loc + nblocks,
+                                      iov[i].bv_count);
+      nblocks += iov[i].bv_count;
+    }
+  }
+  if (0 == --bs->bs_inflight)
+    bs->bs_busy += time_cycles() - bs->bs_busy_start;
+
+  if (0 > ret) {
+    bs->bs_errors++;
+    return ret;
+  }
+  for (nblocks = 0, i = 0; i < iovcnt; ++i)
+    nblocks += iov[i].bv_count;
+  bs->bs_ops[write]++;
+  bs->bs_blocks[write] += nblocks;
+  hist_add_since(&bs->bs_hist[write], start);
+  return 0;
+}
+
+int blockdev_readv(blockdev_t *dev, const blockdev_iovec_t *iov, int iovcnt,
+                   blocknum_t loc) {
+  return blockdev_transfer(dev, iov, iovcnt, loc, 0);
+}
+
+int blockdev_writev(blockdev_t *dev, const blockdev_iovec_t *iov, int iovcnt,
+                    blocknum_t loc) {
+  return blockdev_transfer(dev, iov, iovcnt, loc, 1);
+}
+
+/*
+ * Picks the next request to service: the first request at or past the
+ * head position (a one-way elevator which wraps back to the lowest
+ * block), unless some request has already been passed over
+ * BLOCKDEV_MAX_PASSES times, in which case it goes first.
+ */
+static blockdev_req_t *blockdev_next_req(blockdev_t *bd) {
+  blockdev_req_t *req, *next = NULL;
+  list_iterate_begin(&bd->bd_reqq, req, blockdev_req_t, br_link) {
+    if (BLOCKDEV_MAX_PASSES <= req->br_passes)
+      return req;
+    if (NULL == next && req->br_loc >= bd->bd_head)
+      next = req;
+  }
+  list_iterate_end();
+  if (NULL == next)
+    next = list_head(&bd->bd_reqq, blockdev_req_t, br_link);
+  return next;
+}
+
+/*
+ * Dispatches the next request together with every queued request in the
+ * same direction which follows it on disk without a gap, as a single
+ * driver operation, then completes them all.
+ */
+static void blockdev_dispatch(blockdev_t *bd) {
+  blockdev_iovec_t iov[BLOCKDEV_MAX_MERGE];
+  blockdev_req_t *batch[BLOCKDEV_MAX_MERGE];
+  blockdev_req_t *first, *req;
+  blockdev_done_t done;
+  list_link_t *link;
+  blocknum_t end;
+  size_t nblocks;
+  blockdev_stats_t *bs = &bd->bd_stats;
+  int n = 0, niov = 0, i, status;
+
+  KASSERT(!list_empty(&bd->bd_reqq));
+  first = blockdev_next_req(bd);
+  end = first->br_loc;
+  nblocks = 0;
+  /* The queue is sorted, so mergeable requests follow first directly */
+  for (link = &first->br_link; link != &bd->bd_reqq; link = link->l_next) {
+    req = list_item(link, blockdev_req_t, br_link);
+    if (req->br_loc < end)
+      continue; /* overlaps the batch, leave it for a later pass */
+    if (req->br_loc > end || BLOCKDEV_MAX_MERGE == n || req->br_write != first->br_write ||
+        (n && (nblocks + req->br_count > BLOCKDEV_MAX_MERGE ||
+               niov + req->br_iovcnt > BLOCKDEV_MAX_MERGE)))
+      break;
+    /* A first request with more buffers than fit goes out on its own */
+    for (i = 0; i < req->br_iovcnt && niov + i < BLOCKDEV_MAX_MERGE; ++i)
+      iov[niov + i] = req->br_iov[i];
+    niov += req->br_iovcnt;
+    batch[n++] = req;
+    end += req->br_count;
+    nblocks += req->br_count;
+  }
+
+  for (i = 0; i < n; ++i)
+    list_remove(&batch[i]->br_link);
+  list_iterate_begin(&bd->bd_reqq, req, blockdev_req_t, br_link) {
+    ++req->br_passes;
+  }
+  list_iterate_end();
+  bd->bd_head = end;
+
+  dbg(DBG_DISK, "dispatching %s of %u blocks at %u (%d requests)\n",
+      first->br_write ? "write" : "read", nblocks, first->br_loc, n);
+  if (1 == n && first->br_write)
+    status = blockdev_writev(bd, first->br_iov, first->br_iovcnt, first->br_loc);
+  else if (1 == n)
+    status = blockdev_readv(bd, first->br_iov, first->br_iovcnt, first->br_loc);
+  else if (first->br_write)
+    status = blockdev_writev(bd, iov, niov, first->br_loc);
+  else
+    status = blockdev_readv(bd, iov, niov, first->br_loc);
+  bs->bs_merged[first->br_write] += n - 1;
+  bs->bs_queued -= n;
+
+  /* A callback may free or resubmit its request, so read it first */
+  for (i = 0; i < n; ++i) {
+    req = batch[i];
+    done = req->br_done_fn;
+    req->br_status = status;
+    req->br_done = 1;
+    if (NULL != done)
+      done(req);
+    else
+      sched_wakeup_on(&req->br_waitq);
+  }
+}
+
+/*
+ * Finds a device with queued requests and room for another dispatcher,
+ * or returns NULL.
+ */
+static blockdev_t *blockdev_find_work(void) {
+  blockdev_t *bd;
+  list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+    if (!list_empty(&bd->bd_reqq) && bd->bd_dispatching < bd->bd_depth)
+      return bd;
+  }
+  list_iterate_end();
+  return NULL;
+}
+
+/*
+ * A block I/O thread dispatches on any device with queued requests and a
+ * free dispatcher slot until its queue is empty. Threads waiting on their
+ * own requests dispatch as well, so these are only needed for requests
+ * nobody waits on and for what is left when such a thread returns.
+ */
+static void *biod_run(int arg1, void *arg2) {
+  blockdev_t *bd;
+
+  while (1) {
+    while (NULL == (bd = blockdev_find_work())) {
+      if (sched_cancellable_sleep_on(&biod_waitq))
+        kthread_exit((void *)0);
+    }
+    bd->bd_dispatching++;
+    while (!list_empty(&bd->bd_reqq))
+      blockdev_dispatch(bd);
+    bd->bd_dispatching--;
+  }
+  return NULL;
+}
+
+void blockdev_req_init(blockdev_req_t *req, int write,
+                       const blockdev_iovec_t *iov, int iovcnt,
+                       blocknum_t loc, blockdev_done_t done, void *arg) {
+  int i;
+
+  KASSERT(0 < iovcnt);
+  req->br_write = !!write;
+  req->br_loc = loc;
+  req->br_iov = iov;
+  req->br_iovcnt = iovcnt;
+  req->br_done_fn = done;
+  req->br_arg = arg;
+  req->br_bdev = NULL;
+  req->br_count = 0;
+  for (i = 0; i < iovcnt; ++i)
+    req->br_count += iov[i].bv_count;
+  req->br_passes = 0;
+  req->br_done = 0;
+  req->br_status = 0;
+  sched_queue_init(&req->br_waitq);
+}
+
+/* Puts a request on the device's queue, which is kept sorted by block */
+static void blockdev_req_queue(blockdev_t *bd, blockdev_req_t *req) {
+  blockdev_req_t *r;
+
+  req->br_bdev = bd;
+  if (++bd->bd_stats.bs_queued > bd->bd_stats.bs_max_queued)
+    bd->bd_stats.bs_max_queued = bd->bd_stats.bs_queued;
+  req->br_passes = 0;
+  req->br_done = 0;
+  list_iterate_begin(&bd->bd_reqq, r, blockdev_req_t, br_link) {
+    if (r->br_loc > req->br_loc) {
+      list_insert_before(&r->br_link, &req->br_link);
+      return;
+    }
+  }
+  list_iterate_end();
+  list_insert_tail(&bd->bd_reqq, &req->br_link);
+}
+
+void blockdev_submit_async(blockdev_t *bd, blockdev_req_t *req) {
+  blockdev_req_queue(bd, req);
+  if (bd->bd_dispatching < bd->bd_depth)
+    sched_wakeup_on(&biod_waitq);
+}
+
+/*
+ * Waits for a queued request to complete.
+ *
+ * If fewer than bd_depth threads are dispatching, the waiting thread
+ * does so itself until its own request is finished or in progress
+ * elsewhere, and then leaves whatever is still queued to a block I/O
+ * thread. Requests queued while the dispatchers are waiting on the disk
+ * are sorted and merged into the following operations.
+ */
+int blockdev_req_wait(blockdev_req_t *req) {
+  blockdev_t *bd = req->br_bdev;
+
+  KASSERT(NULL != bd && NULL == req->br_done_fn);
+  while (!req->br_done) {
+    /* With the queue empty, another dispatcher has the request */
+    if (bd->bd_dispatching >= bd->bd_depth || list_empty(&bd->bd_reqq)) {
+      sched_sleep_on(&req->br_waitq);
+      continue;
+    }
+    bd->bd_dispatching++;
+    while (!req->br_done && !list_empty(&bd->bd_reqq))
+      blockdev_dispatch(bd);
+    bd->bd_dispatching--;
+    if (!list_empty(&bd->bd_reqq))
+      sched_wakeup_on(&biod_waitq);
+  }
+  return req->br_status;
+}
+
+/* Queues a transfer on the device and waits for it to complete */
+static int blockdev_submit(blockdev_t *bd, const blockdev_iovec_t *iov,
+                           int iovcnt, blocknum_t loc, int write) {
+  blockdev_req_t req;
+
+  blockdev_req_init(&req, write, iov, iovcnt, loc, NULL, NULL);
+  blockdev_req_queue(bd, &req);
+  return blockdev_req_wait(&req);
+}
+
+int blockdev_read(blockdev_t *dev, char *buf, blocknum_t loc, size_t count) {
+  blockdev_iovec_t iov = {.bv_buf = buf, .bv_count = count};
+  return blockdev_submit(dev, &iov, 1, loc, 0);
+}
+
+int blockdev_write(blockdev_t *dev, const char *buf, blocknum_t loc,
+                   size_t count) {
+  blockdev_iovec_t iov = {.bv_buf = (char *)buf, .bv_count = count};
+  return blockdev_submit(dev, &iov, 1, loc, 1);
+}
+
+int blockdev_flush_cache(blockdev_t *dev) {
+  int ret;
+
+  if (NULL == dev->bd_ops->flush_cache)
+    return 0;
+  if (0 > (ret = dev->bd_ops->flush_cache(dev)))
+    dev->bd_stats.bs_errors++;
+  else
+    dev->bd_stats.bs_flushes++;
+  return ret;
+}
+
 /*
  * Clean and then free all resident pages belonging to this
  * particular block device.
@@ -108,7 +535,10 @@ static int blockdev_fillpage(mmobj_t *o, pframe_t *pf) {
   /* Find the corresponding blockdev */
   blockdev_t *bd = CONTAINER_OF(pf->pf_obj, blockdev_t, bd_mmobj);
   /* And fill in the page by reading from it */
-  return bd->bd_ops->read_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
+  int ret = blockdev_read(bd, pf->pf_addr, pf->pf_pagenum, 1);
+  if (!ret && bd->bd_verify)
+    bd->bd_verify(bd, pf->pf_pagenum, pf->pf_addr);
+  return ret;
 }
 
 /* block devices don't need to make use of this entry point: */
@@ -122,6 +552,24 @@ static int blockdev_cleanpage(mmobj_t *o, pframe_t *pf) {
   KASSERT(pf && pf->pf_obj);
   /* Find the corresponding blockdev */
   blockdev_t *bd = CONTAINER_OF(pf->pf_obj, blockdev_t, bd_mmobj);
+  if (bd->bd_holdwrite && bd->bd_holdwrite(bd))
+    return -EBUSY;
   /* Clean the corresponding page by writing it back */
-  return bd->bd_ops->write_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
+  return blockdev_write(bd, pf->pf_addr, pf->pf_pagenum, 1);
+}
+
+static int blockdev_cleanpages(mmobj_t *o, pframe_t **pfs, int npages) {
+  blockdev_iovec_t iov[PF_WRITEBACK_MAX];
+  int i;
+  dbg(DBG_DISK, "%d pages from %d\n", npages, pfs[0]->pf_pagenum);
+  KASSERT(0 < npages && PF_WRITEBACK_MAX >= npages);
+  blockdev_t *bd = CONTAINER_OF(o, blockdev_t, bd_mmobj);
+  if (bd->bd_holdwrite && bd->bd_holdwrite(bd))
+    return -EBUSY;
+  for (i = 0; i < npages; ++i) {
+    KASSERT(pfs[i]->pf_obj == o && pfs[i]->pf_pagenum == pfs[0]->pf_pagenum + i);
+    iov[i].bv_buf = pfs[i]->pf_addr;
+    iov[i].bv_count = 1;
+  }
+  return blockdev_submit(bd, iov, npages, pfs[0]->pf_pagenum, 1);
 }
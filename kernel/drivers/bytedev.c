@@ -5,6 +5,8 @@
 #include "util/list.h"
 #include "drivers/tty/tty.h"
 #include "drivers/memdevs.h"
+#include "fs/stat.h"
+#include "fs/devfs/devfs.h"
 
 static list_t bytedevs;
 
@@ -34,6 +36,7 @@ int bytedev_register(bytedev_t *dev) {
   /* initialize portions of structure ignored by device drivers: */
 
   list_insert_tail(&bytedevs, &dev->cd_link);
+  devfs_add(S_IFCHR, dev->cd_id);
   return 0;
 }
 
@@ -0,0 +1,639 @@
+/*
+ * A driver for AHCI SATA controllers. Each port with a disk on it has a
+ * command list of up to 32 slots; a transfer takes a slot for each
+ * command it is split into, writes the command's FIS and scatter/gather
+ * table, and sets the slot's bit in the port's command issue register.
+ * If both the controller and the disk do native command queuing, the
+ * commands are READ/WRITE FPDMA QUEUED, tagged with their slot, and the
+ * disk may have as many outstanding as it has tags, finishing them in
+ * whatever order suits it; the block layer is told that as bd_depth.
+ * Otherwise the port does one command at a time, as ATA does.
+ *
+ * Completion is by interrupt: a finished command's bit clears from the
+ * port's SActive (queued) or command issue register.
+ */
+
+#include "types.h"
+#include "errno.h"
+
+#include "main/interrupt.h"
+
+#include "util/debug.h"
+#include "util/delay.h"
+#include "util/string.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/pci.h"
+#include "drivers/disk/ahci.h"
+
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+
+/* Mass storage, SATA, AHCI 1.0 */
+#define AHCI_PCI_CLASS 0x01
+#define AHCI_PCI_SUBCLASS 0x06
+#define AHCI_PCI_INTERFACE 0x01
+#define AHCI_ABAR 5
+
+/* Controller registers */
+#define AHCI_CAP 0x00
+#define AHCI_GHC 0x04
+#define AHCI_IS 0x08
+#define AHCI_PI 0x0c
+
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1f) + 1) /* command slots */
+#define AHCI_CAP_SSS BIT(27)                          /* staggered spin-up */
+#define AHCI_CAP_SNCQ BIT(30)
+
+#define AHCI_GHC_IE BIT(1)
+#define AHCI_GHC_AE BIT(31)
+
+/* Port registers, as offsets from the port's */
+#define AHCI_PORT_BASE 0x100
+#define AHCI_PORT_SIZE 0x80
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+
+#define AHCI_PxCLB 0x00
+#define AHCI_PxCLBU 0x04
+#define AHCI_PxFB 0x08
+#define AHCI_PxFBU 0x0c
+#define AHCI_PxIS 0x10
+#define AHCI_PxIE 0x14
+#define AHCI_PxCMD 0x18
+#define AHCI_PxTFD 0x20
+#define AHCI_PxSIG 0x24
+#define AHCI_PxSSTS 0x28
+#define AHCI_PxSERR 0x30
+#define AHCI_PxSACT 0x34
+#define AHCI_PxCI 0x38
+
+#define AHCI_PxCMD_ST BIT(0)
+#define AHCI_PxCMD_SUD BIT(1)
+#define AHCI_PxCMD_POD BIT(2)
+#define AHCI_PxCMD_FRE BIT(4)
+#define AHCI_PxCMD_FR BIT(14)
+#define AHCI_PxCMD_CR BIT(15)
+
+#define AHCI_PxIS_DHRS BIT(0) /* a register FIS: non-queued completion */
+#define AHCI_PxIS_SDBS BIT(3) /* a set device bits FIS: queued completion */
+#define AHCI_PxIS_ERR 0x7dc00050 /* anything which stops the port */
+
+#define AHCI_PxSSTS_DET(ssts) ((ssts)&0xf)
+#define AHCI_DET_PRESENT 3 /* a device, talking to us */
+#define AHCI_SIG_ATA 0x00000101
+
+#define ATA_SR_BSY 0x80
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_ERR 0x01
+
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_IDENTIFY 0xec
+
+/* Words of IDENTIFY DEVICE */
+#define ATA_IDENT_WORDS 256
+#define ATA_IDENT_SECTORS 60        /* 28-bit capacity, 2 words */
+#define ATA_IDENT_QUEUE_DEPTH 75
+#define ATA_IDENT_SATA_CAP 76
+#define ATA_IDENT_FEATURES 83
+#define ATA_IDENT_SECTORS_EXT 100   /* 48-bit capacity, 4 words */
+#define ATA_IDENT_SATA_NCQ BIT(8)   /* of SATA_CAP */
+#define ATA_IDENT_LBA48 BIT(10)     /* of FEATURES */
+
+#define AHCI_SECTOR_SIZE 512
+#define AHCI_SECTORS_PER_BLOCK (BLOCK_SIZE / AHCI_SECTOR_SIZE)
+
+/* Scatter/gather entries in a command, which makes a command table 512
+ * bytes, eight to a page */
+#define AHCI_PRDS 24
+/* A command moves no more than this, which fits the sector count of
+ * either kind of command */
+#define AHCI_MAX_SECTORS 0x8000
+#define AHCI_PRD_MAX (4 << 20) /* bytes one entry can describe */
+
+/* Milliseconds to wait for the port to do as it is told */
+#define AHCI_TIMEOUT_MS 500
+
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_H2D_CMD 0x80 /* a command, not a device control update */
+#define FIS_DEV_LBA 0x40
+
+typedef struct fis_reg_h2d {
+  uint8_t fi_type;
+  uint8_t fi_flags;
+  uint8_t fi_command;
+  uint8_t fi_featurel;
+  uint8_t fi_lba0, fi_lba1, fi_lba2;
+  uint8_t fi_device;
+  uint8_t fi_lba3, fi_lba4, fi_lba5;
+  uint8_t fi_featureh;
+  uint8_t fi_countl, fi_counth;
+  uint8_t fi_icc;
+  uint8_t fi_control;
+  uint8_t fi_reserved[4];
+} __attribute__((packed)) fis_reg_h2d_t;
+
+#define AHCI_CH_CFL(fis) (sizeof(fis) / sizeof(uint32_t))
+#define AHCI_CH_WRITE BIT(6)
+
+typedef struct ahci_cmd_hdr {
+  uint16_t ch_flags;
+  uint16_t ch_prdtl; /* entries in the table */
+  uint32_t ch_prdbc; /* bytes moved, written by the controller */
+  uint32_t ch_ctba;
+  uint32_t ch_ctbau;
+  uint32_t ch_reserved[4];
+} __attribute__((packed)) ahci_cmd_hdr_t;
+
+typedef struct ahci_prd {
+  uint32_t pr_dba;
+  uint32_t pr_dbau;
+  uint32_t pr_reserved;
+  uint32_t pr_dbc; /* bytes, less one */
+} __attribute__((packed)) ahci_prd_t;
+
+typedef struct ahci_cmd_table {
+  uint8_t ct_cfis[64];
+  uint8_t ct_acmd[16];
+  uint8_t ct_reserved[48];
+  ahci_prd_t ct_prdt[AHCI_PRDS];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+#define AHCI_TABLES_PER_PAGE (PAGE_SIZE / sizeof(ahci_cmd_table_t))
+
+/* The command list (1K-aligned) and received FIS area (256-aligned) share
+ * a page */
+#define AHCI_CL_OFFSET 0
+#define AHCI_FB_OFFSET 1024
+
+/* One caller's transfer, on its stack, and the commands still out on it */
+typedef struct ahci_xfer {
+  ktqueue_t ax_waitq;
+  int ax_pending;
+  int ax_status;
+} ahci_xfer_t;
+
+typedef struct ahci_port {
+  volatile uint8_t *ap_regs;
+  int ap_num;
+  int ap_ncq;
+  int ap_nslots;
+
+  void *ap_page; /* command list and received FISes */
+  ahci_cmd_hdr_t *ap_cmds;
+  ahci_cmd_table_t *ap_tables[AHCI_MAX_SLOTS];
+
+  uint32_t ap_free;   /* slots no command is using */
+  uint32_t ap_active; /* slots issued and not seen complete */
+  ahci_xfer_t *ap_xfers[AHCI_MAX_SLOTS];
+  ktqueue_t ap_slotq; /* transfers waiting for a free slot */
+
+  blockdev_t ap_bdev;
+} ahci_port_t;
+
+#define bd_to_port(bd) CONTAINER_OF(bd, ahci_port_t, ap_bdev)
+
+#define ahci_read(base, reg) (*(volatile uint32_t *)((base) + (reg)))
+#define ahci_write(base, reg, val)                                             \
+  (*(volatile uint32_t *)((base) + (reg)) = (val))
+
+/* A piece of a command: physical memory */
+typedef struct ahci_seg {
+  uint32_t as_addr;
+  uint32_t as_len;
+} ahci_seg_t;
+
+static int ahci_read_block(blockdev_t *bdev, char *data, blocknum_t blocknum,
+                           size_t count);
+static int ahci_write_block(blockdev_t *bdev, const char *data,
+                            blocknum_t blocknum, size_t count);
+static int ahci_readv(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                      int iovcnt, blocknum_t loc);
+static int ahci_writev(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                       int iovcnt, blocknum_t loc);
+
+static blockdev_ops_t ahci_disk_ops = {.read_block = ahci_read_block,
+                                       .write_block = ahci_write_block,
+                                       .readv_block = ahci_readv,
+                                       .writev_block = ahci_writev};
+
+static volatile uint8_t *ahci_abar;
+static ahci_port_t *ahci_ports[AHCI_MAX_PORTS];
+
+/* Waits for the register's bits in mask to be value; returns 0, or
+ * -ETIME if it took too long */
+static int ahci_wait(volatile uint8_t *base, uint32_t reg, uint32_t mask,
+                     uint32_t value) {
+  int ms;
+
+  for (ms = 0; ms < AHCI_TIMEOUT_MS; ms++) {
+    if ((ahci_read(base, reg) & mask) == value)
+      return 0;
+    udelay(1000);
+  }
+  return -ETIME;
+}
+
+static int ahci_port_stop(ahci_port_t *ap) {
+  ahci_write(ap->ap_regs, AHCI_PxCMD,
+             ahci_read(ap->ap_regs, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+  if (ahci_wait(ap->ap_regs, AHCI_PxCMD, AHCI_PxCMD_CR, 0))
+    return -ETIME;
+  ahci_write(ap->ap_regs, AHCI_PxCMD,
+             ahci_read(ap->ap_regs, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+  return ahci_wait(ap->ap_regs, AHCI_PxCMD, AHCI_PxCMD_FR, 0);
+}
+
+/* Clears what the port last complained of, and starts it processing
+ * its command list */
+static int ahci_port_start(ahci_port_t *ap) {
+  ahci_write(ap->ap_regs, AHCI_PxSERR, 0xffffffff);
+  ahci_write(ap->ap_regs, AHCI_PxIS, 0xffffffff);
+  ahci_write(ap->ap_regs, AHCI_PxCMD,
+             ahci_read(ap->ap_regs, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+  if (ahci_wait(ap->ap_regs, AHCI_PxTFD, ATA_SR_BSY | ATA_SR_DRQ, 0))
+    return -ETIME;
+  ahci_write(ap->ap_regs, AHCI_PxCMD,
+             ahci_read(ap->ap_regs, AHCI_PxCMD) | AHCI_PxCMD_ST);
+  return 0;
+}
+
+/* Fills in slot's command: its FIS and scatter/gather table */
+static void ahci_build(ahci_port_t *ap, int slot, uint8_t command,
+                       uint32_t lba, uint32_t nsectors, const ahci_seg_t *segs,
+                       int nsegs, int write) {
+  ahci_cmd_hdr_t *ch = &ap->ap_cmds[slot];
+  ahci_cmd_table_t *ct = ap->ap_tables[slot];
+  fis_reg_h2d_t *fis = (fis_reg_h2d_t *)ct->ct_cfis;
+  int i;
+
+  memset(fis, 0, sizeof(*fis));
+  fis->fi_type = FIS_TYPE_REG_H2D;
+  fis->fi_flags = FIS_H2D_CMD;
+  fis->fi_command = command;
+  fis->fi_device = FIS_DEV_LBA;
+  fis->fi_lba0 = lba & 0xff;
+  fis->fi_lba1 = (lba >> 8) & 0xff;
+  fis->fi_lba2 = (lba >> 16) & 0xff;
+  fis->fi_lba3 = (lba >> 24) & 0xff;
+  if (ATA_CMD_READ_FPDMA_QUEUED == command ||
+      ATA_CMD_WRITE_FPDMA_QUEUED == command) {
+    /* Queued commands take the count in the features, and the tag in
+     * the count */
+    fis->fi_featurel = nsectors & 0xff;
+    fis->fi_featureh = (nsectors >> 8) & 0xff;
+    fis->fi_countl = slot << 3;
+  } else {
+    fis->fi_countl = nsectors & 0xff;
+    fis->fi_counth = (nsectors >> 8) & 0xff;
+  }
+
+  for (i = 0; i < nsegs; i++) {
+    ct->ct_prdt[i].pr_dba = segs[i].as_addr;
+    ct->ct_prdt[i].pr_dbau = 0;
+    ct->ct_prdt[i].pr_reserved = 0;
+    ct->ct_prdt[i].pr_dbc = segs[i].as_len - 1;
+  }
+  ch->ch_flags = AHCI_CH_CFL(fis_reg_h2d_t) | (write ? AHCI_CH_WRITE : 0);
+  ch->ch_prdtl = nsegs;
+  ch->ch_prdbc = 0;
+}
+
+/* Marks the commands in slots finished, with status if it is an error */
+static void ahci_complete(ahci_port_t *ap, uint32_t slots, int status) {
+  int slot;
+
+  if (!slots)
+    return;
+  while (slots) {
+    slot = __builtin_ctz(slots);
+    slots &= ~BIT(slot);
+
+    ahci_xfer_t *ax = ap->ap_xfers[slot];
+    if (status)
+      ax->ax_status = status;
+    if (0 == --ax->ax_pending)
+      sched_wakeup_on(&ax->ax_waitq);
+    ap->ap_active &= ~BIT(slot);
+    ap->ap_free |= BIT(slot);
+  }
+  sched_broadcast_on(&ap->ap_slotq);
+}
+
+/*
+ * An error stops the port, taking every command on it with it, so all of
+ * them fail and the port is restarted for whatever comes next.
+ */
+static void ahci_port_intr(ahci_port_t *ap) {
+  uint32_t is = ahci_read(ap->ap_regs, AHCI_PxIS);
+
+  ahci_write(ap->ap_regs, AHCI_PxIS, is);
+  if (is & AHCI_PxIS_ERR) {
+    dbg(DBG_DISK, "AHCI port %d error: is 0x%x, tfd 0x%x, serr 0x%x\n",
+        ap->ap_num, is, ahci_read(ap->ap_regs, AHCI_PxTFD),
+        ahci_read(ap->ap_regs, AHCI_PxSERR));
+    ahci_complete(ap, ap->ap_active, -EIO);
+    if (ahci_port_stop(ap) || ahci_port_start(ap))
+      dbg(DBG_DISK, "AHCI port %d did not restart\n", ap->ap_num);
+    return;
+  }
+  ahci_complete(ap, ap->ap_active & ~(ahci_read(ap->ap_regs, AHCI_PxSACT) |
+                                      ahci_read(ap->ap_regs, AHCI_PxCI)),
+                0);
+}
+
+/* The line is level-triggered but arrives here as an edge, so it is only
+ * let go once no port has anything more to say */
+static void ahci_intr(regs_t *regs) {
+  uint32_t is, ports;
+  int i;
+
+  while (0 != (is = ahci_read(ahci_abar, AHCI_IS))) {
+    for (ports = is; ports; ports &= ~BIT(i)) {
+      i = __builtin_ctz(ports);
+      if (NULL != ahci_ports[i])
+        ahci_port_intr(ahci_ports[i]);
+      else
+        ahci_write(ahci_abar + AHCI_PORT_BASE + i * AHCI_PORT_SIZE, AHCI_PxIS,
+                   0xffffffff);
+    }
+    ahci_write(ahci_abar, AHCI_IS, is);
+  }
+}
+
+/* Takes a free slot, sleeping for one if there are none; with the port's
+ * interrupt blocked */
+static int ahci_slot_get(ahci_port_t *ap) {
+  int slot;
+
+  while (0 == ap->ap_free)
+    sched_sleep_on(&ap->ap_slotq);
+  slot = __builtin_ctz(ap->ap_free);
+  ap->ap_free &= ~BIT(slot);
+  return slot;
+}
+
+static void ahci_issue(ahci_port_t *ap, ahci_xfer_t *ax, uint32_t lba,
+                       uint32_t nsectors, const ahci_seg_t *segs, int nsegs,
+                       int write) {
+  uint8_t command;
+  int slot = ahci_slot_get(ap);
+
+  if (ap->ap_ncq)
+    command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+  else
+    command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+  ahci_build(ap, slot, command, lba, nsectors, segs, nsegs, write);
+  ap->ap_xfers[slot] = ax;
+  ap->ap_active |= BIT(slot);
+  ax->ax_pending++;
+
+  __asm__ volatile("" ::: "memory");
+  if (ap->ap_ncq)
+    ahci_write(ap->ap_regs, AHCI_PxSACT, BIT(slot));
+  ahci_write(ap->ap_regs, AHCI_PxCI, BIT(slot));
+}
+
+static int ahci_transfer(ahci_port_t *ap, const blockdev_iovec_t *iov,
+                         int iovcnt, blocknum_t loc, int write) {
+  ahci_seg_t segs[AHCI_PRDS];
+  ahci_xfer_t ax;
+  uint32_t lba = loc * AHCI_SECTORS_PER_BLOCK;
+  uint32_t nsectors = 0; /* in segs */
+  int nsegs = 0, i;
+
+  sched_queue_init(&ax.ax_waitq);
+  ax.ax_pending = 0;
+  ax.ax_status = 0;
+
+  uint8_t oldipl = intr_getipl();
+  intr_setipl(INTR_AHCI);
+  for (i = 0; i < iovcnt; i++) {
+    uintptr_t vaddr = (uintptr_t)iov[i].bv_buf;
+    size_t left = iov[i].bv_count;
+
+    KASSERT(PAGE_ALIGNED(vaddr));
+    /* One page at a time, since a buffer need not be physically
+     * contiguous */
+    for (; left; left--, vaddr += PAGE_SIZE) {
+      uint32_t paddr = pt_virt_to_phys(vaddr);
+
+      if (nsectors + AHCI_SECTORS_PER_BLOCK > AHCI_MAX_SECTORS) {
+        ahci_issue(ap, &ax, lba, nsectors, segs, nsegs, write);
+        lba += nsectors;
+        nsectors = nsegs = 0;
+      }
+      if (nsegs && segs[nsegs - 1].as_addr + segs[nsegs - 1].as_len == paddr &&
+          segs[nsegs - 1].as_len + PAGE_SIZE <= AHCI_PRD_MAX) {
+        segs[nsegs - 1].as_len += PAGE_SIZE;
+      } else {
+        if (AHCI_PRDS == nsegs) {
+          ahci_issue(ap, &ax, lba, nsectors, segs, nsegs, write);
+          lba += nsectors;
+          nsectors = nsegs = 0;
+        }
+        segs[nsegs].as_addr = paddr;
+        segs[nsegs++].as_len = PAGE_SIZE;
+      }
+      nsectors += AHCI_SECTORS_PER_BLOCK;
+    }
+  }
+  if (nsegs)
+    ahci_issue(ap, &ax, lba, nsectors, segs, nsegs, write);
+  while (ax.ax_pending)
+    sched_sleep_on(&ax.ax_waitq);
+  intr_setipl(oldipl);
+
+  if (ax.ax_status)
+    dbg(DBG_DISK, "AHCI port %d %s error at block %u\n", ap->ap_num,
+        write ? "write" : "read", loc);
+  return ax.ax_status;
+}
+
+static int ahci_read_block(blockdev_t *bdev, char *data, blocknum_t blocknum,
+                           size_t count) {
+  blockdev_iovec_t iov = {.bv_buf = data, .bv_count = count};
+  return ahci_transfer(bd_to_port(bdev), &iov, 1, blocknum, 0);
+}
+
+static int ahci_write_block(blockdev_t *bdev, const char *data,
+                            blocknum_t blocknum, size_t count) {
+  blockdev_iovec_t iov = {.bv_buf = (char *)data, .bv_count = count};
+  return ahci_transfer(bd_to_port(bdev), &iov, 1, blocknum, 1);
+}
+
+static int ahci_readv(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                      int iovcnt, blocknum_t loc) {
+  return ahci_transfer(bd_to_port(bdev), iov, iovcnt, loc, 0);
+}
+
+static int ahci_writev(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                       int iovcnt, blocknum_t loc) {
+  return ahci_transfer(bd_to_port(bdev), iov, iovcnt, loc, 1);
+}
+
+/* IDENTIFY DEVICE, polled in slot 0, before the port interrupts */
+static int ahci_identify(ahci_port_t *ap, uint16_t *ident) {
+  ahci_seg_t seg = {pt_virt_to_phys((uintptr_t)ident),
+                    ATA_IDENT_WORDS * sizeof(uint16_t)};
+
+  ahci_build(ap, 0, ATA_CMD_IDENTIFY, 0, 0, &seg, 1, 0);
+  ((fis_reg_h2d_t *)ap->ap_tables[0]->ct_cfis)->fi_device = 0;
+  ahci_write(ap->ap_regs, AHCI_PxCI, BIT(0));
+  if (ahci_wait(ap->ap_regs, AHCI_PxCI, BIT(0), 0))
+    return -ETIME;
+  if (ahci_read(ap->ap_regs, AHCI_PxTFD) & ATA_SR_ERR)
+    return -EIO;
+  return 0;
+}
+
+/* Sets up the port's memory and starts it; returns 0, or -errno */
+static int ahci_port_setup(ahci_port_t *ap, uint32_t cap) {
+  uintptr_t paddr;
+  char *tables = NULL;
+  int i, err;
+
+  if (0 > (err = ahci_port_stop(ap)))
+    return err;
+
+  if (NULL == (ap->ap_page = page_alloc()))
+    return -ENOMEM;
+  memset(ap->ap_page, 0, PAGE_SIZE);
+  ap->ap_cmds = (ahci_cmd_hdr_t *)((char *)ap->ap_page + AHCI_CL_OFFSET);
+  ap->ap_nslots = AHCI_CAP_NCS(cap);
+  for (i = 0; i < ap->ap_nslots; i++) {
+    if (0 == i % AHCI_TABLES_PER_PAGE) {
+      if (NULL == (tables = page_alloc()))
+        return -ENOMEM;
+      memset(tables, 0, PAGE_SIZE);
+    }
+    ap->ap_tables[i] = (ahci_cmd_table_t *)tables + i % AHCI_TABLES_PER_PAGE;
+    ap->ap_cmds[i].ch_ctba = pt_virt_to_phys((uintptr_t)ap->ap_tables[i]);
+    ap->ap_cmds[i].ch_ctbau = 0;
+  }
+
+  paddr = pt_virt_to_phys((uintptr_t)ap->ap_page);
+  ahci_write(ap->ap_regs, AHCI_PxCLB, paddr + AHCI_CL_OFFSET);
+  ahci_write(ap->ap_regs, AHCI_PxCLBU, 0);
+  ahci_write(ap->ap_regs, AHCI_PxFB, paddr + AHCI_FB_OFFSET);
+  ahci_write(ap->ap_regs, AHCI_PxFBU, 0);
+  if (cap & AHCI_CAP_SSS)
+    ahci_write(ap->ap_regs, AHCI_PxCMD, ahci_read(ap->ap_regs, AHCI_PxCMD) |
+                                            AHCI_PxCMD_SUD | AHCI_PxCMD_POD);
+  return ahci_port_start(ap);
+}
+
+/* Returns the disk's size in blocks, and decides how it is driven */
+static int ahci_port_probe(ahci_port_t *ap, uint32_t cap, blocknum_t *nblocks) {
+  uint16_t *ident;
+  uint64_t sectors;
+  int err;
+
+  if (NULL == (ident = page_alloc()))
+    return -ENOMEM;
+  if (0 > (err = ahci_identify(ap, ident)))
+    goto out;
+
+  if (ident[ATA_IDENT_FEATURES] & ATA_IDENT_LBA48)
+    sectors = ident[ATA_IDENT_SECTORS_EXT] |
+              ((uint64_t)ident[ATA_IDENT_SECTORS_EXT + 1] << 16) |
+              ((uint64_t)ident[ATA_IDENT_SECTORS_EXT + 2] << 32);
+  else
+    sectors = ident[ATA_IDENT_SECTORS] |
+              ((uint32_t)ident[ATA_IDENT_SECTORS + 1] << 16);
+  *nblocks = sectors / AHCI_SECTORS_PER_BLOCK;
+
+  ap->ap_ncq = (cap & AHCI_CAP_SNCQ) &&
+               (ident[ATA_IDENT_SATA_CAP] & ATA_IDENT_SATA_NCQ);
+  if (ap->ap_ncq)
+    ap->ap_nslots = MIN(ap->ap_nslots,
+                        (ident[ATA_IDENT_QUEUE_DEPTH] & 0x1f) + 1);
+  else
+    ap->ap_nslots = 1;
+out:
+  page_free(ident);
+  return err;
+}
+
+void ahci_init() {
+  pcidev_t *pd;
+  uint32_t cap, pi;
+  int i, minor = 0, err;
+
+  if (NULL == (pd = pci_lookup(AHCI_PCI_CLASS, AHCI_PCI_SUBCLASS,
+                               AHCI_PCI_INTERFACE)))
+    return;
+  if (PCI_MMIO != pd->pci_bar[AHCI_ABAR].mem_type ||
+      !pd->pci_bar[AHCI_ABAR].base_addr) {
+    dbg(DBG_DISK, "AHCI controller without its registers, skipped\n");
+    return;
+  }
+  pci_write_config(pd, PCI_COMMAND,
+                   pci_read_config(pd, PCI_COMMAND, 2) | PCI_CMD_MMIO |
+                       PCI_CMD_BUSMASTER,
+                   2);
+  ahci_abar = (volatile uint8_t *)pt_phys_perm_map(
+      (uintptr_t)PAGE_ALIGN_DOWN(pd->pci_bar[AHCI_ABAR].base_addr),
+      (AHCI_PORT_BASE + AHCI_MAX_PORTS * AHCI_PORT_SIZE + PAGE_SIZE - 1) /
+          PAGE_SIZE);
+  ahci_abar += pd->pci_bar[AHCI_ABAR].base_addr & (PAGE_SIZE - 1);
+
+  ahci_write(ahci_abar, AHCI_GHC, ahci_read(ahci_abar, AHCI_GHC) | AHCI_GHC_AE);
+  cap = ahci_read(ahci_abar, AHCI_CAP);
+  pi = ahci_read(ahci_abar, AHCI_PI);
+
+  for (i = 0; i < AHCI_MAX_PORTS; i++) {
+    volatile uint8_t *regs = ahci_abar + AHCI_PORT_BASE + i * AHCI_PORT_SIZE;
+    ahci_port_t *ap;
+    blocknum_t nblocks;
+
+    if (!(pi & BIT(i)) ||
+        AHCI_DET_PRESENT != AHCI_PxSSTS_DET(ahci_read(regs, AHCI_PxSSTS)) ||
+        AHCI_SIG_ATA != ahci_read(regs, AHCI_PxSIG))
+      continue;
+
+    if (NULL == (ap = kmalloc(sizeof(ahci_port_t))))
+      panic("Not enough memory for ahci port struct!\n");
+    memset(ap, 0, sizeof(*ap));
+    ap->ap_regs = regs;
+    ap->ap_num = i;
+    sched_queue_init(&ap->ap_slotq);
+    if (0 > (err = ahci_port_setup(ap, cap)) ||
+        0 > (err = ahci_port_probe(ap, cap, &nblocks))) {
+      /* What was allocated is kept, being too little to matter */
+      dbg(DBG_DISK, "AHCI port %d setup failed: %d\n", i, err);
+      ahci_port_stop(ap);
+      continue;
+    }
+    ap->ap_free = (uint32_t)((1ULL << ap->ap_nslots) - 1);
+
+    /* After whatever disks ATA and virtio found */
+    while (NULL != blockdev_lookup(MKDEVID(DISK_MAJOR, minor)))
+      minor++;
+    ap->ap_bdev.bd_id = MKDEVID(DISK_MAJOR, minor);
+    ap->ap_bdev.bd_nblocks = nblocks;
+    ap->ap_bdev.bd_ops = &ahci_disk_ops;
+    ap->ap_bdev.bd_depth = ap->ap_nslots;
+    ahci_ports[i] = ap;
+
+    ahci_write(regs, AHCI_PxIS, 0xffffffff);
+    ahci_write(regs, AHCI_PxIE, AHCI_PxIS_DHRS | AHCI_PxIS_SDBS |
+                                    AHCI_PxIS_ERR);
+    blockdev_register(&ap->ap_bdev);
+    dbg(DBG_DISK, "Initialized AHCI disk %d on port %d, %s, %d slots, "
+                  "%u blocks\n",
+        minor, i, ap->ap_ncq ? "NCQ" : "no NCQ", ap->ap_nslots, nblocks);
+  }
+
+  intr_map(pd->pci_irq, INTR_AHCI);
+  intr_register(INTR_AHCI, ahci_intr);
+  ahci_write(ahci_abar, AHCI_IS, 0xffffffff);
+  ahci_write(ahci_abar, AHCI_GHC, ahci_read(ahci_abar, AHCI_GHC) | AHCI_GHC_IE);
+}
@@ -1,12 +1,15 @@
 #include "types.h"
+#include "errno.h"
 
 #include "main/interrupt.h"
 #include "main/io.h"
+#include "main/tasklet.h"
 
 #include "util/string.h"
 #include "util/debug.h"
 #include "util/list.h"
 #include "util/delay.h"
+#include "util/trace.h"
 
 #include "drivers/blockdev.h"
 #include "drivers/dev.h"
@@ -83,6 +86,11 @@ static struct ata_channel {
 
 #define ATA_SECTOR_SIZE 512 /* Pretty much always true */
 
+/* Most sectors a single (non-LBA48) command can transfer; written to
+ * ATA_REG_SECCOUNT0 as 0 */
+#define ATA_MAX_SECTORS 256
+#define ATA_MAX_BLOCKS (ATA_MAX_SECTORS * ATA_SECTOR_SIZE / BLOCK_SIZE)
+
 /* Drive/head values (for ATA_REG_DRIVEHEAD) */
 #define ATA_DRIVEHEAD_MASTER 0xA0
 #define ATA_DRIVEHEAD_SLAVE 0xB0
@@ -149,12 +157,21 @@ static struct ata_channel {
 #define ATA_CMD_PACKET 0xA0
 #define ATA_CMD_IDENTIFY_PACKET 0xA1
 #define ATA_CMD_IDENTIFY 0xEC
+#define ATA_CMD_SET_FEATURES 0xEF
+
+/* Subcommands of ATA_CMD_SET_FEATURES (for ATA_REG_FEATURE) */
+#define ATA_FEATURE_WCACHE_ON 0x02
 
 /* Drive/head values for CHS / LBA */
 #define ATA_DRIVEHEAD_CHS 0x00
 #define ATA_DRIVEHEAD_LBA 0x40
 
 #define ATA_IDENT_MAX_LBA 30
+/* Words 82 and 83 (command sets supported), and 84 and 85 (command sets
+ * enabled); the first of each pair is in the low half */
+#define ATA_IDENT_CMDSET_SUPPORTED 41
+#define ATA_IDENT_CMDSET_ENABLED 42
+#define ATA_CMDSET_WCACHE 0x20 /* a write cache, in words 82 and 85 */
 
 /* Reads from the command registers, NOT the control registers */
 #define ata_inb_reg(channel, reg) inb(ATA_CHANNELS[channel].atac_cmd + reg)
@@ -199,9 +216,18 @@ typedef struct ata_disk {
 
   uint32_t ata_sectors_per_block;
 
+  /* Whether the drive's write cache is on, so that a completed write
+   * may not be on the media yet, and whether any write has completed
+   * since the last cache flush */
+  int ata_wcache;
+  int ata_unflushed;
+
   /* Threads making blocking disk operations wait one this
-   * queue, and disk interrupt wakes them up */
+   * queue. The disk interrupt sets ata_done and leaves waking them up to
+   * ata_tasklet */
   ktqueue_t ata_waitq;
+  volatile int ata_done;
+  tasklet_t ata_tasklet;
 
   /* Disk mutex since only one process can be using the disk at
    * any time */
@@ -221,12 +247,42 @@ static int ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum,
                     unsigned int count);
 static int ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum,
                      unsigned int count);
-static int ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t sectornum,
-                            int write);
+static int ata_readv(blockdev_t *bdev, const blockdev_iovec_t *iov, int iovcnt,
+                     blocknum_t blocknum);
+static int ata_writev(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                      int iovcnt, blocknum_t blocknum);
+static int ata_transfer(ata_disk_t *adisk, const blockdev_iovec_t *iov,
+                        int iovcnt, blocknum_t blocknum, int write);
+static int ata_do_operation(ata_disk_t *adisk, const dma_sg_t *sg, int nsg,
+                            blocknum_t blocknum, uint32_t count, int write);
+static int ata_flush_cache(blockdev_t *bdev);
 static void ata_intr(regs_t *regs, void *arg);
+static void ata_complete(void *arg);
 
 static blockdev_ops_t ata_disk_ops = {.read_block = ata_read,
-                                      .write_block = ata_write};
+                                      .write_block = ata_write,
+                                      .readv_block = ata_readv,
+                                      .writev_block = ata_writev,
+                                      .flush_cache = ata_flush_cache};
+
+/*
+ * Turns on the write cache of the drive on channel, polling for the
+ * command to finish since the drive's interrupt handler isn't set up
+ * yet. Returns 1 if the drive took the command, 0 if not.
+ */
+static int ata_enable_wcache(int channel) {
+  uint16_t control = ATA_CHANNELS[channel].atac_ctrl + ATA_REG_CONTROL;
+  uint8_t status;
+
+  outb(control, 0x02); /* no interrupt for this one */
+  ata_outb_reg(channel, ATA_REG_FEATURE, ATA_FEATURE_WCACHE_ON);
+  ata_outb_reg(channel, ATA_REG_COMMAND, ATA_CMD_SET_FEATURES);
+  ata_pause(channel);
+  while ((status = ata_inb_reg(channel, ATA_REG_STATUS)) & ATA_SR_BSY)
+    ata_pause(channel);
+  outb(control, 0x00);
+  return !(status & (ATA_SR_ERR | ATA_SR_DF));
+}
 
 void ata_init() {
   int ii;
@@ -315,17 +371,31 @@ void ata_init() {
     /* Determine disk size */
     adisk->ata_size = ident_buf[ATA_IDENT_MAX_LBA];
     /* In theory we could use this identification buffer
-     * to find out lots of other things but we don't
-     * really need to know any of them */
+     * to find out lots of other things, but the only other one we
+     * need is whether the drive has a write cache, and whether it is
+     * on already; we turn it on if it isn't, and flush it when the
+     * file system needs writes to be durable */
+    if (ATA_WRITE_CACHE &&
+        (ident_buf[ATA_IDENT_CMDSET_SUPPORTED] & ATA_CMDSET_WCACHE))
+      adisk->ata_wcache = ata_enable_wcache(channel);
+    else
+      adisk->ata_wcache =
+          !!((ident_buf[ATA_IDENT_CMDSET_ENABLED] >> 16) & ATA_CMDSET_WCACHE);
+    adisk->ata_unflushed = 0;
 
     adisk->ata_sectors_per_block = BLOCK_SIZE / ATA_SECTOR_SIZE;
 
     sched_queue_init(&adisk->ata_waitq);
+    tasklet_init(&adisk->ata_tasklet, ata_complete, adisk,
+                 ATA_CHANNELS[adisk->ata_channel].atac_intr);
     kmutex_init(&adisk->ata_mutex);
 
-    dbg(DBG_DISK, "Initialized ATA device %d, channel %s, drive %s, size %d\n",
+    dbg(DBG_DISK,
+        "Initialized ATA device %d, channel %s, drive %s, size %d, "
+        "write cache %s\n",
         ii, (adisk->ata_channel ? "SECONDARY" : "PRIMARY"),
-        (adisk->ata_drive ? "SLAVE" : "MASTER"), adisk->ata_size);
+        (adisk->ata_drive ? "SLAVE" : "MASTER"), adisk->ata_size,
+        (adisk->ata_wcache ? "on" : "off"));
 
     /* Set up corresponding handler */
     intr_register(ATA_CHANNELS[adisk->ata_channel].atac_intr, ata_intr_wrapper);
@@ -335,7 +405,9 @@ void ata_init() {
         ata_setup_busmaster(adisk);
 
     adisk->ata_bdev.bd_id = MKDEVID(DISK_MAJOR, ii);
+    adisk->ata_bdev.bd_nblocks = adisk->ata_size / adisk->ata_sectors_per_block;
     adisk->ata_bdev.bd_ops = &ata_disk_ops;
+    adisk->ata_bdev.bd_depth = 1;
     blockdev_register(&adisk->ata_bdev);
   }
   intr_setipl(oldipl);
@@ -373,13 +445,8 @@ static void ata_intr_wrapper(regs_t *regs) {
 static int ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum,
                     unsigned int count) {
   dbg(DBG_DISK, "blocknum: %d count: %d\n", blocknum, count);
-  int status = 0;
-  for (unsigned i = 0; i < count * BLOCK_SIZE; i += BLOCK_SIZE) {
-    status = ata_do_operation(bd_to_ata(bdev), data+i, blocknum, 0);
-    if (status)
-      break;
-  }
-  return status;
+  blockdev_iovec_t iov = {.bv_buf = data, .bv_count = count};
+  return ata_transfer(bd_to_ata(bdev), &iov, 1, blocknum, 0);
 }
 
 /**
@@ -394,22 +461,108 @@ static int ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum,
  */
 static int ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum,
                      unsigned int count) {
-  dbg(DBG_DISK, "\n");
-  int status = 0;
-  for (unsigned i = 0; i < count * BLOCK_SIZE; i += BLOCK_SIZE) {
-    status = ata_do_operation(bd_to_ata(bdev), (char *)data+i, blocknum, 1);
-    if (status)
-      break;
+  dbg(DBG_DISK, "blocknum: %d count: %d\n", blocknum, count);
+  blockdev_iovec_t iov = {.bv_buf = (char *)data, .bv_count = count};
+  return ata_transfer(bd_to_ata(bdev), &iov, 1, blocknum, 1);
+}
+
+/**
+ * Reads consecutive blocks starting at blocknum into a list of buffers.
+ *
+ * @param bdev the block device to read from
+ * @param iov the buffers to read into
+ * @param iovcnt the number of buffers
+ * @param blocknum the block number to start reading at
+ * @return 0 on success and <0 on error
+ */
+static int ata_readv(blockdev_t *bdev, const blockdev_iovec_t *iov, int iovcnt,
+                     blocknum_t blocknum) {
+  dbg(DBG_DISK, "blocknum: %d iovcnt: %d\n", blocknum, iovcnt);
+  return ata_transfer(bd_to_ata(bdev), iov, iovcnt, blocknum, 0);
+}
+
+/**
+ * Writes a list of buffers to consecutive blocks starting at blocknum.
+ *
+ * @param bdev the block device to write to
+ * @param iov the buffers to write from
+ * @param iovcnt the number of buffers
+ * @param blocknum the block number to start writing at
+ * @return 0 on success and <0 on error
+ */
+static int ata_writev(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                      int iovcnt, blocknum_t blocknum) {
+  dbg(DBG_DISK, "blocknum: %d iovcnt: %d\n", blocknum, iovcnt);
+  return ata_transfer(bd_to_ata(bdev), iov, iovcnt, blocknum, 1);
+}
+
+/**
+ * Splits a scatter/gather list into as few disk commands as possible.
+ * Each command moves up to ATA_MAX_BLOCKS blocks with a single DMA
+ * setup and a single interrupt, however many buffers it spans.
+ *
+ * @param adisk the disk to perform the operation on
+ * @param iov the buffers to transfer
+ * @param iovcnt the number of buffers
+ * @param blocknum the first block on the disk to transfer
+ * @param write true if writing, false if reading
+ * @return 0 on success or <0 on error
+ */
+static int ata_transfer(ata_disk_t *adisk, const blockdev_iovec_t *iov,
+                        int iovcnt, blocknum_t blocknum, int write) {
+  dma_sg_t sg[ATA_MAX_BLOCKS];
+  int nsg = 0;
+  uint32_t nblocks = 0;
+  int status;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i) {
+    char *buf = iov[i].bv_buf;
+    size_t left = iov[i].bv_count;
+    while (left) {
+      size_t n = MIN(left, ATA_MAX_BLOCKS - nblocks);
+      sg[nsg].sg_addr = buf;
+      sg[nsg].sg_count = n * BLOCK_SIZE;
+      ++nsg;
+      nblocks += n;
+      buf += n * BLOCK_SIZE;
+      left -= n;
+      if (ATA_MAX_BLOCKS == nblocks) {
+        if ((status = ata_do_operation(adisk, sg, nsg, blocknum, nblocks,
+                                       write)))
+          return status;
+        blocknum += nblocks;
+        nsg = 0;
+        nblocks = 0;
+      }
+    }
   }
-  return status;
+  if (nblocks)
+    return ata_do_operation(adisk, sg, nsg, blocknum, nblocks, write);
+  return 0;
+}
+
+/*
+ * Sleeps until the disk interrupts. Only the test and the sleep need the
+ * disk interrupts (and so their tasklet) masked, so that the wakeup can't
+ * come in between; setting up the operation beforehand doesn't.
+ */
+static void ata_wait(ata_disk_t *adisk) {
+  uint8_t old_ipl = intr_getipl();
+  intr_setipl(INTR_DISK_SECONDARY);
+  while (!adisk->ata_done)
+    sched_sleep_on(&adisk->ata_waitq);
+  intr_setipl(old_ipl);
 }
 
 /**
- * Read/write the given block.
+ * Read/write the given run of blocks with a single disk command.
  *
  * @param adisk the disk to perform the operation on
- * @param data the buffer to write from or read into
- * @param blocknum which block on the disk to read or write
+ * @param sg the buffers to write from or read into
+ * @param nsg the number of buffers in sg
+ * @param blocknum the first block on the disk to read or write
+ * @param count the total number of blocks in sg, at most ATA_MAX_BLOCKS
  * @param write true if writing, false if reading
  * @return 0 on sucess or <0 on error
  */
@@ -418,17 +571,11 @@ static int ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum,
  * direct memory access (DMA). Follow these steps _VERY_
  * carefully. The steps are as follows:
  *
- *     o Lock the mutex and set the IPL. We don't want to
- *     other threads trying to perform an operation while we
- *     are in the middle of this operation. We also don't want
- *     to receive a disk interrupt, which is supposed to wake
- *     up this thread to alert us that the DMA operation has
- *     completed, before the thread goes to sleep and puts
- *     itself on the wait queue. Since the only interrupts we
- *     care about are disk interrupts, we do not have to mask
- *     all interrupts, just disk interrupts (and consequently,
- *     all interrupts with lower priority than disk
- *     interrupts). Try INTR_DISK_SECONDARY.
+ *     o Lock the mutex, so that no other thread tries to
+ *     perform an operation while we are in the middle of
+ *     this one, and clear ata_done. The disk interrupt sets
+ *     it, so an interrupt arriving before we get to sleep
+ *     is not lost (see ata_wait()).
  *
  *     o Initialize DMA for this operation (see the dma_load()
  *     function)
@@ -471,8 +618,8 @@ static int ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum,
  *     requested operation.
  *
  *     Specifically, we want to sleep on the disk's wait queue
- *     so we can be woken up by the interrupt handler, which
- *     will be called when the DMA operation is completed.
+ *     so we can be woken up by the interrupt handler's
+ *     tasklet once the DMA operation is completed.
  *
  *     o Once we have woken up from sleep, we need to read
  *     the status of the DMA operation from the disk's
@@ -488,21 +635,22 @@ static int ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum,
  *     interrupt and, if necessary, clear the error bit (see
  *     dma_reset() function).
  *
- *     o Now we are finished. Restore the IPL, release any
- *     locks we have, and return the status of the DMA
- *     operation.
+ *     o Now we are finished. Release any locks we have, and
+ *     return the status of the DMA operation.
  */
-static int ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum,
-                            int write) {
-  dbg(DBG_DISK, "blocknum: %d\n", blocknum);
-  int old_ipl = intr_getipl();
-  intr_setipl(INTR_DISK_SECONDARY);
+static int ata_do_operation(ata_disk_t *adisk, const dma_sg_t *sg, int nsg,
+                            blocknum_t blocknum, uint32_t count, int write) {
+  dbg(DBG_DISK, "blocknum: %d count: %d nsg: %d\n", blocknum, count, nsg);
+  KASSERT(0 < count && ATA_MAX_BLOCKS >= count);
   kmutex_lock(&adisk->ata_mutex);
   dbg(DBG_DISK, "acquired mutex\n");
-  dma_load(adisk->ata_channel, data, BLOCK_SIZE);
-  // Set sector 
+  adisk->ata_done = 0;
+  trace(TRACE_DISK_BEGIN, blocknum, count | ((uint32_t)!!write << 31));
+  dma_load_sg(adisk->ata_channel, sg, nsg);
+  // Set sector; a count of ATA_MAX_SECTORS is written as 0
   uint32_t secnum = blocknum * adisk->ata_sectors_per_block;
-  ata_outb_reg(adisk->ata_channel, ATA_REG_SECCOUNT0, adisk->ata_sectors_per_block);
+  uint32_t nsectors = count * adisk->ata_sectors_per_block;
+  ata_outb_reg(adisk->ata_channel, ATA_REG_SECCOUNT0, nsectors & 0xFF);
   ata_outb_reg(adisk->ata_channel, ATA_REG_LBA0, secnum & 0xFF);
   ata_outb_reg(adisk->ata_channel, ATA_REG_LBA1, (secnum >> 8) & 0xFF);
   ata_outb_reg(adisk->ata_channel, ATA_REG_LBA2, (secnum >> 16) & 0xFF);
@@ -513,7 +661,7 @@ static int ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum,
     ata_outb_reg(adisk->ata_channel, ATA_REG_COMMAND, ATA_CMD_READ_DMA);
   ata_pause(adisk->ata_channel);
   dma_start(adisk->ata_channel, ATA_CHANNELS[adisk->ata_channel].atac_busmaster, write); 
-  sched_sleep_on(&adisk->ata_waitq); // Wait for interrupt
+  ata_wait(adisk);
   int status = ata_inb_reg(adisk->ata_channel, ATA_REG_STATUS);
   int error = 0;
   if (status & ATA_SR_ERR) {
@@ -521,11 +669,45 @@ static int ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum,
     dbg(DBG_DISK, "ata error: %d\n", error);
   }
   dma_reset(ATA_CHANNELS[adisk->ata_channel].atac_busmaster);
+  if (write && !error)
+    adisk->ata_unflushed = 1;
+  trace(TRACE_DISK_END, blocknum, error);
   kmutex_unlock(&adisk->ata_mutex);
-  intr_setipl(old_ipl);
   return -1*error;
 }
 
+/**
+ * Flushes the disk's write cache, so that every write completed before
+ * this is on the media when it returns. Does nothing if the cache is
+ * off or no write has completed since the last flush. Waits for the
+ * disk's interrupt as ata_do_operation does.
+ *
+ * @param bdev the block device to flush
+ * @return 0 on success or -EIO on error
+ */
+static int ata_flush_cache(blockdev_t *bdev) {
+  ata_disk_t *adisk = bd_to_ata(bdev);
+  int status, error = 0;
+
+  if (!adisk->ata_wcache || !adisk->ata_unflushed)
+    return 0;
+  kmutex_lock(&adisk->ata_mutex);
+  adisk->ata_done = 0;
+  /* writes completing after this need a flush of their own; none can
+   * while we hold the mutex */
+  adisk->ata_unflushed = 0;
+  ata_outb_reg(adisk->ata_channel, ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+  ata_wait(adisk);
+  status = ata_inb_reg(adisk->ata_channel, ATA_REG_STATUS);
+  if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+    error = ata_inb_reg(adisk->ata_channel, ATA_REG_ERROR);
+    dbg(DBG_DISK, "ata cache flush error: %d\n", error);
+    adisk->ata_unflushed = 1;
+  }
+  kmutex_unlock(&adisk->ata_mutex);
+  return (status & (ATA_SR_ERR | ATA_SR_DF)) ? -EIO : 0;
+}
+
 /**
  * Interrupt handler called by the disk when an operation has
  * completed.
@@ -535,6 +717,13 @@ static int ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum,
  * a pointer to an ata_disk_t struct.
  */
 static void ata_intr(regs_t *regs, void *arg) {
+  ata_disk_t *adisk = arg;
+  adisk->ata_done = 1;
+  tasklet_schedule(&adisk->ata_tasklet);
+}
+
+/* The interrupt's tasklet, which wakes up the waiting thread */
+static void ata_complete(void *arg) {
   sched_wakeup_on(&((ata_disk_t *)arg)->ata_waitq);
 }
 
@@ -1,3 +1,5 @@
+#include "kernel.h"
+
 #include "main/io.h"
 
 #include "util/debug.h"
@@ -15,27 +17,66 @@ typedef struct {
   uint16_t prd_last;
 } prd_t;
 
-static prd_t prd_table[2] __attribute__((aligned(32)));
+/* Each channel gets its own table of DMA_MAX_PRDS entries. The tables are
+ * aligned to their own size so that none of them crosses a 64K boundary,
+ * which the busmaster does not allow. */
+static prd_t prd_table[2][DMA_MAX_PRDS]
+    __attribute__((aligned(DMA_MAX_PRDS * sizeof(prd_t))));
 
 static prd_t *DMA_PRDS[2];
 
+/* A single PRD may not cross a 64K boundary in physical memory (and so
+ * describes at most 64K) */
+#define DMA_SAME_64K(a, b) (((a) >> 16) == ((b) >> 16))
+
 void dma_init() {
   /* Clear the table */
-  memset(prd_table, 0, sizeof(prd_t) * 2);
-  /* Set pointers to it; note each channel only needs one PRD entry */
-  DMA_PRDS[0] = prd_table;
-  DMA_PRDS[1] = prd_table + 1;
+  memset(prd_table, 0, sizeof(prd_table));
+  /* Set pointers to it */
+  DMA_PRDS[0] = prd_table[0];
+  DMA_PRDS[1] = prd_table[1];
 }
 
 void dma_load(uint8_t channel, void *start, int count) {
-  KASSERT(PAGE_ALIGNED(start));
+  dma_sg_t sg = {.sg_addr = start, .sg_count = count};
+  dma_load_sg(channel, &sg, 1);
+}
+
+void dma_load_sg(uint8_t channel, const dma_sg_t *sg, int nsg) {
   prd_t *table = DMA_PRDS[channel];
-  memset(table, 0, sizeof(prd_t));
-  /* set up the PRD for this operation */
-  table->prd_addr = pt_virt_to_phys((uintptr_t)start);
-  table->prd_count = count;
-  table->prd_last = 0x8000;
-  return;
+  prd_t *prd = NULL;
+  uint32_t prdlen = 0; /* bytes described by prd so far */
+  int nprds = 0;
+  int i;
+
+  memset(table, 0, sizeof(prd_t) * DMA_MAX_PRDS);
+  for (i = 0; i < nsg; ++i) {
+    uintptr_t vaddr = (uintptr_t)sg[i].sg_addr;
+    uint32_t left = sg[i].sg_count;
+    KASSERT(PAGE_ALIGNED(vaddr));
+    while (left) {
+      /* translate one page at a time, since virtually contiguous
+       * buffers need not be physically contiguous */
+      uint32_t len = MIN(left, PAGE_SIZE);
+      uint32_t paddr = pt_virt_to_phys(vaddr);
+      if (prd && prd->prd_addr + prdlen == paddr &&
+          DMA_SAME_64K(prd->prd_addr, paddr + len - 1)) {
+        /* physically adjacent to the previous entry, extend it */
+        prdlen += len;
+      } else {
+        KASSERT(nprds < DMA_MAX_PRDS && "too many DMA segments");
+        prd = &table[nprds++];
+        prd->prd_addr = paddr;
+        prdlen = len;
+      }
+      /* a count of 0 means 64K to the controller */
+      prd->prd_count = (uint16_t)prdlen;
+      vaddr += len;
+      left -= len;
+    }
+  }
+  KASSERT(prd && "empty DMA transfer");
+  prd->prd_last = 0x8000;
 }
 
 void dma_start(uint8_t channel, uint16_t busmaster_addr, int write) {
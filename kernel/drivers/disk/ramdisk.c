@@ -0,0 +1,108 @@
+/*
+ * A disk held in memory, of RAMDISK_BLOCKS blocks, which are zero to
+ * begin with. Reads and writes are copies to and from its store, made
+ * in the calling thread, so a file system on it runs at memory speed:
+ * it makes a scratch disk, and shows how much of the cost of a disk
+ * operation is the block layer's rather than the disk's.
+ *
+ * The store is allocated whole at boot, in runs of pages as long as
+ * page_alloc_n can give, and is never freed.
+ */
+
+#include "kernel.h"
+#include "config.h"
+#include "types.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/disk/ramdisk.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+
+/* Blocks in each run of the store */
+#define RAMDISK_CHUNK_BLOCKS (1U << (PAGE_NSIZES - 1))
+
+typedef struct ramdisk {
+  char **rd_chunks;
+  blockdev_t rd_bdev;
+} ramdisk_t;
+
+static ramdisk_t *ramdisk;
+
+/* Where block blocknum of the disk is kept */
+static char *ramdisk_block(ramdisk_t *rd, blocknum_t blocknum) {
+  return rd->rd_chunks[blocknum / RAMDISK_CHUNK_BLOCKS] +
+         (blocknum % RAMDISK_CHUNK_BLOCKS) * BLOCK_SIZE;
+}
+
+static int ramdisk_rw(blockdev_t *bdev, char *buf, blocknum_t blocknum,
+                      size_t count, int write) {
+  ramdisk_t *rd = CONTAINER_OF(bdev, ramdisk_t, rd_bdev);
+  size_t n;
+
+  if (blocknum + count > bdev->bd_nblocks || blocknum + count < blocknum)
+    return -EINVAL;
+  for (; count; count -= n, blocknum += n, buf += n * BLOCK_SIZE) {
+    n = MIN(count, RAMDISK_CHUNK_BLOCKS - blocknum % RAMDISK_CHUNK_BLOCKS);
+    if (write)
+      memcpy(ramdisk_block(rd, blocknum), buf, n * BLOCK_SIZE);
+    else
+      memcpy(buf, ramdisk_block(rd, blocknum), n * BLOCK_SIZE);
+  }
+  return 0;
+}
+
+static int ramdisk_read(blockdev_t *bdev, char *buf, blocknum_t blocknum,
+                        size_t count) {
+  dbg(DBG_DISK, "blocknum: %d count: %d\n", blocknum, count);
+  return ramdisk_rw(bdev, buf, blocknum, count, 0);
+}
+
+static int ramdisk_write(blockdev_t *bdev, const char *buf,
+                         blocknum_t blocknum, size_t count) {
+  dbg(DBG_DISK, "blocknum: %d count: %d\n", blocknum, count);
+  return ramdisk_rw(bdev, (char *)buf, blocknum, count, 1);
+}
+
+static blockdev_ops_t ramdisk_ops = {.read_block = ramdisk_read,
+                                     .write_block = ramdisk_write,
+                                     .readv_block = NULL,
+                                     .writev_block = NULL,
+                                     .flush_cache = NULL};
+
+void ramdisk_init() {
+  uint32_t nchunks, i, n;
+  int minor = 0;
+
+  if (!RAMDISK_BLOCKS)
+    return;
+  nchunks = (RAMDISK_BLOCKS + RAMDISK_CHUNK_BLOCKS - 1) / RAMDISK_CHUNK_BLOCKS;
+  if (NULL == (ramdisk = kmalloc(sizeof(ramdisk_t))) ||
+      NULL == (ramdisk->rd_chunks = kmalloc(nchunks * sizeof(char *))))
+    panic("Not enough memory for ramdisk struct!\n");
+  memset(&ramdisk->rd_bdev, 0, sizeof(blockdev_t));
+  for (i = 0; i < nchunks; ++i) {
+    n = MIN(RAMDISK_CHUNK_BLOCKS, RAMDISK_BLOCKS - i * RAMDISK_CHUNK_BLOCKS);
+    if (NULL == (ramdisk->rd_chunks[i] = page_alloc_n(n)))
+      panic("Not enough memory for a ramdisk of %u blocks\n", RAMDISK_BLOCKS);
+    memset(ramdisk->rd_chunks[i], 0, n * BLOCK_SIZE);
+  }
+
+  /* After whatever real disks there are */
+  while (NULL != blockdev_lookup(MKDEVID(DISK_MAJOR, minor)))
+    minor++;
+  ramdisk->rd_bdev.bd_id = MKDEVID(DISK_MAJOR, minor);
+  ramdisk->rd_bdev.bd_nblocks = RAMDISK_BLOCKS;
+  ramdisk->rd_bdev.bd_ops = &ramdisk_ops;
+  ramdisk->rd_bdev.bd_depth = 1;
+  blockdev_register(&ramdisk->rd_bdev);
+  dbg(DBG_DISK, "Initialized ramdisk as disk %d, %u blocks\n", minor,
+      RAMDISK_BLOCKS);
+}
+
+blockdev_t *ramdisk_get() { return ramdisk ? &ramdisk->rd_bdev : NULL; }
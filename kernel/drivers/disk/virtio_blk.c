@@ -0,0 +1,383 @@
+/*
+ * A driver for virtio block devices, through the legacy PCI interface.
+ *
+ * A transfer is split into virtio requests of at most VBLK_MAX_SEGS
+ * pieces of physically contiguous memory, and every request is put on
+ * the queue before the device is told, once, that there is work. The
+ * caller then sleeps until the interrupt has seen all of them completed.
+ * Several callers can have transfers on the queue at once, so the disk
+ * says it takes bd_depth operations together, and the block layer sends
+ * that many.
+ */
+
+#include "types.h"
+#include "errno.h"
+
+#include "main/interrupt.h"
+#include "main/io.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/pci.h"
+#include "drivers/virtio.h"
+#include "drivers/disk/virtio_blk.h"
+
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+
+#define VIRTIO_BLK_DEVICE 0x1001 /* the transitional (legacy) id */
+#define VIRTIO_BLK_CAPACITY VIRTIO_PCI_CONFIG /* 64 bits, in sectors */
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK 0
+
+#define VBLK_SECTOR_SIZE 512
+#define VBLK_SECTORS_PER_BLOCK (BLOCK_SIZE / VBLK_SECTOR_SIZE)
+
+/* Data descriptors in one request; with the header and status ones, a
+ * request takes VBLK_MAX_SEGS + 2 */
+#define VBLK_MAX_SEGS 32
+
+typedef struct virtio_blk_hdr {
+  uint32_t vh_type;
+  uint32_t vh_reserved;
+  uint64_t vh_sector;
+} __attribute__((packed)) virtio_blk_hdr_t;
+
+/* One caller's transfer, on its stack, and the requests still out on it */
+typedef struct vblk_xfer {
+  ktqueue_t vx_waitq;
+  int vx_pending;
+  int vx_status;
+} vblk_xfer_t;
+
+typedef struct vblk_disk {
+  uint16_t vb_port;
+  uint16_t vb_qsize;
+
+  /* The queue, in vb_qpages physically contiguous pages */
+  void *vb_queue;
+  uint32_t vb_qpages;
+  vring_desc_t *vb_desc;
+  vring_avail_t *vb_avail;
+  volatile vring_used_t *vb_used;
+  uint16_t vb_last_used; /* used ring entries already seen */
+
+  /* Free descriptors, chained through vd_next */
+  uint16_t vb_free;
+  uint16_t vb_nfree;
+  ktqueue_t vb_descq; /* callers waiting for enough of them */
+
+  /* Per request, by its first descriptor: its header and status, in
+   * memory the device can reach, and the transfer it is part of */
+  virtio_blk_hdr_t *vb_hdrs;
+  uint8_t *vb_status;
+  vblk_xfer_t **vb_xfers;
+
+  blockdev_t vb_bdev;
+  list_link_t vb_link;
+} vblk_disk_t;
+
+#define bd_to_vblk(bd) CONTAINER_OF(bd, vblk_disk_t, vb_bdev)
+
+/* A piece of a request: physical memory */
+typedef struct vblk_seg {
+  uint32_t vs_addr;
+  uint32_t vs_len;
+} vblk_seg_t;
+
+static int vblk_read(blockdev_t *bdev, char *data, blocknum_t blocknum,
+                     size_t count);
+static int vblk_write(blockdev_t *bdev, const char *data, blocknum_t blocknum,
+                      size_t count);
+static int vblk_readv(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                      int iovcnt, blocknum_t loc);
+static int vblk_writev(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                       int iovcnt, blocknum_t loc);
+
+static blockdev_ops_t vblk_disk_ops = {.read_block = vblk_read,
+                                       .write_block = vblk_write,
+                                       .readv_block = vblk_readv,
+                                       .writev_block = vblk_writev};
+
+static list_t vblk_disks;
+
+/* Takes back the descriptors of a completed request */
+static void vblk_free_chain(vblk_disk_t *vb, uint16_t head) {
+  uint16_t i = head;
+
+  for (;;) {
+    vb->vb_nfree++;
+    if (!(vb->vb_desc[i].vd_flags & VRING_DESC_F_NEXT))
+      break;
+    i = vb->vb_desc[i].vd_next;
+  }
+  vb->vb_desc[i].vd_next = vb->vb_free;
+  vb->vb_desc[i].vd_flags = VRING_DESC_F_NEXT;
+  vb->vb_free = head;
+}
+
+/* Reading the ISR acknowledges the interrupt, so it is read before the
+ * used ring, and anything completed after sets it again */
+static void vblk_intr(regs_t *regs) {
+  vblk_disk_t *vb;
+
+  list_iterate_begin(&vblk_disks, vb, vblk_disk_t, vb_link) {
+    int freed = 0;
+
+    if (!(inb(vb->vb_port + VIRTIO_PCI_ISR) & 0x1))
+      continue;
+    while (vb->vb_last_used != vb->vb_used->vu_idx) {
+      uint16_t head =
+          vb->vb_used->vu_ring[vb->vb_last_used % vb->vb_qsize].vu_id;
+      vblk_xfer_t *vx = vb->vb_xfers[head];
+
+      if (VIRTIO_BLK_S_OK != vb->vb_status[head])
+        vx->vx_status = -EIO;
+      vblk_free_chain(vb, head);
+      if (0 == --vx->vx_pending)
+        sched_wakeup_on(&vx->vx_waitq);
+      vb->vb_last_used++;
+      freed = 1;
+    }
+    if (freed)
+      sched_broadcast_on(&vb->vb_descq);
+  }
+  list_iterate_end();
+}
+
+static void vblk_notify(vblk_disk_t *vb) {
+  __asm__ volatile("" ::: "memory");
+  if (!(vb->vb_used->vu_flags & VRING_USED_F_NO_NOTIFY))
+    outw(vb->vb_port + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+}
+
+/*
+ * Puts one request on the available ring, without telling the device.
+ * Called with the disk's interrupt blocked; if there are not enough free
+ * descriptors, tells the device about what is queued already and sleeps.
+ */
+static void vblk_queue(vblk_disk_t *vb, vblk_xfer_t *vx, uint32_t sector,
+                       const vblk_seg_t *segs, int nsegs, int write) {
+  uint16_t head, d;
+  int i;
+
+  while (vb->vb_nfree < nsegs + 2) {
+    vblk_notify(vb);
+    sched_sleep_on(&vb->vb_descq);
+  }
+  head = d = vb->vb_free;
+  vb->vb_hdrs[head].vh_type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  vb->vb_hdrs[head].vh_reserved = 0;
+  vb->vb_hdrs[head].vh_sector = sector;
+  vb->vb_status[head] = 0xff;
+  vb->vb_xfers[head] = vx;
+
+  vb->vb_desc[d].vd_addr = pt_virt_to_phys((uintptr_t)&vb->vb_hdrs[head]);
+  vb->vb_desc[d].vd_len = sizeof(virtio_blk_hdr_t);
+  vb->vb_desc[d].vd_flags = VRING_DESC_F_NEXT;
+  for (i = 0; i < nsegs; i++) {
+    d = vb->vb_desc[d].vd_next;
+    vb->vb_desc[d].vd_addr = segs[i].vs_addr;
+    vb->vb_desc[d].vd_len = segs[i].vs_len;
+    vb->vb_desc[d].vd_flags =
+        VRING_DESC_F_NEXT | (write ? 0 : VRING_DESC_F_WRITE);
+  }
+  d = vb->vb_desc[d].vd_next;
+  vb->vb_desc[d].vd_addr = pt_virt_to_phys((uintptr_t)&vb->vb_status[head]);
+  vb->vb_desc[d].vd_len = 1;
+  vb->vb_desc[d].vd_flags = VRING_DESC_F_WRITE;
+  vb->vb_free = vb->vb_desc[d].vd_next;
+  vb->vb_nfree -= nsegs + 2;
+
+  vb->vb_avail->va_ring[vb->vb_avail->va_idx % vb->vb_qsize] = head;
+  __asm__ volatile("" ::: "memory");
+  vb->vb_avail->va_idx++;
+  vx->vx_pending++;
+}
+
+static int vblk_transfer(vblk_disk_t *vb, const blockdev_iovec_t *iov,
+                         int iovcnt, blocknum_t loc, int write) {
+  vblk_seg_t segs[VBLK_MAX_SEGS];
+  vblk_xfer_t vx;
+  uint32_t sector = loc * VBLK_SECTORS_PER_BLOCK;
+  uint32_t nsectors = 0; /* in segs */
+  int nsegs = 0, i;
+
+  sched_queue_init(&vx.vx_waitq);
+  vx.vx_pending = 0;
+  vx.vx_status = 0;
+
+  uint8_t oldipl = intr_getipl();
+  intr_setipl(INTR_VIRTIO_BLK);
+  for (i = 0; i < iovcnt; i++) {
+    uintptr_t vaddr = (uintptr_t)iov[i].bv_buf;
+    size_t left = iov[i].bv_count;
+
+    KASSERT(PAGE_ALIGNED(vaddr));
+    /* One page at a time, since a buffer need not be physically
+     * contiguous */
+    for (; left; left--, vaddr += PAGE_SIZE) {
+      uint32_t paddr = pt_virt_to_phys(vaddr);
+      if (nsegs && segs[nsegs - 1].vs_addr + segs[nsegs - 1].vs_len == paddr) {
+        segs[nsegs - 1].vs_len += PAGE_SIZE;
+      } else {
+        if (VBLK_MAX_SEGS == nsegs) {
+          vblk_queue(vb, &vx, sector, segs, nsegs, write);
+          sector += nsectors;
+          nsectors = nsegs = 0;
+        }
+        segs[nsegs].vs_addr = paddr;
+        segs[nsegs++].vs_len = PAGE_SIZE;
+      }
+      nsectors += VBLK_SECTORS_PER_BLOCK;
+    }
+  }
+  if (nsegs)
+    vblk_queue(vb, &vx, sector, segs, nsegs, write);
+  vblk_notify(vb);
+  while (vx.vx_pending)
+    sched_sleep_on(&vx.vx_waitq);
+  intr_setipl(oldipl);
+
+  if (vx.vx_status)
+    dbg(DBG_DISK, "virtio-blk %s error at block %u\n",
+        write ? "write" : "read", loc);
+  return vx.vx_status;
+}
+
+static int vblk_read(blockdev_t *bdev, char *data, blocknum_t blocknum,
+                     size_t count) {
+  blockdev_iovec_t iov = {.bv_buf = data, .bv_count = count};
+  return vblk_transfer(bd_to_vblk(bdev), &iov, 1, blocknum, 0);
+}
+
+static int vblk_write(blockdev_t *bdev, const char *data, blocknum_t blocknum,
+                      size_t count) {
+  blockdev_iovec_t iov = {.bv_buf = (char *)data, .bv_count = count};
+  return vblk_transfer(bd_to_vblk(bdev), &iov, 1, blocknum, 1);
+}
+
+static int vblk_readv(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                      int iovcnt, blocknum_t loc) {
+  return vblk_transfer(bd_to_vblk(bdev), iov, iovcnt, loc, 0);
+}
+
+static int vblk_writev(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                       int iovcnt, blocknum_t loc) {
+  return vblk_transfer(bd_to_vblk(bdev), iov, iovcnt, loc, 1);
+}
+
+/* Sets up the device's one queue; returns 0, or -errno and leaves the
+ * device failed */
+static int vblk_setup(vblk_disk_t *vb) {
+  uintptr_t paddr;
+  uint32_t i, nhdrpages;
+
+  outw(vb->vb_port + VIRTIO_PCI_QUEUE_SEL, 0);
+  vb->vb_qsize = inw(vb->vb_port + VIRTIO_PCI_QUEUE_NUM);
+  if (vb->vb_qsize < VBLK_MAX_SEGS + 2)
+    return -ENODEV;
+
+  vb->vb_qpages = vring_size(vb->vb_qsize) / PAGE_SIZE;
+  if (NULL == (vb->vb_queue = page_alloc_n(vb->vb_qpages)))
+    return -ENOMEM;
+  paddr = pt_virt_to_phys((uintptr_t)vb->vb_queue);
+  for (i = 1; i < vb->vb_qpages; i++) {
+    if (pt_virt_to_phys((uintptr_t)vb->vb_queue + i * PAGE_SIZE) !=
+        paddr + i * PAGE_SIZE)
+      return -ENOMEM; /* the device needs it physically contiguous */
+  }
+  memset(vb->vb_queue, 0, vb->vb_qpages * PAGE_SIZE);
+  vb->vb_desc = vb->vb_queue;
+  vb->vb_avail = (vring_avail_t *)(vb->vb_desc + vb->vb_qsize);
+  vb->vb_used =
+      (vring_used_t *)((char *)vb->vb_queue + vring_avail_size(vb->vb_qsize));
+  vb->vb_last_used = 0;
+  for (i = 0; i < vb->vb_qsize; i++) {
+    vb->vb_desc[i].vd_next = (i + 1) % vb->vb_qsize;
+    vb->vb_desc[i].vd_flags = VRING_DESC_F_NEXT;
+  }
+  vb->vb_free = 0;
+  vb->vb_nfree = vb->vb_qsize;
+  sched_queue_init(&vb->vb_descq);
+
+  /* A header is 16 bytes, so none straddles two pages */
+  nhdrpages = (vb->vb_qsize * (sizeof(virtio_blk_hdr_t) + 1) + PAGE_SIZE - 1) /
+              PAGE_SIZE;
+  if (NULL == (vb->vb_hdrs = page_alloc_n(nhdrpages)))
+    return -ENOMEM;
+  vb->vb_status = (uint8_t *)(vb->vb_hdrs + vb->vb_qsize);
+  vb->vb_xfers = kmalloc(sizeof(vblk_xfer_t *) * vb->vb_qsize);
+  if (NULL == vb->vb_xfers)
+    return -ENOMEM;
+
+  outl(vb->vb_port + VIRTIO_PCI_QUEUE_PFN, paddr / PAGE_SIZE);
+  return 0;
+}
+
+void virtio_blk_init() {
+  pcidev_t *pd = NULL;
+  int minor = 0, err;
+
+  list_init(&vblk_disks);
+  intr_register(INTR_VIRTIO_BLK, vblk_intr);
+
+  while (NULL != (pd = pci_lookup_id(VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, pd))) {
+    vblk_disk_t *vb;
+
+    if (PCI_IO != pd->pci_bar[0].mem_type) {
+      dbg(DBG_DISK, "virtio-blk without an I/O BAR, skipped\n");
+      continue;
+    }
+    if (NULL == (vb = kmalloc(sizeof(vblk_disk_t))))
+      panic("Not enough memory for virtio disk struct!\n");
+    memset(vb, 0, sizeof(*vb));
+    vb->vb_port = pd->pci_bar[0].base_addr;
+    pci_write_config(pd, PCI_COMMAND,
+                     pci_read_config(pd, PCI_COMMAND, 2) | PCI_CMD_IO |
+                         PCI_CMD_BUSMASTER,
+                     2);
+
+    /* Reset, then say we have found it and can drive it, wanting none of
+     * the optional features */
+    outb(vb->vb_port + VIRTIO_PCI_STATUS, 0);
+    outb(vb->vb_port + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+    outb(vb->vb_port + VIRTIO_PCI_STATUS,
+         VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+    outl(vb->vb_port + VIRTIO_PCI_GUEST_FEATURES, 0);
+    if (0 > (err = vblk_setup(vb))) {
+      dbg(DBG_DISK, "virtio-blk setup failed: %d\n", err);
+      outb(vb->vb_port + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+      continue; /* what was allocated is kept, being too little to matter */
+    }
+
+    /* After whatever disks ATA found */
+    while (NULL != blockdev_lookup(MKDEVID(DISK_MAJOR, minor)))
+      minor++;
+    vb->vb_bdev.bd_id = MKDEVID(DISK_MAJOR, minor);
+    vb->vb_bdev.bd_nblocks =
+        (inl(vb->vb_port + VIRTIO_BLK_CAPACITY) |
+         ((uint64_t)inl(vb->vb_port + VIRTIO_BLK_CAPACITY + 4) << 32)) /
+        VBLK_SECTORS_PER_BLOCK;
+    vb->vb_bdev.bd_ops = &vblk_disk_ops;
+    vb->vb_bdev.bd_depth = vb->vb_qsize / (VBLK_MAX_SEGS + 2);
+    list_insert_tail(&vblk_disks, &vb->vb_link);
+
+    intr_map(pd->pci_irq, INTR_VIRTIO_BLK);
+    outb(vb->vb_port + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK |
+                                              VIRTIO_STATUS_DRIVER |
+                                              VIRTIO_STATUS_DRIVER_OK);
+    blockdev_register(&vb->vb_bdev);
+    dbg(DBG_DISK, "Initialized virtio-blk disk %d, queue %u, %u blocks\n",
+        minor, vb->vb_qsize, vb->vb_bdev.bd_nblocks);
+  }
+}
@@ -14,6 +14,7 @@
 
 #include "vm/anon.h"
 
+#include "fs/poll.h"
 #include "fs/vnode.h"
 
 static int null_read(bytedev_t *dev, int offset, void *buf, int count);
@@ -22,10 +23,13 @@ static int null_write(bytedev_t *dev, int offset, const void *buf, int count);
 static int zero_read(bytedev_t *dev, int offset, void *buf, int count);
 static int zero_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
 
-bytedev_ops_t null_dev_ops = {null_read, null_write, NULL, NULL, NULL, NULL};
+static int mem_poll(bytedev_t *dev, int events, poll_table_t *pt);
 
-bytedev_ops_t zero_dev_ops = {zero_read, null_write, zero_mmap,
-                              NULL,      NULL,       NULL};
+bytedev_ops_t null_dev_ops = {null_read, null_write, NULL, NULL,
+                              NULL,      NULL,       mem_poll};
+
+bytedev_ops_t zero_dev_ops = {zero_read, null_write, zero_mmap, NULL,
+                              NULL,      NULL,       mem_poll};
 
 /*
  * The byte device code needs to know about these mem devices, so create
@@ -93,10 +97,26 @@ static int zero_read(bytedev_t *dev, int offset, void *buf, int count) {
   return count;
 }
 
-/* Don't worry about these until VM. Once you're there, they shouldn't be hard.
+/**
+ * Neither device ever blocks: reads of null see the end of the file at
+ * once, and reads of zero and writes of both always complete.
+ *
+ * @param dev the null or zero device
+ * @param events the events of interest
+ * @param pt the poller, which need never be woken
+ * @return POLLIN | POLLOUT
  */
+static int mem_poll(bytedev_t *dev, int events, poll_table_t *pt) {
+  return POLLIN | POLLOUT;
+}
 
+/*
+ * Mapping the zero device gives fresh anonymous memory. A private mapping
+ * of it reads through the shared zero page until written (see
+ * vm/pagefault.c).
+ */
 static int zero_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret) {
-  NOT_YET_IMPLEMENTED("VM: zero_mmap");
-  return -1;
+  if (NULL == (*ret = anon_create()))
+    return -ENOMEM;
+  return 0;
 }
@@ -0,0 +1,414 @@
+/*
+ * A driver for a virtio network device, through the legacy PCI interface,
+ * as the network stack's one interface (see net/net.h).
+ *
+ * Each queue is split into slots of three descriptors, chained once at
+ * setup: the virtio header, the frame's headers, and its data. A receive
+ * slot's headers are exactly NET_UDP_HLEN bytes, so that the device
+ * leaves a UDP payload at the start of the slot's page, which is a page
+ * of an anonymous object of the driver's; a socket keeping the page
+ * takes it over and the slot gets a new one. A transmit slot's headers
+ * are copied in, and its data is a page the stack gives up, freed once
+ * the device is done with it.
+ *
+ * The interrupt handler only acknowledges the device; its tasklet queues
+ * the work item, which in a kworker reaps what was sent and takes in
+ * what was received. Getting pages may block, and the item may be run
+ * again meanwhile, so receiving is under vn_rxlock. Otherwise the rings
+ * are only touched by threads which don't block while they are
+ * inconsistent, which is enough on the one processor running threads.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "drivers/net/virtio_net.h"
+#include "drivers/pci.h"
+#include "drivers/virtio.h"
+
+#include "main/interrupt.h"
+#include "main/io.h"
+#include "main/tasklet.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
+
+#include "net/net.h"
+
+#include "proc/kmutex.h"
+#include "proc/sched.h"
+#include "proc/workqueue.h"
+
+#include "vm/anon.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+#define VIRTIO_NET_DEVICE 0x1000 /* the transitional (legacy) id */
+#define VIRTIO_NET_F_MAC (1 << 5) /* the configuration has a MAC address */
+#define VIRTIO_NET_MAC VIRTIO_PCI_CONFIG
+
+#define VNET_RXQ 0
+#define VNET_TXQ 1
+#define VNET_SLOT_DESCS 3
+
+typedef struct virtio_net_hdr {
+  uint8_t vh_flags;
+  uint8_t vh_gso_type;
+  uint16_t vh_hdr_len;
+  uint16_t vh_gso_size;
+  uint16_t vh_csum_start;
+  uint16_t vh_csum_offset;
+} __attribute__((packed)) virtio_net_hdr_t;
+
+/* A slot's headers, in memory the device can reach; 64 bytes, so that
+ * none straddles two pages */
+typedef struct vnet_hdrs {
+  virtio_net_hdr_t vs_vhdr;
+  char vs_frame[NET_HDR_MAX];
+} __attribute__((packed)) vnet_hdrs_t;
+
+typedef struct vnet_queue {
+  uint16_t vq_size;
+  uint16_t vq_nslots;
+  void *vq_mem; /* vring_size() bytes, physically contiguous */
+  vring_desc_t *vq_desc;
+  vring_avail_t *vq_avail;
+  volatile vring_used_t *vq_used;
+  uint16_t vq_last_used; /* used ring entries already seen */
+  vnet_hdrs_t *vq_hdrs;  /* per slot */
+} vnet_queue_t;
+
+typedef struct vnet {
+  uint16_t vn_port;
+  vnet_queue_t vn_rxq;
+  vnet_queue_t vn_txq;
+
+  mmobj_t *vn_rxobj;     /* the receive pages, until a socket takes one */
+  uint32_t vn_rxnext;    /* page number for the next */
+  pframe_t **vn_rxpages; /* per receive slot, pinned */
+  pframe_t *vn_rxspare;  /* a page got for a slot but not yet needed */
+  kmutex_t vn_rxlock;
+
+  void **vn_txdata;      /* per transmit slot, the page being sent */
+  uint16_t *vn_txfree;   /* a stack of the free transmit slots */
+  uint16_t vn_ntxfree;
+  ktqueue_t vn_txwaitq;  /* senders waiting for a slot */
+
+  tasklet_t vn_tasklet;
+  work_t vn_work;
+  netif_t vn_if;
+} vnet_t;
+
+static vnet_t *vnet = NULL;
+
+static void vnet_intr(regs_t *regs) {
+  if (vnet && (inb(vnet->vn_port + VIRTIO_PCI_ISR) & 0x1))
+    tasklet_schedule(&vnet->vn_tasklet);
+}
+
+static void vnet_tasklet(void *arg) { work_queue(&((vnet_t *)arg)->vn_work); }
+
+static void vnet_notify(vnet_t *vn, vnet_queue_t *vq, uint16_t index) {
+  __asm__ volatile("" ::: "memory");
+  if (!(vq->vq_used->vu_flags & VRING_USED_F_NO_NOTIFY))
+    outw(vn->vn_port + VIRTIO_PCI_QUEUE_NOTIFY, index);
+}
+
+/* Makes a slot's chain available to the device, without telling it */
+static void vnet_post(vnet_queue_t *vq, uint16_t slot) {
+  vq->vq_avail->va_ring[vq->vq_avail->va_idx % vq->vq_size] =
+      slot * VNET_SLOT_DESCS;
+  __asm__ volatile("" ::: "memory");
+  vq->vq_avail->va_idx++;
+}
+
+/* Gets a new receive page, pinned while the device may write it */
+static int vnet_rx_page(vnet_t *vn, pframe_t **pfp) {
+  int ret;
+
+  if (vn->vn_rxspare) {
+    *pfp = vn->vn_rxspare;
+    vn->vn_rxspare = NULL;
+    return 0;
+  }
+  if (0 > (ret = pframe_get(vn->vn_rxobj, vn->vn_rxnext++, pfp)))
+    return ret;
+  pframe_pin(*pfp);
+  return 0;
+}
+
+static void vnet_rx_fill(vnet_t *vn, uint16_t slot, pframe_t *pf) {
+  vring_desc_t *d = &vn->vn_rxq.vq_desc[slot * VNET_SLOT_DESCS + 2];
+
+  vn->vn_rxpages[slot] = pf;
+  d->vd_addr = pt_virt_to_phys((uintptr_t)pf->pf_addr);
+  vnet_post(&vn->vn_rxq, slot);
+}
+
+/*
+ * Hands what was received up the stack. A frame whose page is kept is
+ * replaced with a new page got first; if there is none to be had, the
+ * frame is dropped and its page reused, as if the device had run out of
+ * buffers.
+ */
+static void vnet_rx(vnet_t *vn) {
+  vnet_queue_t *vq = &vn->vn_rxq;
+  uint16_t slot;
+  pframe_t *pf;
+  size_t len, hdrlen;
+  int posted = 0;
+
+  while (vq->vq_last_used != vq->vq_used->vu_idx) {
+    volatile vring_used_elem_t *ue =
+        &vq->vq_used->vu_ring[vq->vq_last_used % vq->vq_size];
+    slot = ue->vu_id / VNET_SLOT_DESCS;
+    len = ue->vu_len - MIN(ue->vu_len, sizeof(virtio_net_hdr_t));
+    vq->vq_last_used++;
+    pf = vn->vn_rxpages[slot];
+
+    if (!vn->vn_rxspare && 0 > vnet_rx_page(vn, &vn->vn_rxspare)) {
+      vn->vn_if.ni_rx_dropped++;
+    } else {
+      hdrlen = MIN(len, NET_UDP_HLEN);
+      if (net_input(&vn->vn_if, vq->vq_hdrs[slot].vs_frame, hdrlen, pf,
+                    len - hdrlen)) {
+        pf = vn->vn_rxspare;
+        vn->vn_rxspare = NULL;
+      }
+    }
+    vnet_rx_fill(vn, slot, pf);
+    posted = 1;
+  }
+  if (posted)
+    vnet_notify(vn, vq, VNET_RXQ);
+}
+
+/* Frees the pages the device has finished sending, and their slots */
+static void vnet_tx_reap(vnet_t *vn) {
+  vnet_queue_t *vq = &vn->vn_txq;
+  uint16_t slot;
+  int freed = 0;
+
+  while (vq->vq_last_used != vq->vq_used->vu_idx) {
+    slot = vq->vq_used->vu_ring[vq->vq_last_used % vq->vq_size].vu_id /
+           VNET_SLOT_DESCS;
+    vq->vq_last_used++;
+    if (vn->vn_txdata[slot]) {
+      page_free(vn->vn_txdata[slot]);
+      vn->vn_txdata[slot] = NULL;
+    }
+    vn->vn_txfree[vn->vn_ntxfree++] = slot;
+    freed = 1;
+  }
+  if (freed)
+    sched_broadcast_on(&vn->vn_txwaitq);
+}
+
+static void vnet_work(work_t *work) {
+  vnet_t *vn = CONTAINER_OF(work, vnet_t, vn_work);
+  vnet_tx_reap(vn);
+  kmutex_lock(&vn->vn_rxlock);
+  vnet_rx(vn);
+  kmutex_unlock(&vn->vn_rxlock);
+}
+
+static int vnet_xmit(netif_t *ni, const void *hdr, size_t hdrlen, void *data,
+                     size_t len, int wait) {
+  vnet_t *vn = CONTAINER_OF(ni, vnet_t, vn_if);
+  vnet_queue_t *vq = &vn->vn_txq;
+  vring_desc_t *d;
+  uint16_t slot;
+
+  KASSERT(hdrlen <= NET_HDR_MAX && (data || !len));
+  vnet_tx_reap(vn);
+  while (!vn->vn_ntxfree) {
+    if (!wait) {
+      ni->ni_tx_dropped++;
+      if (data)
+        page_free(data);
+      return -EAGAIN;
+    }
+    sched_sleep_on(&vn->vn_txwaitq);
+    vnet_tx_reap(vn);
+  }
+  slot = vn->vn_txfree[--vn->vn_ntxfree];
+  memset(&vq->vq_hdrs[slot].vs_vhdr, 0, sizeof(virtio_net_hdr_t));
+  memcpy(vq->vq_hdrs[slot].vs_frame, hdr, hdrlen);
+  vn->vn_txdata[slot] = data;
+
+  d = &vq->vq_desc[slot * VNET_SLOT_DESCS];
+  d[1].vd_len = hdrlen;
+  if (len) {
+    d[1].vd_flags = VRING_DESC_F_NEXT;
+    d[2].vd_addr = pt_virt_to_phys((uintptr_t)data);
+    d[2].vd_len = len;
+  } else {
+    d[1].vd_flags = 0;
+  }
+  vnet_post(vq, slot);
+  vnet_notify(vn, vq, VNET_TXQ);
+  ni->ni_tx_packets++;
+  ni->ni_tx_bytes += hdrlen + len;
+  return 0;
+}
+
+/*
+ * Sets up queue index, of at most maxslots slots, chaining each slot's
+ * descriptors to its headers; the receive queue's are written by the
+ * device. Returns 0, or -errno and leaves the device to be failed.
+ */
+static int vnet_setup_queue(vnet_t *vn, vnet_queue_t *vq, uint16_t index,
+                            uint16_t maxslots) {
+  uint32_t npages, i;
+  uintptr_t paddr;
+  uint16_t write = VNET_RXQ == index ? VRING_DESC_F_WRITE : 0;
+  vring_desc_t *d;
+
+  outw(vn->vn_port + VIRTIO_PCI_QUEUE_SEL, index);
+  vq->vq_size = inw(vn->vn_port + VIRTIO_PCI_QUEUE_NUM);
+  vq->vq_nslots = MIN(maxslots, vq->vq_size / VNET_SLOT_DESCS);
+  if (!vq->vq_nslots)
+    return -ENODEV;
+
+  npages = vring_size(vq->vq_size) / PAGE_SIZE;
+  if (NULL == (vq->vq_mem = page_alloc_n(npages)))
+    return -ENOMEM;
+  paddr = pt_virt_to_phys((uintptr_t)vq->vq_mem);
+  for (i = 1; i < npages; i++) {
+    if (pt_virt_to_phys((uintptr_t)vq->vq_mem + i * PAGE_SIZE) !=
+        paddr + i * PAGE_SIZE)
+      return -ENOMEM; /* the device needs it physically contiguous */
+  }
+  memset(vq->vq_mem, 0, npages * PAGE_SIZE);
+  vq->vq_desc = vq->vq_mem;
+  vq->vq_avail = (vring_avail_t *)(vq->vq_desc + vq->vq_size);
+  vq->vq_used =
+      (vring_used_t *)((char *)vq->vq_mem + vring_avail_size(vq->vq_size));
+  vq->vq_last_used = 0;
+
+  npages = (vq->vq_nslots * sizeof(vnet_hdrs_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+  if (NULL == (vq->vq_hdrs = page_alloc_n(npages)))
+    return -ENOMEM;
+  memset(vq->vq_hdrs, 0, npages * PAGE_SIZE);
+  for (i = 0; i < vq->vq_nslots; i++) {
+    d = &vq->vq_desc[i * VNET_SLOT_DESCS];
+    d[0].vd_addr = pt_virt_to_phys((uintptr_t)&vq->vq_hdrs[i].vs_vhdr);
+    d[0].vd_len = sizeof(virtio_net_hdr_t);
+    d[0].vd_flags = VRING_DESC_F_NEXT | write;
+    d[0].vd_next = i * VNET_SLOT_DESCS + 1;
+    d[1].vd_addr = pt_virt_to_phys((uintptr_t)vq->vq_hdrs[i].vs_frame);
+    d[1].vd_len = NET_UDP_HLEN;
+    d[1].vd_flags = VRING_DESC_F_NEXT | write;
+    d[1].vd_next = i * VNET_SLOT_DESCS + 2;
+    d[2].vd_len = PAGE_SIZE;
+    d[2].vd_flags = write;
+  }
+
+  outl(vn->vn_port + VIRTIO_PCI_QUEUE_PFN, paddr / PAGE_SIZE);
+  return 0;
+}
+
+static int vnet_setup(vnet_t *vn) {
+  uint16_t i;
+  pframe_t *pf;
+  int ret;
+
+  if (0 > (ret = vnet_setup_queue(vn, &vn->vn_rxq, VNET_RXQ, NET_RX_BUFS)) ||
+      0 > (ret = vnet_setup_queue(vn, &vn->vn_txq, VNET_TXQ, 0xffff)))
+    return ret;
+
+  vn->vn_txdata = kmalloc(sizeof(void *) * vn->vn_txq.vq_nslots);
+  vn->vn_txfree = kmalloc(sizeof(uint16_t) * vn->vn_txq.vq_nslots);
+  vn->vn_rxpages = kmalloc(sizeof(pframe_t *) * vn->vn_rxq.vq_nslots);
+  if (!vn->vn_txdata || !vn->vn_txfree || !vn->vn_rxpages)
+    return -ENOMEM;
+  for (i = 0; i < vn->vn_txq.vq_nslots; i++) {
+    vn->vn_txdata[i] = NULL;
+    vn->vn_txfree[i] = vn->vn_txq.vq_nslots - 1 - i;
+  }
+  vn->vn_ntxfree = vn->vn_txq.vq_nslots;
+  sched_queue_init(&vn->vn_txwaitq);
+
+  kmutex_init(&vn->vn_rxlock);
+  if (NULL == (vn->vn_rxobj = anon_create()))
+    return -ENOMEM;
+  for (i = 0; i < vn->vn_rxq.vq_nslots; i++) {
+    if (0 > (ret = vnet_rx_page(vn, &pf)))
+      return ret;
+    vnet_rx_fill(vn, i, pf);
+  }
+  return 0;
+}
+
+/*
+ * Finds the first virtio network device and makes it the interface.
+ * Started once the workqueue is, since the interrupt queues work; and
+ * only with VM, since received pages are anonymous memory.
+ */
+static __attribute__((unused)) void virtio_net_init(void) {
+  pcidev_t *pd;
+  uint32_t features;
+  vnet_t *vn;
+  int err, i;
+
+  if (NULL == (pd = pci_lookup_id(VIRTIO_VENDOR, VIRTIO_NET_DEVICE, NULL)))
+    return;
+  if (PCI_IO != pd->pci_bar[0].mem_type) {
+    dbg(DBG_NET, "virtio-net without an I/O BAR, skipped\n");
+    return;
+  }
+  if (NULL == (vn = kmalloc(sizeof(vnet_t))))
+    panic("Not enough memory for virtio network device struct!\n");
+  memset(vn, 0, sizeof(*vn));
+  vn->vn_port = pd->pci_bar[0].base_addr;
+  pci_write_config(pd, PCI_COMMAND,
+                   pci_read_config(pd, PCI_COMMAND, 2) | PCI_CMD_IO |
+                       PCI_CMD_BUSMASTER,
+                   2);
+
+  outb(vn->vn_port + VIRTIO_PCI_STATUS, 0);
+  outb(vn->vn_port + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+  outb(vn->vn_port + VIRTIO_PCI_STATUS,
+       VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+  features = inl(vn->vn_port + VIRTIO_PCI_HOST_FEATURES) & VIRTIO_NET_F_MAC;
+  outl(vn->vn_port + VIRTIO_PCI_GUEST_FEATURES, features);
+  if (0 > (err = vnet_setup(vn))) {
+    dbg(DBG_NET, "virtio-net setup failed: %d\n", err);
+    outb(vn->vn_port + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+    return; /* what was allocated is kept, being too little to matter */
+  }
+
+  vn->vn_if.ni_name = "vnet0";
+  for (i = 0; i < ETH_ALEN; i++) {
+    /* Without one from the device, qemu's default */
+    static const uint8_t mac[ETH_ALEN] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+    vn->vn_if.ni_mac[i] = (features & VIRTIO_NET_F_MAC)
+                              ? inb(vn->vn_port + VIRTIO_NET_MAC + i)
+                              : mac[i];
+  }
+  vn->vn_if.ni_xmit = vnet_xmit;
+  tasklet_init(&vn->vn_tasklet, vnet_tasklet, vn, INTR_VIRTIO_NET);
+  work_init(&vn->vn_work, vnet_work);
+  vnet = vn;
+  net_register(&vn->vn_if);
+
+  intr_register(INTR_VIRTIO_NET, vnet_intr);
+  intr_map(pd->pci_irq, INTR_VIRTIO_NET);
+  outb(vn->vn_port + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK |
+                                            VIRTIO_STATUS_DRIVER |
+                                            VIRTIO_STATUS_DRIVER_OK);
+  vnet_notify(vn, &vn->vn_rxq, VNET_RXQ);
+  dbg(DBG_NET, "Initialized virtio-net, %u receive and %u transmit slots\n",
+      vn->vn_rxq.vq_nslots, vn->vn_txq.vq_nslots);
+}
+#if defined(__DRIVERS__) && defined(__VM__)
+init_func(virtio_net_init);
+init_depends(workqueue_init);
+init_depends(net_init);
+#endif
@@ -171,6 +171,20 @@ pcidev_t *pci_lookup(uint8_t class, uint8_t subclass, uint8_t interface) {
   return NULL;
 }
 
+/*
+ * Given a vendor and device id, return the first device with them after
+ * 'after' in the list (from the start if 'after' is NULL), or NULL
+ */
+pcidev_t *pci_lookup_id(uint16_t vendor, uint16_t device, pcidev_t *after) {
+  list_link_t *link = after ? after->pci_link.l_next : pci_list.l_next;
+  for (; link != &pci_list; link = link->l_next) {
+    pcidev_t *dev = list_item(link, pcidev_t, pci_link);
+    if (dev->pci_vendorid == vendor && dev->pci_deviceid == device)
+      return dev;
+  }
+  return NULL;
+}
+
 /*
  * High level interface to reading from the PCI Tables
  */
@@ -5,6 +5,7 @@
 
 #include "main/io.h"
 #include "main/interrupt.h"
+#include "main/tasklet.h"
 
 #include "util/debug.h"
 
@@ -81,15 +82,34 @@ static const char *shift_scancodes = "\0"
 
 static keyboard_char_handler_t keyboard_handler = NULL;
 
-/* This is the function we register with the interrupt handler - it reads the
- * scancode and, if appropriate, call's the tty's receive_char function */
+/*
+ * The interrupt handler only reads the scancode and queues it; turning
+ * scancodes into characters and passing them on to the terminal (which
+ * echoes and cooks them) is left to keyboard_tasklet. The tasklet runs
+ * at the keyboard's IPL, so the handler never runs alongside it. A
+ * scancode arriving when the queue is full is dropped.
+ */
+#define KEYBOARD_QUEUE_SIZE 64
+static uint8_t keyboard_queue[KEYBOARD_QUEUE_SIZE];
+static uint32_t keyboard_qhead = 0; /* scancodes queued */
+static uint32_t keyboard_qtail = 0; /* scancodes taken off */
+static tasklet_t keyboard_tasklet;
+
+/* Reads the scancode and queues it for keyboard_tasklet */
 static void keyboard_intr_handler(regs_t *regs) {
-  uint8_t sc;     /* The scancode we receive */
+  uint8_t sc = inb(KEYBOARD_IN_PORT);
+
+  if (keyboard_qhead - keyboard_qtail < KEYBOARD_QUEUE_SIZE)
+    keyboard_queue[keyboard_qhead++ % KEYBOARD_QUEUE_SIZE] = sc;
+  tasklet_schedule(&keyboard_tasklet);
+}
+
+/* Handles a scancode and, if appropriate, calls the tty's receive_char
+ * function */
+static void keyboard_scancode(uint8_t sc) {
   int break_code; /* Was it a break code */
   /* the resulting character ('\0' -> ignored char) */
   uint8_t c = NO_CHAR;
-  /* Get the scancode */
-  sc = inb(KEYBOARD_IN_PORT);
 
   /* Separate out the break code */
   break_code = sc & BREAK_MASK;
@@ -165,7 +185,13 @@ static void keyboard_intr_handler(regs_t *regs) {
   }
 }
 
+static void keyboard_run(void *arg) {
+  while (keyboard_qtail != keyboard_qhead)
+    keyboard_scancode(keyboard_queue[keyboard_qtail++ % KEYBOARD_QUEUE_SIZE]);
+}
+
 void keyboard_init() {
+  tasklet_init(&keyboard_tasklet, keyboard_run, NULL, INTR_KEYBOARD);
   intr_map(IRQ_KEYBOARD, INTR_KEYBOARD);
   intr_register(INTR_KEYBOARD, keyboard_intr_handler);
 }
@@ -1,54 +1,65 @@
 #include "drivers/tty/n_tty.h"
 
+#include "config.h"
 #include "errno.h"
 
 #include "drivers/tty/driver.h"
 #include "drivers/tty/ldisc.h"
 #include "drivers/tty/tty.h"
 
+#include "fs/poll.h"
+
 #include "mm/kmalloc.h"
 
 #include "proc/kthread.h"
 
 #include "util/debug.h"
+#include "util/string.h"
 
 /* helpful macros */
 #define EOFC '\x4'
 #define ldisc_to_ntty(ldisc) CONTAINER_OF(ldisc, n_tty_t, ntty_ldisc)
-#define TTY_BUF_SIZE_T uint8_t
+#define TTY_BUF_MASK (TTY_BUF_SIZE - 1)
 
 static void n_tty_attach(tty_ldisc_t *ldisc, tty_device_t *tty);
 static void n_tty_detach(tty_ldisc_t *ldisc, tty_device_t *tty);
 static int n_tty_read(tty_ldisc_t *ldisc, void *buf, int len);
 static const char *n_tty_receive_char(tty_ldisc_t *ldisc, char c);
 static const char *n_tty_process_char(tty_ldisc_t *ldisc, char c);
+static int n_tty_process_buf(tty_ldisc_t *ldisc, const char *in, int len,
+                             char *out, int outlen, int *nout);
+static int n_tty_poll(tty_ldisc_t *ldisc, poll_table_t *pt);
 
 static tty_ldisc_ops_t n_tty_ops = {.attach = n_tty_attach,
                                     .detach = n_tty_detach,
                                     .read = n_tty_read,
                                     .receive_char = n_tty_receive_char,
-                                    .process_char = n_tty_process_char};
+                                    .process_char = n_tty_process_char,
+                                    .process_buf = n_tty_process_buf,
+                                    .poll = n_tty_poll};
 
 struct n_tty {
   kmutex_t rlock;
   ktqueue_t rwaitq;
-  char *inbuf;
-  TTY_BUF_SIZE_T rhead; // Raw head
-  TTY_BUF_SIZE_T rawtail; // Raw tail
-  TTY_BUF_SIZE_T ckdtail; // First uncooked character
+  pollq_t rpollq;
+  char *inbuf; // TTY_BUF_SIZE bytes
+  // Indices into inbuf, which are not wrapped; rhead <= ckdtail <= rawtail
+  uint32_t rhead; // Raw head
+  uint32_t rawtail; // Raw tail
+  uint32_t ckdtail; // First uncooked character
 
   tty_ldisc_t ntty_ldisc;
 };
 
 // Helper access functions
 char *get_rhead(struct n_tty *nt) {
-  return nt->inbuf + nt->rhead;
+  return nt->inbuf + (nt->rhead & TTY_BUF_MASK);
 }
 char *get_rawtail(struct n_tty *nt) {
-  return nt->inbuf + nt->rawtail;
+  return nt->inbuf + (nt->rawtail & TTY_BUF_MASK);
 }
 char *get_ckdtail(struct n_tty *nt) {
-  return nt->inbuf + nt->ckdtail;
+  return nt->inbuf + (nt->ckdtail & TTY_BUF_MASK);
 }
 
 tty_ldisc_t *n_tty_create() {
@@ -73,8 +84,10 @@ void n_tty_attach(tty_ldisc_t *ldisc, tty_device_t *tty) {
   n_tty_t *nt = ldisc_to_ntty(ldisc);
   kmutex_init(&nt->rlock);
   sched_queue_init(&nt->rwaitq);
+  pollq_init(&nt->rpollq);
 
-  nt->inbuf = kmalloc(sizeof(TTY_BUF_SIZE_T));
+  nt->inbuf = kmalloc(TTY_BUF_SIZE);
+  KASSERT(nt->inbuf);
   nt->rhead = 0;
   nt->rawtail = 0;
   nt->ckdtail = 0;
@@ -111,6 +124,9 @@ void n_tty_detach(tty_ldisc_t *ldisc, tty_device_t *tty) {
  *
  * Remember to handle newline characters and CTRL-D, or ASCII 0x04,
  * properly.
+ *
+ * The cooked bytes are copied out in at most two pieces, either side of
+ * the end of the buffer, each only looked through for the end of a line.
  */
 int n_tty_read(tty_ldisc_t *ldisc, void *buf, int len) {
   KASSERT(len >= 0);
@@ -125,23 +141,22 @@ int n_tty_read(tty_ldisc_t *ldisc, void *buf, int len) {
     kmutex_lock(&nt->rlock);
   }
 
-  int read = 0;
+  int read = 0, eol = 0;
   char *buff = buf;
-  // While rhead != cooked tail
-  for (; nt->rhead != nt->ckdtail && len; ++(nt->rhead)) {
-    buff[read] = *get_rhead(nt);
-    --len;
-    ++read;
-    if (buff[read-1] == '\n' || 
-        buff[read-1] == '\r' || 
-        buff[read-1] == 0x04) {
-      ++(nt->rhead);
-      break;
-    }
+  while (!eol && nt->rhead != nt->ckdtail && read < len) {
+    const char *from = get_rhead(nt);
+    int n = MIN((uint32_t)(len - read), nt->ckdtail - nt->rhead);
+    n = MIN(n, (int)(TTY_BUF_SIZE - (nt->rhead & TTY_BUF_MASK)));
+    int i;
+    for (i = 0; i < n && !eol; i++)
+      eol = from[i] == '\n' || from[i] == '\r' || from[i] == EOFC;
+    memcpy(buff + read, from, i);
+    read += i;
+    nt->rhead += i;
   }
-   
+
   kmutex_unlock(&nt->rlock);
-  dbg(DBG_TERM, "rhead: %d, ckdtail: %d, rawtail: %d\n",
+  dbg(DBG_TERM, "rhead: %u, ckdtail: %u, rawtail: %u\n",
       nt->rhead, nt->ckdtail, nt->rawtail);
   return read;
 }
@@ -158,6 +173,10 @@ int n_tty_read(tty_ldisc_t *ldisc, void *buf, int len) {
  * Return a null terminated string containing the characters which
  * need to be echoed to the screen. For a normal, printable character,
  * just the character to be echoed.
+ *
+ * Readers are only woken when a line is complete, or when the buffer
+ * fills without one, which cooks what there is so that a reader can make
+ * room, rather than everything after being dropped.
  */
 const char *n_tty_receive_char(tty_ldisc_t *ldisc, char c) {
   n_tty_t *nt = ldisc_to_ntty(ldisc);
@@ -177,14 +196,18 @@ const char *n_tty_receive_char(tty_ldisc_t *ldisc, char c) {
       dbg(DBG_TERM, "Ignoring backspace\n");
     }
     return out_string;
-  } else if (nt->rawtail + 1 != nt->rhead) {
+  } else if (nt->rawtail - nt->rhead < TTY_BUF_SIZE) {
     *get_rawtail(nt) = c;
     ++(nt->rawtail);
-    dbg(DBG_TERM, "added 0x%x, new rawtail %d\n", c, nt->rawtail);
-    if (c == '\r' || c == '\n' || c == 0) { // New line
+    dbg(DBG_TERM, "added 0x%x, new rawtail %u\n", c, nt->rawtail);
+    if (c == '\r' || c == '\n' || c == 0 ||
+        nt->rawtail - nt->rhead == TTY_BUF_SIZE) { // New line
       nt->ckdtail = nt->rawtail;
       sched_broadcast_on(&nt->rwaitq);
+      pollq_wakeup(&nt->rpollq);
     }
+  } else {
+    out_string[0] = '\0'; // Dropped, so not echoed
   }
   return out_string;
 }
@@ -206,3 +229,25 @@ const char *n_tty_process_char(tty_ldisc_t *ldisc, char c) {
   return out_string;
 }
 
+/* Output goes through unchanged, as in n_tty_process_char, except that a
+ * NUL, which would end process_char's string, is dropped */
+int n_tty_process_buf(tty_ldisc_t *ldisc, const char *in, int len, char *out,
+                      int outlen, int *nout) {
+  int i, n = 0;
+  for (i = 0; i < len && n < outlen; i++) {
+    if (in[i])
+      out[n++] = in[i];
+  }
+  *nout = n;
+  return i;
+}
+
+/*
+ * Like n_tty_read, there is input once a line has been cooked. Called
+ * with I/O blocked, so the keyboard can't cook one in between.
+ */
+int n_tty_poll(tty_ldisc_t *ldisc, poll_table_t *pt) {
+  n_tty_t *nt = ldisc_to_ntty(ldisc);
+  poll_wait(&nt->rpollq, pt);
+  return nt->rhead != nt->ckdtail;
+}
@@ -0,0 +1,225 @@
+/*
+ * Pseudo-terminals. The slave of a pair is an ordinary tty, with n_tty
+ * for its line discipline, whose driver is the master: what the slave
+ * outputs is queued for reads of the master, and what is written to the
+ * master is given to the line discipline a character at a time, the way
+ * the keyboard gives it to a virtual terminal, echo and all.
+ *
+ * There are no interrupts, so blocking I/O is nothing. A slave writer
+ * waits for the master to read when the queue is full, except for echo,
+ * which comes from the master's own writes and is dropped instead.
+ */
+
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+
+#include "drivers/bytedev.h"
+#include "drivers/tty/driver.h"
+#include "drivers/tty/pty.h"
+#include "drivers/tty/tty.h"
+
+#include "fs/poll.h"
+
+#include "mm/page.h"
+
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+/* Slave output queued for the master; a power of two */
+#define PTY_BUF_SIZE PAGE_SIZE
+#define PTY_BUF_MASK (PTY_BUF_SIZE - 1)
+
+#define driver_to_pty(driver) CONTAINER_OF(driver, pty_t, pt_driver)
+#define bd_to_pty(bd) CONTAINER_OF(bd, pty_t, pt_master)
+
+typedef struct pty {
+  tty_driver_t pt_driver; /* the slave's */
+  bytedev_t pt_master;
+
+  /* Slave output; head and tail are not wrapped */
+  char pt_buf[PTY_BUF_SIZE];
+  uint32_t pt_head; /* next byte queued */
+  uint32_t pt_tail; /* next byte read by the master */
+
+  int pt_echoing; /* in a master write, so output is echo */
+
+  ktqueue_t pt_readq;  /* master readers waiting for output */
+  ktqueue_t pt_writeq; /* slave writers waiting for room */
+  pollq_t pt_pollq;
+} pty_t;
+
+static void pty_provide_char(tty_driver_t *ttyd, char c);
+static void pty_provide_buf(tty_driver_t *ttyd, const char *buf, int len);
+static tty_driver_callback_t
+pty_register_callback_handler(tty_driver_t *ttyd,
+                              tty_driver_callback_t callback, void *arg);
+static tty_driver_callback_t
+pty_unregister_callback_handler(tty_driver_t *ttyd);
+static void *pty_block_io(tty_driver_t *ttyd);
+static void pty_unblock_io(tty_driver_t *ttyd, void *data);
+
+static tty_driver_ops_t pty_driver_ops = {
+    .provide_char = pty_provide_char,
+    .provide_buf = pty_provide_buf,
+    .register_callback_handler = pty_register_callback_handler,
+    .unregister_callback_handler = pty_unregister_callback_handler,
+    .block_io = pty_block_io,
+    .unblock_io = pty_unblock_io};
+
+static int pty_master_read(bytedev_t *dev, int offset, void *buf, int count);
+static int pty_master_write(bytedev_t *dev, int offset, const void *buf,
+                            int count);
+static int pty_master_poll(bytedev_t *dev, int events, poll_table_t *pt);
+
+static bytedev_ops_t pty_master_ops = {pty_master_read, pty_master_write,
+                                       NULL,            NULL,
+                                       NULL,            NULL,
+                                       pty_master_poll};
+
+static pty_t pty_table[NPTYS];
+
+void pty_init() {
+  int i;
+
+  for (i = 0; i < NPTYS; i++) {
+    pty_t *pt = &pty_table[i];
+
+    pt->pt_driver.ttd_ops = &pty_driver_ops;
+    pt->pt_driver.ttd_callback = NULL;
+    pt->pt_driver.ttd_callback_arg = NULL;
+    pt->pt_head = pt->pt_tail = 0;
+    pt->pt_echoing = 0;
+    sched_queue_init(&pt->pt_readq);
+    sched_queue_init(&pt->pt_writeq);
+    pollq_init(&pt->pt_pollq);
+
+    tty_attach(&pt->pt_driver, MKDEVID(PTY_SLAVE_MAJOR, i));
+
+    pt->pt_master.cd_id = MKDEVID(PTY_MASTER_MAJOR, i);
+    pt->pt_master.cd_ops = &pty_master_ops;
+    list_link_init(&pt->pt_master.cd_link);
+    if (bytedev_register(&pt->pt_master) != 0) {
+      panic("Error registering pty master as byte device\n");
+    }
+  }
+}
+
+static void pty_put(pty_t *pt, char c) {
+  pt->pt_buf[pt->pt_head++ & PTY_BUF_MASK] = c;
+}
+
+void pty_provide_char(tty_driver_t *ttyd, char c) {
+  pty_provide_buf(ttyd, &c, 1);
+}
+
+/* As a serial terminal, '\n' goes out as CR LF */
+void pty_provide_buf(tty_driver_t *ttyd, const char *buf, int len) {
+  KASSERT(NULL != ttyd);
+
+  pty_t *pt = driver_to_pty(ttyd);
+  int i;
+
+  for (i = 0; i < len; i++) {
+    while (PTY_BUF_SIZE - (pt->pt_head - pt->pt_tail) < 2) {
+      if (pt->pt_echoing)
+        goto out;
+      /* A cancelled writer's output is lost, as if it had been sent */
+      sched_broadcast_on(&pt->pt_readq);
+      pollq_wakeup(&pt->pt_pollq);
+      if (sched_cancellable_sleep_on(&pt->pt_writeq))
+        goto out;
+    }
+    if ('\n' == buf[i])
+      pty_put(pt, '\r');
+    pty_put(pt, buf[i]);
+  }
+out:
+  sched_broadcast_on(&pt->pt_readq);
+  pollq_wakeup(&pt->pt_pollq);
+}
+
+tty_driver_callback_t
+pty_register_callback_handler(tty_driver_t *ttyd,
+                              tty_driver_callback_t callback, void *arg) {
+  tty_driver_callback_t previous_callback;
+
+  KASSERT(NULL != ttyd);
+  previous_callback = ttyd->ttd_callback;
+  ttyd->ttd_callback = callback;
+  ttyd->ttd_callback_arg = arg;
+  return previous_callback;
+}
+
+tty_driver_callback_t pty_unregister_callback_handler(tty_driver_t *ttyd) {
+  tty_driver_callback_t previous_callback;
+
+  KASSERT(NULL != ttyd);
+  previous_callback = ttyd->ttd_callback;
+  ttyd->ttd_callback = NULL;
+  return previous_callback;
+}
+
+void *pty_block_io(tty_driver_t *ttyd) {
+  KASSERT(NULL != ttyd);
+  return NULL;
+}
+
+void pty_unblock_io(tty_driver_t *ttyd, void *data) { KASSERT(NULL != ttyd); }
+
+/* Blocks until the slave has output, then takes as much as fits, in at
+ * most two copies either side of the end of the queue */
+int pty_master_read(bytedev_t *dev, int offset, void *buf, int count) {
+  pty_t *pt = bd_to_pty(dev);
+  int read = 0, n;
+
+  while (pt->pt_head == pt->pt_tail) {
+    if (sched_cancellable_sleep_on(&pt->pt_readq))
+      return -EINTR;
+  }
+  while (read < count && pt->pt_head != pt->pt_tail) {
+    n = MIN((uint32_t)(count - read), pt->pt_head - pt->pt_tail);
+    n = MIN(n, (int)(PTY_BUF_SIZE - (pt->pt_tail & PTY_BUF_MASK)));
+    memcpy((char *)buf + read, pt->pt_buf + (pt->pt_tail & PTY_BUF_MASK), n);
+    pt->pt_tail += n;
+    read += n;
+  }
+  sched_broadcast_on(&pt->pt_writeq);
+  return read;
+}
+
+/* Typed input, so carriage return and delete become what the keyboard
+ * gives for enter and backspace */
+int pty_master_write(bytedev_t *dev, int offset, const void *buf, int count) {
+  pty_t *pt = bd_to_pty(dev);
+  const char *in = buf;
+  char c;
+  int i;
+
+  if (NULL == pt->pt_driver.ttd_callback)
+    return -ENXIO;
+  pt->pt_echoing = 1;
+  for (i = 0; i < count; i++) {
+    c = in[i];
+    if ('\r' == c)
+      c = '\n';
+    else if (0x7f == c)
+      c = '\b';
+    pt->pt_driver.ttd_callback(pt->pt_driver.ttd_callback_arg, c);
+  }
+  pt->pt_echoing = 0;
+  return count;
+}
+
+/* Writes never block, any more than typing does */
+int pty_master_poll(bytedev_t *dev, int events, poll_table_t *pt) {
+  pty_t *p = bd_to_pty(dev);
+  int ready = POLLOUT;
+
+  poll_wait(&p->pt_pollq, pt);
+  if (p->pt_head != p->pt_tail)
+    ready |= POLLIN;
+  return ready;
+}
@@ -5,6 +5,7 @@
 
 #include "main/io.h"
 
+#include "mm/page.h"
 #include "mm/pagetable.h"
 
 #include "util/debug.h"
@@ -14,6 +15,11 @@
 /* Note that this is a short * as video memory is addressed in 2-byte chunks -
  * 1st byte is attributes, 2nd byte is char */
 #define PHYS_VIDEORAM 0xb8000
+/* Colour text mode has 32K of video memory, room for SCREEN_VRAM_ROWS rows,
+ * of which the DISPLAY_HEIGHT from screen_origin on are shown */
+#define SCREEN_VRAM_PAGES 8
+#define SCREEN_VRAM_ROWS                                                       \
+  (SCREEN_VRAM_PAGES * PAGE_SIZE / (DISPLAY_WIDTH * sizeof(uint16_t)))
 /* Port addresses for the CRT controller */
 #define CRT_CONTROL_ADDR 0x3d4
 #define CRT_CONTROL_DATA 0x3d5
@@ -21,10 +27,13 @@
 /* Addresses we can pass to the CRT_CONTROLL_ADDR port */
 #define CURSOR_HIGH 0x0e
 #define CURSOR_LOW 0x0f
+/* Where the display starts in video memory, in characters */
+#define START_HIGH 0x0c
+#define START_LOW 0x0d
 /* Right now, we shouldn't need cursor high to change from zero */
 
 /* Default attribs */
-#define DEFAULT_ATTRIB 0x0F
+#define DEFAULT_ATTRIB SCREEN_DEFAULT_ATTRIB
 
 /* This is basically a "logic-free" file - it interfaces directly with the
  * hardware, but higher-level terminal output logic will be dealt with elsewhere
@@ -32,16 +41,32 @@
 
 static uint16_t *videoram;
 
+/* The row of video memory at the top of the display */
+static int screen_origin = 0;
+
+/* The cell at (x, y) on the display */
+#define screen_cell(x, y) (videoram + (screen_origin + (y)) * DISPLAY_WIDTH + (x))
+
+static void screen_set_start(int row) {
+  uint16_t pos = row * DISPLAY_WIDTH;
+
+  outb(CRT_CONTROL_ADDR, START_HIGH);
+  outb(CRT_CONTROL_DATA, pos >> 8);
+  outb(CRT_CONTROL_ADDR, START_LOW);
+  outb(CRT_CONTROL_DATA, pos & 0xff);
+}
+
 /* Needs to get a virtual memory mapping for video memory */
 void screen_init() {
-  videoram = (uint16_t *)pt_phys_perm_map(PHYS_VIDEORAM, 1);
+  videoram = (uint16_t *)pt_phys_perm_map(PHYS_VIDEORAM, SCREEN_VRAM_PAGES);
+  screen_set_start(screen_origin);
 }
 
 /* Copied from OSDev */
 void screen_move_cursor(uint8_t x, uint8_t y) {
   /* Commented out until we have kasserts */
   /* KASSERT(cursor_col < DISPLAY_WIDTH && cursor_row < DISPLAY_HEIGHT); */
-  uint16_t pos = y * DISPLAY_WIDTH + x;
+  uint16_t pos = (screen_origin + y) * DISPLAY_WIDTH + x;
 
   outb(CRT_CONTROL_ADDR, CURSOR_HIGH);
   outb(CRT_CONTROL_DATA, pos >> 8);
@@ -55,24 +80,47 @@ void screen_move_cursor(uint8_t x, uint8_t y) {
 void screen_putchar(char c, uint8_t x, uint8_t y) {
   /* Update the character at the current cursor position, using the default
    * attributes */
-  *(videoram + (y * DISPLAY_WIDTH + x)) = (DEFAULT_ATTRIB << 8) | c;
+  *screen_cell(x, y) = (DEFAULT_ATTRIB << 8) | c;
 }
 
 void screen_putchar_attrib(char c, uint8_t x, uint8_t y, uint8_t attrib) {
   /* Similarly, but with custom attributes */
-  *(videoram + (y * DISPLAY_WIDTH + x)) = (attrib << 8) | c;
+  *screen_cell(x, y) = (attrib << 8) | c;
 }
 
 void screen_putbuf(const char *buf) {
+  uint16_t *start = screen_cell(0, 0);
   uint16_t *pos;
-  for (pos = videoram; pos - videoram < DISPLAY_WIDTH * DISPLAY_HEIGHT;
-       buf++, pos++)
+  for (pos = start; pos - start < DISPLAY_WIDTH * DISPLAY_HEIGHT; buf++, pos++)
     *pos = (DEFAULT_ATTRIB << 8) | *buf;
 }
 
 /* In theory, this one should be much faster, but it probably isn't */
 void screen_putbuf_attrib(const uint16_t *buf) {
-  memcpy(videoram, buf, DISPLAY_WIDTH * DISPLAY_HEIGHT * 2);
+  memcpy(screen_cell(0, 0), buf, DISPLAY_WIDTH * DISPLAY_HEIGHT * 2);
+}
+
+void screen_putrow(const uint16_t *row, uint8_t y) {
+  memcpy(screen_cell(0, y), row, DISPLAY_WIDTH * sizeof(uint16_t));
+}
+
+/*
+ * The display is a window onto video memory, so scrolling is moving the
+ * window down. Only when it hits the end of video memory are the rows
+ * still shown copied, back to the start.
+ */
+void screen_scroll(int lines) {
+  KASSERT(0 < lines && lines < DISPLAY_HEIGHT);
+
+  if (screen_origin + lines + DISPLAY_HEIGHT > (int)SCREEN_VRAM_ROWS) {
+    /* The rows are near the end, so they don't overlap their new place */
+    memcpy(videoram, screen_cell(0, lines),
+            (DISPLAY_HEIGHT - lines) * DISPLAY_WIDTH * sizeof(uint16_t));
+    screen_origin = 0;
+  } else {
+    screen_origin += lines;
+  }
+  screen_set_start(screen_origin);
 }
 
 void screen_clear() {
@@ -82,6 +130,7 @@ void screen_clear() {
    * attribute settings . . . ) */
   uint16_t blank = (DEFAULT_ATTRIB << 8) | 0x20;
   uint16_t *pos;
-  for (pos = videoram; pos - videoram < DISPLAY_WIDTH * DISPLAY_HEIGHT; pos++)
+  uint16_t *start = screen_cell(0, 0);
+  for (pos = start; pos - start < DISPLAY_WIDTH * DISPLAY_HEIGHT; pos++)
     *pos = blank;
 }
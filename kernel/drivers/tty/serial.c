@@ -0,0 +1,244 @@
+/*
+ * A tty driver for a 16550 UART. Both directions run off the port's
+ * interrupt: received bytes are handed to the tty as they arrive, and
+ * output is queued in a ring which the transmitter interrupt drains a
+ * FIFO's worth at a time. Nothing polls the port unless the ring is full,
+ * when the writer waits on the port for room as dbg_puts() would.
+ *
+ * The port is COM2; COM1 carries debug output (see util/debug.c).
+ */
+
+#include "config.h"
+
+#include "drivers/tty/serial.h"
+
+#include "drivers/tty/driver.h"
+
+#include "main/interrupt.h"
+#include "main/io.h"
+
+#include "mm/page.h"
+
+#include "util/debug.h"
+
+#define SERIAL_PORT 0x2f8
+#define IRQ_SERIAL 3
+
+/* Registers, as offsets from the port */
+#define UART_DATA 0 /* receive buffer / transmit holding */
+#define UART_IER 1  /* interrupt enable */
+#define UART_FCR 2  /* FIFO control */
+#define UART_LCR 3  /* line control */
+#define UART_MCR 4  /* modem control */
+#define UART_LSR 5  /* line status */
+#define UART_MSR 6  /* modem status */
+#define UART_SCR 7  /* scratch */
+
+#define UART_IER_RX 0x01   /* data has been received */
+#define UART_IER_THRE 0x02 /* the transmitter's FIFO is empty */
+
+#define UART_LSR_DR 0x01   /* data ready */
+#define UART_LSR_THRE 0x20 /* transmit FIFO empty */
+
+/* DTR and RTS, and OUT2, which on a PC connects the UART to its IRQ */
+#define UART_MCR_ENABLE 0x0b
+
+/* Bytes the UART takes at once when its FIFO is empty */
+#define UART_FIFO_SIZE 16
+
+#define SERIAL_TXBUF_SIZE PAGE_SIZE
+#define SERIAL_TXBUF_MASK (SERIAL_TXBUF_SIZE - 1)
+
+#define driver_to_serial(driver) CONTAINER_OF(driver, serial_t, st_driver)
+
+typedef struct serial {
+  uint16_t st_port;
+
+  /* Output not yet given to the UART; head and tail are not wrapped */
+  char st_txbuf[SERIAL_TXBUF_SIZE];
+  uint32_t st_txhead; /* next byte queued */
+  uint32_t st_txtail; /* next byte sent */
+
+  tty_driver_t st_driver;
+} serial_t;
+
+static void serial_provide_char(tty_driver_t *ttyd, char c);
+static void serial_provide_buf(tty_driver_t *ttyd, const char *buf, int len);
+static tty_driver_callback_t
+serial_register_callback_handler(tty_driver_t *ttyd,
+                                 tty_driver_callback_t callback, void *arg);
+static tty_driver_callback_t
+serial_unregister_callback_handler(tty_driver_t *ttyd);
+static void *serial_block_io(tty_driver_t *ttyd);
+static void serial_unblock_io(tty_driver_t *ttyd, void *data);
+
+static tty_driver_ops_t serial_driver_ops = {
+    .provide_char = serial_provide_char,
+    .provide_buf = serial_provide_buf,
+    .register_callback_handler = serial_register_callback_handler,
+    .unregister_callback_handler = serial_unregister_callback_handler,
+    .block_io = serial_block_io,
+    .unblock_io = serial_unblock_io};
+
+static serial_t serial_term;
+static int serial_nterms = 0;
+
+/*
+ * Gives the UART as much queued output as it takes now, and asks for an
+ * interrupt when it can take more, if there is more. I/O must be blocked.
+ */
+static void serial_tx_push(serial_t *st) {
+  uint32_t n;
+
+  if (st->st_txtail != st->st_txhead &&
+      (inb(st->st_port + UART_LSR) & UART_LSR_THRE)) {
+    n = MIN(UART_FIFO_SIZE, st->st_txhead - st->st_txtail);
+    while (n--)
+      outb(st->st_port + UART_DATA,
+           st->st_txbuf[st->st_txtail++ & SERIAL_TXBUF_MASK]);
+  }
+  outb(st->st_port + UART_IER,
+       UART_IER_RX | (st->st_txtail != st->st_txhead ? UART_IER_THRE : 0));
+}
+
+static void serial_tx_put(serial_t *st, char c) {
+  while (st->st_txhead - st->st_txtail == SERIAL_TXBUF_SIZE) {
+    /* Full: wait for the port to take some */
+    while (!(inb(st->st_port + UART_LSR) & UART_LSR_THRE))
+      ;
+    serial_tx_push(st);
+  }
+  st->st_txbuf[st->st_txhead++ & SERIAL_TXBUF_MASK] = c;
+}
+
+/*
+ * Terminals on the other end send carriage return for enter and delete
+ * for backspace, which are made what the keyboard gives. Anything else
+ * the port says, about the line or the modem, is read to quiet it.
+ */
+static void serial_intr_handler(regs_t *regs) {
+  serial_t *st = &serial_term;
+  uint8_t lsr;
+  char c;
+
+  while ((lsr = inb(st->st_port + UART_LSR)) & UART_LSR_DR) {
+    c = inb(st->st_port + UART_DATA);
+    if ('\r' == c)
+      c = '\n';
+    else if (0x7f == c)
+      c = '\b';
+    if (NULL != st->st_driver.ttd_callback)
+      st->st_driver.ttd_callback(st->st_driver.ttd_callback_arg, c);
+  }
+  inb(st->st_port + UART_MSR);
+  serial_tx_push(st);
+}
+
+/* A UART has a scratch register, which holds what is written to it */
+static int serial_probe(uint16_t port) {
+  outb(port + UART_SCR, 0x5a);
+  if (0x5a != inb(port + UART_SCR))
+    return 0;
+  outb(port + UART_SCR, 0xa5);
+  return 0xa5 == inb(port + UART_SCR);
+}
+
+void serial_init() {
+  serial_t *st = &serial_term;
+
+  if (!SERIAL_TTY || !serial_probe(SERIAL_PORT)) {
+    dbg(DBG_TERM, "no serial terminal\n");
+    return;
+  }
+  st->st_port = SERIAL_PORT;
+  st->st_txhead = st->st_txtail = 0;
+  st->st_driver.ttd_ops = &serial_driver_ops;
+  st->st_driver.ttd_callback = NULL;
+  st->st_driver.ttd_callback_arg = NULL;
+
+  /* As dbg_init() sets COM1 up */
+  outb(st->st_port + UART_IER, 0x00);
+  outb(st->st_port + UART_LCR, 0x80); /* Enable DLAB (set baud rate divisor) */
+  outb(st->st_port + 0, 0x03);        /* Set divisor to 3 (lo byte) 38400 baud */
+  outb(st->st_port + 1, 0x00);        /*                  (hi byte) */
+  outb(st->st_port + UART_LCR, 0x03); /* 8 bits, no parity, one stop bit */
+  outb(st->st_port + UART_FCR, 0xc7); /* Enable FIFO, clear them, 14-byte trigger */
+  outb(st->st_port + UART_MCR, UART_MCR_ENABLE);
+
+  intr_map(IRQ_SERIAL, INTR_SERIAL);
+  intr_register(INTR_SERIAL, serial_intr_handler);
+  outb(st->st_port + UART_IER, UART_IER_RX);
+  serial_nterms = 1;
+  dbg(DBG_TERM, "serial terminal on port 0x%x\n", st->st_port);
+}
+
+int serial_num_terminals() { return serial_nterms; }
+
+tty_driver_t *serial_get_tty_driver(int id) {
+  if (id < 0 || id >= serial_nterms)
+    return NULL;
+  return &serial_term.st_driver;
+}
+
+void serial_provide_char(tty_driver_t *ttyd, char c) {
+  serial_provide_buf(ttyd, &c, 1);
+}
+
+/* A newline goes out as the carriage return and line feed a terminal
+ * wants; the virtual terminals do both for one '\n' too */
+void serial_provide_buf(tty_driver_t *ttyd, const char *buf, int len) {
+  KASSERT(NULL != ttyd);
+
+  serial_t *st = driver_to_serial(ttyd);
+  uint8_t oldipl = intr_getipl();
+  int i;
+
+  if (oldipl < INTR_SERIAL)
+    intr_setipl(INTR_SERIAL);
+  for (i = 0; i < len; i++) {
+    if ('\n' == buf[i])
+      serial_tx_put(st, '\r');
+    serial_tx_put(st, buf[i]);
+  }
+  serial_tx_push(st);
+  if (oldipl < INTR_SERIAL)
+    intr_setipl(oldipl);
+}
+
+tty_driver_callback_t
+serial_register_callback_handler(tty_driver_t *ttyd,
+                                 tty_driver_callback_t callback, void *arg) {
+  tty_driver_callback_t previous_callback;
+
+  KASSERT(NULL != ttyd);
+  previous_callback = ttyd->ttd_callback;
+  ttyd->ttd_callback = callback;
+  ttyd->ttd_callback_arg = arg;
+  return previous_callback;
+}
+
+tty_driver_callback_t serial_unregister_callback_handler(tty_driver_t *ttyd) {
+  tty_driver_callback_t previous_callback;
+
+  KASSERT(NULL != ttyd);
+  previous_callback = ttyd->ttd_callback;
+  ttyd->ttd_callback = NULL;
+  return previous_callback;
+}
+
+void *serial_block_io(tty_driver_t *ttyd) {
+  uint8_t oldipl;
+  KASSERT(NULL != ttyd);
+
+  oldipl = intr_getipl();
+  intr_setipl(INTR_SERIAL);
+  return (void *)(uintptr_t)oldipl;
+}
+
+void serial_unblock_io(tty_driver_t *ttyd, void *data) {
+  uint8_t oldipl = (uint8_t)(uintptr_t)data;
+  KASSERT(NULL != ttyd);
+
+  KASSERT(intr_getipl() == INTR_SERIAL && "Serial terminal I/O not blocked");
+  intr_setipl(oldipl);
+}
@@ -6,15 +6,23 @@
 #include "drivers/tty/keyboard.h"
 #include "drivers/tty/ldisc.h"
 #include "drivers/tty/n_tty.h"
+#include "drivers/tty/pty.h"
 #include "drivers/tty/screen.h"
+#include "drivers/tty/serial.h"
 #include "drivers/tty/virtterm.h"
 
+#include "fs/poll.h"
+
 #include "mm/kmalloc.h"
 
 #include "util/debug.h"
+#include "util/string.h"
 
 #define bd_to_tty(bd) CONTAINER_OF(bd, tty_device_t, tty_cdev)
 
+/* Output is put through the line discipline this much at a time */
+#define TTY_WRITE_CHUNK 256
+
 /**
  * The callback function called by the virtual terminal subsystem when
  * a key is pressed.
@@ -49,6 +57,16 @@ static int tty_read(bytedev_t *dev, int offset, void *buf, int count);
  */
 static int tty_write(bytedev_t *dev, int offset, const void *buf, int count);
 
+/**
+ * Reports whether a tty can be read or written without blocking.
+ *
+ * @param dev the tty to poll
+ * @param events the events of interest
+ * @param pt the poller to wake when a line arrives, or NULL
+ * @return the events which apply now
+ */
+static int tty_poll(bytedev_t *dev, int events, poll_table_t *pt);
+
 /**
  * Echoes out to the tty driver.
  *
@@ -58,62 +76,75 @@ static int tty_write(bytedev_t *dev, int offset, const void *buf, int count);
 static void tty_echo(tty_driver_t *driver, const char *out);
 
 static bytedev_ops_t tty_bytedev_ops = {tty_read, tty_write, NULL,
-                                        NULL,     NULL,      NULL};
+                                        NULL,     NULL,      NULL,
+                                        tty_poll};
+
+tty_device_t *tty_attach(tty_driver_t *ttyd, devid_t devid) {
+  tty_device_t *tty;
+  tty_ldisc_t *ldisc;
+  int id = MINOR(devid);
+
+  KASSERT(NULL != ttyd);
+  KASSERT(NULL != ttyd->ttd_ops);
+  KASSERT(NULL != ttyd->ttd_ops->register_callback_handler);
+
+  tty = tty_create(ttyd, id);
+  if (NULL == tty) {
+    panic("Not enough memory to allocate tty\n");
+  }
+  tty->tty_cdev.cd_id = devid;
+
+  if (NULL !=
+      ttyd->ttd_ops->register_callback_handler(
+          ttyd, tty_global_driver_callback, (void *)tty)) {
+    panic("Callback already registered "
+          "to terminal %d\n",
+          id);
+  }
+
+  dbg(DBG_TERM, "n_tty_create\n");
+  ldisc = n_tty_create();
+  if (NULL == ldisc) {
+    panic("Not enough memory to allocate "
+          "line discipline\n");
+  }
+  KASSERT(NULL != ldisc);
+  KASSERT(NULL != ldisc->ld_ops);
+  KASSERT(NULL != ldisc->ld_ops->attach);
+  dbg(DBG_TERM, "ldisc attach\n");
+  ldisc->ld_ops->attach(ldisc, tty);
+
+  dbg(DBG_TERM, "bytedev_register\n");
+  if (bytedev_register(&tty->tty_cdev) != 0) {
+    panic("Error registering tty as byte device\n");
+  }
+  return tty;
+}
 
 void tty_init() {
   dbg(DBG_TERM, "scree, vt, keyboard init\n");
   screen_init();
   vt_init();
   keyboard_init();
+  serial_init();
 
   /*
    * Create NTERMS tty's, all with the default line discipline
-   * and a virtual terminal driver.
+   * and a virtual terminal driver, then one for each serial
+   * terminal.
    */
   int nterms, i;
 
   nterms = vt_num_terminals();
   for (i = 0; i < nterms; ++i) {
     dbg(DBG_TERM, "creating nterm %d\n", i);
-    tty_driver_t *ttyd;
-    tty_device_t *tty;
-    tty_ldisc_t *ldisc;
-
-    ttyd = vt_get_tty_driver(i);
-    KASSERT(NULL != ttyd);
-    KASSERT(NULL != ttyd->ttd_ops);
-    KASSERT(NULL != ttyd->ttd_ops->register_callback_handler);
-
-    tty = tty_create(ttyd, i);
-    if (NULL == tty) {
-      panic("Not enough memory to allocate tty\n");
-    }
-
-    if (NULL !=
-        ttyd->ttd_ops->register_callback_handler(
-            ttyd, tty_global_driver_callback, (void *)tty)) {
-      panic("Callback already registered "
-            "to terminal %d\n",
-            i);
-    }
-
-    dbg(DBG_TERM, "n_tty_create\n");
-    ldisc = n_tty_create();
-    if (NULL == ldisc) {
-      panic("Not enough memory to allocate "
-            "line discipline\n");
-    }
-    KASSERT(NULL != ldisc);
-    KASSERT(NULL != ldisc->ld_ops);
-    KASSERT(NULL != ldisc->ld_ops->attach);
-    dbg(DBG_TERM, "ldisc attach\n");
-    ldisc->ld_ops->attach(ldisc, tty);
-
-    dbg(DBG_TERM, "bytedev_register\n");
-    if (bytedev_register(&tty->tty_cdev) != 0) {
-      panic("Error registering tty as byte device\n");
-    }
+    tty_attach(vt_get_tty_driver(i), MKDEVID(TTY_MAJOR, i));
+  }
+  for (i = 0; i < serial_num_terminals(); ++i) {
+    dbg(DBG_TERM, "creating serial terminal %d\n", i);
+    tty_attach(serial_get_tty_driver(i), MKDEVID(TTY_MAJOR, nterms + i));
   }
+  pty_init();
 }
 
 /*
@@ -161,13 +192,11 @@ void tty_global_driver_callback(void *arg, char c) {
 }
 
 /*
- * You should use the driver's provide_char function to output
- * each character of the string 'out'.
+ * The driver's provide_buf outputs the whole string 'out' at once.
  */
 void tty_echo(tty_driver_t *driver, const char *out) {
   dbg(DBG_TERM, "\n");
-  for (int i = 0; out[i] != '\0'; ++i)
-    driver->ttd_ops->provide_char(driver, out[i]);
+  driver->ttd_ops->provide_buf(driver, out, strlen(out));
 }
 
 /*
@@ -185,9 +214,10 @@ int tty_read(bytedev_t *dev, int offset, void *buf, int count) {
 }
 
 /*
- * In this function, you should block I/O, process each
- * character with the line discipline and output the result to
- * the driver, and then unblock I/O.
+ * In this function, you should block I/O, process the characters
+ * with the line discipline and output the result to the driver, and
+ * then unblock I/O. Both are done a chunk at a time, through a buffer
+ * on the stack.
  *
  * Important: You should return the number of bytes processed,
  * _NOT_ the number of bytes written out to the driver.
@@ -195,16 +225,30 @@ int tty_read(bytedev_t *dev, int offset, void *buf, int count) {
 int tty_write(bytedev_t *dev, int offset, const void *buf, int count) {
   dbg(DBG_TERM, "\n");
   tty_device_t *td = bd_to_tty(dev);
+  char out[TTY_WRITE_CHUNK];
+  int written = 0, nout;
   void *data = td->tty_driver->ttd_ops->block_io(td->tty_driver);
-  int written = 0;
-  for (int i = 0; i < count; ++i) {
-    const char *out = td->tty_ldisc->ld_ops->process_char(td->tty_ldisc, *((char *)buf+i));
-    if (out[0])
-      td->tty_driver->ttd_ops->provide_char(td->tty_driver, out[0]);
-    kfree((void *)out);
-    ++written;
+  while (written < count) {
+    written += td->tty_ldisc->ld_ops->process_buf(
+        td->tty_ldisc, (const char *)buf + written, count - written, out,
+        sizeof(out), &nout);
+    td->tty_driver->ttd_ops->provide_buf(td->tty_driver, out, nout);
   }
   td->tty_driver->ttd_ops->unblock_io(td->tty_driver, data);
   return written;
 }
 
+/*
+ * Writes never block. Reads block until the line discipline has a line,
+ * which it learns about from the keyboard interrupt, so block I/O while
+ * asking it.
+ */
+int tty_poll(bytedev_t *dev, int events, poll_table_t *pt) {
+  tty_device_t *td = bd_to_tty(dev);
+  int ready = POLLOUT;
+  void *data = td->tty_driver->ttd_ops->block_io(td->tty_driver);
+  if (td->tty_ldisc->ld_ops->poll(td->tty_ldisc, pt))
+    ready |= POLLIN;
+  td->tty_driver->ttd_ops->unblock_io(td->tty_driver, data);
+  return ready;
+}
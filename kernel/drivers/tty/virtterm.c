@@ -18,9 +18,23 @@
 /* Total size of the scroll buffer */
 #define SCROLL_BUFSIZE (5 * DISPLAY_SIZE)
 
+/* The number of rows in the scroll buffer */
+#define SCROLL_ROWS (SCROLL_BUFSIZE / DISPLAY_WIDTH)
+
+/* What space not yet written holds */
+#define VT_BLANK SCREEN_CELL(' ', SCREEN_DEFAULT_ATTRIB)
+
+/* Where a terminal is in an escape sequence */
+#define VT_ESC_NONE 0
+#define VT_ESC_START 1 /* seen ESC */
+#define VT_ESC_CSI 2   /* seen ESC [, reading parameters */
+
+#define VT_ESC_MAXPARAMS 8
+
 #define driver_to_vt(driver) CONTAINER_OF(driver, virtterm_t, vt_driver)
 
 static void vt_provide_char(tty_driver_t *ttyd, char c);
+static void vt_provide_buf(tty_driver_t *ttyd, const char *buf, int len);
 static tty_driver_callback_t
 vt_register_callback_handler(tty_driver_t *ttyd, tty_driver_callback_t callback,
                              void *arg);
@@ -31,6 +45,7 @@ static void vt_unblock_io(tty_driver_t *ttyd, void *data);
 
 static tty_driver_ops_t vt_driver_ops = {
     .provide_char = vt_provide_char,
+    .provide_buf = vt_provide_buf,
     .register_callback_handler = vt_register_callback_handler,
     .unregister_callback_handler = vt_unregister_callback_handler,
     .block_io = vt_block_io,
@@ -53,11 +68,22 @@ typedef struct virtterm {
   /* Cursor position (in buffer, not on screen) */
   int vt_cursor;
 
-  /* scroll buffer */
-  char vt_buf[SCROLL_BUFSIZE];
+  /* scroll buffer, in the cells video memory takes, so that rows are
+   * copied straight onto the screen */
+  uint16_t vt_buf[SCROLL_BUFSIZE];
 
-  /* "Temporary buffer" */
-  char vt_tempbuf[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+  /* The attributes characters are written with, as the last ANSI "select
+   * graphic rendition" sequence set them */
+  uint8_t vt_attrib;
+
+  /* The escape sequence being read */
+  int vt_esc;
+  int vt_esc_nparams;
+  int vt_esc_params[VT_ESC_MAXPARAMS];
+
+  /* The rows of the scroll buffer changed since the screen was drawn,
+   * one bit each */
+  uint32_t vt_dirty[(SCROLL_ROWS + 31) / 32];
 
   tty_driver_t vt_driver;
 } virtterm_t;
@@ -65,6 +91,12 @@ typedef struct virtterm {
 static virtterm_t vt_terms[NTERMS];
 static virtterm_t *vt_curterm;
 
+/* A row of VT_BLANK */
+static uint16_t vt_blank_row[DISPLAY_WIDTH];
+
+/* vt_curterm's top when the screen was last drawn */
+static int vt_drawn_top;
+
 /**
  * Called when a key is pressed. Sends the key press to the current
  * terminal if there is one.
@@ -85,11 +117,25 @@ static void vt_keyboard_handler(char c);
  */
 static int vt_handle_char(virtterm_t *vt, char c);
 
+/**
+ * Feeds a character to the terminal's escape sequence parser.
+ *
+ * @return true if the character was part of an escape sequence, and so
+ * is not to be displayed
+ */
+static int vt_handle_escape(virtterm_t *vt, char c);
+
 /**
  * Redraws the entire screen.
  */
 static void vt_redraw();
 
+/**
+ * Brings the screen up to date with the given terminal, if it is the
+ * current one, redrawing only the rows which have changed.
+ */
+static void vt_flush(virtterm_t *vt);
+
 /**
  * Redraws only the cursor.
  */
@@ -115,11 +161,26 @@ static void vt_cursor_redraw();
 #define buf_inc(ptr) buf_add(ptr, 1)
 #define buf_dec(ptr) buf_add(ptr, -1)
 
+/* Marks the row holding position i as changed */
+#define vt_mark_dirty(vt, i)                                                   \
+  ((vt)->vt_dirty[(i) / DISPLAY_WIDTH / 32] |= 1U << ((i) / DISPLAY_WIDTH % 32))
+#define vt_is_dirty(vt, i)                                                     \
+  ((vt)->vt_dirty[(i) / DISPLAY_WIDTH / 32] & (1U << ((i) / DISPLAY_WIDTH % 32)))
+
+/* Blanks n cells */
+static void vt_fill(uint16_t *cells, int n) {
+  while (n-- > 0)
+    *cells++ = VT_BLANK;
+}
+
 void vt_init() {
   /* Initialize NTERMS virtual terminals */
   int i;
+  vt_fill(vt_blank_row, DISPLAY_WIDTH);
   for (i = 0; i < NTERMS; i++) {
-    memset(vt_terms[i].vt_buf, 0, SCROLL_BUFSIZE);
+    vt_fill(vt_terms[i].vt_buf, SCROLL_BUFSIZE);
+    vt_terms[i].vt_attrib = SCREEN_DEFAULT_ATTRIB;
+    vt_terms[i].vt_esc = VT_ESC_NONE;
     vt_terms[i].vt_top = 0;
     vt_terms[i].vt_cursor = 0;
     vt_terms[i].vt_head = 0;
@@ -208,44 +269,35 @@ void vt_print_shutdown() {
     ttyd->ttd_ops->provide_char(ttyd, str[i]);
   for (i = 0; i < 14; i++)
     ttyd->ttd_ops->provide_char(ttyd, '\n');
+  vt_flush(vt_curterm);
 }
 
 void vt_provide_char(tty_driver_t *ttyd, char c) {
+  vt_provide_buf(ttyd, &c, 1);
+}
+
+/*
+ * Characters only go into the buffer here, marking their rows dirty; the
+ * screen catches up in vt_flush, when the I/O is unblocked at the end of a
+ * tty write or after a key's echo, however many writes came in between.
+ */
+void vt_provide_buf(tty_driver_t *ttyd, const char *buf, int len) {
   KASSERT(NULL != ttyd);
 
   virtterm_t *vt = driver_to_vt(ttyd);
+  int i;
 
-  /* Store for optimizing */
-  int old_cursor = vt->vt_cursor;
-  int old_top = vt->vt_top;
-  int can_write_char;
-
-  /* If cursor is not on the screen, we move top */
-  if (circ_dist(vt->vt_cursor, vt->vt_top) >= DISPLAY_SIZE) {
-    /* Cursor should be on the last row in this case */
-
-    vt->vt_top = next_row(vt->vt_cursor);
-    buf_add(vt->vt_top, -DISPLAY_SIZE);
-  }
-
-  can_write_char = vt_handle_char(vt, c);
+  for (i = 0; i < len; i++) {
+    /* If cursor is not on the screen, we move top */
+    if (circ_dist(vt->vt_cursor, vt->vt_top) >= DISPLAY_SIZE) {
+      /* Cursor should be on the last row in this case */
 
-  /* Redraw if it's the current terminal */
-  if (vt_curterm == vt) {
-    /*
-     * Check if we can optimize (just put 1 char instead
-     * of redrawing screen)
-     */
-    if (old_top == vt->vt_top) {
-      if (can_write_char) {
-        int rel_cursor = circ_dist(old_cursor, vt->vt_top);
-        screen_putchar(c, rel_cursor % DISPLAY_WIDTH,
-                       rel_cursor / DISPLAY_WIDTH);
-      }
-      vt_cursor_redraw();
-    } else {
-      vt_redraw();
+      vt->vt_top = next_row(vt->vt_cursor);
+      buf_add(vt->vt_top, -DISPLAY_SIZE);
     }
+
+    if (!vt_handle_escape(vt, buf[i]))
+      vt_handle_char(vt, buf[i]);
   }
 }
 
@@ -284,6 +336,7 @@ void vt_unblock_io(tty_driver_t *ttyd, void *data) {
   KASSERT(NULL != ttyd);
 
   KASSERT(intr_getipl() == INTR_KEYBOARD && "Virtual terminal I/O not blocked");
+  vt_flush(driver_to_vt(ttyd));
   intr_setipl(oldipl);
 }
 
@@ -291,6 +344,7 @@ void vt_keyboard_handler(char c) {
   if (vt_curterm && vt_curterm->vt_driver.ttd_callback) {
     vt_curterm->vt_driver.ttd_callback(vt_curterm->vt_driver.ttd_callback_arg,
                                        c);
+    vt_flush(vt_curterm);
   }
 }
 
@@ -300,48 +354,61 @@ void vt_cursor_redraw() {
   screen_move_cursor(rel_cursor % DISPLAY_WIDTH, rel_cursor / DISPLAY_WIDTH);
 }
 
+/* Draws the buffer row starting at pos onto screen row y. Rows past the
+ * tail have not been written yet, so they are blank. */
+static void vt_draw_row(virtterm_t *vt, int pos, int y) {
+  if (circ_dist(pos, vt->vt_top) < circ_dist(vt->vt_tail, vt->vt_top))
+    screen_putrow(vt->vt_buf + pos, y);
+  else
+    screen_putrow(vt_blank_row, y);
+}
+
 /* Redraws the screen based on the current virtual terminal */
 void vt_redraw() {
-  /* akerber: There is, quite tragically, a reason why this
-   * doesn't ever use MIN and MAX - see the appropriate
-   * header */
-
-  /* Clear temporary buffer for use */
-  memset(vt_curterm->vt_tempbuf, 0, DISPLAY_SIZE);
-  /* Write in the entire buffer starting from top */
-  if (vt_curterm->vt_top <= vt_curterm->vt_tail) { /* No wraparound */
-    if (vt_curterm->vt_tail - vt_curterm->vt_top <= DISPLAY_SIZE) {
-      memcpy(vt_curterm->vt_tempbuf, vt_curterm->vt_buf + vt_curterm->vt_top,
-             vt_curterm->vt_tail - vt_curterm->vt_top);
-    } else {
-      memcpy(vt_curterm->vt_tempbuf, vt_curterm->vt_buf + vt_curterm->vt_top,
-             DISPLAY_SIZE);
-    }
-  } else { /* Wraparound */
-    int first_part_size = SCROLL_BUFSIZE - vt_curterm->vt_top;
-    /* First half */
-    if (first_part_size >= DISPLAY_SIZE) {
-      memcpy(vt_curterm->vt_tempbuf, vt_curterm->vt_buf + vt_curterm->vt_top,
-             DISPLAY_SIZE);
-    } else {
-      memcpy(vt_curterm->vt_tempbuf, vt_curterm->vt_buf + vt_curterm->vt_top,
-             first_part_size);
-      /* Second half (after wrapping) */
-      if (first_part_size + vt_curterm->vt_tail <= DISPLAY_SIZE) {
-        memcpy(vt_curterm->vt_tempbuf + first_part_size, vt_curterm->vt_buf,
-               vt_curterm->vt_tail);
-      } else {
-        memcpy(vt_curterm->vt_tempbuf + first_part_size, vt_curterm->vt_buf,
-               DISPLAY_SIZE - first_part_size);
-      }
-    }
+  int pos = vt_curterm->vt_top;
+  int y;
+
+  for (y = 0; y < DISPLAY_HEIGHT; y++) {
+    vt_draw_row(vt_curterm, pos, y);
+    buf_add(pos, DISPLAY_WIDTH);
   }
-  screen_putbuf(vt_curterm->vt_tempbuf);
+  memset(vt_curterm->vt_dirty, 0, sizeof(vt_curterm->vt_dirty));
+  vt_drawn_top = vt_curterm->vt_top;
 
   /* Also want to reposition the cursor */
   vt_cursor_redraw();
 }
 
+/*
+ * If top has moved down since the screen was drawn, the screen is scrolled
+ * in hardware to match, so only the rows coming into view and the rows
+ * written since need drawing. Every row written is marked, so even if top
+ * has gone right round the buffer, what the screen shows is right.
+ */
+void vt_flush(virtterm_t *vt) {
+  int shift, pos, y;
+
+  if (vt != vt_curterm)
+    return;
+  shift = circ_dist(vt->vt_top, vt_drawn_top) / DISPLAY_WIDTH;
+  if (shift >= DISPLAY_HEIGHT) {
+    vt_redraw();
+    return;
+  }
+  if (shift > 0)
+    screen_scroll(shift);
+
+  pos = vt->vt_top;
+  for (y = 0; y < DISPLAY_HEIGHT; y++) {
+    if (y >= DISPLAY_HEIGHT - shift || vt_is_dirty(vt, pos))
+      vt_draw_row(vt, pos, y);
+    buf_add(pos, DISPLAY_WIDTH);
+  }
+  memset(vt->vt_dirty, 0, sizeof(vt->vt_dirty));
+  vt_drawn_top = vt->vt_top;
+  vt_cursor_redraw();
+}
+
 /* Puts the given char into the given terminal's buffer, moving the
  * cursor accordingly for control chars Returns 1 if char can be
  * echoed (non-control char), 0 otherwise */
@@ -371,7 +438,8 @@ static int vt_handle_char(virtterm_t *vt, char c) {
     goto handle_tail;
   default:
     /* Actually put a char into the buffer */
-    vt->vt_buf[new_cursor] = c;
+    vt->vt_buf[new_cursor] = SCREEN_CELL(c, vt->vt_attrib);
+    vt_mark_dirty(vt, new_cursor);
     /* And increment */
     buf_inc(new_cursor);
     ret = 1;
@@ -390,12 +458,16 @@ static int vt_handle_char(virtterm_t *vt, char c) {
         vt->vt_head = next_row(new_tail);
       }
 
-      /* Remember to clear space we may have acquired */
+      /* Remember to clear space we may have acquired, and that it
+       * needs drawing */
+      int pos;
+      for (pos = vt->vt_tail; pos != new_tail; buf_add(pos, DISPLAY_WIDTH))
+        vt_mark_dirty(vt, pos);
       if (vt->vt_tail <= new_tail) {
-        memset(vt->vt_buf + vt->vt_tail, 0, new_tail - vt->vt_tail);
+        vt_fill(vt->vt_buf + vt->vt_tail, new_tail - vt->vt_tail);
       } else {
-        memset(vt->vt_buf + vt->vt_tail, 0, SCROLL_BUFSIZE - vt->vt_tail);
-        memset(vt->vt_buf, 0, new_tail);
+        vt_fill(vt->vt_buf + vt->vt_tail, SCROLL_BUFSIZE - vt->vt_tail);
+        vt_fill(vt->vt_buf, new_tail);
       }
       /* Finally, set the new tail */
       vt->vt_tail = new_tail;
@@ -405,3 +477,90 @@ static int vt_handle_char(virtterm_t *vt, char c) {
   vt->vt_cursor = new_cursor;
   return ret;
 }
+
+/* ANSI colour numbers in VGA's order */
+static const uint8_t vt_ansi_colours[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+
+/*
+ * Applies "ESC [ n ; ... m". Bold is the bright version of the foreground
+ * colour, and reverse (7) swaps foreground and background. Parameters other
+ * than these and the colours are ignored.
+ */
+static void vt_set_rendition(virtterm_t *vt) {
+  uint8_t fg = vt->vt_attrib & 0x0f;
+  uint8_t bg = (vt->vt_attrib >> 4) & 0x07;
+  int i, p;
+
+  if (0 == vt->vt_esc_nparams)
+    vt->vt_esc_params[vt->vt_esc_nparams++] = 0;
+  for (i = 0; i < vt->vt_esc_nparams; i++) {
+    p = vt->vt_esc_params[i];
+    if (0 == p) {
+      fg = SCREEN_DEFAULT_ATTRIB & 0x0f;
+      bg = (SCREEN_DEFAULT_ATTRIB >> 4) & 0x07;
+    } else if (1 == p) {
+      fg |= 0x08;
+    } else if (22 == p) {
+      fg &= 0x07;
+    } else if (7 == p) {
+      uint8_t t = fg & 0x07;
+      fg = (fg & 0x08) | bg;
+      bg = t;
+    } else if (30 <= p && p <= 37) {
+      fg = (fg & 0x08) | vt_ansi_colours[p - 30];
+    } else if (39 == p) {
+      fg = (fg & 0x08) | (SCREEN_DEFAULT_ATTRIB & 0x07);
+    } else if (40 <= p && p <= 47) {
+      bg = vt_ansi_colours[p - 40];
+    } else if (49 == p) {
+      bg = (SCREEN_DEFAULT_ATTRIB >> 4) & 0x07;
+    } else if (90 <= p && p <= 97) {
+      fg = 0x08 | vt_ansi_colours[p - 90];
+    }
+  }
+  vt->vt_attrib = (bg << 4) | fg;
+}
+
+/* Only SGR sequences do anything; other control sequences are read to
+ * their final byte and dropped, rather than shown */
+static int vt_handle_escape(virtterm_t *vt, char c) {
+  switch (vt->vt_esc) {
+  case VT_ESC_NONE:
+    if ('\033' != c)
+      return 0;
+    vt->vt_esc = VT_ESC_START;
+    return 1;
+  case VT_ESC_START:
+    if ('[' == c) {
+      vt->vt_esc = VT_ESC_CSI;
+      vt->vt_esc_nparams = 0;
+      vt->vt_esc_params[0] = 0;
+    } else {
+      vt->vt_esc = VT_ESC_NONE;
+    }
+    return 1;
+  default:
+    if ('0' <= c && c <= '9') {
+      if (vt->vt_esc_nparams == 0)
+        vt->vt_esc_nparams = 1;
+      if (vt->vt_esc_nparams <= VT_ESC_MAXPARAMS) {
+        int *p = &vt->vt_esc_params[vt->vt_esc_nparams - 1];
+        *p = *p * 10 + (c - '0');
+      }
+    } else if (';' == c) {
+      if (vt->vt_esc_nparams == 0)
+        vt->vt_esc_nparams = 1;
+      if (vt->vt_esc_nparams < VT_ESC_MAXPARAMS)
+        vt->vt_esc_params[vt->vt_esc_nparams] = 0;
+      vt->vt_esc_nparams++;
+    } else if (0x40 <= c && c <= 0x7e) {
+      /* A final byte ends the sequence */
+      if (vt->vt_esc_nparams > VT_ESC_MAXPARAMS)
+        vt->vt_esc_nparams = VT_ESC_MAXPARAMS;
+      if ('m' == c)
+        vt_set_rendition(vt);
+      vt->vt_esc = VT_ESC_NONE;
+    }
+    return 1;
+  }
+}
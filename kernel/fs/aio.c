@@ -0,0 +1,316 @@
+/*
+ *  FILE: aio.c
+ *  DESC: Asynchronous file I/O, for io_setup(2), io_submit(2) and
+ *        io_getevents(2).
+ *
+ * A process sets up a context, then submits batches of requests and
+ * collects their results later. Each request is put on one queue shared
+ * by every process and served by the workqueue, whose workers call the
+ * file's vnode operations and, for fsync, write its dirty pages through
+ * the block device's request queue. A finished request moves to its
+ * context's done list until io_getevents collects it.
+ *
+ * The workers cannot see the submitting process's address space,
+ * so each read or write goes through a kernel buffer: write data is
+ * copied in by io_submit and read data copied out by io_getevents.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "api/access.h"
+
+#include "fs/aio.h"
+#include "fs/file.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/page.h"
+#include "mm/slab.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/workqueue.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/time.h"
+
+typedef struct aio_ctx {
+  unsigned int ac_entries; /* most requests outstanding at once */
+  unsigned int ac_count;   /* submitted and not yet collected */
+  unsigned int ac_inflight; /* queued or being served */
+  list_t ac_done;          /* finished, waiting to be collected */
+  ktqueue_t ac_waitq;      /* io_getevents, or the process exiting */
+} aio_ctx_t;
+
+typedef struct aio_req {
+  aio_ctx_t *ar_ctx;
+  file_t *ar_file; /* held with fref until the request is collected */
+  struct io_sqe ar_sqe;
+  char *ar_kbuf;   /* the data, if any */
+  uint32_t ar_npages;
+  int ar_res;
+  work_t ar_work;
+  list_link_t ar_link; /* on ac_done */
+} aio_req_t;
+
+static slab_allocator_t *aio_ctx_allocator = NULL;
+static slab_allocator_t *aio_req_allocator = NULL;
+
+static void aio_work(work_t *work);
+
+static __attribute__((unused)) void aio_init(void) {
+  aio_ctx_allocator = slab_allocator_create("aio_ctx", sizeof(aio_ctx_t));
+  KASSERT(NULL != aio_ctx_allocator);
+  aio_req_allocator = slab_allocator_create("aio_req", sizeof(aio_req_t));
+  KASSERT(NULL != aio_req_allocator);
+}
+init_func(aio_init);
+
+/* Carries out one request on behalf of its process */
+static int aio_serve(aio_req_t *req) {
+  vnode_t *vn = req->ar_file->f_vnode;
+  struct io_sqe *sqe = &req->ar_sqe;
+
+  switch (sqe->op) {
+  case IO_OP_READ:
+    if (!sqe->nbytes)
+      return 0;
+    return vn->vn_ops->read(vn, sqe->offset, req->ar_kbuf, sqe->nbytes);
+  case IO_OP_WRITE:
+    if (!sqe->nbytes)
+      return 0;
+    vnode_exec_forget(vn);
+    return vn->vn_ops->write(vn, sqe->offset, req->ar_kbuf, sqe->nbytes);
+  case IO_OP_FSYNC:
+    /* Metadata reaches the disk with the file system's own commits */
+    return vnode_flush(vn);
+  default:
+    panic("aio request with unknown op %d\n", sqe->op);
+  }
+  return -EINVAL;
+}
+
+static void aio_work(work_t *work) {
+  aio_req_t *req = list_item(work, aio_req_t, ar_work);
+
+  req->ar_res = aio_serve(req);
+  dbg(DBG_VFS, "aio: op %d on fd %d returned %d\n", req->ar_sqe.op,
+      req->ar_sqe.fd, req->ar_res);
+
+  list_insert_tail(&req->ar_ctx->ac_done, &req->ar_link);
+  req->ar_ctx->ac_inflight--;
+  sched_broadcast_on(&req->ar_ctx->ac_waitq);
+}
+
+static void aio_req_free(aio_req_t *req) {
+  if (req->ar_kbuf)
+    page_free_n(req->ar_kbuf, req->ar_npages);
+  fput(req->ar_file);
+  slab_obj_free(aio_req_allocator, req);
+}
+
+/*
+ * Creates the current process's context, which holds up to entries
+ * outstanding requests.
+ *
+ * Error cases:
+ *      o EINVAL
+ *        entries is 0 or more than AIO_MAX_ENTRIES, or the process
+ *        already has a context.
+ *      o ENOMEM
+ *        there was no memory for the context.
+ */
+int do_io_setup(unsigned int entries) {
+  aio_ctx_t *ctx;
+
+  if (!entries || entries > AIO_MAX_ENTRIES || curproc->p_aio)
+    return -EINVAL;
+  if (NULL == (ctx = (aio_ctx_t *)slab_obj_alloc(aio_ctx_allocator)))
+    return -ENOMEM;
+  ctx->ac_entries = entries;
+  ctx->ac_count = 0;
+  ctx->ac_inflight = 0;
+  list_init(&ctx->ac_done);
+  sched_queue_init(&ctx->ac_waitq);
+  curproc->p_aio = ctx;
+  return 0;
+}
+
+/* Checks one request and makes it ready to queue */
+static int aio_prepare(aio_ctx_t *ctx, const struct io_sqe *sqe,
+                       aio_req_t **reqp) {
+  aio_req_t *req;
+  file_t *f;
+  int ret;
+
+  if (sqe->op != IO_OP_READ && sqe->op != IO_OP_WRITE &&
+      sqe->op != IO_OP_FSYNC)
+    return -EINVAL;
+  if (sqe->op != IO_OP_FSYNC &&
+      (sqe->offset < 0 || sqe->nbytes > AIO_MAX_BYTES))
+    return -EINVAL;
+  if (ctx->ac_count >= ctx->ac_entries)
+    return -EAGAIN;
+  if (NULL == (f = fget(sqe->fd)))
+    return -EBADF;
+  if ((IO_OP_READ == sqe->op && !(f->f_mode & FMODE_READ)) ||
+      (IO_OP_WRITE == sqe->op && !(f->f_mode & FMODE_WRITE))) {
+    fput(f);
+    return -EBADF;
+  }
+  /* A worker waiting on a pipe or tty could wait forever */
+  if (!S_ISREG(f->f_vnode->vn_mode)) {
+    fput(f);
+    return -EINVAL;
+  }
+  if (NULL == (req = (aio_req_t *)slab_obj_alloc(aio_req_allocator))) {
+    fput(f);
+    return -ENOMEM;
+  }
+  req->ar_ctx = ctx;
+  req->ar_file = f;
+  req->ar_sqe = *sqe;
+  req->ar_kbuf = NULL;
+  req->ar_npages = 0;
+  req->ar_res = 0;
+  work_init(&req->ar_work, aio_work);
+  list_link_init(&req->ar_link);
+
+  if (sqe->op != IO_OP_FSYNC && sqe->nbytes) {
+    req->ar_npages = (sqe->nbytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (NULL == (req->ar_kbuf = (char *)page_alloc_n(req->ar_npages))) {
+      req->ar_npages = 0;
+      aio_req_free(req);
+      return -ENOMEM;
+    }
+    if (IO_OP_WRITE == sqe->op &&
+        (ret = copy_from_user(req->ar_kbuf, sqe->buf, sqe->nbytes)) < 0) {
+      aio_req_free(req);
+      return ret;
+    }
+  }
+  *reqp = req;
+  return 0;
+}
+
+/*
+ * Queues the nr requests of sqes, which is in kernel memory; the buffers
+ * the requests name are in the process's. Returns how many were queued,
+ * which is less than nr if one failed, or -errno if the first failed.
+ *
+ * Error cases:
+ *      o EINVAL
+ *        the process has no context, nr is negative, or a request has an
+ *        unknown op, a negative offset, more than AIO_MAX_BYTES or a file
+ *        which is not a regular file.
+ *      o EAGAIN
+ *        the context already holds as many requests as it was set up for.
+ *      o EBADF
+ *        a request's fd is not open for what it asks.
+ *      o EFAULT
+ *        a write's buffer could not be read.
+ *      o ENOMEM
+ *        there was no memory for a request.
+ */
+int do_io_submit(const struct io_sqe *sqes, int nr) {
+  aio_ctx_t *ctx = curproc->p_aio;
+  aio_req_t *req;
+  int i, ret = 0;
+
+  if (!ctx || nr < 0)
+    return -EINVAL;
+  for (i = 0; i < nr; ++i) {
+    if ((ret = aio_prepare(ctx, &sqes[i], &req)) < 0)
+      break;
+    ctx->ac_count++;
+    ctx->ac_inflight++;
+    work_queue(&req->ar_work);
+  }
+  return i ? i : ret;
+}
+
+/*
+ * Collects up to nr finished requests into cqes, waiting up to timeout
+ * milliseconds (forever if negative) until at least min_nr have finished.
+ * min_nr is taken as no more than the number outstanding. Returns how many
+ * were collected.
+ *
+ * Error cases:
+ *      o EINVAL
+ *        the process has no context, or min_nr or nr is negative or min_nr
+ *        is more than nr.
+ *      o EINTR
+ *        the wait was cancelled before anything finished.
+ */
+int do_io_getevents(struct io_cqe *cqes, int min_nr, int nr, int timeout) {
+  aio_ctx_t *ctx = curproc->p_aio;
+  aio_req_t *req;
+  unsigned long deadline = 0, now;
+  int n = 0, ret;
+
+  if (!ctx || min_nr < 0 || nr < 0 || min_nr > nr)
+    return -EINVAL;
+  if ((unsigned int)min_nr > ctx->ac_count)
+    min_nr = ctx->ac_count;
+  if (timeout > 0)
+    deadline = time_deadline_ms(timeout);
+
+  while (n < nr) {
+    if (list_empty(&ctx->ac_done)) {
+      if (n >= min_nr || !timeout)
+        break;
+      if (timeout < 0)
+        ret = sched_cancellable_sleep_on(&ctx->ac_waitq);
+      else if ((now = time_ticks()) < deadline)
+        ret = sched_cancellable_sleep_on_timeout(&ctx->ac_waitq,
+                                                 deadline - now);
+      else
+        ret = -ETIMEDOUT;
+      if (-EINTR == ret)
+        return n ? n : ret;
+      if (-ETIMEDOUT == ret)
+        timeout = 0;
+      continue;
+    }
+    req = list_head(&ctx->ac_done, aio_req_t, ar_link);
+    list_remove(&req->ar_link);
+    ctx->ac_count--;
+
+    cqes[n].user_data = req->ar_sqe.user_data;
+    cqes[n].res = req->ar_res;
+    if (IO_OP_READ == req->ar_sqe.op && 0 < req->ar_res &&
+        (ret = copy_to_user(req->ar_sqe.buf, req->ar_kbuf, req->ar_res)) < 0)
+      cqes[n].res = ret;
+    aio_req_free(req);
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Waits for p's requests still being served and frees its context along
+ * with everything not collected. Called as p exits.
+ */
+void aio_destroy(proc_t *p) {
+  aio_ctx_t *ctx = p->p_aio;
+  aio_req_t *req;
+
+  KASSERT(curproc == p && NULL != ctx);
+  /* Not cancellable: the workers still point into the context */
+  while (ctx->ac_inflight)
+    sched_sleep_on(&ctx->ac_waitq);
+  list_iterate_begin(&ctx->ac_done, req, aio_req_t, ar_link) {
+    list_remove(&req->ar_link);
+    aio_req_free(req);
+  }
+  list_iterate_end();
+  p->p_aio = NULL;
+  slab_obj_free(aio_ctx_allocator, ctx);
+}
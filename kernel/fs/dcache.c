@@ -0,0 +1,240 @@
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/debug.h"
+#include "util/printf.h"
+
+#include "fs/dcache.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "proc/rcu.h"
+#include "proc/spinlock.h"
+
+/*
+ * Lookups take no lock: they walk a hash chain under rcu_read_lock, and
+ * an entry's key and result don't change while it is hashed. Changing
+ * what a name maps to replaces its entry. An entry taken off its chain is
+ * retired until a grace period has passed, since a lookup may still be
+ * standing on it, and only then is it free for reuse.
+ *
+ * Entries are replaced by a clock algorithm rather than a strict LRU
+ * list, so that a hit need not move anything: a lookup sets
+ * de_referenced, and the hand clears it and passes over the entry once
+ * before retiring it.
+ */
+
+#define DE_FREE 0
+#define DE_HASHED 1
+#define DE_RETIRED 2 /* waiting for a grace period */
+
+typedef struct dcache_entry {
+  list_link_t de_hlink; /* link on hash chain, if hashed */
+  rcu_head_t de_rcu;
+  int de_state;
+  int de_referenced;
+  struct fs *de_fs;
+  ino_t de_dir;
+  ino_t de_vno;
+  int de_negative;
+  size_t de_namelen;
+  char de_name[NAME_LEN];
+} dcache_entry_t;
+
+#define DCACHE_HASH_SIZE (1 << DCACHE_HASH_ORDER)
+
+static dcache_entry_t dcache_entries[DCACHE_SIZE];
+static list_t dcache_hash[DCACHE_HASH_SIZE];
+static int dcache_hand; /* next entry the clock looks at */
+static uint32_t dcache_gen;
+/* Serializes changes; lookups don't take it */
+static spinlock_t dcache_lock;
+
+static __attribute__((unused)) void dcache_init(void) {
+  int i;
+  for (i = 0; i < DCACHE_HASH_SIZE; ++i)
+    list_init(&dcache_hash[i]);
+  for (i = 0; i < DCACHE_SIZE; ++i)
+    dcache_entries[i].de_state = DE_FREE;
+  dcache_hand = 0;
+  spinlock_init(&dcache_lock, "dcache");
+}
+init_func(dcache_init);
+
+static list_t *dcache_chain(struct fs *fs, ino_t dir, const char *name,
+                            size_t len) {
+  uint32_t h = ((uint32_t)fs >> 4) ^ (uint32_t)dir;
+  size_t i;
+  for (i = 0; i < len; ++i)
+    h = h * 31 + (unsigned char)name[i];
+  return &dcache_hash[(h * 0x9e3779b1U) >> (32 - DCACHE_HASH_ORDER)];
+}
+
+/* Under rcu_read_lock or dcache_lock */
+static dcache_entry_t *dcache_find(struct fs *fs, ino_t dir, const char *name,
+                                   size_t len) {
+  list_t *chain = dcache_chain(fs, dir, name, len);
+  dcache_entry_t *de;
+  list_iterate_rcu(chain, de, dcache_entry_t, de_hlink) {
+    if (de->de_fs == fs && de->de_dir == dir && de->de_namelen == len &&
+        !strncmp(de->de_name, name, len))
+      return de;
+  }
+  return NULL;
+}
+
+static void dcache_free_rcu(rcu_head_t *head) {
+  dcache_entry_t *de = list_item(head, dcache_entry_t, de_rcu);
+  spin_lock(&dcache_lock);
+  KASSERT(DE_RETIRED == de->de_state);
+  de->de_state = DE_FREE;
+  spin_unlock(&dcache_lock);
+}
+
+/* Unhashes an entry, to be reused once no lookup can be looking at it */
+static void dcache_retire(dcache_entry_t *de) {
+  KASSERT(DE_HASHED == de->de_state);
+  list_remove_rcu(&de->de_hlink);
+  de->de_state = DE_RETIRED;
+  call_rcu(&de->de_rcu, dcache_free_rcu);
+}
+
+/*
+ * Finds a free entry, moving the clock hand on and retiring at most one
+ * entry which has not been looked up since the hand last passed it, so
+ * that the cache keeps a few free entries in hand.
+ *
+ * @return the entry, or NULL if every entry is in use or retired
+ */
+static dcache_entry_t *dcache_alloc(void) {
+  dcache_entry_t *de;
+  int n, retired = 0;
+
+  for (n = 0; n < 2 * DCACHE_SIZE; ++n) {
+    de = &dcache_entries[dcache_hand];
+    dcache_hand = (dcache_hand + 1) % DCACHE_SIZE;
+    if (DE_FREE == de->de_state)
+      return de;
+    if (DE_HASHED == de->de_state && !retired) {
+      if (de->de_referenced) {
+        de->de_referenced = 0;
+      } else {
+        dcache_retire(de);
+        retired = 1;
+      }
+    }
+  }
+  return NULL;
+}
+
+int dcache_lookup(vnode_t *dir, const char *name, size_t len, ino_t *vno) {
+  dcache_entry_t *de;
+  int ret = DCACHE_MISS;
+
+  rcu_read_lock();
+  if (NULL != (de = dcache_find(dir->vn_fs, dir->vn_vno, name, len))) {
+    /* Only written when it changes, so that hot entries' cache lines
+     * stay shared */
+    if (!de->de_referenced)
+      de->de_referenced = 1;
+    if (de->de_negative) {
+      ret = -ENOENT;
+      percpu_inc(pc_dcache_negative);
+    } else {
+      *vno = de->de_vno;
+      ret = DCACHE_HIT;
+      percpu_inc(pc_dcache_hits);
+    }
+  } else {
+    percpu_inc(pc_dcache_misses);
+  }
+  rcu_read_unlock();
+  return ret;
+}
+
+uint32_t dcache_generation(void) { return dcache_gen; }
+
+void dcache_enter(vnode_t *dir, const char *name, size_t len, vnode_t *result,
+                  uint32_t gen) {
+  dcache_entry_t *de;
+  ino_t vno = result ? result->vn_vno : 0;
+
+  if (len > NAME_LEN)
+    return;
+  /* A lookup which crossed into another file system (a mount point)
+   * can't be described by an inode number in this one */
+  if (result && result->vn_fs != dir->vn_fs)
+    return;
+
+  spin_lock(&dcache_lock);
+  if (gen != dcache_gen) {
+    spin_unlock(&dcache_lock);
+    return;
+  }
+  if (NULL != (de = dcache_find(dir->vn_fs, dir->vn_vno, name, len))) {
+    if (de->de_negative == (NULL == result) && de->de_vno == vno) {
+      de->de_referenced = 1;
+      spin_unlock(&dcache_lock);
+      return;
+    }
+    dcache_retire(de);
+  }
+  if (NULL != (de = dcache_alloc())) {
+    de->de_fs = dir->vn_fs;
+    de->de_dir = dir->vn_vno;
+    de->de_namelen = len;
+    memcpy(de->de_name, name, len);
+    de->de_negative = (NULL == result);
+    de->de_vno = vno;
+    de->de_referenced = 1;
+    de->de_state = DE_HASHED;
+    list_insert_head_rcu(dcache_chain(de->de_fs, de->de_dir, name, len),
+                         &de->de_hlink);
+  }
+  spin_unlock(&dcache_lock);
+}
+
+void dcache_remove(vnode_t *dir, const char *name, size_t len) {
+  dcache_entry_t *de;
+
+  spin_lock(&dcache_lock);
+  dcache_gen++;
+  if (NULL != (de = dcache_find(dir->vn_fs, dir->vn_vno, name, len)))
+    dcache_retire(de);
+  spin_unlock(&dcache_lock);
+}
+
+/* Drops every entry in use which matches fs and, unless all is set, dir */
+static void dcache_purge(struct fs *fs, ino_t dir, int all) {
+  int i;
+
+  spin_lock(&dcache_lock);
+  dcache_gen++;
+  for (i = 0; i < DCACHE_SIZE; ++i) {
+    dcache_entry_t *de = &dcache_entries[i];
+    if (DE_HASHED == de->de_state && de->de_fs == fs &&
+        (all || de->de_dir == dir))
+      dcache_retire(de);
+  }
+  spin_unlock(&dcache_lock);
+}
+
+void dcache_purge_dir(struct fs *fs, ino_t dirvno) {
+  dcache_purge(fs, dirvno, 0);
+}
+
+void dcache_purge_fs(struct fs *fs) { dcache_purge(fs, 0, 1); }
+
+size_t dcache_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "hits %u\n", percpu_sum(pc_dcache_hits));
+  iprintf(&buf, &size, "negative_hits %u\n", percpu_sum(pc_dcache_negative));
+  iprintf(&buf, &size, "misses %u\n", percpu_sum(pc_dcache_misses));
+  return size;
+}
@@ -0,0 +1,259 @@
+/*
+ * A file system of device nodes, mounted on /dev at boot. It keeps
+ * nothing on a device: its nodes are added by bytedev_register and
+ * blockdev_register as drivers come up, named after the device's major
+ * and minor numbers (see dev.h), so creating /dev costs no disk writes
+ * and devices which appear after boot are found there too.
+ *
+ * Every devfs shows the same nodes. The root directory is inode 0 and
+ * each node has the inode number it was given when it was added; nodes
+ * are never removed, and it is read-only otherwise.
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "fs/dirent.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "fs/devfs/devfs.h"
+
+#include "drivers/dev.h"
+#include "drivers/tty/pty.h"
+#include "drivers/tty/tty.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#define DEVFS_ROOT_INO 0
+
+typedef struct devfs_node {
+  char dn_name[16];
+  int dn_mode;
+  devid_t dn_devid;
+  ino_t dn_ino;
+  list_link_t dn_link; /* on devfs_nodes */
+} devfs_node_t;
+
+/* In the order they were added, which is that of their inode numbers */
+static list_t devfs_nodes = {&devfs_nodes, &devfs_nodes};
+static ino_t devfs_next_ino = DEVFS_ROOT_INO + 1;
+
+static void devfs_read_vnode(vnode_t *vn);
+static int devfs_query_vnode(vnode_t *vn);
+static int devfs_umount(fs_t *fs);
+
+static fs_ops_t devfs_ops = {.read_vnode = devfs_read_vnode,
+                             .delete_vnode = NULL,
+                             .query_vnode = devfs_query_vnode,
+                             .umount = devfs_umount};
+
+static int devfs_create(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result);
+static int devfs_mknod(vnode_t *dir, const char *name, size_t name_len,
+                       int mode, devid_t devid);
+static int devfs_lookup(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result);
+static int devfs_link(vnode_t *oldvnode, vnode_t *dir, const char *name,
+                      size_t name_len);
+static int devfs_unlink(vnode_t *dir, const char *name, size_t name_len);
+static int devfs_readdir(vnode_t *dir, off_t offset, struct dirent *d);
+static int devfs_readdirv(vnode_t *dir, off_t offset, struct dirent *d, int n,
+                          int *nread);
+static int devfs_stat(vnode_t *vn, struct stat *buf);
+
+/* mkdir and rmdir take the same arguments as unlink, and fail the same way.
+ * The nodes themselves get the special file operations from vget; their
+ * stat comes here by way of the root's. */
+static vnode_ops_t devfs_dir_vops = {.create = devfs_create,
+                                     .mknod = devfs_mknod,
+                                     .lookup = devfs_lookup,
+                                     .link = devfs_link,
+                                     .unlink = devfs_unlink,
+                                     .mkdir = devfs_unlink,
+                                     .rmdir = devfs_unlink,
+                                     .readdir = devfs_readdir,
+                                     .readdirv = devfs_readdirv,
+                                     .stat = devfs_stat};
+
+/* The name of a device in /dev, as the comment in dev.h lays them out */
+static void devfs_name(int mode, devid_t devid, char *buf, size_t size) {
+  unsigned major = MAJOR(devid), minor = MINOR(devid);
+
+  if (S_ISBLK(mode)) {
+    if (DISK_MAJOR == major && minor < 26)
+      snprintf(buf, size, "sd%c", 'a' + minor);
+    else
+      snprintf(buf, size, "blk%u.%u", major, minor);
+    return;
+  }
+  switch (major) {
+  case MEM_MAJOR:
+    if (MEM_NULL_MINOR == minor)
+      snprintf(buf, size, "null");
+    else if (MEM_ZERO_MINOR == minor)
+      snprintf(buf, size, "zero");
+    else
+      snprintf(buf, size, "mem%u", minor);
+    break;
+  case TTY_MAJOR:
+    snprintf(buf, size, "tty%u", minor);
+    break;
+  case PTY_MASTER_MAJOR:
+    snprintf(buf, size, "pty%u", minor);
+    break;
+  case PTY_SLAVE_MAJOR:
+    snprintf(buf, size, "pts%u", minor);
+    break;
+  default:
+    snprintf(buf, size, "chr%u.%u", major, minor);
+    break;
+  }
+}
+
+void devfs_add(int mode, devid_t devid) {
+  devfs_node_t *dn;
+
+  KASSERT(S_ISCHR(mode) || S_ISBLK(mode));
+  if (NULL == (dn = kmalloc(sizeof(devfs_node_t)))) {
+    dbg(DBG_PRINT, "devfs: no memory for device 0x%x, not in /dev\n", devid);
+    return;
+  }
+  devfs_name(mode, devid, dn->dn_name, sizeof(dn->dn_name));
+  dn->dn_mode = mode;
+  dn->dn_devid = devid;
+  dn->dn_ino = devfs_next_ino++;
+  list_insert_tail(&devfs_nodes, &dn->dn_link);
+  dbg(DBG_VFS, "devfs: /dev/%s is inode %d\n", dn->dn_name, (int)dn->dn_ino);
+}
+
+static devfs_node_t *devfs_node(ino_t ino) {
+  devfs_node_t *dn;
+
+  list_iterate_begin(&devfs_nodes, dn, devfs_node_t, dn_link) {
+    if (dn->dn_ino == ino)
+      return dn;
+  }
+  list_iterate_end();
+  return NULL;
+}
+
+int devfs_mount(struct fs *fs) {
+  fs->fs_i = NULL;
+  fs->fs_op = &devfs_ops;
+  fs->fs_root = vget(fs, DEVFS_ROOT_INO);
+  return 0;
+}
+
+static void devfs_read_vnode(vnode_t *vn) {
+  devfs_node_t *dn;
+
+  vn->vn_len = 0;
+  vn->vn_i = NULL;
+  if (DEVFS_ROOT_INO == vn->vn_vno) {
+    vn->vn_mode = S_IFDIR;
+    vn->vn_ops = &devfs_dir_vops;
+  } else {
+    dn = devfs_node(vn->vn_vno);
+    KASSERT(NULL != dn);
+    vn->vn_mode = dn->dn_mode;
+    vn->vn_devid = dn->dn_devid;
+  }
+}
+
+/* Nothing is ever unlinked */
+static int devfs_query_vnode(vnode_t *vn) { return 1; }
+
+static int devfs_umount(fs_t *fs) {
+  vput(fs->fs_root);
+  return 0;
+}
+
+static int devfs_create(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result) {
+  return -EROFS;
+}
+
+static int devfs_mknod(vnode_t *dir, const char *name, size_t name_len,
+                       int mode, devid_t devid) {
+  return -EROFS;
+}
+
+static int devfs_lookup(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result) {
+  devfs_node_t *dn;
+
+  if (name_match(".", name, name_len) || name_match("..", name, name_len)) {
+    *result = vget(dir->vn_fs, DEVFS_ROOT_INO);
+    return 0;
+  }
+  list_iterate_begin(&devfs_nodes, dn, devfs_node_t, dn_link) {
+    if (name_match(dn->dn_name, name, name_len)) {
+      *result = vget(dir->vn_fs, dn->dn_ino);
+      return 0;
+    }
+  }
+  list_iterate_end();
+  return -ENOENT;
+}
+
+static int devfs_link(vnode_t *oldvnode, vnode_t *dir, const char *name,
+                      size_t name_len) {
+  return -EROFS;
+}
+
+static int devfs_unlink(vnode_t *dir, const char *name, size_t name_len) {
+  return -EROFS;
+}
+
+/* An offset is an entry number: ".", "..", then the nodes */
+static int devfs_readdir(vnode_t *dir, off_t offset, struct dirent *d) {
+  devfs_node_t *dn;
+  off_t i = 2;
+
+  KASSERT(S_ISDIR(dir->vn_mode));
+  d->d_off = 0; /* unused */
+  if (offset < 2) {
+    d->d_ino = DEVFS_ROOT_INO;
+    strcpy(d->d_name, offset ? ".." : ".");
+    return 1;
+  }
+  list_iterate_begin(&devfs_nodes, dn, devfs_node_t, dn_link) {
+    if (i++ == offset) {
+      d->d_ino = dn->dn_ino;
+      strcpy(d->d_name, dn->dn_name);
+      return 1;
+    }
+  }
+  list_iterate_end();
+  return 0;
+}
+
+static int devfs_readdirv(vnode_t *dir, off_t offset, struct dirent *d, int n,
+                          int *nread) {
+  int total = 0;
+
+  for (*nread = 0; *nread < n; ++*nread) {
+    if (0 == devfs_readdir(dir, offset + total, d + *nread))
+      break;
+    total++;
+  }
+  return total;
+}
+
+static int devfs_stat(vnode_t *vn, struct stat *buf) {
+  memset(buf, 0, sizeof(struct stat));
+  buf->st_mode = vn->vn_mode;
+  buf->st_ino = (int)vn->vn_vno;
+  buf->st_nlink = S_ISDIR(vn->vn_mode) ? 2 : 1;
+  if (!S_ISDIR(vn->vn_mode))
+    buf->st_rdev = (int)vn->vn_devid;
+  buf->st_blksize = (int)PAGE_SIZE;
+  return 0;
+}
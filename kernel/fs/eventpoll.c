@@ -0,0 +1,473 @@
+/*
+ *  FILE: eventpoll.c
+ *  DESC: Persistent interest sets with a ready list, for epoll(2).
+ *
+ * An epoll instance is a file whose vnode holds the set of files being
+ * watched. Each watched file gets an entry on its object's pollq when it
+ * is added, and keeps it until it is removed, so a wakeup of the object
+ * puts the item straight on the instance's ready list. epoll_wait then
+ * only looks at the items on that list rather than at every file.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "fs/epoll.h"
+#include "fs/file.h"
+#include "fs/open.h"
+#include "fs/poll.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "main/interrupt.h"
+
+#include "mm/slab.h"
+
+#include "proc/kmutex.h"
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/time.h"
+
+/* The events a watched file is always polled for */
+#define EP_ALWAYS (EPOLLERR | EPOLLHUP)
+/* The flags which are not events */
+#define EP_FLAGS (EPOLLET | EPOLLONESHOT)
+
+typedef struct eventpoll {
+  list_t ep_items;    /* everything being watched */
+  list_t ep_ready;    /* items which may be ready; changed at IPL_HIGH */
+  kmutex_t ep_mtx;    /* held while changing or scanning the items */
+  ktqueue_t ep_waitq; /* threads in epoll_wait */
+  pollq_t ep_pollq;   /* pollers of the instance itself */
+} eventpoll_t;
+
+/* A file being watched */
+typedef struct epitem {
+  eventpoll_t *ei_ep;
+  vnode_t *ei_vnode; /* held with vref, so the object stays */
+  int ei_fd;
+  struct epoll_event ei_event;
+  poll_table_t ei_pt;    /* for registering ei_entry */
+  poll_entry_t ei_entry; /* on the object's pollq */
+  int ei_registered;
+  int ei_disabled;       /* EPOLLONESHOT has fired */
+  int ei_woken;          /* woken since epoll_wait last polled it */
+  list_link_t ei_link;   /* on ep_items */
+  list_link_t ei_rdlink; /* on ep_ready, or a list epoll_wait is scanning */
+} epitem_t;
+
+#define VNODE_TO_EP(vn) ((eventpoll_t *)((vn)->vn_i))
+
+static void ep_read_vnode(vnode_t *vnode);
+static void ep_delete_vnode(vnode_t *vnode);
+static int ep_query_vnode(vnode_t *vnode);
+
+static fs_ops_t ep_fsops = {.read_vnode = ep_read_vnode,
+                            .delete_vnode = ep_delete_vnode,
+                            .query_vnode = ep_query_vnode,
+                            /* like pipefs, never mounted */
+                            .umount = NULL};
+
+static fs_t ep_fs = {.fs_dev = "epoll",
+                     .fs_type = "epoll",
+                     .fs_op = &ep_fsops,
+                     .fs_root = NULL,
+                     .fs_i = NULL};
+
+static int ep_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int ep_write(vnode_t *vnode, off_t offset, const void *buf,
+                    size_t len);
+static int ep_stat(vnode_t *vnode, struct stat *ss);
+static int ep_poll(vnode_t *vnode, int events, poll_table_t *pt);
+
+static vnode_ops_t ep_vops = {.read = ep_read,
+                              .write = ep_write,
+                              .stat = ep_stat,
+                              .poll = ep_poll};
+
+static slab_allocator_t *ep_allocator = NULL;
+static slab_allocator_t *epitem_allocator = NULL;
+static int next_epno = 0;
+
+static __attribute__((unused)) void eventpoll_init(void) {
+  ep_allocator = slab_allocator_create("eventpoll", sizeof(eventpoll_t));
+  KASSERT(ep_allocator != NULL);
+  epitem_allocator = slab_allocator_create("epitem", sizeof(epitem_t));
+  KASSERT(epitem_allocator != NULL);
+}
+init_func(eventpoll_init);
+init_depends(vfs_init);
+
+/*
+ * Called by the watched object, possibly from an interrupt handler: put
+ * the item on the ready list unless it is on it (or being scanned) and
+ * wake anyone waiting.
+ */
+static void ep_item_wake(void *arg) {
+  epitem_t *ei = (epitem_t *)arg;
+  ei->ei_woken = 1;
+  if (!list_link_is_linked(&ei->ei_rdlink)) {
+    list_insert_tail(&ei->ei_ep->ep_ready, &ei->ei_rdlink);
+    sched_broadcast_on(&ei->ei_ep->ep_waitq);
+    pollq_wakeup(&ei->ei_ep->ep_pollq);
+  }
+}
+
+/* An item watches a single pollq for as long as it lives */
+static void ep_item_qproc(pollq_t *q, poll_table_t *pt) {
+  epitem_t *ei = CONTAINER_OF(pt, epitem_t, ei_pt);
+  if (ei->ei_registered)
+    return;
+  ei->ei_registered = 1;
+  pollq_add(q, &ei->ei_entry);
+}
+
+/* The events of interest the item's file has right now */
+static int ep_item_poll(epitem_t *ei, poll_table_t *pt) {
+  int events = (ei->ei_event.events & ~EP_FLAGS) | EP_ALWAYS;
+  if (ei->ei_disabled)
+    return 0;
+  return events & ei->ei_vnode->vn_ops->poll(ei->ei_vnode, events, pt);
+}
+
+static void ep_item_destroy(epitem_t *ei) {
+  uint8_t old_ipl = intr_getipl();
+  if (ei->ei_registered)
+    pollq_remove(&ei->ei_entry);
+  intr_setipl(IPL_HIGH);
+  if (list_link_is_linked(&ei->ei_rdlink))
+    list_remove(&ei->ei_rdlink);
+  intr_setipl(old_ipl);
+  list_remove(&ei->ei_link);
+  vput(ei->ei_vnode);
+  slab_obj_free(epitem_allocator, ei);
+}
+
+/* epollfs vnode operations */
+static void ep_read_vnode(vnode_t *vnode) {
+  vnode->vn_ops = &ep_vops;
+  /* not seekable, like a pipe (and S_IFCHR would make it a device) */
+  vnode->vn_mode = S_IFIFO;
+  vnode->vn_len = 0;
+  vnode->vn_i = NULL;
+}
+
+static void ep_delete_vnode(vnode_t *vnode) {
+  eventpoll_t *ep = VNODE_TO_EP(vnode);
+  epitem_t *ei;
+  if (!ep)
+    return;
+  list_iterate_begin(&ep->ep_items, ei, epitem_t, ei_link) {
+    ep_item_destroy(ei);
+  }
+  list_iterate_end();
+  slab_obj_free(ep_allocator, ep);
+}
+
+/* Like pipes, there are never pages to clean up */
+static int ep_query_vnode(vnode_t *vnode) { return 1; }
+
+static int ep_read(vnode_t *vnode, off_t offset, void *buf, size_t len) {
+  return -EINVAL;
+}
+
+static int ep_write(vnode_t *vnode, off_t offset, const void *buf,
+                    size_t len) {
+  return -EINVAL;
+}
+
+static int ep_stat(vnode_t *vnode, struct stat *ss) {
+  memset(ss, 0, sizeof(*ss));
+  ss->st_mode = vnode->vn_mode;
+  ss->st_ino = (int)vnode->vn_vno;
+  ss->st_nlink = 1;
+  return 0;
+}
+
+/* An instance can itself be watched: it is readable while anything may
+ * be ready */
+static int ep_poll(vnode_t *vnode, int events, poll_table_t *pt) {
+  eventpoll_t *ep = VNODE_TO_EP(vnode);
+  poll_wait(&ep->ep_pollq, pt);
+  return list_empty(&ep->ep_ready) ? 0 : POLLIN;
+}
+
+/*
+ * Creates an epoll instance with nothing in its interest set and returns
+ * a file descriptor for it.
+ *
+ * Error cases:
+ *      o EMFILE
+ *        The process already has the maximum number of files open.
+ *      o ENOMEM
+ *        Insufficient kernel memory was available.
+ */
+int do_epoll_create(void) {
+  vnode_t *vn;
+  eventpoll_t *ep;
+  file_t *f;
+  int fd;
+
+  if (0 > (fd = get_empty_fd(curproc)))
+    return fd;
+  if (NULL == (vn = vget(&ep_fs, next_epno++)))
+    return -ENOMEM;
+  if (NULL == (ep = (eventpoll_t *)slab_obj_alloc(ep_allocator))) {
+    vput(vn);
+    return -ENOMEM;
+  }
+  list_init(&ep->ep_items);
+  list_init(&ep->ep_ready);
+  kmutex_init(&ep->ep_mtx);
+  sched_queue_init(&ep->ep_waitq);
+  pollq_init(&ep->ep_pollq);
+  vn->vn_i = ep;
+  if (NULL == (f = fget(-1))) {
+    vput(vn);
+    return -ENOMEM;
+  }
+  f->f_mode = FMODE_READ;
+  facq(f, vn);
+  fdtable_set(curproc->p_fdt, fd, f);
+  return fd;
+}
+
+/* Finds the item watching fd, which must still refer to the same file */
+static epitem_t *ep_find(eventpoll_t *ep, int fd, vnode_t *vn) {
+  epitem_t *ei;
+  list_iterate_begin(&ep->ep_items, ei, epitem_t, ei_link) {
+    if (ei->ei_fd == fd && ei->ei_vnode == vn)
+      return ei;
+  }
+  list_iterate_end();
+  return NULL;
+}
+
+/*
+ * Adds fd to the interest set of epfd, removes it, or changes the
+ * events it is watched for (and the data returned with them).
+ *
+ * Error cases:
+ *      o EBADF
+ *        epfd or fd is not a valid file descriptor.
+ *      o EINVAL
+ *        epfd is not an epoll instance, fd is epfd, or op is unknown.
+ *      o EEXIST
+ *        op is EPOLL_CTL_ADD and fd is already watched.
+ *      o ENOENT
+ *        op is EPOLL_CTL_DEL or EPOLL_CTL_MOD and fd is not watched.
+ *      o EPERM
+ *        fd refers to a file which never blocks, such as a regular file.
+ *      o ENOMEM
+ *        Insufficient kernel memory was available.
+ */
+int do_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+  file_t *epf = NULL, *f = NULL;
+  eventpoll_t *ep;
+  epitem_t *ei;
+  uint8_t old_ipl;
+  int ret = 0;
+
+  if (NULL == (epf = fget(epfd)) || NULL == (f = fget(fd))) {
+    ret = -EBADF;
+    goto out;
+  }
+  if (epf->f_vnode->vn_ops != &ep_vops || epf == f) {
+    ret = -EINVAL;
+    goto out;
+  }
+  if (NULL == f->f_vnode->vn_ops->poll) {
+    ret = -EPERM;
+    goto out;
+  }
+  ep = VNODE_TO_EP(epf->f_vnode);
+  kmutex_lock(&ep->ep_mtx);
+  ei = ep_find(ep, fd, f->f_vnode);
+  switch (op) {
+  case EPOLL_CTL_ADD:
+    if (ei) {
+      ret = -EEXIST;
+      break;
+    }
+    if (NULL == (ei = (epitem_t *)slab_obj_alloc(epitem_allocator))) {
+      ret = -ENOMEM;
+      break;
+    }
+    memset(ei, 0, sizeof(*ei));
+    ei->ei_ep = ep;
+    ei->ei_vnode = f->f_vnode;
+    vref(ei->ei_vnode);
+    ei->ei_fd = fd;
+    ei->ei_event = *event;
+    ei->ei_pt.pt_qproc = ep_item_qproc;
+    ei->ei_entry.pe_wake = ep_item_wake;
+    ei->ei_entry.pe_arg = ei;
+    list_link_init(&ei->ei_rdlink);
+    list_insert_tail(&ep->ep_items, &ei->ei_link);
+    /* Register, and catch up on what is ready already */
+    if (ep_item_poll(ei, &ei->ei_pt)) {
+      old_ipl = intr_getipl();
+      intr_setipl(IPL_HIGH);
+      ep_item_wake(ei);
+      intr_setipl(old_ipl);
+    }
+    break;
+  case EPOLL_CTL_MOD:
+    if (!ei) {
+      ret = -ENOENT;
+      break;
+    }
+    ei->ei_event = *event;
+    ei->ei_disabled = 0;
+    if (ep_item_poll(ei, NULL)) {
+      old_ipl = intr_getipl();
+      intr_setipl(IPL_HIGH);
+      ep_item_wake(ei);
+      intr_setipl(old_ipl);
+    }
+    break;
+  case EPOLL_CTL_DEL:
+    if (!ei)
+      ret = -ENOENT;
+    else
+      ep_item_destroy(ei);
+    break;
+  default:
+    ret = -EINVAL;
+  }
+  kmutex_unlock(&ep->ep_mtx);
+out:
+  if (f)
+    fput(f);
+  if (epf)
+    fput(epf);
+  return ret;
+}
+
+/*
+ * Takes the items on the ready list and reports, into events, those
+ * whose files really are ready. A level-triggered item which is still
+ * ready goes back on the list, to be reported again next time; an
+ * edge-triggered one waits for its file to wake it again. An item woken
+ * while it was being polled goes back on the list either way, since the
+ * poll may have missed what woke it. Items beyond maxevents are left on
+ * the list.
+ */
+static int ep_collect(eventpoll_t *ep, struct epoll_event *events,
+                      int maxevents) {
+  list_t scan;
+  epitem_t *ei;
+  uint8_t old_ipl;
+  int n = 0, revents, requeue;
+
+  list_init(&scan);
+  old_ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  /* Move the ready list into scan */
+  if (!list_empty(&ep->ep_ready)) {
+    scan.l_next = ep->ep_ready.l_next;
+    scan.l_prev = ep->ep_ready.l_prev;
+    scan.l_next->l_prev = &scan;
+    scan.l_prev->l_next = &scan;
+    list_init(&ep->ep_ready);
+  }
+  while (n < maxevents && !list_empty(&scan)) {
+    ei = list_head(&scan, epitem_t, ei_rdlink);
+    ei->ei_woken = 0;
+    intr_setipl(old_ipl);
+    /* Still linked while we poll it, so that a wakeup now only sets
+     * ei_woken; we decide below where it goes */
+    revents = ep_item_poll(ei, NULL);
+    intr_setipl(IPL_HIGH);
+    list_remove(&ei->ei_rdlink);
+    requeue = ei->ei_woken;
+    if (revents) {
+      events[n].events = revents;
+      events[n].data = ei->ei_event.data;
+      n++;
+      if (ei->ei_event.events & EPOLLONESHOT)
+        ei->ei_disabled = 1;
+      else if (!(ei->ei_event.events & EPOLLET))
+        requeue = 1;
+    }
+    if (requeue && !ei->ei_disabled)
+      list_insert_tail(&ep->ep_ready, &ei->ei_rdlink);
+  }
+  /* Put back what didn't fit, ahead of anything woken meanwhile */
+  while (!list_empty(&scan)) {
+    ei = list_tail(&scan, epitem_t, ei_rdlink);
+    list_remove(&ei->ei_rdlink);
+    list_insert_head(&ep->ep_ready, &ei->ei_rdlink);
+  }
+  intr_setipl(old_ipl);
+  return n;
+}
+
+/*
+ * Waits up to timeout milliseconds (forever if negative) for any file
+ * watched by epfd to be ready, and stores up to maxevents of them in
+ * events. Returns how many were stored, 0 on timeout, or -errno.
+ *
+ * Error cases:
+ *      o EBADF
+ *        epfd is not a valid file descriptor.
+ *      o EINVAL
+ *        epfd is not an epoll instance, or maxevents is not positive.
+ *      o EINTR
+ *        the wait was cancelled.
+ */
+int do_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                  int timeout) {
+  file_t *epf;
+  eventpoll_t *ep;
+  unsigned long deadline = 0, now;
+  uint8_t old_ipl;
+  int n, ret;
+
+  if (NULL == (epf = fget(epfd)))
+    return -EBADF;
+  if (epf->f_vnode->vn_ops != &ep_vops || maxevents <= 0) {
+    fput(epf);
+    return -EINVAL;
+  }
+  ep = VNODE_TO_EP(epf->f_vnode);
+  if (timeout > 0)
+    deadline = time_deadline_ms(timeout);
+
+  for (;;) {
+    kmutex_lock(&ep->ep_mtx);
+    n = ep_collect(ep, events, maxevents);
+    kmutex_unlock(&ep->ep_mtx);
+    if (n || !timeout)
+      break;
+    ret = 0;
+    /* Masked from the check to the sleep, so a tty waking us in between
+     * is not missed */
+    old_ipl = intr_getipl();
+    intr_setipl(IPL_HIGH);
+    if (list_empty(&ep->ep_ready)) {
+      if (timeout < 0)
+        ret = sched_cancellable_sleep_on(&ep->ep_waitq);
+      else if ((now = time_ticks()) < deadline)
+        ret = sched_cancellable_sleep_on_timeout(&ep->ep_waitq, deadline - now);
+      else
+        ret = -ETIMEDOUT;
+    }
+    intr_setipl(old_ipl);
+    if (-EINTR == ret) {
+      n = ret;
+      break;
+    }
+    /* Look once more, without waiting, when the time is up */
+    if (-ETIMEDOUT == ret)
+      timeout = 0;
+  }
+  fput(epf);
+  return n;
+}
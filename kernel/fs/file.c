@@ -6,6 +6,8 @@
  */
 
 #include "kernel.h"
+#include "errno.h"
+#include "util/bitmap.h"
 #include "util/init.h"
 #include "util/debug.h"
 #include "util/string.h"
@@ -16,18 +18,21 @@
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "proc/proc.h"
+#include "mm/kmalloc.h"
 #include "mm/slab.h"
 #include "config.h"
 
 static slab_allocator_t *file_allocator;
+static slab_allocator_t *fdtable_allocator;
 
 static __attribute__((unused)) void file_init(void) {
   file_allocator = slab_allocator_create("file", sizeof(file_t));
+  fdtable_allocator = slab_allocator_create("fdtable", sizeof(fdtable_t));
 }
 init_func(file_init);
 
 void fref(file_t *f) {
-  KASSERT(f->f_mode >= 0 && f->f_mode < 8);
+  KASSERT(f->f_mode >= 0 && f->f_mode < 16);
   KASSERT(f->f_pos >= -1);
   KASSERT(f->f_refcount >= 0);
   if (f->f_refcount != 0)
@@ -64,9 +69,7 @@ file_t *fget(int fd) {
     if (f)
       memset(f, 0, sizeof(file_t));
   } else {
-    if (fd < 0 || fd >= NFILES)
-      return NULL;
-    f = curproc->p_files[fd];
+    f = fdtable_get(curproc->p_fdt, fd);
   }
   if (f)
     fref(f);
@@ -74,13 +77,24 @@ file_t *fget(int fd) {
   return f;
 }
 
+file_t *fget_light(int fd, int *put) {
+  file_t *f = fdtable_get(curproc->p_fdt, fd);
+
+  *put = 0;
+  if (NULL != f && curproc->p_threads.l_next != curproc->p_threads.l_prev) {
+    fref(f);
+    *put = 1;
+  }
+  return f;
+}
+
 /* - Decrement f_count.
  * - If f_count == 0, call release (if available), vput() and free it. */
 void fput(file_t *f) {
   if (f->f_vnode && f->f_vnode->vn_vno)
     dbg(DBG_VFS, "ino %d\n", f->f_vnode->vn_vno);
   KASSERT(f);
-  KASSERT(f->f_mode >= 0 && f->f_mode < 8);
+  KASSERT(f->f_mode >= 0 && f->f_mode < 16);
   KASSERT(f->f_pos >= -1);
   KASSERT(f->f_refcount > 0);
   if (f->f_refcount != 1)
@@ -106,3 +120,153 @@ void fput(file_t *f) {
     slab_obj_free(file_allocator, f);
   }
 }
+
+/*
+ * Gives ft room for size descriptors, keeping those it has. The files
+ * and the bitmap share one allocation.
+ */
+static int fdtable_resize(fdtable_t *ft, int size) {
+  size_t len = size * sizeof(file_t *) + size / 8;
+  file_t **files;
+
+  KASSERT(0 == size % 32 && size > ft->ft_size);
+  if (NULL == (files = kmalloc(len)))
+    return -ENOMEM;
+  memset(files, 0, len);
+  if (NULL != ft->ft_files) {
+    memcpy(files, ft->ft_files, ft->ft_size * sizeof(file_t *));
+    memcpy(files + size, ft->ft_used, ft->ft_size / 8);
+    kfree(ft->ft_files);
+  }
+  ft->ft_files = files;
+  ft->ft_used = (uint32_t *)(files + size);
+  ft->ft_size = size;
+  return 0;
+}
+
+fdtable_t *fdtable_create(void) {
+  fdtable_t *ft;
+
+  if (NULL == (ft = slab_obj_alloc(fdtable_allocator)))
+    return NULL;
+  ft->ft_refcount = 1;
+  ft->ft_size = 0;
+  ft->ft_hint = 0;
+  ft->ft_files = NULL;
+  ft->ft_used = NULL;
+  if (fdtable_resize(ft, NFILES)) {
+    slab_obj_free(fdtable_allocator, ft);
+    return NULL;
+  }
+  return ft;
+}
+
+fdtable_t *fdtable_copy(fdtable_t *ft) {
+  fdtable_t *copy;
+  int fd;
+
+  if (NULL == (copy = fdtable_create()))
+    return NULL;
+  if (ft->ft_size > copy->ft_size && fdtable_resize(copy, ft->ft_size)) {
+    fdtable_put(copy);
+    return NULL;
+  }
+  memcpy(copy->ft_files, ft->ft_files, ft->ft_size * sizeof(file_t *));
+  memcpy(copy->ft_used, ft->ft_used, ft->ft_size / 8);
+  copy->ft_hint = ft->ft_hint;
+  for (fd = 0; fd < ft->ft_size; ++fd) {
+    if (NULL != ft->ft_files[fd])
+      fref(ft->ft_files[fd]);
+  }
+  return copy;
+}
+
+void fdtable_ref(fdtable_t *ft) {
+  KASSERT(0 < ft->ft_refcount);
+  ft->ft_refcount++;
+}
+
+void fdtable_put(fdtable_t *ft) {
+  int fd;
+
+  KASSERT(0 < ft->ft_refcount);
+  if (0 < --ft->ft_refcount)
+    return;
+  for (fd = 0; fd < ft->ft_size; ++fd) {
+    if (NULL != ft->ft_files[fd])
+      fput(ft->ft_files[fd]);
+  }
+  kfree(ft->ft_files);
+  slab_obj_free(fdtable_allocator, ft);
+}
+
+file_t *fdtable_get(fdtable_t *ft, int fd) {
+  if (fd < 0 || fd >= ft->ft_size)
+    return NULL;
+  return ft->ft_files[fd];
+}
+
+void fdtable_set(fdtable_t *ft, int fd, file_t *f) {
+  KASSERT(1 == ft->ft_refcount && "changing a shared fd table");
+  KASSERT(0 <= fd && fd < ft->ft_size && NULL == ft->ft_files[fd]);
+  KASSERT(NULL != f);
+  ft->ft_files[fd] = f;
+  bitmap_set(ft->ft_used, fd);
+}
+
+file_t *fdtable_clear(fdtable_t *ft, int fd) {
+  file_t *f;
+
+  KASSERT(1 == ft->ft_refcount && "changing a shared fd table");
+  if (NULL == (f = fdtable_get(ft, fd)))
+    return NULL;
+  ft->ft_files[fd] = NULL;
+  bitmap_clear(ft->ft_used, fd);
+  if (fd / 32 < ft->ft_hint)
+    ft->ft_hint = fd / 32;
+  return f;
+}
+
+int fdtable_fit(fdtable_t *ft, int fd) {
+  int size = ft->ft_size;
+
+  if (fd < 0 || fd >= NFILES_MAX)
+    return -EBADF;
+  while (size <= fd)
+    size = MIN(2 * size, NFILES_MAX);
+  return size == ft->ft_size ? 0 : fdtable_resize(ft, size);
+}
+
+/*
+ * Searches the bitmap from the hint, so that unless descriptors were
+ * closed below it the first word looked at has a free one.
+ */
+int fdtable_alloc(fdtable_t *ft) {
+  int fd, size = ft->ft_size;
+
+  fd = bitmap_find_next_zero(ft->ft_used, size, ft->ft_hint * 32);
+  if (fd < size) {
+    ft->ft_hint = fd / 32;
+    return fd;
+  }
+  if (NFILES_MAX == size)
+    return -EMFILE;
+  if (fdtable_resize(ft, MIN(2 * size, NFILES_MAX)))
+    return -ENOMEM;
+  ft->ft_hint = size / 32;
+  return size;
+}
+
+int fd_private(proc_t *p, int fd) {
+  fdtable_t *ft;
+
+  if (-1 != fd && (fd < 0 || fd >= NFILES_MAX))
+    return -EBADF;
+  if (1 < p->p_fdt->ft_refcount) {
+    if (NULL == (ft = fdtable_copy(p->p_fdt)))
+      return -ENOMEM;
+    fdtable_put(p->p_fdt);
+    p->p_fdt = ft;
+  }
+  return -1 == fd ? 0 : fdtable_fit(p->p_fdt, fd);
+}
@@ -0,0 +1,178 @@
+/*
+ * The user programs built into the kernel image, so that init and the
+ * shell run from memory rather than being read in from disk at boot.
+ *
+ * The archive is a "newc" cpio archive made by tools/mkinitramfs.py and
+ * linked in by fs/initramfs_data.S. Each of its directories whose parent
+ * is not in it (bin, sbin, usr/bin) gets a tmpfs of its own mounted over
+ * the directory of that name in the root file system, which is made if
+ * it is missing; everything under it is unpacked into the tmpfs. Nothing
+ * is written to the root file system but the mount points themselves.
+ */
+
+#include "kernel.h"
+#include "errno.h"
+
+#include "fs/fcntl.h"
+#include "fs/initramfs.h"
+#include "fs/vfs_syscall.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#ifdef __INITRAMFS__
+
+#ifndef __MOUNTING__
+#error "INITRAMFS mounts a tmpfs for the archive and needs MOUNTING"
+#endif
+
+extern const char initramfs_start[];
+extern const char initramfs_end[];
+
+#define CPIO_MAGIC "070701"
+#define CPIO_HEADER_LEN 110
+#define CPIO_TRAILER "TRAILER!!!"
+
+/* The header's fields, each 8 hex digits, in order after the magic */
+#define CPIO_MODE 1
+#define CPIO_FILESIZE 6
+#define CPIO_NAMESIZE 11
+
+/* Modes are POSIX ones, not those of stat.h */
+#define CPIO_S_IFMT 0170000
+#define CPIO_S_IFDIR 0040000
+#define CPIO_S_IFREG 0100000
+#define CPIO_ISDIR(m) (((m)&CPIO_S_IFMT) == CPIO_S_IFDIR)
+#define CPIO_ISREG(m) (((m)&CPIO_S_IFMT) == CPIO_S_IFREG)
+
+#define CPIO_ALIGN(n) (((n) + 3) & ~3U)
+
+typedef struct cpio_entry {
+  const char *ce_name; /* relative, NUL terminated */
+  int ce_mode;
+  const char *ce_data;
+  size_t ce_size;
+} cpio_entry_t;
+
+static unsigned long cpio_field(const char *hdr, int field) {
+  const char *p = hdr + strlen(CPIO_MAGIC) + 8 * field;
+  unsigned long val = 0;
+  int i;
+
+  for (i = 0; i < 8; ++i) {
+    val <<= 4;
+    if (p[i] >= '0' && p[i] <= '9')
+      val |= p[i] - '0';
+    else
+      val |= (p[i] | 0x20) - 'a' + 10;
+  }
+  return val;
+}
+
+/*
+ * Reads the entry at *pos into e and moves *pos past it. Returns 1, 0 at
+ * the trailer, or -EINVAL if the archive is not well formed.
+ */
+static int cpio_next(const char **pos, cpio_entry_t *e) {
+  const char *hdr = *pos;
+  size_t namesize;
+
+  if (hdr + CPIO_HEADER_LEN > initramfs_end ||
+      memcmp(hdr, CPIO_MAGIC, strlen(CPIO_MAGIC)))
+    return -EINVAL;
+  namesize = cpio_field(hdr, CPIO_NAMESIZE);
+  e->ce_name = hdr + CPIO_HEADER_LEN;
+  e->ce_mode = (int)cpio_field(hdr, CPIO_MODE);
+  e->ce_size = cpio_field(hdr, CPIO_FILESIZE);
+  e->ce_data = hdr + CPIO_ALIGN(CPIO_HEADER_LEN + namesize);
+  if (!namesize || e->ce_data + e->ce_size > initramfs_end ||
+      e->ce_name[namesize - 1])
+    return -EINVAL;
+  *pos = e->ce_data + CPIO_ALIGN(e->ce_size);
+  return strcmp(e->ce_name, CPIO_TRAILER) ? 1 : 0;
+}
+
+/* Whether the archive has a directory called name before pos */
+static int initramfs_has_dir(const char *pos, const char *name, size_t len) {
+  const char *p = initramfs_start;
+  cpio_entry_t e;
+
+  while (p < pos && 0 < cpio_next(&p, &e)) {
+    if (CPIO_ISDIR(e.ce_mode) && !strncmp(e.ce_name, name, len) &&
+        !e.ce_name[len])
+      return 1;
+  }
+  return 0;
+}
+
+/* Makes path and any missing parents in the root file system */
+static void initramfs_mkdirs(char *path) {
+  char *p;
+
+  for (p = path + 1; *p; ++p) {
+    if ('/' == *p) {
+      *p = '\0';
+      do_mkdir(path);
+      *p = '/';
+    }
+  }
+  do_mkdir(path);
+}
+
+static int initramfs_write(const char *path, const char *data, size_t size) {
+  int fd, ret = 0;
+
+  if (0 > (fd = do_open(path, O_WRONLY | O_CREAT | O_TRUNC)))
+    return fd;
+  while (size && 0 < (ret = do_write(fd, data, size))) {
+    data += ret;
+    size -= ret;
+  }
+  do_close(fd);
+  return MIN(ret, 0);
+}
+
+int initramfs_unpack() {
+  const char *pos = initramfs_start, *here;
+  char path[MAXPATHLEN];
+  const char *slash;
+  cpio_entry_t e;
+  int nmounts = 0, nfiles = 0, ret;
+
+  while (here = pos, 0 < (ret = cpio_next(&pos, &e))) {
+    if (strlen(e.ce_name) + 2 > MAXPATHLEN)
+      return -ENAMETOOLONG;
+    path[0] = '/';
+    strcpy(path + 1, e.ce_name);
+
+    if (CPIO_ISDIR(e.ce_mode)) {
+      slash = strrchr(e.ce_name, '/');
+      if (slash && initramfs_has_dir(here, e.ce_name, slash - e.ce_name)) {
+        ret = do_mkdir(path);
+      } else {
+        initramfs_mkdirs(path);
+        ret = do_mount(NULL, path, "tmpfs");
+        nmounts++;
+      }
+    } else if (CPIO_ISREG(e.ce_mode)) {
+      ret = initramfs_write(path, e.ce_data, e.ce_size);
+      nfiles++;
+    } else {
+      ret = 0;
+    }
+    if (0 > ret) {
+      dbg(DBG_PRINT, "initramfs: could not unpack %s: %d\n", path, ret);
+      return ret;
+    }
+  }
+  if (0 > ret) {
+    dbg(DBG_PRINT, "initramfs: archive is corrupt at offset %d\n",
+        (int)(here - initramfs_start));
+    return ret;
+  }
+  dbg(DBG_VFS, "initramfs: %d files in %d tmpfs mounts from %d bytes\n",
+      nfiles, nmounts, (int)(initramfs_end - initramfs_start));
+  return 0;
+}
+
+#endif /* __INITRAMFS__ */
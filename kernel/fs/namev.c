@@ -7,6 +7,7 @@
 #include "util/printf.h"
 #include "util/debug.h"
 
+#include "fs/dcache.h"
 #include "fs/dirent.h"
 #include "fs/fcntl.h"
 #include "fs/stat.h"
@@ -19,6 +20,10 @@
  *
  * If dir has no lookup(), return -ENOTDIR.
  *
+ * Results, including names which don't exist, are remembered in the name
+ * cache, so repeated lookups of the same name needn't search the
+ * directory.
+ *
  * Note: returns with the vnode refcount on *result incremented.
  */
 int lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result) {
@@ -33,7 +38,27 @@ int lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result) {
     *result = dir;
     return 0;
   }
-  int status = dir->vn_ops->lookup(dir, name, len, result);
+#ifdef __MOUNTING__
+  /* ".." from the root of a mounted file system is ".." of the directory
+   * it is mounted on */
+  if (name_match("..", name, len) && dir == dir->vn_fs->fs_root &&
+      dir->vn_fs->fs_mtpt != dir)
+    return lookup(dir->vn_fs->fs_mtpt, name, len, result);
+#endif
+  ino_t vno;
+  int status = dcache_lookup(dir, name, len, &vno);
+  if (DCACHE_HIT == status) {
+    *result = vget(dir->vn_fs, vno);
+    return 0;
+  } else if (status) {
+    return status;
+  }
+  uint32_t gen = dcache_generation();
+  status = dir->vn_ops->lookup(dir, name, len, result);
+  if (!status)
+    dcache_enter(dir, name, len, *result, gen);
+  else if (-ENOENT == status)
+    dcache_enter(dir, name, len, NULL, gen);
   return status;
 }
 
@@ -60,10 +85,8 @@ int dir_namev(const char *pathname, size_t *namelen, const char **name,
   dbg(DBG_VFS, "path: %s\n", pathname);
   if (!pathname)
     return -ENOENT;
-  if (!strlen(pathname))
+  if (!pathname[0])
     return -EINVAL;
-  if (strlen(pathname) > MAXPATHLEN)
-    return -ENAMETOOLONG;
 
   // Set base
   if (!base)
@@ -74,19 +97,24 @@ int dir_namev(const char *pathname, size_t *namelen, const char **name,
     for (; pathname[i] == '/'; ++i); // First not slash
   }
   vref(base);
+  // One pass over the path: each component is measured, checked and
+  // looked up as it is reached
   size_t j = 0;
   size_t k = 0;
   for (;; i += j+k) {
     // Advance to next '/' or end
     for (j = 0; pathname[i+j] && (pathname[i+j] != '/'); ++j);
-    if (j > NAME_LEN) { // Check file name length
+    // Skip consecutive '/'
+    for (k = 0; pathname[i+j+k] == '/'; ++k); 
+    if (j > NAME_LEN || i+j+k > MAXPATHLEN) {
       vput(base);
       return -ENAMETOOLONG;
     }
-    // Skip consecutive '/'
-    for (k = 0; pathname[i+j+k] == '/'; ++k); 
     // Stop if at the end or at the trailing /
     if (!pathname[i+j+k]) break;
+    // "." is the directory itself; ENOTDIR for a file is left to the
+    // next lookup, or to the check below
+    if (j == 1 && pathname[i] == '.') continue;
     vnode_t *result;
     int status = lookup(base, pathname+i, j, &result);
     vput(base);
@@ -104,7 +132,7 @@ int dir_namev(const char *pathname, size_t *namelen, const char **name,
   }
   if (namelen) *namelen = j;
   if (name) *name = pathname + i;
-  dbg(DBG_VFS, "%.*s, %d\n", *namelen, *name, *namelen);
+  dbg(DBG_VFS, "%.*s, %d\n", j, pathname + i, j);
   if (res_vnode) *res_vnode = base; // Set res_vnode if possible
   else vput(base);
   return 0;
@@ -147,6 +175,7 @@ int open_namev(const char *pathname, int flag, vnode_t **res_vnode,
       return -ENOENT;
     }
     status = dir->vn_ops->create(dir, name, namelen, &result);
+    dcache_remove(dir, name, namelen);
     if (status) {
       dbg(DBG_VFS, "create error: %d\n", status);
       vput(dir);
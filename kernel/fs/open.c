@@ -18,19 +18,18 @@
 #include "fs/stat.h"
 #include "util/debug.h"
 
-/* find empty index in p->p_files[] */
+/* find the lowest free descriptor in p's fd table, making the table
+ * p's own first so that the descriptor can be installed */
 int get_empty_fd(proc_t *p) {
   int fd;
 
-  for (fd = 0; fd < NFILES; fd++) {
-    if (!p->p_files[fd])
-      return fd;
-  }
+  if (0 <= (fd = fd_private(p, -1)) && 0 <= (fd = fdtable_alloc(p->p_fdt)))
+    return fd;
 
   dbg(DBG_ERROR | DBG_VFS, "ERROR: get_empty_fd: out of file descriptors "
                            "for pid %d\n",
       curproc->p_pid);
-  return -EMFILE;
+  return fd;
 }
 
 /*
@@ -40,10 +39,11 @@ int get_empty_fd(proc_t *p) {
  *      3. Save the file_t in curproc's file descriptor table.
  *      4. Set file_t->f_mode to OR of FMODE_(READ|WRITE|APPEND) based on
  *         oflags, which can be O_RDONLY, O_WRONLY or O_RDWR, possibly OR'd with
- *         O_APPEND.
+ *         O_APPEND, O_NONBLOCK and O_DIRECT.
  *      5. Use open_namev() to get the vnode for the file_t.
  *      6. Fill in the fields of the file_t.
- *      7. Return new fd.
+ *      7. With O_TRUNC, truncate a regular file opened for writing.
+ *      8. Return new fd.
  *
  * If anything goes wrong at any point (specifically if the call to open_namev
  * fails), be sure to remove the fd from curproc, fput the file_t and return an
@@ -51,7 +51,8 @@ int get_empty_fd(proc_t *p) {
  *
  * Error cases you must handle for this function at the VFS level:
  *      o EINVAL
- *        oflags is not valid.
+ *        oflags is not valid, or has O_DIRECT for a file which can't do
+ *        direct I/O.
  *      o EMFILE
  *        The process already has the maximum number of files open.
  *      o ENOMEM
@@ -73,11 +74,11 @@ int do_open(const char *filename, int oflags) {
   dbg(DBG_VFS, "opening %s flags: 0x%x\n", filename, oflags);
   // Get new fd and empty f struct
   int new_fd = get_empty_fd(curproc);
-  if (new_fd == -EMFILE)
-    return -EMFILE;
+  if (new_fd < 0)
+    return new_fd;
   file_t *f = fget(-1);
   if (!f) return -ENOMEM;
-  curproc->p_files[new_fd] = f;
+  fdtable_set(curproc->p_fdt, new_fd, f);
 
   // Set file mode
   if ((oflags & 3) == O_RDONLY) {
@@ -93,13 +94,16 @@ int do_open(const char *filename, int oflags) {
   }
   if (oflags & O_APPEND)
     f->f_mode |= FMODE_APPEND;
+  if (oflags & O_NONBLOCK)
+    f->f_mode |= FMODE_NONBLOCK;
+  if (oflags & O_DIRECT)
+    f->f_mode |= FMODE_DIRECT;
 
   vnode_t *result;
   int status = open_namev(filename, oflags, &result, NULL);
   if (status) {
     dbg(DBG_VFS, "couldn't open path\n");
     do_close(new_fd);
-    curproc->p_files[new_fd] = NULL;
     return status;
   }
   KASSERT(result);
@@ -109,7 +113,21 @@ int do_open(const char *filename, int oflags) {
     vput(result);
     return -EISDIR;
   }
+  if ((f->f_mode & FMODE_DIRECT) && NULL == result->vn_ops->direct_io) {
+    dbg(DBG_VFS, "error: no direct I/O on this file\n");
+    do_close(new_fd);
+    vput(result);
+    return -EINVAL;
+  }
   f->f_vnode = result;
+  if ((oflags & O_TRUNC) && (f->f_mode & FMODE_WRITE) &&
+      S_ISREG(result->vn_mode) && NULL != result->vn_ops->truncate) {
+    vnode_exec_forget(result);
+    if ((status = result->vn_ops->truncate(result, 0))) {
+      do_close(new_fd);
+      return status;
+    }
+  }
   return new_fd;
 }
 
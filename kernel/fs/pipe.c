@@ -11,6 +11,7 @@
 #include "fs/file.h"
 #include "fs/open.h"
 #include "fs/pipe.h"
+#include "fs/poll.h"
 #include "fs/stat.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vfs.h"
@@ -18,13 +19,17 @@
 
 #include "mm/slab.h"
 #include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/shrinker.h"
 
 #include "proc/sched.h"
 
 #include "util/debug.h"
 #include "util/string.h"
 
-#define PIPE_BUF_SIZE 4096
+/* Bytes a pipe can hold, and the room which wakes up blocked writers */
+#define PIPE_CAPACITY (PIPE_MAX_PAGES * PAGE_SIZE)
+#define PIPE_WAKE_ROOM (PIPE_WAKE_PAGES * PAGE_SIZE)
 
 static void pipe_read_vnode(vnode_t *vnode);
 static void pipe_delete_vnode(vnode_t *vnode);
@@ -49,6 +54,7 @@ static int pipe_write(vnode_t *vnode, off_t offset, const void *buf,
 static int pipe_stat(vnode_t *vnode, struct stat *ss);
 static int pipe_acquire(vnode_t *vnode, file_t *file);
 static int pipe_release(vnode_t *vnode, file_t *file);
+static int pipe_poll(vnode_t *vnode, int events, poll_table_t *pt);
 
 static vnode_ops_t pipe_vops = {.read = pipe_read,
                                 .write = pipe_write,
@@ -62,6 +68,7 @@ static vnode_ops_t pipe_vops = {.read = pipe_read,
                                 .rmdir = NULL,
                                 .readdir = NULL,
                                 .stat = pipe_stat,
+                                .poll = pipe_poll,
                                 .acquire = pipe_acquire,
                                 .release = pipe_release,
                                 .fillpage = NULL,
@@ -71,14 +78,19 @@ static vnode_ops_t pipe_vops = {.read = pipe_read,
 /* struct pipe defines some data specific to pipes. One of these
    should be present in the vn_i field of each pipe vnode. */
 typedef struct pipe {
-  /* Buffer for data in the pipe, which has been written but not yet read. */
-  char *pv_buf;
   /*
-   * Position of the head and number of characters in the buffer. You can
-   * write in characters at position head so long as size does not grow beyond
-   * the pipe buffer size.
+   * Data in the pipe, which has been written but not yet read, in a ring
+   * of PIPE_CAPACITY bytes made of pages. A page is only allocated when
+   * there is something to write into it, and is freed once it has been
+   * read, so an idle pipe holds at most one page.
    */
-  off_t pv_head;
+  char *pv_pages[PIPE_MAX_PAGES];
+  /*
+   * Position of the head and number of characters in the ring. You can
+   * write in characters at position head+size so long as size does not
+   * grow beyond PIPE_CAPACITY.
+   */
+  size_t pv_head;
   size_t pv_size;
   /* Number of file descriptors using this pipe for read and write. */
   int pv_readers;
@@ -93,42 +105,95 @@ typedef struct pipe {
   kmutex_t pv_wrlock;
   /*
    * Waitqueues for threads attempting to read from an empty buffer, or
-   * write to a full buffer. When the pipe becomes non-empty (or non-full)
-   * then the corresponding waitq should be broadcasted on to make sure all
-   * of the threads get a chance to go.
+   * write to a full buffer. To save each side from waking the other for
+   * every few bytes, readers are only woken once a write has finished or
+   * filled the pipe, and writers once there are PIPE_WAKE_ROOM bytes free.
    */
   ktqueue_t pv_read_waitq;
   ktqueue_t pv_write_waitq;
+  /* Pollers, woken along with either waitq */
+  pollq_t pv_pollq;
+  /* On pipe_list */
+  list_link_t pv_link;
 } pipe_t;
 
 #define VNODE_TO_PIPE(vn) ((pipe_t *)((vn)->vn_i))
 
 static slab_allocator_t *pipe_allocator = NULL;
 static int next_pno = 0;
+/* Every pipe, for the shrinker */
+static list_t pipe_list;
+
+/*
+ * An empty pipe keeps the page it will write into next; the shrinker
+ * takes it back, to be allocated again by the next write.
+ */
+static uint32_t pipe_shrink(uint32_t nr, int reclaim) {
+  pipe_t *p;
+  uint32_t n = 0, i;
+
+  list_iterate_begin(&pipe_list, p, pipe_t, pv_link) {
+    if (n == nr)
+      break;
+    if (p->pv_size)
+      continue;
+    /* a writer only blocks holding a page once the pipe is full, so
+     * nothing is using these */
+    for (i = 0; i < PIPE_MAX_PAGES; ++i) {
+      if (p->pv_pages[i]) {
+        if (reclaim) {
+          page_free(p->pv_pages[i]);
+          p->pv_pages[i] = NULL;
+        }
+        n++;
+      }
+    }
+  }
+  list_iterate_end();
+  return n;
+}
+
+static uint32_t pipe_shrink_count(void) { return pipe_shrink(~0U, 0); }
+
+static uint32_t pipe_shrink_scan(uint32_t nr) { return pipe_shrink(nr, 1); }
+
+static shrinker_t pipe_shrinker = {.sh_name = "pipe",
+                                   .sh_count = pipe_shrink_count,
+                                   .sh_scan = pipe_shrink_scan};
 
 static __attribute__((unused)) void pipe_init(void) {
   pipe_allocator = slab_allocator_create("pipe", sizeof(pipe_t));
   KASSERT(pipe_allocator != NULL);
+  list_init(&pipe_list);
+  shrinker_register(&pipe_shrinker);
 }
 init_func(pipe_init);
 init_depends(vfs_init);
+init_depends(shrinker_init);
 
-/*
- * Create a pipe struct here. You are going to need to allocate all
- * of the necessary structs and buffers, and then initialize all of
- * the necessary fields (head, size, readers, writers, and the locks
- * and queues.)
- */
 static pipe_t *pipe_create(void) {
-  NOT_YET_IMPLEMENTED("PIPES: pipe_create");
-  return NULL;
+  pipe_t *p = (pipe_t *)slab_obj_alloc(pipe_allocator);
+  if (!p)
+    return NULL;
+  memset(p, 0, sizeof(*p));
+  kmutex_init(&p->pv_rdlock);
+  kmutex_init(&p->pv_wrlock);
+  sched_queue_init(&p->pv_read_waitq);
+  sched_queue_init(&p->pv_write_waitq);
+  pollq_init(&p->pv_pollq);
+  list_insert_tail(&pipe_list, &p->pv_link);
+  return p;
 }
 
-/*
- * Free all necessary memory.
- */
 static void pipe_destroy(pipe_t *pipe) {
-  NOT_YET_IMPLEMENTED("PIPES: pipe_destroy");
+  int i;
+  KASSERT(!pipe->pv_readers && !pipe->pv_writers);
+  for (i = 0; i < PIPE_MAX_PAGES; ++i) {
+    if (pipe->pv_pages[i])
+      page_free(pipe->pv_pages[i]);
+  }
+  list_remove(&pipe->pv_link);
+  slab_obj_free(pipe_allocator, pipe);
 }
 
 /* pipefs vnode operations */
@@ -167,94 +232,215 @@ static int pipe_query_vnode(vnode_t *vnode) {
  * vnode if pipe_create fails.
  */
 static vnode_t *pget(void) {
-  NOT_YET_IMPLEMENTED("PIPES: pget");
-  return NULL;
+  vnode_t *vn = vget(&pipe_fs, next_pno++);
+  pipe_t *p;
+  if (!vn)
+    return NULL;
+  if (NULL == (p = pipe_create())) {
+    vput(vn);
+    return NULL;
+  }
+  vn->vn_i = p;
+  return vn;
 }
 
 /*
- * An implementation of the pipe(2) system call. You really
- * only have to worry about a few things:
- *   o Running out of memory when allocating the vnode, at which
- *     point you should fail with ENOMEM;
- *   o Running out of file descriptors, in which case you should
- *     fail with EMFILE.
- * Once all of the structures are set up, just put the read-end
- * file descriptor of the pipe into pipefd[0], and the write-end
- * descriptor into pipefd[1].
+ * An implementation of the pipe(2) system call. Fails with ENOMEM if the
+ * vnode or files cannot be allocated, and EMFILE if the process is out
+ * of file descriptors. The read end goes in pipefd[0] and the write end
+ * in pipefd[1].
  */
 int do_pipe(int pipefd[2]) {
-  NOT_YET_IMPLEMENTED("PIPES: do_pipe");
-  return -ENOTSUP;
+  vnode_t *vn;
+  file_t *rf, *wf;
+  int rfd, wfd;
+
+  if (NULL == (vn = pget()))
+    return -ENOMEM;
+  if (0 > (rfd = get_empty_fd(curproc))) {
+    vput(vn);
+    return rfd;
+  }
+  if (NULL == (rf = fget(-1))) {
+    vput(vn);
+    return -ENOMEM;
+  }
+  fdtable_set(curproc->p_fdt, rfd, rf);
+  if (0 > (wfd = get_empty_fd(curproc)) || NULL == (wf = fget(-1))) {
+    fdtable_clear(curproc->p_fdt, rfd);
+    fput(rf);
+    vput(vn);
+    return wfd < 0 ? wfd : -ENOMEM;
+  }
+  fdtable_set(curproc->p_fdt, wfd, wf);
+
+  rf->f_mode = FMODE_READ;
+  wf->f_mode = FMODE_WRITE;
+  vref(vn);
+  facq(rf, vn);
+  facq(wf, vn);
+  pipefd[0] = rfd;
+  pipefd[1] = wfd;
+  return 0;
 }
 
 /*
- * When reading from a pipe, you should make sure there are enough characters in
- * the buffer to read. If there are, grab them and move up the tail by
- *subtracting
- * from size. offset is ignored. Also, remember to take the reader lock to
- *prevent
- * other threads from reading while you are waiting for more characters.
- *
- * This might block, e.g. if there are no or not enough characters to read.
- * It might be the case that there are no more writers and we aren't done
- *reading.
- * However, in situations like this, there is no way to open the pipe for
- *writing
- * again so no more writers will ever put characters in the pipe. The reader
- *should
- * just take as much as it needs (or barring that, as much as it can get) and
- * return with a partial buffer.
+ * Reads whatever is in the pipe, up to len bytes, taking the reader lock
+ * so that concurrent reads each get contiguous data. offset is ignored.
+ * Blocks while the pipe is empty and there are still writers; once there
+ * are none, no more data can arrive, and an empty pipe reads as the end
+ * of the file.
  */
 static int pipe_read(vnode_t *vnode, off_t offset, void *buf, size_t len) {
-  NOT_YET_IMPLEMENTED("PIPES: pipe_read");
-  return -EINVAL;
+  pipe_t *p = VNODE_TO_PIPE(vnode);
+  size_t n, pg, total = 0;
+  int ret;
+
+  if (!len)
+    return 0;
+  if ((ret = kmutex_lock_cancellable(&p->pv_rdlock)))
+    return ret;
+  while (!p->pv_size) {
+    if (!p->pv_writers) {
+      kmutex_unlock(&p->pv_rdlock);
+      return 0;
+    }
+    if (sched_cancellable_sleep_on(&p->pv_read_waitq)) {
+      kmutex_unlock(&p->pv_rdlock);
+      return -EINTR;
+    }
+  }
+  while (total < len && p->pv_size) {
+    pg = p->pv_head / PAGE_SIZE;
+    n = MIN(MIN(len - total, PAGE_SIZE - p->pv_head % PAGE_SIZE), p->pv_size);
+    memcpy((char *)buf + total, p->pv_pages[pg] + p->pv_head % PAGE_SIZE, n);
+    total += n;
+    p->pv_size -= n;
+    p->pv_head = (p->pv_head + n) % PIPE_CAPACITY;
+    /* free a page once it has been read, unless it is the one being
+     * written into next */
+    if (!(p->pv_head % PAGE_SIZE) &&
+        pg != ((p->pv_head + p->pv_size) % PIPE_CAPACITY) / PAGE_SIZE) {
+      page_free(p->pv_pages[pg]);
+      p->pv_pages[pg] = NULL;
+    }
+  }
+  if (PIPE_CAPACITY - p->pv_size >= PIPE_WAKE_ROOM) {
+    sched_broadcast_on(&p->pv_write_waitq);
+    pollq_wakeup(&p->pv_pollq);
+  }
+  kmutex_unlock(&p->pv_rdlock);
+  return total;
 }
 
 /*
- * Writing to a pipe is the dual of reading: if there is room, we can write our
- * data and go, but if not, we have to wait until there is more room and alert
- * any potential readers. Like above, you should take the writer lock to make
- * sure your write is contiguous.
+ * Writing to a pipe is the dual of reading: if there is room, we can write
+ * our data and go, but if not, we have to alert the readers and wait until
+ * there is more room. The writer lock keeps each write contiguous.
  *
- * If there are no more readers, we have a broken pipe, and should fail with
- * the EPIPE error number.
+ * If there are no more readers, we have a broken pipe, and fail with
+ * EPIPE, or return what was written before they went away.
  */
 static int pipe_write(vnode_t *vnode, off_t offset, const void *buf,
                       size_t len) {
-  NOT_YET_IMPLEMENTED("PIPES: pipe_write");
-  return -EINVAL;
+  pipe_t *p = VNODE_TO_PIPE(vnode);
+  size_t n, pos, total = 0;
+  int ret = 0;
+
+  if ((ret = kmutex_lock_cancellable(&p->pv_wrlock)))
+    return ret;
+  while (total < len) {
+    if (!p->pv_readers) {
+      ret = -EPIPE;
+      break;
+    }
+    if (p->pv_size == PIPE_CAPACITY) {
+      sched_broadcast_on(&p->pv_read_waitq);
+      if ((ret = sched_cancellable_sleep_on(&p->pv_write_waitq)))
+        break;
+      continue;
+    }
+    pos = (p->pv_head + p->pv_size) % PIPE_CAPACITY;
+    if (!p->pv_pages[pos / PAGE_SIZE] &&
+        NULL == (p->pv_pages[pos / PAGE_SIZE] = (char *)page_alloc())) {
+      ret = -ENOMEM;
+      break;
+    }
+    n = MIN(MIN(len - total, PAGE_SIZE - pos % PAGE_SIZE),
+            PIPE_CAPACITY - p->pv_size);
+    memcpy(p->pv_pages[pos / PAGE_SIZE] + pos % PAGE_SIZE,
+           (const char *)buf + total, n);
+    total += n;
+    p->pv_size += n;
+  }
+  if (total) {
+    sched_broadcast_on(&p->pv_read_waitq);
+    pollq_wakeup(&p->pv_pollq);
+  }
+  kmutex_unlock(&p->pv_wrlock);
+  return total ? (int)total : ret;
 }
 
 /*
- * It's still possible to stat a pipe using the fstat call, which takes a file
- * descriptor.
- * Pipes don't have too much information, though. The only ones that matter here
- * are
- * st_mode and st_ino, though you want to zero out some of the others.
+ * Pipes don't have much to stat: just the mode, the number, and how much
+ * is waiting to be read.
  */
 static int pipe_stat(vnode_t *vnode, struct stat *ss) {
-  NOT_YET_IMPLEMENTED("PIPES: pipe_stat");
-  return -EINVAL;
+  memset(ss, 0, sizeof(*ss));
+  ss->st_mode = vnode->vn_mode;
+  ss->st_ino = (int)vnode->vn_vno;
+  ss->st_nlink = 1;
+  ss->st_size = (int)VNODE_TO_PIPE(vnode)->pv_size;
+  ss->st_blksize = (int)PAGE_SIZE;
+  return 0;
 }
 
 /*
- * If someone is opening the read end of the pipe, we need to increment
- * the reader count, and the same for the writer count if a file open
- * for writing is acquiring this vnode. This count needs to be accurate
- * for correct reading and writing behavior.
+ * Count the readers and writers, which pipe_read and pipe_write rely on
+ * to tell when the other end has gone away.
  */
 static int pipe_acquire(vnode_t *vnode, file_t *file) {
-  NOT_YET_IMPLEMENTED("PIPES: pipe_acquire");
+  pipe_t *p = VNODE_TO_PIPE(vnode);
+  if (file->f_mode & FMODE_READ)
+    p->pv_readers++;
+  if (file->f_mode & FMODE_WRITE)
+    p->pv_writers++;
   return 0;
 }
 
 /*
- * Subtract from the reader or writer count as necessary here. If either
- * count hits zero, you are going to need to wake up the other group of
- * threads so they can either return with their partial read or notice
- * the broken pipe.
+ * When the last reader or writer goes away, wake the other side so that
+ * it can return a partial read or notice the broken pipe.
  */
 static int pipe_release(vnode_t *vnode, file_t *file) {
-  NOT_YET_IMPLEMENTED("PIPES: pipe_release");
+  pipe_t *p = VNODE_TO_PIPE(vnode);
+  if ((file->f_mode & FMODE_READ) && !--p->pv_readers) {
+    sched_broadcast_on(&p->pv_write_waitq);
+    pollq_wakeup(&p->pv_pollq);
+  }
+  if ((file->f_mode & FMODE_WRITE) && !--p->pv_writers) {
+    sched_broadcast_on(&p->pv_read_waitq);
+    pollq_wakeup(&p->pv_pollq);
+  }
   return 0;
 }
+
+/*
+ * A pipe can be read if it has data, and written once there is as much
+ * room as would wake a blocked writer. With no writers left, reads see
+ * the end of the file (POLLHUP); with no readers, writes fail (POLLERR).
+ */
+static int pipe_poll(vnode_t *vnode, int events, poll_table_t *pt) {
+  pipe_t *p = VNODE_TO_PIPE(vnode);
+  int ready = 0;
+  poll_wait(&p->pv_pollq, pt);
+  if (p->pv_size)
+    ready |= POLLIN;
+  if (PIPE_CAPACITY - p->pv_size >= PIPE_WAKE_ROOM)
+    ready |= POLLOUT;
+  if (!p->pv_writers)
+    ready |= POLLHUP;
+  if (!p->pv_readers)
+    ready |= POLLERR;
+  return ready;
+}
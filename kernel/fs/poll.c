@@ -0,0 +1,174 @@
+/*
+ *  FILE: poll.c
+ *  DESC: Waiting for any of several files to become ready, for poll(2).
+ */
+
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "fs/file.h"
+#include "fs/poll.h"
+#include "fs/vnode.h"
+
+#include "main/interrupt.h"
+
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/time.h"
+
+/*
+ * One thread in do_poll, on its stack. A thread can only sleep on one
+ * queue, so the objects it polls wake pw_waitq through its entries on
+ * their pollqs; pw_woken catches a wakeup which comes before it sleeps.
+ */
+typedef struct poll_wqueues {
+  poll_table_t pw_pt;
+  ktqueue_t pw_waitq;
+  int pw_woken;
+  int pw_nentries;
+  poll_entry_t pw_entries[NFILES];
+} poll_wqueues_t;
+
+void pollq_init(pollq_t *q) { list_init(&q->pq_entries); }
+
+void poll_wait(pollq_t *q, poll_table_t *pt) {
+  if (pt)
+    pt->pt_qproc(q, pt);
+}
+
+void pollq_wakeup(pollq_t *q) {
+  poll_entry_t *pe;
+  uint8_t old_ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  list_iterate_begin(&q->pq_entries, pe, poll_entry_t, pe_link) {
+    pe->pe_wake(pe->pe_arg);
+  }
+  list_iterate_end();
+  intr_setipl(old_ipl);
+}
+
+void pollq_add(pollq_t *q, poll_entry_t *pe) {
+  uint8_t old_ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  list_insert_tail(&q->pq_entries, &pe->pe_link);
+  intr_setipl(old_ipl);
+}
+
+void pollq_remove(poll_entry_t *pe) {
+  uint8_t old_ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  list_remove(&pe->pe_link);
+  intr_setipl(old_ipl);
+}
+
+static void poll_wake(void *arg) {
+  poll_wqueues_t *pw = (poll_wqueues_t *)arg;
+  pw->pw_woken = 1;
+  sched_broadcast_on(&pw->pw_waitq);
+}
+
+static void poll_qproc(pollq_t *q, poll_table_t *pt) {
+  poll_wqueues_t *pw = CONTAINER_OF(pt, poll_wqueues_t, pw_pt);
+  poll_entry_t *pe;
+  /* Each file registers on at most one queue and there are at most
+   * NFILES files, but if the table does fill, don't sleep on it */
+  if (pw->pw_nentries == NFILES) {
+    pw->pw_woken = 1;
+    return;
+  }
+  pe = &pw->pw_entries[pw->pw_nentries++];
+  pe->pe_wake = poll_wake;
+  pe->pe_arg = pw;
+  pollq_add(q, pe);
+}
+
+/* Takes pw off every pollq it was put on */
+static void poll_unregister(poll_wqueues_t *pw) {
+  int i;
+  uint8_t old_ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  for (i = 0; i < pw->pw_nentries; ++i)
+    list_remove(&pw->pw_entries[i].pe_link);
+  pw->pw_nentries = 0;
+  pw->pw_woken = 0;
+  intr_setipl(old_ipl);
+}
+
+/*
+ * Sets the revents of each of fds and returns how many are set. Files
+ * without a poll operation, like regular files, never block and so are
+ * always ready. pt is passed to the poll operations only until some file
+ * is found ready, since then there is no need to wait.
+ */
+static int poll_scan(struct pollfd *fds, nfds_t nfds, poll_table_t *pt) {
+  file_t *f;
+  vnode_t *vn;
+  nfds_t i;
+  int events, nready = 0;
+
+  for (i = 0; i < nfds; ++i) {
+    fds[i].revents = 0;
+    if (fds[i].fd < 0)
+      continue;
+    if (NULL == (f = fget(fds[i].fd))) {
+      fds[i].revents = POLLNVAL;
+    } else {
+      vn = f->f_vnode;
+      events = fds[i].events | POLLERR | POLLHUP;
+      if (vn->vn_ops->poll)
+        fds[i].revents = events & vn->vn_ops->poll(vn, events,
+                                                   nready ? NULL : pt);
+      else
+        fds[i].revents = events & (POLLIN | POLLOUT);
+      fput(f);
+    }
+    if (fds[i].revents)
+      nready++;
+  }
+  return nready;
+}
+
+int do_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  poll_wqueues_t pw;
+  unsigned long deadline = 0, now;
+  uint8_t old_ipl;
+  int nready, ret;
+
+  if (nfds > NFILES)
+    return -EINVAL;
+  pw.pw_pt.pt_qproc = poll_qproc;
+  sched_queue_init(&pw.pw_waitq);
+  pw.pw_woken = 0;
+  pw.pw_nentries = 0;
+  if (timeout > 0)
+    deadline = time_deadline_ms(timeout);
+
+  while (!(nready = poll_scan(fds, nfds, timeout ? &pw.pw_pt : NULL)) &&
+         timeout) {
+    ret = 0;
+    /* Interrupts stay masked from the check to the sleep, so that a tty
+     * waking us in between is not missed */
+    old_ipl = intr_getipl();
+    intr_setipl(IPL_HIGH);
+    if (!pw.pw_woken) {
+      if (timeout < 0)
+        ret = sched_cancellable_sleep_on(&pw.pw_waitq);
+      else if ((now = time_ticks()) < deadline)
+        ret = sched_cancellable_sleep_on_timeout(&pw.pw_waitq, deadline - now);
+      else
+        ret = -ETIMEDOUT;
+    }
+    intr_setipl(old_ipl);
+    poll_unregister(&pw);
+    if (-EINTR == ret)
+      return ret;
+    /* Look once more, without waiting, when the time is up */
+    if (-ETIMEDOUT == ret)
+      timeout = 0;
+  }
+  poll_unregister(&pw);
+  return nready;
+}
@@ -61,6 +61,8 @@ static int ramfs_unlink(vnode_t *dir, const char *name, size_t name_len);
 static int ramfs_mkdir(vnode_t *dir, const char *name, size_t name_len);
 static int ramfs_rmdir(vnode_t *dir, const char *name, size_t name_len);
 static int ramfs_readdir(vnode_t *dir, off_t offset, struct dirent *d);
+static int ramfs_readdirv(vnode_t *dir, off_t offset, struct dirent *d, int n,
+                          int *nread);
 static int ramfs_stat(vnode_t *file, struct stat *buf);
 
 static vnode_ops_t ramfs_dir_vops = {.read = NULL,
@@ -74,6 +76,7 @@ static vnode_ops_t ramfs_dir_vops = {.read = NULL,
                                      .mkdir = ramfs_mkdir,
                                      .rmdir = ramfs_rmdir,
                                      .readdir = ramfs_readdir,
+                                     .readdirv = ramfs_readdirv,
                                      .stat = ramfs_stat,
                                      .acquire = NULL,
                                      .release = NULL,
@@ -604,6 +607,18 @@ static int ramfs_readdir(vnode_t *dir, off_t offset, struct dirent *d) {
   return ret;
 }
 
+static int ramfs_readdirv(vnode_t *dir, off_t offset, struct dirent *d, int n,
+                          int *nread) {
+  int ret, total = 0;
+
+  for (*nread = 0; *nread < n; ++*nread) {
+    if (0 == (ret = ramfs_readdir(dir, offset + total, d + *nread)))
+      break;
+    total += ret;
+  }
+  return total;
+}
+
 static int ramfs_stat(vnode_t *file, struct stat *buf) {
   ramfs_inode_t *i = VNODE_TO_RAMFSINODE(file);
   memset(buf, 0, sizeof(struct stat));
@@ -14,14 +14,22 @@
 #include "util/debug.h"
 
 #include "proc/kmutex.h"
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
 
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_csum.h"
+#include "fs/s5fs/s5fs_warm.h"
+#include "fs/s5fs/s5fs_compress.h"
 #include "fs/dirent.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "fs/file.h"
 #include "fs/stat.h"
+#include "fs/uio.h"
 
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
@@ -37,7 +45,8 @@
 
 /* Diagnostic/Utility: */
 static int s5_check_super(s5_super_t *super);
-static int s5fs_check_refcounts(fs_t *fs);
+static int s5fs_check_refcounts(fs_t *fs, int repair);
+static void *s5fs_fsck_run(int arg1, void *arg2);
 
 /* fs_t entry points: */
 static void s5fs_read_vnode(vnode_t *vnode);
@@ -49,6 +58,14 @@ static int s5fs_umount(fs_t *fs);
 static int s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
 static int s5fs_write(vnode_t *vnode, off_t offset, const void *buf,
                       size_t len);
+static int s5fs_readv(vnode_t *vnode, off_t offset, const struct iovec *iov,
+                      int iovcnt);
+static int s5fs_writev(vnode_t *vnode, off_t offset, const struct iovec *iov,
+                       int iovcnt);
+static int s5fs_splice_read(vnode_t *vnode, off_t offset, size_t count,
+                            splice_actor_t actor, void *arg);
+static int s5fs_direct_io(vnode_t *vnode, off_t offset, void *buf, size_t len,
+                          int write);
 static int s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
 static int s5fs_create(vnode_t *vdir, const char *name, size_t namelen,
                        vnode_t **result);
@@ -62,11 +79,20 @@ static int s5fs_unlink(vnode_t *vdir, const char *name, size_t namelen);
 static int s5fs_mkdir(vnode_t *vdir, const char *name, size_t namelen);
 static int s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen);
 static int s5fs_readdir(vnode_t *vnode, int offset, struct dirent *d);
+static int s5fs_readdirv(vnode_t *vnode, off_t offset, struct dirent *d,
+                         int n, int *nread);
 static int s5fs_stat(vnode_t *vnode, struct stat *ss);
 static int s5fs_release(vnode_t *vnode, file_t *file);
 static int s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf);
 static int s5fs_dirtypage(vnode_t *vnode, off_t offset);
 static int s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf);
+static int s5fs_cleanpages(vnode_t *vnode, off_t offset, void **pagebufs,
+                           int npages);
+static void s5fs_readahead(vnode_t *vnode, uint32_t pagenum, uint32_t npages);
+static int s5fs_fsync(vnode_t *vnode, int datasync);
+static int s5fs_truncate(vnode_t *vnode, off_t len);
+static int s5fs_punch_hole(vnode_t *vnode, off_t offset, off_t len);
+static int s5fs_compress(vnode_t *vnode, int on);
 
 fs_ops_t s5fs_fsops = {s5fs_read_vnode, s5fs_delete_vnode, s5fs_query_vnode,
                        s5fs_umount};
@@ -83,16 +109,22 @@ static vnode_ops_t s5fs_dir_vops = {.read = NULL,
                                     .mkdir = s5fs_mkdir,
                                     .rmdir = s5fs_rmdir,
                                     .readdir = s5fs_readdir,
+                                    .readdirv = s5fs_readdirv,
                                     .stat = s5fs_stat,
                                     .acquire = NULL,
                                     .release = NULL,
                                     .fillpage = s5fs_fillpage,
                                     .dirtypage = s5fs_dirtypage,
-                                    .cleanpage = s5fs_cleanpage};
+                                    .cleanpage = s5fs_cleanpage,
+                                    .fsync = s5fs_fsync};
 
 /* vnode operations table for regular files: */
 static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
                                      .write = s5fs_write,
+                                     .readv = s5fs_readv,
+                                     .writev = s5fs_writev,
+                                     .splice_read = s5fs_splice_read,
+                                     .direct_io = s5fs_direct_io,
                                      .mmap = s5fs_mmap,
                                      .create = NULL,
                                      .mknod = NULL,
@@ -107,7 +139,13 @@ static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
                                      .release = NULL,
                                      .fillpage = s5fs_fillpage,
                                      .dirtypage = s5fs_dirtypage,
-                                     .cleanpage = s5fs_cleanpage};
+                                     .cleanpage = s5fs_cleanpage,
+                                     .cleanpages = s5fs_cleanpages,
+                                     .readahead = s5fs_readahead,
+                                     .fsync = s5fs_fsync,
+                                     .truncate = s5fs_truncate,
+                                     .punch_hole = s5fs_punch_hole,
+                                     .compress = s5fs_compress};
 
 /*
  * Read fs->fs_dev and set fs_op, fs_root, and fs_i.
@@ -118,12 +156,93 @@ static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
  *
  * Return 0 on success, negative on failure.
  */
+int s5fs_format(blockdev_t *bd, uint32_t ninodes) {
+  uint32_t iblocks = (ninodes + S5_INODES_PER_BLOCK - 1) / S5_INODES_PER_BLOCK;
+  uint32_t rootblock = iblocks + 1, last = (uint32_t)-1, num, i;
+  s5_super_t *super = NULL;
+  s5_inode_t *inode;
+  s5_dirent_t *dirent;
+  uint32_t *node;
+  char *buf;
+  int ret = -ENOMEM;
+
+  if (!ninodes || rootblock + 1 >= bd->bd_nblocks)
+    return -EINVAL;
+  if (NULL == (buf = page_alloc()) || NULL == (super = page_alloc()))
+    goto out;
+  memset(super, 0, S5_BLOCK_SIZE);
+
+  /* the inodes, each free but the root and pointing at the next */
+  for (num = 1; num <= iblocks; ++num) {
+    memset(buf, 0, S5_BLOCK_SIZE);
+    inode = (s5_inode_t *)buf;
+    for (i = (num - 1) * S5_INODES_PER_BLOCK;
+         i < MIN(num * S5_INODES_PER_BLOCK, ninodes); ++i, ++inode) {
+      inode->s5_number = i;
+      inode->s5_type = S5_TYPE_FREE;
+      inode->s5_next_free = i + 1 < ninodes ? i + 1 : (uint32_t)-1;
+    }
+    if (1 == num) {
+      inode = (s5_inode_t *)buf;
+      inode->s5_type = S5_TYPE_DIR;
+      inode->s5_size = 2 * sizeof(s5_dirent_t);
+      inode->s5_linkcount = 1;
+      inode->s5_direct_blocks[0] = rootblock;
+    }
+    if ((ret = blockdev_write(bd, buf, num, 1)))
+      goto out;
+  }
+
+  memset(buf, 0, S5_BLOCK_SIZE);
+  dirent = (s5_dirent_t *)buf;
+  strcpy(dirent[0].s5d_name, ".");
+  strcpy(dirent[1].s5d_name, "..");
+  if ((ret = blockdev_write(bd, buf, rootblock, 1)))
+    goto out;
+
+  /* the free list: a block of it is written each time the superblock's
+   * part fills up, and the superblock then points at it */
+  for (num = rootblock + 1; num < bd->bd_nblocks; ++num) {
+    if (super->s5s_nfree < S5_NBLKS_PER_FNODE - 1) {
+      super->s5s_free_blocks[super->s5s_nfree++] = num;
+      continue;
+    }
+    node = (uint32_t *)buf;
+    memcpy(node, super->s5s_free_blocks, sizeof(super->s5s_free_blocks));
+    node[S5_NBLKS_PER_FNODE - 1] = last;
+    if ((ret = blockdev_write(bd, buf, num, 1)))
+      goto out;
+    last = num;
+    super->s5s_nfree = 0;
+  }
+  super->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = last;
+
+  super->s5s_magic = S5_MAGIC;
+  super->s5s_free_inode = 1 < ninodes ? 1 : (uint32_t)-1;
+  super->s5s_root_inode = 0;
+  super->s5s_num_inodes = ninodes;
+  super->s5s_version = S5_CURRENT_VERSION;
+  super->s5s_state = S5_STATE_CLEAN;
+  s5_csum_super(super);
+  if (!(ret = blockdev_write(bd, (char *)super, S5_SUPER_BLOCK, 1)))
+    ret = blockdev_flush_cache(bd);
+  dbg(DBG_S5FS, "formatted %u blocks with %u inodes: %d\n", bd->bd_nblocks,
+      ninodes, ret);
+out:
+  if (buf)
+    page_free(buf);
+  if (super)
+    page_free(super);
+  return ret;
+}
+
 int s5fs_mount(struct fs *fs) {
   dbg(DBG_S5FS, "\n");
   int num;
   blockdev_t *dev;
   s5fs_t *s5;
   pframe_t *vp;
+  int csum;
 
   KASSERT(fs);
 
@@ -144,6 +263,12 @@ int s5fs_mount(struct fs *fs) {
   /*     init s5f_disk: */
   s5->s5f_bdev = dev;
 
+  /*     finish what a crash interrupted, before reading anything: */
+  if ((num = s5_journal_recover(dev))) {
+    kfree(s5);
+    return num;
+  }
+
   /*     init s5f_super: */
   pframe_get(S5FS_TO_VMOBJ(s5), S5_SUPER_BLOCK, &vp);
 
@@ -160,18 +285,78 @@ int s5fs_mount(struct fs *fs) {
 
   pframe_pin(vp);
 
+  /*     mark the disk as mounted before anything on it changes, and as
+   *     the current version, which may write inodes an older one
+   *     doesn't know: */
+  s5->s5f_state = s5->s5f_super->s5s_state;
+  if (0 > (csum = s5_csum_check_super(s5->s5f_super))) {
+    dbg(DBG_PRINT, "s5fs: superblock of %s fails its checksum\n",
+        fs->fs_dev);
+    if (S5_STATE_CLEAN == s5->s5f_state)
+      s5->s5f_state = S5_STATE_REPAIR;
+  }
+  s5->s5f_super->s5s_state = S5_STATE_MOUNTED;
+  s5->s5f_super->s5s_version = S5_CURRENT_VERSION;
+  s5_csum_super(s5->s5f_super);
+  if ((num = blockdev_write(dev, vp->pf_addr, S5_SUPER_BLOCK, 1)) ||
+      (num = blockdev_flush_cache(dev))) {
+    pframe_unpin(vp);
+    kfree(s5);
+    return num;
+  }
+  s5->s5f_fsck_thr = NULL;
+  sched_queue_init(&s5->s5f_fsckq);
+
   /*     init s5f_mutex: */
   kmutex_init(&s5->s5f_mutex);
 
+  /*     init the free block and inode bitmaps: */
+  spinlock_init(&s5->s5f_map_lock, "s5fs_map");
+  if ((num = s5_load_freemaps(s5))) {
+    pframe_unpin(vp);
+    spinlock_destroy(&s5->s5f_map_lock);
+    kfree(s5);
+    return num;
+  }
+
+  /*     init s5f_journal: */
+  s5->s5f_csum_nblocks = 0;
+  if ((num = s5_journal_start(s5)))
+    dbg(DBG_PRINT, "s5fs: cannot start journal (%d), not journaling\n", num);
+
   /*     init s5f_fs: */
   s5->s5f_fs = fs;
 
+  /*     init the metadata checksums: */
+  if ((num = s5_csum_start(s5, csum)))
+    dbg(DBG_PRINT, "s5fs: cannot start checksums (%d), not checksumming\n",
+        num);
+
   /* Init the members of fs that we (the fs-implementation) are
    * responsible for initializing: */
   fs->fs_i = s5;
   fs->fs_op = &s5fs_fsops;
   fs->fs_root = vget(fs, s5->s5f_super->s5s_root_inode);
 
+  /* the pages hot at the last unmount are only worth reading back in if
+   * nothing has changed the disk since */
+  s5_warm_start(s5, 1 == csum && S5_STATE_CLEAN == s5->s5f_state);
+
+  /* A clean unmount leaves consistent link counts, so they are only
+   * checked (and repaired) after a crash */
+  if (S5_STATE_CLEAN != s5->s5f_state) {
+    if (S5_FSCK_BACKGROUND && S5_STATE_MOUNTED == s5->s5f_state) {
+      proc_t *p = proc_create("s5fsck");
+      KASSERT(NULL != p);
+      s5->s5f_fsck_thr = kthread_create(p, s5fs_fsck_run, 0, fs);
+      KASSERT(NULL != s5->s5f_fsck_thr);
+      sched_make_runnable(s5->s5f_fsck_thr);
+    } else {
+      s5fs_check_refcounts(fs, 1);
+      s5->s5f_state = S5_STATE_CLEAN;
+    }
+  }
+
   return 0;
 }
 
@@ -207,7 +392,9 @@ int s5fs_mount(struct fs *fs) {
  */
 static void s5fs_read_vnode(vnode_t *vnode) {
   dbg(DBG_S5FS, "vno: %d\n", vnode->vn_vno);
-  kmutex_lock(&vnode->vn_mutex);
+  s5_jhandle_t h;
+  s5_journal_begin(VNODE_TO_S5FS(vnode), &h);
+  krwlock_write_lock(&vnode->vn_lock);
   // Get page frame
   pframe_t *pframe;
   mmobj_t *mmobj = S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode));
@@ -225,8 +412,8 @@ static void s5fs_read_vnode(vnode_t *vnode) {
   // Set devid
   vnode->vn_devid = NULL;
   // Set mode and ops
-  if (type == S5_TYPE_FREE ||
-      (inode->s5_type == S5_TYPE_DATA)) {
+  if (type == S5_TYPE_FREE || type == S5_TYPE_DATA ||
+      type == S5_TYPE_INLINE || type == S5_TYPE_COMPRESSED) {
     vnode->vn_mode = S_IFREG;
     vnode->vn_ops = &s5fs_file_vops;
   } else if (type == S5_TYPE_DIR) {
@@ -249,7 +436,8 @@ static void s5fs_read_vnode(vnode_t *vnode) {
   else
     vnode->vn_len = inode->s5_size;
   dbg(DBG_S5FS, "read vno: %d linkcount: %d\n", vnode->vn_vno, inode->s5_linkcount);
-  kmutex_unlock(&vnode->vn_mutex);
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(VNODE_TO_S5FS(vnode), &h);
 }
 
 /*
@@ -262,7 +450,9 @@ static void s5fs_read_vnode(vnode_t *vnode) {
  */
 static void s5fs_delete_vnode(vnode_t *vnode) {
   dbg(DBG_S5FS, "vno: %d\n", vnode->vn_vno);
-  kmutex_lock(&vnode->vn_mutex);
+  s5_jhandle_t h;
+  s5_journal_begin(VNODE_TO_S5FS(vnode), &h);
+  krwlock_write_lock(&vnode->vn_lock);
   // Get page frame
   pframe_t *pframe;
   mmobj_t *mmobj = S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode));
@@ -275,10 +465,12 @@ static void s5fs_delete_vnode(vnode_t *vnode) {
   KASSERT(inode->s5_linkcount >= 0);
   // Free inode if link count zero
   pframe_unpin(pframe); // Unpin frame
+  s5_dindex_destroy(vnode);
   if (!inode->s5_linkcount)
     s5_free_inode(vnode);
   dbg(DBG_S5FS, "vno: %d, linkcount: %d\n", vnode->vn_vno, inode->s5_linkcount);
-  kmutex_unlock(&vnode->vn_mutex);
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(VNODE_TO_S5FS(vnode), &h);
 }
 
 /*
@@ -290,11 +482,11 @@ static void s5fs_delete_vnode(vnode_t *vnode) {
  */
 static int s5fs_query_vnode(vnode_t *vnode) {
   dbg(DBG_S5FS, "vno: %d\n", vnode->vn_vno);
-  kmutex_lock(&vnode->vn_mutex);
+  krwlock_read_lock(&vnode->vn_lock);
   // Get inode
   s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
   KASSERT(inode->s5_linkcount >= 0);
-  kmutex_unlock(&vnode->vn_mutex);
+  krwlock_read_unlock(&vnode->vn_lock);
   return inode->s5_linkcount > 0;
 }
 
@@ -306,10 +498,16 @@ static int s5fs_umount(fs_t *fs) {
   dbg(DBG_S5FS, "\n");
   s5fs_t *s5 = (s5fs_t *)fs->fs_i;
   blockdev_t *bd = s5->s5f_bdev;
+  s5_jhandle_t h;
   pframe_t *sbp;
   int ret;
 
-  if (s5fs_check_refcounts(fs)) {
+  while (s5->s5f_fsck_thr)
+    sched_sleep_on(&s5->s5f_fsckq);
+  s5_csum_stop(s5);
+  s5_warm_stop(s5);
+
+  if (S5_UMOUNT_CHECK && s5fs_check_refcounts(fs, 0)) {
     dbg(DBG_PRINT, "s5fs_umount: WARNING: linkcount corruption "
                    "discovered in fs on block device with major %d "
                    "and minor %d!!\n",
@@ -330,12 +528,24 @@ static int s5fs_umount(fs_t *fs) {
           MAJOR(bd->bd_id), MINOR(bd->bd_id));
   }
 
+  if ((ret = s5_warm_record(s5)))
+    dbg(DBG_PRINT, "s5fs: cannot write down hot pages (%d)\n", ret);
+
   dbg(DBG_S5FS, "flushing all vnodes\n");
   vnode_flush_all(fs);
 
   dbg(DBG_S5FS, "vput root\n");
   vput(fs->fs_root);
 
+  /* writing back dirty pages allocates blocks, so only now can the free
+   * blocks and inodes go back on the superblock's lists */
+  s5_journal_begin(s5, &h);
+  s5_save_freemaps(s5);
+  s5_journal_end(s5, &h);
+
+  /* commit what is left; after this all metadata is home */
+  s5_journal_stop(s5);
+
   if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(s5), S5_SUPER_BLOCK, &sbp))) {
     panic("s5fs_umount: failed to pframe_get super block. "
           "This should never happen (the page should already "
@@ -348,9 +558,20 @@ static int s5fs_umount(fs_t *fs) {
 
   pframe_unpin(sbp);
 
-  kfree(s5);
+  blockdev_flush_all(bd);
+  blockdev_flush_cache(bd);
 
+  /* only once everything is home may the disk say it was unmounted */
+  pframe_get(S5FS_TO_VMOBJ(s5), S5_SUPER_BLOCK, &sbp);
+  KASSERT(sbp);
+  ((s5_super_t *)sbp->pf_addr)->s5s_state = s5->s5f_state;
+  s5_csum_super((s5_super_t *)sbp->pf_addr);
+  pframe_dirty(sbp);
   blockdev_flush_all(bd);
+  blockdev_flush_cache(bd);
+
+  spinlock_destroy(&s5->s5f_map_lock);
+  kfree(s5);
 
   return 0;
 }
@@ -382,9 +603,9 @@ static int s5fs_umount(fs_t *fs) {
 /* Simply call s5_read_file. */
 static int s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len) {
   dbg(DBG_S5FS, "\n");
-  kmutex_lock(&vnode->vn_mutex);
+  krwlock_read_lock(&vnode->vn_lock);
   int status = s5_read_file(vnode, offset, (char *)buf, len);
-  kmutex_unlock(&vnode->vn_mutex);
+  krwlock_read_unlock(&vnode->vn_lock);
   return status;
 }
 
@@ -392,12 +613,116 @@ static int s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len) {
 static int s5fs_write(vnode_t *vnode, off_t offset, const void *buf,
                       size_t len) {
   dbg(DBG_S5FS, "\n");
-  kmutex_lock(&vnode->vn_mutex);
+  s5_jhandle_t h;
+  s5_journal_begin(VNODE_TO_S5FS(vnode), &h);
+  krwlock_write_lock(&vnode->vn_lock);
   int status = s5_write_file(vnode, offset, (char *)buf, len);
-  kmutex_unlock(&vnode->vn_mutex);
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(VNODE_TO_S5FS(vnode), &h);
   return status;
 }
 
+/*
+ * Call s5_read_file (or s5_write_file) on each buffer in turn, holding
+ * the vnode lock throughout, until one comes up short.
+ */
+static int s5fs_readv(vnode_t *vnode, off_t offset, const struct iovec *iov,
+                      int iovcnt) {
+  dbg(DBG_S5FS, "\n");
+  int i, n, total = 0;
+  krwlock_read_lock(&vnode->vn_lock);
+  for (i = 0; i < iovcnt; ++i) {
+    n = s5_read_file(vnode, offset + total, iov[i].iov_base, iov[i].iov_len);
+    if (n < 0) {
+      if (!total)
+        total = n;
+      break;
+    }
+    total += n;
+    if ((size_t)n < iov[i].iov_len)
+      break;
+  }
+  krwlock_read_unlock(&vnode->vn_lock);
+  return total;
+}
+
+static int s5fs_writev(vnode_t *vnode, off_t offset, const struct iovec *iov,
+                       int iovcnt) {
+  dbg(DBG_S5FS, "\n");
+  s5_jhandle_t h;
+  int i, n, total = 0;
+  s5_journal_begin(VNODE_TO_S5FS(vnode), &h);
+  krwlock_write_lock(&vnode->vn_lock);
+  for (i = 0; i < iovcnt; ++i) {
+    n = s5_write_file(vnode, offset + total, iov[i].iov_base, iov[i].iov_len);
+    if (n < 0) {
+      if (!total)
+        total = n;
+      break;
+    }
+    total += n;
+    if ((size_t)n < iov[i].iov_len)
+      break;
+  }
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(VNODE_TO_S5FS(vnode), &h);
+  return total;
+}
+
+/* Call s5_direct_io, locked as s5fs_read or s5fs_write would be. */
+static int s5fs_direct_io(vnode_t *vnode, off_t offset, void *buf, size_t len,
+                          int write) {
+  dbg(DBG_S5FS, "\n");
+  s5_jhandle_t h;
+  int status;
+  if (!write) {
+    krwlock_read_lock(&vnode->vn_lock);
+    status = s5_direct_io(vnode, offset, (char *)buf, len, 0);
+    krwlock_read_unlock(&vnode->vn_lock);
+    return status;
+  }
+  s5_journal_begin(VNODE_TO_S5FS(vnode), &h);
+  krwlock_write_lock(&vnode->vn_lock);
+  status = s5_direct_io(vnode, offset, (char *)buf, len, 1);
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(VNODE_TO_S5FS(vnode), &h);
+  return status;
+}
+
+/*
+ * Pin each page in turn under the read lock, then drop the lock while the
+ * actor consumes it, so that the actor can write to another s5fs file
+ * (whose journal handle must not be taken under a vnode lock) or block on
+ * a slow device without holding up writers to this one.
+ */
+static int s5fs_splice_read(vnode_t *vnode, off_t offset, size_t count,
+                            splice_actor_t actor, void *arg) {
+  dbg(DBG_S5FS, "\n");
+  pframe_t *pf;
+  size_t n, total = 0;
+  int status;
+
+  while (total < count) {
+    krwlock_read_lock(&vnode->vn_lock);
+    status = s5_pin_file_page(vnode, offset + total, &pf, &n);
+    krwlock_read_unlock(&vnode->vn_lock);
+    if (status < 0)
+      return total ? (int)total : status;
+    if (!pf)
+      break;
+    n = MIN(n, count - total);
+    status = actor(arg, (char *)pf->pf_addr + S5_DATA_OFFSET(offset + total),
+                   n);
+    pframe_unpin(pf);
+    if (status < 0)
+      return total ? (int)total : status;
+    total += status;
+    if ((size_t)status < n)
+      break;
+  }
+  return total;
+}
+
 /* This function is deceptivly simple, just return the vnode's
  * mmobj_t through the ret variable. Remember to watch the
  * refcount.
@@ -405,9 +730,8 @@ static int s5fs_write(vnode_t *vnode, off_t offset, const void *buf,
  * Don't worry about this until VM.
  */
 static int s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret) {
-  NOT_YET_IMPLEMENTED("VM: s5fs_mmap");
-  if (ret) 
-    *ret = &file->vn_mmobj;
+  vref(file);
+  *ret = &file->vn_mmobj;
   return 0;
 }
 
@@ -422,23 +746,27 @@ static int s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret) {
 static int s5fs_create(vnode_t *dir, const char *name, size_t namelen,
                        vnode_t **result) {
   dbg(DBG_S5FS, "\n");
+  s5_jhandle_t h;
   if (namelen > S5_NAME_LEN)
     return -ENAMETOOLONG;
-  kmutex_lock(&dir->vn_mutex);
+  s5_journal_begin(VNODE_TO_S5FS(dir), &h);
+  krwlock_write_lock(&dir->vn_lock);
   int ino = s5_alloc_inode(dir->vn_fs, S5_TYPE_DATA, dir->vn_devid);
   if (ino < 0) {
     dbg(DBG_S5FS, "alloc_inode error: %d\n", ino);
-    kmutex_unlock(&dir->vn_mutex);
+    krwlock_write_unlock(&dir->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(dir), &h);
     return ino;
   }
   vnode_t *vnode = vget(dir->vn_fs, ino);
-  kmutex_lock(&vnode->vn_mutex);
+  krwlock_write_lock(&vnode->vn_lock);
   if (result) *result = vnode;
   int status = s5_link(dir, vnode, name, namelen);
-  kmutex_unlock(&dir->vn_mutex);
-  kmutex_unlock(&vnode->vn_mutex);
+  krwlock_write_unlock(&dir->vn_lock);
+  krwlock_write_unlock(&vnode->vn_lock);
   KASSERT(vnode->vn_refcount == 1);
   KASSERT(VNODE_TO_S5INODE(vnode)->s5_linkcount == 2);
+  s5_journal_end(VNODE_TO_S5FS(dir), &h);
   return status;
 }
 
@@ -453,9 +781,11 @@ static int s5fs_create(vnode_t *dir, const char *name, size_t namelen,
 static int s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode,
                       devid_t devid) {
   dbg(DBG_S5FS, "\n");
+  s5_jhandle_t h;
   if (namelen > S5_NAME_LEN)
     return -ENAMETOOLONG;
-  kmutex_lock(&dir->vn_mutex);
+  s5_journal_begin(VNODE_TO_S5FS(dir), &h);
+  krwlock_write_lock(&dir->vn_lock);
   uint16_t type = 0;
   if (S_ISCHR(mode))
     type = S5_TYPE_CHR;
@@ -465,15 +795,17 @@ static int s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode,
     panic("Invalid mode!\n");
   int ino = s5_alloc_inode(dir->vn_fs, type, devid);
   if (ino < 0) {
-    kmutex_unlock(&dir->vn_mutex);
+    krwlock_write_unlock(&dir->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(dir), &h);
     return ino;
   }
   vnode_t *vnode = vget(dir->vn_fs, ino);
-  kmutex_lock(&vnode->vn_mutex);
+  krwlock_write_lock(&vnode->vn_lock);
   int status = s5_link(dir, vnode, name, namelen);
-  kmutex_unlock(&dir->vn_mutex);
-  kmutex_unlock(&vnode->vn_mutex);
+  krwlock_write_unlock(&dir->vn_lock);
+  krwlock_write_unlock(&vnode->vn_lock);
   vput(vnode);
+  s5_journal_end(VNODE_TO_S5FS(dir), &h);
   return status;
 }
 
@@ -485,18 +817,22 @@ static int s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode,
 int s5fs_lookup(vnode_t *base, const char *name, size_t namelen,
                 vnode_t **result) {
   dbg(DBG_S5FS, "%.*s\n", namelen, name);
+  s5_jhandle_t h;
   if (namelen > S5_NAME_LEN)
     return -ENAMETOOLONG;
-  kmutex_lock(&base->vn_mutex);
+  s5_journal_begin(VNODE_TO_S5FS(base), &h);
+  krwlock_read_lock(&base->vn_lock);
   int ino = s5_find_dirent(base, name, namelen);
   if (ino < 0) {
-    kmutex_unlock(&base->vn_mutex);
+    krwlock_read_unlock(&base->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(base), &h);
     return ino;
   }
   vnode_t *vnode = vget(base->vn_fs, ino);
   if (result) *result = vnode;
   else vput(vnode);
-  kmutex_unlock(&base->vn_mutex);
+  krwlock_read_unlock(&base->vn_lock);
+  s5_journal_end(VNODE_TO_S5FS(base), &h);
   return 0;
 }
 
@@ -511,12 +847,15 @@ int s5fs_lookup(vnode_t *base, const char *name, size_t namelen,
 static int s5fs_link(vnode_t *src, vnode_t *dir, const char *name,
                      size_t namelen) {
   dbg(DBG_S5FS, "\n");
+  s5_jhandle_t h;
   if (namelen > S5_NAME_LEN) return -ENAMETOOLONG;
-  kmutex_lock(&src->vn_mutex);
-  kmutex_lock(&dir->vn_mutex);
+  s5_journal_begin(VNODE_TO_S5FS(dir), &h);
+  krwlock_write_lock(&src->vn_lock);
+  krwlock_write_lock(&dir->vn_lock);
   int status = s5_link(dir, src, name, namelen);
-  kmutex_unlock(&src->vn_mutex);
-  kmutex_unlock(&dir->vn_mutex);
+  krwlock_write_unlock(&src->vn_lock);
+  krwlock_write_unlock(&dir->vn_lock);
+  s5_journal_end(VNODE_TO_S5FS(dir), &h);
   return status;
 }
 
@@ -530,11 +869,14 @@ static int s5fs_link(vnode_t *src, vnode_t *dir, const char *name,
  */
 static int s5fs_unlink(vnode_t *dir, const char *name, size_t namelen) {
   dbg(DBG_S5FS, "\n");
+  s5_jhandle_t h;
   if (namelen > S5_NAME_LEN)
     return -ENAMETOOLONG;
-  kmutex_lock(&dir->vn_mutex);
+  s5_journal_begin(VNODE_TO_S5FS(dir), &h);
+  krwlock_write_lock(&dir->vn_lock);
   int status = s5_remove_dirent(dir, name, namelen);
-  kmutex_unlock(&dir->vn_mutex);
+  krwlock_write_unlock(&dir->vn_lock);
+  s5_journal_end(VNODE_TO_S5FS(dir), &h);
   return status;
 }
 
@@ -560,43 +902,50 @@ static int s5fs_unlink(vnode_t *dir, const char *name, size_t namelen) {
  */
 static int s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen) {
   dbg(DBG_S5FS, "\n");
+  s5_jhandle_t h;
   if (namelen > S5_NAME_LEN) return -ENAMETOOLONG;
-  kmutex_lock(&dir->vn_mutex);
+  s5_journal_begin(VNODE_TO_S5FS(dir), &h);
+  krwlock_write_lock(&dir->vn_lock);
   // Get new inode/vnode
   int ino = s5_alloc_inode(dir->vn_fs, S5_TYPE_DIR, dir->vn_devid);
   if (ino < 0) {
     dbg(DBG_S5FS, "alloc_inode error: %d\n", ino);
-    kmutex_unlock(&dir->vn_mutex);
+    krwlock_write_unlock(&dir->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(dir), &h);
     return ino;
   }
   vnode_t *new_dir = vget(dir->vn_fs, ino);
-  kmutex_lock(&new_dir->vn_mutex);
+  krwlock_write_lock(&new_dir->vn_lock);
   // Link new vno to directory
   int status = s5_link(dir, new_dir, name, namelen);
   if (status) {
     vput(new_dir);
-    kmutex_unlock(&dir->vn_mutex);
-    kmutex_unlock(&new_dir->vn_mutex);
+    krwlock_write_unlock(&dir->vn_lock);
+    krwlock_write_unlock(&new_dir->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(dir), &h);
     return status;
   }
   // Create . and .. entries
   status = s5_link(new_dir, new_dir, ".", 1);
   if (status) {
-    kmutex_unlock(&dir->vn_mutex);
-    kmutex_unlock(&new_dir->vn_mutex);
+    krwlock_write_unlock(&dir->vn_lock);
+    krwlock_write_unlock(&new_dir->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(dir), &h);
     return status;
   }
   status = s5_link(new_dir, dir, "..", 2);
   if (status) {
-    kmutex_unlock(&dir->vn_mutex);
-    kmutex_unlock(&new_dir->vn_mutex);
+    krwlock_write_unlock(&dir->vn_lock);
+    krwlock_write_unlock(&new_dir->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(dir), &h);
     return status;
   }
-  kmutex_unlock(&dir->vn_mutex);
-  kmutex_unlock(&new_dir->vn_mutex);
+  krwlock_write_unlock(&dir->vn_lock);
+  krwlock_write_unlock(&new_dir->vn_lock);
   vput(new_dir);
   // TODO: what the fuck happens to this vnode?
   KASSERT(new_dir->vn_refcount == 1);
+  s5_journal_end(VNODE_TO_S5FS(dir), &h);
   return status;
 }
 
@@ -612,43 +961,50 @@ static int s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen) {
  */
 static int s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen) {
   dbg(DBG_S5FS, "\n");
+  s5_jhandle_t h;
   if (namelen > S5_NAME_LEN)
     return -ENAMETOOLONG;
   KASSERT(!name_match(".", name, namelen) &&
           !name_match("..", name, namelen));
-  kmutex_lock(&parent->vn_mutex);
+  s5_journal_begin(VNODE_TO_S5FS(parent), &h);
+  krwlock_write_lock(&parent->vn_lock);
   // Find inode/vnode
   int ino = s5_find_dirent(parent, name, namelen);
   if (ino < 0) {
-    kmutex_unlock(&parent->vn_mutex);
+    krwlock_write_unlock(&parent->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(parent), &h);
     return ino;
   }
   vnode_t *vn = vget(parent->vn_fs, ino);
   // Must be a directory
   if (!S_ISDIR(vn->vn_mode)) {
     vput(vn);
-    kmutex_unlock(&parent->vn_mutex);
+    krwlock_write_unlock(&parent->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(parent), &h);
     return -ENOTDIR;
   }
   // Must be empty
   if (vn->vn_len != 2 * sizeof(s5_dirent_t)) {
     vput(vn);
-    kmutex_unlock(&parent->vn_mutex);
+    krwlock_write_unlock(&parent->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(parent), &h);
     return -ENOTEMPTY;
   }
   // Remove .. link to parent
-  kmutex_lock(&vn->vn_mutex);
+  krwlock_write_lock(&vn->vn_lock);
   int status = s5_remove_dirent(vn, "..", 2);
-  kmutex_unlock(&vn->vn_mutex);
+  krwlock_write_unlock(&vn->vn_lock);
   if (status) {
     vput(vn);
-    kmutex_unlock(&parent->vn_mutex);
+    krwlock_write_unlock(&parent->vn_lock);
+    s5_journal_end(VNODE_TO_S5FS(parent), &h);
     return status;
   }
   // Remove dir from parent directory
   status = s5_remove_dirent(parent, name, namelen);
   vput(vn);
-  kmutex_unlock(&parent->vn_mutex);
+  krwlock_write_unlock(&parent->vn_lock);
+  s5_journal_end(VNODE_TO_S5FS(parent), &h);
   return status;
 }
 
@@ -661,18 +1017,27 @@ static int s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen) {
  * number of bytes read.
  */
 static int s5fs_readdir(vnode_t *vnode, off_t offset, struct dirent *d) {
+  int nread;
+  return s5fs_readdirv(vnode, offset, d, 1, &nread);
+}
+
+/*
+ * Like readdir, but fills in up to n dirents, a directory block at a time
+ * (see s5_read_dirents()).
+ */
+static int s5fs_readdirv(vnode_t *vnode, off_t offset, struct dirent *d,
+                         int n, int *nread) {
+  *nread = 0;
   if (offset >= vnode->vn_len)
     return 0;
-  kmutex_lock(&vnode->vn_mutex);
-  s5_dirent_t dirent;
-  int nread = s5_read_file(vnode, offset, (char *)&dirent, sizeof(s5_dirent_t));
-  KASSERT(nread == sizeof(s5_dirent_t) || nread == 0);
-  kmutex_unlock(&vnode->vn_mutex);
-  d->d_off = 0;
-  d->d_ino = dirent.s5d_inode;
-  strcpy((char *) &d->d_name, (const char *) &dirent.s5d_name);
-  dbg(DBG_S5FS, "%s ino: %d offset: %d\n", d->d_name, d->d_ino, offset);
-  return nread;
+  krwlock_read_lock(&vnode->vn_lock);
+  int status = s5_read_dirents(vnode, offset, d, n);
+  krwlock_read_unlock(&vnode->vn_lock);
+  if (status < 0)
+    return status;
+  *nread = status;
+  dbg(DBG_S5FS, "read %d entries at offset: %d\n", status, offset);
+  return status * sizeof(s5_dirent_t);
 }
 
 /*
@@ -688,14 +1053,14 @@ static int s5fs_stat(vnode_t *vnode, struct stat *ss) {
   dbg(DBG_S5FS, "vno: %d\n", vnode->vn_vno);
   s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
   KASSERT(ss);
-  kmutex_lock(&vnode->vn_mutex);
+  krwlock_read_lock(&vnode->vn_lock);
   ss->st_mode = vnode->vn_mode;
   ss->st_ino = vnode->vn_mode;
   ss->st_nlink = inode->s5_linkcount;
   ss->st_size = inode->s5_size;
   ss->st_blksize = S5_BLOCK_SIZE;
   ss->st_blocks = s5_inode_blocks(vnode);
-  kmutex_unlock(&vnode->vn_mutex);
+  krwlock_read_unlock(&vnode->vn_lock);
   return 0;
 }
 
@@ -710,7 +1075,17 @@ static int s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf) {
   KASSERT(vnode);
   KASSERT(pagebuf);
   KASSERT(PAGE_ALIGNED(pagebuf));
-  KASSERT(vnode->vn_mutex.km_holder == curthr);
+  KASSERT(krwlock_locked(&vnode->vn_lock));
+  s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  if (S5_TYPE_INLINE == inode->s5_type) { // Served from the inode
+    memset(pagebuf, 0, S5_BLOCK_SIZE);
+    if (!S5_DATA_BLOCK(offset))
+      memcpy(pagebuf, inode->s5_direct_blocks,
+             MIN(inode->s5_size, S5_INLINE_MAX));
+    return 0;
+  }
+  if (S5_TYPE_COMPRESSED == inode->s5_type)
+    return s5_fill_compressed(vnode, offset, pagebuf);
   // Find block
   int block_no = s5_seek_to_block(vnode, offset, 0);
   if (block_no < 0) { // Error
@@ -718,10 +1093,17 @@ static int s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf) {
     return block_no;
   }
   int status = 0;
-  if (block_no) { // Non-sparse block
+  if (block_no && S_ISDIR(vnode->vn_mode)) {
+    /* Directory blocks are metadata: the journal writes them from the
+     * device's pages, which may be newer than the disk */
+    pframe_t *pf;
+    if (!(status = pframe_get(S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode)), block_no,
+                              &pf)))
+      memcpy(pagebuf, pf->pf_addr, S5_BLOCK_SIZE);
+  } else if (block_no) { // Non-sparse block
     dbg(DBG_S5FS, "reading block\n");
-    status = VNODE_TO_S5FS(vnode)->s5f_bdev->bd_ops->read_block(
-        VNODE_TO_S5FS(vnode)->s5f_bdev, (char *)pagebuf, block_no, 1);
+    status = blockdev_read(VNODE_TO_S5FS(vnode)->s5f_bdev, (char *)pagebuf,
+                           block_no, 1);
   } else { // Sparse block, fill with zeros
     memset(pagebuf, 0, S5_BLOCK_SIZE);
   }
@@ -729,53 +1111,215 @@ static int s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf) {
 }
 
 /*
- * if this offset is NOT within a sparse region of the file
- *     return 0;
- *
- * attempt to make the region containing this offset no longer
- * sparse
- *     - attempt to allocate a free block
- *     - if no free blocks available, return -ENOSPC
- *     - associate this block with the inode; alter the inode as
- *       appropriate
- *         - dirty the page containing this inode
- *
- * Much of this can be done with s5_seek_to_block()
+ * Blocks are not allocated when a page is dirtied but when it is written
+ * back, in cleanpage (delayed allocation). By then a file written
+ * sequentially has many dirty pages, which cleanpages allocates as one
+ * run of consecutive blocks. Sparse regions therefore stay sparse here;
+ * only errors looking up the block are reported.
  */
 static int s5fs_dirtypage(vnode_t *vnode, off_t offset) {
   dbg(DBG_S5FS, "vno: %d offset: %d\n", vnode->vn_vno, offset);
-  KASSERT(curthr == vnode->vn_mutex.km_holder);
-  // Verify this is a sparse region
+  KASSERT(krwlock_write_held(&vnode->vn_lock));
   int status = s5_seek_to_block(vnode, offset, 0);
-  if (status >= 0) { 
-    return 0;
-  } else if (status < 0) {
-    return status;
-  }
-  // Attempt to make not sparse
-  status = s5_seek_to_block(vnode, offset, 1);
-  if (status < 0)
-    return status;
-  else
-    return 0;
+  return status < 0 ? status : 0;
 }
 
 /*
- * Like fillpage, but for writing.
+ * Like fillpage, but for writing. File data goes straight to disk, where
+ * it lands before the journal commits the allocation that points at it.
+ * Directory blocks are copied into the device's pages instead, to be
+ * committed with the rest of the metadata.
  */
 static int s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf) {
   dbg(DBG_S5FS, "vno: %d offset: %d\n", vnode->vn_vno, offset);
+  s5fs_t *s5 = VNODE_TO_S5FS(vnode);
+  s5_jhandle_t h;
+  pframe_t *pf;
   KASSERT(PAGE_ALIGNED(pagebuf));
-  KASSERT(!vnode->vn_mutex.km_holder);
-  kmutex_lock(&vnode->vn_mutex);
+  KASSERT(!krwlock_write_held(&vnode->vn_lock));
+  /* A holder may be waiting on this very page, so don't wait for it;
+   * the page stays dirty and is written back on a later pass. The same
+   * goes for a commit, which may be waiting for memory this frees. */
+  if (krwlock_locked(&vnode->vn_lock))
+    return -EBUSY;
+  if (s5_journal_trybegin(s5, &h))
+    return -EBUSY;
+  krwlock_write_lock(&vnode->vn_lock);
+  // A small file goes in its inode rather than a block
+  int status = s5_clean_inline(vnode, offset, pagebuf);
+  if (status) {
+    krwlock_write_unlock(&vnode->vn_lock);
+    s5_journal_end(s5, &h);
+    return status < 0 ? status : 0;
+  }
+  if (S5_TYPE_COMPRESSED == VNODE_TO_S5INODE(vnode)->s5_type) {
+    status = s5_clean_compressed(vnode, offset, &pagebuf, 1);
+    krwlock_write_unlock(&vnode->vn_lock);
+    s5_journal_end(s5, &h);
+    return status;
+  }
   // Find block
   int block_no = s5_seek_to_block(vnode, offset, 1);
-  if (block_no <= 0) { // Error
-    return block_no;
+  status = block_no;
+  if (block_no > 0 && S_ISDIR(vnode->vn_mode)) {
+    if (!(status = pframe_get(S5FS_TO_VMOBJ(s5), block_no, &pf))) {
+      memcpy(pf->pf_addr, pagebuf, S5_BLOCK_SIZE);
+      status = pframe_dirty(pf);
+    }
+  } else if (block_no > 0) {
+    status = blockdev_write(s5->s5f_bdev, (char *)pagebuf, block_no, 1);
+  }
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(s5, &h);
+  return status;
+}
+
+/*
+ * Write back a run of consecutive pages of a regular file. The pages
+ * still without blocks are given theirs together by s5_seek_to_run, and
+ * then go to disk one request per run of consecutive blocks.
+ */
+static int s5fs_cleanpages(vnode_t *vnode, off_t offset, void **pagebufs,
+                           int npages) {
+  dbg(DBG_S5FS, "vno: %d offset: %d pages: %d\n", vnode->vn_vno, offset,
+      npages);
+  s5fs_t *s5 = VNODE_TO_S5FS(vnode);
+  blockdev_iovec_t iov[PF_WRITEBACK_MAX];
+  int blocks[PF_WRITEBACK_MAX];
+  s5_jhandle_t h;
+  int status, start, i;
+  KASSERT(0 < npages && npages <= PF_WRITEBACK_MAX);
+  KASSERT(!krwlock_write_held(&vnode->vn_lock));
+  /* A file small enough to be inline has a page or two past its end at
+   * most, which s5fs_cleanpage deals with */
+  if (VNODE_TO_S5INODE(vnode)->s5_size <= S5_INLINE_MAX) {
+    for (i = 0, status = 0; !status && i < npages; ++i)
+      status = s5fs_cleanpage(vnode, offset + i * S5_BLOCK_SIZE, pagebufs[i]);
+    return status;
+  }
+  /* As in s5fs_cleanpage */
+  if (krwlock_locked(&vnode->vn_lock))
+    return -EBUSY;
+  if (s5_journal_trybegin(s5, &h))
+    return -EBUSY;
+  krwlock_write_lock(&vnode->vn_lock);
+  if (S5_TYPE_COMPRESSED == VNODE_TO_S5INODE(vnode)->s5_type) {
+    status = s5_clean_compressed(vnode, offset, pagebufs, npages);
+    npages = 0;
+  } else {
+    status = s5_seek_to_run(vnode, offset, blocks, npages);
+  }
+  for (start = 0, i = 0; !status && i < npages; ++i) {
+    iov[i].bv_buf = (char *)pagebufs[i];
+    iov[i].bv_count = 1;
+    if (i + 1 == npages || blocks[i + 1] != blocks[i] + 1) {
+      status = blockdev_writev(s5->s5f_bdev, iov + start, i + 1 - start,
+                               blocks[start]);
+      start = i + 1;
+    }
+  }
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(s5, &h);
+  return status;
+}
+
+/*
+ * Shrinking frees everything past the new end with s5_punch_hole;
+ * growing just moves the end, leaving a hole.
+ */
+static int s5fs_truncate(vnode_t *vnode, off_t len) {
+  dbg(DBG_S5FS, "vno: %d len: %d\n", vnode->vn_vno, len);
+  s5fs_t *s5 = VNODE_TO_S5FS(vnode);
+  s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  s5_jhandle_t h;
+  int status = 0;
+  s5_journal_begin(s5, &h);
+  krwlock_write_lock(&vnode->vn_lock);
+  if ((uint32_t)len > S5_INLINE_MAX)
+    status = s5_uninline(vnode);
+  if (!status && len < vnode->vn_len)
+    status = s5_punch_hole(vnode, len,
+                           S5_DATA_BLOCK(vnode->vn_len + S5_BLOCK_SIZE - 1) *
+                               S5_BLOCK_SIZE);
+  if (!status && len != vnode->vn_len) {
+    inode->s5_size = vnode->vn_len = len;
+    s5_dirty_inode(s5, inode);
   }
-  int status = VNODE_TO_S5FS(vnode)->s5f_bdev->bd_ops->write_block(
-      VNODE_TO_S5FS(vnode)->s5f_bdev, (char *)pagebuf, block_no, 1);
-  kmutex_unlock(&vnode->vn_mutex);
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(s5, &h);
+  return status;
+}
+
+/* Nothing past the end of the file has a block to free */
+static int s5fs_punch_hole(vnode_t *vnode, off_t offset, off_t len) {
+  dbg(DBG_S5FS, "vno: %d offset: %d len: %d\n", vnode->vn_vno, offset, len);
+  s5fs_t *s5 = VNODE_TO_S5FS(vnode);
+  s5_jhandle_t h;
+  int status = 0;
+  s5_journal_begin(s5, &h);
+  krwlock_write_lock(&vnode->vn_lock);
+  if (offset < vnode->vn_len)
+    status = s5_punch_hole(vnode, offset,
+                           offset + MIN(len, vnode->vn_len - offset));
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(s5, &h);
+  return status;
+}
+
+/*
+ * A file's data is laid out differently once it is compressed (see
+ * s5fs_compress.h), so compression is only turned on or off while the
+ * file is empty.
+ */
+static int s5fs_compress(vnode_t *vnode, int on) {
+  dbg(DBG_S5FS, "vno: %d on: %d\n", vnode->vn_vno, on);
+  s5fs_t *s5 = VNODE_TO_S5FS(vnode);
+  s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  s5_jhandle_t h;
+  int was;
+
+  s5_journal_begin(s5, &h);
+  krwlock_write_lock(&vnode->vn_lock);
+  was = S5_TYPE_COMPRESSED == inode->s5_type;
+  if (0 <= on && !on != !was) {
+    if (vnode->vn_len || s5_inode_blocks(vnode)) {
+      was = -EBUSY;
+    } else {
+      memset(inode->s5_direct_blocks, 0, S5_INLINE_MAX);
+      inode->s5_type = on ? S5_TYPE_COMPRESSED : S5_TYPE_DATA;
+      s5_dirty_inode(s5, inode);
+    }
+  }
+  krwlock_write_unlock(&vnode->vn_lock);
+  s5_journal_end(s5, &h);
+  return was;
+}
+
+/*
+ * Read ahead for madvise and posix_fadvise, under the same lock as a
+ * read.
+ */
+static void s5fs_readahead(vnode_t *vnode, uint32_t pagenum,
+                           uint32_t npages) {
+  dbg(DBG_S5FS, "vno: %d pages: %u+%u\n", vnode->vn_vno, pagenum, npages);
+  krwlock_read_lock(&vnode->vn_lock);
+  s5_prefetch(vnode, pagenum, npages);
+  krwlock_read_unlock(&vnode->vn_lock);
+}
+
+/*
+ * The inode and indirect blocks live in the device's pages, which reach
+ * the disk only through the journal, so commit it; that has nothing to
+ * write if the metadata is already clean. Inodes keep no times, so there
+ * is nothing for datasync to leave out. The data pages written back
+ * since the last commit may still be in the disk's write cache, so that
+ * is flushed either way.
+ */
+static int s5fs_fsync(vnode_t *vnode, int datasync) {
+  dbg(DBG_S5FS, "vno: %d\n", vnode->vn_vno);
+  int status = s5_journal_sync(VNODE_TO_S5FS(vnode));
+  if (!status)
+    status = blockdev_flush_cache(VNODE_TO_S5FS(vnode)->s5f_bdev);
   return status;
 }
 
@@ -791,10 +1335,11 @@ static int s5_check_super(s5_super_t *super) {
          super->s5s_free_inode == (uint32_t)-1) &&
         super->s5s_root_inode < super->s5s_num_inodes))
     return -1;
-  if (super->s5s_version != S5_CURRENT_VERSION) {
+  if (super->s5s_version < S5_OLDEST_VERSION ||
+      super->s5s_version > S5_CURRENT_VERSION) {
     dbg(DBG_PRINT, "Filesystem is version %d; "
-                   "only version %d is supported.\n",
-        super->s5s_version, S5_CURRENT_VERSION);
+                   "only versions %d to %d are supported.\n",
+        super->s5s_version, S5_OLDEST_VERSION, S5_CURRENT_VERSION);
     return -1;
   }
   return 0;
@@ -828,6 +1373,7 @@ static void calculate_refcounts(int *counts, vnode_t *vnode) {
         vput(child);
       }
       offset += ret;
+      cond_resched();
     }
 
     KASSERT(ret == 0);
@@ -839,8 +1385,12 @@ static void calculate_refcounts(int *counts, vnode_t *vnode) {
  * the expected number of refcounts will equal the actual number.  To do this,
  * we have to create a data structure to hold the counts of all the expected
  * refcounts, and then walk the fs to calculate them.
+ *
+ * With repair set, wrong link counts are corrected and inodes which are in
+ * use but reachable from nowhere (files still open at a crash) are freed.
+ * That is only safe while nothing else uses the fs, i.e. during mount.
  */
-int s5fs_check_refcounts(fs_t *fs) {
+int s5fs_check_refcounts(fs_t *fs, int repair) {
   s5fs_t *s5fs = (s5fs_t *)fs->fs_i;
   int *refcounts;
   int ret = 0;
@@ -862,8 +1412,11 @@ int s5fs_check_refcounts(fs_t *fs) {
 
   for (i = 0; i < s5fs->s5f_super->s5s_num_inodes; i++) {
     vnode_t *vn;
+    s5_jhandle_t h;
 
-    if (!refcounts[i])
+    cond_resched();
+    if (!refcounts[i] && !(repair && i != fs->fs_root->vn_vno &&
+                           s5_inode_in_use(s5fs, i)))
       continue;
 
     vn = vget(fs, i);
@@ -873,6 +1426,14 @@ int s5fs_check_refcounts(fs_t *fs) {
       dbg(DBG_PRINT, "   Inode %d, expecting %d, found %d\n", i, refcounts[i],
           VNODE_TO_S5INODE(vn)->s5_linkcount - 1);
       ret = -1;
+      if (repair) {
+        /* the vnode's own reference is dropped by vput, which frees
+         * the inode if nothing links to it */
+        s5_journal_begin(s5fs, &h);
+        VNODE_TO_S5INODE(vn)->s5_linkcount = refcounts[i] + 1;
+        s5_dirty_inode(s5fs, VNODE_TO_S5INODE(vn));
+        s5_journal_end(s5fs, &h);
+      }
     }
     vput(vn);
   }
@@ -885,3 +1446,25 @@ int s5fs_check_refcounts(fs_t *fs) {
   kfree(refcounts);
   return ret;
 }
+
+/*
+ * Runs the link count check of a file system mounted after a crash in
+ * the background. The fs is in use meanwhile, so nothing can be repaired
+ * here; that is left to the next mount. arg2 is the fs; arg1 is unused.
+ */
+static void *s5fs_fsck_run(int arg1, void *arg2) {
+  fs_t *fs = arg2;
+  s5fs_t *s5 = FS_TO_S5FS(fs);
+
+  if (s5fs_check_refcounts(fs, 0)) {
+    dbg(DBG_PRINT, "s5fs: link counts on %s will be repaired at the next "
+                   "mount\n", fs->fs_dev);
+    s5->s5f_state = S5_STATE_REPAIR;
+  } else {
+    s5->s5f_state = S5_STATE_CLEAN;
+  }
+  s5->s5f_fsck_thr = NULL;
+  sched_broadcast_on(&s5->s5f_fsckq);
+  kthread_exit(NULL);
+  return NULL;
+}
@@ -0,0 +1,379 @@
+/*
+ *   FILE: s5fs_compress.c
+ *  DESCR: S5 transparent compression of file data (see s5fs_compress.h)
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "drivers/blockdev.h"
+
+#include "fs/vnode.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs_compress.h"
+
+/*
+ * The codec: a greedy LZ77 with a single-entry hash table, writing LZ4's
+ * block format. Each sequence is a token whose high nibble is the number
+ * of literals and low nibble the match length less S5_LZ_MINMATCH (15
+ * meaning more follow, in bytes of 255 ending with one below it), the
+ * literals, and the match's 16-bit little-endian distance back; the
+ * last sequence is literals alone. As LZ4 requires, the last
+ * S5_LZ_LASTLITERALS bytes are always literals, and no match starts in
+ * the last S5_LZ_MFLIMIT.
+ */
+#define S5_LZ_MINMATCH 4
+#define S5_LZ_LASTLITERALS 5
+#define S5_LZ_MFLIMIT 12
+#define S5_LZ_HASH_BITS 11 /* 2048 16-bit entries fill S5_LZ_TABLE_SIZE */
+
+static inline uint32_t s5_lz_read32(const uint8_t *p) {
+  return *(const uint32_t *)p;
+}
+
+static inline uint32_t s5_lz_hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - S5_LZ_HASH_BITS);
+}
+
+/* The bytes of a length of 15 or more, past the nibble */
+static uint8_t *s5_lz_putlen(uint8_t *op, size_t len) {
+  for (len -= 15; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+/* Writes a sequence of the literals [lit, lit + nlit) and, unless mlen
+ * is 0, a match of mlen bytes dist back; NULL if it doesn't fit */
+static uint8_t *s5_lz_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                               size_t nlit, size_t dist, size_t mlen) {
+  size_t need = 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+  uint8_t *token = op++;
+
+  if (need > (size_t)(oend - token))
+    return NULL;
+  *token = (uint8_t)(MIN(nlit, 15) << 4);
+  if (nlit >= 15)
+    op = s5_lz_putlen(op, nlit);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen) {
+    mlen -= S5_LZ_MINMATCH;
+    *token |= (uint8_t)MIN(mlen, 15);
+    *op++ = (uint8_t)dist;
+    *op++ = (uint8_t)(dist >> 8);
+    if (mlen >= 15)
+      op = s5_lz_putlen(op, mlen);
+  }
+  return op;
+}
+
+size_t s5_lz_compress(const void *src, size_t len, void *dst, size_t max,
+                      void *table) {
+  const uint8_t *base = src, *ip = base, *anchor = base, *ref, *m, *r;
+  const uint8_t *mflimit = base + len - S5_LZ_MFLIMIT;
+  const uint8_t *matchlimit = base + len - S5_LZ_LASTLITERALS;
+  uint8_t *op = dst, *oend = op + max;
+  uint16_t *hash = table;
+  uint32_t v, h;
+
+  KASSERT(len <= 0xffff);
+  memset(hash, 0, S5_LZ_TABLE_SIZE);
+  while (len > S5_LZ_MFLIMIT && ip < mflimit) {
+    v = s5_lz_read32(ip);
+    h = s5_lz_hash(v);
+    ref = base + hash[h];
+    hash[h] = (uint16_t)(ip - base);
+    if (ref >= ip || s5_lz_read32(ref) != v) {
+      /* Skip faster through data which isn't matching */
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+    while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+      --ip;
+      --ref;
+    }
+    for (m = ip + S5_LZ_MINMATCH, r = ref + S5_LZ_MINMATCH;
+         m < matchlimit && *m == *r; ++m, ++r)
+      ;
+    if (NULL == (op = s5_lz_sequence(op, oend, anchor, ip - anchor, ip - ref,
+                                     m - ip)))
+      return 0;
+    anchor = ip = m;
+    if (ip < mflimit)
+      hash[s5_lz_hash(s5_lz_read32(ip - 2))] = (uint16_t)(ip - 2 - base);
+  }
+  if (NULL == (op = s5_lz_sequence(op, oend, anchor, base + len - anchor, 0,
+                                   0)))
+    return 0;
+  return op - (uint8_t *)dst;
+}
+
+/* Reads the rest of a length whose nibble was 15 */
+static int s5_lz_getlen(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+  uint8_t b;
+
+  do {
+    if (*ip >= iend)
+      return -EIO;
+    b = *(*ip)++;
+    *len += b;
+  } while (255 == b);
+  return 0;
+}
+
+int s5_lz_decompress(const void *src, size_t len, void *dst, size_t max) {
+  const uint8_t *ip = src, *iend = ip + len, *ref;
+  uint8_t *op = dst, *oend = op + max;
+  size_t nlit, mlen, dist, n;
+  uint8_t token;
+
+  while (ip < iend && op < oend) {
+    token = *ip++;
+    nlit = token >> 4;
+    if (15 == nlit && s5_lz_getlen(&ip, iend, &nlit))
+      return -EIO;
+    if (nlit > (size_t)(iend - ip))
+      return -EIO;
+    n = MIN(nlit, (size_t)(oend - op));
+    memcpy(op, ip, n);
+    op += n;
+    ip += nlit;
+    if (ip == iend || op == oend)
+      break;
+    if (iend - ip < 2)
+      return -EIO;
+    dist = ip[0] | (ip[1] << 8);
+    ip += 2;
+    mlen = token & 15;
+    if (15 == mlen && s5_lz_getlen(&ip, iend, &mlen))
+      return -EIO;
+    mlen += S5_LZ_MINMATCH;
+    if (!dist || dist > (size_t)(op - (uint8_t *)dst))
+      return -EIO;
+    ref = op - dist;
+    n = MIN(mlen, (size_t)(oend - op));
+    if (dist >= n) {
+      memcpy(op, ref, n);
+      op += n;
+    } else { /* Overlapping: a repeating pattern */
+      while (n--)
+        *op++ = *ref++;
+    }
+  }
+  return op - (uint8_t *)dst;
+}
+
+/*
+ * Moves the n blocks of a cluster between buf and the disk, a run of
+ * consecutive blocks per request.
+ */
+static int s5_cluster_io(s5fs_t *fs, const int *blocks, int n, char *buf,
+                         int write) {
+  int status = 0, start, i;
+
+  for (start = 0, i = 0; !status && i < n; ++i) {
+    if (i + 1 < n && blocks[i + 1] == blocks[i] + 1)
+      continue;
+    if (write)
+      status = blockdev_write(fs->s5f_bdev, buf + start * S5_BLOCK_SIZE,
+                              blocks[start], i + 1 - start);
+    else
+      status = blockdev_read(fs->s5f_bdev, buf + start * S5_BLOCK_SIZE,
+                             blocks[start], i + 1 - start);
+    start = i + 1;
+  }
+  return status;
+}
+
+/* The number of pages of a file which are (partly) before its end */
+static uint32_t s5_file_pages(vnode_t *vnode) {
+  return S5_DATA_BLOCK(vnode->vn_len + S5_BLOCK_SIZE - 1);
+}
+
+/*
+ * Reads the first npages pages of the cluster which starts at page base
+ * into raw, with packed (S5_CLUSTER_PAGES pages) to read a compressed
+ * cluster into.
+ */
+static int s5_read_cluster(vnode_t *vnode, uint32_t base, char *raw,
+                           uint32_t npages, char *packed) {
+  s5_cluster_t *hdr = (s5_cluster_t *)packed;
+  int blocks[S5_CLUSTER_PAGES];
+  int n, status;
+
+  for (n = 0; n < S5_CLUSTER_PAGES; ++n) {
+    blocks[n] = s5_seek_to_block(vnode, (off_t)(base + n) * S5_BLOCK_SIZE, 0);
+    if (0 > blocks[n])
+      return blocks[n];
+  }
+  for (n = 0; n < S5_CLUSTER_PAGES && blocks[n]; ++n)
+    ;
+  if (!n) { /* A hole */
+    memset(raw, 0, npages * S5_BLOCK_SIZE);
+    return 0;
+  }
+  if (S5_CLUSTER_PAGES == n) /* Stored as it is */
+    return s5_cluster_io(VNODE_TO_S5FS(vnode), blocks, npages, raw, 0);
+  if ((status = s5_cluster_io(VNODE_TO_S5FS(vnode), blocks, n, packed, 0)))
+    return status;
+  if (hdr->s5c_len > n * S5_BLOCK_SIZE - sizeof(*hdr) ||
+      0 > (status = s5_lz_decompress(hdr + 1, hdr->s5c_len, raw,
+                                     npages * S5_BLOCK_SIZE))) {
+    dbg(DBG_PRINT, "s5fs: bad compressed cluster at page %u of inode %d\n",
+        base, vnode->vn_vno);
+    return -EIO;
+  }
+  memset(raw + status, 0, npages * S5_BLOCK_SIZE - status);
+  return 0;
+}
+
+/*
+ * Writes the cluster which starts at page base, whose first npages pages
+ * are in raw and the rest past the end of the file, compressing it into
+ * packed (S5_CLUSTER_PAGES pages, the last of them scratch space).
+ */
+static int s5_write_cluster(vnode_t *vnode, uint32_t base, char *raw,
+                            uint32_t npages, char *packed) {
+  s5_cluster_t *hdr = (s5_cluster_t *)packed;
+  int blocks[S5_CLUSTER_PAGES];
+  uint32_t *w = (uint32_t *)raw;
+  size_t len = npages * S5_BLOCK_SIZE, i;
+  char *buf = packed;
+  int n, status;
+
+  for (i = 0; i < len / sizeof(*w) && !w[i]; ++i)
+    ;
+  if (len / sizeof(*w) == i) { /* All zeros: make it a hole */
+    s5_free_range(vnode, base, base + S5_CLUSTER_PAGES);
+    return 0;
+  }
+  hdr->s5c_len = s5_lz_compress(
+      raw, len, hdr + 1, S5_CLUSTER_MAX_PACKED,
+      packed + (S5_CLUSTER_PAGES - 1) * S5_BLOCK_SIZE);
+  if (hdr->s5c_len) {
+    i = sizeof(*hdr) + hdr->s5c_len;
+    n = (i + S5_BLOCK_SIZE - 1) / S5_BLOCK_SIZE;
+    memset(packed + i, 0, n * S5_BLOCK_SIZE - i);
+  } else {
+    n = S5_CLUSTER_PAGES;
+    buf = raw;
+    memset(raw + len, 0, S5_CLUSTER_PAGES * S5_BLOCK_SIZE - len);
+  }
+  if ((status = s5_seek_to_run(vnode, (off_t)base * S5_BLOCK_SIZE, blocks, n)))
+    return status;
+  s5_free_range(vnode, base + n, base + S5_CLUSTER_PAGES);
+  return s5_cluster_io(VNODE_TO_S5FS(vnode), blocks, n, buf, 1);
+}
+
+/*
+ * Only as many pages as there are up to the page wanted are decompressed,
+ * so a page of a cluster read by itself costs half a cluster on average;
+ * reads in order go through s5_readahead_compressed instead.
+ */
+int s5_fill_compressed(vnode_t *vnode, off_t offset, void *pagebuf) {
+  uint32_t pagenum = S5_DATA_BLOCK(offset);
+  uint32_t index = pagenum % S5_CLUSTER_PAGES;
+  char *raw, *packed;
+  int status;
+
+  KASSERT(krwlock_locked(&vnode->vn_lock));
+  raw = page_alloc_n(S5_CLUSTER_PAGES);
+  packed = page_alloc_n(S5_CLUSTER_PAGES);
+  if (!raw || !packed)
+    status = -ENOMEM;
+  else if (!(status = s5_read_cluster(vnode, pagenum - index, raw, index + 1,
+                                      packed)))
+    memcpy(pagebuf, raw + index * S5_BLOCK_SIZE, S5_BLOCK_SIZE);
+  if (raw)
+    page_free_n(raw, S5_CLUSTER_PAGES);
+  if (packed)
+    page_free_n(packed, S5_CLUSTER_PAGES);
+  return status;
+}
+
+uint32_t s5_readahead_compressed(vnode_t *vnode, uint32_t start,
+                                 uint32_t end) {
+  pframe_t *pfs[S5_CLUSTER_PAGES];
+  uint32_t nfile = s5_file_pages(vnode), base, n, i, last;
+  char *raw, *packed;
+  int status;
+
+  KASSERT(krwlock_locked(&vnode->vn_lock));
+  raw = page_alloc_n(S5_CLUSTER_PAGES);
+  packed = page_alloc_n(S5_CLUSTER_PAGES);
+  for (base = start - start % S5_CLUSTER_PAGES;
+       raw && packed && base < MIN(end, nfile); base += S5_CLUSTER_PAGES) {
+    n = MIN(S5_CLUSTER_PAGES, nfile - base);
+    for (i = 0, last = 0; i < n; ++i) {
+      if ((pfs[i] = pframe_alloc_busy(&vnode->vn_mmobj, base + i)))
+        last = i + 1;
+    }
+    if (!last)
+      continue;
+    status = s5_read_cluster(vnode, base, raw, last, packed);
+    for (i = 0; i < last; ++i) {
+      if (!pfs[i])
+        continue;
+      if (!status)
+        memcpy(pfs[i]->pf_addr, raw + i * S5_BLOCK_SIZE, S5_BLOCK_SIZE);
+      pframe_fill_done(pfs[i], status);
+    }
+  }
+  if (raw)
+    page_free_n(raw, S5_CLUSTER_PAGES);
+  if (packed)
+    page_free_n(packed, S5_CLUSTER_PAGES);
+  return end - start;
+}
+
+/*
+ * A cluster whose pages are not all being written is read in first, and
+ * one wholly past the end of the file (truncated while its pages were
+ * dirty) is freed. Pages past the end are never written, so the part of
+ * a cluster there is left as zeros on disk.
+ */
+int s5_clean_compressed(vnode_t *vnode, off_t offset, void **pagebufs,
+                        int npages) {
+  uint32_t first = S5_DATA_BLOCK(offset), end = first + npages;
+  uint32_t nfile = s5_file_pages(vnode), base, n, lo, hi, i;
+  char *raw, *packed;
+  int status = 0;
+
+  KASSERT(krwlock_write_held(&vnode->vn_lock));
+  raw = page_alloc_n(S5_CLUSTER_PAGES);
+  packed = page_alloc_n(S5_CLUSTER_PAGES);
+  if (!raw || !packed)
+    status = -ENOMEM;
+  for (base = first - first % S5_CLUSTER_PAGES; !status && base < end;
+       base += S5_CLUSTER_PAGES) {
+    if (base >= nfile) {
+      s5_free_range(vnode, base, base + S5_CLUSTER_PAGES);
+      continue;
+    }
+    n = MIN(S5_CLUSTER_PAGES, nfile - base);
+    lo = MAX(base, first);
+    hi = MIN(base + n, end);
+    if ((lo > base || hi < base + n) &&
+        (status = s5_read_cluster(vnode, base, raw, n, packed)))
+      break;
+    for (i = lo; i < hi; ++i)
+      memcpy(raw + (i - base) * S5_BLOCK_SIZE, pagebufs[i - first],
+             S5_BLOCK_SIZE);
+    status = s5_write_cluster(vnode, base, raw, n, packed);
+  }
+  if (raw)
+    page_free_n(raw, S5_CLUSTER_PAGES);
+  if (packed)
+    page_free_n(packed, S5_CLUSTER_PAGES);
+  return status;
+}
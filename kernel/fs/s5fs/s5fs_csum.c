@@ -0,0 +1,303 @@
+/*
+ *   FILE: s5fs_csum.c
+ *  DESCR: S5 metadata block checksums and background scrubbing (see
+ *         s5fs_csum.h)
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/crc32c.h"
+#include "util/debug.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "drivers/blockdev.h"
+
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_csum.h"
+
+static void *s5_scrub_run(int arg1, void *arg2);
+
+/* The checksum of a block's contents; never 0, which means none */
+static uint32_t s5_csum_of(const void *buf) {
+  uint32_t sum = crc32c(0, buf, S5_BLOCK_SIZE);
+  return sum ? sum : 1;
+}
+
+int s5_csum_check_super(s5_super_t *super) {
+  uint32_t sum = super->s5s_csum;
+  int ret;
+
+  if (!sum)
+    return 0;
+  super->s5s_csum = 0;
+  ret = s5_csum_of(super) == sum ? 1 : -1;
+  super->s5s_csum = sum;
+  return ret;
+}
+
+void s5_csum_super(s5_super_t *super) {
+  super->s5s_csum = 0;
+  super->s5s_csum = s5_csum_of(super);
+}
+
+int s5_csum_is_table(s5fs_t *fs, uint32_t blockno) {
+  return blockno - fs->s5f_csum_start < fs->s5f_csum_nblocks;
+}
+
+/*
+ * Returns where in the table blockno's checksum is kept, with *pfp set to
+ * the table's page, or NULL if the block has no place there or the page
+ * cannot be read.
+ */
+static uint32_t *s5_csum_slot(s5fs_t *fs, uint32_t blockno, pframe_t **pfp) {
+  if (!fs->s5f_csum_nblocks || S5_IS_SUPER(blockno) ||
+      blockno >= fs->s5f_nblocks || s5_csum_is_table(fs, blockno))
+    return NULL;
+  if (pframe_get(S5FS_TO_VMOBJ(fs),
+                 fs->s5f_csum_start + blockno / S5_CSUMS_PER_BLOCK, pfp))
+    return NULL;
+  return (uint32_t *)(*pfp)->pf_addr + blockno % S5_CSUMS_PER_BLOCK;
+}
+
+/* The stored checksum of a block, or 0 if it has none */
+static uint32_t s5_csum_lookup(s5fs_t *fs, uint32_t blockno) {
+  pframe_t *pf;
+  uint32_t *slot = s5_csum_slot(fs, blockno, &pf);
+  return slot ? *slot : 0;
+}
+
+static void s5_csum_error(s5fs_t *fs, uint32_t blockno, const char *by) {
+  dbg(DBG_PRINT, "s5fs: block %u of %s fails its checksum (found by %s); "
+                 "it will be checked at the next mount\n",
+      blockno, fs->s5f_fs->fs_dev, by);
+  fs->s5f_csum_errors++;
+  fs->s5f_state = S5_STATE_REPAIR;
+}
+
+/* The device's bd_verify, for every block read into its pages */
+static void s5_csum_verify(blockdev_t *bd, blocknum_t blockno,
+                           const char *buf) {
+  s5fs_t *fs = bd->bd_holdarg;
+  uint32_t sum = s5_csum_lookup(fs, blockno);
+
+  if (sum && sum != s5_csum_of(buf))
+    s5_csum_error(fs, blockno, "read");
+}
+
+void s5_csum_forget(s5fs_t *fs, uint32_t blockno) {
+  pframe_t *pf;
+  uint32_t *slot = s5_csum_slot(fs, blockno, &pf);
+
+  if (slot && *slot) {
+    *slot = 0;
+    pframe_dirty(pf);
+  }
+}
+
+uint32_t s5_csum_seal(s5fs_t *fs, pframe_t **pfs, uint32_t n) {
+  pframe_t *pf, *tpf;
+  uint32_t *slot, i, k;
+
+  for (i = 0; i < n; ++i) {
+    if (S5_IS_SUPER(pfs[i]->pf_pagenum)) {
+      s5_csum_super((s5_super_t *)pfs[i]->pf_addr);
+    } else if (NULL != (slot = s5_csum_slot(fs, pfs[i]->pf_pagenum, &tpf))) {
+      *slot = s5_csum_of(pfs[i]->pf_addr);
+      pframe_dirty(tpf);
+    }
+  }
+
+  for (i = 0; i < fs->s5f_csum_nblocks; ++i) {
+    pf = pframe_get_resident(S5FS_TO_VMOBJ(fs), fs->s5f_csum_start + i);
+    if (!pf || !pframe_is_dirty(pf) || pframe_is_busy(pf))
+      continue;
+    pframe_pin(pf);
+    for (k = n++; k > 0 && pfs[k - 1]->pf_pagenum > pf->pf_pagenum; --k)
+      pfs[k] = pfs[k - 1];
+    pfs[k] = pf;
+  }
+  return n;
+}
+
+/*
+ * Writes zeroes over the table, which is nblocks blocks at start, and
+ * records it in the superblock, which goes home at once.
+ */
+static int s5_csum_clear(s5fs_t *fs, uint32_t start, uint32_t nblocks) {
+  s5_super_t *super = fs->s5f_super;
+  char *zero = page_alloc_zeroed();
+  uint32_t i;
+  int ret = 0;
+
+  if (!zero)
+    return -ENOMEM;
+  for (i = 0; !ret && i < nblocks; ++i)
+    ret = blockdev_write(fs->s5f_bdev, zero, start + i, 1);
+  page_free(zero);
+  if (ret)
+    return ret;
+  super->s5s_csum_start = start;
+  super->s5s_csum_nblocks = nblocks;
+  s5_csum_super(super);
+  return blockdev_write(fs->s5f_bdev, (char *)super, S5_SUPER_BLOCK, 1);
+}
+
+int s5_csum_start(s5fs_t *fs, int trusted) {
+  s5_super_t *super = fs->s5f_super;
+  uint32_t n = (fs->s5f_nblocks + S5_CSUMS_PER_BLOCK - 1) / S5_CSUMS_PER_BLOCK;
+  uint32_t i, k, b, *sums;
+  s5_jhandle_t h;
+  pframe_t *pf;
+  proc_t *p;
+  int ret;
+
+  fs->s5f_csum_start = 0;
+  fs->s5f_csum_nblocks = 0;
+  fs->s5f_csum_errors = 0;
+  fs->s5f_scrub_next = 1;
+  fs->s5f_scrub_stopping = 0;
+  fs->s5f_scrub_thr = NULL;
+  sched_queue_init(&fs->s5f_scrubq);
+  if (!S5_CSUM || !fs->s5f_journal)
+    return 0;
+
+  /* a commit must have room for the whole table besides its blocks */
+  if (n > fs->s5f_journal->j_ntags / 2) {
+    dbg(DBG_PRINT, "s5fs: disk too large for the journal to checksum, "
+                   "not checksumming\n");
+    return 0;
+  }
+  if (!super->s5s_csum_start) {
+    if (0 > (ret = s5_alloc_run(fs, 0, n))) {
+      dbg(DBG_PRINT, "s5fs: no room for checksums, not checksumming\n");
+      return 0;
+    }
+    if ((ret = s5_csum_clear(fs, ret, n)))
+      return ret;
+  } else if (super->s5s_csum_nblocks != n) {
+    dbg(DBG_PRINT, "s5fs: checksum table is %u blocks, not %u; "
+                   "not checksumming\n", super->s5s_csum_nblocks, n);
+    return 0;
+  } else if (1 != trusted &&
+             (ret = s5_csum_clear(fs, super->s5s_csum_start, n))) {
+    return ret;
+  }
+  fs->s5f_csum_start = super->s5s_csum_start;
+  fs->s5f_csum_nblocks = n;
+
+  /* blocks taken off the free lists at mount may have held metadata
+   * before, and must not keep checksums they will not be written with */
+  s5_journal_begin(fs, &h);
+  for (i = 0; i < n; ++i) {
+    if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), fs->s5f_csum_start + i, &pf)))
+      break;
+    sums = (uint32_t *)pf->pf_addr;
+    for (k = 0; k < S5_CSUMS_PER_BLOCK; ++k) {
+      b = i * S5_CSUMS_PER_BLOCK + k;
+      if (sums[k] && b < fs->s5f_nblocks && !s5_block_in_use(fs, b)) {
+        sums[k] = 0;
+        pframe_dirty(pf);
+      }
+    }
+  }
+  s5_journal_end(fs, &h);
+  if (ret) {
+    fs->s5f_csum_nblocks = 0;
+    return ret;
+  }
+
+  fs->s5f_bdev->bd_verify = s5_csum_verify;
+  p = proc_create("s5scrub");
+  KASSERT(NULL != p);
+  fs->s5f_scrub_thr = kthread_create(p, s5_scrub_run, 0, fs);
+  KASSERT(NULL != fs->s5f_scrub_thr);
+  sched_make_runnable(fs->s5f_scrub_thr);
+  dbg(DBG_S5FS, "checksum table of %u blocks at %u\n", n,
+      fs->s5f_csum_start);
+  return 0;
+}
+
+void s5_csum_stop(s5fs_t *fs) {
+  if (!fs->s5f_csum_nblocks)
+    return;
+  fs->s5f_bdev->bd_verify = NULL;
+  fs->s5f_scrub_stopping = 1;
+  sched_broadcast_on(&fs->s5f_scrubq);
+  while (fs->s5f_scrub_thr)
+    sched_sleep_on(&fs->s5f_scrubq);
+  if (fs->s5f_csum_errors)
+    dbg(DBG_PRINT, "s5fs: %u checksum mismatches on %s\n",
+        fs->s5f_csum_errors, fs->s5f_fs->fs_dev);
+}
+
+/*
+ * Checks one block against its checksum by reading it into buf, unless
+ * it has none or is resident, in which case it was checked when it was
+ * read and the page is newer than the disk anyway. Returns 1 if the
+ * block was read. An operation is held throughout so that no commit
+ * changes the block or its checksum meanwhile; a block freed meanwhile
+ * has its checksum forgotten, so the checksum is looked at again.
+ */
+static int s5_scrub_block(s5fs_t *fs, uint32_t blockno, char *buf) {
+  s5_jhandle_t h;
+  uint32_t sum;
+  int read = 0;
+
+  s5_journal_begin(fs, &h);
+  if ((sum = s5_csum_lookup(fs, blockno)) &&
+      !pframe_get_resident(S5FS_TO_VMOBJ(fs), blockno)) {
+    read = 1;
+    if (!blockdev_read(fs->s5f_bdev, buf, blockno, 1) &&
+        sum == s5_csum_lookup(fs, blockno) && sum != s5_csum_of(buf))
+      s5_csum_error(fs, blockno, "scrub");
+  }
+  s5_journal_end(fs, &h);
+  return read;
+}
+
+/*
+ * The scrubber wakes every S5_SCRUB_INTERVAL_MSECS and, unless anything
+ * else is waiting for the disk, reads up to S5_SCRUB_BATCH blocks which
+ * have checksums, going round the disk from where it left off, and
+ * looking through at most a table block's worth of blocks per batch.
+ * arg2 is the file system; arg1 is unused.
+ */
+static void *s5_scrub_run(int arg1, void *arg2) {
+  s5fs_t *fs = arg2;
+  char *buf = page_alloc();
+  uint32_t nread, nseen;
+
+  while (buf && !fs->s5f_scrub_stopping) {
+    sched_cancellable_sleep_on_timeout(
+        &fs->s5f_scrubq, S5_SCRUB_INTERVAL_MSECS / TICK_MSECS);
+    if (fs->s5f_scrub_stopping || fs->s5f_bdev->bd_stats.bs_queued)
+      continue;
+    nread = 0;
+    for (nseen = 0; nseen < S5_CSUMS_PER_BLOCK && nread < S5_SCRUB_BATCH &&
+                    !fs->s5f_scrub_stopping;
+         ++nseen) {
+      nread += s5_scrub_block(fs, fs->s5f_scrub_next, buf);
+      if (++fs->s5f_scrub_next == fs->s5f_nblocks) {
+        dbg(DBG_S5FS, "scrubbed all of %s\n", fs->s5f_fs->fs_dev);
+        fs->s5f_scrub_next = 1;
+      }
+    }
+  }
+  if (buf)
+    page_free(buf);
+  fs->s5f_scrub_thr = NULL;
+  sched_broadcast_on(&fs->s5f_scrubq);
+  kthread_exit(NULL);
+  return NULL;
+}
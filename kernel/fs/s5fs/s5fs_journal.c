@@ -0,0 +1,399 @@
+/*
+ *   FILE: s5fs_journal.c
+ *  DESCR: S5 write-ahead metadata journal (see s5fs_journal.h)
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/string.h"
+#include "util/debug.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "drivers/blockdev.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_csum.h"
+
+#define S5_JOURNAL_TAGS (S5_BLOCK_SIZE / sizeof(uint32_t))
+
+static void *s5_journal_run(int arg1, void *arg2);
+
+int s5_journal_recover(blockdev_t *bd) {
+  char *buf = page_alloc(), *hdrbuf = page_alloc();
+  uint32_t *tags = page_alloc();
+  s5_super_t *super = (s5_super_t *)buf;
+  s5_jheader_t *hdr = (s5_jheader_t *)hdrbuf;
+  uint32_t start, i;
+  int ret = -ENOMEM;
+
+  if (!buf || !hdrbuf || !tags)
+    goto out;
+  if ((ret = blockdev_read(bd, buf, S5_SUPER_BLOCK, 1)))
+    goto out;
+  if (S5_MAGIC != super->s5s_magic || !super->s5s_journal_start)
+    goto out;
+  start = super->s5s_journal_start;
+  if ((ret = blockdev_read(bd, hdrbuf, start, 1)))
+    goto out;
+  if (S5_JOURNAL_MAGIC != hdr->s5j_magic || !hdr->s5j_nblocks)
+    goto out;
+
+  KASSERT(hdr->s5j_nblocks <= S5_JOURNAL_TAGS &&
+          hdr->s5j_nblocks + 2 <= super->s5s_journal_nblocks);
+  dbg(DBG_PRINT, "s5fs: replaying journal transaction %u (%u blocks)\n",
+      hdr->s5j_sequence, hdr->s5j_nblocks);
+  if ((ret = blockdev_read(bd, (char *)tags, start + 1, 1)))
+    goto out;
+  for (i = 0; i < hdr->s5j_nblocks; ++i) {
+    if ((ret = blockdev_read(bd, buf, start + 2 + i, 1)) ||
+        (ret = blockdev_write(bd, buf, tags[i], 1)))
+      goto out;
+  }
+  if ((ret = blockdev_flush_cache(bd)))
+    goto out;
+  hdr->s5j_nblocks = 0;
+  if (!(ret = blockdev_write(bd, hdrbuf, start, 1)))
+    ret = blockdev_flush_cache(bd);
+
+out:
+  if (buf)
+    page_free(buf);
+  if (hdrbuf)
+    page_free(hdrbuf);
+  if (tags)
+    page_free(tags);
+  return ret;
+}
+
+/* Called by the pager before it writes back pages of the device */
+static int s5_journal_holdwrite(blockdev_t *bd) {
+  s5_journal_kick(bd->bd_holdarg);
+  return 1;
+}
+
+/* Runs in interrupt context */
+static void s5_journal_timeout(void *arg) { s5_journal_kick(arg); }
+
+int s5_journal_start(s5fs_t *fs) {
+  s5_super_t *super = fs->s5f_super;
+  blockdev_t *bd = fs->s5f_bdev;
+  s5_jheader_t *hdr;
+  s5_journal_t *j;
+  uint32_t start;
+  proc_t *p;
+  int ret;
+
+  fs->s5f_journal = NULL;
+  if (!S5_JOURNAL_BLOCKS)
+    return 0;
+
+  if (NULL == (j = kmalloc(sizeof(s5_journal_t))))
+    return -ENOMEM;
+  memset(j, 0, sizeof(s5_journal_t));
+  j->j_hdr = page_alloc_zeroed();
+  j->j_tags = page_alloc();
+  if (!j->j_hdr || !j->j_tags)
+    goto nomem;
+  hdr = (s5_jheader_t *)j->j_hdr;
+
+  if (!super->s5s_journal_start) {
+    /* Make one. The superblock goes home at once, so that no commit
+     * can be written before the disk knows where the journal is. */
+    if (0 > (ret = s5_alloc_run(fs, 0, S5_JOURNAL_BLOCKS))) {
+      dbg(DBG_PRINT, "s5fs: no room for a journal, not journaling\n");
+      ret = 0;
+      goto fail;
+    }
+    start = ret;
+    hdr->s5j_magic = S5_JOURNAL_MAGIC;
+    if ((ret = blockdev_write(bd, j->j_hdr, start, 1)) ||
+        (ret = blockdev_flush_cache(bd)))
+      goto fail;
+    super->s5s_journal_start = start;
+    super->s5s_journal_nblocks = S5_JOURNAL_BLOCKS;
+    s5_csum_super(super);
+    if ((ret = blockdev_write(bd, (char *)super, S5_SUPER_BLOCK, 1)))
+      goto fail;
+  } else if ((ret = blockdev_read(bd, j->j_hdr,
+                                  super->s5s_journal_start, 1))) {
+    goto fail;
+  }
+  KASSERT(S5_JOURNAL_MAGIC == hdr->s5j_magic && !hdr->s5j_nblocks);
+
+  j->j_fs = fs;
+  j->j_bdev = bd;
+  j->j_start = super->s5s_journal_start;
+  j->j_ntags = MIN(super->s5s_journal_nblocks - 2, S5_JOURNAL_TAGS);
+  j->j_sequence = hdr->s5j_sequence;
+  j->j_pfs = kmalloc(j->j_ntags * sizeof(pframe_t *));
+  j->j_iov = kmalloc((j->j_ntags + 1) * sizeof(blockdev_iovec_t));
+  if (!j->j_pfs || !j->j_iov)
+    goto nomem;
+  list_init(&j->j_handles);
+  sched_queue_init(&j->j_opq);
+  sched_queue_init(&j->j_drainq);
+  sched_queue_init(&j->j_daemonq);
+  timer_init(&j->j_timer, s5_journal_timeout, fs);
+
+  p = proc_create("s5jd");
+  KASSERT(NULL != p);
+  j->j_thr = kthread_create(p, s5_journal_run, 0, j);
+  KASSERT(NULL != j->j_thr);
+  sched_make_runnable(j->j_thr);
+
+  fs->s5f_journal = j;
+  bd->bd_holdarg = fs;
+  bd->bd_holdwrite = s5_journal_holdwrite;
+  dbg(DBG_S5FS, "journal of %u blocks at %u\n", super->s5s_journal_nblocks,
+      j->j_start);
+  return 0;
+
+nomem:
+  ret = -ENOMEM;
+fail:
+  if (j->j_hdr)
+    page_free(j->j_hdr);
+  if (j->j_tags)
+    page_free(j->j_tags);
+  if (j->j_pfs)
+    kfree(j->j_pfs);
+  if (j->j_iov)
+    kfree(j->j_iov);
+  kfree(j);
+  return ret;
+}
+
+void s5_journal_begin(s5fs_t *fs, s5_jhandle_t *h) {
+  s5_journal_t *j = fs->s5f_journal;
+  s5_jhandle_t *o;
+
+  h->jh_nested = 1;
+  if (!j)
+    return;
+  list_iterate_begin(&j->j_handles, o, s5_jhandle_t, jh_link) {
+    if (o->jh_thr == curthr)
+      return;
+  }
+  list_iterate_end();
+
+  while (j->j_committing)
+    sched_sleep_on(&j->j_opq);
+  h->jh_nested = 0;
+  h->jh_thr = curthr;
+  list_insert_tail(&j->j_handles, &h->jh_link);
+}
+
+int s5_journal_trybegin(s5fs_t *fs, s5_jhandle_t *h) {
+  s5_journal_t *j = fs->s5f_journal;
+  if (j && j->j_committing) {
+    h->jh_nested = 1;
+    return -EBUSY;
+  }
+  s5_journal_begin(fs, h);
+  return 0;
+}
+
+void s5_journal_end(s5fs_t *fs, s5_jhandle_t *h) {
+  s5_journal_t *j = fs->s5f_journal;
+
+  if (h->jh_nested)
+    return;
+  list_remove(&h->jh_link);
+  if (j->j_committing) {
+    if (list_empty(&j->j_handles))
+      sched_broadcast_on(&j->j_drainq);
+  } else if (!timer_pending(&j->j_timer)) {
+    timer_add(&j->j_timer,
+              time_ticks() + S5_JOURNAL_INTERVAL_MSECS / TICK_MSECS);
+  }
+}
+
+void s5_journal_kick(s5fs_t *fs) {
+  s5_journal_t *j = fs->s5f_journal;
+  if (!j)
+    return;
+  j->j_wanted = 1;
+  sched_wakeup_on(&j->j_daemonq);
+}
+
+/*
+ * Pin up to j_ntags dirty metadata pages of the device into j_pfs, in
+ * order of block number, and return how many. Room is left for the pages
+ * of the checksum table, which s5_csum_seal adds once it has stored the
+ * checksums of the others.
+ */
+static uint32_t s5_journal_gather(s5_journal_t *j) {
+  uint32_t max = j->j_ntags - j->j_fs->s5f_csum_nblocks;
+  pframe_t *pf;
+  uint32_t n = 0, i;
+
+  list_iterate_begin(&j->j_bdev->bd_mmobj.mmo_respages, pf, pframe_t,
+                     pf_olink) {
+    if (n == max || !pframe_is_dirty(pf) || pframe_is_busy(pf) ||
+        s5_csum_is_table(j->j_fs, pf->pf_pagenum))
+      continue;
+    pframe_pin(pf);
+    for (i = n++; i > 0 && j->j_pfs[i - 1]->pf_pagenum > pf->pf_pagenum; --i)
+      j->j_pfs[i] = j->j_pfs[i - 1];
+    j->j_pfs[i] = pf;
+  }
+  list_iterate_end();
+  return s5_csum_seal(j->j_fs, j->j_pfs, n);
+}
+
+/*
+ * Log, commit and write home the n pages gathered in j_pfs. The pages
+ * are marked clean only if all of it succeeds. The disk's write cache
+ * is flushed between the steps, so that the commit can't reach the disk
+ * before the copies it vouches for (or the file data written back before
+ * it, which the metadata may point to), nor the home blocks before the
+ * commit, nor the next transaction's copies before this one's header
+ * says the journal is empty.
+ */
+static int s5_journal_write(s5_journal_t *j, uint32_t n) {
+  s5_jheader_t *hdr = (s5_jheader_t *)j->j_hdr;
+  blockdev_t *bd = j->j_bdev;
+  uint32_t i, run;
+  int ret;
+
+  if (j->j_emptied) {
+    if ((ret = blockdev_flush_cache(bd)))
+      goto out;
+    j->j_emptied = 0;
+  }
+
+  /* the tags and the copies, in one sequential request */
+  memset(j->j_tags, 0, S5_BLOCK_SIZE);
+  j->j_iov[0].bv_buf = (char *)j->j_tags;
+  j->j_iov[0].bv_count = 1;
+  for (i = 0; i < n; ++i) {
+    j->j_tags[i] = j->j_pfs[i]->pf_pagenum;
+    j->j_iov[i + 1].bv_buf = j->j_pfs[i]->pf_addr;
+    j->j_iov[i + 1].bv_count = 1;
+  }
+  if ((ret = blockdev_writev(bd, j->j_iov, n + 1, j->j_start + 1)) ||
+      (ret = blockdev_flush_cache(bd)))
+    goto out;
+
+  /* the commit point */
+  hdr->s5j_sequence = j->j_sequence + 1;
+  hdr->s5j_nblocks = n;
+  if ((ret = blockdev_write(bd, j->j_hdr, j->j_start, 1)) ||
+      (ret = blockdev_flush_cache(bd)))
+    goto out;
+  j->j_sequence++;
+
+  /* home, a run of consecutive blocks at a time */
+  for (i = 0; i < n; i += run) {
+    for (run = 1; i + run < n && j->j_pfs[i + run]->pf_pagenum ==
+                                     j->j_pfs[i]->pf_pagenum + run;
+         ++run)
+      ;
+    if ((ret = blockdev_writev(bd, j->j_iov + i + 1, run,
+                               j->j_pfs[i]->pf_pagenum)))
+      goto out;
+  }
+
+  if ((ret = blockdev_flush_cache(bd)))
+    goto out;
+  hdr->s5j_nblocks = 0;
+  if ((ret = blockdev_write(bd, j->j_hdr, j->j_start, 1)))
+    goto out;
+  j->j_emptied = 1;
+  for (i = 0; i < n; ++i)
+    pframe_set_clean(j->j_pfs[i]);
+
+out:
+  if (ret)
+    dbg(DBG_PRINT, "s5fs: journal commit failed: %d\n", ret);
+  for (i = 0; i < n; ++i)
+    pframe_unpin(j->j_pfs[i]);
+  return ret;
+}
+
+/*
+ * Wait for the operations in progress to finish, keeping new ones out,
+ * and commit everything they left dirty. If that is more than one
+ * transaction can hold it goes out as several, each of which is atomic
+ * on its own.
+ */
+static int s5_journal_commit(s5_journal_t *j) {
+  uint32_t n;
+  int ret = 0;
+
+  while (j->j_committing)
+    sched_sleep_on(&j->j_opq);
+  j->j_committing = 1;
+  while (!list_empty(&j->j_handles))
+    sched_sleep_on(&j->j_drainq);
+
+  while ((n = s5_journal_gather(j)) && !(ret = s5_journal_write(j, n)))
+    ;
+
+  j->j_committing = 0;
+  sched_broadcast_on(&j->j_opq);
+  return ret;
+}
+
+int s5_journal_sync(s5fs_t *fs) {
+  if (!fs->s5f_journal)
+    return pframe_writeback_obj(&fs->s5f_bdev->bd_mmobj);
+  return s5_journal_commit(fs->s5f_journal);
+}
+
+/*
+ * The journal daemon commits whenever it is kicked: by the commit timer,
+ * which operations arm, or by the pager wanting metadata pages cleaned.
+ * arg2 is the journal; arg1 is unused.
+ */
+static void *s5_journal_run(int arg1, void *arg2) {
+  s5_journal_t *j = arg2;
+
+  while (!j->j_stopping) {
+    if (!j->j_wanted) {
+      sched_sleep_on(&j->j_daemonq);
+      continue;
+    }
+    j->j_wanted = 0;
+    s5_journal_commit(j);
+  }
+  j->j_thr = NULL;
+  sched_broadcast_on(&j->j_opq);
+  kthread_exit(NULL);
+  return NULL;
+}
+
+void s5_journal_stop(s5fs_t *fs) {
+  s5_journal_t *j = fs->s5f_journal;
+
+  if (!j)
+    return;
+  s5_journal_commit(j);
+
+  j->j_stopping = 1;
+  sched_wakeup_on(&j->j_daemonq);
+  while (j->j_thr)
+    sched_sleep_on(&j->j_opq);
+
+  timer_cancel(&j->j_timer);
+  j->j_bdev->bd_holdwrite = NULL;
+  j->j_bdev->bd_holdarg = NULL;
+  fs->s5f_journal = NULL;
+  page_free(j->j_hdr);
+  page_free(j->j_tags);
+  kfree(j->j_pfs);
+  kfree(j->j_iov);
+  kfree(j);
+}
@@ -18,11 +18,15 @@
 #include "mm/mmobj.h"
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
+#include "fs/dirent.h"
+#include "fs/fcntl.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_csum.h"
+#include "fs/s5fs/s5fs_compress.h"
 #include "mm/mm.h"
 #include "mm/page.h"
 
@@ -40,7 +44,8 @@
   } while (0)
 
 static void s5_free_block(s5fs_t *fs, int block);
-static int s5_alloc_block(s5fs_t *);
+static int s5_alloc_block(s5fs_t *fs, uint32_t goal);
+static int s5_seek(vnode_t *vnode, off_t seekptr, int alloc, uint32_t want);
 
 /*
  * Return the disk-block number for the given seek pointer (aka file
@@ -51,50 +56,156 @@ static int s5_alloc_block(s5fs_t *);
  * alloc is true, then allocate a new disk block (and make the inode
  * point to it) and return it.
  *
- * Be sure to handle indirect blocks!
+ * Blocks past the direct blocks are mapped through the indirect block,
+ * and past those through the double indirect block, which holds the
+ * numbers of further indirect blocks. An inline file has no blocks, so
+ * every block of it is sparse; it must be moved out of its inode with
+ * s5_uninline before one is allocated.
  *
  * If there is an error, return -errno.
  *
  * You probably want to use pframe_get, pframe_pin, pframe_unpin, pframe_dirty.
  */
 int s5_seek_to_block(vnode_t *vnode, off_t seekptr, int alloc) {
+  return s5_seek(vnode, seekptr, alloc, 0);
+}
+
+/*
+ * Like s5_seek_to_block with alloc set, for the npages consecutive
+ * blocks of a file starting at the one containing seekptr, whose
+ * numbers are stored in blocks. The sparse ones are allocated together
+ * as a run of consecutive blocks, following the block before them if
+ * that is free, so that a burst of appends written back at once lands
+ * contiguously even while other files are growing. Without a free run
+ * that long they get a block at a time. Returns 0 or -errno.
+ */
+int s5_seek_to_run(vnode_t *vnode, off_t seekptr, int *blocks, int npages) {
+  s5fs_t *fs = VNODE_TO_S5FS(vnode);
+  int nsparse = 0, goal = 0, run, i;
+
+  for (i = 0; i < npages; ++i) {
+    blocks[i] = s5_seek_to_block(vnode, seekptr + i * S5_BLOCK_SIZE, 0);
+    if (0 > blocks[i])
+      return blocks[i];
+    if (!blocks[i])
+      ++nsparse;
+    else if (!nsparse)
+      goal = blocks[i] + 1;
+  }
+  if (!nsparse)
+    return 0;
+  if (!goal && seekptr >= S5_BLOCK_SIZE &&
+      0 < (goal = s5_seek_to_block(vnode, seekptr - S5_BLOCK_SIZE, 0)))
+    ++goal;
+  run = 1 < nsparse ? s5_alloc_run(fs, MAX(goal, 0), nsparse) : 0;
+  for (i = 0; i < npages; ++i) {
+    if (blocks[i])
+      continue;
+    blocks[i] = s5_seek(vnode, seekptr + i * S5_BLOCK_SIZE, 1,
+                        0 < run ? run : 0);
+    if (0 > blocks[i]) {
+      /* Give back what is left of the run */
+      for (; 0 < run && nsparse; --nsparse)
+        s5_free_block(fs, run++);
+      return blocks[i];
+    }
+    if (0 < run)
+      ++run;
+    --nsparse;
+  }
+  return 0;
+}
+
+/*
+ * The work of s5_seek_to_block; a sparse data block is given the block
+ * 'want' if that is nonzero, rather than a newly allocated one.
+ */
+static int s5_seek(vnode_t *vnode, off_t seekptr, int alloc, uint32_t want) {
   dbg(DBG_S5FS, "vno: %d seekptr: %d\n", vnode->vn_vno, seekptr);
-  // TODO: pin inode. Otherwise looks good
+  s5fs_t *fs = VNODE_TO_S5FS(vnode);
   s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
   KASSERT(inode);
-  KASSERT(curthr == vnode->vn_mutex.km_holder);
-  blocknum_t block_index = S5_DATA_BLOCK(seekptr);
-  uint32_t blocknum;
-  int indirect = 0; // Bool, true if indirect block
-  pframe_t *pframe;
-  if (block_index < S5_NDIRECT_BLOCKS) { // Direct blocks
-    blocknum = inode->s5_direct_blocks[block_index];
-  } else { // Indirect blocks
-    indirect = 1;
-    block_index -= S5_NDIRECT_BLOCKS;
-    if (block_index >= S5_NIDIRECT_BLOCKS)
-      return -EFBIG;
-    int status = pframe_get(S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode)), 
-        block_index, &pframe);
-    if (status) return status;
-    blocknum = ((uint32_t *)pframe->pf_addr)[block_index];
-  }
-  if (!blocknum) { // Blocknum is zero, must be sparse
-    if (!alloc) // Can't allocate a new block, return zero
-      return 0;
-    // Allocate new block
-    blocknum = s5_alloc_block(VNODE_TO_S5FS(vnode));
-    if (blocknum <= 0) {
-      return blocknum;
-    }
-    if (indirect) { // New indirect block
-      pframe_dirty(pframe);
-      ((uint32_t *)pframe->pf_addr)[block_index] = blocknum;
-    } else { // New direct block
-      s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
-      inode->s5_direct_blocks[block_index] = blocknum;
+  KASSERT(alloc ? krwlock_write_held(&vnode->vn_lock)
+                : krwlock_locked(&vnode->vn_lock));
+  if (S5_TYPE_INLINE == inode->s5_type) {
+    KASSERT(!alloc);
+    return 0;
+  }
+  uint32_t block_index = S5_DATA_BLOCK(seekptr);
+  uint32_t *slot;          // where the next block number is stored
+  pframe_t *owner = NULL;  // pinned page holding slot; NULL for the inode
+  int levels;              // indirect blocks between slot and the data
+  if (block_index < S5_NDIRECT_BLOCKS) {
+    slot = &inode->s5_direct_blocks[block_index];
+    levels = 0;
+  } else if ((block_index -= S5_NDIRECT_BLOCKS) < S5_NIDIRECT_BLOCKS) {
+    slot = &inode->s5_indirect_block;
+    levels = 1;
+  } else if ((block_index -= S5_NIDIRECT_BLOCKS) <
+             S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS) {
+    slot = &inode->s5_dindirect_block;
+    levels = 2;
+  } else {
+    return -EFBIG;
+  }
+
+  int blocknum;
+  for (;;) {
+    blocknum = *slot;
+    if (!blocknum) { // Sparse, or no indirect block yet
+      if (!alloc)
+        goto out;
+      // Aim for the block after the one mapped by the previous slot or,
+      // at the start of an indirect block, after the indirect block
+      // itself. s5_indirect_block follows the last direct block in the
+      // inode, so its previous slot is that block.
+      uint32_t goal = 0;
+      if (owner ? slot != (uint32_t *)owner->pf_addr
+                : slot != inode->s5_direct_blocks) {
+        if (slot[-1])
+          goal = slot[-1] + 1;
+      } else if (owner) {
+        goal = owner->pf_pagenum + 1;
+      }
+      if (!levels && want)
+        blocknum = want;
+      else if (0 >= (blocknum = s5_alloc_block(fs, goal)))
+        goto out;
+      if (levels) { // New indirect blocks start out empty
+        pframe_t *pframe;
+        int status = pframe_get(S5FS_TO_VMOBJ(fs), blocknum, &pframe);
+        if (status) {
+          s5_free_block(fs, blocknum);
+          blocknum = status;
+          goto out;
+        }
+        pframe_dirty(pframe);
+        memset(pframe->pf_addr, 0, S5_BLOCK_SIZE);
+      }
+      if (owner)
+        pframe_dirty(owner);
+      else
+        s5_dirty_inode(fs, inode);
+      *slot = blocknum;
     }
+    if (owner)
+      pframe_unpin(owner);
+    if (!levels)
+      return blocknum;
+
+    // Step down into the indirect block
+    int status = pframe_get(S5FS_TO_VMOBJ(fs), blocknum, &owner);
+    if (status)
+      return status;
+    pframe_pin(owner);
+    uint32_t index = block_index;
+    if (--levels)
+      index /= S5_NIDIRECT_BLOCKS;
+    slot = (uint32_t *)owner->pf_addr + index % S5_NIDIRECT_BLOCKS;
   }
+out:
+  if (owner)
+    pframe_unpin(owner);
   return blocknum;
 }
 
@@ -108,6 +219,189 @@ static void lock_s5(s5fs_t *fs) { kmutex_lock(&fs->s5f_mutex); }
  */
 static void unlock_s5(s5fs_t *fs) { kmutex_unlock(&fs->s5f_mutex); }
 
+/*
+ * Read the pages [start, start + npages) of a file into its page cache,
+ * stopping at the end of the file, at a sparse block, or at the first page
+ * which is already resident. Pages which are contiguous on disk are read
+ * with a single device request. Returns the number of pages read.
+ */
+static uint32_t s5_readahead(vnode_t *vnode, uint32_t start,
+                             uint32_t npages) {
+  blockdev_t *bdev = VNODE_TO_S5FS(vnode)->s5f_bdev;
+  blockdev_iovec_t iov[S5_READAHEAD_MAX];
+  pframe_t *pfs[S5_READAHEAD_MAX];
+  int n = 0, runstart = 0, status, i;
+  uint32_t pagenum, end;
+
+  if (!vnode->vn_len)
+    return 0;
+  end = MIN(start + MIN(npages, S5_READAHEAD_MAX),
+            (uint32_t)S5_DATA_BLOCK(vnode->vn_len - 1) + 1);
+  /* Whose blocks are not its pages */
+  if (S5_TYPE_COMPRESSED == VNODE_TO_S5INODE(vnode)->s5_type)
+    return start < end ? s5_readahead_compressed(vnode, start, end) : 0;
+  for (pagenum = start; pagenum <= end; ++pagenum) {
+    int block = 0;
+    pframe_t *pf = NULL;
+    if (pagenum < end &&
+        0 < (block = s5_seek_to_block(vnode, pagenum * S5_BLOCK_SIZE, 0)) &&
+        n && block != runstart + n) {
+      /* Not contiguous with the current run; issue that first */
+      status = blockdev_readv(bdev, iov, n, runstart);
+      for (i = 0; i < n; ++i)
+        pframe_fill_done(pfs[i], status);
+      n = 0;
+    }
+    if (0 < block)
+      pf = pframe_alloc_busy(&vnode->vn_mmobj, pagenum);
+    if (NULL == pf) {
+      if (n) {
+        status = blockdev_readv(bdev, iov, n, runstart);
+        for (i = 0; i < n; ++i)
+          pframe_fill_done(pfs[i], status);
+      }
+      break;
+    }
+    if (!n)
+      runstart = block;
+    iov[n].bv_buf = pf->pf_addr;
+    iov[n].bv_count = 1;
+    pfs[n++] = pf;
+  }
+  dbg(DBG_S5FS, "vno: %d read ahead %d pages from %d\n", vnode->vn_vno,
+      pagenum - start, start);
+  return pagenum - start;
+}
+
+/*
+ * Read the pages [start, start + npages) of a file into its page cache,
+ * as far as the end of the file, passing over those which are resident
+ * or sparse. The caller holds the vnode lock.
+ */
+void s5_prefetch(vnode_t *vnode, uint32_t start, uint32_t npages) {
+  uint32_t end, n;
+
+  KASSERT(krwlock_locked(&vnode->vn_lock));
+  if (!vnode->vn_len)
+    return;
+  end = MIN(start + npages, (uint32_t)S5_DATA_BLOCK(vnode->vn_len - 1) + 1);
+  while (start < end) {
+    n = s5_readahead(vnode, start, end - start);
+    start += n ? n : 1;
+  }
+}
+
+/*
+ * Note a read of the given page, and read ahead if the file is being read
+ * sequentially and the page is not resident. Each miss in a sequential run
+ * doubles the window, and any out-of-order read resets it. Files advised
+ * POSIX_FADV_RANDOM are never read ahead, and those advised
+ * POSIX_FADV_SEQUENTIAL read the largest window ahead on every miss.
+ *
+ * Readers only share the vnode lock, so concurrent readers may interleave
+ * their updates here; the window is just a hint, so that does no harm.
+ */
+static void s5_readahead_check(vnode_t *vnode, uint32_t pagenum) {
+  int seq = POSIX_FADV_SEQUENTIAL == vnode->vn_ra_advice;
+
+  if (POSIX_FADV_RANDOM == vnode->vn_ra_advice)
+    return;
+  if (!seq && pagenum != vnode->vn_ra_next) {
+    vnode->vn_ra_window = 0;
+  } else if (NULL == pframe_get_resident(&vnode->vn_mmobj, pagenum)) {
+    if (seq)
+      vnode->vn_ra_window = S5_READAHEAD_MAX;
+    else
+      vnode->vn_ra_window =
+          vnode->vn_ra_window ? MIN(2 * vnode->vn_ra_window, S5_READAHEAD_MAX)
+                              : S5_READAHEAD_MIN;
+    s5_readahead(vnode, pagenum, vnode->vn_ra_window);
+  }
+  vnode->vn_ra_next = pagenum + 1;
+}
+
+/*
+ * Gets the page for a write which covers all of it. There is no point in
+ * reading the old contents from disk only to overwrite them, so a page
+ * which is not resident is filled straight from buf instead; the caller
+ * must not copy into it again. Falls back to pframe_get (and returns 0 in
+ * *filled) when the page is resident or memory is short.
+ */
+static int s5_get_overwrite(vnode_t *vnode, uint32_t pagenum, const char *buf,
+                            pframe_t **pf, int *filled) {
+  *filled = 0;
+  if (NULL == (*pf = pframe_alloc_busy(&vnode->vn_mmobj, pagenum)))
+    return pframe_get(&vnode->vn_mmobj, pagenum, pf);
+  memcpy((*pf)->pf_addr, buf, S5_BLOCK_SIZE);
+  pframe_fill_done(*pf, 0);
+  *filled = 1;
+  return 0;
+}
+
+/*
+ * True if a regular file is inline, or could be made so: it is no
+ * longer than S5_INLINE_MAX bytes and has no blocks.
+ */
+static int s5_inlinable(s5_inode_t *inode) {
+  if (S5_TYPE_INLINE == inode->s5_type)
+    return 1;
+  if (S5_TYPE_DATA != inode->s5_type || inode->s5_size > S5_INLINE_MAX ||
+      inode->s5_indirect_block || inode->s5_dindirect_block)
+    return 0;
+  for (int i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
+    if (inode->s5_direct_blocks[i])
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Write back a page of a small file into its inode rather than a block,
+ * making the file inline if it wasn't yet, so that it never takes a
+ * block and is read back from the inode's already cached page. Any
+ * later page of such a file is past its end, and is dropped.
+ *
+ * Returns 1 if the page was dealt with, or 0 if the file is not small
+ * enough and the page needs a block as usual.
+ */
+int s5_clean_inline(vnode_t *vnode, off_t offset, const void *pagebuf) {
+  s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  KASSERT(krwlock_write_held(&vnode->vn_lock));
+  if (!S_ISREG(vnode->vn_mode) || !s5_inlinable(inode))
+    return 0;
+  if (!S5_DATA_BLOCK(offset)) {
+    memset(inode->s5_direct_blocks, 0, S5_INLINE_MAX);
+    memcpy(inode->s5_direct_blocks, pagebuf, inode->s5_size);
+    inode->s5_type = S5_TYPE_INLINE;
+    s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
+  }
+  return 1;
+}
+
+/*
+ * Move an inline file's data out of its inode into its first page, left
+ * dirty to be given a block when it is written back, so that the file
+ * can grow past S5_INLINE_MAX bytes. Does nothing to any other file.
+ * Returns 0 or -errno.
+ */
+int s5_uninline(vnode_t *vnode) {
+  s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  pframe_t *pf;
+  int status;
+
+  KASSERT(krwlock_write_held(&vnode->vn_lock));
+  if (S5_TYPE_INLINE != inode->s5_type)
+    return 0;
+  /* Filled from the inode, unless it is resident already and newer */
+  if ((status = pframe_get(&vnode->vn_mmobj, 0, &pf)) ||
+      (status = pframe_dirty(pf)))
+    return status;
+  memset(inode->s5_direct_blocks, 0, S5_INLINE_MAX);
+  inode->s5_type = S5_TYPE_DATA;
+  s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
+  return 0;
+}
+
 /* Abstraction for both reading and writing files
  * @write a boolean indicating whether to write (1) or read (0)
  * */
@@ -116,7 +410,8 @@ int s5_file_op(struct vnode *vnode, off_t seek, char *buf, size_t len, int write
   s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
   KASSERT(seek >= 0);
   KASSERT(inode);
-  KASSERT(curthr == vnode->vn_mutex.km_holder);
+  KASSERT(write ? krwlock_write_held(&vnode->vn_lock)
+                : krwlock_locked(&vnode->vn_lock));
   // Check for reading after file end
   if (!write && seek >= inode->s5_size) {
     dbg(DBG_S5FS, "read past end of file\n");
@@ -124,23 +419,39 @@ int s5_file_op(struct vnode *vnode, off_t seek, char *buf, size_t len, int write
   }
   //dbg(DBG_S5FS, "vno: %d, seek: %d len: %d filelen: %d\n", vnode->vn_vno, 
   //    seek, len, inode->s5_size);
+  // Don't read, or copy out, the pages past the end of the file
+  if (!write)
+    len = MIN(len, inode->s5_size - (uint32_t)seek);
+  // A file growing out of its inode needs blocks
+  if (write && seek + len > S5_INLINE_MAX) {
+    int status = s5_uninline(vnode);
+    if (status)
+      return status;
+  }
   pframe_t *pframe;
   size_t ndone_total = 0;
   while (len) {
-    blocknum_t blocknum = S5_DATA_BLOCK(seek);
-    //int status = pframe_get(S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode)), blocknum, &pframe);
-    int status = pframe_get(&vnode->vn_mmobj, blocknum, &pframe);
+    blocknum_t blocknum = S5_DATA_BLOCK(seek + ndone_total);
+    size_t offset = S5_DATA_OFFSET(seek + ndone_total);
+    size_t ndone = MIN(len, S5_BLOCK_SIZE - offset);
+    int status, filled = 0;
+    if (!write)
+      s5_readahead_check(vnode, blocknum);
+    if (write && S5_BLOCK_SIZE == ndone)
+      status = s5_get_overwrite(vnode, blocknum, buf + ndone_total, &pframe,
+                                &filled);
+    else
+      status = pframe_get(&vnode->vn_mmobj, blocknum, &pframe);
     if (status) {
       dbg(DBG_S5FS, "pframe_get error: %d\n", status);
       return ndone_total;
     }
-    size_t offset = S5_DATA_OFFSET(seek + ndone_total);
-    size_t ndone = MIN(len, S5_BLOCK_SIZE - offset);
 
     // Do the operation on this page
     if (write) {
       pframe_dirty(pframe);
-      memcpy(pframe->pf_addr + offset, buf + ndone_total, ndone);
+      if (!filled)
+        memcpy(pframe->pf_addr + offset, buf + ndone_total, ndone);
     } else {
       memcpy(buf + ndone_total, pframe->pf_addr + offset, ndone);
     }
@@ -215,38 +526,168 @@ int s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len) {
   return s5_file_op(vnode, seek, dest, len, 0);
 }
 
+/*
+ * Gets and pins the page holding byte seek of the given file, reading it
+ * (and reading ahead) as s5_read_file would, and sets *nbytes to the
+ * number of bytes of the file from seek to the end of that page. Sets
+ * *pf to NULL if seek is at or past the end of the file. The page stays
+ * valid, though not locked against writers, after the vnode lock is
+ * dropped; the caller unpins it when done.
+ */
+int s5_pin_file_page(struct vnode *vnode, off_t seek, pframe_t **pf,
+                     size_t *nbytes) {
+  s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  uint32_t pagenum = S5_DATA_BLOCK(seek);
+  int status;
+
+  KASSERT(krwlock_locked(&vnode->vn_lock));
+  KASSERT(seek >= 0);
+  *pf = NULL;
+  if ((uint32_t)seek >= inode->s5_size)
+    return 0;
+  s5_readahead_check(vnode, pagenum);
+  if ((status = pframe_get(&vnode->vn_mmobj, pagenum, pf))) {
+    *pf = NULL;
+    return status;
+  }
+  pframe_pin(*pf);
+  *nbytes = MIN((uint32_t)(S5_BLOCK_SIZE - S5_DATA_OFFSET(seek)),
+                inode->s5_size - (uint32_t)seek);
+  return 0;
+}
+
+/* Gets page pagenum of a file if it is resident, once no one is reading
+ * or writing it */
+static pframe_t *s5_direct_resident(vnode_t *vnode, uint32_t pagenum) {
+  pframe_t *pf;
+
+  while ((pf = pframe_get_resident(&vnode->vn_mmobj, pagenum)) &&
+         pframe_is_busy(pf))
+    sched_sleep_on(pframe_waitq(pf));
+  return pf;
+}
 
 /*
- * Allocate a new disk-block off the block free list and return it. If
- * there are no free blocks, return -ENOSPC.
- *
- * This will not initialize the contents of an allocated block; these
- * contents are undefined.
- *
- * If the super block's s5s_nfree is 0, you need to refill
- * s5s_free_blocks and reset s5s_nfree.  You need to read the contents
- * of this page using the pframe system in order to obtain the next set of
- * free block numbers.
- *
- * Don't forget to dirty the appropriate blocks!
+ * Transfers the npages whole blocks of a file from seek directly between
+ * buf and the disk, a run of consecutive blocks per request. A resident
+ * page may be newer than its block, so a read takes it instead of the
+ * block, and a write copies into it as well.
+ */
+static int s5_direct_run(vnode_t *vnode, off_t seek, char *buf, int npages,
+                         int write) {
+  s5fs_t *fs = VNODE_TO_S5FS(vnode);
+  int blocks[PF_WRITEBACK_MAX];
+  uint32_t pagenum = S5_DATA_BLOCK(seek);
+  int status = 0, start, i;
+  pframe_t *pf;
+  char *p;
+
+  KASSERT(0 < npages && npages <= PF_WRITEBACK_MAX);
+  if (write && (status = s5_seek_to_run(vnode, seek, blocks, npages)))
+    return status;
+  for (i = 0; !write && i < npages; ++i) {
+    blocks[i] = s5_seek_to_block(vnode, seek + i * S5_BLOCK_SIZE, 0);
+    if (0 > blocks[i])
+      return blocks[i];
+  }
+  for (i = 0; i < npages; ++i) {
+    p = buf + i * S5_BLOCK_SIZE;
+    pf = s5_direct_resident(vnode, pagenum + i);
+    if (pf && write) {
+      memcpy(pf->pf_addr, p, S5_BLOCK_SIZE);
+    } else if (pf) {
+      memcpy(p, pf->pf_addr, S5_BLOCK_SIZE);
+      blocks[i] = 0;
+    } else if (!blocks[i]) { // Sparse block, read as zeros
+      memset(p, 0, S5_BLOCK_SIZE);
+    }
+  }
+  for (start = 0, i = 0; !status && i < npages; ++i) {
+    if (!blocks[i]) {
+      start = i + 1;
+      continue;
+    }
+    if (i + 1 == npages || blocks[i + 1] != blocks[i] + 1) {
+      p = buf + start * S5_BLOCK_SIZE;
+      if (write)
+        status = blockdev_write(fs->s5f_bdev, p, blocks[start], i + 1 - start);
+      else
+        status = blockdev_read(fs->s5f_bdev, p, blocks[start], i + 1 - start);
+      start = i + 1;
+    }
+  }
+  return status;
+}
+
+/*
+ * Reads or writes a regular file for O_DIRECT. When seek and buf are
+ * block aligned, the whole blocks from seek go straight between buf and
+ * the disk, mapped with s5_seek_to_block rather than read in with
+ * pframe_get; see s5_direct_run. Sparse blocks read as zeros, and are
+ * allocated when written. The rest (all of an unaligned transfer or an
+ * inline or compressed file, and the part block at the end of one) goes
+ * through s5_file_op as usual.
  *
- * You'll probably want to use lock_s5(), unlock_s5(), pframe_get(),
- * and s5_dirty_super()
+ * Returns the number of bytes transferred, or -errno if none were.
  */
-static int s5_alloc_block(s5fs_t *fs) {
-  dbg(DBG_S5FS, "\n");
-  lock_s5(fs);
+int s5_direct_io(vnode_t *vnode, off_t seek, char *buf, size_t len,
+                 int write) {
+  s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  size_t n, done = 0;
+  int status = 0, npages;
+
+  KASSERT(S_ISREG(vnode->vn_mode));
+  KASSERT(seek >= 0);
+  KASSERT(write ? krwlock_write_held(&vnode->vn_lock)
+                : krwlock_locked(&vnode->vn_lock));
+  // A file growing out of its inode needs blocks
+  if (write && seek + len > S5_INLINE_MAX && (status = s5_uninline(vnode)))
+    return status;
+  if (PAGE_ALIGNED(buf) && !S5_DATA_OFFSET(seek) &&
+      S5_TYPE_INLINE != inode->s5_type &&
+      S5_TYPE_COMPRESSED != inode->s5_type) {
+    while (!status) {
+      n = len - done;
+      if (!write)
+        n = MIN(n, inode->s5_size -
+                       MIN(inode->s5_size, (uint32_t)seek + done));
+      if (!(npages = MIN(n / S5_BLOCK_SIZE, PF_WRITEBACK_MAX)))
+        break;
+      status = s5_direct_run(vnode, seek + done, buf + done, npages, write);
+      if (!status)
+        done += npages * S5_BLOCK_SIZE;
+    }
+  }
+  if (write && (uint32_t)seek + done > inode->s5_size) {
+    KASSERT((uint32_t)vnode->vn_len == inode->s5_size);
+    inode->s5_size = (uint32_t)seek + done;
+    vnode->vn_len = inode->s5_size;
+    s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
+  }
+  if (!status && done < len &&
+      0 < (status = s5_file_op(vnode, seek + done, buf + done, len - done,
+                               write))) {
+    done += status;
+    status = 0;
+  }
+  return done ? (int)done : status;
+}
+
+
+/*
+ * Take a block off the superblock's free list, refilling the list from
+ * the next free-list block when it runs out. The caller holds s5f_mutex
+ * and dirties the superblock.
+ */
+static int s5_super_alloc_block(s5fs_t *fs) {
   s5_super_t *super = fs->s5f_super;
-  s5_dirty_super(fs); // Dirty super
   if (super->s5s_nfree) { // Use next entry in super block
     --super->s5s_nfree;
-    unlock_s5(fs);
     return super->s5s_free_blocks[super->s5s_nfree];
   } else { // Super block exhausted
     int next = super->s5s_free_blocks[S5_NBLKS_PER_FNODE-1];
     if (next == -1) {
       dbg(DBG_S5FS, "out of free blocks!\n");
-      unlock_s5(fs);
       return -ENOSPC;
     }
     // Copy contents of next block on list
@@ -254,7 +695,6 @@ static int s5_alloc_block(s5fs_t *fs) {
     int status = pframe_get(S5FS_TO_VMOBJ(fs), next, &pframe);
     if (status) {
       dbg(DBG_S5FS, "pframe_get returned %d\n", status);
-      unlock_s5(fs);
       return status;
     }
     uint32_t *freeblocks = (uint32_t *) pframe->pf_addr;
@@ -262,25 +702,18 @@ static int s5_alloc_block(s5fs_t *fs) {
       super->s5s_free_blocks[i] = freeblocks[i];
     }
     super->s5s_nfree = S5_NBLKS_PER_FNODE - 1;
-    unlock_s5(fs);
     return next; // Return emptied out next block
   }
 }
 
 /*
- * Given a filesystem and a block number, frees the given block in the
- * filesystem.
- *
- * This function may potentially block.
- *
- * The caller is responsible for ensuring that the block being placed on
- * the free list is actually free and is not resident.
+ * Put a block on the superblock's free list, spilling the list into the
+ * block itself when it is full. The caller holds s5f_mutex and dirties
+ * the superblock.
  */
-static void s5_free_block(s5fs_t *fs, int blockno) {
+static void s5_super_free_block(s5fs_t *fs, int blockno) {
   s5_super_t *s = fs->s5f_super;
 
-  lock_s5(fs);
-
   KASSERT(S5_NBLKS_PER_FNODE > s->s5s_nfree);
 
   if ((S5_NBLKS_PER_FNODE - 1) == s->s5s_nfree) {
@@ -301,33 +734,159 @@ static void s5_free_block(s5fs_t *fs, int blockno) {
   } else {
     s->s5s_free_blocks[s->s5s_nfree++] = blockno;
   }
+}
 
-  s5_dirty_super(fs);
+/*
+ * Free block and inode bitmaps: bit n of a map is set when block (or
+ * inode) n is free.
+ */
+#define S5_MAP_WORDS(nbits) (((nbits) + 31) / 32)
+#define s5_map_isset(map, n) ((map)[(n) / 32] & (1U << ((n) % 32)))
+#define s5_map_set(map, n) ((map)[(n) / 32] |= 1U << ((n) % 32))
+#define s5_map_clear(map, n) ((map)[(n) / 32] &= ~(1U << ((n) % 32)))
 
-  unlock_s5(fs);
+/*
+ * Returns the first set bit at or after start in a map of nbits bits,
+ * wrapping around the end. The map must have a bit set.
+ */
+static uint32_t s5_map_find(uint32_t *map, uint32_t nbits, uint32_t start) {
+  uint32_t nwords = S5_MAP_WORDS(nbits);
+  uint32_t i, w = 0, bits = 0;
+
+  if (start >= nbits)
+    start = 0;
+  /* the word holding start is looked at twice: first from start up, and
+   * last, after wrapping around, below start */
+  for (i = 0; i <= nwords; ++i) {
+    w = (start / 32 + i) % nwords;
+    bits = map[w];
+    if (0 == i)
+      bits &= ~0U << (start % 32);
+    if (bits)
+      break;
+  }
+  KASSERT(bits && "free count is wrong");
+  return w * 32 + __builtin_ctz(bits);
 }
 
 /*
- * Creates a new inode from the free list and initializes its fields.
- * Uses S5_INODE_BLOCK to get the page from which to create the inode
+ * Allocate a new disk-block and return it. If there are no free blocks,
+ * return -ENOSPC.
  *
- * This function may block.
+ * This will not initialize the contents of an allocated block; these
+ * contents are undefined.
+ *
+ * The block is the first free one at or after goal, wrapping around the
+ * end of the disk; a goal of 0 means the block after the last one
+ * allocated. Passing the block after a file's previous block keeps the
+ * file contiguous while there is room.
  */
-int s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid) {
-  s5fs_t *s5fs = FS_TO_S5FS(fs);
-  pframe_t *inodep;
-  s5_inode_t *inode;
-  int ret = -1;
+static int s5_alloc_block(s5fs_t *fs, uint32_t goal) {
+  int ret = -ENOSPC;
 
-  KASSERT((S5_TYPE_DATA == type) || (S5_TYPE_DIR == type) ||
-          (S5_TYPE_CHR == type) || (S5_TYPE_BLK == type));
+  dbg(DBG_S5FS, "goal: %u\n", goal);
+  spin_lock(&fs->s5f_map_lock);
+  if (fs->s5f_nfreeblocks) {
+    ret = s5_map_find(fs->s5f_freemap, fs->s5f_nblocks,
+                      goal ? goal : fs->s5f_rotor);
+    s5_map_clear(fs->s5f_freemap, ret);
+    fs->s5f_nfreeblocks--;
+    fs->s5f_rotor = ret + 1;
+  }
+  spin_unlock(&fs->s5f_map_lock);
+  return ret;
+}
 
-  lock_s5(s5fs);
+/*
+ * Given a filesystem and a block number, frees the given block in the
+ * filesystem.
+ *
+ * The caller is responsible for ensuring that the block being placed on
+ * the free list is actually free. A dirty page of the block left over
+ * from its use as metadata is dropped, so that it is not written over
+ * whatever the block holds next, and so is its checksum.
+ */
+static void s5_free_block(s5fs_t *fs, int blockno) {
+  uint32_t b = blockno;
+  pframe_t *pf;
 
-  if (s5fs->s5f_super->s5s_free_inode == (uint32_t)-1) {
-    unlock_s5(s5fs);
-    return -ENOSPC;
+  KASSERT(!S5_IS_SUPER(b) && b < fs->s5f_nblocks);
+  pf = pframe_get_resident(S5FS_TO_VMOBJ(fs), b);
+  if (pf && !pframe_is_busy(pf))
+    pframe_set_clean(pf);
+  s5_csum_forget(fs, b);
+  spin_lock(&fs->s5f_map_lock);
+  KASSERT(!s5_map_isset(fs->s5f_freemap, b) && "double free");
+  s5_map_set(fs->s5f_freemap, b);
+  fs->s5f_nfreeblocks++;
+  spin_unlock(&fs->s5f_map_lock);
+}
+
+/*
+ * Allocate n consecutive blocks and return the first, or -ENOSPC if
+ * there is no free run that long. The first run at or after 'goal' is
+ * taken if there is one, else the first on the disk.
+ */
+int s5_alloc_run(s5fs_t *fs, uint32_t goal, uint32_t n) {
+  uint32_t b, len = 0;
+  int ret = -ENOSPC;
+
+  if (S5_IS_SUPER(goal) || goal >= fs->s5f_nblocks)
+    goal = 1;
+  spin_lock(&fs->s5f_map_lock);
+  for (b = goal; b < fs->s5f_nblocks; ++b) {
+    len = s5_map_isset(fs->s5f_freemap, b) ? len + 1 : 0;
+    if (len == n) {
+      ret = b + 1 - n;
+      break;
+    }
+  }
+  for (b = 1, len = 0; 0 > ret && b < goal + n - 1 && b < fs->s5f_nblocks;
+       ++b) {
+    len = s5_map_isset(fs->s5f_freemap, b) ? len + 1 : 0;
+    if (len == n)
+      ret = b + 1 - n;
+  }
+  if (0 < ret) {
+    for (b = ret; b < ret + n; ++b)
+      s5_map_clear(fs->s5f_freemap, b);
+    fs->s5f_nfreeblocks -= n;
+    fs->s5f_rotor = ret + n;
   }
+  spin_unlock(&fs->s5f_map_lock);
+  return ret;
+}
+
+/* True if the block is not free in the free map */
+int s5_block_in_use(s5fs_t *fs, uint32_t blockno) {
+  int ret;
+  spin_lock(&fs->s5f_map_lock);
+  ret = !s5_map_isset(fs->s5f_freemap, blockno);
+  spin_unlock(&fs->s5f_map_lock);
+  return ret;
+}
+
+/* True if the inode on disk is not free, whether or not anything links
+ * to it */
+int s5_inode_in_use(s5fs_t *fs, uint32_t ino) {
+  pframe_t *inodep;
+  if (pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(ino), &inodep))
+    return 0;
+  return S5_TYPE_FREE !=
+         ((s5_inode_t *)(inodep->pf_addr) + S5_INODE_OFFSET(ino))->s5_type;
+}
+
+/*
+ * Take an inode off the superblock's inode free list and return its
+ * number, or -ENOSPC. The caller holds s5f_mutex and dirties the
+ * superblock.
+ */
+static int s5_super_alloc_inode(s5fs_t *s5fs) {
+  pframe_t *inodep;
+  s5_inode_t *inode;
+
+  if (s5fs->s5f_super->s5s_free_inode == (uint32_t)-1)
+    return -ENOSPC;
 
   pframe_get(&s5fs->s5f_bdev->bd_mmobj,
              S5_INODE_BLOCK(s5fs->s5f_super->s5s_free_inode), &inodep);
@@ -338,13 +897,207 @@ int s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid) {
 
   KASSERT(inode->s5_number == s5fs->s5f_super->s5s_free_inode);
 
-  ret = inode->s5_number;
-
   /* reset s5s_free_inode; remove the inode from the inode free list: */
   s5fs->s5f_super->s5s_free_inode = inode->s5_next_free;
-  pframe_pin(inodep);
-  s5_dirty_super(s5fs);
-  pframe_unpin(inodep);
+  return inode->s5_number;
+}
+
+/*
+ * Marks the indirect block blockno (if it is not 0) and every block it
+ * maps as in use, as in s5_free_indirect(). Block numbers past the end
+ * of the disk are ignored.
+ */
+static int s5_scan_indirect(s5fs_t *fs, uint32_t blockno, int levels) {
+  pframe_t *ibp;
+  uint32_t *b, i;
+  int ret = 0;
+
+  if (!blockno || blockno >= fs->s5f_nblocks)
+    return 0;
+  s5_map_clear(fs->s5f_freemap, blockno);
+  if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), blockno, &ibp)))
+    return ret;
+  pframe_pin(ibp);
+  b = (uint32_t *)ibp->pf_addr;
+  for (i = 0; !ret && i < S5_NIDIRECT_BLOCKS; ++i) {
+    if (1 < levels)
+      ret = s5_scan_indirect(fs, b[i], levels - 1);
+    else if (b[i] && b[i] < fs->s5f_nblocks)
+      s5_map_clear(fs->s5f_freemap, b[i]);
+  }
+  pframe_unpin(ibp);
+  return ret;
+}
+
+/*
+ * Build the bitmaps from the inodes rather than the free lists, which are
+ * empty on disk while mounted: an inode is free if its type says so, and
+ * a block is free unless it is metadata or some inode maps it. Called at
+ * mount after a crash, with the maps zeroed. The superblock's lists are
+ * emptied to match.
+ */
+static int s5_scan_freemaps(s5fs_t *fs) {
+  s5_super_t *super = fs->s5f_super;
+  uint32_t first = S5_INODE_BLOCK(super->s5s_num_inodes - 1) + 1;
+  pframe_t *inodep = NULL;
+  s5_inode_t *inode;
+  uint32_t n, i;
+  int ret = 0;
+
+  dbg(DBG_PRINT, "s5fs: not unmounted cleanly, scanning %u inodes\n",
+      super->s5s_num_inodes);
+  for (n = first; n < fs->s5f_nblocks; ++n)
+    s5_map_set(fs->s5f_freemap, n);
+  for (n = 0; n < super->s5s_journal_nblocks; ++n)
+    s5_map_clear(fs->s5f_freemap, super->s5s_journal_start + n);
+  for (n = 0; n < super->s5s_csum_nblocks; ++n)
+    s5_map_clear(fs->s5f_freemap, super->s5s_csum_start + n);
+  if (super->s5s_warm_block && super->s5s_warm_block < fs->s5f_nblocks)
+    s5_map_clear(fs->s5f_freemap, super->s5s_warm_block);
+
+  for (n = 0; !ret && n < super->s5s_num_inodes; ++n) {
+    if (!inodep || inodep->pf_pagenum != S5_INODE_BLOCK(n)) {
+      if (inodep)
+        pframe_unpin(inodep);
+      if ((ret = pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(n), &inodep))) {
+        inodep = NULL;
+        break;
+      }
+      pframe_pin(inodep);
+    }
+    inode = (s5_inode_t *)(inodep->pf_addr) + S5_INODE_OFFSET(n);
+    if (S5_TYPE_FREE == inode->s5_type) {
+      s5_map_set(fs->s5f_inodemap, n);
+      continue;
+    }
+    if (S5_TYPE_DATA != inode->s5_type && S5_TYPE_DIR != inode->s5_type &&
+        S5_TYPE_COMPRESSED != inode->s5_type)
+      continue;
+    for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
+      if (inode->s5_direct_blocks[i] &&
+          inode->s5_direct_blocks[i] < fs->s5f_nblocks)
+        s5_map_clear(fs->s5f_freemap, inode->s5_direct_blocks[i]);
+    }
+    if (!(ret = s5_scan_indirect(fs, inode->s5_indirect_block, 1)))
+      ret = s5_scan_indirect(fs, inode->s5_dindirect_block, 2);
+  }
+  if (inodep)
+    pframe_unpin(inodep);
+
+  for (n = 0; n < fs->s5f_nblocks; ++n)
+    fs->s5f_nfreeblocks += !!s5_map_isset(fs->s5f_freemap, n);
+  for (n = 0; n < super->s5s_num_inodes; ++n)
+    fs->s5f_nfreeinodes += !!s5_map_isset(fs->s5f_inodemap, n);
+
+  lock_s5(fs);
+  super->s5s_nfree = 0;
+  super->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = (uint32_t)-1;
+  super->s5s_free_inode = (uint32_t)-1;
+  s5_dirty_super(fs);
+  unlock_s5(fs);
+  return ret;
+}
+
+/*
+ * Build the free block and inode bitmaps by taking everything off the
+ * superblock's free lists, or, if the last mount ended in a crash, by
+ * scanning the inodes. Called at mount. Returns 0 or -errno.
+ */
+int s5_load_freemaps(s5fs_t *fs) {
+  uint32_t nblocks = fs->s5f_bdev->bd_nblocks;
+  uint32_t ninodes = fs->s5f_super->s5s_num_inodes;
+  int n;
+
+  KASSERT(nblocks);
+  fs->s5f_nblocks = nblocks;
+  fs->s5f_nfreeblocks = 0;
+  fs->s5f_rotor = 0;
+  fs->s5f_nfreeinodes = 0;
+  fs->s5f_irotor = 0;
+  fs->s5f_freemap = kmalloc(S5_MAP_WORDS(nblocks) * sizeof(uint32_t));
+  fs->s5f_inodemap = kmalloc(S5_MAP_WORDS(ninodes) * sizeof(uint32_t));
+  if (!fs->s5f_freemap || !fs->s5f_inodemap) {
+    if (fs->s5f_freemap)
+      kfree(fs->s5f_freemap);
+    if (fs->s5f_inodemap)
+      kfree(fs->s5f_inodemap);
+    return -ENOMEM;
+  }
+  memset(fs->s5f_freemap, 0, S5_MAP_WORDS(nblocks) * sizeof(uint32_t));
+  memset(fs->s5f_inodemap, 0, S5_MAP_WORDS(ninodes) * sizeof(uint32_t));
+
+  if (S5_STATE_MOUNTED == fs->s5f_state) {
+    n = s5_scan_freemaps(fs);
+    goto done;
+  }
+
+  lock_s5(fs);
+  while (0 < (n = s5_super_alloc_block(fs))) {
+    if ((uint32_t)n >= nblocks) {
+      dbg(DBG_S5FS, "free block %d is past the end of the disk\n", n);
+      continue;
+    }
+    s5_map_set(fs->s5f_freemap, n);
+    fs->s5f_nfreeblocks++;
+  }
+  if (-ENOSPC == n) {
+    while (0 <= (n = s5_super_alloc_inode(fs))) {
+      KASSERT((uint32_t)n < ninodes);
+      s5_map_set(fs->s5f_inodemap, n);
+      fs->s5f_nfreeinodes++;
+    }
+  }
+  s5_dirty_super(fs);
+  unlock_s5(fs);
+  n = -ENOSPC == n ? 0 : n;
+
+done:
+  if (n) {
+    kfree(fs->s5f_freemap);
+    kfree(fs->s5f_inodemap);
+    fs->s5f_freemap = fs->s5f_inodemap = NULL;
+    return n;
+  }
+  dbg(DBG_S5FS, "%u of %u blocks and %u of %u inodes free\n",
+      fs->s5f_nfreeblocks, nblocks, fs->s5f_nfreeinodes, ninodes);
+  return 0;
+}
+
+/*
+ * Creates a new inode and initializes its fields.
+ * Uses S5_INODE_BLOCK to get the page from which to create the inode
+ *
+ * Inodes are taken from the bitmap in ascending order from where the
+ * last allocation left off, so inodes created together share inode
+ * blocks and are written back together.
+ *
+ * This function may block.
+ */
+int s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid) {
+  s5fs_t *s5fs = FS_TO_S5FS(fs);
+  pframe_t *inodep;
+  s5_inode_t *inode;
+  int ret;
+
+  KASSERT((S5_TYPE_DATA == type) || (S5_TYPE_DIR == type) ||
+          (S5_TYPE_CHR == type) || (S5_TYPE_BLK == type));
+
+  spin_lock(&s5fs->s5f_map_lock);
+  if (!s5fs->s5f_nfreeinodes) {
+    spin_unlock(&s5fs->s5f_map_lock);
+    return -ENOSPC;
+  }
+  ret = s5_map_find(s5fs->s5f_inodemap, s5fs->s5f_super->s5s_num_inodes,
+                    s5fs->s5f_irotor);
+  s5_map_clear(s5fs->s5f_inodemap, ret);
+  s5fs->s5f_nfreeinodes--;
+  s5fs->s5f_irotor = ret + 1;
+  spin_unlock(&s5fs->s5f_map_lock);
+
+  pframe_get(&s5fs->s5f_bdev->bd_mmobj, S5_INODE_BLOCK(ret), &inodep);
+  KASSERT(inodep);
+  inode = (s5_inode_t *)(inodep->pf_addr) + S5_INODE_OFFSET(ret);
+  KASSERT(inode->s5_number == (uint32_t)ret);
 
   /* init the newly-allocated inode: */
   inode->s5_size = 0;
@@ -355,14 +1108,302 @@ int s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid) {
     inode->s5_indirect_block = devid;
   else
     inode->s5_indirect_block = 0;
+  inode->s5_dindirect_block = 0;
 
   s5_dirty_inode(s5fs, inode);
 
-  unlock_s5(s5fs);
-
   return ret;
 }
 
+/*
+ * Rebuild the superblock's free block and inode lists from the bitmaps,
+ * so that the superblock is accurate on disk, and free the bitmaps.
+ * Called at unmount, once nothing more will be allocated.
+ *
+ * Both lists are built from the top down, so that they hand blocks and
+ * inodes out in ascending order. Consecutive free inodes share an inode
+ * block, so each inode block is looked up and dirtied once.
+ */
+void s5_save_freemaps(s5fs_t *fs) {
+  s5_super_t *super = fs->s5f_super;
+  pframe_t *inodep = NULL;
+  s5_inode_t *inode;
+  uint32_t n;
+
+  lock_s5(fs);
+  for (n = fs->s5f_nblocks; n-- > 0;) {
+    if (s5_map_isset(fs->s5f_freemap, n))
+      s5_super_free_block(fs, n);
+  }
+  for (n = super->s5s_num_inodes; n-- > 0;) {
+    if (!s5_map_isset(fs->s5f_inodemap, n))
+      continue;
+    if (!inodep || inodep->pf_pagenum != S5_INODE_BLOCK(n)) {
+      pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(n), &inodep);
+      KASSERT(inodep);
+      pframe_dirty(inodep);
+    }
+    inode = (s5_inode_t *)(inodep->pf_addr) + S5_INODE_OFFSET(n);
+    KASSERT(S5_TYPE_FREE == inode->s5_type);
+    inode->s5_next_free = super->s5s_free_inode;
+    super->s5s_free_inode = n;
+  }
+  s5_dirty_super(fs);
+  unlock_s5(fs);
+
+  kfree(fs->s5f_freemap);
+  kfree(fs->s5f_inodemap);
+  fs->s5f_freemap = fs->s5f_inodemap = NULL;
+  fs->s5f_nfreeblocks = fs->s5f_nfreeinodes = 0;
+}
+
+/* Most data blocks gathered before the free map is locked to free them */
+#define S5_FREE_BATCH 64
+
+/*
+ * Like s5_free_block for n blocks at once, taking the free map lock only
+ * once.
+ */
+static void s5_free_blocks(s5fs_t *fs, const uint32_t *blocks, uint32_t n) {
+  pframe_t *pf;
+  uint32_t i;
+
+  for (i = 0; i < n; ++i) {
+    KASSERT(!S5_IS_SUPER(blocks[i]) && blocks[i] < fs->s5f_nblocks);
+    pf = pframe_get_resident(S5FS_TO_VMOBJ(fs), blocks[i]);
+    if (pf && !pframe_is_busy(pf))
+      pframe_set_clean(pf);
+    s5_csum_forget(fs, blocks[i]);
+  }
+  spin_lock(&fs->s5f_map_lock);
+  for (i = 0; i < n; ++i) {
+    KASSERT(!s5_map_isset(fs->s5f_freemap, blocks[i]) && "double free");
+    s5_map_set(fs->s5f_freemap, blocks[i]);
+  }
+  fs->s5f_nfreeblocks += n;
+  spin_unlock(&fs->s5f_map_lock);
+}
+
+/*
+ * Frees the indirect block blockno (if it is not 0) along with every
+ * block it maps; levels is 1 for a block of data block numbers and 2 for
+ * a block of indirect block numbers. The data blocks are freed in
+ * batches.
+ */
+static void s5_free_indirect(s5fs_t *fs, uint32_t blockno, int levels) {
+  uint32_t batch[S5_FREE_BATCH];
+  uint32_t n = 0;
+  pframe_t *ibp;
+  uint32_t *b;
+
+  if (!blockno)
+    return;
+  pframe_get(S5FS_TO_VMOBJ(fs), blockno, &ibp);
+  KASSERT(ibp && "because never fails for block_device "
+                 "vm_objects");
+  pframe_pin(ibp);
+
+  b = (uint32_t *)(ibp->pf_addr);
+  for (uint32_t i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+    KASSERT(b[i] != blockno);
+    if (1 < levels) {
+      s5_free_indirect(fs, b[i], levels - 1);
+    } else if (b[i]) {
+      batch[n++] = b[i];
+      if (S5_FREE_BATCH == n) {
+        s5_free_blocks(fs, batch, n);
+        n = 0;
+      }
+    }
+  }
+  s5_free_blocks(fs, batch, n);
+
+  pframe_unpin(ibp);
+  s5_free_block(fs, blockno);
+}
+
+/*
+ * Free the blocks of the data blocks [lo, hi), counted from the first
+ * one mapped through 'slots', a table of nslots block numbers each of
+ * which maps S5_NIDIRECT_BLOCKS^levels data blocks. Sparse slots are
+ * skipped whatever they span, indirect blocks wholly inside the range
+ * go at once with everything they map, and the rest are descended into;
+ * those left empty are freed too. Returns true if the table changed, for
+ * the caller to dirty the page holding it.
+ */
+static int s5_free_slots(s5fs_t *fs, uint32_t *slots, uint32_t nslots,
+                         int levels, uint32_t lo, uint32_t hi) {
+  uint32_t batch[S5_FREE_BATCH];
+  uint32_t span = 1, n = 0, first, i, j;
+  int changed = 0, l;
+  pframe_t *ibp;
+
+  for (l = 0; l < levels; ++l)
+    span *= S5_NIDIRECT_BLOCKS;
+  for (i = lo / span; i < nslots && i * span < hi; ++i) {
+    if (!slots[i])
+      continue;
+    first = i * span;
+    if (lo <= first && first + span <= hi) {
+      if (levels)
+        s5_free_indirect(fs, slots[i], levels);
+      else
+        batch[n++] = slots[i];
+      slots[i] = 0;
+      changed = 1;
+    } else {
+      /* Only the first and last slots can be partly in the range, and
+       * only for an indirect block */
+      KASSERT(levels);
+      pframe_get(S5FS_TO_VMOBJ(fs), slots[i], &ibp);
+      KASSERT(ibp);
+      pframe_pin(ibp);
+      uint32_t *b = (uint32_t *)ibp->pf_addr;
+      if (s5_free_slots(fs, b, S5_NIDIRECT_BLOCKS, levels - 1,
+                        MAX(lo, first) - first, MIN(hi, first + span) - first))
+        pframe_dirty(ibp);
+      for (j = 0; j < S5_NIDIRECT_BLOCKS && !b[j]; ++j)
+        ;
+      pframe_unpin(ibp);
+      if (S5_NIDIRECT_BLOCKS == j) {
+        s5_free_block(fs, slots[i]);
+        slots[i] = 0;
+        changed = 1;
+      }
+    }
+    if (S5_FREE_BATCH == n) {
+      s5_free_blocks(fs, batch, n);
+      n = 0;
+    }
+  }
+  s5_free_blocks(fs, batch, n);
+  return changed;
+}
+
+/*
+ * Zero the bytes [from, to) of the page of a file at pagenum, which all
+ * lie in that page. A page which is neither resident nor has a block is
+ * a hole, and already reads as zeros; in a compressed file, that is
+ * one whose cluster has no first block.
+ */
+static int s5_zero_page(vnode_t *vnode, uint32_t pagenum, size_t from,
+                        size_t to) {
+  uint32_t mapped = pagenum;
+  pframe_t *pf;
+  int status;
+
+  if (from == to)
+    return 0;
+  if (S5_TYPE_COMPRESSED == VNODE_TO_S5INODE(vnode)->s5_type)
+    mapped -= pagenum % S5_CLUSTER_PAGES;
+  if (NULL == pframe_get_resident(&vnode->vn_mmobj, pagenum) &&
+      0 >= (status = s5_seek_to_block(vnode, mapped * S5_BLOCK_SIZE, 0)))
+    return status;
+  if ((status = pframe_get(&vnode->vn_mmobj, pagenum, &pf)))
+    return status;
+  if ((status = pframe_dirty(pf)))
+    return status;
+  memset((char *)pf->pf_addr + from, 0, to - from);
+  return 0;
+}
+
+/*
+ * Make the bytes [start, end) of a file a hole: the pages wholly inside
+ * it leave the page cache and their blocks are freed, and the parts of
+ * the pages at either end which fall inside it are zeroed. The size of
+ * the file is left alone; for truncation the caller passes the old end
+ * of the file, rounded up to a block, as end.
+ *
+ * The caller holds the vnode lock for writing, inside a journal bracket.
+ * Returns 0 or -errno.
+ */
+int s5_punch_hole(vnode_t *vnode, off_t start, off_t end) {
+  s5fs_t *fs = VNODE_TO_S5FS(vnode);
+  s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  uint32_t lo = S5_DATA_BLOCK(start + S5_BLOCK_SIZE - 1);
+  uint32_t hi = MIN((uint32_t)S5_DATA_BLOCK(end), S5_MAX_FILE_BLOCKS);
+  uint32_t clo, chi, p;
+  int status;
+
+  KASSERT(krwlock_write_held(&vnode->vn_lock));
+  KASSERT(0 <= start && start <= end);
+  if (S5_TYPE_INLINE == inode->s5_type) {
+    /* No blocks; zero the bytes in the inode, and in the first page if
+     * that is resident and will be written back over them */
+    if ((uint32_t)start >= S5_INLINE_MAX)
+      return 0;
+    memset((char *)inode->s5_direct_blocks + start, 0,
+           MIN((uint32_t)end, S5_INLINE_MAX) - start);
+    s5_dirty_inode(fs, inode);
+    return s5_zero_page(vnode, 0, start, MIN(end, S5_BLOCK_SIZE));
+  }
+  if (lo > hi) { /* Within a single page */
+    return s5_zero_page(vnode, S5_DATA_BLOCK(start), S5_DATA_OFFSET(start),
+                        S5_DATA_OFFSET(end));
+  }
+  if ((status = s5_zero_page(vnode, S5_DATA_BLOCK(start),
+                             S5_DATA_OFFSET(start),
+                             S5_DATA_OFFSET(start) ? S5_BLOCK_SIZE : 0)) ||
+      (status = s5_zero_page(vnode, S5_DATA_BLOCK(end), 0,
+                             S5_DATA_OFFSET(end))))
+    return status;
+  if (S5_TYPE_COMPRESSED == inode->s5_type) {
+    /* Only whole clusters can be freed, so the pages of the clusters at
+     * either end are zeroed instead, to be written back; everything
+     * past the end of the file is as good as zero already */
+    clo = lo + (S5_CLUSTER_PAGES - lo % S5_CLUSTER_PAGES) % S5_CLUSTER_PAGES;
+    chi = hi - hi % S5_CLUSTER_PAGES;
+    if ((uint32_t)end >= (uint32_t)vnode->vn_len)
+      chi = hi + (S5_CLUSTER_PAGES - hi % S5_CLUSTER_PAGES) % S5_CLUSTER_PAGES;
+    for (p = lo; p < MIN(clo, hi); ++p) {
+      if ((status = s5_zero_page(vnode, p, 0, S5_BLOCK_SIZE)))
+        return status;
+    }
+    for (p = MAX(chi, clo); p < hi; ++p) {
+      if ((status = s5_zero_page(vnode, p, 0, S5_BLOCK_SIZE)))
+        return status;
+    }
+    lo = clo;
+    hi = MAX(clo, chi);
+  }
+  if (lo == hi)
+    return 0;
+
+  /* The pages go first, so that none is written back to a freed block */
+  vnode_drop_pages(vnode, lo, hi);
+  s5_free_range(vnode, lo, hi);
+  return 0;
+}
+
+/*
+ * Free the blocks of the pages [lo, hi) of a file, and the indirect
+ * blocks left empty, leaving its page cache alone. The caller holds the
+ * vnode lock for writing, inside a journal bracket.
+ */
+void s5_free_range(vnode_t *vnode, uint32_t lo, uint32_t hi) {
+  s5fs_t *fs = VNODE_TO_S5FS(vnode);
+  s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  uint32_t base;
+  int changed;
+
+  KASSERT(krwlock_write_held(&vnode->vn_lock));
+  hi = MIN(hi, S5_MAX_FILE_BLOCKS);
+  if (lo >= hi)
+    return;
+  changed = s5_free_slots(fs, inode->s5_direct_blocks, S5_NDIRECT_BLOCKS, 0,
+                          lo, hi);
+  base = S5_NDIRECT_BLOCKS;
+  if (hi > base)
+    changed |= s5_free_slots(fs, &inode->s5_indirect_block, 1, 1,
+                             MAX(lo, base) - base, hi - base);
+  base += S5_NIDIRECT_BLOCKS;
+  if (hi > base)
+    changed |= s5_free_slots(fs, &inode->s5_dindirect_block, 1, 2,
+                             MAX(lo, base) - base, hi - base);
+  if (changed)
+    s5_dirty_inode(fs, inode);
+}
+
 /*
  * Free an inode by freeing its disk blocks and putting it back on the
  * inode free list.
@@ -370,63 +1411,286 @@ int s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid) {
  * You should also reset the inode to an unused state (eg. zero-ing its
  * list of blocks and setting its type to S5_FREE_TYPE).
  *
- * Don't forget to free the indirect block if it exists.
+ * Don't forget to free the indirect blocks if they exist.
  *
  * You probably want to use s5_free_block().
  */
 void s5_free_inode(vnode_t *vnode) {
-  KASSERT(curthr == vnode->vn_mutex.km_holder);
+  KASSERT(krwlock_write_held(&vnode->vn_lock));
   uint32_t i;
   s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
   s5fs_t *fs = VNODE_TO_S5FS(vnode);
 
   KASSERT((S5_TYPE_DATA == inode->s5_type) || (S5_TYPE_DIR == inode->s5_type) ||
-          (S5_TYPE_CHR == inode->s5_type) || (S5_TYPE_BLK == inode->s5_type));
+          (S5_TYPE_CHR == inode->s5_type) || (S5_TYPE_BLK == inode->s5_type) ||
+          (S5_TYPE_INLINE == inode->s5_type) ||
+          (S5_TYPE_COMPRESSED == inode->s5_type));
+
+  /* an inline file's data is not block numbers */
+  if (S5_TYPE_INLINE == inode->s5_type)
+    memset(inode->s5_direct_blocks, 0, S5_INLINE_MAX);
 
   /* free any direct blocks */
   for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
     if (inode->s5_direct_blocks[i]) {
       dprintf("freeing block %d\n", inode->s5_direct_blocks[i]);
       s5_free_block(fs, inode->s5_direct_blocks[i]);
-
-      s5_dirty_inode(fs, inode);
       inode->s5_direct_blocks[i] = 0;
     }
   }
 
-  if (((S5_TYPE_DATA == inode->s5_type) || (S5_TYPE_DIR == inode->s5_type)) &&
-      inode->s5_indirect_block) {
-    pframe_t *ibp;
-    uint32_t *b;
+  if ((S5_TYPE_DATA == inode->s5_type) || (S5_TYPE_DIR == inode->s5_type) ||
+      (S5_TYPE_COMPRESSED == inode->s5_type)) {
+    s5_free_indirect(fs, inode->s5_indirect_block, 1);
+    s5_free_indirect(fs, inode->s5_dindirect_block, 2);
+  }
+
+  inode->s5_indirect_block = 0;
+  inode->s5_dindirect_block = 0;
+  inode->s5_type = S5_TYPE_FREE;
+  s5_dirty_inode(fs, inode);
+
+  spin_lock(&fs->s5f_map_lock);
+  s5_map_set(fs->s5f_inodemap, inode->s5_number);
+  fs->s5f_nfreeinodes++;
+  spin_unlock(&fs->s5f_map_lock);
+}
+
+/*
+ * Directory entries are kept contiguous, so a directory of vn_len bytes
+ * has entries in slots [0, vn_len / sizeof(s5_dirent_t)). Directories with
+ * at least S5_DINDEX_MIN entries get an in-core hash index from name to
+ * slot the first time they are searched, which is then kept up to date by
+ * s5_link and s5_remove_dirent until the vnode goes away. Nothing about it
+ * is stored on disk.
+ */
+typedef struct s5_dindex {
+  uint32_t di_nbuckets; /* a power of two */
+  uint32_t di_cap;      /* slots di_hash and di_next have room for */
+  int32_t *di_buckets;  /* first slot in each bucket, or -1 */
+  uint32_t *di_hash;    /* name hash of each slot */
+  int32_t *di_next;     /* next slot in the same bucket, or -1 */
+} s5_dindex_t;
+
+/* vn_dindex while a reader is building the index */
+#define S5_DINDEX_BUILDING ((void *)1)
+
+#define S5_DIR_NSLOTS(vn) ((uint32_t)(vn)->vn_len / sizeof(s5_dirent_t))
+
+static s5_dindex_t *s5_dindex(vnode_t *vnode) {
+  return S5_DINDEX_BUILDING == vnode->vn_dindex
+             ? NULL
+             : (s5_dindex_t *)vnode->vn_dindex;
+}
+
+static uint32_t s5_name_hash(const char *name, size_t namelen) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < namelen && name[i]; ++i)
+    h = (h ^ (unsigned char)name[i]) * 16777619U;
+  return h;
+}
+
+#define S5_DINDEX_BUCKET(di, h) ((h) & ((di)->di_nbuckets - 1))
+
+static void s5_dindex_insert(s5_dindex_t *di, uint32_t slot, uint32_t hash) {
+  uint32_t b = S5_DINDEX_BUCKET(di, hash);
+  di->di_hash[slot] = hash;
+  di->di_next[slot] = di->di_buckets[b];
+  di->di_buckets[b] = slot;
+}
+
+static void s5_dindex_unlink(s5_dindex_t *di, uint32_t slot) {
+  int32_t *pp = &di->di_buckets[S5_DINDEX_BUCKET(di, di->di_hash[slot])];
+  while ((uint32_t)*pp != slot) {
+    KASSERT(-1 != *pp);
+    pp = &di->di_next[*pp];
+  }
+  *pp = di->di_next[slot];
+}
+
+/*
+ * Make room for nslots slots, growing the arrays and rehashing the
+ * first nused slots as needed. On failure the index is unchanged.
+ */
+static int s5_dindex_reserve(s5_dindex_t *di, uint32_t nslots,
+                             uint32_t nused) {
+  uint32_t cap = di->di_cap, nbuckets = di->di_nbuckets, i;
+  int32_t *buckets, *next;
+  uint32_t *hash;
+
+  if (di->di_hash && nslots <= cap && nslots <= 2 * nbuckets)
+    return 0;
+  while (cap < nslots)
+    cap *= 2;
+  while (2 * nbuckets < cap)
+    nbuckets *= 2;
+
+  buckets = kmalloc(nbuckets * sizeof(int32_t));
+  hash = kmalloc(cap * sizeof(uint32_t));
+  next = kmalloc(cap * sizeof(int32_t));
+  if (!buckets || !hash || !next) {
+    if (buckets)
+      kfree(buckets);
+    if (hash)
+      kfree(hash);
+    if (next)
+      kfree(next);
+    return -ENOMEM;
+  }
+  if (di->di_hash) {
+    memcpy(hash, di->di_hash, nused * sizeof(uint32_t));
+    kfree(di->di_buckets);
+    kfree(di->di_hash);
+    kfree(di->di_next);
+  }
+  di->di_buckets = buckets;
+  di->di_hash = hash;
+  di->di_next = next;
+  di->di_cap = cap;
+  di->di_nbuckets = nbuckets;
+  for (i = 0; i < nbuckets; ++i)
+    buckets[i] = -1;
+  for (i = 0; i < nused; ++i)
+    s5_dindex_insert(di, i, hash[i]);
+  return 0;
+}
+
+/*
+ * Get the page holding the given directory slot, and a pointer to the
+ * slot's entry within it.
+ */
+static int s5_dirent_slot(vnode_t *vnode, uint32_t slot, s5_dirent_t **d) {
+  pframe_t *pf;
+  int status = pframe_get(&vnode->vn_mmobj, slot / S5_DIRENTS_PER_BLOCK, &pf);
+  if (status)
+    return status;
+  *d = (s5_dirent_t *)pf->pf_addr + slot % S5_DIRENTS_PER_BLOCK;
+  return 0;
+}
 
-    pframe_get(S5FS_TO_VMOBJ(fs), (unsigned)inode->s5_indirect_block, &ibp);
-    KASSERT(ibp && "because never fails for block_device "
-                   "vm_objects");
-    pframe_pin(ibp);
+/*
+ * Build the index for a directory. Readers share the vnode lock, so one
+ * builds it while the others keep searching linearly; writers can't get
+ * in until it is done.
+ */
+static void s5_dindex_build(vnode_t *vnode) {
+  uint32_t nslots = S5_DIR_NSLOTS(vnode), slot, i;
+  s5_dindex_t *di;
 
-    b = (uint32_t *)(ibp->pf_addr);
-    for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
-      KASSERT(b[i] != inode->s5_indirect_block);
-      if (b[i])
-        s5_free_block(fs, b[i]);
+  KASSERT(NULL == vnode->vn_dindex);
+  vnode->vn_dindex = S5_DINDEX_BUILDING;
+  if (NULL == (di = kmalloc(sizeof(s5_dindex_t))))
+    goto fail;
+  memset(di, 0, sizeof(s5_dindex_t));
+  di->di_cap = di->di_nbuckets = S5_DIRENTS_PER_BLOCK;
+  if (s5_dindex_reserve(di, nslots, 0)) {
+    kfree(di);
+    goto fail;
+  }
+  for (slot = 0; slot < nslots; slot += S5_DIRENTS_PER_BLOCK) {
+    s5_dirent_t *d;
+    if (s5_dirent_slot(vnode, slot, &d)) {
+      vnode->vn_dindex = di;
+      s5_dindex_destroy(vnode);
+      return;
     }
+    for (i = 0; i < S5_DIRENTS_PER_BLOCK && slot + i < nslots; ++i)
+      s5_dindex_insert(di, slot + i, s5_name_hash(d[i].s5d_name, S5_NAME_LEN));
+  }
+  dbg(DBG_S5FS, "vno: %d indexed %d entries\n", vnode->vn_vno, nslots);
+  vnode->vn_dindex = di;
+  return;
+fail:
+  vnode->vn_dindex = NULL;
+}
 
-    pframe_unpin(ibp);
+/*
+ * Free a directory's index, if it has one.
+ */
+void s5_dindex_destroy(vnode_t *vnode) {
+  s5_dindex_t *di = s5_dindex(vnode);
+  if (di) {
+    kfree(di->di_buckets);
+    kfree(di->di_hash);
+    kfree(di->di_next);
+    kfree(di);
+    vnode->vn_dindex = NULL;
+  }
+}
 
-    s5_free_block(fs, inode->s5_indirect_block);
+/*
+ * Find the slot of the entry with the given name, using the index if
+ * there is one and scanning the directory a block at a time otherwise.
+ * Returns the slot or -errno; on success *dirent is a copy of the entry.
+ */
+static int s5_find_slot(vnode_t *vnode, const char *name, size_t namelen,
+                        s5_dirent_t *dirent) {
+  uint32_t nslots = S5_DIR_NSLOTS(vnode), slot, i;
+  s5_dindex_t *di;
+  s5_dirent_t *d;
+  int status;
+
+  if (NULL == vnode->vn_dindex && nslots >= S5_DINDEX_MIN)
+    s5_dindex_build(vnode);
+
+  if (NULL != (di = s5_dindex(vnode))) {
+    uint32_t h = s5_name_hash(name, namelen);
+    int32_t s;
+    for (s = di->di_buckets[S5_DINDEX_BUCKET(di, h)]; -1 != s;
+         s = di->di_next[s]) {
+      if (di->di_hash[s] != h)
+        continue;
+      if ((status = s5_dirent_slot(vnode, s, &d)))
+        return status;
+      if (name_match(d->s5d_name, name, namelen)) {
+        *dirent = *d;
+        return s;
+      }
+    }
+    return -ENOENT;
   }
 
-  inode->s5_indirect_block = 0;
-  inode->s5_type = S5_TYPE_FREE;
-  s5_dirty_inode(fs, inode);
+  for (slot = 0; slot < nslots; slot += S5_DIRENTS_PER_BLOCK) {
+    if ((status = s5_dirent_slot(vnode, slot, &d)))
+      return status;
+    for (i = 0; i < S5_DIRENTS_PER_BLOCK && slot + i < nslots; ++i) {
+      if (name_match(d[i].s5d_name, name, namelen)) {
+        *dirent = d[i];
+        return slot + i;
+      }
+    }
+  }
+  return -ENOENT;
+}
 
-  lock_s5(fs);
-  inode->s5_next_free = fs->s5f_super->s5s_free_inode;
-  fs->s5f_super->s5s_free_inode = inode->s5_number;
-  unlock_s5(fs);
+/*
+ * Read up to n directory entries starting at the given byte offset into
+ * d, scanning each directory block in place in the page cache. Returns
+ * the number of entries read, or -errno if none could be.
+ */
+int s5_read_dirents(vnode_t *vnode, off_t offset, struct dirent *d, int n) {
+  KASSERT(krwlock_locked(&vnode->vn_lock));
+  KASSERT(0 == offset % sizeof(s5_dirent_t));
+  uint32_t nslots = S5_DIR_NSLOTS(vnode);
+  uint32_t slot = offset / sizeof(s5_dirent_t);
+  s5_dirent_t *sd;
+  int nread = 0, status;
 
-  s5_dirty_inode(fs, inode);
-  s5_dirty_super(fs);
+  while (nread < n && slot < nslots) {
+    if ((status = s5_dirent_slot(vnode, slot, &sd)))
+      return nread ? nread : status;
+    do {
+      d[nread].d_ino = sd->s5d_inode;
+      d[nread].d_off = 0;
+      strncpy(d[nread].d_name, sd->s5d_name, S5_NAME_LEN);
+      d[nread].d_name[S5_NAME_LEN] = '\0';
+      ++nread;
+      ++sd;
+      ++slot;
+    } while (nread < n && slot < nslots && slot % S5_DIRENTS_PER_BLOCK);
+  }
+  return nread;
 }
 
 /*
@@ -434,27 +1698,18 @@ void s5_free_inode(vnode_t *vnode) {
  * and return its inode number. If there is no entry with the given
  * name, return -ENOENT.
  *
- * You'll probably want to use s5_read_file and name_match
- *
- * You can either read one dirent at a time or optimize and read more.
- * Either is fine.
+ * Large directories are searched through their index; see s5_dindex_t.
  */
 int s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen) {
   dbg(DBG_S5FS, "\n");
-  KASSERT(curthr == vnode->vn_mutex.km_holder);
+  KASSERT(krwlock_locked(&vnode->vn_lock));
   KASSERT(name);
   KASSERT(namelen);
-  size_t seek = 0;
   s5_dirent_t dirent;
-  int nread = s5_read_file(vnode, seek, (char *)&dirent, sizeof(s5_dirent_t));
-  while (nread) {
-    KASSERT(nread == sizeof(s5_dirent_t));
-    seek += nread;
-    if (name_match(dirent.s5d_name, name, namelen))
-      return dirent.s5d_inode;
-    nread = s5_read_file(vnode, seek, (char *)&dirent, sizeof(s5_dirent_t));
-  }
-  return -ENOENT;
+  int slot = s5_find_slot(vnode, name, namelen, &dirent);
+  if (slot < 0)
+    return slot;
+  return dirent.s5d_inode;
 }
 
 /*
@@ -479,37 +1734,41 @@ int s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen) {
  */
 int s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen) {
   dbg(DBG_S5FS, "\n");
-  KASSERT(curthr == vnode->vn_mutex.km_holder);
-  size_t fpos = 0; // Position in file
-  s5_dirent_t dirent;
-  s5_dirent_t last_dirent; // Remember last non-zero dirent
-  int nread = s5_read_file(vnode, fpos, (char *)&dirent, sizeof(s5_dirent_t));
-  size_t found_pos = -1; // Position of found directory entry
-  // Find matching directory entry
-  while (nread && dirent.s5d_name[0]) {
-    KASSERT(nread == sizeof(s5_dirent_t));
-    if (name_match(dirent.s5d_name, name, namelen)) {
-      found_pos = fpos;
-      vnode_t *vn = vget(vnode->vn_fs, dirent.s5d_inode);
-      s5_dirty_inode(VNODE_TO_S5FS(vn), VNODE_TO_S5INODE(vn));
-      --VNODE_TO_S5INODE(vn)->s5_linkcount;
-      vput(vn);
-    }
-    fpos += nread;
-    last_dirent = dirent;
-    nread = s5_read_file(vnode, fpos, (char *)&dirent, sizeof(s5_dirent_t));
-  }
-  if (found_pos == -1)
-    return -ENOENT;
+  KASSERT(krwlock_write_held(&vnode->vn_lock));
+  s5_dirent_t dirent, last_dirent;
+  int found = s5_find_slot(vnode, name, namelen, &dirent);
+  if (found < 0)
+    return found;
+  uint32_t last = S5_DIR_NSLOTS(vnode) - 1;
+
+  vnode_t *vn = vget(vnode->vn_fs, dirent.s5d_inode);
+  s5_dirty_inode(VNODE_TO_S5FS(vn), VNODE_TO_S5INODE(vn));
+  --VNODE_TO_S5INODE(vn)->s5_linkcount;
+  vput(vn);
+
   // Replace found entry with last entry
-  int nwrite = s5_write_file(vnode, found_pos, (char *)&last_dirent, 
-      sizeof(s5_dirent_t));
+  int nread = s5_read_file(vnode, last * sizeof(s5_dirent_t),
+                           (char *)&last_dirent, sizeof(s5_dirent_t));
+  KASSERT(nread == sizeof(s5_dirent_t));
+  int nwrite = s5_write_file(vnode, found * sizeof(s5_dirent_t),
+                             (char *)&last_dirent, sizeof(s5_dirent_t));
   KASSERT(nwrite == sizeof(s5_dirent_t));
   // Zero out last entry
   memset((void *)&dirent, 0, sizeof(s5_dirent_t));
-  nwrite = s5_write_file(vnode, fpos - sizeof(s5_dirent_t), (char *)&dirent, 
-      sizeof(s5_dirent_t));
+  nwrite = s5_write_file(vnode, last * sizeof(s5_dirent_t), (char *)&dirent,
+                         sizeof(s5_dirent_t));
   KASSERT(nwrite == sizeof(s5_dirent_t));
+
+  s5_dindex_t *di = s5_dindex(vnode);
+  if (di) {
+    uint32_t h = di->di_hash[last];
+    s5_dindex_unlink(di, found);
+    if ((uint32_t)found != last) {
+      s5_dindex_unlink(di, last);
+      s5_dindex_insert(di, found, h);
+    }
+  }
+
   // Decrease file size
   s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
   KASSERT(inode->s5_size >= sizeof(s5_dirent_t));
@@ -529,29 +1788,35 @@ int s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen) {
  *
  * Remember to increment the ref counts appropriately
  *
- * You probably want to use s5_find_dirent(), s5_write_file(), and
- *s5_dirty_inode().
+ * Entries are contiguous, so the new one simply goes at the end of the
+ * directory.
  */
 int s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen) {
   dbg(DBG_S5FS, "%.*s\n", namelen, name);
-  KASSERT(curthr == parent->vn_mutex.km_holder);
-  KASSERT(curthr == child->vn_mutex.km_holder);
-  size_t fpos = 0; // Position in file
+  KASSERT(krwlock_write_held(&parent->vn_lock));
+  KASSERT(krwlock_write_held(&child->vn_lock));
+  /* the name must fit with its null terminator */
+  if (namelen >= S5_NAME_LEN)
+    return -ENAMETOOLONG;
+  uint32_t slot = S5_DIR_NSLOTS(parent);
+  s5_dindex_t *di = s5_dindex(parent);
   s5_dirent_t dirent;
-  int nread = s5_read_file(parent, fpos, (char *)&dirent, sizeof(s5_dirent_t));
-  // Find last directory entry
-  while (nread && dirent.s5d_name[0]) {
-    KASSERT(nread == sizeof(s5_dirent_t));
-    fpos += nread;
-    nread = s5_read_file(parent, fpos, (char *)&dirent, sizeof(s5_dirent_t));
+
+  /* if the index can't grow, drop it rather than let it go stale */
+  if (di && s5_dindex_reserve(di, slot + 1, slot)) {
+    s5_dindex_destroy(parent);
+    di = NULL;
   }
   // Add new entry at end
+  memset(&dirent, 0, sizeof(s5_dirent_t));
   strncpy(dirent.s5d_name, name, namelen); // Copy name
-  dirent.s5d_name[namelen] = '\0';
   dirent.s5d_inode = child->vn_vno; // Copy inode number
-  int nwrite = s5_write_file(parent, fpos, (char *)&dirent, 
-      sizeof(s5_dirent_t));
-  KASSERT(nwrite == sizeof(s5_dirent_t));
+  int nwrite = s5_write_file(parent, slot * sizeof(s5_dirent_t),
+                             (char *)&dirent, sizeof(s5_dirent_t));
+  if (nwrite != sizeof(s5_dirent_t))
+    return nwrite < 0 ? nwrite : -ENOSPC;
+  if (di)
+    s5_dindex_insert(di, slot, s5_name_hash(name, namelen));
   // Increment refcount
   if (parent != child) { // Increment if not a self link
     s5_dirty_inode(VNODE_TO_S5FS(child), VNODE_TO_S5INODE(child));
@@ -560,6 +1825,36 @@ int s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen) {
   return 0;
 }
 
+/*
+ * Counts the indirect block blockno (if it is not 0) and every block it
+ * maps, as in s5_free_indirect().
+ */
+static int s5_indirect_blocks(s5fs_t *fs, uint32_t blockno, int levels) {
+  pframe_t *pframe;
+  int blocks = 1;
+
+  if (!blockno)
+    return 0;
+  int status = pframe_get(S5FS_TO_VMOBJ(fs), blockno, &pframe);
+  if (status) {
+    dbg(DBG_S5FS, "pframe_get returned %d\n", status);
+    return status;
+  }
+  pframe_pin(pframe);
+  uint32_t *b = (uint32_t *)pframe->pf_addr;
+  for (uint32_t i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+    if (1 < levels) {
+      if (0 > (status = s5_indirect_blocks(fs, b[i], levels - 1)))
+        break;
+      blocks += status;
+    } else if (b[i]) {
+      ++blocks;
+    }
+  }
+  pframe_unpin(pframe);
+  return 0 > status ? status : blocks;
+}
+
 /*
  * Return the number of blocks that this inode has allocated on disk.
  * This should include the indirect block, but not include sparse
@@ -571,28 +1866,29 @@ int s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen) {
  */
 int s5_inode_blocks(vnode_t *vnode) {
   dbg(DBG_S5FS, "\n");
-  KASSERT(curthr == vnode->vn_mutex.km_holder);
+  KASSERT(krwlock_locked(&vnode->vn_lock));
   int blocks = 0;
   // Get inode
   s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+  if (S5_TYPE_INLINE == inode->s5_type)
+    return 0;
   // Look in the inode
   for (int i = 0; i < S5_NDIRECT_BLOCKS; ++i) { 
     if (inode->s5_direct_blocks[i])
       ++blocks;
   }
-  // Look in the indirect block
-  if (inode->s5_indirect_block) {
-    for (uint32_t i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
-      pframe_t *pframe;
-      int status = pframe_get(S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode)), 
-          inode->s5_indirect_block, &pframe);
-      if (status) {
-        dbg(DBG_S5FS, "pframe_get returned %d\n", status);
-        return status;
-      }
-      if (((uint32_t *)pframe->pf_addr)[i])
-        ++blocks;
-    }
-  }
+  // Look in the indirect blocks; device files keep their devid there
+  if ((S5_TYPE_DATA != inode->s5_type) && (S5_TYPE_DIR != inode->s5_type) &&
+      (S5_TYPE_COMPRESSED != inode->s5_type))
+    return blocks;
+  int status;
+  if (0 > (status = s5_indirect_blocks(VNODE_TO_S5FS(vnode),
+                                       inode->s5_indirect_block, 1)))
+    return status;
+  blocks += status;
+  if (0 > (status = s5_indirect_blocks(VNODE_TO_S5FS(vnode),
+                                       inode->s5_dindirect_block, 2)))
+    return status;
+  blocks += status;
   return blocks;
 }
@@ -0,0 +1,231 @@
+/*
+ *   FILE: s5fs_warm.c
+ *  DESCR: S5 page cache warming across a clean unmount (see s5fs_warm.h)
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "fs/stat.h"
+#include "fs/vnode.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_csum.h"
+#include "fs/s5fs/s5fs_warm.h"
+
+static void *s5_warm_run(int arg1, void *arg2);
+
+/* A page being written down, and the block it is in */
+typedef struct s5_warm_entry {
+  s5_warm_page_t we_page;
+  uint32_t we_block;
+} s5_warm_entry_t;
+
+typedef struct s5_warm_list {
+  s5_warm_entry_t *wl_entries;
+  uint32_t wl_count;
+} s5_warm_list_t;
+
+static void s5_warm_add(s5_warm_list_t *wl, uint32_t ino, uint32_t pagenum,
+                        uint32_t block) {
+  s5_warm_entry_t *e;
+
+  if (wl->wl_count == S5_WARM_MAX_PAGES)
+    return;
+  e = &wl->wl_entries[wl->wl_count++];
+  e->we_page.swp_ino = ino;
+  e->we_page.swp_pagenum = pagenum;
+  e->we_block = block;
+}
+
+/* Called with the vnode list locked: the block is looked up later */
+static void s5_warm_add_vnode_page(pframe_t *pf, void *arg) {
+  if (pf->pf_flags & PF_ACTIVE)
+    s5_warm_add(arg, CONTAINER_OF(pf->pf_obj, vnode_t, vn_mmobj)->vn_vno,
+                pf->pf_pagenum, 0);
+}
+
+/* Blocks which are read at mount anyway, or whose pages are not cache */
+static int s5_warm_skip_meta(s5fs_t *fs, uint32_t blockno) {
+  s5_super_t *super = fs->s5f_super;
+
+  return S5_IS_SUPER(blockno) || blockno == super->s5s_warm_block ||
+         blockno - super->s5s_journal_start < super->s5s_journal_nblocks ||
+         s5_csum_is_table(fs, blockno);
+}
+
+/*
+ * Finds the block each file page is in, dropping those in none, and
+ * sorts the entries by block. Returns how many are left.
+ */
+static uint32_t s5_warm_place(s5fs_t *fs, s5_warm_list_t *wl) {
+  s5_warm_entry_t *e = wl->wl_entries, tmp;
+  uint32_t n = 0, i, k;
+  vnode_t *vn;
+  int block;
+
+  for (i = 0; i < wl->wl_count; ++i) {
+    if (S5_WARM_META != e[i].we_page.swp_ino) {
+      vn = vget(fs->s5f_fs, e[i].we_page.swp_ino);
+      block = 0;
+      if (S_ISREG(vn->vn_mode) || S_ISDIR(vn->vn_mode)) {
+        krwlock_read_lock(&vn->vn_lock);
+        block = s5_seek_to_block(
+            vn, (off_t)e[i].we_page.swp_pagenum * S5_BLOCK_SIZE, 0);
+        krwlock_read_unlock(&vn->vn_lock);
+      }
+      vput(vn);
+      if (0 >= block)
+        continue;
+      e[i].we_block = block;
+    }
+    tmp = e[i];
+    for (k = n++; k > 0 && e[k - 1].we_block > tmp.we_block; --k)
+      e[k] = e[k - 1];
+    e[k] = tmp;
+  }
+  return n;
+}
+
+int s5_warm_record(s5fs_t *fs) {
+  s5_super_t *super = fs->s5f_super;
+  s5_warm_list_t wl;
+  s5_warm_t *w;
+  s5_jhandle_t h;
+  pframe_t *pf;
+  uint32_t blockno, i;
+  int ret = 0;
+
+  if (!S5_WARM)
+    return 0;
+  if (NULL == (wl.wl_entries = kmalloc(S5_WARM_MAX_PAGES *
+                                       sizeof(s5_warm_entry_t))))
+    return -ENOMEM;
+  wl.wl_count = 0;
+  vnode_foreach_respage(fs->s5f_fs, s5_warm_add_vnode_page, &wl);
+  list_iterate_begin(&S5FS_TO_VMOBJ(fs)->mmo_respages, pf, pframe_t,
+                     pf_olink) {
+    if ((pf->pf_flags & PF_ACTIVE) && !s5_warm_skip_meta(fs, pf->pf_pagenum))
+      s5_warm_add(&wl, S5_WARM_META, pf->pf_pagenum, pf->pf_pagenum);
+  }
+  list_iterate_end();
+  wl.wl_count = s5_warm_place(fs, &wl);
+
+  /* with nothing to write down, an old list need only be emptied */
+  if (!(blockno = super->s5s_warm_block) && wl.wl_count) {
+    if (0 > (ret = s5_alloc_run(fs, 0, 1)))
+      goto out;
+    blockno = ret;
+    ret = 0;
+  }
+  if (!blockno)
+    goto out;
+
+  s5_journal_begin(fs, &h);
+  if (!(ret = pframe_get(S5FS_TO_VMOBJ(fs), blockno, &pf))) {
+    w = (s5_warm_t *)pf->pf_addr;
+    memset(w, 0, S5_BLOCK_SIZE);
+    w->sw_count = wl.wl_count;
+    for (i = 0; i < wl.wl_count; ++i)
+      w->sw_pages[i] = wl.wl_entries[i].we_page;
+    pframe_dirty(pf);
+  }
+  if (!ret && super->s5s_warm_block != blockno) {
+    super->s5s_warm_block = blockno;
+    if (!(ret = pframe_get(S5FS_TO_VMOBJ(fs), S5_SUPER_BLOCK, &pf)))
+      pframe_dirty(pf);
+  }
+  s5_journal_end(fs, &h);
+  dbg(DBG_S5FS, "wrote down %u hot pages of %s in block %u\n", wl.wl_count,
+      fs->s5f_fs->fs_dev, blockno);
+out:
+  kfree(wl.wl_entries);
+  return ret;
+}
+
+void s5_warm_start(s5fs_t *fs, int trusted) {
+  proc_t *p;
+
+  fs->s5f_warm_stopping = 0;
+  fs->s5f_warm_thr = NULL;
+  sched_queue_init(&fs->s5f_warmq);
+  if (!S5_WARM || !trusted || !fs->s5f_super->s5s_warm_block ||
+      fs->s5f_super->s5s_warm_block >= fs->s5f_nblocks)
+    return;
+
+  p = proc_create("s5warm");
+  KASSERT(NULL != p);
+  fs->s5f_warm_thr = kthread_create(p, s5_warm_run, 0, fs);
+  KASSERT(NULL != fs->s5f_warm_thr);
+  sched_make_runnable(fs->s5f_warm_thr);
+}
+
+void s5_warm_stop(s5fs_t *fs) {
+  fs->s5f_warm_stopping = 1;
+  while (fs->s5f_warm_thr)
+    sched_sleep_on(&fs->s5f_warmq);
+}
+
+/*
+ * Reads in the pages on the list, in its order, which is that of their
+ * blocks. Runs of pages of the same file are read with s5_prefetch, which
+ * passes over those already resident. arg2 is the file system; arg1 is
+ * unused.
+ */
+static void *s5_warm_run(int arg1, void *arg2) {
+  s5fs_t *fs = arg2;
+  s5_warm_t *w = page_alloc();
+  s5_warm_page_t *sp;
+  uint32_t n = 0, i, next;
+  pframe_t *pf;
+  vnode_t *vn;
+
+  if (w && !pframe_get(S5FS_TO_VMOBJ(fs), fs->s5f_super->s5s_warm_block,
+                       &pf)) {
+    memcpy(w, pf->pf_addr, S5_BLOCK_SIZE);
+    n = MIN(w->sw_count, S5_WARM_MAX_PAGES);
+  }
+  for (i = 0; i < n && !fs->s5f_warm_stopping; i = next) {
+    sp = &w->sw_pages[i];
+    next = i + 1;
+    if (S5_WARM_META == sp->swp_ino) {
+      if (sp->swp_pagenum < fs->s5f_nblocks)
+        pframe_get(S5FS_TO_VMOBJ(fs), sp->swp_pagenum, &pf);
+      continue;
+    }
+    while (next < n && w->sw_pages[next].swp_ino == sp->swp_ino &&
+           w->sw_pages[next].swp_pagenum == sp->swp_pagenum + (next - i))
+      next++;
+    if (sp->swp_ino >= fs->s5f_super->s5s_num_inodes ||
+        !s5_inode_in_use(fs, sp->swp_ino))
+      continue;
+    vn = vget(fs->s5f_fs, sp->swp_ino);
+    if (S_ISREG(vn->vn_mode) || S_ISDIR(vn->vn_mode)) {
+      krwlock_read_lock(&vn->vn_lock);
+      s5_prefetch(vn, sp->swp_pagenum, next - i);
+      krwlock_read_unlock(&vn->vn_lock);
+    }
+    vput(vn);
+  }
+  dbg(DBG_S5FS, "warmed %u of %u pages of %s\n", i, n, fs->s5f_fs->fs_dev);
+  if (w)
+    page_free(w);
+  fs->s5f_warm_thr = NULL;
+  sched_broadcast_on(&fs->s5f_warmq);
+  kthread_exit(NULL);
+  return NULL;
+}
@@ -0,0 +1,933 @@
+/*
+ *  FILE: socket.c
+ *  DESC: Local (UNIX-domain) sockets, for socketpair(2), sendmsg(2) and
+ *        recvmsg(2), and the socket calls for the UDP sockets of
+ *        net/udp.c.
+ *
+ * Each end of a pair is a vnode of its own, as a pipe is, holding a
+ * socket_t. What one end sends is queued on the other's receive queue as
+ * segments, each either bytes copied from the sender or whole pages the
+ * sender gave up (MSG_GIFT), which wait in an anonymous object of the
+ * segment's own until they are received. A segment may also carry files
+ * being passed, which the receiver gets along with its first byte.
+ *
+ * An end is open for as long as a file refers to it. When the last one
+ * goes, whatever was queued for the end is thrown away, and the peer
+ * reads what is queued for it and then the end of the stream, and gets
+ * EPIPE from sending.
+ *
+ * Files in flight hold references like any others, so an end passed
+ * through its own connection would keep itself open forever; that is
+ * refused. Longer cycles, through other connections, are not looked for
+ * and leak.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "api/access.h"
+
+#include "fs/file.h"
+#include "fs/open.h"
+#include "fs/poll.h"
+#include "fs/socket.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mm.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "net/in.h"
+#include "net/udp.h"
+
+#include "proc/kmutex.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "vm/anon.h"
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+
+/* Bytes an end may have queued for it before its peer's senders wait */
+#define SOCK_CAPACITY (SOCK_BUF_PAGES * PAGE_SIZE)
+
+typedef struct sock_seg {
+  list_link_t sg_link; /* on the receiving end's sk_queue */
+  size_t sg_len;
+  size_t sg_off;       /* bytes already received */
+  mmobj_t *sg_obj;     /* holds the bytes in pages 0.., or NULL for sg_data */
+  file_t **sg_files;   /* passed with the first byte; kmalloc()ed */
+  int sg_nfiles;
+  int sg_eor;          /* ends a datagram */
+  char sg_data[];
+} sock_seg_t;
+
+/* Most bytes one segment copies, so that it fits in a page */
+#define SOCK_SEG_DATA (PAGE_SIZE - sizeof(sock_seg_t))
+
+typedef struct socket {
+  int sk_type;             /* SOCK_STREAM or SOCK_DGRAM */
+  vnode_t *sk_vnode;
+  struct socket *sk_peer;  /* NULL once either end has closed */
+  int sk_nfiles;           /* files open on this end */
+  list_t sk_queue;         /* segments sent to this end, oldest first */
+  size_t sk_queued;        /* bytes in them not yet received */
+  /*
+   * A receiver holds sk_rdlock, so that each gets contiguous data, and a
+   * sender sk_wrlock, so that one send is not interleaved with another
+   * and nothing but the holder adds to the peer's queue.
+   */
+  kmutex_t sk_rdlock;
+  kmutex_t sk_wrlock;
+  ktqueue_t sk_read_waitq;  /* receivers waiting for something queued */
+  ktqueue_t sk_write_waitq; /* senders waiting for room at the peer */
+  pollq_t sk_pollq;
+} socket_t;
+
+#define VNODE_TO_SOCK(vn) ((socket_t *)((vn)->vn_i))
+
+/* Buffers being sent from or received into, in the kernel or in the
+ * current process. The vector is the caller's copy, used up as data
+ * moves. */
+typedef struct sock_io {
+  struct iovec *si_iov;
+  int si_iovcnt;
+  int si_user;
+} sock_io_t;
+
+static void sock_read_vnode(vnode_t *vnode);
+static void sock_delete_vnode(vnode_t *vnode);
+static int sock_query_vnode(vnode_t *vnode);
+
+static fs_ops_t sock_fsops = {.read_vnode = sock_read_vnode,
+                              .delete_vnode = sock_delete_vnode,
+                              .query_vnode = sock_query_vnode,
+                              /* like pipefs, never mounted */
+                              .umount = NULL};
+
+static fs_t sock_fs = {.fs_dev = "socket",
+                       .fs_type = "socket",
+                       .fs_op = &sock_fsops,
+                       .fs_root = NULL,
+                       .fs_i = NULL};
+
+static int sock_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int sock_write(vnode_t *vnode, off_t offset, const void *buf,
+                      size_t len);
+static int sock_stat(vnode_t *vnode, struct stat *ss);
+static int sock_acquire(vnode_t *vnode, file_t *file);
+static int sock_release(vnode_t *vnode, file_t *file);
+static int sock_poll(vnode_t *vnode, int events, poll_table_t *pt);
+
+static vnode_ops_t sock_vops = {.read = sock_read,
+                                .write = sock_write,
+                                .stat = sock_stat,
+                                .poll = sock_poll,
+                                .acquire = sock_acquire,
+                                .release = sock_release};
+
+static slab_allocator_t *sock_allocator = NULL;
+static int next_sno = 0;
+
+static __attribute__((unused)) void socket_init(void) {
+  sock_allocator = slab_allocator_create("socket", sizeof(socket_t));
+  KASSERT(sock_allocator != NULL);
+}
+init_func(socket_init);
+init_depends(vfs_init);
+
+static void sock_read_vnode(vnode_t *vnode) {
+  vnode->vn_ops = &sock_vops;
+  vnode->vn_mode = S_IFSOCK;
+  vnode->vn_len = 0;
+  vnode->vn_i = NULL;
+}
+
+static void sock_delete_vnode(vnode_t *vnode) {
+  socket_t *so = VNODE_TO_SOCK(vnode);
+  if (so) {
+    KASSERT(!so->sk_nfiles && list_empty(&so->sk_queue));
+    slab_obj_free(sock_allocator, so);
+  }
+}
+
+/* As with pipes, there are never pages to clean up */
+static int sock_query_vnode(vnode_t *vnode) { return 1; }
+
+/* Gets a vnode for a new, unconnected end, as pget() does for a pipe */
+static vnode_t *sock_get(int type) {
+  vnode_t *vn = vget(&sock_fs, next_sno++);
+  socket_t *so;
+
+  if (!vn)
+    return NULL;
+  if (NULL == (so = (socket_t *)slab_obj_alloc(sock_allocator))) {
+    vput(vn);
+    return NULL;
+  }
+  memset(so, 0, sizeof(*so));
+  so->sk_type = type;
+  so->sk_vnode = vn;
+  list_init(&so->sk_queue);
+  kmutex_init(&so->sk_rdlock);
+  kmutex_init(&so->sk_wrlock);
+  sched_queue_init(&so->sk_read_waitq);
+  sched_queue_init(&so->sk_write_waitq);
+  pollq_init(&so->sk_pollq);
+  vn->vn_i = so;
+  return vn;
+}
+
+static void sock_files_put(file_t **files, int nfiles) {
+  int i;
+  for (i = 0; i < nfiles; ++i)
+    fput(files[i]);
+  kfree(files);
+}
+
+static sock_seg_t *sock_seg_alloc(size_t len) {
+  sock_seg_t *sg = (sock_seg_t *)kmalloc(sizeof(*sg) + len);
+  if (sg) {
+    list_link_init(&sg->sg_link);
+    sg->sg_len = len;
+    sg->sg_off = 0;
+    sg->sg_obj = NULL;
+    sg->sg_files = NULL;
+    sg->sg_nfiles = 0;
+    sg->sg_eor = 0;
+  }
+  return sg;
+}
+
+static void sock_seg_free(sock_seg_t *sg) {
+  if (sg->sg_files)
+    sock_files_put(sg->sg_files, sg->sg_nfiles);
+  if (sg->sg_obj)
+    sg->sg_obj->mmo_ops->put(sg->sg_obj);
+  kfree(sg);
+}
+
+static void sock_segs_free(list_t *segs) {
+  sock_seg_t *sg;
+  list_iterate_begin(segs, sg, sock_seg_t, sg_link) {
+    list_remove(&sg->sg_link);
+    sock_seg_free(sg);
+  }
+  list_iterate_end();
+}
+
+static size_t sock_io_len(sock_io_t *io) {
+  size_t len = 0;
+  int i;
+  for (i = 0; i < io->si_iovcnt; ++i)
+    len += io->si_iov[i].iov_len;
+  return len;
+}
+
+/* The buffer data moves to or from next, or NULL once all are used up */
+static struct iovec *sock_io_cur(sock_io_t *io) {
+  while (io->si_iovcnt && !io->si_iov->iov_len) {
+    io->si_iov++;
+    io->si_iovcnt--;
+  }
+  return io->si_iovcnt ? io->si_iov : NULL;
+}
+
+static void sock_io_advance(struct iovec *iov, size_t n) {
+  iov->iov_base = (char *)iov->iov_base + n;
+  iov->iov_len -= n;
+}
+
+/* Moves n bytes between buf and io, which must have room for them */
+static int sock_io_copy(sock_io_t *io, void *buf, size_t n, int in) {
+  struct iovec *iov;
+  size_t k;
+  int ret;
+
+  while (n) {
+    iov = sock_io_cur(io);
+    KASSERT(NULL != iov);
+    k = MIN(n, iov->iov_len);
+    if (!io->si_user) {
+      if (in)
+        memcpy(buf, iov->iov_base, k);
+      else
+        memcpy(iov->iov_base, buf, k);
+    } else if (0 > (ret = in ? copy_from_user(buf, iov->iov_base, k)
+                             : copy_to_user(iov->iov_base, buf, k))) {
+      return ret;
+    }
+    sock_io_advance(iov, k);
+    buf = (char *)buf + k;
+    n -= k;
+  }
+  return 0;
+}
+
+/*
+ * Takes up to npages whole pages from the start of iov, a page-aligned
+ * user buffer, into a new segment, stopping at the first the process
+ * won't give up (see vmmap_take_page). *sgp is NULL if it gave none.
+ */
+static int sock_take_pages(struct iovec *iov, uint32_t npages,
+                           sock_seg_t **sgp) {
+  uint32_t vfn = ADDR_TO_PN(iov->iov_base), i;
+  sock_seg_t *sg;
+
+  *sgp = NULL;
+  if (NULL == (sg = sock_seg_alloc(0)))
+    return -ENOMEM;
+  if (NULL == (sg->sg_obj = anon_create())) {
+    kfree(sg);
+    return -ENOMEM;
+  }
+  for (i = 0; i < npages; ++i) {
+    if (0 > vmmap_take_page(curproc->p_vmmap, vfn + i, sg->sg_obj, i))
+      break;
+  }
+  if (!i) {
+    sock_seg_free(sg);
+    return 0;
+  }
+  sg->sg_len = i * PAGE_SIZE;
+  sock_io_advance(iov, sg->sg_len);
+  *sgp = sg;
+  return 0;
+}
+
+/*
+ * Makes segments of the next len bytes of io, onto segs. With MSG_GIFT,
+ * runs of whole pages of user buffers are taken rather than copied, and
+ * copies stop at page boundaries so that the pages after them can be.
+ */
+static int sock_build(sock_io_t *io, size_t len, int flags, list_t *segs) {
+  struct iovec *iov;
+  sock_seg_t *sg;
+  size_t n;
+  int ret;
+
+  while (len) {
+    iov = sock_io_cur(io);
+    KASSERT(NULL != iov);
+    n = MIN(len, SOCK_SEG_DATA);
+    if ((flags & MSG_GIFT) && io->si_user) {
+      if (PAGE_ALIGNED(iov->iov_base) && MIN(len, iov->iov_len) >= PAGE_SIZE) {
+        if (0 > (ret = sock_take_pages(iov, MIN(len, iov->iov_len) / PAGE_SIZE,
+                                       &sg)))
+          return ret;
+        if (sg) {
+          list_insert_tail(segs, &sg->sg_link);
+          len -= sg->sg_len;
+          continue;
+        }
+      }
+      n = MIN(n, PAGE_SIZE - PAGE_OFFSET(iov->iov_base));
+    }
+    if (NULL == (sg = sock_seg_alloc(n)))
+      return -ENOMEM;
+    list_insert_tail(segs, &sg->sg_link);
+    if (0 > (ret = sock_io_copy(io, sg->sg_data, n, 1)))
+      return ret;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Moves the next n bytes of a segment into io. Given pages go whole into
+ * a page-aligned user buffer which will take them (see vmmap_give_page),
+ * and are copied otherwise.
+ */
+static int sock_seg_copyout(sock_seg_t *sg, sock_io_t *io, size_t n) {
+  struct iovec *iov;
+  pframe_t *pf;
+  uint32_t pagenum;
+  size_t off, k;
+  int ret;
+
+  if (!sg->sg_obj) {
+    if (0 > (ret = sock_io_copy(io, sg->sg_data + sg->sg_off, n, 0)))
+      return ret;
+    sg->sg_off += n;
+    return 0;
+  }
+  while (n) {
+    iov = sock_io_cur(io);
+    KASSERT(NULL != iov);
+    pagenum = sg->sg_off / PAGE_SIZE;
+    off = sg->sg_off % PAGE_SIZE;
+    if (io->si_user && !off && n >= PAGE_SIZE && iov->iov_len >= PAGE_SIZE &&
+        PAGE_ALIGNED(iov->iov_base) &&
+        0 <= vmmap_give_page(curproc->p_vmmap, ADDR_TO_PN(iov->iov_base),
+                             sg->sg_obj, pagenum)) {
+      k = PAGE_SIZE;
+      sock_io_advance(iov, k);
+    } else {
+      k = MIN(n, PAGE_SIZE - off);
+      if (0 > (ret = pframe_lookup(sg->sg_obj, pagenum, 0, &pf)))
+        return ret;
+      /* Kept while copying to the user blocks */
+      pframe_pin(pf);
+      ret = sock_io_copy(io, (char *)pf->pf_addr + off, k, 0);
+      pframe_unpin(pf);
+      if (0 > ret)
+        return ret;
+    }
+    sg->sg_off += k;
+    n -= k;
+  }
+  return 0;
+}
+
+/*
+ * Gives the current process the files a segment passes, as descriptors
+ * in an SCM_RIGHTS message after the *used bytes of msg's control
+ * buffer. Those there is no room or no descriptor for are closed, and
+ * MSG_CTRUNC set in *mflags; with no msg, as for read(), all are.
+ */
+static void sock_recv_files(sock_seg_t *sg, struct msghdr *msg,
+                            socklen_t *used, int *mflags) {
+  struct cmsghdr *cm = NULL;
+  int *fds = NULL;
+  size_t room = 0;
+  int i, k = 0, max = 0, fd;
+
+  if (msg) {
+    room = msg->msg_controllen - *used;
+    cm = (struct cmsghdr *)((char *)msg->msg_control + *used);
+    fds = (int *)CMSG_DATA(cm);
+  }
+  if (room >= CMSG_LEN(sizeof(int)))
+    max = (room - CMSG_LEN(0)) / sizeof(int);
+  for (i = 0; i < sg->sg_nfiles; ++i) {
+    if (k < max && 0 <= (fd = get_empty_fd(curproc))) {
+      fdtable_set(curproc->p_fdt, fd, sg->sg_files[i]);
+      fds[k++] = fd;
+    } else {
+      fput(sg->sg_files[i]);
+      *mflags |= MSG_CTRUNC;
+    }
+  }
+  if (k) {
+    cm->cmsg_len = CMSG_LEN(k * sizeof(int));
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    *used += MIN(CMSG_SPACE(k * sizeof(int)), room);
+  }
+  kfree(sg->sg_files);
+  sg->sg_files = NULL;
+  sg->sg_nfiles = 0;
+}
+
+/*
+ * Receives into io what is queued for so: for a datagram socket the next
+ * datagram, dropping what doesn't fit, and for a stream as much as there
+ * is, stopping short of a segment which passes files unless it comes
+ * first. Waits while nothing is queued unless the peer has closed, after
+ * which an empty queue reads as the end of the stream. The control
+ * messages and flags go in msg, if there is one.
+ */
+static int sock_recv(socket_t *so, sock_io_t *io, struct msghdr *msg,
+                     int flags) {
+  size_t len = sock_io_len(io), total = 0, n, off;
+  socklen_t used = 0;
+  sock_seg_t *sg;
+  int ret, eor, mflags = 0;
+
+  if (!len && SOCK_STREAM == so->sk_type) {
+    if (msg)
+      msg->msg_controllen = msg->msg_flags = 0;
+    return 0;
+  }
+  if ((ret = kmutex_lock_cancellable(&so->sk_rdlock)))
+    return ret;
+  while (list_empty(&so->sk_queue)) {
+    if (!so->sk_peer)
+      goto out;
+    if (flags & MSG_DONTWAIT) {
+      ret = -EAGAIN;
+      goto out;
+    }
+    if ((ret = sched_cancellable_sleep_on(&so->sk_read_waitq)))
+      goto out;
+  }
+
+  while (!list_empty(&so->sk_queue)) {
+    sg = list_head(&so->sk_queue, sock_seg_t, sg_link);
+    if (sg->sg_nfiles) {
+      if (total)
+        break;
+      sock_recv_files(sg, msg, &used, &mflags);
+    }
+    n = MIN(len - total, sg->sg_len - sg->sg_off);
+    off = sg->sg_off;
+    ret = n ? sock_seg_copyout(sg, io, n) : 0;
+    total += sg->sg_off - off;
+    so->sk_queued -= sg->sg_off - off;
+    if (0 > ret)
+      break;
+    if (sg->sg_off < sg->sg_len) {
+      if (SOCK_STREAM == so->sk_type)
+        break;
+      /* The rest of a datagram which doesn't fit is dropped */
+      mflags |= MSG_TRUNC;
+      do {
+        sg = list_head(&so->sk_queue, sock_seg_t, sg_link);
+        so->sk_queued -= sg->sg_len - sg->sg_off;
+        eor = sg->sg_eor;
+        list_remove(&sg->sg_link);
+        sock_seg_free(sg);
+      } while (!eor);
+      break;
+    }
+    eor = sg->sg_eor;
+    list_remove(&sg->sg_link);
+    sock_seg_free(sg);
+    if (eor || (SOCK_STREAM == so->sk_type && total == len))
+      break;
+  }
+  if (so->sk_peer) {
+    sched_broadcast_on(&so->sk_peer->sk_write_waitq);
+    pollq_wakeup(&so->sk_peer->sk_pollq);
+  }
+
+out:
+  kmutex_unlock(&so->sk_rdlock);
+  if (msg) {
+    msg->msg_controllen = used;
+    msg->msg_flags = mflags;
+  }
+  return total ? (int)total : ret;
+}
+
+/*
+ * Sends io to so's peer: a datagram socket all of it as one datagram, of
+ * at most SOCK_CAPACITY bytes, once there is room for it, and a stream
+ * as much as there is room for at a time until all is sent. The files,
+ * if any, ride on the first segment; they are the caller's no longer,
+ * and are closed if the send fails before they go. Returns the bytes
+ * sent, or -EPIPE once the peer has closed.
+ */
+static int sock_send(socket_t *so, sock_io_t *io, file_t **files, int nfiles,
+                     int flags) {
+  size_t len = sock_io_len(io), total = 0, room, n;
+  socket_t *peer;
+  sock_seg_t *sg;
+  list_t segs;
+  int ret;
+
+  if (SOCK_DGRAM == so->sk_type && len > SOCK_CAPACITY) {
+    ret = -EMSGSIZE;
+    goto done;
+  }
+  if (SOCK_STREAM == so->sk_type && !len) {
+    /* files need a byte to go with */
+    ret = nfiles ? -EINVAL : 0;
+    goto done;
+  }
+  if ((ret = kmutex_lock_cancellable(&so->sk_wrlock)))
+    goto done;
+  while (1) {
+    if (NULL == (peer = so->sk_peer)) {
+      ret = -EPIPE;
+      break;
+    }
+    room = SOCK_CAPACITY - MIN(peer->sk_queued, SOCK_CAPACITY);
+    if (SOCK_DGRAM == so->sk_type ? room < len : !room) {
+      if (flags & MSG_DONTWAIT) {
+        ret = -EAGAIN;
+        break;
+      }
+      if ((ret = sched_cancellable_sleep_on(&so->sk_write_waitq)))
+        break;
+      continue;
+    }
+
+    n = MIN(room, len - total);
+    list_init(&segs);
+    ret = sock_build(io, n, flags, &segs);
+    if (0 <= ret && list_empty(&segs)) {
+      /* An empty datagram still takes a segment */
+      if (NULL == (sg = sock_seg_alloc(0)))
+        ret = -ENOMEM;
+      else
+        list_insert_tail(&segs, &sg->sg_link);
+    }
+    if (0 > ret) {
+      sock_segs_free(&segs);
+      break;
+    }
+    /* The peer may have closed while the data was copied */
+    if (NULL == (peer = so->sk_peer)) {
+      sock_segs_free(&segs);
+      ret = -EPIPE;
+      break;
+    }
+    if (SOCK_DGRAM == so->sk_type) {
+      sg = list_tail(&segs, sock_seg_t, sg_link);
+      sg->sg_eor = 1;
+    }
+    if (nfiles) {
+      sg = list_head(&segs, sock_seg_t, sg_link);
+      sg->sg_files = files;
+      sg->sg_nfiles = nfiles;
+      nfiles = 0;
+    }
+    list_iterate_begin(&segs, sg, sock_seg_t, sg_link) {
+      list_remove(&sg->sg_link);
+      list_insert_tail(&peer->sk_queue, &sg->sg_link);
+    }
+    list_iterate_end();
+    peer->sk_queued += n;
+    total += n;
+    sched_broadcast_on(&peer->sk_read_waitq);
+    pollq_wakeup(&peer->sk_pollq);
+    if (total == len)
+      break;
+  }
+  kmutex_unlock(&so->sk_wrlock);
+
+done:
+  if (nfiles)
+    sock_files_put(files, nfiles);
+  return total ? (int)total : ret;
+}
+
+static int sock_read(vnode_t *vnode, off_t offset, void *buf, size_t len) {
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  sock_io_t io = {.si_iov = &iov, .si_iovcnt = 1, .si_user = 0};
+  return sock_recv(VNODE_TO_SOCK(vnode), &io, NULL, 0);
+}
+
+static int sock_write(vnode_t *vnode, off_t offset, const void *buf,
+                      size_t len) {
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+  sock_io_t io = {.si_iov = &iov, .si_iovcnt = 1, .si_user = 0};
+  return sock_send(VNODE_TO_SOCK(vnode), &io, NULL, 0, 0);
+}
+
+static int sock_stat(vnode_t *vnode, struct stat *ss) {
+  memset(ss, 0, sizeof(*ss));
+  ss->st_mode = vnode->vn_mode;
+  ss->st_ino = (int)vnode->vn_vno;
+  ss->st_nlink = 1;
+  ss->st_size = (int)VNODE_TO_SOCK(vnode)->sk_queued;
+  ss->st_blksize = (int)PAGE_SIZE;
+  return 0;
+}
+
+static int sock_acquire(vnode_t *vnode, file_t *file) {
+  VNODE_TO_SOCK(vnode)->sk_nfiles++;
+  return 0;
+}
+
+/*
+ * When the last file on an end goes, the connection is broken: the peer
+ * is woken to notice, and what was queued for this end, which no one
+ * can now receive, is thrown away.
+ */
+static int sock_release(vnode_t *vnode, file_t *file) {
+  socket_t *so = VNODE_TO_SOCK(vnode), *peer;
+
+  if (--so->sk_nfiles)
+    return 0;
+  if (NULL != (peer = so->sk_peer)) {
+    peer->sk_peer = NULL;
+    so->sk_peer = NULL;
+    sched_broadcast_on(&peer->sk_read_waitq);
+    sched_broadcast_on(&peer->sk_write_waitq);
+    pollq_wakeup(&peer->sk_pollq);
+  }
+  so->sk_queued = 0;
+  sock_segs_free(&so->sk_queue);
+  return 0;
+}
+
+/*
+ * An end can be read if something is queued for it, and written while
+ * its peer has room; once the peer has closed, reads see the end of the
+ * stream (POLLHUP) and writes fail.
+ */
+static int sock_poll(vnode_t *vnode, int events, poll_table_t *pt) {
+  socket_t *so = VNODE_TO_SOCK(vnode);
+  int ready = 0;
+
+  poll_wait(&so->sk_pollq, pt);
+  if (!list_empty(&so->sk_queue))
+    ready |= POLLIN;
+  if (!so->sk_peer)
+    ready |= POLLHUP | POLLERR;
+  else if (so->sk_peer->sk_queued < SOCK_CAPACITY)
+    ready |= POLLOUT;
+  return ready;
+}
+
+/*
+ * An implementation of the socketpair(2) system call. Fails with
+ * EAFNOSUPPORT unless domain is AF_UNIX, ESOCKTNOSUPPORT unless type is
+ * SOCK_STREAM or SOCK_DGRAM, EPROTONOSUPPORT unless protocol is 0, and
+ * otherwise as pipe(2) does.
+ */
+int do_socketpair(int domain, int type, int protocol, int sv[2]) {
+  vnode_t *vn[2] = {NULL, NULL};
+  int fd[2] = {-1, -1};
+  file_t *f;
+  int i, ret;
+
+  if (AF_UNIX != domain)
+    return -EAFNOSUPPORT;
+  if (SOCK_STREAM != type && SOCK_DGRAM != type)
+    return -ESOCKTNOSUPPORT;
+  if (protocol)
+    return -EPROTONOSUPPORT;
+
+  for (i = 0; i < 2; ++i) {
+    if (NULL == (vn[i] = sock_get(type))) {
+      ret = -ENOMEM;
+      goto fail;
+    }
+  }
+  VNODE_TO_SOCK(vn[0])->sk_peer = VNODE_TO_SOCK(vn[1]);
+  VNODE_TO_SOCK(vn[1])->sk_peer = VNODE_TO_SOCK(vn[0]);
+  for (i = 0; i < 2; ++i) {
+    if (0 > (ret = get_empty_fd(curproc)))
+      goto fail;
+    if (NULL == (f = fget(-1))) {
+      ret = -ENOMEM;
+      goto fail;
+    }
+    f->f_mode = FMODE_READ | FMODE_WRITE;
+    facq(f, vn[i]);
+    vn[i] = NULL;
+    fdtable_set(curproc->p_fdt, fd[i] = ret, f);
+  }
+  sv[0] = fd[0];
+  sv[1] = fd[1];
+  return 0;
+
+fail:
+  for (i = 0; i < 2; ++i) {
+    if (0 <= fd[i])
+      fput(fdtable_clear(curproc->p_fdt, fd[i]));
+    if (vn[i])
+      vput(vn[i]);
+  }
+  return ret;
+}
+
+/*
+ * The socket(2) system call, for UDP sockets: AF_INET and SOCK_DGRAM,
+ * with protocol 0 or IPPROTO_UDP. Local sockets have no names to bind or
+ * send to, so come only in pairs from socketpair(); asking for one fails
+ * with EOPNOTSUPP.
+ */
+int do_socket(int domain, int type, int protocol) {
+  vnode_t *vn;
+  file_t *f;
+  int fd;
+
+  if (AF_UNIX == domain)
+    return -EOPNOTSUPP;
+  if (AF_INET != domain)
+    return -EAFNOSUPPORT;
+  if (SOCK_DGRAM != type)
+    return -ESOCKTNOSUPPORT;
+  if (protocol && IPPROTO_UDP != protocol)
+    return -EPROTONOSUPPORT;
+
+  if (0 > (fd = get_empty_fd(curproc)))
+    return fd;
+  if (NULL == (vn = udp_socket()))
+    return -ENOMEM;
+  if (NULL == (f = fget(-1))) {
+    vput(vn);
+    return -ENOMEM;
+  }
+  f->f_mode = FMODE_READ | FMODE_WRITE;
+  facq(f, vn);
+  fdtable_set(curproc->p_fdt, fd, f);
+  return fd;
+}
+
+/* The bind(2) system call; addr is a kernel copy */
+int do_bind(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  file_t *f;
+  int put, ret;
+
+  if (NULL == (f = fget_light(fd, &put)))
+    return -EBADF;
+  if (!udp_is(f->f_vnode))
+    ret = &sock_vops == f->f_vnode->vn_ops ? -EOPNOTSUPP : -ENOTSOCK;
+  else if (addrlen < sizeof(struct sockaddr_in))
+    ret = -EINVAL;
+  else
+    ret = udp_bind(f->f_vnode, (const struct sockaddr_in *)addr);
+  fput_light(f, put);
+  return ret;
+}
+
+/* The file open on fd if it is a socket of either kind, or NULL with
+ * *ret set */
+static file_t *sock_fget(int fd, int *put, int *ret) {
+  file_t *f;
+
+  if (NULL == (f = fget_light(fd, put))) {
+    *ret = -EBADF;
+    return NULL;
+  }
+  if (&sock_vops != f->f_vnode->vn_ops && !udp_is(f->f_vnode)) {
+    fput_light(f, *put);
+    *ret = -ENOTSOCK;
+    return NULL;
+  }
+  return f;
+}
+
+/*
+ * Gets a reference to each file an SCM_RIGHTS message in msg's control
+ * buffer names, into a kmalloc()ed array. Control messages of any other
+ * kind, and either end of so's own connection, are refused with EINVAL;
+ * more than SCM_MAX_FD files with ETOOMANYREFS.
+ */
+static int sock_send_files(socket_t *so, const struct msghdr *msg,
+                           file_t ***filesp, int *nfilesp) {
+  struct cmsghdr *cm;
+  file_t **files;
+  int *fds;
+  int i, n, nfiles = 0, ret = 0;
+
+  *filesp = NULL;
+  *nfilesp = 0;
+  if (!msg->msg_controllen)
+    return 0;
+  if (NULL == (files = (file_t **)kmalloc(SCM_MAX_FD * sizeof(file_t *))))
+    return -ENOMEM;
+  for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR((struct msghdr *)msg, cm)) {
+    if (cm->cmsg_len < CMSG_LEN(0) ||
+        (char *)cm + cm->cmsg_len >
+            (char *)msg->msg_control + msg->msg_controllen ||
+        SOL_SOCKET != cm->cmsg_level || SCM_RIGHTS != cm->cmsg_type) {
+      ret = -EINVAL;
+      goto fail;
+    }
+    n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (nfiles + n > SCM_MAX_FD) {
+      ret = -ETOOMANYREFS;
+      goto fail;
+    }
+    fds = (int *)CMSG_DATA(cm);
+    for (i = 0; i < n; ++i) {
+      if (NULL == (files[nfiles] = fget(fds[i]))) {
+        ret = -EBADF;
+        goto fail;
+      }
+      nfiles++;
+      if (files[nfiles - 1]->f_vnode == so->sk_vnode ||
+          (so->sk_peer &&
+           files[nfiles - 1]->f_vnode == so->sk_peer->sk_vnode)) {
+        ret = -EINVAL;
+        goto fail;
+      }
+    }
+  }
+  if (!nfiles) {
+    kfree(files);
+    return 0;
+  }
+  *filesp = files;
+  *nfilesp = nfiles;
+  return 0;
+
+fail:
+  sock_files_put(files, nfiles);
+  return ret;
+}
+
+/*
+ * The sendmsg(2) system call. msg is the caller's copy of the user's
+ * header, whose msg_iov points at a copy of the user's vector, of at
+ * most IOV_MAX buffers still in user space, and whose msg_control and
+ * msg_name point at copies of the control messages and the address.
+ * Returns the bytes sent or -errno.
+ */
+int do_sendmsg(int fd, const struct msghdr *msg, int flags) {
+  struct iovec iov[IOV_MAX];
+  sock_io_t io;
+  file_t *f, **files;
+  socket_t *so;
+  int put, nfiles, ret;
+
+  if (flags & ~(MSG_DONTWAIT | MSG_GIFT))
+    return -EINVAL;
+  if (msg->msg_iovlen < 0 || msg->msg_iovlen > IOV_MAX)
+    return -EINVAL;
+  if (NULL == (f = sock_fget(fd, &put, &ret)))
+    return ret;
+  if (f->f_mode & FMODE_NONBLOCK)
+    flags |= MSG_DONTWAIT;
+  if (!(f->f_mode & FMODE_WRITE)) {
+    ret = -EBADF;
+  } else if (udp_is(f->f_vnode)) {
+    ret = udp_sendmsg(f->f_vnode, msg, flags);
+  } else if (msg->msg_name) {
+    ret = -EISCONN;
+  } else {
+    so = VNODE_TO_SOCK(f->f_vnode);
+    if (0 <= (ret = sock_send_files(so, msg, &files, &nfiles))) {
+      memcpy(iov, msg->msg_iov, msg->msg_iovlen * sizeof(*iov));
+      io.si_iov = iov;
+      io.si_iovcnt = msg->msg_iovlen;
+      io.si_user = 1;
+      ret = sock_send(so, &io, files, nfiles, flags);
+    }
+  }
+  fput_light(f, put);
+  return ret;
+}
+
+/*
+ * The recvmsg(2) system call. msg is as for do_sendmsg, but its control
+ * buffer and address are for the caller to copy out; on return
+ * msg_controllen and msg_namelen are the lengths of what was put there
+ * and msg_flags is set. Returns the bytes received or -errno.
+ */
+int do_recvmsg(int fd, struct msghdr *msg, int flags) {
+  struct iovec iov[IOV_MAX];
+  sock_io_t io;
+  file_t *f;
+  int put, ret;
+
+  if (flags & ~(MSG_DONTWAIT | MSG_GIFT))
+    return -EINVAL;
+  if (msg->msg_iovlen < 0 || msg->msg_iovlen > IOV_MAX)
+    return -EINVAL;
+  if (NULL == (f = sock_fget(fd, &put, &ret)))
+    return ret;
+  if (f->f_mode & FMODE_NONBLOCK)
+    flags |= MSG_DONTWAIT;
+  if (!(f->f_mode & FMODE_READ)) {
+    ret = -EBADF;
+  } else if (udp_is(f->f_vnode)) {
+    ret = udp_recvmsg(f->f_vnode, msg, flags);
+  } else {
+    /* Given pages are mapped in wherever they can be, MSG_GIFT or not */
+    memcpy(iov, msg->msg_iov, msg->msg_iovlen * sizeof(*iov));
+    io.si_iov = iov;
+    io.si_iovcnt = msg->msg_iovlen;
+    io.si_user = 1;
+    msg->msg_namelen = 0;
+    ret = sock_recv(VNODE_TO_SOCK(f->f_vnode), &io, msg, flags);
+  }
+  fput_light(f, put);
+  return ret;
+}
@@ -0,0 +1,287 @@
+/*
+ * A read-only file system of kernel statistics, for programs to read
+ * without a debugger. Each file is regenerated from one of the kernel's
+ * debug info functions (see dbg_printinfo) when it is read from the
+ * start, so the counters in it are current and hang together; reads
+ * further on continue the same snapshot. A program which wants fresh
+ * numbers reads the file again from offset 0. A snapshot holds at most
+ * STATSFS_SNAP_PAGES pages of text; the rest is cut off.
+ *
+ * Nothing is kept on a device, and the files and their inode numbers
+ * are fixed: the root directory is inode 0 and the nth file in
+ * statsfs_files is inode n + 1. Files report a size of 0.
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "fs/dcache.h"
+#include "fs/dirent.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "fs/statsfs/statsfs.h"
+
+#include "api/syscall.h"
+
+#include "drivers/blockdev.h"
+#include "main/interrupt.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "net/net.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/rcu.h"
+#include "proc/sched.h"
+#include "proc/workqueue.h"
+
+#include "vm/pagefault.h"
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+static const struct {
+  const char *sf_name;
+  dbg_infofunc_t sf_info; /* called with NULL */
+} statsfs_files[] = {
+    {"pframe", pframe_info},   {"slab", slab_info},
+    {"sched", sched_info},     {"syscall", syscall_info},
+    {"runq", sched_runq_info}, {"pframe_obj", pframe_obj_info},
+    {"slab_occ", slab_occupancy_info},
+    {"disk", blockdev_info},  {"vnode", vnode_info},
+    {"dcache", dcache_info},   {"proc", proc_list_info},
+    {"syscall_lat", syscall_latency_info},
+    {"disk_lat", blockdev_latency_info},
+    {"init", init_info},       {"rcu", rcu_info},
+    {"workqueue", workqueue_info}, {"interrupts", intr_info},
+    {"net", net_info},
+#ifdef __VM__
+    {"fault_lat", pagefault_info},
+    {"vmmaps", vmmap_procs_info},
+#endif
+#if KSTACK_STATS
+    {"kstack", kthread_stack_info},
+#endif
+};
+
+#define STATSFS_NFILES ((int)(sizeof(statsfs_files) / sizeof(statsfs_files[0])))
+#define STATSFS_ROOT_INO 0
+#define statsfs_ino(n) ((ino_t)(n) + 1)
+#define statsfs_file(vn) ((int)(vn)->vn_vno - 1)
+
+/* The last text generated for a file; a vnode's vn_i */
+typedef struct statsfs_snap {
+  char *ss_buf; /* STATSFS_SNAP_PAGES, allocated at the first read */
+  size_t ss_len;
+} statsfs_snap_t;
+
+typedef struct statsfs {
+  statsfs_snap_t sfs_snaps[sizeof(statsfs_files) / sizeof(statsfs_files[0])];
+} statsfs_t;
+
+#define VNODE_TO_STATSFS(vn) ((statsfs_t *)(vn)->vn_fs->fs_i)
+
+static void statsfs_read_vnode(vnode_t *vn);
+static int statsfs_query_vnode(vnode_t *vn);
+static int statsfs_umount(fs_t *fs);
+
+static fs_ops_t statsfs_ops = {.read_vnode = statsfs_read_vnode,
+                               .delete_vnode = NULL,
+                               .query_vnode = statsfs_query_vnode,
+                               .umount = statsfs_umount};
+
+static int statsfs_read(vnode_t *file, off_t offset, void *buf, size_t count);
+static int statsfs_write(vnode_t *file, off_t offset, const void *buf,
+                         size_t count);
+static int statsfs_create(vnode_t *dir, const char *name, size_t name_len,
+                          vnode_t **result);
+static int statsfs_mknod(vnode_t *dir, const char *name, size_t name_len,
+                         int mode, devid_t devid);
+static int statsfs_lookup(vnode_t *dir, const char *name, size_t name_len,
+                          vnode_t **result);
+static int statsfs_link(vnode_t *oldvnode, vnode_t *dir, const char *name,
+                        size_t name_len);
+static int statsfs_unlink(vnode_t *dir, const char *name, size_t name_len);
+static int statsfs_readdir(vnode_t *dir, off_t offset, struct dirent *d);
+static int statsfs_readdirv(vnode_t *dir, off_t offset, struct dirent *d,
+                            int n, int *nread);
+static int statsfs_stat(vnode_t *vn, struct stat *buf);
+
+/* mkdir and rmdir take the same arguments as unlink, and fail the same way */
+static vnode_ops_t statsfs_dir_vops = {.create = statsfs_create,
+                                       .mknod = statsfs_mknod,
+                                       .lookup = statsfs_lookup,
+                                       .link = statsfs_link,
+                                       .unlink = statsfs_unlink,
+                                       .mkdir = statsfs_unlink,
+                                       .rmdir = statsfs_unlink,
+                                       .readdir = statsfs_readdir,
+                                       .readdirv = statsfs_readdirv,
+                                       .stat = statsfs_stat};
+
+static vnode_ops_t statsfs_file_vops = {.read = statsfs_read,
+                                        .write = statsfs_write,
+                                        .stat = statsfs_stat};
+
+int statsfs_mount(struct fs *fs) {
+  statsfs_t *sfs;
+
+  if (NULL == (sfs = kmalloc(sizeof(statsfs_t))))
+    return -ENOMEM;
+  memset(sfs, 0, sizeof(statsfs_t));
+  fs->fs_i = sfs;
+  fs->fs_op = &statsfs_ops;
+  fs->fs_root = vget(fs, STATSFS_ROOT_INO);
+  return 0;
+}
+
+dbg_infofunc_t statsfs_info(const char *name) {
+  int i;
+
+  for (i = 0; i < STATSFS_NFILES; i++) {
+    if (0 == strcmp(statsfs_files[i].sf_name, name))
+      return statsfs_files[i].sf_info;
+  }
+  return NULL;
+}
+
+const char *statsfs_name(int n) {
+  return 0 <= n && n < STATSFS_NFILES ? statsfs_files[n].sf_name : NULL;
+}
+
+static void statsfs_read_vnode(vnode_t *vn) {
+  vn->vn_len = 0;
+  if (STATSFS_ROOT_INO == vn->vn_vno) {
+    vn->vn_mode = S_IFDIR;
+    vn->vn_ops = &statsfs_dir_vops;
+    vn->vn_i = NULL;
+  } else {
+    KASSERT(statsfs_file(vn) < STATSFS_NFILES);
+    vn->vn_mode = S_IFREG;
+    vn->vn_ops = &statsfs_file_vops;
+    vn->vn_i = &VNODE_TO_STATSFS(vn)->sfs_snaps[statsfs_file(vn)];
+  }
+}
+
+/* Nothing is ever unlinked */
+static int statsfs_query_vnode(vnode_t *vn) { return 1; }
+
+static int statsfs_umount(fs_t *fs) {
+  statsfs_t *sfs = (statsfs_t *)fs->fs_i;
+  int i;
+
+  vput(fs->fs_root);
+  for (i = 0; i < STATSFS_NFILES; i++) {
+    if (NULL != sfs->sfs_snaps[i].ss_buf)
+      page_free_n(sfs->sfs_snaps[i].ss_buf, STATSFS_SNAP_PAGES);
+  }
+  kfree(sfs);
+  return 0;
+}
+
+static int statsfs_read(vnode_t *file, off_t offset, void *buf, size_t count) {
+  statsfs_snap_t *ss = (statsfs_snap_t *)file->vn_i;
+  int ret;
+
+  if (NULL == ss->ss_buf) {
+    if (NULL == (ss->ss_buf = page_alloc_n(STATSFS_SNAP_PAGES)))
+      return -ENOMEM;
+    offset = 0;
+  }
+  if (0 == offset) {
+    statsfs_files[statsfs_file(file)].sf_info(NULL, ss->ss_buf,
+                                              STATSFS_SNAP_PAGES * PAGE_SIZE);
+    ss->ss_len = strlen(ss->ss_buf);
+  }
+  ret = MAX(0, MIN((off_t)count, (off_t)ss->ss_len - offset));
+  memcpy(buf, ss->ss_buf + offset, ret);
+  return ret;
+}
+
+static int statsfs_write(vnode_t *file, off_t offset, const void *buf,
+                         size_t count) {
+  return -EROFS;
+}
+
+static int statsfs_create(vnode_t *dir, const char *name, size_t name_len,
+                          vnode_t **result) {
+  return -EROFS;
+}
+
+static int statsfs_mknod(vnode_t *dir, const char *name, size_t name_len,
+                         int mode, devid_t devid) {
+  return -EROFS;
+}
+
+static int statsfs_lookup(vnode_t *dir, const char *name, size_t name_len,
+                          vnode_t **result) {
+  int i;
+
+  if (name_match(".", name, name_len) || name_match("..", name, name_len)) {
+    *result = vget(dir->vn_fs, STATSFS_ROOT_INO);
+    return 0;
+  }
+  for (i = 0; i < STATSFS_NFILES; i++) {
+    if (name_match(statsfs_files[i].sf_name, name, name_len)) {
+      *result = vget(dir->vn_fs, statsfs_ino(i));
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+static int statsfs_link(vnode_t *oldvnode, vnode_t *dir, const char *name,
+                        size_t name_len) {
+  return -EROFS;
+}
+
+static int statsfs_unlink(vnode_t *dir, const char *name, size_t name_len) {
+  return -EROFS;
+}
+
+/* An offset is an entry number: ".", "..", then the files */
+static int statsfs_readdir(vnode_t *dir, off_t offset, struct dirent *d) {
+  KASSERT(S_ISDIR(dir->vn_mode));
+  if (offset >= 2 + STATSFS_NFILES)
+    return 0;
+  d->d_off = 0; /* unused */
+  if (offset < 2) {
+    d->d_ino = STATSFS_ROOT_INO;
+    strcpy(d->d_name, offset ? ".." : ".");
+  } else {
+    d->d_ino = statsfs_ino(offset - 2);
+    strcpy(d->d_name, statsfs_files[offset - 2].sf_name);
+  }
+  return 1;
+}
+
+static int statsfs_readdirv(vnode_t *dir, off_t offset, struct dirent *d,
+                            int n, int *nread) {
+  int total = 0;
+
+  for (*nread = 0; *nread < n; ++*nread) {
+    if (0 == statsfs_readdir(dir, offset + total, d + *nread))
+      break;
+    total++;
+  }
+  return total;
+}
+
+static int statsfs_stat(vnode_t *vn, struct stat *buf) {
+  memset(buf, 0, sizeof(struct stat));
+  buf->st_mode = vn->vn_mode;
+  buf->st_ino = (int)vn->vn_vno;
+  buf->st_nlink = S_ISDIR(vn->vn_mode) ? 2 : 1;
+  buf->st_size = 0;
+  buf->st_blksize = (int)PAGE_SIZE;
+  buf->st_blocks = 0;
+  return 0;
+}
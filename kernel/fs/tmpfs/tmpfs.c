@@ -0,0 +1,650 @@
+/*
+ * An in-memory file system whose file data lives in the page cache.
+ *
+ * Unlike ramfs, a regular file has no buffer of its own: its contents are
+ * the resident pages of its vnode's mmobj, so files grow without limit,
+ * reads and writes go through pframe_get() like s5fs, and mmap hands out
+ * the vnode's mmobj directly. There is nothing behind the pages, so
+ * fillpage zero-fills and pins each page; pinned pages are never paged
+ * out, and they keep the vnode (and so the inode) cached. The pins are
+ * dropped when the pages are freed, which is when the last reference to
+ * an unlinked file goes away (see vput) or when the file system is
+ * unmounted.
+ *
+ * Directories are lists of entries in the order they were made, and
+ * every entry is also on a per-mount hash table keyed by the directory
+ * and the name, so lookups do not scan. A readdir offset is a cookie:
+ * 0 and 1 are "." and "..", and each entry gets the next number of its
+ * directory when it is made, so removing entries does not move the
+ * others.
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+#include "limits.h"
+
+#include "fs/dirent.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "fs/tmpfs/tmpfs.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mm.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+
+typedef struct tmpfs_inode {
+  ino_t ti_ino;
+  int ti_mode;        /* S_IFREG, S_IFDIR, S_IFCHR or S_IFBLK */
+  int ti_nlink;       /* names for this inode */
+  off_t ti_size;      /* regular files */
+  devid_t ti_devid;   /* device special files */
+  ino_t ti_parent;    /* directories: the inode of ".." */
+  list_t ti_dirents;  /* directories: entries, oldest first */
+  int ti_nentries;    /* directories: entries other than "." and ".." */
+  off_t ti_nextoff;   /* directories: cookie for the next entry */
+} tmpfs_inode_t;
+
+typedef struct tmpfs_dirent {
+  ino_t td_dir;            /* directory this entry is in */
+  ino_t td_ino;            /* inode it names */
+  off_t td_off;            /* readdir cookie */
+  list_link_t td_dlink;    /* link on the directory's ti_dirents */
+  list_link_t td_hlink;    /* link on the mount's hash chain */
+  size_t td_namelen;
+  char td_name[NAME_LEN + 1];
+} tmpfs_dirent_t;
+
+#define TMPFS_HASH_SIZE (1 << TMPFS_HASH_ORDER)
+#define TMPFS_ROOT_INO 0
+
+typedef struct tmpfs {
+  tmpfs_inode_t **tfs_inodes; /* indexed by inode number */
+  int tfs_ninodes;            /* slots in tfs_inodes */
+  int tfs_hint;               /* no free slot below this */
+  list_t tfs_hash[TMPFS_HASH_SIZE];
+} tmpfs_t;
+
+#define VNODE_TO_TMPFS(vn) ((tmpfs_t *)(vn)->vn_fs->fs_i)
+#define VNODE_TO_TMPFSINODE(vn) ((tmpfs_inode_t *)(vn)->vn_i)
+
+static void tmpfs_read_vnode(vnode_t *vn);
+static void tmpfs_delete_vnode(vnode_t *vn);
+static int tmpfs_query_vnode(vnode_t *vn);
+static int tmpfs_umount(fs_t *fs);
+
+static fs_ops_t tmpfs_ops = {.read_vnode = tmpfs_read_vnode,
+                             .delete_vnode = tmpfs_delete_vnode,
+                             .query_vnode = tmpfs_query_vnode,
+                             .umount = tmpfs_umount};
+
+static int tmpfs_read(vnode_t *file, off_t offset, void *buf, size_t count);
+static int tmpfs_write(vnode_t *file, off_t offset, const void *buf,
+                       size_t count);
+static int tmpfs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
+static int tmpfs_truncate(vnode_t *file, off_t len);
+static int tmpfs_create(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result);
+static int tmpfs_mknod(vnode_t *dir, const char *name, size_t name_len,
+                       int mode, devid_t devid);
+static int tmpfs_lookup(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result);
+static int tmpfs_link(vnode_t *oldvnode, vnode_t *dir, const char *name,
+                      size_t name_len);
+static int tmpfs_unlink(vnode_t *dir, const char *name, size_t name_len);
+static int tmpfs_mkdir(vnode_t *dir, const char *name, size_t name_len);
+static int tmpfs_rmdir(vnode_t *dir, const char *name, size_t name_len);
+static int tmpfs_readdir(vnode_t *dir, off_t offset, struct dirent *d);
+static int tmpfs_readdirv(vnode_t *dir, off_t offset, struct dirent *d, int n,
+                          int *nread);
+static int tmpfs_stat(vnode_t *vn, struct stat *buf);
+static int tmpfs_fillpage(vnode_t *vn, off_t offset, void *pagebuf);
+static int tmpfs_dirtypage(vnode_t *vn, off_t offset);
+static int tmpfs_cleanpage(vnode_t *vn, off_t offset, void *pagebuf);
+
+static vnode_ops_t tmpfs_dir_vops = {.create = tmpfs_create,
+                                     .mknod = tmpfs_mknod,
+                                     .lookup = tmpfs_lookup,
+                                     .link = tmpfs_link,
+                                     .unlink = tmpfs_unlink,
+                                     .mkdir = tmpfs_mkdir,
+                                     .rmdir = tmpfs_rmdir,
+                                     .readdir = tmpfs_readdir,
+                                     .readdirv = tmpfs_readdirv,
+                                     .stat = tmpfs_stat};
+
+static vnode_ops_t tmpfs_file_vops = {.read = tmpfs_read,
+                                      .write = tmpfs_write,
+                                      .mmap = tmpfs_mmap,
+                                      .truncate = tmpfs_truncate,
+                                      .stat = tmpfs_stat,
+                                      .fillpage = tmpfs_fillpage,
+                                      .dirtypage = tmpfs_dirtypage,
+                                      .cleanpage = tmpfs_cleanpage};
+
+/*
+ * Inodes
+ */
+
+/* Returns the new inode's number, or -errno */
+static int tmpfs_alloc_inode(tmpfs_t *tfs, int mode, devid_t devid) {
+  tmpfs_inode_t *inode;
+  int ino;
+
+  for (ino = tfs->tfs_hint; ino < tfs->tfs_ninodes; ino++) {
+    if (NULL == tfs->tfs_inodes[ino])
+      break;
+  }
+  if (ino == tfs->tfs_ninodes) {
+    int n = 2 * tfs->tfs_ninodes;
+    tmpfs_inode_t **inodes;
+
+    if (NULL == (inodes = kmalloc(n * sizeof(*inodes))))
+      return -ENOSPC;
+    memcpy(inodes, tfs->tfs_inodes, tfs->tfs_ninodes * sizeof(*inodes));
+    memset(inodes + tfs->tfs_ninodes, 0, tfs->tfs_ninodes * sizeof(*inodes));
+    kfree(tfs->tfs_inodes);
+    tfs->tfs_inodes = inodes;
+    tfs->tfs_ninodes = n;
+  }
+
+  if (NULL == (inode = kmalloc(sizeof(tmpfs_inode_t))))
+    return -ENOSPC;
+  memset(inode, 0, sizeof(tmpfs_inode_t));
+  inode->ti_ino = ino;
+  inode->ti_mode = mode;
+  inode->ti_nlink = 1;
+  inode->ti_devid = devid;
+  list_init(&inode->ti_dirents);
+  inode->ti_nextoff = 2;
+
+  tfs->tfs_inodes[ino] = inode;
+  tfs->tfs_hint = ino + 1;
+  return ino;
+}
+
+static void tmpfs_free_inode(tmpfs_t *tfs, tmpfs_inode_t *inode) {
+  KASSERT(tfs->tfs_inodes[inode->ti_ino] == inode);
+  KASSERT(list_empty(&inode->ti_dirents));
+
+  tfs->tfs_inodes[inode->ti_ino] = NULL;
+  tfs->tfs_hint = MIN(tfs->tfs_hint, (int)inode->ti_ino);
+  kfree(inode);
+}
+
+/*
+ * Directory entries
+ */
+
+static list_t *tmpfs_chain(tmpfs_t *tfs, ino_t dir, const char *name,
+                           size_t len) {
+  uint32_t h = (uint32_t)dir;
+  size_t i;
+  for (i = 0; i < len; ++i)
+    h = h * 31 + (unsigned char)name[i];
+  return &tfs->tfs_hash[(h * 0x9e3779b1U) >> (32 - TMPFS_HASH_ORDER)];
+}
+
+static tmpfs_dirent_t *tmpfs_find(vnode_t *dir, const char *name,
+                                  size_t len) {
+  list_t *chain = tmpfs_chain(VNODE_TO_TMPFS(dir), dir->vn_vno, name, len);
+  tmpfs_dirent_t *de;
+
+  list_iterate_begin(chain, de, tmpfs_dirent_t, td_hlink) {
+    if (de->td_dir == dir->vn_vno && de->td_namelen == len &&
+        !strncmp(de->td_name, name, len))
+      return de;
+  }
+  list_iterate_end();
+  return NULL;
+}
+
+static int tmpfs_add_entry(vnode_t *dir, const char *name, size_t len,
+                           ino_t ino) {
+  tmpfs_inode_t *dinode = VNODE_TO_TMPFSINODE(dir);
+  tmpfs_dirent_t *de;
+
+  KASSERT(NULL == tmpfs_find(dir, name, len));
+  if (len > NAME_LEN)
+    return -ENAMETOOLONG;
+  if (NULL == (de = kmalloc(sizeof(tmpfs_dirent_t))))
+    return -ENOSPC;
+
+  de->td_dir = dir->vn_vno;
+  de->td_ino = ino;
+  de->td_off = dinode->ti_nextoff++;
+  de->td_namelen = len;
+  memcpy(de->td_name, name, len);
+  de->td_name[len] = '\0';
+  list_insert_tail(&dinode->ti_dirents, &de->td_dlink);
+  list_insert_head(tmpfs_chain(VNODE_TO_TMPFS(dir), dir->vn_vno, name, len),
+                   &de->td_hlink);
+  dinode->ti_nentries++;
+  return 0;
+}
+
+static void tmpfs_remove_entry(vnode_t *dir, tmpfs_dirent_t *de) {
+  list_remove(&de->td_dlink);
+  list_remove(&de->td_hlink);
+  VNODE_TO_TMPFSINODE(dir)->ti_nentries--;
+  kfree(de);
+}
+
+/*
+ * File system operations
+ */
+
+int tmpfs_mount(struct fs *fs) {
+  tmpfs_t *tfs;
+  int i, ino;
+
+  if (NULL == (tfs = kmalloc(sizeof(tmpfs_t))))
+    return -ENOMEM;
+  tfs->tfs_ninodes = 16;
+  tfs->tfs_hint = 0;
+  if (NULL == (tfs->tfs_inodes =
+                   kmalloc(tfs->tfs_ninodes * sizeof(tmpfs_inode_t *)))) {
+    kfree(tfs);
+    return -ENOMEM;
+  }
+  memset(tfs->tfs_inodes, 0, tfs->tfs_ninodes * sizeof(tmpfs_inode_t *));
+  for (i = 0; i < TMPFS_HASH_SIZE; i++)
+    list_init(&tfs->tfs_hash[i]);
+
+  if (0 > (ino = tmpfs_alloc_inode(tfs, S_IFDIR, 0))) {
+    kfree(tfs->tfs_inodes);
+    kfree(tfs);
+    return ino;
+  }
+  KASSERT(TMPFS_ROOT_INO == ino);
+  tfs->tfs_inodes[ino]->ti_parent = TMPFS_ROOT_INO;
+
+  fs->fs_i = tfs;
+  fs->fs_op = &tmpfs_ops;
+  fs->fs_root = vget(fs, TMPFS_ROOT_INO);
+  return 0;
+}
+
+static void tmpfs_read_vnode(vnode_t *vn) {
+  tmpfs_inode_t *inode = VNODE_TO_TMPFS(vn)->tfs_inodes[vn->vn_vno];
+  KASSERT(inode && inode->ti_ino == vn->vn_vno);
+
+  vn->vn_i = inode;
+  vn->vn_mode = inode->ti_mode;
+  vn->vn_len = inode->ti_size;
+  switch (inode->ti_mode) {
+  case S_IFREG:
+    vn->vn_ops = &tmpfs_file_vops;
+    break;
+  case S_IFDIR:
+    vn->vn_ops = &tmpfs_dir_vops;
+    break;
+  case S_IFCHR:
+  case S_IFBLK:
+    vn->vn_ops = NULL; /* set by the vnode layer */
+    vn->vn_devid = inode->ti_devid;
+    break;
+  default:
+    panic("inode %d has unknown/invalid mode %d!!\n", (int)vn->vn_vno,
+          inode->ti_mode);
+  }
+}
+
+/* The inode outlives its vnode until its last name is gone */
+static void tmpfs_delete_vnode(vnode_t *vn) {
+  tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(vn);
+
+  if (0 == inode->ti_nlink)
+    tmpfs_free_inode(VNODE_TO_TMPFS(vn), inode);
+}
+
+static int tmpfs_query_vnode(vnode_t *vn) {
+  return VNODE_TO_TMPFSINODE(vn)->ti_nlink > 0;
+}
+
+static int tmpfs_umount(fs_t *fs) {
+  tmpfs_t *tfs = (tmpfs_t *)fs->fs_i;
+  int ino;
+
+  vput(fs->fs_root);
+
+  /* Everything left is linked, so each file's pages are still pinned and
+   * holding its vnode; unpin and free them so the vnodes go too */
+  for (ino = 0; ino < tfs->tfs_ninodes; ino++) {
+    tmpfs_inode_t *inode = tfs->tfs_inodes[ino];
+    vnode_t *vn;
+    pframe_t *pf;
+
+    if (NULL == inode || S_IFREG != inode->ti_mode)
+      continue;
+    vn = vget(fs, ino);
+    list_iterate_begin(&vn->vn_mmobj.mmo_respages, pf, pframe_t, pf_olink) {
+      while (pframe_is_busy(pf))
+        sched_sleep_on(pframe_waitq(pf));
+      while (pframe_is_pinned(pf))
+        pframe_unpin(pf);
+      pframe_free(pf);
+    }
+    list_iterate_end();
+    vput(vn);
+  }
+
+  for (ino = 0; ino < tfs->tfs_ninodes; ino++) {
+    tmpfs_inode_t *inode = tfs->tfs_inodes[ino];
+    tmpfs_dirent_t *de;
+
+    if (NULL == inode)
+      continue;
+    list_iterate_begin(&inode->ti_dirents, de, tmpfs_dirent_t, td_dlink) {
+      kfree(de);
+    }
+    list_iterate_end();
+    kfree(inode);
+  }
+  kfree(tfs->tfs_inodes);
+  kfree(tfs);
+  return 0;
+}
+
+/*
+ * Regular files
+ */
+
+static int tmpfs_read(vnode_t *file, off_t offset, void *buf, size_t count) {
+  tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(file);
+  size_t done = 0;
+
+  KASSERT(S_ISREG(file->vn_mode));
+  if (offset >= inode->ti_size)
+    return 0;
+  count = MIN(count, (size_t)(inode->ti_size - offset));
+
+  while (done < count) {
+    uint32_t pagenum = ADDR_TO_PN(offset + done);
+    size_t pageoff = PAGE_OFFSET(offset + done);
+    size_t n = MIN(count - done, PAGE_SIZE - pageoff);
+    pframe_t *pf;
+    int err;
+
+    /* A page that was never written is a hole; don't fill one just to
+     * copy zeroes out of it */
+    if (NULL == pframe_get_resident(&file->vn_mmobj, pagenum)) {
+      memset((char *)buf + done, 0, n);
+    } else {
+      if (0 > (err = pframe_get(&file->vn_mmobj, pagenum, &pf)))
+        return done ? (int)done : err;
+      memcpy((char *)buf + done, (char *)pf->pf_addr + pageoff, n);
+    }
+    done += n;
+  }
+  return done;
+}
+
+static int tmpfs_write(vnode_t *file, off_t offset, const void *buf,
+                       size_t count) {
+  tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(file);
+  size_t done = 0;
+
+  KASSERT(S_ISREG(file->vn_mode));
+  KASSERT(file->vn_len == inode->ti_size);
+  if (count > (size_t)(INT_MAX - offset))
+    return -EFBIG;
+
+  while (done < count) {
+    uint32_t pagenum = ADDR_TO_PN(offset + done);
+    size_t pageoff = PAGE_OFFSET(offset + done);
+    size_t n = MIN(count - done, PAGE_SIZE - pageoff);
+    pframe_t *pf;
+    int err;
+
+    if (0 > (err = pframe_get(&file->vn_mmobj, pagenum, &pf))) {
+      if (!done)
+        return err;
+      break;
+    }
+    memcpy((char *)pf->pf_addr + pageoff, (const char *)buf + done, n);
+    done += n;
+  }
+
+  if (offset + (off_t)done > inode->ti_size) {
+    inode->ti_size = offset + done;
+    file->vn_len = inode->ti_size;
+  }
+  return done;
+}
+
+static int tmpfs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret) {
+  vref(file);
+  *ret = &file->vn_mmobj;
+  return 0;
+}
+
+/*
+ * Growing a file only changes its size, the new pages being zero-filled
+ * as they are touched. Shrinking frees the pages past the new end, which
+ * unmaps them from any process that has the file mapped, and zeroes the
+ * rest of the last page so that growing the file again reads zeros.
+ */
+static int tmpfs_truncate(vnode_t *file, off_t len) {
+  tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(file);
+  uint32_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(len));
+  pframe_t *pf;
+
+  KASSERT(S_ISREG(file->vn_mode));
+  if (len < inode->ti_size) {
+    list_iterate_begin(&file->vn_mmobj.mmo_respages, pf, pframe_t, pf_olink) {
+      if (pf->pf_pagenum < npages)
+        continue;
+      while (pframe_is_busy(pf))
+        sched_sleep_on(pframe_waitq(pf));
+      while (pframe_is_pinned(pf))
+        pframe_unpin(pf);
+      pframe_free(pf);
+    }
+    list_iterate_end();
+    if (PAGE_OFFSET(len) &&
+        NULL != (pf = pframe_get_resident(&file->vn_mmobj, ADDR_TO_PN(len))))
+      memset((char *)pf->pf_addr + PAGE_OFFSET(len), 0,
+             PAGE_SIZE - PAGE_OFFSET(len));
+  }
+  inode->ti_size = len;
+  file->vn_len = len;
+  return 0;
+}
+
+/* There is no backing store, so a new page starts out zeroed and is pinned
+ * until the file goes away */
+static int tmpfs_fillpage(vnode_t *vn, off_t offset, void *pagebuf) {
+  pframe_t *pf = pframe_get_resident(&vn->vn_mmobj, ADDR_TO_PN(offset));
+
+  KASSERT(pf && pf->pf_addr == pagebuf && pframe_is_busy(pf));
+  memset(pagebuf, 0, PAGE_SIZE);
+  pframe_pin(pf);
+  return 0;
+}
+
+static int tmpfs_dirtypage(vnode_t *vn, off_t offset) { return 0; }
+
+static int tmpfs_cleanpage(vnode_t *vn, off_t offset, void *pagebuf) {
+  return 0;
+}
+
+/*
+ * Directories
+ */
+
+static int tmpfs_make(vnode_t *dir, const char *name, size_t name_len,
+                      int mode, devid_t devid) {
+  tmpfs_t *tfs = VNODE_TO_TMPFS(dir);
+  int ino, err;
+
+  if (0 > (ino = tmpfs_alloc_inode(tfs, mode, devid)))
+    return ino;
+  if (S_ISDIR(mode))
+    tfs->tfs_inodes[ino]->ti_parent = dir->vn_vno;
+  if (0 > (err = tmpfs_add_entry(dir, name, name_len, ino))) {
+    tmpfs_free_inode(tfs, tfs->tfs_inodes[ino]);
+    return err;
+  }
+  return ino;
+}
+
+static int tmpfs_create(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result) {
+  int ino;
+
+  if (0 > (ino = tmpfs_make(dir, name, name_len, S_IFREG, 0)))
+    return ino;
+  *result = vget(dir->vn_fs, ino);
+  return 0;
+}
+
+static int tmpfs_mknod(vnode_t *dir, const char *name, size_t name_len,
+                       int mode, devid_t devid) {
+  int ino;
+
+  KASSERT(S_ISCHR(mode) || S_ISBLK(mode));
+  mode = S_ISCHR(mode) ? S_IFCHR : S_IFBLK;
+  if (0 > (ino = tmpfs_make(dir, name, name_len, mode, devid)))
+    return ino;
+  return 0;
+}
+
+static int tmpfs_lookup(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result) {
+  tmpfs_dirent_t *de;
+
+  if (name_match(".", name, name_len)) {
+    *result = vget(dir->vn_fs, dir->vn_vno);
+    return 0;
+  }
+  if (name_match("..", name, name_len)) {
+    *result = vget(dir->vn_fs, VNODE_TO_TMPFSINODE(dir)->ti_parent);
+    return 0;
+  }
+  if (NULL == (de = tmpfs_find(dir, name, name_len)))
+    return -ENOENT;
+  *result = vget(dir->vn_fs, de->td_ino);
+  return 0;
+}
+
+static int tmpfs_link(vnode_t *oldvnode, vnode_t *dir, const char *name,
+                      size_t name_len) {
+  int err;
+
+  KASSERT(oldvnode->vn_fs == dir->vn_fs);
+  if (0 > (err = tmpfs_add_entry(dir, name, name_len, oldvnode->vn_vno)))
+    return err;
+  VNODE_TO_TMPFSINODE(oldvnode)->ti_nlink++;
+  return 0;
+}
+
+static int tmpfs_unlink(vnode_t *dir, const char *name, size_t name_len) {
+  tmpfs_dirent_t *de = tmpfs_find(dir, name, name_len);
+  vnode_t *vn;
+
+  KASSERT(de);
+  vn = vget(dir->vn_fs, de->td_ino);
+  KASSERT(!S_ISDIR(vn->vn_mode));
+
+  tmpfs_remove_entry(dir, de);
+  VNODE_TO_TMPFSINODE(vn)->ti_nlink--;
+  /* if that was the last name, this frees the pages (and so unpins them)
+   * unless the file is still open */
+  vput(vn);
+  return 0;
+}
+
+static int tmpfs_mkdir(vnode_t *dir, const char *name, size_t name_len) {
+  int ino;
+
+  if (0 > (ino = tmpfs_make(dir, name, name_len, S_IFDIR, 0)))
+    return ino;
+  return 0;
+}
+
+static int tmpfs_rmdir(vnode_t *dir, const char *name, size_t name_len) {
+  tmpfs_dirent_t *de;
+  vnode_t *vn;
+
+  KASSERT(!name_match(".", name, name_len) &&
+          !name_match("..", name, name_len));
+
+  if (NULL == (de = tmpfs_find(dir, name, name_len)))
+    return -ENOENT;
+  vn = vget(dir->vn_fs, de->td_ino);
+  if (!S_ISDIR(vn->vn_mode)) {
+    vput(vn);
+    return -ENOTDIR;
+  }
+  if (0 < VNODE_TO_TMPFSINODE(vn)->ti_nentries) {
+    vput(vn);
+    return -ENOTEMPTY;
+  }
+
+  tmpfs_remove_entry(dir, de);
+  VNODE_TO_TMPFSINODE(vn)->ti_nlink--;
+  vput(vn);
+  return 0;
+}
+
+/* Returns how far to advance offset past the entry read, or 0 at the end */
+static int tmpfs_readdir(vnode_t *dir, off_t offset, struct dirent *d) {
+  tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(dir);
+  tmpfs_dirent_t *de;
+
+  KASSERT(S_ISDIR(dir->vn_mode));
+  d->d_off = 0; /* unused */
+  if (offset < 2) {
+    d->d_ino = offset ? inode->ti_parent : dir->vn_vno;
+    strcpy(d->d_name, offset ? ".." : ".");
+    return 1;
+  }
+  list_iterate_begin(&inode->ti_dirents, de, tmpfs_dirent_t, td_dlink) {
+    if (de->td_off >= offset) {
+      d->d_ino = de->td_ino;
+      strcpy(d->d_name, de->td_name);
+      return de->td_off + 1 - offset;
+    }
+  }
+  list_iterate_end();
+  return 0;
+}
+
+static int tmpfs_readdirv(vnode_t *dir, off_t offset, struct dirent *d, int n,
+                          int *nread) {
+  int ret, total = 0;
+
+  for (*nread = 0; *nread < n; ++*nread) {
+    if (0 == (ret = tmpfs_readdir(dir, offset + total, d + *nread)))
+      break;
+    total += ret;
+  }
+  return total;
+}
+
+static int tmpfs_stat(vnode_t *vn, struct stat *buf) {
+  tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(vn);
+
+  memset(buf, 0, sizeof(struct stat));
+  buf->st_mode = vn->vn_mode;
+  buf->st_ino = (int)vn->vn_vno;
+  buf->st_nlink = inode->ti_nlink;
+  if (S_ISCHR(vn->vn_mode) || S_ISBLK(vn->vn_mode))
+    buf->st_rdev = (int)inode->ti_devid;
+  if (S_ISDIR(vn->vn_mode))
+    buf->st_size = (2 + inode->ti_nentries) * (int)sizeof(struct dirent);
+  else
+    buf->st_size = (int)inode->ti_size;
+  buf->st_blksize = (int)PAGE_SIZE;
+  buf->st_blocks = vn->vn_mmobj.mmo_nrespages;
+  return 0;
+}
@@ -15,11 +15,15 @@
 #ifdef __S5FS__
 #include "fs/s5fs/s5fs.h"
 #endif
+#include "fs/dcache.h"
 #include "fs/vfs.h"
 #include "fs/file.h"
 #include "fs/vnode.h"
 #include "fs/vfs_syscall.h"
 #include "fs/ramfs/ramfs.h"
+#include "fs/devfs/devfs.h"
+#include "fs/statsfs/statsfs.h"
+#include "fs/tmpfs/tmpfs.h"
 
 #include "fs/stat.h"
 #include "fs/fcntl.h"
@@ -54,8 +58,19 @@ list_t mounted_fs_list;
  * This function is not meant to mount the root file system.
  */
 int vfs_mount(struct vnode *mtpt, fs_t *fs) {
-  NOT_YET_IMPLEMENTED("MOUNTING: vfs_mount");
-  return -EINVAL;
+  KASSERT(mtpt && fs && fs->fs_root);
+  if (!S_ISDIR(mtpt->vn_mode))
+    return -ENOTDIR;
+  if (mtpt->vn_mount != mtpt)
+    return -EBUSY;
+
+  /* The caller's reference on mtpt becomes the file system's */
+  fs->fs_mtpt = mtpt;
+  mtpt->vn_mount = fs->fs_root;
+  /* At the head so that vfs_shutdown unmounts the newest first, before
+   * anything it may be mounted on */
+  list_insert_head(&mounted_fs_list, &fs->fs_link);
+  return 0;
 }
 
 /*
@@ -72,8 +87,30 @@ int vfs_mount(struct vnode *mtpt, fs_t *fs) {
  * to unmount the root file system).
  */
 int vfs_umount(fs_t *fs) {
-  NOT_YET_IMPLEMENTED("MOUNTING: vfs_umount");
-  return -EINVAL;
+  vnode_t *mtpt = fs->fs_mtpt;
+  int ret;
+
+  if (fs == vfs_root_vn->vn_fs)
+    return -EINVAL;
+  if (0 > (ret = vfs_is_in_use(fs)))
+    return ret;
+
+  dcache_purge_fs(fs);
+  vnode_cache_stop(fs);
+  mtpt->vn_mount = mtpt;
+  list_remove(&fs->fs_link);
+
+  if (fs->fs_op->umount) {
+    ret = fs->fs_op->umount(fs);
+  } else {
+    vput(fs->fs_root);
+  }
+  KASSERT(!vnode_inuse(fs));
+
+  vput(mtpt);
+  vnode_table_destroy(fs);
+  kfree(fs);
+  return ret;
 }
 #endif /* __MOUNTING__ */
 
@@ -157,6 +194,9 @@ int vfs_shutdown() {
           "filesystem!!! This shouldn't happen!!\n");
   }
 
+  dcache_purge_fs(fs);
+  vnode_cache_stop(fs);
+
   if (vn->vn_fs->fs_op->umount) {
     ret = vn->vn_fs->fs_op->umount(fs);
   } else {
@@ -169,6 +209,7 @@ int vfs_shutdown() {
 
   vfs_root_vn = NULL; /* not /really/ necessary... */
 
+  vnode_table_destroy(fs);
   kfree(fs);
 
   return ret;
@@ -176,7 +217,7 @@ int vfs_shutdown() {
 
 /*
  * Given an fs_t, we search through the list of known file systems
- * and call the proper mount function.
+ * and call the proper mount function, with the fs's vnode table set up.
  */
 int mountfunc(fs_t *fs) {
   static const struct {
@@ -187,12 +228,24 @@ int mountfunc(fs_t *fs) {
         {"s5fs", s5fs_mount},
 #endif
         {"ramfs", ramfs_mount},
+        {"devfs", devfs_mount},
+        {"statsfs", statsfs_mount},
+        {"tmpfs", tmpfs_mount},
     };
   unsigned i;
-
-  for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
-    if (strcmp(fs->fs_type, types[i].fstype) == 0)
-      return types[i].mountfunc(fs);
+  int ret;
+
+  for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+    if (strcmp(fs->fs_type, types[i].fstype) == 0) {
+      if (0 > (ret = vnode_table_init(fs)))
+        return ret;
+      if (0 > (ret = types[i].mountfunc(fs)))
+        vnode_table_destroy(fs);
+      else
+        fs->fs_vcache = 1;
+      return ret;
+    }
+  }
 
   return -EINVAL;
 }
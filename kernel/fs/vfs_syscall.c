@@ -9,6 +9,7 @@
 #include "kernel.h"
 #include "errno.h"
 #include "globals.h"
+#include "fs/dcache.h"
 #include "fs/vfs.h"
 #include "fs/file.h"
 #include "fs/vnode.h"
@@ -16,12 +17,20 @@
 #include "fs/open.h"
 #include "fs/fcntl.h"
 #include "fs/lseek.h"
+#include "fs/uio.h"
+#include "fs/poll.h"
+#include "limits.h"
 #include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
 #include "util/string.h"
 #include "util/printf.h"
 #include "fs/stat.h"
 #include "util/debug.h"
 
+static int file_rw(file_t *f, off_t offset, const struct iovec *iov,
+                   int iovcnt, int write);
+
 /* To read a file:
  *      o fget(fd)
  *      o call its virtual read f_op
@@ -34,27 +43,45 @@
  *        fd is not a valid file descriptor or is not open for reading.
  *      o EISDIR
  *        fd refers to a directory.
+ *      o EAGAIN
+ *        fd is nonblocking and there is nothing to read yet.
  *
  * In all cases, be sure you do not leak file refcounts by returning before
  * you fput() a file that you fget()'ed.
  */
 int do_read(int fd, void *buf, size_t nbytes) {
   dbg(DBG_VFS, "\n");
-  file_t *f = fget(fd);
+  int put;
+  file_t *f = fget_light(fd, &put);
   if (!f || !(f->f_mode & FMODE_READ)) {
-    if (f) fput(f);
+    if (f) fput_light(f, put);
     return -EBADF;
   }
   if (f->f_vnode->vn_mode == S_IFDIR) {
-    fput(f);
+    fput_light(f, put);
     return -EISDIR;
   }
-  int out = f->f_vnode->vn_ops->read(f->f_vnode, f->f_pos, buf, nbytes);
-  f->f_pos += out;
-  fput(f);
+  int out;
+  if (f->f_mode & (FMODE_NONBLOCK | FMODE_DIRECT)) {
+    struct iovec iov = {buf, nbytes};
+    out = file_rw(f, f->f_pos, &iov, 1, 0);
+  } else {
+    out = f->f_vnode->vn_ops->read(f->f_vnode, f->f_pos, buf, nbytes);
+  }
+  if (out > 0)
+    f->f_pos += out;
+  fput_light(f, put);
   return out;
 }
 
+/* Holds back a writer which has been filling memory with dirty pages */
+static void write_throttle(file_t *f, int nwritten) {
+  vnode_t *vn = f->f_vnode;
+  if (0 < nwritten && S_ISREG(vn->vn_mode) && !(f->f_mode & FMODE_DIRECT))
+    pframe_throttle_dirty(vn->vn_fs,
+                          ((uint32_t)nwritten + PAGE_SIZE - 1) >> PAGE_SHIFT);
+}
+
 /* Very similar to do_read.  Check f_mode to be sure the file is writable.  If
  * f_mode & FMODE_APPEND, do_lseek() to the end of the file, call the write
  * f_op, and fput the file.  As always, be mindful of refcount leaks.
@@ -62,25 +89,554 @@ int do_read(int fd, void *buf, size_t nbytes) {
  * Error cases you must handle for this function at the VFS level:
  *      o EBADF
  *        fd is not a valid file descriptor or is not open for writing.
+ *      o EAGAIN
+ *        fd is nonblocking and there is no room to write yet.
  */
 int do_write(int fd, const void *buf, size_t nbytes) {
   dbg(DBG_VFS, "\n");
-  file_t *f = fget(fd);
+  int put;
+  file_t *f = fget_light(fd, &put);
   if (!f || !(f->f_mode & FMODE_WRITE)) {
-    if (f) fput(f);
+    if (f) fput_light(f, put);
     return -EBADF;
   }
   // Seek to end if appending
   if (f->f_mode & FMODE_APPEND)
     do_lseek(fd, 0, SEEK_END);
-  int out = f->f_vnode->vn_ops->write(f->f_vnode, f->f_pos, buf, nbytes);
-  f->f_pos += out;
-  fput(f);
+  int out;
+  vnode_exec_forget(f->f_vnode);
+  if (f->f_mode & (FMODE_NONBLOCK | FMODE_DIRECT)) {
+    struct iovec iov = {(void *)buf, nbytes};
+    out = file_rw(f, f->f_pos, &iov, 1, 1);
+  } else {
+    out = f->f_vnode->vn_ops->write(f->f_vnode, f->f_pos, buf, nbytes);
+  }
+  if (out > 0)
+    f->f_pos += out;
+  write_throttle(f, out);
+  fput_light(f, put);
   return out;
 }
 
+/* True if a read (or write) of f can go ahead without blocking */
+static int file_ready(file_t *f, int write) {
+  vnode_t *vn = f->f_vnode;
+  if (write)
+    return vn->vn_ops->poll(vn, POLLOUT, NULL) & (POLLOUT | POLLERR);
+  return vn->vn_ops->poll(vn, POLLIN, NULL) & (POLLIN | POLLHUP | POLLERR);
+}
+
+/*
+ * file_rw for a nonblocking file which can block: each transfer is made
+ * only once poll says it won't block, and writes go PIPE_BUF bytes at a
+ * time since that is all poll promises to take. Stops at the first
+ * transfer which can't be made, failing with EAGAIN if it was the first.
+ */
+static int file_rw_nonblock(file_t *f, off_t offset, const struct iovec *iov,
+                            int iovcnt, int write) {
+  vnode_ops_t *ops = f->f_vnode->vn_ops;
+  size_t len, done;
+  int i, n, total = 0;
+
+  for (i = 0; i < iovcnt; ++i) {
+    for (done = 0; done < iov[i].iov_len; done += n) {
+      if (!file_ready(f, write))
+        return total ? total : -EAGAIN;
+      len = iov[i].iov_len - done;
+      if (write) {
+        len = MIN(len, PIPE_BUF);
+        n = ops->write(f->f_vnode, offset + total,
+                       (char *)iov[i].iov_base + done, len);
+      } else {
+        n = ops->read(f->f_vnode, offset + total,
+                      (char *)iov[i].iov_base + done, len);
+      }
+      if (n < 0)
+        return total ? total : n;
+      total += n;
+      if ((size_t)n < len)
+        return total;
+    }
+  }
+  return total;
+}
+
+/*
+ * Transfers between f at offset and the iovcnt buffers of iov, as one
+ * vnode operation if the vnode has readv or writev, or else one buffer
+ * at a time until one comes up short. A file opened with O_DIRECT goes
+ * a buffer at a time through direct_io. Returns the number of bytes
+ * transferred, or -errno if nothing was.
+ */
+static int file_rw(file_t *f, off_t offset, const struct iovec *iov,
+                   int iovcnt, int write) {
+  vnode_ops_t *ops = f->f_vnode->vn_ops;
+  int i, n, total = 0;
+
+  if (write)
+    vnode_exec_forget(f->f_vnode);
+  if ((f->f_mode & FMODE_NONBLOCK) && ops->poll &&
+      (write ? (void *)ops->write : (void *)ops->read))
+    return file_rw_nonblock(f, offset, iov, iovcnt, write);
+  if ((f->f_mode & FMODE_DIRECT) && ops->direct_io) {
+    for (i = 0; i < iovcnt; ++i) {
+      n = ops->direct_io(f->f_vnode, offset + total, iov[i].iov_base,
+                         iov[i].iov_len, write);
+      if (n < 0)
+        return total ? total : n;
+      total += n;
+      if ((size_t)n < iov[i].iov_len)
+        break;
+    }
+    return total;
+  }
+  if (write && ops->writev)
+    return ops->writev(f->f_vnode, offset, iov, iovcnt);
+  if (!write && ops->readv)
+    return ops->readv(f->f_vnode, offset, iov, iovcnt);
+  if (NULL == (write ? (void *)ops->write : (void *)ops->read))
+    return -EINVAL;
+  for (i = 0; i < iovcnt; ++i) {
+    if (write)
+      n = ops->write(f->f_vnode, offset + total, iov[i].iov_base,
+                     iov[i].iov_len);
+    else
+      n = ops->read(f->f_vnode, offset + total, iov[i].iov_base,
+                    iov[i].iov_len);
+    if (n < 0)
+      return total ? total : n;
+    total += n;
+    if ((size_t)n < iov[i].iov_len)
+      break;
+  }
+  return total;
+}
+
+/*
+ * The common part of readv, writev, pread and pwrite: checks fd as
+ * do_read and do_write do, then transfers at offset or, if offset is
+ * negative, at (and advancing) f_pos.
+ *
+ * Error cases beyond do_read's and do_write's:
+ *      o EINVAL
+ *        iovcnt is not between 1 and IOV_MAX.
+ *      o ESPIPE
+ *        an offset was given for a pipe.
+ */
+static int do_rw(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                 int write) {
+  file_t *f;
+  int ret, put;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX)
+    return -EINVAL;
+  if (NULL == (f = fget_light(fd, &put)))
+    return -EBADF;
+  if (!(f->f_mode & (write ? FMODE_WRITE : FMODE_READ))) {
+    fput_light(f, put);
+    return -EBADF;
+  }
+  if (S_ISDIR(f->f_vnode->vn_mode)) {
+    fput_light(f, put);
+    return -EISDIR;
+  }
+  if (offset >= 0 && S_ISFIFO(f->f_vnode->vn_mode)) {
+    fput_light(f, put);
+    return -ESPIPE;
+  }
+  if (offset >= 0) {
+    ret = file_rw(f, offset, iov, iovcnt, write);
+  } else {
+    if (write && (f->f_mode & FMODE_APPEND))
+      f->f_pos = f->f_vnode->vn_len;
+    if (0 < (ret = file_rw(f, f->f_pos, iov, iovcnt, write)))
+      f->f_pos += ret;
+  }
+  if (write)
+    write_throttle(f, ret);
+  fput_light(f, put);
+  return ret;
+}
+
+/*
+ * Like do_read and do_write, but into or out of each of the iovcnt
+ * buffers of iov in turn.
+ */
+int do_readv(int fd, const struct iovec *iov, int iovcnt) {
+  dbg(DBG_VFS, "\n");
+  return do_rw(fd, iov, iovcnt, -1, 0);
+}
+
+int do_writev(int fd, const struct iovec *iov, int iovcnt) {
+  dbg(DBG_VFS, "\n");
+  return do_rw(fd, iov, iovcnt, -1, 1);
+}
+
+/*
+ * Like do_read and do_write, but at the given offset, leaving f_pos
+ * alone, so that threads sharing a file need not race to seek it. Writes
+ * go to offset even if the file was opened for appending.
+ *
+ * Error cases beyond do_read's and do_write's:
+ *      o EINVAL
+ *        offset is negative.
+ *      o ESPIPE
+ *        fd refers to a pipe.
+ */
+int do_pread(int fd, void *buf, size_t nbytes, off_t offset) {
+  dbg(DBG_VFS, "\n");
+  struct iovec iov = {buf, nbytes};
+  if (offset < 0)
+    return -EINVAL;
+  return do_rw(fd, &iov, 1, offset, 0);
+}
+
+int do_pwrite(int fd, const void *buf, size_t nbytes, off_t offset) {
+  dbg(DBG_VFS, "\n");
+  struct iovec iov = {(void *)buf, nbytes};
+  if (offset < 0)
+    return -EINVAL;
+  return do_rw(fd, &iov, 1, offset, 1);
+}
+
+/* Where a sendfile is writing to */
+typedef struct sendfile_dest {
+  file_t *sd_file;
+  off_t sd_pos;
+} sendfile_dest_t;
+
+static int sendfile_actor(void *arg, const void *buf, size_t len) {
+  sendfile_dest_t *sd = (sendfile_dest_t *)arg;
+  vnode_t *vn = sd->sd_file->f_vnode;
+  vnode_exec_forget(vn);
+  int n = vn->vn_ops->write(vn, sd->sd_pos, buf, len);
+  if (n > 0)
+    sd->sd_pos += n;
+  return n;
+}
+
+/*
+ * Copies up to count bytes from in_fd to out_fd inside the kernel. If the
+ * source has splice_read, its pages are written out as they are, without
+ * being copied at all; otherwise they go through a page of kernel memory.
+ * Reads from *offset, updating it, if offset is not NULL, and otherwise
+ * from (and advancing) in_fd's f_pos. Writes at (and advances) out_fd's
+ * position. Returns the number of bytes copied, or -errno if none were.
+ *
+ * Error cases:
+ *      o EBADF
+ *        in_fd is not open for reading or out_fd is not open for writing.
+ *      o EINVAL
+ *        in_fd refers to a directory, either file cannot be read or
+ *        written as needed, or *offset is negative.
+ *      o ESPIPE
+ *        an offset was given for a pipe.
+ */
+int do_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+  dbg(DBG_VFS, "\n");
+  file_t *in = NULL;
+  sendfile_dest_t sd = {NULL, 0};
+  vnode_t *vn;
+  off_t pos;
+  char *buf = NULL;
+  int n, ret = 0;
+  size_t len, total = 0;
+
+  if (NULL == (in = fget(in_fd)) || !(in->f_mode & FMODE_READ) ||
+      NULL == (sd.sd_file = fget(out_fd)) ||
+      !(sd.sd_file->f_mode & FMODE_WRITE)) {
+    ret = -EBADF;
+    goto out;
+  }
+  vn = in->f_vnode;
+  if (S_ISDIR(vn->vn_mode) || NULL == vn->vn_ops->read ||
+      NULL == sd.sd_file->f_vnode->vn_ops->write || (offset && *offset < 0)) {
+    ret = -EINVAL;
+    goto out;
+  }
+  if (offset && S_ISFIFO(vn->vn_mode)) {
+    ret = -ESPIPE;
+    goto out;
+  }
+  pos = offset ? *offset : in->f_pos;
+  if (sd.sd_file->f_mode & FMODE_APPEND)
+    sd.sd_file->f_pos = sd.sd_file->f_vnode->vn_len;
+  sd.sd_pos = sd.sd_file->f_pos;
+
+  if (vn->vn_ops->splice_read) {
+    ret = vn->vn_ops->splice_read(vn, pos, count, sendfile_actor, &sd);
+    if (ret < 0)
+      goto out;
+    total = ret;
+  } else {
+    if (NULL == (buf = (char *)page_alloc())) {
+      ret = -ENOMEM;
+      goto out;
+    }
+    while (total < count) {
+      len = MIN(PAGE_SIZE, count - total);
+      if (0 < (n = vn->vn_ops->read(vn, pos + total, buf, len)))
+        n = sendfile_actor(&sd, buf, n);
+      if (n <= 0) {
+        if (!total)
+          ret = n;
+        break;
+      }
+      total += n;
+      if ((size_t)n < len)
+        break;
+    }
+    if (!total && ret < 0)
+      goto out;
+  }
+  ret = total;
+  if (offset)
+    *offset = pos + total;
+  else
+    in->f_pos = pos + total;
+  sd.sd_file->f_pos = sd.sd_pos;
+out:
+  if (buf)
+    page_free(buf);
+  if (sd.sd_file)
+    fput(sd.sd_file);
+  if (in)
+    fput(in);
+  return ret;
+}
+
+/*
+ * Gets (F_GETFL) the access mode and status flags of fd, as open's
+ * oflags, or sets (F_SETFL) its O_APPEND, O_NONBLOCK and O_DIRECT flags
+ * to those in arg. The flags belong to the open file, so they are shared
+ * with dups. F_GETCOMPRESS and F_SETCOMPRESS get and set whether the
+ * file system keeps the file's data compressed, which belongs to the
+ * file itself; F_SETCOMPRESS returns whether it was.
+ *
+ * Error cases:
+ *      o EBADF
+ *        fd isn't a valid open file descriptor, or is not open for
+ *        writing for F_SETCOMPRESS.
+ *      o EINVAL
+ *        cmd is none of the above, O_DIRECT is set for a file which
+ *        can't do direct I/O, or the file can't be compressed.
+ *      o EBUSY
+ *        F_SETCOMPRESS would change a file which isn't empty.
+ */
+int do_fcntl(int fd, int cmd, int arg) {
+  dbg(DBG_VFS, "\n");
+  file_t *f;
+  int ret = 0;
+
+  if (NULL == (f = fget(fd)))
+    return -EBADF;
+  switch (cmd) {
+  case F_GETFL:
+    if ((f->f_mode & FMODE_READ) && (f->f_mode & FMODE_WRITE))
+      ret = O_RDWR;
+    else if (f->f_mode & FMODE_WRITE)
+      ret = O_WRONLY;
+    else
+      ret = O_RDONLY;
+    if (f->f_mode & FMODE_APPEND)
+      ret |= O_APPEND;
+    if (f->f_mode & FMODE_NONBLOCK)
+      ret |= O_NONBLOCK;
+    if (f->f_mode & FMODE_DIRECT)
+      ret |= O_DIRECT;
+    break;
+  case F_SETFL:
+    if ((arg & O_DIRECT) && NULL == f->f_vnode->vn_ops->direct_io) {
+      ret = -EINVAL;
+      break;
+    }
+    f->f_mode &= FMODE_READ | FMODE_WRITE;
+    if (arg & O_APPEND)
+      f->f_mode |= FMODE_APPEND;
+    if (arg & O_NONBLOCK)
+      f->f_mode |= FMODE_NONBLOCK;
+    if (arg & O_DIRECT)
+      f->f_mode |= FMODE_DIRECT;
+    break;
+  case F_GETCOMPRESS:
+  case F_SETCOMPRESS:
+    if (!S_ISREG(f->f_vnode->vn_mode) || NULL == f->f_vnode->vn_ops->compress)
+      ret = -EINVAL;
+    else if (F_SETCOMPRESS == cmd && !(f->f_mode & FMODE_WRITE))
+      ret = -EBADF;
+    else
+      ret = f->f_vnode->vn_ops->compress(f->f_vnode,
+                                         F_GETCOMPRESS == cmd ? -1 : !!arg);
+    break;
+  default:
+    ret = -EINVAL;
+  }
+  fput(f);
+  return ret;
+}
+
+/*
+ * Advise the page cache how the file at fd is about to be used, from
+ * offset for len bytes (to the end of the file if len is 0).
+ * POSIX_FADV_NORMAL, _RANDOM and _SEQUENTIAL set how the file system reads
+ * ahead, for the whole file; POSIX_FADV_WILLNEED reads the range in and
+ * POSIX_FADV_DONTNEED lets its pages go.
+ *
+ * Error cases you must handle for this function at the VFS level:
+ *      o EBADF
+ *        fd isn't a valid open file descriptor.
+ *      o ESPIPE
+ *        fd is a pipe.
+ *      o EINVAL
+ *        offset or len is negative, or advice is not one of the above.
+ */
+int do_fadvise(int fd, off_t offset, off_t len, int advice) {
+  file_t *f;
+  vnode_t *vn;
+  uint32_t lo, hi, end;
+
+  if (offset < 0 || len < 0 || advice < POSIX_FADV_NORMAL ||
+      advice > POSIX_FADV_DONTNEED)
+    return -EINVAL;
+  if (NULL == (f = fget(fd)))
+    return -EBADF;
+  vn = f->f_vnode;
+  if (S_ISFIFO(vn->vn_mode)) {
+    fput(f);
+    return -ESPIPE;
+  }
+  /* Nothing past the end of the file is cached */
+  end = (uint32_t)vn->vn_len;
+  if (len && (uint32_t)len < end - MIN((uint32_t)offset, end))
+    end = (uint32_t)offset + (uint32_t)len;
+  lo = (uint32_t)offset >> PAGE_SHIFT;
+  hi = (end + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  switch (advice) {
+  case POSIX_FADV_WILLNEED:
+    vnode_readahead(vn, lo, hi);
+    break;
+  case POSIX_FADV_DONTNEED:
+    vnode_dontneed(vn, lo, hi);
+    break;
+  default:
+    vn->vn_ra_advice = advice;
+    vn->vn_ra_window = 0;
+  }
+  fput(f);
+  return 0;
+}
+
 /*
- * Zero curproc->p_files[fd], and fput() the file. Return 0 on success
+ * Write back the file at fd's dirty pages and then, through the file
+ * system's fsync operation, its metadata, so that all of it will survive
+ * a crash. Only this file's pages are written; nothing else is waited
+ * for. With datasync set (fdatasync(2)), metadata which isn't needed to
+ * read the data back may be left for later.
+ *
+ * Error cases you must handle for this function at the VFS level:
+ *      o EBADF
+ *        fd isn't a valid open file descriptor.
+ *      o EINVAL
+ *        fd is not a regular file or directory.
+ */
+int do_fsync(int fd, int datasync) {
+  file_t *f;
+  vnode_t *vn;
+  int ret;
+
+  if (NULL == (f = fget(fd)))
+    return -EBADF;
+  vn = f->f_vnode;
+  if (!S_ISREG(vn->vn_mode) && !S_ISDIR(vn->vn_mode)) {
+    fput(f);
+    return -EINVAL;
+  }
+  ret = vnode_flush(vn);
+  if (!ret && NULL != vn->vn_ops->fsync)
+    ret = vn->vn_ops->fsync(vn, datasync);
+  fput(f);
+  return ret;
+}
+
+/*
+ * Set the size of the file at fd to len. Blocks past the new end are
+ * freed; a file which grows reads as zeros up to len.
+ *
+ * Error cases you must handle for this function at the VFS level:
+ *      o EBADF
+ *        fd isn't a valid open file descriptor, or is not open for
+ *        writing.
+ *      o EINVAL
+ *        len is negative, or fd is not a regular file on a file system
+ *        which can truncate.
+ */
+int do_ftruncate(int fd, off_t len) {
+  file_t *f;
+  vnode_t *vn;
+  int ret;
+
+  if (len < 0)
+    return -EINVAL;
+  if (NULL == (f = fget(fd)))
+    return -EBADF;
+  vn = f->f_vnode;
+  if (!(f->f_mode & FMODE_WRITE))
+    ret = -EBADF;
+  else if (!S_ISREG(vn->vn_mode) || NULL == vn->vn_ops->truncate)
+    ret = -EINVAL;
+  else {
+    vnode_exec_forget(vn);
+    ret = vn->vn_ops->truncate(vn, len);
+  }
+  fput(f);
+  return ret;
+}
+
+/*
+ * Only FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE is supported: make
+ * [offset, offset + len) of the file at fd a hole, freeing its blocks,
+ * without changing the file's size.
+ *
+ * Error cases you must handle for this function at the VFS level:
+ *      o EBADF
+ *        fd isn't a valid open file descriptor, or is not open for
+ *        writing.
+ *      o EINVAL
+ *        offset is negative or len is not positive.
+ *      o ENODEV
+ *        fd is not a regular file.
+ *      o EOPNOTSUPP
+ *        mode is anything else, or the file system can't punch holes.
+ */
+int do_fallocate(int fd, int mode, off_t offset, off_t len) {
+  file_t *f;
+  vnode_t *vn;
+  int ret;
+
+  if (offset < 0 || len <= 0)
+    return -EINVAL;
+  if ((FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE) != mode)
+    return -EOPNOTSUPP;
+  if (NULL == (f = fget(fd)))
+    return -EBADF;
+  vn = f->f_vnode;
+  if (!(f->f_mode & FMODE_WRITE))
+    ret = -EBADF;
+  else if (!S_ISREG(vn->vn_mode))
+    ret = -ENODEV;
+  else if (NULL == vn->vn_ops->punch_hole)
+    ret = -EOPNOTSUPP;
+  else {
+    vnode_exec_forget(vn);
+    ret = vn->vn_ops->punch_hole(vn, offset, len);
+  }
+  fput(f);
+  return ret;
+}
+
+/*
+ * Take fd out of curproc's fd table, and fput() the file. Return 0 on
+ * success
  *
  * Error cases you must handle for this function at the VFS level:
  *      o EBADF
@@ -88,11 +644,10 @@ int do_write(int fd, const void *buf, size_t nbytes) {
  */
 int do_close(int fd) {
   dbg(DBG_VFS, "\n");
-  if (fd < 0 || fd >= NFILES) return -EBADF;
-  file_t *f = curproc->p_files[fd];
-  if (!f) return -EBADF;
-  curproc->p_files[fd] = NULL;
-  fput(f);
+  if (!fdtable_get(curproc->p_fdt, fd)) return -EBADF;
+  int status = fd_private(curproc, -1);
+  if (status) return status;
+  fput(fdtable_clear(curproc->p_fdt, fd));
   return 0;
 }
 
@@ -118,11 +673,11 @@ int do_dup(int fd) {
   file_t *f = fget(fd);
   if (!f) return -EBADF;
   int new_fd = get_empty_fd(curproc);
-  if (new_fd == -EMFILE) {
+  if (new_fd < 0) {
     fput(f);
-    return -EMFILE;
+    return new_fd;
   }
-  curproc->p_files[new_fd] = f;
+  fdtable_set(curproc->p_fdt, new_fd, f);
   return new_fd;
 }
 
@@ -139,17 +694,19 @@ int do_dup2(int ofd, int nfd) {
   dbg(DBG_VFS, "\n");
   if (ofd == -1) return -EBADF;
   file_t *f = fget(ofd);
-  if (!f || nfd < 0 || nfd >= NFILES) {
-    if (f) fput(f);
-    return -EBADF;
-  }
+  if (!f) return -EBADF;
   if (ofd == nfd) {
     fput(f);  
     return nfd;
   }
-  if (curproc->p_files[nfd])
+  int status = fd_private(curproc, nfd);
+  if (status) {
+    fput(f);
+    return status;
+  }
+  if (fdtable_get(curproc->p_fdt, nfd))
     do_close(nfd);
-  curproc->p_files[nfd] = f;
+  fdtable_set(curproc->p_fdt, nfd, f);
   return nfd;
 }
 
@@ -204,6 +761,7 @@ int do_mknod(const char *path, int mode, unsigned devid) {
   }
   dbg(DBG_VFS, "making node: %s\n", path);
   status = dir->vn_ops->mknod(dir, name, namelen, mode, devid);
+  dcache_remove(dir, name, namelen);
   vput(dir);
   return status;
 }
@@ -244,6 +802,7 @@ int do_mkdir(const char *path) {
   }
 
   ret_code = dir->vn_ops->mkdir(dir, name, namelen);
+  dcache_remove(dir, name, namelen);
   dbg(DBG_VFS, "vnode mkdir returned %d\n", ret_code);
   vput(dir);
   return ret_code;
@@ -283,6 +842,7 @@ int do_rmdir(const char *path) {
     return -ENOTEMPTY;
   }
   status = dir->vn_ops->rmdir(dir, name, namelen);
+  dcache_remove(dir, name, namelen);
   dbg(DBG_VFS, "status: %d\n", status);
   vput(dir);
   return status;
@@ -321,6 +881,7 @@ int do_unlink(const char *path) {
   }
   vput(res);
   status = dir->vn_ops->unlink(dir, name, namelen);
+  dcache_remove(dir, name, namelen);
   vput(dir);
   return status;
 }
@@ -375,6 +936,7 @@ int do_link(const char *from, const char *to) {
     return status;
   }
   status = res_to_dir->vn_ops->link(res_from, res_to_dir, name, namelen);
+  dcache_remove(res_to_dir, name, namelen);
   vput(res_from);
   vput(res_to_dir);
   return status;
@@ -387,6 +949,8 @@ int do_link(const char *from, const char *to) {
  * Note that this does not provide the same behavior as the
  * Linux system call (if unlink fails then two links to the
  * file could exist).
+ *
+ * do_link and do_unlink keep the name cache up to date for both names.
  */
 int do_rename(const char *oldname, const char *newname) {
   dbg(DBG_VFS, "\n");
@@ -442,6 +1006,39 @@ int do_chdir(const char *path) {
  *      o ENOTDIR
  *        File descriptor does not refer to a directory.
  */
+/*
+ * Like do_getdent, but reads as many directory entries as fit in count
+ * bytes. Returns the number of bytes of dirents read, 0 at the end of the
+ * directory, or -errno.
+ */
+int do_getdents(int fd, struct dirent *dirp, size_t count) {
+  dbg(DBG_VFS, "\n");
+  int n = count / sizeof(dirent_t), nread = 0, result = 0;
+  if (!n) return -EINVAL;
+  file_t *f = fget(fd);
+  if (!f) return -EBADF;
+  vnode_t *dir = f->f_vnode;
+  if (!S_ISDIR(dir->vn_mode)) {
+    fput(f);
+    return -ENOTDIR;
+  }
+  if (dir->vn_ops->readdirv) {
+    result = dir->vn_ops->readdirv(dir, f->f_pos, dirp, n, &nread);
+    if (result > 0)
+      f->f_pos += result;
+  } else {
+    while (nread < n &&
+           0 < (result = dir->vn_ops->readdir(dir, f->f_pos, dirp + nread))) {
+      f->f_pos += result;
+      ++nread;
+    }
+  }
+  fput(f);
+  if (result < 0 && !nread)
+    return result;
+  return nread * sizeof(dirent_t);
+}
+
 int do_getdent(int fd, struct dirent *dirp) {
   dbg(DBG_VFS, "\n");
   if (fd == -1) return -EBADF;
@@ -474,10 +1071,11 @@ int do_lseek(int fd, int offset, int whence) {
   dbg(DBG_VFS, "\n");
   // Input validation
   if (fd == -1) return -EBADF;
-  file_t *f = fget(fd);
+  int put;
+  file_t *f = fget_light(fd, &put);
   if (!f) return -EBADF;
   if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
-    fput(f);
+    fput_light(f, put);
     return -EINVAL;
   }
   int new_pos;
@@ -489,15 +1087,27 @@ int do_lseek(int fd, int offset, int whence) {
     new_pos = f->f_vnode->vn_len + offset;
   }
   if (new_pos < 0) {
-    fput(f);
+    fput_light(f, put);
     return -EINVAL;
   }
   f->f_pos = new_pos;
   int ret = f->f_pos;
-  fput(f);
+  fput_light(f, put);
   return ret;
 }
 
+/*
+ * The stat() vnode operation, on a zeroed buffer so no file system leaves
+ * kernel memory in the fields it does not set. Not every file system
+ * records a device's id either, so the vnode's is used.
+ */
+static int vnode_stat(vnode_t *vn, struct stat *buf) {
+  memset(buf, 0, sizeof(*buf));
+  if (S_ISCHR(vn->vn_mode) || S_ISBLK(vn->vn_mode))
+    buf->st_rdev = (int)vn->vn_devid;
+  return vn->vn_ops->stat(vn, buf);
+}
+
 /*
  * Find the vnode associated with the path, and call the stat() vnode operation.
  *
@@ -514,7 +1124,61 @@ int do_stat(const char *path, struct stat *buf) {
   struct vnode *res;
   int status = open_namev(path, O_RDONLY, &res, NULL);
   if (status) return status;
-  status = res->vn_ops->stat(res, buf);
+  status = vnode_stat(res, buf);
+  vput(res);
+  return status;
+}
+
+/*
+ * Like do_stat(), of an open file. This is how a program finds out what
+ * its descriptors are, e.g. whether stdout is a terminal.
+ *
+ * Error cases you must handle for this function at the VFS level:
+ *      o EBADF
+ *        fd is not an open file descriptor.
+ */
+int do_fstat(int fd, struct stat *buf) {
+  file_t *f;
+  int status, put;
+
+  if (NULL == (f = fget_light(fd, &put)))
+    return -EBADF;
+  status = vnode_stat(f->f_vnode, buf);
+  fput_light(f, put);
+  return status;
+}
+
+/*
+ * Like do_stat(), but a relative path is looked up from the directory
+ * open on dirfd rather than the current directory (unless dirfd is
+ * AT_FDCWD). Listing a directory this way resolves only each entry's own
+ * name, not the directory's path all over again.
+ *
+ * Error cases you must handle for this function at the VFS level:
+ *      o EBADF
+ *        path is relative and dirfd is not an open file descriptor.
+ *      o ENOTDIR
+ *        path is relative and dirfd is not open on a directory.
+ */
+int do_fstatat(int dirfd, const char *path, struct stat *buf) {
+  vnode_t *res;
+  file_t *f = NULL;
+  int status, put;
+
+  if (path[0] != '/' && dirfd != AT_FDCWD) {
+    if (NULL == (f = fget_light(dirfd, &put)))
+      return -EBADF;
+    if (!S_ISDIR(f->f_vnode->vn_mode)) {
+      fput_light(f, put);
+      return -ENOTDIR;
+    }
+  }
+  status = open_namev(path, O_RDONLY, &res, f ? f->f_vnode : NULL);
+  if (f)
+    fput_light(f, put);
+  if (status)
+    return status;
+  status = vnode_stat(res, buf);
   vput(res);
   return status;
 }
@@ -537,8 +1201,50 @@ int do_stat(const char *path, struct stat *buf) {
  * so you should not write arbitrary length strings to them.
  */
 int do_mount(const char *source, const char *target, const char *type) {
-  NOT_YET_IMPLEMENTED("MOUNTING: do_mount");
-  return -EINVAL;
+  vnode_t *mtpt;
+  fs_t *fs;
+  int ret;
+
+  if (strlen(type) >= STR_MAX || (source && strlen(source) >= STR_MAX))
+    return -ENAMETOOLONG;
+  if (0 > (ret = open_namev(target, 0, &mtpt, NULL)))
+    return ret;
+  if (!S_ISDIR(mtpt->vn_mode)) {
+    vput(mtpt);
+    return -ENOTDIR;
+  }
+  /* Something is already mounted here, and mtpt is its root */
+  if (mtpt == mtpt->vn_fs->fs_root) {
+    vput(mtpt);
+    return -EBUSY;
+  }
+
+  if (NULL == (fs = kmalloc(sizeof(fs_t)))) {
+    vput(mtpt);
+    return -ENOMEM;
+  }
+  memset(fs, 0, sizeof(fs_t));
+  strcpy(fs->fs_type, type);
+  if (source)
+    strcpy(fs->fs_dev, source);
+  if (0 > (ret = mountfunc(fs))) {
+    vput(mtpt);
+    kfree(fs);
+    return ret;
+  }
+
+  /* vfs_mount keeps the reference on mtpt */
+  if (0 > (ret = vfs_mount(mtpt, fs))) {
+    vnode_cache_stop(fs);
+    if (fs->fs_op->umount)
+      fs->fs_op->umount(fs);
+    else
+      vput(fs->fs_root);
+    vput(mtpt);
+    vnode_table_destroy(fs);
+    kfree(fs);
+  }
+  return ret;
 }
 
 /*
@@ -553,7 +1259,17 @@ int do_mount(const char *source, const char *target, const char *type) {
  * checking.
  */
 int do_umount(const char *target) {
-  NOT_YET_IMPLEMENTED("MOUNTING: do_umount");
-  return -EINVAL;
+  vnode_t *root;
+  fs_t *fs;
+  int ret;
+
+  if (0 > (ret = open_namev(target, 0, &root, NULL)))
+    return ret;
+  fs = root->vn_fs;
+  vput(root);
+  /* target must name the root of a mounted file system */
+  if (root != fs->fs_root || fs == vfs_root_vn->vn_fs)
+    return -EINVAL;
+  return vfs_umount(fs);
 }
 #endif
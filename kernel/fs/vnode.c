@@ -11,10 +11,15 @@
 #include "util/printf.h"
 #include "errno.h"
 #include "fs/stat.h"
+#include "fs/dcache.h"
+#include "fs/poll.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
+#include "mm/kmalloc.h"
+#include "mm/shrinker.h"
 #include "mm/slab.h"
 #include "proc/sched.h"
+#include "proc/spinlock.h"
 #include "util/debug.h"
 #include "vm/vmmap.h"
 #include "globals.h"
@@ -23,6 +28,46 @@ static slab_allocator_t *vnode_allocator;
 
 static list_t vnode_inuse_list;
 
+/*
+ * In-core vnodes are also on their file system's fs_vnodes and hashed by
+ * vno in its fs_vhash, so vget need not scan the whole list and one file
+ * system's vnodes can be gone through without the others'. Threads
+ * waiting for a busy vnode sleep on its bucket's queue, which is
+ * broadcast whenever a vnode in the bucket stops being busy or goes away.
+ */
+typedef struct vnode_bucket {
+  list_t vb_list;
+  ktqueue_t vb_waitq;
+} vnode_bucket_t;
+
+#define VNODE_HASH_SIZE (1 << VNODE_HASH_ORDER)
+
+/* Protects vnode_inuse_list and every file system's fs_vnodes and
+ * fs_vhash; never held across anything that can block */
+static spinlock_t vnode_inuse_lock;
+
+/* vget calls which found the vnode in core, and which had to read it */
+static uint32_t vnode_nhits = 0;
+static uint32_t vnode_nmisses = 0;
+
+/*
+ * Vnodes which nobody references any more but whose files still exist
+ * are kept in core, least recently used at the head, so that a file
+ * opened again soon (a program run over and over, a directory walked
+ * again) need not have its inode read back in. There are at most
+ * VNODE_CACHE_MAX of them, and the vnode_cache shrinker gives back more
+ * when memory runs short. vget takes a vnode off the list again. Under
+ * vnode_inuse_lock.
+ */
+static list_t vnode_unused_list;
+static uint32_t vnode_nunused = 0;
+static uint32_t vnode_nunused_hits = 0; /* of vnode_nhits */
+
+static vnode_bucket_t *vnode_bucket(struct fs *fs, ino_t vno) {
+  return &fs->fs_vhash[((uint32_t)vno * 0x9e3779b1U) >>
+                       (32 - VNODE_HASH_ORDER)];
+}
+
 /* Related to vnodes representing special files: */
 static void init_special_vnode(vnode_t *vn);
 static int special_file_read(vnode_t *file, off_t offset, void *buf,
@@ -31,6 +76,7 @@ static int special_file_write(vnode_t *file, off_t offset, const void *buf,
                               size_t count);
 static int special_file_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
 static int special_file_stat(vnode_t *vnode, struct stat *ss);
+static int special_file_poll(vnode_t *file, int events, poll_table_t *pt);
 static int special_file_fillpage(vnode_t *file, off_t offset, void *pagebuf);
 static int special_file_dirtypage(vnode_t *file, off_t offset);
 static int special_file_cleanpage(vnode_t *file, off_t offset, void *pagebuf);
@@ -43,13 +89,20 @@ static int vlookuppage(mmobj_t *o, uint32_t pagenum, int forwrite,
 static int vreadpage(mmobj_t *o, pframe_t *pf);
 static int vdirtypage(mmobj_t *o, pframe_t *pf);
 static int vcleanpage(mmobj_t *o, pframe_t *pf);
+static int vcleanpages(mmobj_t *o, pframe_t **pfs, int npages);
+
+static shrinker_t vnode_shrinker;
+static shrinker_t vnode_cache_shrinker;
+static void vnode_destroy(vnode_t *vn);
 
-static mmobj_ops_t vnode_mmobj_ops = {.ref = vo_vref,
+static mmobj_ops_t vnode_mmobj_ops = {.name = "vnode",
+                                      .ref = vo_vref,
                                       .put = vo_vput,
                                       .lookuppage = vlookuppage,
                                       .fillpage = vreadpage,
                                       .dirtypage = vdirtypage,
-                                      .cleanpage = vcleanpage};
+                                      .cleanpage = vcleanpage,
+                                      .cleanpages = vcleanpages};
 
 /* vnode operations tables for special files: */
 static vnode_ops_t bytedev_spec_vops = {.read = special_file_read,
@@ -64,6 +117,7 @@ static vnode_ops_t bytedev_spec_vops = {.read = special_file_read,
                                         .rmdir = NULL,
                                         .readdir = NULL,
                                         .stat = special_file_stat,
+                                        .poll = special_file_poll,
                                         .fillpage = special_file_fillpage,
                                         .dirtypage = special_file_dirtypage,
                                         .cleanpage = special_file_cleanpage};
@@ -87,11 +141,48 @@ static vnode_ops_t blockdev_spec_vops = {.read = NULL,
 /*
  * Initialization:
  */
+
+/* A free vnode's lock is always left unlocked, so it is only set up once
+ * per slab */
+static void vnode_ctor(void *obj) {
+  vnode_t *vn = obj;
+
+  memset(vn, 0, sizeof(vnode_t));
+  krwlock_init(&vn->vn_lock);
+}
+
 static __attribute__((unused)) void vnode_init(void) {
   list_init(&vnode_inuse_list);
-  vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t));
+  list_init(&vnode_unused_list);
+  spinlock_init(&vnode_inuse_lock, "vnode_inuse");
+  vnode_allocator =
+      slab_allocator_create_ctor("vnode", sizeof(vnode_t), vnode_ctor, NULL);
+  shrinker_register(&vnode_shrinker);
+  shrinker_register(&vnode_cache_shrinker);
 }
 init_func(vnode_init);
+init_depends(shrinker_init);
+
+int vnode_table_init(struct fs *fs) {
+  int i;
+
+  if (NULL == (fs->fs_vhash = kmalloc(VNODE_HASH_SIZE *
+                                      sizeof(vnode_bucket_t))))
+    return -ENOMEM;
+  for (i = 0; i < VNODE_HASH_SIZE; ++i) {
+    list_init(&fs->fs_vhash[i].vb_list);
+    sched_queue_init(&fs->fs_vhash[i].vb_waitq);
+  }
+  list_init(&fs->fs_vnodes);
+  fs->fs_vcache = 0;
+  return 0;
+}
+
+void vnode_table_destroy(struct fs *fs) {
+  KASSERT(list_empty(&fs->fs_vnodes));
+  kfree(fs->fs_vhash);
+  fs->fs_vhash = NULL;
+}
 
 /*
  * Core vnode management routines:
@@ -106,13 +197,15 @@ void vref(vnode_t *vn) {
 
 vnode_t *vget(struct fs *fs, ino_t vno) {
   dbg(DBG_VNREF, "ino %d\n", vno);
+  vnode_bucket_t *b = vnode_bucket(fs, vno);
   vnode_t *vn = NULL;
 
   KASSERT(fs);
 
 /* look for inuse vnode */
 find:
-  list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+  spin_lock(&vnode_inuse_lock);
+  list_iterate_begin(&b->vb_list, vn, vnode_t, vn_hlink) {
     if ((vn->vn_fs == fs) && (vn->vn_vno == vno)) {
       /* found it... */
       if (VN_BUSY & vn->vn_flags) {
@@ -124,10 +217,21 @@ find:
             "vget: wow, found vnode busy (0x%p, 0x%p ino %ld refcount %d)\n",
             vn, vn->vn_fs, (long)vn->vn_vno, vn->vn_refcount);
 
-        sched_sleep_on(&vn->vn_waitq);
+        spin_unlock(&vnode_inuse_lock);
+        sched_sleep_on(&b->vb_waitq);
         goto find;
       }
 
+      vnode_nhits++;
+      if (0 == vn->vn_refcount) {
+        /* unused, so nothing can be mounted on it */
+        list_remove(&vn->vn_ulink);
+        vnode_nunused--;
+        vnode_nunused_hits++;
+        vn->vn_refcount = 1;
+        spin_unlock(&vnode_inuse_lock);
+        return vn;
+      }
 #ifndef __MOUNTING__
       /* If we are implementing mountpoint support
          then we should get the mounted vnode,
@@ -135,9 +239,11 @@ find:
          mounted then vn->vn_mount should
          point back to vn) */
       vref(vn);
+      spin_unlock(&vnode_inuse_lock);
       return vn;
 #else
       vref(vn->vn_mount);
+      spin_unlock(&vnode_inuse_lock);
       return vn->vn_mount;
 #endif
     }
@@ -145,9 +251,11 @@ find:
   list_iterate_end();
 
   /* if we got here, we didn't find the vnode. */
-  /*   alloc a new vnode: */
+  /*   alloc a new vnode: (still holding the list lock, so nobody
+   *   else can bring the same vnode in meanwhile) */
   vn = slab_obj_alloc(vnode_allocator);
   if (!vn) {
+    spin_unlock(&vnode_inuse_lock);
     dbg(DBG_VNREF, "vget: kmem has been exhausted. "
                    "will then re-attempt to vget vnode later %d of fs %p\n",
         vno, fs);
@@ -155,14 +263,15 @@ find:
     sched_switch();
     goto find;
   }
-  memset(vn, 0, sizeof(vnode_t));
+  vnode_nmisses++;
+  /* everything but vn_lock, which vnode_ctor set up */
+  memset(vn, 0, offsetof(vnode_t, vn_lock));
+  memset(&vn->vn_i, 0, sizeof(vnode_t) - offsetof(vnode_t, vn_i));
   /*   initialize its contents: */
   /*     members that can be initialized here: */
   vn->vn_fs = fs;
   vn->vn_vno = vno;
-  kmutex_init(&vn->vn_mutex);
   mmobj_init(&vn->vn_mmobj, &vnode_mmobj_ops);
-  sched_queue_init(&vn->vn_waitq);
 
 #ifdef __MOUNTING__
   vn->vn_mount = vn;
@@ -180,6 +289,9 @@ find:
    */
   vn->vn_flags |= VN_BUSY;
   list_insert_head(&vnode_inuse_list, &vn->vn_link);
+  list_insert_head(&fs->fs_vnodes, &vn->vn_fslink);
+  list_insert_head(&b->vb_list, &vn->vn_hlink);
+  spin_unlock(&vnode_inuse_lock);
 
   KASSERT(vn->vn_fs->fs_op && vn->vn_fs->fs_op->read_vnode);
   /*       this is where we might block (depending on the underlying
@@ -187,6 +299,7 @@ find:
   vn->vn_fs->fs_op->read_vnode(vn);
 
   vn->vn_flags &= ~VN_BUSY;
+  sched_broadcast_on(&b->vb_waitq);
 
   /*     for special files: */
   if (S_ISCHR(vn->vn_mode) || S_ISBLK(vn->vn_mode))
@@ -197,11 +310,47 @@ find:
   return vn;
 }
 
+/*
+ * Frees up to n vnodes from the head of the unused list, only those of fs
+ * if it is not NULL. Each is marked busy as it comes off the list, so
+ * that a vget of it waits for it to be gone rather than taking it back.
+ * Returns how many were freed.
+ */
+static uint32_t vnode_cache_evict(uint32_t n, struct fs *fs) {
+  vnode_t *vn;
+  uint32_t nfreed = 0;
+
+  while (nfreed < n) {
+    spin_lock(&vnode_inuse_lock);
+    list_iterate_begin(&vnode_unused_list, vn, vnode_t, vn_ulink) {
+      if (NULL == fs || vn->vn_fs == fs)
+        goto found;
+    }
+    list_iterate_end();
+    spin_unlock(&vnode_inuse_lock);
+    break;
+  found:
+    list_remove(&vn->vn_ulink);
+    vnode_nunused--;
+    vn->vn_flags |= VN_BUSY;
+    spin_unlock(&vnode_inuse_lock);
+    vnode_destroy(vn);
+    nfreed++;
+  }
+  return nfreed;
+}
+
+void vnode_cache_stop(struct fs *fs) {
+  fs->fs_vcache = 0;
+  vnode_cache_evict((uint32_t)-1, fs);
+}
+
 /*
  * - decrement vn->vn_refcount
  * - if it is zero
  *     - (vn->vn_nrespages should also be zero)
- *     - free the vnode
+ *     - if the file still exists, keep the vnode on the unused list
+ *     - otherwise free the vnode
  *
  * - (otherwise it is > zero)
  *
@@ -249,7 +398,11 @@ void vput(struct vnode *vn) {
        * definately free the page, if they have it busy.
        */
       while (pframe_is_busy(vp))
-        sched_sleep_on(&(vp->pf_waitq));
+        sched_sleep_on(pframe_waitq(vp));
+      /* a file system with nothing behind its pages (tmpfs) keeps them
+       * pinned for as long as the file exists */
+      while (pframe_is_pinned(vp))
+        pframe_unpin(vp);
       pframe_free(vp);
     }
     list_iterate_end();
@@ -268,29 +421,48 @@ void vput(struct vnode *vn) {
   KASSERT(vn->vn_mount == vn);
 #endif
 
-  /* no res pages and no more active references; free the vnode */
+  /* no res pages and no more active references */
   KASSERT(0 == vn->vn_refcount);
   KASSERT(0 == vn->vn_nrespages);
 
+  if (vn->vn_fs->fs_vcache && vn->vn_fs->fs_op->query_vnode(vn)) {
+    spin_lock(&vnode_inuse_lock);
+    list_insert_tail(&vnode_unused_list, &vn->vn_ulink);
+    vnode_nunused++;
+    spin_unlock(&vnode_inuse_lock);
+    if (vnode_nunused > VNODE_CACHE_MAX)
+      vnode_cache_evict(1, NULL);
+    return;
+  }
+
   vn->vn_flags |= VN_BUSY;
+  vnode_destroy(vn);
+}
+
+/* Frees an unreferenced vnode, which the caller has marked busy */
+static void vnode_destroy(vnode_t *vn) {
+  KASSERT(VN_BUSY & vn->vn_flags);
+  /* an unlinked directory's inode is about to be freed and may be reused,
+   * so forget anything cached about the names that were in it */
+  if (S_ISDIR(vn->vn_mode) && !vn->vn_fs->fs_op->query_vnode(vn))
+    dcache_purge_dir(vn->vn_fs, vn->vn_vno);
   if (vn->vn_fs->fs_op->delete_vnode) {
     vn->vn_fs->fs_op->delete_vnode(vn);
   }
 /* (really no need to clear VN_BUSY): */
 
-#ifndef NDEBUG
-  if (!sched_queue_empty(&vn->vn_waitq)) {
-    dbg(DBG_VNREF, "vput: wow, found thread(s) trying to vget "
-                   "(%p, %p ino %ld) after returning from delete_vnode.\n",
-        vn, vn->vn_fs, (long)vn->vn_vno);
-  }
-#endif
+  spin_lock(&vnode_inuse_lock);
+  list_remove(&vn->vn_link); /* remove from vn_inuse_list */
+  list_remove(&vn->vn_fslink);
+  list_remove(&vn->vn_hlink);
+  spin_unlock(&vnode_inuse_lock);
 
   /* wake up anyone who might have attempted to vget this vnode while
-   * we were taking it away: */
-  sched_broadcast_on(&vn->vn_waitq);
-
-  list_remove(&vn->vn_link); /* remove from vn_inuse_list */
+   * we were taking it away (they will find it gone and bring it back
+   * in themselves): */
+  sched_broadcast_on(&vnode_bucket(vn->vn_fs, vn->vn_vno)->vb_waitq);
+  vnode_exec_forget(vn);
+  KASSERT(!vn->vn_lock.krw_writer && !vn->vn_lock.krw_readers);
   slab_obj_free(vnode_allocator, vn);
 }
 
@@ -309,20 +481,17 @@ int vfs_is_in_use(fs_t *fs) {
    *             - return -EBUSY
    *
    */
-  list_t *list = &vnode_inuse_list;
+  list_t *list = &fs->fs_vnodes;
   list_link_t *link;
   int ret = 0;
+  spin_lock(&vnode_inuse_lock);
   for (link = list->l_next; link != list; link = link->l_next) {
-    vnode_t *vn = list_item(link, vnode_t, vn_link);
+    vnode_t *vn = list_item(link, vnode_t, vn_fslink);
     int refs;
 
     KASSERT(vn->vn_refcount >= vn->vn_nrespages);
     KASSERT(vn->vn_nrespages >= 0);
-
-    if (fs != vn->vn_fs)
-      continue;
-
-    /* otherwise, vn belongs to the given fs */
+    KASSERT(fs == vn->vn_fs);
 
     /* if it is the root vnode and it has more than one
      * reference
@@ -344,46 +513,80 @@ int vfs_is_in_use(fs_t *fs) {
       ret = -EBUSY;
     }
   }
+  spin_unlock(&vnode_inuse_lock);
 
   return ret;
 }
 
-void vnode_flush_all(struct fs *fs) {
+/*
+ * Find a resident page of some in-use vnode of fs, dirty if 'dirty' is set.
+ * The list lock is dropped before returning, since cleaning or freeing the
+ * page can block or vput the vnode; callers restart the scan after each
+ * page.
+ */
+static pframe_t *vnode_find_respage(struct fs *fs, int dirty) {
   vnode_t *v;
+  pframe_t *p;
+  list_link_t *vl, *pl;
+
+  spin_lock(&vnode_inuse_lock);
+  for (vl = fs->fs_vnodes.l_next; vl != &fs->fs_vnodes; vl = vl->l_next) {
+    v = list_item(vl, vnode_t, vn_fslink);
+    for (pl = v->vn_mmobj.mmo_respages.l_next;
+         pl != &v->vn_mmobj.mmo_respages; pl = pl->l_next) {
+      p = list_item(pl, pframe_t, pf_olink);
+      if (!dirty || pframe_is_dirty(p)) {
+        spin_unlock(&vnode_inuse_lock);
+        return p;
+      }
+    }
+  }
+  spin_unlock(&vnode_inuse_lock);
+  return NULL;
+}
+
+void vnode_flush_all(struct fs *fs) {
   pframe_t *p;
   int err;
 
-clean:
-  list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
-    list_iterate_begin(&v->vn_mmobj.mmo_respages, p, pframe_t, pf_olink) {
-      dbg(DBG_VFS, "vno: %d pno: %d pflags: %d &p: %p\n", v->vn_vno, p->pf_pagenum, 
-          p->pf_flags, &p->pf_flags);
-      if (pframe_is_dirty(p)) {
-        if (0 > (err = pframe_clean(p))) {
-          dbg(DBG_VFS, "vnode_flush_all: WARNING: failed to clean page %d of "
-                       "vnode %ld of fs %p of type %s\n",
-              p->pf_pagenum, (long)v->vn_vno, v->vn_fs, v->vn_fs->fs_type);
-        }
-        KASSERT((!err) && "as things presently stand, "
-                          "this shouldn't happen");
-        /* This may have blocked. */
-        goto clean;
-      }
+  while (NULL != (p = vnode_find_respage(fs, 1))) {
+    vnode_t *v = CONTAINER_OF(p->pf_obj, vnode_t, vn_mmobj);
+    dbg(DBG_VFS, "vno: %d pno: %d pflags: %d &p: %p\n", v->vn_vno,
+        p->pf_pagenum, p->pf_flags, &p->pf_flags);
+    if (0 > (err = pframe_clean(p))) {
+      dbg(DBG_VFS, "vnode_flush_all: WARNING: failed to clean page %d of "
+                   "vnode %ld of fs %p of type %s\n",
+          p->pf_pagenum, (long)v->vn_vno, v->vn_fs, v->vn_fs->fs_type);
     }
-    list_iterate_end();
+    KASSERT((!err) && "as things presently stand, "
+                      "this shouldn't happen");
   }
-  list_iterate_end();
 
   /* all pages of all vnodes belonging to this fs have been cleaned.
    * Now, uncache all of them: */
-  list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
-    list_iterate_begin(&v->vn_mmobj.mmo_respages, p, pframe_t, pf_olink) {
-      KASSERT(!pframe_is_dirty(p));
-      pframe_free(p);
-    }
-    list_iterate_end();
+  while (NULL != (p = vnode_find_respage(fs, 0))) {
+    KASSERT(!pframe_is_dirty(p));
+    pframe_free(p);
   }
-  list_iterate_end();
+}
+
+void vnode_foreach_respage(struct fs *fs, void (*fn)(pframe_t *, void *),
+                           void *arg) {
+  vnode_t *v;
+  list_link_t *vl, *pl;
+
+  spin_lock(&vnode_inuse_lock);
+  for (vl = fs->fs_vnodes.l_next; vl != &fs->fs_vnodes; vl = vl->l_next) {
+    v = list_item(vl, vnode_t, vn_fslink);
+    for (pl = v->vn_mmobj.mmo_respages.l_next;
+         pl != &v->vn_mmobj.mmo_respages; pl = pl->l_next)
+      fn(list_item(pl, pframe_t, pf_olink), arg);
+  }
+  spin_unlock(&vnode_inuse_lock);
+}
+
+int vnode_flush(vnode_t *vn) {
+  return pframe_writeback_obj(&vn->vn_mmobj);
 }
 
 /*
@@ -393,14 +596,181 @@ int vnode_inuse(struct fs *fs) {
   vnode_t *vn;
   int n = 0;
 
+  spin_lock(&vnode_inuse_lock);
+  list_iterate_begin(&fs->fs_vnodes, vn, vnode_t, vn_fslink) {
+    KASSERT(vn->vn_fs == fs);
+    n++;
+  }
+  list_iterate_end();
+  spin_unlock(&vnode_inuse_lock);
+  return n;
+}
+
+size_t vnode_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  list_link_t *link;
+  int n = 0;
+
+  KASSERT(NULL == arg);
+  spin_lock(&vnode_inuse_lock);
+  for (link = vnode_inuse_list.l_next; link != &vnode_inuse_list;
+       link = link->l_next)
+    n++;
+  spin_unlock(&vnode_inuse_lock);
+  iprintf(&buf, &size, "incore %d\n", n);
+  iprintf(&buf, &size, "unused %u\n", vnode_nunused);
+  iprintf(&buf, &size, "hits %u\n", vnode_nhits);
+  iprintf(&buf, &size, "unused_hits %u\n", vnode_nunused_hits);
+  iprintf(&buf, &size, "misses %u\n", vnode_nmisses);
+  return size;
+}
+
+vnode_t *vnode_of_mmobj(mmobj_t *o) {
+  return &vnode_mmobj_ops == o->mmo_ops ? CONTAINER_OF(o, vnode_t, vn_mmobj)
+                                        : NULL;
+}
+
+void vnode_readahead(vnode_t *vn, uint32_t lo, uint32_t hi) {
+  if (lo < hi && NULL != vn->vn_ops->readahead)
+    vn->vn_ops->readahead(vn, lo, hi - lo);
+}
+
+/*
+ * A page still in someone's page tables would only be faulted back in,
+ * so such pages, like dirty ones, just go to the head of the inactive
+ * list. The caller's reference keeps the vnode around while the pages
+ * go, and freeing them doesn't block.
+ */
+void vnode_dontneed(vnode_t *vn, uint32_t lo, uint32_t hi) {
+  pframe_t *pf;
+
+  list_iterate_begin(&vn->vn_mmobj.mmo_respages, pf, pframe_t, pf_olink) {
+    if (pf->pf_pagenum < lo || hi <= pf->pf_pagenum || pframe_is_busy(pf) ||
+        pframe_is_pinned(pf))
+      continue;
+    if (pframe_is_dirty(pf) || !list_empty(&pf->pf_rmaps) ||
+        (pf->pf_flags & PF_RMAP_LOST))
+      pframe_reclaim_soon(pf);
+    else
+      pframe_free(pf);
+  }
+  list_iterate_end();
+}
+
+void vnode_drop_pages(vnode_t *vn, uint32_t lo, uint32_t hi) {
+  pframe_t *pf;
+
+again:
+  list_iterate_begin(&vn->vn_mmobj.mmo_respages, pf, pframe_t, pf_olink) {
+    if (pf->pf_pagenum < lo || hi <= pf->pf_pagenum)
+      continue;
+    KASSERT(!pframe_is_pinned(pf));
+    if (pframe_is_busy(pf)) {
+      sched_sleep_on(pframe_waitq(pf));
+      goto again;
+    }
+    pframe_free(pf);
+  }
+  list_iterate_end();
+}
+
+void vnode_exec_forget(vnode_t *vn) {
+  if (NULL != vn->vn_exec && VN_EXEC_BUILDING != vn->vn_exec)
+    kfree(vn->vn_exec);
+  vn->vn_exec = NULL;
+}
+
+/*
+ * Shrinker for passively-referenced vnodes, that is, those of files no
+ * one has open or mapped which are kept only for their cached pages.
+ * Their clean pages are freed all at once, along with the vnode itself
+ * once the last one goes, rather than waiting for each page to reach the
+ * end of the inactive list.
+ */
+#define vnode_is_passive(vn)                                                   \
+  (!((vn)->vn_flags & VN_BUSY) && 0 < (vn)->vn_nrespages &&                    \
+   (vn)->vn_refcount == (vn)->vn_nrespages)
+
+static uint32_t vnode_shrink_count(void) {
+  vnode_t *vn;
+  uint32_t n = 0;
+
+  spin_lock(&vnode_inuse_lock);
   list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
-    if (vn->vn_fs == fs)
-      n++;
+    if (vnode_is_passive(vn))
+      n += vn->vn_nrespages;
   }
   list_iterate_end();
+  spin_unlock(&vnode_inuse_lock);
   return n;
 }
 
+static uint32_t vnode_shrink_scan(uint32_t nr) {
+  vnode_t *vn;
+  pframe_t *pf;
+  uint32_t nfreed = 0, nvisit = 0;
+  list_link_t *link;
+
+  spin_lock(&vnode_inuse_lock);
+  for (link = vnode_inuse_list.l_next; link != &vnode_inuse_list;
+       link = link->l_next)
+    nvisit++;
+  spin_unlock(&vnode_inuse_lock);
+
+  /* Take vnodes from the head and put them back at the tail, so that
+   * each is looked at once however the list changes while we block */
+  while (nfreed < nr && nvisit--) {
+    spin_lock(&vnode_inuse_lock);
+    if (list_empty(&vnode_inuse_list)) {
+      spin_unlock(&vnode_inuse_lock);
+      break;
+    }
+    vn = list_head(&vnode_inuse_list, vnode_t, vn_link);
+    list_remove(&vn->vn_link);
+    list_insert_tail(&vnode_inuse_list, &vn->vn_link);
+    spin_unlock(&vnode_inuse_lock);
+    if (!vnode_is_passive(vn))
+      continue;
+
+    /* Our reference keeps it from going away under us; freeing its pages
+     * doesn't block */
+    vref(vn);
+    list_iterate_begin(&vn->vn_mmobj.mmo_respages, pf, pframe_t, pf_olink) {
+      if (pframe_is_busy(pf) || pframe_is_dirty(pf) || pframe_is_pinned(pf))
+        continue;
+      pframe_free(pf);
+      nfreed++;
+    }
+    list_iterate_end();
+    /* frees the vnode if it has no pages left */
+    vput(vn);
+  }
+  return nfreed;
+}
+
+static shrinker_t vnode_shrinker = {.sh_name = "vnode",
+                                    .sh_count = vnode_shrink_count,
+                                    .sh_scan = vnode_shrink_scan};
+
+/*
+ * Shrinker for the unused list, counting vnodes by the slab memory they
+ * take up. What their file systems keep for them (an s5fs vnode holds
+ * its inode's block pinned) comes back with them.
+ */
+#define VNODES_PER_PAGE (PAGE_SIZE / sizeof(vnode_t))
+
+static uint32_t vnode_cache_count(void) {
+  return vnode_nunused / VNODES_PER_PAGE;
+}
+
+static uint32_t vnode_cache_scan(uint32_t nr) {
+  return vnode_cache_evict(nr * VNODES_PER_PAGE, NULL) / VNODES_PER_PAGE;
+}
+
+static shrinker_t vnode_cache_shrinker = {.sh_name = "vnode_cache",
+                                          .sh_count = vnode_cache_count,
+                                          .sh_scan = vnode_cache_scan};
+
 static void init_special_vnode(vnode_t *vn) {
   if (S_ISCHR(vn->vn_mode)) {
     vn->vn_ops = &bytedev_spec_vops;
@@ -438,6 +808,16 @@ static int special_file_write(vnode_t *file, off_t offset, const void *buf,
   return file->vn_cdev->cd_ops->write(file->vn_cdev, offset, buf, count);
 }
 
+/*
+ * Pass poll through to the byte device, which is always ready if it
+ * doesn't say otherwise.
+ */
+static int special_file_poll(vnode_t *file, int events, poll_table_t *pt) {
+  if (file->vn_bdev || !file->vn_cdev->cd_ops->poll)
+    return POLLIN | POLLOUT;
+  return file->vn_cdev->cd_ops->poll(file->vn_cdev, events, pt);
+}
+
 /* Memory map the special file represented by <file>. All of the
  * work for this function is device-specific, so look up the
  * file's bytedev_t and pass the arguments through to its mmap
@@ -446,8 +826,9 @@ static int special_file_write(vnode_t *file, off_t offset, const void *buf,
  * Do not worry about this until VM.
  */
 static int special_file_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret) {
-  NOT_YET_IMPLEMENTED("VM: special_file_mmap");
-  return 0;
+  if (file->vn_bdev || !file->vn_cdev->cd_ops->mmap)
+    return -ENODEV;
+  return file->vn_cdev->cd_ops->mmap(file, vma, ret);
 }
 
 /* Stat is currently the only filesystem specific routine that we have to worry
@@ -546,3 +927,21 @@ static int vcleanpage(mmobj_t *o, pframe_t *pf) {
   vnode_t *v = mmobj_to_vnode(o);
   return v->vn_ops->cleanpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);
 }
+
+static int vcleanpages(mmobj_t *o, pframe_t **pfs, int npages) {
+  KASSERT(NULL != o);
+  KASSERT(0 < npages && npages <= PF_WRITEBACK_MAX);
+
+  vnode_t *v = mmobj_to_vnode(o);
+  void *bufs[PF_WRITEBACK_MAX];
+  int status = 0, i;
+  if (NULL == v->vn_ops->cleanpages) {
+    for (i = 0; !status && i < npages; ++i)
+      status = vcleanpage(o, pfs[i]);
+    return status;
+  }
+  for (i = 0; i < npages; ++i)
+    bufs[i] = pfs[i]->pf_addr;
+  return v->vn_ops->cleanpages(v, (int)PN_TO_ADDR(pfs[0]->pf_pagenum), bufs,
+                               npages);
+}
@@ -5,11 +5,19 @@
 struct proc;
 struct argstr;
 struct argvec;
+struct regs;
 
 int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes);
 int copy_to_user(void *uaddr, const void *kaddr, size_t nbytes);
 
+/* Called on a page fault in the kernel; returns 1 if it was one of the
+ * copies above touching user memory, which then carries on without the
+ * rest of it, and 0 for a real kernel bug */
+int access_fixup(struct regs *regs, uintptr_t vaddr);
+
 char *user_strdup(struct argstr *ustr);
+char *user_getpath(struct argstr *ustr);
+void user_putpath(char *path);
 char **user_vecdup(struct argvec *uvec);
 
 int range_perm(struct proc *p, const void *vaddr, size_t len, int perm);
@@ -0,0 +1,32 @@
+/*  perf.h - hardware performance counters, per thread
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+#define PERF_CYCLES 0       /* core cycles, not counting halted ones */
+#define PERF_INSTRUCTIONS 1 /* instructions retired */
+#define PERF_LLC_MISSES 2   /* last level cache misses */
+#define PERF_DTLB_MISSES 3  /* data loads missing the TLB, which walk */
+#define PERF_NCOUNTERS 4
+
+/* The events the calling thread has caused since it was created, in
+ * userland and in the kernel on its behalf. Only counters with their bit
+ * in pc_valid count anything; the others are 0. */
+typedef struct perf_counts {
+  uint32_t pc_valid;
+  uint32_t pc_pad;
+  uint64_t pc_count[PERF_NCOUNTERS];
+} perf_counts_t;
+
+#ifdef __KERNEL__
+int do_perf_read(perf_counts_t *pc);
+#else
+int perf_read(perf_counts_t *pc);
+#endif
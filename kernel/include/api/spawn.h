@@ -0,0 +1,26 @@
+/*  spawn.h - starting a program in a new process without fork
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#define SPAWN_DUP2 1  /* dup2(sa_fd, sa_newfd) in the new process */
+#define SPAWN_CLOSE 2 /* close(sa_fd) in the new process */
+
+#define SPAWN_ACTIONS_MAX 32
+
+/* Done in order to the spawner's file descriptors before the program
+ * starts */
+struct spawn_action {
+  int sa_op;
+  int sa_fd;
+  int sa_newfd;
+};
+
+#ifdef __KERNEL__
+int do_spawn(const char *filename, char *const *argv, char *const *envp,
+             const struct spawn_action *actions, int nactions);
+#else
+int spawn(const char *filename, char *const argv[], char *const envp[],
+          const struct spawn_action *actions, int nactions);
+#endif
@@ -40,12 +40,12 @@
 #define SYS_munmap 26
 #define SYS_rename 27 /* NYI */
 #define SYS_uname 28
-#define SYS_thr_create 29 /* NYI */
+#define SYS_thr_create 29
 #define SYS_thr_cancel 30
 #define SYS_thr_exit 31
 #define SYS_thr_yield 32
-#define SYS_thr_join 33 /* NYI */
-#define SYS_gettid 34   /* NYI */
+#define SYS_thr_join 33
+#define SYS_gettid 34
 #define SYS_getpid 35
 #define SYS_errno 39
 #define SYS_halt 40
@@ -56,6 +56,46 @@
 #define SYS_mount 45
 #define SYS_umount 46
 #define SYS_stat 47
+#define SYS_nanosleep 48
+#define SYS_readv 49
+#define SYS_writev 50
+#define SYS_pread 51
+#define SYS_pwrite 52
+#define SYS_sendfile 53
+#define SYS_poll 54
+#define SYS_epoll_create 55
+#define SYS_epoll_ctl 56
+#define SYS_epoll_wait 57
+#define SYS_fcntl 58
+#define SYS_io_setup 59
+#define SYS_io_submit 60
+#define SYS_io_getevents 61
+#define SYS_spawn 62
+#define SYS_brk_populate 63
+#define SYS_madvise 64
+#define SYS_fadvise 65
+#define SYS_set_tls 66
+#define SYS_futex 67
+#define SYS_thr_detach 68
+#define SYS_getrusage 69
+#define SYS_times 70
+#define SYS_sched_setaffinity 71
+#define SYS_sched_getaffinity 72
+#define SYS_sysenter 73 /* 1 if SYSENTER may be used instead of the trap */
+#define SYS_mremap 74
+#define SYS_fstat 75
+#define SYS_perf_read 76
+#define SYS_fsync 77
+#define SYS_fdatasync 78
+#define SYS_ftruncate 79
+#define SYS_fallocate 80
+#define SYS_clock_gettime 81
+#define SYS_socketpair 82
+#define SYS_sendmsg 83
+#define SYS_recvmsg 84
+#define SYS_socket 85
+#define SYS_bind 86
+#define SYS_fstatat 87
 
 /*
  * ... what does the scouter say about his syscall?
@@ -67,6 +107,14 @@
 
 struct regs;
 struct stat;
+struct timespec;
+struct iovec;
+struct pollfd;
+struct epoll_event;
+struct io_sqe;
+struct io_cqe;
+struct spawn_action;
+struct msghdr;
 
 typedef struct argstr {
   const char *as_str;
@@ -98,6 +146,19 @@ typedef struct munmap_args {
   size_t len;
 } munmap_args_t;
 
+typedef struct madvise_args {
+  void *addr;
+  size_t len;
+  int advice;
+} madvise_args_t;
+
+typedef struct mremap_args {
+  void *addr;
+  size_t oldlen;
+  size_t newlen;
+  int flags;
+} mremap_args_t;
+
 typedef struct open_args {
   argstr_t filename;
   int flags;
@@ -116,6 +177,131 @@ typedef struct write_args {
   size_t nbytes;
 } write_args_t;
 
+typedef struct readv_args {
+  int fd;
+  const struct iovec *iov;
+  int iovcnt;
+} readv_args_t;
+
+typedef struct writev_args {
+  int fd;
+  const struct iovec *iov;
+  int iovcnt;
+} writev_args_t;
+
+typedef struct pread_args {
+  int fd;
+  void *buf;
+  size_t nbytes;
+  off_t offset;
+} pread_args_t;
+
+typedef struct pwrite_args {
+  int fd;
+  const void *buf;
+  size_t nbytes;
+  off_t offset;
+} pwrite_args_t;
+
+typedef struct sendfile_args {
+  int out_fd;
+  int in_fd;
+  off_t *offset;
+  size_t count;
+} sendfile_args_t;
+
+typedef struct poll_args {
+  struct pollfd *fds;
+  unsigned int nfds;
+  int timeout;
+} poll_args_t;
+
+typedef struct fcntl_args {
+  int fd;
+  int cmd;
+  int arg;
+} fcntl_args_t;
+
+typedef struct thr_create_args {
+  void *entry; /* where the thread starts, in userland */
+  void *stack; /* its initial stack pointer */
+  void *tls;   /* base of its %gs segment */
+} thr_create_args_t;
+
+typedef struct thr_join_args {
+  int tid;
+  void **retval;
+} thr_join_args_t;
+
+typedef struct thr_cancel_args {
+  int tid;
+  void *retval;
+} thr_cancel_args_t;
+
+typedef struct futex_args {
+  int *uaddr;
+  int op;
+  int val;
+  int *uaddr2; /* the requeue operations only, as are val2 and val3 */
+  int val2;
+  int val3;
+} futex_args_t;
+
+typedef struct getrusage_args {
+  int who;
+  struct rusage *ru;
+} getrusage_args_t;
+
+typedef struct sched_affinity_args {
+  int tid; /* a thread of the calling process, 0 for the caller */
+  uint32_t *mask;
+} sched_affinity_args_t;
+
+typedef struct fadvise_args {
+  int fd;
+  off_t offset;
+  off_t len;
+  int advice;
+} fadvise_args_t;
+
+typedef struct ftruncate_args {
+  int fd;
+  off_t len;
+} ftruncate_args_t;
+
+typedef struct fallocate_args {
+  int fd;
+  int mode;
+  off_t offset;
+  off_t len;
+} fallocate_args_t;
+
+typedef struct epoll_ctl_args {
+  int epfd;
+  int op;
+  int fd;
+  struct epoll_event *event;
+} epoll_ctl_args_t;
+
+typedef struct epoll_wait_args {
+  int epfd;
+  struct epoll_event *events;
+  int maxevents;
+  int timeout;
+} epoll_wait_args_t;
+
+typedef struct io_submit_args {
+  const struct io_sqe *sqes;
+  int nr;
+} io_submit_args_t;
+
+typedef struct io_getevents_args {
+  struct io_cqe *cqes;
+  int min_nr;
+  int nr;
+  int timeout;
+} io_getevents_args_t;
+
 typedef struct mkdir_args {
   argstr_t path;
   int mode;
@@ -132,6 +318,14 @@ typedef struct execve_args {
   argvec_t envp;
 } execve_args_t;
 
+typedef struct spawn_args {
+  argstr_t filename;
+  argvec_t argv;
+  argvec_t envp;
+  const struct spawn_action *actions;
+  int nactions;
+} spawn_args_t;
+
 typedef struct rename_args {
   argstr_t oldname;
   argstr_t newname;
@@ -167,4 +361,64 @@ typedef struct stat_args {
   struct stat *buf;
 } stat_args_t;
 
+typedef struct fstat_args {
+  int fd;
+  struct stat *buf;
+} fstat_args_t;
+
+typedef struct fstatat_args {
+  int dirfd;
+  argstr_t path;
+  struct stat *buf;
+} fstatat_args_t;
+
+typedef struct nanosleep_args {
+  const struct timespec *req;
+  struct timespec *rem;
+} nanosleep_args_t;
+
+typedef struct clock_gettime_args {
+  int clk;
+  struct timespec *tp;
+} clock_gettime_args_t;
+
+typedef struct socketpair_args {
+  int domain;
+  int type;
+  int protocol;
+  int *sv;
+} socketpair_args_t;
+
+typedef struct sendmsg_args {
+  int fd;
+  const struct msghdr *msg;
+  int flags;
+} sendmsg_args_t;
+
+typedef struct recvmsg_args {
+  int fd;
+  struct msghdr *msg;
+  int flags;
+} recvmsg_args_t;
+
+typedef struct socket_args {
+  int domain;
+  int type;
+  int protocol;
+} socket_args_t;
+
+typedef struct bind_args {
+  int fd;
+  const struct sockaddr *addr;
+  uint32_t addrlen;
+} bind_args_t;
+
 struct utsname;
+
+#ifdef __KERNEL__
+/* A dbg_infofunc_t: how many times each system call has been made, by
+ * number */
+size_t syscall_info(const void *arg, char *buf, size_t osize);
+/* A dbg_infofunc_t: latency percentiles of each system call, in usecs */
+size_t syscall_latency_info(const void *arg, char *buf, size_t osize);
+#endif
@@ -12,23 +12,79 @@
  * kernel configuration parameters
  */
 #define DEFAULT_STACK_SIZE (56 * 1024) /* size of stacks */
+#define KSTACK_CACHE_MAX 16            /* freed kernel stacks kept for reuse */
+#define KSTACK_STATS 0                 /* measure kernel stack depth per thread function */
+#define PAGEDIR_CACHE_MAX 16           /* freed page directories kept for reuse */
 #define TICK_MSECS 10                  /* msecs between clock interrupts */
+#define SCHED_NPRIO 8                  /* run queue priority levels */
+#define SCHED_BOOST_TICKS 100          /* ticks between priority boosts */
+#define WQ_MAX_WORKERS 4               /* most kworker threads in the workqueue pool */
+#define KMUTEX_SPIN_LIMIT 1000         /* spins before a mutex waiter sleeps */
+#define KMUTEX_PI_DEPTH 8              /* mutex chain priority inheritance follows */
+#define KMUTEX_STATS 0                 /* keep contention statistics per kmutex_init site */
+#define INTR_CPU_DISK 0                /* processor disk interrupts are delivered to */
+#define INTR_CPU_KEYBOARD 0            /* and keyboard interrupts */
+#define INTR_CPU_NET 0                 /* and network interrupts */
+#define SERIAL_TTY 1                   /* a tty on COM2, after the virtual terminals */
+#define TTY_BUF_SIZE 4096              /* bytes of input a tty holds, a power of two */
+#define NPTYS 8                        /* pseudo-terminal pairs */
 
 /*
  * Memory-management-related:
  */
 
-/*
- *     finds fraction of available page frames that will be dedicated to kmem
- *     the rest are given to the vm system
- */
-#define KMEM_FRAC(x) (((x) >> 2) + ((x) >> 3)) /* 37.5%-ish */
+#define PAGE_ZERO_POOL_MAX 32 /* free pages the idle loop keeps zeroed */
+#define VMALLOC_PAGES 8192    /* kernel address space for vmalloc, in 4mb steps */
+#define KMEM_PROFILE 0        /* count kmalloc and slab allocations per call site */
+#define KMEM_PROFILE_SITES 256 /* call sites counted apart, a power of two */
 
 /*     pframe/mmobj-system-related: */
-#define PF_HASH_SIZE 17 /* Number of buckets in pn/mmobj->pframe hash */
+#define PF_HASH_MIN_ORDER 9 /* log2 of initial buckets in pn/mmobj->pframe hash */
+#define PF_HASH_MAX_LOAD 2   /* average chain length before the hash doubles */
+#define PF_WAITQ_ORDER 6     /* log2 of wait queues shared by busy pages */
 /*         Pageout-related: */
-#define PAGEOUTD_FREE_TARGET_SHIFT 5 /* 3.125% */
-#define PAGEOUTD_FREE_MIN_SHIFT 4    /* 6.25% */
+#define PAGEOUTD_FREE_MIN_SHIFT 5  /* 3.125%: misses reclaim pages themselves */
+#define PAGEOUTD_FREE_LOW_SHIFT 4  /* 6.25%: pageoutd wakes up */
+#define PAGEOUTD_FREE_HIGH_SHIFT 3 /* 12.5%: and reclaims up to here */
+#define PF_DIRECT_RECLAIM_SCAN 32  /* most pages a miss looks at below min */
+/*         Writeback-related: */
+#define PF_WRITEBACK_MAX 64   /* most dirty pages gathered per writeback pass */
+#define PFLUSHD_DIRTY_SHIFT 3 /* wake pflushd once 12.5% of memory is dirty */
+#define PF_DIRTY_LIMIT_SHIFT 2 /* writers wait while 25% of memory is dirty */
+#define PF_DIRTY_FS_SHIFT 1    /* or while one file system has half that */
+#define PF_DIRTY_MAX_PAUSE_MSECS 200 /* longest a writer is paused at once */
+#define PFLUSHD_INTERVAL_MSECS 5000 /* most time a page stays dirty in memory */
+/*         Swap-related: */
+#define SWAP_ZCACHE_PAGES 1024 /* most memory compressed anon pages take */
+#define SWAP_ZCACHE_MAX_LEN 3072 /* pages compressing worse go to disk */
+/*         Fault-related: */
+#define FAULT_AROUND_PAGES 16 /* window of resident pages mapped per fault */
+#define FAULT_AHEAD_PAGES 32  /* read and mapped ahead under MADV_SEQUENTIAL */
+#define SHADOW_MAX_DEPTH 8    /* most shadow objects fork leaves over an area */
+#define BRK_RESERVE_PAGES 16  /* heap growth rounds the area up to this many */
+
+/*
+ * block device I/O queue parameters
+ */
+#define BLOCKDEV_MAX_MERGE 32 /* most blocks merged into one request */
+#define BLOCKDEV_MAX_PASSES 8 /* dispatches a request may be passed over */
+#define BLOCKDEV_WORKERS 2    /* threads dispatching asynchronous requests */
+#define ATA_WRITE_CACHE 1     /* turn on disks' write caches, flushed as needed */
+#define RAMDISK_BLOCKS 1024   /* blocks in the disk kept in memory; 0 for none */
+#define RAMDISK_INODES 256    /* inodes in the s5fs it is formatted with */
+
+/*
+ * network configuration parameters; the addresses, in host byte order,
+ * suit qemu's user-mode networking
+ */
+#define NET_ADDR 0x0a00020f    /* 10.0.2.15: this machine's IPv4 address */
+#define NET_NETMASK 0xffffff00 /* 255.255.255.0 */
+#define NET_GATEWAY 0x0a000202 /* 10.0.2.2: where other networks are reached */
+#define NET_RX_BUFS 64         /* receive buffers, a page each, lent the NIC */
+#define NET_ARP_ENTRIES 16     /* neighbours' hardware addresses remembered */
+#define NET_ARP_TRIES 3        /* ARP requests sent before giving up */
+#define NET_ARP_TIMEOUT_MSECS 500 /* wait for a reply to each */
+#define UDP_QUEUE_MAX 64       /* datagrams a UDP socket holds before dropping */
 
 /*
  * filesystem/vfs configuration parameters
@@ -39,7 +95,31 @@
 #define MAX_VFS 8       /* max # of vfses */
 #define MAX_VNODES 1024 /* max number of in-core vnodes */
 #define NAME_LEN 28     /* maximum directory entry length */
-#define NFILES 32       /* maximum number of open files */
+#define NFILES 32       /* descriptors a new fd table has room for */
+#define NFILES_MAX 1024 /* maximum number of open files per process */
+#define VNODE_HASH_ORDER 8 /* log2 of buckets in the in-core vnode table */
+#define VNODE_CACHE_MAX 256 /* unreferenced vnodes kept in core for reuse */
+#define DCACHE_SIZE 512     /* directory name lookup cache entries */
+#define DCACHE_HASH_ORDER 7 /* log2 of buckets in the name cache */
+#define TMPFS_HASH_ORDER 8  /* log2 of directory hash buckets per tmpfs */
+#define PIPE_MAX_PAGES 16   /* most pages of unread data a pipe buffers */
+#define PIPE_WAKE_PAGES 4   /* free pages which wake a writer of a full pipe */
+#define SOCK_BUF_PAGES 16   /* most pages of data queued for a socket end */
+#define AIO_MAX_ENTRIES 128 /* most requests a process may have outstanding */
+#define AIO_MAX_BYTES 65536 /* most bytes one asynchronous request moves */
+#define STATSFS_SNAP_PAGES 4 /* most text in one statsfs file or kshell stats */
+
+#define S5_READAHEAD_MIN 4  /* blocks read ahead once access looks sequential */
+#define S5_READAHEAD_MAX 32 /* read-ahead window doubles up to this many */
+#define S5_DINDEX_MIN 128   /* directory entries before a dir gets indexed */
+#define S5_JOURNAL_BLOCKS 256 /* size of the s5fs metadata journal, 0 for none */
+#define S5_JOURNAL_INTERVAL_MSECS 1000 /* most time between journal commits */
+#define S5_FSCK_BACKGROUND 0 /* check link counts after a crash in the background */
+#define S5_UMOUNT_CHECK 0    /* verify link counts at every unmount */
+#define S5_CSUM 1            /* checksum s5fs metadata blocks (needs the journal) */
+#define S5_SCRUB_INTERVAL_MSECS 1000 /* time between batches of the scrubber */
+#define S5_SCRUB_BATCH 16    /* most blocks the scrubber reads per batch */
+#define S5_WARM 0 /* read the pages hot at the last unmount back in at mount */
 
 /* Note: if rootfs is ramfs, this is completely ignored */
 #define VFS_ROOTFS_DEV "disk0" /* device containing root filesystem */
@@ -13,22 +13,113 @@
 #include "mm/page.h"
 #include "mm/mmobj.h"
 
+#include "proc/sched.h"
+
+#include "util/hist.h"
+
 #define BLOCK_SIZE PAGE_SIZE
 
 struct blockdev_ops;
 
+/*
+ * One element of a block I/O scatter/gather list: bv_count consecutive
+ * blocks held in the page-aligned buffer bv_buf.
+ */
+typedef struct blockdev_iovec {
+  char *bv_buf;
+  size_t bv_count;
+} blockdev_iovec_t;
+
+struct blockdev_req;
+
+/*
+ * Called in thread context once a request submitted with
+ * blockdev_submit_async() has finished, with br_status set. The request
+ * belongs to the caller again and may be freed or resubmitted.
+ */
+typedef void (*blockdev_done_t)(struct blockdev_req *req);
+
+/*
+ * A block I/O request: br_iovcnt buffers transferred to or from
+ * consecutive blocks starting at br_loc. The submitter fills in the
+ * fields above the line with blockdev_req_init(); the rest belong to the
+ * block layer until the request is done.
+ */
+typedef struct blockdev_req {
+  int br_write;
+  blocknum_t br_loc;
+  const blockdev_iovec_t *br_iov; /* must stay valid until done */
+  int br_iovcnt;
+  blockdev_done_t br_done_fn; /* NULL to wake br_waitq instead */
+  void *br_arg;               /* for the submitter's use */
+  /* ------------------------------------------------------------ */
+  struct blockdev *br_bdev;
+  size_t br_count;   /* total blocks in br_iov */
+  int br_passes;     /* times a dispatch has gone by without us */
+  int br_done;
+  int br_status;     /* 0 or -errno, once br_done is set */
+  ktqueue_t br_waitq;
+  list_link_t br_link; /* on the device's bd_reqq */
+} blockdev_req_t;
+
+/*
+ * Counters the block layer keeps for each device, indexed by direction
+ * (0 for reads, 1 for writes) where there are two.
+ */
+typedef struct blockdev_stats {
+  uint32_t bs_ops[2];     /* driver operations completed without error */
+  uint32_t bs_merged[2];  /* requests merged into another's operation */
+  uint64_t bs_blocks[2];  /* blocks those operations moved */
+  uint32_t bs_errors;     /* driver operations which failed */
+  uint32_t bs_flushes;    /* write cache flushes asked for */
+  uint32_t bs_queued;     /* requests submitted and not yet done */
+  uint32_t bs_max_queued;
+  uint32_t bs_inflight;   /* driver operations in progress */
+  uint64_t bs_busy_start; /* time_cycles() bs_inflight last left 0 */
+  uint64_t bs_busy;       /* cycles with an operation in progress */
+  hist_t bs_hist[2];      /* service time of operations, in the driver */
+} blockdev_stats_t;
+
 /*
  * Represents a Weenix block device.
  */
 typedef struct blockdev {
   /* Fields that should be initialized by drivers: */
   devid_t bd_id;
+  blocknum_t bd_nblocks; /* size of the device in blocks */
 
   struct blockdev_ops *bd_ops;
 
+  /* Operations the driver can have in progress at once, each called
+   * from a thread of its own; 1 for a driver which does one at a time */
+  int bd_depth;
+
   /* Fields that should be ignored by drivers: */
   struct mmobj bd_mmobj;
 
+  /* Pending requests sorted by block number, the block just past the
+   * last dispatched request, and how many threads are dispatching
+   * requests to the driver, at most bd_depth */
+  list_t bd_reqq;
+  blocknum_t bd_head;
+  int bd_dispatching;
+
+  blockdev_stats_t bd_stats;
+
+  /* If set, asked before the pager writes dirty pages of this device
+   * back; a nonzero return leaves them dirty. This lets a file system
+   * with a journal keep metadata from reaching its home blocks before
+   * it has been logged. */
+  int (*bd_holdwrite)(struct blockdev *bd);
+
+  /* If set, shown every block read into the device's pages, so that a
+   * file system can check it against a checksum */
+  void (*bd_verify)(struct blockdev *bd, blocknum_t blockno,
+                    const char *buf);
+
+  /* For the use of the file system setting the above */
+  void *bd_holdarg;
+
   /* Link on the list of block-oriented devices */
   list_link_t bd_link;
 } blockdev_t;
@@ -58,6 +149,47 @@ typedef struct blockdev_ops {
    */
   int (*write_block)(blockdev_t *bdev, const char *buf, blocknum_t loc,
                      size_t count);
+
+  /**
+   * Reads consecutive blocks from the block device into several
+   * discontiguous buffers. The device blocks starting at loc are
+   * distributed over the buffers in order. This call will block.
+   * Drivers which cannot do this in one operation may leave this
+   * NULL; use blockdev_readv() rather than calling it directly.
+   *
+   * @param bdev the block device
+   * @param iov the buffers to read into
+   * @param iovcnt the number of entries in iov
+   * @param loc the number of the block to start reading from
+   * @return 0 on success, -errno on failure
+   */
+  int (*readv_block)(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                     int iovcnt, blocknum_t loc);
+
+  /**
+   * Writes several discontiguous buffers to consecutive blocks of the
+   * block device starting at loc. This call will block. May be NULL;
+   * use blockdev_writev() rather than calling it directly.
+   *
+   * @param bdev the block device
+   * @param iov the buffers to write from
+   * @param iovcnt the number of entries in iov
+   * @param loc the number of the block to start writing at
+   * @return 0 on success, -errno on failure
+   */
+  int (*writev_block)(blockdev_t *bdev, const blockdev_iovec_t *iov,
+                      int iovcnt, blocknum_t loc);
+
+  /**
+   * Makes every write the device has completed durable, by flushing its
+   * write cache. This call will block. May be NULL if completed writes
+   * are durable already; use blockdev_flush_cache() rather than calling
+   * it directly.
+   *
+   * @param bdev the block device
+   * @return 0 on success, -errno on failure
+   */
+  int (*flush_cache)(blockdev_t *bdev);
 } blockdev_ops_t;
 
 /**
@@ -81,6 +213,94 @@ int blockdev_register(blockdev_t *dev);
  */
 blockdev_t *blockdev_lookup(devid_t id);
 
+/**
+ * @return the reads and writes completed by all disks since boot
+ */
+uint32_t blockdev_op_count(void);
+
+/**
+ * Sets up a request for blockdev_submit_async().
+ *
+ * @param req the request
+ * @param write nonzero to write the buffers, zero to read into them
+ * @param iov the buffers, which must stay valid until the request is done
+ * @param iovcnt the number of entries in iov
+ * @param loc the first block to transfer
+ * @param done called when the request finishes, or NULL to wake anyone
+ *      in blockdev_req_wait() instead
+ * @param arg stored in br_arg for the caller
+ */
+void blockdev_req_init(blockdev_req_t *req, int write,
+                       const blockdev_iovec_t *iov, int iovcnt,
+                       blocknum_t loc, blockdev_done_t done, void *arg);
+
+/**
+ * Queues a request on the device's request queue and returns without
+ * waiting for it. One of the block I/O threads dispatches it, sorted
+ * and merged with whatever else is queued, unless a synchronous caller
+ * gets there first.
+ *
+ * @param dev the block device
+ * @param req the request, set up with blockdev_req_init()
+ */
+void blockdev_submit_async(blockdev_t *dev, blockdev_req_t *req);
+
+/**
+ * Waits for a request submitted without a completion callback.
+ *
+ * @param req the request
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_req_wait(blockdev_req_t *req);
+
+/**
+ * Reads count blocks starting at loc through the request queue. This
+ * call will block.
+ *
+ * @param dev the block device
+ * @param buf the page-aligned buffer to read into
+ * @param loc the first block to read
+ * @param count the number of blocks to read
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_read(blockdev_t *dev, char *buf, blocknum_t loc, size_t count);
+
+/**
+ * Writes count blocks starting at loc through the request queue. This
+ * call will block.
+ *
+ * @param dev the block device
+ * @param buf the page-aligned buffer to write from
+ * @param loc the first block to write
+ * @param count the number of blocks to write
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_write(blockdev_t *dev, const char *buf, blocknum_t loc,
+                   size_t count);
+
+/**
+ * A dbg_infofunc_t: for each disk, like Linux's /proc/diskstats, the
+ * operations completed and merged, the bytes moved, the requests queued
+ * now and at most, and how long the disk has been busy.
+ *
+ * @param arg must be NULL
+ */
+size_t blockdev_info(const void *arg, char *buf, size_t osize);
+
+/**
+ * A dbg_infofunc_t: percentiles of how long each disk's reads and writes
+ * took in the driver, in microseconds.
+ *
+ * @param arg must be NULL
+ */
+size_t blockdev_latency_info(const void *arg, char *buf, size_t osize);
+
+/**
+ * Stops the block I/O threads. Called from idleproc at shutdown, once
+ * nothing is left to submit requests.
+ */
+void blockdev_shutdown(void);
+
 /**
  * Cleans and frees all resident pages belonging to a given block
  * device.
@@ -88,3 +308,40 @@ blockdev_t *blockdev_lookup(devid_t id);
  * @param dev the block device to flush
  */
 void blockdev_flush_all(blockdev_t *dev);
+
+/**
+ * A write barrier: makes every write to the device which has completed
+ * durable before returning, so that nothing written after it can reach
+ * the media ahead of them. Writes still queued are not covered. This
+ * call will block.
+ *
+ * @param dev the block device
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_flush_cache(blockdev_t *dev);
+
+/**
+ * Reads consecutive blocks starting at loc into a list of buffers, using
+ * a single device operation if the driver supports it.
+ *
+ * @param dev the block device to read from
+ * @param iov the buffers to read into
+ * @param iovcnt the number of entries in iov
+ * @param loc the first block to read
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_readv(blockdev_t *dev, const blockdev_iovec_t *iov, int iovcnt,
+                   blocknum_t loc);
+
+/**
+ * Writes a list of buffers to consecutive blocks starting at loc, using a
+ * single device operation if the driver supports it.
+ *
+ * @param dev the block device to write to
+ * @param iov the buffers to write from
+ * @param iovcnt the number of entries in iov
+ * @param loc the first block to write
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_writev(blockdev_t *dev, const blockdev_iovec_t *iov, int iovcnt,
+                    blocknum_t loc);
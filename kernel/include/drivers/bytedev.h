@@ -9,6 +9,7 @@ struct pframe;
 struct bytedev_ops;
 struct vmarea;
 struct mmobj;
+struct poll_table;
 
 typedef struct bytedev {
   devid_t cd_id;
@@ -23,6 +24,8 @@ typedef struct bytedev_ops {
   int (*fillpage)(struct vnode *file, off_t offset, void *pagebuf);
   int (*dirtypage)(struct vnode *file, off_t offset);
   int (*cleanpage)(struct vnode *file, off_t offset, void *pagebuf);
+  /* Like the vnode poll operation; NULL for always ready */
+  int (*poll)(bytedev_t *dev, int events, struct poll_table *pt);
 } bytedev_ops_t;
 
 /**
@@ -25,6 +25,14 @@
  *         - minor 1:          /dev/tty1       Second TTY device
  *         - and so on...
  *
+ *     - char major 3:         Pseudo-terminal masters (pty)
+ *         - minor 0:          /dev/pty0       Master of the first pair
+ *         - and so on...
+ *
+ *     - char major 4:         Pseudo-terminal slaves, ttys (pts)
+ *         - minor 0:          /dev/pts0       Slave of the first pair
+ *         - and so on...
+ *
  *     - block major 1:        Disk devices
  *         - minor 0:          first disk device
  *         - minor 1:          second disk device
@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Finds an AHCI SATA controller on the PCI bus, and registers each disk
+ * attached to it, after any ATA and virtio disks.
+ */
+void ahci_init(void);
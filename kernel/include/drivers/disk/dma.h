@@ -25,16 +25,37 @@ void dma_status(uint16_t busmaster_addr);
  */
 void dma_reset(uint16_t busmaster_addr);
 
+/* Maximum number of physical regions in a single DMA transfer. A channel
+ * never needs more than one per page of the largest ATA transfer. */
+#define DMA_MAX_PRDS 32
+
+/* One element of a scatter/gather list: a page-aligned buffer and its
+ * length in bytes */
+typedef struct dma_sg {
+  void *sg_addr;
+  uint32_t sg_count;
+} dma_sg_t;
+
 /**
  * Initialize DMA for an operation
  *
  * @param channel the channel on which to perform the operation
  * @param start the beginning of the buffer in memory
  * @param count the number of bytes to read/write
- * @param write true if writing, false if reading
  */
 void dma_load(uint8_t channel, void *start, int count);
 
+/**
+ * Initialize DMA for an operation on several discontiguous buffers.
+ * The buffers are transferred in order, as if they were one. Physically
+ * adjacent pages are merged into a single PRD entry.
+ *
+ * @param channel the channel on which to perform the operation
+ * @param sg the list of page-aligned buffers
+ * @param nsg the number of entries in sg
+ */
+void dma_load_sg(uint8_t channel, const dma_sg_t *sg, int nsg);
+
 /* 1/24/13 Commented this out for now, it isn't used anyway */
 /**
  * Cancel the current DMA operation.
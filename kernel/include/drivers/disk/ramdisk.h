@@ -0,0 +1,14 @@
+#pragma once
+
+struct blockdev;
+
+/**
+ * Sets up a disk of RAMDISK_BLOCKS blocks held in memory, if that is
+ * nonzero, and registers it after any real disks.
+ */
+void ramdisk_init(void);
+
+/**
+ * @return the ramdisk, or NULL if there is none
+ */
+struct blockdev *ramdisk_get(void);
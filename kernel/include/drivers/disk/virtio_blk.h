@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * Finds the virtio block devices on the PCI bus, and registers each as a
+ * disk, after any ATA disks.
+ */
+void virtio_blk_init(void);
@@ -0,0 +1,7 @@
+#pragma once
+
+/*
+ * The virtio network driver starts itself, as an init_func, and
+ * registers the first device it finds as the network interface (see
+ * net/net.h); it has nothing else to export.
+ */
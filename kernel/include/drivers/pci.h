@@ -64,6 +64,7 @@ typedef struct pcidev {
 void pci_init(void);
 
 pcidev_t *pci_lookup(uint8_t class, uint8_t subclass, uint8_t interface);
+pcidev_t *pci_lookup_id(uint16_t vendor, uint16_t device, pcidev_t *after);
 
 uint32_t pci_read_config(pcidev_t *dev, uint8_t reg_off, uint8_t length);
 
@@ -14,6 +14,16 @@ typedef struct tty_driver_ops {
    */
   void (*provide_char)(struct tty_driver *ttyd, char c);
 
+  /**
+   * Write the given characters to the tty driver, as provide_char
+   * would one at a time, but updating the display only once.
+   *
+   * @param ttyd the tty driver
+   * @param buf the characters to write
+   * @param len the number of characters in buf
+   */
+  void (*provide_buf)(struct tty_driver *ttyd, const char *buf, int len);
+
   /**
    * Registers a callback to be called when the tty driver has
    * received a character from an input device and returns the
@@ -2,6 +2,7 @@
 
 struct tty_ldisc;
 struct tty_device;
+struct poll_table;
 
 typedef struct tty_ldisc_ops {
   /**
@@ -51,6 +52,32 @@ typedef struct tty_ldisc_ops {
    * @return a null terminated string to be echoed to the tty
    */
   const char *(*process_char)(struct tty_ldisc *ldisc, char c);
+
+  /**
+   * Processes a buffer of output characters, as process_char does
+   * one, into a buffer of the caller's. Stops early, at a character
+   * boundary, if out fills up.
+   *
+   * @param ldisc the line discipline
+   * @param in the characters to process
+   * @param len the number of characters in in
+   * @param out where to put the output
+   * @param outlen the size of out
+   * @param nout set to the number of bytes put in out
+   * @return the number of characters of in which were processed
+   */
+  int (*process_buf)(struct tty_ldisc *ldisc, const char *in, int len,
+                     char *out, int outlen, int *nout);
+
+  /**
+   * Reports whether a read would return without blocking, and has pt
+   * woken (see poll_wait) when one might.
+   *
+   * @param ldisc the line discipline
+   * @param pt the poller to wake, or NULL
+   * @return nonzero if there is input to read
+   */
+  int (*poll)(struct tty_ldisc *ldisc, struct poll_table *pt);
 } tty_ldisc_ops_t;
 
 typedef struct tty_ldisc { tty_ldisc_ops_t *ld_ops; } tty_ldisc_t;
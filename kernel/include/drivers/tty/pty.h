@@ -0,0 +1,12 @@
+#pragma once
+
+#define PTY_MASTER_MAJOR 3
+#define PTY_SLAVE_MAJOR 4
+
+/**
+ * Creates NPTYS pseudo-terminal pairs. The slave of each is a tty with
+ * the default line discipline; its master is a byte device through which
+ * a program reads what is written to the slave and writes what the slave
+ * reads, as if it were the keyboard.
+ */
+void pty_init(void);
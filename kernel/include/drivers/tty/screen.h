@@ -1,6 +1,13 @@
 #pragma once
 #include "types.h"
 
+/* A character cell as video memory holds it: the attributes in the high
+ * byte (background colour, then foreground), the character in the low */
+#define SCREEN_CELL(c, attrib) ((uint16_t)(((attrib) << 8) | (uint8_t)(c)))
+
+/* The attributes of plain text, white on black */
+#define SCREEN_DEFAULT_ATTRIB 0x0F
+
 /**
  * Initialize the screen subsystem.
  */
@@ -50,6 +57,23 @@ void screen_putbuf(const char *buf);
  */
 void screen_putbuf_attrib(const uint16_t *buf);
 
+/**
+ * Write a row of _EXACTLY_ DISPLAY_WIDTH characters and attributes.
+ *
+ * @param row the cells to write
+ * @param y the row to write them to
+ */
+void screen_putrow(const uint16_t *row, uint8_t y);
+
+/**
+ * Scroll the screen up, in hardware. The bottom lines rows are left
+ * with stale contents for the caller to write, and the cursor must be
+ * moved again.
+ *
+ * @param lines the number of rows to scroll by, less than DISPLAY_HEIGHT
+ */
+void screen_scroll(int lines);
+
 /**
  * Clear the screen.
  */
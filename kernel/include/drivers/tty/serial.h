@@ -0,0 +1,20 @@
+#pragma once
+
+struct tty_driver;
+
+/**
+ * Initializes the serial terminals, finding which ports have a UART.
+ */
+void serial_init(void);
+
+/**
+ * @return the number of serial terminals, each of which is a tty after
+ * the virtual terminals
+ */
+int serial_num_terminals(void);
+
+/**
+ * @param id the serial terminal, from 0
+ * @return its tty driver, or NULL if there is no such terminal
+ */
+struct tty_driver *serial_get_tty_driver(int id);
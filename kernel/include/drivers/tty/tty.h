@@ -27,3 +27,13 @@ void tty_init(void);
  * @return a newly allocated tty or NULL on error
  */
 tty_device_t *tty_create(struct tty_driver *driver, int id);
+
+/**
+ * Creates a tty with the given driver and the default line discipline,
+ * and registers it as a byte device. Panics if there is not the memory.
+ *
+ * @param driver the tty driver to use
+ * @param devid the byte device id, whose minor is the tty's id
+ * @return the new tty
+ */
+tty_device_t *tty_attach(struct tty_driver *driver, devid_t devid);
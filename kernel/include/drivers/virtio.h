@@ -0,0 +1,72 @@
+#pragma once
+
+#include "types.h"
+
+#include "mm/page.h"
+
+/*
+ * What the virtio drivers share: the legacy PCI interface's registers and
+ * the layout of a virtqueue. Each driver does its own probing and keeps
+ * its own queues.
+ */
+
+#define VIRTIO_VENDOR 0x1af4
+
+/* Legacy registers, as offsets into the I/O BAR */
+#define VIRTIO_PCI_HOST_FEATURES 0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_PFN 0x08
+#define VIRTIO_PCI_QUEUE_NUM 0x0c
+#define VIRTIO_PCI_QUEUE_SEL 0x0e
+#define VIRTIO_PCI_QUEUE_NOTIFY 0x10
+#define VIRTIO_PCI_STATUS 0x12
+#define VIRTIO_PCI_ISR 0x13
+#define VIRTIO_PCI_CONFIG 0x14 /* the device's own configuration */
+
+#define VIRTIO_STATUS_ACK 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED 0x80
+
+#define VRING_DESC_F_NEXT 0x1
+#define VRING_DESC_F_WRITE 0x2  /* the device writes the buffer */
+#define VRING_USED_F_NO_NOTIFY 0x1
+
+typedef struct vring_desc {
+  uint64_t vd_addr;
+  uint32_t vd_len;
+  uint16_t vd_flags;
+  uint16_t vd_next;
+} __attribute__((packed)) vring_desc_t;
+
+typedef struct vring_avail {
+  uint16_t va_flags;
+  uint16_t va_idx;
+  uint16_t va_ring[];
+} __attribute__((packed)) vring_avail_t;
+
+typedef struct vring_used_elem {
+  uint32_t vu_id;
+  uint32_t vu_len;
+} __attribute__((packed)) vring_used_elem_t;
+
+typedef struct vring_used {
+  uint16_t vu_flags;
+  uint16_t vu_idx;
+  vring_used_elem_t vu_ring[];
+} __attribute__((packed)) vring_used_t;
+
+#define VRING_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+/* Bytes of the descriptors and available ring of a queue of qsize
+ * entries, after which, on the next page, comes the used ring */
+static inline uint32_t vring_avail_size(uint16_t qsize) {
+  return VRING_ALIGN(sizeof(vring_desc_t) * qsize +
+                     sizeof(uint16_t) * (3 + qsize));
+}
+
+/* Bytes of the whole legacy queue layout for qsize entries */
+static inline uint32_t vring_size(uint16_t qsize) {
+  return vring_avail_size(qsize) +
+         VRING_ALIGN(sizeof(uint16_t) * 3 + sizeof(vring_used_elem_t) * qsize);
+}
@@ -4,9 +4,11 @@
 
 #ifndef __KERNEL__
 #ifndef errno
-#define errno _libc_errno
+#define errno (*__errno_location())
 #endif
 extern int _libc_errno;
+/* &_libc_errno, or the calling thread's own once there are threads */
+int *__errno_location(void);
 #endif
 
 #define EPERM 1    /* Operation not permitted */
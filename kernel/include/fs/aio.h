@@ -0,0 +1,44 @@
+/*  aio.h - asynchronous file I/O with a submission and completion queue
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+#define IO_OP_READ 1  /* read nbytes at offset into buf */
+#define IO_OP_WRITE 2 /* write nbytes from buf at offset */
+#define IO_OP_FSYNC 3 /* write the file's dirty pages to disk */
+
+/* A request, as submitted */
+struct io_sqe {
+  int op;
+  int fd;
+  void *buf;
+  size_t nbytes;
+  off_t offset;
+  uint32_t user_data; /* returned along with the result */
+};
+
+/* A finished request */
+struct io_cqe {
+  uint32_t user_data;
+  int res; /* what read, write or fsync would have returned, or -errno */
+};
+
+#ifdef __KERNEL__
+struct proc;
+
+int do_io_setup(unsigned int entries);
+int do_io_submit(const struct io_sqe *sqes, int nr);
+int do_io_getevents(struct io_cqe *cqes, int min_nr, int nr, int timeout);
+void aio_destroy(struct proc *p);
+#else
+int io_setup(unsigned int entries);
+int io_submit(const struct io_sqe *sqes, int nr);
+int io_getevents(struct io_cqe *cqes, int min_nr, int nr, int timeout);
+#endif
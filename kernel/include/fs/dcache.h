@@ -0,0 +1,74 @@
+#pragma once
+
+#include "types.h"
+
+struct fs;
+struct vnode;
+
+/*
+ * The name cache remembers the results of directory lookups, keyed by the
+ * directory's (fs, vno) and the name. A positive entry holds the inode
+ * number the name refers to and a negative entry records that the name
+ * does not exist. Entries hold no vnode references, so the cache never
+ * keeps a vnode in core.
+ *
+ * Anything which adds or removes a name must call dcache_remove on it
+ * after the change, and a directory whose inode is being freed must be
+ * purged, since its inode number may be reused.
+ */
+
+/* Returned by dcache_lookup */
+#define DCACHE_MISS 0
+#define DCACHE_HIT 1
+
+/**
+ * Looks up a name in the cache.
+ *
+ * @param dir the directory
+ * @param name the name, not necessarily null-terminated
+ * @param len the length of the name
+ * @param vno set to the inode number on a positive hit
+ * @return DCACHE_HIT, DCACHE_MISS, or -ENOENT on a negative hit
+ */
+int dcache_lookup(struct vnode *dir, const char *name, size_t len, ino_t *vno);
+
+/**
+ * Returns the current generation of the cache, which is bumped by every
+ * removal. A lookup which may have raced with a change must pass the
+ * generation from before it started to dcache_enter.
+ */
+uint32_t dcache_generation(void);
+
+/**
+ * Enters the result of a lookup in the cache, unless a name has been
+ * removed since the given generation.
+ *
+ * @param dir the directory
+ * @param name the name
+ * @param len the length of the name
+ * @param result the vnode found, or NULL to enter a negative entry
+ * @param gen dcache_generation() from before the lookup
+ */
+void dcache_enter(struct vnode *dir, const char *name, size_t len,
+                  struct vnode *result, uint32_t gen);
+
+/**
+ * Forgets any entry for the given name.
+ */
+void dcache_remove(struct vnode *dir, const char *name, size_t len);
+
+/**
+ * Forgets every entry in the directory with the given inode number.
+ */
+void dcache_purge_dir(struct fs *fs, ino_t dirvno);
+
+/**
+ * Forgets every entry of the given file system.
+ */
+void dcache_purge_fs(struct fs *fs);
+
+/**
+ * A dbg_infofunc_t (arg must be NULL): how many lookups found a name,
+ * found that it does not exist, and had to ask the file system.
+ */
+size_t dcache_info(const void *arg, char *buf, size_t osize);
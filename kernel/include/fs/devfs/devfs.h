@@ -0,0 +1,13 @@
+#pragma once
+
+#include "drivers/dev.h"
+#include "fs/vfs.h"
+
+int devfs_mount(struct fs *fs);
+
+/*
+ * Adds a node for the device to every devfs, named after its major and
+ * minor numbers; mode is S_IFCHR or S_IFBLK. Called by bytedev_register
+ * and blockdev_register.
+ */
+void devfs_add(int mode, devid_t devid);
@@ -18,3 +18,21 @@ typedef struct dirent {
 } dirent_t;
 
 #define d_fileno d_ino
+
+#ifndef __KERNEL__
+/* Directory streams, buffered on getdents(2) */
+
+#define DIRBUF_ENTRIES 32
+
+typedef struct {
+  int d_fd;      /* open directory */
+  int d_next;    /* index of the next entry in d_buf to return */
+  int d_nbuf;    /* number of valid entries in d_buf */
+  dirent_t d_buf[DIRBUF_ENTRIES];
+} DIR;
+
+DIR *opendir(const char *name);
+struct dirent *readdir(DIR *dirp);
+void rewinddir(DIR *dirp);
+int closedir(DIR *dirp);
+#endif
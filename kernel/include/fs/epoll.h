@@ -0,0 +1,48 @@
+/*  epoll.h - persistent interest sets with a ready list
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#include "fs/poll.h"
+#else
+#include "sys/types.h"
+#include "poll.h"
+#endif
+
+#define EPOLLIN POLLIN
+#define EPOLLPRI POLLPRI
+#define EPOLLOUT POLLOUT
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+#define EPOLLONESHOT (1u << 30) /* stop watching after one event */
+#define EPOLLET (1u << 31)      /* report only new events (edge-triggered) */
+
+#define EPOLL_CTL_ADD 1 /* watch fd */
+#define EPOLL_CTL_DEL 2 /* stop watching fd */
+#define EPOLL_CTL_MOD 3 /* change the events fd is watched for */
+
+typedef union epoll_data {
+  void *ptr;
+  int fd;
+  uint32_t u32;
+} epoll_data_t;
+
+struct epoll_event {
+  uint32_t events;   /* events of interest, or that happened */
+  epoll_data_t data; /* returned along with the events */
+};
+
+#ifdef __KERNEL__
+int do_epoll_create(void);
+int do_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int do_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                  int timeout);
+#else
+int epoll_create(int size);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+#endif
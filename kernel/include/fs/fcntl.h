@@ -15,3 +15,33 @@
 #define O_CREAT 0x100  /* Create file if non-existent. */
 #define O_TRUNC 0x200  /* Truncate to zero length. */
 #define O_APPEND 0x400 /* Append to file. */
+#define O_NONBLOCK 0x800 /* Fail with EAGAIN rather than block. */
+#define O_DIRECT 0x1000  /* Transfer whole blocks around the page cache. */
+
+/* As the directory of fstatat(), the current directory */
+#define AT_FDCWD -100
+
+/* Commands for fcntl(). */
+#define F_GETFL 3 /* Get the access mode and file status flags. */
+#define F_SETFL 4 /* Set the file status flags (O_APPEND, O_NONBLOCK, ...). */
+#define F_GETCOMPRESS 5 /* Whether the file's data is kept compressed. */
+#define F_SETCOMPRESS 6 /* Set it (arg 1) or not (0), while the file is empty. */
+
+/* Advice for posix_fadvise(), numbered as for madvise(). */
+#define POSIX_FADV_NORMAL 0     /* No special treatment. */
+#define POSIX_FADV_RANDOM 1     /* Expect random access: no read-ahead. */
+#define POSIX_FADV_SEQUENTIAL 2 /* Expect sequential access: read far ahead. */
+#define POSIX_FADV_WILLNEED 3   /* Expect access soon: read the range in now. */
+#define POSIX_FADV_DONTNEED 4   /* Don't expect access: drop cached pages. */
+
+/* Modes for fallocate(); only both together are supported. */
+#define FALLOC_FL_KEEP_SIZE 0x1  /* Leave the file's size alone. */
+#define FALLOC_FL_PUNCH_HOLE 0x2 /* Free the range, leaving a hole. */
+
+#ifndef __KERNEL__
+#include "sys/types.h"
+
+int fcntl(int fd, int cmd, int arg);
+int posix_fadvise(int fd, off_t offset, off_t len, int advice);
+int fallocate(int fd, int mode, off_t offset, off_t len);
+#endif
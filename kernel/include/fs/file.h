@@ -5,8 +5,11 @@
 #define FMODE_READ 1
 #define FMODE_WRITE 2
 #define FMODE_APPEND 4
+#define FMODE_NONBLOCK 8
+#define FMODE_DIRECT 16
 
 struct vnode;
+struct proc;
 
 typedef struct file {
   /*
@@ -18,9 +21,10 @@ typedef struct file {
 
   /*
    * The mode in which this file was opened. This is a mask of the flags
-   * FMODE_READ, FMODE_WRITE, and FMODE_APPEND. It is set when the file
-   * is first opened, and use to restrict the operations that can be
-   * performed on the underlying vnode.
+   * FMODE_READ, FMODE_WRITE, FMODE_APPEND, FMODE_NONBLOCK and
+   * FMODE_DIRECT. It is set when the file is first opened, and use to
+   * restrict the operations that can be performed on the underlying
+   * vnode. fcntl can change all but FMODE_READ and FMODE_WRITE later.
    */
   int f_mode;
 
@@ -36,6 +40,20 @@ typedef struct file {
   struct vnode *f_vnode;
 } file_t;
 
+/*
+ * A process's file descriptor table. A forked child shares its parent's
+ * table, and whichever process first changes it gets a copy of its own
+ * (see fd_private()). The table starts with room for NFILES descriptors
+ * and doubles, up to NFILES_MAX, when it fills.
+ */
+typedef struct fdtable {
+  int ft_refcount;         /* processes sharing the table */
+  int ft_size;             /* descriptors there is room for */
+  int ft_hint;             /* no word of ft_used below this one is full */
+  struct file **ft_files;  /* indexed by descriptor */
+  uint32_t *ft_used;       /* bit fd is set while ft_files[fd] is */
+} fdtable_t;
+
 /*
  * Returns the file_t assiciated with the given file descriptor for the
  * current process. If there is no associated file_t, returns NULL.
@@ -46,6 +64,16 @@ typedef struct file {
  */
 struct file *fget(int fd);
 
+/*
+ * fget_light() is fget() for a system call which is done with the file
+ * before it returns. While the process has a single thread nothing else
+ * can close fd during the call, and the table keeps its reference (a
+ * process sharing the table after fork copies it before changing it),
+ * so no reference is taken and *put is set to 0. Pass *put to
+ * fput_light() when done. Returns NULL if fd isn't open.
+ */
+struct file *fget_light(int fd, int *put);
+
 /*
  * Places the vnode vn inside of the given file, possibly calling the
  * acquire vnode operation if one exists.
@@ -66,3 +94,62 @@ void fref(file_t *f);
  * The vnode release operation will also be called if it exists.
  */
 void fput(file_t *f);
+
+/* Drops what fget_light() took */
+static inline void fput_light(file_t *f, int put) {
+  if (put)
+    fput(f);
+}
+
+/*
+ * Returns a new, empty file descriptor table, or NULL if there is no
+ * memory for one.
+ */
+fdtable_t *fdtable_create(void);
+
+/*
+ * Returns a private copy of ft, holding a reference to each of its
+ * files, or NULL if there is no memory for one.
+ */
+fdtable_t *fdtable_copy(fdtable_t *ft);
+
+/*
+ * fdtable_ref() takes another reference to ft for a process to share;
+ * fdtable_put() drops one, closing every file in ft with the last.
+ */
+void fdtable_ref(fdtable_t *ft);
+void fdtable_put(fdtable_t *ft);
+
+/*
+ * Returns the file open on fd in ft, without taking a reference to it,
+ * or NULL if fd isn't open.
+ */
+struct file *fdtable_get(fdtable_t *ft, int fd);
+
+/*
+ * fdtable_set() puts f on fd, which must not be open, and the table
+ * takes over the caller's reference to f; fdtable_clear() takes the file
+ * off fd and returns it with the table's reference. fd must fit in ft
+ * (see fdtable_fit()) and ft must not be shared (see fd_private()).
+ */
+void fdtable_set(fdtable_t *ft, int fd, struct file *f);
+struct file *fdtable_clear(fdtable_t *ft, int fd);
+
+/*
+ * Grows ft until it has room for fd. Returns 0, -EBADF if fd is not
+ * below NFILES_MAX, or -ENOMEM.
+ */
+int fdtable_fit(fdtable_t *ft, int fd);
+
+/*
+ * Returns the lowest descriptor not open in ft, growing ft if every one
+ * is, or -EMFILE or -ENOMEM.
+ */
+int fdtable_alloc(fdtable_t *ft);
+
+/*
+ * Gives p a table of its own if it shares one, before p changes it, and
+ * grows it to hold fd unless fd is -1. Returns 0 or -errno as
+ * fdtable_fit() does.
+ */
+int fd_private(struct proc *p, int fd);
@@ -0,0 +1,8 @@
+#pragma once
+
+/*
+ * Mounts a tmpfs on each top directory of the archive the kernel is
+ * built with and unpacks the archive into them. Called by idleproc
+ * before init runs; returns 0 or -errno.
+ */
+int initramfs_unpack(void);
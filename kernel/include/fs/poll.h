@@ -0,0 +1,97 @@
+/*  poll.h - waiting for any of several files to become ready
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#include "util/list.h"
+#else
+#include "sys/types.h"
+#endif
+
+#define POLLIN 0x0001   /* data can be read without blocking */
+#define POLLPRI 0x0002  /* urgent data can be read (never set) */
+#define POLLOUT 0x0004  /* data can be written without blocking */
+#define POLLERR 0x0008  /* error, e.g. a pipe with no readers; always polled */
+#define POLLHUP 0x0010  /* the other end hung up; always polled */
+#define POLLNVAL 0x0020 /* fd is not open; always polled */
+
+typedef unsigned int nfds_t;
+
+struct pollfd {
+  int fd;        /* file to poll, or negative to skip this entry */
+  short events;  /* events of interest */
+  short revents; /* events which happened */
+};
+
+#ifdef __KERNEL__
+
+struct poll_table;
+
+/*
+ * Pollers waiting for an object to become ready. Each pollable object
+ * owns one, passes it to poll_wait from its poll operation, and calls
+ * pollq_wakeup whenever it may have become ready. pollq_wakeup may be
+ * called from interrupt context.
+ */
+typedef struct pollq {
+  list_t pq_entries;
+} pollq_t;
+
+/* A poller's place on one pollq: pe_wake(pe_arg) is called on wakeup */
+typedef struct poll_entry {
+  list_link_t pe_link;
+  void (*pe_wake)(void *arg);
+  void *pe_arg;
+} poll_entry_t;
+
+/*
+ * Passed to poll operations to say how to wait: poll_wait hands the
+ * object's pollq to pt_qproc, which puts an entry of the caller's on it.
+ * do_poll's entries last for one wait; epoll's for as long as the file
+ * is watched.
+ */
+typedef struct poll_table {
+  void (*pt_qproc)(pollq_t *q, struct poll_table *pt);
+} poll_table_t;
+
+void pollq_init(pollq_t *q);
+
+/**
+ * Called from a poll operation to have pt woken when q is woken. Does
+ * nothing if pt is NULL, which is how readiness is asked for without
+ * waiting.
+ */
+void poll_wait(pollq_t *q, poll_table_t *pt);
+
+/**
+ * Wakes every poller waiting on q.
+ */
+void pollq_wakeup(pollq_t *q);
+
+/**
+ * Puts pe on q, or takes it off whatever queue it is on. With
+ * interrupts masked, since q may be woken from an interrupt handler.
+ */
+void pollq_add(pollq_t *q, poll_entry_t *pe);
+void pollq_remove(poll_entry_t *pe);
+
+/**
+ * Waits up to timeout milliseconds (forever if negative) for any of the
+ * nfds files of fds to be ready for the events asked for, and sets
+ * their revents. Returns the number of entries with revents set, 0 on
+ * timeout, or -errno.
+ *
+ * Error cases:
+ *      o EINVAL
+ *        nfds is more than NFILES.
+ *      o EINTR
+ *        the wait was cancelled.
+ */
+int do_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+#else
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+#endif
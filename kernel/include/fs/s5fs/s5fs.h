@@ -12,6 +12,7 @@
 #include "config.h"
 
 #include "proc/kmutex.h"
+#include "proc/spinlock.h"
 #include "fs/vfs.h"
 #include "mm/page.h"
 #include "drivers/blockdev.h"
@@ -21,11 +22,12 @@
 #define S5_IS_SUPER(blkno) ((blkno) == S5_SUPER_BLOCK)
 #define S5_NBLKS_PER_FNODE 30
 #define S5_BLOCK_SIZE 4096
-#define S5_NDIRECT_BLOCKS 28
+#define S5_NDIRECT_BLOCKS 27
 #define S5_INODES_PER_BLOCK (S5_BLOCK_SIZE / sizeof(s5_inode_t))
 #define S5_DIRENTS_PER_BLOCK (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
-#define S5_MAX_FILE_BLOCKS \
-  (S5_NDIRECT_BLOCKS + (S5_BLOCK_SIZE / sizeof(uint32_t)))
+#define S5_MAX_FILE_BLOCKS                  \
+  (S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS + \
+   S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS)
 #define S5_NAME_LEN 28
 
 #define S5_TYPE_FREE 0x0
@@ -33,9 +35,17 @@
 #define S5_TYPE_DIR 0x2
 #define S5_TYPE_CHR 0x4
 #define S5_TYPE_BLK 0x8
+/* A regular file of at most S5_INLINE_MAX bytes, kept where its direct
+ * block numbers would be; it has no blocks of its own */
+#define S5_TYPE_INLINE 0x10
+/* A regular file whose data is kept compressed (see s5fs_compress.h) */
+#define S5_TYPE_COMPRESSED 0x20
+
+#define S5_INLINE_MAX (S5_NDIRECT_BLOCKS * sizeof(uint32_t))
 
 #define S5_MAGIC 071177
-#define S5_CURRENT_VERSION 3
+#define S5_CURRENT_VERSION 7 /* 5 added S5_TYPE_INLINE, 6 checksums, 7 compression */
+#define S5_OLDEST_VERSION 4  /* older versions mount, and are upgraded */
 
 /* Number of blocks stored in the indirect block */
 #define S5_NIDIRECT_BLOCKS (S5_BLOCK_SIZE / sizeof(uint32_t))
@@ -81,8 +91,47 @@ typedef struct s5_super {
   uint32_t s5s_root_inode; /* root inode */
   uint32_t s5s_num_inodes; /* number of inodes */
   uint32_t s5s_version;    /* version of this disk format */
+
+  /* Metadata journal, created at first mount; 0 if there is none */
+  uint32_t s5s_journal_start;   /* first block of the journal */
+  uint32_t s5s_journal_nblocks; /* blocks in the journal */
+
+  uint32_t s5s_state; /* S5_STATE_*, below */
+
+  /* Checksums of the metadata blocks, created at first mount; 0 if
+   * there are none (see s5fs_csum.h) */
+  uint32_t s5s_csum_start;   /* first block of the checksum table */
+  uint32_t s5s_csum_nblocks; /* blocks in the table */
+  uint32_t s5s_csum;         /* of this block, with this field 0 */
+
+  /* Pages to read in at the next mount (see s5fs_warm.h); 0 if none */
+  uint32_t s5s_warm_block;
 } s5_super_t;
 
+/*
+ * The superblock says the fs is mounted while it is, so that a mount
+ * which finds it so knows the last one ended in a crash. An unmount after
+ * a background check which found link counts to repair leaves it asking
+ * the next mount to repair them.
+ */
+#define S5_STATE_CLEAN 0
+#define S5_STATE_MOUNTED 1
+#define S5_STATE_REPAIR 2
+
+/*
+ * The first block of the journal. The second holds the home block
+ * numbers of the logged blocks, whose copies follow it in order. A
+ * transaction is committed once the header records its size, and is
+ * finished once the header is reset to 0 after every block has been
+ * written home.
+ */
+#define S5_JOURNAL_MAGIC 0x4a6e6c35
+typedef struct s5_jheader {
+  uint32_t s5j_magic;
+  uint32_t s5j_sequence; /* number of the last transaction committed */
+  uint32_t s5j_nblocks;  /* blocks in the committed transaction, or 0 */
+} s5_jheader_t;
+
 /* The contents of an inode, as stored on disk. */
 typedef struct s5_inode {
   union {
@@ -92,10 +141,11 @@ typedef struct s5_inode {
 #define s5_next_free s5_un.s5_next_free
 #define s5_size s5_un.s5_size
   uint32_t s5_number;   /* this inode's number */
-  uint16_t s5_type;     /* one of S5_TYPE_{FREE,DATA,DIR,CHR,BLK} */
+  uint16_t s5_type;     /* one of S5_TYPE_*, above */
   int16_t s5_linkcount; /* link count of this inode */
   uint32_t s5_direct_blocks[S5_NDIRECT_BLOCKS];
-  uint32_t s5_indirect_block;
+  uint32_t s5_indirect_block;  /* or the devid of a device file */
+  uint32_t s5_dindirect_block; /* block of indirect block numbers */
 } s5_inode_t;
 
 /* The contents of a directory entry, as stored on disk. */
@@ -105,13 +155,65 @@ typedef struct s5_dirent {
 } s5_dirent_t;
 
 #ifndef __FSMAKER__
+struct s5_journal;
+
 /* Our in-memory representation of a s5fs filesytem (fs_i points to this) */
 typedef struct s5fs {
   blockdev_t *s5f_bdev;
   s5_super_t *s5f_super;
   kmutex_t s5f_mutex;
   fs_t *s5f_fs;
+
+  /*
+   * Free blocks and inodes are tracked in in-core bitmaps, so that a
+   * file's blocks can be placed next to each other and allocations
+   * neither take s5f_mutex nor dirty the superblock. The superblock's
+   * free lists are drained into them at mount and rebuilt from them at
+   * unmount; while mounted, the lists on disk are empty, so after a
+   * crash the maps are rebuilt by scanning the inodes instead.
+   * Allocations without a goal start looking at s5f_rotor (blocks) or
+   * s5f_irotor (inodes).
+   */
+  spinlock_t s5f_map_lock;
+  uint32_t *s5f_freemap;     /* bit set for each free block */
+  uint32_t s5f_nblocks;      /* blocks covered by s5f_freemap */
+  uint32_t s5f_nfreeblocks;  /* bits set in s5f_freemap */
+  uint32_t s5f_rotor;
+  uint32_t *s5f_inodemap;    /* bit set for each free inode */
+  uint32_t s5f_nfreeinodes;  /* bits set in s5f_inodemap */
+  uint32_t s5f_irotor;
+
+  struct s5_journal *s5f_journal; /* NULL if the fs has no journal */
+
+  uint32_t s5f_state;           /* S5_STATE_* to leave on disk at unmount */
+  struct kthread *s5f_fsck_thr; /* background check, if running */
+  ktqueue_t s5f_fsckq;          /* waiting for it to finish */
+
+  /* Metadata checksums; s5f_csum_nblocks is 0 while they are off */
+  uint32_t s5f_csum_start;
+  uint32_t s5f_csum_nblocks;
+  uint32_t s5f_csum_errors;      /* mismatches found since mount */
+  uint32_t s5f_scrub_next;       /* next block the scrubber looks at */
+  int s5f_scrub_stopping;
+  struct kthread *s5f_scrub_thr; /* background scrubber, if running */
+  ktqueue_t s5f_scrubq;          /* it sleeps here between batches */
+
+  /* Warming the page cache at mount */
+  int s5f_warm_stopping;
+  struct kthread *s5f_warm_thr; /* reading in the pages, if running */
+  ktqueue_t s5f_warmq;          /* waiting for it to finish */
 } s5fs_t;
 
 int s5fs_mount(struct fs *fs);
+
+/**
+ * Makes an empty file system on a disk, as fsmaker's format does: the
+ * superblock, ninodes free inodes but the root, a root directory of "."
+ * and "..", and every other block on the free list.
+ *
+ * @param bd the disk, which must not be mounted
+ * @param ninodes how many inodes the file system has
+ * @return 0 or -errno
+ */
+int s5fs_format(blockdev_t *bd, uint32_t ninodes);
 #endif
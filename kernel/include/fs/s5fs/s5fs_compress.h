@@ -0,0 +1,90 @@
+/*
+ *   FILE: s5fs_compress.h
+ *  DESCR: S5 transparent compression of file data
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include "fs/s5fs/s5fs.h"
+
+/*
+ * The data of an S5_TYPE_COMPRESSED file is kept in clusters of
+ * S5_CLUSTER_PAGES pages, each of which is compressed as a unit when it
+ * is written back and stored in as few blocks as it then needs, in the
+ * block slots of the cluster's first pages; the slots left over are
+ * sparse. A cluster which does not shrink by at least a block is stored
+ * as it is, in all of its slots, and one which is all zeros is a hole,
+ * with none. So a cluster is
+ *
+ *      a hole             if its first slot is sparse,
+ *      stored as it is    if none of its slots is, and
+ *      compressed         otherwise.
+ *
+ * A compressed cluster is an s5_cluster_t followed by the pages of the
+ * cluster up to the end of the file in LZ4's block format; the rest of
+ * the cluster reads as zeros. Pages are read in by decompressing their
+ * cluster (all of its pages, when reading ahead), and each writeback
+ * compresses the whole cluster again, reading in from disk whatever
+ * part of it is not being written.
+ *
+ * Compression is turned on or off for a file with fcntl(F_SETCOMPRESS)
+ * while it is empty; copying a file into one made compressed compresses
+ * it.
+ */
+#define S5_CLUSTER_PAGES 4
+
+/* The start of a compressed cluster, as stored on disk. */
+typedef struct s5_cluster {
+  uint32_t s5c_len; /* bytes of compressed data which follow */
+} s5_cluster_t;
+
+/* Most bytes of compressed data a cluster can hold and still save a
+ * block */
+#define S5_CLUSTER_MAX_PACKED                                                  \
+  ((S5_CLUSTER_PAGES - 1) * S5_BLOCK_SIZE - sizeof(s5_cluster_t))
+
+struct vnode;
+
+/**
+ * Compresses len bytes from src into at most max bytes at dst, in LZ4's
+ * block format.
+ *
+ * @param table scratch space of S5_LZ_TABLE_SIZE bytes
+ * @return the size of the compressed data, or 0 if it doesn't fit
+ */
+#define S5_LZ_TABLE_SIZE PAGE_SIZE
+size_t s5_lz_compress(const void *src, size_t len, void *dst, size_t max,
+                      void *table);
+
+/**
+ * Decompresses len bytes of LZ4 block data from src into dst, stopping
+ * once max bytes have been written there.
+ *
+ * @return the number of bytes written, or -EIO if the data is corrupt
+ */
+int s5_lz_decompress(const void *src, size_t len, void *dst, size_t max);
+
+/**
+ * Fills a page of a compressed file; the fillpage operation. The caller
+ * holds the vnode lock.
+ */
+int s5_fill_compressed(struct vnode *vnode, off_t offset, void *pagebuf);
+
+/**
+ * Reads the pages of the clusters [start, end) covers which are not
+ * resident into the page cache, one decompression per cluster. The
+ * caller holds the vnode lock. Returns the number of pages passed over.
+ */
+uint32_t s5_readahead_compressed(struct vnode *vnode, uint32_t start,
+                                 uint32_t end);
+
+/**
+ * Writes back the npages consecutive pages of a compressed file from the
+ * one containing offset, compressing each cluster they are in. The
+ * caller holds the vnode lock for writing, inside a journal bracket.
+ * Returns 0 or -errno.
+ */
+int s5_clean_compressed(struct vnode *vnode, off_t offset, void **pagebufs,
+                        int npages);
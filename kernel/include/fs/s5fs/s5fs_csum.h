@@ -0,0 +1,97 @@
+/*
+ *   FILE: s5fs_csum.h
+ *  DESCR: S5 metadata block checksums and background scrubbing
+ */
+
+#pragma once
+
+#include "types.h"
+
+struct pframe;
+struct s5fs;
+struct s5_super;
+
+/*
+ * Every metadata block but the superblock (which carries its own, in
+ * s5s_csum) has a CRC-32C in a table of S5_CSUMS_PER_BLOCK to a block,
+ * created at first mount; 0 there means the block has none. The journal
+ * stores the checksums of the blocks it commits in the same transaction
+ * as the blocks, so a crash never leaves a checksum out of date, and a
+ * block which is freed has its checksum forgotten, since whatever it
+ * holds next may be written without going through the journal. Blocks
+ * are checked as they are read into the device's pages, and those which
+ * are not read for a long time by a scrubber, a few at a time whenever
+ * the disk is idle, so that corruption is found while it is still
+ * small. A mismatch is reported and makes the next mount check the file
+ * system; reads which find one still succeed.
+ *
+ * Checksums are kept only while the file system has a journal. Anything
+ * else which changes the disk (fsmaker) clears s5s_csum, which makes
+ * the next mount start the table over rather than trust it.
+ */
+#define S5_CSUMS_PER_BLOCK (S5_BLOCK_SIZE / sizeof(uint32_t))
+
+/**
+ * Checks the superblock's own checksum.
+ *
+ * @param super the superblock
+ * @return 1 if it is right, 0 if there is none, -1 if it is wrong
+ */
+int s5_csum_check_super(struct s5_super *super);
+
+/**
+ * Sets the superblock's own checksum. Called whenever the superblock is
+ * about to be written.
+ *
+ * @param super the superblock
+ */
+void s5_csum_super(struct s5_super *super);
+
+/**
+ * Starts keeping checksums: makes the table if the file system has none
+ * (or zeroes it unless trusted is 1), forgets the checksums of free blocks,
+ * starts checking blocks as they are read and starts the scrubber.
+ * Called at mount once the journal is started. Checksums are left off
+ * if they cannot be kept.
+ *
+ * @param fs the file system
+ * @param trusted what s5_csum_check_super said of the superblock on disk
+ * @return 0 or -errno
+ */
+int s5_csum_start(struct s5fs *fs, int trusted);
+
+/**
+ * Stops the scrubber and checking blocks as they are read. Called at
+ * unmount before the journal is stopped; the commits which follow still
+ * store checksums.
+ *
+ * @param fs the file system
+ */
+void s5_csum_stop(struct s5fs *fs);
+
+/**
+ * True if the block is part of the checksum table.
+ */
+int s5_csum_is_table(struct s5fs *fs, uint32_t blockno);
+
+/**
+ * Forgets the checksum of a block which is being freed. Called inside
+ * an operation.
+ *
+ * @param fs the file system
+ * @param blockno the block
+ */
+void s5_csum_forget(struct s5fs *fs, uint32_t blockno);
+
+/**
+ * Stores the checksums of the n pinned pages about to be committed, then
+ * adds to them, pinned and in order of block number, every dirty page of
+ * the table; there must be room in pfs for s5f_csum_nblocks more. Called
+ * by the journal with operations kept out.
+ *
+ * @param fs the file system
+ * @param pfs the pages, sorted by block number
+ * @param n how many there are
+ * @return how many there are now
+ */
+uint32_t s5_csum_seal(struct s5fs *fs, struct pframe **pfs, uint32_t n);
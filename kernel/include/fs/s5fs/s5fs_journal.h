@@ -0,0 +1,127 @@
+/*
+ *   FILE: s5fs_journal.h
+ *  DESCR: S5 write-ahead metadata journal
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+#include "util/time.h"
+#include "proc/sched.h"
+
+struct blockdev;
+struct blockdev_iovec;
+struct kthread;
+struct pframe;
+struct s5fs;
+
+/*
+ * Metadata (the superblock, inode blocks, indirect blocks, free list
+ * blocks and, through s5fs_cleanpage, directory blocks) lives in the
+ * block device's pages. Those pages are never written home by the pager;
+ * instead the journal daemon periodically commits all of them at once:
+ * it waits for operations in progress to finish, writes copies of every
+ * dirty metadata page to the journal in one sequential request, commits
+ * by writing the journal header, writes the pages home and then marks
+ * the journal empty. A crash leaves either the old or the new contents
+ * of every block, and mount replays a committed transaction that was not
+ * finished. Each step is kept from reaching the disk ahead of the one
+ * before it by flushing the disk's write cache in between.
+ *
+ * Operations which change metadata are bracketed by s5_journal_begin and
+ * s5_journal_end so that a commit never captures one half-done. Brackets
+ * nest within a thread.
+ */
+typedef struct s5_journal {
+  struct s5fs *j_fs;
+  struct blockdev *j_bdev;
+  uint32_t j_start;   /* first block of the journal */
+  uint32_t j_ntags;   /* most blocks a transaction can log */
+  uint32_t j_sequence;
+
+  list_t j_handles;   /* handles of operations in progress */
+  int j_committing;   /* a commit is waiting for them or writing */
+  int j_wanted;       /* a commit has been asked for */
+  int j_stopping;     /* the daemon should exit */
+  int j_emptied;      /* the header saying so may not be durable yet */
+  ktqueue_t j_opq;    /* waiting for a commit (or the daemon) to finish */
+  ktqueue_t j_drainq; /* the commit waiting for operations to finish */
+  ktqueue_t j_daemonq;
+  ktimer_t j_timer;
+  struct kthread *j_thr;
+
+  char *j_hdr;         /* page for the journal header */
+  uint32_t *j_tags;    /* page for home block numbers */
+  struct pframe **j_pfs;      /* pages of the transaction being written */
+  struct blockdev_iovec *j_iov; /* the tags, then each page */
+} s5_journal_t;
+
+/* An operation in progress, on the stack of the thread doing it */
+typedef struct s5_jhandle {
+  struct kthread *jh_thr;
+  int jh_nested;
+  list_link_t jh_link;
+} s5_jhandle_t;
+
+/**
+ * Replays a committed but unfinished transaction, if there is one. Must
+ * be called before anything of the file system is read through the
+ * block device's pages.
+ *
+ * @param bd the device holding the file system
+ * @return 0 or -errno
+ */
+int s5_journal_recover(struct blockdev *bd);
+
+/**
+ * Starts journaling: creates the journal on disk if the file system
+ * doesn't have one yet, and starts the daemon. Called at mount once the
+ * free maps are loaded. The file system is left without a journal if
+ * none can be made.
+ *
+ * @param fs the file system
+ * @return 0 or -errno
+ */
+int s5_journal_start(struct s5fs *fs);
+
+/**
+ * Commits everything, stops the daemon and frees the journal. Called at
+ * unmount once nothing more will change.
+ *
+ * @param fs the file system
+ */
+void s5_journal_stop(struct s5fs *fs);
+
+/**
+ * Begins an operation which changes metadata. May block while a commit
+ * is being written.
+ */
+void s5_journal_begin(struct s5fs *fs, s5_jhandle_t *h);
+
+/**
+ * Like s5_journal_begin, but fails with -EBUSY rather than wait for a
+ * commit. For the pager, which a commit may be waiting on.
+ */
+int s5_journal_trybegin(struct s5fs *fs, s5_jhandle_t *h);
+
+/**
+ * Ends an operation begun with s5_journal_begin.
+ */
+void s5_journal_end(struct s5fs *fs, s5_jhandle_t *h);
+
+/**
+ * Asks the daemon to commit soon, without waiting for it.
+ */
+void s5_journal_kick(struct s5fs *fs);
+
+/**
+ * Commits everything now, on the caller's thread, and waits for it to be
+ * on disk. Without a journal, the dirty metadata pages are written home
+ * directly. Must not be called inside an operation.
+ *
+ * @param fs the file system
+ * @return 0 or -errno
+ */
+int s5_journal_sync(struct s5fs *fs);
@@ -8,14 +8,25 @@
 
 #include "types.h"
 
+struct dirent;
 struct fs;
+struct pframe;
 struct vnode;
+struct s5fs;
 
 int s5_alloc_inode(struct fs *fs, uint16_t type, devid_t devid);
 void s5_free_inode(struct vnode *vnode);
+int s5_load_freemaps(struct s5fs *fs);
+int s5_alloc_run(struct s5fs *fs, uint32_t goal, uint32_t n);
+int s5_inode_in_use(struct s5fs *fs, uint32_t ino);
+int s5_block_in_use(struct s5fs *fs, uint32_t blockno);
+void s5_save_freemaps(struct s5fs *fs);
 
 int s5_read_file(struct vnode *vn, off_t seek, char *dest, size_t len);
 int s5_write_file(struct vnode *vn, off_t seek, const char *bytes, size_t len);
+int s5_pin_file_page(struct vnode *vn, off_t seek, struct pframe **pf,
+                     size_t *nbytes);
+void s5_prefetch(struct vnode *vn, uint32_t start, uint32_t npages);
 
 /* TA BLANK {{{ */
 /* TODO: perhaps change the order of the arguments 'parent' and 'child' to
@@ -24,9 +35,20 @@ int s5_write_file(struct vnode *vn, off_t seek, const char *bytes, size_t len);
 int s5_link(struct vnode *parent, struct vnode *child, const char *name,
             size_t namelen);
 int s5_find_dirent(struct vnode *vnode, const char *name, size_t namelen);
+int s5_read_dirents(struct vnode *vnode, off_t offset, struct dirent *d,
+                    int n);
 int s5_remove_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_seek_to_block(struct vnode *vnode, off_t seekptr, int alloc);
+int s5_seek_to_run(struct vnode *vnode, off_t seekptr, int *blocks,
+                   int npages);
+int s5_punch_hole(struct vnode *vnode, off_t start, off_t end);
+void s5_free_range(struct vnode *vnode, uint32_t lo, uint32_t hi);
+int s5_clean_inline(struct vnode *vnode, off_t offset, const void *pagebuf);
+int s5_uninline(struct vnode *vnode);
+int s5_direct_io(struct vnode *vnode, off_t seek, char *buf, size_t len,
+                 int write);
 int s5_inode_blocks(struct vnode *vnode);
+void s5_dindex_destroy(struct vnode *vnode);
 
 #define VNODE_TO_S5FS(vn) ((s5fs_t *)((vn)->vn_fs->fs_i))
 #define VNODE_TO_S5INODE(vn) ((s5_inode_t *)(vn)->vn_i)
@@ -42,9 +64,11 @@ int s5_inode_blocks(struct vnode *vnode);
     int err;                                                                   \
     pframe_get(S5FS_TO_VMOBJ((fs)), S5_INODE_BLOCK((inode)->s5_number), &p);   \
     KASSERT(p);                                                                \
-    err = pframe_dirty(p);                                                     \
-    KASSERT(!err && "shouldn\'t fail for a page belonging "                    \
-                    "to a block device");                                      \
+    if (!pframe_is_dirty(p)) {                                                 \
+      err = pframe_dirty(p);                                                   \
+      KASSERT(!err && "shouldn\'t fail for a page belonging "                  \
+                      "to a block device");                                    \
+    }                                                                          \
   } while (0)
 
 /*
@@ -0,0 +1,70 @@
+/*
+ *   FILE: s5fs_warm.h
+ *  DESCR: S5 page cache warming across a clean unmount
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include "fs/s5fs/s5fs.h"
+
+/*
+ * With S5_WARM, a clean unmount writes down which pages were on the
+ * active lists, files' and metadata alike, in a block of its own named
+ * by s5s_warm_block, and the next mount reads them back in the
+ * background, in order of where they are on the disk, so that what was
+ * being used before a reboot is resident again soon after it. A file's
+ * page is named by its inode and page number, and a metadata block by
+ * its block number (with S5_WARM_META in place of the inode).
+ *
+ * The list is only trusted if the last unmount was clean and the
+ * superblock's checksum is right; anything else which may have changed
+ * the disk since (a crash, fsmaker) leaves it unread. It is kept at
+ * unmount rather than in pframe_shutdown, since the vnodes and their
+ * pages are gone by then.
+ */
+#define S5_WARM_META 0xffffffff
+
+typedef struct s5_warm_page {
+  uint32_t swp_ino; /* or S5_WARM_META */
+  uint32_t swp_pagenum;
+} s5_warm_page_t;
+
+#define S5_WARM_MAX_PAGES                                                      \
+  ((S5_BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(s5_warm_page_t))
+
+/* The contents of the block, as stored on disk. */
+typedef struct s5_warm {
+  uint32_t sw_count; /* entries in sw_pages */
+  uint32_t sw_unused;
+  s5_warm_page_t sw_pages[S5_WARM_MAX_PAGES];
+} s5_warm_t;
+
+/**
+ * Starts reading in the pages the last unmount wrote down, if there is
+ * a list and it can be trusted. Called at the end of mount.
+ *
+ * @param fs the file system
+ * @param trusted whether the disk is as the last unmount left it
+ */
+void s5_warm_start(struct s5fs *fs, int trusted);
+
+/**
+ * Stops reading pages in, and waits for the thread doing it to finish.
+ * Called at the start of unmount.
+ *
+ * @param fs the file system
+ */
+void s5_warm_stop(struct s5fs *fs);
+
+/**
+ * Writes down the pages of the file system on the active lists, making
+ * the block to keep them in if there is none. Called at unmount while
+ * the pages are still resident and the journal is running, before the
+ * free lists are saved.
+ *
+ * @param fs the file system
+ * @return 0 or -errno
+ */
+int s5_warm_record(struct s5fs *fs);
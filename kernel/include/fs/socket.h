@@ -0,0 +1,117 @@
+/*  socket.h - local (UNIX-domain) and UDP sockets
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#include "fs/uio.h"
+#else
+#include "sys/types.h"
+#include "sys/uio.h"
+#endif
+
+typedef uint32_t socklen_t;
+
+#define AF_UNIX 1 /* sockets on this machine */
+#define AF_LOCAL AF_UNIX
+#define AF_INET 2 /* IPv4; see netinet/in.h */
+
+#define SOCK_STREAM 1 /* a bidirectional byte stream */
+#define SOCK_DGRAM 2  /* bidirectional, boundary-preserving messages */
+
+/* Flags for sendmsg() and recvmsg() */
+#define MSG_DONTWAIT 0x01 /* fail with EAGAIN rather than block */
+#define MSG_TRUNC 0x02    /* msg_flags: the rest of a datagram was dropped */
+#define MSG_CTRUNC 0x04   /* msg_flags: files were dropped for want of room */
+#define MSG_GIFT 0x08     /* hand over whole pages rather than copy them */
+
+#define SOL_SOCKET 1
+#define SCM_RIGHTS 1 /* control message of file descriptors to pass */
+
+#define SCM_MAX_FD 16 /* most descriptors one message may pass */
+
+/* An address of any family, which is in sa_family */
+struct sockaddr {
+  uint16_t sa_family;
+  char sa_data[14];
+};
+
+struct msghdr {
+  void *msg_name; /* AF_INET: the peer's struct sockaddr_in */
+  socklen_t msg_namelen;
+  struct iovec *msg_iov; /* data to send or room to receive it */
+  int msg_iovlen;
+  void *msg_control; /* control messages (struct cmsghdr) */
+  socklen_t msg_controllen;
+  int msg_flags; /* set by recvmsg() */
+};
+
+struct cmsghdr {
+  socklen_t cmsg_len; /* bytes, including this header */
+  int cmsg_level;     /* SOL_SOCKET */
+  int cmsg_type;      /* SCM_RIGHTS */
+};
+
+#define CMSG_ALIGN(len) (((len) + sizeof(int) - 1) & ~(sizeof(int) - 1))
+#define CMSG_DATA(cmsg) ((unsigned char *)((struct cmsghdr *)(cmsg) + 1))
+#define CMSG_LEN(len) (sizeof(struct cmsghdr) + (len))
+#define CMSG_SPACE(len) (sizeof(struct cmsghdr) + CMSG_ALIGN(len))
+#define CMSG_FIRSTHDR(msg)                                                     \
+  ((msg)->msg_controllen >= sizeof(struct cmsghdr)                             \
+       ? (struct cmsghdr *)(msg)->msg_control                                  \
+       : NULL)
+#define CMSG_NXTHDR(msg, cmsg) __cmsg_nxthdr(msg, cmsg)
+
+static inline struct cmsghdr *__cmsg_nxthdr(struct msghdr *msg,
+                                            struct cmsghdr *cmsg) {
+  char *next = (char *)cmsg + CMSG_ALIGN(cmsg->cmsg_len);
+  char *end = (char *)msg->msg_control + msg->msg_controllen;
+
+  if (cmsg->cmsg_len < sizeof(struct cmsghdr) ||
+      next + sizeof(struct cmsghdr) > end)
+    return NULL;
+  return (struct cmsghdr *)next;
+}
+
+/*
+ * A pair of sockets is made connected to each other, and whatever is
+ * sent on one end is received on the other. Both ends may be read and
+ * written, by read() and write() as well as recvmsg() and sendmsg();
+ * only the latter two pass descriptors (SCM_RIGHTS), which the receiver
+ * gets as new descriptors for the same open files.
+ *
+ * With MSG_GIFT, the whole pages of the sender's buffers which lie in
+ * private, writable mappings are taken from it rather than copied, and
+ * the receiver's buffers get them the same way wherever they are page
+ * aligned; afterwards those pages of the sender read as after
+ * madvise(MADV_DONTNEED). Buffers which don't qualify are copied.
+ *
+ * socket() makes only UDP sockets, AF_INET and SOCK_DGRAM, whose
+ * datagrams go to and come from the address in msg_name; one not bound
+ * with bind() is given a port when it first sends. A received datagram
+ * arrives in a page of its own, which recvmsg() with MSG_GIFT maps in
+ * whole, in place of the first page of a page-aligned buffer at least a
+ * page long, rather than copying it; the rest of the page past the
+ * datagram reads as zeros.
+ */
+#ifdef __KERNEL__
+int do_socketpair(int domain, int type, int protocol, int sv[2]);
+int do_socket(int domain, int type, int protocol);
+int do_bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int do_sendmsg(int fd, const struct msghdr *msg, int flags);
+int do_recvmsg(int fd, struct msghdr *msg, int flags);
+#else
+int socketpair(int domain, int type, int protocol, int sv[2]);
+int socket(int domain, int type, int protocol);
+int bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int sendmsg(int fd, const struct msghdr *msg, int flags);
+int recvmsg(int fd, struct msghdr *msg, int flags);
+int send(int fd, const void *buf, size_t len, int flags);
+int recv(int fd, void *buf, size_t len, int flags);
+int sendto(int fd, const void *buf, size_t len, int flags,
+           const struct sockaddr *to, socklen_t tolen);
+int recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *from,
+             socklen_t *fromlen);
+#endif
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "fs/vfs.h"
+
+#include "util/debug.h"
+
+int statsfs_mount(struct fs *fs);
+
+/* The info function behind the statsfs file with the given name, or NULL
+ * if there is none */
+dbg_infofunc_t statsfs_info(const char *name);
+
+/* The name of the nth statsfs file, or NULL past the last one */
+const char *statsfs_name(int n);
@@ -0,0 +1,23 @@
+/*  uio.h - scatter/gather I/O vectors
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+#define IOV_MAX 16 /* most elements in a readv/writev vector */
+
+struct iovec {
+  void *iov_base; /* start of the buffer */
+  size_t iov_len; /* bytes in it */
+};
+
+#ifndef __KERNEL__
+int readv(int fd, const struct iovec *iov, int iovcnt);
+int writev(int fd, const struct iovec *iov, int iovcnt);
+#endif
@@ -115,6 +115,15 @@ typedef struct fs {
 
   /* Filesystem-specific data. */
   void *fs_i;
+
+  /*
+   * This file system's in-core vnodes, hashed by vno (see
+   * vnode_table_init).
+   */
+  list_t fs_vnodes;
+  struct vnode_bucket *fs_vhash;
+  int fs_vcache; /* whether vput keeps unreferenced vnodes (see vnode.c) */
+  int fs_ndirty; /* dirty resident pages of its files (see pframe.c) */
 } fs_t;
 
 /* - this is the vnode on which we will mount the vfsroot fs.
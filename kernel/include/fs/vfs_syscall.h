@@ -7,11 +7,22 @@
 #include "fs/open.h"
 #include "fs/pipe.h"
 #include "fs/stat.h"
+#include "fs/uio.h"
 
 int do_close(int fd);
 int do_read(int fd, void *buf, size_t nbytes);
 int do_write(int fd, const void *buf, size_t nbytes);
+int do_readv(int fd, const struct iovec *iov, int iovcnt);
+int do_writev(int fd, const struct iovec *iov, int iovcnt);
+int do_pread(int fd, void *buf, size_t nbytes, off_t offset);
+int do_pwrite(int fd, const void *buf, size_t nbytes, off_t offset);
+int do_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
 int do_dup(int fd);
+int do_fcntl(int fd, int cmd, int arg);
+int do_fadvise(int fd, off_t offset, off_t len, int advice);
+int do_fsync(int fd, int datasync);
+int do_ftruncate(int fd, off_t len);
+int do_fallocate(int fd, int mode, off_t offset, off_t len);
 int do_dup2(int ofd, int nfd);
 int do_mknod(const char *path, int mode, unsigned devid);
 int do_mkdir(const char *path);
@@ -21,8 +32,11 @@ int do_link(const char *from, const char *to);
 int do_rename(const char *oldname, const char *newname);
 int do_chdir(const char *path);
 int do_getdent(int fd, struct dirent *dirp);
+int do_getdents(int fd, struct dirent *dirp, size_t count);
 int do_lseek(int fd, int offset, int whence);
 int do_stat(const char *path, struct stat *uf);
+int do_fstat(int fd, struct stat *uf);
+int do_fstatat(int dirfd, const char *path, struct stat *uf);
 
 #ifdef __MOUNTING__
 /* for mounting implementations only, not required */
@@ -13,6 +13,7 @@
 #include "drivers/bytedev.h"
 #include "util/list.h"
 #include "proc/kmutex.h"
+#include "proc/krwlock.h"
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 
@@ -22,6 +23,15 @@ struct stat;
 struct file;
 struct vnode;
 struct vmarea;
+struct iovec;
+struct poll_table;
+struct pframe;
+
+/*
+ * Consumes len bytes of a file's contents at buf for splice_read,
+ * returning the number of bytes taken or -errno.
+ */
+typedef int (*splice_actor_t)(void *arg, const void *buf, size_t len);
 
 typedef struct vnode_ops {
   /* The following functions map directly to their corresponding
@@ -46,6 +56,40 @@ typedef struct vnode_ops {
    * transferred.
    */
   int (*write)(struct vnode *file, off_t offset, const void *buf, size_t count);
+  /*
+   * readv and writev are like read and write, but transfer to or from
+   * each of the iovcnt buffers of iov in turn, as one operation: the
+   * bytes are consecutive in the file, and no other write comes between
+   * them. They return the total number of bytes transferred. These are
+   * optional; if they are NULL, read or write is called once per buffer
+   * instead.
+   */
+  int (*readv)(struct vnode *file, off_t offset, const struct iovec *iov,
+               int iovcnt);
+  int (*writev)(struct vnode *file, off_t offset, const struct iovec *iov,
+                int iovcnt);
+  /*
+   * splice_read hands up to count bytes of file, from offset, to actor a
+   * piece at a time straight out of the file's pages, so that they need
+   * not be copied into a buffer first. No lock is held while actor runs,
+   * so it may block or write to other files. It stops at the end of the
+   * file or when actor takes less than it was given, and returns the
+   * total actor took, or -errno if that was nothing. This is optional;
+   * if it is NULL, the file is read into a buffer instead.
+   */
+  int (*splice_read)(struct vnode *file, off_t offset, size_t count,
+                     splice_actor_t actor, void *arg);
+  /*
+   * direct_io is read (or, if write is set, write) for a file opened
+   * with O_DIRECT: whole blocks at block-aligned offsets, from and to a
+   * page-aligned buf, go between buf and the disk without passing
+   * through the page cache, though any of them resident are kept up to
+   * date with (or read from) it. Whatever is not so aligned is
+   * transferred as read or write would. This is optional; a file
+   * without it can't be opened with O_DIRECT.
+   */
+  int (*direct_io)(struct vnode *file, off_t offset, void *buf, size_t count,
+                   int write);
   /*
    * Everything within 'vma' other than vma->vma_obj (and
    * vma_plink--meaning that 'vma' has not yet been entered into
@@ -109,6 +153,14 @@ typedef struct vnode_ops {
    * read and 0 will be returned.
    */
   int (*readdir)(struct vnode *dir, off_t offset, struct dirent *d);
+  /*
+   * readdirv is like readdir, but reads up to n entries into the array
+   * d at once, setting *nread to the number read. It returns the total
+   * amount offset should be increased by. This is optional; if it is
+   * NULL, readdir is called once per entry instead.
+   */
+  int (*readdirv)(struct vnode *dir, off_t offset, struct dirent *d, int n,
+                  int *nread);
 
   /* Operations that can be performed on any type of file: */
   /*
@@ -116,6 +168,16 @@ typedef struct vnode_ops {
    * information about file.
    */
   int (*stat)(struct vnode *vnode, struct stat *buf);
+  /*
+   * poll returns which of the poll(2) events (POLLIN, POLLOUT, POLLERR,
+   * POLLHUP) apply to file right now, and passes its pollq and pt to
+   * poll_wait so that do_poll is woken when that may change. POLLIN
+   * (or POLLHUP or POLLERR) promises that a read will not block, and
+   * POLLOUT that a write of up to PIPE_BUF bytes will not; nonblocking
+   * files rely on this. This is optional; if it is NULL, the file is
+   * always ready for reading and writing.
+   */
+  int (*poll)(struct vnode *file, int events, struct poll_table *pt);
   /*
    * acquire is called on a vnode when a file takes its first
    * reference to the vnode. The file is passed in.
@@ -155,6 +217,45 @@ typedef struct vnode_ops {
    * containing 'offset'.
    */
   int (*cleanpage)(struct vnode *vnode, off_t offset, void *pagebuf);
+  /*
+   * Optional: like cleanpage, for the 'npages' consecutive pages of
+   * 'vnode' starting with the one containing 'offset', whose buffers
+   * are given in order in 'pagebufs'. Lets the file system allocate
+   * and write the whole run at once.
+   */
+  int (*cleanpages)(struct vnode *vnode, off_t offset, void **pagebufs,
+                    int npages);
+  /*
+   * Optional: start reading the pages [pagenum, pagenum + npages) of
+   * 'vnode' into its page cache, skipping any already resident and
+   * stopping at the end of the file. A hint; it reports no errors.
+   */
+  void (*readahead)(struct vnode *vnode, uint32_t pagenum, uint32_t npages);
+  /*
+   * Optional: make the metadata of 'vnode' durable, once its data pages
+   * have been written back. If 'datasync' is set, only what is needed
+   * to read the data back (its size and where its blocks are) has to
+   * be. Returns 0 or -errno.
+   */
+  int (*fsync)(struct vnode *vnode, int datasync);
+  /*
+   * Optional: set the size of the regular file 'vnode' to 'len',
+   * freeing the blocks past it if it shrinks; a file which grows gains
+   * a hole. Returns 0 or -errno.
+   */
+  int (*truncate)(struct vnode *vnode, off_t len);
+  /*
+   * Optional: make [offset, offset + len) of the regular file 'vnode'
+   * a hole, freeing the blocks wholly inside it and zeroing the rest,
+   * without changing its size. Returns 0 or -errno.
+   */
+  int (*punch_hole)(struct vnode *vnode, off_t offset, off_t len);
+  /*
+   * Optional: turn compression of the data of the regular file 'vnode'
+   * on (1) or off (0), or leave it as it is (-1). Returns whether it was
+   * on, or -errno.
+   */
+  int (*compress)(struct vnode *vnode, int on);
 } vnode_ops_t;
 
 #define VN_BUSY 0x1
@@ -227,10 +328,12 @@ typedef struct vnode {
   off_t vn_len;
 
   /*
-   * A mutex used to synchronize reads and writes. This is only used by
-   * the underlying filesystem implementation.
+   * A reader-writer lock used to synchronize reads and writes. Reads,
+   * lookups, readdir and stat take it shared; anything which changes the
+   * file or directory takes it exclusive. This is only used by the
+   * underlying filesystem implementation.
    */
-  kmutex_t vn_mutex;
+  krwlock_t vn_lock;
 
   /*
    * A generic pointer which the file system can use to store any extra
@@ -238,6 +341,29 @@ typedef struct vnode {
    */
   void *vn_i;
 
+  /*
+   * Read-ahead state, maintained by the file system: the page a
+   * sequential reader would touch next and the current read-ahead
+   * window in pages (0 if access is not sequential). vn_ra_advice is the
+   * last POSIX_FADV_ access pattern given for the file.
+   */
+  uint32_t vn_ra_next;
+  uint32_t vn_ra_window;
+  int vn_ra_advice;
+
+  /*
+   * In-core index of a large directory's entries, maintained by the file
+   * system; NULL if there is none.
+   */
+  void *vn_dindex;
+
+  /*
+   * What exec last read of this file's headers, a single kmalloc()ed
+   * block kept by the binary loader (VN_EXEC_BUILDING while it is being
+   * read), or NULL. Any write to the file throws it away.
+   */
+  void *vn_exec;
+
   /* VFS BLANK {{{ */
   /* XXX: also changed because of name changes to bytedev_t and blockdev_t */
   /* VFS BLANK }}} */
@@ -260,10 +386,11 @@ typedef struct vnode {
   blockdev_t *vn_bdev;
 
   /* Used (only) by the v{get,ref,put} facilities (vfs/vnode.c): */
-  list_link_t vn_link; /* link on system vnode list */
-  int vn_flags;        /* VN_BUSY */
-  ktqueue_t vn_waitq;  /* queue of threads waiting for vnode
-                          to become not busy */
+  list_link_t vn_link;   /* link on system vnode list */
+  list_link_t vn_fslink; /* link on its file system's fs_vnodes */
+  list_link_t vn_hlink;  /* link on its hash bucket in fs_vhash */
+  list_link_t vn_ulink;  /* link on the unused list, if unreferenced */
+  int vn_flags;         /* VN_BUSY; waiters sleep on the hash bucket */
 } vnode_t;
 
 /* Core vnode management routines: */
@@ -341,6 +468,22 @@ void vput(vnode_t *vn);
 /*     Unmounting (shutting down the VFS) is the primary reason for the
  *     existence of the following three routines (when unmounting an s5 fs,
  *     they are used in the order that they are listed here): */
+/*
+ *         Set up (before its mount function is called) and tear down
+ *         (after it is unmounted) the table of a file system's in-core
+ *         vnodes. Each mount has its own, so vget, unmount and the
+ *         flushing of one file system don't wade through the others.
+ */
+int vnode_table_init(struct fs *fs);
+void vnode_table_destroy(struct fs *fs);
+
+/*
+ *         Stop keeping the file system's unreferenced vnodes around, and
+ *         get rid of those being kept. Called before it is unmounted, so
+ *         that its vnodes all go while it still can write them back.
+ */
+void vnode_cache_stop(struct fs *fs);
+
 /*
  *         Checks to see if there are any actively-referenced vnodes
  *         belonging to the specified filesystem.
@@ -359,12 +502,71 @@ int vfs_is_in_use(struct fs *fs);
  */
 void vnode_flush_all(struct fs *fs);
 
+/*
+ *         Calls fn(pf, arg) on each resident page of each vnode of the
+ *         specified fs. The vnode list lock is held throughout, so fn
+ *         must not block.
+ */
+void vnode_foreach_respage(struct fs *fs, void (*fn)(struct pframe *, void *),
+                           void *arg);
+
+/*
+ *         Write back the dirty resident pages of one vnode, a run of
+ *         adjacent pages at a time, waiting for any writes of them
+ *         already in progress. Returns 0 or -errno. Pages pinned right
+ *         now are left for the pager.
+ */
+int vnode_flush(vnode_t *vn);
+
 /*
  *         Returns the number of vnodes from this filesystem that are in
  *         use.
  */
 int vnode_inuse(struct fs *fs);
 
+/*
+ *         A dbg_infofunc_t (arg must be NULL): how many vnodes are in
+ *         core and how many of those are unused, and how often vget found
+ *         the one it wanted there.
+ */
+size_t vnode_info(const void *arg, char *buf, size_t osize);
+
+/*
+ *         Returns the vnode whose page cache 'o' is, or NULL if 'o' is
+ *         some other kind of object.
+ */
+vnode_t *vnode_of_mmobj(struct mmobj *o);
+
+/*
+ *         Reads the pages [lo, hi) of a file into its page cache ahead
+ *         of use, if the file system can.
+ */
+void vnode_readahead(vnode_t *vn, uint32_t lo, uint32_t hi);
+
+/*
+ *         Drops the clean, unmapped resident pages in [lo, hi) of a file
+ *         from its page cache, and makes the rest the pager's first
+ *         choice.
+ */
+void vnode_dontneed(vnode_t *vn, uint32_t lo, uint32_t hi);
+
+/*
+ *         Throws away the resident pages in [lo, hi) of a file, dirty or
+ *         mapped, because the blocks under them are about to be freed.
+ *         Waits for any being read or written. The caller holds vn_lock
+ *         for writing.
+ */
+void vnode_drop_pages(vnode_t *vn, uint32_t lo, uint32_t hi);
+
+#define VN_EXEC_BUILDING ((void *)1)
+
+/*
+ *         Forgets vn_exec, because the file is about to change (or go
+ *         away). A loader in the middle of filling it in sees that it is
+ *         no longer VN_EXEC_BUILDING, and keeps its result to itself.
+ */
+void vnode_exec_forget(vnode_t *vn);
+
 /* Diagnostic: */
 /*
  *     Prints the vnodes that are in use.  Specifying a fs_t will restrict
@@ -16,3 +16,5 @@
 #define LONG_MIN (-LONG_MAX - 1)
 
 #define UPTR_MAX UINT_MAX
+
+#define PIPE_BUF 4096 /* most bytes a poll for POLLOUT promises to take */
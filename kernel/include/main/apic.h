@@ -10,12 +10,30 @@ void apic_init();
 /* Maps the given IRQ to the given interrupt number. */
 void apic_setredir(uint32_t irq, uint8_t intr);
 
-/* Starts the APIC timer */
+/* Which processor, by index as for apic_cpu_apicid, the I/O APIC
+ * delivers irq to */
+void apic_setaffinity(uint32_t irq, int cpu);
+int apic_getaffinity(uint32_t irq);
+
+/* Starts the APIC timer, interrupting freq times a second */
 void apic_enable_periodic_timer(uint32_t freq);
 
 /* Stops the APIC timer */
 void apic_disable_periodic_timer();
 
+/* Restarts the periodic timer at the frequency last given to
+ * apic_enable_periodic_timer, e.g. after apic_oneshot_timer. */
+void apic_resume_periodic_timer();
+
+/* Replaces the periodic timer with a single interrupt after the given
+ * number of its periods. Returns the number of periods actually
+ * programmed, which is less if the count would not fit the counter. */
+uint32_t apic_oneshot_timer(uint32_t periods);
+
+/* Returns the number of periods, to the nearest, since the timer was
+ * last started. */
+uint32_t apic_timer_elapsed();
+
 /* Sets the interrupt to raise when a spurious
  * interrupt occurs. */
 void apic_setspur(uint8_t intr);
@@ -33,3 +51,10 @@ uint8_t apic_getipl();
  * originating from the APIC has been finished. This function
  * should only be called from the interrupt subsystem. */
 void apic_eoi();
+
+/* Returns the number of usable processors found in the ACPI tables.
+ * Processor 0 is the one Weenix booted on. */
+int apic_cpu_count();
+
+/* Returns the local APIC id of the given processor. */
+uint8_t apic_cpu_apicid(int cpu);
@@ -86,7 +86,18 @@ enum cpuid_requests {
 };
 
 static inline void cpuid(int request, uint32_t *a, uint32_t *d) {
-  __asm__ volatile("cpuid" : "=a"(*a), "=d"(*d) : "0"(request));
+  __asm__ volatile("cpuid"
+                   : "=a"(*a), "=d"(*d)
+                   : "0"(request)
+                   : "ebx", "ecx");
+}
+
+/* All four registers, for leaves which use ebx and ecx too */
+static inline void cpuid_regs(uint32_t request, uint32_t *a, uint32_t *b,
+                              uint32_t *c, uint32_t *d) {
+  __asm__ volatile("cpuid"
+                   : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                   : "0"(request), "2"(0));
 }
 
 static inline void cpuid_get_msr(uint32_t msr, uint32_t *lo, uint32_t *hi) {
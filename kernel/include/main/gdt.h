@@ -10,10 +10,15 @@
 #define GDT_USER_TEXT 0x18
 #define GDT_USER_DATA 0x20
 #define GDT_TSS 0x28
+#define GDT_USER_TLS 0x30 /* %gs in userland, see gdt_set_tls */
+#define GDT_KERNEL_PERCPU 0x38 /* %fs in the kernel, see main/percpu.h */
 
 void gdt_init(void);
 
 void gdt_set_kernel_stack(void *addr);
+/* Where the TSS keeps the kernel stack, which SYSENTER starts out on */
+uint32_t *gdt_kernel_stack_slot(void);
+void gdt_set_tls(uint32_t base);
 
 void gdt_set_entry(uint32_t segment, uint32_t base, uint32_t limit,
                    uint8_t ring, int exec, int dir, int rw);
@@ -7,14 +7,19 @@
 
 #define INTR_DIVIDE_BY_ZERO 0x00
 #define INTR_INVALID_OPCODE 0x06
+#define INTR_DEVICE_NOT_AVAILABLE 0x07
 #define INTR_GPF 0x0d
 #define INTR_PAGE_FAULT 0x0e
 
 #define INTR_PIT 0xf1
 #define INTR_APICTIMER 0xf0
 #define INTR_KEYBOARD 0xe0
+#define INTR_SERIAL 0xe1
 #define INTR_DISK_PRIMARY 0xd0
 #define INTR_DISK_SECONDARY 0xd1
+#define INTR_VIRTIO_BLK 0xd2
+#define INTR_AHCI 0xd3
+#define INTR_VIRTIO_NET 0xd4
 
 /* NOTE: INTR_SYSCALL is not defined here, but is in syscall.h (it must be
  * in a userland-accessible header) */
@@ -23,7 +28,7 @@
 #define IPL_HIGH (0xff)
 
 typedef struct regs {
-  uint32_t r_es, r_ds; /* pushed manually */
+  uint32_t r_fs, r_es, r_ds; /* pushed manually */
   uint32_t r_edi, r_esi, r_ebp, r_esp, r_ebx, r_edx, r_ecx,
       r_eax;              /* pushed by pusha */
   uint32_t r_intr, r_err; /* intr number and error code */
@@ -33,6 +38,13 @@ typedef struct regs {
 
 void intr_init();
 
+/* r_err in the frame of a system call made with SYSENTER; the int
+ * $INTR_SYSCALL kind have 0 there */
+#define INTR_SYSENTER 0x1
+
+/* Whether userland may use SYSENTER instead of int $INTR_SYSCALL */
+int intr_sysenter_enabled(void);
+
 /* The function pointer which should be implemented by functions
  * which will handle interrupts. These handlers should be registered
  * with the interrupt subsystem via the intr_register function.
@@ -48,10 +60,40 @@ typedef void (*intr_handler_t)(regs_t *regs);
 intr_handler_t intr_register(uint8_t intr, intr_handler_t handler);
 int32_t intr_map(uint16_t irq, uint8_t intr);
 
+/* Delivers irq, which must have been intr_map'd, to processor cpu from
+ * now on. Returns 0, or -EINVAL if either is not in use. An irq is first
+ * delivered to the processor config.h names for its kind of device. */
+int intr_set_affinity(uint16_t irq, uint32_t cpu);
+
+/* Interrupt counts per vector and processor, for statsfs */
+size_t intr_info(const void *arg, char *buf, size_t osize);
+
 static inline void intr_enable() { __asm__ volatile("sti"); }
 
 static inline void intr_disable() { __asm__ volatile("cli"); }
 
+/* Disables interrupts, returning the flags for intr_restore(), which puts
+ * them back the way they were. Unlike the IPL this works before the APIC
+ * is set up, and it masks the timer too. */
+static inline uint32_t intr_save() {
+  uint32_t flags;
+  __asm__ volatile("pushfl\n\t"
+                   "popl %0\n\t"
+                   "cli"
+                   : "=r"(flags)
+                   :
+                   : "memory");
+  return flags;
+}
+
+static inline void intr_restore(uint32_t flags) {
+  __asm__ volatile("pushl %0\n\t"
+                   "popfl"
+                   :
+                   : "r"(flags)
+                   : "memory", "cc");
+}
+
 /* Atomically enables interrupts using the sti
  * instruction and puts the processor into a halted
  * state, this function returns once an interrupt
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "types.h"
+
+#define NUMA_MAX_NODES 8
+
+/* Reads the NUMA topology from the ACPI SRAT, if there is one, and
+ * tells the page allocator which memory is on which node. ACPI and
+ * the APIC must be initialized before calling this function. */
+void numa_init();
+
+/* Returns the number of NUMA nodes, at least 1. */
+int numa_node_count();
+
+/* Returns the node of the processor with the given local APIC id. */
+int numa_cpu_node(uint8_t apicid);
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "kernel.h"
+#include "types.h"
+
+/*
+ * Per-CPU data. Each processor has a percpu_t of its own, and its %fs
+ * segment (the GDT_KERNEL_PERCPU selector, whose base is that processor's
+ * area) points at it whenever it is in the kernel: gdt_init loads %fs and
+ * the interrupt and system call entry code reloads it on the way in from
+ * userland.
+ *
+ * percpu_read, percpu_write and percpu_add are each a single instruction
+ * through %fs, so they are atomic with respect to interrupts on this
+ * processor and need neither a lock prefix nor the IPL raised; nothing
+ * else ever writes another processor's area. Readers wanting a total add
+ * up every area with percpu_sum, which may be slightly stale but never
+ * torn. The accessors only handle 32 bit fields.
+ *
+ * Only the boot processor runs threads for now. One brought up later
+ * gets a GDT of its own with GDT_KERNEL_PERCPU pointed at its area, so
+ * that the selector, and everything here, stays the same.
+ */
+
+struct tasklet;
+
+#define PERCPU_MAX 16 /* processors apic.c will record */
+
+typedef struct percpu {
+  struct percpu *pc_self; /* %fs:0, so that this_cpu is one load */
+  uint32_t pc_cpu;        /* index, the boot processor being 0 */
+
+  uint32_t pc_nswitches; /* sched_switch calls */
+  uint32_t pc_nidles;    /* times sched_switch found nothing to run */
+
+  uint32_t pc_rcu_qs;      /* grace period last quiescent in, see rcu.c */
+  uint32_t pc_rcu_nesting; /* rcu_read_lock depth */
+
+  uint32_t pc_dcache_hits; /* dcache_lookup results */
+  uint32_t pc_dcache_negative;
+  uint32_t pc_dcache_misses;
+
+  struct tasklet *pc_tasklets; /* pending, see main/tasklet.h */
+  struct tasklet **pc_tasklet_tail;
+  uint32_t pc_tasklet_running;
+  uint32_t pc_ntasklets; /* tasklets run */
+} __attribute__((aligned(64))) percpu_t;
+
+extern percpu_t percpu_areas[PERCPU_MAX];
+extern uint32_t percpu_ncpus;
+
+/* Points processor cpu's GDT_KERNEL_PERCPU at its area and loads %fs;
+ * called on each processor after its GDT is set up */
+void percpu_init(uint32_t cpu);
+
+#define percpu_read(field)                                                     \
+  ({                                                                           \
+    uint32_t __v;                                                              \
+    __asm__ volatile("movl %%fs:%c1, %0"                                       \
+                     : "=r"(__v)                                               \
+                     : "i"(offsetof(percpu_t, field))                          \
+                     : "memory");                                              \
+    __v;                                                                       \
+  })
+
+#define percpu_write(field, val)                                               \
+  __asm__ volatile("movl %1, %%fs:%c0" ::"i"(offsetof(percpu_t, field)),       \
+                   "ri"((uint32_t)(val))                                       \
+                   : "memory")
+
+#define percpu_add(field, n)                                                   \
+  __asm__ volatile("addl %1, %%fs:%c0" ::"i"(offsetof(percpu_t, field)),       \
+                   "ri"((uint32_t)(n))                                         \
+                   : "memory", "cc")
+
+#define percpu_inc(field) percpu_add(field, 1)
+
+#define this_cpu() ((percpu_t *)percpu_read(pc_self))
+
+#define percpu_sum(field)                                                      \
+  ({                                                                           \
+    uint32_t __sum = 0, __cpu;                                                 \
+    for (__cpu = 0; __cpu < percpu_ncpus; __cpu++)                             \
+      __sum += percpu_areas[__cpu].field;                                      \
+    __sum;                                                                     \
+  })
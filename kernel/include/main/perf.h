@@ -0,0 +1,16 @@
+#pragma once
+
+#include "types.h"
+
+#include "api/perf.h"
+
+struct kthread;
+
+/* Programs the counters api/perf.h names which the processor has */
+void perf_init(void);
+
+/* Adds what the counters have counted since the last call to thr, or to
+ * no one if thr is NULL. The scheduler calls this when a thread stops
+ * running, and with NULL when it is done idling, which is how each
+ * thread gets counters of its own. */
+void perf_charge(struct kthread *thr);
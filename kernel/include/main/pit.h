@@ -2,8 +2,17 @@
 
 #include "types.h"
 
-/* Starts the Programmable Interval Timer (PIT)
- * delivering periodic interrupts at 1000 Hz
- * (i.e., one every millisecond) to the given interrupt. */
-void pit_init(uint8_t intr);
-void pit_starttimer(uint8_t intr);
+/*
+ * The Programmable Interval Timer, used only to measure the other clocks
+ * against at boot: channel 2, whose gate and output software can get at
+ * through port 0x61, counts down once at PIT_HZ.
+ */
+
+#define PIT_HZ 1193182 /* input cycles per second */
+
+/* Starts channel 2 counting down count input cycles, count / PIT_HZ
+ * seconds */
+void pit_oneshot_start(uint16_t count);
+
+/* Spins until the count started by pit_oneshot_start reaches zero */
+void pit_oneshot_wait(void);
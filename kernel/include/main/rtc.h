@@ -0,0 +1,7 @@
+#pragma once
+
+#include "time.h"
+
+/* Reads the battery-backed real-time clock, which is taken to run in UTC,
+ * as seconds since the epoch */
+time_t rtc_read(void);
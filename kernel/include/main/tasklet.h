@@ -0,0 +1,46 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Tasklets are work an interrupt handler defers until it has returned, so
+ * that the handler itself need only acknowledge the device and note what
+ * happened. Pending tasklets are run, in the order they were scheduled,
+ * on the way out of the interrupt once it has been acknowledged, provided
+ * the code it interrupted had interrupts on and the IPL at IPL_LOW;
+ * otherwise they wait for the next interrupt which finds things so, or
+ * for sched_switch to go idle.
+ *
+ * A tasklet runs with interrupts on and the IPL at its own t_ipl, which
+ * is normally that of the interrupt scheduling it: anything which raises
+ * the IPL to hold off the interrupt holds off the tasklet too, but
+ * interrupts of higher priority, the timer in particular, get in while it
+ * runs. Tasklets must not block. One scheduled again while it is pending
+ * still runs once; one scheduled while it runs runs again afterwards.
+ */
+
+typedef struct tasklet {
+  struct tasklet *t_next; /* on the pending list */
+  int t_pending;
+  uint8_t t_ipl;
+  void (*t_func)(void *arg);
+  void *t_arg;
+} tasklet_t;
+
+void tasklet_init(tasklet_t *t, void (*func)(void *arg), void *arg,
+                  uint8_t ipl);
+
+/* Makes the tasklet pending. Called with interrupts off, as they are in
+ * an interrupt handler */
+void tasklet_schedule(tasklet_t *t);
+
+/**
+ * Runs the pending tasklets. Called with interrupts off and the IPL at
+ * IPL_LOW, which is how it returns.
+ *
+ * @return the number run
+ */
+int tasklet_run(void);
+
+/* Whether tasklets are waiting to run */
+int tasklet_pending(void);
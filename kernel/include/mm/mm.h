@@ -7,6 +7,11 @@
 #define USER_MEM_LOW 0x00400000  /* inclusive */
 #define USER_MEM_HIGH 0xc0000000 /* exclusive */
 
+/* The kernel addresses vmalloc maps pages at, just below the last 4mb,
+ * which hold the temporary mappings */
+#define VMALLOC_HIGH 0xffc00000 /* exclusive */
+#define VMALLOC_LOW (VMALLOC_HIGH - VMALLOC_PAGES * PAGE_SIZE)
+
 #define PTR_SIZE (sizeof(void *))
 #define PTR_MASK (PTR_SIZE - 1)
 
@@ -35,3 +40,8 @@ void pt_template_init();
  * only after the page subsystem has been initialized. Slab allocators
  * and kmalloc will not work until this funciton has been called. */
 void slab_init();
+
+/* Initializes vmalloc (see mm/vmalloc.h), whose page tables pt_init has
+ * made. This should be done only after the slab allocator has been
+ * initialized. */
+void vmalloc_init();
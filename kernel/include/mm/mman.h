@@ -23,3 +23,21 @@
 */
 #define MAP_FIXED 4
 #define MAP_ANON 8
+
+/* Advice for madvise().
+*/
+#define MADV_NORMAL 0     /* No special treatment. */
+#define MADV_RANDOM 1     /* Expect random access: no fault-around. */
+#define MADV_SEQUENTIAL 2 /* Expect sequential access: read ahead, and
+                           * reclaim pages soon after they are passed. */
+#define MADV_WILLNEED 3   /* Expect access soon: read the pages in now. */
+#define MADV_DONTNEED 4   /* Don't expect access soon: drop the pages. */
+
+/* Where shm_open() keeps its objects: a tmpfs, so that an object is
+ * a file whose pages a MAP_SHARED mapping of it shares outright.
+*/
+#define SHM_DIR "/shm"
+
+/* Flags for mremap().
+*/
+#define MREMAP_MAYMOVE 1 /* The mapping may move if it can't grow in place. */
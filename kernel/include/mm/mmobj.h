@@ -33,10 +33,16 @@ typedef struct mmobj {
    */
   /* Members relevant only to shadow objects: */
   struct mmobj *mmo_shadowed; /* the object that we shadow */
+
+  /* Swap slots of anonymous and shadow objects (see vm/swap.h) */
+  list_t mmo_swapped;
 } mmobj_t;
 
 struct mmobj_ops {
 
+  /* What kind of object this is, for statistics */
+  const char *name;
+
   /* Add a reference to 'o'.
    * This may not block. */
   void (*ref)(mmobj_t *o);
@@ -87,6 +93,15 @@ struct mmobj_ops {
    * Return 0 on success and -errno otherwise.
    */
   int (*cleanpage)(mmobj_t *o, struct pframe *pf);
+
+  /*
+   * Optional; may be NULL. Like cleanpage, but for npages pages of 'o'
+   * with consecutive page numbers, given in pfs in increasing order,
+   * so that the object can write them back with a single request.
+   * This may block.
+   * Return 0 on success and -errno otherwise.
+   */
+  int (*cleanpages)(mmobj_t *o, struct pframe **pfs, int npages);
 };
 
 /*
@@ -100,6 +115,7 @@ static inline void mmobj_init(mmobj_t *o, mmobj_ops_t *ops) {
   list_init(&(o)->mmo_respages);
   list_init(&(o)->mmo_un.mmo_vmas);
   (o)->mmo_shadowed = NULL;
+  list_init(&(o)->mmo_swapped);
 }
 
 #define mmobj_bottom_obj(o)                                                    \
@@ -31,6 +31,14 @@
  * only be called once for any given page (no overlaps). */
 void page_add_range(uintptr_t start, uintptr_t end);
 
+/* Records that the physical memory [pstart,pend) is on
+ * the given NUMA node, and which node the processor is
+ * on. Allocations are satisfied from memory on the local
+ * node when there is any; until told otherwise, all the
+ * memory and the processor are on node 0. */
+void page_set_node(uintptr_t pstart, uintptr_t pend, int node);
+void page_set_local_node(int node);
+
 /* These functions allocate and free one page-aligned,
  * page-sized block of memory. Values passed to
  * page_free MUST have been returned by page_alloc
@@ -41,15 +49,40 @@ void page_add_range(uintptr_t start, uintptr_t end);
 void *page_alloc(void);
 void page_free(void *addr);
 
+/* Like page_alloc, but the page is filled with zeros.
+ * Such pages are kept ready by page_zero_idle, which
+ * the scheduler calls when it has nothing else to do,
+ * so this is usually no more expensive than page_alloc.
+ * Free the page with page_free. */
+void *page_alloc_zeroed(void);
+int page_zero_idle(void);
+
 /* These functions allocate and free a page-aligned
  * block of memory which are npages pages in length.
  * A call to page_alloc_n will allocate a block, to free
  * that block a call should be made to page_free_n with
  * npages set to the same as it was when the block was
- * allocated */
+ * allocated. When free memory is too scattered for the
+ * block, pages of the page cache are moved out of the
+ * way to make one (see pframe_relocate). */
 void *page_alloc_n(uint32_t npages);
 void page_free_n(void *start, uint32_t npages);
 
+/* Record (or, with owner NULL, clear) an owner for each
+ * of the npages pages starting at addr, and look up the
+ * owner of the page containing an address. This is for
+ * the benefit of whoever allocated the pages, such as the
+ * slab allocator. */
+void page_set_owner(void *addr, uint32_t npages, void *owner);
+void *page_get_owner(void *addr);
+
+/* Every page has a frame descriptor, set aside along with
+ * the page allocator's own bookkeeping when its range is
+ * added, and looked up by the page's frame number within
+ * its range. The descriptors are zeroed to begin with and
+ * are otherwise left entirely to pframe.c. */
+struct pframe *page_pframe(void *addr);
+
 /* Returns the number of free pages remaining in the
  * system. Note that calls to page_alloc_n(npages) may
  * fail even if page_free_count() >= npages. */
@@ -23,11 +23,16 @@ typedef uint32_t pde_t;
 typedef struct pagedir pagedir_t;
 
 /* Temporarily maps one page at the given physical address in at a
- * virtual address and returns that virtual address. Note that repeated
- * calls to this function will return the same virtual address, thereby
- * invalidating the previous mapping. */
+ * virtual address and returns that virtual address. There are only a
+ * few slots for temporary mappings, used in turn, so the mapping only
+ * lasts until a few more pages have been mapped; a page which is still
+ * mapped is given the same address again without a TLB flush. */
 uintptr_t pt_phys_tmp_map(uintptr_t paddr);
 
+/* Likewise maps count (at most 8) physical pages starting at paddr, at
+ * consecutive virtual addresses, and returns the first. */
+uintptr_t pt_phys_tmp_map_range(uintptr_t paddr, uint32_t count);
+
 /* Permenantly maps the given number of physical pages, starting at the
  * given physical address to a virtual address and returns that virtual
  * address. Each call will return a different virtual address and the
@@ -45,34 +50,58 @@ uintptr_t pt_virt_to_phys(uintptr_t vaddr);
 /* Maps the given physical page in at the given virtual page in the
  * given page directory. Creates a new page table if necessary and
  * places an entry in it in the page directory. vaddr must be in the
- * user address space. Both vaddr and paddr must be page aligned.
+ * user address space, or in that of vmalloc, whose page tables are made
+ * at boot and shared by every page directory, so that a mapping there is
+ * made in all of them. Both vaddr and paddr must be page aligned.
  * Note that the TLB is not flushed by this function. */
 int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags,
            uint32_t ptflags);
 
+/* Maps the given physical page read-only for userland at vaddr, which
+ * is below USER_MEM_LOW, in every page directory at once: they all share
+ * the template's page table for the bottom 4MB, which has nothing else
+ * in it. */
+void pt_map_user_shared(uintptr_t vaddr, uintptr_t paddr);
+
 /* Unmaps the page for the given virtual page from the given page
- * directory. vaddr must be in the user address space. vaddr must
- * be page aligned. Note that the TLB is not flushed by this function. */
+ * directory. vaddr must be in the user address space or that of
+ * vmalloc. vaddr must be page aligned. Note that the TLB is not flushed by this function. */
 void pt_unmap(pagedir_t *pd, uintptr_t vaddr);
 
+/* Returns the physical page which vaddr is mapped to in the given page
+ * directory, or 0 if it isn't mapped. vaddr must be page aligned in the
+ * user address space or that of vmalloc. */
+uintptr_t pt_lookup(pagedir_t *pd, uintptr_t vaddr);
+
 /* Unmaps the given range of addresses [low, high). As with pt_unmap,
  * the addresses must be page aligned in the user address space */
 void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh);
 
+/* Makes a page of the kernel's own memory (as from page_alloc) fault on
+ * any access, or undoes that, for guard pages. The kernel's page tables
+ * are shared by every page directory, so this affects them all. The TLB
+ * is flushed. */
+void pt_kernel_guard(uintptr_t vaddr);
+void pt_kernel_unguard(uintptr_t vaddr);
+
 /* Creates a new page directory which is initialized to contain
  * mappings for all kernel memory. If there is not enough memory
  * to allocate the directory NULL is returned. Note that destroying
  * a page diretory does not affect the TLB, it is assumed that the
- * page directory being destroyed is not currently in use. Destroying
+ * page directory being destroyed is not currently in use by a user
+ * thread, though a kernel thread may be running on it (in which case
+ * the template is loaded in its place). Destroying
  * a page directory frees all page tables for user memory referenced
- * by that page directory. */
+ * by that page directory; the directory itself may be kept to be
+ * handed out again by pt_create_pagedir. */
 pagedir_t *pt_create_pagedir();
 void pt_destroy_pagedir(pagedir_t *pdir);
 
 /* Sets the page table in cr3 and performs other updates required by
  * the page table subsystem. The address should be a virtual address,
  * it will be translated by the current page table before being
- * placed in cr3. */
+ * placed in cr3. Nothing is done if it is there already, so the TLB is
+ * only flushed when the page directory changes. */
 void pt_set(pagedir_t *pd);
 
 /* Retreives the virtual address of the page directory currently in cr3. */
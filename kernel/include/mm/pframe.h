@@ -8,9 +8,14 @@
 #include "util/init.h"
 
 struct mmobj;
+struct vmarea;
+struct fs;
 
 #define PF_BUSY 0x01
 #define PF_DIRTY 0x02
+#define PF_REFERENCED 0x04 /* requested again since last aged (pframe.c) */
+#define PF_ACTIVE 0x08     /* on (or, if pinned, returns to) the active list */
+#define PF_RMAP_LOST 0x10  /* a user mapping is missing from pf_rmaps */
 
 
 #define pframe_is_pinned(pf) ((pf)->pf_pincount)
@@ -18,7 +23,9 @@ struct mmobj;
 
 /* A pframe structure represents a page frame in physical memory available to
  * the
- * kernel. pframes are managed by mmobjs */
+ * kernel. pframes are managed by mmobjs. There is one for every page the page
+ * allocator manages, whether resident or not (see page_pframe); a page which
+ * is not resident has no object. */
 typedef struct pframe {
   /* Public read: (do not modify outside pframe.c) */
 
@@ -32,12 +39,13 @@ typedef struct pframe {
   void *pf_addr;
 
   /* Private: */
-  uint8_t pf_flags;   /* PF_DIRTY, PF_BUSY */
-  ktqueue_t pf_waitq; /* wait on this if page is busy */
+  uint8_t pf_flags;   /* PF_DIRTY, PF_BUSY, PF_REFERENCED, PF_ACTIVE,
+                         PF_RMAP_LOST */
   int pf_pincount;
-  list_link_t pf_link;  /* link on {free,allocated,pinned}_list */
+  list_link_t pf_link;  /* link on {active,inactive,pinned}_list */
   list_link_t pf_hlink; /* link on hash chain of resident page hash */
   list_link_t pf_olink; /* link on object's list of resident pages */
+  list_t pf_rmaps;      /* user mappings of the page (pframe_rmap_t) */
 } pframe_t;
 
 static inline uint8_t pframe_is_busy(pframe_t *pf) {
@@ -59,6 +67,10 @@ static inline void pframe_clear_dirty(pframe_t *pf) {
   pf->pf_flags &= ~PF_DIRTY;
 }
 
+/* The queue to wait on while a page is busy. It is shared with other pages,
+ * so check the page again on waking. */
+ktqueue_t *pframe_waitq(pframe_t *pf);
+
 void pframe_init(void);
 void pframe_add_range(uint32_t startpfn, uint32_t endpfn);
 void pframe_pageoutd_init(void);
@@ -68,17 +80,51 @@ void pframe_shutdown(void);
 pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum);
 
 int pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result);
+pframe_t *pframe_alloc_busy(struct mmobj *o, uint32_t pagenum);
+void pframe_fill_done(pframe_t *pf, int status);
 int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite,
                   pframe_t **result);
 void pframe_migrate(pframe_t *pf, mmobj_t *dest);
+void pframe_move(pframe_t *pf, mmobj_t *dest, uint32_t pagenum);
+void pframe_relocate(pframe_t *pf, void *addr);
 
 void pframe_pin(pframe_t *pf);
 void pframe_unpin(pframe_t *pf);
+void pframe_reclaim_soon(pframe_t *pf);
 
 int pframe_dirty(pframe_t *pf);
 int pframe_clean(pframe_t *pf);
+void pframe_set_clean(pframe_t *pf);
 void pframe_free(pframe_t *pf);
 
+/* Called by a writer, holding no locks, after writing about npages pages of
+ * a file of fs; paces it if too much of memory, or of fs's share of it, is
+ * dirty (see pframe.c) */
+void pframe_throttle_dirty(struct fs *fs, uint32_t npages);
+
+int pframe_writeback(void);
+int pframe_writeback_obj(struct mmobj *o);
 void pframe_clean_all(void);
 
 void pframe_remove_from_pts(pframe_t *pf);
+void pframe_add_mapping(pframe_t *pf, struct vmarea *vma, uintptr_t vaddr);
+void pframe_remove_mappings(struct vmarea *vma);
+void pframe_split_mappings(struct vmarea *vma, struct vmarea *split);
+
+/* A dbg_infofunc_t: the page cache's size, hit and miss counts, and how
+ * much pageoutd has done */
+size_t pframe_info(const void *arg, char *buf, size_t osize);
+
+/* A dbg_infofunc_t: the resident pages by the object they belong to, the
+ * objects with the most first, and how many of each are active, dirty and
+ * pinned */
+size_t pframe_obj_info(const void *arg, char *buf, size_t osize);
+
+/* Called by the kernel heap each time it tries to take pages from the
+ * free lists the page cache shares with it, whether or not it got them:
+ * wakes pageoutd if free memory is below the low watermark, so that
+ * cache pages are given up before the heap runs out. Does not block. */
+void pframe_kmem_pressure(void);
+
+/* How many times since boot pframe_get has had to fill a page */
+uint32_t pframe_miss_count(void);
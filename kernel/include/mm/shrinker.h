@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * A cache which can give memory back when it runs short. When pageoutd
+ * wakes up to free pages, it first asks every registered shrinker to
+ * give back its share of the shortfall, in proportion to how much of
+ * the reclaimable memory it holds, and only then evicts pages from the
+ * page cache for whatever remains.
+ *
+ * Both callbacks are in units of pages.
+ */
+typedef struct shrinker {
+  const char *sh_name;
+  /* How many pages the cache could give back now; must not block */
+  uint32_t (*sh_count)(void);
+  /* Gives back about nr pages and returns how many it did; may block */
+  uint32_t (*sh_scan)(uint32_t nr);
+  list_link_t sh_link;
+} shrinker_t;
+
+void shrinker_register(shrinker_t *sh);
+void shrinker_unregister(shrinker_t *sh);
+
+/**
+ * Asks every shrinker for its share of need pages, where nlru pages of
+ * the page cache are also reclaimable, then gives any slabs emptied as
+ * a result back to the page allocator.
+ *
+ * @return the number of pages given back
+ */
+uint32_t shrinkers_run(uint32_t need, uint32_t nlru);
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "config.h"
+#include "types.h"
+
 /* Define SLAB_REDZONE to add top and bottom redzones to every object.
  * Use kmem_check_redzones() liberally throughout your code to test
  * for memory pissing. */
@@ -16,11 +19,56 @@
  * it to the free list *without calling the destructor*. This lets you save
  * on destruction/construction calls; the idea is that every free object in
  * the cache is in a known state.
+ *
+ * The constructor is run on every object of a slab when the slab is made,
+ * and the destructor on every object of an empty slab before it is freed.
+ * Either may be NULL. Objects must be freed in their constructed state.
+ * Neither may block or allocate from the slab allocator.
  */
 typedef struct slab_allocator slab_allocator_t;
 
 slab_allocator_t *slab_allocator_create(const char *name, size_t size);
+slab_allocator_t *slab_allocator_create_ctor(const char *name, size_t size,
+                                             void (*ctor)(void *),
+                                             void (*dtor)(void *));
 int slab_allocators_reclaim(int target);
 
 void *slab_obj_alloc(slab_allocator_t *allocator);
 void slab_obj_free(slab_allocator_t *allocator, void *obj);
+
+/* A dbg_infofunc_t: each allocator's object size and how many objects it
+ * has handed out and had back */
+size_t slab_info(const void *arg, char *buf, size_t osize);
+
+/* A dbg_infofunc_t: how full each allocator's slabs are. Objects sitting
+ * in the magazines count as allocated to the slabs but not to FILL%. */
+size_t slab_occupancy_info(const void *arg, char *buf, size_t osize);
+
+/* How many pages the slabs and kmalloc hold, used or not */
+uint32_t slab_npages(void);
+
+#if KMEM_PROFILE
+/*
+ * With KMEM_PROFILE, every object handed out by kmalloc or slab_obj_alloc
+ * is counted against its call site, the return address of the call (for
+ * kmalloc, that of kmalloc itself). Each site counts its allocations and
+ * frees, the bytes it holds now and at most, and a histogram of how long
+ * its objects lived, in clock ticks: bucket 0 is under one tick and
+ * bucket i under 4^i, except the last, which is everything longer. Sites
+ * beyond KMEM_PROFILE_SITES share the last entry, whose ks_pc is 0. The
+ * kshell's "kmemprof" lists them; symbolize the addresses with gdb or
+ * addr2line on weenix.dbg.
+ */
+#define KMEM_PROFILE_NLIFE 8
+
+typedef struct kmem_site {
+  uintptr_t ks_pc; /* 0 if unused (or the overflow entry) */
+  uint32_t ks_allocs;
+  uint32_t ks_frees;
+  uint32_t ks_bytes;      /* held now */
+  uint32_t ks_peak_bytes; /* most ever held at once */
+  uint32_t ks_life[KMEM_PROFILE_NLIFE];
+} kmem_site_t;
+
+extern kmem_site_t kmem_sites[KMEM_PROFILE_SITES + 1];
+#endif
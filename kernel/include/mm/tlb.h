@@ -1,6 +1,7 @@
 #pragma once
 
 #include "kernel.h"
+#include "limits.h"
 #include "types.h"
 
 #include "mm/page.h"
@@ -22,9 +23,56 @@ static inline void tlb_flush_range(uintptr_t vaddr, uint32_t count) {
   }
 }
 
-/* Invalidates the entire TLB. */
+/* Invalidates the entire TLB, except for global entries (the kernel's
+ * mappings, which are the same in every page directory). */
 static inline void tlb_flush_all() {
   uintptr_t pdir;
   __asm__ volatile("movl %%cr3, %0" : "=r"(pdir));
   __asm__ volatile("movl %0, %%cr3" ::"r"(pdir) : "memory");
 }
+
+/* Past this many pages, reloading cr3 is cheaper than flushing each */
+#define TLB_FLUSH_ALL_PAGES 32
+
+/* The span of user addresses whose mappings have been changed since the
+ * batch was last flushed. Code which unmaps several pages adds each to a
+ * batch and flushes it once it is done, so that they are invalidated in
+ * one go. Only add addresses of the address space in use, which is that
+ * of the page directory loaded (pt_get()); that is not always curproc's,
+ * as kernel threads run on whichever one the last user thread left. */
+typedef struct tlb_batch {
+  uintptr_t tb_start;
+  uintptr_t tb_end;
+} tlb_batch_t;
+
+static inline void tlb_batch_init(tlb_batch_t *tb) {
+  tb->tb_start = UPTR_MAX;
+  tb->tb_end = 0;
+}
+
+/* Adds the count pages starting at vaddr to the batch */
+static inline void tlb_batch_add_range(tlb_batch_t *tb, uintptr_t vaddr,
+                                       uint32_t count) {
+  if (vaddr < tb->tb_start)
+    tb->tb_start = vaddr;
+  if (vaddr + count * PAGE_SIZE > tb->tb_end)
+    tb->tb_end = vaddr + count * PAGE_SIZE;
+}
+
+static inline void tlb_batch_add(tlb_batch_t *tb, uintptr_t vaddr) {
+  tlb_batch_add_range(tb, vaddr, 1);
+}
+
+/* Invalidates everything in the batch, and empties it */
+static inline void tlb_batch_flush(tlb_batch_t *tb) {
+  uint32_t count;
+
+  if (tb->tb_start >= tb->tb_end)
+    return;
+  count = (tb->tb_end - tb->tb_start) >> PAGE_SHIFT;
+  if (TLB_FLUSH_ALL_PAGES < count)
+    tlb_flush_all();
+  else
+    tlb_flush_range(tb->tb_start, count);
+  tlb_batch_init(tb);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Large kernel buffers which need not be physically contiguous. Each
+ * page is allocated on its own with page_alloc and mapped in the kernel
+ * address space reserved for vmalloc (VMALLOC_LOW to VMALLOC_HIGH), so
+ * a buffer of any size up to that space can be had however fragmented
+ * physical memory is. Each buffer is followed by an unmapped page, which
+ * catches running off its end.
+ *
+ * The memory cannot be used for DMA, which needs physically contiguous
+ * pages; use page_alloc_n for that. vmalloc and vfree may be called
+ * from any thread, but not from interrupt handlers.
+ */
+
+/**
+ * Allocates a page aligned buffer of at least size bytes.
+ *
+ * @param size the size of the buffer, which must be nonzero
+ * @return the buffer, or NULL if there is not enough memory or address
+ * space
+ */
+void *vmalloc(size_t size);
+
+/**
+ * Frees a buffer from vmalloc, unmapping and freeing its pages.
+ *
+ * @param addr the buffer
+ */
+void vfree(void *addr);
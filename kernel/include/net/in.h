@@ -0,0 +1,39 @@
+/*  in.h - Internet (IPv4) addresses
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+typedef uint32_t in_addr_t; /* in network byte order */
+typedef uint16_t in_port_t; /* likewise */
+
+struct in_addr {
+  in_addr_t s_addr;
+};
+
+/* A struct sockaddr of family AF_INET */
+struct sockaddr_in {
+  uint16_t sin_family; /* AF_INET */
+  in_port_t sin_port;
+  struct in_addr sin_addr;
+  char sin_zero[8];
+};
+
+#define INADDR_ANY ((in_addr_t)0x00000000)
+#define INADDR_BROADCAST ((in_addr_t)0xffffffff)
+
+#define IPPROTO_UDP 17
+
+/* The network byte order is big-endian, the processor's little-endian */
+static inline uint16_t htons(uint16_t x) { return (uint16_t)(x << 8 | x >> 8); }
+static inline uint16_t ntohs(uint16_t x) { return htons(x); }
+static inline uint32_t htonl(uint32_t x) {
+  return x << 24 | (x & 0xff00) << 8 | (x >> 8 & 0xff00) | x >> 24;
+}
+static inline uint32_t ntohl(uint32_t x) { return htonl(x); }
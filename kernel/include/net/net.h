@@ -0,0 +1,101 @@
+#pragma once
+
+#include "types.h"
+
+#include "net/in.h"
+
+/*
+ * A minimal IPv4 stack over Ethernet: ARP for finding neighbours, and
+ * UDP (net/udp.h) on top of IP, with nothing else. The one interface has
+ * its address, netmask and gateway fixed in config.h; datagrams are never
+ * fragmented, received ones with IP options or in fragments are dropped,
+ * and UDP checksums are neither sent nor checked.
+ *
+ * A driver hands each frame up as its first bytes, in a buffer of its
+ * own, and the rest in a page of an anonymous object. It reads the first
+ * NET_UDP_HLEN bytes into the buffer, so that a UDP datagram's payload
+ * lands at the start of the page, which the socket it is for can then
+ * take over and pass to the receiving process whole (see
+ * vmmap_give_page) without copying it.
+ */
+
+struct pframe;
+
+#define ETH_ALEN 6
+#define ETH_HLEN 14
+#define ETH_MTU 1500 /* most bytes a frame carries after its header */
+#define ETH_P_IP 0x0800
+#define ETH_P_ARP 0x0806
+
+#define IP_HLEN 20 /* without options, as are all those sent */
+#define UDP_HLEN 8
+
+/* Bytes of a UDP datagram's headers, in front of its payload */
+#define NET_UDP_HLEN (ETH_HLEN + IP_HLEN + UDP_HLEN)
+/* Most bytes of headers a frame is sent with */
+#define NET_HDR_MAX 54
+
+#define UDP_MAX_PAYLOAD (ETH_MTU - IP_HLEN - UDP_HLEN)
+
+typedef struct udp_hdr {
+  in_port_t uh_sport;
+  in_port_t uh_dport;
+  uint16_t uh_len; /* bytes, header included */
+  uint16_t uh_csum;
+} __attribute__((packed)) udp_hdr_t;
+
+typedef struct netif {
+  const char *ni_name;
+  uint8_t ni_mac[ETH_ALEN];
+  in_addr_t ni_addr; /* in network byte order, as are the next two */
+  in_addr_t ni_netmask;
+  in_addr_t ni_gateway;
+
+  /*
+   * Sends a frame of hdrlen bytes of headers, which are copied, followed
+   * by len bytes at data, a page from page_alloc() which is freed once
+   * sent, or NULL. While the device has no room, waits if wait is set
+   * and fails with -EAGAIN if not; data is freed either way.
+   */
+  int (*ni_xmit)(struct netif *ni, const void *hdr, size_t hdrlen,
+                 void *data, size_t len, int wait);
+
+  /* for net_info */
+  uint32_t ni_rx_packets;
+  uint32_t ni_rx_bytes;
+  uint32_t ni_rx_dropped;
+  uint32_t ni_tx_packets;
+  uint32_t ni_tx_bytes;
+  uint32_t ni_tx_dropped;
+} netif_t;
+
+/* Makes ni the interface; there is room for one */
+void net_register(netif_t *ni);
+
+/**
+ * Handles a received frame, from thread context. hdr holds its first
+ * hdrlen bytes, at most NET_UDP_HLEN, and pf, pinned, the len after.
+ *
+ * @return 1 if the frame's page was kept, along with the pin, in which
+ * case the driver needs another; 0 if the driver may reuse it
+ */
+int net_input(netif_t *ni, const void *hdr, size_t hdrlen, struct pframe *pf,
+              size_t len);
+
+/**
+ * Sends an IP datagram to dst, of thlen bytes of the protocol's header
+ * followed by len bytes at data, a page which is the stack's now (see
+ * ni_xmit). Finds dst's or the gateway's hardware address first, which
+ * waits for an ARP reply unless nowait is set.
+ *
+ * @return 0, or -ENETUNREACH without an interface, -EHOSTUNREACH if the
+ * next hop doesn't answer, -EAGAIN if it would have to be waited for, or
+ * -EINTR
+ */
+int net_send(in_addr_t dst, uint8_t proto, const void *thdr, size_t thlen,
+             void *data, size_t len, int nowait);
+
+/* The interface's address, or INADDR_ANY without one */
+in_addr_t net_addr(void);
+
+size_t net_info(const void *arg, char *buf, size_t osize);
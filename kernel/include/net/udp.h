@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+#include "net/in.h"
+
+struct msghdr;
+struct pframe;
+struct sockaddr_in;
+struct vnode;
+
+/*
+ * UDP sockets, reached through the socket calls in fs/socket.c. Each is
+ * a vnode of its own, like a local socket; received datagrams wait on it
+ * in pages of their own.
+ */
+
+/* A vnode for a new, unbound UDP socket, or NULL */
+struct vnode *udp_socket(void);
+
+/* Whether vn is a UDP socket */
+int udp_is(struct vnode *vn);
+
+int udp_bind(struct vnode *vn, const struct sockaddr_in *sin);
+
+/* As do_sendmsg and do_recvmsg, with msg_name a kernel copy */
+int udp_sendmsg(struct vnode *vn, const struct msghdr *msg, int flags);
+int udp_recvmsg(struct vnode *vn, struct msghdr *msg, int flags);
+
+/**
+ * Queues a received datagram for the socket bound to dport, if there is
+ * one with room. Its len bytes of payload start pf, which is taken as
+ * for net_input.
+ *
+ * @return whether pf was taken
+ */
+int udp_input(in_addr_t src, in_port_t sport, in_port_t dport,
+              struct pframe *pf, size_t len);
+
+size_t udp_info(const void *arg, char *buf, size_t osize);
@@ -19,13 +19,20 @@ typedef struct context {
 
   uintptr_t c_kstack;
   size_t c_kstacksz;
+
+  uint32_t c_tls; /* base of the userland %gs segment; see set_tls(2) */
+  void *c_fpu;    /* saved FPU/SSE registers, NULL until first used */
 } context_t;
 
 /**
  * Initialize the given context such that when it begins execution it
  * will execute func(arg1,arg2). When the thread returns from func it
- * will be cancelled. A kernel stack and page directory exclusive to
- * this context must also be provided.
+ * will be cancelled. A kernel stack exclusive to this context must also
+ * be provided, and the page directory it runs on, or NULL if it only
+ * runs in the kernel, in which case it runs on whichever directory is
+ * loaded when it is switched to. That saves switching to a kernel
+ * thread from loading cr3, and so from emptying the TLB, and then again
+ * switching back. Set c_pdptr before such a context runs in userland.
  *
  * @param c the context to initialize
  * @param func the function which will begin executing when this
@@ -34,11 +41,37 @@ typedef struct context {
  * @param arg2 the second argument to func
  * @param kstack a pointer to the kernel stack this context will use
  * @param kstacksz the size of the kernel stack
- * @param pdptr the pagetable this context will use
+ * @param pdptr the pagetable this context will use, or NULL
  */
 void context_setup(context_t *c, context_func_t func, int arg1, void *arg2,
                    void *kstack, size_t kstacksz, pagedir_t *pdptr);
 
+/**
+ * Frees what a context holds besides its stack: the FPU registers it
+ * saved, or holds in the FPU.
+ *
+ * @param c the context, which must never run again
+ */
+void context_cleanup(context_t *c);
+
+/**
+ * Gives a new context, which has never run, a copy of the FPU registers
+ * of the current one.
+ *
+ * @param newc the context to copy to
+ * @param oldc the running context, to copy from
+ * @return 0 on success, or -ENOMEM
+ */
+int context_fpu_copy(context_t *newc, context_t *oldc);
+
+/**
+ * Forgets the FPU registers of the running context, which starts from
+ * freshly initialized ones the next time it uses the FPU.
+ *
+ * @param c the running context
+ */
+void context_fpu_reset(context_t *c);
+
 /**
  * Makes the given context the one currently running on the CPU. Use
  * this mainly for the initial context.
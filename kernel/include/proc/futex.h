@@ -0,0 +1,18 @@
+/*  futex.h - fast userland mutexes: sleeping on and waking a lock word
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#define FUTEX_WAIT 0        /* sleep while *uaddr is still val */
+#define FUTEX_WAKE 1        /* wake up to val threads sleeping on uaddr */
+#define FUTEX_REQUEUE 2     /* wake val, move up to val2 others to uaddr2 */
+#define FUTEX_CMP_REQUEUE 3 /* the same, if *uaddr is still val3 */
+
+#ifdef __KERNEL__
+int do_futex(int *uaddr, int op, int val, int *uaddr2, int val2, int val3);
+#else
+int futex(int *uaddr, int op, int val);
+int futex_requeue(int *uaddr, int op, int val, int *uaddr2, int val2,
+                  int val3);
+#endif
@@ -1,18 +1,64 @@
 #pragma once
 
+#include "config.h"
+
 #include "proc/sched.h"
 
+#if KMUTEX_STATS
+/*
+ * Contention statistics for every mutex initialized at one place in the
+ * source, so that all the vnodes' or all the disks' mutexes are counted
+ * together. Times are in time stamp counter cycles.
+ */
+typedef struct kmutex_class {
+  const char *kc_site;     /* "file:line mutex" of the kmutex_init */
+  list_link_t kc_link;     /* on kmutex_class_list, once first used */
+  uint32_t kc_acquired;    /* times locked */
+  uint32_t kc_contended;   /* times a locker found it held */
+  uint64_t kc_wait_cycles; /* total time lockers spent waiting */
+  uint64_t kc_max_hold;    /* longest time it was held */
+} kmutex_class_t;
+
+/* Every class a mutex has been initialized in, for the kshell's lockstat */
+extern list_t kmutex_class_list;
+#else
+typedef struct kmutex_class kmutex_class_t;
+#endif
+
 typedef struct kmutex {
   ktqueue_t km_waitq;        /* wait queue */
   struct kthread *km_holder; /* current holder */
+  list_link_t km_link;       /* on the holder's kt_mutexes */
+#if KMUTEX_STATS
+  kmutex_class_t *km_class;
+  uint64_t km_taken; /* when km_holder got it */
+#endif
 } kmutex_t;
 
+#define KMUTEX_STR2(x) #x
+#define KMUTEX_STR(x) KMUTEX_STR2(x)
+
 /**
- * Initializes the fields of the specified kmutex_t.
+ * Initializes the fields of the specified kmutex_t. With KMUTEX_STATS
+ * the mutex is counted in a class of its own for this call site.
  *
  * @param mtx the mutex to initialize
  */
-void kmutex_init(kmutex_t *mtx);
+#if KMUTEX_STATS
+#define kmutex_init(mtx)                                                       \
+  do {                                                                         \
+    static kmutex_class_t __kmutex_class = {                                   \
+        .kc_site = __FILE__ ":" KMUTEX_STR(__LINE__) " " #mtx};                \
+    kmutex_init_class((mtx), &__kmutex_class);                                 \
+  } while (0)
+#else
+#define kmutex_init(mtx) kmutex_init_class((mtx), NULL)
+#endif
+
+/**
+ * Initializes a mutex in the given class; use kmutex_init instead.
+ */
+void kmutex_init_class(kmutex_t *mtx, kmutex_class_t *kc);
 
 /**
  * Locks the specified mutex.
@@ -39,6 +85,22 @@ void kmutex_lock(kmutex_t *mtx);
  */
 int kmutex_lock_cancellable(kmutex_t *mtx);
 
+/**
+ * Locks the specified mutex like kmutex_lock_cancellable, but gives up if
+ * it is not acquired within the given number of clock ticks.
+ *
+ * Note: This function may block.
+ *
+ * Note: These locks are not re-entrant.
+ *
+ * @param mtx the mutex to lock
+ * @param ticks the most clock ticks to wait for
+ * @return 0 if the current thread now holds the mutex, -EINTR if the
+ * sleep was cancelled and -ETIMEDOUT if the time ran out, in which cases
+ * this thread does not hold the mutex
+ */
+int kmutex_lock_timeout(kmutex_t *mtx, unsigned long ticks);
+
 /**
  * Unlocks the specified mutex.
  *
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "config.h"
+
+#include "proc/kmutex.h"
+#include "proc/sched.h"
+
+/*
+ * A sleeping reader-writer lock. Any number of readers may hold it at
+ * once; a writer holds it alone. Once a writer is waiting, new readers
+ * wait behind it, so a stream of readers cannot starve writers, and a
+ * writer which unlocks lets in every reader waiting at that point before
+ * the next writer, so writers cannot starve readers either.
+ *
+ * Like kmutexes, the lock is handed directly to the threads being woken,
+ * and it must never be taken or released from interrupt context. Read
+ * locks are not recursive: a reader which read-locks again while a
+ * writer is waiting deadlocks.
+ *
+ * With KMUTEX_STATS each krwlock_init call site gets a kmutex_class_t of
+ * its own on kmutex_class_list, so the vnode locks show up in lockstat
+ * next to the mutexes. Acquisitions, contention and waits are counted in
+ * both modes; the longest hold is of the lock in write mode only, as
+ * readers are not recorded.
+ */
+typedef struct krwlock {
+  ktqueue_t krw_rdq;          /* readers waiting */
+  ktqueue_t krw_wrq;          /* writers waiting */
+  struct kthread *krw_writer; /* holder in write mode */
+  int krw_readers;            /* number of holders in read mode */
+#if KMUTEX_STATS
+  kmutex_class_t *krw_class;
+  uint64_t krw_taken; /* when krw_writer got it */
+#endif
+} krwlock_t;
+
+/**
+ * Initializes the fields of the specified krwlock_t. With KMUTEX_STATS
+ * the lock is counted in a class of its own for this call site.
+ *
+ * @param rw the lock to initialize
+ */
+#if KMUTEX_STATS
+#define krwlock_init(rw)                                                       \
+  do {                                                                         \
+    static kmutex_class_t __krwlock_class = {                                  \
+        .kc_site = __FILE__ ":" KMUTEX_STR(__LINE__) " " #rw};                 \
+    krwlock_init_class((rw), &__krwlock_class);                                \
+  } while (0)
+#else
+#define krwlock_init(rw) krwlock_init_class((rw), NULL)
+#endif
+
+/**
+ * Initializes a lock in the given class; use krwlock_init instead.
+ */
+void krwlock_init_class(krwlock_t *rw, kmutex_class_t *kc);
+
+/**
+ * Locks the specified lock in read (shared) mode.
+ *
+ * Note: This function may block.
+ *
+ * @param rw the lock to lock
+ */
+void krwlock_read_lock(krwlock_t *rw);
+
+/**
+ * Releases a read lock on the specified lock.
+ *
+ * @param rw the lock to unlock
+ */
+void krwlock_read_unlock(krwlock_t *rw);
+
+/**
+ * Locks the specified lock in write (exclusive) mode.
+ *
+ * Note: This function may block.
+ *
+ * Note: These locks are not re-entrant.
+ *
+ * @param rw the lock to lock
+ */
+void krwlock_write_lock(krwlock_t *rw);
+
+/**
+ * Releases the current thread's write lock on the specified lock.
+ *
+ * @param rw the lock to unlock
+ */
+void krwlock_write_unlock(krwlock_t *rw);
+
+/* True if the current thread holds the lock in write mode */
+#define krwlock_write_held(rw) ((rw)->krw_writer == curthr)
+
+/* True if the lock is held in either mode. Readers are not recorded, so
+ * this cannot tell whether the current thread is one of them. */
+#define krwlock_locked(rw) ((rw)->krw_writer || (rw)->krw_readers)
@@ -5,8 +5,13 @@
  */
 #pragma once
 
+#include "config.h"
+#include "types.h"
+
 #include "util/list.h"
 
+#include "api/perf.h"
+
 #include "proc/sched.h"
 #include "proc/context.h"
 
@@ -19,16 +24,35 @@ typedef struct kthread {
   void *kt_retval;      /* this thread's return value */
   int kt_errno;         /* error no. of most recent syscall */
   struct proc *kt_proc; /* the thread's process */
+  int kt_tid;           /* thread id, unique within the process */
 
   int kt_cancelled;     /* 1 if this thread has been cancelled */
   ktqueue_t *kt_wchan;  /* The queue that this thread is blocked on */
+  int kt_preempt_count; /* spinlocks held and preempt_disable depth */
+  void *kt_worker;      /* its workqueue worker if a kworker, else NULL */
   int kt_state;         /* this thread's state */
   list_link_t kt_qlink; /* link on ktqueue */
   list_link_t kt_plink; /* link on proc thread list */
+
+  int kt_prio;              /* run queue level, 0 is the highest */
+  unsigned int kt_ticks;    /* ticks used of the current quantum */
+  unsigned long kt_runtime; /* ticks charged over the thread's life */
+  uint64_t kt_utime;        /* cycles spent in userland, see sched_charge */
+  uint64_t kt_stime;        /* cycles spent in the kernel */
+  uint32_t kt_cpumask;      /* processors it may run on, bit n for cpu n */
+  uint64_t kt_perf[PERF_NCOUNTERS]; /* events counted, see perf_charge */
+
+  /* Priority inheritance, see kmutex.c */
+  int kt_pi_prio;               /* best level of our mutexes' waiters */
+  list_t kt_mutexes;            /* the mutexes we hold */
+  struct kmutex *kt_blocked_on; /* the mutex we are waiting for */
 #ifdef __MTP__
   int kt_detached;    /* if the thread has been detached */
   ktqueue_t kt_joinq; /* thread waiting to join with this thread */
 #endif
+#if KSTACK_STATS
+  kthread_func_t kt_func; /* what it was created to run, NULL if cloned */
+#endif
 } kthread_t;
 
 /* thread states */
@@ -61,7 +85,9 @@ kthread_t *kthread_create(struct proc *p, kthread_func_t func, long arg1,
 void kthread_destroy(kthread_t *t);
 
 /**
- * Cancel a thread.
+ * Cancel a thread. A sleeping thread is woken if its sleep is
+ * cancellable; a running one exits when it next leaves the kernel, or
+ * when it is preempted in userland.
  *
  * @param kthr the thread to be cancelled
  * @param retval the return value for the thread
@@ -83,12 +109,38 @@ void kthread_exit(void *retval);
  */
 kthread_t *kthread_clone(kthread_t *thr);
 
+#if KSTACK_STATS
+/**
+ * A dbg_infofunc_t: for each function threads were created to run (and
+ * for forked threads together), how many have been destroyed and how
+ * deep their stacks got, at most and on average.
+ */
+size_t kthread_stack_info(const void *arg, char *buf, size_t osize);
+#endif
+
 #ifdef __MTP__
 /**
  * Shuts down the reaper daemon.
  */
 void kthread_reapd_shutdown(void);
 
+/**
+ * Hands an exited, detached thread to the reaper daemon, which frees it
+ * once it is no longer running on its stack.
+ *
+ * @param kthr the thread to free
+ */
+void kthread_reapd_add(kthread_t *kthr);
+
+/**
+ * Finds a thread of a process.
+ *
+ * @param p the process
+ * @param tid the thread id
+ * @return the thread, or NULL if p has no thread with that id
+ */
+kthread_t *kthread_lookup(struct proc *p, int tid);
+
 /**
  * Put a thread in the detached state.
  *
@@ -3,6 +3,7 @@
 #include "types.h"
 
 #include "proc/kthread.h"
+#include "proc/rcu.h"
 
 #include "mm/pagetable.h"
 
@@ -20,21 +21,33 @@ typedef struct proc {
   char p_comm[PROC_NAME_LEN]; /* process name */
 
   list_t p_threads;     /* the process's thread list */
+  int p_nexttid;        /* id for the next thread we create */
   list_t p_children;    /* the process's children list */
   struct proc *p_pproc; /* our parent process */
 
   int p_status;     /* exit status */
   int p_state;      /* running/sleeping/etc. */
   ktqueue_t p_wait; /* queue for wait(2) */
+  pid_t p_waitpid;  /* the pid we wait for then, -1 for any, 0 if none */
+  list_t p_zombies; /* exited children, not yet reaped, oldest first */
+
+  /* Processor time, in time stamp counter cycles, of our threads which
+   * have exited, and of our reaped children and all of theirs */
+  uint64_t p_utime, p_stime;
+  uint64_t p_cutime, p_cstime;
 
   pagedir_t *p_pagedir;
 
   list_link_t p_list_link;  /* link on the list of all processes */
   list_link_t p_child_link; /* link on proc list of children */
+  list_link_t p_hash_link;  /* link on the chain for our pid, see proc.c */
+  list_link_t p_zombie_link; /* link on parent's p_zombies once exited */
+  rcu_head_t p_rcu;          /* for freeing once reaped */
 
   /* VFS-related: */
-  struct file *p_files[NFILES]; /* open files */
-  struct vnode *p_cwd;          /* current working dir */
+  struct fdtable *p_fdt;  /* open files, maybe shared since fork */
+  struct vnode *p_cwd;    /* current working dir */
+  struct aio_ctx *p_aio;  /* asynchronous I/O; see io_setup(2) */
 
   /* VM */
   void *p_brk;           /* process break; see brk(2) */
@@ -62,12 +75,26 @@ void proc_init(void);
  */
 proc_t *proc_create(char *name);
 
+/**
+ * Creates a process for a kernel daemon. It is made a child of the idle
+ * process, whichever process is creating it, so that it is idleproc
+ * which waits for it at shutdown.
+ *
+ * @param name the name to give the newly created process
+ * @return the newly created process
+ */
+proc_t *proc_create_daemon(char *name);
+
 /**
  * Finds the process with the specified PID.
  *
  * @param pid the PID of the process to find
  * @return a pointer to the process with PID pid, or NULL if there is
  * no such process
+ *
+ * The lookup takes no lock. The process found stays in memory until the
+ * caller next blocks; it is up to the caller to know it won't be reaped
+ * for any longer than that.
  */
 proc_t *proc_lookup(int pid);
 
@@ -100,6 +127,17 @@ void proc_kill_all(void);
  */
 void proc_thread_exited(void *retval);
 
+#ifdef __MTP__
+/**
+ * Cancels every other thread of the current process and waits for them
+ * to exit, for execve(2).
+ *
+ * @return 0 once the current thread is the only one left, or -EINTR if
+ * it is cancelled while waiting
+ */
+int proc_kill_threads(void);
+#endif
+
 /**
  * This function implements the _exit(2) system call.
  *
@@ -126,6 +164,18 @@ pid_t do_waitpid(pid_t pid, int options, int *status);
  */
 int do_fork(struct regs *regs);
 
+#ifdef __MTP__
+/**
+ * This function implements the thr_create(2) system call: a new thread
+ * in the current process, which enters userland at entry with its stack
+ * pointer at stack and its %gs segment based at tls.
+ *
+ * @param regs the register state at the time of the system call
+ * @return the new thread's id, or -errno
+ */
+int do_thr_create(struct regs *regs, void *entry, void *stack, void *tls);
+#endif
+
 /**
  * Provides detailed debug information about a given process.
  *
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "types.h"
+
+#include "main/percpu.h"
+
+#include "util/atomic.h"
+#include "util/list.h"
+
+/*
+ * Read-copy-update, for data which is looked up far more often than it
+ * changes. Readers bracket their lookups with rcu_read_lock and
+ * rcu_read_unlock, which take no lock and write nothing shared, and must
+ * not block in between. Writers still lock against each other, unlink
+ * with the _rcu list operations below so that a reader part way along a
+ * chain can carry on, and hand anything a reader may still be looking at
+ * to call_rcu instead of freeing it.
+ *
+ * Since kernel threads are not preempted and readers don't block, a
+ * processor which goes through sched_switch is not in a read section. A
+ * grace period is over once every processor has done so since it began,
+ * and the callbacks queued before it began are then run. Callbacks are
+ * run by sched_switch, with interrupts off but no locks held, so they may
+ * take spinlocks but must not block.
+ */
+
+typedef struct rcu_head {
+  struct rcu_head *rh_next;
+  void (*rh_func)(struct rcu_head *head);
+} rcu_head_t;
+
+/* Readers may nest; the count is only for KASSERTs */
+static inline void rcu_read_lock(void) {
+  percpu_inc(pc_rcu_nesting);
+  barrier();
+}
+
+static inline void rcu_read_unlock(void) {
+  barrier();
+  percpu_add(pc_rcu_nesting, -1);
+}
+
+/**
+ * Arranges for func(head) to be called once every reader which might
+ * have found what head is embedded in has finished.
+ */
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head));
+
+/* Notes that this processor is between threads, and runs the callbacks
+ * whose grace period that ended; called by sched_switch */
+void rcu_quiescent(void);
+
+size_t rcu_info(const void *arg, char *buf, size_t osize);
+
+/* Loads a pointer a writer may be changing under us, once */
+#define rcu_dereference(p) (*(__typeof__(p) volatile *)&(p))
+
+/*
+ * The list operations readers may run alongside. A link is filled in
+ * before it is made reachable, and one which is removed keeps its l_next
+ * so that a reader standing on it still gets back to the list head; it
+ * must not be reused or freed until a grace period has passed.
+ */
+static inline void list_insert_head_rcu(list_t *list, list_link_t *link) {
+  list_link_t *next = list->l_next;
+  link->l_next = next;
+  link->l_prev = list;
+  wmb();
+  next->l_prev = link;
+  list->l_next = link;
+}
+
+static inline void list_remove_rcu(list_link_t *link) {
+  link->l_prev->l_next = link->l_next;
+  link->l_next->l_prev = link->l_prev;
+  link->l_prev = NULL;
+}
+
+#define list_iterate_rcu(list, var, type, member)                              \
+  for (list_link_t *__link = rcu_dereference((list)->l_next);                  \
+       __link != (list) && ((var) = list_item(__link, type, member), 1);       \
+       __link = rcu_dereference(__link->l_next))
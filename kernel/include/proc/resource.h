@@ -0,0 +1,22 @@
+/*  resource.h - the processor time used by a process and its children
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#include "time.h"
+
+#define RUSAGE_SELF 0      /* all of the calling process's threads */
+#define RUSAGE_CHILDREN -1 /* its children which have been waited for */
+#define RUSAGE_THREAD 1    /* just the calling thread */
+
+struct rusage {
+  struct timeval ru_utime; /* time spent in userland */
+  struct timeval ru_stime; /* time spent in the kernel on its behalf */
+};
+
+#ifdef __KERNEL__
+int do_getrusage(int who, struct rusage *ru);
+#else
+int getrusage(int who, struct rusage *ru);
+#endif
@@ -15,11 +15,51 @@ void sched_switch(void);
 
 /**
  * Marks the given thread as runnable, and adds it to the run queue.
+ * Passing curthr while it is still running yields the processor to
+ * the other threads at its priority.
  *
  * @param thr the thread to make runnable
  */
 void sched_make_runnable(struct kthread *kt);
 
+/**
+ * Charges one clock tick to the current thread. Called from the timer
+ * interrupt.
+ *
+ * @return true if the current thread has used up its quantum and
+ * should be switched out
+ */
+int sched_tick(void);
+
+/**
+ * Yields the processor if sched_tick has asked for a reschedule since
+ * the current thread was last switched in. Called on the way back out
+ * to userland.
+ */
+void sched_preempt(void);
+
+/*
+ * Kernel code is not switched out at arbitrary points: most of it relies
+ * on running undisturbed between the places where it blocks. Instead,
+ * code which may run for a long time without blocking calls cond_resched
+ * wherever it could as well have blocked, and yields there if the
+ * current thread's quantum is up or a thread of better priority is
+ * waiting (the same test sched_preempt makes on the way out to userland).
+ *
+ * cond_resched does nothing while the thread holds a spinlock, has
+ * called preempt_disable, or has the IPL raised, so a helper which
+ * calls it is still safe to use from such sections.
+ */
+void preempt_disable(void);
+void preempt_enable(void);
+
+/**
+ * A preemption point.
+ *
+ * @return true if the thread yielded
+ */
+int cond_resched(void);
+
 /**
  * Initializes a queue.
  *
@@ -35,6 +75,14 @@ void sched_queue_init(ktqueue_t *q);
  */
 int sched_queue_empty(ktqueue_t *q);
 
+/**
+ * Returns the thread sched_wakeup_on would wake next, without waking it.
+ *
+ * @param q the queue
+ * @return NULL if q is empty, and the thread otherwise
+ */
+struct kthread *sched_queue_peek(ktqueue_t *q);
+
 /**
  * Causes the current thread to enter into an uncancellable sleep on
  * the given queue.
@@ -43,6 +91,16 @@ int sched_queue_empty(ktqueue_t *q);
  */
 void sched_sleep_on(ktqueue_t *q);
 
+/**
+ * Like sched_sleep_on, but returns even if the thread was cancelled
+ * while it slept, instead of exiting. For lock waiters, which are handed
+ * the lock before they are woken and must not exit holding it; they
+ * notice the cancellation the next time they sleep or leave the kernel.
+ *
+ * @param q the queue to sleep on
+ */
+void sched_sleep_on_handoff(ktqueue_t *q);
+
 /**
  * Causes the current thread to enter into a cancellable sleep on the
  * given queue.
@@ -52,6 +110,18 @@ void sched_sleep_on(ktqueue_t *q);
  */
 int sched_cancellable_sleep_on(ktqueue_t *q);
 
+/**
+ * Causes the current thread to enter into a cancellable sleep on the
+ * given queue, which also ends after the given number of clock ticks.
+ *
+ * @param q the queue to sleep on
+ * @param ticks the most clock ticks to sleep for; the current tick,
+ * which is already partway over, counts as one
+ * @return -EINTR if the thread was cancelled, -ETIMEDOUT if the time ran
+ * out first, and 0 if it was woken up
+ */
+int sched_cancellable_sleep_on_timeout(ktqueue_t *q, unsigned long ticks);
+
 /**
  * Wakes a single thread from sleep if there are any waiting on the
  * queue.
@@ -68,9 +138,69 @@ struct kthread *sched_wakeup_on(ktqueue_t *q);
  */
 void sched_broadcast_on(ktqueue_t *q);
 
+#define SCHED_CPUMASK_ALL 0xffffffffU
+
+/**
+ * Returns the processors threads are run on, as a mask with bit n set
+ * for processor n (in apic_cpu_apicid's numbering). Weenix only runs on
+ * the one it booted on, processor 0.
+ */
+uint32_t sched_cpus_online(void);
+
+/**
+ * Restricts a thread to the processors in mask. Fails with -EINVAL,
+ * changing nothing, unless at least one of them is online.
+ *
+ * @param thr the thread
+ * @param mask the processors it may run on
+ * @return 0 on success, or -EINVAL
+ */
+int sched_set_affinity(struct kthread *thr, uint32_t mask);
+
+/**
+ * Returns the run queue level a thread is scheduled at: its own, or the
+ * better one it has inherited from a waiter on a mutex it holds.
+ */
+int sched_prio(struct kthread *thr);
+
+/**
+ * Sets the level a thread has inherited, SCHED_NPRIO for none, moving it
+ * within the run queue if it is on it.
+ *
+ * @param thr the thread
+ * @param prio the level it inherits
+ */
+void sched_set_inherited(struct kthread *thr, int prio);
+
+/**
+ * Charges the current thread for the processor time since it was last
+ * charged: as user time when called on entering the kernel from
+ * userland, and as system time otherwise. The scheduler charges the
+ * thread it switches away from; the time with nothing to run is nobody's.
+ *
+ * @param user whether the time was spent in userland
+ */
+void sched_charge(int user);
+
 /**
  * Cancel the given thread from the queue it sleeps on.
  *
  * @param the thread to cancel sleep from
  */
 void sched_cancel(struct kthread *kthr);
+
+/**
+ * A dbg_infofunc_t: how many times the scheduler has switched threads,
+ * and how many times it found nothing to run.
+ *
+ * @param arg must be NULL
+ */
+size_t sched_info(const void *arg, char *buf, size_t osize);
+
+/**
+ * A dbg_infofunc_t: the running thread, then the runnable ones by run
+ * queue level, in the order they will run.
+ *
+ * @param arg must be NULL
+ */
+size_t sched_runq_info(const void *arg, char *buf, size_t osize);
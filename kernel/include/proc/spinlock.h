@@ -0,0 +1,105 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+struct kthread;
+
+/*
+ * A ticket spinlock: each locker takes the next ticket and waits until it
+ * is being served, so waiters get the lock in the order they arrived.
+ *
+ * Spinlocks protect short critical sections which never block. A thread
+ * must not sleep or call sched_switch while holding one. Data which is
+ * also touched from interrupt handlers must be locked with the
+ * spin_lock_irqsave variant, which masks interrupts first, or the
+ * handler could spin forever on a lock the interrupted thread holds.
+ *
+ * Every spinlock records how often it was taken and how often it had to
+ * wait, for the kshell's lockstat command.
+ */
+typedef struct spinlock {
+  volatile uint32_t sl_next;    /* next ticket to hand out */
+  volatile uint32_t sl_serving; /* ticket which holds the lock */
+  struct kthread *sl_holder;    /* for debugging */
+
+  const char *sl_name;
+  list_link_t sl_link;   /* link on spinlock_list */
+  uint32_t sl_acquired;  /* times locked */
+  uint32_t sl_contended; /* times a locker found it held */
+  uint32_t sl_spins;     /* total turns of the wait loop */
+} spinlock_t;
+
+/* Every initialized spinlock, for lock statistics */
+extern list_t spinlock_list;
+
+/**
+ * Initializes a spinlock and adds it to spinlock_list. A spinlock in
+ * memory which is later freed must be passed to spinlock_destroy first.
+ *
+ * @param sl the lock
+ * @param name a name to show in lock statistics
+ */
+void spinlock_init(spinlock_t *sl, const char *name);
+
+/**
+ * Takes an unlocked spinlock off spinlock_list.
+ */
+void spinlock_destroy(spinlock_t *sl);
+
+/**
+ * Spins until the lock is held by the current thread.
+ */
+void spin_lock(spinlock_t *sl);
+
+/**
+ * Releases the lock.
+ */
+void spin_unlock(spinlock_t *sl);
+
+/**
+ * Masks interrupts and then takes the lock.
+ *
+ * @return the previous interrupt priority level, to pass to
+ * spin_unlock_irqrestore
+ */
+uint8_t spin_lock_irqsave(spinlock_t *sl);
+
+/**
+ * Releases the lock and then restores the interrupt priority level
+ * from before spin_lock_irqsave.
+ */
+void spin_unlock_irqrestore(spinlock_t *sl, uint8_t ipl);
+
+/**
+ * Masks interrupts and takes the lock if nobody holds it.
+ *
+ * @param ipl where to store the previous interrupt priority level, if
+ * the lock was taken
+ * @return true if the lock was taken; otherwise the IPL is left as it
+ * was
+ */
+int spin_trylock_irqsave(spinlock_t *sl, uint8_t *ipl);
+
+/**
+ * Returns true if someone holds the lock.
+ */
+int spin_is_locked(spinlock_t *sl);
+
+/*
+ * A reader-writer spinlock. Any number of readers may hold it at once; a
+ * writer has it to itself. A writer holds rw_lock for the whole write and
+ * readers take it only briefly to get in, so a waiting writer stops new
+ * readers from starving it.
+ */
+typedef struct rwlock {
+  spinlock_t rw_lock;
+  volatile uint32_t rw_readers; /* number of readers in */
+} rwlock_t;
+
+void rwlock_init(rwlock_t *rw, const char *name);
+void read_lock(rwlock_t *rw);
+void read_unlock(rwlock_t *rw);
+void write_lock(rwlock_t *rw);
+void write_unlock(rwlock_t *rw);
@@ -0,0 +1,28 @@
+/*  times.h - processor times in clock ticks
+ */
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "config.h"
+#else
+#include "weenix/config.h"
+#endif
+
+typedef long clock_t;
+
+#define CLK_TCK (1000 / TICK_MSECS) /* clock ticks per second */
+
+struct tms {
+  clock_t tms_utime;  /* user time of the calling process */
+  clock_t tms_stime;  /* system time of the calling process */
+  clock_t tms_cutime; /* user time of its waited-for children */
+  clock_t tms_cstime; /* system time of its waited-for children */
+};
+
+#ifdef __KERNEL__
+clock_t do_times(struct tms *buf);
+#else
+clock_t times(struct tms *buf);
+#endif
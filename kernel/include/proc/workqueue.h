@@ -0,0 +1,59 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * The kernel workqueue: work which must be done in a thread, since it may
+ * block, but which doesn't warrant a daemon of its own. A work item is
+ * queued from thread or tasklet context and later run by one of a pool of
+ * "kworker" threads, in the order items were queued.
+ *
+ * The pool manages its own concurrency. It tries to keep exactly one
+ * worker runnable while work is waiting: when the running worker blocks
+ * inside an item and nothing else is, sched_switch tells the pool, which
+ * wakes an idle worker to carry on with the next item. A worker about to
+ * run an item when none is idle first creates another, up to
+ * WQ_MAX_WORKERS, so that one is ready should the item block. Items which
+ * never block are therefore all run by one thread, one after another.
+ *
+ * Only the boot processor runs threads, so there is one pool; should
+ * another processor start running them it wants a pool of its own, its
+ * workers pinned to it.
+ */
+
+struct kthread;
+struct work;
+
+typedef void (*work_func_t)(struct work *work);
+
+typedef struct work {
+  list_link_t w_link; /* on the pending list */
+  int w_pending;
+  work_func_t w_func;
+} work_t;
+
+void work_init(work_t *work, work_func_t func);
+
+/**
+ * Queues work to be run. An item may be queued again once it has started
+ * running, including by itself, but not before; it must stay in memory
+ * until it has.
+ *
+ * @return 1 if the work was queued, 0 if it was already pending
+ */
+int work_queue(work_t *work);
+
+/* Whether any work is waiting or running */
+int workqueue_busy(void);
+
+/* Waits for the queue to drain and the workers to exit. Called from
+ * idleproc once every other process has exited */
+void workqueue_shutdown(void);
+
+/* Called by the scheduler as a worker thread blocks or is woken */
+void workqueue_sleeping(struct kthread *thr);
+void workqueue_waking(struct kthread *thr);
+
+size_t workqueue_info(const void *arg, char *buf, size_t osize);
@@ -0,0 +1,88 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+typedef int32_t time_t;
+
+struct timespec {
+  time_t tv_sec; /* seconds */
+  long tv_nsec;  /* nanoseconds, less than 1000000000 */
+};
+
+struct timeval {
+  time_t tv_sec; /* seconds */
+  long tv_usec;  /* microseconds, less than 1000000 */
+};
+
+typedef int clockid_t;
+
+#define CLOCK_REALTIME 0  /* since the epoch, set from the hardware clock */
+#define CLOCK_MONOTONIC 1 /* since boot, never set */
+
+/*
+ * The time page: the kernel keeps the clocks here, and every address
+ * space has it mapped read-only at TIME_PAGE_ADDR, so that time_page_read
+ * can tell the time from userland without a system call.
+ *
+ * The kernel rewrites it every clock tick, bumping tp_seq to odd before
+ * and back to even after. Between updates the time is worked out from
+ * how far the time stamp counter has run since tp_tsc, which the reader
+ * only does up to 2^32 cycles: longer means the tick was stopped while
+ * the kernel was idle, and the page is stale until a system call or the
+ * next tick updates it.
+ */
+#define TIME_PAGE_ADDR 0x003ff000 /* the page below USER_MEM_LOW */
+
+typedef struct time_page {
+  volatile uint32_t tp_seq;
+  uint32_t tp_mult;   /* nanoseconds per cycle, times 2^tp_shift */
+  uint32_t tp_shift;
+  uint32_t tp_pad;
+  uint64_t tp_tsc;     /* the time stamp counter at the last update */
+  uint64_t tp_mono_ns; /* CLOCK_MONOTONIC then */
+  uint64_t tp_real_ns; /* CLOCK_REALTIME less CLOCK_MONOTONIC */
+} time_page_t;
+
+/**
+ * Reads a clock from the time page.
+ *
+ * @param tp the time page
+ * @param clk CLOCK_REALTIME or CLOCK_MONOTONIC
+ * @param ns where to put the time, in nanoseconds
+ * @return 0, or -1 if the clock is unknown or the page is stale
+ */
+static inline int time_page_read(const time_page_t *tp, clockid_t clk,
+                                 uint64_t *ns) {
+  uint32_t seq, lo, hi;
+  uint64_t delta, t;
+
+  if (CLOCK_REALTIME != clk && CLOCK_MONOTONIC != clk)
+    return -1;
+  do {
+    while ((seq = tp->tp_seq) & 1)
+      ;
+    __asm__ volatile("" ::: "memory");
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    delta = (((uint64_t)hi << 32) | lo) - tp->tp_tsc;
+    t = tp->tp_mono_ns;
+    if (CLOCK_REALTIME == clk)
+      t += tp->tp_real_ns;
+    if (delta >> 32)
+      return -1;
+    t += (delta * tp->tp_mult) >> tp->tp_shift;
+    __asm__ volatile("" ::: "memory");
+  } while (seq != tp->tp_seq);
+  *ns = t;
+  return 0;
+}
+
+#ifndef __KERNEL__
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int clock_gettime(clockid_t clk, struct timespec *tp);
+#endif
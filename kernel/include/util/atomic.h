@@ -0,0 +1,94 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Atomic operations on 32 bit words and memory barriers, for data shared
+ * between processors (and with interrupt handlers) which doesn't warrant
+ * a lock. The read-modify-write operations are lock-prefixed, so they are
+ * atomic with respect to other processors as well as to interrupts, and
+ * are full barriers. Data which only the local processor touches is better
+ * kept per-CPU (see main/percpu.h), where a plain add will do.
+ */
+
+/* Stops the compiler, but not the processor, reordering memory accesses */
+#define barrier() __asm__ volatile("" ::: "memory")
+
+/*
+ * Orders every load and store before it against every one after it. x86
+ * only ever lets a load pass an earlier store, so loads need nothing
+ * against loads and stores nothing against stores, bar keeping the
+ * compiler from moving them.
+ */
+#define mb() __asm__ volatile("lock; addl $0, (%%esp)" ::: "memory", "cc")
+#define rmb() barrier()
+#define wmb() barrier()
+
+/* What a spin-wait loop should do each time around */
+static inline void cpu_relax(void) { __asm__ volatile("pause" ::: "memory"); }
+
+static inline uint32_t atomic_read(const volatile uint32_t *p) { return *p; }
+
+static inline void atomic_set(volatile uint32_t *p, uint32_t v) { *p = v; }
+
+/* Adds n to *p and returns what *p was before */
+static inline uint32_t atomic_fetch_add(volatile uint32_t *p, uint32_t n) {
+  __asm__ volatile("lock; xaddl %0, %1"
+                   : "+r"(n), "+m"(*p)
+                   :
+                   : "memory", "cc");
+  return n;
+}
+
+static inline uint32_t atomic_add_return(volatile uint32_t *p, uint32_t n) {
+  return atomic_fetch_add(p, n) + n;
+}
+
+static inline void atomic_add(volatile uint32_t *p, uint32_t n) {
+  __asm__ volatile("lock; addl %1, %0" : "+m"(*p) : "ir"(n) : "memory", "cc");
+}
+
+static inline void atomic_sub(volatile uint32_t *p, uint32_t n) {
+  __asm__ volatile("lock; subl %1, %0" : "+m"(*p) : "ir"(n) : "memory", "cc");
+}
+
+static inline void atomic_inc(volatile uint32_t *p) {
+  __asm__ volatile("lock; incl %0" : "+m"(*p) : : "memory", "cc");
+}
+
+static inline void atomic_dec(volatile uint32_t *p) {
+  __asm__ volatile("lock; decl %0" : "+m"(*p) : : "memory", "cc");
+}
+
+/* Decrements *p and returns true if that made it zero */
+static inline int atomic_dec_and_test(volatile uint32_t *p) {
+  uint8_t zero;
+  __asm__ volatile("lock; decl %0\n\t"
+                   "sete %1"
+                   : "+m"(*p), "=qm"(zero)
+                   :
+                   : "memory", "cc");
+  return zero;
+}
+
+/* Stores v in *p and returns what was there; xchg with memory is always
+ * locked, so it needs no prefix */
+static inline uint32_t atomic_xchg(volatile uint32_t *p, uint32_t v) {
+  __asm__ volatile("xchgl %0, %1" : "+r"(v), "+m"(*p) : : "memory");
+  return v;
+}
+
+/*
+ * Stores new in *p if *p is old.
+ *
+ * @return what *p was, which is old if and only if the store happened
+ */
+static inline uint32_t atomic_cmpxchg(volatile uint32_t *p, uint32_t old,
+                                      uint32_t new) {
+  uint32_t prev;
+  __asm__ volatile("lock; cmpxchgl %2, %1"
+                   : "=a"(prev), "+m"(*p)
+                   : "r"(new), "0"(old)
+                   : "memory", "cc");
+  return prev;
+}
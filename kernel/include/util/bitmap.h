@@ -0,0 +1,43 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Bitmaps as arrays of 32 bit words, bit n being bit n % 32 of word
+ * n / 32. The searches look at a word at a time and find the bit in it
+ * with bsf (__builtin_ctz); bits past nbits in the last word must be
+ * left clear.
+ */
+
+#define BITMAP_WORDS(nbits) (((nbits) + 31) / 32)
+
+static inline void bitmap_set(uint32_t *map, uint32_t bit) {
+  map[bit / 32] |= 1U << (bit % 32);
+}
+
+static inline void bitmap_clear(uint32_t *map, uint32_t bit) {
+  map[bit / 32] &= ~(1U << (bit % 32));
+}
+
+static inline int bitmap_test(const uint32_t *map, uint32_t bit) {
+  return (map[bit / 32] >> (bit % 32)) & 1;
+}
+
+/**
+ * Finds the first set bit at or after start.
+ *
+ * @return the bit, or nbits if there is none
+ */
+uint32_t bitmap_find_next_set(const uint32_t *map, uint32_t nbits,
+                              uint32_t start);
+
+/**
+ * Finds the first clear bit at or after start.
+ *
+ * @return the bit, or nbits if there is none
+ */
+uint32_t bitmap_find_next_zero(const uint32_t *map, uint32_t nbits,
+                               uint32_t start);
+
+#define bitmap_find_first_set(map, nbits) bitmap_find_next_set(map, nbits, 0)
+#define bitmap_find_first_zero(map, nbits) bitmap_find_next_zero(map, nbits, 0)
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI, ext4 and btrfs for checksums
+ * of metadata. Computed with the SSE4.2 crc32 instruction where the
+ * processor has it, and a byte at a time from a table where it doesn't.
+ */
+
+/*
+ * Returns the CRC of len bytes at buf, continuing from crc, which is 0
+ * to begin with (or a CRC returned before, to checksum the bytes that
+ * follow).
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
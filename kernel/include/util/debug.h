@@ -60,6 +60,7 @@
 #define DBG_THR DBG_MODE(23)      /* thread stuff                 */
 #define DBG_PRINT DBG_MODE(24)    /* printdbg.c                   */
 #define DBG_OSYSCALL DBG_MODE(25) /* other system calls           */
+#define DBG_NET DBG_MODE(26)      /* network driver and stack     */
 #define DBG_VM DBG_MODE(28)       /* VM                           */
 #define DBG_TEST DBG_MODE(30)     /* for testing code             */
 #define DBG_TESTPASS DBG_MODE(31) /* for testing code             */
@@ -90,6 +91,7 @@
       {"sched", DBG_SCHED, _GREEN_},                                           \
       {"init", DBG_INIT, _NORMAL_}, /* Kern 2 */                               \
       {"term", DBG_TERM, _BMAGENTA_}, {"disk", DBG_DISK, _YELLOW_},            \
+      {"net", DBG_NET, _CYAN_},                                                \
       {"memdev", DBG_MEMDEV, _BBLUE_}, /* VFS */                               \
       {"vfs", DBG_VFS, _WHITE_}, {"fref", DBG_FREF, _MAGENTA_},                \
       {"vnref", DBG_VNREF, _CYAN_}, /* S5FS */                                 \
@@ -116,6 +118,15 @@
 
 extern uint64_t dbg_modes;
 
+/* The modes DBG in Config.mk turns on, the only ones built in: dbg() for
+ * any other mode compiles to nothing, arguments and all, and turning it
+ * on at runtime does nothing */
+#ifdef __DBG_MASK__
+#define DBG_BUILT_IN ((uint64_t)(__DBG_MASK__))
+#else
+#define DBG_BUILT_IN DBG_ALL
+#endif
+
 /* A common interface for functions which provide human-readable information
  * about
  * some data structure. Functions implementing this interface should fill buf
@@ -132,6 +143,12 @@ void dbg_init(void);
 void dbg_print(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void dbg_printinfo(dbg_infofunc_t func, const void *data);
 
+/* Sends queued output without waiting on the port; returns 1 if some is
+ * still queued */
+int dbg_drain(void);
+/* Sends all queued output, waiting on the port as long as it takes */
+void dbg_flush(void);
+
 const char *dbg_color(uint64_t d_mode);
 
 #ifndef NDEBUG
@@ -163,7 +180,7 @@ const char *dbg_color(uint64_t d_mode);
     }                                                                          \
   } while (0)
 
-#define dbg_active(mode) (dbg_modes & (mode))
+#define dbg_active(mode) ((DBG_BUILT_IN & (mode)) && (dbg_modes & (mode)))
 void dbg_add_mode(const char *mode);
 void dbg_add_modes(const char *modes);
 #else
@@ -0,0 +1,24 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+#include "stdarg.h"
+
+/*
+ * Where vformat() puts what it formats, in runs: each stretch of literal
+ * text, each converted field and each run of padding is one call. Returns
+ * 0, or nonzero to have the rest of the output thrown away.
+ */
+typedef int (*format_sink_t)(void *arg, const char *buf, size_t len);
+
+/*
+ * The printf engine behind vsnprintf(), and in userland vfprintf().
+ * Returns how many bytes the whole format came to, or -1 if the sink
+ * stopped it.
+ */
+int vformat(format_sink_t sink, void *arg, const char *fmt, va_list args);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A log-scale latency histogram, after HdrHistogram: each power of two
+ * is split into 1 << HIST_SUB_BITS equal buckets, so a value is counted
+ * to within 1 / (1 << HIST_SUB_BITS) of itself whatever its size, and
+ * tail percentiles come out as well as the median does. Values are in
+ * microseconds.
+ */
+
+#define HIST_SUB_BITS 2
+#define HIST_NBUCKETS ((32 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct hist {
+  uint32_t h_count;
+  uint32_t h_max;
+  uint32_t h_buckets[HIST_NBUCKETS];
+} hist_t;
+
+/* Counts one value */
+void hist_add(hist_t *h, uint32_t usecs);
+
+/* Counts the time since the given time_cycles() */
+void hist_add_since(hist_t *h, uint64_t start);
+
+/*
+ * Returns the value which the given parts per 10000 of those counted are
+ * no greater than, to within a bucket, e.g. 9990 gives the p99.9.
+ */
+uint32_t hist_percentile(const hist_t *h, uint32_t per10k);
+
+/*
+ * Print, like iprintf, the column headings for histograms, and then a
+ * line for one: its count, median, p90, p99, p99.9 and maximum.
+ */
+void hist_iprintf_header(char **buf, size_t *size);
+void hist_iprintf(char **buf, size_t *size, const char *name,
+                  const hist_t *h);
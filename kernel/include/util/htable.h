@@ -0,0 +1,60 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * An intrusive hash table of chains of list_link_ts, which doubles its
+ * buckets once it holds more than ht_max_load entries per bucket. Rather
+ * than moving every entry at once, growing keeps the old buckets and
+ * each insert and remove afterwards moves HTABLE_REHASH_STEP of them over,
+ * so no one operation takes long however big the table is. An entry is on
+ * exactly one chain at any time, old or new, and htable_bucket knows
+ * which.
+ *
+ * The table knows nothing of keys: callers hash their keys to 32 bits
+ * themselves, look through the chain htable_bucket gives them, and supply
+ * ht_hash to rehash an entry from its link when it is moved. Nothing
+ * here blocks (the buckets come from vmalloc), and callers do their own
+ * locking, so the table may be used with a spinlock held.
+ */
+
+#define HTABLE_REHASH_STEP 4
+
+typedef uint32_t (*htable_hash_t)(list_link_t *link);
+
+typedef struct htable {
+  list_t *ht_buckets;
+  uint32_t ht_order;    /* log2 of the number of buckets */
+  list_t *ht_old;       /* buckets being emptied into ht_buckets, or NULL */
+  uint32_t ht_oldorder;
+  uint32_t ht_moved;    /* ht_old buckets emptied so far */
+  uint32_t ht_count;    /* entries */
+  uint32_t ht_grow_at;  /* ht_count at which to grow */
+  uint32_t ht_max_load;
+  htable_hash_t ht_hash;
+} htable_t;
+
+/**
+ * Initializes a table.
+ *
+ * @param order log2 of the number of buckets to start with, at least 1
+ * @param max_load the average chain length at which the table grows
+ * @param hash gives the hash of an entry in the table
+ * @return 0 or -ENOMEM
+ */
+int htable_init(htable_t *ht, uint32_t order, uint32_t max_load,
+                htable_hash_t hash);
+
+/* The chain an entry with the given hash is, or should be put, on */
+list_t *htable_bucket(htable_t *ht, uint32_t hash);
+
+/* Adds an entry, growing the table if it is due */
+void htable_insert(htable_t *ht, list_link_t *link, uint32_t hash);
+
+/* Takes an entry out */
+void htable_remove(htable_t *ht, list_link_t *link);
+
+/* The number of buckets, old and new */
+uint32_t htable_nbuckets(htable_t *ht);
@@ -1,16 +1,36 @@
 #pragma once
 
-#define init_func(func)                                                        \
-  __asm__(".pushsection .init\n\t"                                             \
-          ".long " #func "\n\t"                                                \
-          ".string \"" #func "\"\n\t"                                          \
-          ".popsection\n\t");
-#define init_depends(name)                                                     \
+#include "types.h"
+
+/*
+ * init_func(f) has init_call_all() call f at boot, after every function
+ * named with init_depends() right after it. Each puts an entry of
+ * INIT_ENTRY_SIZE bytes in the .init section: the address of the
+ * function (0 for init_depends), a byte which is 1 for init_depends, and
+ * the name. tools/initsort.py reads the entries from the objects at build
+ * time and works out the order to call the functions in.
+ */
+#define INIT_ENTRY_SIZE 64 /* also in tools/initsort.py */
+
+#define _init_entry(addr, isdep, name)                                        \
   __asm__(".pushsection .init\n\t"                                             \
-          ".long 0\n\t"                                                        \
-          ".string \"" #name "\"\n\t"                                          \
+          "1:\n\t"                                                             \
+          ".long " addr "\n\t"                                                 \
+          ".byte " isdep "\n\t"                                                \
+          ".string \"" name "\"\n\t"                                           \
+          ".org 1b + 64\n\t"                                                   \
           ".popsection\n\t");
+#define init_func(func) _init_entry(#func, "0", #func)
+#define init_depends(name) _init_entry("0", "1", #name)
 
 typedef void (*init_func_t)();
 
 void init_call_all(void);
+
+/**
+ * A dbg_infofunc_t: how long each initialization function took at boot,
+ * in microseconds, and all of them together.
+ *
+ * @param arg must be NULL
+ */
+size_t init_info(const void *arg, char *buf, size_t osize);
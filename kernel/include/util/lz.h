@@ -0,0 +1,30 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A fast byte-oriented LZ77 compressor in the style of LZ4, for pages
+ * kept compressed in memory. The input is a run of sequences, each a
+ * token byte (literal count in the high nibble, match length less
+ * LZ_MIN_MATCH in the low one, 15 meaning that more length bytes follow,
+ * each adding up to 255), the literals, then a two-byte little-endian
+ * offset back into the output. The last sequence has literals only.
+ * Nothing but the compressed bytes is stored: the caller keeps the
+ * lengths.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_INPUT 0xffff /* offsets must fit in two bytes */
+
+/*
+ * Compresses len bytes at src into at most cap bytes at dst. Returns the
+ * compressed length, or 0 if it would not fit in cap. Doesn't block, and
+ * uses a table of its own, so it is not reentrant.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/*
+ * Decompresses len bytes at src into at most cap bytes at dst. Returns
+ * the decompressed length, or -1 if the input is malformed or would
+ * overflow cap.
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap);
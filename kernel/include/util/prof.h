@@ -0,0 +1,36 @@
+#pragma once
+
+#include "types.h"
+
+#include "main/interrupt.h"
+
+/*
+ * A sampling profiler. While it is on, each clock tick takes the
+ * interrupted %eip and, for kernel code, up to PROF_DEPTH - 1 return
+ * addresses from the frame pointer chain, and counts the stack in a hash
+ * table, a bucket per thread and distinct stack. kshell's "prof" command
+ * turns it on and off and lists the buckets; "kernel prof <file>" in gdb
+ * (util/prof.py) writes them out symbolized, as folded stacks for
+ * flamegraph.pl.
+ */
+
+#define PROF_DEPTH 8
+#define PROF_NBUCKETS 1024 /* a power of two */
+
+typedef struct prof_bucket {
+  uint32_t pb_count; /* 0 if the bucket is unused */
+  uint32_t pb_thr;   /* the kthread, 0 for none */
+  int32_t pb_pid;    /* -1 for none */
+  uint16_t pb_depth;
+  uint16_t pb_user; /* the %eip was in userland, and all there is */
+  uint32_t pb_pc[PROF_DEPTH]; /* innermost first */
+} prof_bucket_t;
+
+extern int prof_enabled;
+extern prof_bucket_t prof_buckets[PROF_NBUCKETS];
+extern uint32_t prof_nsamples; /* ticks sampled */
+extern uint32_t prof_ndropped; /* ticks not counted, the table being full */
+
+/* Called from the clock interrupt */
+void prof_sample(regs_t *regs);
+void prof_clear(void);
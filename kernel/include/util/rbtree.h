@@ -0,0 +1,64 @@
+#pragma once
+
+#include "kernel.h"
+
+/*
+ * Intrusive red-black tree. An rb_node_t is embedded in each structure
+ * kept in a tree; the tree does not know the keys, so callers walk down
+ * from rbt_root themselves, both to look things up and to find where a
+ * new node goes:
+ *
+ *   rb_node_t **link = &tree->rbt_root, *parent = NULL;
+ *   while (*link) {
+ *     parent = *link;
+ *     link = key < rb_item(parent, foo_t, f_node)->f_key ? &parent->rb_left
+ *                                                        : &parent->rb_right;
+ *   }
+ *   rb_link(&foo->f_node, parent, link);
+ *   rb_insert_fixup(tree, &foo->f_node);
+ *
+ * A tree may be augmented: each node keeps something summed up over its
+ * subtree (the largest gap, a count), which rbt_augment recomputes for a
+ * node from its own value and its children's. The tree calls it on every
+ * node whose subtree changes shape, starting with a new node in
+ * rb_insert_fixup; a caller which changes the value of a node already in
+ * the tree calls rb_propagate on it.
+ */
+
+typedef struct rb_node {
+  struct rb_node *rb_parent;
+  struct rb_node *rb_left;
+  struct rb_node *rb_right;
+  int rb_red;
+} rb_node_t;
+
+typedef void (*rb_augment_t)(rb_node_t *node);
+
+typedef struct rb_tree {
+  rb_node_t *rbt_root;
+  rb_augment_t rbt_augment; /* or NULL */
+} rb_tree_t;
+
+#define rb_item(node, type, member) CONTAINER_OF(node, type, member)
+
+/* Initializes an empty tree */
+void rb_init(rb_tree_t *tree, rb_augment_t augment);
+
+/* Puts node, as a red leaf, at link, a child pointer of parent (or the
+ * root pointer, with parent NULL) */
+void rb_link(rb_node_t *node, rb_node_t *parent, rb_node_t **link);
+
+/* Rebalances the tree after rb_link, augmenting the new node first */
+void rb_insert_fixup(rb_tree_t *tree, rb_node_t *node);
+
+/* Takes node out of the tree */
+void rb_remove(rb_tree_t *tree, rb_node_t *node);
+
+/* Calls rbt_augment on node and each of its ancestors */
+void rb_propagate(rb_tree_t *tree, rb_node_t *node);
+
+/* The nodes in order, each NULL past the end */
+rb_node_t *rb_first(rb_tree_t *tree);
+rb_node_t *rb_last(rb_tree_t *tree);
+rb_node_t *rb_next(rb_node_t *node);
+rb_node_t *rb_prev(rb_node_t *node);
@@ -61,6 +61,7 @@
 /* string and memory manipulation */
 int memcmp(const void *cs, const void *ct, size_t count);
 void *memcpy(void *dest, const void *src, size_t count);
+void *memchr(const void *s, int c, size_t count);
 int strncmp(const char *cs, const char *ct, size_t count);
 int strcmp(const char *cs, const char *ct);
 char *strcpy(char *dest, const char *src);
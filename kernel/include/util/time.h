@@ -0,0 +1,117 @@
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#include "util/list.h"
+
+#define TIME_HZ (1000 / TICK_MSECS) /* clock ticks per second */
+
+struct timespec;
+
+typedef void (*ktimer_func_t)(void *arg);
+
+/* A kernel timer. The function is called from the timer interrupt at the
+ * first tick at or after tm_expires, so it must not block. */
+typedef struct ktimer {
+  list_link_t tm_link;       /* link on a timer wheel slot */
+  unsigned long tm_expires;  /* tick at which to fire */
+  ktimer_func_t tm_func;     /* called with tm_arg when the timer fires */
+  void *tm_arg;
+} ktimer_t;
+
+/**
+ * Returns the number of clock ticks (each TICK_MSECS long) since the
+ * timer was started.
+ */
+unsigned long time_ticks(void);
+
+/**
+ * Returns the tick (see time_ticks) by which at least the given number
+ * of milliseconds will have passed, for waits with a timeout.
+ *
+ * @param msecs how long from now
+ */
+unsigned long time_deadline_ms(unsigned int msecs);
+
+/**
+ * Returns the processor's time stamp counter, which counts cycles.
+ */
+static inline uint64_t time_cycles(void) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * Converts a number of time stamp counter cycles to microseconds, or
+ * to clock ticks. The counter's rate is measured against the PIT as the
+ * clock is started; until then these return 0.
+ */
+uint64_t time_cycles_to_usecs(uint64_t cycles);
+unsigned long time_cycles_to_ticks(uint64_t cycles);
+
+/**
+ * Reads a clock, see time.h.
+ *
+ * @param clk CLOCK_REALTIME or CLOCK_MONOTONIC
+ * @param ts where to put the time
+ * @return 0, or -EINVAL if clk is neither
+ */
+int time_gettime(int clk, struct timespec *ts);
+
+/**
+ * Puts the current thread to sleep for at least the given number of
+ * milliseconds, rounded up to whole ticks. The sleep can be cancelled.
+ *
+ * @param msecs how long to sleep
+ * @return -EINTR if the thread was cancelled and 0 otherwise
+ */
+int time_sleep(unsigned int msecs);
+
+/**
+ * Initializes a timer which is not pending.
+ *
+ * @param t the timer
+ * @param func the function to call when the timer fires
+ * @param arg the argument to pass to func
+ */
+void timer_init(ktimer_t *t, ktimer_func_t func, void *arg);
+
+/**
+ * Arms a timer to fire at the given tick (see time_ticks). If it was
+ * already pending it is moved to the new time.
+ *
+ * @param t the timer
+ * @param expires the tick at which to fire
+ */
+void timer_add(ktimer_t *t, unsigned long expires);
+
+/**
+ * Disarms a timer.
+ *
+ * @param t the timer
+ * @return true if the timer was pending
+ */
+int timer_cancel(ktimer_t *t);
+
+/**
+ * Returns true if the timer is armed and has not fired yet.
+ */
+int timer_pending(ktimer_t *t);
+
+/**
+ * Called by the scheduler, with interrupts disabled, just before it
+ * waits for an interrupt with nothing to run. Stops the periodic tick
+ * and programs the timer for the next pending deadline instead, if
+ * that is far enough off to be worth it. time_idle_exit must be called
+ * once the wait is over.
+ */
+void time_idle_enter(void);
+
+/**
+ * Called by the scheduler, with interrupts disabled, after waiting for an
+ * interrupt. Accounts for the time spent idle and restarts the periodic
+ * tick if time_idle_enter stopped it.
+ */
+void time_idle_exit(void);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Static tracepoints. trace() at an event records it, with the time stamp
+ * counter, the current thread and process and two words of arguments, in
+ * a ring of the last TRACE_NEVENTS events. An event which is not turned
+ * on costs one test of trace_mask; kshell's "trace" command turns events
+ * on and off and dumps the ring, and "kernel trace" in gdb (util/trace.py)
+ * writes it out as a Chrome trace / Perfetto JSON file.
+ *
+ * Events ending in _BEGIN and _END bracket something which takes time;
+ * the others are instants.
+ */
+
+#define TRACE_SCHED_SWITCH 0   /* to curthr, from arg0 */
+#define TRACE_SCHED_WAKEUP 1   /* thread arg0 of proc arg1 made runnable */
+#define TRACE_PFRAME_HIT 2     /* page arg1 of object arg0 */
+#define TRACE_PFRAME_MISS 3    /* page arg1 of object arg0 */
+#define TRACE_PFRAME_FILL_BEGIN 4
+#define TRACE_PFRAME_FILL_END 5 /* arg1 is what fillpage returned */
+#define TRACE_DISK_BEGIN 6     /* block arg0, arg1 blocks (bit 31 for a write) */
+#define TRACE_DISK_END 7       /* arg1 is the error */
+#define TRACE_SYSCALL_BEGIN 8  /* arg0 the number, arg1 the argument */
+#define TRACE_SYSCALL_END 9    /* arg1 the return value */
+#define TRACE_FAULT_BEGIN 10   /* at address arg0, cause arg1 */
+#define TRACE_FAULT_END 11
+#define TRACE_NTYPES 12
+
+#define TRACE_ALL ((1U << TRACE_NTYPES) - 1)
+
+/* From TRACE_PFRAME_FILL_BEGIN on, events come in _BEGIN, _END pairs */
+#define TRACE_IS_BEGIN(type) ((type) >= TRACE_PFRAME_FILL_BEGIN && !((type)&1))
+#define TRACE_IS_END(type) ((type) >= TRACE_PFRAME_FILL_BEGIN && ((type)&1))
+
+/* A power of two */
+#define TRACE_NEVENTS 2048
+
+typedef struct trace_event {
+  uint64_t te_tsc;
+  uint16_t te_type;
+  uint16_t te_cpu;
+  int32_t te_pid; /* -1 if there is no current process */
+  uint32_t te_thr;
+  uint32_t te_arg[2];
+  uint32_t te_pad;
+} trace_event_t;
+
+extern uint32_t trace_mask;
+extern trace_event_t trace_ring[TRACE_NEVENTS];
+extern uint32_t trace_head; /* events recorded since the last clear */
+
+extern const char *trace_names[TRACE_NTYPES];
+
+void trace_record(int type, uint32_t arg0, uint32_t arg1);
+void trace_clear(void);
+
+#define trace(type, arg0, arg1)                                                \
+  do {                                                                         \
+    if (__builtin_expect(trace_mask & (1U << (type)), 0))                      \
+      trace_record((type), (uint32_t)(arg0), (uint32_t)(arg1));                \
+  } while (0)
@@ -4,5 +4,6 @@ struct mmobj;
 
 void anon_init();
 struct mmobj *anon_create(void);
+int anon_is(struct mmobj *o);
 
 extern int anon_count;
@@ -1,3 +1,3 @@
 #pragma once
 
-int do_brk(void *addr, void **ret);
+int do_brk(void *addr, int populate, void **ret);
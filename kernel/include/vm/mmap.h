@@ -6,3 +6,6 @@ struct vmarea;
 int do_munmap(void *addr, size_t len);
 int do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
             void **ret);
+int do_madvise(void *addr, size_t len, int advice);
+int do_mremap(void *addr, size_t oldlen, size_t newlen, int flags,
+              void **ret);
@@ -8,4 +8,9 @@
 #define FAULT_RESERVED 0x08
 #define FAULT_EXEC 0x10
 
+struct vmarea;
+
 void handle_pagefault(uintptr_t vaddr, uint32_t cause);
+/* A dbg_infofunc_t: latency percentiles of faults by kind, in usecs */
+size_t pagefault_info(const void *arg, char *buf, size_t osize);
+int vm_populate(struct vmarea *vma, uint32_t lo, uint32_t hi);
@@ -1,8 +1,17 @@
 #pragma once
 
 struct mmobj;
+struct vmarea;
 
 void shadow_init();
 struct mmobj *shadow_create(void);
 
+int shadow_depth(struct mmobj *o);
+void shadow_collapse(struct vmarea *vma);
+void shadow_collapse_all(struct mmobj *bottom);
+int shadow_flatten(struct vmarea *vma);
+
 extern int shadow_count;
+extern unsigned int shadow_collapsed;
+extern unsigned int shadow_migrated;
+extern unsigned int shadow_flattened;
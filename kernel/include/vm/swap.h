@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.h"
+
+struct mmobj;
+struct pframe;
+
+/*
+ * Backing store for the pages of anonymous and shadow objects. Each page
+ * written out is given a slot of its own, keyed by its object and page
+ * number, which stays with the page while it is resident and clean so
+ * that paging it out again costs nothing; the slot is given up once the
+ * page is dirtied or its object dies.
+ *
+ * A slot is first of all a compressed copy in memory (lz.h), of which
+ * there are at most SWAP_ZCACHE_PAGES pages' worth. Pages which don't
+ * compress to SWAP_ZCACHE_MAX_LEN, or don't fit, go to a block on the
+ * second disk instead, if there is one. The compressed cache is meant for
+ * pages pageoutd is reclaiming, so with it writeback leaves anonymous
+ * pages to pageoutd (see pframe_writeback).
+ *
+ * With neither there is no swap, and those objects pin their pages as
+ * before.
+ */
+
+/* Whether there is anywhere to swap to */
+int swap_enabled(void);
+
+/* Whether there is a compressed cache */
+int swap_zcache_enabled(void);
+
+/* Whether the page of o has a slot */
+int swap_has(struct mmobj *o, uint32_t pagenum);
+
+/**
+ * Reads the page back from its slot, if it has one, keeping the slot.
+ *
+ * @return 1 if the page was read, 0 if it has no slot, or -errno
+ */
+int swap_in(struct mmobj *o, struct pframe *pf);
+
+/**
+ * Writes the page to its slot, giving it one first if it has none.
+ *
+ * @return 0, -ENOSPC if the device is full, or -errno
+ */
+int swap_out(struct mmobj *o, struct pframe *pf);
+
+/* Gives up the page's slot, if it has one */
+void swap_discard(struct mmobj *o, uint32_t pagenum);
+
+/* Gives up all of the object's slots, for when it dies */
+void swap_release(struct mmobj *o);
+
+/*
+ * Hands the slots of a shadow object which is being collapsed to the
+ * object above it, except for pages the latter has a newer version of.
+ * Called once the pages of from have been moved up.
+ */
+void swap_move(struct mmobj *from, struct mmobj *to);
+
+extern uint32_t swap_nslots; /* for debugging/verification purposes */
+extern uint32_t swap_nused;
+extern uint32_t swap_nzpages; /* pages in the compressed cache */
+extern uint32_t swap_nzbytes; /* and the bytes they take there */
@@ -3,6 +3,7 @@
 #include "types.h"
 
 #include "util/list.h"
+#include "util/rbtree.h"
 
 #define VMMAP_DIR_LOHI 1
 #define VMMAP_DIR_HILO 2
@@ -11,8 +12,18 @@ struct mmobj;
 struct proc;
 struct vnode;
 
+/*
+ * The areas of a map are kept both on vmm_list, sorted by address, and in
+ * a red-black tree keyed by address. Each area records the free pages
+ * between it and the area before it, and each node of the tree the
+ * largest such gap in its subtree, so both finding the area holding a
+ * page and finding a large enough gap take time logarithmic in the
+ * number of areas.
+ */
 typedef struct vmmap {
   list_t vmm_list;
+  rb_tree_t vmm_tree;       /* the areas, by address */
+  struct vmarea *vmm_cache; /* area vmmap_lookup found last */
   struct proc *vmm_proc;
 } vmmap_t;
 
@@ -25,6 +36,7 @@ typedef struct vmarea {
 
   int vma_prot;  /* permissions on mapping */
   int vma_flags; /* either MAP_SHARED or MAP_PRIVATE */
+  int vma_advice; /* MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL */
 
   struct vmmap *vma_vmmap; /* address space that this area belongs to */
   struct mmobj *vma_obj;   /* the vm object to read pages from */
@@ -32,6 +44,12 @@ typedef struct vmarea {
   list_link_t vma_olink;   /* link on the list of all vm_areas
                             * having the same vm_object at the
                             * bottom of their chain */
+  list_t vma_rmaps;        /* mappings of pages in this area, see pframe.c */
+
+  /* Managed by vmmap: the area's node in the map's tree */
+  rb_node_t vma_node;
+  uint32_t vma_gap;    /* free pages between the previous area and this */
+  uint32_t vma_maxgap; /* largest vma_gap in this subtree */
 } vmarea_t;
 
 void vmmap_init(void);
@@ -43,6 +61,9 @@ vmarea_t *vmmap_lookup(vmmap_t *map, uint32_t vfn);
 int vmmap_map(vmmap_t *map, struct vnode *file, uint32_t lopage,
               uint32_t npages, int prot, int flags, off_t off, int dir,
               vmarea_t **new);
+void vmmap_extend(vmmap_t *map, vmarea_t *vma, uint32_t npages);
+int vmmap_move(vmmap_t *map, uint32_t lopage, uint32_t npages,
+               uint32_t newpages);
 int vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages);
 int vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages);
 int vmmap_find_range(vmmap_t *map, uint32_t npages, int dir);
@@ -50,6 +71,16 @@ int vmmap_find_range(vmmap_t *map, uint32_t npages, int dir);
 int vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count);
 int vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count);
 
+int vmmap_take_page(vmmap_t *map, uint32_t vfn, struct mmobj *dest,
+                    uint32_t pagenum);
+int vmmap_give_page(vmmap_t *map, uint32_t vfn, struct mmobj *src,
+                    uint32_t pagenum);
+
 vmmap_t *vmmap_clone(vmmap_t *map);
 
 size_t vmmap_mapping_info(const void *map, char *buf, size_t size);
+
+/* A dbg_infofunc_t (arg NULL): the areas of every process's map, with the
+ * object at the bottom of each one's shadow chain, as listed by
+ * pframe_obj_info, and how many pages its shadow objects hold */
+size_t vmmap_procs_info(const void *arg, char *buf, size_t osize);
@@ -1,8 +1,10 @@
 #include "types.h"
 
+#include "main/apic.h"
 #include "main/io.h"
 #include "main/acpi.h"
 #include "main/cpuid.h"
+#include "main/pit.h"
 
 #include "mm/page.h"
 #include "mm/pagetable.h"
@@ -135,9 +137,17 @@ struct ioapic_table {
 };
 
 static struct apic_table *apic = NULL;
-static struct lapic_table *lapic = NULL;
+static struct lapic_table *lapic = NULL; /* the boot processor's */
 static struct ioapic_table *ioapic = NULL;
 
+/* Every enabled processor listed in the MADT, the boot processor first */
+#define APIC_MAX_CPUS 16
+static struct lapic_table *apic_cpus[APIC_MAX_CPUS];
+/* The processor each I/O APIC input is delivered to, an index into
+ * apic_cpus; all go to the boot processor unless told otherwise */
+static uint8_t apic_irq_cpu[256];
+static int apic_ncpus = 0;
+
 static uint32_t __lapic_getid(void) { return (LAPICID >> 24) & 0x0f; }
 
 static uint32_t __lapic_getver(void) { return LAPICVER & 0xff; }
@@ -194,7 +204,7 @@ static void __ioapic_setredir(uint32_t irq, uint8_t intr) {
   ioapic_write((uintptr_t)ioapic->at_addr, IRQ_TO_OFFSET(irq, 0), data);
   /* Now deal with the higher order register */
   data = ioapic_read((uintptr_t)ioapic->at_addr, IRQ_TO_OFFSET(irq, 1));
-  ((uint8_t *)&data)[3] = lapic->at_apicid;
+  ((uint8_t *)&data)[3] = apic_cpus[apic_irq_cpu[irq]]->at_apicid;
   ioapic_write((uintptr_t)ioapic->at_addr, IRQ_TO_OFFSET(irq, 1), data);
 }
 
@@ -248,45 +258,63 @@ void apic_disable_periodic_timer() {
   *(uint32_t *)(apic->at_addr + LOCAL_APIC_TASKPRIOR) = 0;
 }
 
+/* Timer count for one period, as set by apic_enable_periodic_timer, and the
+ * count the timer was last started from */
+static uint32_t apic_timer_count = 0;
+static uint32_t apic_timer_initcnt = 0;
+
+/* Starts the timer ticking freq times a second. Its rate is measured
+ * against the PIT over APIC_CALIBRATE_HZ'th of a second. */
+#define APIC_CALIBRATE_HZ 100
+
 void apic_enable_periodic_timer(uint32_t freq) {
-  uint32_t tmp;
-  uint32_t cpubusfreq;
+  uint32_t counted, tmp;
 
   dbgq(DBG_CORE, "--- Enabling APIC Timer ---\n");
 
+  /* Count down from the top, masked, at the bus clock over 16 */
+  *(uint32_t *)(apic->at_addr + LOCAL_APIC_LVT_TMR) = LOCAL_APIC_DISABLE;
   *(uint32_t *)(apic->at_addr + LOCAL_APIC_TMRDIV) = 0x03;
-  /* Initialize PIT Ch 2 in one-shot mode */
-  /* Some crazy magic numbers here */
-  outb(0x61, (inb(0x61) & 0xfd) | 1);
-  outb(0x43, 0xb2);
-  outb(0x42, 0x9b);
-  inb(0x60);
-  outb(0x42, 0x2e);
-
-  /* reset PIT one-shot counter (start counting) */
-  tmp = (uint32_t)(inb(0x61) & 0xfe);
-  outb(0x61, (uint8_t)tmp);
-  outb(0x61, (uint8_t)tmp | 1);
-  /* reset APIC timer (set counter to -1) */
+  pit_oneshot_start(PIT_HZ / APIC_CALIBRATE_HZ);
   *(uint32_t *)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = 0xffffffff;
-  /* wait until the PIT reaches zero */
-  while (!(inb(0x61) & 0x20))
-    ;
-  /* Stop the APIC timer */
-  *(uint32_t *)(apic->at_addr + LOCAL_APIC_LVT_TMR) = LOCAL_APIC_DISABLE;
-  /* some math */
-  cpubusfreq =
-      ((0xffffffff - *(uint32_t *)(apic->at_addr + LOCAL_APIC_TMRINITCNT)) +
-       1) *
-      16 * 100;
-  tmp = (cpubusfreq / freq / 16) * 10000;
-  dbgq(DBG_CORE, "CPU Bus Freq: %u\n", cpubusfreq);
+  pit_oneshot_wait();
+  counted = 0xffffffff -
+            *(volatile uint32_t *)(apic->at_addr + LOCAL_APIC_TMRCURRCNT);
+  *(uint32_t *)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = 0;
+
+  tmp = counted * APIC_CALIBRATE_HZ / freq;
+  dbgq(DBG_CORE, "CPU Bus Freq: %u\n", counted * APIC_CALIBRATE_HZ * 16);
   dbgq(DBG_CORE, "APIC Timer initial count %u\n", tmp);
+  apic_timer_count = (tmp < 16 ? 16 : tmp);
+  apic_resume_periodic_timer();
+}
+
+void apic_resume_periodic_timer() {
+  KASSERT(apic_timer_count);
   /* Set up the APIC timer for periodic mode */
-  *(uint32_t *)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = (tmp < 16 ? 16 : tmp);
   *(uint32_t *)(apic->at_addr + LOCAL_APIC_LVT_TMR) =
       32 | LOCAL_APIC_TMR_PERIODIC;
   *(uint32_t *)(apic->at_addr + LOCAL_APIC_TMRDIV) = 0x03;
+  *(uint32_t *)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = apic_timer_count;
+  apic_timer_initcnt = apic_timer_count;
+}
+
+uint32_t apic_oneshot_timer(uint32_t periods) {
+  KASSERT(apic_timer_count && periods);
+  if (periods > 0xffffffff / apic_timer_count)
+    periods = 0xffffffff / apic_timer_count;
+  *(uint32_t *)(apic->at_addr + LOCAL_APIC_LVT_TMR) = 32;
+  *(uint32_t *)(apic->at_addr + LOCAL_APIC_TMRDIV) = 0x03;
+  apic_timer_initcnt = periods * apic_timer_count;
+  *(uint32_t *)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = apic_timer_initcnt;
+  return periods;
+}
+
+uint32_t apic_timer_elapsed() {
+  uint32_t left = *(volatile uint32_t *)(apic->at_addr + LOCAL_APIC_TMRCURRCNT);
+  KASSERT(left <= apic_timer_initcnt);
+  /* Round to the nearest period */
+  return (apic_timer_initcnt - left + apic_timer_count / 2) / apic_timer_count;
 }
 
 static void apic_disable_8259() {
@@ -327,24 +355,33 @@ void apic_init() {
   KASSERT(PAGE_ALIGNED(apic->at_addr));
   apic->at_addr = pt_phys_perm_map(apic->at_addr, 1);
 
-  /* Get the tables for the local APIC and IO APICS,
-   * Weenix currently only supports one of each, in order
-   * to enforce this a KASSERT will fail this if more than one
-   * of each type is found */
-  uint8_t off = sizeof(*apic);
+  /* Get the tables for the local APICs and IO APICS. There is a local
+   * APIC for each processor; Weenix keeps a list of them all but only
+   * runs on the one it booted on. Only one IO APIC is supported, in
+   * order to enforce this a KASSERT will fail if more than one is
+   * found */
+  uint32_t off = sizeof(*apic);
   while (off < apic->at_header.ah_size) {
     uint8_t type = *(ptr + off);
     uint8_t size = *(ptr + off + 1);
     if (TYPE_LAPIC == type) {
+      struct lapic_table *cpu = (struct lapic_table *)(ptr + off);
       KASSERT(apic_exists() && "Local APIC does not exist");
       KASSERT(sizeof(struct lapic_table) == size);
-      KASSERT(NULL == lapic && "Weenix only supports a single local APIC");
-      lapic = (struct lapic_table *)(ptr + off);
       dbgq(DBG_CORE, "LAPIC:\n");
-      dbgq(DBG_CORE, "   id:         0x%.2x\n", (uint32_t)lapic->at_apicid);
-      dbgq(DBG_CORE, "   processor:  0x%.3x\n", (uint32_t)lapic->at_procid);
-      dbgq(DBG_CORE, "   enabled:    %i\n", lapic->at_flags & 0x1);
-      KASSERT(lapic->at_flags & 0x1 && "The local APIC is disabled");
+      dbgq(DBG_CORE, "   id:         0x%.2x\n", (uint32_t)cpu->at_apicid);
+      dbgq(DBG_CORE, "   processor:  0x%.3x\n", (uint32_t)cpu->at_procid);
+      dbgq(DBG_CORE, "   enabled:    %i\n", cpu->at_flags & 0x1);
+      if (!(cpu->at_flags & 0x1)) {
+        /* Not usable; skip it */
+      } else if (cpu->at_apicid == __lapic_getid()) {
+        KASSERT(NULL == lapic && "Two local APICs with the boot APIC's id");
+        lapic = cpu;
+      } else if (apic_ncpus + 1 < APIC_MAX_CPUS) {
+        apic_cpus[++apic_ncpus] = cpu;
+      } else {
+        dbgq(DBG_CORE, "   ignored, too many processors\n");
+      }
     } else if (TYPE_IOAPIC == type) {
       KASSERT(apic_exists() && "IO APIC does not exist");
       KASSERT(sizeof(struct ioapic_table) == size);
@@ -361,8 +398,11 @@ void apic_init() {
     }
     off += size;
   }
-  KASSERT(NULL != lapic && "Could not find a local APIC device");
+  KASSERT(NULL != lapic && "Could not find the boot processor's local APIC");
   KASSERT(NULL != ioapic && "Could not find an IO APIC");
+  apic_cpus[0] = lapic;
+  apic_ncpus++;
+  dbgq(DBG_CORE, "%d processor(s) found\n", apic_ncpus);
 
   dbgq(DBG_CORE, "--- Enabling APIC ---\n");
   apic_enable();
@@ -387,8 +427,33 @@ void apic_setspur(uint8_t intr) {
 
 void apic_eoi() { LAPICEOI = 0x0; }
 
+int apic_cpu_count() { return apic_ncpus; }
+
+uint8_t apic_cpu_apicid(int cpu) {
+  KASSERT(0 <= cpu && cpu < apic_ncpus);
+  return apic_cpus[cpu]->at_apicid;
+}
+
 void apic_setredir(uint32_t irq, uint8_t intr) {
   dbg(DBG_CORE, "redirecting irq %u to interrupt %hhu\n", irq, intr);
   __ioapic_setredir(irq, intr);
   __ioapic_setmask(irq, 0);
 }
+
+void apic_setaffinity(uint32_t irq, int cpu) {
+  uint32_t data;
+
+  KASSERT(irq <= __ioapic_getmaxredir());
+  KASSERT(0 <= cpu && cpu < apic_ncpus);
+  dbg(DBG_CORE, "delivering irq %u to processor %d\n", irq, cpu);
+  apic_irq_cpu[irq] = cpu;
+  /* Only the destination changes, so the vector and mask are left be */
+  data = ioapic_read((uintptr_t)ioapic->at_addr, IRQ_TO_OFFSET(irq, 1));
+  ((uint8_t *)&data)[3] = apic_cpus[cpu]->at_apicid;
+  ioapic_write((uintptr_t)ioapic->at_addr, IRQ_TO_OFFSET(irq, 1), data);
+}
+
+int apic_getaffinity(uint32_t irq) {
+  KASSERT(irq < sizeof(apic_irq_cpu));
+  return apic_irq_cpu[irq];
+}
@@ -1,4 +1,5 @@
 #include "main/gdt.h"
+#include "main/percpu.h"
 
 #include "util/printf.h"
 #include "util/debug.h"
@@ -61,6 +62,7 @@ void gdt_init(void) {
   gdt_set_entry(GDT_KERNEL_DATA, 0x0, 0xFFFFF, 0, 0, 0, 1);
   gdt_set_entry(GDT_USER_TEXT, 0x0, 0xFFFFF, 3, 1, 0, 1);
   gdt_set_entry(GDT_USER_DATA, 0x0, 0xFFFFF, 3, 0, 0, 1);
+  gdt_set_entry(GDT_USER_TLS, 0x0, 0xFFFFF, 3, 0, 0, 1);
 
   __asm__ volatile("lgdt (%0)" ::"p"(data));
 
@@ -75,10 +77,28 @@ void gdt_init(void) {
 
   int segment = GDT_TSS;
   __asm__ volatile("ltr %0" ::"m"(segment));
+
+  percpu_init(0);
 }
 
 void gdt_set_kernel_stack(void *addr) { tss.ts_esp0 = (uint32_t)addr; }
 
+uint32_t *gdt_kernel_stack_slot(void) { return &tss.ts_esp0; }
+
+/*
+ * Moves the user TLS segment to base, for the thread about to run, and
+ * reloads %gs so that the new base takes effect. The kernel never uses
+ * %gs itself and neither interrupts nor context_switch save it, so the
+ * selector loaded here is what the thread sees when it gets to userland.
+ */
+void gdt_set_tls(uint32_t base) {
+  int index = GDT_USER_TLS / 8;
+  gdt[index].ge_baselo = (uint16_t)base;
+  gdt[index].ge_basemid = (uint8_t)(base >> 16);
+  gdt[index].ge_basehi = (uint8_t)(base >> 24);
+  __asm__ volatile("movw %w0, %%gs" ::"r"(GDT_USER_TLS | 3));
+}
+
 void gdt_set_entry(uint32_t segment, uint32_t base, uint32_t limit,
                    uint8_t ring, int exec, int dir, int rw) {
   KASSERT(segment < GDT_COUNT * 8 && 0 == segment % 8);
@@ -1,12 +1,21 @@
+#include "config.h"
+#include "errno.h"
 #include "types.h"
 
 #include "util/debug.h"
+#include "util/printf.h"
 #include "util/string.h"
+#include "util/time.h"
 
 #include "main/io.h"
 #include "main/apic.h"
 #include "main/interrupt.h"
 #include "main/gdt.h"
+#include "main/percpu.h"
+#include "main/tasklet.h"
+#include "main/cpuid.h"
+
+#include "proc/sched.h"
 
 #define MAX_INTERRUPTS 256
 
@@ -23,6 +32,10 @@
 #define IDT_DESC_RING3 0x60
 #define IDT_DESC_PRESENT 0x80
 
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
 #define INTR(isr) (__intr_handler##isr)
 #define INTR_ERRCODE(isr)                                                      \
   extern intr_handler_t __intr_handler##isr;                                   \
@@ -32,10 +45,14 @@
           "pusha\n\t"                                                          \
           "push %ds\n\t"                                                       \
           "push %es\n\t"                                                       \
+          "push %fs\n\t"                                                       \
           "movl %ss, %edx\n\t"                                                 \
           "movl %edx, %ds\n\t"                                                 \
           "movl %edx, %es\n\t"                                                 \
+          "movl $0x38, %edx\n\t" /* GDT_KERNEL_PERCPU */                       \
+          "movl %edx, %fs\n\t"                                                 \
           "call __intr_handler\n\t"                                            \
+          "pop %fs\n\t"                                                        \
           "pop %es\n\t"                                                        \
           "pop %ds\n\t"                                                        \
           "popa\n\t"                                                           \
@@ -51,16 +68,63 @@
           "pusha\n\t"                                                          \
           "push %ds\n\t"                                                       \
           "push %es\n\t"                                                       \
+          "push %fs\n\t"                                                       \
           "movl %ss, %edx\n\t"                                                 \
           "movl %edx, %ds\n\t"                                                 \
           "movl %edx, %es\n\t"                                                 \
+          "movl $0x38, %edx\n\t" /* GDT_KERNEL_PERCPU */                       \
+          "movl %edx, %fs\n\t"                                                 \
           "call __intr_handler\n\t"                                            \
+          "pop %fs\n\t"                                                        \
           "pop %es\n\t"                                                        \
           "pop %ds\n\t"                                                        \
           "popa\n\t"                                                           \
           "add $8, %esp\n\t"                                                   \
           "iret\n");
 
+/*
+ * Userland's side of SYSENTER puts the system call number in %eax, the
+ * argument in %edx, its stack pointer in %ecx and where to return to in
+ * %esi. SYSENTER leaves us on the word of the TSS which holds the kernel
+ * stack, with interrupts off; from there we build the same frame that int
+ * $INTR_SYSCALL would have, so everything past this point (fork copying
+ * the frame, exec rewriting it) is none the wiser. SYSEXIT goes back to
+ * whatever %eip and %esp the frame holds by then, with %esi clobbered.
+ */
+extern intr_handler_t __intr_sysenter;
+__asm__(".global __intr_sysenter\n"
+        "__intr_sysenter:\n\t"
+        "movl (%esp), %esp\n\t"
+        "push $0x23\n\t" /* GDT_USER_DATA | 3 */
+        "push %ecx\n\t"
+        "pushf\n\t"
+        "orl $0x200, (%esp)\n\t" /* IF, which SYSENTER cleared */
+        "push $0x1b\n\t"         /* GDT_USER_TEXT | 3 */
+        "push %esi\n\t"
+        "push $0x1\n\t" /* INTR_SYSENTER */
+        "push $0x2e\n\t" /* INTR_SYSCALL */
+        "pusha\n\t"
+        "push %ds\n\t"
+        "push %es\n\t"
+        "push %fs\n\t"
+        "movl %ss, %edx\n\t"
+        "movl %edx, %ds\n\t"
+        "movl %edx, %es\n\t"
+        "movl $0x38, %edx\n\t" /* GDT_KERNEL_PERCPU */
+        "movl %edx, %fs\n\t"
+        "sti\n\t" /* as the system call gate, a trap gate, would be */
+        "call __intr_handler\n\t"
+        "pop %fs\n\t"
+        "pop %es\n\t"
+        "pop %ds\n\t"
+        "popa\n\t"
+        "add $8, %esp\n\t"
+        "movl (%esp), %edx\n\t"
+        "movl 12(%esp), %ecx\n\t"
+        "add $8, %esp\n\t"
+        "popf\n\t"
+        "sysexit\n");
+
 INTR_NOERRCODE(0)
 INTR_NOERRCODE(1)
 INTR_NOERRCODE(2)
@@ -335,6 +399,12 @@ static intr_desc_t intr_table[MAX_INTERRUPTS];
 static intr_handler_t intr_handlers[MAX_INTERRUPTS];
 static int32_t intr_mappings[MAX_INTERRUPTS];
 
+/* How often each processor has taken each vector, and the cycles spent
+ * in its handler. Kept here rather than in percpu_t, which has to fit in
+ * a page. */
+static uint32_t intr_counts[PERCPU_MAX][MAX_INTERRUPTS];
+static uint64_t intr_cycles[PERCPU_MAX][MAX_INTERRUPTS];
+
 intr_info_t intr_data = {.size = sizeof(intr_info_t),
                          .base = (uint32_t)intr_table};
 
@@ -352,17 +422,91 @@ intr_handler_t intr_register(uint8_t intr, intr_handler_t handler) {
   return old;
 }
 
+/* The processor config.h steers interrupt intr to */
+static uint32_t intr_default_cpu(uint8_t intr) {
+  switch (intr) {
+  case INTR_DISK_PRIMARY:
+  case INTR_DISK_SECONDARY:
+  case INTR_VIRTIO_BLK:
+  case INTR_AHCI:
+    return INTR_CPU_DISK;
+  case INTR_KEYBOARD:
+    return INTR_CPU_KEYBOARD;
+  case INTR_VIRTIO_NET:
+    return INTR_CPU_NET;
+  default:
+    return 0;
+  }
+}
+
 int32_t intr_map(uint16_t irq, uint8_t intr) {
   KASSERT(INTR_SPURIOUS != intr);
 
   int32_t oldirq = intr_mappings[intr];
   intr_mappings[intr] = irq;
   apic_setredir(irq, intr);
+  if (intr_set_affinity(irq, intr_default_cpu(intr)))
+    dbg(DBG_CORE, "irq %u left on the boot processor\n", irq);
   return oldirq;
 }
 
+int intr_set_affinity(uint16_t irq, uint32_t cpu) {
+  int i;
+
+  /* A processor which hasn't set up its per-CPU area isn't taking
+   * interrupts */
+  if (cpu >= percpu_ncpus || (int)cpu >= apic_cpu_count())
+    return -EINVAL;
+  for (i = 0; i < MAX_INTERRUPTS; i++) {
+    if (intr_mappings[i] == irq) {
+      apic_setaffinity(irq, cpu);
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+size_t intr_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  uint32_t cpu, total;
+  uint64_t cycles;
+  int i;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "%-6s %4s %4s", "vector", "irq", "cpu");
+  for (cpu = 0; cpu < percpu_ncpus; cpu++)
+    iprintf(&buf, &size, "   count%-3u", cpu);
+  iprintf(&buf, &size, " %14s\n", "cycles");
+  for (i = 0; i < MAX_INTERRUPTS; i++) {
+    total = 0;
+    cycles = 0;
+    for (cpu = 0; cpu < percpu_ncpus; cpu++) {
+      total += intr_counts[cpu][i];
+      cycles += intr_cycles[cpu][i];
+    }
+    if (!total && intr_mappings[i] < 0)
+      continue;
+    if (intr_mappings[i] < 0)
+      iprintf(&buf, &size, "0x%.2x   %4s %4s", i, "-", "-");
+    else
+      iprintf(&buf, &size, "0x%.2x   %4d %4d", i, intr_mappings[i],
+              apic_getaffinity(intr_mappings[i]));
+    for (cpu = 0; cpu < percpu_ncpus; cpu++)
+      iprintf(&buf, &size, " %10u", intr_counts[cpu][i]);
+    iprintf(&buf, &size, " %14llu\n", cycles);
+  }
+  return size;
+}
+
 static __attribute__((used)) void __intr_handler(regs_t regs) {
   intr_handler_t handler = intr_handlers[regs.r_intr];
+  uint32_t cpu = percpu_read(pc_cpu);
+  uint32_t nswitches = percpu_read(pc_nswitches);
+  uint64_t start = time_cycles();
+  /* Here is where userland time ends and starts again */
+  int from_user = (regs.r_cs & 0x3) == 0x3;
+  if (from_user)
+    sched_charge(1);
   _intr_regs = &regs;
   if (NULL != handler) {
     handler(&regs);
@@ -374,7 +518,24 @@ static __attribute__((used)) void __intr_handler(regs_t regs) {
     apic_eoi();
   }
 
+  /* A handler which switched away, the timer preempting userland or a
+   * fault or system call which blocked, is counted but not timed */
+  intr_counts[cpu][regs.r_intr]++;
+  if (percpu_read(pc_nswitches) == nswitches)
+    intr_cycles[cpu][regs.r_intr] += time_cycles() - start;
+
   _intr_regs = NULL;
+  /* Deferred work from this interrupt or an earlier one, unless we
+   * interrupted code which holds off interrupts. A system call gets here
+   * with interrupts on, but the way back out turns them on again in any
+   * case. */
+  if ((regs.r_eflags & 0x200) && IPL_LOW == intr_getipl()) {
+    intr_disable();
+    if (tasklet_pending())
+      tasklet_run();
+  }
+  if (from_user)
+    sched_charge(0);
 }
 
 static void __intr_divide_by_zero_handler(regs_t *regs) {
@@ -397,6 +558,35 @@ static void __intr_spurious(regs_t *regs) {
   dbg(DBG_CORE, ("ignoring spurious interrupt\n"));
 }
 
+static int intr_sysenter = 0;
+
+/*
+ * Points the SYSENTER MSRs at __intr_sysenter if the processor has them.
+ * The early Pentium Pros claim SEP without having it. SYSENTER_ESP is the
+ * TSS's kernel stack slot rather than the stack itself, so switching
+ * threads never has to write an MSR.
+ */
+static void intr_sysenter_init(void) {
+  uint32_t eax, edx;
+  uint32_t family, model, stepping;
+
+  cpuid(CPUID_GETFEATURES, &eax, &edx);
+  family = (eax >> 8) & 0xf;
+  model = (eax >> 4) & 0xf;
+  stepping = eax & 0xf;
+  if (!(edx & CPUID_FEAT_EDX_SEP) ||
+      (6 == family && model < 3 && stepping < 3)) {
+    dbg(DBG_CORE, "no SYSENTER, system calls trap\n");
+    return;
+  }
+  cpuid_set_msr(MSR_SYSENTER_CS, GDT_KERNEL_TEXT, 0);
+  cpuid_set_msr(MSR_SYSENTER_ESP, (uint32_t)gdt_kernel_stack_slot(), 0);
+  cpuid_set_msr(MSR_SYSENTER_EIP, (uint32_t)&__intr_sysenter, 0);
+  intr_sysenter = 1;
+}
+
+int intr_sysenter_enabled(void) { return intr_sysenter; }
+
 static void __intr_set_entry(uint8_t isr, uint32_t addr, int seg, int flags) {
   intr_table[isr].baselo = (uint16_t)((addr)&0xffff);
   intr_table[isr].basehi = (uint16_t)(((addr) >> 16) & 0xffff);
@@ -942,4 +1132,6 @@ void intr_init() {
   intr_register(INTR_DIVIDE_BY_ZERO, __intr_divide_by_zero_handler);
   intr_register(INTR_GPF, __intr_gpf_handler);
   intr_register(INTR_INVALID_OPCODE, __intr_inval_opcode_handler);
+
+  intr_sysenter_init();
 }
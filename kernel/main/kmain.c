@@ -9,6 +9,7 @@
 #include "util/printf.h"
 
 #include "mm/mm.h"
+#include "mm/mman.h"
 #include "mm/page.h"
 #include "mm/pagetable.h"
 #include "mm/pframe.h"
@@ -20,16 +21,21 @@
 
 #include "main/acpi.h"
 #include "main/apic.h"
+#include "main/numa.h"
 #include "main/interrupt.h"
 #include "main/gdt.h"
 
 #include "proc/sched.h"
 #include "proc/proc.h"
 #include "proc/kthread.h"
+#include "proc/workqueue.h"
 
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
 #include "drivers/disk/ata.h"
+#include "drivers/disk/ramdisk.h"
+#include "drivers/tty/pty.h"
+#include "drivers/tty/serial.h"
 #include "drivers/tty/virtterm.h"
 #include "drivers/pci.h"
 
@@ -39,8 +45,11 @@
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "fs/vfs_syscall.h"
+#include "fs/aio.h"
 #include "fs/fcntl.h"
+#include "fs/initramfs.h"
 #include "fs/stat.h"
+#include "fs/s5fs/s5fs.h"
 
 #include "test/kshell/kshell.h"
 
@@ -81,10 +90,12 @@ void kmain() {
 
   pt_init();
   slab_init();
+  vmalloc_init();
   pframe_init();
 
   acpi_init();
   apic_init();
+  numa_init();
   pci_init();
   intr_init();
 
@@ -172,15 +183,61 @@ static void *idleproc_run(int arg1, void *arg2) {
   vref(vfs_root_vn); // Want to start with three references
   vref(vfs_root_vn); 
 
-/* Here you need to make the null, zero, and tty devices using mknod */
-/* You can't do this until you have VFS, check the include/drivers/dev.h
- * file for macros with the device ID's you will need to pass to mknod */
+/* The device nodes live in devfs, which the drivers have filled in by
+ * now, so only the mount point is ever written to the root file system */
   do_mkdir("/dev");
+#ifdef __MOUNTING__
+  int devret = do_mount(NULL, "/dev", "devfs");
+  if (0 > devret)
+    panic("could not mount devfs on /dev: %d\n", devret);
+#else
   do_mknod("/dev/null", S_IFCHR, MKDEVID(1,0));
   do_mknod("/dev/zero", S_IFCHR, MKDEVID(1,1));
   do_mknod("/dev/tty0", S_IFCHR, MKDEVID(2,0));
   do_mknod("/dev/tty1", S_IFCHR, MKDEVID(2,1));
+  /* Serial terminals come after the virtual ones */
+  for (int i = 0; i < serial_num_terminals(); ++i) {
+    char tty_path[16];
+    int id = vt_num_terminals() + i;
+    snprintf(tty_path, sizeof(tty_path), "/dev/tty%d", id);
+    do_mknod(tty_path, S_IFCHR, MKDEVID(2, id));
+  }
+  for (int i = 0; i < NPTYS; ++i) {
+    char pty_path[16];
+    snprintf(pty_path, sizeof(pty_path), "/dev/pty%d", i);
+    do_mknod(pty_path, S_IFCHR, MKDEVID(PTY_MASTER_MAJOR, i));
+    snprintf(pty_path, sizeof(pty_path), "/dev/pts%d", i);
+    do_mknod(pty_path, S_IFCHR, MKDEVID(PTY_SLAVE_MAJOR, i));
+  }
   do_mknod("/dev/sda", S_IFBLK, MKDEVID(1,0));
+#endif /* __MOUNTING__ */
+#if defined(__MOUNTING__) && defined(__S5FS__)
+  /* A fresh file system on the ramdisk, for scratch files and for timing
+   * the file system without a disk under it */
+  blockdev_t *ramdisk = ramdisk_get();
+  if (ramdisk) {
+    char ramdev[16];
+    snprintf(ramdev, sizeof(ramdev), "disk%d", MINOR(ramdisk->bd_id));
+    do_mkdir("/ram");
+    int ramret = s5fs_format(ramdisk, RAMDISK_INODES);
+    if (!ramret)
+      ramret = do_mount(ramdev, "/ram", "s5fs");
+    if (0 > ramret)
+      dbg(DBG_PRINT, "could not mount the ramdisk on /ram: %d\n", ramret);
+  }
+#endif
+#ifdef __MOUNTING__
+  /* Shared memory objects, see shm_open(3) */
+  do_mkdir(SHM_DIR);
+  int shmret = do_mount(NULL, SHM_DIR, "tmpfs");
+  if (0 > shmret)
+    dbg(DBG_PRINT, "could not mount a tmpfs on " SHM_DIR ": %d\n", shmret);
+#endif
+#ifdef __INITRAMFS__
+  int rdret = initramfs_unpack();
+  if (0 > rdret)
+    panic("could not unpack the initramfs: %d\n", rdret);
+#endif
 #endif
 
   /* Finally, enable interrupts (we want to make sure interrupts
@@ -204,6 +261,8 @@ static void *idleproc_run(int arg1, void *arg2) {
   shadowd_shutdown();
 #endif
 
+  workqueue_shutdown();
+
 #ifdef __VFS__
   /* Shutdown the vfs: */
   dbg_print("weenix: vfs shutdown...\n");
@@ -218,6 +277,10 @@ static void *idleproc_run(int arg1, void *arg2) {
   pframe_shutdown();
 #endif
 
+#ifdef __DRIVERS__
+  blockdev_shutdown();
+#endif
+
   dbg_print("\nweenix: halted cleanly!\n");
   GDB_CALL_HOOK(shutdown);
   hard_shutdown();
@@ -271,6 +334,18 @@ void *calc_fib(int arg1, void *arg2) {
  * @param arg1 the first argument (unused)
  * @param arg2 the second argument (unused)
  */
+static void *kshell_run(int ttyid, void *arg2) {
+  int err = 0;
+  kshell_t *ksh = kshell_create(ttyid);
+  KASSERT(ksh && "kshell_create failed");
+
+  while ((err = kshell_execute_next(ksh)) > 0);
+  KASSERT(!err && "kshell exited with error");
+  kshell_destroy(ksh);
+
+  return NULL;
+}
+
 static void *initproc_run(int arg1, void *arg2) {
   dbg(DBG_INIT, "init running\n");
 
@@ -278,14 +353,19 @@ static void *initproc_run(int arg1, void *arg2) {
   kshell_add_command("drivers", &test_drivers, "test drivers");
   kshell_add_command("vfs", &test_vfs, "test vfs");
 
-  int err = 0;
-  kshell_t *ksh = kshell_create(0);
-  KASSERT(ksh && "kshell_create failed");
+  /* A kshell on the serial terminal too, for running without a screen */
+  pid_t serial_pid = -1;
+  if (serial_num_terminals() > 0) {
+    proc_t *p = proc_create("kshell");
+    KASSERT(p && "proc_create failed");
+    serial_pid = p->p_pid;
+    sched_make_runnable(kthread_create(p, kshell_run, vt_num_terminals(), NULL));
+  }
 
-  while ((err = kshell_execute_next(ksh)) > 0);
-  KASSERT(!err && "kshell exited with error");
-  kshell_destroy(ksh);
+  kshell_run(0, NULL);
 
+  if (serial_pid >= 0)
+    do_waitpid(serial_pid, 0, NULL);
   return NULL;
 }
 
@@ -387,8 +467,9 @@ int test_drivers(kshell_t *ks, int argc, char **argv) {
   return 0;
 }
 
+/* "vfs -t <runs> [-s|-c <file>]" times the tests (see vfstest.c) */
 int test_vfs(kshell_t *ks, int argc, char **argv) {
-  vfstest_main(1, NULL);
+  vfstest_main(argc, argv);
   return 0;
 }
 
@@ -400,5 +481,6 @@ static void hard_shutdown() {
 #ifdef __DRIVERS__
   vt_print_shutdown();
 #endif
+  dbg_flush();
   __asm__ volatile("cli; hlt");
 }
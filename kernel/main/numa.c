@@ -0,0 +1,140 @@
+/*
+ *  FILE: numa.c
+ *  DESC: the machine's NUMA topology, from the ACPI SRAT.
+ *
+ * The System Resource Affinity Table gives a proximity domain for each
+ * processor's local APIC and for each range of physical memory. Domains
+ * are numbered densely here, in the order they first appear, as nodes.
+ * Without the table everything is on node 0.
+ */
+
+#include "types.h"
+#include "kernel.h"
+
+#include "main/acpi.h"
+#include "main/apic.h"
+#include "main/numa.h"
+
+#include "mm/page.h"
+
+#include "util/debug.h"
+
+#define SRAT_SIGNATURE (*(uint32_t *)"SRAT")
+
+#define SRAT_TYPE_LAPIC 0
+#define SRAT_TYPE_MEMORY 1
+
+#define SRAT_ENABLED 0x1
+
+struct srat_table {
+  struct acpi_header st_header;
+  uint32_t st_reserved1;
+  uint8_t st_reserved2[8];
+} __attribute__((packed));
+
+struct srat_lapic {
+  uint8_t sl_type;
+  uint8_t sl_size;
+  uint8_t sl_domain_lo;
+  uint8_t sl_apicid;
+  uint32_t sl_flags;
+  uint8_t sl_sapic_eid;
+  uint8_t sl_domain_hi[3];
+  uint32_t sl_clock_domain;
+} __attribute__((packed));
+
+struct srat_memory {
+  uint8_t sm_type;
+  uint8_t sm_size;
+  uint32_t sm_domain;
+  uint16_t sm_reserved1;
+  uint32_t sm_base_lo;
+  uint32_t sm_base_hi;
+  uint32_t sm_len_lo;
+  uint32_t sm_len_hi;
+  uint32_t sm_reserved2;
+  uint32_t sm_flags;
+  uint8_t sm_reserved3[8];
+} __attribute__((packed));
+
+static uint32_t numa_domains[NUMA_MAX_NODES]; /* node n's proximity domain */
+static int numa_nnodes = 1;
+
+/* The node of each local APIC id, a node number plus one, 0 if unknown */
+static uint8_t numa_apic_node[256];
+
+/* Returns the node for a proximity domain, giving it one if it is new */
+static int numa_node_of_domain(uint32_t domain) {
+  int n;
+  for (n = 0; n < numa_nnodes; ++n) {
+    if (numa_domains[n] == domain)
+      return n;
+  }
+  if (numa_nnodes == NUMA_MAX_NODES) {
+    dbgq(DBG_CORE, "   too many nodes, domain %u put on node 0\n", domain);
+    return 0;
+  }
+  numa_domains[numa_nnodes] = domain;
+  return numa_nnodes++;
+}
+
+void numa_init() {
+  struct srat_table *srat = acpi_table(SRAT_SIGNATURE, 0);
+  uint8_t *ptr = (uint8_t *)srat;
+  int seen = 0;
+  int node;
+
+  dbgq(DBG_CORE, "--- NUMA INIT ---\n");
+  if (NULL == srat) {
+    dbgq(DBG_CORE, "no SRAT, 1 node\n");
+    return;
+  }
+
+  /* Node 0 goes to the first domain listed, not to domain 0 */
+  numa_nnodes = 0;
+  uint32_t off = sizeof(*srat);
+  while (off < srat->st_header.ah_size) {
+    uint8_t type = *(ptr + off);
+    uint8_t size = *(ptr + off + 1);
+    if (0 == size)
+      break;
+    if (SRAT_TYPE_LAPIC == type && sizeof(struct srat_lapic) == size) {
+      struct srat_lapic *sl = (struct srat_lapic *)(ptr + off);
+      if (sl->sl_flags & SRAT_ENABLED) {
+        uint32_t domain = sl->sl_domain_lo | (sl->sl_domain_hi[0] << 8) |
+                          (sl->sl_domain_hi[1] << 16) |
+                          (sl->sl_domain_hi[2] << 24);
+        node = numa_node_of_domain(domain);
+        numa_apic_node[sl->sl_apicid] = node + 1;
+        seen = 1;
+        dbgq(DBG_CORE, "   apic 0x%.2x on node %d\n", (uint32_t)sl->sl_apicid,
+             node);
+      }
+    } else if (SRAT_TYPE_MEMORY == type && sizeof(struct srat_memory) == size) {
+      struct srat_memory *sm = (struct srat_memory *)(ptr + off);
+      /* Weenix only has memory below 4G */
+      if ((sm->sm_flags & SRAT_ENABLED) && 0 == sm->sm_base_hi) {
+        uint32_t end = sm->sm_base_lo + sm->sm_len_lo;
+        if (sm->sm_len_hi || end < sm->sm_base_lo)
+          end = 0xffffffff;
+        node = numa_node_of_domain(sm->sm_domain);
+        seen = 1;
+        dbgq(DBG_CORE, "   memory 0x%.8x-0x%.8x on node %d\n",
+             sm->sm_base_lo, end, node);
+        page_set_node(sm->sm_base_lo, end, node);
+      }
+    }
+    off += size;
+  }
+  if (!seen)
+    numa_nnodes = 1;
+  page_set_local_node(numa_cpu_node(apic_cpu_apicid(0)));
+  dbgq(DBG_CORE, "%d node(s), booted on node %d\n", numa_nnodes,
+       numa_cpu_node(apic_cpu_apicid(0)));
+}
+
+int numa_node_count() { return numa_nnodes; }
+
+int numa_cpu_node(uint8_t apicid) {
+  return numa_apic_node[apicid] ? numa_apic_node[apicid] - 1 : 0;
+}
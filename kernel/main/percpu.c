@@ -0,0 +1,25 @@
+#include "main/gdt.h"
+#include "main/percpu.h"
+
+#include "mm/page.h"
+
+#include "util/debug.h"
+
+percpu_t percpu_areas[PERCPU_MAX];
+uint32_t percpu_ncpus = 0;
+
+void percpu_init(uint32_t cpu) {
+  percpu_t *pc = &percpu_areas[cpu];
+
+  KASSERT(cpu < PERCPU_MAX);
+  /* the limit is in pages, so the segment covers one */
+  KASSERT(sizeof(percpu_t) <= PAGE_SIZE);
+  pc->pc_self = pc;
+  pc->pc_cpu = cpu;
+  pc->pc_tasklets = NULL;
+  pc->pc_tasklet_tail = &pc->pc_tasklets;
+  gdt_set_entry(GDT_KERNEL_PERCPU, (uint32_t)pc, 0, 0, 0, 0, 1);
+  __asm__ volatile("movw %w0, %%fs" ::"r"(GDT_KERNEL_PERCPU));
+  if (cpu >= percpu_ncpus)
+    percpu_ncpus = cpu + 1;
+}
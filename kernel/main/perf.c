@@ -0,0 +1,135 @@
+/*
+ *  FILE: perf.c
+ *  DESC: the processor's performance counters, virtualized per thread.
+ *
+ * Intel's architectural performance monitoring, CPUID leaf 0xA, gives
+ * some number of general purpose counters, each counting the event its
+ * IA32_PERFEVTSELn selects. Counter n here is programmed into general
+ * purpose counter n, in userland and the kernel alike, and is left
+ * running; the scheduler reads them all each time a thread stops running
+ * and adds what they counted to the thread's kt_perf. A counter the
+ * processor lacks, or one whose event it says it cannot count, is left
+ * out of perf_valid and reads as 0.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "types.h"
+
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+#include "main/perf.h"
+
+#include "proc/kthread.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+#define IA32_PMC0 0xc1
+#define IA32_PERFEVTSEL0 0x186
+#define IA32_PERF_GLOBAL_CTRL 0x38f
+
+#define PERFEVTSEL_USR (1 << 16)
+#define PERFEVTSEL_OS (1 << 17)
+#define PERFEVTSEL_EN (1 << 22)
+
+#define CPUID_PERFMON 0xa
+
+/* Each counter's event select and unit mask, and the bit in leaf 0xA's
+ * ebx which is set if the event is not available */
+static const struct {
+  uint8_t event;
+  uint8_t umask;
+  int8_t unavail; /* -1 for a model specific event */
+} perf_events[PERF_NCOUNTERS] = {
+        [PERF_CYCLES] = {0x3c, 0x00, 0},
+        [PERF_INSTRUCTIONS] = {0xc0, 0x00, 1},
+        [PERF_LLC_MISSES] = {0x2e, 0x41, 4},
+        /* DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK, on family 6 since Nehalem */
+        [PERF_DTLB_MISSES] = {0x08, 0x01, -1}};
+
+static uint32_t perf_valid = 0;  /* bit n set if counter n counts */
+static uint64_t perf_width_mask; /* the bits a counter has */
+static uint64_t perf_stamp[PERF_NCOUNTERS]; /* as of the last perf_charge */
+
+static inline uint64_t perf_rdpmc(uint32_t n) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(n));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+/* unavail is leaf 0xA's ebx */
+static int perf_can_count(int n, uint32_t unavail, uint32_t family) {
+  if (0 > perf_events[n].unavail)
+    return 6 == family;
+  return !(unavail & (1U << perf_events[n].unavail));
+}
+
+void perf_init(void) {
+  uint32_t a, b, c, d, version, ngp, family;
+  int n;
+
+  cpuid_regs(CPUID_GETVENDORSTRING, &a, &b, &c, &d);
+  if (a < CPUID_PERFMON || memcmp(&b, "Genu", 4) || memcmp(&d, "ineI", 4) ||
+      memcmp(&c, "ntel", 4)) {
+    dbg(DBG_CORE, "no architectural performance counters\n");
+    return;
+  }
+  cpuid_regs(CPUID_GETFEATURES, &a, &b, &c, &d);
+  family = (a >> 8) & 0xf;
+  cpuid_regs(CPUID_PERFMON, &a, &b, &c, &d);
+  version = a & 0xff;
+  ngp = (a >> 8) & 0xff;
+  if (0 == version || 0 == ngp) {
+    dbg(DBG_CORE, "no architectural performance counters\n");
+    return;
+  }
+  perf_width_mask = (1ULL << ((a >> 16) & 0xff)) - 1;
+
+  for (n = 0; n < PERF_NCOUNTERS && n < (int)ngp; n++) {
+    if (!perf_can_count(n, b, family))
+      continue;
+    cpuid_set_msr(IA32_PERFEVTSEL0 + n, 0, 0);
+    cpuid_set_msr(IA32_PMC0 + n, 0, 0);
+    cpuid_set_msr(IA32_PERFEVTSEL0 + n,
+                  perf_events[n].event | (perf_events[n].umask << 8) |
+                      PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN,
+                  0);
+    perf_valid |= 1U << n;
+  }
+  /* From version 2 on, a counter also has to be enabled globally */
+  if (2 <= version)
+    cpuid_set_msr(IA32_PERF_GLOBAL_CTRL, perf_valid, 0);
+  dbg(DBG_CORE, "performance monitoring version %u, counters 0x%x\n", version,
+      perf_valid);
+}
+init_func(perf_init);
+
+void perf_charge(kthread_t *thr) {
+  uint64_t now;
+  int n;
+
+  for (n = 0; n < PERF_NCOUNTERS; n++) {
+    if (!(perf_valid & (1U << n)))
+      continue;
+    now = perf_rdpmc(n);
+    if (NULL != thr)
+      thr->kt_perf[n] += (now - perf_stamp[n]) & perf_width_mask;
+    perf_stamp[n] = now;
+  }
+}
+
+int do_perf_read(perf_counts_t *pc) {
+  uint32_t flags;
+
+  if (0 == perf_valid)
+    return -ENODEV;
+  flags = intr_save();
+  perf_charge(curthr);
+  intr_restore(flags);
+  pc->pc_valid = perf_valid;
+  pc->pc_pad = 0;
+  memcpy(pc->pc_count, curthr->kt_perf, sizeof(pc->pc_count));
+  return 0;
+}
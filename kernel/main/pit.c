@@ -1,31 +1,31 @@
-#include "globals.h"
-
 #include "main/io.h"
-#include "main/interrupt.h"
-#include "util/delay.h"
-#include "main/apic.h"
-
-#include "proc/sched.h"
-#include "proc/kthread.h"
-
-#define APIC_TIMER_IRQ 32 /* Map interrupt 32 */
-
-/* IRQ */
-/*#define PIT_IRQ 0*/
+#include "main/pit.h"
 
 /* I/O ports */
-/*#define PIT_DATA0 0x40
-#define PIT_DATA1 0x41
 #define PIT_DATA2 0x42
-#define PIT_CMD   0x43
-
-#define CLOCK_TICK_RATE 1193182
-#undef HZ
-#define HZ 1000
-
-#define LATCH (CLOCK_TICK_RATE / HZ)*/
-static unsigned int ms = 0;
-
-void pit_handler(regs_t *regs) {}
-
-void pit_init(uint8_t intr) {}
+#define PIT_CMD 0x43
+#define PIT_GATE 0x61 /* bit 0 gates channel 2, bit 5 is its output */
+
+/* Channel 2, low then high byte, mode 1 (one-shot started by the gate) */
+#define PIT_CMD_ONESHOT2 0xb2
+
+void pit_oneshot_start(uint16_t count) {
+  uint8_t gate;
+
+  /* Gate on and the speaker, bit 1, off */
+  outb(PIT_GATE, (inb(PIT_GATE) & 0xfd) | 1);
+  outb(PIT_CMD, PIT_CMD_ONESHOT2);
+  outb(PIT_DATA2, count & 0xff);
+  inb(0x60); /* a short delay between the two bytes */
+  outb(PIT_DATA2, count >> 8);
+
+  /* The count starts on a rising edge of the gate */
+  gate = inb(PIT_GATE) & 0xfe;
+  outb(PIT_GATE, gate);
+  outb(PIT_GATE, gate | 1);
+}
+
+void pit_oneshot_wait(void) {
+  while (!(inb(PIT_GATE) & 0x20))
+    ;
+}
@@ -0,0 +1,97 @@
+#include "time.h"
+#include "types.h"
+
+#include "main/io.h"
+#include "main/rtc.h"
+
+#include "util/string.h"
+
+/* I/O ports of the CMOS memory the clock keeps its registers in */
+#define CMOS_ADDR 0x70
+#define CMOS_DATA 0x71
+
+#define RTC_SECONDS 0x00
+#define RTC_MINUTES 0x02
+#define RTC_HOURS 0x04
+#define RTC_DAY 0x07
+#define RTC_MONTH 0x08
+#define RTC_YEAR 0x09
+#define RTC_STATUS_A 0x0a
+#define RTC_STATUS_B 0x0b
+
+#define RTC_A_UPDATING 0x80 /* the registers are about to change */
+#define RTC_B_24HOUR 0x02
+#define RTC_B_BINARY 0x04   /* otherwise BCD */
+#define RTC_HOURS_PM 0x80   /* in 12 hour mode */
+
+typedef struct rtc_time {
+  uint8_t rt_sec, rt_min, rt_hour, rt_day, rt_mon, rt_year;
+} rtc_time_t;
+
+static uint8_t cmos_read(uint8_t reg) {
+  outb(CMOS_ADDR, reg);
+  return inb(CMOS_DATA);
+}
+
+static void rtc_read_raw(rtc_time_t *rt) {
+  while (cmos_read(RTC_STATUS_A) & RTC_A_UPDATING)
+    ;
+  rt->rt_sec = cmos_read(RTC_SECONDS);
+  rt->rt_min = cmos_read(RTC_MINUTES);
+  rt->rt_hour = cmos_read(RTC_HOURS);
+  rt->rt_day = cmos_read(RTC_DAY);
+  rt->rt_mon = cmos_read(RTC_MONTH);
+  rt->rt_year = cmos_read(RTC_YEAR);
+}
+
+static uint8_t bcd(uint8_t v) { return (v & 0x0f) + (v >> 4) * 10; }
+
+/* Days from 1970-01-01 to the given date, in the proleptic Gregorian
+ * calendar */
+static int32_t days_from_civil(int32_t y, uint32_t m, uint32_t d) {
+  uint32_t era, yoe, doy, doe;
+
+  y -= m <= 2;
+  era = y / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+time_t rtc_read(void) {
+  rtc_time_t rt, again;
+  uint8_t status, pm;
+  uint32_t hour;
+  int32_t year;
+
+  /* The registers can still change between reads, so read until two
+   * agree */
+  rtc_read_raw(&rt);
+  while (1) {
+    rtc_read_raw(&again);
+    if (!memcmp(&rt, &again, sizeof(rt)))
+      break;
+    rt = again;
+  }
+
+  status = cmos_read(RTC_STATUS_B);
+  pm = rt.rt_hour & RTC_HOURS_PM;
+  rt.rt_hour &= ~RTC_HOURS_PM;
+  if (!(status & RTC_B_BINARY)) {
+    rt.rt_sec = bcd(rt.rt_sec);
+    rt.rt_min = bcd(rt.rt_min);
+    rt.rt_hour = bcd(rt.rt_hour);
+    rt.rt_day = bcd(rt.rt_day);
+    rt.rt_mon = bcd(rt.rt_mon);
+    rt.rt_year = bcd(rt.rt_year);
+  }
+  hour = rt.rt_hour;
+  if (!(status & RTC_B_24HOUR))
+    hour = hour % 12 + (pm ? 12 : 0);
+  /* Two digits, which we take to be this century */
+  year = 2000 + rt.rt_year;
+
+  return (time_t)(days_from_civil(year, rt.rt_mon, rt.rt_day) * 86400 +
+                  hour * 3600 + rt.rt_min * 60 + rt.rt_sec);
+}
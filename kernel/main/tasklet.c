@@ -0,0 +1,56 @@
+#include "kernel.h"
+
+#include "main/interrupt.h"
+#include "main/percpu.h"
+#include "main/tasklet.h"
+
+#include "util/debug.h"
+
+void tasklet_init(tasklet_t *t, void (*func)(void *arg), void *arg,
+                  uint8_t ipl) {
+  t->t_next = NULL;
+  t->t_pending = 0;
+  t->t_ipl = ipl;
+  t->t_func = func;
+  t->t_arg = arg;
+}
+
+void tasklet_schedule(tasklet_t *t) {
+  percpu_t *pc = this_cpu();
+
+  if (t->t_pending)
+    return;
+  t->t_pending = 1;
+  t->t_next = NULL;
+  *pc->pc_tasklet_tail = t;
+  pc->pc_tasklet_tail = &t->t_next;
+}
+
+int tasklet_pending(void) { return NULL != this_cpu()->pc_tasklets; }
+
+int tasklet_run(void) {
+  percpu_t *pc = this_cpu();
+  tasklet_t *t;
+  int n = 0;
+
+  KASSERT(IPL_LOW == intr_getipl());
+  /* An interrupt which arrives while a tasklet runs leaves its own for
+   * this loop */
+  if (pc->pc_tasklet_running)
+    return 0;
+  pc->pc_tasklet_running = 1;
+  while (NULL != (t = pc->pc_tasklets)) {
+    if (NULL == (pc->pc_tasklets = t->t_next))
+      pc->pc_tasklet_tail = &pc->pc_tasklets;
+    t->t_pending = 0;
+    intr_setipl(t->t_ipl);
+    intr_enable();
+    t->t_func(t->t_arg);
+    intr_disable();
+    n++;
+  }
+  intr_setipl(IPL_LOW);
+  pc->pc_tasklet_running = 0;
+  pc->pc_ntasklets += n;
+  return n;
+}
@@ -1,8 +1,11 @@
 #include "types.h"
 #include "kernel.h"
+#include "config.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
 #include "mm/slab.h"
 
 #include "util/gdb.h"
@@ -21,11 +24,23 @@ GDB_DEFINE_HOOK(page_free, void *addr, int npages)
 static list_t pagegroup_list;
 static uintptr_t page_freecount;
 
+/* The NUMA node of the processor we run on; groups on it are used first */
+static int page_local_node = 0;
+
+/* Free pages which have already been zeroed, by page_zero_idle. These
+ * count as free, and are given back to the buddy lists if we run out. */
+static list_t page_zeroed_list;
+static uint32_t page_nzeroed;
+
 struct pagegroup {
   list_t pg_freelist[PAGE_NSIZES];
   void *pg_map[PAGE_NSIZES];
+  uint8_t *pg_freeorder; /* per-page, see _freelist_insert */
+  void **pg_owner; /* per-page owner, see page_set_owner */
+  pframe_t *pg_frames; /* per-page frame descriptor, see page_pframe */
   uintptr_t pg_baseaddr;
   uintptr_t pg_endaddr;
+  int pg_node; /* NUMA node of the memory, see page_set_node */
   list_link_t pg_link;
 };
 
@@ -33,6 +48,24 @@ struct freepage {
   list_link_t fp_link;
 };
 
+/*
+ * Blocks go on and off the free lists through these, which also keep
+ * pg_freeorder: the order plus one for the first page of each free
+ * block, and 0 for every other page. That is how compaction tells which
+ * pages are free without searching the lists.
+ */
+static void _freelist_insert(struct pagegroup *group, int order,
+                             uintptr_t addr) {
+  list_insert_head(&group->pg_freelist[order],
+                   &((struct freepage *)addr)->fp_link);
+  group->pg_freeorder[ADDR_TO_PN(addr - group->pg_baseaddr)] = order + 1;
+}
+
+static void _freelist_remove(struct pagegroup *group, uintptr_t addr) {
+  list_remove(&((struct freepage *)addr)->fp_link);
+  group->pg_freeorder[ADDR_TO_PN(addr - group->pg_baseaddr)] = 0;
+}
+
 static struct pagegroup *_pagegroup_create(uintptr_t start, uintptr_t end) {
   KASSERT(PAGE_NSIZES > 0);
   KASSERT(sizeof(struct pagegroup) <= PAGE_SIZE);
@@ -44,6 +77,7 @@ static struct pagegroup *_pagegroup_create(uintptr_t start, uintptr_t end) {
   group = (struct pagegroup *)end;
 
   group->pg_baseaddr = start;
+  group->pg_node = 0;
   group->pg_map[0] = NULL;
 
   /* allocate some of the space for the buddy bit maps,
@@ -60,6 +94,21 @@ static struct pagegroup *_pagegroup_create(uintptr_t start, uintptr_t end) {
     memset(group->pg_map[order], 0, count);
   }
 
+  /* and one free list order per page */
+  end -= npages;
+  group->pg_freeorder = (uint8_t *)end;
+  memset(group->pg_freeorder, 0, npages);
+
+  /* and one owner pointer per page */
+  end = (end - npages * sizeof(void *)) & ~(sizeof(void *) - 1);
+  group->pg_owner = (void **)end;
+  memset(group->pg_owner, 0, npages * sizeof(void *));
+
+  /* and one frame descriptor per page */
+  end = (end - npages * sizeof(pframe_t)) & ~(sizeof(void *) - 1);
+  group->pg_frames = (pframe_t *)end;
+  memset(group->pg_frames, 0, npages * sizeof(pframe_t));
+
   /* discard the remainder of the page being used for
    * mappings and read just npages */
   end = (uintptr_t)PAGE_ALIGN_DOWN(end);
@@ -72,8 +121,7 @@ static struct pagegroup *_pagegroup_create(uintptr_t start, uintptr_t end) {
     list_init(&group->pg_freelist[order]);
     if (npages & (1 << order)) {
       end -= (1 << order) << PAGE_SHIFT;
-      list_insert_head(&group->pg_freelist[order],
-                       &((struct freepage *)end)->fp_link);
+      _freelist_insert(group, order, end);
     }
   }
 
@@ -82,8 +130,7 @@ static struct pagegroup *_pagegroup_create(uintptr_t start, uintptr_t end) {
   list_init(&group->pg_freelist[order]);
   uintptr_t current = start;
   while (current < end) {
-    list_insert_head(&group->pg_freelist[order],
-                     &((struct freepage *)current)->fp_link);
+    _freelist_insert(group, order, current);
     current += (1 << order) << PAGE_SHIFT;
   }
 
@@ -103,6 +150,8 @@ static struct pagegroup *_pagegroup_from_address(uintptr_t addr) {
 void page_init() {
   list_init(&pagegroup_list);
   page_freecount = 0;
+  list_init(&page_zeroed_list);
+  page_nzeroed = 0;
 }
 
 void page_add_range(uintptr_t start, uintptr_t end) {
@@ -119,6 +168,22 @@ void page_add_range(uintptr_t start, uintptr_t end) {
   }
 }
 
+void page_set_node(uintptr_t pstart, uintptr_t pend, int node) {
+  struct pagegroup *group;
+  list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+    uintptr_t pbase = pt_virt_to_phys(group->pg_baseaddr);
+    if (pbase >= pstart && pbase < pend) {
+      group->pg_node = node;
+      if (pbase + (group->pg_endaddr - group->pg_baseaddr) > pend)
+        dbg(DBG_MM, "page group at 0x%08x runs past the end of node %d\n",
+            pbase, node);
+    }
+  }
+  list_iterate_end();
+}
+
+void page_set_local_node(int node) { page_local_node = node; }
+
 /**
  * Calculates the address's index in to the buddy bitmap for the
  * specified order. The address must be within the range of addresses
@@ -152,7 +217,7 @@ static void __page_split(struct pagegroup *group, uint32_t order) {
 
   uintptr_t target = (uintptr_t)list_head(&group->pg_freelist[order],
                                           struct freepage, fp_link);
-  list_remove_head(&group->pg_freelist[order]);
+  _freelist_remove(group, target);
 
   /* splitting the page requires marking it as allocated */
   if (likely(order < PAGE_NSIZES - 1)) {
@@ -164,22 +229,173 @@ static void __page_split(struct pagegroup *group, uint32_t order) {
                      _pagegroup_calculate_index(group, order, target)));
 
   uintptr_t buddy = (target + ((1 << (order - 1)) << PAGE_SHIFT));
-  list_insert_head(&group->pg_freelist[order - 1],
-                   &((struct freepage *)target)->fp_link);
-  list_insert_head(&group->pg_freelist[order - 1],
-                   &((struct freepage *)buddy)->fp_link);
+  _freelist_insert(group, order - 1, target);
+  _freelist_insert(group, order - 1, buddy);
   dbg(DBG_PAGEALLOC, "split 0x%.8x (%u) into 0x%.8x and 0x%.8x\n", target,
       order, target, buddy);
 }
 
+static void _page_free_order(void *addr, int order);
+
+/**
+ * Gives every page in the zeroed pool back to the buddy lists.
+ *
+ * @return the number of pages released
+ */
+static uint32_t _page_zeroed_drain(void) {
+  uint32_t n = page_nzeroed;
+  while (!list_empty(&page_zeroed_list)) {
+    void *addr = list_head(&page_zeroed_list, struct freepage, fp_link);
+    list_remove_head(&page_zeroed_list);
+    --page_nzeroed;
+    _page_free_order(addr, 0);
+  }
+  return n;
+}
+
 /**
- * Finds a block of pages strictly bigger than a block of the given order and
- * splits it into blocks of the given order. Used, for example, when the user
+ * Finds the smallest free block of at least the given order in a group on
+ * the local NUMA node (or, if local is 0, on any other node) and splits it
+ * into blocks of the given order. Used, for example, when the user
  * requests a 4k block and there are no free 4k blocks, but there is an 8k or
  * 16k block.
  *
  * @param order the order of the block to split into.
- * @return the group where the split took place on success, NULL otherwise
+ * @param local whether to look at the local node's groups or the others
+ * @return the group holding a free block of the given order, NULL if none
+ */
+static struct pagegroup *_page_find(int order, int local) {
+  int norder;
+
+  for (norder = order; norder < PAGE_NSIZES; norder++) {
+    struct pagegroup *group;
+    list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+      if ((page_local_node == group->pg_node) == local &&
+          !list_empty(&group->pg_freelist[norder])) {
+        while (norder > order) {
+          __page_split(group, norder);
+          --norder;
+        }
+        KASSERT(!list_empty(&group->pg_freelist[order]));
+        return group;
+      }
+    }
+    list_iterate_end();
+  }
+  return NULL;
+}
+
+static void *_page_alloc_order(uint32_t order);
+
+/* Whether the page at addr is in a block of at least the given order on
+ * the free lists */
+static int _page_is_free_order(struct pagegroup *group, uintptr_t addr,
+                               int order) {
+  uintptr_t pn = ADDR_TO_PN(addr - group->pg_baseaddr);
+
+  for (; order < PAGE_NSIZES; ++order) {
+    if (order + 1 == group->pg_freeorder[pn & ~((1U << order) - 1)])
+      return 1;
+  }
+  return 0;
+}
+
+#define _page_is_free(group, addr) _page_is_free_order(group, addr, 0)
+
+/* Whether a page of the cache can be moved by pframe_relocate */
+static int _page_is_movable(struct pagegroup *group, uintptr_t addr) {
+  pframe_t *pf = &group->pg_frames[ADDR_TO_PN(addr - group->pg_baseaddr)];
+
+  return !pframe_is_free(pf) && !pframe_is_busy(pf) && !pframe_is_pinned(pf);
+}
+
+/*
+ * Moves every page of the cache out of the block at addr, taking pages
+ * to move them to from the free lists as usual. Pages so taken which are
+ * in the block itself are held until it is empty, then freed with it.
+ *
+ * @return 1 if the block is now free, 0 if some page could not be moved
+ */
+static int _page_empty_block(struct pagegroup *group, uintptr_t block,
+                             int order) {
+  uintptr_t end = block + ((1 << order) << PAGE_SHIFT), addr, dest;
+  pframe_t *pf;
+  list_t held;
+
+  list_init(&held);
+  for (addr = block; addr < end; addr += PAGE_SIZE) {
+    pf = &group->pg_frames[ADDR_TO_PN(addr - group->pg_baseaddr)];
+    if (_page_is_free(group, addr) || !_page_is_movable(group, addr))
+      continue;
+    while (NULL != (dest = (uintptr_t)_page_alloc_order(0)) &&
+           block <= dest && dest < end)
+      list_insert_head(&held, &((struct freepage *)dest)->fp_link);
+    if (!dest)
+      break;
+    GDB_CALL_HOOK(page_alloc, (void *)dest, 1);
+    pframe_relocate(pf, (void *)dest);
+  }
+  while (!list_empty(&held)) {
+    addr = (uintptr_t)list_head(&held, struct freepage, fp_link);
+    list_remove_head(&held);
+    _page_free_order((void *)addr, 0);
+  }
+  return _page_is_free_order(group, block, order);
+}
+
+/*
+ * Compaction: when there are enough free pages for a block of the given
+ * order but too scattered to make one, finds an aligned block whose
+ * pages are all either free or pages of the cache which are neither busy
+ * nor pinned, and moves the latter elsewhere (see pframe_relocate) so that
+ * the block comes free. Anything else the kernel holds can't be moved,
+ * and rules out the block it is in. The block needing the fewest moves
+ * is chosen.
+ *
+ * @param order the order of the block wanted
+ * @return 1 if a block of that order was made, 0 if not
+ */
+static int _page_compact(int order) {
+  struct pagegroup *group, *best_group = NULL;
+  uintptr_t block, addr, best = 0;
+  uint32_t size = (1 << order) << PAGE_SHIFT, nmove, best_nmove = 0;
+
+  list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+    for (block = group->pg_baseaddr; block + size <= group->pg_endaddr;
+         block += size) {
+      nmove = 0;
+      for (addr = block; addr < block + size; addr += PAGE_SIZE) {
+        if (_page_is_free(group, addr))
+          continue;
+        if (!_page_is_movable(group, addr))
+          break;
+        nmove++;
+      }
+      if (addr < block + size || 0 == nmove ||
+          (best_group && nmove >= best_nmove))
+        continue;
+      best_group = group;
+      best = block;
+      best_nmove = nmove;
+    }
+  }
+  list_iterate_end();
+  /* the block's free pages and those moved out of it add up to its size,
+   * and the latter must come from outside it */
+  if (NULL == best_group || page_freecount < (1U << order))
+    return 0;
+  dbg(DBG_PAGEALLOC, "compacting 0x%.8x (%u), moving %u pages\n", best, order,
+      best_nmove);
+  return _page_empty_block(best_group, best, order);
+}
+
+/**
+ * Finds a group with a free block of the given order, splitting a bigger
+ * block if need be, and reclaiming memory if there is none. Local memory
+ * is used before remote memory, and any memory before reclaiming.
+ *
+ * @param order the order of the block wanted
+ * @return the group holding a free block of the given order, NULL if none
  */
 static struct pagegroup *_page_split(int order) {
 #ifdef __SHADOWD__
@@ -187,26 +403,24 @@ static struct pagegroup *_page_split(int order) {
 #else
   uint32_t num_retrys = 0;
 #endif
-  int norder;
+  struct pagegroup *group;
 
   do {
-    /* Find the first free block of greater size than requested. */
-    for (norder = order + 1; norder < PAGE_NSIZES; norder++) {
-      struct pagegroup *group;
-      list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-        if (!list_empty(&group->pg_freelist[norder])) {
-          while (norder > order) {
-            __page_split(group, norder);
-            --norder;
-          }
-          KASSERT(!list_empty(&group->pg_freelist[order]));
-          return group;
-        }
-      }
-      list_iterate_end();
-    }
+    if (NULL != (group = _page_find(order, 1)) ||
+        NULL != (group = _page_find(order, 0)))
+      return group;
 
     dbg(DBG_PAGEALLOC, "WARNING, cannot allocate order=%u\n", order);
+    /* Unzeroed memory is better than none */
+    if (_page_zeroed_drain()) {
+      ++num_retrys;
+      continue;
+    }
+    /* and moving cached pages around is cheaper than dropping caches */
+    if (0 < order && _page_compact(order)) {
+      ++num_retrys;
+      continue;
+    }
 /* We have run out of kernel memory. Lets try and collapse some
    shadow trees, and then retry */
 #ifdef __SHADOWD__
@@ -234,22 +448,12 @@ static void *_page_alloc_order(uint32_t order) {
   uintptr_t addr;
   struct pagegroup *group;
 
-  list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-    if (!list_empty(&group->pg_freelist[order]))
-      goto found;
-  }
-  list_iterate_end();
-
-  if (NULL != (group = _page_split(order))) {
-    KASSERT(!list_empty(&group->pg_freelist[order]));
-    goto found;
-  }
-  return NULL;
-
-found:
+  if (NULL == (group = _page_split(order)))
+    return NULL;
+  KASSERT(!list_empty(&group->pg_freelist[order]));
   addr = (uintptr_t)list_head(&group->pg_freelist[order], struct freepage,
                               fp_link);
-  list_remove_head(&group->pg_freelist[order]);
+  _freelist_remove(group, addr);
   if (PAGE_NSIZES - 1 > order)
     bit_flip(group->pg_map[order + 1],
              _pagegroup_calculate_index(group, order + 1, addr));
@@ -284,12 +488,11 @@ static void __page_join(struct pagegroup *group, int order, uintptr_t addr) {
     dbg(DBG_PAGEALLOC, "joining 0x%.8x and 0x%.8x (%u) into 0x%.8x\n", addr,
         buddy, order, MIN(offset, buddy));
 
-    list_remove(&((struct freepage *)addr)->fp_link);
-    list_remove(&((struct freepage *)buddy)->fp_link);
+    _freelist_remove(group, addr);
+    _freelist_remove(group, buddy);
     addr = MIN(addr, buddy);
     ++order;
-    list_insert_head(&group->pg_freelist[order],
-                     &((struct freepage *)addr)->fp_link);
+    _freelist_insert(group, order, addr);
 
     if (PAGE_NSIZES - 1 > order)
       bit_flip(group->pg_map[order + 1],
@@ -317,8 +520,7 @@ static void _page_free_order(void *addr, int order) {
   if (NULL == group)
     return;
 
-  list_insert_head(&group->pg_freelist[order],
-                   &((struct freepage *)addr)->fp_link);
+  _freelist_insert(group, order, (uintptr_t)addr);
   page_freecount += (1 << order);
 
   if (PAGE_NSIZES - 1 > order) {
@@ -343,6 +545,44 @@ void *page_alloc(void) {
   return addr;
 }
 
+/*
+ * Allocate one page of memory filled with zeros, taking it from the pool
+ * zeroed by the idle loop if possible.
+ * @return the address of the page
+ */
+void *page_alloc_zeroed(void) {
+  void *addr;
+  if (!list_empty(&page_zeroed_list)) {
+    addr = list_head(&page_zeroed_list, struct freepage, fp_link);
+    list_remove_head(&page_zeroed_list);
+    --page_nzeroed;
+    /* only the list link was written since the page was zeroed */
+    memset(addr, 0, sizeof(struct freepage));
+    GDB_CALL_HOOK(page_alloc, addr, 1);
+  } else if (NULL != (addr = page_alloc())) {
+    memset(addr, 0, PAGE_SIZE);
+  }
+  return addr;
+}
+
+/*
+ * Called from the scheduler when there is nothing to run: zeroes one free
+ * page into the zeroed pool, unless the pool is full or memory is short.
+ * @return 1 if a page was zeroed, 0 if there was nothing to do
+ */
+int page_zero_idle(void) {
+  void *addr;
+  if (page_nzeroed >= PAGE_ZERO_POOL_MAX ||
+      page_freecount <= PAGE_ZERO_POOL_MAX)
+    return 0;
+  if (NULL == (addr = _page_alloc_order(0)))
+    return 0;
+  memset(addr, 0, PAGE_SIZE);
+  list_insert_head(&page_zeroed_list, &((struct freepage *)addr)->fp_link);
+  ++page_nzeroed;
+  return 1;
+}
+
 /*
  * Free one page of memory (which was allocated with page_alloc())
  * @param addr the address of the page to be freed
@@ -353,13 +593,19 @@ void page_free(void *addr) {
 }
 
 /*
- * Allocates a block of at least npages pages.
+ * Allocates a block of at least npages pages. The smallest power of two
+ * block which fits is allocated, and the pages past npages are returned to
+ * the free lists straight away: working upwards from npages, each piece is
+ * the largest buddy block which starts there, so a 15 page kernel stack
+ * costs 15 pages rather than 16.
  * @param npages the number of pages to allocate
  * @return the address of the block
  */
 void *page_alloc_n(uint32_t npages) {
   int order;
 
+  if (!npages)
+    npages = 1;
   for (order = 0; order < PAGE_NSIZES; order++)
     if ((1 << order) >= (int)npages)
       break;
@@ -367,17 +613,32 @@ void *page_alloc_n(uint32_t npages) {
     panic("Implementation does not permit allocating %u pages!\n", npages);
 
   void *addr = _page_alloc_order(order);
+  if (NULL != addr) {
+    uint32_t pos = npages;
+    while (pos < (1U << order)) {
+      int tail_order = __builtin_ctz(pos);
+      _page_free_order((char *)addr + (pos << PAGE_SHIFT), tail_order);
+      pos += 1U << tail_order;
+    }
+  }
   GDB_CALL_HOOK(page_alloc, addr, npages);
   return addr;
 }
 
 /*
- * Frees a block of npages pages allocated with page_alloc_n().
+ * Frees a block of npages pages allocated with page_alloc_n(). What is
+ * left of the block after page_alloc_n() gave back its tail is freed as
+ * the buddy blocks making up the binary representation of npages, largest
+ * first; these rejoin each other (and the tail, if it is still free) as
+ * usual.
  * @param npages the size of the block (as given to page_alloc_n)
  */
 void page_free_n(void *start, uint32_t npages) {
   int order;
+  uint32_t pos = 0;
 
+  if (!npages)
+    npages = 1;
   for (order = 0; order < PAGE_NSIZES; order++)
     if ((1 << order) >= (int)npages)
       break;
@@ -385,10 +646,52 @@ void page_free_n(void *start, uint32_t npages) {
     panic("Implementation does not permit allocating %u pages!\n", npages);
 
   GDB_CALL_HOOK(page_free, start, npages);
-  _page_free_order(start, order);
+  for (; order >= 0; --order) {
+    if (npages & (1U << order)) {
+      _page_free_order((char *)start + (pos << PAGE_SHIFT), order);
+      pos += 1U << order;
+    }
+  }
+}
+
+/*
+ * Records an owner for each page of an allocated block, so that the
+ * owner can later be found from any address within the block. Used by
+ * the slab allocator to find an object's slab; page.c itself never
+ * looks at it.
+ * @param addr the start of the block
+ * @param npages the number of pages to record the owner for
+ * @param owner the owner, or NULL to forget it
+ */
+void page_set_owner(void *addr, uint32_t npages, void *owner) {
+  struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+  KASSERT(NULL != group && PAGE_ALIGNED(addr));
+  uintptr_t index = ADDR_TO_PN((uintptr_t)addr - group->pg_baseaddr);
+  while (npages--)
+    group->pg_owner[index++] = owner;
+}
+
+/*
+ * @param addr any address within an allocated block
+ * @return the owner last recorded for the page containing addr
+ */
+void *page_get_owner(void *addr) {
+  struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+  KASSERT(NULL != group);
+  return group->pg_owner[ADDR_TO_PN((uintptr_t)addr - group->pg_baseaddr)];
+}
+
+/*
+ * @param addr any address within a page the page allocator manages
+ * @return the frame descriptor of that page
+ */
+pframe_t *page_pframe(void *addr) {
+  struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+  KASSERT(NULL != group);
+  return &group->pg_frames[ADDR_TO_PN((uintptr_t)addr - group->pg_baseaddr)];
 }
 
 /*
  * @return the number of free pages in the kmem system
  */
-uint32_t page_free_count() { return page_freecount; }
+uint32_t page_free_count() { return page_freecount + page_nzeroed; }
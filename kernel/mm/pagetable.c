@@ -5,6 +5,7 @@
 #include "limits.h"
 #include "globals.h"
 
+#include "main/cpuid.h"
 #include "main/interrupt.h"
 
 #include "mm/mm.h"
@@ -13,15 +14,20 @@
 #include "mm/phys.h"
 #include "mm/tlb.h"
 #include "mm/pframe.h"
+#include "mm/shrinker.h"
 
 #include "util/debug.h"
+#include "util/init.h"
 #include "util/string.h"
 #include "util/printf.h"
 
 #include "vm/pagefault.h"
+#include "api/access.h"
 
 #include "boot/config.h"
 
+#define CR0_WP 0x00010000
+
 #define PT_ENTRY_COUNT (PAGE_SIZE / sizeof(uint32_t))
 #define PT_VADDR_SIZE (PAGE_SIZE * PT_ENTRY_COUNT)
 
@@ -40,20 +46,98 @@ struct pagedir {
   ((((uint32_t)(vaddr)) >> PAGE_SHIFT) % PT_ENTRY_COUNT)
 #define vaddr_to_offset(vaddr) (((uint32_t)(vaddr)) & (~PAGE_MASK))
 
+/* Addresses pt_map and friends work on: those of user memory, and those
+ * of vmalloc, whose page tables every page directory shares */
+#define vaddr_is_vmalloc(vaddr)                                                \
+  (VMALLOC_LOW <= (vaddr) && VMALLOC_HIGH > (vaddr))
+#define vaddr_is_mappable(vaddr)                                               \
+  ((USER_MEM_LOW <= (vaddr) && USER_MEM_HIGH > (vaddr)) ||                     \
+   vaddr_is_vmalloc(vaddr))
+
 /* the virtual address of the page directory in cr3 */
 static pagedir_t *current_pagedir = NULL;
 static pagedir_t *template_pagedir = NULL;
 
-static uint32_t phys_map_count = 1;
+/*
+ * Every page directory's kernel half is the template's, whose entries
+ * point at the same page tables, which are never replaced once
+ * pt_template_init has run (vmalloc's are made at boot too), so a change
+ * to a kernel mapping is seen by all of them at once and a directory
+ * never has to be brought up to date. What is left of making one is the
+ * copy, and freed directories, whose kernel halves are still intact, are
+ * kept on pagedir_cache for reuse with their user halves cleared, up to
+ * PAGEDIR_CACHE_MAX of them, and given back under memory pressure.
+ */
+static pagedir_t *pagedir_cache[PAGEDIR_CACHE_MAX];
+static uint32_t pagedir_ncached = 0;
+
+/*
+ * The last page table, final_page, holds the temporary and permanent
+ * mappings of physical memory outside the kernel's: its top PT_TMP_SLOTS
+ * entries are slots for temporary ones, handed out in turn, and the
+ * permanent ones grow down from below them. A page still in a slot is
+ * found there again rather than mapped anew, and only a slot which is
+ * reused has its TLB entry invalidated, so mapping a few pages over and
+ * over, or a run of them at once, costs no flushes after the first.
+ */
+#define PT_TMP_SLOTS 8
+#define pt_tmp_slot_entry(slot) (PT_ENTRY_COUNT - PT_TMP_SLOTS + (slot))
+#define pt_tmp_slot_vaddr(slot)                                                \
+  (UPTR_MAX - (PT_TMP_SLOTS - (slot)) * PAGE_SIZE + 1)
+
+static uint32_t tmp_slot_next = 0;
+static uint32_t phys_map_count = PT_TMP_SLOTS;
 static pte_t *final_page;
 
-uintptr_t pt_phys_tmp_map(uintptr_t paddr) {
+#define CR4_PGE 0x80 /* enables global pages */
+
+/* Flags for the kernel's mappings: with PT_GLOBAL if the processor has
+ * global pages, which are left in the TLB when cr3 is loaded, so that
+ * switching processes doesn't throw the kernel's entries away. */
+static pte_t kernel_ptflags = PT_PRESENT | PT_WRITE;
+
+/* The first of count slots in a row which map the pages from paddr on,
+ * or PT_TMP_SLOTS if there are none */
+static uint32_t pt_tmp_slot_find(uintptr_t paddr, uint32_t count) {
+  uint32_t slot, i;
+
+  for (slot = 0; slot + count <= PT_TMP_SLOTS; ++slot) {
+    for (i = 0; i < count && final_page[pt_tmp_slot_entry(slot + i)] ==
+                                 ((paddr + i * PAGE_SIZE) | PT_PRESENT | PT_WRITE);
+         ++i)
+      ;
+    if (i == count)
+      return slot;
+  }
+  return PT_TMP_SLOTS;
+}
+
+uintptr_t pt_phys_tmp_map_range(uintptr_t paddr, uint32_t count) {
+  uint32_t slot, i;
+  pte_t old;
+
   KASSERT(PAGE_ALIGNED(paddr));
-  final_page[PT_ENTRY_COUNT - 1] = paddr | PT_PRESENT | PT_WRITE;
+  KASSERT(0 < count && count <= PT_TMP_SLOTS);
+  if (PT_TMP_SLOTS != (slot = pt_tmp_slot_find(paddr, count)))
+    return pt_tmp_slot_vaddr(slot);
+
+  if (tmp_slot_next + count > PT_TMP_SLOTS)
+    tmp_slot_next = 0;
+  slot = tmp_slot_next;
+  tmp_slot_next += count;
+  for (i = 0; i < count; ++i) {
+    old = final_page[pt_tmp_slot_entry(slot + i)];
+    final_page[pt_tmp_slot_entry(slot + i)] =
+        (paddr + i * PAGE_SIZE) | PT_PRESENT | PT_WRITE;
+    /* a slot never used can't be in the TLB */
+    if (PT_PRESENT & old)
+      tlb_flush(pt_tmp_slot_vaddr(slot + i));
+  }
+  return pt_tmp_slot_vaddr(slot);
+}
 
-  uintptr_t vaddr = UPTR_MAX - PAGE_SIZE + 1;
-  tlb_flush(vaddr);
-  return vaddr;
+uintptr_t pt_phys_tmp_map(uintptr_t paddr) {
+  return pt_phys_tmp_map_range(paddr, 1);
 }
 
 uintptr_t pt_phys_perm_map(uintptr_t paddr, uint32_t count) {
@@ -78,34 +162,45 @@ uintptr_t pt_virt_to_phys(uintptr_t vaddr) {
   uint32_t entry = vaddr_to_ptindex(vaddr);
   uint32_t offset = vaddr_to_offset(vaddr);
 
-  pte_t *pagetable =
-      (pte_t *)pt_phys_tmp_map(current_pagedir->pd_physical[table] & PAGE_MASK);
+  /* every page table is in kernel memory, so there is no need to map it */
+  pte_t *pagetable = (pte_t *)current_pagedir->pd_virtual[table];
+  if (NULL == pagetable)
+    pagetable = (pte_t *)pt_phys_tmp_map(current_pagedir->pd_physical[table] &
+                                         PAGE_MASK);
   uintptr_t page = pagetable[entry] & PAGE_MASK;
   return page + offset;
 }
 
-void pt_set(pagedir_t *pd) {
+static void _pt_load(pagedir_t *pd) {
   uintptr_t pdir = pt_virt_to_phys((uintptr_t)pd->pd_physical);
   current_pagedir = pd;
   __asm__ volatile("movl %0, %%cr3" ::"r"(pdir) : "memory");
 }
 
+/* Whoever changes the mappings of the directory in cr3 flushes what they
+ * changed (see tlb.h), so loading it again would only empty the TLB */
+void pt_set(pagedir_t *pd) {
+  if (pd != current_pagedir)
+    _pt_load(pd);
+}
+
 pagedir_t *pt_get(void) { return current_pagedir; }
 
 int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags,
            uint32_t ptflags) {
   KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(paddr));
-  KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+  KASSERT(vaddr_is_mappable(vaddr));
 
   int index = vaddr_to_pdindex(vaddr);
 
   pte_t *pt;
   if (!(PT_PRESENT & pd->pd_physical[index])) {
-    if (NULL == (pt = page_alloc())) {
+    /* a table made here would be in this directory only */
+    KASSERT(!vaddr_is_vmalloc(vaddr));
+    if (NULL == (pt = page_alloc_zeroed())) {
       return -ENOMEM;
     } else {
       KASSERT((pdflags & ~PAGE_MASK) == pdflags);
-      memset(pt, 0, PAGE_SIZE);
       pd->pd_physical[index] = pt_virt_to_phys((uintptr_t)pt) | pdflags;
       pd->pd_virtual[index] = pt;
     }
@@ -123,9 +218,18 @@ int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags,
   return 0;
 }
 
+void pt_map_user_shared(uintptr_t vaddr, uintptr_t paddr) {
+  pte_t *pt = (pte_t *)template_pagedir->pd_virtual[0];
+
+  KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(paddr));
+  KASSERT(vaddr && vaddr < USER_MEM_LOW && vaddr < PT_VADDR_SIZE);
+  pt[vaddr_to_ptindex(vaddr)] = paddr | PT_PRESENT | PT_USER;
+  tlb_flush(vaddr);
+}
+
 void pt_unmap(pagedir_t *pd, uintptr_t vaddr) {
   KASSERT(PAGE_ALIGNED(vaddr));
-  KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+  KASSERT(vaddr_is_mappable(vaddr));
 
   int index = vaddr_to_pdindex(vaddr);
 
@@ -137,6 +241,22 @@ void pt_unmap(pagedir_t *pd, uintptr_t vaddr) {
   }
 }
 
+uintptr_t pt_lookup(pagedir_t *pd, uintptr_t vaddr) {
+  KASSERT(PAGE_ALIGNED(vaddr));
+  KASSERT(vaddr_is_mappable(vaddr));
+
+  int index = vaddr_to_pdindex(vaddr);
+
+  if (PT_PRESENT & pd->pd_physical[index]) {
+    pte_t *pt = (pte_t *)pd->pd_virtual[index];
+
+    index = vaddr_to_ptindex(vaddr);
+    if (PT_PRESENT & pt[index])
+      return pt[index] & PAGE_MASK;
+  }
+  return 0;
+}
+
 void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh) {
   uint32_t index;
 
@@ -170,10 +290,38 @@ void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh) {
   }
 }
 
+static pte_t *pt_kernel_pte(uintptr_t vaddr) {
+  pte_t *pt;
+
+  KASSERT(PAGE_ALIGNED(vaddr) && (uintptr_t)&kernel_start <= vaddr);
+  pt = (pte_t *)current_pagedir->pd_virtual[vaddr_to_pdindex(vaddr)];
+  KASSERT(NULL != pt);
+  return &pt[vaddr_to_ptindex(vaddr)];
+}
+
+/* The frame stays in the entry, so unguarding only sets PT_PRESENT back */
+void pt_kernel_guard(uintptr_t vaddr) {
+  pte_t *pte = pt_kernel_pte(vaddr);
+
+  KASSERT(PT_PRESENT & *pte);
+  *pte &= ~PT_PRESENT;
+  tlb_flush(vaddr);
+}
+
+void pt_kernel_unguard(uintptr_t vaddr) {
+  pte_t *pte = pt_kernel_pte(vaddr);
+
+  KASSERT(!(PT_PRESENT & *pte));
+  *pte |= PT_PRESENT;
+  tlb_flush(vaddr);
+}
+
 pagedir_t *pt_create_pagedir() {
   KASSERT(sizeof(pagedir_t) == PAGE_SIZE * 2);
 
   pagedir_t *pdir;
+  if (pagedir_ncached)
+    return pagedir_cache[--pagedir_ncached];
   if (NULL == (pdir = page_alloc_n(2))) {
     return NULL;
   }
@@ -185,6 +333,10 @@ pagedir_t *pt_create_pagedir() {
 void pt_destroy_pagedir(pagedir_t *pdir) {
   KASSERT(PAGE_ALIGNED(pdir));
 
+  /* a kernel thread may still be running on it */
+  if (pdir == current_pagedir)
+    pt_set(template_pagedir);
+
   uint32_t begin = USER_MEM_LOW / PT_VADDR_SIZE;
   uint32_t end = (USER_MEM_HIGH - 1) / PT_VADDR_SIZE;
   KASSERT(begin < end && begin > 0);
@@ -193,11 +345,38 @@ void pt_destroy_pagedir(pagedir_t *pdir) {
   for (i = begin; i <= end; ++i) {
     if (PT_PRESENT & pdir->pd_physical[i]) {
       page_free(pdir->pd_virtual[i]);
+      pdir->pd_physical[i] = 0;
+      pdir->pd_virtual[i] = NULL;
     }
   }
-  page_free_n(pdir, 2);
+  if (pagedir_ncached < PAGEDIR_CACHE_MAX)
+    pagedir_cache[pagedir_ncached++] = pdir;
+  else
+    page_free_n(pdir, 2);
+}
+
+static uint32_t pagedir_shrink_count(void) { return pagedir_ncached * 2; }
+
+static uint32_t pagedir_shrink_scan(uint32_t nr) {
+  uint32_t nfreed = 0;
+
+  while (nfreed < nr && pagedir_ncached) {
+    page_free_n(pagedir_cache[--pagedir_ncached], 2);
+    nfreed += 2;
+  }
+  return nfreed;
 }
 
+static shrinker_t pagedir_shrinker = {.sh_name = "pagedir",
+                                      .sh_count = pagedir_shrink_count,
+                                      .sh_scan = pagedir_shrink_scan};
+
+static __attribute__((unused)) void pagedir_cache_init(void) {
+  shrinker_register(&pagedir_shrinker);
+}
+init_func(pagedir_cache_init);
+init_depends(shrinker_init);
+
 static void _pt_fault_handler(regs_t *regs) {
   uintptr_t vaddr;
   /* Get the address where the fault occurred */
@@ -207,7 +386,7 @@ static void _pt_fault_handler(regs_t *regs) {
   /* Check if pagefault was in user space (otherwise, BAD!) */
   if (cause & FAULT_USER) {
     handle_pagefault(vaddr, cause);
-  } else {
+  } else if (!access_fixup(regs, vaddr)) {
     panic("\nPage faulted while accessing 0x%08x\n", vaddr);
   }
 }
@@ -247,6 +426,11 @@ void pt_init(void) {
   pde_t *temppdir;
   __asm__ volatile("movl %%cr3, %0" : "=r"(temppdir));
 
+  uint32_t eax, edx;
+  cpuid(CPUID_GETFEATURES, &eax, &edx);
+  if (edx & CPUID_FEAT_EDX_PGE)
+    kernel_ptflags |= PT_GLOBAL;
+
   pagedir_t *pagedir = (pagedir_t *)&kernel_end;
   /* The kernel ending address should be page aligned by the linker script */
   KASSERT(PAGE_ALIGNED(pagedir));
@@ -283,8 +467,8 @@ void pt_init(void) {
   uintptr_t phys_start = KERNEL_PHYS_BASE;
   pagetable += PT_ENTRY_COUNT;
   for (uint32_t cnt = 0; cnt < kernel_page_tables; cnt++) {
-    _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE,
-                  PT_PRESENT | PT_WRITE, map_start, phys_start);
+    _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, kernel_ptflags,
+                  map_start, phys_start);
     map_start += PT_VADDR_SIZE;
     phys_start += PT_VADDR_SIZE;
     pagetable += PT_ENTRY_COUNT;
@@ -292,13 +476,18 @@ void pt_init(void) {
   /* Map the extra page. (needed in case we don't have enough extra space for
    * the
    * last_page page directory. */
-  _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE,
-                PT_PRESENT | PT_WRITE, map_start, phys_start);
+  _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, kernel_ptflags,
+                map_start, phys_start);
 
   current_pagedir = pagedir;
   /* swap the temporary page table with our identical, but more
    * permanant page table */
-  pt_set(pagedir);
+  _pt_load(pagedir);
+  if (kernel_ptflags & PT_GLOBAL) {
+    uint32_t cr4;
+    __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile("movl %0, %%cr4" ::"r"(cr4 | CR4_PGE) : "memory");
+  }
 
   uintptr_t physmax = phys_detect_highmem();
   dbgq(DBG_MM, "Highest usable physical memory: 0x%08x\n", physmax);
@@ -310,10 +499,23 @@ void pt_init(void) {
     pagetable += PT_ENTRY_COUNT;
     vaddr += PT_VADDR_SIZE;
     paddr += PT_VADDR_SIZE;
-    _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE,
-                  PT_PRESENT | PT_WRITE, vaddr, paddr);
+    _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, kernel_ptflags,
+                  vaddr, paddr);
   } while (paddr < physmax);
 
+  /* Empty page tables for vmalloc, made now so that the template, and so
+   * every page directory, has them */
+  KASSERT(vaddr + PT_VADDR_SIZE <= VMALLOC_LOW);
+  KASSERT(0 == VMALLOC_LOW % PT_VADDR_SIZE);
+  for (vaddr = VMALLOC_LOW; vaddr < VMALLOC_HIGH; vaddr += PT_VADDR_SIZE) {
+    pagetable += PT_ENTRY_COUNT;
+    memset(pagetable, 0, PAGE_SIZE);
+    pagedir->pd_physical[vaddr_to_pdindex(vaddr)] =
+        ((uintptr_t)pagetable - (uintptr_t)&kernel_start + KERNEL_PHYS_BASE) |
+        PD_PRESENT | PD_WRITE;
+    pagedir->pd_virtual[vaddr_to_pdindex(vaddr)] = pagetable;
+  }
+
   page_add_range((uintptr_t)PAGE_ALIGN_UP(pagetable),
                  physmax + ((uintptr_t)&kernel_start) - KERNEL_PHYS_BASE);
 }
@@ -324,12 +526,22 @@ void pt_template_init() {
    * to remove the mapping of the first 4mb and then saved in a
    * seperate page as the template */
   memset(current_pagedir->pd_virtual[0], 0, PAGE_SIZE);
+  /* The emptied table stays, shared by every page directory copied from
+   * the template, for pt_map_user_shared; each entry decides whether
+   * userland may see its page */
+  current_pagedir->pd_physical[0] |= PD_USER;
   tlb_flush_all();
 
   template_pagedir = page_alloc_n(2);
   KASSERT(NULL != template_pagedir);
   memcpy(template_pagedir, current_pagedir, sizeof(*template_pagedir));
 
+  /* Make the kernel respect read-only user pages too, for the direct
+   * copies in copy_to_user; all of the kernel's own pages are writable */
+  uint32_t cr0;
+  __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+  __asm__ volatile("movl %0, %%cr0" ::"r"(cr0 | CR0_WP));
+
   intr_register(INTR_PAGE_FAULT, _pt_fault_handler);
 }
 
@@ -3,9 +3,14 @@
 #include "errno.h"
 
 #include "proc/proc.h"
+#include "proc/spinlock.h"
 
 #include "util/debug.h"
+#include "util/htable.h"
+#include "util/printf.h"
 #include "util/string.h"
+#include "util/time.h"
+#include "util/trace.h"
 
 #include "mm/mmobj.h"
 #include "mm/page.h"
@@ -13,8 +18,15 @@
 #include "mm/kmalloc.h"
 #include "mm/pframe.h"
 #include "mm/tlb.h"
+#include "mm/shrinker.h"
 #include "mm/pagetable.h"
+#include "mm/vmalloc.h"
 
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "vm/anon.h"
+#include "vm/swap.h"
 #include "vm/vmmap.h"
 
 /*
@@ -29,10 +41,9 @@
  *     - (3) pinned
  *
  * (1) Free pages do not contain identifiable data and are readily
- *     available for use. They are not pre-zeroed (at the moment, at least
- *     (but often times, OSs will have their equivalent of Weenix's
- *     idleproc (or another thread/process dedicated to this purpose) zero
- *     unzeroed pages on the free list when the system is otherwise idle)).
+ *     available for use. pframes are not pre-zeroed, but the scheduler
+ *     keeps a small pool of zeroed free pages topped up when it has nothing
+ *     to run (see page_alloc_zeroed), for users which need a zero page.
  *
  * (2) Allocated pages contain identifiable data.
  *
@@ -50,8 +61,8 @@
  *
  *
  * When a page is allocated or pinned:
- *     - pf_link links the page into allocated_list or pinned_list,
- *       respectively
+ *     - pf_link links the page into active_list or inactive_list, or
+ *       pinned_list, respectively
  *     - pf_hlink links the page into the appropriate hash chain of the
  *       resident page hashtable
  *     - pf_olink links the page into the appropriate mmobj's list of
@@ -74,81 +85,227 @@
 static int npinned;
 static list_t pinned_list;
 
-/*     The ALLOCATED list: */
-/*       Pages on this list contain useful/actual/real data. This list is
- *       maintained in least-recently-requested (via pframe_get or
- *       pframe_get_resident) (and thus, *roughly/approximately* LRU) order.
+/*     The ACTIVE and INACTIVE lists: */
+/*       Pages on these lists contain useful/actual/real data, and together
+ *       they make up the allocated pages. New pages start at the tail of
+ *       the inactive list, and pageoutd reclaims from its head. A request
+ *       (via pframe_get or pframe_get_resident) only sets PF_REFERENCED;
+ *       an inactive page requested a second time is promoted to the
+ *       active list. Whenever the active list outgrows the inactive one,
+ *       pages at its head are aged: referenced ones get another trip
+ *       round the active list, the rest are demoted to the inactive tail.
+ *
+ *       A single pass over a large file therefore only cycles pages through
+ *       the inactive list, and pages used repeatedly (inodes, indirect
+ *       blocks, executables) stay on the active list.
  */
-static int nallocated;
-static list_t alloc_list;
-
-static slab_allocator_t *pframe_allocator;
+static int nallocated; /* nactive + ninactive */
+static int nactive;
+static list_t active_list;
+static int ninactive;
+static list_t inactive_list;
+
+/* Threads waiting for busy pages, hashed by frame; see pframe_waitq */
+static ktqueue_t pframe_waitqs[1 << PF_WAITQ_ORDER];
+
+/* A user mapping of a page, on both the page's and the area's lists, so
+ * that a page can be unmapped in time proportional to its mappings. An
+ * entry can go stale without being removed (the area shrank, or the
+ * address was unmapped or remapped to another page) and is checked
+ * against the page table when used. */
+typedef struct pframe_rmap {
+  vmarea_t *pr_vma;
+  uintptr_t pr_vaddr;
+  list_link_t pr_plink; /* link on the page's pf_rmaps */
+  list_link_t pr_vlink; /* link on the area's vma_rmaps */
+} pframe_rmap_t;
+
+static slab_allocator_t *pframe_rmap_allocator;
 
 /* Used to quickly look up pframes. ALL pages "owned by" some
  * mmobj should be in this hash
- * (object, pagenum) --> list of pframes */
-#define hash_page(obj, pagenum) ((((uint32_t)(obj)) + (pagenum)) % PF_HASH_SIZE)
-static list_t pframe_hash[PF_HASH_SIZE];
+ * (object, pagenum) --> list of pframes
+ *
+ * The table (see util/htable.h) doubles whenever the number of resident
+ * pages exceeds PF_HASH_MAX_LOAD per bucket, moving pages to the new
+ * buckets a few chains at a time, so chains stay short no matter how much
+ * memory is cached and no page fault pays for moving them all. mmobjs are
+ * embedded in slab objects and so share their low address bits; the
+ * object pointer is scrambled with a multiplicative hash and the page
+ * number added afterwards. */
+#define PF_HASH_MULT 0x9e3779b1U
+#define hash_page(obj, pagenum) ((uint32_t)(obj)*PF_HASH_MULT + (pagenum))
+static htable_t pframe_hash;
+/* protects the table */
+static spinlock_t pframe_hash_lock;
+
+static uint32_t pframe_hash_link(list_link_t *link) {
+  pframe_t *pf = list_item(link, pframe_t, pf_hlink);
+  return hash_page(pf->pf_obj, pf->pf_pagenum);
+}
 
 /* Related to the Pageout daemon: */
 
+/*
+ * Free memory watermarks: below low, a miss wakes pageoutd, which
+ * reclaims in the background until free memory is back up to high. Only
+ * below min does a miss reclaim pages itself, and only if that fails
+ * does it wait for pageoutd.
+ */
 static uint32_t nfreepages_min = 0;
-static uint32_t nfreepages_target = 0;
+static uint32_t nfreepages_low = 0;
+static uint32_t nfreepages_high = 0;
+
+/* For pframe_info */
+static uint32_t pframe_nhits = 0;      /* pframe_get found the page */
+static uint32_t pframe_nmisses = 0;    /* and had to fill it */
+static uint32_t pframe_nevictions = 0; /* pages pageoutd reclaimed */
+static uint32_t pageoutd_nruns = 0;
+static uint32_t pframe_ndirect = 0; /* pages misses reclaimed themselves */
+static uint32_t pframe_nwaits = 0;  /* misses which waited on pageoutd */
+static uint32_t pframe_nrelocated = 0; /* pages moved by compaction */
 
 /*   pageoutd sleeps on this queue */
 static proc_t *pageoutd = NULL;
 static kthread_t *pageoutd_thr = NULL;
 static ktqueue_t pageoutd_waitq;
 
-/* threads waiting for pageoutd to run sleep on this queue */
-static ktqueue_t alloc_waitq;
+/*
+ * Threads which missed below the min watermark, and could not reclaim
+ * enough themselves, wait here in order of arrival, each on a queue of its own. As pageoutd
+ * frees pages it hands them out from the front of the line, one page per
+ * waiter, and wakes just that waiter; until the waiter has run, its page
+ * is counted in nreserved so that nobody else takes it.
+ */
+typedef struct pframe_waiter {
+  list_link_t pw_link;
+  ktqueue_t pw_q;
+  int pw_granted;
+} pframe_waiter_t;
+
+static list_t alloc_waiters;
+static uint32_t nwaiting = 0;
+static uint32_t nreserved = 0;
+
+/* Related to the flusher daemon, which writes back dirty pages before
+ * pageoutd has to: */
+
+/* number of resident dirty pages, and the count at which pflushd wakes */
+static int ndirty = 0;
+static int ndirty_background = 0;
+
+/*
+ * Writers are held back as dirty pages approach ndirty_limit, so that one
+ * of them can't fill memory with dirty pages and leave pageoutd to clean
+ * them, synchronously, for everyone else. A file system's own dirty pages
+ * count 1 << PF_DIRTY_FS_SHIFT times over, so that one slow device can't
+ * take up the whole allowance either. Past halfway from ndirty_background
+ * to the limit, a writer is paused after each write for as long as
+ * writeback would take to clean what it wrote, up to four times that
+ * near the limit; at the limit it waits on pframe_dirty_waitq until
+ * pflushd brings the count back down.
+ */
+static int ndirty_limit = 0;
+static ktqueue_t pframe_dirty_waitq;
+static int pframe_nthrottled = 0;   /* writers waiting at the limit */
+static uint32_t pframe_wb_rate = 0; /* pages/sec writeback manages, or 0 */
+static uint32_t pframe_nthrottles = 0;
+
+static proc_t *pflushd = NULL;
+static kthread_t *pflushd_thr = NULL;
+static ktqueue_t pflushd_waitq;
+
+/* armed when the first page becomes dirty, so nothing sits dirty for more
+ * than PFLUSHD_INTERVAL_MSECS */
+static ktimer_t pflushd_timer;
+static int pflushd_expired = 0;
+
+static void *pflushd_run(int arg1, void *arg2);
+static void pflushd_timeout(void *arg);
+#define pflushd_wakeup() (sched_broadcast_on(&pflushd_waitq))
+#define pflushd_arm()                                                         \
+  (timer_add(&pflushd_timer,                                                  \
+             time_ticks() + PFLUSHD_INTERVAL_MSECS / TICK_MSECS))
+
+static void pframe_unmap(pframe_t *pf, tlb_batch_t *tb);
+static void pframe_count_dirty(pframe_t *pf, int delta);
 
 /* Pageout daemon functions */
 static void *pageoutd_run(int arg1, void *arg2);
 static void pageoutd_exit(void);
 #define pageoutd_wakeup() (sched_broadcast_on(&pageoutd_waitq))
 #define pageoutd_needed()                                                      \
-  ((page_free_count() <= nfreepages_min) && (!list_empty(&alloc_list)))
-#define pageoutd_target_met() (page_free_count() >= nfreepages_target)
+  ((page_free_count() <= nfreepages_low + nreserved) && (0 < nallocated))
+#define pageoutd_target_met()                                                  \
+  (page_free_count() >= nfreepages_high + nreserved + nwaiting)
+#define pframe_below_min() (page_free_count() <= nfreepages_min + nreserved)
+
+/*
+ * Busy pages are few at any time, so rather than each frame having a wait
+ * queue of its own they share a small table of them. A thread woken on one
+ * may find its page still busy, or gone, and every waiter checks again.
+ */
+ktqueue_t *pframe_waitq(pframe_t *pf) {
+  return &pframe_waitqs[(uint32_t)pf * PF_HASH_MULT >> (32 - PF_WAITQ_ORDER)];
+}
 
 /*
- * Initialize the pinned and allocated counts and lists. Then, make a pframe
- * slab allocator. You should also list_init all the lists that make
+ * Initialize the pinned and allocated counts and lists, and the queues
+ * for busy pages. Then, make an allocator for reverse mappings. You should also list_init all the lists that make
  * up the pframe_hash. Finally, you need to set things up for pageoutd to
- * run by setting nfreepages_min and nfreepages_target.
+ * run by setting its watermarks.
  */
 void pframe_init(void) {
+  uint32_t i;
+
   /* initialize page lists: */
   npinned = 0;
   list_init(&pinned_list);
   nallocated = 0;
-  list_init(&alloc_list);
+  nactive = 0;
+  list_init(&active_list);
+  ninactive = 0;
+  list_init(&inactive_list);
+
+  for (i = 0; i < (1U << PF_WAITQ_ORDER); ++i)
+    sched_queue_init(&pframe_waitqs[i]);
 
-  pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
-  KASSERT(NULL != pframe_allocator);
+  pframe_rmap_allocator =
+      slab_allocator_create("pframe_rmap", sizeof(pframe_rmap_t));
+  KASSERT(NULL != pframe_rmap_allocator);
 
   /* initialize pframe_hash: */
-  int i;
-  for (i = 0; i < PF_HASH_SIZE; ++i)
-    list_init(&pframe_hash[i]);
+  spinlock_init(&pframe_hash_lock, "pframe_hash");
+  if (htable_init(&pframe_hash, PF_HASH_MIN_ORDER, PF_HASH_MAX_LOAD,
+                  pframe_hash_link))
+    panic("Couldn't allocate the pframe hash!\n");
 
   /* initialize pageout parameters: */
-  nfreepages_target = page_free_count() >> 1;
-  nfreepages_min = 0;
-
-  /* initialize alloc_waitq */
-  sched_queue_init(&alloc_waitq);
+  nfreepages_min = page_free_count() >> PAGEOUTD_FREE_MIN_SHIFT;
+  nfreepages_low = page_free_count() >> PAGEOUTD_FREE_LOW_SHIFT;
+  nfreepages_high = page_free_count() >> PAGEOUTD_FREE_HIGH_SHIFT;
+  ndirty_background = page_free_count() >> PFLUSHD_DIRTY_SHIFT;
+  ndirty_limit = page_free_count() >> PF_DIRTY_LIMIT_SHIFT;
+  sched_queue_init(&pframe_dirty_waitq);
+
+  list_init(&alloc_waiters);
 }
 
 void pframe_shutdown() {
   KASSERT(PID_IDLE == curproc->p_pid); /* Should call from idleproc */
 
-  /* Stop pageoutd and wait for it */
+  /* Stop pageoutd and pflushd and wait for them */
   pageoutd_exit();
+  timer_cancel(&pflushd_timer);
+  kthread_cancel(pflushd_thr, (void *)0);
+  pflushd_thr = NULL;
 
   int pid = pageoutd->p_pid;
-  int child = do_waitpid(-1, 0, NULL);
+  int child = do_waitpid(pid, 0, NULL);
   KASSERT(pid == child && "waited on process other than pageoutd");
+  pid = pflushd->p_pid;
+  child = do_waitpid(pid, 0, NULL);
+  KASSERT(pid == child && "waited on process other than pflushd");
   KASSERT(0 == npinned && "WARNING: FOUND PINNED "
                           "PAGES!!!!!!!!!! SOMETHING IS BROKEN!!\n");
 
@@ -157,7 +314,14 @@ void pframe_shutdown() {
 
   /* Free all pages */
   pframe_t *pf;
-  list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
+  list_iterate_begin(&inactive_list, pf, pframe_t, pf_link) {
+    KASSERT(!pframe_is_dirty(pf));
+    KASSERT(!pframe_is_busy(pf));
+    KASSERT(!pframe_is_pinned(pf));
+    pframe_free(pf);
+  }
+  list_iterate_end();
+  list_iterate_begin(&active_list, pf, pframe_t, pf_link) {
     KASSERT(!pframe_is_dirty(pf));
     KASSERT(!pframe_is_busy(pf));
     KASSERT(!pframe_is_pinned(pf));
@@ -166,6 +330,89 @@ void pframe_shutdown() {
   list_iterate_end();
 }
 
+/*
+ * Move an unpinned page onto the tail of the active list.
+ */
+static void pframe_activate(pframe_t *pf) {
+  KASSERT(!pframe_is_pinned(pf) && !(pf->pf_flags & PF_ACTIVE));
+  list_remove(&pf->pf_link);
+  list_insert_tail(&active_list, &pf->pf_link);
+  pf->pf_flags = (pf->pf_flags | PF_ACTIVE) & ~PF_REFERENCED;
+  --ninactive;
+  ++nactive;
+}
+
+/*
+ * Move an unpinned page onto the tail of the inactive list.
+ */
+static void pframe_deactivate(pframe_t *pf) {
+  KASSERT(!pframe_is_pinned(pf) && (pf->pf_flags & PF_ACTIVE));
+  list_remove(&pf->pf_link);
+  list_insert_tail(&inactive_list, &pf->pf_link);
+  pf->pf_flags &= ~(PF_ACTIVE | PF_REFERENCED);
+  --nactive;
+  ++ninactive;
+}
+
+/*
+ * Choose the page pageoutd should reclaim next: first age the active list
+ * until it is no longer than the inactive list, then take the head of the
+ * inactive list, activating any page there that has been referenced since
+ * it was put on the list. This does not block.
+ *
+ * @return the least valuable allocated page, or NULL if there are none
+ */
+static pframe_t *pframe_reclaim_candidate(void) {
+  pframe_t *pf;
+
+  while (nactive > ninactive) {
+    pf = list_head(&active_list, pframe_t, pf_link);
+    if (pf->pf_flags & PF_REFERENCED) {
+      pf->pf_flags &= ~PF_REFERENCED;
+      list_remove(&pf->pf_link);
+      list_insert_tail(&active_list, &pf->pf_link);
+    } else {
+      pframe_deactivate(pf);
+    }
+  }
+
+  while (!list_empty(&inactive_list)) {
+    pf = list_head(&inactive_list, pframe_t, pf_link);
+    if (!(pf->pf_flags & PF_REFERENCED))
+      return pf;
+    pframe_activate(pf);
+  }
+  /* Everything was referenced and is now active */
+  if (!list_empty(&active_list)) {
+    pf = list_head(&active_list, pframe_t, pf_link);
+    pframe_deactivate(pf);
+    return pf;
+  }
+  return NULL;
+}
+
+/*
+ * Find the page with the given identity in the resident page hash without
+ * touching its position on the active or inactive list.
+ */
+static pframe_t *pframe_hash_lookup(struct mmobj *o, uint32_t pagenum) {
+  list_t *hashchain;
+  pframe_t *pf;
+
+  spin_lock(&pframe_hash_lock);
+  hashchain = htable_bucket(&pframe_hash, hash_page(o, pagenum));
+  list_iterate_begin(hashchain, pf, pframe_t, pf_hlink) {
+    if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
+      spin_unlock(&pframe_hash_lock);
+      return pf;
+    }
+  }
+  list_iterate_end();
+  spin_unlock(&pframe_hash_lock);
+
+  return NULL;
+}
+
 /*
  * Obtain the (unique) page identified by 'o' and 'pagenum' only if this page is
  * already resident; if this page is not already resident, NULL is
@@ -182,34 +429,28 @@ void pframe_shutdown() {
  * @return the page requested, or NULL if it is not resident.
  */
 pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum) {
-  list_t *hashchain;
-  pframe_t *pf;
-
-  hashchain = &pframe_hash[hash_page(o, pagenum)];
-  list_iterate_begin(hashchain, pf, pframe_t, pf_hlink) {
-    if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
-      /* found a page with the specified identity. It is
-       * up to the caller to recognize/care if the page
-       * is busy. */
-      if (!pframe_is_pinned(pf)) {
-        /* send to back of alloc_list */
-        list_remove(&pf->pf_link);
-        list_insert_tail(&alloc_list, &pf->pf_link);
-      }
-      return pf;
-    }
+  pframe_t *pf = pframe_hash_lookup(o, pagenum);
+
+  /* It is up to the caller to recognize/care if the page is busy. */
+  if (NULL != pf) {
+    /* A second request while inactive promotes the page; otherwise just
+     * note the request and leave the lists alone */
+    if ((pf->pf_flags & PF_REFERENCED) && !(pf->pf_flags & PF_ACTIVE) &&
+        !pframe_is_pinned(pf))
+      pframe_activate(pf);
+    else
+      pf->pf_flags |= PF_REFERENCED;
   }
-  list_iterate_end();
-
-  return NULL;
+  return pf;
 }
 
 /*
  * Allocate a pframe to hold the page identified by the object and page number.
  * The given page should not already be resident.
  *
- * We allocate a page from the free list. We then initialize the newly allocated
- * page's object, pagenum, and flags, pin count, and links. We also update the
+ * We allocate a page from the free list and take its frame descriptor, so no
+ * memory is allocated for the pframe itself. We then initialize the page's
+ * object, pagenum, and flags, pin count, and links. We also update the
  * object's nrespages.
  *
  * @param o the mmobj identifying this page
@@ -219,26 +460,28 @@ pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum) {
  */
 static pframe_t *pframe_alloc(mmobj_t *o, uint32_t pagenum) {
   pframe_t *pf;
-  if (NULL == (pf = slab_obj_alloc(pframe_allocator))) {
-    dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
-    return NULL;
-  }
-  if (NULL == (pf->pf_addr = page_alloc())) {
+  void *addr;
+  if (NULL == (addr = page_alloc())) {
     dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
-    slab_obj_free(pframe_allocator, pf);
     return NULL;
   }
+  pf = page_pframe(addr);
+  KASSERT(pframe_is_free(pf));
+  pf->pf_addr = addr;
 
   nallocated++;
-  list_insert_tail(&alloc_list, &pf->pf_link);
+  ninactive++;
+  list_insert_tail(&inactive_list, &pf->pf_link);
 
   pf->pf_obj = o;
   pf->pf_pagenum = pagenum;
   pf->pf_flags = 0;
-  sched_queue_init(&pf->pf_waitq);
   pf->pf_pincount = 0;
+  list_init(&pf->pf_rmaps);
 
-  list_insert_head(&pframe_hash[hash_page(o, pagenum)], &pf->pf_hlink);
+  spin_lock(&pframe_hash_lock);
+  htable_insert(&pframe_hash, &pf->pf_hlink, hash_page(o, pagenum));
+  spin_unlock(&pframe_hash_lock);
 
   o->mmo_ops->ref(o);
   o->mmo_nrespages++;
@@ -256,14 +499,101 @@ static int pframe_fill(pframe_t *pf) {
   int ret;
 
   pframe_set_busy(pf);
+  trace(TRACE_PFRAME_FILL_BEGIN, pf->pf_obj, pf->pf_pagenum);
   ret = pf->pf_obj->mmo_ops->fillpage(pf->pf_obj, pf);
+  trace(TRACE_PFRAME_FILL_END, pf->pf_obj, ret);
   pframe_clear_busy(pf);
 
-  sched_broadcast_on(&pf->pf_waitq);
+  sched_broadcast_on(pframe_waitq(pf));
 
   return ret;
 }
 
+/*
+ * Reclaim clean, idle pages from the inactive end of the lists until free
+ * memory is above the min watermark, for a miss which found it below.
+ * Busy and dirty pages are passed over rather than waited on or written,
+ * and at most PF_DIRECT_RECLAIM_SCAN pages are looked at, so this is
+ * cheap and bounded; anything harder is left to pageoutd.
+ */
+static void pframe_direct_reclaim(void) {
+  pframe_t *pf;
+  int nscan;
+
+  for (nscan = 0; nscan < PF_DIRECT_RECLAIM_SCAN && pframe_below_min() &&
+                  NULL != (pf = pframe_reclaim_candidate());
+       ++nscan) {
+    if (pframe_is_busy(pf) || pframe_is_dirty(pf)) {
+      list_remove(&pf->pf_link);
+      list_insert_tail(&inactive_list, &pf->pf_link);
+    } else {
+      pframe_free(pf);
+      pframe_ndirect++;
+    }
+  }
+}
+
+/*
+ * Called before a miss takes a page. Below the low watermark, wakes
+ * pageoutd, without waiting for it. Below min (less the pages handed to
+ * threads which have yet to run), reclaims what it cheaply can; if that
+ * is not enough, or others are already waiting, gets in line behind them
+ * and sleeps until pageoutd has freed a page for us. The daemons
+ * themselves never wait, since pageoutd may be waiting on them.
+ *
+ * @return 1 if we slept, 0 if not
+ */
+static int pframe_wait_for_memory(void) {
+  pframe_waiter_t w;
+
+  if (pageoutd_needed())
+    pageoutd_wakeup();
+  if (NULL == pageoutd_thr || curthr == pageoutd_thr ||
+      curthr == pflushd_thr ||
+      (list_empty(&alloc_waiters) && !pframe_below_min()))
+    return 0;
+
+  pframe_direct_reclaim();
+  if (list_empty(&alloc_waiters) && !pframe_below_min())
+    return 0;
+
+  pframe_nwaits++;
+  sched_queue_init(&w.pw_q);
+  w.pw_granted = 0;
+  list_insert_tail(&alloc_waiters, &w.pw_link);
+  nwaiting++;
+  pageoutd_wakeup();
+  while (!w.pw_granted && !sched_cancellable_sleep_on(&w.pw_q))
+    ;
+  if (w.pw_granted) {
+    nreserved--;
+  } else { /* cancelled; go ahead without a page of our own */
+    list_remove(&w.pw_link);
+    nwaiting--;
+  }
+  return 1;
+}
+
+/*
+ * Hands the free pages above the min watermark to the threads waiting
+ * for them, first come first served. With all set, everyone waiting is
+ * let go whether or not there is a page for them, which pageoutd does
+ * before it blocks, as a waiter may hold what it would block on.
+ */
+static void pframe_grant(int all) {
+  pframe_waiter_t *w;
+
+  while (!list_empty(&alloc_waiters) &&
+         (all || !pframe_below_min())) {
+    w = list_head(&alloc_waiters, pframe_waiter_t, pw_link);
+    list_remove(&w->pw_link);
+    nwaiting--;
+    nreserved++;
+    w->pw_granted = 1;
+    sched_wakeup_on(&w->pw_q);
+  }
+}
+
 /*
  * Find and return the pframe representing the page identified by the object
  * and page number. If the page is already resident in memory, then we return
@@ -287,26 +617,70 @@ static int pframe_fill(pframe_t *pf) {
 int pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result) {
   if (!result) return 0;
   *result = pframe_get_resident(o, pagenum);
-  if (*result) { // Already resident
-    while (pframe_is_busy(*result)) {// Wait until not busy
-      sched_cancellable_sleep_on(&(*result)->pf_waitq);
-      *result = pframe_get_resident(o, pagenum);
-    }
-  } else { // Not resident, allocate new page
+  trace(*result ? TRACE_PFRAME_HIT : TRACE_PFRAME_MISS, o, pagenum);
+  if (*result)
+    pframe_nhits++;
+  else
+    pframe_nmisses++;
+  while (*result && pframe_is_busy(*result)) { // Wait until not busy
+    sched_cancellable_sleep_on(pframe_waitq(*result));
+    /* A failed fill frees the page, in which case we fill it ourselves */
+    *result = pframe_get_resident(o, pagenum);
+  }
+  if (!*result && pframe_wait_for_memory()) {
+    /* someone else may have read it in while we waited */
+    while ((*result = pframe_get_resident(o, pagenum)) &&
+           pframe_is_busy(*result))
+      sched_cancellable_sleep_on(pframe_waitq(*result));
+  }
+  if (!*result) { // Not resident, allocate new page
     *result = pframe_alloc(o, pagenum);
     dbg(DBG_PFRAME, "allocated new pframe %p\n", *result);
     int status = pframe_fill(*result);
     if (status) return status;
-    if (page_free_count() == nfreepages_target) {
-      pframe_pin(*result);
-      pageoutd_wakeup();
-      sched_sleep_on(&alloc_waitq);
-      pframe_unpin(*result);
-    }
   }
   return 0;
 }
 
+/*
+ * Allocate a frame for a page that is not resident and return it busy and
+ * unfilled, so that the caller can fill several frames with a single device
+ * operation (e.g. for read-ahead). Once the contents are in place the caller
+ * must call pframe_fill_done().
+ *
+ * Since this is meant for speculative reads, NULL is returned rather than
+ * blocking if the page is already resident or if free memory has fallen to
+ * the low watermark.
+ *
+ * @param o the parent object of the page
+ * @param pagenum the page number of this page in the object
+ * @return a new busy pframe, or NULL
+ */
+pframe_t *pframe_alloc_busy(struct mmobj *o, uint32_t pagenum) {
+  pframe_t *pf;
+  if (page_free_count() <= nfreepages_low + nreserved ||
+      NULL != pframe_get_resident(o, pagenum))
+    return NULL;
+  if (NULL != (pf = pframe_alloc(o, pagenum)))
+    pframe_set_busy(pf);
+  return pf;
+}
+
+/*
+ * Finish filling a page returned by pframe_alloc_busy(), waking up anyone
+ * waiting for it. If the fill failed the page is freed again.
+ *
+ * @param pf the page that was being filled
+ * @param status 0 if the page was filled, <0 if the fill failed
+ */
+void pframe_fill_done(pframe_t *pf, int status) {
+  KASSERT(pframe_is_busy(pf));
+  pframe_clear_busy(pf);
+  sched_broadcast_on(pframe_waitq(pf));
+  if (status)
+    pframe_free(pf);
+}
+
 int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite,
                   pframe_t **result) {
   KASSERT(NULL != o);
@@ -318,7 +692,7 @@ int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite,
 /*
  * Migrate a page frame up the tree. The destination must be on the same
  * branch as the pframe's current object. pf must not be busy. If dest
- * already has a page with the same number as pf clean pf.
+ * already has a page with the same number as pf, pf is freed instead.
  *
  * @param pf page to be migrated
  * @param dest destination vm object
@@ -326,33 +700,121 @@ int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite,
 void pframe_migrate(pframe_t *pf, mmobj_t *dest) {
   KASSERT(!pframe_is_busy(pf));
   if (NULL != pframe_get_resident(dest, pf->pf_pagenum)) {
-    /* dest already has a newer version of the page, clean this page */
-    pframe_unpin(pf);
-    pframe_clean(pf);
+    /* dest already has a newer version of the page, so this one is of
+     * no use to anyone */
+    if (pframe_is_pinned(pf))
+      pframe_unpin(pf);
     pframe_free(pf);
   } else {
     mmobj_t *src = pf->pf_obj;
+    if (pframe_is_dirty(pf))
+      pframe_count_dirty(pf, -1);
+    spin_lock(&pframe_hash_lock);
     pf->pf_obj = dest;
-    list_remove(&pf->pf_hlink);
+    htable_remove(&pframe_hash, &pf->pf_hlink);
+    htable_insert(&pframe_hash, &pf->pf_hlink,
+                  hash_page(dest, pf->pf_pagenum));
+    spin_unlock(&pframe_hash_lock);
     list_remove(&pf->pf_olink);
     src->mmo_nrespages--;
     src->mmo_ops->put(src);
-    list_insert_head(&pframe_hash[hash_page(dest, pf->pf_pagenum)],
-                     &pf->pf_hlink);
     list_insert_head(&dest->mmo_respages, &pf->pf_olink);
     dest->mmo_nrespages++;
     dest->mmo_ops->ref(dest);
+    if (pframe_is_dirty(pf))
+      pframe_count_dirty(pf, 1);
   }
 }
 
+/*
+ * Hands a page to another object, under a new page number, for passing
+ * pages between address spaces without copying them (see
+ * vmmap_take_page). Unlike pframe_migrate, the page leaves every user
+ * mapping of it, since those are mappings of its old place. dest must
+ * not have a page resident at pagenum; swap slots at either place are
+ * the caller's to discard. pf must not be busy.
+ *
+ * @param pf page to be moved
+ * @param dest object to move it to
+ * @param pagenum its page number there
+ */
+void pframe_move(pframe_t *pf, mmobj_t *dest, uint32_t pagenum) {
+  mmobj_t *src = pf->pf_obj;
+
+  KASSERT(!pframe_is_busy(pf));
+  KASSERT(NULL == pframe_get_resident(dest, pagenum));
+  pframe_remove_from_pts(pf);
+  if (pframe_is_dirty(pf))
+    pframe_count_dirty(pf, -1);
+  spin_lock(&pframe_hash_lock);
+  pf->pf_obj = dest;
+  pf->pf_pagenum = pagenum;
+  htable_remove(&pframe_hash, &pf->pf_hlink);
+  htable_insert(&pframe_hash, &pf->pf_hlink, hash_page(dest, pagenum));
+  spin_unlock(&pframe_hash_lock);
+  list_remove(&pf->pf_olink);
+  src->mmo_nrespages--;
+  list_insert_head(&dest->mmo_respages, &pf->pf_olink);
+  dest->mmo_nrespages++;
+  dest->mmo_ops->ref(dest);
+  if (pframe_is_dirty(pf))
+    pframe_count_dirty(pf, 1);
+  /* Last, as this can block */
+  src->mmo_ops->put(src);
+}
+
+/*
+ * Moves a page to another frame, for compaction in page.c: copies it to
+ * the free page at addr, whose frame descriptor takes the page's place in
+ * the hash and on its object's and the pager's lists, and frees the old
+ * frame. User mappings are removed rather than pointed at the new frame,
+ * since whether each was writable isn't recorded; the next access faults
+ * the page in again. Doesn't block.
+ *
+ * @param pf a resident page which is neither busy nor pinned
+ * @param addr the page to move it to
+ */
+void pframe_relocate(pframe_t *pf, void *addr) {
+  pframe_t *npf = page_pframe(addr);
+  tlb_batch_t tb;
+
+  KASSERT(!pframe_is_free(pf) && !pframe_is_busy(pf) && !pframe_is_pinned(pf));
+  KASSERT(pframe_is_free(npf));
+
+  tlb_batch_init(&tb);
+  pframe_unmap(pf, &tb);
+  tlb_batch_flush(&tb);
+  memcpy(addr, pf->pf_addr, PAGE_SIZE);
+
+  npf->pf_obj = pf->pf_obj;
+  npf->pf_pagenum = pf->pf_pagenum;
+  npf->pf_addr = addr;
+  npf->pf_flags = pf->pf_flags;
+  npf->pf_pincount = 0;
+  list_init(&npf->pf_rmaps);
+  list_insert_before(&pf->pf_link, &npf->pf_link);
+  list_remove(&pf->pf_link);
+  list_insert_before(&pf->pf_olink, &npf->pf_olink);
+  list_remove(&pf->pf_olink);
+  spin_lock(&pframe_hash_lock);
+  list_insert_before(&pf->pf_hlink, &npf->pf_hlink);
+  list_remove(&pf->pf_hlink);
+  spin_unlock(&pframe_hash_lock);
+
+  pf->pf_obj = NULL;
+  pf->pf_flags = 0;
+  page_free(pf->pf_addr);
+  pframe_nrelocated++;
+}
+
 /*
  * Increases the pin count on this page. Pages with a pin count > 0 will not be
  * paged out by pageoutd, so this ensures that the page will remain resident
  * until the pin count is decreased.
  *
  * If the pframe has not yet been pinned, remove this pframe's list link from
- * the allocated list and add it to the pinned list.  Be sure to decrement
- * nallocated and increment npinned.
+ * the active or inactive list and add it to the pinned list.  Be sure to
+ * decrement nallocated and increment npinned.
  *
  * In either case, increment the pf_pincount.
  *
@@ -364,6 +826,10 @@ void pframe_pin(pframe_t *pf) {
   if (!pf->pf_pincount++) {
     list_remove(&pf->pf_link);
     list_insert_tail(&pinned_list, &pf->pf_link);
+    if (pf->pf_flags & PF_ACTIVE)
+      --nactive;
+    else
+      --ninactive;
     --nallocated;
     ++npinned;
   }
@@ -374,8 +840,8 @@ void pframe_pin(pframe_t *pf) {
  * page could be paged out any time after the calling context blocks.
  *
  * If the pin count reaches zero, move the pframe's list link from the pinned
- * list to the allocated list.  Be sure to correctly update npinned and
- * nallocated
+ * list to the tail of the active list, since the page has clearly been in
+ * use.  Be sure to correctly update npinned and nallocated
  *
  * @param pf a pinned page (a page with a positive pin count)
  */
@@ -383,13 +849,47 @@ void pframe_unpin(pframe_t *pf) {
   dbg(DBG_PFRAME, "%d\n", pf->pf_pagenum);
   if (!--pf->pf_pincount) {
     list_remove(&pf->pf_link);
-    list_insert_tail(&alloc_list, &pf->pf_link);
+    list_insert_tail(&active_list, &pf->pf_link);
+    pf->pf_flags = (pf->pf_flags | PF_ACTIVE) & ~PF_REFERENCED;
+    ++nactive;
     ++nallocated;
     --npinned;
   }
   KASSERT(pf->pf_pincount >= 0);
 }
 
+/*
+ * Makes an unpinned page the next one pageoutd reclaims, by moving it to
+ * the head of the inactive list and forgetting any recent reference. For
+ * pages a caller knows won't be wanted again soon. Pinned pages are left
+ * alone.
+ */
+void pframe_reclaim_soon(pframe_t *pf) {
+  if (pframe_is_pinned(pf))
+    return;
+  if (pf->pf_flags & PF_ACTIVE) {
+    --nactive;
+    ++ninactive;
+  }
+  list_remove(&pf->pf_link);
+  list_insert_head(&inactive_list, &pf->pf_link);
+  pf->pf_flags &= ~(PF_ACTIVE | PF_REFERENCED);
+}
+
+/*
+ * Counts a page into (delta 1) or out of (delta -1) the dirty pages, and
+ * its file system's, waking writers held at the limit once it is cleared.
+ */
+static void pframe_count_dirty(pframe_t *pf, int delta) {
+  vnode_t *vn = vnode_of_mmobj(pf->pf_obj);
+
+  ndirty += delta;
+  if (NULL != vn)
+    vn->vn_fs->fs_ndirty += delta;
+  if (0 > delta && pframe_nthrottled && ndirty < ndirty_limit)
+    sched_broadcast_on(&pframe_dirty_waitq);
+}
+
 /*
  * Indicates that a page is about to be modified. This should be called on a
  * page before any attempt to modify its contents. This marks the page dirty
@@ -412,12 +912,19 @@ int pframe_dirty(pframe_t *pf) {
   pframe_set_busy(pf);
 
   if (!(ret = pf->pf_obj->mmo_ops->dirtypage(pf->pf_obj, pf))) {
+    if (!pframe_is_dirty(pf)) {
+      pframe_count_dirty(pf, 1);
+      if (ndirty >= ndirty_background)
+        pflushd_wakeup();
+      else if (pflushd_thr && !timer_pending(&pflushd_timer))
+        pflushd_arm();
+    }
     pframe_set_dirty(pf);
   } else {
     dbg(DBG_PFRAME, "couldn't dirty, error: %d\n", ret);
   }
   pframe_clear_busy(pf);
-  sched_broadcast_on(&pf->pf_waitq);
+  sched_broadcast_on(pframe_waitq(pf));
 
   return ret;
 }
@@ -448,6 +955,7 @@ int pframe_clean(pframe_t *pf) {
    * we won't (incorrectly) think the page has been fully cleaned.
    */
   pframe_clear_dirty(pf);
+  pframe_count_dirty(pf, -1);
 
   /* Make sure a future write to the page will fault (and hence dirty it) */
   tlb_flush((uintptr_t)pf->pf_addr);
@@ -455,14 +963,31 @@ int pframe_clean(pframe_t *pf) {
 
   pframe_set_busy(pf);
   if ((ret = pf->pf_obj->mmo_ops->cleanpage(pf->pf_obj, pf)) < 0) {
+    /* Someone may have dirtied it again while we blocked */
+    if (!pframe_is_dirty(pf))
+      pframe_count_dirty(pf, 1);
     pframe_set_dirty(pf);
   }
   pframe_clear_busy(pf);
-  sched_broadcast_on(&pf->pf_waitq);
+  sched_broadcast_on(pframe_waitq(pf));
 
   return ret;
 }
 
+/*
+ * Marks a page clean without writing it, for a caller which has written
+ * the page's contents out itself (such as a file system journal writing
+ * pinned metadata pages home in its own order). The caller must make
+ * sure nothing changes the page while it is being written.
+ */
+void pframe_set_clean(pframe_t *pf) {
+  KASSERT(!pframe_is_busy(pf));
+  if (pframe_is_dirty(pf)) {
+    pframe_clear_dirty(pf);
+    pframe_count_dirty(pf, -1);
+  }
+}
+
 /*
  * Deallocates a pframe (reclaims the page frame for use by something else).
  * The page should not be pinned, free, or busy. Note that if the page is dirty
@@ -485,53 +1010,318 @@ void pframe_free(pframe_t *pf) {
   /* Remove from all pagetables that map it */
   pframe_remove_from_pts(pf);
 
-  list_remove(&pf->pf_hlink);
+  spin_lock(&pframe_hash_lock);
+  htable_remove(&pframe_hash, &pf->pf_hlink);
+  spin_unlock(&pframe_hash_lock);
 
+  if (pframe_is_dirty(pf))
+    pframe_count_dirty(pf, -1);
   pf->pf_obj = NULL;
   nallocated--;
+  if (pf->pf_flags & PF_ACTIVE)
+    nactive--;
+  else
+    ninactive--;
   list_remove(&pf->pf_link);
 
-  page_free(pf->pf_addr);
-  slab_obj_free(pframe_allocator, pf);
-
   o->mmo_nrespages--;
   list_remove(&pf->pf_olink);
 
+  pf->pf_flags = 0;
+  page_free(pf->pf_addr);
+
   /* Now that pf has effectively been freed, dereference the corresponding
    * object. We don't do this earlier as we are modifying the object's counts
    * and also because this op can block */
   o->mmo_ops->put(o);
 }
 
+/*
+ * Write back a run of dirty pages of one object with consecutive page
+ * numbers, all of which the caller has already marked busy. Uses the
+ * object's cleanpages operation if it has one. The pages are left busy.
+ *
+ * @return the number of pages successfully cleaned
+ */
+static int pframe_clean_run(pframe_t **pfs, int npages) {
+  mmobj_t *o = pfs[0]->pf_obj;
+  int ncleaned = npages, ret, i;
+  tlb_batch_t tb;
+
+  tlb_batch_init(&tb);
+  for (i = 0; i < npages; ++i) {
+    /* As in pframe_clean, clear the dirty bit before blocking */
+    pframe_clear_dirty(pfs[i]);
+    pframe_count_dirty(pfs[i], -1);
+    tlb_flush((uintptr_t)pfs[i]->pf_addr);
+    pframe_unmap(pfs[i], &tb);
+  }
+  tlb_batch_flush(&tb);
+
+  if (1 < npages && NULL != o->mmo_ops->cleanpages) {
+    ret = o->mmo_ops->cleanpages(o, pfs, npages);
+    for (i = 0; ret < 0 && i < npages; ++i) {
+      if (!pframe_is_dirty(pfs[i]))
+        pframe_count_dirty(pfs[i], 1);
+      pframe_set_dirty(pfs[i]);
+      --ncleaned;
+    }
+  } else {
+    for (i = 0; i < npages; ++i) {
+      if (0 > o->mmo_ops->cleanpage(o, pfs[i])) {
+        if (!pframe_is_dirty(pfs[i]))
+          pframe_count_dirty(pfs[i], 1);
+        pframe_set_dirty(pfs[i]);
+        --ncleaned;
+      }
+    }
+  }
+  return ncleaned;
+}
+
+/* The identity of a dirty page gathered for writeback */
+typedef struct pframe_key {
+  mmobj_t *pk_obj;
+  uint32_t pk_pagenum;
+} pframe_key_t;
+
+/* Add pf to keys[0..n), which is kept sorted by (object, page number) */
+static void pframe_key_insert(pframe_key_t *keys, int n, pframe_t *pf) {
+  int i;
+
+  for (i = n; i > 0; --i) {
+    if ((uintptr_t)keys[i - 1].pk_obj < (uintptr_t)pf->pf_obj ||
+        (keys[i - 1].pk_obj == pf->pf_obj &&
+         keys[i - 1].pk_pagenum < pf->pf_pagenum))
+      break;
+    keys[i] = keys[i - 1];
+  }
+  keys[i].pk_obj = pf->pf_obj;
+  keys[i].pk_pagenum = pf->pf_pagenum;
+}
+
+/*
+ * Write back the pages named by the n sorted keys, a run of consecutive
+ * pages of one object at a time. Each run is looked up again and marked
+ * busy just before it is written, so, as with pframe_clean, only the
+ * pages actually being written are ever busy, and pages which have been
+ * cleaned or freed meanwhile are skipped.
+ *
+ * @return the number of pages successfully cleaned
+ */
+static int pframe_writeback_keys(pframe_key_t *keys, int n) {
+  pframe_t *run[PF_WRITEBACK_MAX];
+  pframe_t *pf;
+  int nrun, nwritten = 0, i, j;
+
+  KASSERT(n <= PF_WRITEBACK_MAX);
+  dbg(DBG_PFRAME, "writing back up to %d pages\n", n);
+  for (i = 0; i < n;) {
+    /* Collect the next run of consecutive pages which still need
+     * cleaning; nothing here blocks */
+    nrun = 0;
+    while (i < n) {
+      if (nrun && (keys[i].pk_obj != run[0]->pf_obj ||
+                   keys[i].pk_pagenum != run[nrun - 1]->pf_pagenum + 1))
+        break;
+      pf = pframe_hash_lookup(keys[i].pk_obj, keys[i].pk_pagenum);
+      ++i;
+      if (NULL == pf || !pframe_is_dirty(pf) || pframe_is_busy(pf) ||
+          pframe_is_pinned(pf)) {
+        if (nrun)
+          break;
+        continue;
+      }
+      pframe_set_busy(pf);
+      run[nrun++] = pf;
+    }
+    if (!nrun)
+      continue;
+
+    nwritten += pframe_clean_run(run, nrun);
+    for (j = 0; j < nrun; ++j) {
+      pframe_clear_busy(run[j]);
+      sched_broadcast_on(pframe_waitq(run[j]));
+    }
+  }
+  return nwritten;
+}
+
+/*
+ * With the compressed swap cache, anonymous and shadow pages are written
+ * out only by pageoutd, as it reclaims them: cleaning one any earlier
+ * would spend memory on a compressed copy of a page that stays resident,
+ * or put it on the swap device ahead of the cache.
+ */
+static int pframe_writeback_deferred(pframe_t *pf) {
+  return swap_zcache_enabled() && curthr != pageoutd_thr &&
+         (anon_is(pf->pf_obj) || NULL != pf->pf_obj->mmo_shadowed);
+}
+
+/*
+ * Gather up to PF_WRITEBACK_MAX dirty pages, inactive ones first, sort
+ * them by object and page number, and write them back so that pages
+ * which are adjacent within an object (and so, for block devices, on
+ * disk) go out together in one request rather than in LRU order one at
+ * a time.
+ *
+ * @return the number of pages successfully cleaned
+ */
+int pframe_writeback() {
+  pframe_key_t keys[PF_WRITEBACK_MAX];
+  list_t *lists[] = {&inactive_list, &active_list};
+  unsigned long start;
+  uint32_t rate;
+  pframe_t *pf;
+  int n = 0, l;
+
+  for (l = 0; l < 2; ++l) {
+    list_iterate_begin(lists[l], pf, pframe_t, pf_link) {
+      if (PF_WRITEBACK_MAX == n)
+        break;
+      if (!pframe_is_dirty(pf) || pframe_is_busy(pf) ||
+          pframe_writeback_deferred(pf))
+        continue;
+      pframe_key_insert(keys, n++, pf);
+    }
+    list_iterate_end();
+  }
+
+  /* keep a running average of how fast pages get written back, for
+   * pframe_throttle_dirty */
+  start = time_ticks();
+  if (0 < (n = pframe_writeback_keys(keys, n))) {
+    rate = n * TIME_HZ / MAX(time_ticks() - start, 1UL);
+    pframe_wb_rate = pframe_wb_rate ? (3 * pframe_wb_rate + rate) / 4 : rate;
+  }
+  return n;
+}
+
+/* How far writers have gone toward the limit, on its scale */
+static int pframe_dirty_level(struct fs *fs) {
+  return MAX(ndirty, NULL != fs ? fs->fs_ndirty << PF_DIRTY_FS_SHIFT : 0);
+}
+
+void pframe_throttle_dirty(struct fs *fs, uint32_t npages) {
+  int start = (ndirty_background + ndirty_limit) / 2, level;
+  unsigned long pause;
+  ktqueue_t q;
+
+  if (NULL == pflushd_thr || curthr == pflushd_thr || curthr == pageoutd_thr ||
+      (level = pframe_dirty_level(fs)) <= start)
+    return;
+
+  pframe_nthrottles++;
+  pflushd_wakeup();
+  if (level < ndirty_limit) {
+    /* 1x writeback's time for what was written at start, 4x at the limit;
+     * at least a tick until there is a rate to go by */
+    pause = pframe_wb_rate ? npages * TIME_HZ / pframe_wb_rate : 1;
+    pause += pause * 3 * (level - start) / (ndirty_limit - start);
+    pause = MIN(MAX(pause, 1UL), PF_DIRTY_MAX_PAUSE_MSECS / TICK_MSECS);
+    sched_queue_init(&q);
+    sched_cancellable_sleep_on_timeout(&q, pause);
+    return;
+  }
+
+  pframe_nthrottled++;
+  while (pframe_dirty_level(fs) >= ndirty_limit && NULL != pflushd_thr) {
+    pflushd_wakeup();
+    if (-EINTR == sched_cancellable_sleep_on_timeout(
+                      &pframe_dirty_waitq,
+                      PF_DIRTY_MAX_PAUSE_MSECS / TICK_MSECS))
+      break;
+  }
+  pframe_nthrottled--;
+}
+
+/*
+ * Write back every dirty page of one object the same way, waiting for
+ * any which are being written already, and return once none is left
+ * dirty. Pinned pages are left for the pager. For fsync(2), which
+ * shouldn't have to wait for anything but the one file.
+ *
+ * @param o the object
+ * @return 0, or -EIO if some pages could not be cleaned
+ */
+int pframe_writeback_obj(mmobj_t *o) {
+  pframe_key_t keys[PF_WRITEBACK_MAX];
+  pframe_t *pf, *busy;
+  int n, nstuck = 0;
+
+  while (1) {
+    n = 0;
+    busy = NULL;
+    list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+      if (!pframe_is_dirty(pf) || pframe_is_pinned(pf))
+        continue;
+      if (pframe_is_busy(pf))
+        busy = pf;
+      else if (n < PF_WRITEBACK_MAX)
+        pframe_key_insert(keys, n++, pf);
+    }
+    list_iterate_end();
+
+    if (n) {
+      if (pframe_writeback_keys(keys, n)) {
+        nstuck = 0;
+        continue;
+      }
+      /* A cleanpage may refuse while someone holds the page's file (see
+       * s5fs_cleanpage), so give them a couple of chances to finish */
+      if (++nstuck == 3)
+        return -EIO;
+      sched_make_runnable(curthr);
+      sched_switch();
+    } else if (busy) {
+      sched_sleep_on(pframe_waitq(busy));
+    } else {
+      return 0;
+    }
+  }
+}
+
 /*
  * Clean all allocated pages (that is, all pages that are not pinned and
  * not free). This is called by sync(2).
  */
 void pframe_clean_all() {
+  list_t *lists[] = {&inactive_list, &active_list};
   pframe_t *pf;
+  int l;
   dbg(DBG_PFRAME, "pframe_clean_all: starting (this may take a while)\n");
 
 /*
- * Iterate from head of alloc_list to tail; This is a rough attempt to
- * sync from least active to most active. Note that every time we block we
- * need to start the loop over as the "current element" pf may have been
- * moved or removed in the meantime (our list has no multithreaded
- * integrity)
+ * Iterate over the inactive list and then the active list, each from head
+ * to tail; This is a rough attempt to sync from least active to most
+ * active. Note that every time we block we need to start the loop over as
+ * the "current element" pf may have been moved or removed in the meantime
+ * (our lists have no multithreaded integrity)
  */
 list_start:
-  list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
-    KASSERT(!pframe_is_pinned(pf));
-    KASSERT(!pframe_is_free(pf));
-    if (pframe_is_busy(pf)) {
-      sched_sleep_on(&pf->pf_waitq);
-      goto list_start;
-    }
-    if (pframe_is_dirty(pf)) {
-      pframe_clean(pf);
-      goto list_start;
+  for (l = 0; l < 2; ++l) {
+    list_iterate_begin(lists[l], pf, pframe_t, pf_link) {
+      KASSERT(!pframe_is_pinned(pf));
+      KASSERT(!pframe_is_free(pf));
+      if (pframe_is_busy(pf)) {
+        sched_sleep_on(pframe_waitq(pf));
+        goto list_start;
+      }
+      /* A long run of clean pages would otherwise hold everyone up */
+      if (cond_resched())
+        goto list_start;
+      if (pframe_is_dirty(pf) && !pframe_writeback_deferred(pf)) {
+        if (!pframe_writeback()) {
+          /* Nothing could be cleaned right now (e.g. the pages' files
+           * are in use); let whoever is holding them up run */
+          sched_make_runnable(curthr);
+          sched_switch();
+        }
+        goto list_start;
+      }
     }
+    list_iterate_end();
   }
-  list_iterate_end();
 
   /* In theory, this function might never terminate (if new pages are
    * constantly being added at the same time). That's why the user shouldn't
@@ -543,8 +1333,83 @@ list_start:
  * To do that, traverse all processes that map the given page frame into
  * their address space, and zero the corresponding address entry.
  */
-void pframe_remove_from_pts(pframe_t *pf) {
+static void pframe_rmap_free(pframe_rmap_t *rm) {
+  list_remove(&rm->pr_plink);
+  list_remove(&rm->pr_vlink);
+  slab_obj_free(pframe_rmap_allocator, rm);
+}
+
+/* Records that the page has been mapped at vaddr in the given area */
+void pframe_add_mapping(pframe_t *pf, vmarea_t *vma, uintptr_t vaddr) {
+  pframe_rmap_t *rm;
+
+  list_iterate_begin(&pf->pf_rmaps, rm, pframe_rmap_t, pr_plink) {
+    if (rm->pr_vma == vma && rm->pr_vaddr == vaddr)
+      return;
+  }
+  list_iterate_end();
+  if (NULL == (rm = slab_obj_alloc(pframe_rmap_allocator))) {
+    /* The mapping can still be found by searching the object's areas */
+    pf->pf_flags |= PF_RMAP_LOST;
+    return;
+  }
+  rm->pr_vma = vma;
+  rm->pr_vaddr = vaddr;
+  list_insert_tail(&pf->pf_rmaps, &rm->pr_plink);
+  list_insert_tail(&vma->vma_rmaps, &rm->pr_vlink);
+}
+
+/* Forgets the mappings in an area which is going away */
+void pframe_remove_mappings(vmarea_t *vma) {
+  pframe_rmap_t *rm;
+
+  list_iterate_begin(&vma->vma_rmaps, rm, pframe_rmap_t, pr_vlink) {
+    pframe_rmap_free(rm);
+  }
+  list_iterate_end();
+}
+
+/* Moves the mappings of an area which lie in another, split off from it,
+ * to that one */
+void pframe_split_mappings(vmarea_t *vma, vmarea_t *split) {
+  uintptr_t lo = (uintptr_t)PN_TO_ADDR(split->vma_start);
+  uintptr_t hi = (uintptr_t)PN_TO_ADDR(split->vma_end);
+  pframe_rmap_t *rm;
+
+  list_iterate_begin(&vma->vma_rmaps, rm, pframe_rmap_t, pr_vlink) {
+    if (lo <= rm->pr_vaddr && rm->pr_vaddr < hi) {
+      list_remove(&rm->pr_vlink);
+      rm->pr_vma = split;
+      list_insert_tail(&split->vma_rmaps, &rm->pr_vlink);
+    }
+  }
+  list_iterate_end();
+}
+
+/* Removes the page from the page tables of every area mapping it, adding
+ * the addresses it had in the running process to the batch */
+static void pframe_unmap(pframe_t *pf, tlb_batch_t *tb) {
+  uintptr_t paddr = pt_virt_to_phys((uintptr_t)pf->pf_addr);
+  pframe_rmap_t *rm;
   vmarea_t *vma;
+  proc_t *p;
+
+  list_iterate_begin(&pf->pf_rmaps, rm, pframe_rmap_t, pr_plink) {
+    p = rm->pr_vma->vma_vmmap->vmm_proc;
+    if (NULL != p && paddr == pt_lookup(p->p_pagedir, rm->pr_vaddr)) {
+      pt_unmap(p->p_pagedir, rm->pr_vaddr);
+      /* The stale entry may be cached if the proc's directory is loaded */
+      if (pt_get() == p->p_pagedir)
+        tlb_batch_add(tb, rm->pr_vaddr);
+    }
+    pframe_rmap_free(rm);
+  }
+  list_iterate_end();
+  if (!(pf->pf_flags & PF_RMAP_LOST))
+    return;
+
+  /* Otherwise look through every area the page could be mapped in */
+  pf->pf_flags &= ~PF_RMAP_LOST;
   list_iterate_begin(mmobj_bottom_vmas(pf->pf_obj), vma, vmarea_t, vma_olink) {
     /* Get the virtual address in the area corresponding to this pf */
     if ((pf->pf_pagenum >= vma->vma_off) &&
@@ -552,14 +1417,25 @@ void pframe_remove_from_pts(pframe_t *pf) {
       uintptr_t vaddr =
           (uintptr_t)PN_TO_ADDR(vma->vma_start + pf->pf_pagenum - vma->vma_off);
       /* And unmap it from that area's proc */
-      if (NULL != vma->vma_vmmap->vmm_proc) {
-        pt_unmap(vma->vma_vmmap->vmm_proc->p_pagedir, vaddr);
+      if (NULL != (p = vma->vma_vmmap->vmm_proc) &&
+          paddr == pt_lookup(p->p_pagedir, vaddr)) {
+        pt_unmap(p->p_pagedir, vaddr);
+        if (pt_get() == p->p_pagedir)
+          tlb_batch_add(tb, vaddr);
       }
     }
   }
   list_iterate_end();
 }
 
+void pframe_remove_from_pts(pframe_t *pf) {
+  tlb_batch_t tb;
+
+  tlb_batch_init(&tb);
+  pframe_unmap(pf, &tb);
+  tlb_batch_flush(&tb);
+}
+
 /* ------------------------------------------------------------------ */
 /* ------------------------- PAGEOUT DAEMON ------------------------- */
 /* ------------------------------------------------------------------ */
@@ -596,8 +1472,10 @@ static void pageoutd_exit() {
 }
 
 /*
- * The pageout daemon, when run, gets the least-recently-requested page from the
- * list of pages which are available to be paged out. Make sure to check if the
+ * The pageout daemon, when run, first has the registered shrinkers (see
+ * mm/shrinker.h) trim their caches, then gets the least valuable page (see
+ * pframe_reclaim_candidate) from the pages which are available to be paged
+ * out. Make sure to check if the
  * page is busy before yanking it. If the page you select is dirty, make sure
  * to clean it before yanking it. Finally, go back to sleep after having paged
  * out the appropriate page.
@@ -606,40 +1484,235 @@ static void pageoutd_exit() {
 static void *pageoutd_run(int arg1, void *arg2) {
   while (1) {
     KASSERT(nallocated >= 0);
-    while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
+    pageoutd_nruns++;
+    /* let the other caches give back their share before evicting pages */
+    if (!pageoutd_target_met()) {
+      uint32_t want = nfreepages_high + nreserved + nwaiting -
+                      page_free_count();
+      pframe_grant(1);
+      shrinkers_run(want, nallocated);
+    }
+    while ((!pageoutd_target_met()) && (0 < nallocated)) {
       pframe_t *pf;
 
-      /* obtain least-recently-requested page: */
-      pf = list_head(&alloc_list, pframe_t, pf_link);
+      /* obtain the least valuable page: */
+      pf = pframe_reclaim_candidate();
 
       if (pframe_is_busy(pf)) {
-        sched_sleep_on(&pf->pf_waitq);
+        pframe_grant(1);
+        sched_sleep_on(pframe_waitq(pf));
       } else if (pframe_is_dirty(pf)) {
-        pframe_clean(pf);
+        /* clean it along with any other dirty pages near it; if it
+         * can't be cleaned right now, try the others first */
+        pframe_grant(1);
+        if (!pframe_writeback()) {
+          /* we may have blocked, so look at the head afresh */
+          if (!list_empty(&inactive_list) &&
+              pframe_is_dirty(pf = list_head(&inactive_list, pframe_t,
+                                             pf_link))) {
+            list_remove(&pf->pf_link);
+            list_insert_tail(&inactive_list, &pf->pf_link);
+          }
+          sched_make_runnable(curthr);
+          sched_switch();
+        }
       } else {
-        /* it's not busy, it's clean, and it's
-         * least-recently-requested; reclaim it: */
+        /* it's not busy, it's clean, and it's the least valuable page;
+         * reclaim it: */
         pframe_free(pf);
+        pframe_nevictions++;
+        pframe_grant(0);
       }
     }
 
-    /*   release the thundering herd... */
-    sched_broadcast_on(&alloc_waitq);
+    /* with nothing left to evict, let go of anyone still waiting */
+    pframe_grant(1);
 
     dbg(DBG_PFRAME, "PAGEOUT DEMAON: Falling asleep\n");
     dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
                     "nfreepages_min=|%d| "
+                    "nfreepages_low=|%d| "
+                    "nfreepages_high=|%d| "
                     "page_free_count=|%d|\n",
-        nfreepages_target, nfreepages_min, page_free_count());
+        nfreepages_min, nfreepages_low, nfreepages_high, page_free_count());
     if (sched_cancellable_sleep_on(&pageoutd_waitq))
       kthread_exit((void *)0);
     dbg(DBG_PFRAME, "PAGEOUT DEMAON: Waking up\n");
     dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
                     "nfreepages_min=|%d| "
+                    "nfreepages_low=|%d| "
+                    "nfreepages_high=|%d| "
                     "page_free_count=|%d|\n",
-        nfreepages_target, nfreepages_min, page_free_count());
+        nfreepages_min, nfreepages_low, nfreepages_high, page_free_count());
+  }
+  return NULL;
+}
+
+size_t pframe_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "resident %d\n", nallocated);
+  iprintf(&buf, &size, "kmem %u\n", slab_npages());
+  iprintf(&buf, &size, "free %u\n", page_free_count());
+  iprintf(&buf, &size, "hits %u\n", pframe_nhits);
+  iprintf(&buf, &size, "misses %u\n", pframe_nmisses);
+  iprintf(&buf, &size, "evictions %u\n", pframe_nevictions);
+  iprintf(&buf, &size, "relocations %u\n", pframe_nrelocated);
+  iprintf(&buf, &size, "pageoutd_runs %u\n", pageoutd_nruns);
+  iprintf(&buf, &size, "dirty %d\n", ndirty);
+  iprintf(&buf, &size, "dirty_limits %d %d\n", ndirty_background,
+          ndirty_limit);
+  iprintf(&buf, &size, "writeback_rate %u\n", pframe_wb_rate);
+  iprintf(&buf, &size, "dirty_throttles %u\n", pframe_nthrottles);
+  iprintf(&buf, &size, "watermarks %u %u %u\n", nfreepages_min,
+          nfreepages_low, nfreepages_high);
+  iprintf(&buf, &size, "direct_reclaims %u\n", pframe_ndirect);
+  iprintf(&buf, &size, "alloc_waits %u\n", pframe_nwaits);
+  iprintf(&buf, &size, "alloc_waiting %u\n", nwaiting);
+  return size;
+}
+
+/* Objects pframe_obj_info lists apart; pages of any others are added up
+ * on one line */
+#define PF_OBJ_INFO_MAX 32
+
+typedef struct pframe_obj_count {
+  mmobj_t *oc_obj; /* NULL for the rest */
+  int oc_resident;
+  int oc_active;
+  int oc_dirty;
+  int oc_pinned;
+} pframe_obj_count_t;
+
+size_t pframe_obj_info(const void *arg, char *buf, size_t osize) {
+  pframe_obj_count_t counts[PF_OBJ_INFO_MAX + 1], tmp, *oc = NULL;
+  list_t *lists[] = {&inactive_list, &active_list, &pinned_list};
+  size_t size = osize;
+  vnode_t *vn;
+  pframe_t *pf;
+  int n = 0, i, j, l;
+
+  KASSERT(NULL == arg);
+  memset(&counts[PF_OBJ_INFO_MAX], 0, sizeof(pframe_obj_count_t));
+
+  /* One pass over the resident pages, which neither blocks nor lets
+   * anything else run, so the counts are all of the same moment. Runs
+   * of pages usually belong to one object, so try the last one first. */
+  for (l = 0; l < 3; ++l) {
+    list_iterate_begin(lists[l], pf, pframe_t, pf_link) {
+      if (NULL == oc || oc->oc_obj != pf->pf_obj) {
+        for (i = 0; i < n && counts[i].oc_obj != pf->pf_obj; i++)
+          ;
+        if (i == n && n < PF_OBJ_INFO_MAX) {
+          memset(&counts[n], 0, sizeof(pframe_obj_count_t));
+          counts[n++].oc_obj = pf->pf_obj;
+        }
+        oc = i < n ? &counts[i] : &counts[PF_OBJ_INFO_MAX];
+      }
+      oc->oc_resident++;
+      if (pf->pf_flags & PF_ACTIVE)
+        oc->oc_active++;
+      if (pframe_is_dirty(pf))
+        oc->oc_dirty++;
+      if (pframe_is_pinned(pf))
+        oc->oc_pinned++;
+    }
+    list_iterate_end();
+  }
+
+  /* Biggest first */
+  for (i = 1; i < n; i++) {
+    tmp = counts[i];
+    for (j = i; j > 0 && counts[j - 1].oc_resident < tmp.oc_resident; --j)
+      counts[j] = counts[j - 1];
+    counts[j] = tmp;
+  }
+  if (counts[PF_OBJ_INFO_MAX].oc_resident)
+    counts[n++] = counts[PF_OBJ_INFO_MAX];
+
+  iprintf(&buf, &size, "%-10s %-8s %8s %8s %8s %8s  %s\n", "MMOBJ", "KIND",
+          "RESIDENT", "ACTIVE", "DIRTY", "PINNED", "FILE");
+  for (i = 0; i < n; i++) {
+    oc = &counts[i];
+    if (NULL == oc->oc_obj) {
+      iprintf(&buf, &size, "%-10s %-8s", "-", "other");
+    } else {
+      iprintf(&buf, &size, "0x%p %-8s", oc->oc_obj,
+              oc->oc_obj->mmo_ops->name);
+    }
+    iprintf(&buf, &size, " %8d %8d %8d %8d", oc->oc_resident, oc->oc_active,
+            oc->oc_dirty, oc->oc_pinned);
+    if (NULL != oc->oc_obj && NULL != (vn = vnode_of_mmobj(oc->oc_obj)))
+      iprintf(&buf, &size, "  %s:%u", vn->vn_fs->fs_dev, vn->vn_vno);
+    iprintf(&buf, &size, "\n");
+  }
+  return size;
+}
+
+uint32_t pframe_miss_count() { return pframe_nmisses; }
+
+void pframe_kmem_pressure() {
+  if (NULL != pageoutd_thr && pageoutd_needed())
+    pageoutd_wakeup();
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------- FLUSHER DAEMON ------------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Start the flusher daemon, which writes dirty pages back in the
+ * background so that pageoutd and sync(2) find mostly clean pages.
+ */
+static __attribute__((unused)) void pflushd_init(void) {
+  sched_queue_init(&pflushd_waitq);
+  timer_init(&pflushd_timer, pflushd_timeout, NULL);
+
+  KASSERT(curproc && (PID_IDLE == curproc->p_pid) &&
+          "should be calling this from idleproc");
+  pflushd = proc_create("pflushd");
+  KASSERT(NULL != pflushd);
+  pflushd_thr = kthread_create(pflushd, pflushd_run, 0, NULL);
+  KASSERT(NULL != pflushd_thr);
+
+  sched_make_runnable(pflushd_thr);
+}
+init_func(pflushd_init);
+init_depends(sched_init);
+init_depends(time_init);
+
+/* Runs in interrupt context */
+static void pflushd_timeout(void *arg) {
+  pflushd_expired = 1;
+  pflushd_wakeup();
+}
+
+/*
+ * The flusher daemon is woken once ndirty_background pages are dirty, and
+ * writes back batches of them until under half that many remain. It is
+ * also woken PFLUSHD_INTERVAL_MSECS after a page is dirtied while the
+ * timer is idle, and then writes back everything it can.
+ * Both arguments unused.
+ */
+static void *pflushd_run(int arg1, void *arg2) {
+  while (1) {
+    /* with writers held at the limit, keep going until they are let go,
+     * though a file system's share may be what holds them */
+    while ((ndirty > ndirty_background / 2 || pframe_nthrottled) &&
+           pframe_writeback())
+      ;
+    if (pflushd_expired) {
+      pflushd_expired = 0;
+      while (ndirty && pframe_writeback())
+        ;
+      /* Whatever was busy gets another interval */
+      if (ndirty && !timer_pending(&pflushd_timer))
+        pflushd_arm();
+    }
+    dbg(DBG_PFRAME, "PFLUSHD: Falling asleep, %d dirty pages\n", ndirty);
+    if (sched_cancellable_sleep_on(&pflushd_waitq))
+      kthread_exit((void *)0);
   }
   return NULL;
 }
@@ -0,0 +1,62 @@
+#include "types.h"
+#include "kernel.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#include "mm/page.h"
+#include "mm/shrinker.h"
+#include "mm/slab.h"
+
+static list_t shrinkers;
+
+static __attribute__((unused)) void shrinker_init(void) {
+  list_init(&shrinkers);
+}
+init_func(shrinker_init);
+
+void shrinker_register(shrinker_t *sh) {
+  list_insert_tail(&shrinkers, &sh->sh_link);
+}
+
+void shrinker_unregister(shrinker_t *sh) {
+  KASSERT(list_link_is_linked(&sh->sh_link));
+  list_remove(&sh->sh_link);
+}
+
+uint32_t shrinkers_run(uint32_t need, uint32_t nlru) {
+  shrinker_t *sh;
+  uint32_t total = nlru, nfreed = 0, before = page_free_count();
+  uint32_t count, share, nr, reclaimed;
+  int nslab;
+
+  list_iterate_begin(&shrinkers, sh, shrinker_t, sh_link) {
+    total += sh->sh_count();
+  }
+  list_iterate_end();
+  if (0 == total)
+    return 0;
+
+  /* Each asks for a fresh count, since an earlier one may have blocked.
+   * Nothing here unregisters a shrinker, so the list is stable. */
+  list_iterate_begin(&shrinkers, sh, shrinker_t, sh_link) {
+    if (0 == (count = sh->sh_count()))
+      continue;
+    /* the cache's share of the shortfall, in 1024ths to stay within 32
+     * bits, rounded up so that a small cache still gives something */
+    share = (count << 10) / total;
+    nr = MIN(count, MAX(1, (need * share + 1023) >> 10));
+    reclaimed = sh->sh_scan(nr);
+    dbg(DBG_MM, "shrinker %s: asked for %u of %u, gave back %u\n",
+        sh->sh_name, nr, count, reclaimed);
+    nfreed += reclaimed;
+  }
+  list_iterate_end();
+
+  /* Objects given back to slabs only become pages once a slab empties */
+  if (page_free_count() < before + need &&
+      0 < (nslab = slab_allocators_reclaim(before + need - page_free_count())))
+    nfreed += nslab;
+  return nfreed;
+}
@@ -6,10 +6,32 @@
  * (used in Solaris and Linux) from UNIX Internals: The New Frontiers,
  * by Uresh Vahalia.
  *
- * Note that there is no need for locking in allocation and deallocation because
- * it never blocks nor is used by an interrupt handler. Hurray for non
- *preemptible
- * kernels!
+ * Allocation and deallocation never block, but kmalloc is called from
+ * interrupt context (the tty's receive path), so each allocator is
+ * protected by a spinlock (sa_lock) taken with interrupts masked. No lock
+ * is held while pages are allocated for a new slab or magazine: page
+ * allocation may call slab_allocators_reclaim, or sleep. The only nesting
+ * is an allocator's lock followed by that of slab_magazine_allocator,
+ * when slab_allocators_reclaim frees an allocator's magazines; and since
+ * reclaim may be called from within an allocator (when a constructor or
+ * destructor allocates), it passes over allocators whose lock is held.
+ *
+ * Each allocator keeps its slabs on three lists (full, partially used, and
+ * empty), so finding a free object never has to search. In front of the
+ * slabs sits a magazine layer as described by Bonwick and Adams ("Magazines
+ * and Vmem", USENIX 2001): a magazine is a small stack of free objects, and
+ * each CPU (there is only one for now) has a loaded and a previous magazine
+ * from which most allocations and frees are satisfied without touching a
+ * slab at all. Full and empty magazines are exchanged with a per-allocator
+ * depot, which slab_allocators_reclaim() drains back into the slabs.
+ *
+ * Whatever a slab's page block has left over after its objects goes in
+ * front of them, a cache line more in each new slab than in the last
+ * (wrapping around), so that the same field of objects in different
+ * slabs doesn't always land in the same cache sets. An allocator may have
+ * a constructor, run on each object when its slab is made, and a
+ * destructor, run when the slab is freed; objects are handed back to the
+ * allocator in their constructed state, so nothing is run in between.
  */
 
 #include "types.h"
@@ -17,10 +39,16 @@
 #include "mm/mm.h"
 #include "mm/slab.h"
 #include "mm/page.h"
+#include "mm/pframe.h"
 
 #include "util/gdb.h"
+#include "util/time.h"
+
+#include "proc/spinlock.h"
 #include "util/string.h"
 #include "util/debug.h"
+#include "util/list.h"
+#include "util/printf.h"
 
 #ifdef SLAB_REDZONE
 #define front_rz(obj) (*(uintptr_t *)(obj))
@@ -35,22 +63,60 @@
       panic("alloc: red-zone check failed: *(0x%p)=0x%.8x\n",                  \
             &rear_rz(cache, obj), rear_rz(cache, obj));                        \
   } while (0);
+#define user_obj(obj) ((void *)((uintptr_t)(obj) + sizeof(SLAB_REDZONE)))
+#define slab_obj(obj) ((void *)((uintptr_t)(obj) - sizeof(SLAB_REDZONE)))
+#else
+#define user_obj(obj) (obj)
+#define slab_obj(obj) (obj)
 #endif
 
+/* Most objects a magazine holds, and the largest objects we keep in
+ * magazines at all. Allocators for objects bigger than
+ * SLAB_MAGAZINE_BYTES / SLAB_MAGAZINE_SIZE get proportionally smaller
+ * magazines so that no more than SLAB_MAGAZINE_BYTES sit in any one. */
+#define SLAB_MAGAZINE_SIZE 15
+#define SLAB_MAGAZINE_BYTES (16 * 1024)
+
+/* Slabs' colour offsets are multiples of this */
+#define SLAB_COLOR_ALIGN 64
+
 struct slab {
-  struct slab *s_next; /* link on list of slabs */
-  int s_inuse;         /* number of allocated objs */
-  void *s_free;        /* head of obj free list */
-  void *s_addr;        /* start address */
+  list_link_t s_link; /* link on one of the allocator's slab lists */
+  int s_inuse;        /* number of allocated objs */
+  void *s_free;       /* head of obj free list */
+  void *s_addr;       /* start address of the page block */
+  uint32_t s_color;   /* offset of the first obj from s_addr */
+};
+
+struct slab_magazine {
+  struct slab_magazine *m_next; /* link in the depot */
+  int m_rounds;                 /* number of objs in m_objs */
+  void *m_objs[SLAB_MAGAZINE_SIZE];
 };
 
 struct slab_allocator {
   struct slab_allocator *sa_next; /* link on list of slab allocators */
   const char *sa_name;            /* user-provided name */
   size_t sa_objsize;              /* object size */
-  struct slab *sa_slabs;          /* head of slab list */
+  list_t sa_full;                 /* slabs with no free objs */
+  list_t sa_partial;              /* slabs with some free objs */
+  list_t sa_empty;                /* slabs with no allocated objs */
   int sa_order;                   /* npages = (1 << order) */
   int sa_slab_nobjs;              /* number of objs per slab */
+  uint32_t sa_ncolors;            /* colour offsets the leftover allows */
+  uint32_t sa_color;              /* and the one the next slab gets */
+  void (*sa_ctor)(void *obj);     /* or NULL */
+  void (*sa_dtor)(void *obj);     /* or NULL */
+  spinlock_t sa_lock;             /* protects everything below */
+  uint32_t sa_nallocs;            /* objs ever handed out */
+  uint32_t sa_nfrees;             /* and given back */
+
+  /* Magazine layer */
+  int sa_magsize;                      /* rounds per magazine, 0 for none */
+  struct slab_magazine *sa_loaded;     /* per-CPU magazines */
+  struct slab_magazine *sa_previous;
+  struct slab_magazine *sa_depot_full; /* depot */
+  struct slab_magazine *sa_depot_empty;
 };
 
 struct slab_bufctl {
@@ -61,6 +127,10 @@ struct slab_bufctl {
 #ifdef SLAB_CHECK_FREE
   uint8_t sb_free; /* true if is object is free */
 #endif
+#if KMEM_PROFILE
+  uint16_t sb_site;  /* kmem_sites index of who allocated it */
+  uint32_t sb_born;  /* and the tick it was allocated at */
+#endif
 };
 #define sb_next u.sb_next
 #define sb_slab u.sb_slab
@@ -76,12 +146,73 @@ struct slab_bufctl {
 GDB_DEFINE_HOOK(slab_obj_alloc, void *addr, struct slab_allocator *allocator)
 GDB_DEFINE_HOOK(slab_obj_free, void *addr, struct slab_allocator *allocator)
 
+#if KMEM_PROFILE
+/* An open addressed hash table on the call site, see slab.h */
+kmem_site_t kmem_sites[KMEM_PROFILE_SITES + 1];
+static spinlock_t kmem_sites_lock;
+
+/* Counts an allocation of size bytes from pc, returning its site */
+static uint16_t _kmem_profile_alloc(uintptr_t pc, size_t size) {
+  uint32_t i, n;
+  kmem_site_t *ks;
+  uint8_t ipl;
+
+  ipl = spin_lock_irqsave(&kmem_sites_lock);
+  i = (pc >> 2) & (KMEM_PROFILE_SITES - 1);
+  for (n = 0; n < KMEM_PROFILE_SITES; ++n) {
+    if (kmem_sites[i].ks_pc == pc || !kmem_sites[i].ks_pc)
+      break;
+    i = (i + 1) & (KMEM_PROFILE_SITES - 1);
+  }
+  if (n == KMEM_PROFILE_SITES)
+    i = KMEM_PROFILE_SITES;
+  ks = &kmem_sites[i];
+  if (i < KMEM_PROFILE_SITES)
+    ks->ks_pc = pc;
+  ks->ks_allocs++;
+  ks->ks_bytes += size;
+  ks->ks_peak_bytes = MAX(ks->ks_peak_bytes, ks->ks_bytes);
+  spin_unlock_irqrestore(&kmem_sites_lock, ipl);
+  return i;
+}
+
+static void _kmem_profile_free(uint16_t site, size_t size, uint32_t born) {
+  unsigned long life = time_ticks() - born;
+  int bucket = 0;
+  kmem_site_t *ks = &kmem_sites[site];
+  uint8_t ipl;
+
+  while (life && bucket < KMEM_PROFILE_NLIFE - 1) {
+    bucket++;
+    life >>= 2;
+  }
+  ipl = spin_lock_irqsave(&kmem_sites_lock);
+  ks->ks_frees++;
+  ks->ks_bytes -= size;
+  ks->ks_life[bucket]++;
+  spin_unlock_irqrestore(&kmem_sites_lock, ipl);
+}
+#endif
+
 /* Head of global list of slab allocators. */
 static struct slab_allocator *slab_allocators = NULL;
 
 /* Special case - allocator for allocation of slab_allocator objects. */
 static struct slab_allocator slab_allocator_allocator;
 
+/* Allocator for magazines, which does not use magazines itself. */
+static struct slab_allocator *slab_magazine_allocator = NULL;
+
+/*
+ * Pages held by slabs and by kmalloc directly. They come from the same
+ * free lists as the page cache's, with no share of memory set aside for
+ * either: each time the heap takes pages, the page cache is told, so
+ * that pageoutd can give some of its pages up if free memory is short,
+ * and under pressure pageoutd takes empty slabs back through the
+ * shrinkers.
+ */
+static uint32_t kmem_npages = 0;
+
 /*
  * This constant defines how many orders of magnitude (in page block
  * sizes) we'll search for an optimal slab size (past the smallest
@@ -146,10 +277,14 @@ static void _calc_slab_size(struct slab_allocator *allocator) {
   */
   allocator->sa_order = best_order;
   allocator->sa_slab_nobjs = _slab_nobjs(allocator->sa_objsize, best_order);
+  allocator->sa_ncolors =
+      _slab_waste(allocator->sa_objsize, best_order) / SLAB_COLOR_ALIGN + 1;
+  allocator->sa_color = 0;
 }
 
 static void _allocator_init(struct slab_allocator *allocator, const char *name,
-                            size_t size) {
+                            size_t size, void (*ctor)(void *),
+                            void (*dtor)(void *)) {
 #ifdef SLAB_REDZONE
   /*
    * Add space for the front and rear red-zones.
@@ -162,9 +297,22 @@ static void _allocator_init(struct slab_allocator *allocator, const char *name,
 
   allocator->sa_name = name;
   allocator->sa_objsize = size;
-  allocator->sa_slabs = NULL;
+  allocator->sa_ctor = ctor;
+  allocator->sa_dtor = dtor;
+  spinlock_init(&allocator->sa_lock, name);
+  list_init(&allocator->sa_full);
+  list_init(&allocator->sa_partial);
+  list_init(&allocator->sa_empty);
   _calc_slab_size(allocator);
 
+  allocator->sa_magsize = MIN(SLAB_MAGAZINE_SIZE, SLAB_MAGAZINE_BYTES / size);
+  allocator->sa_loaded = NULL;
+  allocator->sa_previous = NULL;
+  allocator->sa_depot_full = NULL;
+  allocator->sa_depot_empty = NULL;
+  allocator->sa_nallocs = 0;
+  allocator->sa_nfrees = 0;
+
   /* Add cache to global cache list. */
   allocator->sa_next = slab_allocators;
   slab_allocators = allocator;
@@ -175,9 +323,14 @@ static void _allocator_init(struct slab_allocator *allocator, const char *name,
   dbgq(DBG_MM, "  Object Size:   %d\n", allocator->sa_objsize);
   dbgq(DBG_MM, "  Order:         %d\n", allocator->sa_order);
   dbgq(DBG_MM, "  Slab Capacity: %d\n", allocator->sa_slab_nobjs);
+  dbgq(DBG_MM, "  Colours:       %d\n", allocator->sa_ncolors);
+  dbgq(DBG_MM, "  Magazine Size: %d\n", allocator->sa_magsize);
 }
 
-struct slab_allocator *slab_allocator_create(const char *name, size_t size) {
+struct slab_allocator *slab_allocator_create_ctor(const char *name,
+                                                  size_t size,
+                                                  void (*ctor)(void *),
+                                                  void (*dtor)(void *)) {
   struct slab_allocator *allocator;
 
   allocator =
@@ -185,23 +338,41 @@ struct slab_allocator *slab_allocator_create(const char *name, size_t size) {
   if (!allocator)
     return NULL;
 
-  _allocator_init(allocator, name, size);
+  _allocator_init(allocator, name, size, ctor, dtor);
   return allocator;
 }
 
-static int _slab_allocator_grow(struct slab_allocator *allocator) {
+struct slab_allocator *slab_allocator_create(const char *name, size_t size) {
+  return slab_allocator_create_ctor(name, size, NULL, NULL);
+}
+
+/*
+ * Adds an empty slab to the allocator. Called with sa_lock held, which is
+ * let go (restoring the IPL it was taken at, *ipl) while the pages are
+ * allocated and the slab is set up, and taken again before returning.
+ */
+static int _slab_allocator_grow(struct slab_allocator *allocator,
+                                uint8_t *ipl) {
   void *addr;
   void *obj;
   int ii, npages;
+  uint32_t color;
   struct slab *slab;
 
   npages = 1 << allocator->sa_order;
+  color = allocator->sa_color * SLAB_COLOR_ALIGN;
+  allocator->sa_color = (allocator->sa_color + 1) % allocator->sa_ncolors;
+
+  spin_unlock_irqrestore(&allocator->sa_lock, *ipl);
   addr = page_alloc_n(npages);
-  if (!addr)
+  pframe_kmem_pressure();
+  if (!addr) {
+    *ipl = spin_lock_irqsave(&allocator->sa_lock);
     return 0;
+  }
 
   /* Initialize each bufctl to be free and point to the next object. */
-  obj = addr;
+  obj = (char *)addr + color;
   for (ii = 0; ii < (allocator->sa_slab_nobjs - 1); ii++) {
 #ifdef SLAB_CHECK_FREE
     obj_bufctl(allocator, obj)->sb_free = 1;
@@ -219,20 +390,23 @@ static int _slab_allocator_grow(struct slab_allocator *allocator) {
   slab = (struct slab *)next_obj(allocator, obj);
 
   /*
-   * The first object in the slab will be the head of the free
-   * list and the start address of the slab.
+   * The first object in the slab, past the colour offset, will be the
+   * head of the free list.
    */
-  slab->s_free = addr;
+  slab->s_free = (char *)addr + color;
   slab->s_addr = addr;
+  slab->s_color = color;
   slab->s_inuse = 0;
 
   /* Initialize objects. */
-  obj = addr;
+  obj = slab->s_free;
   for (ii = 0; ii < allocator->sa_slab_nobjs; ii++) {
 #ifdef SLAB_REDZONE
     front_rz(obj) = SLAB_REDZONE;
     rear_rz(allocator, obj) = SLAB_REDZONE;
 #endif
+    if (allocator->sa_ctor)
+      allocator->sa_ctor(user_obj(obj));
     obj = next_obj(allocator, obj);
   }
 
@@ -240,27 +414,31 @@ static int _slab_allocator_grow(struct slab_allocator *allocator) {
               "(%d pages)\n",
       allocator->sa_name, allocator, slab, 1 << allocator->sa_order);
 
-  /* Place this slab into the cache. */
-  slab->s_next = allocator->sa_slabs;
-  allocator->sa_slabs = slab;
+  /* Let kfree find the slab, and place it into the cache. */
+  page_set_owner(addr, npages, allocator);
+  *ipl = spin_lock_irqsave(&allocator->sa_lock);
+  kmem_npages += npages;
+  list_insert_head(&allocator->sa_empty, &slab->s_link);
 
   return 1;
 }
 
-void *slab_obj_alloc(struct slab_allocator *allocator) {
+/*
+ * Allocate an object straight from the slabs, bypassing the magazines.
+ * Called with sa_lock held, taken at *ipl; see _slab_allocator_grow.
+ */
+static void *_slab_obj_alloc(struct slab_allocator *allocator, uint8_t *ipl) {
   struct slab *slab;
   void *obj;
 
-  /* Find a slab with a free object. */
-  for (;;) {
-    slab = allocator->sa_slabs;
-    while (slab && (slab->s_inuse == allocator->sa_slab_nobjs))
-      slab = slab->s_next;
-    if (slab && (slab->s_inuse < allocator->sa_slab_nobjs))
-      break;
-    if (!_slab_allocator_grow(allocator))
-      return NULL;
-  }
+  /* Prefer partially used slabs, so that empty ones can be reclaimed. */
+  if (list_empty(&allocator->sa_partial) && list_empty(&allocator->sa_empty) &&
+      !_slab_allocator_grow(allocator, ipl))
+    return NULL;
+  if (!list_empty(&allocator->sa_partial))
+    slab = list_head(&allocator->sa_partial, struct slab, s_link);
+  else
+    slab = list_head(&allocator->sa_empty, struct slab, s_link);
 
   /*
    * Remove an object from the slab's free list.  We'll use the
@@ -274,38 +452,43 @@ void *slab_obj_alloc(struct slab_allocator *allocator) {
   obj_bufctl(allocator, obj)->sb_free = 0;
 #endif
 
-  slab->s_inuse++;
+  /* Move the slab to the list matching its new state. */
+  if (++slab->s_inuse == allocator->sa_slab_nobjs) {
+    list_remove(&slab->s_link);
+    list_insert_head(&allocator->sa_full, &slab->s_link);
+  } else if (1 == slab->s_inuse) {
+    list_remove(&slab->s_link);
+    list_insert_head(&allocator->sa_partial, &slab->s_link);
+  }
 
   dbg(DBG_MM, "Allocated object 0x%p from \"%s\" (0x%p), "
               "slab 0x%p, inuse %d\n",
-      obj, allocator->sa_name, allocator, allocator, slab->s_inuse);
+      obj, allocator->sa_name, allocator, slab, slab->s_inuse);
 
 #ifdef SLAB_REDZONE
   VERIFY_REDZONES(allocator, obj);
+#endif
 
   /*
    * Make object pointer point past the first red-zone.
    */
-  obj = (void *)((uintptr_t)obj + sizeof(SLAB_REDZONE));
-#endif
-
-  GDB_CALL_HOOK(slab_obj_alloc, obj, allocator);
-  return obj;
+  return user_obj(obj);
 }
 
-void slab_obj_free(struct slab_allocator *allocator, void *obj) {
+/*
+ * Return an object straight to its slab, bypassing the magazines.
+ */
+static void _slab_obj_free(struct slab_allocator *allocator, void *obj) {
   struct slab *slab;
-  GDB_CALL_HOOK(slab_obj_free, obj, allocator);
 
-#ifdef SLAB_REDZONE
-  /* Move pointer back.  See the end of kmem_cache_alloc. */
-  obj = (void *)((uintptr_t)obj - sizeof(SLAB_REDZONE));
+  /* Move pointer back.  See the end of _slab_obj_alloc. */
+  obj = slab_obj(obj);
 
+#ifdef SLAB_REDZONE
   VERIFY_REDZONES(allocator, obj);
 #endif
 
 #ifdef SLAB_CHECK_FREE
-  KASSERT(!obj_bufctl(allocator, obj)->sb_free && "INVALID FREE!");
   obj_bufctl(allocator, obj)->sb_free = 1;
 #endif
 
@@ -315,12 +498,228 @@ void slab_obj_free(struct slab_allocator *allocator, void *obj) {
   obj_bufctl(allocator, obj)->sb_next = slab->s_free;
   slab->s_free = obj;
 
-  slab->s_inuse--;
+  /* Move the slab to the list matching its new state. */
+  if (0 == --slab->s_inuse) {
+    list_remove(&slab->s_link);
+    list_insert_head(&allocator->sa_empty, &slab->s_link);
+  } else if (allocator->sa_slab_nobjs - 1 == slab->s_inuse) {
+    list_remove(&slab->s_link);
+    list_insert_head(&allocator->sa_partial, &slab->s_link);
+  }
 
   dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
       obj, allocator->sa_name, allocator, slab, slab->s_inuse);
 }
 
+/* Magazines come straight from the slabs of slab_magazine_allocator */
+static struct slab_magazine *_magazine_alloc(void) {
+  struct slab_magazine *mag;
+  uint8_t ipl = spin_lock_irqsave(&slab_magazine_allocator->sa_lock);
+  mag = _slab_obj_alloc(slab_magazine_allocator, &ipl);
+  spin_unlock_irqrestore(&slab_magazine_allocator->sa_lock, ipl);
+  return mag;
+}
+
+static void _magazine_free(struct slab_magazine *mag) {
+  uint8_t ipl = spin_lock_irqsave(&slab_magazine_allocator->sa_lock);
+  _slab_obj_free(slab_magazine_allocator, mag);
+  spin_unlock_irqrestore(&slab_magazine_allocator->sa_lock, ipl);
+}
+
+/*
+ * Return every object in the magazine to the slabs.
+ */
+static void _magazine_drain(struct slab_allocator *allocator,
+                            struct slab_magazine *mag) {
+  while (mag->m_rounds)
+    _slab_obj_free(allocator, mag->m_objs[--mag->m_rounds]);
+}
+
+/* slab_obj_alloc, counting the object against pc */
+static void *_slab_obj_alloc_from(struct slab_allocator *allocator,
+                                  uintptr_t pc) {
+  struct slab_magazine *mag;
+  void *obj;
+  uint8_t ipl;
+
+  ipl = spin_lock_irqsave(&allocator->sa_lock);
+  if (!allocator->sa_loaded || !allocator->sa_loaded->m_rounds) {
+    if (allocator->sa_previous && allocator->sa_previous->m_rounds) {
+      /* Previous magazine has objects, use it */
+      mag = allocator->sa_loaded;
+      allocator->sa_loaded = allocator->sa_previous;
+      allocator->sa_previous = mag;
+    } else if (NULL != (mag = allocator->sa_depot_full)) {
+      /* Trade the empty previous magazine for a full one */
+      allocator->sa_depot_full = mag->m_next;
+      if (allocator->sa_previous) {
+        allocator->sa_previous->m_next = allocator->sa_depot_empty;
+        allocator->sa_depot_empty = allocator->sa_previous;
+      }
+      allocator->sa_previous = allocator->sa_loaded;
+      allocator->sa_loaded = mag;
+    }
+  }
+
+  if (allocator->sa_loaded && allocator->sa_loaded->m_rounds) {
+    obj = allocator->sa_loaded->m_objs[--allocator->sa_loaded->m_rounds];
+#ifdef SLAB_CHECK_FREE
+    obj_bufctl(allocator, slab_obj(obj))->sb_free = 0;
+#endif
+  } else if (NULL == (obj = _slab_obj_alloc(allocator, &ipl))) {
+    spin_unlock_irqrestore(&allocator->sa_lock, ipl);
+    return NULL;
+  }
+  allocator->sa_nallocs++;
+  spin_unlock_irqrestore(&allocator->sa_lock, ipl);
+
+#if KMEM_PROFILE
+  obj_bufctl(allocator, slab_obj(obj))->sb_site =
+      _kmem_profile_alloc(pc, allocator->sa_objsize);
+  obj_bufctl(allocator, slab_obj(obj))->sb_born = time_ticks();
+#endif
+  GDB_CALL_HOOK(slab_obj_alloc, obj, allocator);
+  return obj;
+}
+
+void *slab_obj_alloc(struct slab_allocator *allocator) {
+  return _slab_obj_alloc_from(allocator,
+                              (uintptr_t)__builtin_return_address(0));
+}
+
+void slab_obj_free(struct slab_allocator *allocator, void *obj) {
+  struct slab_magazine *mag;
+  uint8_t ipl;
+  GDB_CALL_HOOK(slab_obj_free, obj, allocator);
+
+#ifdef SLAB_REDZONE
+  VERIFY_REDZONES(allocator, slab_obj(obj));
+#endif
+
+#ifdef SLAB_CHECK_FREE
+  KASSERT(!obj_bufctl(allocator, slab_obj(obj))->sb_free && "INVALID FREE!");
+#endif
+#if KMEM_PROFILE
+  _kmem_profile_free(obj_bufctl(allocator, slab_obj(obj))->sb_site,
+                     allocator->sa_objsize,
+                     obj_bufctl(allocator, slab_obj(obj))->sb_born);
+#endif
+
+  ipl = spin_lock_irqsave(&allocator->sa_lock);
+  allocator->sa_nfrees++;
+  if (!allocator->sa_magsize || allocator == slab_magazine_allocator) {
+    _slab_obj_free(allocator, obj);
+    spin_unlock_irqrestore(&allocator->sa_lock, ipl);
+    return;
+  }
+
+again:
+  if (!allocator->sa_loaded ||
+      allocator->sa_magsize == allocator->sa_loaded->m_rounds) {
+    if (allocator->sa_previous && !allocator->sa_previous->m_rounds) {
+      /* Previous magazine is empty, use it */
+      mag = allocator->sa_loaded;
+      allocator->sa_loaded = allocator->sa_previous;
+      allocator->sa_previous = mag;
+    } else {
+      /* Trade the full previous magazine for an empty one */
+      if (NULL != (mag = allocator->sa_depot_empty)) {
+        allocator->sa_depot_empty = mag->m_next;
+      } else {
+        /* The magazine allocator may need to grow, which must not be
+         * done holding our lock; then things may have moved meanwhile,
+         * so put the magazine in the depot and look again */
+        spin_unlock_irqrestore(&allocator->sa_lock, ipl);
+        mag = NULL != slab_magazine_allocator ? _magazine_alloc() : NULL;
+        ipl = spin_lock_irqsave(&allocator->sa_lock);
+        if (NULL != mag) {
+          mag->m_rounds = 0;
+          mag->m_next = allocator->sa_depot_empty;
+          allocator->sa_depot_empty = mag;
+          goto again;
+        }
+        _slab_obj_free(allocator, obj);
+        spin_unlock_irqrestore(&allocator->sa_lock, ipl);
+        return;
+      }
+      if (allocator->sa_previous) {
+        allocator->sa_previous->m_next = allocator->sa_depot_full;
+        allocator->sa_depot_full = allocator->sa_previous;
+      }
+      allocator->sa_previous = allocator->sa_loaded;
+      allocator->sa_loaded = mag;
+    }
+  }
+
+#ifdef SLAB_CHECK_FREE
+  obj_bufctl(allocator, slab_obj(obj))->sb_free = 1;
+#endif
+  allocator->sa_loaded->m_objs[allocator->sa_loaded->m_rounds++] = obj;
+  spin_unlock_irqrestore(&allocator->sa_lock, ipl);
+}
+
+size_t slab_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  struct slab_allocator *a;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "%-20s %6s %10s %10s %8s\n", "NAME", "SIZE", "ALLOCS",
+          "FREES", "INUSE");
+  for (a = slab_allocators; NULL != a; a = a->sa_next) {
+    iprintf(&buf, &size, "%-20s %6u %10u %10u %8u\n", a->sa_name,
+            a->sa_objsize, a->sa_nallocs, a->sa_nfrees,
+            a->sa_nallocs - a->sa_nfrees);
+  }
+  iprintf(&buf, &size, "%u pages held\n", kmem_npages);
+  return size;
+}
+
+size_t slab_occupancy_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  struct slab_allocator *a;
+  struct slab_magazine *mag;
+  struct slab *s;
+  int nslabs[3], nobjs, ncached, i;
+  uint8_t ipl;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "%-20s %6s %6s %6s %6s %6s %8s %8s %5s\n", "NAME",
+          "FULL", "PART", "EMPTY", "PAGES", "OBJS", "INSLABS", "CACHED",
+          "FILL%");
+  for (a = slab_allocators; NULL != a; a = a->sa_next) {
+    list_t *lists[] = {&a->sa_full, &a->sa_partial, &a->sa_empty};
+
+    /* Each allocator is counted under its lock, so its line is
+     * consistent; only the partial slabs need looking into */
+    nobjs = ncached = 0;
+    ipl = spin_lock_irqsave(&a->sa_lock);
+    for (i = 0; i < 3; i++) {
+      nslabs[i] = 0;
+      list_iterate_begin(lists[i], s, struct slab, s_link) {
+        nslabs[i]++;
+        nobjs += s->s_inuse;
+      }
+      list_iterate_end();
+    }
+    if (a->sa_loaded)
+      ncached += a->sa_loaded->m_rounds;
+    if (a->sa_previous)
+      ncached += a->sa_previous->m_rounds;
+    for (mag = a->sa_depot_full; NULL != mag; mag = mag->m_next)
+      ncached += mag->m_rounds;
+    spin_unlock_irqrestore(&a->sa_lock, ipl);
+
+    i = (nslabs[0] + nslabs[1] + nslabs[2]) * a->sa_slab_nobjs;
+    iprintf(&buf, &size, "%-20s %6d %6d %6d %6d %6d %8d %8d %5d\n",
+            a->sa_name, nslabs[0], nslabs[1], nslabs[2],
+            (nslabs[0] + nslabs[1] + nslabs[2]) << a->sa_order, i, nobjs,
+            ncached, i ? 100 * (nobjs - ncached) / i : 0);
+  }
+  return size;
+}
+
+uint32_t slab_npages() { return kmem_npages; }
+
 /*
  * Reclaims as much memory (up to a target) from
  * unused slabs as possible
@@ -332,78 +731,154 @@ int slab_allocators_reclaim(int target) {
   int npages_freed = 0, npages;
 
   struct slab_allocator *a;
-  struct slab *s, **prev;
+  struct slab_magazine *mag, *next;
+  struct slab *s;
+  uint8_t ipl;
+
+  /* Empty every magazine back into the slabs, and free the magazines.
+   * An allocator whose lock is already held is in the middle of an
+   * allocation or free further up this thread's stack (the lock is only
+   * ever held with interrupts masked, so no one else can hold it), and is
+   * left alone. */
+  for (a = slab_allocators; NULL != a; a = a->sa_next) {
+    struct slab_magazine *mags[4];
+    int i;
+    if (a == slab_magazine_allocator ||
+        !spin_trylock_irqsave(&a->sa_lock, &ipl))
+      continue;
+    mags[0] = a->sa_loaded;
+    mags[1] = a->sa_previous;
+    mags[2] = a->sa_depot_full;
+    mags[3] = a->sa_depot_empty;
+    a->sa_loaded = a->sa_previous = NULL;
+    a->sa_depot_full = a->sa_depot_empty = NULL;
+    for (i = 0; i < 4; ++i) {
+      /* only the depot lists are chained through m_next */
+      for (mag = mags[i]; NULL != mag; mag = next) {
+        next = (i < 2) ? NULL : mag->m_next;
+        _magazine_drain(a, mag);
+        _magazine_free(mag);
+      }
+    }
+    spin_unlock_irqrestore(&a->sa_lock, ipl);
+  }
 
   /* Go through all caches */
   for (a = slab_allocators; NULL != a; a = a->sa_next) {
-    prev = &(a->sa_slabs);
-    s = a->sa_slabs;
-    while (NULL != s) {
-      struct slab *next = s->s_next;
-      if (0 == s->s_inuse) {
-        /* Free Slab */
-        (*prev) = next;
-        npages = 1 << a->sa_order;
-
-        page_free_n(s->s_addr, npages);
-        npages_freed += npages;
-      } else {
-        prev = &(s->s_next);
+    if (!spin_trylock_irqsave(&a->sa_lock, &ipl))
+      continue;
+    while (!list_empty(&a->sa_empty)) {
+      s = list_head(&a->sa_empty, struct slab, s_link);
+      KASSERT(0 == s->s_inuse);
+      /* Free Slab */
+      list_remove(&s->s_link);
+      npages = 1 << a->sa_order;
+      if (a->sa_dtor) {
+        void *obj;
+        int i;
+        obj = (char *)s->s_addr + s->s_color;
+        for (i = 0; i < a->sa_slab_nobjs; ++i, obj = next_obj(a, obj))
+          a->sa_dtor(user_obj(obj));
       }
+
+      page_set_owner(s->s_addr, npages, NULL);
+      page_free_n(s->s_addr, npages);
+      kmem_npages -= npages;
+      npages_freed += npages;
       /* Check if target was met */
       if ((target > 0) && (npages_freed >= target)) {
+        spin_unlock_irqrestore(&a->sa_lock, ipl);
         return npages_freed;
       }
-      s = next;
     }
+    spin_unlock_irqrestore(&a->sa_lock, ipl);
   }
   return npages_freed;
 }
 
-#define KMALLOC_SIZE_MIN_ORDER (6)
-#define KMALLOC_SIZE_MAX_ORDER (18)
-
-static struct slab_allocator *
-    kmalloc_allocators[KMALLOC_SIZE_MAX_ORDER - KMALLOC_SIZE_MIN_ORDER + 1];
-
-/* Note that kmem_cache_names should be modified to remain consistent
- * with KMALLOC_SIZE_MIN_ORDER ... KMALLOC_SIZE_MAX_ORDER.
+/*
+ * kmalloc size classes. Up to 64 bytes there is a class every 16 bytes;
+ * beyond that there are four classes per power of two (2^k times 5/4, 3/2,
+ * 7/4 and 2), so no more than 20% of an object is wasted. The class for a
+ * size is found by indexing kmalloc_small_index (in 16 byte steps, up to
+ * 1 KiB) or kmalloc_large_index (in 128 byte steps, up to
+ * KMALLOC_MAX_SIZE). Requests bigger than KMALLOC_MAX_SIZE get whole
+ * pages from page_alloc_n.
+ *
+ * There is no header in front of kmalloc'd memory: kfree finds the
+ * allocator through the owner page.c records for each page. Pages handed
+ * out directly are recorded with their page count and the low bit set,
+ * which can never be an allocator pointer. With KMEM_PROFILE such a block
+ * (always at least three pages) keeps its kmem_sites index and the tick
+ * it was allocated at as the owners of its second and third pages.
  */
-static const char *kmalloc_allocator_names[] = {
-    "size-64",    "size-128",    "size-256",   "size-512",   "size-1024",
-    "size-2048",  "size-4096",   "size-8192",  "size-16384", "size-32768",
-    "size-65536", "size-131072", "size-262144"};
+#define KMALLOC_MIN_SIZE 16
+#define KMALLOC_MAX_SIZE 8192
+#define KMALLOC_NCLASSES 32
+#define KMALLOC_SMALL_MAX 1024
+#define KMALLOC_SMALL_SHIFT 4
+#define KMALLOC_LARGE_SHIFT 7
+
+#define kmalloc_pages_owner(npages) ((void *)(((npages) << 1) | 1))
+#define kmalloc_is_pages_owner(owner) ((uintptr_t)(owner) & 1)
+#define kmalloc_owner_npages(owner) ((uint32_t)(owner) >> 1)
+
+static struct slab_allocator *kmalloc_allocators[KMALLOC_NCLASSES];
+static char kmalloc_allocator_names[KMALLOC_NCLASSES][16];
+static uint8_t
+    kmalloc_small_index[(KMALLOC_SMALL_MAX >> KMALLOC_SMALL_SHIFT) + 1];
+static uint8_t
+    kmalloc_large_index[(KMALLOC_MAX_SIZE >> KMALLOC_LARGE_SHIFT) + 1];
+
+static size_t _kmalloc_class_size(int class) {
+  if (class < 4)
+    return (class + 1) * KMALLOC_MIN_SIZE;
+  /* 64 << (class / 4 - 1), times (5 + class % 4) / 4 */
+  return (((size_t)64 << ((class - 4) / 4)) * (5 + (class - 4) % 4)) / 4;
+}
 
 void *kmalloc(size_t size) {
-  int order;
-  struct slab_allocator **cs;
+  struct slab_allocator *cs;
   void *addr;
 
-  size += sizeof(struct slab_allocator *);
-
-  /*
-   * Find the first power of two bucket bigger than the
-   * requested size, and allocate from it.
-   */
-  cs = kmalloc_allocators;
-  for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER;
-       order++, cs++) {
-    if ((size_t)(1 << order) >= size) {
-      addr = slab_obj_alloc(*cs);
-      if (!addr) {
-        dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
-        return NULL;
-      }
-#ifdef MM_POISON
-      memset(addr, MM_POISON_ALLOC, size);
-#endif /* MM_POISON */
-      *((struct slab_allocator **)addr) = *cs;
-      return (void *)(((struct slab_allocator **)addr) + 1);
+  if (size > KMALLOC_MAX_SIZE) {
+    uint32_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(size));
+    if (npages > (1U << (PAGE_NSIZES - 1)))
+      panic("size bigger than maxorder %ld\n", (unsigned long)size);
+    addr = page_alloc_n(npages);
+    pframe_kmem_pressure();
+    if (NULL == addr) {
+      dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
+      return NULL;
     }
+    kmem_npages += npages;
+    page_set_owner(addr, 1, kmalloc_pages_owner(npages));
+#if KMEM_PROFILE
+    page_set_owner((char *)addr + PAGE_SIZE, 1,
+                   (void *)(uintptr_t)_kmem_profile_alloc(
+                       (uintptr_t)__builtin_return_address(0),
+                       npages * PAGE_SIZE));
+    page_set_owner((char *)addr + 2 * PAGE_SIZE, 1, (void *)time_ticks());
+#endif
+    return addr;
   }
 
-  panic("size bigger than maxorder %ld\n", (unsigned long)size);
-  return NULL;
+  if (size <= KMALLOC_SMALL_MAX)
+    cs = kmalloc_allocators[kmalloc_small_index[(size + 15) >>
+                                               KMALLOC_SMALL_SHIFT]];
+  else
+    cs = kmalloc_allocators[kmalloc_large_index[(size + 127) >>
+                                               KMALLOC_LARGE_SHIFT]];
+
+  addr = _slab_obj_alloc_from(cs, (uintptr_t)__builtin_return_address(0));
+  if (!addr) {
+    dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
+    return NULL;
+  }
+#ifdef MM_POISON
+  memset(addr, MM_POISON_ALLOC, size);
+#endif /* MM_POISON */
+  return addr;
 }
 
 __attribute__((used)) static void *malloc(size_t size) {
@@ -414,8 +889,23 @@ __attribute__((used)) static void *malloc(size_t size) {
 }
 
 void kfree(void *addr) {
-  addr = (void *)(((struct slab_allocator **)addr) - 1);
-  struct slab_allocator *sa = *(struct slab_allocator **)addr;
+  struct slab_allocator *sa = page_get_owner(addr);
+  KASSERT(NULL != sa && "kfree of memory not from kmalloc");
+
+  if (kmalloc_is_pages_owner(sa)) {
+    KASSERT(PAGE_ALIGNED(addr));
+#if KMEM_PROFILE
+    _kmem_profile_free(
+        (uintptr_t)page_get_owner((char *)addr + PAGE_SIZE),
+        kmalloc_owner_npages(sa) * PAGE_SIZE,
+        (uintptr_t)page_get_owner((char *)addr + 2 * PAGE_SIZE));
+    page_set_owner((char *)addr + PAGE_SIZE, 2, NULL);
+#endif
+    page_set_owner(addr, 1, NULL);
+    page_free_n(addr, kmalloc_owner_npages(sa));
+    kmem_npages -= kmalloc_owner_npages(sa);
+    return;
+  }
 
 #ifdef MM_POISON
   /* If poisoning is enabled, wipe the memory given in
@@ -439,24 +929,44 @@ __attribute__((used)) static void free(void *addr) {
 }
 
 void slab_init() {
-  int order;
-  struct slab_allocator **cs;
+  int class;
+  uint32_t i;
+
+#if KMEM_PROFILE
+  spinlock_init(&kmem_sites_lock, "kmem_sites");
+#endif
 
   /* Special case initialization of the kmem_cache_t cache. */
   _allocator_init(&slab_allocator_allocator, "slab_allocators",
-                  sizeof(struct slab_allocator));
+                  sizeof(struct slab_allocator), NULL, NULL);
+
+  if (NULL == (slab_magazine_allocator = slab_allocator_create(
+                   "slab_magazines", sizeof(struct slab_magazine))))
+    panic("Couldn't create slab magazine allocator!\n");
 
   /*
-   * Allocate the power of two buckets for generic
-   * kmalloc/kfree.
+   * Allocate the size classes for generic kmalloc/kfree.
    */
-  cs = kmalloc_allocators;
-  for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER;
-       order++, cs++) {
-    if (NULL == (*cs = slab_allocator_create(
-                     kmalloc_allocator_names[order - KMALLOC_SIZE_MIN_ORDER],
-                     (1 << order)))) {
+  KASSERT(KMALLOC_MAX_SIZE == _kmalloc_class_size(KMALLOC_NCLASSES - 1));
+  for (class = 0; class < KMALLOC_NCLASSES; class++) {
+    snprintf(kmalloc_allocator_names[class], sizeof(kmalloc_allocator_names[0]),
+             "size-%u", _kmalloc_class_size(class));
+    if (NULL == (kmalloc_allocators[class] = slab_allocator_create(
+                     kmalloc_allocator_names[class],
+                     _kmalloc_class_size(class)))) {
       panic("Couldn't create kmalloc allocators!\n");
     }
   }
+
+  /* And the size to class lookup tables */
+  for (i = 0, class = 0; i <= (KMALLOC_SMALL_MAX >> KMALLOC_SMALL_SHIFT); i++) {
+    while (_kmalloc_class_size(class) < (i << KMALLOC_SMALL_SHIFT))
+      class++;
+    kmalloc_small_index[i] = class;
+  }
+  for (i = 0, class = 0; i <= (KMALLOC_MAX_SIZE >> KMALLOC_LARGE_SHIFT); i++) {
+    while (_kmalloc_class_size(class) < (i << KMALLOC_LARGE_SHIFT))
+      class++;
+    kmalloc_large_index[i] = class;
+  }
 }
@@ -0,0 +1,108 @@
+#include "types.h"
+#include "kernel.h"
+#include "config.h"
+
+#include "mm/mm.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
+#include "mm/vmalloc.h"
+
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+
+#include "boot/config.h"
+
+#define VMALLOC_PN(addr) (ADDR_TO_PN((uintptr_t)(addr) - VMALLOC_LOW))
+#define VMALLOC_ADDR(pn) ((uintptr_t)PN_TO_ADDR(pn) + VMALLOC_LOW)
+#define VMALLOC_CONTAINS(addr)                                                 \
+  (VMALLOC_LOW <= (uintptr_t)(addr) && VMALLOC_HIGH > (uintptr_t)(addr))
+
+/*
+ * For each page of the space, the length in pages of the buffer which
+ * starts there, or 0. A buffer of n pages takes n + 1 pages of the
+ * space, the last its guard page, so the space is a sequence of buffers
+ * with their guards, found by stepping from one to the next, and free
+ * pages between them.
+ */
+static uint16_t vmalloc_npages[VMALLOC_PAGES];
+static spinlock_t vmalloc_lock;
+
+void vmalloc_init() {
+  KASSERT(VMALLOC_PAGES <= 0x10000);
+  spinlock_init(&vmalloc_lock, "vmalloc");
+}
+
+/* Takes the first stretch of the space with room for npages pages and a
+ * guard; returns its first page or -1 */
+static int vmalloc_reserve(uint32_t npages) {
+  uint32_t pn = 0, start = 0;
+  int ret = -1;
+
+  spin_lock(&vmalloc_lock);
+  while (pn < VMALLOC_PAGES) {
+    if (vmalloc_npages[pn]) {
+      pn += vmalloc_npages[pn] + 1;
+      start = pn;
+    } else if (++pn - start == npages + 1) {
+      vmalloc_npages[start] = npages;
+      ret = start;
+      break;
+    }
+  }
+  spin_unlock(&vmalloc_lock);
+  return ret;
+}
+
+/* Unmaps and frees the first npages pages of the buffer at pn */
+static void vmalloc_unmap(uint32_t pn, uint32_t npages) {
+  pagedir_t *pd = pt_get();
+  uintptr_t vaddr, paddr;
+
+  for (vaddr = VMALLOC_ADDR(pn); npages; --npages, vaddr += PAGE_SIZE) {
+    paddr = pt_lookup(pd, vaddr);
+    KASSERT(paddr);
+    pt_unmap(pd, vaddr);
+    tlb_flush(vaddr);
+    page_free((void *)(paddr - KERNEL_PHYS_BASE + (uintptr_t)&kernel_start));
+  }
+}
+
+void *vmalloc(size_t size) {
+  uint32_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(size)), i;
+  pagedir_t *pd = pt_get();
+  void *page;
+  int pn;
+
+  KASSERT(size);
+  if (npages >= VMALLOC_PAGES || 0 > (pn = vmalloc_reserve(npages)))
+    return NULL;
+
+  /* the page tables are shared, so any directory will do */
+  for (i = 0; i < npages; ++i) {
+    if (NULL == (page = page_alloc()) ||
+        0 > pt_map(pd, VMALLOC_ADDR(pn + i), pt_virt_to_phys((uintptr_t)page),
+                   PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE)) {
+      if (page)
+        page_free(page);
+      vmalloc_unmap(pn, i);
+      spin_lock(&vmalloc_lock);
+      vmalloc_npages[pn] = 0;
+      spin_unlock(&vmalloc_lock);
+      return NULL;
+    }
+  }
+  return (void *)VMALLOC_ADDR(pn);
+}
+
+void vfree(void *addr) {
+  uint32_t pn = VMALLOC_PN(addr);
+
+  KASSERT(PAGE_ALIGNED(addr) && VMALLOC_CONTAINS(addr));
+  KASSERT(vmalloc_npages[pn] && "freeing memory vmalloc did not allocate");
+  vmalloc_unmap(pn, vmalloc_npages[pn]);
+  spin_lock(&vmalloc_lock);
+  vmalloc_npages[pn] = 0;
+  spin_unlock(&vmalloc_lock);
+}
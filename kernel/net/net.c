@@ -0,0 +1,354 @@
+/*
+ *  FILE: net.c
+ *  DESC: Ethernet, ARP and IPv4, for the UDP sockets in udp.c.
+ *
+ * Frames come up from the driver's worker thread and go down from
+ * whichever thread sends. Nothing here is touched from interrupt
+ * context, and only the boot processor runs threads, so the ARP table
+ * and counters need no lock beyond not blocking while they are changed.
+ *
+ * ARP entries are learned from every request and reply addressed to us
+ * and are never aged out; when the table is full the oldest is replaced.
+ * A sender waiting on an address asks again every NET_ARP_TIMEOUT_MSECS,
+ * NET_ARP_TRIES times, before giving up.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "fs/socket.h"
+
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "net/net.h"
+#include "net/udp.h"
+
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/printf.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#define ARP_HTYPE_ETHER 1
+#define ARP_OP_REQUEST 1
+#define ARP_OP_REPLY 2
+#define ARP_LEN 28
+
+#define IP_VERSION 4
+#define IP_TTL 64
+#define IP_FLAG_MF 0x2000
+#define IP_FRAG_OFFSET 0x1fff
+
+typedef struct eth_hdr {
+  uint8_t eh_dst[ETH_ALEN];
+  uint8_t eh_src[ETH_ALEN];
+  uint16_t eh_type;
+} __attribute__((packed)) eth_hdr_t;
+
+typedef struct arp_pkt {
+  uint16_t ap_htype;
+  uint16_t ap_ptype;
+  uint8_t ap_hlen;
+  uint8_t ap_plen;
+  uint16_t ap_op;
+  uint8_t ap_sha[ETH_ALEN];
+  in_addr_t ap_spa;
+  uint8_t ap_tha[ETH_ALEN];
+  in_addr_t ap_tpa;
+} __attribute__((packed)) arp_pkt_t;
+
+typedef struct ip_hdr {
+  uint8_t ih_vhl; /* version and header length in words */
+  uint8_t ih_tos;
+  uint16_t ih_len;
+  uint16_t ih_id;
+  uint16_t ih_frag;
+  uint8_t ih_ttl;
+  uint8_t ih_proto;
+  uint16_t ih_csum;
+  in_addr_t ih_src;
+  in_addr_t ih_dst;
+} __attribute__((packed)) ip_hdr_t;
+
+typedef struct arp_entry {
+  in_addr_t ae_addr; /* INADDR_ANY when unused */
+  uint8_t ae_mac[ETH_ALEN];
+} arp_entry_t;
+
+static const uint8_t eth_broadcast[ETH_ALEN] = {0xff, 0xff, 0xff,
+                                                0xff, 0xff, 0xff};
+
+static netif_t *net_if = NULL;
+static arp_entry_t arp_table[NET_ARP_ENTRIES];
+static int arp_next = 0;     /* entry replaced next once the table is full */
+static ktqueue_t arp_waitq;  /* senders waiting on a reply */
+static uint16_t ip_next_id = 0;
+
+/* for net_info, along with the interface's counters, whose rx_dropped
+ * are frames not for us or of no protocol we know */
+static uint32_t arp_nrequests = 0;
+static uint32_t arp_nreplies = 0;
+static uint32_t ip_nbad = 0; /* dropped: bad header, options or fragments */
+
+static __attribute__((unused)) void net_init(void) {
+  sched_queue_init(&arp_waitq);
+}
+init_func(net_init);
+init_depends(sched_init);
+
+void net_register(netif_t *ni) {
+  KASSERT(NULL == net_if && "only one network interface is supported");
+  ni->ni_addr = htonl(NET_ADDR);
+  ni->ni_netmask = htonl(NET_NETMASK);
+  ni->ni_gateway = htonl(NET_GATEWAY);
+  net_if = ni;
+  dbg(DBG_NET, "%s: %02x:%02x:%02x:%02x:%02x:%02x, address %08x\n",
+      ni->ni_name, ni->ni_mac[0], ni->ni_mac[1], ni->ni_mac[2], ni->ni_mac[3],
+      ni->ni_mac[4], ni->ni_mac[5], NET_ADDR);
+}
+
+in_addr_t net_addr(void) { return net_if ? net_if->ni_addr : INADDR_ANY; }
+
+/* The Internet checksum of len bytes, a whole number of halfwords */
+static uint16_t ip_csum(const void *buf, size_t len) {
+  const uint16_t *p = (const uint16_t *)buf;
+  uint32_t sum = 0;
+
+  for (; len > 1; len -= 2)
+    sum += *p++;
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+static arp_entry_t *arp_lookup(in_addr_t addr) {
+  int i;
+  for (i = 0; i < NET_ARP_ENTRIES; ++i) {
+    if (arp_table[i].ae_addr == addr)
+      return &arp_table[i];
+  }
+  return NULL;
+}
+
+static void arp_learn(in_addr_t addr, const uint8_t *mac) {
+  arp_entry_t *ae;
+
+  if (INADDR_ANY == addr)
+    return;
+  if (NULL == (ae = arp_lookup(addr)) &&
+      NULL == (ae = arp_lookup(INADDR_ANY))) {
+    ae = &arp_table[arp_next];
+    arp_next = (arp_next + 1) % NET_ARP_ENTRIES;
+  }
+  ae->ae_addr = addr;
+  memcpy(ae->ae_mac, mac, ETH_ALEN);
+  sched_broadcast_on(&arp_waitq);
+}
+
+static void eth_header(netif_t *ni, eth_hdr_t *eh, const uint8_t *dst,
+                       uint16_t type) {
+  memcpy(eh->eh_dst, dst, ETH_ALEN);
+  memcpy(eh->eh_src, ni->ni_mac, ETH_ALEN);
+  eh->eh_type = htons(type);
+}
+
+/* Sends an ARP packet; replies go straight back to whoever asked, and
+ * aren't worth waiting for room for, since they can be asked for again */
+static void arp_send(netif_t *ni, uint16_t op, const uint8_t *tha,
+                     in_addr_t tpa, int wait) {
+  char frame[ETH_HLEN + ARP_LEN];
+  arp_pkt_t *ap = (arp_pkt_t *)(frame + ETH_HLEN);
+
+  eth_header(ni, (eth_hdr_t *)frame,
+             ARP_OP_REQUEST == op ? eth_broadcast : tha, ETH_P_ARP);
+  ap->ap_htype = htons(ARP_HTYPE_ETHER);
+  ap->ap_ptype = htons(ETH_P_IP);
+  ap->ap_hlen = ETH_ALEN;
+  ap->ap_plen = sizeof(in_addr_t);
+  ap->ap_op = htons(op);
+  memcpy(ap->ap_sha, ni->ni_mac, ETH_ALEN);
+  ap->ap_spa = ni->ni_addr;
+  memcpy(ap->ap_tha, tha, ETH_ALEN);
+  ap->ap_tpa = tpa;
+  if (ARP_OP_REQUEST == op)
+    arp_nrequests++;
+  else
+    arp_nreplies++;
+  ni->ni_xmit(ni, frame, sizeof(frame), NULL, 0, wait);
+}
+
+static void arp_input(netif_t *ni, const arp_pkt_t *ap) {
+  if (htons(ARP_HTYPE_ETHER) != ap->ap_htype ||
+      htons(ETH_P_IP) != ap->ap_ptype || ETH_ALEN != ap->ap_hlen ||
+      sizeof(in_addr_t) != ap->ap_plen || ap->ap_tpa != ni->ni_addr)
+    return;
+  arp_learn(ap->ap_spa, ap->ap_sha);
+  if (htons(ARP_OP_REQUEST) == ap->ap_op)
+    arp_send(ni, ARP_OP_REPLY, ap->ap_sha, ap->ap_spa, 0);
+}
+
+/* Finds the hardware address of addr, a neighbour, into mac */
+static int arp_resolve(netif_t *ni, in_addr_t addr, uint8_t *mac, int nowait) {
+  arp_entry_t *ae;
+  int tries, ret;
+
+  for (tries = 0;; ++tries) {
+    if (NULL != (ae = arp_lookup(addr))) {
+      memcpy(mac, ae->ae_mac, ETH_ALEN);
+      return 0;
+    }
+    if (NET_ARP_TRIES == tries)
+      return -EHOSTUNREACH;
+    arp_send(ni, ARP_OP_REQUEST, eth_broadcast, addr, !nowait);
+    if (nowait)
+      return -EAGAIN;
+    ret = sched_cancellable_sleep_on_timeout(
+        &arp_waitq, NET_ARP_TIMEOUT_MSECS / TICK_MSECS);
+    if (-EINTR == ret)
+      return ret;
+  }
+}
+
+int net_send(in_addr_t dst, uint8_t proto, const void *thdr, size_t thlen,
+             void *data, size_t len, int nowait) {
+  char hdr[NET_HDR_MAX];
+  netif_t *ni = net_if;
+  ip_hdr_t *ih = (ip_hdr_t *)(hdr + ETH_HLEN);
+  uint8_t mac[ETH_ALEN];
+  in_addr_t hop;
+  int ret;
+
+  KASSERT(ETH_HLEN + IP_HLEN + thlen <= NET_HDR_MAX);
+  KASSERT(IP_HLEN + thlen + len <= ETH_MTU);
+  if (!ni) {
+    ret = -ENETUNREACH;
+    goto fail;
+  }
+  if (INADDR_BROADCAST == dst ||
+      dst == (ni->ni_addr | ~ni->ni_netmask)) {
+    memcpy(mac, eth_broadcast, ETH_ALEN);
+  } else {
+    hop = (dst & ni->ni_netmask) == (ni->ni_addr & ni->ni_netmask)
+              ? dst
+              : ni->ni_gateway;
+    if (0 > (ret = arp_resolve(ni, hop, mac, nowait)))
+      goto fail;
+  }
+
+  eth_header(ni, (eth_hdr_t *)hdr, mac, ETH_P_IP);
+  ih->ih_vhl = IP_VERSION << 4 | IP_HLEN / 4;
+  ih->ih_tos = 0;
+  ih->ih_len = htons(IP_HLEN + thlen + len);
+  ih->ih_id = htons(ip_next_id++);
+  ih->ih_frag = 0;
+  ih->ih_ttl = IP_TTL;
+  ih->ih_proto = proto;
+  ih->ih_csum = 0;
+  ih->ih_src = ni->ni_addr;
+  ih->ih_dst = dst;
+  ih->ih_csum = ip_csum(ih, IP_HLEN);
+  memcpy(hdr + ETH_HLEN + IP_HLEN, thdr, thlen);
+  return ni->ni_xmit(ni, hdr, ETH_HLEN + IP_HLEN + thlen, data, len, !nowait);
+
+fail:
+  if (data)
+    page_free(data);
+  return ret;
+}
+
+/* Takes an IPv4 datagram's payload to its protocol, of which there is
+ * only UDP; returns whether pf was kept */
+static int ip_input(netif_t *ni, const ip_hdr_t *ih, size_t hdrlen,
+                    pframe_t *pf, size_t len) {
+  const udp_hdr_t *uh = (const udp_hdr_t *)(ih + 1);
+  size_t iplen = ntohs(ih->ih_len), ulen;
+
+  /* The payload is only at the start of the page without options */
+  if (ih->ih_vhl != (IP_VERSION << 4 | IP_HLEN / 4) ||
+      (ih->ih_frag & htons(IP_FLAG_MF | IP_FRAG_OFFSET)) ||
+      ip_csum(ih, IP_HLEN) || iplen < IP_HLEN + UDP_HLEN ||
+      IPPROTO_UDP != ih->ih_proto || hdrlen < NET_UDP_HLEN) {
+    ip_nbad++;
+    return 0;
+  }
+  if (ih->ih_dst != ni->ni_addr && INADDR_BROADCAST != ih->ih_dst &&
+      ih->ih_dst != (ni->ni_addr | ~ni->ni_netmask))
+    return 0;
+  ulen = ntohs(uh->uh_len);
+  if (ulen < UDP_HLEN || ulen > iplen - IP_HLEN ||
+      ulen - UDP_HLEN > len) {
+    ip_nbad++;
+    return 0;
+  }
+  return udp_input(ih->ih_src, uh->uh_sport, uh->uh_dport, pf,
+                   ulen - UDP_HLEN);
+}
+
+int net_input(netif_t *ni, const void *hdr, size_t hdrlen, pframe_t *pf,
+              size_t len) {
+  const eth_hdr_t *eh = (const eth_hdr_t *)hdr;
+
+  ni->ni_rx_packets++;
+  ni->ni_rx_bytes += hdrlen + len;
+  if (hdrlen < ETH_HLEN)
+    goto drop;
+  if (memcmp(eh->eh_dst, ni->ni_mac, ETH_ALEN) &&
+      memcmp(eh->eh_dst, eth_broadcast, ETH_ALEN))
+    goto drop;
+  switch (ntohs(eh->eh_type)) {
+  case ETH_P_ARP:
+    if (hdrlen >= ETH_HLEN + ARP_LEN) {
+      arp_input(ni, (const arp_pkt_t *)(eh + 1));
+      return 0;
+    }
+    break;
+  case ETH_P_IP:
+    if (hdrlen >= ETH_HLEN + IP_HLEN)
+      return ip_input(ni, (const ip_hdr_t *)(eh + 1), hdrlen - ETH_HLEN, pf,
+                      len);
+    break;
+  }
+drop:
+  ni->ni_rx_dropped++;
+  return 0;
+}
+
+size_t net_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  netif_t *ni = net_if;
+  in_addr_t a;
+  int i;
+
+  KASSERT(NULL == arg);
+  if (!ni) {
+    iprintf(&buf, &size, "no interface\n");
+    return size;
+  }
+  a = ntohl(ni->ni_addr);
+  iprintf(&buf, &size, "%s %02x:%02x:%02x:%02x:%02x:%02x %u.%u.%u.%u\n",
+          ni->ni_name, ni->ni_mac[0], ni->ni_mac[1], ni->ni_mac[2],
+          ni->ni_mac[3], ni->ni_mac[4], ni->ni_mac[5], a >> 24,
+          a >> 16 & 0xff, a >> 8 & 0xff, a & 0xff);
+  iprintf(&buf, &size, "rx packets %u\n", ni->ni_rx_packets);
+  iprintf(&buf, &size, "rx bytes %u\n", ni->ni_rx_bytes);
+  iprintf(&buf, &size, "rx dropped %u\n", ni->ni_rx_dropped);
+  iprintf(&buf, &size, "tx packets %u\n", ni->ni_tx_packets);
+  iprintf(&buf, &size, "tx bytes %u\n", ni->ni_tx_bytes);
+  iprintf(&buf, &size, "tx dropped %u\n", ni->ni_tx_dropped);
+  iprintf(&buf, &size, "ip bad %u\n", ip_nbad);
+  iprintf(&buf, &size, "arp requests %u\n", arp_nrequests);
+  iprintf(&buf, &size, "arp replies %u\n", arp_nreplies);
+  for (i = 0; i < NET_ARP_ENTRIES; ++i) {
+    const uint8_t *m = arp_table[i].ae_mac;
+    if (INADDR_ANY == (a = ntohl(arp_table[i].ae_addr)))
+      continue;
+    iprintf(&buf, &size, "arp %u.%u.%u.%u %02x:%02x:%02x:%02x:%02x:%02x\n",
+            a >> 24, a >> 16 & 0xff, a >> 8 & 0xff, a & 0xff, m[0], m[1],
+            m[2], m[3], m[4], m[5]);
+  }
+  return udp_info(NULL, buf, size);
+}
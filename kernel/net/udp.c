@@ -0,0 +1,502 @@
+/*
+ *  FILE: udp.c
+ *  DESC: UDP sockets.
+ *
+ * A socket is a vnode of its own, as a local socket is, holding a
+ * udp_sock_t. Bound sockets are on udp_socks, which udp_input searches
+ * by port; there is one interface, so the address a socket is bound to
+ * makes no difference to what it receives.
+ *
+ * A datagram is kept as it arrived: the driver's page, which the
+ * payload starts, moved into an anonymous object of the datagram's own,
+ * so that recvmsg() with MSG_GIFT can hand it to the process with
+ * vmmap_give_page as a local socket hands on given pages. Nothing is
+ * copied on the way in but the bytes past the payload, which are zeroed
+ * so that an old frame's don't go along. Datagrams arriving while
+ * UDP_QUEUE_MAX wait are dropped, as are those for ports nobody has.
+ *
+ * Sending copies the payload into a page of its own for the driver.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "api/access.h"
+
+#include "fs/file.h"
+#include "fs/poll.h"
+#include "fs/socket.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/mm.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "net/net.h"
+#include "net/udp.h"
+
+#include "proc/kmutex.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "vm/anon.h"
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#define UDP_PORT_EPHEMERAL 49152 /* first of the ports given out */
+
+typedef struct udp_dgram {
+  list_link_t ud_link; /* on the socket's us_queue */
+  in_addr_t ud_src;
+  in_port_t ud_sport;
+  size_t ud_len;
+  mmobj_t *ud_obj; /* page 0 holds the payload, or NULL if empty */
+} udp_dgram_t;
+
+typedef struct udp_sock {
+  vnode_t *us_vnode;
+  in_port_t us_port;    /* 0 until bound */
+  list_link_t us_link;  /* on udp_socks once bound */
+  int us_nfiles;
+  list_t us_queue;      /* received datagrams, oldest first */
+  int us_nqueued;
+  kmutex_t us_rdlock;   /* held by a receiver, who may block copying */
+  ktqueue_t us_waitq;   /* receivers waiting for a datagram */
+  pollq_t us_pollq;
+} udp_sock_t;
+
+#define VNODE_TO_UDP(vn) ((udp_sock_t *)((vn)->vn_i))
+
+static void udp_read_vnode(vnode_t *vnode);
+static void udp_delete_vnode(vnode_t *vnode);
+static int udp_query_vnode(vnode_t *vnode);
+
+static fs_ops_t udp_fsops = {.read_vnode = udp_read_vnode,
+                             .delete_vnode = udp_delete_vnode,
+                             .query_vnode = udp_query_vnode,
+                             /* like pipefs, never mounted */
+                             .umount = NULL};
+
+static fs_t udp_fs = {.fs_dev = "udp",
+                      .fs_type = "udp",
+                      .fs_op = &udp_fsops,
+                      .fs_root = NULL,
+                      .fs_i = NULL};
+
+static int udp_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int udp_write(vnode_t *vnode, off_t offset, const void *buf,
+                     size_t len);
+static int udp_stat(vnode_t *vnode, struct stat *ss);
+static int udp_acquire(vnode_t *vnode, file_t *file);
+static int udp_release(vnode_t *vnode, file_t *file);
+static int udp_poll(vnode_t *vnode, int events, poll_table_t *pt);
+
+static vnode_ops_t udp_vops = {.read = udp_read,
+                               .write = udp_write,
+                               .stat = udp_stat,
+                               .poll = udp_poll,
+                               .acquire = udp_acquire,
+                               .release = udp_release};
+
+static slab_allocator_t *udp_sock_allocator = NULL;
+static slab_allocator_t *udp_dgram_allocator = NULL;
+static list_t udp_socks;
+static int next_uno = 0;
+static uint16_t udp_next_port = UDP_PORT_EPHEMERAL;
+
+/* for udp_info */
+static uint32_t udp_nsent = 0;
+static uint32_t udp_nreceived = 0;
+static uint32_t udp_nnoport = 0;   /* dropped: nobody bound to the port */
+static uint32_t udp_noverflow = 0; /* dropped: the socket's queue was full */
+static uint32_t udp_ngifted = 0;   /* received pages mapped into a process */
+static uint32_t udp_ncopied = 0;   /* and copied out instead */
+
+static __attribute__((unused)) void udp_init(void) {
+  udp_sock_allocator = slab_allocator_create("udp_sock", sizeof(udp_sock_t));
+  KASSERT(udp_sock_allocator != NULL);
+  udp_dgram_allocator =
+      slab_allocator_create("udp_dgram", sizeof(udp_dgram_t));
+  KASSERT(udp_dgram_allocator != NULL);
+  list_init(&udp_socks);
+}
+init_func(udp_init);
+init_depends(vfs_init);
+
+static void udp_read_vnode(vnode_t *vnode) {
+  vnode->vn_ops = &udp_vops;
+  vnode->vn_mode = S_IFSOCK;
+  vnode->vn_len = 0;
+  vnode->vn_i = NULL;
+}
+
+static void udp_delete_vnode(vnode_t *vnode) {
+  udp_sock_t *us = VNODE_TO_UDP(vnode);
+  if (us) {
+    KASSERT(!us->us_nfiles && list_empty(&us->us_queue));
+    slab_obj_free(udp_sock_allocator, us);
+  }
+}
+
+static int udp_query_vnode(vnode_t *vnode) { return 1; }
+
+vnode_t *udp_socket(void) {
+  vnode_t *vn = vget(&udp_fs, next_uno++);
+  udp_sock_t *us;
+
+  if (!vn)
+    return NULL;
+  if (NULL == (us = (udp_sock_t *)slab_obj_alloc(udp_sock_allocator))) {
+    vput(vn);
+    return NULL;
+  }
+  memset(us, 0, sizeof(*us));
+  us->us_vnode = vn;
+  list_link_init(&us->us_link);
+  list_init(&us->us_queue);
+  kmutex_init(&us->us_rdlock);
+  sched_queue_init(&us->us_waitq);
+  pollq_init(&us->us_pollq);
+  vn->vn_i = us;
+  return vn;
+}
+
+int udp_is(vnode_t *vn) { return &udp_vops == vn->vn_ops; }
+
+static void udp_dgram_free(udp_dgram_t *ud) {
+  if (ud->ud_obj)
+    ud->ud_obj->mmo_ops->put(ud->ud_obj);
+  slab_obj_free(udp_dgram_allocator, ud);
+}
+
+/* The socket bound to port, or NULL */
+static udp_sock_t *udp_lookup(in_port_t port) {
+  udp_sock_t *us;
+  list_iterate_begin(&udp_socks, us, udp_sock_t, us_link) {
+    if (us->us_port == port)
+      return us;
+  }
+  list_iterate_end();
+  return NULL;
+}
+
+/* Binds us to port, or to the next free ephemeral port if it is 0 */
+static int udp_bind_port(udp_sock_t *us, in_port_t port) {
+  int n;
+
+  if (!port) {
+    for (n = 0; n < 65536 - UDP_PORT_EPHEMERAL; ++n) {
+      port = htons(udp_next_port);
+      if (++udp_next_port < UDP_PORT_EPHEMERAL)
+        udp_next_port = UDP_PORT_EPHEMERAL;
+      if (!udp_lookup(port))
+        break;
+    }
+    if (n == 65536 - UDP_PORT_EPHEMERAL)
+      return -EADDRINUSE;
+  } else if (udp_lookup(port)) {
+    return -EADDRINUSE;
+  }
+  us->us_port = port;
+  list_insert_tail(&udp_socks, &us->us_link);
+  return 0;
+}
+
+int udp_bind(vnode_t *vn, const struct sockaddr_in *sin) {
+  udp_sock_t *us = VNODE_TO_UDP(vn);
+
+  if (AF_INET != sin->sin_family)
+    return -EAFNOSUPPORT;
+  if (INADDR_ANY != sin->sin_addr.s_addr && net_addr() != sin->sin_addr.s_addr)
+    return -EADDRNOTAVAIL;
+  if (us->us_port)
+    return -EINVAL;
+  return udp_bind_port(us, sin->sin_port);
+}
+
+int udp_input(in_addr_t src, in_port_t sport, in_port_t dport, pframe_t *pf,
+              size_t len) {
+  udp_sock_t *us;
+  udp_dgram_t *ud;
+
+  if (NULL == (us = udp_lookup(dport))) {
+    udp_nnoport++;
+    return 0;
+  }
+  if (us->us_nqueued >= UDP_QUEUE_MAX) {
+    udp_noverflow++;
+    return 0;
+  }
+  if (NULL == (ud = (udp_dgram_t *)slab_obj_alloc(udp_dgram_allocator)))
+    return 0;
+  list_link_init(&ud->ud_link);
+  ud->ud_src = src;
+  ud->ud_sport = sport;
+  ud->ud_len = len;
+  ud->ud_obj = NULL;
+  if (len) {
+    if (NULL == (ud->ud_obj = anon_create())) {
+      slab_obj_free(udp_dgram_allocator, ud);
+      return 0;
+    }
+    memset((char *)pf->pf_addr + len, 0, PAGE_SIZE - len);
+    pframe_move(pf, ud->ud_obj, 0);
+    /* The page is the only copy now, so it must be written out if paged
+     * out, and it is off the driver's ring */
+    pframe_dirty(pf);
+    pframe_unpin(pf);
+  }
+  list_insert_tail(&us->us_queue, &ud->ud_link);
+  us->us_nqueued++;
+  udp_nreceived++;
+  sched_wakeup_on(&us->us_waitq);
+  pollq_wakeup(&us->us_pollq);
+  return len ? 1 : 0;
+}
+
+/* Copies n bytes of a datagram's payload out to the user's iov */
+static int udp_copyout(udp_dgram_t *ud, struct iovec *iov, int iovcnt,
+                       size_t n) {
+  pframe_t *pf;
+  size_t off = 0, k;
+  int i, ret;
+
+  if (!n)
+    return 0;
+  if (0 > (ret = pframe_lookup(ud->ud_obj, 0, 0, &pf)))
+    return ret;
+  /* Kept while copying to the user blocks */
+  pframe_pin(pf);
+  for (i = 0; i < iovcnt && off < n; ++i) {
+    k = MIN(n - off, iov[i].iov_len);
+    if (0 > (ret = copy_to_user(iov[i].iov_base, (char *)pf->pf_addr + off,
+                                k)))
+      break;
+    off += k;
+  }
+  pframe_unpin(pf);
+  return 0 > ret ? ret : 0;
+}
+
+/*
+ * Receives the next datagram into msg's buffers, waiting for one unless
+ * MSG_DONTWAIT. With MSG_GIFT, a payload goes whole into a first buffer
+ * which is page aligned and at least a page long if the process will
+ * take the page there (see vmmap_give_page), and is copied otherwise;
+ * what doesn't fit is dropped, setting MSG_TRUNC. The sender's address
+ * goes in msg_name, if there is room for it.
+ */
+int udp_recvmsg(vnode_t *vn, struct msghdr *msg, int flags) {
+  udp_sock_t *us = VNODE_TO_UDP(vn);
+  struct iovec *iov = msg->msg_iov;
+  struct sockaddr_in sin;
+  udp_dgram_t *ud;
+  size_t room = 0, n;
+  int i, ret;
+
+  for (i = 0; i < msg->msg_iovlen; ++i)
+    room += iov[i].iov_len;
+  if ((ret = kmutex_lock_cancellable(&us->us_rdlock)))
+    return ret;
+  while (list_empty(&us->us_queue)) {
+    if (flags & MSG_DONTWAIT) {
+      ret = -EAGAIN;
+      goto out;
+    }
+    if ((ret = sched_cancellable_sleep_on(&us->us_waitq)))
+      goto out;
+  }
+  ud = list_head(&us->us_queue, udp_dgram_t, ud_link);
+  n = MIN(room, ud->ud_len);
+  if (!n) {
+    ret = 0;
+  } else if ((flags & MSG_GIFT) && iov[0].iov_len >= PAGE_SIZE &&
+             PAGE_ALIGNED(iov[0].iov_base) &&
+             0 <= vmmap_give_page(curproc->p_vmmap,
+                                  ADDR_TO_PN(iov[0].iov_base), ud->ud_obj,
+                                  0)) {
+    udp_ngifted++;
+  } else if (0 > (ret = udp_copyout(ud, iov, msg->msg_iovlen, n))) {
+    goto out;
+  } else {
+    udp_ncopied++;
+  }
+  msg->msg_flags = n < ud->ud_len ? MSG_TRUNC : 0;
+  msg->msg_controllen = 0;
+  if (msg->msg_name) {
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = ud->ud_sport;
+    sin.sin_addr.s_addr = ud->ud_src;
+    memcpy(msg->msg_name, &sin, MIN(msg->msg_namelen, sizeof(sin)));
+    msg->msg_namelen = sizeof(sin);
+  }
+  list_remove(&ud->ud_link);
+  us->us_nqueued--;
+  udp_dgram_free(ud);
+  ret = (int)n;
+
+out:
+  kmutex_unlock(&us->us_rdlock);
+  return ret;
+}
+
+/*
+ * Sends msg's buffers as one datagram to the address in msg_name, of at
+ * most UDP_MAX_PAYLOAD bytes, binding the socket to a port first if it
+ * has none.
+ */
+int udp_sendmsg(vnode_t *vn, const struct msghdr *msg, int flags) {
+  udp_sock_t *us = VNODE_TO_UDP(vn);
+  const struct sockaddr_in *sin = (const struct sockaddr_in *)msg->msg_name;
+  udp_hdr_t uh;
+  size_t len = 0, off = 0;
+  void *data = NULL;
+  int i, ret;
+
+  if (!sin)
+    return -EDESTADDRREQ;
+  if (msg->msg_namelen < sizeof(*sin) || AF_INET != sin->sin_family)
+    return -EINVAL;
+  if (msg->msg_controllen)
+    return -EINVAL;
+  for (i = 0; i < msg->msg_iovlen; ++i)
+    len += msg->msg_iov[i].iov_len;
+  if (len > UDP_MAX_PAYLOAD)
+    return -EMSGSIZE;
+  if (!us->us_port && 0 > (ret = udp_bind_port(us, 0)))
+    return ret;
+
+  if (len) {
+    if (NULL == (data = page_alloc()))
+      return -ENOMEM;
+    for (i = 0; i < msg->msg_iovlen; ++i) {
+      if (0 > (ret = copy_from_user((char *)data + off,
+                                    msg->msg_iov[i].iov_base,
+                                    msg->msg_iov[i].iov_len))) {
+        page_free(data);
+        return ret;
+      }
+      off += msg->msg_iov[i].iov_len;
+    }
+  }
+  uh.uh_sport = us->us_port;
+  uh.uh_dport = sin->sin_port;
+  uh.uh_len = htons(UDP_HLEN + len);
+  uh.uh_csum = 0; /* none, which IPv4 allows */
+  if (0 > (ret = net_send(sin->sin_addr.s_addr, IPPROTO_UDP, &uh, sizeof(uh),
+                          data, len, flags & MSG_DONTWAIT)))
+    return ret;
+  udp_nsent++;
+  return (int)len;
+}
+
+static int udp_read(vnode_t *vnode, off_t offset, void *buf, size_t len) {
+  /* recvmsg() copies to the user; read() has a kernel buffer */
+  udp_sock_t *us = VNODE_TO_UDP(vnode);
+  udp_dgram_t *ud;
+  pframe_t *pf;
+  int ret;
+
+  if ((ret = kmutex_lock_cancellable(&us->us_rdlock)))
+    return ret;
+  while (list_empty(&us->us_queue)) {
+    if ((ret = sched_cancellable_sleep_on(&us->us_waitq)))
+      goto out;
+  }
+  ud = list_head(&us->us_queue, udp_dgram_t, ud_link);
+  len = MIN(len, ud->ud_len);
+  if (len) {
+    if (0 > (ret = pframe_lookup(ud->ud_obj, 0, 0, &pf)))
+      goto out;
+    memcpy(buf, pf->pf_addr, len);
+    udp_ncopied++;
+  }
+  list_remove(&ud->ud_link);
+  us->us_nqueued--;
+  udp_dgram_free(ud);
+  ret = (int)len;
+
+out:
+  kmutex_unlock(&us->us_rdlock);
+  return ret;
+}
+
+/* There is no connect(), so nowhere for write() to send */
+static int udp_write(vnode_t *vnode, off_t offset, const void *buf,
+                     size_t len) {
+  return -EDESTADDRREQ;
+}
+
+static int udp_stat(vnode_t *vnode, struct stat *ss) {
+  memset(ss, 0, sizeof(*ss));
+  ss->st_mode = vnode->vn_mode;
+  ss->st_ino = (int)vnode->vn_vno;
+  ss->st_nlink = 1;
+  ss->st_size = VNODE_TO_UDP(vnode)->us_nqueued;
+  ss->st_blksize = (int)PAGE_SIZE;
+  return 0;
+}
+
+static int udp_acquire(vnode_t *vnode, file_t *file) {
+  VNODE_TO_UDP(vnode)->us_nfiles++;
+  return 0;
+}
+
+/* When the last file goes, the port is given up and what was queued for
+ * it thrown away */
+static int udp_release(vnode_t *vnode, file_t *file) {
+  udp_sock_t *us = VNODE_TO_UDP(vnode);
+  udp_dgram_t *ud;
+
+  if (--us->us_nfiles)
+    return 0;
+  if (us->us_port) {
+    list_remove(&us->us_link);
+    us->us_port = 0;
+  }
+  list_iterate_begin(&us->us_queue, ud, udp_dgram_t, ud_link) {
+    list_remove(&ud->ud_link);
+    udp_dgram_free(ud);
+  }
+  list_iterate_end();
+  us->us_nqueued = 0;
+  return 0;
+}
+
+/* A socket can always be sent from, and read once a datagram waits */
+static int udp_poll(vnode_t *vnode, int events, poll_table_t *pt) {
+  udp_sock_t *us = VNODE_TO_UDP(vnode);
+
+  poll_wait(&us->us_pollq, pt);
+  return POLLOUT | (list_empty(&us->us_queue) ? 0 : POLLIN);
+}
+
+size_t udp_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  udp_sock_t *us;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "udp sent %u\n", udp_nsent);
+  iprintf(&buf, &size, "udp received %u\n", udp_nreceived);
+  iprintf(&buf, &size, "udp no port %u\n", udp_nnoport);
+  iprintf(&buf, &size, "udp overflow %u\n", udp_noverflow);
+  iprintf(&buf, &size, "udp gifted %u\n", udp_ngifted);
+  iprintf(&buf, &size, "udp copied %u\n", udp_ncopied);
+  list_iterate_begin(&udp_socks, us, udp_sock_t, us_link) {
+    iprintf(&buf, &size, "udp port %u queued %d\n", ntohs(us->us_port),
+            us->us_nqueued);
+  }
+  list_iterate_end();
+  return size;
+}
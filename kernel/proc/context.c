@@ -1,16 +1,138 @@
 #include "config.h"
+#include "errno.h"
+#include "globals.h"
 
 #include "proc/context.h"
 #include "proc/kthread.h"
+#include "proc/proc.h"
 
 #include "main/apic.h"
+#include "main/cpuid.h"
 #include "main/interrupt.h"
 #include "main/gdt.h"
 
 #include "mm/page.h"
 #include "mm/pagetable.h"
+#include "mm/slab.h"
 
 #include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+/*
+ * The FPU and SSE registers are switched lazily. They belong to
+ * fpu_owner, the context which used them last, and every other context
+ * runs with CR0.TS set. Its first FPU instruction then traps to
+ * fpu_trap, which saves the owner's registers and loads this context's.
+ * Switching between threads which never use the FPU (all of the kernel's,
+ * and most of userland's) costs at most a write to CR0, and a thread
+ * switched away from and back to with nobody using the FPU in between
+ * finds its registers where it left them.
+ *
+ * The saved registers are kept in FPU_STATE_SIZE bytes from a slab,
+ * aligned by hand since FXSAVE needs 16 byte alignment. Without FXSR
+ * they are saved with FNSAVE, which needs less room and no alignment.
+ */
+#define CR0_MP 0x00000002 /* WAIT traps with TS too */
+#define CR0_EM 0x00000004 /* no FPU: every FPU instruction traps */
+#define CR0_TS 0x00000008 /* task switched: the next FPU instruction traps */
+#define CR0_NE 0x00000020 /* FPU errors as exceptions, not IRQ 13 */
+#define CR4_OSFXSR 0x00000200     /* FXSAVE saves SSE, SSE is allowed */
+#define CR4_OSXMMEXCPT 0x00000400 /* SSE errors as exceptions */
+
+#define FPU_STATE_SIZE 512
+#define FPU_STATE_ALIGN 16
+#define MXCSR_DEFAULT 0x1f80 /* all SSE exceptions masked */
+
+#define fpu_state(c)                                                           \
+  ((void *)(((uintptr_t)(c)->c_fpu + FPU_STATE_ALIGN - 1) &                    \
+            ~(uintptr_t)(FPU_STATE_ALIGN - 1)))
+
+static slab_allocator_t *fpu_state_allocator = NULL; /* NULL until init */
+static context_t *fpu_owner = NULL;
+static int fpu_fxsr = 0;     /* FXSAVE and FXRSTOR can be used */
+static int fpu_sse = 0;      /* SSE is enabled, and has an MXCSR */
+static int fpu_trapping = 0; /* CR0.TS is set */
+
+static inline uint32_t fpu_get_cr0(void) {
+  uint32_t cr0;
+  __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+  return cr0;
+}
+
+static inline void fpu_set_cr0(uint32_t cr0) {
+  __asm__ volatile("movl %0, %%cr0" ::"r"(cr0));
+}
+
+static void fpu_save(context_t *c) {
+  if (fpu_fxsr)
+    __asm__ volatile("fxsave %0"
+                     : "=m"(*(uint8_t(*)[FPU_STATE_SIZE])fpu_state(c)));
+  else
+    __asm__ volatile("fnsave %0"
+                     : "=m"(*(uint8_t(*)[FPU_STATE_SIZE])fpu_state(c)));
+}
+
+static void fpu_restore(context_t *c) {
+  if (fpu_fxsr)
+    __asm__ volatile("fxrstor %0"
+                     ::"m"(*(uint8_t(*)[FPU_STATE_SIZE])fpu_state(c)));
+  else
+    __asm__ volatile("frstor %0"
+                     ::"m"(*(uint8_t(*)[FPU_STATE_SIZE])fpu_state(c)));
+}
+
+/* Sets CR0.TS unless the context we are switching to owns the FPU */
+static void fpu_switch(context_t *newc) {
+  int trap = (newc != fpu_owner);
+
+  if (NULL == fpu_state_allocator || trap == fpu_trapping)
+    return;
+  if (trap)
+    fpu_set_cr0(fpu_get_cr0() | CR0_TS);
+  else
+    __asm__ volatile("clts");
+  fpu_trapping = trap;
+}
+
+/*
+ * The device not available trap: the current thread wants the FPU. It
+ * is synchronous, in the thread's own context, so it may block for
+ * memory like a page fault does; a thread which cannot get any is
+ * killed.
+ */
+static void fpu_trap(regs_t *regs) {
+  context_t *c;
+
+  KASSERT(NULL != curthr && "FPU used with no thread running");
+  c = &curthr->kt_ctx;
+  __asm__ volatile("clts");
+  fpu_trapping = 0;
+  if (fpu_owner == c)
+    return;
+
+  if (NULL != fpu_owner)
+    fpu_save(fpu_owner);
+  fpu_owner = NULL;
+
+  if (NULL != c->c_fpu) {
+    fpu_restore(c);
+  } else if (NULL != (c->c_fpu = slab_obj_alloc(fpu_state_allocator))) {
+    /* First use: start from the registers as they are after reset */
+    __asm__ volatile("fninit");
+    if (fpu_sse) {
+      uint32_t mxcsr = MXCSR_DEFAULT;
+      __asm__ volatile("ldmxcsr %0" ::"m"(mxcsr));
+    }
+  } else {
+    dbg(DBG_THR, "no memory for thread %p's FPU state\n", curthr);
+    fpu_set_cr0(fpu_get_cr0() | CR0_TS);
+    fpu_trapping = 1;
+    proc_kill(curproc, ENOMEM);
+    return;
+  }
+  fpu_owner = c;
+}
 
 static void __context_initial_func(context_func_t func, int arg1, void *arg2) {
   apic_setipl(IPL_LOW);
@@ -22,14 +144,76 @@ static void __context_initial_func(context_func_t func, int arg1, void *arg2) {
   panic("\nReturned from kthread_exit.\n");
 }
 
+static __attribute__((unused)) void fpu_init(void) {
+  uint32_t eax, edx, cr4;
+
+  cpuid(CPUID_GETFEATURES, &eax, &edx);
+  KASSERT((edx & CPUID_FEAT_EDX_FPU) && "Weenix needs an FPU");
+  fpu_fxsr = !!(edx & CPUID_FEAT_EDX_FXSR);
+  if (fpu_fxsr) {
+    __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR;
+    if (edx & CPUID_FEAT_EDX_SSE) {
+      cr4 |= CR4_OSXMMEXCPT;
+      fpu_sse = 1;
+    }
+    __asm__ volatile("movl %0, %%cr4" ::"r"(cr4));
+  }
+  fpu_set_cr0((fpu_get_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+
+  fpu_state_allocator =
+      slab_allocator_create("fpu_state", FPU_STATE_SIZE + FPU_STATE_ALIGN - 1);
+  KASSERT(NULL != fpu_state_allocator);
+  intr_register(INTR_DEVICE_NOT_AVAILABLE, fpu_trap);
+
+  /* Nobody owns the FPU yet, so the next thread to use it traps */
+  fpu_owner = NULL;
+  fpu_set_cr0(fpu_get_cr0() | CR0_TS);
+  fpu_trapping = 1;
+  dbg(DBG_CORE, "lazy FPU switching, with %s\n",
+      fpu_sse ? "SSE" : (fpu_fxsr ? "FXSAVE" : "FNSAVE"));
+}
+init_func(fpu_init);
+
+void context_cleanup(context_t *c) {
+  if (fpu_owner == c)
+    fpu_owner = NULL;
+  if (NULL != c->c_fpu) {
+    slab_obj_free(fpu_state_allocator, c->c_fpu);
+    c->c_fpu = NULL;
+  }
+}
+
+int context_fpu_copy(context_t *newc, context_t *oldc) {
+  newc->c_fpu = NULL;
+  if (NULL == oldc->c_fpu)
+    return 0;
+  if (NULL == (newc->c_fpu = slab_obj_alloc(fpu_state_allocator)))
+    return -ENOMEM;
+  if (fpu_owner == oldc) {
+    /* FNSAVE leaves the FPU initialized, so put ours back */
+    fpu_save(oldc);
+    if (!fpu_fxsr)
+      fpu_restore(oldc);
+  }
+  memcpy(fpu_state(newc), fpu_state(oldc), FPU_STATE_SIZE);
+  return 0;
+}
+
+void context_fpu_reset(context_t *c) {
+  context_cleanup(c);
+  fpu_switch(c);
+}
+
 void context_setup(context_t *c, context_func_t func, int arg1, void *arg2,
                    void *kstack, size_t kstacksz, pagedir_t *pdptr) {
-  KASSERT(NULL != pdptr);
   KASSERT(PAGE_ALIGNED(kstack));
 
   c->c_kstack = (uintptr_t)kstack;
   c->c_kstacksz = kstacksz;
   c->c_pdptr = pdptr;
+  c->c_tls = 0;
+  c->c_fpu = NULL;
 
   /* put the arguments for __contect_initial_func onto the
    * stack, leave room at the bottom of the stack for a phony
@@ -50,7 +234,10 @@ void context_setup(context_t *c, context_func_t func, int arg1, void *arg2,
 
 void context_make_active(context_t *c) {
   gdt_set_kernel_stack((void *)((uintptr_t)c->c_kstack + c->c_kstacksz));
-  pt_set(c->c_pdptr);
+  gdt_set_tls(c->c_tls);
+  fpu_switch(c);
+  if (c->c_pdptr)
+    pt_set(c->c_pdptr);
 
   /* Switch stacks and run the thread */
   __asm__ volatile("movl %0,%%ebp\n\t" /* update ebp */
@@ -63,7 +250,10 @@ void context_make_active(context_t *c) {
 
 void context_switch(context_t *oldc, context_t *newc) {
   gdt_set_kernel_stack((void *)((uintptr_t)newc->c_kstack + newc->c_kstacksz));
-  pt_set(newc->c_pdptr);
+  gdt_set_tls(newc->c_tls);
+  fpu_switch(newc);
+  if (newc->c_pdptr)
+    pt_set(newc->c_pdptr);
 
   /*
    * Save the current value of the stack pointer and the frame pointer into
@@ -1,4 +1,5 @@
 #include "types.h"
+#include "config.h"
 #include "globals.h"
 #include "errno.h"
 
@@ -49,6 +50,163 @@ static uint32_t fork_setup_stack(const regs_t *regs, void *kstack) {
  * Go forth and conquer.
  */
 int do_fork(struct regs *regs) {
-  NOT_YET_IMPLEMENTED("VM: do_fork");
-  return 0;
+  proc_t *child;
+  kthread_t *thr;
+  vmmap_t *map;
+  vmarea_t *vma, *cvma;
+  mmobj_t *obj, *pshadow, *cshadow;
+  int ret;
+
+  KASSERT(regs != NULL);
+  KASSERT(curproc != NULL);
+  KASSERT(curproc->p_state == PROC_RUNNING);
+
+  /* Each fork puts another shadow object over every private area, so
+   * cut chains which have reached the limit down first */
+  list_iterate_begin(&curproc->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+    if ((MAP_PRIVATE & vma->vma_flags) &&
+        SHADOW_MAX_DEPTH <= shadow_depth(vma->vma_obj)) {
+      shadow_collapse(vma);
+      if (SHADOW_MAX_DEPTH <= shadow_depth(vma->vma_obj) &&
+          0 > (ret = shadow_flatten(vma)))
+        return ret;
+    }
+  }
+  list_iterate_end();
+
+  if (NULL == (map = vmmap_clone(curproc->p_vmmap)))
+    return -ENOMEM;
+  /* Two shadow objects for each private area, made up front so that
+   * nothing below can fail half way through */
+  cvma = list_head(&map->vmm_list, vmarea_t, vma_plink);
+  list_iterate_begin(&curproc->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+    if (MAP_PRIVATE & vma->vma_flags) {
+      if (NULL == (pshadow = shadow_create()) ||
+          NULL == (cshadow = shadow_create())) {
+        if (pshadow)
+          pshadow->mmo_ops->put(pshadow);
+        vmmap_destroy(map);
+        return -ENOMEM;
+      }
+      /* Parked on the child's area, where vmmap_destroy puts both */
+      pshadow->mmo_shadowed = cshadow;
+      cvma->vma_obj = pshadow;
+    }
+    cvma = list_item(cvma->vma_plink.l_next, vmarea_t, vma_plink);
+  }
+  list_iterate_end();
+  if (NULL == (thr = kthread_clone(curthr))) {
+    vmmap_destroy(map);
+    return -ENOMEM;
+  }
+  if (0 > context_fpu_copy(&thr->kt_ctx, &curthr->kt_ctx)) {
+    thr->kt_state = KT_EXITED;
+    kthread_destroy(thr);
+    vmmap_destroy(map);
+    return -ENOMEM;
+  }
+
+  child = proc_create(curproc->p_comm);
+  KASSERT(NULL != child);
+
+  /* Address space: shared areas share the object, and both sides of a
+   * private area get a new shadow object over the old one, so that each
+   * copies a page the first time it writes it */
+  vmmap_destroy(child->p_vmmap);
+  child->p_vmmap = map;
+  map->vmm_proc = child;
+  cvma = list_head(&map->vmm_list, vmarea_t, vma_plink);
+  list_iterate_begin(&curproc->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+    obj = vma->vma_obj;
+    if (MAP_PRIVATE & vma->vma_flags) {
+      pshadow = cvma->vma_obj;
+      cshadow = pshadow->mmo_shadowed;
+      /* The old object loses the parent's reference and gains one from
+       * each shadow */
+      obj->mmo_ops->ref(obj);
+      pshadow->mmo_shadowed = obj;
+      pshadow->mmo_un.mmo_bottom_obj = mmobj_bottom_obj(obj);
+      cshadow->mmo_shadowed = obj;
+      cshadow->mmo_un.mmo_bottom_obj = mmobj_bottom_obj(obj);
+      vma->vma_obj = pshadow;
+      cvma->vma_obj = cshadow;
+    } else {
+      obj->mmo_ops->ref(obj);
+      cvma->vma_obj = obj;
+    }
+    list_insert_tail(mmobj_bottom_vmas(obj), &cvma->vma_olink);
+    cvma = list_item(cvma->vma_plink.l_next, vmarea_t, vma_plink);
+  }
+  list_iterate_end();
+
+  /* Rather than copy the page tables, drop the parent's user mappings:
+   * its pages now belong to objects the parent must write through its
+   * new shadows, and both processes fault in what they touch */
+  pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
+  tlb_flush_all();
+
+  /* Everything else */
+  fdtable_put(child->p_fdt);
+  fdtable_ref(curproc->p_fdt);
+  child->p_fdt = curproc->p_fdt;
+  if (child->p_cwd)
+    vput(child->p_cwd);
+  if (NULL != (child->p_cwd = curproc->p_cwd))
+    vref(child->p_cwd);
+  child->p_brk = curproc->p_brk;
+  child->p_start_brk = curproc->p_start_brk;
+
+  /* The child returns 0 from fork, straight into userland */
+  regs->r_eax = 0;
+  thr->kt_ctx.c_pdptr = child->p_pagedir;
+  thr->kt_ctx.c_eip = (uint32_t)userland_entry;
+  thr->kt_ctx.c_esp = fork_setup_stack(regs, thr->kt_kstack);
+  thr->kt_ctx.c_ebp = thr->kt_ctx.c_esp;
+  thr->kt_ctx.c_kstack = (uintptr_t)thr->kt_kstack;
+  thr->kt_ctx.c_kstacksz = DEFAULT_STACK_SIZE;
+  thr->kt_ctx.c_tls = curthr->kt_ctx.c_tls;
+  thr->kt_proc = child;
+  thr->kt_tid = child->p_nexttid++;
+  list_insert_tail(&child->p_threads, &thr->kt_plink);
+  sched_make_runnable(thr);
+
+  return child->p_pid;
+}
+
+#ifdef __MTP__
+/*
+ * The new thread starts out like a child of fork, in userland_entry, but
+ * in our own address space, and with the registers the caller asked for
+ * in place of the ones it trapped with. The entry point and the stack are
+ * the caller's to get right: if they are wrong, the thread faults.
+ */
+int do_thr_create(struct regs *regs, void *entry, void *stack, void *tls) {
+  kthread_t *thr;
+  regs_t tregs;
+
+  KASSERT(curproc->p_state == PROC_RUNNING);
+  if ((uint32_t)entry >= USER_MEM_HIGH || (uint32_t)stack > USER_MEM_HIGH ||
+      (uint32_t)tls >= USER_MEM_HIGH)
+    return -EINVAL;
+  if (NULL == (thr = kthread_clone(curthr)))
+    return -ENOMEM;
+
+  tregs = *regs;
+  tregs.r_eip = (uint32_t)entry;
+  tregs.r_useresp = (uint32_t)stack;
+  tregs.r_eax = 0;
+  thr->kt_ctx.c_pdptr = curproc->p_pagedir;
+  thr->kt_ctx.c_eip = (uint32_t)userland_entry;
+  thr->kt_ctx.c_esp = fork_setup_stack(&tregs, thr->kt_kstack);
+  thr->kt_ctx.c_ebp = thr->kt_ctx.c_esp;
+  thr->kt_ctx.c_kstack = (uintptr_t)thr->kt_kstack;
+  thr->kt_ctx.c_kstacksz = DEFAULT_STACK_SIZE;
+  thr->kt_ctx.c_tls = (uint32_t)tls;
+  thr->kt_proc = curproc;
+  thr->kt_tid = curproc->p_nexttid++;
+  list_insert_tail(&curproc->p_threads, &thr->kt_plink);
+  sched_make_runnable(thr);
+
+  return thr->kt_tid;
 }
+#endif
@@ -0,0 +1,155 @@
+/*
+ *  FILE: futex.c
+ *  DESC: futex(2), the slow path of userland locks.
+ *
+ * A lock is an int in the process's memory that its threads change with
+ * atomic instructions, and only come here when they have to wait for it,
+ * or when they release it and someone may be waiting. A futex is named
+ * by its address space and user address. Its waiters are kept, on their
+ * own stacks, in a hash table on that key, each sleeping on a ktqueue_t
+ * of its own, so that waking or requeueing one never disturbs waiters on
+ * other futexes in the same chain. A futex with no waiters has nothing
+ * at all in the kernel.
+ *
+ * FUTEX_WAIT reads the word and goes to sleep without blocking in
+ * between, so a FUTEX_WAKE from a thread which changed the word after it
+ * was read cannot be missed. FUTEX_REQUEUE wakes some waiters and moves
+ * the rest to another futex without waking them, which lets a condition
+ * variable broadcast hand its waiters to the mutex one at a time instead
+ * of letting them all fight over it. Futexes are private to an address
+ * space: the same page shared between two processes gives two unrelated
+ * futexes.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "api/access.h"
+
+#include "proc/futex.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#define FUTEX_HASH_ORDER 6
+#define FUTEX_HASH_MULT 0x9e3779b1U
+#define hash_futex(map, uaddr)                                                 \
+  (((((uint32_t)(map)) ^ ((uint32_t)(uaddr))) * FUTEX_HASH_MULT) >>          \
+   (32 - FUTEX_HASH_ORDER))
+#define futex_chain(map, uaddr) (&futex_hash[hash_futex(map, uaddr)])
+
+/* A thread in FUTEX_WAIT */
+typedef struct futex_waiter {
+  vmmap_t *fw_map;
+  int *fw_uaddr;     /* changed, along with the chain, by FUTEX_REQUEUE */
+  int fw_woken;      /* set, and taken off the chain, by FUTEX_WAKE */
+  ktqueue_t fw_wait; /* just this thread */
+  list_link_t fw_link;
+} futex_waiter_t;
+
+static list_t futex_hash[1 << FUTEX_HASH_ORDER];
+
+static __attribute__((unused)) void futex_init(void) {
+  int i;
+  for (i = 0; i < (1 << FUTEX_HASH_ORDER); i++)
+    list_init(&futex_hash[i]);
+}
+init_func(futex_init);
+
+static int futex_wait(int *uaddr, int val) {
+  futex_waiter_t fw;
+  int cur;
+
+  /* This may fault the page in and block, which is why the check below
+   * comes after it */
+  if (copy_from_user(&cur, uaddr, sizeof(cur)))
+    return -EFAULT;
+  if (cur != val)
+    return -EAGAIN;
+
+  fw.fw_map = curproc->p_vmmap;
+  fw.fw_uaddr = uaddr;
+  fw.fw_woken = 0;
+  sched_queue_init(&fw.fw_wait);
+  list_link_init(&fw.fw_link);
+  list_insert_tail(futex_chain(fw.fw_map, uaddr), &fw.fw_link);
+  if (sched_cancellable_sleep_on(&fw.fw_wait) && !fw.fw_woken) {
+    list_remove(&fw.fw_link);
+    return -EINTR;
+  }
+  KASSERT(!list_link_is_linked(&fw.fw_link));
+  return 0;
+}
+
+/*
+ * Wakes up to nr waiters on uaddr, in the order they went to sleep, and
+ * moves up to nrequeue of the others to uaddr2 (if it is not NULL).
+ * Returns how many were woken plus how many were moved.
+ */
+static int futex_wake_requeue(int *uaddr, int nr, int *uaddr2, int nrequeue) {
+  vmmap_t *map = curproc->p_vmmap;
+  futex_waiter_t *fw;
+  int woken = 0, moved = 0;
+
+  list_iterate_begin(futex_chain(map, uaddr), fw, futex_waiter_t, fw_link) {
+    if (map == fw->fw_map && uaddr == fw->fw_uaddr) {
+      if (woken < nr) {
+        list_remove(&fw->fw_link);
+        fw->fw_woken = 1;
+        sched_wakeup_on(&fw->fw_wait);
+        woken++;
+      } else if (NULL != uaddr2 && moved < nrequeue) {
+        /* At the tail of the new chain, so a requeued waiter stays behind
+         * those already waiting there */
+        list_remove(&fw->fw_link);
+        fw->fw_uaddr = uaddr2;
+        list_insert_tail(futex_chain(map, uaddr2), &fw->fw_link);
+        moved++;
+      }
+    }
+  }
+  list_iterate_end();
+  return woken + moved;
+}
+
+/*
+ * Returns 0 for FUTEX_WAIT, once woken; -EAGAIN if *uaddr was not val to
+ * begin with, or -EINTR if cancelled first. FUTEX_WAKE returns how many
+ * threads it woke, and the requeue operations how many they woke or
+ * moved; FUTEX_CMP_REQUEUE fails with -EAGAIN, doing nothing, unless
+ * *uaddr is still val3.
+ */
+int do_futex(int *uaddr, int op, int val, int *uaddr2, int val2, int val3) {
+  int cur;
+
+  if ((uint32_t)uaddr % sizeof(int))
+    return -EINVAL;
+  if (NULL == curproc->p_vmmap)
+    return -EINVAL;
+  switch (op) {
+  case FUTEX_WAIT:
+    return futex_wait(uaddr, val);
+  case FUTEX_WAKE:
+    return 0 > val ? -EINVAL : futex_wake_requeue(uaddr, val, NULL, 0);
+  case FUTEX_CMP_REQUEUE:
+    if (copy_from_user(&cur, uaddr, sizeof(cur)))
+      return -EFAULT;
+    if (cur != val3)
+      return -EAGAIN;
+    /* fall through */
+  case FUTEX_REQUEUE:
+    if (0 > val || 0 > val2 || (uint32_t)uaddr2 % sizeof(int))
+      return -EINVAL;
+    if (uaddr2 == uaddr)
+      uaddr2 = NULL;
+    return futex_wake_requeue(uaddr, val, uaddr2, val2);
+  default:
+    return -EINVAL;
+  }
+}
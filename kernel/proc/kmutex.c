@@ -1,7 +1,9 @@
+#include "kernel.h"
 #include "globals.h"
 #include "errno.h"
 
 #include "util/debug.h"
+#include "util/time.h"
 
 #include "proc/kthread.h"
 #include "proc/kmutex.h"
@@ -12,9 +14,152 @@
  * thread context.
  */
 
-void kmutex_init(kmutex_t *mtx) {
+/*
+ * Mutexes are handed over directly: kmutex_unlock makes the first waiter
+ * the holder before waking it, so the lock cannot be taken by a thread
+ * which comes along before the waiter runs, and a waiter which wakes up
+ * already holds the mutex.
+ */
+
+/*
+ * Priority inheritance: a thread going to sleep on a mutex lends its run
+ * queue level to the holder, if that is better than the holder's, so
+ * that threads at the levels in between cannot keep the holder (and so
+ * the waiter) off the processor. If the holder is itself waiting for a
+ * mutex the loan is passed on to that one's holder, and so on, up to
+ * KMUTEX_PI_DEPTH mutexes along. A thread keeps the best level of all
+ * the waiters on the mutexes it holds, and looks at them again whenever
+ * it lets one go or a waiter gives up.
+ */
+
+/*
+ * With KMUTEX_STATS every mutex belongs to the class of the kmutex_init
+ * call which set it up. A class is counted from when the holder is made
+ * (including when a mutex is handed over) until kmutex_unlock, and a
+ * locker which has to wait adds the time until it holds the mutex or
+ * gives up. The classes are put on kmutex_class_list the first time one
+ * of their mutexes is initialized, and never taken off.
+ */
+#if KMUTEX_STATS
+list_t kmutex_class_list = {&kmutex_class_list, &kmutex_class_list};
+#endif
+
+/* When a locker started waiting for mtx */
+static inline uint64_t kmutex_stat_now(void) {
+#if KMUTEX_STATS
+  return time_cycles();
+#else
+  return 0;
+#endif
+}
+
+static inline void kmutex_stat_waited(kmutex_t *mtx, uint64_t since) {
+#if KMUTEX_STATS
+  mtx->km_class->kc_contended++;
+  mtx->km_class->kc_wait_cycles += time_cycles() - since;
+#endif
+}
+
+static inline void kmutex_stat_released(kmutex_t *mtx) {
+#if KMUTEX_STATS
+  uint64_t held = time_cycles() - mtx->km_taken;
+  if (held > mtx->km_class->kc_max_hold)
+    mtx->km_class->kc_max_hold = held;
+#endif
+}
+
+/* Makes thr the holder of mtx */
+static void kmutex_take(kmutex_t *mtx, kthread_t *thr) {
+  mtx->km_holder = thr;
+  list_insert_head(&thr->kt_mutexes, &mtx->km_link);
+#if KMUTEX_STATS
+  mtx->km_class->kc_acquired++;
+  mtx->km_taken = time_cycles();
+#endif
+}
+
+/* Lends the given level to the holder of mtx, and along the chain of
+ * mutexes it is waiting for */
+static void kmutex_pi_lend(kmutex_t *mtx, int prio) {
+  kthread_t *holder;
+  int depth;
+
+  for (depth = 0; depth < KMUTEX_PI_DEPTH && NULL != mtx; ++depth) {
+    holder = mtx->km_holder;
+    if (NULL == holder || holder->kt_pi_prio <= prio)
+      return;
+    sched_set_inherited(holder, prio);
+    mtx = holder->kt_blocked_on;
+  }
+}
+
+/* Works out again the level thr inherits from its mutexes' waiters */
+static void kmutex_pi_update(kthread_t *thr) {
+  int prio = SCHED_NPRIO;
+  kmutex_t *mtx;
+  kthread_t *waiter;
+
+  list_iterate_begin(&thr->kt_mutexes, mtx, kmutex_t, km_link) {
+    list_iterate_begin(&mtx->km_waitq.tq_list, waiter, kthread_t, kt_qlink) {
+      prio = MIN(prio, sched_prio(waiter));
+    }
+    list_iterate_end();
+  }
+  list_iterate_end();
+  if (prio != thr->kt_pi_prio)
+    sched_set_inherited(thr, prio);
+}
+
+/* Called around a sleep on mtx, so that we lend our level to its holder
+ * while we wait */
+static void kmutex_wait_begin(kmutex_t *mtx) {
+  curthr->kt_blocked_on = mtx;
+  kmutex_pi_lend(mtx, sched_prio(curthr));
+}
+
+static void kmutex_wait_end(kmutex_t *mtx) {
+  curthr->kt_blocked_on = NULL;
+  /* If we gave up, the holder may have been running on our level */
+  if (mtx->km_holder != curthr && NULL != mtx->km_holder)
+    kmutex_pi_update(mtx->km_holder);
+}
+
+/*
+ * True if the holder is running on some processor right now, and so is
+ * likely to release the mutex soon. Only one processor runs threads, and
+ * it is running us, so for now the holder never is.
+ */
+static int kmutex_holder_running(kmutex_t *mtx) { return 0; }
+
+/*
+ * Spins for a while if the holder is running elsewhere, in the hope that
+ * it releases the mutex before we have to go to sleep. Returns true if
+ * the mutex was taken.
+ */
+static int kmutex_spin(kmutex_t *mtx) {
+  int spins;
+
+  for (spins = 0; spins < KMUTEX_SPIN_LIMIT && kmutex_holder_running(mtx);
+       ++spins) {
+    __asm__ volatile("pause" ::: "memory");
+  }
+  if (!mtx->km_holder && sched_queue_empty(&mtx->km_waitq)) {
+    kmutex_take(mtx, curthr);
+    return 1;
+  }
+  return 0;
+}
+
+void kmutex_init_class(kmutex_t *mtx, kmutex_class_t *kc) {
   sched_queue_init(&mtx->km_waitq);
   mtx->km_holder = NULL;
+  list_link_init(&mtx->km_link);
+#if KMUTEX_STATS
+  KASSERT(kc);
+  mtx->km_class = kc;
+  if (!list_link_is_linked(&kc->kc_link))
+    list_insert_tail(&kmutex_class_list, &kc->kc_link);
+#endif
 }
 
 /*
@@ -25,24 +170,72 @@ void kmutex_init(kmutex_t *mtx) {
  */
 void kmutex_lock(kmutex_t *mtx) {
   KASSERT(mtx->km_holder != curthr);
-  if (mtx->km_holder)
-    sched_sleep_on(&mtx->km_waitq);
-  KASSERT(!mtx->km_holder);
-  mtx->km_holder = curthr;
+  if (!mtx->km_holder) {
+    kmutex_take(mtx, curthr);
+    return;
+  }
+  uint64_t since = kmutex_stat_now();
+  if (!kmutex_spin(mtx)) {
+    kmutex_wait_begin(mtx);
+    sched_sleep_on_handoff(&mtx->km_waitq);
+    kmutex_wait_end(mtx);
+  }
+  kmutex_stat_waited(mtx, since);
+  KASSERT(mtx->km_holder == curthr);
 }
 
 /*
  * This should do the same as kmutex_lock, but use a cancellable sleep
  * instead.
+ *
+ * A cancelled waiter has been taken off the queue, so it can never have
+ * been handed the mutex; if we were handed it then we hold it, whether
+ * or not we were also cancelled afterwards.
  */
 int kmutex_lock_cancellable(kmutex_t *mtx) {
   KASSERT(mtx->km_holder != curthr);
-  if (mtx->km_holder) {
-    int canceled = sched_cancellable_sleep_on(&mtx->km_waitq);
-    mtx->km_holder = curthr;
-    return canceled;
+  if (!mtx->km_holder) {
+    kmutex_take(mtx, curthr);
+    return 0;
   }
-  return 0;
+  uint64_t since = kmutex_stat_now();
+  if (kmutex_spin(mtx)) {
+    kmutex_stat_waited(mtx, since);
+    return 0;
+  }
+  kmutex_wait_begin(mtx);
+  int canceled = sched_cancellable_sleep_on(&mtx->km_waitq);
+  kmutex_wait_end(mtx);
+  kmutex_stat_waited(mtx, since);
+  if (mtx->km_holder == curthr)
+    return 0;
+  KASSERT(canceled);
+  return canceled;
+}
+
+/*
+ * Like kmutex_lock_cancellable, but also gives up after the given number
+ * of clock ticks.
+ */
+int kmutex_lock_timeout(kmutex_t *mtx, unsigned long ticks) {
+  KASSERT(mtx->km_holder != curthr);
+  if (!mtx->km_holder) {
+    kmutex_take(mtx, curthr);
+    return 0;
+  }
+  uint64_t since = kmutex_stat_now();
+  if (kmutex_spin(mtx)) {
+    kmutex_stat_waited(mtx, since);
+    return 0;
+  }
+  kmutex_wait_begin(mtx);
+  int ret = sched_cancellable_sleep_on_timeout(&mtx->km_waitq, ticks);
+  kmutex_wait_end(mtx);
+  kmutex_stat_waited(mtx, since);
+  if (mtx->km_holder == curthr)
+    return 0;
+  KASSERT(ret);
+  return ret;
 }
 
 /*
@@ -57,11 +250,34 @@ int kmutex_lock_cancellable(kmutex_t *mtx) {
  * Note: Make sure that the thread on the head of the mutex's wait
  * queue becomes the new owner of the mutex.
  *
+ * A waiter in kmutex_lock_cancellable or kmutex_lock_timeout which has
+ * been cancelled gives up as soon as it wakes up, so it is woken without
+ * being given the mutex. A waiter in kmutex_lock is given it regardless:
+ * its sleep cannot be cancelled, and it only notices the cancellation
+ * after it has the mutex.
+ *
+ * The new holder inherits from the waiters left behind, and we go back
+ * to what the mutexes we still hold give us.
+ *
  * @param mtx the mutex to unlock
  */
 void kmutex_unlock(kmutex_t *mtx) {
+  kthread_t *next;
+  int gives_up;
+
   KASSERT(mtx->km_holder && mtx->km_holder == curthr); // Make sure the mutex is locked
+  kmutex_stat_released(mtx);
   mtx->km_holder = NULL;
-  sched_wakeup_on(&mtx->km_waitq);
+  list_remove(&mtx->km_link);
+  while (NULL != (next = sched_queue_peek(&mtx->km_waitq))) {
+    /* waking it makes it runnable, so look at how it sleeps first */
+    gives_up = next->kt_cancelled && KT_SLEEP_CANCELLABLE == next->kt_state;
+    sched_wakeup_on(&mtx->km_waitq);
+    if (!gives_up) {
+      kmutex_take(mtx, next);
+      kmutex_pi_update(next);
+      break;
+    }
+  }
+  kmutex_pi_update(curthr);
 }
-
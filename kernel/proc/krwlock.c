@@ -0,0 +1,127 @@
+#include "globals.h"
+
+#include "util/debug.h"
+#include "util/time.h"
+
+#include "proc/kthread.h"
+#include "proc/krwlock.h"
+
+/*
+ * IMPORTANT: As with mutexes, these locks can _NEVER_ be locked or
+ * unlocked from an interrupt context.
+ *
+ * Waiters are given the lock before they are woken up, so a thread which
+ * returns from sleeping on either queue already holds it. The sleeps
+ * cannot be cancelled, so that holds for a waiter which was cancelled
+ * meanwhile too; it notices once it has the lock.
+ */
+
+/* When a locker started waiting for rw */
+static inline uint64_t krwlock_stat_now(void) {
+#if KMUTEX_STATS
+  return time_cycles();
+#else
+  return 0;
+#endif
+}
+
+static inline void krwlock_stat_acquired(krwlock_t *rw, int n) {
+#if KMUTEX_STATS
+  rw->krw_class->kc_acquired += n;
+#endif
+}
+
+static inline void krwlock_stat_waited(krwlock_t *rw, uint64_t since) {
+#if KMUTEX_STATS
+  rw->krw_class->kc_contended++;
+  rw->krw_class->kc_wait_cycles += time_cycles() - since;
+#endif
+}
+
+/* Makes thr the holder of rw in write mode */
+static void krwlock_take_write(krwlock_t *rw, kthread_t *thr) {
+  rw->krw_writer = thr;
+  krwlock_stat_acquired(rw, 1);
+#if KMUTEX_STATS
+  rw->krw_taken = time_cycles();
+#endif
+}
+
+static inline void krwlock_stat_write_released(krwlock_t *rw) {
+#if KMUTEX_STATS
+  uint64_t held = time_cycles() - rw->krw_taken;
+  if (held > rw->krw_class->kc_max_hold)
+    rw->krw_class->kc_max_hold = held;
+#endif
+}
+
+/* Hands the lock to the first waiting writer, if any */
+static int krwlock_wake_writer(krwlock_t *rw) {
+  kthread_t *next;
+  if (NULL == (next = sched_wakeup_on(&rw->krw_wrq)))
+    return 0;
+  krwlock_take_write(rw, next);
+  return 1;
+}
+
+/* Hands the lock to every waiting reader */
+static int krwlock_wake_readers(krwlock_t *rw) {
+  int n = 0;
+  while (NULL != sched_wakeup_on(&rw->krw_rdq))
+    n++;
+  rw->krw_readers += n;
+  krwlock_stat_acquired(rw, n);
+  return n;
+}
+
+void krwlock_init_class(krwlock_t *rw, kmutex_class_t *kc) {
+  sched_queue_init(&rw->krw_rdq);
+  sched_queue_init(&rw->krw_wrq);
+  rw->krw_writer = NULL;
+  rw->krw_readers = 0;
+#if KMUTEX_STATS
+  KASSERT(kc);
+  rw->krw_class = kc;
+  if (!list_link_is_linked(&kc->kc_link))
+    list_insert_tail(&kmutex_class_list, &kc->kc_link);
+#endif
+}
+
+void krwlock_read_lock(krwlock_t *rw) {
+  KASSERT(rw->krw_writer != curthr);
+  if (!rw->krw_writer && sched_queue_empty(&rw->krw_wrq)) {
+    rw->krw_readers++;
+    krwlock_stat_acquired(rw, 1);
+    return;
+  }
+  uint64_t since = krwlock_stat_now();
+  sched_sleep_on_handoff(&rw->krw_rdq);
+  krwlock_stat_waited(rw, since);
+  KASSERT(!rw->krw_writer && 0 < rw->krw_readers);
+}
+
+void krwlock_read_unlock(krwlock_t *rw) {
+  KASSERT(!rw->krw_writer && 0 < rw->krw_readers);
+  if (0 == --rw->krw_readers)
+    krwlock_wake_writer(rw);
+}
+
+void krwlock_write_lock(krwlock_t *rw) {
+  KASSERT(rw->krw_writer != curthr);
+  if (!rw->krw_writer && !rw->krw_readers) {
+    krwlock_take_write(rw, curthr);
+    return;
+  }
+  uint64_t since = krwlock_stat_now();
+  sched_sleep_on_handoff(&rw->krw_wrq);
+  krwlock_stat_waited(rw, since);
+  KASSERT(rw->krw_writer == curthr && !rw->krw_readers);
+}
+
+void krwlock_write_unlock(krwlock_t *rw) {
+  KASSERT(krwlock_write_held(rw));
+  krwlock_stat_write_released(rw);
+  rw->krw_writer = NULL;
+  if (!krwlock_wake_readers(rw))
+    krwlock_wake_writer(rw);
+}
@@ -6,6 +6,7 @@
 #include "util/init.h"
 #include "util/debug.h"
 #include "util/list.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 #include "proc/kthread.h"
@@ -14,6 +15,8 @@
 
 #include "mm/slab.h"
 #include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/shrinker.h"
 
 kthread_t *curthr; /* global */
 static slab_allocator_t *kthread_allocator = NULL;
@@ -28,56 +31,222 @@ static list_t kthread_reapd_deadlist; /* Threads to be cleaned */
 static void *kthread_reapd_run(int arg1, void *arg2);
 #endif
 
+/*
+ * A kernel stack is DEFAULT_STACK_SIZE bytes above a guard page, which is
+ * left unmapped so that overflowing the stack faults rather than
+ * overwriting whatever lies below. Freed stacks are kept, guard and all,
+ * on kstack_cache (linked through their lowest bytes) for the next thread,
+ * up to KSTACK_CACHE_MAX of them, and given back to the page allocator
+ * under memory pressure.
+ */
+#define KSTACK_NPAGES (1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT))
+
+static list_t kstack_cache;
+static uint32_t kstack_ncached = 0;
+
+static shrinker_t kstack_shrinker;
+
+#if KSTACK_STATS
+/*
+ * With KSTACK_STATS every stack is filled with KSTACK_CANARY when it is
+ * handed out, and when its thread is destroyed the lowest word no longer
+ * holding it marks how deep the stack got. The depths are added up per
+ * function the threads were created to run, with forked threads counted
+ * together; functions beyond KSTACK_STATS_FUNCS share the last entry.
+ */
+#define KSTACK_CANARY 0x57ac57ac
+#define KSTACK_STATS_FUNCS 32
+
+typedef struct kstack_stat {
+  kthread_func_t ks_func;
+  uint32_t ks_nthreads; /* destroyed so far, 0 if the entry is unused */
+  uint32_t ks_max;      /* deepest, in bytes */
+  uint64_t ks_total;    /* sum of depths, in bytes */
+} kstack_stat_t;
+
+static kstack_stat_t kstack_stats[KSTACK_STATS_FUNCS];
+
+static void kstack_fill(char *stack) {
+  uint32_t *p = (uint32_t *)stack;
+  uint32_t *end = (uint32_t *)(stack + DEFAULT_STACK_SIZE);
+
+  while (p < end)
+    *p++ = KSTACK_CANARY;
+}
+
+static uint32_t kstack_depth(char *stack) {
+  uint32_t *p = (uint32_t *)stack;
+  uint32_t *end = (uint32_t *)(stack + DEFAULT_STACK_SIZE);
+
+  while (p < end && KSTACK_CANARY == *p)
+    p++;
+  return (char *)end - (char *)p;
+}
+
+static void kstack_account(kthread_t *t) {
+  uint32_t depth = kstack_depth(t->kt_kstack);
+  kstack_stat_t *ks;
+
+  for (ks = kstack_stats; ks < &kstack_stats[KSTACK_STATS_FUNCS - 1]; ++ks) {
+    if (!ks->ks_nthreads || ks->ks_func == t->kt_func)
+      break;
+  }
+  ks->ks_func = t->kt_func;
+  ks->ks_nthreads++;
+  ks->ks_max = MAX(ks->ks_max, depth);
+  ks->ks_total += depth;
+}
+
+size_t kthread_stack_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  kstack_stat_t *ks;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "stacks of %u bytes\n", DEFAULT_STACK_SIZE);
+  iprintf(&buf, &size, "%-10s %8s %8s %8s\n", "FUNC", "THREADS", "MAX",
+          "AVG");
+  for (ks = kstack_stats;
+       ks < &kstack_stats[KSTACK_STATS_FUNCS] && ks->ks_nthreads; ++ks) {
+    if (ks->ks_func)
+      iprintf(&buf, &size, "0x%.8x", (uintptr_t)ks->ks_func);
+    else
+      iprintf(&buf, &size, "%-10s", "fork");
+    iprintf(&buf, &size, " %8u %8u %8u\n", ks->ks_nthreads, ks->ks_max,
+            (uint32_t)(ks->ks_total / ks->ks_nthreads));
+  }
+  return size;
+}
+#endif
+
 void kthread_init() {
   kthread_allocator = slab_allocator_create("kthread", sizeof(kthread_t));
   KASSERT(NULL != kthread_allocator);
+  list_init(&kstack_cache);
 }
 
+/* kthread_init runs before the shrinkers are set up */
+static __attribute__((unused)) void kthread_stack_init(void) {
+  shrinker_register(&kstack_shrinker);
+}
+init_func(kthread_stack_init);
+init_depends(shrinker_init);
+
 /**
- * Allocates a new kernel stack.
+ * Allocates a new kernel stack, from the cache if it has one.
  *
  * @return a newly allocated stack, or NULL if there is not enough
  * memory available
  */
 static char *alloc_stack(void) {
-  /* extra page for "magic" data */
-  char *kstack;
-  int npages = 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT);
-  kstack = (char *)page_alloc_n(npages);
+  char *block, *stack;
+  list_link_t *link;
 
-  return kstack;
+  if (!list_empty(&kstack_cache)) {
+    link = kstack_cache.l_next;
+    list_remove(link);
+    kstack_ncached--;
+    stack = (char *)link;
+  } else {
+    if (NULL == (block = (char *)page_alloc_n(KSTACK_NPAGES)))
+      return NULL;
+    pt_kernel_guard((uintptr_t)block);
+    stack = block + PAGE_SIZE;
+  }
+#if KSTACK_STATS
+  kstack_fill(stack);
+#endif
+  return stack;
+}
+
+/* Gives a stack and its guard page back to the page allocator */
+static void release_stack(char *stack) {
+  pt_kernel_unguard((uintptr_t)stack - PAGE_SIZE);
+  page_free_n(stack - PAGE_SIZE, KSTACK_NPAGES);
 }
 
 /**
- * Frees a stack allocated with alloc_stack.
+ * Frees a stack allocated with alloc_stack, keeping it in the cache if
+ * there is room.
  *
  * @param stack the stack to free
  */
 static void free_stack(char *stack) {
-  page_free_n(stack, 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT));
+  list_link_t *link = (list_link_t *)stack;
+
+  if (kstack_ncached >= KSTACK_CACHE_MAX) {
+    release_stack(stack);
+    return;
+  }
+  list_link_init(link);
+  list_insert_head(&kstack_cache, link);
+  kstack_ncached++;
+}
+
+static uint32_t kstack_shrink_count(void) {
+  return kstack_ncached * KSTACK_NPAGES;
+}
+
+/* The stacks freed longest ago go first */
+static uint32_t kstack_shrink_scan(uint32_t nr) {
+  list_link_t *link;
+  uint32_t nfreed = 0;
+
+  while (nfreed < nr && !list_empty(&kstack_cache)) {
+    link = kstack_cache.l_prev;
+    list_remove(link);
+    kstack_ncached--;
+    release_stack((char *)link);
+    nfreed += KSTACK_NPAGES;
+  }
+  return nfreed;
 }
 
+static shrinker_t kstack_shrinker = {.sh_name = "kstack",
+                                     .sh_count = kstack_shrink_count,
+                                     .sh_scan = kstack_shrink_scan};
+
 /*
  * Allocate a new stack with the alloc_stack function. The size of the
  * stack is DEFAULT_STACK_SIZE.
  *
  * Don't forget to initialize the thread context with the
- * context_setup function. The context should have the same pagetable
- * pointer as the process.
+ * context_setup function. The thread runs only in the kernel until it
+ * execs, so its context has no page directory of its own and borrows
+ * whichever is loaded (see context.h); exec gives it the process's.
  */
 kthread_t *kthread_create(struct proc *p, kthread_func_t func, long arg1,
                           void *arg2) {
   kthread_t *new_kt = slab_obj_alloc(kthread_allocator);
   new_kt->kt_kstack = alloc_stack();
   KASSERT(new_kt->kt_kstack);
+#if KSTACK_STATS
+  new_kt->kt_func = func;
+#endif
   context_setup(&new_kt->kt_ctx, func, arg1, arg2, new_kt->kt_kstack,
-                DEFAULT_STACK_SIZE, p->p_pagedir);
+                DEFAULT_STACK_SIZE, NULL);
   new_kt->kt_retval = 0;
   new_kt->kt_errno = 0;
   new_kt->kt_proc = p;
+  new_kt->kt_tid = p->p_nexttid++;
   new_kt->kt_cancelled = 0;
   new_kt->kt_wchan = NULL;
+  new_kt->kt_preempt_count = 0;
+  new_kt->kt_worker = NULL;
   new_kt->kt_state = KT_NO_STATE;
+  new_kt->kt_prio = 0;
+  new_kt->kt_ticks = 0;
+  new_kt->kt_runtime = 0;
+  new_kt->kt_utime = 0;
+  new_kt->kt_stime = 0;
+  memset(new_kt->kt_perf, 0, sizeof(new_kt->kt_perf));
+  new_kt->kt_cpumask = SCHED_CPUMASK_ALL;
+  new_kt->kt_pi_prio = SCHED_NPRIO;
+  list_init(&new_kt->kt_mutexes);
+  new_kt->kt_blocked_on = NULL;
+#ifdef __MTP__
+  new_kt->kt_detached = 0;
+  sched_queue_init(&new_kt->kt_joinq);
+#endif
   list_link_init(&new_kt->kt_qlink);
   list_link_init(&new_kt->kt_plink);
   list_insert_tail(&p->p_threads, &new_kt->kt_plink);
@@ -86,10 +255,16 @@ kthread_t *kthread_create(struct proc *p, kthread_func_t func, long arg1,
 
 // Clean up the thread from another thread
 void kthread_destroy(kthread_t *t) {
-  dbg(DBG_INIT, "destroying thread of proc %d\n", t->kt_proc->p_pid);
+  /* A detached thread's process may be gone by the time reapd gets here,
+   * so this does not look at kt_proc */
+  dbg(DBG_THR, "destroying thread %p\n", t);
   KASSERT(t && t->kt_kstack);
   KASSERT(t->kt_state == KT_EXITED);
   KASSERT(!list_link_is_linked(&t->kt_qlink));
+  context_cleanup(&t->kt_ctx);
+#if KSTACK_STATS
+  kstack_account(t);
+#endif
   free_stack(t->kt_kstack);
   // if (list_link_is_linked(&t->kt_plink))
   // list_remove(&t->kt_plink);
@@ -98,27 +273,28 @@ void kthread_destroy(kthread_t *t) {
 
 /*
  * If the thread to be cancelled is the current thread, this is
- * equivalent to calling kthread_exit. Otherwise, the thread is
- * sleeping and we need to set the cancelled and retval fields of the
- * thread.
+ * equivalent to calling kthread_exit. Otherwise, we need to set the
+ * cancelled and retval fields of the thread.
  *
  * If the thread's sleep is cancellable, cancelling the thread should
  * wake it up from sleep.
  *
- * If the thread's sleep is not cancellable, we do nothing else here.
+ * If the thread's sleep is not cancellable, or the thread is on the run
+ * queue, we do nothing else here: it exits when it gets back to the
+ * syscall handler, or at the next tick that finds it in userland.
  */
 void kthread_cancel(kthread_t *kthr, void *retval) {
   if (kthr == curthr)
     kthread_exit(retval);
-  else {
-    if (kthr->kt_state == KT_SLEEP || kthr->kt_state == KT_SLEEP_CANCELLABLE) {
-      kthr->kt_retval = retval;
-      sched_cancel(kthr);
-    } else {
-      panic("kthread_cancel called with invalid state\n");
-    }
-    // TODO: what if the process isn't sleeping? could be on
-    // run queue (proc_kill)
+  else if (kthr->kt_state == KT_SLEEP ||
+           kthr->kt_state == KT_SLEEP_CANCELLABLE) {
+    kthr->kt_retval = retval;
+    sched_cancel(kthr);
+  } else if (kthr->kt_state == KT_RUN) {
+    kthr->kt_retval = retval;
+    kthr->kt_cancelled = 1;
+  } else {
+    KASSERT(kthr->kt_state == KT_EXITED);
   }
 }
 
@@ -150,8 +326,46 @@ void kthread_exit(void *retval) {
  * You do not need to worry about this until VM.
  */
 kthread_t *kthread_clone(kthread_t *thr) {
-  NOT_YET_IMPLEMENTED("VM: kthread_clone");
-  return NULL;
+  kthread_t *new_kt;
+
+  KASSERT(KT_RUN == thr->kt_state);
+  if (NULL == (new_kt = slab_obj_alloc(kthread_allocator)))
+    return NULL;
+  if (NULL == (new_kt->kt_kstack = alloc_stack())) {
+    slab_obj_free(kthread_allocator, new_kt);
+    return NULL;
+  }
+  /* The caller sets up the context and puts the thread in its process */
+  new_kt->kt_ctx.c_fpu = NULL;
+#if KSTACK_STATS
+  new_kt->kt_func = NULL;
+#endif
+  new_kt->kt_retval = 0;
+  new_kt->kt_errno = 0;
+  new_kt->kt_proc = NULL;
+  new_kt->kt_tid = 0;
+  new_kt->kt_cancelled = 0;
+  new_kt->kt_wchan = NULL;
+  new_kt->kt_preempt_count = 0;
+  new_kt->kt_worker = NULL;
+  new_kt->kt_state = KT_NO_STATE;
+  new_kt->kt_prio = thr->kt_prio;
+  new_kt->kt_ticks = 0;
+  new_kt->kt_runtime = 0;
+  new_kt->kt_utime = 0;
+  new_kt->kt_stime = 0;
+  memset(new_kt->kt_perf, 0, sizeof(new_kt->kt_perf));
+  new_kt->kt_cpumask = thr->kt_cpumask;
+  new_kt->kt_pi_prio = SCHED_NPRIO;
+  list_init(&new_kt->kt_mutexes);
+  new_kt->kt_blocked_on = NULL;
+#ifdef __MTP__
+  new_kt->kt_detached = 0;
+  sched_queue_init(&new_kt->kt_joinq);
+#endif
+  list_link_init(&new_kt->kt_qlink);
+  list_link_init(&new_kt->kt_plink);
+  return new_kt;
 }
 
 /*
@@ -160,13 +374,50 @@ kthread_t *kthread_clone(kthread_t *thr) {
  * unless your weenix is perfect.
  */
 #ifdef __MTP__
+kthread_t *kthread_lookup(proc_t *p, int tid) {
+  kthread_t *kthr;
+  list_iterate_begin(&p->p_threads, kthr, kthread_t, kt_plink) {
+    if (tid == kthr->kt_tid)
+      return kthr;
+  }
+  list_iterate_end();
+  return NULL;
+}
+
+/*
+ * A detached thread is freed as soon as it exits, by reapd, so it can no
+ * longer be joined. One that has already exited is freed here.
+ */
 int kthread_detach(kthread_t *kthr) {
-  NOT_YET_IMPLEMENTED("MTP: kthread_detach");
+  if (kthr->kt_detached || !sched_queue_empty(&kthr->kt_joinq))
+    return -EINVAL;
+  if (KT_EXITED == kthr->kt_state) {
+    list_remove(&kthr->kt_plink);
+    kthread_destroy(kthr);
+    return 0;
+  }
+  kthr->kt_detached = 1;
   return 0;
 }
 
+/*
+ * Only one thread may join a given thread, as the joiner frees it. The
+ * joiner's sleep is cancellable, so that a process exiting with one
+ * thread waiting for another does not hang.
+ */
 int kthread_join(kthread_t *kthr, void **retval) {
-  NOT_YET_IMPLEMENTED("MTP: kthread_join");
+  if (kthr == curthr)
+    return -EDEADLK;
+  if (kthr->kt_detached || !sched_queue_empty(&kthr->kt_joinq))
+    return -EINVAL;
+  while (KT_EXITED != kthr->kt_state) {
+    if (sched_cancellable_sleep_on(&kthr->kt_joinq))
+      return -EINTR;
+  }
+  if (retval)
+    *retval = kthr->kt_retval;
+  list_remove(&kthr->kt_plink);
+  kthread_destroy(kthr);
   return 0;
 }
 
@@ -174,17 +425,50 @@ int kthread_join(kthread_t *kthr, void **retval) {
 /* -------------------------- REAPER DAEMON ------------------------- */
 /* ------------------------------------------------------------------ */
 static __attribute__((unused)) void kthread_reapd_init() {
-  NOT_YET_IMPLEMENTED("MTP: kthread_reapd_init");
+  list_init(&kthread_reapd_deadlist);
+  sched_queue_init(&reapd_waitq);
+
+  KASSERT(NULL != curproc && (PID_IDLE == curproc->p_pid));
+  reapd = proc_create("reapd");
+  KASSERT(NULL != reapd);
+  reapd_thr = kthread_create(reapd, kthread_reapd_run, 0, NULL);
+  KASSERT(NULL != reapd_thr);
+  sched_make_runnable(reapd_thr);
 }
 init_func(kthread_reapd_init);
 init_depends(sched_init);
 
 void kthread_reapd_shutdown() {
-  NOT_YET_IMPLEMENTED("MTP: kthread_reapd_shutdown");
+  pid_t pid = reapd->p_pid, child;
+
+  KASSERT(NULL != reapd_thr);
+  KASSERT(PID_IDLE == curproc->p_pid);
+  kthread_cancel(reapd_thr, (void *)0);
+  reapd_thr = NULL;
+  reapd = NULL;
+  child = do_waitpid(pid, 0, NULL);
+  KASSERT(child == pid && "waited on process other than reapd");
 }
 
+void kthread_reapd_add(kthread_t *kthr) {
+  KASSERT(kthr->kt_detached && KT_EXITED == kthr->kt_state);
+  list_insert_tail(&kthread_reapd_deadlist, &kthr->kt_plink);
+  sched_broadcast_on(&reapd_waitq);
+}
+
+/* Threads only get on the dead list as they switch away for the last
+ * time, so by the time reapd runs none of them is on its stack */
 static void *kthread_reapd_run(int arg1, void *arg2) {
-  NOT_YET_IMPLEMENTED("MTP: kthread_reapd_run");
-  return (void *)0;
+  kthread_t *kthr;
+
+  while (1) {
+    list_iterate_begin(&kthread_reapd_deadlist, kthr, kthread_t, kt_plink) {
+      list_remove(&kthr->kt_plink);
+      kthread_destroy(kthr);
+    }
+    list_iterate_end();
+    if (0 > sched_cancellable_sleep_on(&reapd_waitq))
+      return (void *)0;
+  }
 }
 #endif
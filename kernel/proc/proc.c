@@ -7,11 +7,14 @@
 #include "util/list.h"
 #include "util/string.h"
 #include "util/printf.h"
+#include "util/time.h"
 
 #include "proc/kthread.h"
 #include "proc/proc.h"
+#include "proc/rcu.h"
 #include "proc/sched.h"
-#include "proc/proc.h"
+#include "proc/resource.h"
+#include "proc/times.h"
 
 #include "mm/slab.h"
 #include "mm/page.h"
@@ -25,49 +28,78 @@
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 #include "fs/file.h"
+#include "fs/aio.h"
 
 proc_t *curproc = NULL; /* global */
 static slab_allocator_t *proc_allocator = NULL;
 
 static list_t _proc_list;
 static proc_t *proc_initproc = NULL; /* Pointer to the init process (PID 1) */
+static proc_t *proc_idleproc = NULL; /* and the idle process (PID 0) */
+
+/*
+ * Every process, until it is reaped, holds its PID in _proc_pidmap (bit n
+ * is set while PID n is taken) and is on the chain of _proc_hash for its
+ * PID. proc_lookup walks the chains under RCU, so a reaped process is
+ * freed only after a grace period.
+ */
+#define PROC_HASH_ORDER 8
+#define hash_pid(pid) ((uint32_t)(pid) & ((1U << PROC_HASH_ORDER) - 1))
+#define PROC_PIDMAP_WORDS (PROC_MAX_COUNT / 32)
+
+static uint32_t _proc_pidmap[PROC_PIDMAP_WORDS];
+static list_t _proc_hash[1 << PROC_HASH_ORDER];
 
 void proc_init() {
+  int i;
+
   list_init(&_proc_list);
+  for (i = 0; i < (1 << PROC_HASH_ORDER); ++i)
+    list_init(&_proc_hash[i]);
   proc_allocator = slab_allocator_create("proc", sizeof(proc_t));
   KASSERT(proc_allocator != NULL);
 }
 
 static pid_t next_pid = 0;
+static int nr_pids = 0;
 
 /**
- * schedule_cancelable_sleep(p_wait);
- * Returns the next available PID.
+ * Returns the next available PID: the first one at or after next_pid
+ * whose bit in the PID map is clear, wrapping around. This looks at a
+ * word of the map at a time, and unless PIDs have wrapped around the
+ * first word looked at has a free PID.
  *
- * Note: Where n is the number of running processes, this algorithm is
- * worst case O(n^2). As long as PIDs never wrap around it is O(n).
- *
- * @return the next available PID
+ * @return the next available PID, or -1 if there are none
  */
 static int _proc_getid() {
-  proc_t *p;
-  pid_t pid = next_pid;
-  while (1) {
-  failed:
-    list_iterate_begin(&_proc_list, p, proc_t, p_list_link) {
-      // dbg(DBG_INIT, "pid %d taken\n", p->p_pid);
-      if (p->p_pid == pid) {
-        if ((pid = (pid + 1) % PROC_MAX_COUNT) == next_pid) {
-          return -1;
-        } else {
-          goto failed;
-        }
-      }
-    }
-    list_iterate_end();
-    next_pid = (pid + 1) % PROC_MAX_COUNT;
-    return pid;
+  uint32_t i, w = 0, bits = 0;
+  pid_t pid;
+
+  if (PROC_MAX_COUNT == nr_pids)
+    return -1;
+  /* the word holding next_pid is looked at twice: first from next_pid
+   * up, and last, after wrapping around, below it */
+  for (i = 0; i <= PROC_PIDMAP_WORDS; ++i) {
+    w = (next_pid / 32 + i) % PROC_PIDMAP_WORDS;
+    bits = ~_proc_pidmap[w];
+    if (0 == i)
+      bits &= ~0U << (next_pid % 32);
+    if (bits)
+      break;
   }
+  KASSERT(bits && "nr_pids is wrong");
+  pid = w * 32 + __builtin_ctz(bits);
+  _proc_pidmap[pid / 32] |= 1U << (pid % 32);
+  nr_pids++;
+  next_pid = (pid + 1) % PROC_MAX_COUNT;
+  return pid;
+}
+
+/* Makes a reaped process's PID available again */
+static void _proc_putid(pid_t pid) {
+  KASSERT(_proc_pidmap[pid / 32] & (1U << (pid % 32)));
+  _proc_pidmap[pid / 32] &= ~(1U << (pid % 32));
+  nr_pids--;
 }
 
 /*
@@ -78,7 +110,7 @@ static int _proc_getid() {
  * process. You will need to be able to reference the init process
  * when reparenting processes to the init process.
  */
-proc_t *proc_create(char *name) {
+static proc_t *proc_create_under(char *name, proc_t *parent) {
   dbg(DBG_INIT, "creating proc %s\n", name);
   // Allocate new proc
   proc_t *new_proc = slab_obj_alloc(proc_allocator);
@@ -90,41 +122,67 @@ proc_t *proc_create(char *name) {
   strncpy(new_proc->p_comm, name, PROC_NAME_LEN);
   // Initialize thread and children lists
   list_init(&new_proc->p_threads);
+  new_proc->p_nexttid = 1;
   list_init(&new_proc->p_children);
+  list_init(&new_proc->p_zombies);
   list_link_init(&new_proc->p_list_link);
+  list_link_init(&new_proc->p_hash_link);
+  list_link_init(&new_proc->p_zombie_link);
   list_link_init(&new_proc->p_child_link);
-  new_proc->p_pproc = curproc;
+  new_proc->p_pproc = parent;
   new_proc->p_status = 0;
   new_proc->p_state = PROC_RUNNING;
+  new_proc->p_waitpid = 0;
   sched_queue_init(&new_proc->p_wait);
+  new_proc->p_utime = new_proc->p_stime = 0;
+  new_proc->p_cutime = new_proc->p_cstime = 0;
 
   // Handle init case
   if (new_proc->p_pid == PID_INIT)
     proc_initproc = new_proc;
+  else if (new_proc->p_pid == PID_IDLE)
+    proc_idleproc = new_proc;
 
   // Add to tail of process list
   list_insert_tail(&_proc_list, &new_proc->p_list_link);
+  list_insert_head_rcu(&_proc_hash[hash_pid(new_proc->p_pid)],
+                       &new_proc->p_hash_link);
   // Add to parent's child list
-  if (curproc)
-    list_insert_tail(&curproc->p_children, &new_proc->p_child_link);
+  if (parent)
+    list_insert_tail(&parent->p_children, &new_proc->p_child_link);
 
   new_proc->p_pagedir = pt_create_pagedir();
 
-  for (int i = 0; i < NFILES; ++i)
-    new_proc->p_files[i] = NULL; // open files
+  new_proc->p_fdt = fdtable_create(); // open files
+  KASSERT(NULL != new_proc->p_fdt);
   if (vfs_root_vn) 
     vref(vfs_root_vn);
   else 
     dbg(DBG_VFS, "proc %s unable to vref\n", name);
   new_proc->p_cwd = vfs_root_vn; // current working dir 
+  new_proc->p_aio = NULL;
 
-  // Fields unset:
-  // /* VM */
+  new_proc->p_brk = NULL;
+  new_proc->p_start_brk = NULL;
+#ifdef __VM__
+  new_proc->p_vmmap = vmmap_create();
+  KASSERT(new_proc->p_vmmap);
+  new_proc->p_vmmap->vmm_proc = new_proc;
+#else
+  new_proc->p_vmmap = NULL;
+#endif
 
   dbg(DBG_INIT, "returning proc %s\n", name);
   return new_proc;
 }
 
+proc_t *proc_create(char *name) { return proc_create_under(name, curproc); }
+
+proc_t *proc_create_daemon(char *name) {
+  KASSERT(NULL != proc_idleproc);
+  return proc_create_under(name, proc_idleproc);
+}
+
 /**
  * Cleans up as much as the process as can be done from within the
  * process. This involves:
@@ -157,28 +215,43 @@ void proc_cleanup(int status) {
   if (curproc->p_pid == PID_INIT)
     KASSERT(list_empty(&curproc->p_children));
   else {
-    // Add process's children to init's children
+    // Add process's children to init's children, and the exited ones to
+    // those init can reap
     proc_t *iterator;
     list_iterate_begin(&curproc->p_children, iterator, proc_t, p_child_link) {
-      list_insert_tail(&proc_initproc->p_children, &iterator->p_child_link);
       list_remove(&iterator->p_child_link);
+      list_insert_tail(&proc_initproc->p_children, &iterator->p_child_link);
+      iterator->p_pproc = proc_initproc;
     }
     list_iterate_end();
+    if (!list_empty(&curproc->p_zombies)) {
+      list_iterate_begin(&curproc->p_zombies, iterator, proc_t,
+                         p_zombie_link) {
+        list_remove(&iterator->p_zombie_link);
+        list_insert_tail(&proc_initproc->p_zombies, &iterator->p_zombie_link);
+      }
+      list_iterate_end();
+      if (-1 == proc_initproc->p_waitpid)
+        sched_broadcast_on(&proc_initproc->p_wait);
+    }
   }
 
   list_remove(&curproc->p_list_link);
 
-  // Wake parent
-  sched_broadcast_on(&curproc->p_pproc->p_wait);
+  // Wait for asynchronous I/O, which holds references to files
+  if (curproc->p_aio)
+    aio_destroy(curproc);
 
   // Clean up files
-  for (int i = 0; i < NFILES; ++i) {
-    if (curproc->p_files[i])
-      do_close(i);
-  }
+  fdtable_put(curproc->p_fdt);
+  curproc->p_fdt = NULL;
   if (curproc->p_cwd) vput(curproc->p_cwd);
 
-  // TODO: clean up VM mappings
+  // Clean up VM mappings; the page tables go with the page directory
+  if (curproc->p_vmmap) {
+    vmmap_destroy(curproc->p_vmmap);
+    curproc->p_vmmap = NULL;
+  }
 }
 
 /*
@@ -235,14 +308,18 @@ void proc_kill_all() {
 }
 
 proc_t *proc_lookup(int pid) {
-  proc_t *p;
-  list_iterate_begin(&_proc_list, p, proc_t, p_list_link) {
+  proc_t *p, *found = NULL;
+  if (pid < 0 || pid >= PROC_MAX_COUNT)
+    return NULL;
+  rcu_read_lock();
+  list_iterate_rcu(&_proc_hash[hash_pid(pid)], p, proc_t, p_hash_link) {
     if (p->p_pid == pid) {
-      return p;
+      found = p;
+      break;
     }
   }
-  list_iterate_end();
-  return NULL;
+  rcu_read_unlock();
+  return found;
 }
 
 list_t *proc_list() { return &_proc_list; }
@@ -255,13 +332,81 @@ list_t *proc_list() { return &_proc_list; }
  * run. If you are implementing MTP, a single thread exiting does not
  * necessarily mean that the process should be exited.
  */
+/* Moves the current thread's processor time to its process, for good */
+static void proc_charge_exited(void) {
+  sched_charge(0);
+  curproc->p_utime += curthr->kt_utime;
+  curproc->p_stime += curthr->kt_stime;
+  curthr->kt_utime = curthr->kt_stime = 0;
+}
+
 void proc_thread_exited(void *retval) {
+  proc_t *parent;
+
+#ifdef __MTP__
+  kthread_t *kthr;
+  list_iterate_begin(&curproc->p_threads, kthr, kthread_t, kt_plink) {
+    if (kthr != curthr && KT_EXITED != kthr->kt_state) {
+      /* Not the last thread: the process lives on. Once we have switched
+       * away for good, a joiner or reapd frees us */
+      proc_charge_exited();
+      curthr->kt_state = KT_EXITED;
+      sched_broadcast_on(&curthr->kt_joinq);
+      if (curthr->kt_detached) {
+        list_remove(&curthr->kt_plink);
+        kthread_reapd_add(curthr);
+      }
+      sched_switch();
+      panic("exited thread was switched back to\n");
+    }
+  }
+  list_iterate_end();
+#endif
+
   proc_cleanup((int)retval);
+  proc_charge_exited();
   curthr->kt_state = KT_EXITED;
   curproc->p_state = PROC_DEAD;
+
+  // Now the parent can reap us; wake it if it is waiting for us
+  parent = curproc->p_pproc;
+  list_insert_tail(&parent->p_zombies, &curproc->p_zombie_link);
+  if (-1 == parent->p_waitpid || curproc->p_pid == parent->p_waitpid)
+    sched_broadcast_on(&parent->p_wait);
   sched_switch();
 }
 
+static void proc_free_rcu(rcu_head_t *head) {
+  slab_obj_free(proc_allocator, list_item(head, proc_t, p_rcu));
+}
+
+/* Frees an exited child of the current process, returning its pid */
+static pid_t proc_reap(proc_t *child, int *status) {
+  pid_t pid = child->p_pid;
+  kthread_t *thread;
+
+  KASSERT(PROC_DEAD == child->p_state && curproc == child->p_pproc);
+  KASSERT(!list_empty(&child->p_threads));
+  if (status)
+    *status = child->p_status;
+  list_remove(&child->p_child_link);
+  list_remove(&child->p_zombie_link);
+  list_remove_rcu(&child->p_hash_link);
+  _proc_putid(pid);
+  curproc->p_cutime += child->p_utime + child->p_cutime;
+  curproc->p_cstime += child->p_stime + child->p_cstime;
+  /* The thread which exited last, and any nobody joined or detached */
+  list_iterate_begin(&child->p_threads, thread, kthread_t, kt_plink) {
+    KASSERT(thread->kt_state == KT_EXITED);
+    list_remove(&thread->kt_plink);
+    kthread_destroy(thread);
+  }
+  list_iterate_end();
+  pt_destroy_pagedir(child->p_pagedir);
+  call_rcu(&child->p_rcu, proc_free_rcu);
+  return pid;
+}
+
 /* If pid is -1 dispose of one of the exited children of the current
  * process and return its exit status in the status argument, or if
  * all children of this process are still running, then this function
@@ -274,70 +419,167 @@ void proc_thread_exited(void *retval) {
  * If the current process has no children, or the given pid is not
  * a child of the current process return -ECHILD.
  *
+ * Exited children wait on their parent's p_zombies, oldest first, so
+ * neither case looks through the other children; and a child only wakes
+ * its parent if the parent is waiting for it in particular, or for any
+ * child (see p_waitpid).
+ *
  * Pids other than -1 and positive numbers are not supported.
  * Options other than 0 are not supported.
  */
 pid_t do_waitpid(pid_t pid, int options, int *status) {
+  proc_t *child = NULL;
+  int ret;
+
   KASSERT(!options);
   KASSERT(pid >= -1);
-  // Error if no children
-  if (list_empty(&curproc->p_children))
+  if (-1 == pid) {
+    if (list_empty(&curproc->p_children))
+      return -ECHILD;
+  } else if (NULL == (child = proc_lookup(pid)) ||
+             curproc != child->p_pproc) {
     return -ECHILD;
-  int found = 0;
+  }
+
   while (1) {
-    // Iterate through children and reap dead ones
-    proc_t *iterator;
-    list_iterate_begin(&curproc->p_children, iterator, proc_t, p_child_link) {
-      if (pid == -1 || (pid > 0 && iterator->p_pid == pid)) {
-        found = 1;
-        if (iterator->p_state == PROC_DEAD) {
-          KASSERT(!list_empty(&iterator->p_threads));
-          kthread_t *thread =
-              list_item(iterator->p_threads.l_next, kthread_t, kt_plink);
-          KASSERT(thread->kt_state == KT_EXITED);
-          if (status)
-            *status = iterator->p_status;
-          list_remove(&iterator->p_child_link);
-          pid_t pid = iterator->p_pid;
-          kthread_destroy(thread);
-          slab_obj_free(proc_allocator, iterator);
-          pt_destroy_pagedir(iterator->p_pagedir);
-          return pid;
-        }
-      }
+    if (-1 == pid && !list_empty(&curproc->p_zombies))
+      return proc_reap(
+          list_head(&curproc->p_zombies, proc_t, p_zombie_link), status);
+    if (-1 != pid && PROC_DEAD == child->p_state)
+      return proc_reap(child, status);
+    /* Another of our threads may be waiting already, for another child */
+    if (sched_queue_empty(&curproc->p_wait) || pid == curproc->p_waitpid)
+      curproc->p_waitpid = pid;
+    else
+      curproc->p_waitpid = -1;
+    ret = sched_cancellable_sleep_on(&curproc->p_wait);
+    if (sched_queue_empty(&curproc->p_wait))
+      curproc->p_waitpid = 0;
+    if (ret)
+      return -EINTR;
+  }
+}
+
+#ifdef __MTP__
+/*
+ * Threads which exit wake their joiners, so we wait on each in turn and
+ * look again from the start, as a detached one is gone once it has
+ * exited. The rest are joinable and nobody can now join them.
+ */
+int proc_kill_threads(void) {
+  kthread_t *kthr;
+
+  list_iterate_begin(&curproc->p_threads, kthr, kthread_t, kt_plink) {
+    if (kthr != curthr)
+      kthread_cancel(kthr, (void *)0);
+  }
+  list_iterate_end();
+again:
+  list_iterate_begin(&curproc->p_threads, kthr, kthread_t, kt_plink) {
+    if (kthr != curthr && KT_EXITED != kthr->kt_state) {
+      if (sched_cancellable_sleep_on(&kthr->kt_joinq))
+        return -EINTR;
+      goto again;
     }
-    list_iterate_end();
-    if (!found)
-      return -ECHILD;
-    sched_cancellable_sleep_on(&curproc->p_wait);
   }
+  list_iterate_end();
+  list_iterate_begin(&curproc->p_threads, kthr, kthread_t, kt_plink) {
+    if (kthr != curthr) {
+      list_remove(&kthr->kt_plink);
+      kthread_destroy(kthr);
+    }
+  }
+  list_iterate_end();
+  return 0;
 }
+#endif
 
 /*
- * Cancel all threads, join with them, and exit from the current
- * thread.
+ * Cancel all other threads and exit from the current thread. If others
+ * are still around, the last of them to exit cleans up the process; the
+ * status reaches it as the return value they were cancelled with.
  *
  * @param status the exit status of the process
  */
 void do_exit(int status) {
   kthread_t *iterator;
   list_iterate_begin(&curproc->p_threads, iterator, kthread_t, kt_plink) {
-    kthread_cancel(iterator, (void *)status);
+    if (iterator != curthr)
+      kthread_cancel(iterator, (void *)status);
   }
   list_iterate_end();
-#ifdef __MTP__
-  list_iterate_begin(&curproc->p_threads, iterator, kthread_t, kt_plink) {
-    kthread_join(iterator, (void *)status);
+  kthread_exit((void *)status);
+}
+
+/* The processor time of p's threads, living and exited, in cycles */
+static void proc_cputime(const proc_t *p, uint64_t *utime, uint64_t *stime) {
+  kthread_t *kthr;
+
+  if (curproc == p)
+    sched_charge(0);
+  *utime = p->p_utime;
+  *stime = p->p_stime;
+  list_iterate_begin(&p->p_threads, kthr, kthread_t, kt_plink) {
+    *utime += kthr->kt_utime;
+    *stime += kthr->kt_stime;
   }
   list_iterate_end();
-#endif
-  kthread_exit((void *)status);
+}
+
+static void cycles_to_timeval(uint64_t cycles, struct timeval *tv) {
+  uint64_t usecs = time_cycles_to_usecs(cycles);
+  tv->tv_sec = (time_t)(usecs / 1000000);
+  tv->tv_usec = (long)(usecs % 1000000);
+}
+
+/*
+ * This function implements the getrusage(2) system call, for the threads
+ * of the current process, the children it has reaped, or just the
+ * current thread. Only the processor times are kept.
+ */
+int do_getrusage(int who, struct rusage *ru) {
+  uint64_t utime, stime;
+
+  switch (who) {
+  case RUSAGE_SELF:
+    proc_cputime(curproc, &utime, &stime);
+    break;
+  case RUSAGE_CHILDREN:
+    utime = curproc->p_cutime;
+    stime = curproc->p_cstime;
+    break;
+  case RUSAGE_THREAD:
+    sched_charge(0);
+    utime = curthr->kt_utime;
+    stime = curthr->kt_stime;
+    break;
+  default:
+    return -EINVAL;
+  }
+  memset(ru, 0, sizeof(*ru));
+  cycles_to_timeval(utime, &ru->ru_utime);
+  cycles_to_timeval(stime, &ru->ru_stime);
+  return 0;
+}
+
+/* This function implements the times(2) system call, returning the
+ * number of clock ticks since boot */
+clock_t do_times(struct tms *buf) {
+  uint64_t utime, stime;
+
+  proc_cputime(curproc, &utime, &stime);
+  buf->tms_utime = time_cycles_to_ticks(utime);
+  buf->tms_stime = time_cycles_to_ticks(stime);
+  buf->tms_cutime = time_cycles_to_ticks(curproc->p_cutime);
+  buf->tms_cstime = time_cycles_to_ticks(curproc->p_cstime);
+  return time_ticks();
 }
 
 size_t proc_info(const void *arg, char *buf, size_t osize) {
   const proc_t *p = (proc_t *)arg;
   size_t size = osize;
   proc_t *child;
+  uint64_t utime, stime;
 
   KASSERT(NULL != p);
   KASSERT(NULL != buf);
@@ -371,6 +613,11 @@ size_t proc_info(const void *arg, char *buf, size_t osize) {
 
   iprintf(&buf, &size, "status:       %i\n", p->p_status);
   iprintf(&buf, &size, "state:        %i\n", p->p_state);
+  proc_cputime(p, &utime, &stime);
+  iprintf(&buf, &size, "user time:    %u us\n",
+          (uint32_t)time_cycles_to_usecs(utime));
+  iprintf(&buf, &size, "system time:  %u us\n",
+          (uint32_t)time_cycles_to_usecs(stime));
 
 #ifdef __VFS__
 #ifdef __GETCWD__
@@ -400,13 +647,23 @@ size_t proc_list_info(const void *arg, char *buf, size_t osize) {
   KASSERT(NULL != buf);
 
 #if defined(__VFS__) && defined(__GETCWD__)
-  iprintf(&buf, &size, "%5s %-13s %-18s %-s\n", "PID", "NAME", "PARENT", "CWD");
+  iprintf(&buf, &size, "%5s %-13s %-18s %8s %-s\n", "PID", "NAME", "PARENT",
+          "TIME", "CWD");
 #else
-  iprintf(&buf, &size, "%5s %-13s %-s\n", "PID", "NAME", "PARENT");
+  iprintf(&buf, &size, "%5s %-13s %-18s %8s\n", "PID", "NAME", "PARENT", "TIME");
 #endif
 
   list_iterate_begin(&_proc_list, p, proc_t, p_list_link) {
     char parent[64];
+    char cputime[16];
+    uint64_t utime, stime;
+    unsigned long ticks;
+
+    /* user and system time together, in seconds */
+    proc_cputime(p, &utime, &stime);
+    ticks = time_cycles_to_ticks(utime + stime);
+    snprintf(cputime, sizeof(cputime), "%lu.%02lu", ticks / TIME_HZ,
+             (ticks % TIME_HZ) * 100 / TIME_HZ);
     if (NULL != p->p_pproc) {
       snprintf(parent, sizeof(parent), "%3i (%s)", p->p_pproc->p_pid,
                p->p_pproc->p_comm);
@@ -418,14 +675,15 @@ size_t proc_list_info(const void *arg, char *buf, size_t osize) {
     if (NULL != p->p_cwd) {
       char cwd[256];
       lookup_dirpath(p->p_cwd, cwd, sizeof(cwd));
-      iprintf(&buf, &size, " %3i  %-13s %-18s %-s\n", p->p_pid, p->p_comm,
-              parent, cwd);
+      iprintf(&buf, &size, " %3i  %-13s %-18s %8s %-s\n", p->p_pid,
+              p->p_comm, parent, cputime, cwd);
     } else {
-      iprintf(&buf, &size, " %3i  %-13s %-18s -\n", p->p_pid, p->p_comm,
-              parent);
+      iprintf(&buf, &size, " %3i  %-13s %-18s %8s -\n", p->p_pid, p->p_comm,
+              parent, cputime);
     }
 #else
-    iprintf(&buf, &size, " %3i  %-13s %-s\n", p->p_pid, p->p_comm, parent);
+    iprintf(&buf, &size, " %3i  %-13s %-18s %8s\n", p->p_pid, p->p_comm,
+            parent, cputime);
 #endif
   }
   list_iterate_end();
@@ -0,0 +1,131 @@
+#include "kernel.h"
+
+#include "main/percpu.h"
+
+#include "proc/rcu.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/printf.h"
+
+/* A singly linked queue of callbacks */
+typedef struct rcu_queue {
+  rcu_head_t *rq_head;
+  rcu_head_t **rq_tail;
+} rcu_queue_t;
+
+/*
+ * Callbacks move from rcu_next, where call_rcu puts them, to rcu_wait
+ * when a grace period starts, and on to rcu_done when it ends. Only one
+ * grace period is in progress at a time: rcu_gp is the number of the
+ * latest one started, and rcu_completed that of the latest one over, so
+ * one is in progress while they differ. Each processor's pc_rcu_qs is the
+ * grace period it has last been quiescent in.
+ */
+static rcu_queue_t rcu_next, rcu_wait, rcu_done;
+static volatile uint32_t rcu_gp = 0;
+static volatile uint32_t rcu_completed = 0;
+static spinlock_t rcu_lock;
+
+/* for rcu_info */
+static uint32_t rcu_nqueued = 0;
+static uint32_t rcu_nrun = 0;
+
+static void rcu_queue_init(rcu_queue_t *q) {
+  q->rq_head = NULL;
+  q->rq_tail = &q->rq_head;
+}
+
+/* Moves all of from onto the end of to */
+static void rcu_queue_splice(rcu_queue_t *to, rcu_queue_t *from) {
+  if (NULL == from->rq_head)
+    return;
+  *to->rq_tail = from->rq_head;
+  to->rq_tail = from->rq_tail;
+  rcu_queue_init(from);
+}
+
+static __attribute__((unused)) void rcu_init(void) {
+  rcu_queue_init(&rcu_next);
+  rcu_queue_init(&rcu_wait);
+  rcu_queue_init(&rcu_done);
+  spinlock_init(&rcu_lock, "rcu");
+}
+init_func(rcu_init);
+
+/* Ends the grace period in progress if every processor has been
+ * quiescent in it, and starts another if callbacks are waiting for one */
+static void rcu_advance(void) {
+  uint32_t cpu;
+
+  KASSERT(spin_is_locked(&rcu_lock));
+  if (rcu_gp != rcu_completed) {
+    for (cpu = 0; cpu < percpu_ncpus; cpu++) {
+      if (percpu_areas[cpu].pc_rcu_qs != rcu_gp)
+        return;
+    }
+    rcu_completed = rcu_gp;
+    rcu_queue_splice(&rcu_done, &rcu_wait);
+  }
+  if (NULL != rcu_next.rq_head) {
+    rcu_queue_splice(&rcu_wait, &rcu_next);
+    rcu_gp++;
+  }
+}
+
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head)) {
+  head->rh_func = func;
+  head->rh_next = NULL;
+  spin_lock(&rcu_lock);
+  *rcu_next.rq_tail = head;
+  rcu_next.rq_tail = &head->rh_next;
+  rcu_nqueued++;
+  if (rcu_gp == rcu_completed)
+    rcu_advance();
+  spin_unlock(&rcu_lock);
+}
+
+void rcu_quiescent(void) {
+  rcu_head_t *head, *next;
+  uint32_t n = 0;
+
+  KASSERT(0 == percpu_read(pc_rcu_nesting) &&
+          "blocked in an RCU read section");
+  /* Nothing to do, as is nearly always the case, costs two loads of
+   * shared data which only change at the start and end of a grace
+   * period */
+  if (rcu_gp == rcu_completed || percpu_read(pc_rcu_qs) == rcu_gp)
+    return;
+  spin_lock(&rcu_lock);
+  percpu_write(pc_rcu_qs, rcu_gp);
+  rcu_advance();
+  head = rcu_done.rq_head;
+  rcu_queue_init(&rcu_done);
+  spin_unlock(&rcu_lock);
+
+  /* Callbacks may queue more, so they run with the lock dropped */
+  for (; head; head = next) {
+    next = head->rh_next;
+    head->rh_func(head);
+    n++;
+  }
+  if (n) {
+    spin_lock(&rcu_lock);
+    rcu_nrun += n;
+    spin_unlock(&rcu_lock);
+  }
+}
+
+size_t rcu_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+
+  KASSERT(NULL == arg);
+  spin_lock(&rcu_lock);
+  iprintf(&buf, &size, "grace_periods %u\n", rcu_completed);
+  iprintf(&buf, &size, "queued %u\n", rcu_nqueued);
+  iprintf(&buf, &size, "run %u\n", rcu_nrun);
+  iprintf(&buf, &size, "pending %u\n", rcu_nqueued - rcu_nrun);
+  spin_unlock(&rcu_lock);
+  return size;
+}
@@ -1,18 +1,62 @@
+#include "kernel.h"
 #include "globals.h"
 #include "errno.h"
+#include "config.h"
 
 #include "main/interrupt.h"
+#include "main/percpu.h"
+#include "main/tasklet.h"
+#include "main/perf.h"
 
 #include "proc/sched.h"
 #include "proc/kthread.h"
+#include "proc/rcu.h"
+#include "proc/spinlock.h"
+#include "proc/workqueue.h"
 
 #include "util/init.h"
 #include "util/debug.h"
+#include "util/printf.h"
+#include "util/time.h"
+#include "util/trace.h"
 
-static ktqueue_t kt_runq;
+#include "mm/page.h"
+
+/*
+ * The run queue is a multilevel feedback queue: SCHED_NPRIO FIFO queues,
+ * searched from level 0 down. A thread may run for SCHED_QUANTUM(level)
+ * ticks before sched_tick moves it down a level, and each time it sleeps
+ * it moves back up one, so threads which mostly block (shells, tty
+ * readers) get ahead of CPU-bound ones. Every SCHED_BOOST_TICKS ticks all
+ * runnable threads go back to level 0 so the bottom levels cannot starve.
+ *
+ * A thread holding a mutex which a better placed thread waits for runs
+ * at the waiter's level instead, until it lets the mutex go; see
+ * kmutex.c. sched_prio gives the level a thread is queued and preempted
+ * at, and kt_prio alone is what moves up and down.
+ *
+ * Bit i of kt_runq_map is set exactly when level i is non-empty.
+ *
+ * The run queue is also changed by interrupt handlers waking threads, so
+ * kt_runq_lock must be taken with interrupts masked.
+ */
+#define SCHED_QUANTUM(prio) (1U << (prio))
+
+static ktqueue_t kt_runq[SCHED_NPRIO];
+static unsigned int kt_runq_map;
+static spinlock_t kt_runq_lock;
+static unsigned int sched_boost_ticks;
+static int sched_resched; /* curthr should give up the processor */
+static uint64_t sched_stamp; /* time stamp counter when curthr was charged */
+static uint32_t sched_nresched; /* times cond_resched yielded */
 
 static __attribute__((unused)) void sched_init(void) {
-  sched_queue_init(&kt_runq);
+  int i;
+  for (i = 0; i < SCHED_NPRIO; i++)
+    sched_queue_init(&kt_runq[i]);
+  kt_runq_map = 0;
+  spinlock_init(&kt_runq_lock, "runq");
+  sched_boost_ticks = 0;
 }
 init_func(sched_init);
 
@@ -69,6 +113,56 @@ static void ktqueue_remove(ktqueue_t *q, kthread_t *thr) {
   q->tq_size--;
 }
 
+/*** PRIVATE RUN QUEUE FUNCTIONS ***/
+/* These must be called with kt_runq_lock held */
+static void runq_enqueue(kthread_t *thr) {
+  int prio = sched_prio(thr);
+  KASSERT(0 <= prio && prio < SCHED_NPRIO);
+  ktqueue_enqueue(&kt_runq[prio], thr);
+  kt_runq_map |= 1U << prio;
+}
+
+static void runq_remove(kthread_t *thr) {
+  int prio = thr->kt_wchan - kt_runq;
+  KASSERT(0 <= prio && prio < SCHED_NPRIO);
+  ktqueue_remove(&kt_runq[prio], thr);
+  if (sched_queue_empty(&kt_runq[prio]))
+    kt_runq_map &= ~(1U << prio);
+}
+
+static kthread_t *runq_dequeue(void) {
+  kthread_t *thr;
+  int prio;
+
+  if (!kt_runq_map)
+    return NULL;
+  prio = __builtin_ctz(kt_runq_map);
+  thr = ktqueue_dequeue(&kt_runq[prio]);
+  KASSERT(thr);
+  if (sched_queue_empty(&kt_runq[prio]))
+    kt_runq_map &= ~(1U << prio);
+  return thr;
+}
+
+/* Moves every runnable thread, and the current one, back to level 0 */
+static void runq_boost(void) {
+  kthread_t *thr;
+  int prio;
+
+  for (prio = 1; prio < SCHED_NPRIO; prio++) {
+    while ((thr = ktqueue_dequeue(&kt_runq[prio]))) {
+      thr->kt_prio = 0;
+      thr->kt_ticks = 0;
+      runq_enqueue(thr);
+    }
+  }
+  kt_runq_map &= 1U;
+  if (curthr) {
+    curthr->kt_prio = 0;
+    curthr->kt_ticks = 0;
+  }
+}
+
 /*** PUBLIC KTQUEUE MANIPULATION FUNCTIONS ***/
 void sched_queue_init(ktqueue_t *q) {
   list_init(&q->tq_list);
@@ -77,6 +171,12 @@ void sched_queue_init(ktqueue_t *q) {
 
 int sched_queue_empty(ktqueue_t *q) { return list_empty(&q->tq_list); }
 
+/* ktqueue_dequeue takes from the tail */
+kthread_t *sched_queue_peek(ktqueue_t *q) {
+  return list_empty(&q->tq_list) ? NULL
+                                 : list_tail(&q->tq_list, kthread_t, kt_qlink);
+}
+
 /*
  * Updates the thread's state and enqueues it on the given
  * queue. Returns when the thread has been woken up with wakeup_on or
@@ -84,7 +184,7 @@ int sched_queue_empty(ktqueue_t *q) { return list_empty(&q->tq_list); }
  *
  * Use the private queue manipulation functions above.
  */
-void sched_sleep_on(ktqueue_t *q) {
+void sched_sleep_on_handoff(ktqueue_t *q) {
   dbg(DBG_PROC, "thread %s going to sleep\n", curproc->p_comm);
   KASSERT(curthr->kt_state == KT_RUN);
   KASSERT(!curthr->kt_wchan);
@@ -93,6 +193,10 @@ void sched_sleep_on(ktqueue_t *q) {
   sched_switch();
   dbg(DBG_PROC, "thread %s woke up\n", curproc->p_comm);
   KASSERT(!curthr->kt_wchan);
+}
+
+void sched_sleep_on(ktqueue_t *q) {
+  sched_sleep_on_handoff(q);
   // TODO: what behavior when canceled?
   if (curthr->kt_cancelled)
     kthread_exit(NULL);
@@ -120,6 +224,54 @@ int sched_cancellable_sleep_on(ktqueue_t *q) {
     return 0;
 }
 
+/* A thread in sched_cancellable_sleep_on_timeout, on its stack */
+typedef struct sched_timeout {
+  kthread_t *st_thr;
+  ktqueue_t *st_q;
+  int st_expired;
+} sched_timeout_t;
+
+/* Runs from the timer interrupt. The thread may have been woken already,
+ * in which case it is no longer on the queue and this does nothing. */
+static void sched_timeout_expired(void *arg) {
+  sched_timeout_t *st = (sched_timeout_t *)arg;
+  if (st->st_thr->kt_wchan == st->st_q) {
+    st->st_expired = 1;
+    ktqueue_remove(st->st_q, st->st_thr);
+    sched_make_runnable(st->st_thr);
+  }
+}
+
+/*
+ * Like sched_cancellable_sleep_on, but the thread is also woken after
+ * the given number of clock ticks.
+ *
+ * Interrupts are masked from before the timer is armed until it is
+ * disarmed, so it cannot fire before we are on the queue or after we
+ * have been woken up and returned.
+ */
+int sched_cancellable_sleep_on_timeout(ktqueue_t *q, unsigned long ticks) {
+  sched_timeout_t st;
+  ktimer_t timer;
+  int ret;
+
+  st.st_thr = curthr;
+  st.st_q = q;
+  st.st_expired = 0;
+  timer_init(&timer, sched_timeout_expired, &st);
+
+  uint8_t old_ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  timer_add(&timer, time_ticks() + ticks);
+  ret = sched_cancellable_sleep_on(q);
+  timer_cancel(&timer);
+  intr_setipl(old_ipl);
+
+  if (!ret && st.st_expired)
+    ret = -ETIMEDOUT;
+  return ret;
+}
+
 kthread_t *sched_wakeup_on(ktqueue_t *q) {
   if (sched_queue_empty(q))
     return NULL;
@@ -158,6 +310,44 @@ void sched_cancel(struct kthread *kthr) {
   }
 }
 
+uint32_t sched_cpus_online(void) { return 0x1; }
+
+int sched_prio(kthread_t *thr) { return MIN(thr->kt_prio, thr->kt_pi_prio); }
+
+void sched_set_inherited(kthread_t *thr, int prio) {
+  uint8_t old_ipl = spin_lock_irqsave(&kt_runq_lock);
+  if (KT_RUN == thr->kt_state && NULL != thr->kt_wchan) {
+    runq_remove(thr);
+    thr->kt_pi_prio = prio;
+    runq_enqueue(thr);
+  } else {
+    thr->kt_pi_prio = prio;
+  }
+  spin_unlock_irqrestore(&kt_runq_lock, old_ipl);
+}
+
+/* A thread is always put on the run queue of an online processor in its
+ * mask; with only the one run queue, that is the one it is already on. */
+int sched_set_affinity(kthread_t *thr, uint32_t mask) {
+  if (!(mask & sched_cpus_online()))
+    return -EINVAL;
+  thr->kt_cpumask = mask;
+  return 0;
+}
+
+void sched_charge(int user) {
+  uint64_t now = time_cycles();
+
+  /* Nothing has been timed before the first call */
+  if (curthr && sched_stamp) {
+    if (user)
+      curthr->kt_utime += now - sched_stamp;
+    else
+      curthr->kt_stime += now - sched_stamp;
+  }
+  sched_stamp = now;
+}
+
 /*
  * In this function, you will be modifying the run queue, which can
  * also be modified from an interrupt context. In order for thread
@@ -200,13 +390,48 @@ void sched_switch(void) {
   int old_ipl = intr_getipl();
   intr_disable();
   intr_setipl(IPL_LOW);
-  // Wait for interrupt if empty
-  while (!(curthr = ktqueue_dequeue(&kt_runq))) {
+  sched_charge(0);
+  perf_charge(old);
+  rcu_quiescent();
+  /* A worker blocking inside a work item may need another to take over */
+  if (old->kt_worker && KT_RUN != old->kt_state)
+    workqueue_sleeping(old);
+  // Wait for interrupt if empty, zeroing free pages while there is time.
+  // The periodic tick is stopped for the wait if no timer is due soon.
+  while (1) {
+    /* Interrupts are disabled, so the plain spin_lock is enough */
+    spin_lock(&kt_runq_lock);
+    curthr = runq_dequeue();
+    spin_unlock(&kt_runq_lock);
+    if (curthr)
+      break;
+    if (tasklet_pending()) {
+      tasklet_run();
+      continue;
+    }
+    if (page_zero_idle())
+      continue;
+    if (dbg_drain()) {
+      /* let interrupts in (sti holds them off for one instruction) */
+      intr_enable();
+      __asm__ volatile("nop");
+      intr_disable();
+      continue;
+    }
     intr_disable();
+    percpu_inc(pc_nidles);
+    time_idle_enter();
     intr_wait();
+    intr_disable();
+    time_idle_exit();
   }
+  sched_resched = 0;
+  percpu_inc(pc_nswitches);
+  sched_stamp = time_cycles();
+  perf_charge(NULL);
   // Switch procs
   curproc = curthr->kt_proc;
+  trace(TRACE_SCHED_SWITCH, old, 0);
   // Reenable interupts
   KASSERT(curthr->kt_state == KT_RUN);
   context_switch(&old->kt_ctx, &curthr->kt_ctx);
@@ -215,26 +440,133 @@ void sched_switch(void) {
 }
 
 /*
- * Since we are modifying the run queue, we _MUST_ set the IPL to high
- * so that no interrupts happen at an inopportune moment.
-
- * Remember to restore the original IPL before you return from this
- * function. Otherwise, we will not get any interrupts after returning
- * from this function.
- *
- * Using intr_disable/intr_enable would be equally as effective as
- * modifying the IPL in this case. However, in some cases, we may want
- * more fine grained control, making modifying the IPL more
- * suitable. We modify the IPL here for consistency.
+ * Since we are modifying the run queue, we _MUST_ mask interrupts so
+ * that no interrupts happen at an inopportune moment; spin_lock_irqsave
+ * does this by setting the IPL to high, and spin_unlock_irqrestore puts
+ * it back.
  */
 void sched_make_runnable(kthread_t *thr) {
+  KASSERT(thr && "Thread must be non null");
   KASSERT(thr->kt_state == KT_SLEEP || thr->kt_state == KT_SLEEP_CANCELLABLE ||
-          thr->kt_state == KT_NO_STATE);
+          thr->kt_state == KT_NO_STATE ||
+          (thr == curthr && thr->kt_state == KT_RUN));
   KASSERT(!thr->kt_wchan);
-  int old_ipl = intr_getipl();
-  KASSERT(thr && "Thread must be non null");
-  intr_setipl(IPL_HIGH);
+  KASSERT(thr->kt_cpumask & sched_cpus_online());
+  trace(TRACE_SCHED_WAKEUP, thr, thr->kt_proc->p_pid);
+  if (thr->kt_worker)
+    workqueue_waking(thr);
+  uint8_t old_ipl = spin_lock_irqsave(&kt_runq_lock);
+  /* A thread which blocked gave up the processor on its own; move it up
+   * a level. Its used ticks are kept, so a thread which sleeps just
+   * before its quantum runs out still gets moved back down promptly. */
+  if ((thr->kt_state == KT_SLEEP || thr->kt_state == KT_SLEEP_CANCELLABLE) &&
+      thr->kt_prio > 0)
+    thr->kt_prio--;
   thr->kt_state = KT_RUN;
-  ktqueue_enqueue(&kt_runq, thr);
-  intr_setipl(old_ipl);
+  runq_enqueue(thr);
+  spin_unlock_irqrestore(&kt_runq_lock, old_ipl);
+}
+
+/*
+ * Called from the timer interrupt, so interrupts are already masked.
+ * curthr is NULL if the tick arrived while sched_switch was waiting for
+ * something to run.
+ */
+int sched_tick(void) {
+  int resched = 0;
+
+  spin_lock(&kt_runq_lock);
+  if (++sched_boost_ticks >= SCHED_BOOST_TICKS) {
+    sched_boost_ticks = 0;
+    runq_boost();
+  }
+  if (!curthr) {
+    spin_unlock(&kt_runq_lock);
+    return 0;
+  }
+
+  curthr->kt_runtime++;
+  if (++curthr->kt_ticks >= SCHED_QUANTUM(curthr->kt_prio)) {
+    curthr->kt_ticks = 0;
+    if (curthr->kt_prio < SCHED_NPRIO - 1)
+      curthr->kt_prio++;
+    resched = 1;
+  }
+  /* Only worth switching if someone is waiting at our level or above */
+  if (resched)
+    resched = (kt_runq_map & ((2U << sched_prio(curthr)) - 1)) != 0;
+  else
+    resched = (kt_runq_map & ((1U << sched_prio(curthr)) - 1)) != 0;
+  sched_resched |= resched;
+  spin_unlock(&kt_runq_lock);
+  return resched;
+}
+
+void sched_preempt(void) {
+  if (sched_resched) {
+    sched_make_runnable(curthr);
+    sched_switch();
+  }
+}
+
+void preempt_disable(void) {
+  if (curthr)
+    curthr->kt_preempt_count++;
+}
+
+void preempt_enable(void) {
+  if (curthr) {
+    KASSERT(0 < curthr->kt_preempt_count);
+    curthr->kt_preempt_count--;
+  }
+}
+
+int cond_resched(void) {
+  if (!sched_resched || !curthr || curthr->kt_preempt_count ||
+      IPL_LOW != intr_getipl())
+    return 0;
+  sched_nresched++;
+  sched_make_runnable(curthr);
+  sched_switch();
+  return 1;
+}
+
+size_t sched_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "switches %u\n", percpu_sum(pc_nswitches));
+  iprintf(&buf, &size, "idle %u\n", percpu_sum(pc_nidles));
+  iprintf(&buf, &size, "cond_resched %u\n", sched_nresched);
+  iprintf(&buf, &size, "tasklets %u\n", percpu_sum(pc_ntasklets));
+  return size;
+}
+
+size_t sched_runq_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  kthread_t *thr;
+  uint8_t old_ipl;
+  int prio;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "%4s %5s %-16s %5s\n", "PRIO", "PID", "NAME",
+          "TICKS");
+  if (NULL != curthr) {
+    iprintf(&buf, &size, "%4s %5d %-16s %5u\n", "run", curproc->p_pid,
+            curproc->p_comm, curthr->kt_ticks);
+  }
+  /* Each level in the order its threads will run. iprintf doesn't
+   * block, so the whole queue is listed as it stood at one moment. */
+  old_ipl = spin_lock_irqsave(&kt_runq_lock);
+  for (prio = 0; prio < SCHED_NPRIO; prio++) {
+    if (!(kt_runq_map & (1U << prio)))
+      continue;
+    list_iterate_reverse(&kt_runq[prio].tq_list, thr, kthread_t, kt_qlink) {
+      iprintf(&buf, &size, "%4d %5d %-16s %5u\n", prio, thr->kt_proc->p_pid,
+              thr->kt_proc->p_comm, thr->kt_ticks);
+    }
+    list_iterate_end();
+  }
+  spin_unlock_irqrestore(&kt_runq_lock, old_ipl);
+  return size;
 }
@@ -0,0 +1,136 @@
+#include "globals.h"
+
+#include "main/interrupt.h"
+
+#include "proc/kthread.h"
+#include "proc/spinlock.h"
+
+#include "util/atomic.h"
+#include "util/debug.h"
+
+list_t spinlock_list = {&spinlock_list, &spinlock_list};
+
+/* Protects spinlock_list; not on it itself */
+static spinlock_t spinlock_list_lock;
+
+/* Called before the APIC is set up (by slab_init and pframe_init), so this
+ * must not touch the IPL; spinlocks are never initialized from interrupt
+ * context anyway. */
+void spinlock_init(spinlock_t *sl, const char *name) {
+  sl->sl_next = 0;
+  sl->sl_serving = 0;
+  sl->sl_holder = NULL;
+  sl->sl_name = name;
+  sl->sl_acquired = 0;
+  sl->sl_contended = 0;
+  sl->sl_spins = 0;
+
+  spin_lock(&spinlock_list_lock);
+  list_insert_tail(&spinlock_list, &sl->sl_link);
+  spin_unlock(&spinlock_list_lock);
+}
+
+void spinlock_destroy(spinlock_t *sl) {
+  KASSERT(!spin_is_locked(sl));
+  spin_lock(&spinlock_list_lock);
+  list_remove(&sl->sl_link);
+  spin_unlock(&spinlock_list_lock);
+}
+
+void spin_lock(spinlock_t *sl) {
+  uint32_t ticket = atomic_fetch_add(&sl->sl_next, 1);
+  uint32_t spins = 0;
+
+  if (sl->sl_serving != ticket) {
+    /* With one processor nobody else can ever release it */
+    KASSERT(!(curthr && sl->sl_holder == curthr) &&
+            "spinlock already held by this thread");
+    while (sl->sl_serving != ticket) {
+      cpu_relax();
+      spins++;
+    }
+    sl->sl_contended++;
+    sl->sl_spins += spins;
+  }
+  mb();
+  sl->sl_holder = curthr;
+  sl->sl_acquired++;
+  if (curthr)
+    curthr->kt_preempt_count++;
+}
+
+void spin_unlock(spinlock_t *sl) {
+  KASSERT(spin_is_locked(sl));
+  /* The holder rather than curthr, which sched_switch changes while
+   * holding the run queue lock */
+  if (sl->sl_holder)
+    sl->sl_holder->kt_preempt_count--;
+  sl->sl_holder = NULL;
+  mb();
+  sl->sl_serving++;
+}
+
+uint8_t spin_lock_irqsave(spinlock_t *sl) {
+  uint8_t ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  spin_lock(sl);
+  return ipl;
+}
+
+void spin_unlock_irqrestore(spinlock_t *sl, uint8_t ipl) {
+  spin_unlock(sl);
+  intr_setipl(ipl);
+}
+
+int spin_trylock_irqsave(spinlock_t *sl, uint8_t *ipl) {
+  uint32_t ticket;
+
+  *ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  ticket = sl->sl_serving;
+  if (sl->sl_next != ticket ||
+      atomic_cmpxchg(&sl->sl_next, ticket, ticket + 1) != ticket) {
+    intr_setipl(*ipl);
+    return 0;
+  }
+  mb();
+  sl->sl_holder = curthr;
+  sl->sl_acquired++;
+  if (curthr)
+    curthr->kt_preempt_count++;
+  return 1;
+}
+
+int spin_is_locked(spinlock_t *sl) { return sl->sl_serving != sl->sl_next; }
+
+void rwlock_init(rwlock_t *rw, const char *name) {
+  spinlock_init(&rw->rw_lock, name);
+  rw->rw_readers = 0;
+}
+
+void read_lock(rwlock_t *rw) {
+  spin_lock(&rw->rw_lock);
+  atomic_inc(&rw->rw_readers);
+  spin_unlock(&rw->rw_lock);
+}
+
+void read_unlock(rwlock_t *rw) {
+  KASSERT(0 < rw->rw_readers);
+  atomic_dec(&rw->rw_readers);
+}
+
+void write_lock(rwlock_t *rw) {
+  uint32_t spins = 0;
+
+  spin_lock(&rw->rw_lock);
+  while (rw->rw_readers) {
+    cpu_relax();
+    spins++;
+  }
+  if (spins) {
+    rw->rw_lock.sl_contended++;
+    rw->rw_lock.sl_spins += spins;
+  }
+}
+
+void write_unlock(rwlock_t *rw) { spin_unlock(&rw->rw_lock); }
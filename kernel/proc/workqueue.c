@@ -0,0 +1,255 @@
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/interrupt.h"
+
+#include "mm/slab.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+#include "proc/workqueue.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/printf.h"
+
+typedef struct wq_worker {
+  proc_t *ww_proc;
+  kthread_t *ww_thr;
+  int ww_running;         /* counted in wq_nrunning */
+  int ww_blocked;         /* asleep inside an item */
+  list_link_t ww_link;    /* on wq_workers */
+} wq_worker_t;
+
+/*
+ * A worker is idle, asleep on wq_idleq waiting for work; running, which
+ * includes runnable and blocked only on the way to an item; or blocked
+ * inside an item. Whoever wakes an idle worker moves it from wq_nidle to
+ * wq_nrunning, so that a worker woken but not yet on the processor is
+ * not woken twice or joined by another. Everything here is under
+ * wq_lock, taken with the IPL raised since tasklets queue work.
+ */
+static list_t wq_pending;
+static list_t wq_workers;
+static ktqueue_t wq_idleq;
+static spinlock_t wq_lock;
+static uint32_t wq_nworkers = 0;
+static uint32_t wq_nidle = 0;
+static uint32_t wq_nrunning = 0;
+static int wq_creating = 0; /* a worker is creating another */
+static int wq_stopping = 0;
+static slab_allocator_t *wq_worker_allocator = NULL;
+
+/* for workqueue_info */
+static uint32_t wq_nqueued = 0;
+static uint32_t wq_ndone = 0;
+static uint32_t wq_nhandoffs = 0; /* idle workers woken as one blocked */
+
+static void *wq_worker_run(int arg1, void *arg2);
+
+void work_init(work_t *work, work_func_t func) {
+  list_link_init(&work->w_link);
+  work->w_pending = 0;
+  work->w_func = func;
+}
+
+/* Wakes an idle worker if none is running. Called with wq_lock held;
+ * returns whether the caller must wake one on wq_idleq once it has let
+ * go of the lock */
+static int wq_need_wakeup(void) {
+  if (wq_nrunning || !wq_nidle || list_empty(&wq_pending))
+    return 0;
+  wq_nidle--;
+  wq_nrunning++;
+  return 1;
+}
+
+int work_queue(work_t *work) {
+  uint8_t ipl;
+  int wake;
+
+  ipl = spin_lock_irqsave(&wq_lock);
+  KASSERT(!wq_stopping);
+  if (work->w_pending) {
+    spin_unlock_irqrestore(&wq_lock, ipl);
+    return 0;
+  }
+  work->w_pending = 1;
+  list_insert_tail(&wq_pending, &work->w_link);
+  wq_nqueued++;
+  wake = wq_need_wakeup();
+  spin_unlock_irqrestore(&wq_lock, ipl);
+  if (wake)
+    sched_wakeup_on(&wq_idleq);
+  return 1;
+}
+
+int workqueue_busy(void) {
+  uint8_t ipl = spin_lock_irqsave(&wq_lock);
+  int busy = !list_empty(&wq_pending) || wq_nidle != wq_nworkers;
+  spin_unlock_irqrestore(&wq_lock, ipl);
+  return busy;
+}
+
+/* Adds a worker to the pool, counted as running; it goes idle if there
+ * is nothing for it */
+static void wq_create_worker(void) {
+  wq_worker_t *w;
+  uint8_t ipl;
+
+  w = (wq_worker_t *)slab_obj_alloc(wq_worker_allocator);
+  KASSERT(NULL != w);
+  w->ww_proc = proc_create_daemon("kworker");
+  KASSERT(NULL != w->ww_proc);
+  w->ww_thr = kthread_create(w->ww_proc, wq_worker_run, 0, w);
+  KASSERT(NULL != w->ww_thr);
+  w->ww_thr->kt_worker = w;
+  w->ww_running = 1;
+  w->ww_blocked = 0;
+
+  ipl = spin_lock_irqsave(&wq_lock);
+  list_insert_tail(&wq_workers, &w->ww_link);
+  wq_nworkers++;
+  wq_nrunning++;
+  wq_creating = 0;
+  spin_unlock_irqrestore(&wq_lock, ipl);
+  sched_make_runnable(w->ww_thr);
+}
+
+static void *wq_worker_run(int arg1, void *arg2) {
+  wq_worker_t *w = (wq_worker_t *)arg2;
+  work_t *work;
+  int spare;
+  uint8_t ipl;
+
+  ipl = spin_lock_irqsave(&wq_lock);
+  while (1) {
+    if (list_empty(&wq_pending)) {
+      w->ww_running = 0;
+      wq_nrunning--;
+      if (wq_stopping)
+        break;
+      wq_nidle++;
+      /* The IPL stays up until we are on the queue, so that a tasklet
+       * queueing work can't slip in between */
+      spin_unlock(&wq_lock);
+      sched_sleep_on(&wq_idleq);
+      spin_lock(&wq_lock);
+      w->ww_running = 1;
+      continue;
+    }
+    work = list_head(&wq_pending, work_t, w_link);
+    list_remove(&work->w_link);
+    work->w_pending = 0;
+    spare = !wq_nidle && !wq_creating && !wq_stopping &&
+            wq_nworkers < WQ_MAX_WORKERS;
+    if (spare)
+      wq_creating = 1;
+    spin_unlock_irqrestore(&wq_lock, ipl);
+
+    if (spare)
+      wq_create_worker();
+    work->w_func(work);
+
+    ipl = spin_lock_irqsave(&wq_lock);
+    wq_ndone++;
+  }
+  wq_nworkers--;
+  spin_unlock_irqrestore(&wq_lock, ipl);
+  return NULL;
+}
+
+void workqueue_sleeping(kthread_t *thr) {
+  wq_worker_t *w = (wq_worker_t *)thr->kt_worker;
+  int wake;
+
+  KASSERT(curthr == thr);
+  if (!w->ww_running)
+    return;
+  /* Interrupts are off in sched_switch, so the plain spin_lock is
+   * enough */
+  spin_lock(&wq_lock);
+  w->ww_running = 0;
+  w->ww_blocked = 1;
+  wq_nrunning--;
+  if ((wake = wq_need_wakeup()))
+    wq_nhandoffs++;
+  spin_unlock(&wq_lock);
+  if (wake)
+    sched_wakeup_on(&wq_idleq);
+}
+
+void workqueue_waking(kthread_t *thr) {
+  wq_worker_t *w = (wq_worker_t *)thr->kt_worker;
+  uint8_t ipl;
+
+  if (!w->ww_blocked)
+    return;
+  ipl = spin_lock_irqsave(&wq_lock);
+  w->ww_blocked = 0;
+  w->ww_running = 1;
+  wq_nrunning++;
+  spin_unlock_irqrestore(&wq_lock, ipl);
+}
+
+static __attribute__((unused)) void workqueue_init(void) {
+  list_init(&wq_pending);
+  list_init(&wq_workers);
+  sched_queue_init(&wq_idleq);
+  spinlock_init(&wq_lock, "workqueue");
+  wq_worker_allocator =
+      slab_allocator_create("wq_worker", sizeof(wq_worker_t));
+  KASSERT(NULL != wq_worker_allocator);
+
+  KASSERT(curproc && (PID_IDLE == curproc->p_pid) &&
+          "should be calling this from idleproc");
+  wq_create_worker();
+}
+init_func(workqueue_init);
+init_depends(sched_init);
+
+void workqueue_shutdown(void) {
+  wq_worker_t *w;
+  int pid, child;
+  uint8_t ipl;
+
+  KASSERT(PID_IDLE == curproc->p_pid);
+  ipl = spin_lock_irqsave(&wq_lock);
+  wq_stopping = 1;
+  /* The workers finish what is queued before they notice */
+  wq_nrunning += wq_nidle;
+  wq_nidle = 0;
+  spin_unlock_irqrestore(&wq_lock, ipl);
+  sched_broadcast_on(&wq_idleq);
+
+  list_iterate_begin(&wq_workers, w, wq_worker_t, ww_link) {
+    pid = w->ww_proc->p_pid;
+    child = do_waitpid(pid, 0, NULL);
+    KASSERT(pid == child && "waited on process other than kworker");
+    list_remove(&w->ww_link);
+    slab_obj_free(wq_worker_allocator, w);
+  }
+  list_iterate_end();
+  KASSERT(list_empty(&wq_pending) && 0 == wq_nworkers);
+}
+
+size_t workqueue_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  uint8_t ipl;
+
+  KASSERT(NULL == arg);
+  ipl = spin_lock_irqsave(&wq_lock);
+  iprintf(&buf, &size, "workers %u\n", wq_nworkers);
+  iprintf(&buf, &size, "idle %u\n", wq_nidle);
+  iprintf(&buf, &size, "running %u\n", wq_nrunning);
+  iprintf(&buf, &size, "blocked %u\n", wq_nworkers - wq_nidle - wq_nrunning);
+  iprintf(&buf, &size, "queued %u\n", wq_nqueued);
+  iprintf(&buf, &size, "done %u\n", wq_ndone);
+  iprintf(&buf, &size, "pending %u\n", wq_nqueued - wq_ndone);
+  iprintf(&buf, &size, "handoffs %u\n", wq_nhandoffs);
+  spin_unlock_irqrestore(&wq_lock, ipl);
+  return size;
+}
@@ -0,0 +1,361 @@
+/*
+ * The kshell's "bench" command: microbenchmarks of the kernel's hot
+ * paths, timed one operation at a time with the time stamp counter.
+ * Each benchmark runs BENCH_ITERS times after BENCH_WARMUP untimed runs,
+ * and prints the fastest, median and 99th percentile of the times, in
+ * cycles. "null" times nothing, so it shows what reading the counter
+ * itself costs.
+ */
+
+#include "commands.h"
+#include "errno.h"
+#include "globals.h"
+
+#include "test/kshell/io.h"
+
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "proc/kmutex.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "vm/anon.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#define BENCH_ITERS 1000 /* at most a page of samples */
+#define BENCH_WARMUP 16
+
+/* What a benchmark's thread and the helper thread share */
+typedef struct bench_pair {
+  ktqueue_t bp_ping; /* the helper waits here */
+  ktqueue_t bp_pong; /* the benchmark waits here */
+  kmutex_t bp_mutex;
+  int bp_done;
+} bench_pair_t;
+
+/* A benchmark fills in samples[0 .. n - 1], or returns an error */
+typedef struct bench {
+  const char *b_name;
+  int (*b_func)(uint32_t *samples, int n, long arg);
+  long b_arg;
+} bench_t;
+
+#define BENCH_TIME(sample, op)                                                 \
+  do {                                                                         \
+    uint64_t __start = time_cycles();                                          \
+    op;                                                                        \
+    (sample) = (uint32_t)(time_cycles() - __start);                            \
+  } while (0)
+
+/* Runs func in a process of its own, and returns its pid */
+static pid_t bench_helper(kthread_func_t func, bench_pair_t *bp) {
+  proc_t *p;
+  kthread_t *thr;
+
+  if (NULL == (p = proc_create("bench")))
+    return -ENOMEM;
+  thr = kthread_create(p, func, 0, bp);
+  KASSERT(NULL != thr);
+  sched_make_runnable(thr);
+  return p->p_pid;
+}
+
+static void bench_pair_init(bench_pair_t *bp) {
+  sched_queue_init(&bp->bp_ping);
+  sched_queue_init(&bp->bp_pong);
+  kmutex_init(&bp->bp_mutex);
+  bp->bp_done = 0;
+}
+
+static int bench_null(uint32_t *samples, int n, long arg) {
+  int i;
+  for (i = 0; i < n; i++)
+    BENCH_TIME(samples[i], );
+  return 0;
+}
+
+static void *bench_ctxsw_helper(int arg1, void *arg2) {
+  bench_pair_t *bp = arg2;
+  while (!bp->bp_done) {
+    sched_wakeup_on(&bp->bp_pong);
+    sched_sleep_on(&bp->bp_ping);
+  }
+  return NULL;
+}
+
+/* A round trip: wake the helper and sleep until it wakes us back */
+static int bench_ctxsw(uint32_t *samples, int n, long arg) {
+  bench_pair_t bp;
+  pid_t pid;
+  int i;
+
+  bench_pair_init(&bp);
+  if (0 > (pid = bench_helper(bench_ctxsw_helper, &bp)))
+    return pid;
+  sched_sleep_on(&bp.bp_pong);
+  for (i = 0; i < n; i++) {
+    BENCH_TIME(samples[i], {
+      sched_wakeup_on(&bp.bp_ping);
+      sched_sleep_on(&bp.bp_pong);
+    });
+  }
+  bp.bp_done = 1;
+  sched_wakeup_on(&bp.bp_ping);
+  do_waitpid(pid, 0, NULL);
+  return 0;
+}
+
+static int bench_mutex(uint32_t *samples, int n, long arg) {
+  kmutex_t mtx;
+  int i;
+
+  kmutex_init(&mtx);
+  for (i = 0; i < n; i++) {
+    BENCH_TIME(samples[i], {
+      kmutex_lock(&mtx);
+      kmutex_unlock(&mtx);
+    });
+  }
+  return 0;
+}
+
+static void *bench_mutex_helper(int arg1, void *arg2) {
+  bench_pair_t *bp = arg2;
+  sched_wakeup_on(&bp->bp_pong);
+  do {
+    kmutex_lock(&bp->bp_mutex);
+    kmutex_unlock(&bp->bp_mutex);
+  } while (!bp->bp_done);
+  return NULL;
+}
+
+/* The helper is always waiting for the mutex, so each unlock hands it
+ * over, and getting it back means waiting for the helper's turn */
+static int bench_mutex_contended(uint32_t *samples, int n, long arg) {
+  bench_pair_t bp;
+  pid_t pid;
+  int i;
+
+  bench_pair_init(&bp);
+  kmutex_lock(&bp.bp_mutex);
+  if (0 > (pid = bench_helper(bench_mutex_helper, &bp))) {
+    kmutex_unlock(&bp.bp_mutex);
+    return pid;
+  }
+  sched_sleep_on(&bp.bp_pong);
+  for (i = 0; i < n; i++) {
+    BENCH_TIME(samples[i], {
+      kmutex_unlock(&bp.bp_mutex);
+      kmutex_lock(&bp.bp_mutex);
+    });
+  }
+  bp.bp_done = 1;
+  kmutex_unlock(&bp.bp_mutex);
+  do_waitpid(pid, 0, NULL);
+  return 0;
+}
+
+static slab_allocator_t *bench_allocator = NULL;
+
+/* arg is 0 to time slab_obj_alloc, 1 to time slab_obj_free */
+static int bench_slab(uint32_t *samples, int n, long arg) {
+  void *obj;
+  int i;
+
+  if (NULL == bench_allocator &&
+      NULL == (bench_allocator = slab_allocator_create("bench", 64)))
+    return -ENOMEM;
+  for (i = 0; i < n; i++) {
+    if (arg) {
+      if (NULL == (obj = slab_obj_alloc(bench_allocator)))
+        return -ENOMEM;
+      BENCH_TIME(samples[i], slab_obj_free(bench_allocator, obj));
+    } else {
+      BENCH_TIME(samples[i], obj = slab_obj_alloc(bench_allocator));
+      if (NULL == obj)
+        return -ENOMEM;
+      slab_obj_free(bench_allocator, obj);
+    }
+  }
+  return 0;
+}
+
+/* A kmalloc and kfree of arg bytes */
+static int bench_kmalloc(uint32_t *samples, int n, long arg) {
+  void *p;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    BENCH_TIME(samples[i], {
+      p = kmalloc((size_t)arg);
+      kfree(p);
+    });
+    if (NULL == p)
+      return -ENOMEM;
+  }
+  return 0;
+}
+
+/* A page_alloc_n and page_free_n of arg pages */
+static int bench_page(uint32_t *samples, int n, long arg) {
+  void *p;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    BENCH_TIME(samples[i], {
+      p = page_alloc_n((uint32_t)arg);
+      if (NULL != p)
+        page_free_n(p, (uint32_t)arg);
+    });
+    if (NULL == p)
+      return -ENOMEM;
+  }
+  return 0;
+}
+
+#ifdef __VM__
+/* arg is 0 to get the same resident page every time, 1 to get a new
+ * zero-filled one */
+static int bench_pframe(uint32_t *samples, int n, long arg) {
+  mmobj_t *o;
+  pframe_t *pf;
+  int i, ret = 0;
+
+  if (NULL == (o = anon_create()))
+    return -ENOMEM;
+  if (!arg && 0 > (ret = pframe_get(o, 0, &pf)))
+    goto out;
+  for (i = 0; i < n; i++) {
+    BENCH_TIME(samples[i], ret = pframe_get(o, arg ? i : 0, &pf));
+    if (0 > ret)
+      goto out;
+  }
+out:
+  o->mmo_ops->put(o);
+  return ret;
+}
+#endif
+
+#ifdef __VFS__
+/* The root directory is always in core, so this is the hashed lookup */
+static int bench_vget(uint32_t *samples, int n, long arg) {
+  vnode_t *vn;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    BENCH_TIME(samples[i], {
+      vn = vget(vfs_root_vn->vn_fs, vfs_root_vn->vn_vno);
+      vput(vn);
+    });
+  }
+  return 0;
+}
+
+/* After the first, met in the name cache */
+static int bench_lookup(uint32_t *samples, int n, long arg) {
+  vnode_t *vn;
+  int i, ret;
+
+  for (i = 0; i < n; i++) {
+    BENCH_TIME(samples[i], ret = lookup(vfs_root_vn, "..", 2, &vn));
+    if (0 > ret)
+      return ret;
+    vput(vn);
+  }
+  return 0;
+}
+#endif
+
+static const bench_t bench_list[] = {
+    {"null", bench_null, 0},
+    {"ctxsw", bench_ctxsw, 0},
+    {"mutex", bench_mutex, 0},
+    {"mutex_contended", bench_mutex_contended, 0},
+    {"slab_alloc", bench_slab, 0},
+    {"slab_free", bench_slab, 1},
+    {"kmalloc-16", bench_kmalloc, 16},
+    {"kmalloc-64", bench_kmalloc, 64},
+    {"kmalloc-256", bench_kmalloc, 256},
+    {"kmalloc-1024", bench_kmalloc, 1024},
+    {"kmalloc-4096", bench_kmalloc, 4096},
+    {"kmalloc-8192", bench_kmalloc, 8192},
+    {"page_alloc", bench_page, 1},
+    {"page_alloc_n-4", bench_page, 4},
+    {"page_alloc_n-16", bench_page, 16},
+#ifdef __VM__
+    {"pframe_hit", bench_pframe, 0},
+    {"pframe_miss", bench_pframe, 1},
+#endif
+#ifdef __VFS__
+    {"vget", bench_vget, 0},
+    {"lookup", bench_lookup, 0},
+#endif
+};
+
+#define BENCH_COUNT ((int)(sizeof(bench_list) / sizeof(bench_list[0])))
+
+static void bench_sort(uint32_t *v, int n) {
+  int i, j;
+  uint32_t x;
+
+  for (i = 1; i < n; i++) {
+    x = v[i];
+    for (j = i; j > 0 && v[j - 1] > x; j--)
+      v[j] = v[j - 1];
+    v[j] = x;
+  }
+}
+
+static void bench_run(kshell_t *ksh, const bench_t *b, uint32_t *samples) {
+  int ret;
+
+  if (0 > (ret = b->b_func(samples, BENCH_WARMUP, b->b_arg)) ||
+      0 > (ret = b->b_func(samples, BENCH_ITERS, b->b_arg))) {
+    kprintf(ksh, "%-16s failed: %d\n", b->b_name, ret);
+    return;
+  }
+  bench_sort(samples, BENCH_ITERS);
+  kprintf(ksh, "%-16s %10u %10u %10u\n", b->b_name, samples[0],
+          samples[BENCH_ITERS / 2], samples[BENCH_ITERS * 99 / 100]);
+}
+
+KSHELL_CMD(bench) {
+  uint32_t *samples;
+  int i, j, found;
+
+  KASSERT(BENCH_ITERS * sizeof(uint32_t) <= PAGE_SIZE);
+  if (NULL == (samples = page_alloc())) {
+    kprintf(ksh, "bench: out of memory\n");
+    return 0;
+  }
+  kprintf(ksh, "%-16s %10s %10s %10s (cycles, %d runs)\n", "bench", "min",
+          "median", "p99", BENCH_ITERS);
+  for (i = 0; i < BENCH_COUNT; i++) {
+    if (1 == argc)
+      bench_run(ksh, &bench_list[i], samples);
+  }
+  for (j = 1; j < argc; j++) {
+    found = 0;
+    for (i = 0; i < BENCH_COUNT; i++) {
+      if (0 == strcmp(argv[j], bench_list[i].b_name)) {
+        bench_run(ksh, &bench_list[i], samples);
+        found = 1;
+      }
+    }
+    if (!found)
+      kprintf(ksh, "bench: no benchmark %s\n", argv[j]);
+  }
+  page_free(samples);
+  return 0;
+}
@@ -9,12 +9,32 @@
 #include "fs/file.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
+#include "main/interrupt.h"
+#endif
+
+#include "fs/statsfs/statsfs.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+
+#include "proc/kmutex.h"
+#include "proc/spinlock.h"
+
+#ifdef __VM__
+#include "vm/anon.h"
+#include "vm/shadow.h"
+#include "vm/swap.h"
 #endif
 
 #include "test/kshell/io.h"
 
 #include "util/debug.h"
+#include "util/printf.h"
+#include "util/prof.h"
 #include "util/string.h"
+#include "util/time.h"
+#include "util/trace.h"
 
 int kshell_help(kshell_t *ksh, int argc, char **argv) {
   /* Print a list of available commands */
@@ -58,6 +78,218 @@ int kshell_echo(kshell_t *ksh, int argc, char **argv) {
   return 0;
 }
 
+int kshell_lockstat(kshell_t *ksh, int argc, char **argv) {
+  spinlock_t *sl;
+
+  /* kprintf may block, so the registry lock can't be held. Locks are
+   * only destroyed when a file system is unmounted, so don't run this
+   * while unmounting. */
+  kprintf(ksh, "%-16s %10s %10s %10s\n", "lock", "acquired", "contended",
+          "spins");
+  list_iterate_begin(&spinlock_list, sl, spinlock_t, sl_link) {
+    kprintf(ksh, "%-16s %10u %10u %10u\n", sl->sl_name, sl->sl_acquired,
+            sl->sl_contended, sl->sl_spins);
+  }
+  list_iterate_end();
+
+#if KMUTEX_STATS
+  kmutex_class_t *kc;
+
+  /* Times in microseconds; krwlock classes are listed with the mutexes */
+  kprintf(ksh, "\n%-40s %10s %10s %10s %10s\n", "mutex/rwlock", "acquired",
+          "contended", "wait", "max hold");
+  list_iterate_begin(&kmutex_class_list, kc, kmutex_class_t, kc_link) {
+    kprintf(ksh, "%-40s %10u %10u %10u %10u\n", kc->kc_site, kc->kc_acquired,
+            kc->kc_contended,
+            (uint32_t)time_cycles_to_usecs(kc->kc_wait_cycles),
+            (uint32_t)time_cycles_to_usecs(kc->kc_max_hold));
+  }
+  list_iterate_end();
+#endif
+
+  return 0;
+}
+
+/* The events named, a mask of them all if there are none */
+static uint32_t trace_types(kshell_t *ksh, int argc, char **argv) {
+  uint32_t mask = 0, found;
+  int i, type;
+
+  if (0 == argc)
+    return TRACE_ALL;
+  for (i = 0; i < argc; i++) {
+    found = 0;
+    for (type = 0; type < TRACE_NTYPES; type++) {
+      if (0 == strcmp(argv[i], trace_names[type]))
+        found |= 1U << type;
+    }
+    if (!found)
+      kprintf(ksh, "trace: no event %s\n", argv[i]);
+    mask |= found;
+  }
+  return mask;
+}
+
+int kshell_trace(kshell_t *ksh, int argc, char **argv) {
+  uint32_t mask, n, i;
+  uint64_t start;
+  trace_event_t *te;
+
+  if (argc >= 2 && 0 == strcmp(argv[1], "on")) {
+    trace_mask |= trace_types(ksh, argc - 2, argv + 2);
+    return 0;
+  } else if (argc >= 2 && 0 == strcmp(argv[1], "off")) {
+    trace_mask &= ~trace_types(ksh, argc - 2, argv + 2);
+    return 0;
+  } else if (2 == argc && 0 == strcmp(argv[1], "clear")) {
+    trace_clear();
+    return 0;
+  } else if (1 != argc) {
+    kprintf(ksh, "Usage: trace [on|off [<event> ...] | clear]\n");
+    return 0;
+  }
+
+  /* kprintf may block, and what it does would be traced over what is
+   * being printed */
+  mask = trace_mask;
+  trace_mask = 0;
+  n = MIN(trace_head, TRACE_NEVENTS);
+  i = trace_head - n;
+  start = trace_ring[i & (TRACE_NEVENTS - 1)].te_tsc;
+  kprintf(ksh, "%12s %-14s %5s %10s %10s %10s\n", "usecs", "event", "pid",
+          "thread", "arg0", "arg1");
+  for (; i != trace_head; i++) {
+    te = &trace_ring[i & (TRACE_NEVENTS - 1)];
+    kprintf(ksh, "%12llu %-12s %c %5d 0x%.8x 0x%.8x 0x%.8x\n",
+            time_cycles_to_usecs(te->te_tsc - start), trace_names[te->te_type],
+            TRACE_IS_BEGIN(te->te_type) ? '>'
+                                        : TRACE_IS_END(te->te_type) ? '<' : ' ',
+            te->te_pid, te->te_thr, te->te_arg[0], te->te_arg[1]);
+  }
+  trace_mask = mask;
+  return 0;
+}
+
+int kshell_prof(kshell_t *ksh, int argc, char **argv) {
+  int enabled, i, j;
+  prof_bucket_t *pb;
+
+  if (2 == argc && 0 == strcmp(argv[1], "on")) {
+    prof_enabled = 1;
+    return 0;
+  } else if (2 == argc && 0 == strcmp(argv[1], "off")) {
+    prof_enabled = 0;
+    return 0;
+  } else if (2 == argc && 0 == strcmp(argv[1], "clear")) {
+    prof_clear();
+    return 0;
+  } else if (1 != argc) {
+    kprintf(ksh, "Usage: prof [on|off|clear]\n");
+    return 0;
+  }
+
+  /* Stop sampling while the table is printed, kprintf may block */
+  enabled = prof_enabled;
+  prof_enabled = 0;
+  kprintf(ksh, "%u samples, %u dropped\n", prof_nsamples, prof_ndropped);
+  kprintf(ksh, "%8s %5s %10s %s\n", "count", "pid", "thread", "stack");
+  for (i = 0; i < PROF_NBUCKETS; i++) {
+    pb = &prof_buckets[i];
+    if (0 == pb->pb_count)
+      continue;
+    kprintf(ksh, "%8u %5d 0x%.8x %s", pb->pb_count, pb->pb_pid, pb->pb_thr,
+            pb->pb_user ? "user" : "");
+    for (j = 0; j < pb->pb_depth; j++)
+      kprintf(ksh, " 0x%.8x", pb->pb_pc[j]);
+    kprintf(ksh, "\n");
+  }
+  prof_enabled = enabled;
+  return 0;
+}
+
+int kshell_irqaff(kshell_t *ksh, int argc, char **argv) {
+  unsigned int irq, cpu;
+
+  if (3 == argc && 1 == sscanf(argv[1], "%u", &irq) &&
+      1 == sscanf(argv[2], "%u", &cpu)) {
+    if (intr_set_affinity(irq, cpu) < 0)
+      kprintf(ksh, "irqaff: irq %u is not in use or processor %u is not "
+                   "online\n",
+              irq, cpu);
+    return 0;
+  }
+  /* The current settings are in the statsfs interrupts file */
+  kprintf(ksh, "Usage: irqaff <irq> <cpu>\n");
+  return 0;
+}
+
+int kshell_stats(kshell_t *ksh, int argc, char **argv) {
+  dbg_infofunc_t info;
+  char *buf;
+  int i;
+
+  if (argc < 2) {
+    kprintf(ksh, "Usage: stats <names>\nnames:");
+    for (i = 0; NULL != statsfs_name(i); i++)
+      kprintf(ksh, " %s", statsfs_name(i));
+    kprintf(ksh, "\n");
+    return 0;
+  }
+
+  /* Each snapshot is made in one go without blocking, and only then
+   * written out, since writing to the shell may block */
+  if (NULL == (buf = page_alloc_n(STATSFS_SNAP_PAGES))) {
+    kprintf(ksh, "stats: out of memory\n");
+    return 0;
+  }
+  for (i = 1; i < argc; i++) {
+    if (NULL == (info = statsfs_info(argv[i]))) {
+      kprintf(ksh, "stats: %s: no such file\n", argv[i]);
+      continue;
+    }
+    info(NULL, buf, STATSFS_SNAP_PAGES * PAGE_SIZE);
+    if (2 < argc)
+      kprintf(ksh, "%s:\n", argv[i]);
+    kshell_write_all(ksh, buf, strlen(buf));
+  }
+  page_free_n(buf, STATSFS_SNAP_PAGES);
+  return 0;
+}
+
+#if KMEM_PROFILE
+int kshell_kmemprof(kshell_t *ksh, int argc, char **argv) {
+  kmem_site_t *sites, tmp;
+  int n = 0, i, j;
+
+  /* kprintf may block and allocate, so list a copy, biggest holders
+   * first */
+  if (NULL == (sites = kmalloc(sizeof(kmem_sites)))) {
+    kprintf(ksh, "kmemprof: out of memory\n");
+    return 0;
+  }
+  for (i = 0; i <= KMEM_PROFILE_SITES; i++) {
+    if (!kmem_sites[i].ks_allocs)
+      continue;
+    tmp = kmem_sites[i];
+    for (j = n++; j > 0 && sites[j - 1].ks_bytes < tmp.ks_bytes; --j)
+      sites[j] = sites[j - 1];
+    sites[j] = tmp;
+  }
+
+  kprintf(ksh, "%-10s %8s %8s %8s %8s  %s\n", "site", "allocs", "frees",
+          "bytes", "peak", "lifetimes (<1, <4, <16 ... ticks)");
+  for (i = 0; i < n; i++) {
+    kprintf(ksh, "0x%.8x %8u %8u %8u %8u ", sites[i].ks_pc, sites[i].ks_allocs,
+            sites[i].ks_frees, sites[i].ks_bytes, sites[i].ks_peak_bytes);
+    for (j = 0; j < KMEM_PROFILE_NLIFE; j++)
+      kprintf(ksh, " %u", sites[i].ks_life[j]);
+    kprintf(ksh, "\n");
+  }
+  kfree(sites);
+  return 0;
+}
+#endif
+
 #ifdef __VFS__
 int kshell_cat(kshell_t *ksh, int argc, char **argv) {
   if (argc < 2) {
@@ -307,3 +539,17 @@ int kshell_stat(kshell_t *ksh, int argc, char **argv) {
   return exit_val;
 }
 #endif
+
+#ifdef __VM__
+int kshell_shadowstat(kshell_t *ksh, int argc, char **argv) {
+  kprintf(ksh, "anonymous objects: %d\n", anon_count);
+  kprintf(ksh, "shadow objects:    %d\n", shadow_count);
+  kprintf(ksh, "shadows collapsed: %u\n", shadow_collapsed);
+  kprintf(ksh, "pages migrated:    %u\n", shadow_migrated);
+  kprintf(ksh, "chains flattened:  %u\n", shadow_flattened);
+  kprintf(ksh, "swap slots used:   %u of %u\n", swap_nused, swap_nslots);
+  kprintf(ksh, "swap compressed:   %u pages in %u bytes\n", swap_nzpages,
+          swap_nzbytes);
+  return 0;
+}
+#endif
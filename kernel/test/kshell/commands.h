@@ -1,5 +1,7 @@
 #pragma once
 
+#include "config.h"
+
 #include "test/kshell/kshell.h"
 
 #define KSHELL_CMD(name) int kshell_##name(kshell_t *ksh, int argc, char **argv)
@@ -7,6 +9,15 @@
 KSHELL_CMD(help);
 KSHELL_CMD(exit);
 KSHELL_CMD(echo);
+KSHELL_CMD(lockstat);
+KSHELL_CMD(trace);
+KSHELL_CMD(prof);
+KSHELL_CMD(irqaff);
+KSHELL_CMD(bench);
+KSHELL_CMD(stats);
+#if KMEM_PROFILE
+KSHELL_CMD(kmemprof);
+#endif
 #ifdef __VFS__
 KSHELL_CMD(cat);
 KSHELL_CMD(ls);
@@ -17,3 +28,6 @@ KSHELL_CMD(rmdir);
 KSHELL_CMD(mkdir);
 KSHELL_CMD(stat);
 #endif
+#ifdef __VM__
+KSHELL_CMD(shadowstat);
+#endif
@@ -33,6 +33,22 @@ static __attribute__((unused)) void kshell_init() {
   kshell_add_command("help", kshell_help,
                      "prints a list of available commands");
   kshell_add_command("echo", kshell_echo, "display a line of text");
+  kshell_add_command("lockstat", kshell_lockstat,
+                     "display lock contention statistics");
+  kshell_add_command("trace", kshell_trace,
+                     "turn tracepoints on or off, or dump the trace");
+  kshell_add_command("prof", kshell_prof,
+                     "turn the sampling profiler on or off, or dump it");
+  kshell_add_command("irqaff", kshell_irqaff,
+                     "deliver an irq to another processor");
+  kshell_add_command("bench", kshell_bench,
+                     "time kernel operations, all or those named");
+  kshell_add_command("stats", kshell_stats,
+                     "display the statsfs files named, without mounting it");
+#if KMEM_PROFILE
+  kshell_add_command("kmemprof", kshell_kmemprof,
+                     "display kernel memory allocations by call site");
+#endif
 #ifdef __VFS__
   kshell_add_command("cat", kshell_cat,
                      "concatenate files and print on the standard output");
@@ -45,6 +61,10 @@ static __attribute__((unused)) void kshell_init() {
   kshell_add_command("mkdir", kshell_mkdir, "make directories");
   kshell_add_command("stat", kshell_stat, "display file status");
 #endif
+#ifdef __VM__
+  kshell_add_command("shadowstat", kshell_shadowstat,
+                     "display shadow object statistics");
+#endif
 
   kshell_add_command("exit", kshell_exit, "exits the shell");
 }
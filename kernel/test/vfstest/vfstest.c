@@ -20,6 +20,9 @@
 #include "fs/lseek.h"
 #include "mm/mman.h"
 #include "mm/kmalloc.h"
+#include "mm/pframe.h"
+#include "drivers/blockdev.h"
+#include "util/time.h"
 
 #include "test/usertest.h"
 #include "test/vfstest/vfstest.h"
@@ -38,6 +41,10 @@
 #include <weenix/syscall.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/aio.h>
+#include <sys/socket.h>
 #include <stdio.h>
 
 #include <test/test.h>
@@ -524,7 +531,7 @@ static void vfstest_fd(void) {
   syscall_success(lseek(fd2, 5, SEEK_SET));
   test_fpos(fd1, 5);
   test_fpos(fd2, 5);
-  syscall_success(close(fd2)); 
+  syscall_success(close(fd2));
   syscall_success(chdir(".."));
 }
 
@@ -741,8 +748,11 @@ static void vfstest_read(void) {
 }
 
 static void vfstest_getdents(void) {
-  int fd, ret;
+#define GETDENTS_NFILES 150 /* more than a directory block holds */
+  int fd, ret, i, j;
   dirent_t dirents[4];
+  char name[32];
+  char seen[GETDENTS_NFILES];
 
   syscall_success(mkdir("getdents", 0));
   syscall_success(chdir("getdents"));
@@ -775,9 +785,976 @@ static void vfstest_getdents(void) {
   syscall_fail(getdents(fd, dirents, 4 * sizeof(dirent_t)), ENOTDIR);
   syscall_success(close(fd));
 
+  /* Only whole dirents are read, and there must be room for one */
+  syscall_success(fd = open("dir01", O_RDONLY, 0));
+  syscall_fail(getdents(fd, dirents, sizeof(dirent_t) - 1), EINVAL);
+  syscall_success(ret = getdents(fd, dirents, 2 * sizeof(dirent_t) - 1));
+  test_assert(sizeof(dirent_t) == ret, NULL);
+  test_assert(!strcmp(".", dirents[0].d_name), "got %s", dirents[0].d_name);
+  syscall_success(close(fd));
+  syscall_fail(getdents(fd, dirents, sizeof(dirent_t)), EBADF);
+
+  /* A directory spanning several blocks reads back every entry once */
+  syscall_success(mkdir("dir02", 0));
+  for (i = 0; i < GETDENTS_NFILES; ++i) {
+    snprintf(name, sizeof(name), "dir02/file%03d", i);
+    create_file(name);
+  }
+  memset(seen, 0, sizeof(seen));
+  syscall_success(fd = open("dir02", O_RDONLY, 0));
+  while (0 < (ret = getdents(fd, dirents, 3 * sizeof(dirent_t)))) {
+    for (j = 0; j < ret / (int)sizeof(dirent_t); ++j) {
+      if (1 == sscanf(dirents[j].d_name, "file%d", &i) && 0 <= i &&
+          i < GETDENTS_NFILES)
+        seen[i]++;
+      else
+        test_assert(!strcmp(".", dirents[j].d_name) ||
+                        !strcmp("..", dirents[j].d_name),
+                    "unexpected entry %s", dirents[j].d_name);
+    }
+  }
+  syscall_success(ret);
+  syscall_success(close(fd));
+  for (i = 0; i < GETDENTS_NFILES; ++i)
+    test_assert(1 == seen[i], "file%03d seen %d times", i, seen[i]);
+  test_assert(0 == removeall("dir02"), NULL);
+
+  syscall_success(chdir(".."));
+}
+
+#ifndef __KERNEL__
+/*
+ * The tests from here to vfstest_compress use system calls which the
+ * kernel's ksyscall wrappers do not cover, and some (aio, sendmsg) copy
+ * their arguments in from user memory, so they run in userland only.
+ */
+
+/*
+ * Tests readv(), writev(), pread() and pwrite(), including where they
+ * move less than was asked for.
+ */
+static void vfstest_rw(void) {
+#define RW_BIGSIZE 20000
+  static char big[RW_BIGSIZE];
+  int fd, pipefd[2], ret, total;
+  char buf[64], a[8], b[8];
+  struct iovec iov[3];
+
+  syscall_success(mkdir("rw", 0));
+  syscall_success(chdir("rw"));
+
+  syscall_success(fd = open("file", O_RDWR | O_CREAT, 0));
+
+  /* writev gathers the buffers in order and advances the file position */
+  iov[0].iov_base = "abc";
+  iov[0].iov_len = 3;
+  iov[1].iov_base = "";
+  iov[1].iov_len = 0;
+  iov[2].iov_base = "defgh";
+  iov[2].iov_len = 5;
+  test_assert(8 == writev(fd, iov, 3), NULL);
+  test_fpos(fd, 8);
+
+  /* readv scatters them, stopping short at the end of the file */
+  syscall_success(lseek(fd, 2, SEEK_SET));
+  iov[0].iov_base = a;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = b;
+  iov[1].iov_len = 8;
+  test_assert(6 == readv(fd, iov, 2), NULL);
+  test_assert(0 == memcmp(a, "cdef", 4), NULL);
+  test_assert(0 == memcmp(b, "gh", 2), NULL);
+  test_fpos(fd, 8);
+  test_assert(0 == readv(fd, iov, 2), NULL);
+
+  /* pread and pwrite leave the file position alone */
+  test_assert(3 == pwrite(fd, "XYZ", 3, 1), NULL);
+  test_fpos(fd, 8);
+  test_assert(4 == pread(fd, buf, 4, 0), NULL);
+  test_assert(0 == memcmp(buf, "aXYZ", 4), NULL);
+  test_fpos(fd, 8);
+
+  /* A partial read at the end of the file, and nothing past it */
+  test_assert(3 == pread(fd, buf, sizeof(buf), 5), NULL);
+  test_assert(0 == memcmp(buf, "fgh", 3), NULL);
+  test_assert(0 == pread(fd, buf, sizeof(buf), 100), NULL);
+
+  /* A pwrite past the end leaves a hole which reads as zeros */
+  test_assert(1 == pwrite(fd, "!", 1, 12), NULL);
+  test_assert(5 == pread(fd, buf, sizeof(buf), 8), NULL);
+  test_assert(0 == memcmp(buf, "\0\0\0\0!", 5), NULL);
+
+  /* A vector too big to move at once is written in part; the count
+   * says how much, and the rest can follow */
+  syscall_success(lseek(fd, 0, SEEK_SET));
+  memset(big, 'b', sizeof(big));
+  iov[0].iov_base = big;
+  iov[0].iov_len = RW_BIGSIZE;
+  iov[1].iov_base = big;
+  iov[1].iov_len = RW_BIGSIZE;
+  syscall_success(ret = writev(fd, iov, 2));
+  test_assert(0 < ret && ret <= 2 * RW_BIGSIZE, "writev returned %d", ret);
+  test_fpos(fd, ret);
+  for (total = ret; 0 < ret && total < 2 * RW_BIGSIZE; total += ret)
+    syscall_success(
+        ret = write(fd, big, MIN(RW_BIGSIZE, 2 * RW_BIGSIZE - total)));
+  test_fpos(fd, 2 * RW_BIGSIZE);
+  test_assert(1 == pread(fd, buf, 1, 2 * RW_BIGSIZE - 1) && 'b' == buf[0],
+              NULL);
+
+  /* Error cases */
+  syscall_fail(pread(fd, buf, 1, -1), EINVAL);
+  syscall_fail(pwrite(fd, buf, 1, -1), EINVAL);
+  syscall_fail(readv(fd, iov, 0), EINVAL);
+  syscall_fail(writev(fd, iov, IOV_MAX + 1), EINVAL);
+  syscall_success(close(fd));
+  syscall_fail(pread(fd, buf, 1, 0), EBADF);
+  syscall_success(fd = open("file", O_RDONLY, 0));
+  syscall_fail(pwrite(fd, "x", 1, 0), EBADF);
+  syscall_success(close(fd));
+  syscall_success(fd = open(".", O_RDONLY, 0));
+  syscall_fail(pread(fd, buf, 1, 0), EISDIR);
+  syscall_success(close(fd));
+
+  /* A pipe has no offset, and readv takes only what is in it */
+  syscall_success(pipe(pipefd));
+  syscall_fail(pwrite(pipefd[1], "x", 1, 0), ESPIPE);
+  syscall_fail(pread(pipefd[0], buf, 1, 0), ESPIPE);
+  test_assert(4 == write(pipefd[1], "pipe", 4), NULL);
+  iov[0].iov_base = a;
+  iov[0].iov_len = 2;
+  iov[1].iov_base = b;
+  iov[1].iov_len = 8;
+  test_assert(4 == readv(pipefd[0], iov, 2), NULL);
+  test_assert(0 == memcmp(a, "pi", 2) && 0 == memcmp(b, "pe", 2), NULL);
+  syscall_success(close(pipefd[0]));
+  syscall_success(close(pipefd[1]));
+
+  syscall_success(unlink("file"));
+  syscall_success(chdir(".."));
+}
+
+/*
+ * Tests epoll_create(), epoll_ctl() and epoll_wait(), watching a pipe.
+ */
+static void vfstest_epoll(void) {
+  int epfd, fd, pipefd[2];
+  char c, buf[2];
+  struct epoll_event ev, evs[4];
+
+  syscall_success(mkdir("epoll", 0));
+  syscall_success(chdir("epoll"));
+
+  syscall_success(epfd = epoll_create(1));
+  syscall_success(pipe(pipefd));
+  ev.events = EPOLLIN;
+  ev.data.u32 = 42;
+  syscall_success(epoll_ctl(epfd, EPOLL_CTL_ADD, pipefd[0], &ev));
+  syscall_fail(epoll_ctl(epfd, EPOLL_CTL_ADD, pipefd[0], &ev), EEXIST);
+
+  /* Nothing to read: a poll returns at once and a wait times out */
+  test_assert(0 == epoll_wait(epfd, evs, 4, 0), NULL);
+  test_assert(0 == epoll_wait(epfd, evs, 4, 20), NULL);
+
+  /* Level-triggered, the pipe is reported for as long as it has data */
+  test_assert(1 == write(pipefd[1], "x", 1), NULL);
+  test_assert(1 == epoll_wait(epfd, evs, 4, -1), NULL);
+  test_assert((evs[0].events & EPOLLIN) && 42 == evs[0].data.u32, NULL);
+  test_assert(1 == epoll_wait(epfd, evs, 4, 0), NULL);
+  test_assert(1 == read(pipefd[0], &c, 1), NULL);
+  test_assert(0 == epoll_wait(epfd, evs, 4, 0), NULL);
+
+  /* Edge-triggered, only once per write */
+  ev.events = EPOLLIN | EPOLLET;
+  syscall_success(epoll_ctl(epfd, EPOLL_CTL_MOD, pipefd[0], &ev));
+  test_assert(1 == write(pipefd[1], "x", 1), NULL);
+  test_assert(1 == epoll_wait(epfd, evs, 4, 0), NULL);
+  test_assert(0 == epoll_wait(epfd, evs, 4, 0), NULL);
+  test_assert(1 == write(pipefd[1], "x", 1), NULL);
+  test_assert(1 == epoll_wait(epfd, evs, 4, 0), NULL);
+  test_assert(2 == read(pipefd[0], buf, 2), NULL);
+
+  /* One-shot, once until it is modified again */
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  syscall_success(epoll_ctl(epfd, EPOLL_CTL_MOD, pipefd[0], &ev));
+  test_assert(1 == write(pipefd[1], "x", 1), NULL);
+  test_assert(1 == epoll_wait(epfd, evs, 4, 0), NULL);
+  test_assert(0 == epoll_wait(epfd, evs, 4, 0), NULL);
+  syscall_success(epoll_ctl(epfd, EPOLL_CTL_MOD, pipefd[0], &ev));
+  test_assert(1 == epoll_wait(epfd, evs, 4, 0), NULL);
+  test_assert(1 == read(pipefd[0], &c, 1), NULL);
+
+  /* Closing the write end hangs up the read end */
+  ev.events = EPOLLIN;
+  syscall_success(epoll_ctl(epfd, EPOLL_CTL_MOD, pipefd[0], &ev));
+  syscall_success(close(pipefd[1]));
+  test_assert(1 == epoll_wait(epfd, evs, 4, -1), NULL);
+  test_assert(evs[0].events & EPOLLHUP, "events 0x%x", evs[0].events);
+
+  /* Once removed, it is no longer reported */
+  syscall_success(epoll_ctl(epfd, EPOLL_CTL_DEL, pipefd[0], &ev));
+  test_assert(0 == epoll_wait(epfd, evs, 4, 0), NULL);
+  syscall_fail(epoll_ctl(epfd, EPOLL_CTL_DEL, pipefd[0], &ev), ENOENT);
+  syscall_fail(epoll_ctl(epfd, EPOLL_CTL_MOD, pipefd[0], &ev), ENOENT);
+
+  /* Error cases */
+  syscall_success(fd = open("file", O_RDWR | O_CREAT, 0));
+  syscall_fail(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev), EPERM);
+  syscall_fail(epoll_ctl(fd, EPOLL_CTL_ADD, pipefd[0], &ev), EINVAL);
+  syscall_fail(epoll_wait(fd, evs, 4, 0), EINVAL);
+  syscall_fail(epoll_ctl(epfd, EPOLL_CTL_ADD, epfd, &ev), EINVAL);
+  syscall_fail(epoll_ctl(epfd, EPOLL_CTL_ADD, pipefd[1], &ev), EBADF);
+  syscall_fail(epoll_wait(epfd, evs, 0, 0), EINVAL);
+  syscall_success(close(fd));
+  syscall_success(close(pipefd[0]));
+  syscall_success(close(epfd));
+  syscall_fail(epoll_wait(epfd, evs, 4, 0), EBADF);
+
+  syscall_success(unlink("file"));
+  syscall_success(chdir(".."));
+}
+
+/*
+ * Tests fcntl()'s F_GETFL and F_SETFL, and that nonblocking reads and
+ * writes of a pipe fail with EAGAIN, or move only part, rather than
+ * block.
+ */
+static void vfstest_nonblock(void) {
+#define NONBLOCK_BUFSIZE 32768 /* more than a nearly full pipe takes */
+  static char buf[NONBLOCK_BUFSIZE];
+  int fd, fd2, pipefd[2], ret, nwritten, nread;
+
+  syscall_success(mkdir("nonblock", 0));
+  syscall_success(chdir("nonblock"));
+
+  /* The access mode and flags come back as given to open */
+  syscall_success(fd = open("file", O_RDWR | O_CREAT | O_NONBLOCK, 0));
+  test_assert((O_RDWR | O_NONBLOCK) == fcntl(fd, F_GETFL, 0), NULL);
+  syscall_success(fcntl(fd, F_SETFL, O_APPEND));
+  test_assert((O_RDWR | O_APPEND) == fcntl(fd, F_GETFL, 0), NULL);
+
+  /* The flags belong to the open file, so a dup shares them */
+  syscall_success(fd2 = dup(fd));
+  test_assert((O_RDWR | O_APPEND) == fcntl(fd2, F_GETFL, 0), NULL);
+  test_assert(3 == write(fd, "abc", 3), NULL);
+  syscall_success(lseek(fd2, 0, SEEK_SET));
+  test_assert(3 == write(fd2, "def", 3), NULL);
+  test_fpos(fd, 6);
+  syscall_success(close(fd2));
+  syscall_success(close(fd));
+
+  /* Error cases */
+  syscall_fail(fcntl(fd, F_GETFL, 0), EBADF);
+  syscall_success(fd = open("file", O_RDONLY, 0));
+  syscall_fail(fcntl(fd, -1, 0), EINVAL);
+  syscall_success(close(fd));
+
+  /* Reading an empty pipe would block */
+  syscall_success(pipe(pipefd));
+  syscall_success(fcntl(pipefd[0], F_SETFL, O_NONBLOCK));
+  syscall_success(fcntl(pipefd[1], F_SETFL, O_NONBLOCK));
+  test_assert(O_NONBLOCK & fcntl(pipefd[0], F_GETFL, 0), NULL);
+  syscall_fail(read(pipefd[0], buf, 1), EAGAIN);
+
+  /* So would writing a full one */
+  memset(buf, 'n', sizeof(buf));
+  nwritten = 0;
+  while (0 < (ret = write(pipefd[1], buf, 1000)))
+    nwritten += ret;
+  test_assert(-1 == ret && EAGAIN == errno, "write returned %d", ret);
+  test_assert(0 < nwritten, NULL);
+  syscall_fail(write(pipefd[1], buf, 1), EAGAIN);
+
+  /* With only some room, a write moves part of its buffer */
+  test_assert(20000 == read(pipefd[0], buf, 20000), NULL);
+  syscall_success(ret = write(pipefd[1], buf, NONBLOCK_BUFSIZE));
+  test_assert(0 < ret && ret < NONBLOCK_BUFSIZE, "write returned %d", ret);
+  nwritten += ret - 20000;
+
+  /* Everything written reads back, and then the pipe is empty again */
+  nread = 0;
+  while (0 < (ret = read(pipefd[0], buf, NONBLOCK_BUFSIZE)))
+    nread += ret;
+  test_assert(-1 == ret && EAGAIN == errno, "read returned %d", ret);
+  test_assert(nread == nwritten, "read %d of %d", nread, nwritten);
+
+  /* Without a writer, an empty pipe reads as the end of the file */
+  syscall_success(close(pipefd[1]));
+  test_assert(0 == read(pipefd[0], buf, 1), NULL);
+  syscall_success(close(pipefd[0]));
+
+  syscall_success(unlink("file"));
+  syscall_success(chdir(".."));
+}
+
+/*
+ * Tests io_setup(), io_submit() and io_getevents(). A process has only
+ * one context, so the tests run in a child of their own.
+ */
+static void vfstest_aio(void) {
+  int fd, rdfd, pipefd[2], status, i;
+  char buf[64];
+  struct io_sqe sqe[3];
+  struct io_cqe cqe[3];
+
+  syscall_success(mkdir("aio", 0));
+  syscall_success(chdir("aio"));
+
+  syscall_success(fd = open("file", O_WRONLY | O_CREAT, 0));
+  syscall_success(rdfd = open("file", O_RDONLY, 0));
+
+  test_fork_begin() {
+    /* Nothing can be submitted without a context */
+    memset(sqe, 0, sizeof(sqe));
+    sqe[0].op = IO_OP_FSYNC;
+    sqe[0].fd = fd;
+    syscall_fail(io_submit(sqe, 1), EINVAL);
+    syscall_fail(io_getevents(cqe, 0, 1, 0), EINVAL);
+
+    syscall_fail(io_setup(0), EINVAL);
+    syscall_success(io_setup(2));
+    syscall_fail(io_setup(2), EINVAL);
+
+    /* A write, and then an fsync of what it wrote */
+    sqe[0].op = IO_OP_WRITE;
+    sqe[0].buf = SHORTSTR;
+    sqe[0].nbytes = strlen(SHORTSTR);
+    sqe[0].offset = 0;
+    sqe[0].user_data = 1;
+    test_assert(1 == io_submit(sqe, 1), NULL);
+    test_assert(1 == io_getevents(cqe, 1, 3, -1), NULL);
+    test_assert(1 == cqe[0].user_data, NULL);
+    test_assert((int)strlen(SHORTSTR) == cqe[0].res, "res %d", cqe[0].res);
+    sqe[0].op = IO_OP_FSYNC;
+    sqe[0].user_data = 2;
+    test_assert(1 == io_submit(sqe, 1), NULL);
+    test_assert(1 == io_getevents(cqe, 1, 3, -1), NULL);
+    test_assert(2 == cqe[0].user_data && 0 == cqe[0].res, NULL);
+
+    /* Reads across and past the end of the file come up short */
+    memset(buf, 0, sizeof(buf));
+    sqe[0].op = IO_OP_READ;
+    sqe[0].fd = rdfd;
+    sqe[0].buf = buf;
+    sqe[0].nbytes = sizeof(buf);
+    sqe[0].offset = 9;
+    sqe[0].user_data = 3;
+    sqe[1] = sqe[0];
+    sqe[1].buf = buf + 32;
+    sqe[1].nbytes = 8;
+    sqe[1].offset = 1000;
+    sqe[1].user_data = 4;
+    test_assert(2 == io_submit(sqe, 2), NULL);
+
+    /* The context holds no more than it was set up for */
+    syscall_fail(io_submit(sqe, 1), EAGAIN);
+
+    test_assert(2 == io_getevents(cqe, 2, 2, -1), NULL);
+    for (i = 0; i < 2; ++i) {
+      if (3 == cqe[i].user_data)
+        test_assert((int)strlen(SHORTSTR) - 9 == cqe[i].res, "res %d",
+                    cqe[i].res);
+      else
+        test_assert(4 == cqe[i].user_data && 0 == cqe[i].res, NULL);
+    }
+    test_assert(0 == memcmp(buf, SHORTSTR + 9, strlen(SHORTSTR) - 9), NULL);
+
+    /* With nothing outstanding, there is nothing to wait for */
+    test_assert(0 == io_getevents(cqe, 1, 3, -1), NULL);
+
+    /* Error cases */
+    sqe[0].fd = fd;
+    syscall_fail(io_submit(sqe, 1), EBADF);
+    sqe[0].fd = rdfd;
+    sqe[0].offset = -1;
+    syscall_fail(io_submit(sqe, 1), EINVAL);
+    sqe[0].offset = 0;
+    sqe[0].op = 0;
+    syscall_fail(io_submit(sqe, 1), EINVAL);
+    syscall_success(pipe(pipefd));
+    sqe[0].op = IO_OP_READ;
+    sqe[0].fd = pipefd[0];
+    syscall_fail(io_submit(sqe, 1), EINVAL);
+    syscall_fail(io_submit(sqe, -1), EINVAL);
+    syscall_fail(io_getevents(cqe, 2, 1, 0), EINVAL);
+  }
+  test_fork_end(&status);
+  test_assert(0 == status, "child exited with %d", status);
+
+  syscall_success(close(fd));
+  syscall_success(close(rdfd));
+  syscall_success(unlink("file"));
   syscall_success(chdir(".."));
 }
 
+#define TRUNC_PAGE 4096
+
+/* Whether len bytes of fd from off read back as zeros */
+static int read_zeros(int fd, int off, int len) {
+  char buf[256];
+  int n, i;
+
+  for (; len > 0; off += n, len -= n) {
+    if (0 >= (n = pread(fd, buf, MIN(len, (int)sizeof(buf)), off)))
+      return 0;
+    for (i = 0; i < n; ++i)
+      if (buf[i])
+        return 0;
+  }
+  return 1;
+}
+
+/* Writes fd's dirty pages back and drops them all from the page cache,
+ * so that what is read next comes from the disk */
+#define drop_cache(fd)                                                         \
+  do {                                                                         \
+    syscall_success(fsync(fd));                                                \
+    syscall_success(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));             \
+  } while (0);
+
+/*
+ * Tests ftruncate(), fallocate() hole punching and O_TRUNC: whatever
+ * they free reads back as zeros, before and after it goes to disk.
+ */
+static void vfstest_truncate(void) {
+  static char buf[4 * TRUNC_PAGE];
+  int fd, rdfd, ret;
+  struct stat s, s2;
+
+  syscall_success(mkdir("truncate", 0));
+  syscall_success(chdir("truncate"));
+
+  memset(buf, 't', sizeof(buf));
+  syscall_success(fd = open("file", O_RDWR | O_CREAT, 0));
+  test_assert(3 * TRUNC_PAGE == write(fd, buf, 3 * TRUNC_PAGE), NULL);
+  drop_cache(fd);
+
+  /* Shrinking cuts the file off mid-page */
+  syscall_success(ftruncate(fd, 5000));
+  syscall_success(fstat(fd, &s));
+  test_assert(5000 == s.st_size, "size %d", s.st_size);
+  test_assert(10 == pread(fd, buf, 100, 4990), NULL);
+  test_assert(0 == pread(fd, buf, 100, 5000), NULL);
+
+  /* Growing it again reads as zeros where the old data was */
+  syscall_success(ftruncate(fd, 12000));
+  test_assert(read_zeros(fd, 5000, 7000), NULL);
+  drop_cache(fd);
+  test_assert(read_zeros(fd, 5000, 7000), NULL);
+  test_assert(1 == pread(fd, buf, 1, 4999) && 't' == buf[0], NULL);
+
+  /* Punching leaves the size alone and frees the pages it covers */
+  memset(buf, 'p', sizeof(buf));
+  test_assert(4 * TRUNC_PAGE == pwrite(fd, buf, 4 * TRUNC_PAGE, 0), NULL);
+  drop_cache(fd);
+  syscall_success(fstat(fd, &s));
+  syscall_success(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            1000, 2 * TRUNC_PAGE));
+  test_assert(read_zeros(fd, 1000, 2 * TRUNC_PAGE), NULL);
+  drop_cache(fd);
+  syscall_success(fstat(fd, &s2));
+  test_assert(4 * TRUNC_PAGE == s2.st_size, "size %d", s2.st_size);
+  test_assert(s2.st_blocks < s.st_blocks, "blocks %d, were %d", s2.st_blocks,
+              s.st_blocks);
+  test_assert(read_zeros(fd, 1000, 2 * TRUNC_PAGE), NULL);
+  test_assert(1 == pread(fd, buf, 1, 999) && 'p' == buf[0], NULL);
+  test_assert(1 == pread(fd, buf, 1, 1000 + 2 * TRUNC_PAGE) && 'p' == buf[0],
+              NULL);
+
+  /* Punching past the end of the file doesn't grow it */
+  syscall_success(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            3 * TRUNC_PAGE, 4 * TRUNC_PAGE));
+  syscall_success(fstat(fd, &s2));
+  test_assert(4 * TRUNC_PAGE == s2.st_size, "size %d", s2.st_size);
+  test_assert(read_zeros(fd, 3 * TRUNC_PAGE, TRUNC_PAGE), NULL);
+
+  /* O_TRUNC empties the file */
+  syscall_success(rdfd = open("file", O_RDWR | O_TRUNC, 0));
+  syscall_success(fstat(fd, &s2));
+  test_assert(0 == s2.st_size && 0 == s2.st_blocks, "size %d, blocks %d",
+              s2.st_size, s2.st_blocks);
+  syscall_success(close(rdfd));
+
+  /* Error cases */
+  syscall_fail(ftruncate(fd, -1), EINVAL);
+  syscall_fail(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, -1,
+                         1),
+               EINVAL);
+  syscall_fail(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, 0),
+               EINVAL);
+  syscall_fail(fallocate(fd, FALLOC_FL_PUNCH_HOLE, 0, 1), EOPNOTSUPP);
+  syscall_fail(fallocate(fd, 0, 0, 1), EOPNOTSUPP);
+  syscall_success(close(fd));
+  syscall_fail(ftruncate(fd, 0), EBADF);
+  syscall_success(rdfd = open("file", O_RDONLY, 0));
+  syscall_fail(ftruncate(rdfd, 0), EBADF);
+  syscall_fail(fallocate(rdfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                         1),
+               EBADF);
+  syscall_success(close(rdfd));
+
+  syscall_success(unlink("file"));
+  syscall_success(chdir(".."));
+}
+
+/*
+ * Tests files small enough for s5fs to keep in the inode, as they grow
+ * out of it and shrink back, reading them back from disk each time.
+ */
+static void vfstest_inline(void) {
+#define INLINE_MAX 108 /* most bytes of data an s5fs inode holds */
+  char buf[2 * INLINE_MAX];
+  int fd;
+  struct stat s;
+
+  syscall_success(mkdir("inline", 0));
+  syscall_success(chdir("inline"));
+
+  /* A small file takes no block */
+  syscall_success(fd = open("file", O_RDWR | O_CREAT, 0));
+  test_assert(100 == write(fd, TESTSTR, 100), NULL);
+  drop_cache(fd);
+  syscall_success(fstat(fd, &s));
+  test_assert(100 == s.st_size && 0 == s.st_blocks, "size %d, blocks %d",
+              s.st_size, s.st_blocks);
+  test_assert(100 == pread(fd, buf, sizeof(buf), 0), NULL);
+  test_assert(0 == memcmp(buf, TESTSTR, 100), NULL);
+
+  /* Filling the inode exactly still fits */
+  test_assert(INLINE_MAX - 100 == write(fd, TESTSTR + 100, INLINE_MAX - 100),
+              NULL);
+  drop_cache(fd);
+  syscall_success(fstat(fd, &s));
+  test_assert(INLINE_MAX == s.st_size && 0 == s.st_blocks,
+              "size %d, blocks %d", s.st_size, s.st_blocks);
+
+  /* One byte more moves it out to a block, keeping what was there */
+  test_assert(1 == write(fd, "!", 1), NULL);
+  drop_cache(fd);
+  syscall_success(fstat(fd, &s));
+  test_assert(INLINE_MAX + 1 == s.st_size && 1 == s.st_blocks,
+              "size %d, blocks %d", s.st_size, s.st_blocks);
+  test_assert(INLINE_MAX + 1 == pread(fd, buf, sizeof(buf), 0), NULL);
+  test_assert(0 == memcmp(buf, TESTSTR, INLINE_MAX) && '!' == buf[INLINE_MAX],
+              NULL);
+  syscall_success(close(fd));
+
+  /* Shrinking an inline file and growing it past the inode reads as
+   * zeros from where it was cut off */
+  syscall_success(fd = open("file2", O_RDWR | O_CREAT, 0));
+  test_assert(100 == write(fd, TESTSTR, 100), NULL);
+  drop_cache(fd);
+  syscall_success(ftruncate(fd, 40));
+  syscall_success(ftruncate(fd, 2 * INLINE_MAX));
+  test_assert(read_zeros(fd, 40, 2 * INLINE_MAX - 40), NULL);
+  drop_cache(fd);
+  test_assert(read_zeros(fd, 40, 2 * INLINE_MAX - 40), NULL);
+  test_assert(40 == pread(fd, buf, 40, 0), NULL);
+  test_assert(0 == memcmp(buf, TESTSTR, 40), NULL);
+
+  /* The same across the boundary the other way, once it has a block */
+  syscall_success(ftruncate(fd, 20));
+  syscall_success(ftruncate(fd, INLINE_MAX));
+  drop_cache(fd);
+  test_assert(read_zeros(fd, 20, INLINE_MAX - 20), NULL);
+  test_assert(20 == pread(fd, buf, 20, 0), NULL);
+  test_assert(0 == memcmp(buf, TESTSTR, 20), NULL);
+
+  /* A write past the end of an inline file leaves zeros before it */
+  syscall_success(ftruncate(fd, 0));
+  test_assert(10 == write(fd, TESTSTR, 10), NULL);
+  drop_cache(fd);
+  test_assert(1 == pwrite(fd, "!", 1, INLINE_MAX + 10), NULL);
+  drop_cache(fd);
+  test_assert(read_zeros(fd, 10, INLINE_MAX), NULL);
+  test_assert(1 == pread(fd, buf, 2, INLINE_MAX + 10) && '!' == buf[0], NULL);
+  syscall_success(close(fd));
+
+  syscall_success(unlink("file"));
+  syscall_success(unlink("file2"));
+  syscall_success(chdir(".."));
+}
+
+/*
+ * Tests socketpair() streams and datagrams: short and nonblocking
+ * transfers, message boundaries, passing a descriptor, and the end of
+ * a connection.
+ */
+static void vfstest_socket(void) {
+#define SOCKET_BIGSIZE 70000 /* more than a socket end queues */
+  static char big[SOCKET_BIGSIZE];
+  int sv[2], dv[2], fd, n, ret, total;
+  char buf[16];
+  int ctl[CMSG_SPACE(sizeof(int)) / sizeof(int)];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+
+  syscall_success(mkdir("socket", 0));
+  syscall_success(chdir("socket"));
+
+  /* A stream reads back in whatever pieces are asked for */
+  syscall_success(socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  test_assert(5 == write(sv[0], "hello", 5), NULL);
+  test_assert(3 == write(sv[0], "abc", 3), NULL);
+  test_assert(2 == read(sv[1], buf, 2), NULL);
+  test_assert(6 == read(sv[1], buf + 2, sizeof(buf) - 2), NULL);
+  test_assert(0 == memcmp(buf, "helloabc", 8), NULL);
+  test_assert(2 == write(sv[1], "ok", 2), NULL);
+  test_assert(2 == read(sv[0], buf, sizeof(buf)), NULL);
+
+  /* With nothing queued, a nonblocking receive fails rather than wait */
+  syscall_fail(recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT), EAGAIN);
+  syscall_success(fcntl(sv[1], F_SETFL, O_NONBLOCK));
+  syscall_fail(read(sv[1], buf, sizeof(buf)), EAGAIN);
+  syscall_success(fcntl(sv[1], F_SETFL, 0));
+
+  /* More than fits is sent in part, and then not at all */
+  memset(big, 's', sizeof(big));
+  syscall_success(ret = send(sv[0], big, SOCKET_BIGSIZE, MSG_DONTWAIT));
+  test_assert(0 < ret && ret < SOCKET_BIGSIZE, "send returned %d", ret);
+  syscall_fail(send(sv[0], big, 1, MSG_DONTWAIT), EAGAIN);
+  for (total = 0, n = 1; 0 < n && total < ret; total += n)
+    syscall_success(n = read(sv[1], big, SOCKET_BIGSIZE));
+  test_assert(total == ret, "read %d of %d", total, ret);
+
+  /* A descriptor passed over the stream refers to the same open file */
+  syscall_success(fd = open("file", O_RDWR | O_CREAT, 0));
+  test_assert(6 == write(fd, "passed", 6), NULL);
+  syscall_success(lseek(fd, 0, SEEK_SET));
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = "x";
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = CMSG_LEN(sizeof(int));
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  *(int *)CMSG_DATA(cm) = fd;
+  test_assert(1 == sendmsg(sv[0], &msg, 0), NULL);
+  syscall_success(close(fd));
+
+  memset(ctl, 0, sizeof(ctl));
+  iov.iov_base = buf;
+  iov.iov_len = sizeof(buf);
+  msg.msg_controllen = sizeof(ctl);
+  test_assert(1 == recvmsg(sv[1], &msg, 0) && 'x' == buf[0], NULL);
+  cm = CMSG_FIRSTHDR(&msg);
+  test_assert(NULL != cm && SCM_RIGHTS == cm->cmsg_type &&
+                  CMSG_LEN(sizeof(int)) == cm->cmsg_len,
+              NULL);
+  if (NULL != cm) {
+    fd = *(int *)CMSG_DATA(cm);
+    test_assert(3 == read(fd, buf, 3) && 0 == memcmp(buf, "pas", 3), NULL);
+    test_fpos(fd, 3);
+    syscall_success(close(fd));
+  }
+
+  /* Neither end may be passed over its own connection */
+  *(int *)CMSG_DATA(cm = (struct cmsghdr *)ctl) = sv[1];
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  iov.iov_base = "x";
+  iov.iov_len = 1;
+  msg.msg_controllen = CMSG_LEN(sizeof(int));
+  syscall_fail(sendmsg(sv[0], &msg, 0), EINVAL);
+
+  /* Once one end closes, the other reads the end of the stream and can
+   * no longer write */
+  syscall_success(close(sv[0]));
+  test_assert(0 == read(sv[1], buf, sizeof(buf)), NULL);
+  syscall_fail(write(sv[1], "x", 1), EPIPE);
+  syscall_success(close(sv[1]));
+
+  /* Datagrams keep their boundaries, and what doesn't fit is dropped */
+  syscall_success(socketpair(AF_UNIX, SOCK_DGRAM, 0, dv));
+  test_assert(2 == send(dv[0], "ab", 2, 0), NULL);
+  test_assert(3 == send(dv[0], "cde", 3, 0), NULL);
+  test_assert(0 == send(dv[0], "", 0, 0), NULL);
+  test_assert(4 == send(dv[0], "fghi", 4, 0), NULL);
+  test_assert(2 == recv(dv[1], buf, sizeof(buf), 0), NULL);
+  test_assert(0 == memcmp(buf, "ab", 2), NULL);
+  test_assert(3 == recv(dv[1], buf, sizeof(buf), 0), NULL);
+  test_assert(0 == memcmp(buf, "cde", 3), NULL);
+  test_assert(0 == recv(dv[1], buf, sizeof(buf), 0), NULL);
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = 2;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  test_assert(2 == recvmsg(dv[1], &msg, 0), NULL);
+  test_assert(0 == memcmp(buf, "fg", 2) && (msg.msg_flags & MSG_TRUNC), NULL);
+  syscall_fail(recv(dv[1], buf, sizeof(buf), MSG_DONTWAIT), EAGAIN);
+  syscall_success(close(dv[0]));
+  syscall_success(close(dv[1]));
+
+  /* Error cases */
+  syscall_fail(socketpair(AF_INET, SOCK_STREAM, 0, sv), EAFNOSUPPORT);
+  syscall_fail(socketpair(AF_UNIX, 99, 0, sv), ESOCKTNOSUPPORT);
+  syscall_fail(socketpair(AF_UNIX, SOCK_STREAM, 1, sv), EPROTONOSUPPORT);
+
+  syscall_success(unlink("file"));
+  syscall_success(chdir(".."));
+}
+
+/*
+ * Tests fstatat(), relative to a directory fd, the current directory,
+ * and not at all for an absolute path.
+ */
+static void vfstest_fstatat(void) {
+  int dfd, fd;
+  struct stat s, s2;
+
+  syscall_success(mkdir("fstatat", 0));
+  syscall_success(chdir("fstatat"));
+
+  syscall_success(mkdir("dir", 0));
+  syscall_success(mkdir("dir/sub", 0));
+  syscall_success(fd = open("dir/file", O_RDWR | O_CREAT, 0));
+  test_assert(3 == write(fd, "abc", 3), NULL);
+  syscall_success(dfd = open("dir", O_RDONLY, 0));
+
+  /* A relative path starts at the directory */
+  syscall_success(fstatat(dfd, "file", &s));
+  syscall_success(stat("dir/file", &s2));
+  test_assert(S_ISREG(s.st_mode) && 3 == s.st_size, NULL);
+  test_assert(s.st_ino == s2.st_ino, NULL);
+  syscall_success(fstatat(dfd, "sub/..", &s));
+  syscall_success(stat("dir", &s2));
+  test_assert(s.st_ino == s2.st_ino, NULL);
+  syscall_success(fstatat(dfd, "..", &s));
+  syscall_success(stat(".", &s2));
+  test_assert(s.st_ino == s2.st_ino, NULL);
+
+  /* or at the current directory */
+  syscall_success(fstatat(AT_FDCWD, "dir/file", &s));
+  test_assert(3 == s.st_size, NULL);
+
+  /* An absolute path doesn't need a directory */
+  syscall_success(fstatat(fd, "/", &s));
+  syscall_success(stat("/", &s2));
+  test_assert(S_ISDIR(s.st_mode) && s.st_ino == s2.st_ino, NULL);
+
+  /* Error cases */
+  syscall_fail(fstatat(dfd, "noent", &s), ENOENT);
+  syscall_fail(fstatat(dfd, "file/nope", &s), ENOTDIR);
+  syscall_fail(fstatat(fd, "file", &s), ENOTDIR);
+  syscall_success(close(fd));
+  syscall_fail(fstatat(fd, "file", &s), EBADF);
+  syscall_success(close(dfd));
+  syscall_fail(fstatat(dfd, "file", &s), EBADF);
+
+  syscall_success(unlink("dir/file"));
+  syscall_success(rmdir("dir/sub"));
+  syscall_success(rmdir("dir"));
+  syscall_success(chdir(".."));
+}
+
+#define COMPRESS_SIZE (16 * TRUNC_PAGE + 1000) /* four clusters and a bit */
+
+/* Whether fd reads back as len bytes of want, a pread at a time */
+static int read_matches(int fd, const char *want, int len) {
+  static char buf[COMPRESS_SIZE];
+  int n, off;
+
+  for (off = 0; off < len; off += n)
+    if (0 >= (n = pread(fd, buf + off, len - off, off)))
+      return 0;
+  return 0 == pread(fd, buf, 1, len) && 0 == memcmp(buf, want, len);
+}
+
+/*
+ * Puts the name the ramdisk is mounted from, "disk<minor>", in name,
+ * going by the disk file of a statsfs mounted in the current directory:
+ * the ramdisk registers after any real disks, so it has the highest
+ * minor. Returns 0 or an errno.
+ */
+static int ramdisk_name(char *name, int size) {
+  char buf[1024], *line;
+  unsigned int minor, max = 0;
+  int fd, len, found = 0, err = 0;
+
+  if (0 > mkdir("stats", 0777))
+    return errno;
+  if (0 > mount("", "stats", "statsfs")) {
+    err = errno;
+    rmdir("stats");
+    return err;
+  }
+  if (0 > (fd = open("stats/disk", O_RDONLY, 0))) {
+    err = errno;
+  } else {
+    if (0 > (len = read(fd, buf, sizeof(buf) - 1)))
+      err = errno;
+    close(fd);
+  }
+  umount("stats");
+  rmdir("stats");
+  if (err)
+    return err;
+
+  buf[len] = '\0';
+  /* The first line is the column headings */
+  for (line = strchr(buf, '\n'); line && *++line;
+       line = strchr(line, '\n')) {
+    if (1 == sscanf(line, "%u", &minor) && (!found || minor > max)) {
+      max = minor;
+      found = 1;
+    }
+  }
+  if (!found)
+    return ENODEV;
+  snprintf(name, size, "disk%u", max);
+  return 0;
+}
+
+#define VFSTEST_REMOUNT_TRIES 3
+
+/*
+ * Writes a compressed file on the ramdisk s5fs mounted on /ram, unmounts
+ * and mounts it again, and checks the file comes back compressed and
+ * reading as want. Skipped if there is no ramdisk on /ram.
+ */
+static void vfstest_compress_remount(const char *want) {
+  char dev[16];
+  int fd, i, err;
+
+  if ((err = ramdisk_name(dev, sizeof(dev)))) {
+    printf("No ramdisk (%s), skipping the remount test\n", test_errstr(err));
+    return;
+  }
+  if (0 > (fd = open("/ram/vfstest-compress", O_RDWR | O_CREAT | O_TRUNC,
+                     0))) {
+    printf("Cannot create a file on /ram (%s), skipping the remount test\n",
+           test_errstr(errno));
+    return;
+  }
+  test_assert(0 == fcntl(fd, F_SETCOMPRESS, 1), NULL);
+  for (i = 0; i < COMPRESS_SIZE; i += TRUNC_PAGE)
+    test_assert(MIN(TRUNC_PAGE, COMPRESS_SIZE - i) ==
+                    write(fd, want + i, MIN(TRUNC_PAGE, COMPRESS_SIZE - i)),
+                NULL);
+  syscall_success(close(fd));
+
+  if (0 > umount("/ram")) {
+    printf("Cannot unmount /ram (%s), skipping the remount test\n",
+           test_errstr(errno));
+    syscall_success(unlink("/ram/vfstest-compress"));
+    return;
+  }
+  /* Try again before giving up: a failure here leaves /ram unmounted,
+   * which every later user of it this boot would trip over */
+  for (i = 0; i < VFSTEST_REMOUNT_TRIES; ++i) {
+    if (0 <= mount(dev, "/ram", "s5fs"))
+      break;
+    err = errno;
+  }
+  if (i == VFSTEST_REMOUNT_TRIES) {
+    test_assert(0, "could not mount %s on /ram again: %s", dev,
+                test_errstr(err));
+    fprintf(stderr,
+            "vfstest: /ram is left unmounted, with vfstest-compress on %s;"
+            " mount it with \"mount s5fs /ram %s\"\n",
+            dev, dev);
+    return;
+  }
+
+  syscall_success(fd = open("/ram/vfstest-compress", O_RDONLY, 0));
+  test_assert(1 == fcntl(fd, F_GETCOMPRESS, 0), NULL);
+  test_assert(read_matches(fd, want, COMPRESS_SIZE), NULL);
+  syscall_success(close(fd));
+  syscall_success(unlink("/ram/vfstest-compress"));
+}
+
+/*
+ * Tests files which s5fs keeps compressed: that data written round trips
+ * through the disk and through a remount, and that truncating, punching
+ * and overwriting part of a compressed cluster leave the rest of it as
+ * it was.
+ */
+static void vfstest_compress(void) {
+  static char want[COMPRESS_SIZE];
+  int fd, rdfd, i, cut;
+  struct stat s;
+
+  syscall_success(mkdir("compress", 0));
+  syscall_success(chdir("compress"));
+
+  for (i = 0; i < COMPRESS_SIZE; i += (int)strlen(TESTSTR))
+    memcpy(want + i, TESTSTR, MIN((int)strlen(TESTSTR), COMPRESS_SIZE - i));
+
+  /* Compression can be turned on only while the file is empty */
+  syscall_success(fd = open("file", O_RDWR | O_CREAT, 0));
+  test_assert(0 == fcntl(fd, F_GETCOMPRESS, 0), NULL);
+  test_assert(0 == fcntl(fd, F_SETCOMPRESS, 1), NULL);
+  test_assert(1 == fcntl(fd, F_GETCOMPRESS, 0), NULL);
+  test_assert(1 == fcntl(fd, F_SETCOMPRESS, 1), NULL);
+
+  /* Written back, it takes fewer blocks than pages, and reads back from
+   * the disk as it was written */
+  for (i = 0; i < COMPRESS_SIZE; i += TRUNC_PAGE)
+    test_assert(MIN(TRUNC_PAGE, COMPRESS_SIZE - i) ==
+                    write(fd, want + i, MIN(TRUNC_PAGE, COMPRESS_SIZE - i)),
+                NULL);
+  syscall_fail(fcntl(fd, F_SETCOMPRESS, 0), EBUSY);
+  drop_cache(fd);
+  syscall_success(fstat(fd, &s));
+  test_assert(COMPRESS_SIZE == s.st_size, "size %d", s.st_size);
+  test_assert(s.st_blocks < COMPRESS_SIZE / TRUNC_PAGE, "blocks %d",
+              s.st_blocks);
+  test_assert(read_matches(fd, want, COMPRESS_SIZE), NULL);
+
+  /* Overwriting part of a cluster keeps the rest of it */
+  test_assert(5 == pwrite(fd, "12345", 5, 2 * TRUNC_PAGE + 5), NULL);
+  memcpy(want + 2 * TRUNC_PAGE + 5, "12345", 5);
+  drop_cache(fd);
+  test_assert(read_matches(fd, want, COMPRESS_SIZE), NULL);
+
+  /* A hole punched across two clusters reads as zeros, with the rest of
+   * both clusters intact */
+  syscall_success(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            3 * TRUNC_PAGE + 10, 4 * TRUNC_PAGE));
+  memset(want + 3 * TRUNC_PAGE + 10, 0, 4 * TRUNC_PAGE);
+  test_assert(read_matches(fd, want, COMPRESS_SIZE), NULL);
+  drop_cache(fd);
+  test_assert(read_matches(fd, want, COMPRESS_SIZE), NULL);
+
+  /* Cut off in the middle of a cluster and grown again, the file reads
+   * as zeros from the cut */
+  cut = 9 * TRUNC_PAGE + 100;
+  syscall_success(ftruncate(fd, cut));
+  syscall_success(ftruncate(fd, COMPRESS_SIZE));
+  memset(want + cut, 0, COMPRESS_SIZE - cut);
+  test_assert(read_matches(fd, want, COMPRESS_SIZE), NULL);
+  drop_cache(fd);
+  test_assert(read_matches(fd, want, COMPRESS_SIZE), NULL);
+  syscall_success(close(fd));
+
+  /* Opened again, it is still compressed and reads the same */
+  syscall_success(rdfd = open("file", O_RDONLY, 0));
+  test_assert(1 == fcntl(rdfd, F_GETCOMPRESS, 0), NULL);
+  test_assert(read_matches(rdfd, want, COMPRESS_SIZE), NULL);
+
+  /* Error cases */
+  syscall_fail(fcntl(rdfd, F_SETCOMPRESS, 0), EBADF);
+  syscall_success(close(rdfd));
+  syscall_success(fd = open(".", O_RDONLY, 0));
+  syscall_fail(fcntl(fd, F_GETCOMPRESS, 0), EINVAL);
+  syscall_success(close(fd));
+
+  syscall_success(unlink("file"));
+
+  /* It survives the file system being unmounted and mounted again */
+  vfstest_compress_remount(want);
+
+  syscall_success(chdir(".."));
+}
+#endif /* __KERNEL__ */
+
 #ifdef __VM__
 /*
  * Tests link(), rename(), and mmap() (and munmap, and brk).
@@ -935,6 +1912,268 @@ static void vfstest_s5fs_vm(void) {
 }
 #endif
 
+typedef struct vfstest_case {
+  const char *vc_name;
+  void (*vc_func)(void);
+} vfstest_case_t;
+
+static const vfstest_case_t vfstest_cases[] = {
+#ifdef __KERNEL__
+    {"notdir", vfstest_notdir},
+#endif
+    {"stat", vfstest_stat},         {"chdir", vfstest_chdir},
+    {"mkdir", vfstest_mkdir},       {"paths", vfstest_paths},
+    {"fd", vfstest_fd},             {"open", vfstest_open},
+    {"read", vfstest_read},         {"getdents", vfstest_getdents},
+#ifndef __KERNEL__
+    {"rw", vfstest_rw},             {"epoll", vfstest_epoll},
+    {"nonblock", vfstest_nonblock}, {"aio", vfstest_aio},
+    {"truncate", vfstest_truncate}, {"inline", vfstest_inline},
+    {"socket", vfstest_socket},     {"fstatat", vfstest_fstatat},
+    {"compress", vfstest_compress},
+#endif
+#ifdef __VM__
+    {"s5fs_vm", vfstest_s5fs_vm},
+#endif
+};
+
+#define VFSTEST_NCASES ((int)(sizeof(vfstest_cases) / sizeof(vfstest_cases[0])))
+
+/*
+ * Timing mode, "vfstest -t <runs> [-s <file> | -c <file>]": each case is
+ * run <runs> times, each time in a new directory which is removed
+ * afterwards, and the cycles, page cache misses and disk operations of
+ * an average run are printed for each case. -s saves them to the file
+ * as a baseline, a "<case> <cycles> <misses> <diskops>" line per case;
+ * -c reads such a file and flags every case which is now more than
+ * VFSTEST_SLACK percent slower than it was, or misses or goes to disk
+ * more often, so that a change which slows the file system down is
+ * noticed before it goes in.
+ */
+#define VFSTEST_SLACK 10
+#define VFSTEST_MAX_BASELINE 4096
+
+typedef struct vfstest_result {
+  uint64_t vr_cycles;
+  uint32_t vr_misses;
+  uint32_t vr_diskops;
+} vfstest_result_t;
+
+#ifdef __KERNEL__
+/* The kernel reads its counters directly */
+static int vfstest_counters_open(void) { return 0; }
+static void vfstest_counters_close(void) {}
+static uint64_t vfstest_cycles(void) { return time_cycles(); }
+static uint32_t vfstest_misses(void) { return pframe_miss_count(); }
+static uint32_t vfstest_diskops(void) { return blockdev_op_count(); }
+#else
+/*
+ * Userland reads the same counters from statsfs, mounted on
+ * VFSTEST_STATS in the test root for the length of the run: the "misses"
+ * line of its pframe file, and the READS and WRITES columns of its disk
+ * file summed over the disks. A statsfs file is regenerated each time it
+ * is read from the start, so the files are opened once and read with
+ * pread.
+ */
+#define VFSTEST_STATS "stats"
+#define VFSTEST_STATS_SIZE 4096
+
+static int vfstest_pframe_fd = -1, vfstest_disk_fd = -1;
+
+/* Returns 0 or an errno */
+static int vfstest_counters_open(void) {
+  if (0 > mkdir(VFSTEST_STATS, 0777) ||
+      0 > mount("", VFSTEST_STATS, "statsfs"))
+    return errno;
+  if (0 > (vfstest_pframe_fd = open(VFSTEST_STATS "/pframe", O_RDONLY, 0)) ||
+      0 > (vfstest_disk_fd = open(VFSTEST_STATS "/disk", O_RDONLY, 0)))
+    return errno;
+  return 0;
+}
+
+static void vfstest_counters_close(void) {
+  if (0 <= vfstest_pframe_fd)
+    close(vfstest_pframe_fd);
+  if (0 <= vfstest_disk_fd)
+    close(vfstest_disk_fd);
+  vfstest_pframe_fd = vfstest_disk_fd = -1;
+  umount(VFSTEST_STATS);
+  rmdir(VFSTEST_STATS);
+}
+
+static uint64_t vfstest_cycles(void) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+/* A fresh snapshot of the statsfs file open on fd, as a string */
+static char *vfstest_stats_read(int fd) {
+  static char buf[VFSTEST_STATS_SIZE];
+  int len;
+
+  if (0 > (len = pread(fd, buf, sizeof(buf) - 1, 0)))
+    len = 0;
+  buf[len] = '\0';
+  return buf;
+}
+
+static uint32_t vfstest_misses(void) {
+  char *line;
+  uint32_t misses = 0;
+
+  line = strstr(vfstest_stats_read(vfstest_pframe_fd), "\nmisses ");
+  if (line)
+    sscanf(line + 1, "misses %u", &misses);
+  return misses;
+}
+
+static uint32_t vfstest_diskops(void) {
+  char *line;
+  uint32_t minor, reads, writes, n = 0;
+
+  /* The first line is the column headings */
+  line = strchr(vfstest_stats_read(vfstest_disk_fd), '\n');
+  for (; line && *++line; line = strchr(line, '\n')) {
+    if (3 == sscanf(line, "%u %u %*u %*u %u", &minor, &reads, &writes))
+      n += reads + writes;
+  }
+  return n;
+}
+#endif /* __KERNEL__ */
+
+static void vfstest_time(const vfstest_case_t *vc, int runs,
+                         vfstest_result_t *r) {
+  char dir[32];
+  uint64_t cycles;
+  uint32_t misses, diskops;
+  int i;
+
+  memset(r, 0, sizeof(*r));
+  for (i = 0; i < runs; ++i) {
+    snprintf(dir, sizeof(dir), "%s-%d", vc->vc_name, i);
+    if (!syscall_success(mkdir(dir, 0777)) || !syscall_success(chdir(dir)))
+      break;
+    misses = vfstest_misses();
+    diskops = vfstest_diskops();
+    cycles = vfstest_cycles();
+    vc->vc_func();
+    r->vr_cycles += vfstest_cycles() - cycles;
+    r->vr_misses += vfstest_misses() - misses;
+    r->vr_diskops += vfstest_diskops() - diskops;
+    syscall_success(chdir(".."));
+    test_assert(0 == removeall(dir), "could not remove %s", dir);
+  }
+  if (i < runs)
+    printf("vfstest: %s: only %d of %d runs done\n", vc->vc_name, i, runs);
+  /* A case with no runs done is left with vr_cycles 0, and so out of the
+   * baseline */
+  if (i) {
+    r->vr_cycles /= i;
+    r->vr_misses /= i;
+    r->vr_diskops /= i;
+  }
+}
+
+static int vfstest_save(const char *file, const vfstest_result_t *results) {
+  char line[96];
+  int fd, i, len;
+
+  if (0 > (fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)))
+    return errno;
+  for (i = 0; i < VFSTEST_NCASES; ++i) {
+    if (!results[i].vr_cycles)
+      continue;
+    len = snprintf(line, sizeof(line), "%s %llu %u %u\n",
+                   vfstest_cases[i].vc_name, results[i].vr_cycles,
+                   results[i].vr_misses, results[i].vr_diskops);
+    if (len != write(fd, line, len)) {
+      close(fd);
+      return errno ? errno : EIO;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+/*
+ * Reads the baseline in file into base, in the order of vfstest_cases;
+ * cases it does not have are left with vr_cycles 0. Returns 0 or an
+ * errno.
+ */
+static int vfstest_load(const char *file, vfstest_result_t *base) {
+  char *buf, *line, *end, name[32];
+  vfstest_result_t r;
+  int fd, len, i;
+
+  memset(base, 0, VFSTEST_NCASES * sizeof(*base));
+  if (NULL == (buf = malloc(VFSTEST_MAX_BASELINE)))
+    return ENOMEM;
+  if (0 > (fd = open(file, O_RDONLY, 0))) {
+    free(buf);
+    return errno;
+  }
+  len = read(fd, buf, VFSTEST_MAX_BASELINE - 1);
+  close(fd);
+  if (0 > len) {
+    free(buf);
+    return errno;
+  }
+  buf[len] = '\0';
+  for (line = buf; *line; line = end) {
+    if (NULL != (end = strchr(line, '\n')))
+      *end++ = '\0';
+    else
+      end = line + strlen(line);
+    if (4 != sscanf(line, "%31s %llu %u %u", name, &r.vr_cycles,
+                    &r.vr_misses, &r.vr_diskops))
+      continue;
+    for (i = 0; i < VFSTEST_NCASES; ++i) {
+      if (!strcmp(name, vfstest_cases[i].vc_name))
+        base[i] = r;
+    }
+  }
+  free(buf);
+  return 0;
+}
+
+/* Returns how many cases got worse than base (if there is one) or could
+ * not be timed at all */
+static int vfstest_report(const vfstest_result_t *results,
+                          const vfstest_result_t *base) {
+  const vfstest_result_t *r, *b;
+  int i, nworse = 0, worse;
+
+  printf("%-10s %12s %8s %8s\n", "CASE", "CYCLES", "MISSES", "DISKOPS");
+  for (i = 0; i < VFSTEST_NCASES; ++i) {
+    r = &results[i];
+    b = base ? &base[i] : NULL;
+    if (!r->vr_cycles) {
+      /* No run of it was done, so it has nothing to compare */
+      printf("%-10s %12s\n", vfstest_cases[i].vc_name, "FAILED");
+      nworse++;
+      continue;
+    }
+    if (!b || !b->vr_cycles) {
+      printf("%-10s %12llu %8u %8u%s\n", vfstest_cases[i].vc_name,
+             r->vr_cycles, r->vr_misses, r->vr_diskops,
+             b ? "  (not in baseline)" : "");
+      continue;
+    }
+    worse = r->vr_cycles * 100 > b->vr_cycles * (100 + VFSTEST_SLACK) ||
+            r->vr_misses > b->vr_misses || r->vr_diskops > b->vr_diskops;
+    nworse += worse;
+    printf("%-10s %12llu %8u %8u  was %llu %u %u%s\n",
+           vfstest_cases[i].vc_name, r->vr_cycles, r->vr_misses,
+           r->vr_diskops, b->vr_cycles, b->vr_misses, b->vr_diskops,
+           worse ? "  WORSE" : "");
+  }
+  if (base)
+    printf("%d of %d cases worse than the baseline or failed\n", nworse,
+           VFSTEST_NCASES);
+  return nworse;
+}
+
 /*
  * Finally, the main function.
  */
@@ -944,8 +2183,38 @@ int main(int argc, char **argv)
 int vfstest_main(int argc, char **argv)
 #endif
 {
-  if (argc != 1) {
-    fprintf(stderr, "USAGE: vfstest\n");
+  vfstest_result_t *results = NULL, *base = NULL;
+  const char *save = NULL, *compare = NULL;
+  int i, runs = 0, err, ret = 0;
+
+  for (i = 1; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "-t") && 1 == sscanf(argv[i + 1], "%d", &runs) &&
+        0 < runs)
+      continue;
+    else if (!strcmp(argv[i], "-s"))
+      save = argv[i + 1];
+    else if (!strcmp(argv[i], "-c"))
+      compare = argv[i + 1];
+    else
+      break;
+  }
+  if (i != argc || ((save || compare) && !runs) || (save && compare)) {
+    fprintf(stderr, "USAGE: vfstest [-t <runs> [-s <file> | -c <file>]]\n");
+    return 1;
+  }
+  if (runs &&
+      (NULL == (results = malloc(VFSTEST_NCASES * sizeof(*results))) ||
+       (compare && NULL == (base = malloc(VFSTEST_NCASES * sizeof(*base)))))) {
+    fprintf(stderr, "vfstest: out of memory\n");
+    if (results)
+      free(results);
+    return 1;
+  }
+  if (compare && (err = vfstest_load(compare, base))) {
+    fprintf(stderr, "vfstest: cannot read %s: %s\n", compare,
+            test_errstr(err));
+    free(results);
+    free(base);
     return 1;
   }
 
@@ -954,19 +2223,20 @@ int vfstest_main(int argc, char **argv)
 
   syscall_success(chdir(root_dir));
 
-  vfstest_notdir();
-  vfstest_stat();
-  vfstest_chdir();
-  vfstest_mkdir();
-  vfstest_paths();
-  vfstest_fd();
-  vfstest_open();
-  vfstest_read();
-  vfstest_getdents();
-
-#ifdef __VM__
-  vfstest_s5fs_vm();
-#endif
+  if (runs && (err = vfstest_counters_open())) {
+    fprintf(stderr, "vfstest: cannot read the counters: %s\n",
+            test_errstr(err));
+    ret = 1;
+  }
+  for (i = 0; !ret && i < VFSTEST_NCASES; ++i) {
+    if (runs) {
+      vfstest_time(&vfstest_cases[i], runs, &results[i]);
+      continue;
+    }
+    vfstest_cases[i].vc_func();
+  }
+  if (runs)
+    vfstest_counters_close();
 
   /*vfstest_infinite();*/
 
@@ -975,5 +2245,18 @@ int vfstest_main(int argc, char **argv)
   vfstest_term();
   test_fini();
 
-  return 0;
+  if (runs && !ret) {
+    if (vfstest_report(results, base))
+      ret = 1;
+    if (save && (err = vfstest_save(save, results))) {
+      fprintf(stderr, "vfstest: cannot write %s: %s\n", save,
+              test_errstr(err));
+      ret = 1;
+    }
+  }
+  if (results)
+    free(results);
+  if (base)
+    free(base);
+  return ret;
 }
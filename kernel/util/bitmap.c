@@ -0,0 +1,31 @@
+#include "kernel.h"
+
+#include "util/bitmap.h"
+
+/* The first bit at or after start which is set in map, or in its
+ * complement if flip is all ones */
+static uint32_t bitmap_find(const uint32_t *map, uint32_t nbits,
+                            uint32_t start, uint32_t flip) {
+  uint32_t w = start / 32, nwords = BITMAP_WORDS(nbits), bits;
+
+  if (start >= nbits)
+    return nbits;
+  /* the bits below start in its word don't count */
+  bits = (map[w] ^ flip) & (~0U << (start % 32));
+  while (!bits) {
+    if (++w == nwords)
+      return nbits;
+    bits = map[w] ^ flip;
+  }
+  return MIN(w * 32 + __builtin_ctz(bits), nbits);
+}
+
+uint32_t bitmap_find_next_set(const uint32_t *map, uint32_t nbits,
+                              uint32_t start) {
+  return bitmap_find(map, nbits, start, 0);
+}
+
+uint32_t bitmap_find_next_zero(const uint32_t *map, uint32_t nbits,
+                               uint32_t start) {
+  return bitmap_find(map, nbits, start, ~0U);
+}
@@ -0,0 +1,51 @@
+#include "kernel.h"
+
+#include "main/cpuid.h"
+
+#include "util/crc32c.h"
+#include "util/debug.h"
+#include "util/init.h"
+
+#define CRC32C_POLY 0x82f63b78 /* the Castagnoli polynomial, reversed */
+
+static uint32_t crc32c_table[256];
+static int crc32c_sse42;
+
+static __attribute__((unused)) void crc32c_init(void) {
+  uint32_t a, b, c, d, crc;
+  int i, k;
+
+  for (i = 0; i < 256; ++i) {
+    crc = i;
+    for (k = 0; k < 8; ++k)
+      crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+    crc32c_table[i] = crc;
+  }
+  cpuid_regs(CPUID_GETFEATURES, &a, &b, &c, &d);
+  crc32c_sse42 = !!(c & CPUID_FEAT_ECX_SSE4_2);
+  dbg(DBG_INIT, "crc32c: using %s\n", crc32c_sse42 ? "sse4.2" : "a table");
+}
+init_func(crc32c_init);
+
+/* Four bytes per instruction while the buffer is aligned to them */
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+  for (; len && ((uintptr_t)p & 3); --len)
+    __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(*p++));
+  for (; len >= 4; len -= 4, p += 4)
+    __asm__("crc32l %1, %0" : "+r"(crc) : "rm"(*(const uint32_t *)p));
+  while (len--)
+    __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(*p++));
+  return crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+
+  crc = ~crc;
+  if (crc32c_sse42)
+    crc = crc32c_hw(crc, p, len);
+  else
+    while (len--)
+      crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+  return ~crc;
+}
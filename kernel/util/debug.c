@@ -7,6 +7,8 @@
 
 #include "kernel.h"
 
+#include "mm/page.h"
+
 /* Below is a truly terrible poll-driven serial driver that we use for debugging
  * purposes - it outputs to COM1, but
  * this can be easily changed. It does not use interrupts, and cannot read input
@@ -16,6 +18,37 @@
 /* Corresponding interrupt vector */
 #define PORT_INTR 0x0d
 
+/* Line status: the transmitter's FIFO is empty */
+#define PORT_LSR_THRE 0x20
+/* Bytes the UART takes at once when its FIFO is empty */
+#define PORT_FIFO_SIZE 16
+
+/*
+ * Debug output is not written to the port as it is printed, which at
+ * 38400 baud would stall the caller for a quarter of a millisecond a
+ * byte, but appended to a ring. The ring is drained to the port only as
+ * fast as the port takes it without waiting: a little after each message,
+ * and the rest from the idle loop (see dbg_drain()). A message which does
+ * not fit is dropped, and the next one that does is preceded by a count
+ * of what was lost. Panics and shutdown flush the ring and wait on the
+ * port as before.
+ *
+ * There is one processor, so one ring; a message is copied in, and bytes
+ * taken out, with interrupts masked, which is all the exclusion needed:
+ * no lock is taken, and nothing ever waits for anything else.
+ */
+#define DBG_RING_SIZE (4 * PAGE_SIZE)
+#define DBG_RING_MASK (DBG_RING_SIZE - 1)
+/* Most taken out at once, in case the port is one that is never busy */
+#define DBG_PUSH_MAX 256
+
+static char dbg_ring[DBG_RING_SIZE];
+static uint32_t dbg_ring_head; /* next byte written, not wrapped */
+static uint32_t dbg_ring_tail; /* next byte sent to the port */
+static uint32_t dbg_ring_lost; /* messages dropped since the last one kept */
+
+uint32_t dbg_ndropped; /* messages dropped ever */
+
 uint64_t dbg_modes;
 
 typedef struct dbg_mode {
@@ -48,13 +81,61 @@ const char *dbg_color(uint64_t d_mode) {
   return NULL;
 }
 
+/* Sends what the port will take right now; interrupts must be masked */
+static void dbg_ring_push(void) {
+  uint32_t sent = 0, n;
+
+  while (dbg_ring_tail != dbg_ring_head && sent < DBG_PUSH_MAX &&
+         (inb(PORT + 5) & PORT_LSR_THRE)) {
+    n = MIN(PORT_FIFO_SIZE, dbg_ring_head - dbg_ring_tail);
+    sent += n;
+    while (n--)
+      outb(PORT, dbg_ring[dbg_ring_tail++ & DBG_RING_MASK]);
+  }
+}
+
+static void dbg_ring_put(const char *c, uint32_t len) {
+  uint32_t i;
+  for (i = 0; i < len; i++)
+    dbg_ring[dbg_ring_head++ & DBG_RING_MASK] = c[i];
+}
+
 static void dbg_puts(char *c) {
-  while (*c != '\0') {
+  char lost[48];
+  uint32_t len = strlen(c), nlost = 0, flags;
+
+  flags = intr_save();
+  if (dbg_ring_lost)
+    nlost = snprintf(lost, sizeof(lost), "\n[dbg: %u message(s) dropped]\n",
+                     dbg_ring_lost);
+  if (DBG_RING_SIZE - (dbg_ring_head - dbg_ring_tail) < nlost + len) {
+    dbg_ring_lost++;
+    dbg_ndropped++;
+  } else {
+    dbg_ring_put(lost, nlost);
+    dbg_ring_put(c, len);
+    dbg_ring_lost = 0;
+  }
+  dbg_ring_push();
+  intr_restore(flags);
+}
+
+int dbg_drain(void) {
+  uint32_t flags = intr_save();
+  dbg_ring_push();
+  intr_restore(flags);
+  return dbg_ring_tail != dbg_ring_head;
+}
+
+void dbg_flush(void) {
+  uint32_t flags = intr_save();
+  while (dbg_ring_tail != dbg_ring_head) {
     /* Wait until the port is free */
-    while (!(inb(PORT + 5) & 0x20))
+    while (!(inb(PORT + 5) & PORT_LSR_THRE))
       ;
-    outb(PORT, *c++);
+    dbg_ring_push();
   }
+  intr_restore(flags);
 }
 
 #define BUFFER_SIZE 1024
@@ -108,7 +189,7 @@ void dbg_add_mode(const char *name) {
   if (cancel) {
     dbg_modes &= ~mode->d_mode;
   } else {
-    dbg_modes |= mode->d_mode;
+    dbg_modes |= mode->d_mode & DBG_BUILT_IN;
   }
 }
 
@@ -171,6 +252,7 @@ void dbg_panic(const char *file, int line, const char *func, const char *fmt,
   vsnprintf(buf, PANIC_BUFSIZE, fmt, args);
   dbg_print("%s", buf);
   dbg_print("\nKernel Halting.\n\n");
+  dbg_flush();
 
   va_end(args);
 
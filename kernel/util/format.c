@@ -0,0 +1,369 @@
+/*
+ *  FILE: format.c
+ *  DESC: the printf formatting engine, shared by the kernel and libc (via
+ *        symlink).
+ *
+ * Output goes straight to the caller's sink, a run at a time, instead
+ * of a character at a time through a bounds check: literal text between
+ * conversions is handed over in one piece, and a number is converted
+ * into a small buffer, with its sign and prefix in front of it whenever
+ * no zeros go in between, and handed over in one piece too. Decimal
+ * conversion takes two digits at a time from a table, dividing by 100,
+ * and only falls back to 64 bit division while the value does not fit
+ * in 32 bits; octal and hex only shift.
+ */
+
+#ifdef __KERNEL__
+#include "types.h"
+#include "util/format.h"
+#include "util/string.h"
+#else
+#include "string.h"
+#include "weenix/format.h"
+#endif
+#include "ctype.h"
+#include "stdarg.h"
+
+#define ZEROPAD 1  /* pad with zero */
+#define SIGN 2     /* unsigned/signed long */
+#define PLUS 4     /* show plus */
+#define SPACE 8    /* space if plus */
+#define LEFT 16    /* left justified */
+#define SPECIAL 32 /* 0x */
+#define LARGE 64   /* use 'ABCDEF' instead of 'abcdef' */
+
+#define PAD_CHUNK 16
+
+typedef struct format_out {
+  format_sink_t fo_sink;
+  void *fo_arg;
+  int fo_count;   /* everything formatted so far, for %n and the result */
+  int fo_stopped; /* the sink asked for no more */
+} format_out_t;
+
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void emit(format_out_t *o, const char *s, size_t len) {
+  if (0 == len)
+    return;
+  o->fo_count += len;
+  if (!o->fo_stopped && o->fo_sink(o->fo_arg, s, len))
+    o->fo_stopped = 1;
+}
+
+static void emit_pad(format_out_t *o, char c, int n) {
+  static const char spaces[PAD_CHUNK] = "                ";
+  static const char zeros[PAD_CHUNK] = "0000000000000000";
+  const char *s = ('0' == c) ? zeros : spaces;
+
+  while (n > 0) {
+    emit(o, s, n < PAD_CHUNK ? n : PAD_CHUNK);
+    n -= PAD_CHUNK;
+  }
+}
+
+/* Puts num's digits just before end, returns where they start */
+static char *convert(char *end, unsigned long long num, int base,
+                     const char *digits) {
+  char *p = end;
+  uint32_t n, r;
+
+  if (10 != base) {
+    int shift = (16 == base) ? 4 : 3;
+    do {
+      *--p = digits[num & (base - 1)];
+      num >>= shift;
+    } while (num);
+    return p;
+  }
+
+  while (num > 0xffffffffULL) {
+    unsigned long long q = num / 100;
+    r = (uint32_t)(num - q * 100);
+    p -= 2;
+    p[0] = digit_pairs[2 * r];
+    p[1] = digit_pairs[2 * r + 1];
+    num = q;
+  }
+  n = (uint32_t)num;
+  while (n >= 100) {
+    r = n % 100;
+    n /= 100;
+    p -= 2;
+    p[0] = digit_pairs[2 * r];
+    p[1] = digit_pairs[2 * r + 1];
+  }
+  if (n >= 10) {
+    p -= 2;
+    p[0] = digit_pairs[2 * n];
+    p[1] = digit_pairs[2 * n + 1];
+  } else {
+    *--p = '0' + n;
+  }
+  return p;
+}
+
+static void number(format_out_t *o, unsigned long long num, int base,
+                   int size, int precision, int type) {
+  /* 22 octal digits, a prefix and a sign at most */
+  char tmp[32], *end = tmp + sizeof(tmp), *s;
+  const char *digits = (type & LARGE) ? "0123456789ABCDEF" : "0123456789abcdef";
+  char sign = 0, prefix[2];
+  int nprefix = 0, len, zeros;
+
+  if (type & LEFT)
+    type &= ~ZEROPAD;
+  if (type & SIGN) {
+    if ((long long)num < 0) {
+      sign = '-';
+      num = -num;
+    } else if (type & PLUS) {
+      sign = '+';
+    } else if (type & SPACE) {
+      sign = ' ';
+    }
+  }
+  if (sign)
+    size--;
+  if (type & SPECIAL) {
+    if (16 == base) {
+      prefix[nprefix++] = '0';
+      prefix[nprefix++] = (type & LARGE) ? 'X' : 'x';
+    } else if (8 == base) {
+      prefix[nprefix++] = '0';
+    }
+    size -= nprefix;
+  }
+
+  s = convert(end, num, base, digits);
+  len = end - s;
+  if (len > precision)
+    precision = len;
+  size -= precision;
+  zeros = precision - len;
+  if ((type & ZEROPAD) && size > 0) {
+    zeros += size;
+    size = 0;
+  }
+
+  if (!(type & LEFT)) {
+    emit_pad(o, ' ', size);
+    size = 0;
+  }
+  if (0 == zeros) {
+    s -= nprefix;
+    memcpy(s, prefix, nprefix);
+    if (sign)
+      *--s = sign;
+    emit(o, s, end - s);
+  } else {
+    emit(o, &sign, sign ? 1 : 0);
+    emit(o, prefix, nprefix);
+    emit_pad(o, '0', zeros);
+    emit(o, s, len);
+  }
+  emit_pad(o, ' ', size);
+}
+
+static int format_atoi(const char **s) {
+  int i = 0;
+
+  while (isdigit(**s))
+    i = i * 10 + *((*s)++) - '0';
+  return i;
+}
+
+int vformat(format_sink_t sink, void *arg, const char *fmt, va_list args) {
+  format_out_t out = {sink, arg, 0, 0};
+  unsigned long long num;
+  int len, base;
+  const char *p, *s;
+  char c;
+
+  int flags; /* flags to number() */
+
+  int field_width; /* width of output field */
+  int precision;   /* min. # of digits for integers; max
+                  number of chars for from string */
+  int qualifier;   /* 'h', 'l', or 'L' for integer fields */
+
+  for (;; ++fmt) {
+    for (p = fmt; *p && '%' != *p; ++p)
+      ;
+    emit(&out, fmt, p - fmt);
+    if (!*p)
+      break;
+    fmt = p;
+
+    /* process flags */
+    flags = 0;
+  repeat:
+    ++fmt; /* this also skips first '%' */
+    switch (*fmt) {
+    case '-':
+      flags |= LEFT;
+      goto repeat;
+    case '+':
+      flags |= PLUS;
+      goto repeat;
+    case ' ':
+      flags |= SPACE;
+      goto repeat;
+    case '#':
+      flags |= SPECIAL;
+      goto repeat;
+    case '0':
+      flags |= ZEROPAD;
+      goto repeat;
+    }
+
+    /* get field width */
+    field_width = -1;
+    if (isdigit(*fmt))
+      field_width = format_atoi(&fmt);
+    else if (*fmt == '*') {
+      ++fmt;
+      /* it's the next argument */
+      field_width = va_arg(args, int);
+      if (field_width < 0) {
+        field_width = -field_width;
+        flags |= LEFT;
+      }
+    }
+
+    /* get the precision */
+    precision = -1;
+    if (*fmt == '.') {
+      ++fmt;
+      if (isdigit(*fmt))
+        precision = format_atoi(&fmt);
+      else if (*fmt == '*') {
+        ++fmt;
+        /* it's the next argument */
+        precision = va_arg(args, int);
+      }
+      if (precision < 0)
+        precision = 0;
+    }
+
+    /* get the conversion qualifier */
+    qualifier = -1;
+    if (*fmt == 'h' || *fmt == 'l' || *fmt == 'L' || *fmt == 'Z') {
+      qualifier = *fmt;
+      ++fmt;
+      if (qualifier == 'l' && *fmt == 'l') {
+        qualifier = 'L';
+        ++fmt;
+      }
+    }
+    if (*fmt == 'q') {
+      qualifier = 'L';
+      ++fmt;
+    }
+
+    /* default base */
+    base = 10;
+
+    switch (*fmt) {
+    case 'c':
+      c = (unsigned char)va_arg(args, int);
+      if (!(flags & LEFT))
+        emit_pad(&out, ' ', field_width - 1);
+      emit(&out, &c, 1);
+      if (flags & LEFT)
+        emit_pad(&out, ' ', field_width - 1);
+      continue;
+
+    case 's':
+      s = va_arg(args, char *);
+      if (!s)
+        s = "<NULL>";
+
+      len = strnlen(s, precision);
+      if (!(flags & LEFT))
+        emit_pad(&out, ' ', field_width - len);
+      emit(&out, s, len);
+      if (flags & LEFT)
+        emit_pad(&out, ' ', field_width - len);
+      continue;
+
+    case 'p':
+      if (field_width == -1) {
+        field_width = 2 * sizeof(void *);
+        flags |= ZEROPAD;
+      }
+      number(&out, (unsigned long)va_arg(args, void *), 16, field_width,
+             precision, flags);
+      continue;
+
+    case 'n':
+      if (qualifier == 'l') {
+        long *ip = va_arg(args, long *);
+        *ip = out.fo_count;
+      } else if (qualifier == 'Z') {
+        size_t *ip = va_arg(args, size_t *);
+        *ip = out.fo_count;
+      } else {
+        int *ip = va_arg(args, int *);
+        *ip = out.fo_count;
+      }
+      continue;
+
+    case '%':
+      emit(&out, fmt, 1);
+      continue;
+
+    /* integer number formats - set up the flags and "break" */
+    case 'o':
+      base = 8;
+      break;
+
+    case 'X':
+      flags |= LARGE;
+    /* fall through */
+    case 'x':
+      base = 16;
+      break;
+
+    case 'd':
+    case 'i':
+      flags |= SIGN;
+    /* fall through */
+    case 'u':
+      break;
+
+    default:
+      emit(&out, p, 1);
+      if (*fmt)
+        emit(&out, fmt, 1);
+      else
+        --fmt;
+      continue;
+    }
+    if (qualifier == 'L')
+      num = va_arg(args, long long);
+    else if (qualifier == 'l') {
+      num = va_arg(args, unsigned long);
+      if (flags & SIGN)
+        num = (signed long)num;
+    } else if (qualifier == 'Z') {
+      num = va_arg(args, size_t);
+    } else if (qualifier == 'h') {
+      num = (unsigned short)va_arg(args, int);
+      if (flags & SIGN)
+        num = (signed short)num;
+    } else {
+      num = va_arg(args, unsigned int);
+      if (flags & SIGN)
+        num = (signed int)num;
+    }
+
+    number(&out, num, base, field_width, precision, flags);
+  }
+  return out.fo_stopped ? -1 : out.fo_count;
+}
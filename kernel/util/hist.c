@@ -0,0 +1,72 @@
+#include "kernel.h"
+
+#include "util/debug.h"
+#include "util/hist.h"
+#include "util/printf.h"
+#include "util/time.h"
+
+#define HIST_SUB (1U << HIST_SUB_BITS)
+
+/* Values below HIST_SUB get a bucket each; above, the top HIST_SUB_BITS + 1
+ * bits pick the bucket */
+static int hist_bucket(uint32_t v) {
+  int e;
+
+  if (v < HIST_SUB)
+    return (int)v;
+  e = 31 - __builtin_clz(v);
+  return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+         (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The largest value counted in bucket b */
+static uint32_t hist_bucket_max(int b) {
+  int e;
+  uint64_t low;
+
+  if (b < (int)HIST_SUB)
+    return (uint32_t)b;
+  e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  low = (uint64_t)(HIST_SUB | (b & (HIST_SUB - 1))) << (e - HIST_SUB_BITS);
+  return (uint32_t)(low + (1ULL << (e - HIST_SUB_BITS)) - 1);
+}
+
+void hist_add(hist_t *h, uint32_t usecs) {
+  h->h_buckets[hist_bucket(usecs)]++;
+  h->h_count++;
+  if (usecs > h->h_max)
+    h->h_max = usecs;
+}
+
+void hist_add_since(hist_t *h, uint64_t start) {
+  uint64_t usecs = time_cycles_to_usecs(time_cycles() - start);
+  hist_add(h, usecs > 0xffffffffULL ? 0xffffffff : (uint32_t)usecs);
+}
+
+uint32_t hist_percentile(const hist_t *h, uint32_t per10k) {
+  uint64_t want = ((uint64_t)h->h_count * per10k + 9999) / 10000;
+  uint64_t seen = 0;
+  int b;
+
+  KASSERT(per10k <= 10000);
+  if (0 == h->h_count)
+    return 0;
+  for (b = 0; b < HIST_NBUCKETS; b++) {
+    seen += h->h_buckets[b];
+    if (seen >= want && seen)
+      return MIN(hist_bucket_max(b), h->h_max);
+  }
+  return h->h_max;
+}
+
+void hist_iprintf_header(char **buf, size_t *size) {
+  iprintf(buf, size, "%-16s %10s %8s %8s %8s %8s %8s\n", "NAME", "COUNT",
+          "P50", "P90", "P99", "P99.9", "MAX");
+}
+
+void hist_iprintf(char **buf, size_t *size, const char *name,
+                  const hist_t *h) {
+  iprintf(buf, size, "%-16s %10u %8u %8u %8u %8u %8u\n", name, h->h_count,
+          hist_percentile(h, 5000), hist_percentile(h, 9000),
+          hist_percentile(h, 9900), hist_percentile(h, 9990), h->h_max);
+}
@@ -0,0 +1,115 @@
+#include "kernel.h"
+#include "errno.h"
+
+#include "mm/vmalloc.h"
+
+#include "util/debug.h"
+#include "util/htable.h"
+
+/* Fibonacci hashing: a bucket is picked by the top bits of the hash times
+ * 2^32 / phi, so each old bucket i splits into new buckets 2i and 2i + 1 */
+#define HTABLE_MULT 0x9e3779b1U
+
+static inline uint32_t htable_index(uint32_t hash, uint32_t order) {
+  return (hash * HTABLE_MULT) >> (32 - order);
+}
+
+static list_t *htable_alloc(uint32_t order) {
+  list_t *buckets;
+  uint32_t i;
+
+  if (NULL == (buckets = vmalloc(sizeof(list_t) << order)))
+    return NULL;
+  for (i = 0; i < (1U << order); ++i)
+    list_init(&buckets[i]);
+  return buckets;
+}
+
+int htable_init(htable_t *ht, uint32_t order, uint32_t max_load,
+                htable_hash_t hash) {
+  KASSERT(order >= 1 && order < 32);
+  if (NULL == (ht->ht_buckets = htable_alloc(order)))
+    return -ENOMEM;
+  ht->ht_order = order;
+  ht->ht_old = NULL;
+  ht->ht_oldorder = 0;
+  ht->ht_moved = 0;
+  ht->ht_count = 0;
+  ht->ht_max_load = max_load;
+  ht->ht_grow_at = max_load << order;
+  ht->ht_hash = hash;
+  return 0;
+}
+
+list_t *htable_bucket(htable_t *ht, uint32_t hash) {
+  uint32_t i;
+
+  if (ht->ht_old && (i = htable_index(hash, ht->ht_oldorder)) >= ht->ht_moved)
+    return &ht->ht_old[i];
+  return &ht->ht_buckets[htable_index(hash, ht->ht_order)];
+}
+
+uint32_t htable_nbuckets(htable_t *ht) {
+  return (1U << ht->ht_order) + (ht->ht_old ? 1U << ht->ht_oldorder : 0);
+}
+
+/* Moves the next few old buckets' entries to their new ones */
+static void htable_rehash_step(htable_t *ht) {
+  uint32_t n, nold = 1U << ht->ht_oldorder;
+  list_link_t *link;
+  list_t *old;
+
+  for (n = 0; n < HTABLE_REHASH_STEP && ht->ht_moved < nold; ++n) {
+    old = &ht->ht_old[ht->ht_moved];
+    while (!list_empty(old)) {
+      link = old->l_next;
+      list_remove(link);
+      list_insert_head(
+          &ht->ht_buckets[htable_index(ht->ht_hash(link), ht->ht_order)],
+          link);
+    }
+    ht->ht_moved++;
+  }
+  if (ht->ht_moved == nold) {
+    vfree(ht->ht_old);
+    ht->ht_old = NULL;
+  }
+}
+
+/*
+ * Starts moving to twice as many buckets. If vmalloc can't provide them
+ * we keep the buckets we have and don't try again until the number of
+ * entries doubles.
+ */
+static void htable_grow(htable_t *ht) {
+  list_t *buckets;
+
+  if (NULL == (buckets = htable_alloc(ht->ht_order + 1))) {
+    dbg(DBG_MM, "WARNING: could not grow hash table past %u buckets\n",
+        1U << ht->ht_order);
+    ht->ht_grow_at <<= 1;
+    return;
+  }
+  ht->ht_old = ht->ht_buckets;
+  ht->ht_oldorder = ht->ht_order;
+  ht->ht_moved = 0;
+  ht->ht_buckets = buckets;
+  ht->ht_order++;
+  ht->ht_grow_at = ht->ht_max_load << ht->ht_order;
+}
+
+void htable_insert(htable_t *ht, list_link_t *link, uint32_t hash) {
+  list_insert_head(htable_bucket(ht, hash), link);
+  ht->ht_count++;
+  if (ht->ht_old)
+    htable_rehash_step(ht);
+  else if (ht->ht_count > ht->ht_grow_at)
+    htable_grow(ht);
+}
+
+void htable_remove(htable_t *ht, list_link_t *link) {
+  list_remove(link);
+  ht->ht_count--;
+  if (ht->ht_old)
+    htable_rehash_step(ht);
+}
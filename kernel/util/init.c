@@ -1,135 +1,72 @@
 #include "kernel.h"
 
-#include "mm/kmalloc.h"
-
-#include "util/list.h"
-#include "util/string.h"
 #include "util/debug.h"
 #include "util/init.h"
-
-static int _init_search_count = 0;
-
-struct init_function {
-  init_func_t if_func;
-  const char *if_name;
-  list_link_t if_link;
-
-  int if_search;
-  int if_called;
-  list_t if_deps;
-};
-
-struct init_depends {
-  const char *id_name;
-  list_link_t id_link;
+#include "util/printf.h"
+#include "util/time.h"
+
+/*
+ * The order to call the functions in is worked out when the kernel is
+ * built (see init.h), so booting takes a single pass over a table, with
+ * no allocation and no looking up of names. init_order holds the indices
+ * of the init_func entries of the .init section in calling order, and
+ * init_cycles how long each call took, for init_info.
+ */
+struct init_entry {
+  init_func_t ie_func; /* NULL for init_depends */
+  char ie_isdep;
+  char ie_name[INIT_ENTRY_SIZE - sizeof(init_func_t) - 1];
 };
 
-static void _init_call(list_t *funcs, struct init_function *func) {
-  struct init_depends *dep;
-  list_iterate_begin(&func->if_deps, dep, struct init_depends, id_link) {
-    int found = 0;
-    struct init_function *f;
-    list_iterate_begin(funcs, f, struct init_function, if_link) {
-      if (0 == strcmp(dep->id_name, f->if_name)) {
-        found = 1;
-        goto done;
-      }
-    }
-    list_iterate_end();
-  done:
+/* generated into init_order.c by tools/initsort.py */
+extern const int init_nentries;
+extern const int init_ncalls;
+extern const uint16_t init_order[];
+extern uint64_t init_cycles[];
 
-    if (!found) {
-      panic("'%s' dependency for '%s' does not exist", dep->id_name,
-            func->if_name);
-    }
+static uint64_t init_total; /* time_cycles() all of them took */
 
-    if (func->if_search == f->if_search) {
-      panic("circular dependency between '%s' and '%s'", func->if_name,
-            f->if_name);
-    }
-
-    dbg(DBG_INIT, "'%s' depends on '%s': ", func->if_name, f->if_name);
-    if (!f->if_called) {
-      dbgq(DBG_INIT, "calling\n");
-      f->if_search = func->if_search;
-      _init_call(funcs, f);
-    } else {
-      dbgq(DBG_INIT, "already called\n");
-    }
-  }
-  list_iterate_end();
-
-  KASSERT(!func->if_called);
-
-  dbg(DBG_INIT, "Calling %s (0x%p)\n", func->if_name, func->if_func);
-  func->if_func();
-  func->if_called = 1;
-}
+#define init_entry(i) (&((struct init_entry *)&kernel_start_init)[i])
 
 void init_call_all() {
-  list_t funcs;
-  char *buf, *end;
-
-  list_init(&funcs);
-  buf = (char *)&kernel_start_init;
-  end = (char *)&kernel_end_init;
-
-  while (buf < end) {
-    struct init_function *curr = kmalloc(sizeof(*curr));
-    KASSERT(NULL != curr);
-
-    list_insert_tail(&funcs, &curr->if_link);
-    list_init(&curr->if_deps);
-
-    KASSERT(NULL != *(uintptr_t *)buf);
-    curr->if_func = (init_func_t) * (uintptr_t *)buf;
-    curr->if_name = buf + sizeof(curr->if_func);
-    curr->if_search = 0;
-    curr->if_called = 0;
-
-    buf += sizeof(curr->if_func) + strlen(curr->if_name) + 1;
-
-    while ((NULL == *(uintptr_t *)buf) && (buf < end)) {
-      struct init_depends *dep = kmalloc(sizeof(*dep));
-      KASSERT(NULL != dep);
-
-      list_insert_tail(&curr->if_deps, &dep->id_link);
-
-      dep->id_name = buf + sizeof(curr->if_func);
-      buf += sizeof(curr->if_func) + strlen(dep->id_name) + 1;
-    }
+  struct init_entry *e;
+  uint64_t start = time_cycles(), t;
+  int i;
+
+  KASSERT(sizeof(struct init_entry) == INIT_ENTRY_SIZE);
+  KASSERT((char *)&kernel_end_init - (char *)&kernel_start_init ==
+              init_nentries * INIT_ENTRY_SIZE &&
+          "init_order.c does not match the .init section");
+
+  for (i = 0; i < init_ncalls; ++i) {
+    e = init_entry(init_order[i]);
+    KASSERT(!e->ie_isdep && NULL != e->ie_func);
+    dbg(DBG_INIT, "Calling %s (0x%p)\n", e->ie_name, e->ie_func);
+    t = time_cycles();
+    e->ie_func();
+    init_cycles[i] = time_cycles() - t;
   }
+  init_total = time_cycles() - start;
 
-  KASSERT(buf == end);
-
-  struct init_function *func;
-  dbg(DBG_INIT, "Initialization functions and dependencies:\n");
-  list_iterate_begin(&funcs, func, struct init_function, if_link) {
-    dbgq(DBG_INIT, "%s (0x%p): ", func->if_name, func->if_func);
-    struct init_depends *dep;
-    list_iterate_begin(&func->if_deps, dep, struct init_depends, id_link) {
-      dbgq(DBG_INIT, "%s ", dep->id_name);
-    }
-    list_iterate_end();
-    dbgq(DBG_INIT, "\n");
+  for (i = 0; i < init_ncalls; ++i) {
+    dbg(DBG_INIT, "%s took %llu us\n", init_entry(init_order[i])->ie_name,
+        time_cycles_to_usecs(init_cycles[i]));
   }
-  list_iterate_end();
+  dbg(DBG_PRINT, "%d initialization functions took %llu us\n", init_ncalls,
+      time_cycles_to_usecs(init_total));
+}
 
-  list_iterate_begin(&funcs, func, struct init_function, if_link) {
-    if (!func->if_called) {
-      func->if_search = ++_init_search_count;
-      _init_call(&funcs, func);
-    }
-  }
-  list_iterate_end();
+size_t init_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  int i;
 
-  list_iterate_begin(&funcs, func, struct init_function, if_link) {
-    struct init_depends *dep;
-    list_iterate_begin(&func->if_deps, dep, struct init_depends, id_link) {
-      kfree(dep);
-    }
-    list_iterate_end();
-    kfree(func);
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "%-24s %10s\n", "FUNCTION", "USECS");
+  for (i = 0; i < init_ncalls; ++i) {
+    iprintf(&buf, &size, "%-24s %10llu\n", init_entry(init_order[i])->ie_name,
+            time_cycles_to_usecs(init_cycles[i]));
   }
-  list_iterate_end();
+  iprintf(&buf, &size, "%-24s %10llu\n", "total",
+          time_cycles_to_usecs(init_total));
+  return size;
 }
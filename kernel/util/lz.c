@@ -0,0 +1,134 @@
+#include "kernel.h"
+
+#include "util/debug.h"
+#include "util/lz.h"
+#include "util/string.h"
+
+#define LZ_HASH_ORDER 12
+#define LZ_HASH_MULT 0x9e3779b1U
+#define LZ_LEN_MASK 0xf
+
+/* Where in the input each hash of four bytes was last seen */
+static uint16_t lz_table[1 << LZ_HASH_ORDER];
+
+static uint32_t lz_read32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t lz_hash(const uint8_t *p) {
+  return lz_read32(p) * LZ_HASH_MULT >> (32 - LZ_HASH_ORDER);
+}
+
+/* Writes the part of a length past what its token holds */
+static uint8_t *lz_put_len(uint8_t *op, size_t len) {
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+/*
+ * Writes a sequence of nlit literals from lit followed by a match of mlen
+ * bytes off back, or by nothing if mlen is 0. Returns where it ended, or
+ * NULL if it would pass oend.
+ */
+static uint8_t *lz_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                           size_t nlit, size_t off, size_t mlen) {
+  uint8_t *token = op++;
+
+  if ((size_t)(oend - token) < 1 + nlit + nlit / 255 + 1 + 2 + mlen / 255 + 1)
+    return NULL;
+  *token = MIN(nlit, LZ_LEN_MASK) << 4;
+  if (nlit >= LZ_LEN_MASK)
+    op = lz_put_len(op, nlit - LZ_LEN_MASK);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (!mlen)
+    return op;
+  mlen -= LZ_MIN_MATCH;
+  *token |= MIN(mlen, LZ_LEN_MASK);
+  *op++ = off & 0xff;
+  *op++ = off >> 8;
+  if (mlen >= LZ_LEN_MASK)
+    op = lz_put_len(op, mlen - LZ_LEN_MASK);
+  return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+  const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len, *ref;
+  uint8_t *op = dst, *oend = op + cap;
+  size_t mlen;
+  uint32_t h;
+
+  KASSERT(len <= LZ_MAX_INPUT);
+  memset(lz_table, 0, sizeof(lz_table));
+  while (ip + LZ_MIN_MATCH <= end) {
+    h = lz_hash(ip);
+    ref = in + lz_table[h];
+    lz_table[h] = (uint16_t)(ip - in);
+    if (ref >= ip || lz_read32(ref) != lz_read32(ip)) {
+      ip++;
+      continue;
+    }
+    for (mlen = LZ_MIN_MATCH; ip + mlen < end && ref[mlen] == ip[mlen];)
+      mlen++;
+    if (NULL == (op = lz_put_seq(op, oend, anchor, ip - anchor, ip - ref,
+                                 mlen)))
+      return 0;
+    ip += mlen;
+    anchor = ip;
+  }
+  if (NULL == (op = lz_put_seq(op, oend, anchor, end - anchor, 0, 0)))
+    return 0;
+  return op - (uint8_t *)dst;
+}
+
+/* Reads the part of a length past what its token held; -1 past iend */
+static int lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+  uint8_t b;
+
+  do {
+    if (*ip >= iend)
+      return -1;
+    b = *(*ip)++;
+    *len += b;
+  } while (255 == b);
+  return 0;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+  const uint8_t *ip = src, *iend = ip + len, *ref;
+  uint8_t *op = dst, *oend = op + cap;
+  size_t n, off;
+  uint8_t token;
+
+  while (ip < iend) {
+    token = *ip++;
+    n = token >> 4;
+    if (LZ_LEN_MASK == n && 0 > lz_get_len(&ip, iend, &n))
+      return -1;
+    if (n > (size_t)(iend - ip) || n > (size_t)(oend - op))
+      return -1;
+    memcpy(op, ip, n);
+    op += n;
+    ip += n;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    n = token & LZ_LEN_MASK;
+    if (LZ_LEN_MASK == n && 0 > lz_get_len(&ip, iend, &n))
+      return -1;
+    n += LZ_MIN_MATCH;
+    if (0 == off || off > (size_t)(op - (uint8_t *)dst) ||
+        n > (size_t)(oend - op))
+      return -1;
+    /* the match may overlap what it produces, so a byte at a time */
+    for (ref = op - off; n; --n)
+      *op++ = *ref++;
+  }
+  return op - (uint8_t *)dst;
+}
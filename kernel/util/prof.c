@@ -0,0 +1,95 @@
+#include "config.h"
+#include "globals.h"
+#include "types.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+
+#include "util/prof.h"
+#include "util/string.h"
+
+#define PROF_HASH_MULT 0x9e3779b1U
+
+int prof_enabled = 0;
+prof_bucket_t prof_buckets[PROF_NBUCKETS];
+uint32_t prof_nsamples = 0;
+uint32_t prof_ndropped = 0;
+
+/* Fills pc[] from the frame pointer chain, which must stay on the
+ * thread's kernel stack and go up it, returning how many there are */
+static int prof_backtrace(uint32_t eip, uint32_t ebp, uint32_t *pc) {
+  uint32_t lo, hi;
+  int depth = 0;
+
+  pc[depth++] = eip;
+  if (NULL == curthr)
+    return depth;
+  lo = (uint32_t)curthr->kt_kstack;
+  hi = lo + DEFAULT_STACK_SIZE - 2 * sizeof(uint32_t);
+  while (depth < PROF_DEPTH && ebp >= lo && ebp <= hi && !(ebp & 3)) {
+    uint32_t *frame = (uint32_t *)ebp;
+    if (0 == frame[1])
+      break;
+    pc[depth++] = frame[1];
+    if (frame[0] <= ebp)
+      break;
+    ebp = frame[0];
+  }
+  return depth;
+}
+
+static uint32_t prof_hash(uint32_t thr, const uint32_t *pc, int depth) {
+  uint32_t h = thr;
+  int i;
+  for (i = 0; i < depth; i++)
+    h = (h ^ pc[i]) * PROF_HASH_MULT;
+  return h;
+}
+
+/*
+ * The table is open addressed and never shrinks; once it is full, a stack
+ * not already in it is counted in prof_ndropped instead. Interrupts are
+ * off in the clock handler, so nothing else touches it meanwhile.
+ */
+void prof_sample(regs_t *regs) {
+  uint32_t pc[PROF_DEPTH], thr = (uint32_t)curthr, h, i;
+  int user = (regs->r_cs & 0x3) == 0x3;
+  int depth;
+  prof_bucket_t *pb;
+
+  if (user) {
+    pc[0] = regs->r_eip;
+    depth = 1;
+  } else {
+    depth = prof_backtrace(regs->r_eip, regs->r_ebp, pc);
+  }
+
+  prof_nsamples++;
+  h = prof_hash(thr, pc, depth);
+  for (i = 0; i < PROF_NBUCKETS; i++) {
+    pb = &prof_buckets[(h + i) & (PROF_NBUCKETS - 1)];
+    if (0 == pb->pb_count) {
+      pb->pb_thr = thr;
+      pb->pb_pid = (NULL != curproc) ? curproc->p_pid : -1;
+      pb->pb_depth = depth;
+      pb->pb_user = user;
+      memcpy(pb->pb_pc, pc, depth * sizeof(pc[0]));
+      pb->pb_count = 1;
+      return;
+    }
+    if (pb->pb_thr == thr && pb->pb_depth == depth && pb->pb_user == user &&
+        0 == memcmp(pb->pb_pc, pc, depth * sizeof(pc[0]))) {
+      pb->pb_count++;
+      return;
+    }
+  }
+  prof_ndropped++;
+}
+
+void prof_clear(void) {
+  uint32_t flags = intr_save();
+  memset(prof_buckets, 0, sizeof(prof_buckets));
+  prof_nsamples = 0;
+  prof_ndropped = 0;
+  intr_restore(flags);
+}
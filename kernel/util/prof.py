@@ -0,0 +1,28 @@
+import gdb
+
+import weenix
+import weenix.prof
+
+class ProfCommand(weenix.Command):
+	"""usage: prof <file>
+	Writes the sampling profiler's stacks to <file> folded, one
+	"frame;frame;... count" a line, for flamegraph.pl. Turn the
+	profiler on with kshell's "prof on" command, or by setting
+	prof_enabled."""
+
+	def __init__(self):
+		weenix.Command.__init__(self, "prof", gdb.COMMAND_DATA, gdb.COMPLETE_FILENAME)
+
+	def invoke(self, arg, tty):
+		args = gdb.string_to_argv(arg)
+		if (len(args) != 1):
+			gdb.write("{0}\n".format(self.__doc__))
+			raise gdb.GdbError("invalid arguments")
+		f = open(args[0], "w")
+		f.write(weenix.prof.folded())
+		f.close()
+		gdb.write("wrote {0} samples ({1} dropped) to {2}\n".format(
+			int(gdb.parse_and_eval("prof_nsamples")),
+			int(gdb.parse_and_eval("prof_ndropped")), args[0]))
+
+ProfCommand()
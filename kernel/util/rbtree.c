@@ -0,0 +1,245 @@
+#include "kernel.h"
+
+#include "util/debug.h"
+#include "util/rbtree.h"
+
+void rb_init(rb_tree_t *tree, rb_augment_t augment) {
+  tree->rbt_root = NULL;
+  tree->rbt_augment = augment;
+}
+
+static inline void rb_update(rb_tree_t *tree, rb_node_t *node) {
+  if (tree->rbt_augment)
+    tree->rbt_augment(node);
+}
+
+void rb_propagate(rb_tree_t *tree, rb_node_t *node) {
+  if (!tree->rbt_augment)
+    return;
+  for (; node; node = node->rb_parent)
+    tree->rbt_augment(node);
+}
+
+/* Puts child in old's place under old's parent */
+static void rb_replace(rb_tree_t *tree, rb_node_t *old, rb_node_t *child) {
+  rb_node_t *parent = old->rb_parent;
+  if (!parent)
+    tree->rbt_root = child;
+  else if (parent->rb_left == old)
+    parent->rb_left = child;
+  else
+    parent->rb_right = child;
+  if (child)
+    child->rb_parent = parent;
+}
+
+static void rb_rotate_left(rb_tree_t *tree, rb_node_t *x) {
+  rb_node_t *y = x->rb_right;
+  x->rb_right = y->rb_left;
+  if (y->rb_left)
+    y->rb_left->rb_parent = x;
+  rb_replace(tree, x, y);
+  y->rb_left = x;
+  x->rb_parent = y;
+  rb_update(tree, x);
+  rb_update(tree, y);
+}
+
+static void rb_rotate_right(rb_tree_t *tree, rb_node_t *x) {
+  rb_node_t *y = x->rb_left;
+  x->rb_left = y->rb_right;
+  if (y->rb_right)
+    y->rb_right->rb_parent = x;
+  rb_replace(tree, x, y);
+  y->rb_right = x;
+  x->rb_parent = y;
+  rb_update(tree, x);
+  rb_update(tree, y);
+}
+
+#define rb_is_red(node) ((node) && (node)->rb_red)
+
+void rb_link(rb_node_t *node, rb_node_t *parent, rb_node_t **link) {
+  node->rb_parent = parent;
+  node->rb_left = node->rb_right = NULL;
+  node->rb_red = 1;
+  *link = node;
+}
+
+void rb_insert_fixup(rb_tree_t *tree, rb_node_t *node) {
+  rb_node_t *parent, *gparent, *uncle;
+
+  rb_propagate(tree, node);
+  while (rb_is_red(parent = node->rb_parent)) {
+    gparent = parent->rb_parent;
+    if (parent == gparent->rb_left) {
+      uncle = gparent->rb_right;
+      if (rb_is_red(uncle)) {
+        parent->rb_red = uncle->rb_red = 0;
+        gparent->rb_red = 1;
+        node = gparent;
+        continue;
+      }
+      if (node == parent->rb_right) {
+        rb_rotate_left(tree, parent);
+        node = parent;
+        parent = node->rb_parent;
+      }
+      parent->rb_red = 0;
+      gparent->rb_red = 1;
+      rb_rotate_right(tree, gparent);
+    } else {
+      uncle = gparent->rb_left;
+      if (rb_is_red(uncle)) {
+        parent->rb_red = uncle->rb_red = 0;
+        gparent->rb_red = 1;
+        node = gparent;
+        continue;
+      }
+      if (node == parent->rb_left) {
+        rb_rotate_right(tree, parent);
+        node = parent;
+        parent = node->rb_parent;
+      }
+      parent->rb_red = 0;
+      gparent->rb_red = 1;
+      rb_rotate_left(tree, gparent);
+    }
+  }
+  tree->rbt_root->rb_red = 0;
+}
+
+/* Restores the red-black properties after a black node was taken out
+ * from above node (which may be NULL), a child of parent */
+static void rb_remove_fixup(rb_tree_t *tree, rb_node_t *node,
+                            rb_node_t *parent) {
+  rb_node_t *sib;
+
+  while (node != tree->rbt_root && !rb_is_red(node)) {
+    if (node == parent->rb_left) {
+      sib = parent->rb_right;
+      if (rb_is_red(sib)) {
+        sib->rb_red = 0;
+        parent->rb_red = 1;
+        rb_rotate_left(tree, parent);
+        sib = parent->rb_right;
+      }
+      if (!rb_is_red(sib->rb_left) && !rb_is_red(sib->rb_right)) {
+        sib->rb_red = 1;
+        node = parent;
+        parent = node->rb_parent;
+        continue;
+      }
+      if (!rb_is_red(sib->rb_right)) {
+        sib->rb_left->rb_red = 0;
+        sib->rb_red = 1;
+        rb_rotate_right(tree, sib);
+        sib = parent->rb_right;
+      }
+      sib->rb_red = parent->rb_red;
+      parent->rb_red = 0;
+      sib->rb_right->rb_red = 0;
+      rb_rotate_left(tree, parent);
+    } else {
+      sib = parent->rb_left;
+      if (rb_is_red(sib)) {
+        sib->rb_red = 0;
+        parent->rb_red = 1;
+        rb_rotate_right(tree, parent);
+        sib = parent->rb_left;
+      }
+      if (!rb_is_red(sib->rb_left) && !rb_is_red(sib->rb_right)) {
+        sib->rb_red = 1;
+        node = parent;
+        parent = node->rb_parent;
+        continue;
+      }
+      if (!rb_is_red(sib->rb_left)) {
+        sib->rb_right->rb_red = 0;
+        sib->rb_red = 1;
+        rb_rotate_left(tree, sib);
+        sib = parent->rb_left;
+      }
+      sib->rb_red = parent->rb_red;
+      parent->rb_red = 0;
+      sib->rb_left->rb_red = 0;
+      rb_rotate_right(tree, parent);
+    }
+    node = tree->rbt_root;
+  }
+  if (node)
+    node->rb_red = 0;
+}
+
+void rb_remove(rb_tree_t *tree, rb_node_t *node) {
+  rb_node_t *child, *parent, *succ;
+  int red = node->rb_red;
+
+  if (!node->rb_left || !node->rb_right) {
+    child = node->rb_left ? node->rb_left : node->rb_right;
+    parent = node->rb_parent;
+    rb_replace(tree, node, child);
+  } else {
+    /* The successor, which has no left child, takes node's place */
+    succ = node->rb_right;
+    while (succ->rb_left)
+      succ = succ->rb_left;
+    red = succ->rb_red;
+    child = succ->rb_right;
+    if (succ->rb_parent == node) {
+      parent = succ;
+    } else {
+      parent = succ->rb_parent;
+      rb_replace(tree, succ, child);
+      succ->rb_right = node->rb_right;
+      succ->rb_right->rb_parent = succ;
+    }
+    rb_replace(tree, node, succ);
+    succ->rb_left = node->rb_left;
+    succ->rb_left->rb_parent = succ;
+    succ->rb_red = node->rb_red;
+  }
+  rb_propagate(tree, parent);
+
+  if (!red)
+    rb_remove_fixup(tree, child, parent);
+  node->rb_parent = node->rb_left = node->rb_right = NULL;
+}
+
+rb_node_t *rb_first(rb_tree_t *tree) {
+  rb_node_t *node = tree->rbt_root;
+  while (node && node->rb_left)
+    node = node->rb_left;
+  return node;
+}
+
+rb_node_t *rb_last(rb_tree_t *tree) {
+  rb_node_t *node = tree->rbt_root;
+  while (node && node->rb_right)
+    node = node->rb_right;
+  return node;
+}
+
+rb_node_t *rb_next(rb_node_t *node) {
+  if (node->rb_right) {
+    node = node->rb_right;
+    while (node->rb_left)
+      node = node->rb_left;
+    return node;
+  }
+  while (node->rb_parent && node == node->rb_parent->rb_right)
+    node = node->rb_parent;
+  return node->rb_parent;
+}
+
+rb_node_t *rb_prev(rb_node_t *node) {
+  if (node->rb_left) {
+    node = node->rb_left;
+    while (node->rb_right)
+      node = node->rb_right;
+    return node;
+  }
+  while (node->rb_parent && node == node->rb_parent->rb_left)
+    node = node->rb_parent;
+  return node->rb_parent;
+}
@@ -1,6 +1,23 @@
 #include "ctype.h"
 #include "errno.h"
 
+/*
+ * Bulk copies and fills go a word at a time once the destination is
+ * aligned, and strlen and memchr look at a word at a time for the byte
+ * they want. There is no FPU in here, so nothing wider than a word. A
+ * whole aligned word is read even when the string ends inside it, which
+ * can't run onto an unmapped page.
+ */
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+#define ONES 0x01010101U
+#define HIGHS 0x80808080U
+/* Nonzero if any byte of w is zero */
+#define haszero(w) (((w)-ONES) & ~(w) & HIGHS)
+
+/* Shorter than this, rep movsb and rep stosb by themselves do better */
+#define STRING_WORD_MIN 16
+
 int memcmp(const void *cs, const void *ct, size_t count) {
   int ret;
   /* Compare bytes at %esi and %edi up to %ecx bytes OR until
@@ -22,29 +39,69 @@ int memcmp(const void *cs, const void *ct, size_t count) {
 }
 
 void *memcpy(void *dest, const void *src, size_t count) {
-  /* Move %ecx bytes from %esi to %edi */
+  size_t head = 0;
+  int d0, d1, d2;
+
+  if (count >= STRING_WORD_MIN)
+    head = -(uintptr_t)dest & 3;
+  /* Move bytes up to a word boundary of %edi, then words, then the last
+   * few bytes */
   __asm__ volatile("cld\n\t" /* Make sure direction is forwards */
-                   "rep\n\t"
-                   "movsb"
-                   : /* No output */
-                   : "S"(src), "D"(dest), "c"(count)
-                   : "cc" /* We overwrite condition codes - i.e., flags */
-                   );
+                   "rep movsb\n\t"
+                   "movl %6, %%ecx\n\t"
+                   "shrl $2, %%ecx\n\t"
+                   "rep movsl\n\t"
+                   "movl %6, %%ecx\n\t"
+                   "andl $3, %%ecx\n\t"
+                   "rep movsb"
+                   : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                   : "0"(count >= STRING_WORD_MIN ? head : count), "1"(dest),
+                     "2"(src), "r"(count >= STRING_WORD_MIN ? count - head : 0)
+                   : "cc", "memory");
   return dest;
 }
 
 void *memset(void *s, int c, size_t count) {
-  /* Fill %ecx bytes at %edi with %eax (actually %al) */
+  size_t head = 0;
+  int d0, d1;
+
+  if (count >= STRING_WORD_MIN)
+    head = -(uintptr_t)s & 3;
+  /* Fill as memcpy copies, with the byte repeated through %eax */
   __asm__ volatile("cld\n\t" /* Make sure direction is forwards */
-                   "rep\n\t"
-                   "stosb"
-                   : /* No output */
-                   : "a"(c), "D"(s), "c"(count)
-                   : "cc" /* Overwrite flags */
-                   );
+                   "rep stosb\n\t"
+                   "movl %5, %%ecx\n\t"
+                   "shrl $2, %%ecx\n\t"
+                   "rep stosl\n\t"
+                   "movl %5, %%ecx\n\t"
+                   "andl $3, %%ecx\n\t"
+                   "rep stosb"
+                   : "=&c"(d0), "=&D"(d1)
+                   : "0"(count >= STRING_WORD_MIN ? head : count), "1"(s),
+                     "a"((uint8_t)c * ONES),
+                     "r"(count >= STRING_WORD_MIN ? count - head : 0)
+                   : "cc", "memory");
   return s;
 }
 
+void *memchr(const void *s, int c, size_t count) {
+  const unsigned char *p = s;
+  uint32_t pat = (uint8_t)c * ONES;
+
+  for (; count && ((uintptr_t)p & 3); --count, ++p)
+    if (*p == (uint8_t)c)
+      return (void *)p;
+  /* Two words at a time, xored so that the byte wanted becomes zero */
+  for (; count >= 8; count -= 8, p += 8)
+    if (haszero(((const word_t *)p)[0] ^ pat) ||
+        haszero(((const word_t *)p)[1] ^ pat))
+      break;
+  for (; count; --count, ++p)
+    if (*p == (uint8_t)c)
+      return (void *)p;
+  return NULL;
+}
+
 int strncmp(const char *cs, const char *ct, size_t count) {
   register signed char __res = 0;
 
@@ -107,8 +164,17 @@ char *strcat(char *dest, const char *src) {
 
 size_t strlen(const char *s) {
   const char *sc;
-
-  for (sc = s; *sc != '\0'; ++sc)
+  const word_t *w;
+
+  for (sc = s; (uintptr_t)sc & 3; ++sc)
+    if (*sc == '\0')
+      return sc - s;
+  for (w = (const word_t *)sc; !haszero(w[0]); w += 2)
+    if (haszero(w[1])) {
+      w++;
+      break;
+    }
+  for (sc = (const char *)w; *sc != '\0'; ++sc)
     /* nothing */;
   return sc - s;
 }
@@ -1,32 +1,333 @@
 #include "globals.h"
+#include "time.h"
+#include "errno.h"
+#include "config.h"
 
 #include "main/interrupt.h"
 #include "main/apic.h"
 #include "main/pit.h"
+#include "main/rtc.h"
 
+#include "mm/page.h"
+#include "mm/pagetable.h"
+
+#include "util/atomic.h"
 #include "util/debug.h"
 #include "util/init.h"
+#include "util/list.h"
+#include "util/prof.h"
+#include "util/time.h"
 
 #include "proc/sched.h"
 #include "proc/kthread.h"
 
 #define APIC_TIMER_IRQ 32 /* Map interrupt 32 */
 
-#ifdef __UPREEMPT__
-static unsigned int ms = 0;
+/*
+ * Timers are kept on a hierarchical timing wheel. Level 0 has one slot
+ * for each of the next TW_SIZE ticks; each slot of level n covers
+ * TW_SIZE^n ticks. Whenever the low bits of the wheel clock wrap, the
+ * next slot of the level above is cascaded down, so adding, cancelling
+ * and expiring a timer are all O(1) no matter how many are pending.
+ * Timers further out than the wheel reaches are parked in its last slot
+ * and re-sorted each time they come around.
+ */
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 4
+#define TW_SPAN (1UL << (TW_BITS * TW_LEVELS))
+#define TW_INDEX(clock, level) (((clock) >> (TW_BITS * (level))) & TW_MASK)
+
+static list_t time_wheel[TW_LEVELS][TW_SIZE];
+static unsigned long time_wheel_clock; /* next tick the wheel will run */
+
+static volatile unsigned long time_nticks = 0;
+static int time_tickless = 0; /* periodic tick stopped by time_idle_enter */
 
-static void pit_handler(regs_t *regs) { dbg(DBG_CORE, "PIT HANDLER FIRED\n"); }
+/* The time stamp counter's rate, measured against the PIT at boot over
+ * TIME_CALIBRATE_HZ'th of a second */
+#define TIME_CALIBRATE_HZ 20
+static uint64_t time_tsc_hz = 0; /* 0 until measured */
+static uint32_t time_tsc_per_tick = 0;
+static uint64_t time_tsc_boot; /* the counter at CLOCK_MONOTONIC 0 */
+
+static time_page_t *time_page = NULL;
+
+/* These must be called with interrupts masked */
+static void time_wheel_insert(ktimer_t *t) {
+  unsigned long expires = t->tm_expires;
+  unsigned long delta = expires - time_wheel_clock;
+  int level;
+
+  if ((long)delta < 0) {
+    /* Already due; fire on the next tick run */
+    expires = time_wheel_clock;
+    delta = 0;
+  } else if (delta >= TW_SPAN) {
+    expires = time_wheel_clock + TW_SPAN - 1;
+    delta = TW_SPAN - 1;
+  }
+  for (level = 0; delta >= (1UL << (TW_BITS * (level + 1))); level++)
+    ;
+  list_insert_tail(&time_wheel[level][TW_INDEX(expires, level)], &t->tm_link);
+}
 
-/* Uncomment this to enable the apic timer to
- * call the pit_handler for userland preemption
+static void time_wheel_cascade(int level) {
+  list_t *slot = &time_wheel[level][TW_INDEX(time_wheel_clock, level)];
+  ktimer_t *t;
+
+  while (!list_empty(slot)) {
+    t = list_head(slot, ktimer_t, tm_link);
+    list_remove(&t->tm_link);
+    time_wheel_insert(t);
+  }
+}
+
+/* Runs the wheel forward to time_nticks, firing what comes due */
+static void time_wheel_run(void) {
+  list_t *slot;
+  ktimer_t *t;
+  int level;
+
+  while ((long)(time_nticks - time_wheel_clock) >= 0) {
+    for (level = 1;
+         level < TW_LEVELS && !TW_INDEX(time_wheel_clock, level - 1); level++)
+      time_wheel_cascade(level);
+
+    slot = &time_wheel[0][TW_INDEX(time_wheel_clock, 0)];
+    time_wheel_clock++;
+    while (!list_empty(slot)) {
+      t = list_head(slot, ktimer_t, tm_link);
+      list_remove(&t->tm_link);
+      t->tm_func(t->tm_arg);
+    }
+  }
+}
+
+/*
+ * Returns the earliest tick at which the wheel has work: either a level 0
+ * timer expiring or a higher level slot which has to be cascaded. Only
+ * used to decide how long the idle loop can leave the tick off.
  */
+static unsigned long time_wheel_next(void) {
+  unsigned long next = time_wheel_clock + TW_SPAN, window, when;
+  int level, k;
 
-static __attribute__((unused)) void time_init(void) {
-  intr_map(APIC_TIMER_IRQ, APIC_TIMER_IRQ);
-  intr_register(APIC_TIMER_IRQ, pit_handler);
-  /* TODO: figure out how this argument converts to hertz */
-  apic_enable_periodic_timer(8);
+  for (k = 0; k < TW_SIZE; k++) {
+    if (!list_empty(&time_wheel[0][TW_INDEX(time_wheel_clock + k, 0)]))
+      return time_wheel_clock + k;
+  }
+  for (level = 1; level < TW_LEVELS; level++) {
+    window = time_wheel_clock >> (TW_BITS * level);
+    for (k = 1; k <= TW_SIZE; k++) {
+      if (!list_empty(&time_wheel[level][(window + k) & TW_MASK])) {
+        when = (window + k) << (TW_BITS * level);
+        if ((long)(when - next) < 0)
+          next = when;
+        break;
+      }
+    }
+  }
+  return next;
 }
-init_func(time_init);
 
+/* Converts cycles to units of 1/per seconds, in two parts so that the
+ * multiplication can't overflow */
+static uint64_t time_cycles_to(uint64_t cycles, uint64_t per) {
+  return cycles / time_tsc_hz * per + cycles % time_tsc_hz * per / time_tsc_hz;
+}
+
+/* Brings the time page up to date. Called with the IPL raised, as by the
+ * timer interrupt */
+static void time_page_update(void) {
+  uint64_t now = time_cycles();
+
+  time_page->tp_seq++;
+  wmb();
+  time_page->tp_tsc = now;
+  time_page->tp_mono_ns = time_cycles_to(now - time_tsc_boot, 1000000000);
+  wmb();
+  time_page->tp_seq++;
+}
+
+/* Accounts for the idle period and goes back to the periodic tick */
+static void time_tickless_stop(void) {
+  time_nticks += apic_timer_elapsed();
+  apic_resume_periodic_timer();
+  time_tickless = 0;
+  time_page_update();
+}
+
+static void time_tsc_calibrate(void) {
+  uint64_t start;
+
+  pit_oneshot_start(PIT_HZ / TIME_CALIBRATE_HZ);
+  start = time_cycles();
+  pit_oneshot_wait();
+  time_tsc_hz = (time_cycles() - start) * TIME_CALIBRATE_HZ;
+  time_tsc_per_tick = (uint32_t)(time_tsc_hz / TIME_HZ);
+  dbg(DBG_CORE, "time stamp counter runs at %u kHz\n",
+      (uint32_t)(time_tsc_hz / 1000));
+}
+
+uint64_t time_cycles_to_usecs(uint64_t cycles) {
+  if (!time_tsc_hz)
+    return 0;
+  return time_cycles_to(cycles, 1000000);
+}
+
+unsigned long time_cycles_to_ticks(uint64_t cycles) {
+  if (!time_tsc_per_tick)
+    return 0;
+  return (unsigned long)(cycles / time_tsc_per_tick);
+}
+
+static void time_handler(regs_t *regs) {
+  if (time_tickless)
+    time_tickless_stop();
+  else
+    time_nticks++;
+  time_page_update();
+  if (prof_enabled)
+    prof_sample(regs);
+  time_wheel_run();
+  sched_tick();
+
+  /* The local APIC timer does not go through the I/O APIC, so it is not
+   * intr_map'd and __intr_handler will not acknowledge it for us. This
+   * has to happen before we might switch away below. */
+  apic_eoi();
+
+#ifdef __UPREEMPT__
+  /* Only preempt threads which were interrupted in userland; kernel code
+   * is not written to be switched out at arbitrary points. */
+  if ((regs->r_cs & 0x3) == 0x3) {
+    sched_preempt();
+#ifdef __MTP__
+    /* Another thread may have cancelled us, and a thread which does not
+     * make syscalls would otherwise never notice */
+    if (curthr->kt_cancelled)
+      kthread_exit(curthr->kt_retval);
+#endif
+  }
 #endif
+}
+
+void time_idle_enter(void) {
+  unsigned long next;
+
+  KASSERT(!time_tickless);
+  next = time_wheel_next();
+  /* Not worth it unless we skip at least one tick */
+  if ((long)(next - time_nticks) < 2)
+    return;
+  apic_oneshot_timer(next - time_nticks);
+  time_tickless = 1;
+}
+
+void time_idle_exit(void) {
+  if (time_tickless) {
+    time_tickless_stop();
+    time_wheel_run();
+  }
+}
+
+unsigned long time_ticks(void) { return time_nticks; }
+
+unsigned long time_deadline_ms(unsigned int msecs) {
+  /* Round up to whole ticks, +1 because the current tick is already
+   * partway over */
+  return time_nticks + (msecs + TICK_MSECS - 1) / TICK_MSECS + 1;
+}
+
+int time_gettime(int clk, struct timespec *ts) {
+  uint64_t ns;
+  uint8_t old_ipl;
+
+  if (CLOCK_REALTIME != clk && CLOCK_MONOTONIC != clk)
+    return -EINVAL;
+  while (time_page_read(time_page, clk, &ns)) {
+    old_ipl = intr_getipl();
+    intr_setipl(IPL_HIGH);
+    time_page_update();
+    intr_setipl(old_ipl);
+  }
+  ts->tv_sec = (time_t)(ns / 1000000000);
+  ts->tv_nsec = (long)(ns % 1000000000);
+  return 0;
+}
+
+void timer_init(ktimer_t *t, ktimer_func_t func, void *arg) {
+  list_link_init(&t->tm_link);
+  t->tm_expires = 0;
+  t->tm_func = func;
+  t->tm_arg = arg;
+}
+
+void timer_add(ktimer_t *t, unsigned long expires) {
+  uint8_t old_ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  if (list_link_is_linked(&t->tm_link))
+    list_remove(&t->tm_link);
+  t->tm_expires = expires;
+  time_wheel_insert(t);
+  intr_setipl(old_ipl);
+}
+
+int timer_cancel(ktimer_t *t) {
+  int pending;
+  uint8_t old_ipl = intr_getipl();
+  intr_setipl(IPL_HIGH);
+  if ((pending = list_link_is_linked(&t->tm_link)))
+    list_remove(&t->tm_link);
+  intr_setipl(old_ipl);
+  return pending;
+}
+
+int timer_pending(ktimer_t *t) { return list_link_is_linked(&t->tm_link); }
+
+int time_sleep(unsigned int msecs) {
+  unsigned long deadline, now;
+  ktqueue_t waitq;
+  int ret;
+
+  if (!msecs)
+    return 0;
+
+  sched_queue_init(&waitq);
+  deadline = time_deadline_ms(msecs);
+  if ((now = time_ticks()) >= deadline)
+    return 0;
+  ret = sched_cancellable_sleep_on_timeout(&waitq, deadline - now);
+  return ret == -ETIMEDOUT ? 0 : ret;
+}
+
+static __attribute__((unused)) void time_init(void) {
+  int level, i;
+
+  for (level = 0; level < TW_LEVELS; level++)
+    for (i = 0; i < TW_SIZE; i++)
+      list_init(&time_wheel[level][i]);
+  time_wheel_clock = time_nticks + 1;
+
+  time_tsc_calibrate();
+  time_page = (time_page_t *)page_alloc_zeroed();
+  KASSERT(NULL != time_page);
+  /* The largest shift that keeps tp_mult to 32 bits */
+  time_page->tp_shift = 32;
+  while ((1000000000ULL << time_page->tp_shift) / time_tsc_hz >> 32)
+    time_page->tp_shift--;
+  time_page->tp_mult =
+      (uint32_t)((1000000000ULL << time_page->tp_shift) / time_tsc_hz);
+  time_tsc_boot = time_cycles();
+  time_page->tp_real_ns = (uint64_t)rtc_read() * 1000000000;
+  time_page_update();
+  pt_map_user_shared(TIME_PAGE_ADDR,
+                     pt_virt_to_phys((uintptr_t)time_page));
+
+  intr_register(APIC_TIMER_IRQ, time_handler);
+  apic_enable_periodic_timer(1000 / TICK_MSECS);
+}
+init_func(time_init);
+init_depends(sched_init);
@@ -0,0 +1,46 @@
+#include "globals.h"
+#include "types.h"
+
+#include "main/interrupt.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+
+#include "util/string.h"
+#include "util/time.h"
+#include "util/trace.h"
+
+uint32_t trace_mask = 0;
+trace_event_t trace_ring[TRACE_NEVENTS];
+uint32_t trace_head = 0;
+
+const char *trace_names[TRACE_NTYPES] = {
+    "sched_switch", "sched_wakeup", "pframe_hit",  "pframe_miss",
+    "pframe_fill",  "pframe_fill",  "disk",        "disk",
+    "syscall",      "syscall",      "pagefault",   "pagefault"};
+
+/*
+ * The oldest event is overwritten once the ring is full. There is one
+ * processor, so one ring; interrupts are masked while a slot is claimed
+ * and filled, so a tracepoint in an interrupt handler cannot tear it.
+ */
+void trace_record(int type, uint32_t arg0, uint32_t arg1) {
+  uint32_t flags = intr_save();
+  trace_event_t *te = &trace_ring[trace_head++ & (TRACE_NEVENTS - 1)];
+
+  te->te_tsc = time_cycles();
+  te->te_type = type;
+  te->te_cpu = 0;
+  te->te_pid = (NULL != curproc) ? curproc->p_pid : -1;
+  te->te_thr = (uint32_t)curthr;
+  te->te_arg[0] = arg0;
+  te->te_arg[1] = arg1;
+  intr_restore(flags);
+}
+
+void trace_clear(void) {
+  uint32_t flags = intr_save();
+  trace_head = 0;
+  memset(trace_ring, 0, sizeof(trace_ring));
+  intr_restore(flags);
+}
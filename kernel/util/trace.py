@@ -0,0 +1,27 @@
+import gdb
+
+import weenix
+import weenix.trace
+
+class TraceCommand(weenix.Command):
+	"""usage: trace <file>
+	Writes the kernel's trace ring to <file> as Chrome trace
+	event JSON, for chrome://tracing or ui.perfetto.dev. Turn
+	tracepoints on with kshell's "trace on" command, or by
+	setting trace_mask."""
+
+	def __init__(self):
+		weenix.Command.__init__(self, "trace", gdb.COMMAND_DATA, gdb.COMPLETE_FILENAME)
+
+	def invoke(self, arg, tty):
+		args = gdb.string_to_argv(arg)
+		if (len(args) != 1):
+			gdb.write("{0}\n".format(self.__doc__))
+			raise gdb.GdbError("invalid arguments")
+		f = open(args[0], "w")
+		f.write(weenix.trace.chrome_json())
+		f.close()
+		gdb.write("wrote {0} events to {1}\n".format(
+			len(list(weenix.trace.events())), args[0]))
+
+TraceCommand()
@@ -11,6 +11,8 @@
 #include "mm/slab.h"
 #include "mm/tlb.h"
 
+#include "vm/swap.h"
+
 int anon_count = 0; /* for debugging/verification purposes */
 
 static slab_allocator_t *anon_allocator;
@@ -23,7 +25,8 @@ static int anon_fillpage(mmobj_t *o, pframe_t *pf);
 static int anon_dirtypage(mmobj_t *o, pframe_t *pf);
 static int anon_cleanpage(mmobj_t *o, pframe_t *pf);
 
-static mmobj_ops_t anon_mmobj_ops = {.ref = anon_ref,
+static mmobj_ops_t anon_mmobj_ops = {.name = "anon",
+                                     .ref = anon_ref,
                                      .put = anon_put,
                                      .lookuppage = anon_lookuppage,
                                      .fillpage = anon_fillpage,
@@ -35,7 +38,10 @@ static mmobj_ops_t anon_mmobj_ops = {.ref = anon_ref,
  * anonymous page sub system. Currently it only initializes the
  * anon_allocator object.
  */
-void anon_init() { NOT_YET_IMPLEMENTED("VM: anon_init"); }
+void anon_init() {
+  anon_allocator = slab_allocator_create("anon", sizeof(mmobj_t));
+  KASSERT(NULL != anon_allocator && "failed to create anon allocator!");
+}
 
 /*
  * You'll want to use the anon_allocator to allocate the mmobj to
@@ -44,16 +50,27 @@ void anon_init() { NOT_YET_IMPLEMENTED("VM: anon_init"); }
  * reference count is correct.
  */
 mmobj_t *anon_create() {
-  NOT_YET_IMPLEMENTED("VM: anon_create");
-  return NULL;
+  mmobj_t *o = (mmobj_t *)slab_obj_alloc(anon_allocator);
+  if (o) {
+    mmobj_init(o, &anon_mmobj_ops);
+    o->mmo_refcount = 1;
+    anon_count++;
+  }
+  return o;
 }
 
+/* Whether o is an anonymous object */
+int anon_is(mmobj_t *o) { return &anon_mmobj_ops == o->mmo_ops; }
+
 /* Implementation of mmobj entry points: */
 
 /*
  * Increment the reference count on the object.
  */
-static void anon_ref(mmobj_t *o) { NOT_YET_IMPLEMENTED("VM: anon_ref"); }
+static void anon_ref(mmobj_t *o) {
+  KASSERT(o && (0 < o->mmo_refcount) && (&anon_mmobj_ops == o->mmo_ops));
+  o->mmo_refcount++;
+}
 
 /*
  * Decrement the reference count on the object. If, however, the
@@ -63,29 +80,60 @@ static void anon_ref(mmobj_t *o) { NOT_YET_IMPLEMENTED("VM: anon_ref"); }
  * never be used again. You should unpin and uncache all of the
  * object's pages and then free the object itself.
  */
-static void anon_put(mmobj_t *o) { NOT_YET_IMPLEMENTED("VM: anon_put"); }
+static void anon_put(mmobj_t *o) {
+  pframe_t *pf;
+
+  KASSERT(o && (0 < o->mmo_refcount) && (&anon_mmobj_ops == o->mmo_ops));
+  if (o->mmo_nrespages == o->mmo_refcount - 1) {
+    /* Each pframe_free puts the object again, which brings the count
+     * down to ours alone */
+    list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+      while (pframe_is_busy(pf))
+        sched_sleep_on(pframe_waitq(pf));
+      while (pframe_is_pinned(pf))
+        pframe_unpin(pf);
+      pframe_free(pf);
+    }
+    list_iterate_end();
+  }
+  if (0 == --o->mmo_refcount) {
+    KASSERT(0 == o->mmo_nrespages);
+    swap_release(o);
+    slab_obj_free(anon_allocator, o);
+    anon_count--;
+  }
+}
 
 /* Get the corresponding page from the mmobj. No special handling is
  * required. */
 static int anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite,
                            pframe_t **pf) {
-  NOT_YET_IMPLEMENTED("VM: anon_lookuppage");
-  return -1;
+  return pframe_get(o, pagenum, pf);
 }
 
 /* The following three functions should not be difficult. */
 
 static int anon_fillpage(mmobj_t *o, pframe_t *pf) {
-  NOT_YET_IMPLEMENTED("VM: anon_fillpage");
+  int ret;
+
+  KASSERT(pframe_is_busy(pf));
+  if (0 > (ret = swap_in(o, pf)))
+    return ret;
+  if (0 == ret)
+    memset(pf->pf_addr, 0, PAGE_SIZE);
+  /* Without swap there is no backing store, so the page must never be
+   * paged out */
+  if (!swap_enabled())
+    pframe_pin(pf);
   return 0;
 }
 
+/* The copy in swap, if any, is about to be out of date */
 static int anon_dirtypage(mmobj_t *o, pframe_t *pf) {
-  NOT_YET_IMPLEMENTED("VM: anon_dirtypage");
-  return -1;
+  swap_discard(o, pf->pf_pagenum);
+  return 0;
 }
 
 static int anon_cleanpage(mmobj_t *o, pframe_t *pf) {
-  NOT_YET_IMPLEMENTED("VM: anon_cleanpage");
-  return -1;
+  return swap_out(o, pf);
 }
@@ -1,3 +1,4 @@
+#include "config.h"
 #include "globals.h"
 #include "errno.h"
 #include "util/debug.h"
@@ -5,12 +6,32 @@
 #include "mm/mm.h"
 #include "mm/page.h"
 #include "mm/mman.h"
+#include "mm/mmobj.h"
 
+#include "vm/anon.h"
+#include "vm/brk.h"
 #include "vm/mmap.h"
+#include "vm/pagefault.h"
 #include "vm/vmmap.h"
 
 #include "proc/proc.h"
 
+/*
+ * Returns the heap's area, which starts at the first page boundary at or
+ * after the starting break, or NULL if there isn't one (if something
+ * other than private anonymous memory is mapped there, it isn't the
+ * heap).
+ */
+static vmarea_t *brk_area(vmmap_t *map, uint32_t lo) {
+  vmarea_t *vma = vmmap_lookup(map, lo);
+
+  if (NULL == vma || lo != vma->vma_start ||
+      !(MAP_PRIVATE & vma->vma_flags) ||
+      !anon_is(mmobj_bottom_obj(vma->vma_obj)))
+    return NULL;
+  return vma;
+}
+
 /*
  * This function implements the brk(2) system call.
  *
@@ -51,8 +72,61 @@
  *
  * Note that this function "returns" the new break through the "ret" argument.
  * Return 0 on success, -errno on failure.
+ *
+ * The heap's area is grown BRK_RESERVE_PAGES at a time, so that a heap
+ * growing a page at a time doesn't resize its area on every call; the
+ * area can thus run some way past the break. Its pages are demand-zero,
+ * and if populate is set the pages the break moves over are faulted in
+ * here, so that using them takes no faults.
  */
-int do_brk(void *addr, void **ret) {
-  NOT_YET_IMPLEMENTED("VM: do_brk");
+int do_brk(void *addr, int populate, void **ret) {
+  vmmap_t *map = curproc->p_vmmap;
+  uint32_t lo = ADDR_TO_PN(PAGE_ALIGN_UP(curproc->p_start_brk));
+  uint32_t oldhi, newhi, end, want;
+  vmarea_t *heap;
+  int err;
+
+  if (NULL == addr) {
+    *ret = curproc->p_brk;
+    return 0;
+  }
+  if ((uintptr_t)addr < (uintptr_t)curproc->p_start_brk ||
+      (uintptr_t)addr > USER_MEM_HIGH)
+    return -ENOMEM;
+
+  oldhi = ADDR_TO_PN(PAGE_ALIGN_UP(curproc->p_brk));
+  newhi = ADDR_TO_PN(PAGE_ALIGN_UP(addr));
+  heap = brk_area(map, lo);
+  end = heap ? heap->vma_end : lo;
+
+  if (newhi > end) {
+    if (!vmmap_is_range_empty(map, end, newhi - end))
+      return -ENOMEM;
+    /* Reserve the rest of the run too, if nothing is mapped there */
+    want = MIN(ADDR_TO_PN(USER_MEM_HIGH),
+               (newhi - lo + BRK_RESERVE_PAGES - 1) / BRK_RESERVE_PAGES *
+                       BRK_RESERVE_PAGES + lo);
+    if (!vmmap_is_range_empty(map, end, want - end))
+      want = newhi;
+    if (heap) {
+      vmmap_extend(map, heap, want - end);
+    } else if (0 > (err = vmmap_map(map, NULL, lo, want - lo,
+                                    PROT_READ | PROT_WRITE, MAP_PRIVATE, 0,
+                                    VMMAP_DIR_LOHI, &heap))) {
+      return err;
+    }
+  } else if (heap && newhi < oldhi) {
+    /* Shrinking gives the pages back, so that growing again finds them
+     * zeroed */
+    if (0 > (err = vmmap_remove(map, MAX(newhi, lo), end - MAX(newhi, lo))))
+      return err;
+  }
+
+  /* Populating is only an optimisation, so failing to is no error */
+  if (populate && newhi > MAX(oldhi, lo))
+    vm_populate(heap, MAX(oldhi, lo), newhi);
+
+  curproc->p_brk = addr;
+  *ret = addr;
   return 0;
 }
@@ -6,8 +6,12 @@
 #include "mm/tlb.h"
 #include "mm/mman.h"
 #include "mm/page.h"
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/pagetable.h"
 
 #include "proc/proc.h"
+#include "proc/sched.h"
 
 #include "util/string.h"
 #include "util/debug.h"
@@ -18,11 +22,13 @@
 
 #include "vm/vmmap.h"
 #include "vm/mmap.h"
+#include "vm/swap.h"
 
 /*
  * This function implements the mmap(2) syscall, but only
  * supports the MAP_SHARED, MAP_PRIVATE, MAP_FIXED, and
- * MAP_ANON flags.
+ * MAP_ANON flags. Without MAP_FIXED, a free range at addr is used
+ * before looking for one elsewhere.
  *
  * Add a mapping to the current process's address space.
  * You need to do some error checking; see the ERRORS section
@@ -32,8 +38,60 @@
  */
 int do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
             void **ret) {
-  NOT_YET_IMPLEMENTED("VM: do_mmap");
-  return -1;
+  int type = flags & MAP_TYPE;
+  uint32_t lopage = 0, npages;
+  file_t *f = NULL;
+  vnode_t *vn = NULL;
+  vmarea_t *vma;
+  int err;
+
+  if (!len || len > USER_MEM_HIGH - USER_MEM_LOW || off < 0 ||
+      !PAGE_ALIGNED(off))
+    return -EINVAL;
+  if (MAP_SHARED != type && MAP_PRIVATE != type)
+    return -EINVAL;
+  npages = ADDR_TO_PN(PAGE_ALIGN_UP(len));
+  if (flags & MAP_FIXED) {
+    if (!PAGE_ALIGNED(addr) || (uintptr_t)addr < USER_MEM_LOW ||
+        (uintptr_t)addr > USER_MEM_HIGH - len)
+      return -EINVAL;
+    lopage = ADDR_TO_PN(addr);
+  } else if (PAGE_ALIGNED(addr) && (uintptr_t)addr >= USER_MEM_LOW &&
+             (uintptr_t)addr <= USER_MEM_HIGH - len &&
+             vmmap_is_range_empty(curproc->p_vmmap, ADDR_TO_PN(addr),
+                                  npages)) {
+    /* Otherwise addr is a hint, taken if nothing is mapped there; this is
+     * how ld-weenix puts a prelinked library where it was linked to */
+    lopage = ADDR_TO_PN(addr);
+  }
+
+  if (!(flags & MAP_ANON)) {
+    if (NULL == (f = fget(fd)))
+      return -EBADF;
+    /* Writes through a shared mapping go to the file, so it must be open
+     * for writing, and not only for appending */
+    if (!(f->f_mode & FMODE_READ) ||
+        (MAP_SHARED == type && (prot & PROT_WRITE) &&
+         (!(f->f_mode & FMODE_WRITE) || (f->f_mode & FMODE_APPEND)))) {
+      fput(f);
+      return -EACCES;
+    }
+    vn = f->f_vnode;
+    if (NULL == vn->vn_ops->mmap) {
+      fput(f);
+      return -ENODEV;
+    }
+  }
+
+  err = vmmap_map(curproc->p_vmmap, vn, lopage, npages, prot, type, off,
+                  VMMAP_DIR_HILO, &vma);
+  if (f)
+    fput(f);
+  if (0 > err)
+    return err;
+  /* vmmap_remove flushed any old mappings of the range from the TLB */
+  *ret = PN_TO_ADDR(vma->vma_start);
+  return 0;
 }
 
 /*
@@ -44,6 +102,180 @@ int do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
  * Remember to clear the TLB.
  */
 int do_munmap(void *addr, size_t len) {
-  NOT_YET_IMPLEMENTED("VM: do_munmap");
-  return -1;
+  uint32_t npages;
+
+  if (!len || !PAGE_ALIGNED(addr) || (uintptr_t)addr < USER_MEM_LOW ||
+      len > USER_MEM_HIGH - (uintptr_t)addr)
+    return -EINVAL;
+  npages = ADDR_TO_PN(PAGE_ALIGN_UP(len));
+  /* vmmap_remove also flushes the range from the TLB */
+  return vmmap_remove(curproc->p_vmmap, ADDR_TO_PN(addr), npages);
+}
+
+/*
+ * Reads in ahead of use whatever the pages [lo, hi) of an area map from
+ * a file. Anonymous memory is left to be faulted in.
+ */
+static void madvise_willneed(vmarea_t *vma, uint32_t lo, uint32_t hi) {
+  vnode_t *vn = vnode_of_mmobj(mmobj_bottom_obj(vma->vma_obj));
+
+  if (NULL != vn)
+    vnode_readahead(vn, vma->vma_off + lo - vma->vma_start,
+                    vma->vma_off + hi - vma->vma_start);
+}
+
+/*
+ * Drops the pages [lo, hi) of an area from the current process. The
+ * copies a private area has made of them are thrown away, so the next
+ * touch sees the object below again: the file for a private file
+ * mapping, zeros for fresh anonymous memory, or what the page held at
+ * the last fork. The pages below, and those of a shared area, are kept,
+ * but as the pager's first choice.
+ */
+static void madvise_dontneed(vmarea_t *vma, uint32_t lo, uint32_t hi) {
+  mmobj_t *o = vma->vma_obj, *below;
+  uint32_t pagenum = vma->vma_off + lo - vma->vma_start;
+  uint32_t end = pagenum + hi - lo;
+  pframe_t *pf;
+  tlb_batch_t tb;
+
+  pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lo),
+                 (uintptr_t)PN_TO_ADDR(hi));
+  tlb_batch_init(&tb);
+  tlb_batch_add_range(&tb, (uintptr_t)PN_TO_ADDR(lo), hi - lo);
+  tlb_batch_flush(&tb);
+
+  for (; pagenum < end; ++pagenum) {
+    below = o;
+    if (MAP_PRIVATE == vma->vma_flags && NULL != o->mmo_shadowed) {
+      if (NULL != (pf = pframe_get_resident(o, pagenum))) {
+        while (pframe_is_busy(pf))
+          sched_sleep_on(pframe_waitq(pf));
+        while (pframe_is_pinned(pf))
+          pframe_unpin(pf);
+        pframe_free(pf);
+      }
+      swap_discard(o, pagenum);
+      below = o->mmo_shadowed;
+    }
+    for (; NULL != below; below = below->mmo_shadowed) {
+      if (NULL != (pf = pframe_get_resident(below, pagenum))) {
+        pframe_reclaim_soon(pf);
+        break;
+      }
+    }
+  }
+}
+
+/*
+ * This function implements the madvise(2) syscall. MADV_NORMAL,
+ * MADV_RANDOM and MADV_SEQUENTIAL set the access pattern of each area the
+ * range touches, as a whole, for handle_pagefault to go by; MADV_WILLNEED
+ * and MADV_DONTNEED act on just the pages of the range.
+ */
+int do_madvise(void *addr, size_t len, int advice) {
+  vmmap_t *map = curproc->p_vmmap;
+  uint32_t lo, hi, vfn;
+  vmarea_t *vma;
+
+  if (!PAGE_ALIGNED(addr) || (uintptr_t)addr < USER_MEM_LOW ||
+      len > USER_MEM_HIGH - (uintptr_t)addr)
+    return -EINVAL;
+  if (advice < MADV_NORMAL || advice > MADV_DONTNEED)
+    return -EINVAL;
+  lo = ADDR_TO_PN(addr);
+  hi = lo + ADDR_TO_PN(PAGE_ALIGN_UP(len));
+  /* Nothing is done unless all of the range is mapped */
+  for (vfn = lo; vfn < hi; vfn = vma->vma_end) {
+    if (NULL == (vma = vmmap_lookup(map, vfn)))
+      return -ENOMEM;
+  }
+
+  for (vfn = lo; vfn < hi; vfn = vma->vma_end) {
+    vma = vmmap_lookup(map, vfn);
+    KASSERT(NULL != vma);
+    switch (advice) {
+    case MADV_WILLNEED:
+      madvise_willneed(vma, vfn, MIN(hi, vma->vma_end));
+      break;
+    case MADV_DONTNEED:
+      madvise_dontneed(vma, vfn, MIN(hi, vma->vma_end));
+      break;
+    default:
+      vma->vma_advice = advice;
+    }
+  }
+  return 0;
+}
+
+/* Whether an area other than vma, over the same object, maps any of the
+ * object's pages [lo, hi) */
+static int mremap_overlaps(vmarea_t *vma, uint32_t lo, uint32_t hi) {
+  vmarea_t *other;
+
+  list_iterate_begin(mmobj_bottom_vmas(vma->vma_obj), other, vmarea_t,
+                     vma_olink) {
+    if (other != vma && other->vma_obj == vma->vma_obj &&
+        other->vma_off < hi &&
+        lo < other->vma_off + (other->vma_end - other->vma_start))
+      return 1;
+  }
+  list_iterate_end();
+  return 0;
+}
+
+/*
+ * This function implements the mremap(2) syscall: it resizes the
+ * mapping [addr, addr + oldlen), which must lie in one area, to newlen
+ * bytes, and returns its address through ret. Shrinking unmaps the tail.
+ * A mapping which ends its area grows in place if the pages after it are
+ * free, and otherwise, with MREMAP_MAYMOVE, moves to where there is room
+ * (see vmmap_move); either way no bytes are copied. The pages grown over
+ * are dropped first, as by MADV_DONTNEED, since the object may still
+ * have some from when the area was longer, and growing fails with
+ * -ENOMEM if another area maps those pages of the object.
+ */
+int do_mremap(void *addr, size_t oldlen, size_t newlen, int flags,
+              void **ret) {
+  vmmap_t *map = curproc->p_vmmap;
+  uint32_t lo, oldhi, npages, grow, off;
+  vmarea_t *vma;
+  int start;
+
+  if (!oldlen || !newlen || !PAGE_ALIGNED(addr) ||
+      (uintptr_t)addr < USER_MEM_LOW ||
+      oldlen > USER_MEM_HIGH - (uintptr_t)addr ||
+      newlen > USER_MEM_HIGH - USER_MEM_LOW || (flags & ~MREMAP_MAYMOVE))
+    return -EINVAL;
+  lo = ADDR_TO_PN(addr);
+  oldhi = lo + ADDR_TO_PN(PAGE_ALIGN_UP(oldlen));
+  npages = ADDR_TO_PN(PAGE_ALIGN_UP(newlen));
+  if (NULL == (vma = vmmap_lookup(map, lo)) || oldhi > vma->vma_end)
+    return -EFAULT;
+
+  *ret = addr;
+  if (lo + npages <= oldhi)
+    return lo + npages == oldhi ? 0
+                                : vmmap_remove(map, lo + npages,
+                                               oldhi - lo - npages);
+
+  grow = lo + npages - oldhi;
+  off = vma->vma_off + (oldhi - vma->vma_start);
+  if (oldhi != vma->vma_end || mremap_overlaps(vma, off, off + grow))
+    return -ENOMEM;
+  if (lo + npages <= ADDR_TO_PN(USER_MEM_HIGH) &&
+      vmmap_is_range_empty(map, oldhi, grow)) {
+    vmmap_extend(map, vma, grow);
+  } else if (!(flags & MREMAP_MAYMOVE)) {
+    return -ENOMEM;
+  } else {
+    if (0 > (start = vmmap_move(map, lo, oldhi - lo, npages)))
+      return start;
+    vma = vmmap_lookup(map, start);
+    lo = start;
+    oldhi = lo + npages - grow;
+    *ret = PN_TO_ADDR(start);
+  }
+  madvise_dontneed(vma, oldhi, oldhi + grow);
+  return 0;
 }
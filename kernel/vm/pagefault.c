@@ -4,18 +4,210 @@
 #include "errno.h"
 
 #include "util/debug.h"
+#include "util/hist.h"
+#include "util/init.h"
+#include "util/printf.h"
+#include "util/time.h"
+#include "util/trace.h"
 
 #include "proc/proc.h"
 
+#include "fs/vnode.h"
+
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/page.h"
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 #include "mm/pagetable.h"
+#include "mm/tlb.h"
 
+#include "vm/anon.h"
 #include "vm/pagefault.h"
 #include "vm/vmmap.h"
+#include "vm/swap.h"
+
+/*
+ * A page of zeros which read faults on untouched anonymous memory map
+ * read-only instead of getting a page of their own; the first write then
+ * faults again and gets one. The page belongs to no object, so nothing
+ * records where it is mapped, and nothing needs to: it is never paged
+ * out, and a write fault or vmmap_write replaces the entry.
+ */
+static uintptr_t fault_zero_paddr;
+static uint32_t fault_zero_maps; /* read faults that mapped it */
+
+static void pagefault_init(void) {
+  void *zero = page_alloc_zeroed();
+
+  KASSERT(NULL != zero && "no memory for the zero page");
+  fault_zero_paddr = pt_virt_to_phys((uintptr_t)zero);
+}
+init_func(pagefault_init);
+
+/*
+ * Whether pagenum of a private area's object would read as zeros because
+ * nothing was ever put there: no object down the chain has it resident or
+ * in swap, and the bottom one is anonymous. Such an area is private, so
+ * no one else's writes can show through the zero page later.
+ */
+static int fault_is_zero(vmarea_t *vma, uint32_t pagenum) {
+  mmobj_t *obj = vma->vma_obj;
+
+  if (!(vma->vma_flags & MAP_PRIVATE))
+    return 0;
+  for (; NULL != obj->mmo_shadowed; obj = obj->mmo_shadowed) {
+    if (NULL != pframe_get_resident(obj, pagenum) || swap_has(obj, pagenum))
+      return 0;
+  }
+  return anon_is(obj) && NULL == pframe_get_resident(obj, pagenum) &&
+         !swap_has(obj, pagenum);
+}
+
+/*
+ * Finds the resident page which backs pagenum of obj as seen from above:
+ * the one in the highest object of the shadow chain which has it. A
+ * page missing from an upper object has never been copied there unless
+ * it is in swap, in which case there is nothing to map without reading
+ * it back.
+ */
+static pframe_t *fault_around_page(mmobj_t *obj, uint32_t pagenum) {
+  pframe_t *pf;
+
+  for (; NULL != obj; obj = obj->mmo_shadowed) {
+    if (NULL != (pf = pframe_get_resident(obj, pagenum)))
+      return pf;
+    /* the version below is out of date */
+    if (swap_has(obj, pagenum))
+      return NULL;
+  }
+  return NULL;
+}
+
+/*
+ * After a read fault on an area which can't be written, also maps the
+ * pages around vfn which are already resident (those being read or
+ * written back are left for later faults), so that running through a
+ * program's text or a read-only file takes one fault per window rather
+ * than one per page. Only read-only areas qualify, so no writable entry
+ * is ever replaced by a read-only one. An area advised MADV_RANDOM gets
+ * no fault-around, and one advised MADV_SEQUENTIAL gets the window
+ * FAULT_AHEAD_PAGES ahead of vfn instead of the one around it.
+ */
+static void fault_around(vmarea_t *vma, uint32_t vfn) {
+  uint32_t lo, hi;
+  pframe_t *pf;
+
+  if (MADV_RANDOM == vma->vma_advice)
+    return;
+  if (MADV_SEQUENTIAL == vma->vma_advice) {
+    lo = vfn;
+    hi = vfn + FAULT_AHEAD_PAGES;
+  } else {
+    lo = vfn - vfn % FAULT_AROUND_PAGES;
+    hi = lo + FAULT_AROUND_PAGES;
+  }
+  lo = MAX(lo, vma->vma_start);
+  hi = MIN(hi, vma->vma_end);
+  for (; lo < hi; ++lo) {
+    if (lo == vfn)
+      continue;
+    pf = fault_around_page(vma->vma_obj, vma->vma_off + lo - vma->vma_start);
+    if (NULL == pf || pframe_is_busy(pf))
+      continue;
+    if (0 > pt_map(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lo),
+                   pt_virt_to_phys((uintptr_t)pf->pf_addr),
+                   PD_PRESENT | PD_WRITE | PD_USER, PT_PRESENT | PT_USER))
+      return;
+    pframe_add_mapping(pf, vma, (uintptr_t)PN_TO_ADDR(lo));
+    tlb_flush((uintptr_t)PN_TO_ADDR(lo));
+  }
+}
+
+/*
+ * Before a fault on an area advised MADV_SEQUENTIAL: if the area maps a
+ * file and the page is not in its cache, read the file ahead from there
+ * rather than a page per fault. And since a sequential reader won't be
+ * back, the page FAULT_AHEAD_PAGES behind becomes the pager's first
+ * choice.
+ */
+static void fault_ahead(vmarea_t *vma, uint32_t vfn) {
+  mmobj_t *bottom = mmobj_bottom_obj(vma->vma_obj);
+  uint32_t pagenum = vma->vma_off + vfn - vma->vma_start;
+  vnode_t *vn;
+  pframe_t *pf;
+
+  if (vfn >= vma->vma_start + FAULT_AHEAD_PAGES &&
+      NULL != (pf = fault_around_page(vma->vma_obj,
+                                      pagenum - FAULT_AHEAD_PAGES)))
+    pframe_reclaim_soon(pf);
+  if (NULL != (vn = vnode_of_mmobj(bottom)) &&
+      NULL == pframe_get_resident(bottom, pagenum))
+    vnode_readahead(vn, pagenum,
+                    pagenum + MIN(FAULT_AHEAD_PAGES, vma->vma_end - vfn));
+}
+
+/*
+ * Finds the page backing vfn of the area, dirtying it first if it is
+ * wanted for writing, and maps it into the current process. Returns 0 or
+ * -errno.
+ */
+static int fault_in(vmarea_t *vma, uint32_t vfn, int forwrite) {
+  uint32_t pagenum = vma->vma_off + vfn - vma->vma_start;
+  pframe_t *pf;
+  int ret;
+
+  if (!forwrite && fault_is_zero(vma, pagenum)) {
+    if (0 > (ret = pt_map(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(vfn),
+                          fault_zero_paddr, PD_PRESENT | PD_WRITE | PD_USER,
+                          PT_PRESENT | PT_USER)))
+      return ret;
+    tlb_flush((uintptr_t)PN_TO_ADDR(vfn));
+    fault_zero_maps++;
+    return 0;
+  }
+
+  ret = pframe_lookup(vma->vma_obj, pagenum, forwrite, &pf);
+  /*
+   * A page is only ever mapped writable once it has been dirtied, and
+   * cleaning it removes it from the page tables again, so the first write
+   * after each clean faults here and reaches pframe_dirty. That is how
+   * stores through a shared mapping find their way back to the file.
+   */
+  if (0 <= ret && forwrite) {
+    pframe_pin(pf);
+    ret = pframe_dirty(pf);
+    pframe_unpin(pf);
+  }
+  if (0 > ret)
+    return ret;
+
+  if (0 > (ret = pt_map(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(vfn),
+                        pt_virt_to_phys((uintptr_t)pf->pf_addr),
+                        PD_PRESENT | PD_WRITE | PD_USER,
+                        PT_PRESENT | PT_USER | (forwrite ? PT_WRITE : 0))))
+    return ret;
+  pframe_add_mapping(pf, vma, (uintptr_t)PN_TO_ADDR(vfn));
+  tlb_flush((uintptr_t)PN_TO_ADDR(vfn));
+  return 0;
+}
+
+/*
+ * Faults in the pages [lo, hi) of an area of the current process ahead
+ * of use, writable if the area is, so that touching them later takes no
+ * faults. Stops at the first page which can't be had.
+ */
+int vm_populate(vmarea_t *vma, uint32_t lo, uint32_t hi) {
+  int ret;
+
+  KASSERT(curproc->p_vmmap == vma->vma_vmmap);
+  KASSERT(vma->vma_start <= lo && hi <= vma->vma_end);
+  for (; lo < hi; ++lo) {
+    if (0 > (ret = fault_in(vma, lo, !!(vma->vma_prot & PROT_WRITE))))
+      return ret;
+  }
+  return 0;
+}
 
 /*
  * This gets called by _pt_fault_handler in mm/pagetable.c The
@@ -48,6 +240,69 @@
  *              address which caused the fault, possible values
  *              can be found in pagefault.h
  */
+/* How long faults took, by kind, for pagefault_info */
+#define FAULT_KIND_READ 0
+#define FAULT_KIND_WRITE 1
+#define FAULT_KIND_COW 2 /* a write to a present page */
+#define FAULT_KIND_EXEC 3
+#define FAULT_NKINDS 4
+
+static const char *fault_kind_names[FAULT_NKINDS] = {"read", "write", "cow",
+                                                     "exec"};
+static hist_t fault_hists[FAULT_NKINDS];
+
+static int fault_kind(uint32_t cause) {
+  if (cause & FAULT_WRITE)
+    return (cause & FAULT_PRESENT) ? FAULT_KIND_COW : FAULT_KIND_WRITE;
+  return (cause & FAULT_EXEC) ? FAULT_KIND_EXEC : FAULT_KIND_READ;
+}
+
+size_t pagefault_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  int i;
+
+  KASSERT(NULL == arg);
+  hist_iprintf_header(&buf, &size);
+  for (i = 0; i < FAULT_NKINDS; i++)
+    hist_iprintf(&buf, &size, fault_kind_names[i], &fault_hists[i]);
+  iprintf(&buf, &size, "zero page maps: %u\n", fault_zero_maps);
+  return size;
+}
+
 void handle_pagefault(uintptr_t vaddr, uint32_t cause) {
-  NOT_YET_IMPLEMENTED("VM: handle_pagefault");
+  uint32_t vfn = ADDR_TO_PN(vaddr);
+  int forwrite = !!(cause & FAULT_WRITE);
+  uint64_t start = time_cycles();
+  vmarea_t *vma;
+  int perm, ret;
+
+  trace(TRACE_FAULT_BEGIN, vaddr, cause);
+  if (forwrite)
+    perm = PROT_WRITE;
+  else if (cause & FAULT_EXEC)
+    perm = PROT_EXEC;
+  else
+    perm = PROT_READ;
+  if (NULL == (vma = vmmap_lookup(curproc->p_vmmap, vfn)) ||
+      (vma->vma_prot & perm) != perm) {
+    dbg(DBG_VM, "pid %d: bad access to 0x%08x (cause 0x%x)\n",
+        curproc->p_pid, vaddr, cause);
+    proc_kill(curproc, EFAULT);
+    goto out;
+  }
+
+  if (MADV_SEQUENTIAL == vma->vma_advice)
+    fault_ahead(vma, vfn);
+  if (0 > (ret = fault_in(vma, vfn, forwrite))) {
+    dbg(DBG_VM, "pid %d: fault on 0x%08x failed: %d\n", curproc->p_pid,
+        vaddr, ret);
+    proc_kill(curproc, EFAULT);
+    goto out;
+  }
+
+  if (!forwrite && !(vma->vma_prot & PROT_WRITE))
+    fault_around(vma, vfn);
+out:
+  hist_add_since(&fault_hists[fault_kind(cause)], start);
+  trace(TRACE_FAULT_END, vaddr, 0);
 }
@@ -1,3 +1,4 @@
+#include "config.h"
 #include "globals.h"
 #include "errno.h"
 
@@ -8,16 +9,25 @@
 #include "mm/pframe.h"
 #include "mm/mm.h"
 #include "mm/page.h"
+#include "mm/pagetable.h"
 #include "mm/slab.h"
 #include "mm/tlb.h"
 
+#include "proc/proc.h"
+#include "proc/kmutex.h"
+
 #include "vm/vmmap.h"
+#include "vm/anon.h"
 #include "vm/shadow.h"
 #include "vm/shadowd.h"
+#include "vm/swap.h"
 
 #define SHADOW_SINGLETON_THRESHOLD 5
 
 int shadow_count = 0; /* for debugging/verification purposes */
+unsigned int shadow_collapsed = 0; /* shadow objects removed from chains */
+unsigned int shadow_migrated = 0;  /* pages moved up by those removals */
+unsigned int shadow_flattened = 0; /* chains copied out by fork */
 #ifdef __SHADOWD__
 /*
  * number of shadow objects with a single parent, that is another shadow
@@ -27,6 +37,9 @@ static int shadow_singleton_count = 0;
 #endif
 
 static slab_allocator_t *shadow_allocator;
+/* Collapsing blocks on pages being written to swap, and two collapses
+ * of one chain at once would move the same pages */
+static kmutex_t shadow_collapse_mutex;
 
 static void shadow_ref(mmobj_t *o);
 static void shadow_put(mmobj_t *o);
@@ -35,8 +48,10 @@ static int shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite,
 static int shadow_fillpage(mmobj_t *o, pframe_t *pf);
 static int shadow_dirtypage(mmobj_t *o, pframe_t *pf);
 static int shadow_cleanpage(mmobj_t *o, pframe_t *pf);
+static int shadow_find(mmobj_t *o, uint32_t pagenum, pframe_t **pf);
 
-static mmobj_ops_t shadow_mmobj_ops = {.ref = shadow_ref,
+static mmobj_ops_t shadow_mmobj_ops = {.name = "shadow",
+                                       .ref = shadow_ref,
                                        .put = shadow_put,
                                        .lookuppage = shadow_lookuppage,
                                        .fillpage = shadow_fillpage,
@@ -48,7 +63,11 @@ static mmobj_ops_t shadow_mmobj_ops = {.ref = shadow_ref,
  * shadow page sub system. Currently it only initializes the
  * shadow_allocator object.
  */
-void shadow_init() { NOT_YET_IMPLEMENTED("VM: shadow_init"); }
+void shadow_init() {
+  shadow_allocator = slab_allocator_create("shadow", sizeof(mmobj_t));
+  KASSERT(NULL != shadow_allocator && "failed to create shadow allocator!");
+  kmutex_init(&shadow_collapse_mutex);
+}
 
 /*
  * You'll want to use the shadow_allocator to allocate the mmobj to
@@ -57,8 +76,151 @@ void shadow_init() { NOT_YET_IMPLEMENTED("VM: shadow_init"); }
  * reference count is correct.
  */
 mmobj_t *shadow_create() {
-  NOT_YET_IMPLEMENTED("VM: shadow_create");
-  return NULL;
+  mmobj_t *o = (mmobj_t *)slab_obj_alloc(shadow_allocator);
+  if (o) {
+    mmobj_init(o, &shadow_mmobj_ops);
+    o->mmo_refcount = 1;
+    o->mmo_un.mmo_bottom_obj = NULL;
+    shadow_count++;
+  }
+  return o;
+}
+
+/* Returns the number of shadow objects from o down to the bottom object */
+int shadow_depth(mmobj_t *o) {
+  int depth = 0;
+
+  for (; NULL != o->mmo_shadowed; o = o->mmo_shadowed)
+    depth++;
+  return depth;
+}
+
+/*
+ * Removes the unnecessary shadow objects under an area: those which are
+ * not the area's own object and have only one parent, whose pages can
+ * be moved up into the nearest object above them that has two or more
+ * parents (or is the area's).
+ */
+void shadow_collapse(vmarea_t *vma) {
+  mmobj_t *last = vma->vma_obj, *o = last->mmo_shadowed;
+  pframe_t *pf;
+
+  kmutex_lock(&shadow_collapse_mutex);
+  /* ref last, so should every process on this branch die while this
+   * blocks, the branch won't be destroyed until we are done with it */
+  last->mmo_ops->ref(last);
+  while (NULL != o && NULL != o->mmo_shadowed) {
+    mmobj_t *shadow = o->mmo_shadowed;
+    KASSERT(o != last);
+    if (o->mmo_refcount - o->mmo_nrespages == 1) {
+    again:
+      list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+        /* Pages below the top are only busy being read from or written
+         * to swap, and may be gone once that is done */
+        if (pframe_is_busy(pf)) {
+          sched_sleep_on(pframe_waitq(pf));
+          goto again;
+        }
+        /* o has refcount 1+nrespages, so this won't delete it yet */
+        if (swap_has(last, pf->pf_pagenum)) {
+          /* last's own version of the page is in swap */
+          if (pframe_is_pinned(pf))
+            pframe_unpin(pf);
+          pframe_free(pf);
+        } else {
+          pframe_migrate(pf, last);
+          shadow_migrated++;
+        }
+      }
+      list_iterate_end();
+      swap_move(o, last);
+      last->mmo_shadowed = shadow;
+      /* Ref o's shadowed, so we don't delete it when we put o */
+      shadow->mmo_ops->ref(shadow);
+      KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
+      o->mmo_ops->put(o);
+      shadow_collapsed++;
+    } else {
+      o->mmo_ops->ref(o);
+      last->mmo_ops->put(last);
+      last = o;
+    }
+    o = shadow;
+  }
+  last->mmo_ops->put(last);
+  kmutex_unlock(&shadow_collapse_mutex);
+}
+
+/* Collapses the chains of every area over the given bottom object */
+void shadow_collapse_all(mmobj_t *bottom) {
+  vmarea_t *vma;
+
+  KASSERT(NULL == bottom->mmo_shadowed);
+  list_iterate_begin(&bottom->mmo_un.mmo_vmas, vma, vmarea_t, vma_olink) {
+    if (NULL != vma->vma_obj->mmo_shadowed &&
+        NULL != vma->vma_obj->mmo_shadowed->mmo_shadowed)
+      shadow_collapse(vma);
+  }
+  list_iterate_end();
+}
+
+/*
+ * Replaces the chain under a private area with one new shadow object
+ * straight over the bottom object, holding a copy of each page any
+ * shadow object in the chain has. For chains which collapsing can't
+ * shorten because others share them. Returns 0 or -ENOMEM.
+ */
+int shadow_flatten(vmarea_t *vma) {
+  mmobj_t *top = vma->vma_obj, *bottom, *flat;
+  pframe_t *pf;
+  uint32_t pagenum, npages;
+  proc_t *p;
+  tlb_batch_t tb;
+  int ret;
+
+  KASSERT(NULL != top->mmo_shadowed);
+  bottom = top->mmo_un.mmo_bottom_obj;
+  if (NULL == (flat = shadow_create()))
+    return -ENOMEM;
+  /* Filled through the old chain until it has every page the chain has */
+  top->mmo_ops->ref(top);
+  flat->mmo_shadowed = top;
+  flat->mmo_un.mmo_bottom_obj = bottom;
+  npages = vma->vma_end - vma->vma_start;
+  for (pagenum = vma->vma_off; pagenum < vma->vma_off + npages; pagenum++) {
+    if (0 > (ret = shadow_find(top, pagenum, &pf)))
+      goto fail;
+    if (NULL == pf)
+      continue;
+    if (0 > (ret = pframe_get(flat, pagenum, &pf)))
+      goto fail;
+    /* The copy is now the only one, so it must be written out if paged
+     * out */
+    if (0 > (ret = pframe_dirty(pf)))
+      goto fail;
+  }
+  bottom->mmo_ops->ref(bottom);
+  flat->mmo_shadowed = bottom;
+  top->mmo_ops->put(top);
+
+  /* The area may have the chain's pages mapped, writably in the case of
+   * its own ones */
+  p = vma->vma_vmmap->vmm_proc;
+  pt_unmap_range(p->p_pagedir, (uintptr_t)PN_TO_ADDR(vma->vma_start),
+                 (uintptr_t)PN_TO_ADDR(vma->vma_end));
+  if (pt_get() == p->p_pagedir) {
+    tlb_batch_init(&tb);
+    tlb_batch_add_range(&tb, (uintptr_t)PN_TO_ADDR(vma->vma_start), npages);
+    tlb_batch_flush(&tb);
+  }
+  vma->vma_obj = flat;
+  top->mmo_ops->put(top);
+  shadow_flattened++;
+  return 0;
+
+fail:
+  flat->mmo_ops->put(flat);
+  return ret;
 }
 
 /* Implementation of mmobj entry points: */
@@ -66,7 +228,10 @@ mmobj_t *shadow_create() {
 /*
  * Increment the reference count on the object.
  */
-static void shadow_ref(mmobj_t *o) { NOT_YET_IMPLEMENTED("VM: shadow_ref"); }
+static void shadow_ref(mmobj_t *o) {
+  KASSERT(o && (0 < o->mmo_refcount) && (&shadow_mmobj_ops == o->mmo_ops));
+  o->mmo_refcount++;
+}
 
 /*
  * Decrement the reference count on the object. If, however, the
@@ -76,7 +241,51 @@ static void shadow_ref(mmobj_t *o) { NOT_YET_IMPLEMENTED("VM: shadow_ref"); }
  * be used again. You should unpin and uncache all of the object's
  * pages and then free the object itself.
  */
-static void shadow_put(mmobj_t *o) { NOT_YET_IMPLEMENTED("VM: shadow_put"); }
+static void shadow_put(mmobj_t *o) {
+  pframe_t *pf;
+  mmobj_t *shadowed;
+
+  KASSERT(o && (0 < o->mmo_refcount) && (&shadow_mmobj_ops == o->mmo_ops));
+  if (o->mmo_nrespages == o->mmo_refcount - 1) {
+    list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+      while (pframe_is_busy(pf))
+        sched_sleep_on(pframe_waitq(pf));
+      while (pframe_is_pinned(pf))
+        pframe_unpin(pf);
+      pframe_free(pf);
+    }
+    list_iterate_end();
+  }
+  if (0 == --o->mmo_refcount) {
+    KASSERT(0 == o->mmo_nrespages);
+    swap_release(o);
+    shadowed = o->mmo_shadowed;
+    slab_obj_free(shadow_allocator, o);
+    shadow_count--;
+    if (shadowed)
+      shadowed->mmo_ops->put(shadowed);
+  }
+}
+
+/* Finds the first object from o down the chain, short of the bottom
+ * object, with the page resident or in swap, and returns the page once
+ * it is resident and not busy; *pf is NULL if none of them has it */
+static int shadow_find(mmobj_t *o, uint32_t pagenum, pframe_t **pf) {
+  while (NULL != o->mmo_shadowed) {
+    if (NULL != (*pf = pframe_get_resident(o, pagenum))) {
+      if (!pframe_is_busy(*pf))
+        return 0;
+      /* It may have been freed once it stops being busy, so look again */
+      sched_sleep_on(pframe_waitq(*pf));
+      continue;
+    }
+    if (swap_has(o, pagenum))
+      return pframe_get(o, pagenum, pf);
+    o = o->mmo_shadowed;
+  }
+  *pf = NULL;
+  return 0;
+}
 
 /* This function looks up the given page in this shadow object. The
  * forwrite argument is true if the page is being looked up for
@@ -89,8 +298,13 @@ static void shadow_put(mmobj_t *o) { NOT_YET_IMPLEMENTED("VM: shadow_put"); }
  * can overflow the kernel stack when looking down a long shadow chain */
 static int shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite,
                              pframe_t **pf) {
-  NOT_YET_IMPLEMENTED("VM: shadow_lookuppage");
-  return 0;
+  int ret;
+
+  if (forwrite)
+    return pframe_get(o, pagenum, pf);
+  if (0 > (ret = shadow_find(o, pagenum, pf)) || NULL != *pf)
+    return ret;
+  return pframe_lookup(o->mmo_un.mmo_bottom_obj, pagenum, 0, pf);
 }
 
 /* As per the specification in mmobj.h, fill the page frame starting
@@ -105,18 +319,46 @@ static int shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite,
  * recursive implementation can overflow the kernel stack when
  * looking down a long shadow chain */
 static int shadow_fillpage(mmobj_t *o, pframe_t *pf) {
-  NOT_YET_IMPLEMENTED("VM: shadow_fillpage");
+  mmobj_t *bottom;
+  pframe_t *src;
+  int ret;
+
+  KASSERT(pframe_is_busy(pf));
+  KASSERT(NULL != o->mmo_shadowed);
+  /* Our own version of the page may be in swap */
+  if (0 > (ret = swap_in(o, pf)))
+    return ret;
+  if (0 == ret) {
+    if (0 > (ret = shadow_find(o->mmo_shadowed, pf->pf_pagenum, &src)))
+      return ret;
+    bottom = o->mmo_un.mmo_bottom_obj;
+    if (NULL == src && anon_is(bottom) &&
+        NULL == pframe_get_resident(bottom, pf->pf_pagenum) &&
+        !swap_has(bottom, pf->pf_pagenum)) {
+      /* Demand-zero: the anonymous object would only make a page of
+       * zeros to copy, so don't give it one */
+      memset(pf->pf_addr, 0, PAGE_SIZE);
+    } else {
+      if (NULL == src &&
+          0 > (ret = pframe_lookup(bottom, pf->pf_pagenum, 0, &src)))
+        return ret;
+      memcpy(pf->pf_addr, src->pf_addr, PAGE_SIZE);
+    }
+  }
+  /* Without swap the copy is the only one there is, so it must never be
+   * paged out */
+  if (!swap_enabled())
+    pframe_pin(pf);
   return 0;
 }
 
 /* These next two functions are not difficult. */
 
 static int shadow_dirtypage(mmobj_t *o, pframe_t *pf) {
-  NOT_YET_IMPLEMENTED("VM: shadow_dirtypage");
-  return -1;
+  swap_discard(o, pf->pf_pagenum);
+  return 0;
 }
 
 static int shadow_cleanpage(mmobj_t *o, pframe_t *pf) {
-  NOT_YET_IMPLEMENTED("VM: shadow_cleanpage");
-  return -1;
+  return swap_out(o, pf);
 }
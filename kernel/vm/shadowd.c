@@ -11,6 +11,9 @@
 #include "proc/sched.h"
 #include "proc/kthread.h"
 
+#include "vm/vmmap.h"
+#include "vm/shadow.h"
+
 #ifdef __SHADOWD__
 static ktqueue_t shadowd_waitq, kmem_alloc_waitq;
 static int shadowd_initialized = 0;
@@ -57,46 +60,7 @@ static void *shadowd(int arg1, void *arg2) {
       if (PROC_RUNNING == p->p_state) {
         vmarea_t *vma;
         list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
-          mmobj_t *last = vma->vma_obj, *o = last->mmo_shadowed;
-          /* ref last, so if all processes on this branch die while shadowd is
-           * sleeping, the branch won't get destroyed until shadowd() is done
-           * with it */
-          last->mmo_ops->ref(last);
-          while (NULL != o && NULL != o->mmo_shadowed) {
-            mmobj_t *shadow = o->mmo_shadowed;
-            /* iff the object has only one parent, and is not right under
-             * vm_area */
-            KASSERT(o != last);
-            if (o->mmo_refcount - o->mmo_nrespages == 1) {
-              /* migrate all its pages to last, and remove it from the shadow
-               * tree */
-              pframe_t *pf;
-              list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
-                /* Because the operations that could be
-                 * performed with an intermediate shadow object
-                 * to make pages busy are non-blocking,
-                 * we always expect to see non-busy pages. */
-                KASSERT(!pframe_is_busy(pf));
-                /* o has refcount 1+nrespages, so this won't delete it yet */
-                pframe_migrate(pf, last);
-              }
-              list_iterate_end();
-              last->mmo_shadowed = o->mmo_shadowed;
-              /* Ref o's shadowed, so we don't accidentally delete it when we
-               * finally put o */
-              o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
-              KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
-              o->mmo_ops->put(o);
-            } else {
-              KASSERT(o->mmo_refcount - o->mmo_nrespages == 2);
-              o->mmo_ops->ref(o);
-              last->mmo_ops->put(last);
-              last = o;
-            }
-            o = shadow;
-          }
-          KASSERT(NULL != last);
-          last->mmo_ops->put(last);
+          shadow_collapse(vma);
         }
         list_iterate_end();
       }
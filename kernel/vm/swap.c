@@ -0,0 +1,282 @@
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/lz.h"
+#include "util/string.h"
+
+#include "drivers/dev.h"
+#include "drivers/blockdev.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mm.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "vm/swap.h"
+
+/* The swap device is the second disk; a slot is one block, one page */
+#define SWAP_DEVID MKDEVID(DISK_MAJOR, 1)
+
+#define SWAP_HASH_ORDER 10
+#define SWAP_HASH_MULT 0x9e3779b1U
+#define hash_swap(obj, pagenum)                                                \
+  (((((uint32_t)(obj)) * SWAP_HASH_MULT >> (32 - SWAP_HASH_ORDER)) +           \
+    (pagenum)) & ((1U << SWAP_HASH_ORDER) - 1))
+
+/* Bit n of the map is set when slot n is free */
+#define SWAP_MAP_WORDS(nbits) (((nbits) + 31) / 32)
+#define swap_map_isset(n) (swap_map[(n) / 32] & (1U << ((n) % 32)))
+#define swap_map_set(n) (swap_map[(n) / 32] |= 1U << ((n) % 32))
+#define swap_map_clear(n) (swap_map[(n) / 32] &= ~(1U << ((n) % 32)))
+
+#define SWAP_NO_SLOT ((uint32_t)-1)
+
+/* The slot holding a page: a compressed copy, or a block on the device */
+typedef struct swap_entry {
+  mmobj_t *se_obj;
+  uint32_t se_pagenum;
+  uint32_t se_slot;  /* or SWAP_NO_SLOT */
+  void *se_zdata;    /* NULL unless se_slot is SWAP_NO_SLOT */
+  uint32_t se_zlen;
+  list_link_t se_hlink; /* on the hash chain for (se_obj, se_pagenum) */
+  list_link_t se_olink; /* on se_obj's mmo_swapped */
+} swap_entry_t;
+
+uint32_t swap_nslots = 0;
+uint32_t swap_nused = 0;
+uint32_t swap_nzpages = 0;
+uint32_t swap_nzbytes = 0;
+
+static blockdev_t *swap_bdev = NULL;
+static uint32_t *swap_map = NULL;
+static uint32_t swap_rotor = 0;
+static list_t swap_hash[1 << SWAP_HASH_ORDER];
+static slab_allocator_t *swap_entry_allocator;
+/* Pages are compressed here before being copied out at their size */
+static char swap_zbuf[SWAP_ZCACHE_MAX_LEN];
+
+static __attribute__((unused)) void swap_init() {
+  uint32_t i, npages;
+
+  swap_entry_allocator =
+      slab_allocator_create("swap_entry", sizeof(swap_entry_t));
+  KASSERT(NULL != swap_entry_allocator);
+  for (i = 0; i < (1U << SWAP_HASH_ORDER); i++)
+    list_init(&swap_hash[i]);
+
+  if (NULL == (swap_bdev = blockdev_lookup(SWAP_DEVID))) {
+    dbg(DBG_VM, "no swap device\n");
+    return;
+  }
+  swap_nslots = swap_bdev->bd_nblocks;
+  npages = (uint32_t)PAGE_ALIGN_UP(SWAP_MAP_WORDS(swap_nslots) *
+                                   sizeof(uint32_t)) >> PAGE_SHIFT;
+  if (0 == swap_nslots || NULL == (swap_map = page_alloc_n(npages))) {
+    swap_bdev = NULL;
+    swap_nslots = 0;
+    return;
+  }
+  memset(swap_map, 0, npages << PAGE_SHIFT);
+  for (i = 0; i < swap_nslots; i++)
+    swap_map_set(i);
+  dbg(DBG_VM, "swapping to disk 1, %u slots\n", swap_nslots);
+}
+init_func(swap_init);
+
+/*
+ * Returns the first free slot at or after the rotor, wrapping around the
+ * end of the device, or -ENOSPC.
+ */
+static int swap_alloc_slot(void) {
+  uint32_t nwords = SWAP_MAP_WORDS(swap_nslots);
+  uint32_t i, w = 0, bits = 0;
+
+  if (swap_nused == swap_nslots)
+    return -ENOSPC;
+  if (swap_rotor >= swap_nslots)
+    swap_rotor = 0;
+  /* the word holding the rotor is looked at twice: first from the rotor
+   * up, and last, after wrapping around, below it */
+  for (i = 0; i <= nwords; ++i) {
+    w = (swap_rotor / 32 + i) % nwords;
+    bits = swap_map[w];
+    if (0 == i)
+      bits &= ~0U << (swap_rotor % 32);
+    if (bits)
+      break;
+  }
+  KASSERT(bits && "swap_nused is wrong");
+  swap_rotor = w * 32 + __builtin_ctz(bits);
+  swap_map_clear(swap_rotor);
+  swap_nused++;
+  return swap_rotor++;
+}
+
+static swap_entry_t *swap_lookup(mmobj_t *o, uint32_t pagenum) {
+  swap_entry_t *se;
+  list_iterate_begin(&swap_hash[hash_swap(o, pagenum)], se, swap_entry_t,
+                     se_hlink) {
+    if (o == se->se_obj && pagenum == se->se_pagenum)
+      return se;
+  }
+  list_iterate_end();
+  return NULL;
+}
+
+/* Frees what the entry holds the page in, leaving it with neither */
+static void swap_entry_clear(swap_entry_t *se) {
+  if (NULL != se->se_zdata) {
+    kfree(se->se_zdata);
+    se->se_zdata = NULL;
+    swap_nzpages--;
+    swap_nzbytes -= se->se_zlen;
+  } else if (SWAP_NO_SLOT != se->se_slot) {
+    KASSERT(!swap_map_isset(se->se_slot) && "double free");
+    swap_map_set(se->se_slot);
+    swap_nused--;
+  }
+  se->se_slot = SWAP_NO_SLOT;
+}
+
+static void swap_entry_free(swap_entry_t *se) {
+  swap_entry_clear(se);
+  list_remove(&se->se_hlink);
+  list_remove(&se->se_olink);
+  slab_obj_free(swap_entry_allocator, se);
+}
+
+int swap_enabled() { return NULL != swap_bdev || swap_zcache_enabled(); }
+
+int swap_zcache_enabled() { return 0 < SWAP_ZCACHE_PAGES; }
+
+int swap_has(mmobj_t *o, uint32_t pagenum) {
+  return swap_enabled() && NULL != swap_lookup(o, pagenum);
+}
+
+int swap_in(mmobj_t *o, pframe_t *pf) {
+  swap_entry_t *se;
+  blockdev_iovec_t iov = {pf->pf_addr, 1};
+  int ret;
+
+  KASSERT(pframe_is_busy(pf));
+  if (!swap_enabled() || NULL == (se = swap_lookup(o, pf->pf_pagenum)))
+    return 0;
+  if (NULL != se->se_zdata) {
+    if (PAGE_SIZE != lz_decompress(se->se_zdata, se->se_zlen, pf->pf_addr,
+                                   PAGE_SIZE))
+      panic("swap: compressed copy of page %u of %p is corrupt\n",
+            pf->pf_pagenum, o);
+    return 1;
+  }
+  if (0 > (ret = blockdev_readv(swap_bdev, &iov, 1, se->se_slot)))
+    return ret;
+  return 1;
+}
+
+/*
+ * Keeps a compressed copy of the page in place of whatever the entry
+ * had, if it compresses well enough and the cache has room. Returns 0,
+ * or -ENOSPC if the page should go to the device instead.
+ */
+static int swap_zcache_out(swap_entry_t *se, pframe_t *pf) {
+  size_t len;
+  void *zdata;
+
+  if (!swap_zcache_enabled() ||
+      0 == (len = lz_compress(pf->pf_addr, PAGE_SIZE, swap_zbuf,
+                              sizeof(swap_zbuf))))
+    return -ENOSPC;
+  if (swap_nzbytes + len > (uint32_t)SWAP_ZCACHE_PAGES << PAGE_SHIFT ||
+      NULL == (zdata = kmalloc(len)))
+    return -ENOSPC;
+  memcpy(zdata, swap_zbuf, len);
+  swap_entry_clear(se);
+  se->se_zdata = zdata;
+  se->se_zlen = len;
+  swap_nzpages++;
+  swap_nzbytes += len;
+  return 0;
+}
+
+int swap_out(mmobj_t *o, pframe_t *pf) {
+  swap_entry_t *se;
+  blockdev_iovec_t iov = {pf->pf_addr, 1};
+  int ret;
+
+  KASSERT(pframe_is_busy(pf));
+  if (!swap_enabled())
+    return 0;
+  if (NULL == (se = swap_lookup(o, pf->pf_pagenum))) {
+    if (NULL == (se = slab_obj_alloc(swap_entry_allocator)))
+      return -ENOMEM;
+    se->se_obj = o;
+    se->se_pagenum = pf->pf_pagenum;
+    se->se_slot = SWAP_NO_SLOT;
+    se->se_zdata = NULL;
+    list_insert_head(&swap_hash[hash_swap(o, pf->pf_pagenum)], &se->se_hlink);
+    list_insert_tail(&o->mmo_swapped, &se->se_olink);
+  }
+  /* Compression doesn't block, so the cache is tried first */
+  if (0 == swap_zcache_out(se, pf))
+    return 0;
+  if (NULL == swap_bdev) {
+    swap_entry_free(se);
+    return -ENOSPC;
+  }
+  if (SWAP_NO_SLOT == se->se_slot) {
+    swap_entry_clear(se);
+    if (0 > (ret = swap_alloc_slot())) {
+      swap_entry_free(se);
+      return ret;
+    }
+    se->se_slot = ret;
+  }
+  /* The page is busy, so nothing reads the slot until this is done */
+  if (0 > (ret = blockdev_writev(swap_bdev, &iov, 1, se->se_slot))) {
+    swap_entry_free(se);
+    return ret;
+  }
+  return 0;
+}
+
+void swap_discard(mmobj_t *o, uint32_t pagenum) {
+  swap_entry_t *se;
+  if (swap_enabled() && NULL != (se = swap_lookup(o, pagenum)))
+    swap_entry_free(se);
+}
+
+void swap_release(mmobj_t *o) {
+  swap_entry_t *se;
+  list_iterate_begin(&o->mmo_swapped, se, swap_entry_t, se_olink) {
+    swap_entry_free(se);
+  }
+  list_iterate_end();
+}
+
+void swap_move(mmobj_t *from, mmobj_t *to) {
+  swap_entry_t *se;
+  pframe_t *pf;
+
+  list_iterate_begin(&from->mmo_swapped, se, swap_entry_t, se_olink) {
+    /* to's own slot or dirty page is newer than this one */
+    if (NULL != swap_lookup(to, se->se_pagenum) ||
+        (NULL != (pf = pframe_get_resident(to, se->se_pagenum)) &&
+         pframe_is_dirty(pf))) {
+      swap_entry_free(se);
+    } else {
+      list_remove(&se->se_hlink);
+      list_remove(&se->se_olink);
+      se->se_obj = to;
+      list_insert_head(&swap_hash[hash_swap(to, se->se_pagenum)],
+                       &se->se_hlink);
+      list_insert_tail(&to->mmo_swapped, &se->se_olink);
+    }
+  }
+  list_iterate_end();
+}
@@ -5,6 +5,7 @@
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/swap.h"
 
 #include "proc/proc.h"
 
@@ -23,10 +24,15 @@
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
 
 static slab_allocator_t *vmmap_allocator;
 static slab_allocator_t *vmarea_allocator;
 
+static void vmarea_update(rb_node_t *node);
+
 void vmmap_init(void) {
   vmmap_allocator = slab_allocator_create("vmmap", sizeof(vmmap_t));
   KASSERT(NULL != vmmap_allocator && "failed to create vmmap allocator!");
@@ -38,6 +44,8 @@ vmarea_t *vmarea_alloc(void) {
   vmarea_t *newvma = (vmarea_t *)slab_obj_alloc(vmarea_allocator);
   if (newvma) {
     newvma->vma_vmmap = NULL;
+    newvma->vma_advice = MADV_NORMAL;
+    list_init(&newvma->vma_rmaps);
   }
   return newvma;
 }
@@ -50,20 +58,169 @@ void vmarea_free(vmarea_t *vma) {
 /* Create a new vmmap, which has no vmareas and does
  * not refer to a process. */
 vmmap_t *vmmap_create(void) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_create");
-  return NULL;
+  vmmap_t *map = (vmmap_t *)slab_obj_alloc(vmmap_allocator);
+  if (map) {
+    list_init(&map->vmm_list);
+    rb_init(&map->vmm_tree, vmarea_update);
+    map->vmm_cache = NULL;
+    map->vmm_proc = NULL;
+  }
+  return map;
+}
+
+/* Unlinks an area, which is no longer in its map, from its object, and
+ * frees it */
+static void vmarea_release(vmarea_t *vma) {
+  mmobj_t *bottom = NULL;
+
+  if (list_link_is_linked(&vma->vma_olink)) {
+    list_remove(&vma->vma_olink);
+    /* Shadow objects the area shared may be left with one parent, so
+     * collapse them now rather than leave every fault under them a
+     * level deeper */
+    if (NULL != vma->vma_obj->mmo_shadowed) {
+      bottom = mmobj_bottom_obj(vma->vma_obj);
+      bottom->mmo_ops->ref(bottom);
+    }
+  }
+  pframe_remove_mappings(vma);
+  if (vma->vma_obj)
+    vma->vma_obj->mmo_ops->put(vma->vma_obj);
+  vmarea_free(vma);
+  if (bottom) {
+    shadow_collapse_all(bottom);
+    bottom->mmo_ops->put(bottom);
+  }
 }
 
 /* Removes all vmareas from the address space and frees the
  * vmmap struct. */
-void vmmap_destroy(vmmap_t *map) { NOT_YET_IMPLEMENTED("VM: vmmap_destroy"); }
+void vmmap_destroy(vmmap_t *map) {
+  vmarea_t *vma;
+
+  KASSERT(NULL != map);
+  list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+    list_remove(&vma->vma_plink);
+    vmarea_release(vma);
+  }
+  list_iterate_end();
+  slab_obj_free(vmmap_allocator, map);
+}
+
+/* ------------------------------------------------------------------ */
+/* --------------------------- AREA TREE ---------------------------- */
+/* ------------------------------------------------------------------ */
+
+/* The neighbours of an area in address order, or NULL */
+static vmarea_t *vmarea_prev(vmmap_t *map, vmarea_t *vma) {
+  if (vma->vma_plink.l_prev == &map->vmm_list)
+    return NULL;
+  return list_item(vma->vma_plink.l_prev, vmarea_t, vma_plink);
+}
+
+static vmarea_t *vmarea_next(vmmap_t *map, vmarea_t *vma) {
+  if (vma->vma_plink.l_next == &map->vmm_list)
+    return NULL;
+  return list_item(vma->vma_plink.l_next, vmarea_t, vma_plink);
+}
+
+#define vma_of(node) rb_item(node, vmarea_t, vma_node)
+#define vma_maxgap_of(node) ((node) ? vma_of(node)->vma_maxgap : 0)
+
+/* The tree's augmentation: recomputes a node's vma_maxgap from its
+ * children's */
+static void vmarea_update(rb_node_t *node) {
+  vmarea_t *vma = vma_of(node);
+  uint32_t gap = vma->vma_gap;
+  gap = MAX(gap, vma_maxgap_of(node->rb_left));
+  gap = MAX(gap, vma_maxgap_of(node->rb_right));
+  vma->vma_maxgap = gap;
+}
+
+/* Recomputes an area's vma_gap, which changes with the previous area's
+ * end or its own start */
+static void vmarea_setgap(vmmap_t *map, vmarea_t *vma) {
+  vmarea_t *prev = vmarea_prev(map, vma);
+  vma->vma_gap = vma->vma_start - (prev ? prev->vma_end
+                                        : ADDR_TO_PN(USER_MEM_LOW));
+}
+
+/* And passes the change up the tree */
+static void vmarea_regap(vmmap_t *map, vmarea_t *vma) {
+  vmarea_setgap(map, vma);
+  rb_propagate(&map->vmm_tree, &vma->vma_node);
+}
+
+/* Takes an area out of its map's list and tree */
+static void vmmap_unlink(vmmap_t *map, vmarea_t *vma) {
+  vmarea_t *next = vmarea_next(map, vma);
+
+  if (map->vmm_cache == vma)
+    map->vmm_cache = NULL;
+  rb_remove(&map->vmm_tree, &vma->vma_node);
+  list_remove(&vma->vma_plink);
+  if (next)
+    vmarea_regap(map, next);
+  vma->vma_vmmap = NULL;
+}
+
+/* The area with the lowest start above vfn, or NULL */
+static vmarea_t *vmmap_lookup_after(vmmap_t *map, uint32_t vfn) {
+  rb_node_t *node = map->vmm_tree.rbt_root;
+  vmarea_t *found = NULL;
+
+  while (node) {
+    if (vfn < vma_of(node)->vma_start) {
+      found = vma_of(node);
+      node = node->rb_left;
+    } else {
+      node = node->rb_right;
+    }
+  }
+  return found;
+}
 
 /* Add a vmarea to an address space. Assumes (i.e. asserts to some extent)
  * the vmarea is valid.  This involves finding where to put it in the list
  * of VM areas, and adding it. Don't forget to set the vma_vmmap for the
  * area. */
 void vmmap_insert(vmmap_t *map, vmarea_t *newvma) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_insert");
+  rb_node_t **link = &map->vmm_tree.rbt_root, *parent = NULL;
+  vmarea_t *left, *next;
+
+  KASSERT(NULL != map && NULL != newvma);
+  KASSERT(NULL == newvma->vma_vmmap);
+  KASSERT(newvma->vma_start < newvma->vma_end);
+  KASSERT(ADDR_TO_PN(USER_MEM_LOW) <= newvma->vma_start &&
+          ADDR_TO_PN(USER_MEM_HIGH) >= newvma->vma_end);
+
+  /* left ends up as the last area to the left of the new one */
+  left = NULL;
+  while (*link) {
+    parent = *link;
+    if (newvma->vma_start < vma_of(parent)->vma_start) {
+      link = &parent->rb_left;
+    } else {
+      left = vma_of(parent);
+      link = &parent->rb_right;
+    }
+  }
+  KASSERT((!left || left->vma_end <= newvma->vma_start) &&
+          "overlapping vmareas");
+  if (left)
+    list_insert_before(left->vma_plink.l_next, &newvma->vma_plink);
+  else
+    list_insert_head(&map->vmm_list, &newvma->vma_plink);
+  next = vmarea_next(map, newvma);
+  KASSERT((!next || newvma->vma_end <= next->vma_start) &&
+          "overlapping vmareas");
+
+  newvma->vma_vmmap = map;
+  vmarea_setgap(map, newvma);
+  rb_link(&newvma->vma_node, parent, link);
+  rb_insert_fixup(&map->vmm_tree, &newvma->vma_node);
+  if (next)
+    vmarea_regap(map, next);
 }
 
 /* Find a contiguous range of free virtual pages of length npages in
@@ -72,17 +229,65 @@ void vmmap_insert(vmmap_t *map, vmarea_t *newvma) {
  *
  * Your algorithm should be first fit. If dir is VMMAP_DIR_HILO, you
  * should find a gap as high in the address space as possible; if dir
- * is VMMAP_DIR_LOHI, the gap should be as low as possible. */
+ * is VMMAP_DIR_LOHI, the gap should be as low as possible.
+ *
+ * The gaps before areas are found through the tree; only the one after
+ * the last area is not recorded in it. */
 int vmmap_find_range(vmmap_t *map, uint32_t npages, int dir) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_find_range");
-  return -1;
+  uint32_t hi = ADDR_TO_PN(USER_MEM_HIGH), tail = ADDR_TO_PN(USER_MEM_LOW);
+  rb_node_t *node = map->vmm_tree.rbt_root;
+  vmarea_t *last;
+
+  KASSERT(VMMAP_DIR_LOHI == dir || VMMAP_DIR_HILO == dir);
+  if (!list_empty(&map->vmm_list)) {
+    last = list_tail(&map->vmm_list, vmarea_t, vma_plink);
+    tail = last->vma_end;
+  }
+
+  if (VMMAP_DIR_HILO == dir && hi - tail >= npages)
+    return hi - npages;
+  if (vma_maxgap_of(node) < npages)
+    return (VMMAP_DIR_LOHI == dir && hi - tail >= npages) ? (int)tail : -1;
+
+  /* Every subtree descended into has a large enough gap */
+  while (1) {
+    rb_node_t *first = (VMMAP_DIR_LOHI == dir) ? node->rb_left : node->rb_right;
+    rb_node_t *second = (VMMAP_DIR_LOHI == dir) ? node->rb_right : node->rb_left;
+    if (vma_maxgap_of(first) >= npages) {
+      node = first;
+    } else if (vma_of(node)->vma_gap >= npages) {
+      break;
+    } else {
+      KASSERT(vma_maxgap_of(second) >= npages);
+      node = second;
+    }
+  }
+  if (VMMAP_DIR_LOHI == dir)
+    return vma_of(node)->vma_start - vma_of(node)->vma_gap;
+  return vma_of(node)->vma_start - npages;
 }
 
-/* Find the vm_area that vfn lies in. Simply scan the address space
- * looking for a vma whose range covers vfn. If the page is unmapped,
- * return NULL. */
+/* Find the vm_area that vfn lies in. If the page is unmapped, return
+ * NULL. Faults tend to come in runs on one area, so the area found last
+ * is tried first. */
 vmarea_t *vmmap_lookup(vmmap_t *map, uint32_t vfn) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_lookup");
+  vmarea_t *vma = map->vmm_cache;
+  rb_node_t *node;
+
+  KASSERT(NULL != map);
+  if (vma && vma->vma_start <= vfn && vfn < vma->vma_end)
+    return vma;
+  for (node = map->vmm_tree.rbt_root; node;) {
+    vma = vma_of(node);
+    if (vfn < vma->vma_start) {
+      node = node->rb_left;
+    } else if (vfn >= vma->vma_end) {
+      node = node->rb_right;
+    } else {
+      map->vmm_cache = vma;
+      return vma;
+    }
+  }
   return NULL;
 }
 
@@ -91,8 +296,30 @@ vmarea_t *vmmap_lookup(vmmap_t *map, uint32_t vfn) {
  * to the new vmmap on success, NULL on failure. This function is
  * called when implementing fork(2). */
 vmmap_t *vmmap_clone(vmmap_t *map) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_clone");
-  return NULL;
+  vmmap_t *newmap;
+  vmarea_t *vma, *newvma;
+
+  KASSERT(NULL != map);
+  if (NULL == (newmap = vmmap_create()))
+    return NULL;
+  list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+    if (NULL == (newvma = vmarea_alloc())) {
+      vmmap_destroy(newmap);
+      return NULL;
+    }
+    newvma->vma_start = vma->vma_start;
+    newvma->vma_end = vma->vma_end;
+    newvma->vma_off = vma->vma_off;
+    newvma->vma_prot = vma->vma_prot;
+    newvma->vma_flags = vma->vma_flags;
+    newvma->vma_advice = vma->vma_advice;
+    newvma->vma_obj = NULL;
+    list_link_init(&newvma->vma_plink);
+    list_link_init(&newvma->vma_olink);
+    vmmap_insert(newmap, newvma);
+  }
+  list_iterate_end();
+  return newmap;
 }
 
 /* Insert a mapping into the map starting at lopage for npages pages.
@@ -122,8 +349,118 @@ vmmap_t *vmmap_clone(vmmap_t *map) {
  */
 int vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
               int prot, int flags, off_t off, int dir, vmarea_t **new) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_map");
-  return -1;
+  vmarea_t *vma;
+  mmobj_t *obj, *shadow;
+  int start, ret;
+
+  KASSERT(NULL != map);
+  KASSERT(0 < npages);
+  KASSERT((MAP_SHARED & flags) || (MAP_PRIVATE & flags));
+  KASSERT((0 == lopage) || (ADDR_TO_PN(USER_MEM_LOW) <= lopage));
+  KASSERT((0 == lopage) ||
+          (ADDR_TO_PN(USER_MEM_HIGH) >= (lopage + npages)));
+  KASSERT(PAGE_ALIGNED(off));
+
+  if (0 == lopage) {
+    if (0 > (start = vmmap_find_range(map, npages, dir)))
+      return -ENOMEM;
+  } else {
+    start = lopage;
+  }
+
+  if (NULL == (vma = vmarea_alloc()))
+    return -ENOMEM;
+  vma->vma_start = start;
+  vma->vma_end = start + npages;
+  vma->vma_off = ADDR_TO_PN(off);
+  vma->vma_prot = prot;
+  vma->vma_flags = flags;
+  vma->vma_obj = NULL;
+  list_link_init(&vma->vma_plink);
+  list_link_init(&vma->vma_olink);
+
+  if (file) {
+    if (0 > (ret = file->vn_ops->mmap(file, vma, &obj))) {
+      vmarea_free(vma);
+      return ret;
+    }
+  } else if (NULL == (obj = anon_create())) {
+    vmarea_free(vma);
+    return -ENOMEM;
+  }
+
+  if (MAP_PRIVATE & flags) {
+    if (NULL == (shadow = shadow_create())) {
+      obj->mmo_ops->put(obj);
+      vmarea_free(vma);
+      return -ENOMEM;
+    }
+    shadow->mmo_shadowed = obj;
+    shadow->mmo_un.mmo_bottom_obj = mmobj_bottom_obj(obj);
+    obj = shadow;
+  }
+  vma->vma_obj = obj;
+  list_insert_tail(mmobj_bottom_vmas(obj), &vma->vma_olink);
+
+  /* Nothing can fail from here on, so the old mappings can go */
+  if (lopage && !vmmap_is_range_empty(map, lopage, npages))
+    vmmap_remove(map, lopage, npages);
+  vmmap_insert(map, vma);
+
+  if (new)
+    *new = vma;
+  return 0;
+}
+
+/*
+ * Moves the end of an area up by npages, which must be unmapped. The
+ * area's object must have pages for the new range, as an anonymous one
+ * does.
+ */
+void vmmap_extend(vmmap_t *map, vmarea_t *vma, uint32_t npages) {
+  vmarea_t *next;
+
+  KASSERT(0 < npages && vmmap_is_range_empty(map, vma->vma_end, npages));
+  vma->vma_end += npages;
+  if (NULL != (next = vmarea_next(map, vma)))
+    vmarea_regap(map, next);
+}
+
+/*
+ * Moves the pages [lopage, lopage + npages), which must end an area, to
+ * a new area newpages long, at a free range found as for vmmap_map. The
+ * object's pages go with them, so that nothing is copied; the process
+ * faults them in again at their new address. Returns the new area's
+ * first page, or -ENOMEM.
+ */
+int vmmap_move(vmmap_t *map, uint32_t lopage, uint32_t npages,
+               uint32_t newpages) {
+  vmarea_t *vma = vmmap_lookup(map, lopage), *moved;
+  int start;
+
+  KASSERT(NULL != vma && lopage + npages == vma->vma_end);
+  KASSERT(0 < npages && npages <= newpages);
+  if (0 > (start = vmmap_find_range(map, newpages, VMMAP_DIR_HILO)))
+    return -ENOMEM;
+  if (NULL == (moved = vmarea_alloc()))
+    return -ENOMEM;
+  moved->vma_start = start;
+  moved->vma_end = start + newpages;
+  moved->vma_off = vma->vma_off + (lopage - vma->vma_start);
+  moved->vma_prot = vma->vma_prot;
+  moved->vma_flags = vma->vma_flags;
+  moved->vma_advice = vma->vma_advice;
+  moved->vma_obj = vma->vma_obj;
+  moved->vma_obj->mmo_ops->ref(moved->vma_obj);
+  list_link_init(&moved->vma_plink);
+  list_link_init(&moved->vma_olink);
+  list_insert_tail(mmobj_bottom_vmas(moved->vma_obj), &moved->vma_olink);
+  vmmap_insert(map, moved);
+
+  /* The old range ends its area, so this never has to split one, and
+   * can't fail */
+  vmmap_remove(map, lopage, npages);
+  return start;
 }
 
 /*
@@ -156,8 +493,61 @@ int vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
  * list.
  */
 int vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_remove");
-  return -1;
+  uint32_t hipage = lopage + npages;
+  vmarea_t *vma, *next, *split;
+  tlb_batch_t tb;
+
+  /* Start from the area holding lopage, or else the first one after it */
+  if (NULL == (vma = vmmap_lookup(map, lopage)))
+    vma = vmmap_lookup_after(map, lopage);
+  for (; vma && vma->vma_start < hipage; vma = next) {
+    next = vmarea_next(map, vma);
+    if (vma->vma_start < lopage && vma->vma_end > hipage) {
+      /* Case 1: the tail becomes an area of its own */
+      if (NULL == (split = vmarea_alloc()))
+        return -ENOMEM;
+      split->vma_start = hipage;
+      split->vma_end = vma->vma_end;
+      split->vma_off = vma->vma_off + (hipage - vma->vma_start);
+      split->vma_prot = vma->vma_prot;
+      split->vma_flags = vma->vma_flags;
+      split->vma_advice = vma->vma_advice;
+      split->vma_obj = vma->vma_obj;
+      split->vma_obj->mmo_ops->ref(split->vma_obj);
+      list_link_init(&split->vma_plink);
+      list_link_init(&split->vma_olink);
+      list_insert_tail(mmobj_bottom_vmas(split->vma_obj), &split->vma_olink);
+      vma->vma_end = lopage;
+      vmmap_insert(map, split);
+      pframe_split_mappings(vma, split);
+      break;
+    } else if (vma->vma_start < lopage) {
+      /* Case 2 */
+      vma->vma_end = lopage;
+      if (next)
+        vmarea_regap(map, next);
+    } else if (vma->vma_end > hipage) {
+      /* Case 3 */
+      vma->vma_off += hipage - vma->vma_start;
+      vma->vma_start = hipage;
+      vmarea_regap(map, vma);
+    } else {
+      /* Case 4 */
+      vmmap_unlink(map, vma);
+      vmarea_release(vma);
+    }
+  }
+
+  if (map->vmm_proc) {
+    pt_unmap_range(map->vmm_proc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage),
+                   (uintptr_t)PN_TO_ADDR(hipage));
+    if (pt_get() == map->vmm_proc->p_pagedir) {
+      tlb_batch_init(&tb);
+      tlb_batch_add_range(&tb, (uintptr_t)PN_TO_ADDR(lopage), npages);
+      tlb_batch_flush(&tb);
+    }
+  }
+  return 0;
 }
 
 /*
@@ -165,7 +555,71 @@ int vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages) {
  * given range, 0 otherwise.
  */
 int vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_is_range_empty");
+  uint32_t endvfn = startvfn + npages;
+  vmarea_t *vma;
+
+  KASSERT((startvfn < endvfn) && (ADDR_TO_PN(USER_MEM_LOW) <= startvfn) &&
+          (ADDR_TO_PN(USER_MEM_HIGH) >= endvfn));
+  if (vmmap_lookup(map, startvfn))
+    return 0;
+  vma = vmmap_lookup_after(map, startvfn);
+  return !vma || vma->vma_start >= endvfn;
+}
+
+/* Copies count bytes between buf and the address space one page at a time */
+/*
+ * After a write to pf on behalf of the map's process: if the process has
+ * vaddr mapped to some other frame, that is the zero page or a page from
+ * lower down the shadow chain, mapped read-only, and would go on showing
+ * what was there before the write; drop it so the next access faults pf
+ * in.
+ */
+static void vmmap_unmap_stale(vmmap_t *map, uintptr_t vaddr, pframe_t *pf) {
+  proc_t *p = map->vmm_proc;
+  uintptr_t paddr;
+
+  vaddr = (uintptr_t)PAGE_ALIGN_DOWN(vaddr);
+  if (NULL == p || 0 == (paddr = pt_lookup(p->p_pagedir, vaddr)) ||
+      paddr == pt_virt_to_phys((uintptr_t)pf->pf_addr))
+    return;
+  pt_unmap(p->p_pagedir, vaddr);
+  if (pt_get() == p->p_pagedir)
+    tlb_flush(vaddr);
+}
+
+static int vmmap_copy(vmmap_t *map, uintptr_t vaddr, void *buf, size_t count,
+                      int write) {
+  vmarea_t *vma;
+  pframe_t *pf;
+  size_t n;
+  int ret;
+
+  while (count) {
+    vma = vmmap_lookup(map, ADDR_TO_PN(vaddr));
+    KASSERT(NULL != vma);
+    ret = pframe_lookup(vma->vma_obj,
+                        vma->vma_off + ADDR_TO_PN(vaddr) - vma->vma_start,
+                        write, &pf);
+    if (0 > ret)
+      return ret;
+    n = MIN(count, PAGE_SIZE - PAGE_OFFSET(vaddr));
+    if (write) {
+      /* Pinned so that the page stays while dirtying it blocks */
+      pframe_pin(pf);
+      if (0 > (ret = pframe_dirty(pf))) {
+        pframe_unpin(pf);
+        return ret;
+      }
+      memcpy((char *)pf->pf_addr + PAGE_OFFSET(vaddr), buf, n);
+      pframe_unpin(pf);
+      vmmap_unmap_stale(map, vaddr, pf);
+    } else {
+      memcpy(buf, (char *)pf->pf_addr + PAGE_OFFSET(vaddr), n);
+    }
+    vaddr += n;
+    buf = (char *)buf + n;
+    count -= n;
+  }
   return 0;
 }
 
@@ -178,8 +632,7 @@ int vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages) {
  * Returns 0 on success, -errno on error.
  */
 int vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_read");
-  return 0;
+  return vmmap_copy(map, (uintptr_t)vaddr, buf, count, 0);
 }
 
 /* Write from 'buf' into the virtual address space of 'map' starting at
@@ -191,10 +644,100 @@ int vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count) {
  * Returns 0 on success, -errno on error.
  */
 int vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count) {
-  NOT_YET_IMPLEMENTED("VM: vmmap_write");
+  return vmmap_copy(map, (uintptr_t)vaddr, (void *)buf, count, 1);
+}
+
+/*
+ * The page a private, writable area has for vfn in its own shadow
+ * object, and the object; pages are only traded with such areas, since
+ * their pages are theirs alone. Returns -EINVAL for any other area.
+ */
+static int vmmap_own_page(vmmap_t *map, uint32_t vfn, mmobj_t **o,
+                          uint32_t *pagenum) {
+  vmarea_t *vma = vmmap_lookup(map, vfn);
+
+  if (NULL == vma || MAP_PRIVATE != (vma->vma_flags & MAP_TYPE) ||
+      !(vma->vma_prot & PROT_WRITE) || NULL == vma->vma_obj->mmo_shadowed)
+    return -EINVAL;
+  *o = vma->vma_obj;
+  *pagenum = vma->vma_off + vfn - vma->vma_start;
   return 0;
 }
 
+/* Drops whatever the map's process has mapped at vfn */
+static void vmmap_unmap_page(vmmap_t *map, uint32_t vfn) {
+  proc_t *p = map->vmm_proc;
+
+  if (NULL == p)
+    return;
+  pt_unmap(p->p_pagedir, (uintptr_t)PN_TO_ADDR(vfn));
+  if (pt_get() == p->p_pagedir)
+    tlb_flush((uintptr_t)PN_TO_ADDR(vfn));
+}
+
+/*
+ * Takes the page at vfn out of the map, without copying it, and makes it
+ * page pagenum of dest, an anonymous object with no page there. The area
+ * is left as by MADV_DONTNEED: the next touch sees the object below its
+ * own copies again. Returns 0, -EINVAL if the area is not private and
+ * writable, or -errno.
+ */
+int vmmap_take_page(vmmap_t *map, uint32_t vfn, mmobj_t *dest,
+                    uint32_t pagenum) {
+  mmobj_t *o;
+  pframe_t *pf;
+  uint32_t n;
+  int ret;
+
+  KASSERT(anon_is(dest));
+  if (0 > (ret = vmmap_own_page(map, vfn, &o, &n)) ||
+      0 > (ret = pframe_lookup(o, n, 1, &pf)))
+    return ret;
+  KASSERT(pf->pf_obj == o);
+  vmmap_unmap_page(map, vfn);
+  swap_discard(o, n);
+  pframe_move(pf, dest, pagenum);
+  /* The page is now the only copy, so it must be written out if paged
+   * out */
+  return pframe_dirty(pf);
+}
+
+/*
+ * The dual of vmmap_take_page: moves page pagenum of src, an anonymous
+ * object, into the map at vfn, in place of what the area had there.
+ * Returns 0, -EINVAL if the area is not private and writable, or -errno,
+ * in which case src still has the page.
+ */
+int vmmap_give_page(vmmap_t *map, uint32_t vfn, mmobj_t *src,
+                    uint32_t pagenum) {
+  mmobj_t *o;
+  pframe_t *pf, *old;
+  uint32_t n;
+  int ret;
+
+  KASSERT(anon_is(src));
+  if (0 > (ret = vmmap_own_page(map, vfn, &o, &n)) ||
+      0 > (ret = pframe_get(src, pagenum, &pf)))
+    return ret;
+  /* Kept from the pager while making room blocks */
+  pframe_pin(pf);
+  while (NULL != (old = pframe_get_resident(o, n))) {
+    if (pframe_is_busy(old)) {
+      sched_sleep_on(pframe_waitq(old));
+      continue;
+    }
+    while (pframe_is_pinned(old))
+      pframe_unpin(old);
+    pframe_free(old);
+  }
+  /* The area may have a page from lower down the chain mapped */
+  vmmap_unmap_page(map, vfn);
+  swap_discard(src, pagenum);
+  pframe_move(pf, o, n);
+  pframe_unpin(pf);
+  return pframe_dirty(pf);
+}
+
 /* a debugging routine: dumps the mappings of the given address space. */
 size_t vmmap_mapping_info(const void *vmmap, char *buf, size_t osize) {
   KASSERT(0 < osize);
@@ -241,3 +784,37 @@ end:
   */
   return osize - size;
 }
+
+size_t vmmap_procs_info(const void *arg, char *buf, size_t osize) {
+  size_t size = osize;
+  vmarea_t *vma;
+  mmobj_t *o;
+  proc_t *p;
+  int npages;
+
+  KASSERT(NULL == arg);
+  iprintf(&buf, &size, "%5s %-21s %4s %7s %-8s %-10s %8s\n", "PID",
+          "VADDR RANGE", "PROT", "FLAGS", "BACKING", "MMOBJ", "PRIVATE");
+  /* Nothing here blocks, so no map changes under us */
+  list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+    if (NULL == p->p_vmmap)
+      continue;
+    list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+      /* add up the pages of the shadow objects, stopping at the bottom */
+      npages = 0;
+      for (o = vma->vma_obj; NULL != o->mmo_shadowed; o = o->mmo_shadowed)
+        npages += o->mmo_nrespages;
+      iprintf(&buf, &size,
+              "%5d %#.8x-%#.8x  %c%c%c %7s %-8s 0x%p %8d\n", p->p_pid,
+              vma->vma_start << PAGE_SHIFT, vma->vma_end << PAGE_SHIFT,
+              (vma->vma_prot & PROT_READ ? 'r' : '-'),
+              (vma->vma_prot & PROT_WRITE ? 'w' : '-'),
+              (vma->vma_prot & PROT_EXEC ? 'x' : '-'),
+              (vma->vma_flags & MAP_SHARED ? " SHARED" : "PRIVATE"),
+              o->mmo_ops->name, o, npages);
+    }
+    list_iterate_end();
+  }
+  list_iterate_end();
+  return size;
+}
@@ -0,0 +1,69 @@
+import gdb
+import weenix
+import weenix.proc
+
+class Bucket:
+
+	def __init__(self, val):
+		self._val = val
+
+	def count(self):
+		return int(self._val["pb_count"])
+
+	def pid(self):
+		return int(self._val["pb_pid"])
+
+	def thread(self):
+		return int(self._val["pb_thr"])
+
+	def user(self):
+		return int(self._val["pb_user"]) != 0
+
+	def pcs(self):
+		"""The sampled %eip and the return addresses above it, innermost
+		first"""
+		return [int(self._val["pb_pc"][i]) for i in xrange(int(self._val["pb_depth"]))]
+
+def buckets():
+	table = gdb.parse_and_eval("prof_buckets")
+	size = int(gdb.parse_and_eval("sizeof(prof_buckets) / sizeof(prof_buckets[0])"))
+	for i in xrange(size):
+		if (int(table[i]["pb_count"]) != 0):
+			yield Bucket(table[i])
+
+def symbol(pc):
+	try:
+		block = gdb.block_for_pc(pc)
+	except RuntimeError:
+		block = None
+	while (block != None and block.function == None):
+		block = block.superblock
+	if (block == None):
+		return "0x{0:08x}".format(pc)
+	return block.function.name
+
+def folded():
+	"""The samples as folded stacks, "frame;frame;... count" a line,
+	outermost first, as flamegraph.pl reads them. Each stack starts with
+	its process and thread; one interrupted in userland is just [user]."""
+	names = dict()
+	for proc in weenix.proc.iter():
+		names[proc.pid()] = proc.name()
+	counts = dict()
+	for b in buckets():
+		if (b.pid() < 0):
+			frames = ["[none]"]
+		else:
+			frames = ["{0} ({1})".format(names.get(b.pid(), "exited"), b.pid())]
+		frames.append("0x{0:08x}".format(b.thread()))
+		if (b.user()):
+			frames.append("[user]")
+		else:
+			pcs = b.pcs()
+			# Return addresses are just past the call, which may be the
+			# last instruction of the function
+			stack = [symbol(pcs[0])] + [symbol(pc - 1) for pc in pcs[1:]]
+			frames.extend(reversed(stack))
+		line = ";".join(frame.replace(";", ":") for frame in frames)
+		counts[line] = counts.get(line, 0) + b.count()
+	return "".join("{0} {1}\n".format(line, n) for line, n in sorted(counts.items()))
@@ -0,0 +1,82 @@
+import json
+
+import gdb
+import weenix
+
+# Event types, as in kernel/include/util/trace.h; from TRACE_PFRAME_FILL_BEGIN
+# on they come in begin, end pairs
+_TRACE_SCHED_SWITCH = 0
+_TRACE_FIRST_PAIR = 4
+
+class Event:
+
+	def __init__(self, val):
+		self._val = val
+
+	def tsc(self):
+		return int(self._val["te_tsc"])
+
+	def type(self):
+		return int(self._val["te_type"])
+
+	def name(self):
+		return gdb.parse_and_eval("trace_names")[self.type()].string()
+
+	def cpu(self):
+		return int(self._val["te_cpu"])
+
+	def pid(self):
+		return int(self._val["te_pid"])
+
+	def thread(self):
+		return int(self._val["te_thr"])
+
+	def args(self):
+		return [int(self._val["te_arg"][0]), int(self._val["te_arg"][1])]
+
+	def phase(self):
+		if (self.type() < _TRACE_FIRST_PAIR):
+			return "i"
+		return "B" if (self.type() % 2 == 0) else "E"
+
+def events():
+	"""The events in the ring, oldest first"""
+	ring = gdb.parse_and_eval("trace_ring")
+	size = int(gdb.parse_and_eval("sizeof(trace_ring) / sizeof(trace_ring[0])"))
+	head = int(gdb.parse_and_eval("trace_head"))
+	for i in xrange(max(0, head - size), head):
+		yield Event(ring[i % size])
+
+def usecs_per_cycle():
+	# The kernel measures the counter's rate against its clock; until it
+	# has, timestamps are left in cycles
+	usecs = int(weenix.eval_func("time_cycles_to_usecs", "1000000000ULL"))
+	return usecs / 1e9 if (usecs != 0) else 1.0
+
+def chrome_json():
+	"""The trace as Chrome trace event format JSON, which Perfetto and
+	chrome://tracing open. Each kernel thread is a track, in the process
+	it belongs to; a context switch is an instant on the thread switched
+	to, naming the one switched from."""
+	scale = usecs_per_cycle()
+	out = list()
+	start = None
+	for ev in events():
+		if (start == None):
+			start = ev.tsc()
+		args = ev.args()
+		entry = {
+			"name" : ev.name(),
+			"ph" : ev.phase(),
+			"ts" : (ev.tsc() - start) * scale,
+			"pid" : ev.pid(),
+			"tid" : ev.thread(),
+			"args" : { "arg0" : "0x{0:08x}".format(args[0]),
+					   "arg1" : "0x{0:08x}".format(args[1]) }
+		}
+		if (ev.type() == _TRACE_SCHED_SWITCH):
+			entry["args"] = { "from" : "0x{0:08x}".format(args[0]) }
+		if (entry["ph"] == "i"):
+			entry["s"] = "t"
+		out.append(entry)
+	return json.dumps({ "traceEvents" : out, "displayTimeUnit" : "ns" })
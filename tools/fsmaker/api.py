@@ -1,20 +1,24 @@
 import os
+import json
 import math
 import struct
+import hashlib
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 7
 S5_BLOCK_SIZE = 4096
 
 S5_NBLKS_PER_FNODE = 30
-S5_NDIRECT_BLOCKS = 28
+S5_NDIRECT_BLOCKS = 27
+# The kernel also maps blocks through a double indirect block; files
+# written here are limited to the direct and single indirect blocks.
 S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + math.floor(S5_BLOCK_SIZE / 4)
 S5_MAX_FILE_SIZE = S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
 
 S5_NAME_LEN = 28
 S5_DIRENT_SIZE = S5_NAME_LEN + 4
 
-S5_INODE_SIZE = 16 + S5_NDIRECT_BLOCKS * 4
+S5_INODE_SIZE = 20 + S5_NDIRECT_BLOCKS * 4
 S5_INODES_PER_BLOCK = S5_BLOCK_SIZE / S5_INODE_SIZE
 
 S5_TYPE_FREE = 0x0
@@ -22,7 +26,51 @@ S5_TYPE_DATA = 0x1
 S5_TYPE_DIR = 0x2
 S5_TYPE_CHR = 0x4
 S5_TYPE_BLK = 0x8
-S5_TYPES = set([ S5_TYPE_FREE, S5_TYPE_DATA, S5_TYPE_DIR, S5_TYPE_CHR, S5_TYPE_BLK ])
+# A regular file of at most S5_INLINE_MAX bytes kept in place of its
+# direct block numbers, with no blocks of its own
+S5_TYPE_INLINE = 0x10
+# A regular file kept in compressed clusters of S5_CLUSTER_PAGES blocks
+# (see the kernel's s5fs_compress.h); read here, but never written
+S5_TYPE_COMPRESSED = 0x20
+S5_TYPES = set([ S5_TYPE_FREE, S5_TYPE_DATA, S5_TYPE_DIR, S5_TYPE_CHR, S5_TYPE_BLK, S5_TYPE_INLINE, S5_TYPE_COMPRESSED ])
+S5_FILE_TYPES = set([ S5_TYPE_DATA, S5_TYPE_INLINE, S5_TYPE_COMPRESSED ])
+
+S5_INLINE_MAX = S5_NDIRECT_BLOCKS * 4
+
+S5_CLUSTER_PAGES = 4
+
+def lz4_block_decompress(src, size):
+    """Decompresses LZ4 block data, stopping after size bytes"""
+    out = bytearray()
+    i = 0
+    while (i < len(src) and len(out) < size):
+        token = src[i]
+        i += 1
+        nlit = token >> 4
+        if (nlit == 15):
+            while True:
+                nlit += src[i]
+                i += 1
+                if (src[i - 1] != 255):
+                    break
+        out += src[i:i + nlit]
+        i += nlit
+        if (i >= len(src)):
+            break
+        dist = src[i] | (src[i + 1] << 8)
+        i += 2
+        mlen = token & 15
+        if (mlen == 15):
+            while True:
+                mlen += src[i]
+                i += 1
+                if (src[i - 1] != 255):
+                    break
+        if (dist == 0 or dist > len(out)):
+            raise S5fsException("corrupt compressed cluster")
+        for k in xrange(mlen + 4):
+            out.append(out[-dist])
+    return bytes(out[:size])
 
 class S5fsException(Exception):
 
@@ -157,6 +205,14 @@ class Inode:
         self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
         self._simfile.write(struct.pack("I", val))
 
+    def get_dindirect_blockno(self):
+        self._simfile.seek(int(self._offset + 16 + 4 * S5_NDIRECT_BLOCKS))
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_dindirect_blockno(self, val):
+        self._simfile.seek(int(self._offset + 16 + 4 * S5_NDIRECT_BLOCKS))
+        self._simfile.write(struct.pack("I", val))
+
     def get_type_str(self, short=False):
         t = self.get_type()
         name = "INV" if short else "INVALID"
@@ -170,6 +226,10 @@ class Inode:
             name = "blk" if short else "S5_TYPE_BLK"
         elif (t == S5_TYPE_CHR):
             name = "chr" if short else "S5_TYPE_CHR"
+        elif (t == S5_TYPE_INLINE):
+            name = "inl" if short else "S5_TYPE_INLINE"
+        elif (t == S5_TYPE_COMPRESSED):
+            name = "cmp" if short else "S5_TYPE_COMPRESSED"
         return name if short else "{0} (0x{1:02x})".format(name, t)
 
     def get_summary(self):
@@ -178,7 +238,7 @@ class Inode:
         res += "type:  {0}\n".format(self.get_type_str())
         if (self.get_type() != S5_TYPE_FREE):
             res += "links: {0}\n".format(self.get_link_count())
-        if (self.get_type() in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
+        if (self.get_type() in set([ S5_TYPE_DATA, S5_TYPE_DIR, S5_TYPE_COMPRESSED ])):
             res += "size:  {0} bytes".format(self.get_size())
             if (self.get_size() > S5_MAX_FILE_SIZE):
                 res += " (INVALID, max file size is {0})".format(S5_MAX_FILE_SIZE)
@@ -195,14 +255,66 @@ class Inode:
             if (res[-1] != "\n"):
                 res += "\n"
             res += "indirect block: {0}\n".format(self.get_indirect_blockno())
+            res += "double indirect block: {0}\n".format(self.get_dindirect_blockno())
+        elif (self.get_type() == S5_TYPE_INLINE):
+            res += "size:  {0} bytes".format(self.get_size())
+            if (self.get_size() > S5_INLINE_MAX):
+                res += " (INVALID, max inline size is {0})".format(S5_INLINE_MAX)
+            res += " (inline)\n"
         elif (self.get_type() == S5_TYPE_FREE):
             res += "next free: {0}\n".format(self.get_next_free())
         res = res[:-1]
         return res
 
+    def _read_inline(self, offset, size):
+        self._simfile.seek(int(self._offset + 12 + offset))
+        return self._simfile.read(size)
+
+    def _write_inline(self, offset, data):
+        self._simfile.seek(int(self._offset + 12 + offset))
+        self._simfile.write(data)
+
+    def _uninline(self):
+        data = self._read_inline(0, self.get_size())
+        self._write_inline(0, '\0' * S5_INLINE_MAX)
+        self.set_type(S5_TYPE_DATA)
+        self.set_size(len(data))
+        self.write(0, data)
+
+    def _get_file_blockno(self, index):
+        if (index < S5_NDIRECT_BLOCKS):
+            return self.get_direct_blockno(index)
+        if (self.get_indirect_blockno() == 0):
+            return 0
+        indirect = self._simdisk.get_block(self.get_indirect_blockno())
+        return struct.unpack("I", indirect.read((index - S5_NDIRECT_BLOCKS) * 4, 4))[0]
+
+    def _read_compressed(self, offset, size):
+        res = ""
+        first = offset // (S5_CLUSTER_PAGES * S5_BLOCK_SIZE)
+        last = (offset + size + S5_CLUSTER_PAGES * S5_BLOCK_SIZE - 1) // (S5_CLUSTER_PAGES * S5_BLOCK_SIZE)
+        for c in xrange(first, last):
+            blocks = [ self._get_file_blockno(c * S5_CLUSTER_PAGES + k) for k in xrange(S5_CLUSTER_PAGES) ]
+            n = len([ b for b in blocks if b != 0 ])
+            if (blocks[0] == 0):
+                data = ""
+            elif (n == S5_CLUSTER_PAGES):
+                data = "".join([ self._simdisk.get_block(b).read() for b in blocks ])
+            else:
+                packed = bytearray("".join([ self._simdisk.get_block(b).read() for b in blocks[:n] ]))
+                clen = struct.unpack_from("I", packed, 0)[0]
+                data = lz4_block_decompress(packed[4:4 + clen], S5_CLUSTER_PAGES * S5_BLOCK_SIZE)
+            res += data.ljust(S5_CLUSTER_PAGES * S5_BLOCK_SIZE, '\0')
+        start = offset - first * S5_CLUSTER_PAGES * S5_BLOCK_SIZE
+        return res[start:start + size]
+
     def read(self, offset=0, size=None):
         if (size == None):
             size = self.get_size()
+        if (self.get_type() == S5_TYPE_INLINE):
+            return self._read_inline(offset, max(0, min(size, self.get_size() - offset)))
+        if (self.get_type() == S5_TYPE_COMPRESSED):
+            return self._read_compressed(offset, max(0, min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)))
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot read from inode of type " + self.get_type_str())
         size = min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)
@@ -230,6 +342,16 @@ class Inode:
         return res
 
     def write(self, offset, data):
+        # Small files with no blocks yet are kept inline
+        if (self.get_type() == S5_TYPE_DATA and self.get_size() == 0 and offset + len(data) <= S5_INLINE_MAX):
+            self.set_type(S5_TYPE_INLINE)
+        if (self.get_type() == S5_TYPE_INLINE):
+            if (offset + len(data) <= S5_INLINE_MAX):
+                self._write_inline(offset, data)
+                if (offset + len(data) > self.get_size()):
+                    self.set_size(offset + len(data))
+                return
+            self._uninline()
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot write to inode of type " + self.get_type_str())
         if (offset + len(data) > S5_MAX_FILE_SIZE):
@@ -270,6 +392,16 @@ class Inode:
             self.set_size(offset)
 
     def truncate(self, size=0):
+        if (self.get_type() == S5_TYPE_COMPRESSED):
+            raise S5fsException("cannot truncate compressed files")
+        if (self.get_type() == S5_TYPE_INLINE):
+            if (size > S5_INLINE_MAX):
+                self._uninline()
+            else:
+                if (size < self.get_size()):
+                    self._write_inline(size, '\0' * (self.get_size() - size))
+                self.set_size(size)
+                return
         target = math.floor((size - 1) / S5_BLOCK_SIZE)
         curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
         while (curr > target):
@@ -382,6 +514,7 @@ class Inode:
             for i in xrange(S5_NDIRECT_BLOCKS):
                 inode.set_direct_blockno(i, 0)
             inode.set_indirect_blockno(0)
+            inode.set_dindirect_blockno(0)
             self._make_dirent(inode.get_number(), name)
             return inode
         except S5fsException as e:
@@ -397,6 +530,7 @@ class Inode:
             for i in xrange(S5_NDIRECT_BLOCKS):
                 inode.set_direct_blockno(i, 0)
             inode.set_indirect_blockno(0)
+            inode.set_dindirect_blockno(0)
             inode._make_dirent(inode.get_number(), ".")
             inode._make_dirent(self.get_number(), "..")
             self.set_link_count(self.get_link_count() + 1)
@@ -469,6 +603,12 @@ class Simdisk:
 
     def __init__(self, simfile):
         self._simfile = simfile
+        # The kernel's checksums of metadata go stale as soon as anything
+        # here changes it; without the superblock's own checksum the
+        # kernel starts them over at its next mount
+        self._simfile.seek(0, os.SEEK_END)
+        if (self._simfile.tell() >= S5_BLOCK_SIZE and self.get_magic() == S5_MAGIC):
+            self.set_super_csum(0)
 
     def get_magic(self):
         self._simfile.seek(0)
@@ -536,6 +676,14 @@ class Simdisk:
         self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
         self._simfile.write(struct.pack("I", val))
 
+    def get_super_csum(self):
+        self._simfile.seek(44 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_super_csum(self, val):
+        self._simfile.seek(44 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
     def get_super_block_summary(self):
         res = ""
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
@@ -553,7 +701,9 @@ class Simdisk:
         res += "  last free block: {0}\n".format(self.get_last_free_block())
         return res
 
-    def format(self, inodes, size):
+    def _geometry(self, inodes, size):
+        """The number of blocks in a disk of the given size, and of
+        blocks of inodes after the superblock."""
         if (inodes < 1):
             raise S5fsException("cannot format disk with {0} inodes, must have at least one".format(inodes))
         if (size % S5_BLOCK_SIZE != 0):
@@ -562,6 +712,10 @@ class Simdisk:
         iblocks = int(math.floor((inodes - 1) / S5_INODES_PER_BLOCK) + 1)
         if (iblocks + 1 >= blocks):
             raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks) * S5_BLOCK_SIZE))
+        return blocks, iblocks
+
+    def format(self, inodes, size):
+        blocks, iblocks = self._geometry(inodes, size)
         self._simfile.truncate()
         self._simfile.seek(size)
         self._simfile.write("")
@@ -596,6 +750,7 @@ class Simdisk:
         for i in xrange(S5_NDIRECT_BLOCKS):
             root.set_direct_blockno(i, 0)
         root.set_indirect_blockno(0)
+        root.set_dindirect_blockno(0)
         root.set_type(S5_TYPE_DIR)
         root.set_size(0)
         root.set_link_count(1)
@@ -603,6 +758,193 @@ class Simdisk:
         root._make_dirent(root.get_number(), "..")
         root.set_link_count(1)
 
+    def build(self, inodes, size, directory, manifest=None):
+        """Formats the disk with the contents of a directory tree, as
+        format followed by creating each file would, but laid out in one
+        pass in memory and written with a single sequential write: inodes
+        are numbered breadth first from the root, each file's blocks
+        (its indirect block just before the data it maps) follow the
+        last file's, and the blocks after them make up the free list.
+        Small files are kept inline, as Inode.write would keep them.
+
+        With a manifest path, the layout is recorded there, and if the
+        manifest describes this disk as it is and the same tree, only the
+        files whose contents changed are rewritten, in place (see
+        _update)."""
+        if (manifest != None and self._update(inodes, size, directory, manifest)):
+            return
+        image, dirs, files = self._lay_out(inodes, size, directory)
+        self._simfile.seek(0)
+        self._simfile.truncate()
+        self._simfile.write(image)
+        self._simfile.flush()
+        if (manifest != None):
+            self._write_manifest(manifest, inodes, size, image, dirs, files)
+
+    def _lay_out(self, inodes, size, directory):
+        """The image build writes, the paths of the directories in the
+        tree, and for each file, by its path in the tree, [ content hash,
+        inode, first block, blocks ]."""
+        blocks, iblocks = self._geometry(inodes, size)
+        image = bytearray(size)
+
+        # [ host path, is directory, parent, [ (name, inode) ] ], by inode
+        nodes = [ [ directory, True, 0, [] ] ]
+        i = 0
+        while (i < len(nodes)):
+            path, isdir, parent, children = nodes[i]
+            if (isdir):
+                for name in sorted(os.listdir(path)):
+                    if (len(name) >= S5_NAME_LEN):
+                        raise S5fsException("directroy entry name '{0}' too long, limit is {1} characters".format(name, S5_NAME_LEN - 1))
+                    real = os.path.join(path, name)
+                    children.append((name, len(nodes)))
+                    nodes.append([ real, os.path.isdir(real), i, [] ])
+            i += 1
+        if (len(nodes) > inodes):
+            raise S5fsException("disk is out of inodes, {0} files need {1}".format(directory, len(nodes)))
+
+        files = {}
+        nextblock = iblocks + 1
+        for number, (path, isdir, parent, children) in enumerate(nodes):
+            if (isdir):
+                data = bytearray(S5_DIRENT_SIZE * (2 + len(children)))
+                for k, (name, ino) in enumerate([ (".", number), ("..", parent) ] + children):
+                    struct.pack_into("I{0}s".format(S5_NAME_LEN), data, k * S5_DIRENT_SIZE, ino, name.encode("ascii"))
+                kind = S5_TYPE_DIR
+                links = 1 + len([ c for c in children if nodes[c[1]][1] ])
+            else:
+                with open(path, "rb") as f:
+                    data = f.read()
+                kind = S5_TYPE_DATA
+                links = 1
+                files[os.path.relpath(path, directory)] = [ hashlib.sha1(data).hexdigest(), number, nextblock, 0 ]
+            offset = self._inode_offset(number)
+            struct.pack_into("IIHh", image, offset, len(data), number, kind, links)
+
+            if (kind == S5_TYPE_DATA and 0 < len(data) <= S5_INLINE_MAX):
+                struct.pack_into("H", image, offset + 8, S5_TYPE_INLINE)
+                image[offset + 12:offset + 12 + len(data)] = data
+                continue
+            nfileblocks = (len(data) + S5_BLOCK_SIZE - 1) // S5_BLOCK_SIZE
+            if (nfileblocks > S5_MAX_FILE_BLOCKS):
+                raise S5fsException("{0} is {1} bytes, max file size is {2}".format(path, len(data), S5_MAX_FILE_SIZE))
+            if (nextblock + nfileblocks + (nfileblocks > S5_NDIRECT_BLOCKS) > blocks):
+                raise S5fsDiskSpaceException()
+            for k in xrange(nfileblocks):
+                if (k == S5_NDIRECT_BLOCKS):
+                    indirect = nextblock
+                    struct.pack_into("I", image, offset + 12 + 4 * S5_NDIRECT_BLOCKS, indirect)
+                    nextblock += 1
+                if (k < S5_NDIRECT_BLOCKS):
+                    struct.pack_into("I", image, offset + 12 + 4 * k, nextblock)
+                else:
+                    struct.pack_into("I", image, indirect * S5_BLOCK_SIZE + 4 * (k - S5_NDIRECT_BLOCKS), nextblock)
+                chunk = data[k * S5_BLOCK_SIZE:(k + 1) * S5_BLOCK_SIZE]
+                image[nextblock * S5_BLOCK_SIZE:nextblock * S5_BLOCK_SIZE + len(chunk)] = chunk
+                nextblock += 1
+            if (not isdir):
+                files[os.path.relpath(path, directory)][3] = nextblock - files[os.path.relpath(path, directory)][2]
+
+        for number in xrange(len(nodes), inodes):
+            offset = self._inode_offset(number)
+            struct.pack_into("IIH", image, offset, number + 1 if number + 1 < inodes else 0xffffffff, number, S5_TYPE_FREE)
+
+        # the free list, as format makes it, of the blocks left over
+        free = [ 0 ] * (S5_NBLKS_PER_FNODE - 1)
+        last = 0xffffffff
+        k = 0
+        for num in xrange(nextblock, blocks):
+            if (k == S5_NBLKS_PER_FNODE - 1):
+                struct.pack_into("{0}I".format(S5_NBLKS_PER_FNODE), image, num * S5_BLOCK_SIZE, *(free + [ last ]))
+                last = num
+                k = 0
+            else:
+                free[k] = num
+                k += 1
+
+        struct.pack_into("III", image, 0, S5_MAGIC, len(nodes) if len(nodes) < inodes else 0xffffffff, k)
+        struct.pack_into("{0}I".format(S5_NBLKS_PER_FNODE), image, 12, *(free + [ last ]))
+        struct.pack_into("III", image, 12 + 4 * S5_NBLKS_PER_FNODE, 0, inodes, S5_CURRENT_VERSION)
+        dirs = [ os.path.relpath(n[0], directory) for n in nodes[1:] if n[1] ]
+        return image, dirs, files
+
+    def _write_manifest(self, manifest, inodes, size, image, dirs, files):
+        with open(manifest, "w") as f:
+            json.dump({ "version": S5_CURRENT_VERSION, "inodes": inodes, "size": size,
+                        "image": hashlib.sha1(image).hexdigest(),
+                        "dirs": sorted(dirs), "files": files }, f, indent=0, sort_keys=True)
+
+    def _update(self, inodes, size, directory, manifest):
+        """Brings a disk made by build up to date with the tree, if the
+        manifest build left describes it: the disk must hash to what the
+        manifest says, so that nothing has written to it since, and the
+        tree must have the same directories and files. A changed file is
+        rewritten over its old blocks, which it must fit exactly (or, if
+        it has none, fit inline). Returns False, having written nothing,
+        if the disk has to be built over instead."""
+        try:
+            with open(manifest) as f:
+                old = json.load(f)
+        except (IOError, ValueError):
+            return False
+        if (old.get("version") != S5_CURRENT_VERSION or old.get("inodes") != inodes or old.get("size") != size):
+            return False
+        self._simfile.seek(0)
+        image = bytearray(self._simfile.read())
+        if (len(image) != size or hashlib.sha1(image).hexdigest() != old["image"]):
+            return False
+
+        # the tree must match the manifest, directory for directory
+        files = {}
+        dirs = set()
+        for root, subdirs, names in os.walk(directory):
+            for name in subdirs:
+                dirs.add(os.path.relpath(os.path.join(root, name), directory))
+            for name in names:
+                files[os.path.relpath(os.path.join(root, name), directory)] = None
+        if (set(files) != set(old["files"]) or dirs != set(old["dirs"])):
+            return False
+
+        writes = []
+        for path in files:
+            with open(os.path.join(directory, path), "rb") as f:
+                data = f.read()
+            digest, number, first, count = old["files"][path]
+            files[path] = [ hashlib.sha1(data).hexdigest(), number, first, count ]
+            if (files[path][0] == digest):
+                continue
+            nfileblocks = (len(data) + S5_BLOCK_SIZE - 1) // S5_BLOCK_SIZE
+            offset = self._inode_offset(number)
+            if (count == 0 and len(data) <= S5_INLINE_MAX):
+                kind = S5_TYPE_INLINE if len(data) > 0 else S5_TYPE_DATA
+                image[offset + 12:offset + 12 + S5_INLINE_MAX] = bytearray(S5_INLINE_MAX)
+                image[offset + 12:offset + 12 + len(data)] = data
+            elif (len(data) > S5_INLINE_MAX and count == nfileblocks + (nfileblocks > S5_NDIRECT_BLOCKS)):
+                kind = S5_TYPE_DATA
+                for k in xrange(nfileblocks):
+                    blockno = first + k + (k >= S5_NDIRECT_BLOCKS)
+                    chunk = bytearray(data[k * S5_BLOCK_SIZE:(k + 1) * S5_BLOCK_SIZE])
+                    chunk.extend(bytearray(S5_BLOCK_SIZE - len(chunk)))
+                    image[blockno * S5_BLOCK_SIZE:(blockno + 1) * S5_BLOCK_SIZE] = chunk
+                writes.append((first * S5_BLOCK_SIZE, count * S5_BLOCK_SIZE))
+            else:
+                return False
+            struct.pack_into("I", image, offset, len(data))
+            struct.pack_into("H", image, offset + 8, kind)
+            writes.append((offset, S5_INODE_SIZE))
+
+        for offset, length in sorted(writes):
+            self._simfile.seek(offset)
+            self._simfile.write(image[offset:offset + length])
+        self._simfile.flush()
+        self._write_manifest(manifest, inodes, size, image, dirs, files)
+        return True
+
+    def _inode_offset(self, number):
+        ipb = int(S5_INODES_PER_BLOCK)
+        return S5_BLOCK_SIZE * (1 + number // ipb) + S5_INODE_SIZE * (number % ipb)
+
     def free_inodes(self):
         inext = self.get_free_inode()
         while (inext != 0xffffffff):
@@ -4,10 +4,8 @@ import cmd
 import api
 
 import math
-import stat
 import errno
 import shlex
-import Queue
 import struct
 import string
 import optparse
@@ -69,7 +67,9 @@ class FsmakerShell(cmd.Cmd):
         self._parse_format.add_option("-i", "--inodes", action="store", type="int", default=None,
                                       help="number of inodes to put on the disk, this must be specified and be compatible with the size of the disk (there must be enough space for the inodes)")
         self._parse_format.add_option("-d", "--directory", action="store", type="str", default=None,
-                                      help="initializes the disk with the contents of the specified directory")
+                                      help="initializes the disk with the contents of the specified directory, written in one pass")
+        self._parse_format.add_option("-m", "--manifest", action="store", type="str", default=None,
+                                      help="with -d, records the disk's layout in the specified file, and if the file already describes the disk, only rewrites the files which changed")
 
     def open(self, path, create=False):
         if (path.startswith("/")):
@@ -214,7 +214,7 @@ class FsmakerShell(cmd.Cmd):
                 if (inode == None):
                     msg = "<{0}>".format(errmsg)
                 else:
-                    if (itype in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR ])):
+                    if (itype in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR, api.S5_TYPE_INLINE, api.S5_TYPE_COMPRESSED ])):
                         msg = "{0} {1} bytes".format(itypestr, isize)
                     elif (itype in set([ api.S5_TYPE_BLK, api.S5_TYPE_CHR ])):
                         msg = "{0}".format(itypestr)
@@ -294,7 +294,7 @@ class FsmakerShell(cmd.Cmd):
                 else:
                     try:
                         print(inode.get_summary())
-                        if (options.indirect and inode.get_type() in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR ]) and inode.get_indirect_blockno() != 0):
+                        if (options.indirect and inode.get_type() in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR, api.S5_TYPE_COMPRESSED ]) and inode.get_indirect_blockno() != 0):
                             try:
                                 iblock = self._simdisk.get_block(inode.get_indirect_blockno())
                                 for i in xrange(api.S5_BLOCK_SIZE / 4):
@@ -306,7 +306,7 @@ class FsmakerShell(cmd.Cmd):
                                     sys.stdout.write("\n")
                             except api.S5fsException as e:
                                 self._parse_inode.error(str(e))
-                        if (options.contents and inode.get_type() in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR ])):
+                        if (options.contents and inode.get_type() in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR, api.S5_TYPE_INLINE, api.S5_TYPE_COMPRESSED ])):
                             print("contents:")
                             self.binary_print(inode.read(),prefix="  ")
                         if (options.list and inode.get_type() == api.S5_TYPE_DIR):
@@ -395,7 +395,7 @@ class FsmakerShell(cmd.Cmd):
                     f = self.open(arg)
                     if (f == None):
                         self._parse_cat.error("no such file or directory: {0}".format(arg))
-                    elif (f.get_type() != api.S5_TYPE_DATA):
+                    elif (f.get_type() not in api.S5_FILE_TYPES):
                         self._parse_cat.error("not a plain data file: {0}".format(arg))
                     else:
                         print(f.read())
@@ -407,7 +407,7 @@ class FsmakerShell(cmd.Cmd):
         self._parse_cat.print_help()
 
     def complete_cat(self, text, line, begidx, endidx):
-        return self.filepath_completion(text, line, begidx, endidx, types=set([ api.S5_TYPE_DATA ]))
+        return self.filepath_completion(text, line, begidx, endidx, types=api.S5_FILE_TYPES)
 
     def do_truncate(self, args):
         try:
@@ -424,7 +424,7 @@ class FsmakerShell(cmd.Cmd):
                     f = self.open(arg)
                     if (f == None):
                         self._parse_trunc.error("no such file or directory: {0}".format(arg))
-                    elif (f.get_type() != api.S5_TYPE_DATA):
+                    elif (f.get_type() not in api.S5_FILE_TYPES):
                         self._parse_trunc.error("not a plain data file: {0}".format(arg))
                     else:
                         f.truncate(size=options.size)
@@ -435,7 +435,7 @@ class FsmakerShell(cmd.Cmd):
         self._parse_trunc.print_help()
 
     def complete_truncate(self, text, line, begidx, endidx):
-        return self.filepath_completion(text, line, begidx, endidx, types=set([ api.S5_TYPE_DATA ]))
+        return self.filepath_completion(text, line, begidx, endidx, types=api.S5_FILE_TYPES)
 
     def _dir_clear(self, directory):
         for dirent in directory.getdents():
@@ -586,7 +586,7 @@ class FsmakerShell(cmd.Cmd):
             except Exception as e:
                 print str(e)
         elif (argnum == 2):
-            return self.filepath_completion(text, line, begin, end, types=set([ api.S5_TYPE_DATA ]))
+            return self.filepath_completion(text, line, begin, end, types=api.S5_FILE_TYPES)
         else:
             return []
 
@@ -624,7 +624,7 @@ class FsmakerShell(cmd.Cmd):
     def complete_putfile(self, text, line, begin, end):
         argnum = self.completion_argnum(text, line, begin, end)
         if (argnum == 1):
-            return self.filepath_completion(text, line, begin, end, types=set([ api.S5_TYPE_DATA ]))
+            return self.filepath_completion(text, line, begin, end, types=api.S5_FILE_TYPES)
         elif (argnum == 2):
             return self.real_filepath_completion(text, line, begin, end)
         else:
@@ -648,25 +648,13 @@ class FsmakerShell(cmd.Cmd):
                 size = options.size
             else:
                 size = options.blocks * api.S5_BLOCK_SIZE
-            self._simdisk.format(options.inodes, size)
-
-        if (options.directory):
-            q = Queue.Queue()
-            q.put(".")
-            while(not q.empty()):
-                curr = q.get()
-                real = os.path.join(options.directory, curr)
-                mode = os.stat(real).st_mode
-                if (stat.S_ISDIR(mode)):
-                    for path in os.listdir(real):
-                        q.put(os.path.join(curr, path))
-                    parent, name = self.get_parentdir(os.path.join("/", curr))
-                    if ("." != name):
-                        parent.mkdir(name)
+            try:
+                if (options.directory):
+                    self._simdisk.build(options.inodes, size, options.directory, options.manifest)
                 else:
-                    source = open(real, 'r')
-                    dest = self.open(os.path.join("/", curr), create=True)
-                    self.getfile(source, dest)
+                    self._simdisk.format(options.inodes, size)
+            except (api.S5fsException, IOError, OSError) as e:
+                self._parse_format.error(str(e))
 
     def default(self, line):
         if (line.strip() == "EOF"):
@@ -0,0 +1,110 @@
+#!/usr/bin/env python
+#
+# Orders the kernel's initialization functions at build time.
+#
+# Reads the .init sections of the kernel's object files, given in the
+# order they are linked, and prints the C source of the table util/init.c
+# goes by: the indices of the init_func entries of the linked section, in
+# the order they are to be called. Each function is called after the ones it names with
+# init_depends, and otherwise in the order of the section. A dependency
+# which does not exist or a circular one fails the build here rather
+# than the boot.
+#
+# Each entry is INIT_ENTRY_SIZE bytes (see kernel/include/util/init.h): a
+# 4 byte address, a byte which is 1 for init_depends, and the name.
+#
+# usage: initsort.py <objects...> > init_order.c
+
+import struct
+import sys
+
+INIT_ENTRY_SIZE = 64
+
+def die(msg):
+    sys.stderr.write("initsort: {0}\n".format(msg))
+    sys.exit(1)
+
+def init_section(path):
+    """The contents of the .init section of an ELF32 object, or b"" if it
+    has none."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:4] != b"\x7fELF" or data[4:5] != b"\x01":
+        die("{0} is not a 32 bit ELF object".format(path))
+    shoff, = struct.unpack_from("<I", data, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", data, 0x2e)
+    sections = [struct.unpack_from("<IIIIII", data, shoff + i * shentsize)
+                for i in range(shnum)]
+    strtab = sections[shstrndx][4]
+    for name, kind, flags, addr, offset, size in sections:
+        end = data.index(b"\0", strtab + name)
+        if data[strtab + name:end] == b".init":
+            return data[offset:offset + size]
+    return b""
+
+def read_entries(paths):
+    """(name, index, depends) for each init_func, in the order of the
+    linked section, with index its place among all the entries and
+    depends the names it depends on; and how many entries there are."""
+    funcs = []
+    index = 0
+    for path in paths:
+        section = init_section(path)
+        if len(section) % INIT_ENTRY_SIZE:
+            die("{0}: .init is not made of {1} byte entries".format(path, INIT_ENTRY_SIZE))
+        for off in range(0, len(section), INIT_ENTRY_SIZE):
+            entry = section[off:off + INIT_ENTRY_SIZE]
+            isdep = entry[4:5] != b"\0"
+            name = entry[5:entry.index(b"\0", 5)].decode("ascii")
+            if isdep:
+                if not funcs:
+                    die("{0}: init_depends({1}) before any init_func".format(path, name))
+                funcs[-1][2].append(name)
+            else:
+                funcs.append((name, index, []))
+            index += 1
+    return funcs, index
+
+def order(funcs):
+    """Indices into the section of the functions, in calling order."""
+    byname = {}
+    for f in funcs:
+        if f[0] in byname:
+            die("init_func({0}) appears twice".format(f[0]))
+        byname[f[0]] = f
+    called = set()
+    result = []
+
+    def call(f, path):
+        for dep in f[2]:
+            if dep not in byname:
+                die("'{0}' dependency for '{1}' does not exist".format(dep, f[0]))
+            if dep in path:
+                die("circular dependency between '{0}' and '{1}'".format(f[0], dep))
+            if dep not in called:
+                call(byname[dep], path + [dep])
+        called.add(f[0])
+        result.append(f[1])
+
+    for f in funcs:
+        if f[0] not in called:
+            call(f, [f[0]])
+    return result
+
+def main(paths):
+    funcs, nentries = read_entries(paths)
+    calls = order(funcs)
+    names = dict((f[1], f[0]) for f in funcs)
+    out = sys.stdout
+    out.write("/* Generated by tools/initsort.py; do not edit. */\n\n")
+    out.write("#include \"types.h\"\n\n")
+    out.write("const int init_nentries = {0};\n".format(nentries))
+    out.write("const int init_ncalls = {0};\n".format(len(calls)))
+    out.write("const uint16_t init_order[] = {\n")
+    for index in calls:
+        out.write("    {0}, /* {1} */\n".format(index, names[index]))
+    out.write("};\n")
+    out.write("uint64_t init_cycles[{0}];\n".format(len(calls)))
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -0,0 +1,54 @@
+#!/usr/bin/env python
+#
+# Makes the archive of user programs the kernel is built with (see
+# kernel/fs/initramfs.c).
+#
+# Prints a "newc" cpio archive of the given directories of a tree, each
+# directory entry before the entries in it. The given directories get
+# entries, but their parents do not: the kernel mounts a tmpfs on each
+# directory whose parent is not in the archive, and unpacks into it. A
+# directory which does not exist is left out.
+#
+# usage: mkinitramfs.py <root> <dirs...> > initramfs.cpio
+
+import os
+import sys
+
+S_IFDIR = 0o040000
+S_IFREG = 0o100000
+
+def pad(out, n):
+    out.write(b"\0" * ((4 - n % 4) % 4))
+
+def entry(out, ino, name, mode, data=b""):
+    name = name.encode("ascii") + b"\0"
+    fields = [ ino, mode, 0, 0, 1, 0, len(data), 0, 0, 0, 0, len(name), 0 ]
+    header = b"070701" + b"".join(("%08x" % f).encode("ascii") for f in fields)
+    out.write(header)
+    out.write(name)
+    pad(out, len(header) + len(name))
+    out.write(data)
+    pad(out, len(data))
+
+def main(root, dirs):
+    out = getattr(sys.stdout, "buffer", sys.stdout)
+    ino = 1
+    for top in dirs:
+        if (not os.path.isdir(os.path.join(root, top))):
+            continue
+        for path, subdirs, names in os.walk(os.path.join(root, top)):
+            subdirs.sort()
+            rel = os.path.relpath(path, root)
+            entry(out, ino, rel, S_IFDIR | 0o755)
+            ino += 1
+            for name in sorted(names):
+                with open(os.path.join(path, name), "rb") as f:
+                    entry(out, ino, os.path.join(rel, name), S_IFREG | 0o755, f.read())
+                ino += 1
+    entry(out, 0, "TRAILER!!!", 0)
+
+if __name__ == "__main__":
+    if (len(sys.argv) < 2):
+        sys.stderr.write("usage: mkinitramfs.py <root> <dirs...>\n")
+        sys.exit(1)
+    main(sys.argv[1], sys.argv[2:])
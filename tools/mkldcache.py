@@ -0,0 +1,51 @@
+#!/usr/bin/env python
+#
+# Makes the cache ld-weenix finds libraries with (see
+# user/lib/ld-weenix/ldcache.h).
+#
+# Each shared library in the given directories of a tree is entered by
+# its file name, with its absolute path in the tree; where two directories
+# have a library of the same name, the one given first wins, as it does on
+# the loader's default path.
+#
+# usage: mkldcache.py <root> <dirs...> > ld.so.cache
+
+import os
+import struct
+import sys
+
+MAGIC = b"ldcache1"
+HDR = struct.Struct("<8sI")
+ENTRY = struct.Struct("<II")
+
+def main(root, dirs):
+    libs = {}
+    for top in dirs:
+        path = os.path.join(root, top)
+        if (not os.path.isdir(path)):
+            continue
+        for name in sorted(os.listdir(path)):
+            if (not (name.endswith(".so") or ".so." in name)):
+                continue
+            if (name not in libs and os.path.isfile(os.path.join(path, name))):
+                libs[name] = "/" + top.strip("/") + "/" + name
+
+    names = sorted(libs)
+    strings = b""
+    offset = HDR.size + ENTRY.size * len(names)
+    entries = b""
+    for name in names:
+        key = name.encode("ascii") + b"\0"
+        entries += ENTRY.pack(offset + len(strings), offset + len(strings) + len(key))
+        strings += key + libs[name].encode("ascii") + b"\0"
+
+    out = getattr(sys.stdout, "buffer", sys.stdout)
+    out.write(HDR.pack(MAGIC, len(names)))
+    out.write(entries)
+    out.write(strings)
+
+if __name__ == "__main__":
+    if (len(sys.argv) < 3):
+        sys.stderr.write("usage: %s <root> <dirs...>\n" % sys.argv[0])
+        sys.exit(1)
+    main(sys.argv[1], sys.argv[2:])
@@ -113,7 +113,10 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
  * Editor
@@ -139,9 +142,20 @@
 
 #define STAR 01
 
+/*
+ * The text is kept in memory rather than in a temp file. Each line is
+ * named by an int, as it is in the address array, whose low bit is kept
+ * free for the marks of g and k. With MAPPED set, the rest is an offset
+ * into the files read with r or e, which are mapped and left where they
+ * are; otherwise it is an offset into addbuf, where each line written by
+ * putline() is appended, NUL-terminated. Lines aren't ever freed.
+ */
+#define MAPPED 02
+#define TLSHIFT 2
+#define ADDBUF_SIZE (32 * 1024 * 1024)
+#define NMAPS 16
+
 #define error errfunc()
-#define READ 0
-#define WRITE 1
 
 char peekc;
 char lastc;
@@ -171,18 +185,22 @@ int vflag = 1;
 int listf;
 int col;
 char *globp;
-int tfile = -1;
 int tline;
-char tfname[] = "/tmp/exxxxx";
+char *addbuf;
+struct mapping {
+  char *m_addr;
+  unsigned int m_len;
+  unsigned int m_off; /* where its lines' offsets start */
+  int m_dev;
+  int m_ino;
+} maps[NMAPS];
+int nmaps;
+char *mapnext;
+char *mapend;
+int maptl;
 char *loc1;
 char *loc2;
 char *locs;
-char ibuff[512];
-int iblock = -1;
-char obuff[512];
-int oblock = -1;
-int ichanged;
-int nleft;
 void errfunc();
 /* int  *errlab=(int*)errfunc; */
 char TMPERR[] = "TMP";
@@ -213,9 +231,11 @@ void dounix();
 void compile(int c);
 int execute(int gf, int *addr);
 int putline();
-char *getblock(int atl, int iof);
 int getchar();
-void blkio(int b, char *buf, void *);
+int mapfile(int fd);
+int getmapped();
+void unmapfile(char *name);
+void unmapall();
 int compsub();
 void dosub();
 char *place(char *asp, char *al1, char *al2);
@@ -227,10 +247,6 @@ void putchar(char ac);
 void reset();
 void setexit();
 
-extern int strlen(const char *s);
-
-int creat(const char *fname, mode_t mode) { return open(fname, O_CREAT, mode); }
-
 int signal(int a1, ...) { return 0; }
 
 int main(int argc, char **argv) {
@@ -256,11 +272,16 @@ int main(int argc, char **argv) {
       ;
     globp = "r";
   }
+  addbuf = mmap(NULL, ADDBUF_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (addbuf == MAP_FAILED) {
+    puts("?");
+    return 1;
+  }
   fendcore = sbrk(0);
   init();
   /* setexit(); */
   commands();
-  unlink(tfname);
   return 0;
 }
 
@@ -375,7 +396,6 @@ void commands() {
     case 'q':
       setnoaddr();
       newline();
-      unlink(tfname);
       exit(0);
 
     case 'r':
@@ -387,7 +407,10 @@ void commands() {
       }
       setall();
       ninbuf = 0;
-      append(getfile, addr2);
+      if (mapfile(io))
+        append(getmapped, addr2);
+      else
+        append(getfile, addr2);
       exfile();
       continue;
 
@@ -409,6 +432,7 @@ void commands() {
       setall();
       nonzero();
       filename();
+      unmapfile(file);
       if ((io = open(file, O_CREAT | O_RDWR | O_TRUNC, 0666)) < 0)
         error;
       putfile();
@@ -747,7 +771,7 @@ int *a;
         error;
       *corep += 1024;
     }
-    tl = putline();
+    tl = f == getmapped ? maptl : putline();
     nline++;
     a1 = ++dol;
     a2 = a1 + 1;
@@ -800,102 +824,147 @@ void delete () {
 }
 
 char *getline(int tl) {
-  register char *bp, *lp;
-  register int nl;
+  register char *bp, *lp, *ep;
+  register struct mapping *m;
+  unsigned int off;
 
   lp = linebuf;
-  bp = getblock(tl, READ);
-  nl = nleft;
-  tl &= ~0377;
-  while ((*lp++ = *bp++))
-    if (--nl == 0) {
-      bp = getblock(tl += 0400, READ);
-      nl = nleft;
-    }
+  off = (unsigned int)tl >> TLSHIFT;
+  if (!(tl & MAPPED)) {
+    bp = addbuf + off;
+    while ((*lp++ = *bp++))
+      ;
+    return (linebuf);
+  }
+  for (m = maps; off - m->m_off >= m->m_len; m++)
+    ;
+  bp = m->m_addr + (off - m->m_off);
+  ep = m->m_addr + m->m_len;
+  /* As getfile() would have stored it */
+  while (bp < ep && *bp != '\n' && lp < &linebuf[LBSIZE - 1]) {
+    if ((*lp = *bp++ & 0177))
+      lp++;
+  }
+  *lp = 0;
   return (linebuf);
 }
 
 int putline() {
   register char *bp, *lp;
-  register int nl;
   int tl;
 
+  if (tline > ADDBUF_SIZE - LBSIZE) {
+    puts(TMPERR);
+    error;
+    return (0);
+  }
   lp = linebuf;
-  tl = tline;
-  bp = getblock(tl, WRITE);
-  nl = nleft;
-  tl &= ~0377;
+  bp = addbuf + tline;
   while ((*bp = *lp++)) {
     if (*bp++ == '\n') {
       *--bp = 0;
       linebp = lp;
       break;
     }
-    if (--nl == 0) {
-      bp = getblock(tl += 0400, WRITE);
-      nl = nleft;
-    }
   }
-  nl = tline;
-  tline += (((lp - linebuf) + 03) >> 1) & 077776;
-  return (nl);
+  tl = tline << TLSHIFT;
+  tline = bp + 1 - addbuf;
+  return (tl);
 }
 
-char *getblock(int atl, int iof) {
-  register int bno, off;
+/* Maps in the file open on fd for getmapped(), if it's a regular file and
+ * there's room. Returns whether it did. */
+int mapfile(int fd) {
+  struct stat st;
+  struct mapping *m;
+  unsigned int off;
+  char *addr;
 
-  bno = (atl >> 8) & 0377;
-  off = (atl << 1) & 0774;
-  if (bno >= 255) {
-    puts(TMPERR);
+  if (nmaps == NMAPS || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_size <= 0)
+    return (0);
+  m = &maps[nmaps];
+  off = nmaps ? m[-1].m_off + m[-1].m_len : 0;
+  if ((unsigned int)st.st_size > ((~0U >> TLSHIFT) - off))
+    return (0);
+  addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED)
+    return (0);
+  m->m_addr = addr;
+  m->m_len = st.st_size;
+  m->m_off = off;
+  m->m_dev = st.st_dev;
+  m->m_ino = st.st_ino;
+  nmaps++;
+  mapnext = addr;
+  mapend = addr + st.st_size;
+  return (1);
+}
+
+/* The getfile() for a mapped file: rather than copying the next line into
+ * linebuf, it leaves its name in maptl for append(). */
+int getmapped() {
+  register struct mapping *m;
+  register char *nl;
+  int len;
+
+  if (mapnext >= mapend)
+    return (EOF);
+  if (!(nl = memchr(mapnext, '\n', mapend - mapnext)))
+    nl = mapend;
+  len = nl - mapnext;
+  if (len >= LBSIZE)
     error;
+  m = &maps[nmaps - 1];
+  maptl = ((m->m_off + (mapnext - m->m_addr)) << TLSHIFT) | MAPPED;
+  count[1] += len + (nl < mapend);
+  mapnext = nl + 1;
+  return (0);
+}
+
+/* Copies the lines still in files into addbuf, before one of those files
+ * is written over. */
+void unmapfile(char *name) {
+  struct stat st;
+  int i;
+
+  if (stat(name, &st) < 0)
+    return;
+  for (i = 0; i < nmaps; i++) {
+    if (maps[i].m_dev == st.st_dev && maps[i].m_ino == st.st_ino)
+      break;
   }
-  nleft = 512 - off;
-  if (bno == iblock) {
-    ichanged |= iof;
-    return (ibuff + off);
-  }
-  if (bno == oblock)
-    return (obuff + off);
-  if (iof == READ) {
-    if (ichanged)
-      blkio(iblock, ibuff, (void *)write);
-    ichanged = 0;
-    iblock = bno;
-    blkio(bno, ibuff, (void *)read);
-    return (ibuff + off);
-  }
-  if (oblock >= 0)
-    blkio(oblock, obuff, (void *)write);
-  oblock = bno;
-  return (obuff + off);
+  if (i == nmaps)
+    return;
+  unmapall();
 }
 
-void blkio(int b, char *buf, void *iofcn) {
-  int (*iof)(int f, char *b, int len) = (int (*)(int f, char *b, int len))iofcn;
-  lseek(tfile, b, SEEK_SET);
-  if ((*iof)(tfile, buf, 512) != 512) {
-    puts(TMPERR);
-    error;
+void unmapall() {
+  register int *a1, tl;
+  int i;
+
+  for (a1 = zero + 1; a1 <= dol; a1++) {
+    if (!(*a1 & MAPPED))
+      continue;
+    getline(*a1);
+    tl = putline();
+    for (i = 0; i < 26; i++) {
+      if (names[i] == (*a1 | 01))
+        names[i] = tl | 01;
+    }
+    *a1 = tl | (*a1 & 01);
   }
+  for (i = 0; i < nmaps; i++)
+    munmap(maps[i].m_addr, maps[i].m_len);
+  nmaps = 0;
 }
 
 void init() {
-  register char *p;
-  register int pid;
-
-  close(tfile);
-  tline = 0;
-  iblock = -1;
-  oblock = -1;
-  ichanged = 0;
-  pid = getpid();
-  for (p = &tfname[11]; p > &tfname[6];) {
-    *--p = (pid & 07) + '0';
-    pid >>= 3;
-  }
-  close(creat(tfname, 0600));
-  tfile = open(tfname, O_RDWR, 0);
+  dol = zero;
+  unmapall();
+  /* Line 0 is the empty line, which putline() gives out when it's full */
+  addbuf[0] = 0;
+  tline = 1;
   brk(fendcore);
   dot = zero = dol = fendcore;
   endcore = fendcore - 2;
@@ -1380,7 +1449,12 @@ void putd() {
                 putd();
         putchar(r + '0');
 #else
-  printf("%d", count[1]);
+  char buf[12], *p;
+
+  /* through putchar, so the digits stay in order with the rest of line */
+  snprintf(buf, sizeof(buf), "%d", count[1]);
+  for (p = buf; *p; p++)
+    putchar(*p);
 #endif
 }
 
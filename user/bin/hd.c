@@ -8,6 +8,72 @@
 #include <unistd.h>
 
 #define LINE_LEN 16
+#define LINE_MAX 80 /* longest line written, with room to spare */
+
+/* Input is read, and output written, in chunks of this many bytes */
+#define BUF_LEN (16 * 4096)
+
+static char inbuf[BUF_LEN];
+static char outbuf[BUF_LEN];
+static int outlen;
+
+/* The two hex digits of each byte value */
+static char hexpair[256][2];
+
+static void flush_out(void) {
+  int n, done = 0;
+
+  while (done < outlen) {
+    if ((n = write(1, outbuf + done, outlen - done)) < 0) {
+      fprintf(stderr, "write: %s\n", strerror(errno));
+      exit(1);
+    }
+    done += n;
+  }
+  outlen = 0;
+}
+
+static char *put_offset(char *out, unsigned int off) {
+  int shift;
+
+  for (shift = 24; shift >= 0; shift -= 8) {
+    *out++ = hexpair[(off >> shift) & 0xff][0];
+    *out++ = hexpair[(off >> shift) & 0xff][1];
+  }
+  return out;
+}
+
+static void put_line(const unsigned char *line, int bytes, unsigned int off) {
+  char *out, *chars;
+  int i;
+
+  if (outlen > BUF_LEN - LINE_MAX)
+    flush_out();
+  out = outbuf + outlen;
+
+  out = put_offset(out, off);
+  *out++ = ' ';
+  *out++ = ' ';
+  /* The printable characters go after the bytes, which take a fixed width */
+  chars = out + LINE_LEN * 3 + 1;
+  *chars++ = '|';
+  for (i = 0; i < LINE_LEN; ++i) {
+    if (i < bytes) {
+      out[0] = hexpair[line[i]][0];
+      out[1] = hexpair[line[i]][1];
+      *chars++ = (line[i] < 32 || line[i] > 126) ? '.' : line[i];
+    } else {
+      out[0] = out[1] = ' ';
+    }
+    out[2] = ' ';
+    out += 3;
+    if (i == 7)
+      *out++ = ' ';
+  }
+  *chars++ = '|';
+  *chars++ = '\n';
+  outlen = chars - outbuf;
+}
 
 int main(int argc, char **argv) {
   int readfd = 0;
@@ -22,50 +88,59 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  char lastbuf[LINE_LEN];
-  char curbuf[LINE_LEN];
-  int off = 0;
+  static const char hexdigits[] = "0123456789abcdef";
+  unsigned char lastbuf[LINE_LEN];
+  unsigned char *line;
+  unsigned int off = 0;
   int lastrep = 0;
+  int have = 0;
   int bytes;
 
   int i;
-  while ((bytes = read(readfd, curbuf, LINE_LEN)) > 0) {
-    if (off > 0 && !memcmp(lastbuf, curbuf, LINE_LEN)) {
-      if (!lastrep) {
-        printf("*\n");
-        lastrep = 1;
-      }
-      off += bytes;
-      continue;
-    }
-    lastrep = 0;
-    printf("%08x  ", off);
-    off += bytes;
-    /* print bytes */
-    for (i = 0; i < LINE_LEN; ++i) {
-      if (i < bytes) {
-        printf("%02x ", (unsigned char)curbuf[i]);
-      } else {
-        printf("   ");
-      }
-      if (i == 7) {
-        printf(" ");
-      }
+  for (i = 0; i < 256; ++i) {
+    hexpair[i][0] = hexdigits[i >> 4];
+    hexpair[i][1] = hexdigits[i & 0xf];
+  }
+
+  for (;;) {
+    bytes = read(readfd, inbuf + have, BUF_LEN - have);
+    if (bytes < 0) {
+      fprintf(stderr, "read: %s\n", strerror(errno));
+      break;
     }
-    /* show printable characters */
-    printf("|");
-    for (i = 0; i < bytes; ++i) {
-      char c = curbuf[i];
-      if (c < 32 || c > 126) {
-        printf(".");
+    have += bytes;
+
+    /* Dump every whole line read, and at the end whatever is left */
+    line = (unsigned char *)inbuf;
+    while (have >= LINE_LEN || (bytes == 0 && have > 0)) {
+      int len = have < LINE_LEN ? have : LINE_LEN;
+
+      if (len == LINE_LEN && off > 0 && !memcmp(lastbuf, line, LINE_LEN)) {
+        if (!lastrep) {
+          outbuf[outlen++] = '*';
+          outbuf[outlen++] = '\n';
+          if (outlen > BUF_LEN - LINE_MAX)
+            flush_out();
+          lastrep = 1;
+        }
       } else {
-        printf("%c", c);
+        lastrep = 0;
+        put_line(line, len, off);
+        memcpy(lastbuf, line, len);
       }
+      off += len;
+      line += len;
+      have -= len;
     }
-    printf("|\n");
-    memcpy(lastbuf, curbuf, LINE_LEN);
+    if (bytes == 0)
+      break;
+    memmove(inbuf, line, have);
   }
-  printf("%08x\n", off);
+
+  char *out = put_offset(outbuf + outlen, off);
+  *out++ = '\n';
+  outlen = out - outbuf;
+  flush_out();
 
   if (readfd > 0) {
     close(readfd);
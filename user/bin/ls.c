@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -7,16 +9,66 @@
 
 #include <errno.h>
 
+/* Entries fetched by each getdents() */
+#define LS_BATCH 128
+
+typedef struct ls_entry {
+  int le_size;
+  ino_t le_ino;
+  char le_name[NAME_LEN + 1];
+} ls_entry_t;
+
+static ls_entry_t *entries;
+static int nentries, maxentries;
+
+static void sift_down(ls_entry_t **heap, int root, int n) {
+  ls_entry_t *tmp;
+  int child;
+
+  while ((child = 2 * root + 1) < n) {
+    if (child + 1 < n &&
+        strcmp(heap[child]->le_name, heap[child + 1]->le_name) < 0)
+      child++;
+    if (strcmp(heap[root]->le_name, heap[child]->le_name) >= 0)
+      return;
+    tmp = heap[root];
+    heap[root] = heap[child];
+    heap[child] = tmp;
+    root = child;
+  }
+}
+
+/* Heapsorts the entries by name */
+static void sort_entries(ls_entry_t **sorted, int n) {
+  ls_entry_t *tmp;
+  int i;
+
+  for (i = n / 2 - 1; i >= 0; i--)
+    sift_down(sorted, i, n);
+  for (i = n - 1; i > 0; i--) {
+    tmp = sorted[0];
+    sorted[0] = sorted[i];
+    sorted[i] = tmp;
+    sift_down(sorted, 0, i);
+  }
+}
+
+/*
+ * Lists dir sorted by name. Its entries are read LS_BATCH at a time, and
+ * each is stat()ed relative to the open directory, which saves resolving
+ * the directory's path once per entry.
+ */
 static int do_ls(const char *dir) {
   int fd;
   struct dirent *dirent;
   int nbytes;
-  char tmpbuf[256];
   struct stat sbuf;
+  ls_entry_t **sorted;
+  int i;
 
   union {
     struct dirent dirent;
-    char buf[4096];
+    char buf[LS_BATCH * sizeof(struct dirent)];
   } lsb;
 
   fd = open(dir, O_RDONLY, 0600);
@@ -25,6 +77,7 @@ static int do_ls(const char *dir) {
     return 1;
   }
 
+  nentries = 0;
   while ((nbytes = getdents(fd, &lsb.dirent, sizeof(lsb))) > 0) {
     dirent = &lsb.dirent;
 
@@ -36,20 +89,43 @@ static int do_ls(const char *dir) {
     }
     do {
       int reclen;
-      int size;
+      ls_entry_t *e;
 
-      snprintf(tmpbuf, 256, "%s/%s", dir, dirent->d_name);
-      if (0 == stat(tmpbuf, &sbuf))
-        size = sbuf.st_size;
+      if (nentries == maxentries) {
+        maxentries = maxentries ? 2 * maxentries : LS_BATCH;
+        if (!(entries = realloc(entries, maxentries * sizeof(*entries)))) {
+          fprintf(stderr, "ls: out of memory\n");
+          return 1;
+        }
+      }
+      e = &entries[nentries++];
+      if (0 == fstatat(fd, dirent->d_name, &sbuf))
+        e->le_size = sbuf.st_size;
       else
-        size = 0;
+        e->le_size = 0;
+      e->le_ino = dirent->d_ino;
+      strcpy(e->le_name, dirent->d_name);
 
       reclen = sizeof(struct dirent);
-      fprintf(stdout, "%7d  %-20s   %d\n", size, dirent->d_name, dirent->d_ino);
       dirent = (struct dirent *)(((char *)dirent) + reclen);
       nbytes -= reclen;
     } while (nbytes);
   }
+
+  if (nentries) {
+    if (!(sorted = malloc(nentries * sizeof(*sorted)))) {
+      fprintf(stderr, "ls: out of memory\n");
+      return 1;
+    }
+    for (i = 0; i < nentries; i++)
+      sorted[i] = &entries[i];
+    sort_entries(sorted, nentries);
+    for (i = 0; i < nentries; i++)
+      fprintf(stdout, "%7d  %-20s   %d\n", sorted[i]->le_size,
+              sorted[i]->le_name, sorted[i]->le_ino);
+    free(sorted);
+  }
+
   if (nbytes < 0) {
     if (errno == ENOTDIR)
       fprintf(stdout, "%s\n", dir);
@@ -14,6 +14,8 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <stdio.h>
+#include <spawn.h>
+#include <sys/stat.h>
 
 #define ROOT "/"
 
@@ -25,7 +27,7 @@
 
 typedef struct redirect {
   int r_sfd;
-  int r_dfd;
+  int r_dfd; /* or -1 to only close r_sfd in the new process */
 } redirect_t;
 
 typedef struct redirect_map {
@@ -42,6 +44,8 @@ static char **my_envp;
 
 static void parse(char *line);
 static int execute(int argc, char *argv[], redirect_map_t *map);
+static int start_command(int argc, char *argv[], redirect_map_t *map);
+static void cleanup_redirects(redirect_map_t *map);
 static void add_redirect(redirect_map_t *map, int sfd, int dfd);
 
 #define DECL_CMD(x) static int cmd_##x(int argc, char *argv[], ioenv_t *io)
@@ -52,6 +56,8 @@ DECL_CMD(help);
 DECL_CMD(exit);
 DECL_CMD(mkdir);
 DECL_CMD(rmdir);
+DECL_CMD(mount);
+DECL_CMD(umount);
 DECL_CMD(clear);
 DECL_CMD(ln);
 DECL_CMD(rm);
@@ -63,6 +69,7 @@ DECL_CMD(sync);
 DECL_CMD(check);
 DECL_CMD(repeat);
 DECL_CMD(parallel);
+DECL_CMD(hash);
 
 typedef struct {
   const char *cmd_name;
@@ -83,15 +90,126 @@ static cmd_t builtin_cmds[] = {
     {"help", cmd_help, "list shell commands"},
     {"ln", cmd_ln, "link file"},
     {"mkdir", cmd_mkdir, "create a directory"},
+    {"mount", cmd_mount, "mount a file system"},
     {"mv", cmd_mv, "move file"},
     {"quit", cmd_exit, "exit shell"},
     {"rm", cmd_rm, "remove file(s)"},
     {"rmdir", cmd_rmdir, "remove a directory"},
     {"sync", cmd_sync, "sync filesystems"},
+    {"umount", cmd_umount, "unmount a file system"},
     {"repeat", cmd_repeat, "repeat a command"},
     {"parallel", cmd_parallel, "run multiple commands in parallel"},
+    {"hash", cmd_hash, "list or forget remembered command paths"},
     {NULL, NULL, NULL}};
 
+/*
+ * Commands are looked up first in the current directory and then in
+ * /usr/bin. The path each name resolved to is remembered, so that running
+ * a command again costs one spawn rather than a failed one per place
+ * searched; "hash -r" forgets them all. A command found in the current
+ * directory is only remembered until the next cd.
+ */
+#define HASH_BUCKETS 32
+#define HASH_PATH_MAX 256
+
+typedef struct hash_entry {
+  struct hash_entry *he_next;
+  int he_relative; /* found in the current directory */
+  int he_hits;
+  char he_path[HASH_PATH_MAX];
+  char he_name[];
+} hash_entry_t;
+
+static hash_entry_t *hash_table[HASH_BUCKETS];
+
+static hash_entry_t **hash_bucket(const char *name) {
+  unsigned int h = 0;
+
+  while (*name)
+    h = h * 31 + (unsigned char)*name++;
+  return &hash_table[h % HASH_BUCKETS];
+}
+
+static hash_entry_t **hash_find(const char *name) {
+  hash_entry_t **hep;
+
+  for (hep = hash_bucket(name); *hep; hep = &(*hep)->he_next) {
+    if (!strcmp((*hep)->he_name, name))
+      break;
+  }
+  return hep;
+}
+
+static void hash_forget(hash_entry_t **hep) {
+  hash_entry_t *he = *hep;
+
+  *hep = he->he_next;
+  free(he);
+}
+
+static void hash_forget_all(void) {
+  int i;
+
+  for (i = 0; i < HASH_BUCKETS; i++) {
+    while (hash_table[i])
+      hash_forget(&hash_table[i]);
+  }
+}
+
+static void hash_forget_relative(void) {
+  hash_entry_t **hep;
+  int i;
+
+  for (i = 0; i < HASH_BUCKETS; i++) {
+    for (hep = &hash_table[i]; *hep;) {
+      if ((*hep)->he_relative)
+        hash_forget(hep);
+      else
+        hep = &(*hep)->he_next;
+    }
+  }
+}
+
+static int is_command(const char *path) {
+  struct stat st;
+
+  return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+/* Returns the path to spawn for name, or NULL if there is no such command.
+ * Names containing a '/' are used as they are, and not remembered. */
+static const char *hash_lookup(const char *name) {
+  hash_entry_t **hep, *he;
+  char path[HASH_PATH_MAX];
+  int relative;
+
+  if (strchr(name, '/'))
+    return name;
+
+  if (*(hep = hash_find(name))) {
+    (*hep)->he_hits++;
+    return (*hep)->he_path;
+  }
+
+  if ((relative = is_command(name))) {
+    snprintf(path, sizeof(path), "%s", name);
+  } else {
+    snprintf(path, sizeof(path), "/usr/bin/%s", name);
+    if (!is_command(path))
+      return NULL;
+  }
+
+  if (!(he = malloc(sizeof(*he) + strlen(name) + 1)))
+    return name;
+  he->he_relative = relative;
+  he->he_hits = 1;
+  strcpy(he->he_path, path);
+  strcpy(he->he_name, name);
+  he->he_next = NULL;
+  *hep = he;
+  return he->he_path;
+}
+
 #define builtin_stdin (&io->io_map_file[0])
 #define builtin_stdout (&io->io_map_file[1])
 #define builtin_stderr (&io->io_map_file[2])
@@ -746,7 +864,7 @@ DECL_CMD(sync) {
 
 static int do_cp(ioenv_t *io, const char *cmd, const char *in_file, int in_fd,
                  const char *out_file, int out_fd) {
-#define buffer_sz 4096
+#define buffer_sz (16 * 4096) /* as much as a pipe holds */
 
   static char buffer[buffer_sz];
   int nbytes_in;
@@ -757,6 +875,17 @@ static int do_cp(ioenv_t *io, const char *cmd, const char *in_file, int in_fd,
   if (is_std_stream(out_fd))
     out_fd = io->io_map_fd[out_fd];
 
+  /* Let the kernel move the data if it can, without copying it here */
+  while ((nbytes_in = sendfile(out_fd, in_fd, NULL, buffer_sz)) > 0)
+    ;
+  if (nbytes_in == 0)
+    return 1;
+  if (errno != EINVAL) {
+    fprintf(stderr, "%s: unable to copy from %s to %s: %s\n", cmd, in_file,
+            out_file, strerror(errno));
+    return 0;
+  }
+
   while ((nbytes_in = read(in_fd, buffer, buffer_sz)) > 0) {
     if ((nbytes_out = write(out_fd, buffer, nbytes_in)) < 0) {
       fprintf(stderr, "%s: unable to write to %s: %s\n", cmd, out_file,
@@ -946,6 +1075,34 @@ DECL_CMD(rmdir) {
   return 0;
 }
 
+DECL_CMD(mount) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "usage: mount <type> <directory> [<device>]\n");
+    return 1;
+  }
+
+  if (mount(argc == 4 ? argv[3] : "", argv[2], argv[1]) < 0) {
+    fprintf(stderr, "mount: couldn't mount %s on %s: %s\n", argv[1], argv[2],
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+DECL_CMD(umount) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: umount <directory>\n");
+    return 1;
+  }
+
+  if (umount(argv[1]) < 0) {
+    fprintf(stderr, "umount: couldn't unmount %s: %s\n", argv[1],
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
 DECL_CMD(exit) {
   exit(0);
   return 1;
@@ -979,6 +1136,28 @@ DECL_CMD(cd) {
     fprintf(stderr, "sh: couldn't cd to %s: %s\n", dir, strerror(errno));
     return 1;
   }
+  hash_forget_relative();
+  return 0;
+}
+
+DECL_CMD(hash) {
+  hash_entry_t *he;
+  int i;
+
+  if (argc == 2 && !strcmp(argv[1], "-r")) {
+    hash_forget_all();
+    return 0;
+  }
+  if (argc > 1) {
+    fprintf(stderr, "usage: hash [-r]\n");
+    return 1;
+  }
+
+  fprintf(stdout, "hits\tcommand\n");
+  for (i = 0; i < HASH_BUCKETS; i++) {
+    for (he = hash_table[i]; he; he = he->he_next)
+      fprintf(stdout, "%4d\t%s\n", he->he_hits, he->he_path);
+  }
   return 0;
 }
 
@@ -1075,57 +1254,62 @@ DECL_CMD(parallel) {
     return 1;
   }
 
-  /* Fork and execute each command */
+  /* Start each command */
   for (i = 0; i < ncmds; i++) {
-    if (0 == (cmd_pids[i] = fork())) {
-      int status, fd, ii;
-      /* Build weird map thing (as in repeat) */
-      redirect_map_t map;
-      map.rm_nfds = 0;
-      for (ii = 0; ii < 3; ii++) {
-        if (0 > (fd = dup(io->io_map_fd[ii])))
-          exit(1);
-        add_redirect(&map, fd, ii);
-      }
-      /* Execute and return its status */
-      exit(execute(cmd_argcs[i], cmd_argvs[i], &map));
+    int fd, ii;
+    /* Build weird map thing (as in repeat) */
+    redirect_map_t map;
+    map.rm_nfds = 0;
+    for (ii = 0; ii < 3; ii++) {
+      if (0 > (fd = dup(io->io_map_fd[ii])))
+        break;
+      add_redirect(&map, fd, ii);
     }
+    if (ii < 3) {
+      cleanup_redirects(&map);
+      cmd_pids[i] = -1;
+      continue;
+    }
+    cmd_pids[i] = start_command(cmd_argcs[i], cmd_argvs[i], &map);
   }
   /* Wait for each command */
-  int status;
+  int status = 1;
   for (i = 0; i < ncmds; i++) {
-    wait(&status);
+    if (cmd_pids[i] >= 0)
+      waitpid(cmd_pids[i], 0, &status);
   }
   /* Return last status */
   return status;
 }
 
-static int do_redirect(redirect_map_t *map) {
-  int ii;
-  int newfd, oldfd;
+/* Starts filename in a new process with the redirections done, as
+ * fork, dup2 and execve would, but without copying our address space. Returns the new process's pid, or -1 with errno set. */
+static int spawn_redirected(const char *filename, char *argv[],
+                            redirect_map_t *map) {
+  struct spawn_action actions[2 * REDIR_MAX];
+  int ii, n = 0;
 
   for (ii = 0; ii < map->rm_nfds; ii++) {
-    oldfd = map->rm_redir[ii].r_sfd;
-    newfd = map->rm_redir[ii].r_dfd;
-
-    dbg((stderr, "do_redirect: dup2(%d,%d)\n", oldfd, newfd));
-
-    if (dup2(oldfd, newfd) < 0) {
-      fprintf(stderr, "do_redirect: dup2() failed: "
-                      "%s\n",
-              strerror(errno));
-      return -1;
+    if (map->rm_redir[ii].r_dfd >= 0) {
+      actions[n].sa_op = SPAWN_DUP2;
+      actions[n].sa_fd = map->rm_redir[ii].r_sfd;
+      actions[n].sa_newfd = map->rm_redir[ii].r_dfd;
+      n++;
     }
-    close(oldfd);
+    actions[n].sa_op = SPAWN_CLOSE;
+    actions[n].sa_fd = map->rm_redir[ii].r_sfd;
+    n++;
   }
-  return 0;
+  return spawn(filename, argv, my_envp, actions, n);
 }
 
 static void cleanup_redirects(redirect_map_t *map) {
   int ii;
 
-  for (ii = 0; ii < map->rm_nfds; ii++)
-    close(map->rm_redir[ii].r_sfd);
+  for (ii = 0; ii < map->rm_nfds; ii++) {
+    if (map->rm_redir[ii].r_dfd >= 0)
+      close(map->rm_redir[ii].r_sfd);
+  }
 }
 
 static void build_ioenv(redirect_map_t *map, ioenv_t *io) {
@@ -1150,15 +1334,77 @@ static int builtin_exec(cmd_t *cmd, int argc, char *argv[], ioenv_t *io) {
   return (*cmd->cmd_func)(argc, argv, io);
 }
 
-static int execute(int argc, char *argv[], redirect_map_t *map) {
-  int status, pid;
+static cmd_t *find_builtin(const char *name) {
   cmd_t *cmd;
 
   for (cmd = builtin_cmds; cmd->cmd_name; cmd++) {
-    if (!strcmp(cmd->cmd_name, argv[0]))
-      break;
+    if (!strcmp(cmd->cmd_name, name))
+      return cmd;
   }
-  if (cmd->cmd_name) {
+  return NULL;
+}
+
+/* Spawns the command argv[0] names, reporting why if it can't. Returns the
+ * new process's pid, or -1. The redirections are left to the caller. */
+static int spawn_command(char *argv[], redirect_map_t *map) {
+  const char *path;
+  int pid;
+
+  path = hash_lookup(argv[0]);
+  if (path) {
+    pid = spawn_redirected(path, argv, map);
+    if (0 > pid && errno == ENOENT && path != argv[0]) {
+      /* The remembered command has gone away; look for it again. */
+      hash_forget(hash_find(argv[0]));
+      if ((path = hash_lookup(argv[0])))
+        pid = spawn_redirected(path, argv, map);
+      else
+        errno = ENOENT;
+    }
+  } else {
+    pid = -1;
+    errno = ENOENT;
+  }
+  if (0 > pid && errno == ENOENT)
+    fprintf(stderr, "sh: command not found: %s\n", argv[0]);
+  if (0 > pid && errno != ENOENT)
+    fprintf(stderr, "sh: exec failed for %s: %s\n", argv[0], strerror(errno));
+  return pid;
+}
+
+/* Starts argv with the redirections in map without waiting for it: a
+ * command is spawned, and a builtin is run by a forked copy of the shell.
+ * Returns the new process's pid, or -1. */
+static int start_command(int argc, char *argv[], redirect_map_t *map) {
+  int pid, ii;
+
+  if (!find_builtin(argv[0])) {
+    pid = spawn_command(argv, map);
+    cleanup_redirects(map);
+    return pid;
+  }
+
+  if (0 == (pid = fork())) {
+    /* Redirect for real, so builtins writing to stdout are redirected too */
+    for (ii = 0; ii < map->rm_nfds; ii++) {
+      if (map->rm_redir[ii].r_dfd >= 0)
+        dup2(map->rm_redir[ii].r_sfd, map->rm_redir[ii].r_dfd);
+      close(map->rm_redir[ii].r_sfd);
+    }
+    map->rm_nfds = 0;
+    exit(execute(argc, argv, map));
+  }
+  if (0 > pid)
+    fprintf(stderr, "sh: fork failed for %s: %s\n", argv[0], strerror(errno));
+  cleanup_redirects(map);
+  return pid;
+}
+
+static int execute(int argc, char *argv[], redirect_map_t *map) {
+  int status, pid;
+  cmd_t *cmd;
+
+  if ((cmd = find_builtin(argv[0]))) {
     ioenv_t io;
 
     build_ioenv(map, &io);
@@ -1168,26 +1414,10 @@ static int execute(int argc, char *argv[], redirect_map_t *map) {
     return 0;
   }
 
-  if (!(pid = fork())) {
-    if (do_redirect(map) < 0)
-      exit(1);
-
-    execve(argv[0], argv, my_envp);
-    if (errno == ENOENT) {
-      char buf[256];
-      snprintf(buf, 255, "/usr/bin/%s", argv[0]);
-      execve(buf, argv, my_envp);
-      fprintf(stderr, "sh: command not found: %s\n", argv[0]);
-    } else
-      fprintf(stderr, "sh: exec failed for %s: %s\n", argv[0], strerror(errno));
-    exit(1);
-  } else {
-    if (0 > pid) {
-      fprintf(stderr, "sh: fork failed errno = %d\n", errno);
-    }
-  }
-
+  pid = spawn_command(argv, map);
   cleanup_redirects(map);
+  if (0 > pid)
+    return 1;
   int ret = wait(&status);
   if (status == EFAULT) {
     fprintf(stderr, "sh: child process accessed invalid memory\n");
@@ -1409,23 +1639,15 @@ static int parse_redirects(char *line, redirect_map_t *map) {
   return 0;
 }
 
-static void parse(char *line) {
-  char *argv[ARGV_MAX];
+/* Splits line into whitespace-separated words, in place. Returns how many
+ * there are; argv is NULL-terminated. */
+static int split_args(char *line, char *argv[]) {
   int argc;
   char *tmp;
-  int len;
-  redirect_map_t map;
 
   argc = 0;
   tmp = line;
 
-  len = strlen(line);
-  if (line[len - 1] == '\n')
-    line[len - 1] = 0;
-
-  if (parse_redirects(line, &map) < 0)
-    return;
-
   for (;;) {
     /* Ignore leading whitespace.
     */
@@ -1449,8 +1671,120 @@ static void parse(char *line) {
   }
 
   argv[argc] = NULL;
+  return argc;
+}
+
+/* Adds the redirection of dfd to a pipe, unless dfd is redirected
+ * elsewhere already, in which case the pipe end isn't needed. */
+static void pipe_redirect(redirect_map_t *map, int fd, int dfd) {
+  int ii;
+
+  for (ii = 0; ii < map->rm_nfds; ii++) {
+    if (map->rm_redir[ii].r_dfd == dfd) {
+      close(fd);
+      return;
+    }
+  }
+  add_redirect(map, fd, dfd);
+}
+
+#define PIPELINE_MAX 8
+
+/*
+ * Runs the commands in line separated by '|', each one's standard output
+ * going to the next one's standard input. All of them are started before
+ * any is waited for, so the data streams through the pipes. A builtin at
+ * the end of the pipeline runs in the shell itself, as everything writing
+ * to it is running already; builtins elsewhere get a forked shell so that
+ * they can't block the stages after them from starting.
+ */
+static void pipeline(char *line) {
+  static char *argvs[PIPELINE_MAX][ARGV_MAX];
+  char *stages[PIPELINE_MAX];
+  redirect_map_t maps[PIPELINE_MAX];
+  int argcs[PIPELINE_MAX], pids[PIPELINE_MAX];
+  int nstages, i, fds[2], status;
+  cmd_t *cmd;
+
+  nstages = 0;
+  stages[nstages++] = line;
+  while ((line = strchr(line, '|'))) {
+    if (nstages == PIPELINE_MAX) {
+      fprintf(stderr, "sh: too many commands in pipeline\n");
+      return;
+    }
+    *line++ = 0;
+    stages[nstages++] = line;
+  }
+
+  for (i = 0; i < nstages; i++) {
+    if (parse_redirects(stages[i], &maps[i]) < 0)
+      break;
+    if (!(argcs[i] = split_args(stages[i], argvs[i]))) {
+      fprintf(stderr, "sh: empty command in pipeline\n");
+      cleanup_redirects(&maps[i]);
+      break;
+    }
+  }
+  if (i < nstages) {
+    while (i--)
+      cleanup_redirects(&maps[i]);
+    return;
+  }
+
+  for (i = 0; i < nstages; i++) {
+    pids[i] = -1;
+    if (i < nstages - 1) {
+      if (0 > pipe(fds)) {
+        fprintf(stderr, "sh: pipe failed: %s\n", strerror(errno));
+        for (; i < nstages; i++)
+          cleanup_redirects(&maps[i]);
+        break;
+      }
+      pipe_redirect(&maps[i], fds[1], 1);
+      /* The writer mustn't hold the read end, or it would never see the
+       * reader go away. */
+      add_redirect(&maps[i], fds[0], -1);
+      pipe_redirect(&maps[i + 1], fds[0], 0);
+    }
+
+    if (i == nstages - 1 && (cmd = find_builtin(argvs[i][0]))) {
+      ioenv_t io;
+
+      build_ioenv(&maps[i], &io);
+      builtin_exec(cmd, argcs[i], argvs[i], &io);
+      destroy_ioenv(&io);
+      cleanup_redirects(&maps[i]);
+    } else {
+      pids[i] = start_command(argcs[i], argvs[i], &maps[i]);
+    }
+  }
+
+  for (i = 0; i < nstages; i++) {
+    if (pids[i] >= 0)
+      waitpid(pids[i], 0, &status);
+  }
+}
+
+static void parse(char *line) {
+  char *argv[ARGV_MAX];
+  int argc;
+  int len;
+  redirect_map_t map;
+
+  len = strlen(line);
+  if (line[len - 1] == '\n')
+    line[len - 1] = 0;
+
+  if (strchr(line, '|')) {
+    pipeline(line);
+    return;
+  }
+
+  if (parse_redirects(line, &map) < 0)
+    return;
 
-  if (!argc)
+  if (!(argc = split_args(line, argv)))
     return;
 
   execute(argc, argv, &map);
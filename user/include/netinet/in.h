@@ -0,0 +1 @@
+../../../kernel/include/net/in.h
\ No newline at end of file
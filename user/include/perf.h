@@ -0,0 +1 @@
+../../kernel/include/api/perf.h
\ No newline at end of file
@@ -1,17 +1,44 @@
 #pragma once
 
 struct pthread;
-struct pthread_cond;
-struct pthread_mutex;
 
 typedef struct pthread *pthread_t;
-typedef struct pthread_mutex *pthread_mutex_t;
-typedef struct pthread_cond *pthread_cond_t;
+
+/*
+ * Mutexes, condition variables and barriers are words which threads
+ * change with atomic instructions; they only make a syscall, futex(2),
+ * to sleep when they must wait, or to wake a thread which is waiting.
+ */
+typedef struct pthread_mutex {
+  int pm_state; /* 0 unlocked, 1 locked, 2 locked and maybe waited for */
+} pthread_mutex_t;
+
+typedef struct pthread_cond {
+  int pc_seq;                /* bumped by every signal and broadcast */
+  pthread_mutex_t *pc_mutex; /* the waiters', for broadcast to requeue to */
+} pthread_cond_t;
+
+typedef struct pthread_barrier {
+  pthread_mutex_t pb_lock;
+  unsigned int pb_count;   /* threads to wait for */
+  unsigned int pb_waiting; /* threads which have arrived */
+  int pb_seq;              /* bumped as the last thread arrives */
+} pthread_barrier_t;
+
+#define PTHREAD_MUTEX_INITIALIZER {0}
+#define PTHREAD_COND_INITIALIZER {0, 0}
+
+/* pthread_barrier_wait returns this in exactly one of the threads */
+#define PTHREAD_BARRIER_SERIAL_THREAD (-1)
+
+/* What a cancelled thread returns to pthread_join */
+#define PTHREAD_CANCELED ((void *)-1)
 
 /* Attributes NYI */
 typedef int pthread_attr_t;
 typedef int pthread_mutexattr_t;
 typedef int pthread_condattr_t;
+typedef int pthread_barrierattr_t;
 
 void pthread_cleanup_pop(int);
 void pthread_cleanup_push(void (*)(void *), void *routine_arg);
@@ -33,6 +60,12 @@ int pthread_mutex_trylock(pthread_mutex_t *mtx);
 int pthread_mutex_unlock(pthread_mutex_t *mtx);
 void pthread_yield(void);
 int pthread_cancel(pthread_t thr);
+pthread_t pthread_self(void);
+int pthread_mutex_destroy(pthread_mutex_t *mtx);
+int pthread_barrier_init(pthread_barrier_t *barrier,
+                         const pthread_barrierattr_t *, unsigned int count);
+int pthread_barrier_destroy(pthread_barrier_t *barrier);
+int pthread_barrier_wait(pthread_barrier_t *barrier);
 
 /* Everything below NYI */
 #if 0
@@ -55,7 +88,6 @@ int             pthread_mutexattr_init(pthread_mutexattr_t *);
 int             pthread_mutexattr_destroy(pthread_mutexattr_t *);
 int             pthread_mutexattr_gettype(pthread_mutexattr_t *, int *);
 int             pthread_mutexattr_settype(pthread_mutexattr_t *, int);
-int             pthread_mutex_destroy(pthread_mutex_t *);
 int             pthread_attr_getstacksize(const pthread_attr_t *, size_t *);
 int             pthread_attr_getstackaddr(const pthread_attr_t *, void **);
 int             pthread_attr_getguardsize(const pthread_attr_t *, size_t *);
@@ -85,7 +117,6 @@ int             pthread_rwlockattr_getpshared(const pthread_rwlockattr_t *,
                 int *);
 int             pthread_rwlockattr_setpshared(pthread_rwlockattr_t *, int);
 int             pthread_rwlockattr_destroy(pthread_rwlockattr_t *);
-pthread_t       pthread_self(void);
 int             pthread_setspecific(pthread_key_t, const void *);
 int             pthread_sigmask(int, const sigset_t *, sigset_t *);
 
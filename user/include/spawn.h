@@ -0,0 +1 @@
+../../kernel/include/api/spawn.h
\ No newline at end of file
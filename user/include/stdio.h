@@ -5,8 +5,15 @@
 #include "stdarg.h"
 #include "sys/types.h"
 
+/* Buffering modes, for setvbuf() */
+#define _IOFBF 0 /* written when the buffer fills */
+#define _IOLBF 1 /* also written at the end of each line */
+#define _IONBF 2 /* not buffered */
+
 /* Output not buffered */
-#define __IONBF 1
+#define __IONBF _IONBF
+
+#define BUFSIZ 1024
 
 #ifndef EOF
 #define EOF (-1)
@@ -16,8 +23,15 @@
 #define NULL 0
 #endif
 
-/* For now, just store a file descriptor */
-typedef int FILE;
+/* Only the three standard streams exist, there is no fopen() */
+typedef struct __file {
+  int _fd;
+  int _mode;    /* _IOFBF, _IOLBF or _IONBF, -1 until first written to */
+  char *_buf;   /* _size bytes, the first _len of them not written yet */
+  size_t _size;
+  size_t _len;
+  int _flags;
+} FILE;
 typedef off_t fpos_t;
 extern FILE *stdin;
 extern FILE *stdout;
@@ -32,6 +46,11 @@ int sprintf(char *buf, const char *fmt, ...)
     __attribute__((__format__(printf, 2, 3))) __attribute__((__nonnull__(2)));
 
 int fflush(FILE *stream);
+int setvbuf(FILE *stream, char *buf, int mode, size_t size);
+void setbuf(FILE *stream, char *buf);
+int fputc(int c, FILE *stream);
+int fputs(const char *s, FILE *stream);
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
 
 int vprintf(const char *fmt, va_list args)
     __attribute__((__format__(printf, 1, 0))) __attribute__((__nonnull__(1)));
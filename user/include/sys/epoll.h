@@ -0,0 +1 @@
+../../../kernel/include/fs/epoll.h
\ No newline at end of file
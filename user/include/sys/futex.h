@@ -0,0 +1 @@
+../../../kernel/include/proc/futex.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../kernel/include/fs/socket.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../kernel/include/proc/times.h
\ No newline at end of file
@@ -30,6 +30,23 @@
     ;
 #endif
 
+/*
+ * A program's results are kept in memory shared with the processes it
+ * forks. When it is run by testrun, they are kept instead in a slot of a
+ * file which testrun reads once the program exits: testrun leaves the
+ * file open as TEST_RESULTS_FD, at the offset of the slot, which it has
+ * filled with TEST_SLOT_MAGIC. test_init takes the slot over and closes
+ * the descriptor.
+ */
+#define TEST_RESULTS_FD 9
+#define TEST_SLOT_MAGIC 0x74736c74
+
+typedef struct test_data {
+  int td_magic; /* TEST_SLOT_MAGIC, in a testrun slot */
+  int td_passed;
+  int td_failed;
+} test_data_t;
+
 void test_init(void);
 void test_fini(void);
 
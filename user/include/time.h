@@ -0,0 +1 @@
+../../kernel/include/time.h
\ No newline at end of file
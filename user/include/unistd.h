@@ -29,10 +29,24 @@ pid_t waitpid(pid_t pid, int options, int *status);
 void thr_exit(int status);
 int thr_errno(void);
 void thr_set_errno(int n);
+int thr_create(void *entry, void *stack, void *tls);
+int thr_join(int tid, void **retval);
+int thr_cancel(int tid, void *retval);
+int thr_detach(int tid);
+void thr_yield(void);
+int gettid(void);
+int set_tls(void *base);
+int sched_setaffinity(int tid, const uint32_t *mask);
+int sched_getaffinity(int tid, uint32_t *mask);
 void yield(void);
 pid_t getpid(void);
 int halt(void);
 void sync(void);
+int fsync(int fd);
+int fdatasync(int fd);
+int ftruncate(int fd, off_t len);
+unsigned int sleep(unsigned int seconds);
+int usleep(unsigned int usecs);
 
 size_t get_free_mem(void);
 
@@ -41,6 +55,9 @@ int open(const char *filename, int flags, int mode);
 int close(int fd);
 int read(int fd, void *buf, size_t nbytes);
 int write(int fd, const void *buf, size_t nbytes);
+int pread(int fd, void *buf, size_t nbytes, off_t offset);
+int pwrite(int fd, const void *buf, size_t nbytes, off_t offset);
+int sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
 off_t lseek(int fd, off_t offset, int whence);
 int dup(int fd);
 int dup2(int ofd, int nfd);
@@ -52,12 +69,20 @@ int rename(const char *oldname, const char *newname);
 int chdir(const char *path);
 int getdents(int fd, struct dirent *dir, size_t size);
 int stat(const char *path, struct stat *buf);
+int fstat(int fd, struct stat *buf);
+int fstatat(int dirfd, const char *path, struct stat *buf);
+int isatty(int fd);
 int pipe(int pipefd[2]);
 
 /* VM-related */
 void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 int munmap(void *addr, size_t len);
+int madvise(void *addr, size_t len, int advice);
+void *mremap(void *addr, size_t oldlen, size_t newlen, int flags);
+int shm_open(const char *name, int oflag, int mode);
+int shm_unlink(const char *name);
 int brk(void *addr);
+int brk_populate(void *addr);
 void *sbrk(int incr);
 
 /* Mounting */
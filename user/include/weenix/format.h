@@ -0,0 +1 @@
+../../../kernel/include/util/format.h
\ No newline at end of file
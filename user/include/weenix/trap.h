@@ -7,10 +7,33 @@
 
 #define TRAP_INTR_STRING QUOTE(INTR_SYSCALL)
 
+/* 1 if the kernel takes system calls through SYSENTER, 0 if not, and -1
+ * until __trap_int has asked it */
+extern int __trap_sysenter;
+
+int __trap_int(uint32_t num, uint32_t arg);
+
+/*
+ * SYSENTER saves nothing for the way back, so we hand the kernel our
+ * stack pointer in %ecx and where to return to in %esi, and get the
+ * return value in %eax and errno in %esi. %ebx, %edi and %ebp survive,
+ * and %edx and %ecx do not.
+ */
 static inline int trap(uint32_t num, uint32_t arg) {
-  int ret;
-  __asm__ volatile("int $" TRAP_INTR_STRING : "=a"(ret) : "a"(num), "d"(arg));
-  /* Copy in errno */
-  __asm__ volatile("int $" TRAP_INTR_STRING : "=a"(errno) : "a"(SYS_errno));
-  return ret;
+  int ret, err;
+
+  if (0 < __trap_sysenter) {
+    __asm__ volatile("call 1f\n\t"
+                     "1: popl %%esi\n\t"
+                     "addl $2f-1b, %%esi\n\t"
+                     "movl %%esp, %%ecx\n\t"
+                     "sysenter\n\t"
+                     "2:"
+                     : "=a"(ret), "=S"(err), "+d"(arg)
+                     : "0"(num)
+                     : "ecx", "cc", "memory");
+    errno = err;
+    return ret;
+  }
+  return __trap_int(num, arg);
 }
@@ -15,28 +15,39 @@
 static unsigned long start;
 static unsigned long pos;
 static unsigned long amount;
+static unsigned long chunk; /* the size of each new piece of the pool */
 
-/* This function initializes the simple memory allocator.  We basically
- * allocate a specified number of pages to use as scratch memory for
- * the linker itself.  No deallocation functionality is provided; the
- * amount of memory used should be small, and is usually needed for the
- * duration of the program's execution, anyway.
- *
- * All this function does is mmap the specified number of pages of
- * /dev/zero to provide the memory for our little memory-wading-pool. */
-
-void _ldainit(unsigned long pagesize, unsigned long pages) {
-  amount = pagesize * pages;
+/* Maps a piece of anonymous memory of at least size bytes (and at least
+ * chunk) to carry on allocating from; what was left of the last one is
+ * given up, so this is only done when it is too small for the request */
+static void _ldagrow(unsigned long size) {
+  amount = chunk;
+  if (size > amount)
+    amount = (size + chunk - 1) / chunk * chunk;
   pos = 0;
 
   start = (unsigned long)mmap(NULL, amount, PROT_READ | PROT_WRITE,
                               MAP_PRIVATE | MAP_ANON, -1, 0);
   if (start == (unsigned long)MAP_FAILED) {
-    fprintf(stderr, "ld-weenix: panic - unable to map /dev/zero\n");
+    fprintf(stderr,
+            "ld.so.1: panic - unable to allocate %lu bytes (_ldalloc)\n", size);
     exit(1);
   }
 }
 
+/* This function initializes the simple memory allocator.  We basically
+ * allocate a specified number of pages to use as scratch memory for
+ * the linker itself, and as many more at a time whenever that runs out.
+ * No deallocation functionality is provided; the amount of memory used
+ * should be small, and is usually needed for the duration of the
+ * program's execution, anyway. Everything is packed end to end, so the
+ * structures for all of the modules share as few pages as they can. */
+
+void _ldainit(unsigned long pagesize, unsigned long pages) {
+  chunk = pagesize * pages;
+  _ldagrow(0);
+}
+
 /* This function allocates a block of memory of the specified size from
  * our memory pool.  The memory is word-aligned, and cannot be freed. */
 
@@ -47,11 +58,8 @@ void *_ldalloc(unsigned long size) {
     size = (size & ~3) + 4;
   }
 
-  if (pos + size > amount) {
-    fprintf(stderr,
-            "ld.so.1: panic - unable to allocate %lu bytes (_ldalloc)\n", size);
-    exit(1);
-  }
+  if (pos + size > amount)
+    _ldagrow(size);
 
   next = start + pos;
   pos += size;
@@ -0,0 +1,89 @@
+/*
+ *  File: ldcache.c
+ *  Desc: Finding libraries through the cache rather than by trying
+ *        each directory on the default path in turn
+ */
+
+#include "sys/types.h"
+#include "string.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+
+#include "ldcache.h"
+
+static const ldcache_hdr_t *cache;
+static uint32_t cache_size;
+static int cache_tried;
+
+/* Maps in the cache, if there is one and it looks sound */
+static void _ldcachemap() {
+  struct stat st;
+  void *addr;
+  int fd;
+
+  cache_tried = 1;
+  if ((fd = open(LDCACHE_PATH, O_RDONLY, 0)) < 0)
+    return;
+  if (fstat(fd, &st) < 0 || st.st_size < (int)sizeof(ldcache_hdr_t)) {
+    close(fd);
+    return;
+  }
+  addr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return;
+
+  cache = addr;
+  cache_size = st.st_size;
+  if (memcmp(cache->lc_magic, LDCACHE_MAGIC, sizeof(cache->lc_magic)) ||
+      cache->lc_nentries >
+          (cache_size - sizeof(ldcache_hdr_t)) / sizeof(ldcache_entry_t)) {
+    munmap(addr, cache_size);
+    cache = 0;
+  }
+}
+
+/* The string at offset off in the cache, or 0 if it runs off the end */
+static const char *_ldcachestr(uint32_t off) {
+  const char *s = (const char *)cache + off;
+
+  if (off >= cache_size || !memchr(s, 0, cache_size - off))
+    return 0;
+  return s;
+}
+
+/* Opens the library the cache has for name, which it binary searches
+ * for. Returns the file descriptor, or -1 if there is no cache, the
+ * cache doesn't have name, or the file it names can't be opened. */
+int _ldcacheopen(const char *name) {
+  const ldcache_entry_t *entries;
+  const char *entname, *path;
+  uint32_t lo, hi, mid;
+  int cmp;
+
+  if (!cache_tried)
+    _ldcachemap();
+  if (!cache)
+    return -1;
+
+  entries = (const ldcache_entry_t *)(cache + 1);
+  lo = 0;
+  hi = cache->lc_nentries;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (!(entname = _ldcachestr(entries[mid].le_name)))
+      return -1;
+    if (!(cmp = strcmp(name, entname))) {
+      if (!(path = _ldcachestr(entries[mid].le_path)))
+        return -1;
+      return open(path, O_RDONLY, 0);
+    }
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return -1;
+}
@@ -0,0 +1,37 @@
+/*
+ *  File: ldcache.h
+ *  Desc: The cache of where libraries are, which tools/mkldcache.py
+ *        writes when the disk image is built
+ */
+
+#ifndef _ldcache_h_
+#define _ldcache_h_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LDCACHE_PATH "/lib/ld.so.cache"
+#define LDCACHE_MAGIC "ldcache1"
+
+/*
+ * The file is this header, then the entries sorted by name, then the
+ * NUL-terminated strings they point to, by their offsets in the file.
+ */
+typedef struct ldcache_hdr {
+  char lc_magic[8];
+  uint32_t lc_nentries;
+} ldcache_hdr_t;
+
+typedef struct ldcache_entry {
+  uint32_t le_name; /* a library's file name */
+  uint32_t le_path; /* the absolute path to it */
+} ldcache_entry_t;
+
+int _ldcacheopen(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ldcache_h_ */
@@ -112,7 +112,8 @@ void _ldrelocobj(module_t *module) {
     switch (type) {
     /* Position-independent code should ONLY contain the next 4 types */
     case R_386_RELATIVE:
-      *addr += base;
+      if (base)
+        *addr += base;
       break;
     case R_386_COPY:
       symbol = _ldresolve(module, name, -1, &size, 1);
@@ -177,7 +178,9 @@ void _ldrelocplt(module_t *module) {
       printf("Unknown relocation type %d\n", ELF32_R_TYPE(rel[i].r_info));
       exit(1);
     }
-    *(Elf32_Addr *)(module->base + rel[i].r_offset) += module->base;
+    /* Loaded where it was linked to, so the slots are right as they are */
+    if (module->base)
+      *(Elf32_Addr *)(module->base + rel[i].r_offset) += module->base;
   }
 }
 
@@ -14,6 +14,66 @@
 #define H_nchain 1
 #define H_bucket 2
 
+/* The GNU hash table: a header, a Bloom filter of bloom_size words, the
+ * buckets, and then one hash value per symbol from symoffset on, with
+ * the low bit set on the last of each bucket's chain */
+#define G_nbucket 0
+#define G_symoffset 1
+#define G_bloomsize 2
+#define G_bloomshift 3
+#define G_bloom 4
+
+/* Resolved names, by GNU hash, so that the many relocations against the
+ * same few symbols (and the lazy bindings of them) search the modules
+ * once. Only what the whole link chain agrees on goes here, that is
+ * global and weak definitions with no type restriction. */
+#define LD_CACHE_SIZE 128 /* a power of two */
+
+typedef struct ldcache_t {
+  const char *name;
+  unsigned long hash;
+  ldsym_t sym;
+  Elf32_Word size;
+} ldcache_t;
+
+static ldcache_t _ldcache[LD_CACHE_SIZE];
+
+static unsigned long _ldgnuhash(const char *name) {
+  unsigned long h = 5381;
+
+  while (*name)
+    h = h * 33 + (unsigned char)*name++;
+  return h;
+}
+
+/* Looks name up with the module's GNU hash table. The Bloom filter turns
+ * most modules which lack the symbol away without touching their
+ * buckets, and the hash values in the chains without any strcmp */
+static int _ldgnulookup(module_t *module, const char *name,
+                        unsigned long hash) {
+  const Elf32_Word *gh = module->gnuhash;
+  const Elf32_Word *buckets = gh + G_bloom + gh[G_bloomsize];
+  const Elf32_Word *chain = buckets + gh[G_nbucket] - gh[G_symoffset];
+  Elf32_Word word, mask;
+  unsigned long y;
+
+  word = gh[G_bloom + (hash / 32) % gh[G_bloomsize]];
+  mask = (1U << (hash % 32)) | (1U << ((hash >> gh[G_bloomshift]) % 32));
+  if ((word & mask) != mask)
+    return STN_UNDEF;
+
+  y = buckets[hash % gh[G_nbucket]];
+  if (y < gh[G_symoffset])
+    return STN_UNDEF;
+  for (;; y++) {
+    if ((hash | 1) == (chain[y] | 1) &&
+        !strcmp(module->dynstr + module->dynsym[y].st_name, name))
+      return y;
+    if (chain[y] & 1)
+      return STN_UNDEF;
+  }
+}
+
 /* This function looks up the specified symbol in the specified
  * module.  If the symbol is present, it returns the symbol's index in
  * the dynamic symbol table, otherwise STN_UNDEF is returned. */
@@ -22,6 +82,9 @@ int _ldlookup(module_t *module, const char *name) {
   unsigned long hashval;
   unsigned long y;
 
+  if (module->gnuhash)
+    return _ldgnulookup(module, name, _ldgnuhash(name));
+
   hashval = _ldelfhash(name);
   hashval %= module->hash[H_nbucket];
 
@@ -73,25 +136,46 @@ ldsym_t _ldresolve(module_t *module, const char *name, int type,
                    Elf32_Word *size, int exclude) {
   module_t *curmod;
   ldsym_t sym;
+  Elf32_Word symsize;
+  int cacheable = !exclude && type < 0;
+  unsigned long hash = cacheable ? _ldgnuhash(name) : 0;
+  ldcache_t *ent = &_ldcache[hash & (LD_CACHE_SIZE - 1)];
+
+  if (cacheable && ent->name && ent->hash == hash && !strcmp(ent->name, name)) {
+    if (size)
+      *size = ent->size;
+    return ent->sym;
+  }
 
   curmod = module->first;
 
   while (curmod) {
     if (!exclude || curmod != module) {
-      if ((sym = _ldsymbol(curmod, name, STB_GLOBAL, type, size)))
-        return sym;
+      if ((sym = _ldsymbol(curmod, name, STB_GLOBAL, type, &symsize)))
+        goto found;
     }
     curmod = curmod->next;
   }
 
   curmod = module->first;
   while (curmod) {
-    if ((sym = _ldsymbol(curmod, name, STB_WEAK, type, size)))
-      return sym;
+    if ((sym = _ldsymbol(curmod, name, STB_WEAK, type, &symsize)))
+      goto found;
     curmod = curmod->next;
   }
 
   return _ldsymbol(module, name, STB_LOCAL, type, size);
+
+found:
+  if (cacheable) {
+    ent->name = name;
+    ent->hash = hash;
+    ent->sym = sym;
+    ent->size = symsize;
+  }
+  if (size)
+    *size = symsize;
+  return sym;
 }
 
 Elf32_Addr _rtresolve(module_t *mod, Elf32_Word reloff) {
@@ -25,6 +25,7 @@
 #include "ldresolve.h"
 #include "ldnames.h"
 #include "ldalloc.h"
+#include "ldcache.h"
 
 #ifndef DEFAULT_RUNPATH
 #define DEFAULT_RUNPATH "/lib:/usr/lib"
@@ -51,14 +52,17 @@ ldenv_t _ldenv;
 #define trunc_page(x) ((x) & ~(pagesize - 1))
 #define round_page(x) (((x)+pagesize - 1) & ~(pagesize - 1))
 
+/* Returns the value of the environment variable var, or 0 if it is not
+ * set */
 static const char *_ldgetenv(const char *var) {
   char **e = env;
   while (*e) {
     const char *p = *e;
-    while (*p == *var)
-      p++, var++;
-    if (*p == '=' && *var == 0) {
-      return p++;
+    const char *v = var;
+    while (*v && *p == *v)
+      p++, v++;
+    if (*p == '=' && *v == 0) {
+      return p + 1;
     }
     e++;
   }
@@ -67,7 +71,10 @@ static const char *_ldgetenv(const char *var) {
 
 static void _ldenv_init(char **environ) {
   env = environ;
-  if (_ldgetenv("LD_BIND_NOW")) {
+  /* Binding is lazy, through _ld_bind, unless LD_BIND_NOW is set to
+   * something */
+  const char *bindnow = _ldgetenv("LD_BIND_NOW");
+  if (bindnow && *bindnow) {
     _ldenv.ld_bind_now = 1;
   }
   if (_ldgetenv("LD_DEBUG")) {
@@ -107,6 +114,9 @@ static module_t *_ldlinkobj(module_t *info, char *baseaddr, Elf32_Dyn *dyn) {
     case DT_HASH:
       info->hash = (void *)(info->base + curdyn->d_un.d_ptr);
       break;
+    case DT_GNU_HASH:
+      info->gnuhash = (void *)(info->base + curdyn->d_un.d_ptr);
+      break;
     case DT_SYMTAB:
       info->dynsym = (void *)(info->base + curdyn->d_un.d_ptr);
       break;
@@ -343,12 +353,20 @@ void _ldloadobj(module_t *module) {
   char *loc;
   int fd, i;
 
-  /* attempt to open library */
-  fd = _ldtryopen(module->name, _ldenv.ld_library_path);
-  if (fd == -1)
-    fd = _ldtryopen(module->name, module->runpath);
-  if (fd == -1)
-    fd = _ldtryopen(module->name, default_runpath);
+  /* attempt to open library: a name with a '/' in it is a path, and is
+   * used as it is; the cache saves trying each directory on the default
+   * path for the rest */
+  if (strchr(module->name, '/')) {
+    fd = open(module->name, O_RDONLY, 0);
+  } else {
+    fd = _ldtryopen(module->name, _ldenv.ld_library_path);
+    if (fd == -1)
+      fd = _ldtryopen(module->name, module->runpath);
+    if (fd == -1)
+      fd = _ldcacheopen(module->name);
+    if (fd == -1)
+      fd = _ldtryopen(module->name, default_runpath);
+  }
   if (fd == -1) {
     printf(err_cantfind, module->name);
     exit(1);
@@ -374,7 +392,10 @@ void _ldloadobj(module_t *module) {
   top = round_page(top);
   size = top - bottom;
 
-  loc = (char *)mmap(NULL, size, PROT_NONE, MAP_SHARED, fd, 0);
+  /* A prelinked library (one linked to load somewhere other than 0) goes
+   * where it was linked to if nothing is there yet; then its base is 0,
+   * and relocating it leaves its pages alone */
+  loc = (char *)mmap((void *)bottom, size, PROT_NONE, MAP_SHARED, fd, 0);
   munmap(loc, size);
 
   /* Figure out whether or not things marked readonly need to
@@ -34,6 +34,7 @@ struct module_t {
 
   unsigned long base; /* base address of module       */
   Elf32_Word *hash;   /* the module's hash table      */
+  Elf32_Word *gnuhash; /* its GNU hash table, or NULL */
   Elf32_Sym *dynsym;  /* the dynamic symbol table     */
   char *dynstr;       /* the dynamic string table     */
 
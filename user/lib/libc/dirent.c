@@ -0,0 +1,48 @@
+#include "sys/types.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "errno.h"
+
+#include "dirent.h"
+
+DIR *opendir(const char *name) {
+  DIR *dirp;
+  int fd;
+
+  if (0 > (fd = open(name, O_RDONLY, 0)))
+    return NULL;
+  if (NULL == (dirp = malloc(sizeof(*dirp)))) {
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  dirp->d_fd = fd;
+  dirp->d_next = 0;
+  dirp->d_nbuf = 0;
+  return dirp;
+}
+
+struct dirent *readdir(DIR *dirp) {
+  int nbytes;
+
+  if (dirp->d_next >= dirp->d_nbuf) {
+    if (0 >= (nbytes = getdents(dirp->d_fd, dirp->d_buf, sizeof(dirp->d_buf))))
+      return NULL;
+    dirp->d_nbuf = nbytes / sizeof(dirent_t);
+    dirp->d_next = 0;
+  }
+  return &dirp->d_buf[dirp->d_next++];
+}
+
+void rewinddir(DIR *dirp) {
+  lseek(dirp->d_fd, 0, SEEK_SET);
+  dirp->d_next = 0;
+  dirp->d_nbuf = 0;
+}
+
+int closedir(DIR *dirp) {
+  int ret = close(dirp->d_fd);
+  free(dirp);
+  return ret;
+}
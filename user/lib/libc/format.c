@@ -0,0 +1 @@
+../../../kernel/util/format.c
\ No newline at end of file
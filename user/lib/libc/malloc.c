@@ -72,6 +72,7 @@ static int fdzero;
       wrterror("open of /dev/zero");                                           \
   }
 #define MADV_FREE MADV_DONTNEED
+#define HAS_MADVISE
 
 /*
  * No user serviceable parts behind this point.
@@ -138,12 +139,49 @@ struct pgfree {
 #define malloc_maxsize ((malloc_pagesize) >> 1)
 #endif
 
+/*
+ * Heap growths of up to this many pages are faulted in by the kernel
+ * straight away, since malloc is about to use them; larger ones are left
+ * to be faulted in as they are touched.
+ */
+#ifndef malloc_populate
+#define malloc_populate 16
+#endif
+
+/*
+ * Freed runs of at least this many pages are given back to the kernel
+ * with madvise(2), which drops their frames until they are touched again;
+ * the 'H' option does it for every run.
+ */
+#ifndef malloc_release
+#define malloc_release 16
+#endif
+
+/*
+ * Allocations of at least this many pages get anonymous mappings of their
+ * own, outside the heap, so that realloc can have the kernel move their
+ * pages with mremap(2) rather than copy them. They are found again
+ * through a hash on their address.
+ */
+#ifndef malloc_huge
+#define malloc_huge 32
+#endif
+
 /* A mask for the offset inside a page.  */
 #define malloc_pagemask ((malloc_pagesize)-1)
 
 #define pageround(foo) (((foo) + (malloc_pagemask)) & (~(malloc_pagemask)))
 #define ptr2index(foo) (((u_long)(foo) >> malloc_pageshift) - malloc_origo)
 
+/* Once a process has threads they share one lock, and each has a slot
+ * for its cache of chunks; see pthread.c */
+void __libc_malloc_lock(void);
+void __libc_malloc_unlock(void);
+void **__libc_malloc_tcache(void);
+void __libc_malloc_thread_exit(void);
+#define THREAD_LOCK() __libc_malloc_lock()
+#define THREAD_UNLOCK() __libc_malloc_unlock()
+
 #ifndef THREAD_LOCK
 #define THREAD_LOCK()
 #endif
@@ -184,6 +222,9 @@ static unsigned malloc_ninfo;
 /* Free pages line up here */
 static struct pgfree free_list;
 
+/* Has any thread got a cache of chunks ?  */
+static int malloc_tcaches;
+
 /* Abort(), user doesn't handle problems.  */
 static int malloc_abort;
 
@@ -239,6 +280,20 @@ static void *malloc_brk;
 /* one location cache for free-list holders */
 static struct pgfree *px;
 
+/* This structure describes a huge allocation */
+struct pghuge {
+  struct pghuge *next; /* next in the hash chain */
+  void *page;          /* pointer to the mapping */
+  size_t size;         /* its length in bytes */
+};
+
+#define HUGE_HASH 64
+#define huge_chain(p)                                                          \
+  (&huge_hash[((u_long)(p) >> malloc_pageshift) % HUGE_HASH])
+
+/* huge allocations, by address */
+static struct pghuge *huge_hash[HUGE_HASH];
+
 /* compile-time options */
 char *malloc_options;
 typedef char *caddr_t;
@@ -296,7 +351,7 @@ static void *map_pages(int pages) {
   result = (caddr_t)pageround((u_long)sbrk(0));
   tail = result + (pages << malloc_pageshift);
 
-  if (brk(tail)) {
+  if (pages <= malloc_populate ? brk_populate(tail) : brk(tail)) {
 #ifdef EXTRA_SANITY
     wrterror("(ES): map_pages fails\n");
 #endif /* EXTRA_SANITY */
@@ -358,8 +413,9 @@ static int extend_pgdir(u_long index) {
   old = page_dir;
   page_dir = new;
 
-  /* Now free the old stuff */
-  munmap((char *)old, oldlen);
+  /* Now free the old stuff, unless a thread cache may still read it */
+  if (!malloc_tcaches)
+    munmap((char *)old, oldlen);
   return 1;
 }
 
@@ -720,6 +776,44 @@ static void *malloc_bytes(size_t size) {
   return (u_char *)bp->page + k;
 }
 
+/*
+ * Allocate a huge piece of memory
+ */
+static void *malloc_huge_pages(size_t size) {
+  struct pghuge *hp;
+  void *p;
+
+  size = pageround(size);
+  if (!(hp = imalloc(sizeof *hp)))
+    return 0;
+  p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED) {
+    ifree(hp);
+    return 0;
+  }
+  hp->page = p;
+  hp->size = size;
+  hp->next = *huge_chain(p);
+  *huge_chain(p) = hp;
+
+  if (malloc_junk)
+    memset(p, SOME_JUNK, size);
+
+  return p;
+}
+
+/*
+ * Find the link to a huge allocation, if ptr is one
+ */
+static struct pghuge **huge_find(void *ptr) {
+  struct pghuge **hpp;
+
+  for (hpp = huge_chain(ptr); *hpp; hpp = &(*hpp)->next)
+    if ((*hpp)->page == ptr)
+      return hpp;
+  return 0;
+}
+
 /*
  * Allocate a piece of memory
  */
@@ -733,6 +827,8 @@ static void *imalloc(size_t size) {
     result = 0;
   else if (size <= malloc_maxsize)
     result = malloc_bytes(size);
+  else if (size >= (malloc_huge << malloc_pageshift))
+    result = malloc_huge_pages(size);
   else
     result = malloc_pages(size);
 
@@ -745,6 +841,58 @@ static void *imalloc(size_t size) {
   return result;
 }
 
+/*
+ * Grow the run of pages at ptr, osize bytes long, to hold size bytes where
+ * it is: from a free run straight after it, and from moving the break up
+ * if that is (or it is) at the end of the heap.
+ */
+static int grow_pages(void *ptr, u_long osize, size_t size) {
+  void *tail = (char *)ptr + osize;
+  u_long need, have = 0, i;
+  struct pgfree *pf = 0;
+
+  if (pageround(size) < size) /* Check for overflow */
+    return 0;
+  need = pageround(size) - osize;
+
+  if (ptr2index(tail) <= last_index &&
+      page_dir[ptr2index(tail)] == MALLOC_FREE) {
+    for (pf = free_list.next; pf && pf->page != tail; pf = pf->next)
+      ;
+    if (!pf)
+      wrterror("freelist is destroyed.\n");
+    have = pf->size;
+  }
+
+  if (have < need) {
+    if ((char *)tail + have != malloc_brk || /* If there's more behind, */
+        malloc_brk != sbrk(0) ||             /* ..or it's not OK to do, */
+        !map_pages((need - have) >> malloc_pageshift)) /* ..or no memory */
+      return 0;
+  }
+
+  for (i = ptr2index(tail); i < ptr2index((char *)tail + need); i++)
+    page_dir[i] = MALLOC_FOLLOW;
+
+  if (!pf)
+    return 1;
+  if (pf->size > need) {
+    pf->page = (char *)pf->page + need;
+    pf->size -= need;
+    return 1;
+  }
+
+  /* The whole run is gone */
+  if (pf->next)
+    pf->next->prev = pf->prev;
+  pf->prev->next = pf->next;
+  if (!px)
+    px = pf;
+  else
+    ifree(pf);
+  return 1;
+}
+
 /*
  * Change the size of an allocation.
  */
@@ -752,6 +900,7 @@ static void *irealloc(void *ptr, size_t size) {
   void *p;
   u_long osize, index;
   struct pginfo **mp;
+  struct pghuge **hpp, *hp;
   int i;
 
   if (suicide)
@@ -759,6 +908,27 @@ static void *irealloc(void *ptr, size_t size) {
 
   index = ptr2index(ptr);
 
+  if ((index < malloc_pageshift || index > last_index) &&
+      (hpp = huge_find(ptr))) {
+    osize = (*hpp)->size;
+    if (!malloc_realloc) {
+      if (pageround(size) == osize)
+        return ptr;
+      /* Resize the mapping, letting the kernel move it */
+      p = mremap(ptr, osize, pageround(size), MREMAP_MAYMOVE);
+      if (p != MAP_FAILED) {
+        hp = *hpp;
+        *hpp = hp->next;
+        hp->page = p;
+        hp->size = pageround(size);
+        hp->next = *huge_chain(p);
+        *huge_chain(p) = hp;
+        return p;
+      }
+    }
+    goto copy;
+  }
+
   if (index < malloc_pageshift) {
     wrtwarning("junk pointer, too low to make sense.\n");
     return 0;
@@ -789,6 +959,10 @@ static void *irealloc(void *ptr, size_t size) {
       return ptr;                           /* don't do anything. */
     }
 
+    /* Take the pages after it, if they are free, rather than copy */
+    if (!malloc_realloc && size > osize && grow_pages(ptr, osize, size))
+      return ptr;
+
   } else if (*mp >= MALLOC_MAGIC) { /* Chunk allocation */
 
     /* Check the pointer for sane values */
@@ -820,6 +994,7 @@ static void *irealloc(void *ptr, size_t size) {
     return 0;
   }
 
+copy:
   p = imalloc(size);
 
   if (p) {
@@ -871,7 +1046,7 @@ static __inline__ void free_pages(void *ptr, int index, struct pginfo *info) {
     memset(ptr, SOME_JUNK, l);
 
 #ifdef HAS_MADVISE
-  if (malloc_hint)
+  if (malloc_hint || i >= malloc_release)
     madvise(ptr, l, MADV_FREE);
 #endif
 
@@ -1031,6 +1206,7 @@ static __inline__ void free_bytes(void *ptr, int index, struct pginfo *info) {
 
 static void ifree(void *ptr) {
   struct pginfo *info;
+  struct pghuge **hpp, *hp;
   unsigned int index;
 
   /* This is legal */
@@ -1048,6 +1224,15 @@ static void ifree(void *ptr) {
 
   index = ptr2index(ptr);
 
+  if ((index < malloc_pageshift || index > last_index) &&
+      (hpp = huge_find(ptr))) {
+    hp = *hpp;
+    *hpp = hp->next;
+    munmap(hp->page, hp->size);
+    ifree(hp);
+    return;
+  }
+
   if (index < malloc_pageshift) {
     wrtwarning("junk pointer, too low to make sense.\n");
     return;
@@ -1067,12 +1252,153 @@ static void ifree(void *ptr) {
   return;
 }
 
+/*
+ * Once a process has threads, each of them keeps a few free chunks of
+ * every size on lists of its own, threaded through the chunks, and most
+ * small mallocs and frees are done there without taking the lock. The
+ * pages of chunks behind the lock are the depot the lists are filled from
+ * and drained back to, malloc_tcache_batch chunks at a time. A chunk on a
+ * list is still in use as far as the depot knows, so freeing it twice is
+ * only noticed once it gets back there; junk filling wants every chunk to
+ * go through the depot, and turns the caches off.
+ *
+ * To know the size of a chunk being freed, tcache_free reads the page
+ * directory without the lock. The entry for a chunk in use never changes,
+ * and an old copy of the directory still has it, which is why
+ * extend_pgdir keeps the old copies mapped once there are caches.
+ */
+#define malloc_minshift 4U
+#define malloc_tcache_buckets (malloc_pageshift - malloc_minshift)
+#define malloc_tcache_max 16
+#define malloc_tcache_batch 8
+
+struct tcache {
+  void *head[malloc_tcache_buckets];    /* free chunks of 16 << bucket bytes */
+  u_short count[malloc_tcache_buckets]; /* how many on each list */
+};
+
+/* The bucket of chunks size bytes go in, for size <= malloc_maxsize */
+#define tcache_bucket(size)                                                    \
+  ((size) <= malloc_minsize ? 0 : 32 - __builtin_clz((size)-1) - malloc_minshift)
+
+/* The calling thread's slot for its cache, NULL if it should not have one */
+static __inline__ void **tcache_slot(void) {
+  if (!malloc_started || malloc_junk)
+    return NULL;
+  return __libc_malloc_tcache();
+}
+
+/*
+ * Moves up to malloc_tcache_batch chunks for bucket b from the depot to
+ * the calling thread's cache, making the cache first if need be. Returns
+ * whether the bucket has any chunks afterwards.
+ */
+static int tcache_fill(void **slot, int b) {
+  struct tcache *tc;
+  void *p;
+  int n;
+
+  THREAD_LOCK();
+  if (malloc_active++) {
+    malloc_active--;
+    THREAD_UNLOCK();
+    return 0;
+  }
+  malloc_func = " in malloc():";
+  if (NULL == (tc = *slot) && NULL != (tc = imalloc(sizeof *tc))) {
+    memset(tc, 0, sizeof *tc);
+    malloc_tcaches = 1;
+    *slot = tc;
+  }
+  for (n = 0; NULL != tc && n < malloc_tcache_batch; n++) {
+    if (NULL == (p = malloc_bytes(malloc_minsize << b)))
+      break;
+    *(void **)p = tc->head[b];
+    tc->head[b] = p;
+    tc->count[b]++;
+  }
+  malloc_active--;
+  THREAD_UNLOCK();
+  return NULL != tc && NULL != tc->head[b];
+}
+
+/* Gives n chunks of bucket b back to the depot */
+static void tcache_drain(struct tcache *tc, int b, int n) {
+  void *p;
+  u_long index;
+
+  THREAD_LOCK();
+  malloc_func = " in free():";
+  malloc_active++;
+  while (n-- > 0 && NULL != (p = tc->head[b])) {
+    tc->head[b] = *(void **)p;
+    tc->count[b]--;
+    index = ptr2index(p);
+    free_bytes(p, index, page_dir[index]);
+  }
+  malloc_active--;
+  THREAD_UNLOCK();
+}
+
+static __inline__ void *tcache_malloc(void **slot, size_t size) {
+  struct tcache *tc = *slot;
+  int b = tcache_bucket(size);
+  void *r;
+
+  if ((NULL == tc || NULL == tc->head[b]) && !tcache_fill(slot, b))
+    return NULL;
+  tc = *slot;
+  r = tc->head[b];
+  tc->head[b] = *(void **)r;
+  tc->count[b]--;
+  return r;
+}
+
+/* Returns 0, doing nothing, unless ptr looks like a chunk */
+static __inline__ int tcache_free(struct tcache *tc, void *ptr) {
+  struct pginfo **dir = *(struct pginfo **volatile *)&page_dir;
+  u_long index = ptr2index(ptr);
+  struct pginfo *info;
+  int b;
+
+  if (index < malloc_pageshift || index > last_index)
+    return 0;
+  info = dir[index];
+  if (info < MALLOC_MAGIC || ((u_long)ptr & (info->size - 1)))
+    return 0;
+  b = info->shift - malloc_minshift;
+  *(void **)ptr = tc->head[b];
+  tc->head[b] = ptr;
+  if (++tc->count[b] > malloc_tcache_max)
+    tcache_drain(tc, b, malloc_tcache_batch);
+  return 1;
+}
+
+/* Called by an exiting thread: its chunks go back to the depot */
+void __libc_malloc_thread_exit(void) {
+  void **slot = __libc_malloc_tcache();
+  struct tcache *tc;
+  int b;
+
+  if (NULL == slot || NULL == (tc = *slot))
+    return;
+  for (b = 0; b < (int)malloc_tcache_buckets; b++)
+    tcache_drain(tc, b, tc->count[b]);
+  *slot = NULL;
+  free(tc);
+}
+
 /*
  * These are the public exported interface routines.
  */
 
 void *malloc(size_t size) {
   register void *r;
+  void **slot;
+
+  if (size && size <= malloc_maxsize && NULL != (slot = tcache_slot()) &&
+      NULL != (r = tcache_malloc(slot, size)))
+    return r;
 
   THREAD_LOCK();
   malloc_func = " in malloc():";
@@ -1097,6 +1423,12 @@ void *malloc(size_t size) {
 }
 
 void free(void *ptr) {
+  void **slot;
+
+  if (NULL != ptr && NULL != (slot = tcache_slot()) && NULL != *slot &&
+      tcache_free(*slot, ptr))
+    return;
+
   THREAD_LOCK();
   malloc_func = " in free():";
   if (malloc_active++) {
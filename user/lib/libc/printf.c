@@ -57,6 +57,8 @@
 #include "stdio.h"
 #include "unistd.h"
 
+int __libc_stdio_vformat(FILE *f, const char *fmt, va_list args);
+
 int printf(const char *fmt, ...) {
   va_list args;
   int i;
@@ -101,22 +103,10 @@ int vprintf(const char *fmt, va_list args) {
   return vfprintf(stdout, fmt, args);
 }
 
-#define __LIBC_PRINTF_BUFSIZE 1024
 int vfprintf(FILE *stream, const char *fmt, va_list args) {
-  /* I'm really lazy */
-  char buf[__LIBC_PRINTF_BUFSIZE];
-  int ret = vsnprintf(buf, __LIBC_PRINTF_BUFSIZE, fmt, args);
-  if (ret > 0) {
-    write(*stream, buf, ret);
-  }
-  return ret;
+  return __libc_stdio_vformat(stream, fmt, args);
 }
 
 int vsprintf(char *buf, const char *fmt, va_list args) {
   return vsnprintf(buf, 0xffffffffUL, fmt, args);
 }
-
-int fflush(FILE *stream) {
-  /* no-op */
-  return 0;
-}
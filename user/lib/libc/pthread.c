@@ -0,0 +1,371 @@
+/*
+ * Threads, on top of thr_create(2) and friends, and the locks they use.
+ *
+ * Each thread's stack is an anonymous mapping with the thread's struct
+ * pthread at the top, and the thread's %gs segment is based at that
+ * struct, whose first word points back at it; that is how a thread finds
+ * itself, and its errno. The main thread gets a struct too, the first
+ * time it is needed; until then nothing here costs a process anything,
+ * and errno is plain _libc_errno.
+ *
+ * Locks take no syscall unless there is contention. A mutex is 0 when
+ * unlocked, 1 when locked, and 2 when locked and someone may be asleep
+ * in futex(2) on it, which the unlocking thread then has to wake; see
+ * "Futexes Are Tricky" by Ulrich Drepper. A condition variable broadcast
+ * wakes one waiter and requeues the rest onto the mutex, where each is
+ * woken by the unlock before it.
+ */
+
+#include "sys/types.h"
+#include "errno.h"
+#include "unistd.h"
+#include "limits.h"
+
+#include "sys/mman.h"
+#include "sys/futex.h"
+#include "pthread/pthread.h"
+
+#define PTHREAD_STACK_SIZE (64 * 1024)
+#define PTHREAD_CLEANUP_MAX 8
+
+struct pthread {
+  struct pthread *pt_self; /* at %gs:0 */
+  int pt_errno;
+  int pt_tid;
+  int pt_detached;
+  void *(*pt_start)(void *);
+  void *pt_arg;
+  void *pt_stack; /* the mapping, PTHREAD_STACK_SIZE bytes, or NULL */
+  int pt_ncleanup;
+  struct {
+    void (*func)(void *);
+    void *arg;
+  } pt_cleanup[PTHREAD_CLEANUP_MAX];
+  struct pthread *pt_next; /* on pthread_detached */
+  void *pt_tcache;         /* malloc's cache of chunks, see malloc.c */
+};
+
+static int pthread_threaded = 0;
+static struct pthread pthread_main;
+
+/* Detached threads, whose stacks are freed once the kernel has forgotten
+ * them; see pthread_reap */
+static struct pthread *pthread_detached = NULL;
+static pthread_mutex_t pthread_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t malloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stdio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void __libc_malloc_thread_exit(void);
+
+int *__errno_location(void) {
+  struct pthread *self;
+
+  if (!pthread_threaded)
+    return &_libc_errno;
+  __asm__ volatile("movl %%gs:0, %0" : "=r"(self));
+  return &self->pt_errno;
+}
+
+/* Gives the main thread a struct pthread, before there are any others */
+static void pthread_init(void) {
+  pthread_main.pt_self = &pthread_main;
+  pthread_main.pt_errno = _libc_errno;
+  pthread_main.pt_tid = gettid();
+  pthread_main.pt_detached = 0;
+  pthread_main.pt_stack = NULL;
+  pthread_main.pt_ncleanup = 0;
+  pthread_main.pt_tcache = NULL;
+  set_tls(&pthread_main);
+  pthread_threaded = 1;
+}
+
+pthread_t pthread_self(void) {
+  struct pthread *self;
+
+  if (!pthread_threaded)
+    pthread_init();
+  __asm__ volatile("movl %%gs:0, %0" : "=r"(self));
+  return self;
+}
+
+int pthread_equal(pthread_t t1, pthread_t t2) { return t1 == t2; }
+
+/* ------------------------------------------------------------------ */
+
+int pthread_mutex_init(pthread_mutex_t *mtx, const pthread_mutexattr_t *attr) {
+  mtx->pm_state = 0;
+  return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mtx) {
+  return mtx->pm_state ? EBUSY : 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mtx) {
+  int c;
+
+  if (0 == (c = __sync_val_compare_and_swap(&mtx->pm_state, 0, 1)))
+    return 0;
+  /* Say that there is a waiter, then sleep until we get it that way */
+  if (2 != c)
+    c = __sync_lock_test_and_set(&mtx->pm_state, 2);
+  while (0 != c) {
+    futex(&mtx->pm_state, FUTEX_WAIT, 2);
+    c = __sync_lock_test_and_set(&mtx->pm_state, 2);
+  }
+  return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mtx) {
+  return __sync_bool_compare_and_swap(&mtx->pm_state, 0, 1) ? 0 : EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mtx) {
+  if (1 != __sync_fetch_and_sub(&mtx->pm_state, 1)) {
+    mtx->pm_state = 0;
+    futex(&mtx->pm_state, FUTEX_WAKE, 1);
+  }
+  return 0;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
+  cond->pc_seq = 0;
+  cond->pc_mutex = NULL;
+  return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond) { return 0; }
+
+/*
+ * A signal between reading pc_seq and going to sleep changes it, so the
+ * futex wait returns at once and the wakeup is not lost. We take the
+ * mutex back as contended, since other waiters may be queued on it, and
+ * that way our unlock wakes the next of them.
+ */
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mtx) {
+  int seq = cond->pc_seq;
+
+  cond->pc_mutex = mtx;
+  pthread_mutex_unlock(mtx);
+  futex(&cond->pc_seq, FUTEX_WAIT, seq);
+  while (0 != __sync_lock_test_and_set(&mtx->pm_state, 2))
+    futex(&mtx->pm_state, FUTEX_WAIT, 2);
+  return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond) {
+  __sync_fetch_and_add(&cond->pc_seq, 1);
+  futex(&cond->pc_seq, FUTEX_WAKE, 1);
+  return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond) {
+  pthread_mutex_t *mtx = cond->pc_mutex;
+
+  __sync_fetch_and_add(&cond->pc_seq, 1);
+  if (NULL == mtx)
+    futex(&cond->pc_seq, FUTEX_WAKE, INT_MAX);
+  else
+    futex_requeue(&cond->pc_seq, FUTEX_REQUEUE, 1, &mtx->pm_state, INT_MAX,
+                  0);
+  return 0;
+}
+
+int pthread_barrier_init(pthread_barrier_t *barrier,
+                         const pthread_barrierattr_t *attr,
+                         unsigned int count) {
+  if (0 == count)
+    return EINVAL;
+  pthread_mutex_init(&barrier->pb_lock, NULL);
+  barrier->pb_count = count;
+  barrier->pb_waiting = 0;
+  barrier->pb_seq = 0;
+  return 0;
+}
+
+int pthread_barrier_destroy(pthread_barrier_t *barrier) {
+  return barrier->pb_waiting ? EBUSY : 0;
+}
+
+/* The last thread to arrive bumps pb_seq, which every other one is asleep
+ * on, and starts the barrier over for next time */
+int pthread_barrier_wait(pthread_barrier_t *barrier) {
+  int seq;
+
+  pthread_mutex_lock(&barrier->pb_lock);
+  seq = barrier->pb_seq;
+  if (++barrier->pb_waiting == barrier->pb_count) {
+    barrier->pb_waiting = 0;
+    __sync_fetch_and_add(&barrier->pb_seq, 1);
+    pthread_mutex_unlock(&barrier->pb_lock);
+    futex(&barrier->pb_seq, FUTEX_WAKE, INT_MAX);
+    return PTHREAD_BARRIER_SERIAL_THREAD;
+  }
+  pthread_mutex_unlock(&barrier->pb_lock);
+  while (seq == *(volatile int *)&barrier->pb_seq)
+    futex(&barrier->pb_seq, FUTEX_WAIT, seq);
+  return 0;
+}
+
+void __libc_malloc_lock(void) {
+  if (pthread_threaded)
+    pthread_mutex_lock(&malloc_lock);
+}
+
+void __libc_malloc_unlock(void) {
+  if (pthread_threaded)
+    pthread_mutex_unlock(&malloc_lock);
+}
+
+void __libc_stdio_lock(void) {
+  if (pthread_threaded)
+    pthread_mutex_lock(&stdio_lock);
+}
+
+void __libc_stdio_unlock(void) {
+  if (pthread_threaded)
+    pthread_mutex_unlock(&stdio_lock);
+}
+
+/* NULL until there are threads; malloc does without a cache until then */
+void **__libc_malloc_tcache(void) {
+  struct pthread *self;
+
+  if (!pthread_threaded)
+    return NULL;
+  __asm__ volatile("movl %%gs:0, %0" : "=r"(self));
+  return &self->pt_tcache;
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Frees the stacks of detached threads which are gone. thr_join on a
+ * detached thread fails at once, with ESRCH if it has exited (the kernel
+ * frees those straight away, and never reuses a thread id) and EINVAL if
+ * it has not.
+ */
+static void pthread_reap(void) {
+  struct pthread **pp, *thr;
+
+  pthread_mutex_lock(&pthread_list_lock);
+  for (pp = &pthread_detached; NULL != (thr = *pp);) {
+    if (0 > thr_join(thr->pt_tid, NULL) && ESRCH == errno) {
+      *pp = thr->pt_next;
+      munmap(thr->pt_stack, PTHREAD_STACK_SIZE);
+    } else {
+      pp = &thr->pt_next;
+    }
+  }
+  pthread_mutex_unlock(&pthread_list_lock);
+}
+
+/* Where new threads start, on their own stacks, with %gs set up */
+static void pthread_start(struct pthread *self) {
+  self->pt_tid = gettid();
+  pthread_exit(self->pt_start(self->pt_arg));
+}
+
+int pthread_create(pthread_t *thr, const pthread_attr_t *attr,
+                   void *(*start)(void *), void *arg) {
+  struct pthread *new;
+  void *stack;
+  uint32_t *sp;
+  int tid;
+
+  if (!pthread_threaded)
+    pthread_init();
+  pthread_reap();
+
+  stack = mmap(NULL, PTHREAD_STACK_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (MAP_FAILED == stack)
+    return errno;
+  new = (struct pthread *)(((uintptr_t)stack + PTHREAD_STACK_SIZE -
+                            sizeof(struct pthread)) & ~0xfU);
+  new->pt_self = new;
+  new->pt_errno = 0;
+  new->pt_detached = 0;
+  new->pt_start = start;
+  new->pt_arg = arg;
+  new->pt_stack = stack;
+  new->pt_ncleanup = 0;
+  new->pt_next = NULL;
+  new->pt_tcache = NULL;
+
+  /* pthread_start's argument, under a return address it never uses */
+  sp = (uint32_t *)new - 2;
+  sp[0] = 0;
+  sp[1] = (uint32_t)new;
+  /* The new thread can run before thr_create returns here, so it sets
+   * pt_tid itself as well */
+  if (0 > (tid = thr_create(pthread_start, sp, new))) {
+    munmap(stack, PTHREAD_STACK_SIZE);
+    return errno;
+  }
+  new->pt_tid = tid;
+  *thr = new;
+  return 0;
+}
+
+void pthread_exit(void *retval) {
+  struct pthread *self = pthread_self();
+
+  while (self->pt_ncleanup > 0)
+    pthread_cleanup_pop(1);
+  __libc_malloc_thread_exit();
+  thr_exit((int)retval);
+}
+
+int pthread_join(pthread_t thr, void **retval) {
+  if (0 > thr_join(thr->pt_tid, retval))
+    return errno;
+  if (NULL != thr->pt_stack)
+    munmap(thr->pt_stack, PTHREAD_STACK_SIZE);
+  return 0;
+}
+
+int pthread_detach(pthread_t thr) {
+  if (0 > thr_detach(thr->pt_tid))
+    return errno;
+  thr->pt_detached = 1;
+  if (NULL != thr->pt_stack) {
+    pthread_mutex_lock(&pthread_list_lock);
+    thr->pt_next = pthread_detached;
+    pthread_detached = thr;
+    pthread_mutex_unlock(&pthread_list_lock);
+  }
+  return 0;
+}
+
+/* The thread exits the next time it enters the kernel, or is preempted,
+ * without running its cleanup handlers */
+int pthread_cancel(pthread_t thr) {
+  if (0 > thr_cancel(thr->pt_tid, PTHREAD_CANCELED))
+    return errno;
+  return 0;
+}
+
+void pthread_yield(void) { thr_yield(); }
+
+void pthread_cleanup_push(void (*func)(void *), void *arg) {
+  struct pthread *self = pthread_self();
+
+  if (self->pt_ncleanup < PTHREAD_CLEANUP_MAX) {
+    self->pt_cleanup[self->pt_ncleanup].func = func;
+    self->pt_cleanup[self->pt_ncleanup].arg = arg;
+    self->pt_ncleanup++;
+  }
+}
+
+void pthread_cleanup_pop(int execute) {
+  struct pthread *self = pthread_self();
+
+  if (self->pt_ncleanup > 0) {
+    self->pt_ncleanup--;
+    if (execute)
+      self->pt_cleanup[self->pt_ncleanup].func(
+          self->pt_cleanup[self->pt_ncleanup].arg);
+  }
+}
@@ -1,7 +1,202 @@
+/*
+ * The standard streams. What is written to one collects in its buffer,
+ * and goes out when the buffer fills if the stream is fully buffered, and
+ * at the end of each line as well if it is line buffered; stderr is not
+ * buffered at all. Until stdout is first written to, or given a mode with
+ * setvbuf(), it is undecided: line buffered if it is a terminal, fully
+ * buffered if not. exit() flushes everything, as do fork(), execve() and
+ * spawn() before they go to the kernel, so nothing is written twice or
+ * lost; read() flushes the line buffered streams, so that a prompt is out
+ * before its answer is waited for.
+ */
+
+#include "errno.h"
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "weenix/format.h"
+
+#define __SMBF 0x1 /* _buf came from malloc() */
+
+void __libc_stdio_lock(void);
+void __libc_stdio_unlock(void);
+
+static char stdout_buf[BUFSIZ];
 
-static int stdstreams[3] = {0, 1, 2};
+static FILE stdstreams[3] = {{0, _IONBF, NULL, 0, 0, 0},
+                             {1, -1, stdout_buf, BUFSIZ, 0, 0},
+                             {2, _IONBF, NULL, 0, 0, 0}};
 
 FILE *stdin = &stdstreams[0];
 FILE *stdout = &stdstreams[1];
 FILE *stderr = &stdstreams[2];
+
+static int write_all(int fd, const char *p, size_t n) {
+  int ret;
+
+  while (n > 0) {
+    if (0 >= (ret = write(fd, p, n)))
+      return -1;
+    p += ret;
+    n -= ret;
+  }
+  return 0;
+}
+
+/* What could not be written is dropped, not tried again next time */
+static int stream_flush(FILE *f) {
+  int ret = 0;
+
+  if (f->_len) {
+    ret = write_all(f->_fd, f->_buf, f->_len);
+    f->_len = 0;
+  }
+  return ret;
+}
+
+static int stream_write(FILE *f, const char *p, size_t n) {
+  if (0 > f->_mode)
+    f->_mode = isatty(f->_fd) ? _IOLBF : _IOFBF;
+  if (_IONBF == f->_mode)
+    return write_all(f->_fd, p, n);
+
+  if (f->_len + n > f->_size && stream_flush(f))
+    return -1;
+  /* Copying would only cost more than it saves */
+  if (n >= f->_size)
+    return write_all(f->_fd, p, n);
+  memcpy(f->_buf + f->_len, p, n);
+  f->_len += n;
+  if (_IOLBF == f->_mode && NULL != memchr(p, '\n', n))
+    return stream_flush(f);
+  return 0;
+}
+
+/* For vfprintf(); returns 0, or -1 if the stream could not be written */
+int __libc_stdio_write(FILE *f, const char *p, size_t n) {
+  int ret;
+
+  __libc_stdio_lock();
+  ret = stream_write(f, p, n);
+  __libc_stdio_unlock();
+  return ret;
+}
+
+static int stream_sink(void *arg, const char *buf, size_t len) {
+  return stream_write(arg, buf, len);
+}
+
+/* For vfprintf(), formatting straight into the stream, under the lock
+ * so that one call's output is never mixed with another thread's */
+int __libc_stdio_vformat(FILE *f, const char *fmt, va_list args) {
+  int ret;
+
+  __libc_stdio_lock();
+  ret = vformat(stream_sink, f, fmt, args);
+  __libc_stdio_unlock();
+  return ret;
+}
+
+/* For read() */
+void __libc_stdio_flush_lines(void) {
+  int i;
+
+  /* Looked at unlocked first, nearly always there is nothing to do */
+  for (i = 0; i < 3; i++) {
+    if (_IOLBF == stdstreams[i]._mode && stdstreams[i]._len)
+      break;
+  }
+  if (3 == i)
+    return;
+  __libc_stdio_lock();
+  for (i = 0; i < 3; i++) {
+    if (_IOLBF == stdstreams[i]._mode)
+      stream_flush(&stdstreams[i]);
+  }
+  __libc_stdio_unlock();
+}
+
+/* A NULL stream flushes all of them */
+int fflush(FILE *stream) {
+  int i, ret = 0;
+
+  __libc_stdio_lock();
+  if (NULL != stream) {
+    ret = stream_flush(stream);
+  } else {
+    for (i = 0; i < 3; i++) {
+      if (stream_flush(&stdstreams[i]))
+        ret = -1;
+    }
+  }
+  __libc_stdio_unlock();
+  return ret ? EOF : 0;
+}
+
+/*
+ * Anything already written to the stream is flushed first. A NULL buf
+ * with a size gets a buffer of that size (BUFSIZ if size is 0); if there
+ * is no memory for it the stream is left unbuffered and EOF returned.
+ */
+int setvbuf(FILE *stream, char *buf, int mode, size_t size) {
+  int ret = 0;
+
+  if (_IOFBF != mode && _IOLBF != mode && _IONBF != mode) {
+    errno = EINVAL;
+    return EOF;
+  }
+
+  __libc_stdio_lock();
+  stream_flush(stream);
+  if (stream->_flags & __SMBF)
+    free(stream->_buf);
+  stream->_flags &= ~__SMBF;
+  if (_IONBF == mode) {
+    buf = NULL;
+    size = 0;
+  } else if (NULL == buf) {
+    if (0 == size)
+      size = BUFSIZ;
+    if (stdout == stream && BUFSIZ >= size) {
+      buf = stdout_buf;
+    } else if (NULL != (buf = malloc(size))) {
+      stream->_flags |= __SMBF;
+    } else {
+      mode = _IONBF;
+      size = 0;
+      ret = EOF;
+    }
+  } else if (0 == size) {
+    mode = _IONBF;
+    buf = NULL;
+  }
+  stream->_mode = mode;
+  stream->_buf = buf;
+  stream->_size = size;
+  stream->_len = 0;
+  __libc_stdio_unlock();
+  return ret;
+}
+
+void setbuf(FILE *stream, char *buf) {
+  setvbuf(stream, buf, NULL == buf ? _IONBF : _IOFBF, BUFSIZ);
+}
+
+int fputc(int c, FILE *stream) {
+  char ch = (char)c;
+
+  if (__libc_stdio_write(stream, &ch, 1))
+    return EOF;
+  return (unsigned char)ch;
+}
+
+int fputs(const char *s, FILE *stream) {
+  return __libc_stdio_write(stream, s, strlen(s)) ? EOF : 0;
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
+  if (0 == size || 0 == nmemb)
+    return 0;
+  return __libc_stdio_write(stream, ptr, size * nmemb) ? 0 : nmemb;
+}
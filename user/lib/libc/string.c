@@ -3,6 +3,239 @@
 #include "string.h"
 #include "errno.h"
 
+/*
+ * memcpy, memset, strlen, strcmp and memchr each have two versions: one
+ * going a word at a time, and one for processors with SSE2 going sixteen
+ * bytes at a time, which CPUID picks the first time any of them is
+ * called. The SSE2 versions realign the stack for themselves, as nothing
+ * keeps it 16-byte aligned. Reading a whole aligned word or block past
+ * the end of a string can't run onto an unmapped page; strcmp's
+ * unaligned loads check that they stay on the page.
+ */
+typedef uint32_t __attribute__((may_alias)) word_t;
+typedef char v16qi __attribute__((vector_size(16), may_alias));
+typedef char v16qu __attribute__((vector_size(16), aligned(1), may_alias));
+
+#define SSE2 __attribute__((target("sse2"), force_align_arg_pointer))
+#define CPUID_EDX_SSE2 (1 << 26)
+
+#define ONES 0x01010101U
+#define HIGHS 0x80808080U
+/* Nonzero if any byte of w is zero */
+#define haszero(w) (((w)-ONES) & ~(w) & HIGHS)
+/* A bit for each byte of a block, set where x is all ones */
+#define bytemask(x) ((unsigned)__builtin_ia32_pmovmskb128((v16qi)(x)))
+
+/* Shorter than these, the word versions do better */
+#define STRING_WORD_MIN 16
+#define STRING_SSE2_MIN 64
+
+static int string_sse2 = -1;
+
+static int has_sse2(void) {
+  uint32_t eax, ebx, ecx, edx;
+
+  if (0 > string_sse2) {
+    __asm__ volatile("cpuid"
+                     : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                     : "a"(1));
+    string_sse2 = !!(edx & CPUID_EDX_SSE2);
+  }
+  return string_sse2;
+}
+
+static void *memcpy_words(void *dest, const void *src, size_t count) {
+  size_t head = 0;
+  int d0, d1, d2;
+
+  if (count >= STRING_WORD_MIN)
+    head = -(uintptr_t)dest & 3;
+  /* Bytes up to a word boundary of the destination, words, then bytes */
+  __asm__ volatile("rep movsb\n\t"
+                   "movl %6, %%ecx\n\t"
+                   "shrl $2, %%ecx\n\t"
+                   "rep movsl\n\t"
+                   "movl %6, %%ecx\n\t"
+                   "andl $3, %%ecx\n\t"
+                   "rep movsb"
+                   : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                   : "0"(count >= STRING_WORD_MIN ? head : count), "1"(dest),
+                     "2"(src), "r"(count >= STRING_WORD_MIN ? count - head : 0)
+                   : "cc", "memory");
+  return dest;
+}
+
+static SSE2 void *memcpy_sse2(void *dest, const void *src, size_t count) {
+  char *d = dest;
+  const char *s = src;
+  size_t head = -(uintptr_t)d & 15;
+  v16qi a, b, c, e;
+
+  memcpy_words(d, s, head);
+  d += head;
+  s += head;
+  count -= head;
+  for (; count >= 64; count -= 64, d += 64, s += 64) {
+    a = ((const v16qu *)s)[0];
+    b = ((const v16qu *)s)[1];
+    c = ((const v16qu *)s)[2];
+    e = ((const v16qu *)s)[3];
+    ((v16qi *)d)[0] = a;
+    ((v16qi *)d)[1] = b;
+    ((v16qi *)d)[2] = c;
+    ((v16qi *)d)[3] = e;
+  }
+  memcpy_words(d, s, count);
+  return dest;
+}
+
+static void *memset_words(void *s, int c, size_t count) {
+  size_t head = 0;
+  int d0, d1;
+
+  if (count >= STRING_WORD_MIN)
+    head = -(uintptr_t)s & 3;
+  __asm__ volatile("rep stosb\n\t"
+                   "movl %5, %%ecx\n\t"
+                   "shrl $2, %%ecx\n\t"
+                   "rep stosl\n\t"
+                   "movl %5, %%ecx\n\t"
+                   "andl $3, %%ecx\n\t"
+                   "rep stosb"
+                   : "=&c"(d0), "=&D"(d1)
+                   : "0"(count >= STRING_WORD_MIN ? head : count), "1"(s),
+                     "a"((uint8_t)c * ONES),
+                     "r"(count >= STRING_WORD_MIN ? count - head : 0)
+                   : "cc", "memory");
+  return s;
+}
+
+static SSE2 void *memset_sse2(void *s, int c, size_t count) {
+  char *d = s;
+  size_t head = -(uintptr_t)d & 15;
+  v16qi v = {c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c};
+
+  memset_words(d, c, head);
+  d += head;
+  count -= head;
+  for (; count >= 64; count -= 64, d += 64) {
+    ((v16qi *)d)[0] = v;
+    ((v16qi *)d)[1] = v;
+    ((v16qi *)d)[2] = v;
+    ((v16qi *)d)[3] = v;
+  }
+  memset_words(d, c, count);
+  return s;
+}
+
+static size_t strlen_words(const char *s) {
+  const char *sc;
+  const word_t *w;
+
+  for (sc = s; (uintptr_t)sc & 3; ++sc)
+    if (*sc == '\0')
+      return sc - s;
+  for (w = (const word_t *)sc; !haszero(w[0]); w += 2)
+    if (haszero(w[1])) {
+      w++;
+      break;
+    }
+  for (sc = (const char *)w; *sc != '\0'; ++sc)
+    /* nothing */;
+  return sc - s;
+}
+
+static SSE2 size_t strlen_sse2(const char *s) {
+  uintptr_t off = (uintptr_t)s & 15;
+  const char *p = s - off;
+  v16qi z = {0};
+  unsigned mask;
+
+  /* The first block starts before s, so its first off bytes don't count */
+  mask = bytemask(*(const v16qi *)p == z) >> off << off;
+  while (!mask) {
+    p += 16;
+    mask = bytemask(*(const v16qi *)p == z);
+  }
+  return p + __builtin_ctz(mask) - s;
+}
+
+static int strcmp_bytes(const unsigned char *a, const unsigned char *b) {
+  while (*a == *b && *a != '\0') {
+    a++;
+    b++;
+  }
+  return *a - *b;
+}
+
+static SSE2 int strcmp_sse2(const unsigned char *a, const unsigned char *b) {
+  v16qi va, vb, z = {0};
+  unsigned mask;
+
+  for (;;) {
+    /* Near the end of a page, a byte at a time */
+    if (((uintptr_t)a & 4095) > 4080 || ((uintptr_t)b & 4095) > 4080) {
+      if (*a != *b || *a == '\0')
+        return *a - *b;
+      a++;
+      b++;
+      continue;
+    }
+    va = *(const v16qu *)a;
+    vb = *(const v16qu *)b;
+    /* Where they differ, or a ends */
+    mask = (~bytemask(va == vb) & 0xffff) | bytemask(va == z);
+    if (mask)
+      return a[__builtin_ctz(mask)] - b[__builtin_ctz(mask)];
+    a += 16;
+    b += 16;
+  }
+}
+
+static void *memchr_words(const void *s, int c, size_t count) {
+  const unsigned char *p = s;
+  uint32_t pat = (uint8_t)c * ONES;
+
+  for (; count && ((uintptr_t)p & 3); --count, ++p)
+    if (*p == (uint8_t)c)
+      return (void *)p;
+  /* Two words at a time, xored so that the byte wanted becomes zero */
+  for (; count >= 8; count -= 8, p += 8)
+    if (haszero(((const word_t *)p)[0] ^ pat) ||
+        haszero(((const word_t *)p)[1] ^ pat))
+      break;
+  for (; count; --count, ++p)
+    if (*p == (uint8_t)c)
+      return (void *)p;
+  return NULL;
+}
+
+static SSE2 void *memchr_sse2(const void *s, int c, size_t count) {
+  const char *base = s;
+  uintptr_t off = (uintptr_t)base & 15;
+  const char *p = base - off;
+  v16qi v = {c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c};
+  unsigned mask;
+
+  if (!count)
+    return NULL;
+  mask = bytemask(*(const v16qi *)p == v) >> off << off;
+  while (!mask) {
+    p += 16;
+    if ((size_t)(p - base) >= count)
+      return NULL;
+    mask = bytemask(*(const v16qi *)p == v);
+  }
+  p += __builtin_ctz(mask);
+  return (size_t)(p - base) < count ? (void *)p : NULL;
+}
+
+void *memchr(const void *s, int c, size_t count) {
+  if (count >= STRING_WORD_MIN && has_sse2())
+    return memchr_sse2(s, c, count);
+  return memchr_words(s, c, count);
+}
+
 int memcmp(const void *cs, const void *ct, size_t count) {
   const unsigned char *su1, *su2;
   signed char res = 0;
@@ -14,13 +247,9 @@ int memcmp(const void *cs, const void *ct, size_t count) {
 }
 
 void *memcpy(void *dest, const void *src, size_t count) {
-  char *tmp = (char *)dest;
-  const char *s = src;
-
-  while (count--)
-    *tmp++ = *s++;
-
-  return dest;
+  if (count >= STRING_SSE2_MIN && has_sse2())
+    return memcpy_sse2(dest, src, count);
+  return memcpy_words(dest, src, count);
 }
 
 int strncmp(const char *cs, const char *ct, size_t count) {
@@ -36,14 +265,9 @@ int strncmp(const char *cs, const char *ct, size_t count) {
 }
 
 int strcmp(const char *cs, const char *ct) {
-  register signed char __res;
-
-  while (1) {
-    if ((__res = *cs - *ct++) != 0 || !*cs++)
-      break;
-  }
-
-  return __res;
+  if (has_sse2())
+    return strcmp_sse2((const unsigned char *)cs, (const unsigned char *)ct);
+  return strcmp_bytes((const unsigned char *)cs, (const unsigned char *)ct);
 }
 
 char *strcpy(char *dest, const char *src) {
@@ -64,12 +288,9 @@ char *strncpy(char *dest, const char *src, size_t count) {
 }
 
 void *memset(void *s, int c, size_t count) {
-  char *xs = (char *)s;
-
-  while (count--)
-    *xs++ = c;
-
-  return s;
+  if (count >= STRING_SSE2_MIN && has_sse2())
+    return memset_sse2(s, c, count);
+  return memset_words(s, c, count);
 }
 
 size_t strnlen(const char *s, size_t count) {
@@ -93,11 +314,9 @@ char *strcat(char *dest, const char *src) {
 }
 
 size_t strlen(const char *s) {
-  const char *sc;
-
-  for (sc = s; *sc != '\0'; ++sc)
-    /* nothing */;
-  return sc - s;
+  if (has_sse2())
+    return strlen_sse2(s);
+  return strlen_words(s);
 }
 
 char *strchr(const char *s, int c) {
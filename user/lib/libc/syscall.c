@@ -1,13 +1,45 @@
 #include "sys/types.h"
 #include "stdarg.h"
 
+#include "errno.h"
 #include "string.h"
 #include "stdlib.h"
 
 #include "unistd.h"
+#include "stdio.h"
+#include "time.h"
 #include "weenix/trap.h"
 
 #include "dirent.h"
+#include "sys/uio.h"
+#include "poll.h"
+#include "sys/epoll.h"
+#include "sys/aio.h"
+#include "spawn.h"
+#include "perf.h"
+#include "fcntl.h"
+#include "sys/futex.h"
+#include "sys/resource.h"
+#include "sys/times.h"
+#include "sys/mman.h"
+#include "sys/socket.h"
+
+int __trap_sysenter = -1;
+
+/* The first system call asks the kernel whether there is a faster way
+ * than this one */
+int __trap_int(uint32_t num, uint32_t arg) {
+  int ret;
+
+  if (0 > __trap_sysenter) {
+    __asm__ volatile("int $" TRAP_INTR_STRING : "=a"(ret) : "a"(SYS_sysenter));
+    __trap_sysenter = (1 == ret);
+  }
+  __asm__ volatile("int $" TRAP_INTR_STRING : "=a"(ret) : "a"(num), "d"(arg));
+  /* Copy in errno */
+  __asm__ volatile("int $" TRAP_INTR_STRING : "=a"(errno) : "a"(SYS_errno));
+  return ret;
+}
 
 static void *__curbrk = NULL;
 #define MAX_EXIT_HANDLERS 32
@@ -43,17 +75,27 @@ void *sbrk(intptr_t incr) {
   return (void *)oldbrk;
 }
 
-int brk(void *addr) {
+static int brk_trap(int sysnum, void *addr) {
   if (NULL == addr)
     return -1;
-  void *newbrk = (void *)trap(SYS_brk, (uint32_t)addr);
+  void *newbrk = (void *)trap(sysnum, (uint32_t)addr);
   if (newbrk == (void *)-1)
     return -1;
   __curbrk = newbrk;
   return 0;
 }
 
-int fork(void) { return trap(SYS_fork, 0); }
+int brk(void *addr) { return brk_trap(SYS_brk, addr); }
+
+/* Like brk, but faults in the pages gained so that using them takes no
+ * page faults */
+int brk_populate(void *addr) { return brk_trap(SYS_brk_populate, addr); }
+
+int fork(void) {
+  /* or the child writes out the parent's buffers too */
+  fflush(NULL);
+  return trap(SYS_fork, 0);
+}
 
 int atexit(void (*func)(void)) {
   if (atexit_handlers < MAX_EXIT_HANDLERS) {
@@ -78,6 +120,7 @@ void exit(int status) {
     atexit_func[atexit_handlers]();
   }
 
+  fflush(NULL);
   _exit(status);
   exit(status); /* gcc doesn't realize that _exit() exits */
 }
@@ -111,6 +154,89 @@ pid_t waitpid(pid_t pid, int options, int *status) {
 
 void thr_exit(int status) { trap(SYS_thr_exit, (uint32_t)status); }
 
+int thr_create(void *entry, void *stack, void *tls) {
+  thr_create_args_t args;
+
+  args.entry = entry;
+  args.stack = stack;
+  args.tls = tls;
+
+  return trap(SYS_thr_create, (uint32_t)&args);
+}
+
+int thr_join(int tid, void **retval) {
+  thr_join_args_t args;
+
+  args.tid = tid;
+  args.retval = retval;
+
+  return trap(SYS_thr_join, (uint32_t)&args);
+}
+
+int thr_cancel(int tid, void *retval) {
+  thr_cancel_args_t args;
+
+  args.tid = tid;
+  args.retval = retval;
+
+  return trap(SYS_thr_cancel, (uint32_t)&args);
+}
+
+int thr_detach(int tid) { return trap(SYS_thr_detach, (uint32_t)tid); }
+
+void thr_yield(void) { trap(SYS_thr_yield, 0); }
+
+int gettid(void) { return trap(SYS_gettid, 0); }
+
+int set_tls(void *base) { return trap(SYS_set_tls, (uint32_t)base); }
+
+int futex(int *uaddr, int op, int val) {
+  return futex_requeue(uaddr, op, val, NULL, 0, 0);
+}
+
+int futex_requeue(int *uaddr, int op, int val, int *uaddr2, int val2,
+                  int val3) {
+  futex_args_t args;
+
+  args.uaddr = uaddr;
+  args.op = op;
+  args.val = val;
+  args.uaddr2 = uaddr2;
+  args.val2 = val2;
+  args.val3 = val3;
+
+  return trap(SYS_futex, (uint32_t)&args);
+}
+
+int getrusage(int who, struct rusage *ru) {
+  getrusage_args_t args;
+
+  args.who = who;
+  args.ru = ru;
+
+  return trap(SYS_getrusage, (uint32_t)&args);
+}
+
+clock_t times(struct tms *buf) { return trap(SYS_times, (uint32_t)buf); }
+
+int sched_setaffinity(int tid, const uint32_t *mask) {
+  sched_affinity_args_t args;
+
+  args.tid = tid;
+  args.mask = (uint32_t *)mask;
+
+  return trap(SYS_sched_setaffinity, (uint32_t)&args);
+}
+
+int sched_getaffinity(int tid, uint32_t *mask) {
+  sched_affinity_args_t args;
+
+  args.tid = tid;
+  args.mask = mask;
+
+  return trap(SYS_sched_getaffinity, (uint32_t)&args);
+}
+
 pid_t getpid(void) { return trap(SYS_getpid, 0); }
 
 int halt(void) { return trap(SYS_halt, 0); }
@@ -137,8 +263,84 @@ int munmap(void *addr, size_t len) {
   return trap(SYS_munmap, (uint32_t)&args);
 }
 
+int madvise(void *addr, size_t len, int advice) {
+  madvise_args_t args;
+
+  args.addr = addr;
+  args.len = len;
+  args.advice = advice;
+
+  return trap(SYS_madvise, (uint32_t)&args);
+}
+
+/* A shared memory object is a file in the tmpfs on SHM_DIR, named "/"
+ * and up to NAME_LEN more characters with no other slash */
+static int shm_path(const char *name, char *path, size_t size) {
+  if ('/' != name[0] || !name[1] || strchr(name + 1, '/')) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (strlen(name + 1) > NAME_LEN) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  snprintf(path, size, "%s%s", SHM_DIR, name);
+  return 0;
+}
+
+int shm_open(const char *name, int oflag, int mode) {
+  char path[sizeof(SHM_DIR) + NAME_LEN + 1];
+
+  if (shm_path(name, path, sizeof(path)) < 0)
+    return -1;
+  return open(path, oflag, mode);
+}
+
+int shm_unlink(const char *name) {
+  char path[sizeof(SHM_DIR) + NAME_LEN + 1];
+
+  if (shm_path(name, path, sizeof(path)) < 0)
+    return -1;
+  return unlink(path);
+}
+
+void *mremap(void *addr, size_t oldlen, size_t newlen, int flags) {
+  mremap_args_t args;
+
+  args.addr = addr;
+  args.oldlen = oldlen;
+  args.newlen = newlen;
+  args.flags = flags;
+
+  return (void *)trap(SYS_mremap, (uint32_t)&args);
+}
+
 void sync(void) { trap(SYS_sync, 0); }
 
+int fsync(int fd) { return trap(SYS_fsync, (uint32_t)fd); }
+
+int fdatasync(int fd) { return trap(SYS_fdatasync, (uint32_t)fd); }
+
+int ftruncate(int fd, off_t len) {
+  ftruncate_args_t args;
+
+  args.fd = fd;
+  args.len = len;
+
+  return trap(SYS_ftruncate, (uint32_t)&args);
+}
+
+int fallocate(int fd, int mode, off_t offset, off_t len) {
+  fallocate_args_t args;
+
+  args.fd = fd;
+  args.mode = mode;
+  args.offset = offset;
+  args.len = len;
+
+  return trap(SYS_fallocate, (uint32_t)&args);
+}
+
 int open(const char *filename, int flags, int mode) {
   open_args_t args;
 
@@ -160,6 +362,8 @@ off_t lseek(int fd, off_t offset, int whence) {
   return trap(SYS_lseek, (uint32_t)&args);
 }
 
+void __libc_stdio_flush_lines(void);
+
 int read(int fd, void *buf, size_t nbytes) {
   read_args_t args;
 
@@ -167,6 +371,7 @@ int read(int fd, void *buf, size_t nbytes) {
   args.buf = buf;
   args.nbytes = nbytes;
 
+  __libc_stdio_flush_lines();
   return trap(SYS_read, (uint32_t)&args);
 }
 
@@ -180,6 +385,142 @@ int write(int fd, const void *buf, size_t nbytes) {
   return trap(SYS_write, (uint32_t)&args);
 }
 
+int readv(int fd, const struct iovec *iov, int iovcnt) {
+  readv_args_t args;
+
+  args.fd = fd;
+  args.iov = iov;
+  args.iovcnt = iovcnt;
+
+  return trap(SYS_readv, (uint32_t)&args);
+}
+
+int writev(int fd, const struct iovec *iov, int iovcnt) {
+  writev_args_t args;
+
+  args.fd = fd;
+  args.iov = iov;
+  args.iovcnt = iovcnt;
+
+  return trap(SYS_writev, (uint32_t)&args);
+}
+
+int pread(int fd, void *buf, size_t nbytes, off_t offset) {
+  pread_args_t args;
+
+  args.fd = fd;
+  args.buf = buf;
+  args.nbytes = nbytes;
+  args.offset = offset;
+
+  return trap(SYS_pread, (uint32_t)&args);
+}
+
+int pwrite(int fd, const void *buf, size_t nbytes, off_t offset) {
+  pwrite_args_t args;
+
+  args.fd = fd;
+  args.buf = buf;
+  args.nbytes = nbytes;
+  args.offset = offset;
+
+  return trap(SYS_pwrite, (uint32_t)&args);
+}
+
+int sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+  sendfile_args_t args;
+
+  args.out_fd = out_fd;
+  args.in_fd = in_fd;
+  args.offset = offset;
+  args.count = count;
+
+  return trap(SYS_sendfile, (uint32_t)&args);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  poll_args_t args;
+
+  args.fds = fds;
+  args.nfds = nfds;
+  args.timeout = timeout;
+
+  return trap(SYS_poll, (uint32_t)&args);
+}
+
+int fcntl(int fd, int cmd, int arg) {
+  fcntl_args_t args;
+
+  args.fd = fd;
+  args.cmd = cmd;
+  args.arg = arg;
+
+  return trap(SYS_fcntl, (uint32_t)&args);
+}
+
+/* Unlike most calls, this returns the error rather than setting errno */
+int posix_fadvise(int fd, off_t offset, off_t len, int advice) {
+  fadvise_args_t args;
+
+  args.fd = fd;
+  args.offset = offset;
+  args.len = len;
+  args.advice = advice;
+
+  if (0 > trap(SYS_fadvise, (uint32_t)&args))
+    return errno;
+  return 0;
+}
+
+int epoll_create(int size) { return trap(SYS_epoll_create, (uint32_t)size); }
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+  epoll_ctl_args_t args;
+
+  args.epfd = epfd;
+  args.op = op;
+  args.fd = fd;
+  args.event = event;
+
+  return trap(SYS_epoll_ctl, (uint32_t)&args);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout) {
+  epoll_wait_args_t args;
+
+  args.epfd = epfd;
+  args.events = events;
+  args.maxevents = maxevents;
+  args.timeout = timeout;
+
+  return trap(SYS_epoll_wait, (uint32_t)&args);
+}
+
+int io_setup(unsigned int entries) {
+  return trap(SYS_io_setup, (uint32_t)entries);
+}
+
+int io_submit(const struct io_sqe *sqes, int nr) {
+  io_submit_args_t args;
+
+  args.sqes = sqes;
+  args.nr = nr;
+
+  return trap(SYS_io_submit, (uint32_t)&args);
+}
+
+int io_getevents(struct io_cqe *cqes, int min_nr, int nr, int timeout) {
+  io_getevents_args_t args;
+
+  args.cqes = cqes;
+  args.min_nr = min_nr;
+  args.nr = nr;
+  args.timeout = timeout;
+
+  return trap(SYS_io_getevents, (uint32_t)&args);
+}
+
 int close(int fd) { return trap(SYS_close, (uint32_t)fd); }
 
 int dup(int fd) { return trap(SYS_dup, (uint32_t)fd); }
@@ -248,44 +589,67 @@ int chdir(const char *path) {
 
 size_t get_free_mem(void) { return (size_t)trap(SYS_get_free_mem, 0); }
 
+/* Points vec at each string of strs, which ends with NULL. Returns -1 if
+ * there is no memory for the vector. */
+static int build_argvec(argvec_t *vec, char *const strs[]) {
+  size_t i;
+
+  for (i = 0; strs[i] != NULL; i++)
+    ;
+  vec->av_len = i;
+  if (NULL == (vec->av_vec = malloc((vec->av_len + 1) * sizeof(argstr_t))))
+    return -1;
+  for (i = 0; strs[i] != NULL; i++) {
+    vec->av_vec[i].as_len = strlen(strs[i]);
+    vec->av_vec[i].as_str = strs[i];
+  }
+  vec->av_vec[i].as_len = 0;
+  vec->av_vec[i].as_str = NULL;
+  return 0;
+}
+
 int execve(const char *filename, char *const argv[], char *const envp[]) {
   execve_args_t args;
 
-  int i;
-
   args.filename.as_len = strlen(filename);
   args.filename.as_str = filename;
 
-  /* Build argv vector */
-  for (i = 0; argv[i] != NULL; i++)
-    ;
-  args.argv.av_len = i;
-  args.argv.av_vec = malloc((args.argv.av_len + 1) * sizeof(argstr_t));
-  for (i = 0; argv[i] != NULL; i++) {
-    args.argv.av_vec[i].as_len = strlen(argv[i]);
-    args.argv.av_vec[i].as_str = argv[i];
-  }
-  args.argv.av_vec[i].as_len = 0;
-  args.argv.av_vec[i].as_str = NULL;
-
-  /* Build envp vector */
-  for (i = 0; envp[i] != NULL; i++)
-    ;
-  args.envp.av_len = i;
-  args.envp.av_vec = malloc((args.envp.av_len + 1) * sizeof(argstr_t));
-  for (i = 0; envp[i] != NULL; i++) {
-    args.envp.av_vec[i].as_len = strlen(envp[i]);
-    args.envp.av_vec[i].as_str = envp[i];
+  if (0 > build_argvec(&args.argv, argv) || 0 > build_argvec(&args.envp, envp)) {
+    errno = ENOMEM;
+    return -1;
   }
-  args.envp.av_vec[i].as_len = 0;
-  args.envp.av_vec[i].as_str = NULL;
 
   /* Note that we don't need to worry about freeing since we are going to exec
    * (so all our memory will be cleaned up) */
 
+  fflush(NULL);
   return trap(SYS_execve, (uint32_t)&args);
 }
 
+int spawn(const char *filename, char *const argv[], char *const envp[],
+          const struct spawn_action *actions, int nactions) {
+  spawn_args_t args;
+  int ret;
+
+  args.filename.as_len = strlen(filename);
+  args.filename.as_str = filename;
+  args.argv.av_vec = NULL;
+  args.envp.av_vec = NULL;
+  args.actions = actions;
+  args.nactions = nactions;
+
+  if (0 > build_argvec(&args.argv, argv) || 0 > build_argvec(&args.envp, envp)) {
+    errno = ENOMEM;
+    ret = -1;
+  } else {
+    fflush(NULL);
+    ret = trap(SYS_spawn, (uint32_t)&args);
+  }
+  free(args.argv.av_vec);
+  free(args.envp.av_vec);
+  return ret;
+}
+
 void thr_set_errno(int n) { trap(SYS_set_errno, (uint32_t)n); }
 
 int thr_errno(void) { return trap(SYS_errno, 0); }
@@ -334,8 +698,180 @@ int stat(const char *path, struct stat *buf) {
   return trap(SYS_stat, (uint32_t)&args);
 }
 
+int fstat(int fd, struct stat *buf) {
+  fstat_args_t args;
+
+  args.fd = fd;
+  args.buf = buf;
+
+  return trap(SYS_fstat, (uint32_t)&args);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *buf) {
+  fstatat_args_t args;
+
+  args.dirfd = dirfd;
+  args.path.as_len = strlen(path);
+  args.path.as_str = path;
+  args.buf = buf;
+
+  return trap(SYS_fstatat, (uint32_t)&args);
+}
+
+/* From the kernel's drivers/dev.h and drivers/tty/tty.h */
+#define TTY_MAJOR 2
+#define MINOR_BITS 8
+
+int isatty(int fd) {
+  struct stat st;
+
+  return 0 == fstat(fd, &st) && S_ISCHR(st.st_mode) &&
+         TTY_MAJOR == ((unsigned)st.st_rdev >> MINOR_BITS);
+}
+
 int pipe(int pipefd[2]) { return trap(SYS_pipe, (uint32_t)pipefd); }
 
+int perf_read(perf_counts_t *pc) {
+  return trap(SYS_perf_read, (uint32_t)pc);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+  nanosleep_args_t args;
+
+  args.req = req;
+  args.rem = rem;
+
+  return trap(SYS_nanosleep, (uint32_t)&args);
+}
+
+/* The time page saves the system call unless it is stale */
+int clock_gettime(clockid_t clk, struct timespec *tp) {
+  clock_gettime_args_t args;
+  uint64_t ns;
+
+  if (!time_page_read((const time_page_t *)TIME_PAGE_ADDR, clk, &ns)) {
+    tp->tv_sec = (time_t)(ns / 1000000000);
+    tp->tv_nsec = (long)(ns % 1000000000);
+    return 0;
+  }
+  args.clk = clk;
+  args.tp = tp;
+  return trap(SYS_clock_gettime, (uint32_t)&args);
+}
+
+int socketpair(int domain, int type, int protocol, int sv[2]) {
+  socketpair_args_t args;
+
+  args.domain = domain;
+  args.type = type;
+  args.protocol = protocol;
+  args.sv = sv;
+  return trap(SYS_socketpair, (uint32_t)&args);
+}
+
+int sendmsg(int fd, const struct msghdr *msg, int flags) {
+  sendmsg_args_t args;
+
+  args.fd = fd;
+  args.msg = msg;
+  args.flags = flags;
+  return trap(SYS_sendmsg, (uint32_t)&args);
+}
+
+int recvmsg(int fd, struct msghdr *msg, int flags) {
+  recvmsg_args_t args;
+
+  args.fd = fd;
+  args.msg = msg;
+  args.flags = flags;
+  return trap(SYS_recvmsg, (uint32_t)&args);
+}
+
+int send(int fd, const void *buf, size_t len, int flags) {
+  struct iovec iov = {(void *)buf, len};
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  return sendmsg(fd, &msg, flags);
+}
+
+int recv(int fd, void *buf, size_t len, int flags) {
+  struct iovec iov = {buf, len};
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  return recvmsg(fd, &msg, flags);
+}
+
+int socket(int domain, int type, int protocol) {
+  socket_args_t args;
+
+  args.domain = domain;
+  args.type = type;
+  args.protocol = protocol;
+  return trap(SYS_socket, (uint32_t)&args);
+}
+
+int bind(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  bind_args_t args;
+
+  args.fd = fd;
+  args.addr = addr;
+  args.addrlen = addrlen;
+  return trap(SYS_bind, (uint32_t)&args);
+}
+
+int sendto(int fd, const void *buf, size_t len, int flags,
+           const struct sockaddr *to, socklen_t tolen) {
+  struct iovec iov = {(void *)buf, len};
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *)to;
+  msg.msg_namelen = tolen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  return sendmsg(fd, &msg, flags);
+}
+
+int recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *from,
+             socklen_t *fromlen) {
+  struct iovec iov = {buf, len};
+  struct msghdr msg;
+  int ret;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = from;
+  msg.msg_namelen = from ? *fromlen : 0;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (0 <= (ret = recvmsg(fd, &msg, flags)) && from)
+    *fromlen = msg.msg_namelen;
+  return ret;
+}
+
+unsigned int sleep(unsigned int seconds) {
+  struct timespec req, rem;
+
+  req.tv_sec = seconds;
+  req.tv_nsec = 0;
+  if (nanosleep(&req, &rem) < 0)
+    return rem.tv_sec + (rem.tv_nsec > 0);
+  return 0;
+}
+
+int usleep(unsigned int usecs) {
+  struct timespec req;
+
+  req.tv_sec = usecs / 1000000;
+  req.tv_nsec = (usecs % 1000000) * 1000;
+  return nanosleep(&req, NULL);
+}
+
 int uname(struct utsname *buf) { return trap(SYS_uname, (uint32_t)buf); }
 
 int debug(const char *str) {
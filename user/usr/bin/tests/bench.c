@@ -0,0 +1,293 @@
+/*
+ * System benchmarks, for comparing one kernel with another. Each result
+ * is printed on a line of its own as
+ *
+ *     <name> <value> <unit>
+ *
+ * so that runs can be compared with diff or a script; other lines start
+ * with '#'. Times are measured with the time stamp counter, converted
+ * with its rate as measured against the clock tick at startup.
+ *
+ * usage: bench [<name>...]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <lseek.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/times.h>
+#include <unistd.h>
+
+#define BENCH_EXEC "/usr/bin/bench"
+#define BENCH_FILE "/tmp/bench.dat"
+#define FILE_SIZE (1 << 20)
+#define IO_SIZE 4096
+#define PAGE_SIZE 4096
+
+static unsigned long long tsc_hz;
+static char iobuf[IO_SIZE];
+
+static inline unsigned long long rdtsc(void) {
+  unsigned int lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((unsigned long long)hi << 32) | lo;
+}
+
+static void check_failed(const char *what) {
+  printf("# bench: %s failed: errno %d\n", what, errno);
+  exit(1);
+}
+
+/* Counts cycles over CLK_TCK / 5 clock ticks, starting on a tick */
+static void calibrate(void) {
+  clock_t start, now;
+  unsigned long long c0, c1;
+
+  start = times(NULL);
+  while ((now = times(NULL)) == start)
+    ;
+  c0 = rdtsc();
+  while (times(NULL) - now < CLK_TCK / 5)
+    ;
+  c1 = rdtsc();
+  tsc_hz = (c1 - c0) * 5;
+  printf("# tsc_hz %llu\n", tsc_hz);
+}
+
+static unsigned long long to_nsecs(unsigned long long cycles) {
+  return tsc_hz >= 1000000 ? cycles * 1000 / (tsc_hz / 1000000) : 0;
+}
+
+/* Prints the mean time of one of n operations */
+static void report_each(const char *name, unsigned long long cycles, int n) {
+  printf("%s %llu ns\n", name, to_nsecs(cycles / n));
+}
+
+/* Prints a rate of bytes moved */
+static void report_rate(const char *name, unsigned long long cycles,
+                        unsigned long long bytes) {
+  unsigned long long ns = to_nsecs(cycles);
+  printf("%s %llu KB/s\n", name, ns ? bytes * 1000000 / ns : 0);
+}
+
+static void bench_null(void) {
+  unsigned long long c;
+  int i, n = 10000;
+
+  c = rdtsc();
+  for (i = 0; i < n; i++)
+    getpid();
+  report_each("null_syscall", rdtsc() - c, n);
+}
+
+static void bench_fork(void) {
+  unsigned long long c;
+  int i, n = 100, pid;
+
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    if (0 > (pid = fork()))
+      check_failed("fork");
+    if (0 == pid)
+      exit(0);
+    waitpid(pid, 0, NULL);
+  }
+  report_each("fork_exit_wait", rdtsc() - c, n);
+}
+
+static void bench_exec(void) {
+  char *argv[] = {BENCH_EXEC, "-exit", NULL};
+  char *envp[] = {NULL};
+  unsigned long long c;
+  int i, n = 50, pid;
+
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    if (0 > (pid = fork()))
+      check_failed("fork");
+    if (0 == pid) {
+      execve(BENCH_EXEC, argv, envp);
+      exit(1);
+    }
+    waitpid(pid, 0, NULL);
+  }
+  report_each("fork_exec_wait", rdtsc() - c, n);
+}
+
+/* One byte back and forth between two processes, then a stream of
+ * IO_SIZE writes one way */
+static void bench_pipe(void) {
+  unsigned long long c;
+  int to[2], from[2], i, n = 1000, pid, total;
+  char b = 0;
+
+  if (0 > pipe(to) || 0 > pipe(from))
+    check_failed("pipe");
+  if (0 > (pid = fork()))
+    check_failed("fork");
+  if (0 == pid) {
+    close(to[1]);
+    close(from[0]);
+    for (i = 0; i < n; i++) {
+      read(to[0], &b, 1);
+      write(from[1], &b, 1);
+    }
+    for (total = 0; total < FILE_SIZE; total += IO_SIZE)
+      write(from[1], iobuf, IO_SIZE);
+    exit(0);
+  }
+  close(to[0]);
+  close(from[1]);
+
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    write(to[1], &b, 1);
+    read(from[0], &b, 1);
+  }
+  report_each("pipe_round_trip", rdtsc() - c, n);
+
+  c = rdtsc();
+  for (total = 0; total < FILE_SIZE;) {
+    if (0 >= (i = read(from[0], iobuf, IO_SIZE)))
+      check_failed("read pipe");
+    total += i;
+  }
+  report_rate("pipe_throughput", rdtsc() - c, total);
+
+  close(to[1]);
+  close(from[0]);
+  waitpid(pid, 0, NULL);
+}
+
+static void bench_file(void) {
+  unsigned long long c;
+  int fd, i, n = FILE_SIZE / IO_SIZE;
+
+  if (0 > (fd = open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC, 0)))
+    check_failed("open");
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    if (IO_SIZE != write(fd, iobuf, IO_SIZE))
+      check_failed("write");
+  }
+  sync();
+  report_rate("file_seq_write", rdtsc() - c, FILE_SIZE);
+
+  lseek(fd, 0, SEEK_SET);
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    if (IO_SIZE != read(fd, iobuf, IO_SIZE))
+      check_failed("read");
+  }
+  report_rate("file_seq_read", rdtsc() - c, FILE_SIZE);
+
+  srand(1);
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    if (IO_SIZE != pwrite(fd, iobuf, IO_SIZE, (rand() % n) * IO_SIZE))
+      check_failed("pwrite");
+  }
+  sync();
+  report_rate("file_rand_write", rdtsc() - c, FILE_SIZE);
+
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    if (IO_SIZE != pread(fd, iobuf, IO_SIZE, (rand() % n) * IO_SIZE))
+      check_failed("pread");
+  }
+  report_rate("file_rand_read", rdtsc() - c, FILE_SIZE);
+
+  close(fd);
+  unlink(BENCH_FILE);
+}
+
+static void bench_create(void) {
+  char name[32];
+  unsigned long long c;
+  int fd, i, n = 100;
+
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "/tmp/bench%d", i);
+    if (0 > (fd = open(name, O_RDWR | O_CREAT, 0)))
+      check_failed("create");
+    close(fd);
+  }
+  report_each("file_create", rdtsc() - c, n);
+
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "/tmp/bench%d", i);
+    if (0 > unlink(name))
+      check_failed("unlink");
+  }
+  report_each("file_unlink", rdtsc() - c, n);
+}
+
+static void bench_mmap(void) {
+  unsigned long long c;
+  void *addr;
+  int i, n = 1000;
+
+  c = rdtsc();
+  for (i = 0; i < n; i++) {
+    addr = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (MAP_FAILED == addr)
+      check_failed("mmap");
+    munmap(addr, PAGE_SIZE);
+  }
+  report_each("mmap_munmap", rdtsc() - c, n);
+}
+
+/* A write to each page of a fresh anonymous mapping */
+static void bench_fault(void) {
+  unsigned long long c;
+  char *addr;
+  int i, n = 256;
+
+  addr = mmap(NULL, n * PAGE_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (MAP_FAILED == addr)
+    check_failed("mmap");
+  c = rdtsc();
+  for (i = 0; i < n; i++)
+    addr[i * PAGE_SIZE] = 1;
+  report_each("page_fault", rdtsc() - c, n);
+  munmap(addr, n * PAGE_SIZE);
+}
+
+static const struct {
+  const char *name;
+  void (*func)(void);
+} benches[] = {
+    {"null", bench_null}, {"fork", bench_fork},     {"exec", bench_exec},
+    {"pipe", bench_pipe}, {"file", bench_file},     {"create", bench_create},
+    {"mmap", bench_mmap}, {"fault", bench_fault},
+};
+
+#define NBENCHES ((int)(sizeof(benches) / sizeof(benches[0])))
+
+int main(int argc, char **argv) {
+  int i, j;
+
+  /* What bench_exec runs */
+  if (2 == argc && !strcmp(argv[1], "-exit"))
+    return 0;
+
+  calibrate();
+  for (i = 0; i < NBENCHES; i++) {
+    if (1 == argc) {
+      benches[i].func();
+      continue;
+    }
+    for (j = 1; j < argc; j++) {
+      if (!strcmp(argv[j], benches[i].name))
+        benches[i].func();
+    }
+  }
+  return 0;
+}
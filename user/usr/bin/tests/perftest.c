@@ -0,0 +1,81 @@
+/*
+ * Measures a sequential walk and a random pointer chase over the same
+ * array with the performance counters; the chase should take many more
+ * cycles an instruction, and miss the cache and TLB far more often.
+ */
+
+#include <errno.h>
+#include <perf.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NSLOTS (1 << 20) /* 4M, more than the caches and the TLB cover */
+
+static int slots[NSLOTS];
+
+static const char *names[PERF_NCOUNTERS] = {"cycles", "instructions",
+                                            "LLC misses", "dTLB misses"};
+
+/* Links every slot into one cycle, in a random order (Sattolo's) */
+static void shuffle(void) {
+  unsigned int seed = 1, i, j;
+  int tmp;
+
+  for (i = 0; i < NSLOTS; i++)
+    slots[i] = i;
+  for (i = NSLOTS - 1; i > 0; i--) {
+    seed = seed * 1103515245 + 12345;
+    j = seed % i;
+    tmp = slots[i];
+    slots[i] = slots[j];
+    slots[j] = tmp;
+  }
+}
+
+static int walk(void) {
+  int i, sum = 0;
+  for (i = 0; i < NSLOTS; i++)
+    sum += slots[i];
+  return sum;
+}
+
+static int chase(void) {
+  int i, next = 0;
+  for (i = 0; i < NSLOTS; i++)
+    next = slots[next];
+  return next;
+}
+
+static void measure(const char *what, int (*fn)(void)) {
+  perf_counts_t before, after;
+  uint64_t count[PERF_NCOUNTERS];
+  int i;
+
+  perf_read(&before);
+  fn();
+  perf_read(&after);
+  printf("%s:\n", what);
+  for (i = 0; i < PERF_NCOUNTERS; i++) {
+    count[i] = after.pc_count[i] - before.pc_count[i];
+    if (after.pc_valid & (1 << i))
+      printf("  %-12s %12llu\n", names[i], count[i]);
+  }
+  if ((after.pc_valid & (1 << PERF_CYCLES)) &&
+      (after.pc_valid & (1 << PERF_INSTRUCTIONS)) && count[PERF_CYCLES]) {
+    uint64_t ipc = count[PERF_INSTRUCTIONS] * 100 / count[PERF_CYCLES];
+    printf("  %-12s %9llu.%.2llu\n", "IPC", ipc / 100, ipc % 100);
+  }
+}
+
+int main(int argc, char **argv) {
+  perf_counts_t pc;
+
+  if (0 > perf_read(&pc)) {
+    printf("perf_read: %s\n", strerror(errno));
+    return 1;
+  }
+  shuffle();
+  measure("sequential", walk);
+  measure("pointer chase", chase);
+  return 0;
+}
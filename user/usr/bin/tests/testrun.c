@@ -0,0 +1,198 @@
+/*
+ * Runs test programs side by side and sums up how they did. Each
+ * program runs in a process of its own, at most <jobs> at once, with
+ * its output going to a log of its own in /tmp. Programs which use
+ * libtest count their passed and failed assertions in a slot of a file
+ * shared with testrun (see test.h); a program fails if any assertion
+ * did or if it exits with a nonzero status. The summary gives each
+ * program's counts, status and time, then how long the whole run took
+ * against the sum of the programs' times. The logs of programs which
+ * failed are kept; the others are removed.
+ *
+ * Programs are looked for in /usr/bin unless their names have a '/';
+ * they are run without arguments.
+ *
+ * usage: testrun [-j <jobs>] [<program>...]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/times.h>
+#include <unistd.h>
+
+#include <test/test.h>
+
+#define TESTRUN_JOBS 4 /* programs run at once by default */
+#define TESTRUN_MAX 32
+
+typedef struct testrun {
+  const char *tr_name;
+  char tr_log[64];
+  pid_t tr_pid; /* 0 until started, -1 once done */
+  int tr_status;
+  clock_t tr_start;
+  clock_t tr_ticks;
+  test_data_t tr_data;
+} testrun_t;
+
+static const char *default_tests[] = {"memtest", "vfstest", "stress",
+                                      "forktest"};
+
+static char results[64];
+static testrun_t runs[TESTRUN_MAX];
+static int nruns;
+
+static void check_failed(const char *what) {
+  printf("testrun: %s failed: errno %d\n", what, errno);
+  exit(1);
+}
+
+static unsigned long to_msecs(clock_t ticks) {
+  return (unsigned long)ticks * 1000 / CLK_TCK;
+}
+
+/* In the child: sets up its slot and log, and runs the program */
+static void testrun_exec(int i) {
+  char path[64];
+  char *argv[2], *envp[1];
+  int fd;
+
+  if (0 > (fd = open(results, O_RDWR, 0)) ||
+      0 > lseek(fd, i * sizeof(test_data_t), SEEK_SET) ||
+      (TEST_RESULTS_FD != fd && 0 > dup2(fd, TEST_RESULTS_FD)))
+    exit(126);
+  if (TEST_RESULTS_FD != fd)
+    close(fd);
+  if (0 > (fd = open(runs[i].tr_log, O_WRONLY | O_CREAT | O_TRUNC, 0666)) ||
+      0 > dup2(fd, 1) || 0 > dup2(fd, 2))
+    exit(126);
+  close(fd);
+
+  if (strchr(runs[i].tr_name, '/'))
+    snprintf(path, sizeof(path), "%s", runs[i].tr_name);
+  else
+    snprintf(path, sizeof(path), "/usr/bin/%s", runs[i].tr_name);
+  argv[0] = path;
+  argv[1] = NULL;
+  envp[0] = NULL;
+  execve(path, argv, envp);
+  printf("testrun: cannot run %s: errno %d\n", path, errno);
+  exit(127);
+}
+
+static void testrun_start(int i) {
+  const char *base = strrchr(runs[i].tr_name, '/');
+
+  snprintf(runs[i].tr_log, sizeof(runs[i].tr_log), "/tmp/testrun-%d-%d-%s.log",
+           getpid(), i, base ? base + 1 : runs[i].tr_name);
+  runs[i].tr_start = times(NULL);
+  if (0 > (runs[i].tr_pid = fork()))
+    check_failed("fork");
+  if (!runs[i].tr_pid)
+    testrun_exec(i);
+}
+
+/* Waits for one program to finish; returns 0 if none is left */
+static int testrun_wait(void) {
+  int status, i;
+  pid_t pid;
+
+  while (0 < (pid = wait(&status))) {
+    for (i = 0; i < nruns; ++i) {
+      if (runs[i].tr_pid == pid) {
+        runs[i].tr_ticks = times(NULL) - runs[i].tr_start;
+        runs[i].tr_status = status;
+        runs[i].tr_pid = -1;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Reads the slots back, and makes a slot which was never taken over
+ * count for nothing */
+static void testrun_collect(int fd) {
+  int i;
+
+  for (i = 0; i < nruns; ++i) {
+    if (0 > lseek(fd, i * sizeof(test_data_t), SEEK_SET) ||
+        sizeof(test_data_t) !=
+            (size_t)read(fd, &runs[i].tr_data, sizeof(test_data_t)))
+      check_failed("reading results");
+    if (TEST_SLOT_MAGIC != runs[i].tr_data.td_magic)
+      memset(&runs[i].tr_data, 0, sizeof(test_data_t));
+  }
+}
+
+int main(int argc, char **argv) {
+  int jobs = TESTRUN_JOBS, running = 0, next = 0, nfailed = 0, failed;
+  clock_t start, sum = 0;
+  test_data_t slot;
+  int fd, i;
+
+  i = 1;
+  if (3 <= argc && !strcmp(argv[1], "-j")) {
+    jobs = atoi(argv[2]);
+    i = 3;
+  }
+  if (jobs < 1 || argc - i > TESTRUN_MAX) {
+    printf("usage: testrun [-j <jobs>] [<program>...]\n");
+    return 1;
+  }
+  if (i == argc) {
+    for (; nruns < (int)(sizeof(default_tests) / sizeof(default_tests[0]));
+         ++nruns)
+      runs[nruns].tr_name = default_tests[nruns];
+  } else {
+    for (; i < argc; ++i)
+      runs[nruns++].tr_name = argv[i];
+  }
+
+  snprintf(results, sizeof(results), "/tmp/testrun-%d", getpid());
+  if (0 > (fd = open(results, O_RDWR | O_CREAT | O_TRUNC, 0666)))
+    check_failed("creating results");
+  memset(&slot, 0, sizeof(slot));
+  slot.td_magic = TEST_SLOT_MAGIC;
+  for (i = 0; i < nruns; ++i) {
+    if (sizeof(slot) != (size_t)write(fd, &slot, sizeof(slot)))
+      check_failed("writing results");
+  }
+
+  start = times(NULL);
+  while (next < nruns || running) {
+    while (running < jobs && next < nruns) {
+      testrun_start(next++);
+      running++;
+    }
+    if (!testrun_wait())
+      break;
+    running--;
+  }
+  start = times(NULL) - start;
+  testrun_collect(fd);
+  close(fd);
+  unlink(results);
+
+  printf("%-12s %8s %8s %6s %10s\n", "PROGRAM", "PASSED", "FAILED", "STATUS",
+         "MSECS");
+  for (i = 0; i < nruns; ++i) {
+    failed = runs[i].tr_data.td_failed || runs[i].tr_status;
+    nfailed += failed;
+    sum += runs[i].tr_ticks;
+    printf("%-12s %8d %8d %6d %10lu%s\n", runs[i].tr_name,
+           runs[i].tr_data.td_passed, runs[i].tr_data.td_failed,
+           runs[i].tr_status, to_msecs(runs[i].tr_ticks),
+           failed ? "  FAILED" : "");
+    if (failed)
+      printf("    log in %s\n", runs[i].tr_log);
+    else
+      unlink(runs[i].tr_log);
+  }
+  printf("%d of %d programs failed; %lu ms, %lu ms run one at a time\n",
+         nfailed, nruns, to_msecs(start), to_msecs(sum));
+  return nfailed ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <pthread/pthread.h>
+
+#define NTHREADS 4
+#define NLOOPS 10000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_barrier_t barrier;
+static int counter = 0;
+static int finished = 0;
+static int nserial = 0;
+
+static void *worker(void *arg) {
+  int i;
+
+  /* Everyone starts counting at once */
+  if (PTHREAD_BARRIER_SERIAL_THREAD == pthread_barrier_wait(&barrier))
+    __sync_fetch_and_add(&nserial, 1);
+  for (i = 0; i < NLOOPS; i++) {
+    pthread_mutex_lock(&lock);
+    counter++;
+    pthread_mutex_unlock(&lock);
+  }
+  /* errno belongs to this thread alone */
+  errno = (int)arg;
+  pthread_yield();
+  if (errno != (int)arg)
+    printf("tid %d: errno changed under us\n", gettid());
+
+  pthread_mutex_lock(&lock);
+  finished++;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+  return arg;
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+  pthread_t thr[NTHREADS];
+  void *ret;
+  int i, err;
+
+  printf("pid %d: Entering threadtest\n", getpid());
+  pthread_barrier_init(&barrier, NULL, NTHREADS);
+  for (i = 0; i < NTHREADS; i++) {
+    if (0 != (err = pthread_create(&thr[i], NULL, worker, (void *)(i + 1)))) {
+      printf("pthread_create failed: %d\n", err);
+      return 1;
+    }
+  }
+
+  pthread_mutex_lock(&lock);
+  while (finished < NTHREADS)
+    pthread_cond_wait(&cond, &lock);
+  pthread_mutex_unlock(&lock);
+
+  for (i = 0; i < NTHREADS; i++) {
+    if (0 != (err = pthread_join(thr[i], &ret)) || ret != (void *)(i + 1))
+      printf("pthread_join %d: %d, returned %p\n", i, err, ret);
+  }
+  printf("counter %d, expected %d\n", counter, NTHREADS * NLOOPS);
+  if (1 != nserial)
+    printf("%d serial threads at the barrier, expected 1\n", nserial);
+  return counter != NTHREADS * NLOOPS || 1 != nserial;
+}
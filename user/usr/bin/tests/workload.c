@@ -0,0 +1,405 @@
+/*
+ * A reproducible mix of file system and VM operations, for comparing one
+ * kernel with another under the same load. <procs> processes each do
+ * <ops> operations chosen at random, in proportion to the weights given,
+ * on a few files and directories of their own; the choices come from a
+ * generator seeded with <seed> and the process's number, so a run with
+ * the same arguments does the same operations, in the same order in
+ * each process, every time. The operations are
+ *
+ *     open    open (creating if need be) and close a file
+ *     read    read a block at a random offset of a file
+ *     write   write a block at a random offset of a file
+ *     unlink  unlink a file
+ *     mkdir   make a directory, or remove it if it is there
+ *     mmap    map a file shared, write to each page and unmap it
+ *     fork    fork a child which exits, and wait for it
+ *     exec    fork a child which execs this program, and wait for it
+ *
+ * and each is timed from start to end (from open to close, for the
+ * ones which open a file). Results are printed, like bench's, on lines
+ * of their own as
+ *
+ *     <name> <value> <unit>
+ *
+ * giving for each operation how many were done, how many failed (an
+ * unlink of a file which is not there, say), and their mean, median,
+ * 99th percentile and longest times, then the throughput of the whole
+ * run; other lines start with '#'. Percentiles are to within an eighth.
+ *
+ * usage: workload [-s <seed>] [-n <ops>] [-c <procs>] [<op>=<weight>...]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <lseek.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/times.h>
+#include <unistd.h>
+
+#define WORKLOAD_EXEC "/usr/bin/workload"
+#define WORKLOAD_DIR "/tmp/workload"
+#define PAGE_SIZE 4096
+#define IO_SIZE 4096
+#define WL_NFILES 16    /* files each process works on */
+#define WL_NDIRS 8      /* directories each process makes and removes */
+#define FILE_BLOCKS 64  /* reads and writes fall in a file's first blocks */
+#define MMAP_PAGES 16   /* pages mapped by each mmap */
+#define MAX_PROCS 16
+#define NBUCKETS 240    /* of the latency histograms; see bucket_of */
+
+enum { OP_OPEN, OP_READ, OP_WRITE, OP_UNLINK, OP_MKDIR, OP_MMAP, OP_FORK,
+       OP_EXEC, NOPS };
+
+static const char *op_names[NOPS] = {"open",  "read", "write", "unlink",
+                                     "mkdir", "mmap", "fork",  "exec"};
+static int op_weights[NOPS] = {20, 25, 25, 5, 5, 10, 5, 5};
+
+/* What one process did with one kind of operation */
+typedef struct op_stats {
+  unsigned int os_count;
+  unsigned int os_errors;
+  unsigned long long os_cycles;
+  unsigned int os_max;
+  unsigned int os_hist[NBUCKETS];
+} op_stats_t;
+
+static unsigned long long tsc_hz;
+static char iobuf[IO_SIZE];
+static unsigned int rand_state;
+
+static inline unsigned long long rdtsc(void) {
+  unsigned int lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((unsigned long long)hi << 32) | lo;
+}
+
+static void check_failed(const char *what) {
+  printf("# workload: %s failed: errno %d\n", what, errno);
+  exit(1);
+}
+
+/* Counts cycles over CLK_TCK / 5 clock ticks, starting on a tick */
+static void calibrate(void) {
+  clock_t start, now;
+  unsigned long long c0, c1;
+
+  start = times(NULL);
+  while ((now = times(NULL)) == start)
+    ;
+  c0 = rdtsc();
+  while (times(NULL) - now < CLK_TCK / 5)
+    ;
+  c1 = rdtsc();
+  tsc_hz = (c1 - c0) * 5;
+  printf("# tsc_hz %llu\n", tsc_hz);
+}
+
+static unsigned long long to_nsecs(unsigned long long cycles) {
+  return tsc_hz >= 1000000 ? cycles * 1000 / (tsc_hz / 1000000) : 0;
+}
+
+/* xorshift32, so that runs do not depend on libc's rand */
+static unsigned int next_rand(void) {
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state;
+}
+
+/* Below 8 cycles a bucket each; above, eight to each power of two */
+static int bucket_of(unsigned int c) {
+  int b;
+
+  if (c < 8)
+    return c;
+  b = 31 - __builtin_clz(c);
+  return ((b - 2) << 3) | ((c >> (b - 3)) & 7);
+}
+
+static unsigned int bucket_min(int i) {
+  if (i < 8)
+    return i;
+  return (8 | (i & 7)) << ((i >> 3) - 1);
+}
+
+static void file_name(char *buf, size_t size, int k) {
+  snprintf(buf, size, "f%d", k);
+}
+
+static int op_open(int k) {
+  char name[16];
+  int fd;
+
+  file_name(name, sizeof(name), k);
+  if (0 > (fd = open(name, O_RDWR | O_CREAT, 0666)))
+    return -1;
+  return close(fd);
+}
+
+static int op_io(int k, int wr) {
+  char name[16];
+  off_t off = (off_t)(next_rand() % FILE_BLOCKS) * IO_SIZE;
+  int fd, ret;
+
+  file_name(name, sizeof(name), k);
+  if (0 > (fd = open(name, wr ? O_WRONLY | O_CREAT : O_RDONLY, 0666)))
+    return -1;
+  ret = wr ? pwrite(fd, iobuf, IO_SIZE, off) : pread(fd, iobuf, IO_SIZE, off);
+  close(fd);
+  return ret;
+}
+
+static int op_unlink(int k) {
+  char name[16];
+
+  file_name(name, sizeof(name), k);
+  return unlink(name);
+}
+
+static int op_mkdir(int k) {
+  char name[16];
+
+  snprintf(name, sizeof(name), "d%d", k);
+  if (0 == mkdir(name, 0777))
+    return 0;
+  return EEXIST == errno ? rmdir(name) : -1;
+}
+
+static int op_mmap(int k) {
+  char name[16];
+  char *addr;
+  int fd, i;
+
+  file_name(name, sizeof(name), k);
+  if (0 > (fd = open(name, O_RDWR | O_CREAT, 0666)))
+    return -1;
+  if (lseek(fd, 0, SEEK_END) < MMAP_PAGES * PAGE_SIZE &&
+      0 > ftruncate(fd, MMAP_PAGES * PAGE_SIZE)) {
+    close(fd);
+    return -1;
+  }
+  addr = mmap(NULL, MMAP_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == addr)
+    return -1;
+  for (i = 0; i < MMAP_PAGES; i++)
+    addr[i * PAGE_SIZE]++;
+  return munmap(addr, MMAP_PAGES * PAGE_SIZE);
+}
+
+static int op_fork(int exec) {
+  char *argv[] = {WORKLOAD_EXEC, "-exit", NULL};
+  char *envp[] = {NULL};
+  int pid;
+
+  if (0 > (pid = fork()))
+    return -1;
+  if (0 == pid) {
+    if (exec)
+      execve(WORKLOAD_EXEC, argv, envp);
+    exit(exec);
+  }
+  return waitpid(pid, 0, NULL);
+}
+
+static int do_op(int op) {
+  int k = next_rand() % (OP_MKDIR == op ? WL_NDIRS : WL_NFILES);
+
+  switch (op) {
+  case OP_OPEN:
+    return op_open(k);
+  case OP_READ:
+    return op_io(k, 0);
+  case OP_WRITE:
+    return op_io(k, 1);
+  case OP_UNLINK:
+    return op_unlink(k);
+  case OP_MKDIR:
+    return op_mkdir(k);
+  case OP_MMAP:
+    return op_mmap(k);
+  case OP_FORK:
+    return op_fork(0);
+  default:
+    return op_fork(1);
+  }
+}
+
+/* Process number id's share of the run, counted in stats[NOPS] */
+static void worker(int id, unsigned int seed, int nops, op_stats_t *stats) {
+  char dir[32];
+  unsigned long long c;
+  unsigned int cycles, r;
+  int total = 0, i, op, ret;
+
+  snprintf(dir, sizeof(dir), "%d", id);
+  if (0 > mkdir(dir, 0777) || 0 > chdir(dir))
+    check_failed("mkdir");
+  rand_state = seed * 2654435761U + id + 1;
+  if (!rand_state)
+    rand_state = 1;
+  for (op = 0; op < NOPS; op++)
+    total += op_weights[op];
+
+  for (i = 0; i < nops; i++) {
+    r = next_rand() % total;
+    for (op = 0; r >= (unsigned int)op_weights[op]; op++)
+      r -= op_weights[op];
+    c = rdtsc();
+    ret = do_op(op);
+    c = rdtsc() - c;
+    cycles = c > 0xffffffffULL ? 0xffffffffU : (unsigned int)c;
+    stats[op].os_count++;
+    stats[op].os_errors += 0 > ret;
+    stats[op].os_cycles += c;
+    if (cycles > stats[op].os_max)
+      stats[op].os_max = cycles;
+    stats[op].os_hist[bucket_of(cycles)]++;
+  }
+}
+
+/* The time below which frac / 100 of the operations took */
+static unsigned long long percentile(const op_stats_t *s, int frac) {
+  unsigned int want = (s->os_count * frac + 99) / 100, seen = 0;
+  int i;
+
+  for (i = 0; i < NBUCKETS; i++) {
+    if ((seen += s->os_hist[i]) >= want)
+      return to_nsecs(bucket_min(i));
+  }
+  return to_nsecs(s->os_max);
+}
+
+/* Removes what the processes left in the directory */
+static void clean_up(int nprocs) {
+  char path[64];
+  int id, k;
+
+  for (id = 0; id < nprocs; id++) {
+    for (k = 0; k < WL_NFILES; k++) {
+      snprintf(path, sizeof(path), "%d/f%d", id, k);
+      unlink(path);
+    }
+    for (k = 0; k < WL_NDIRS; k++) {
+      snprintf(path, sizeof(path), "%d/d%d", id, k);
+      rmdir(path);
+    }
+    snprintf(path, sizeof(path), "%d", id);
+    rmdir(path);
+  }
+}
+
+static int parse_weight(const char *arg) {
+  const char *eq = strchr(arg, '=');
+  int op;
+
+  if (!eq)
+    return -1;
+  for (op = 0; op < NOPS; op++) {
+    if (strlen(op_names[op]) == (size_t)(eq - arg) &&
+        !strncmp(arg, op_names[op], eq - arg)) {
+      op_weights[op] = atoi(eq + 1);
+      return op_weights[op] < 0 ? -1 : 0;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  unsigned int seed = 1;
+  int nops = 1000, nprocs = 1, total = 0, i, op, pid, zfd;
+  op_stats_t *stats, sum;
+  char dir[32];
+  unsigned long long c, nsecs;
+
+  /* What op_fork(1) runs */
+  if (2 == argc && !strcmp(argv[1], "-exit"))
+    return 0;
+
+  for (i = 1; i < argc; i++) {
+    if (i + 1 < argc && !strcmp(argv[i], "-s"))
+      seed = atoi(argv[++i]);
+    else if (i + 1 < argc && !strcmp(argv[i], "-n"))
+      nops = atoi(argv[++i]);
+    else if (i + 1 < argc && !strcmp(argv[i], "-c"))
+      nprocs = atoi(argv[++i]);
+    else if (0 > parse_weight(argv[i]))
+      break;
+  }
+  for (op = 0; op < NOPS; op++)
+    total += op_weights[op];
+  if (i != argc || nops < 0 || nprocs < 1 || nprocs > MAX_PROCS || !total) {
+    printf("usage: workload [-s <seed>] [-n <ops>] [-c <procs>] "
+           "[<op>=<weight>...]\n");
+    return 1;
+  }
+
+  calibrate();
+  printf("# seed %u ops %d procs %d weights", seed, nops, nprocs);
+  for (op = 0; op < NOPS; op++)
+    printf(" %s=%d", op_names[op], op_weights[op]);
+  printf("\n");
+
+  if (0 > (zfd = open("/dev/zero", O_RDWR, 0)))
+    check_failed("open /dev/zero");
+  stats = mmap(NULL, nprocs * NOPS * sizeof(op_stats_t),
+               PROT_READ | PROT_WRITE, MAP_SHARED, zfd, 0);
+  if (MAP_FAILED == stats)
+    check_failed("mmap");
+  close(zfd);
+  memset(stats, 0, nprocs * NOPS * sizeof(op_stats_t));
+  snprintf(dir, sizeof(dir), "%s-%d", WORKLOAD_DIR, getpid());
+  if (0 > mkdir(dir, 0777) || 0 > chdir(dir))
+    check_failed("mkdir");
+
+  c = rdtsc();
+  for (i = 0; i < nprocs; i++) {
+    if (0 > (pid = fork()))
+      check_failed("fork");
+    if (0 == pid) {
+      worker(i, seed, nops, &stats[i * NOPS]);
+      exit(0);
+    }
+  }
+  while (0 < wait(NULL))
+    ;
+  c = rdtsc() - c;
+
+  for (op = 0; op < NOPS; op++) {
+    memset(&sum, 0, sizeof(sum));
+    for (i = 0; i < nprocs; i++) {
+      op_stats_t *s = &stats[i * NOPS + op];
+      int b;
+      sum.os_count += s->os_count;
+      sum.os_errors += s->os_errors;
+      sum.os_cycles += s->os_cycles;
+      if (s->os_max > sum.os_max)
+        sum.os_max = s->os_max;
+      for (b = 0; b < NBUCKETS; b++)
+        sum.os_hist[b] += s->os_hist[b];
+    }
+    if (!sum.os_count)
+      continue;
+    printf("%s_count %u ops\n", op_names[op], sum.os_count);
+    printf("%s_errors %u ops\n", op_names[op], sum.os_errors);
+    printf("%s_mean %llu ns\n", op_names[op],
+           to_nsecs(sum.os_cycles / sum.os_count));
+    printf("%s_p50 %llu ns\n", op_names[op], percentile(&sum, 50));
+    printf("%s_p99 %llu ns\n", op_names[op], percentile(&sum, 99));
+    printf("%s_max %llu ns\n", op_names[op], to_nsecs(sum.os_max));
+  }
+  nsecs = to_nsecs(c);
+  printf("throughput %llu ops/s\n",
+         nsecs ? (unsigned long long)nops * nprocs * 1000000000ULL / nsecs
+               : 0);
+
+  clean_up(nprocs);
+  chdir("..");
+  rmdir(dir);
+  return 0;
+}